@@ -33,8 +33,14 @@
 #include <binder/IServiceManager.h>
 #include <binder/Parcel.h>
 
+#include <atomic>
 #include <ctime>
 #include <cutils/properties.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <lz4frame.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -69,6 +75,9 @@ static const char *min_buffer_size_str = "16";
 static const char *max_buffer_size_str = "2048";
 static const int time_buf_size = 20;
 static const int path_buf_size = 60;
+static const int ring_drain_period = 100000;    // in micro sec
+static const int min_ring_size = 1;             // in MB per cpu
+static const int max_ring_size = 256;
 
 typedef struct cpu_stat {
     unsigned long utime, ntime, stime, itime;
@@ -82,6 +91,28 @@ typedef struct cpu_stat {
  */
 static int idle_threshold = 10;
 
+/*
+ * Pressure stall information: the time some task was stalled on a resource.
+ * Logging also starts when the share of the time stalled since the last
+ * check reaches the threshold of a resource.
+ * Uint: 0.01%; 0 to ignore the resource.
+ */
+typedef struct psi_stat {
+    const char *name;
+    const char *path;
+    int threshold;
+    int fd;
+    unsigned long long total;   // in micro sec
+} psi_stat_t;
+
+static psi_stat_t psi_stats[] = {
+    { "cpu", "/proc/pressure/cpu", 0, -1, 0 },
+    { "io", "/proc/pressure/io", 0, -1, 0 },
+    { "memory", "/proc/pressure/memory", 0, -1, 0 },
+};
+static struct timespec psi_time;
+static int stat_fd = -1;
+
 static bool quit = false;
 static bool suspend= false;
 static bool dump_requested = false;
@@ -93,6 +124,36 @@ static const char *buf_size_kb = "2048";
 static const char *apps = "";
 static uint64_t tag = 0;
 
+/*
+ * Ring mode: tracing stays on and the pages of every cpu's trace_pipe_raw
+ * are spliced into a preallocated ring file, so a dump only has to swap
+ * the rings and compress the full one in the background.
+ */
+static int ring_size_mb = 0;
+
+typedef struct ring {
+    int fd;
+    size_t head;    // next page to write
+    bool wrapped;
+} ring_t;
+
+typedef struct cpu_ring {
+    int cpu;
+    pthread_t thread;
+    std::atomic<bool> running;
+    pthread_mutex_t lock;
+    /* The drain writes to rings[active], a dump reads the other one */
+    ring_t rings[2];
+    int active;
+    std::atomic<bool> snapshot_requested;
+} cpu_ring_t;
+
+static cpu_ring_t *cpu_rings = NULL;
+static int ring_cpus = 0;
+static size_t ring_pages = 0;
+static long page_size = 0;
+static std::atomic<bool> ring_dumping(false);
+
 static cpu_stat_t new_cpu;
 static cpu_stat_t old_cpu;
 
@@ -122,36 +183,120 @@ static const char* dfs_control_path =
     "/d/tracing/tracing_on";
 static const char* dfs_buffer_size_path =
     "/d/tracing/buffer_size_kb";
+static const char* dfs_per_cpu_raw_path =
+    "/d/tracing/per_cpu/cpu%d/trace_pipe_raw";
+static const char* dfs_events_path =
+    "/d/tracing/events";
+static const char* dfs_saved_cmdlines_path =
+    "/d/tracing/saved_cmdlines";
+static const char* ring_dir_path = "/data/misc/anrd/ring";
 static const char* dfs_tags_property = "debug.atrace.tags.enableflags";
 static const char* dfs_apps_property = "debug.atrace.app_cmdlines";
 
 /*
- * Read accumulated cpu data from /proc/stat
+ * Read accumulated cpu data from /proc/stat. The file is kept open and only
+ * its first line, the total of all cpus, is read.
  */
 static void get_cpu_stat(cpu_stat_t *cpu) {
-    FILE *fp = NULL;
-    const char *params = "cpu  %lu %lu %lu %lu %lu %lu %lu %*d %*d %*d\n";
+    char buf[256];
+    ssize_t len;
+    const char *params = "cpu  %lu %lu %lu %lu %lu %lu %lu";
 
-    if ((fp = fopen("/proc/stat", "r")) == NULL) {
+    if (stat_fd == -1 && (stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC)) == -1) {
         err = true;
         sprintf(err_msg, "can't read from /proc/stat with errno %d", errno);
-    } else {
-        if (fscanf(fp, params, &cpu->utime, &cpu->ntime,
-                &cpu->stime, &cpu->itime, &cpu->iowtime, &cpu->irqtime,
-                &cpu->sirqtime) != cpu_stat_entries) {
-            /*
-             * If failed in getting status, new_cpu won't be updated and
-             * is_heavy_loaded() will return false.
-             */
-            ALOGE("Error in getting cpu status. Skipping this check.");
-            return;
+        return;
+    }
+
+    len = pread(stat_fd, buf, sizeof(buf) - 1, 0);
+    if (len > 0) {
+        buf[len] = '\0';
+    }
+    if (len <= 0 || sscanf(buf, params, &cpu->utime, &cpu->ntime,
+            &cpu->stime, &cpu->itime, &cpu->iowtime, &cpu->irqtime,
+            &cpu->sirqtime) != cpu_stat_entries) {
+        /*
+         * If failed in getting status, new_cpu won't be updated and
+         * is_heavy_loaded() will return false.
+         */
+        ALOGE("Error in getting cpu status. Skipping this check.");
+        return;
+    }
+
+    cpu->total = cpu->utime + cpu->ntime + cpu->stime + cpu->itime
+        + cpu->iowtime + cpu->irqtime + cpu->sirqtime;
+}
+
+/*
+ * Read the total time some task was stalled on a resource.
+ */
+static bool get_psi_total(psi_stat_t *psi, unsigned long long *total) {
+    char buf[256];
+    ssize_t len;
+
+    len = pread(psi->fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return false;
+    }
+    buf[len] = '\0';
+
+    /* The first line is the "some" one */
+    const char *p = strstr(buf, "total=");
+    return p && sscanf(p, "total=%llu", total) == 1;
+}
+
+/*
+ * Open the pressure files of the resources with a threshold. Kernels
+ * without PSI only have the idle threshold.
+ */
+static void init_psi(void) {
+    for (size_t i = 0; i < sizeof(psi_stats) / sizeof(psi_stats[0]); i++) {
+        psi_stat_t *psi = &psi_stats[i];
+        if (!psi->threshold) {
+            continue;
         }
+        psi->fd = open(psi->path, O_RDONLY | O_CLOEXEC);
+        if (psi->fd == -1 || !get_psi_total(psi, &psi->total)) {
+            ALOGE("Can't read %s, ignoring the %s stall threshold.", psi->path, psi->name);
+            if (psi->fd != -1) {
+                close(psi->fd);
+                psi->fd = -1;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &psi_time);
+}
 
-        cpu->total = cpu->utime + cpu->ntime + cpu->stime + cpu->itime
-            + cpu->iowtime + cpu->irqtime + cpu->sirqtime;
+/*
+ * Check whether the share of the time some task was stalled on a resource
+ * since the last check reached its threshold. While tracing, the thresholds
+ * are lowered by a quarter so that we do not turn on and off tracing
+ * frequently when the stall is close to a threshold.
+ */
+static bool is_stalled(void) {
+    struct timespec now;
+    unsigned long long elapsed, total, stalled_time;
+    bool stalled = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - psi_time.tv_sec) * 1000000ULL
+        + now.tv_nsec / 1000 - psi_time.tv_nsec / 1000;
+    psi_time = now;
+
+    for (size_t i = 0; i < sizeof(psi_stats) / sizeof(psi_stats[0]); i++) {
+        psi_stat_t *psi = &psi_stats[i];
+        if (psi->fd == -1 || !get_psi_total(psi, &total)) {
+            continue;
+        }
+        stalled_time = total - psi->total;
+        psi->total = total;
 
-        fclose(fp);
+        int threshold = tracing ? psi->threshold * 3 / 4 : psi->threshold;
+        if (elapsed && stalled_time * 10000 >= elapsed * threshold) {
+            stalled = true;
+        }
     }
+    return stalled;
 }
 
 /*
@@ -163,11 +308,12 @@ static void get_cpu_stat(cpu_stat_t *cpu) {
 static bool is_heavy_load(void) {
     unsigned long diff_idle, diff_total;
     int threshold = idle_threshold + (tracing?100:0);
+    bool stalled = is_stalled();
     get_cpu_stat(&new_cpu);
     diff_idle = new_cpu.itime - old_cpu.itime;
     diff_total = new_cpu.total - old_cpu.total;
     old_cpu = new_cpu;
-    return (diff_idle * 10000 < diff_total * threshold);
+    return stalled || (diff_idle * 10000 < diff_total * threshold);
 }
 
 /*
@@ -359,6 +505,407 @@ static void dump_trace()
     ALOGI("Finished dump. Output file stored at: %s", path_buf);
 }
 
+/*
+ * Write the pages of a ring, oldest first, as one LZ4 frame.
+ */
+static int compress_ring(const ring_t *ring, const char *path) {
+    const size_t chunk_pages = 64;
+    size_t first = ring->wrapped ? ring->head : 0;
+    size_t count = ring->wrapped ? ring_pages : ring->head;
+    size_t in_size = chunk_pages * page_size;
+    size_t out_size = LZ4F_compressBound(in_size, NULL) + 64;
+    LZ4F_compressionContext_t ctx;
+    uint8_t *in = NULL, *out = NULL;
+    size_t filled = 0, len;
+    int ret = -1;
+
+    int output_fd = creat(path, S_IRUSR | S_IWUSR);
+    if (output_fd == -1) {
+        ALOGE("Failed to create %s.", path);
+        return -1;
+    }
+    if (LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION))) {
+        ALOGE("Failed to create the LZ4 context.");
+        close(output_fd);
+        return -1;
+    }
+    in = (uint8_t*)malloc(in_size);
+    out = (uint8_t*)malloc(out_size);
+    if (!in || !out) {
+        ALOGE("Failed to allocate the compression buffers.");
+        goto out;
+    }
+
+    len = LZ4F_compressBegin(ctx, out, out_size, NULL);
+    if (LZ4F_isError(len) || write(output_fd, out, len) != (ssize_t)len) {
+        goto error;
+    }
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = ((first + i) % ring_pages) * page_size;
+        if (pread(ring->fd, in + filled, page_size, offset) != page_size) {
+            goto error;
+        }
+        filled += page_size;
+        if (filled == in_size || i + 1 == count) {
+            len = LZ4F_compressUpdate(ctx, out, out_size, in, filled, NULL);
+            if (LZ4F_isError(len) || write(output_fd, out, len) != (ssize_t)len) {
+                goto error;
+            }
+            filled = 0;
+        }
+    }
+    len = LZ4F_compressEnd(ctx, out, out_size, NULL);
+    if (LZ4F_isError(len) || write(output_fd, out, len) != (ssize_t)len) {
+        goto error;
+    }
+    ret = 0;
+    goto out;
+
+error:
+    ALOGE("Error in compressing the ring into %s: %s", path, strerror(errno));
+out:
+    free(in);
+    free(out);
+    LZ4F_freeCompressionContext(ctx);
+    close(output_fd);
+    return ret;
+}
+
+static void copy_file(const char *src, const char *dst) {
+    char buf[4096];
+    ssize_t len;
+
+    int src_fd = open(src, O_RDONLY);
+    if (src_fd == -1) {
+        return;
+    }
+    int dst_fd = creat(dst, S_IRUSR | S_IWUSR);
+    if (dst_fd != -1) {
+        while ((len = read(src_fd, buf, sizeof(buf))) > 0) {
+            if (write(dst_fd, buf, len) != len) {
+                ALOGE("Failed to write %s.", dst);
+                break;
+            }
+        }
+        close(dst_fd);
+    }
+    close(src_fd);
+}
+
+/*
+ * Copy the format of an event, or of all the events of a system if event is
+ * NULL, as <system>.<event>.format.
+ */
+static void copy_event_formats(const char *dir, const char *system, const char *event) {
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+
+    if (event) {
+        snprintf(src, sizeof(src), "%s/%s/%s/format", dfs_events_path, system, event);
+        snprintf(dst, sizeof(dst), "%s/%s.%s.format", dir, system, event);
+        copy_file(src, dst);
+        return;
+    }
+
+    snprintf(src, sizeof(src), "%s/%s", dfs_events_path, system);
+    DIR *d = opendir(src);
+    if (!d) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_type == DT_DIR && de->d_name[0] != '.') {
+            copy_event_formats(dir, system, de->d_name);
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * Everything needed to decode the pages besides the pages themselves.
+ */
+static void copy_trace_formats(const char *dir) {
+    char dst[PATH_MAX];
+
+    snprintf(dst, sizeof(dst), "%s/header_page", dir);
+    copy_file("/d/tracing/events/header_page", dst);
+    snprintf(dst, sizeof(dst), "%s/header_event", dir);
+    copy_file("/d/tracing/events/header_event", dst);
+    snprintf(dst, sizeof(dst), "%s/saved_cmdlines", dir);
+    copy_file(dfs_saved_cmdlines_path, dst);
+
+    /* Userland atrace markers */
+    copy_event_formats(dir, "ftrace", "print");
+    if (log_sched) {
+        copy_event_formats(dir, "sched", "sched_switch");
+        copy_event_formats(dir, "sched", "sched_wakeup");
+    }
+    if (log_stack) {
+        copy_event_formats(dir, "ftrace", "kernel_stack");
+    }
+    if (log_irq) {
+        copy_event_formats(dir, "irq", NULL);
+    }
+    if (log_sync) {
+        copy_event_formats(dir, "sync", NULL);
+    }
+    if (log_workq) {
+        copy_event_formats(dir, "workqueue", NULL);
+    }
+}
+
+/*
+ * Swap the rings of every cpu and compress the ones swapped out into the
+ * directory "dump_of_anrdaemon.<current_time>" under /data/misc/anrd. Runs
+ * at the lowest priority so it does not add to the load that caused the
+ * dump.
+ */
+static void *ring_dump(void *) {
+    time_t now = time(0);
+    struct tm tstruct;
+    char time_buf[time_buf_size];
+    char dir_buf[PATH_MAX];
+    char path_buf[PATH_MAX];
+
+    setpriority(PRIO_PROCESS, gettid(), 19);
+
+    /* The drains flush their last partial page before swapping */
+    for (int i = 0; i < ring_cpus; i++) {
+        cpu_rings[i].snapshot_requested = true;
+    }
+    for (int i = 0; i < ring_cpus; i++) {
+        while (cpu_rings[i].snapshot_requested && cpu_rings[i].running) {
+            usleep(ring_drain_period / 10);
+        }
+    }
+
+    ALOGI("Started to dump ANRdaemon trace ring.");
+
+    tstruct = *localtime(&now);
+    strftime(time_buf, time_buf_size, "%Y-%m-%d.%X", &tstruct);
+    snprintf(dir_buf, sizeof(dir_buf), "/data/misc/anrd/dump_of_anrdaemon.%s", time_buf);
+    if (mkdir(dir_buf, S_IRWXU) == -1) {
+        ALOGE("Failed to create %s. Dump aborted.", dir_buf);
+        ring_dumping = false;
+        return NULL;
+    }
+
+    for (int i = 0; i < ring_cpus; i++) {
+        cpu_ring_t *cr = &cpu_rings[i];
+        snprintf(path_buf, sizeof(path_buf), "%s/cpu%d.lz4", dir_buf, cr->cpu);
+        compress_ring(&cr->rings[!cr->active], path_buf);
+    }
+    copy_trace_formats(dir_buf);
+
+    ring_dumping = false;
+    ALOGI("Finished dump. Output stored at: %s", dir_buf);
+    return NULL;
+}
+
+/*
+ * Write the page in the pipe, or the len bytes of buf, to the next page of
+ * the active ring.
+ */
+static bool ring_write(cpu_ring_t *cr, int pipe_fd, const void *buf, size_t len) {
+    ring_t *ring = &cr->rings[cr->active];
+    loff_t offset = ring->head * page_size;
+
+    if (buf) {
+        if (pwrite(ring->fd, buf, len, offset) != (ssize_t)len) {
+            return false;
+        }
+    } else {
+        while (len > 0) {
+            ssize_t n = splice(pipe_fd, NULL, ring->fd, &offset, len, SPLICE_F_MOVE);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            len -= n;
+        }
+    }
+    if (++ring->head == ring_pages) {
+        ring->head = 0;
+        ring->wrapped = true;
+    }
+    return true;
+}
+
+/*
+ * Read the pages not yet full of a cpu, then swap its rings.
+ */
+static void ring_snapshot(cpu_ring_t *cr, int raw_fd, uint8_t *page) {
+    ssize_t n;
+
+    while ((n = read(raw_fd, page, page_size)) > 0) {
+        if (!ring_write(cr, -1, page, page_size)) {
+            ALOGE("Failed to write the ring of cpu%d: %s", cr->cpu, strerror(errno));
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&cr->lock);
+    cr->active = !cr->active;
+    cr->rings[cr->active].head = 0;
+    cr->rings[cr->active].wrapped = false;
+    pthread_mutex_unlock(&cr->lock);
+    cr->snapshot_requested = false;
+}
+
+/*
+ * Move the full pages of the cpu's trace buffer to its ring. splice keeps
+ * the pages out of userspace, so draining costs little even under load.
+ */
+static void *ring_drain(void *arg) {
+    cpu_ring_t *cr = (cpu_ring_t*)arg;
+    char path_buf[path_buf_size];
+    int pipe_fds[2];
+    uint8_t *page;
+
+    snprintf(path_buf, path_buf_size, dfs_per_cpu_raw_path, cr->cpu);
+    int raw_fd = open(path_buf, O_RDONLY | O_NONBLOCK);
+    if (raw_fd == -1) {
+        ALOGE("Failed to open %s.", path_buf);
+        cr->running = false;
+        return NULL;
+    }
+    page = (uint8_t*)malloc(page_size);
+    if (!page || pipe(pipe_fds) == -1) {
+        ALOGE("Failed to set up the drain of cpu%d.", cr->cpu);
+        free(page);
+        close(raw_fd);
+        cr->running = false;
+        return NULL;
+    }
+
+    while (!quit) {
+        if (cr->snapshot_requested) {
+            ring_snapshot(cr, raw_fd, page);
+        }
+
+        ssize_t n = splice(raw_fd, NULL, pipe_fds[1], NULL, page_size,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EAGAIN) {
+            /* No full page yet */
+            usleep(ring_drain_period);
+            continue;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            ALOGE("Failed to drain cpu%d: %s", cr->cpu, strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&cr->lock);
+        bool written = ring_write(cr, pipe_fds[0], NULL, n);
+        pthread_mutex_unlock(&cr->lock);
+        if (!written) {
+            ALOGE("Failed to write the ring of cpu%d: %s", cr->cpu, strerror(errno));
+            break;
+        }
+    }
+
+    free(page);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(raw_fd);
+    cr->running = false;
+    return NULL;
+}
+
+/*
+ * Preallocate two rings of ring_size_mb per cpu under /data/misc/anrd/ring.
+ */
+static int ring_init(void) {
+    char path_buf[path_buf_size];
+
+    page_size = sysconf(_SC_PAGESIZE);
+    ring_pages = (size_t)ring_size_mb * 1024 * 1024 / page_size;
+    ring_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    cpu_rings = new cpu_ring_t[ring_cpus];
+
+    if (mkdir(ring_dir_path, S_IRWXU) == -1 && errno != EEXIST) {
+        err = true;
+        sprintf(err_msg, "Can't create %s. Error: %d", ring_dir_path, errno);
+        return -1;
+    }
+    for (int i = 0; i < ring_cpus; i++) {
+        cpu_ring_t *cr = &cpu_rings[i];
+        cr->cpu = i;
+        cr->running = false;
+        cr->active = 0;
+        cr->snapshot_requested = false;
+        pthread_mutex_init(&cr->lock, NULL);
+        for (int j = 0; j < 2; j++) {
+            snprintf(path_buf, path_buf_size, "%s/cpu%d.%d", ring_dir_path, i, j);
+            cr->rings[j].head = 0;
+            cr->rings[j].wrapped = false;
+            cr->rings[j].fd = open(path_buf, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            if (cr->rings[j].fd == -1
+                    || posix_fallocate(cr->rings[j].fd, 0, ring_pages * page_size) != 0) {
+                err = true;
+                sprintf(err_msg, "Can't preallocate %s. Error: %d", path_buf, errno);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Keep tracing into the rings until the daemon quits, handing the dump
+ * requests to a background thread.
+ */
+static void start_ring(void) {
+    if (ring_init() != 0)
+        return;
+
+    if (dfs_enable(true, dfs_control_path) != 0) {
+        ALOGE("Failed to start tracing.");
+        return;
+    }
+    tracing = true;
+    ALOGI("Tracing into rings of %d MB per cpu.", ring_size_mb);
+
+    for (int i = 0; i < ring_cpus; i++) {
+        cpu_rings[i].running = true;
+        if (pthread_create(&cpu_rings[i].thread, NULL, ring_drain, &cpu_rings[i]) != 0) {
+            ALOGE("Failed to start the drain of cpu%d.", i);
+            cpu_rings[i].running = false;
+            cpu_rings[i].thread = 0;
+        }
+    }
+
+    while (!quit && !err) {
+        if (suspend == tracing) {
+            dfs_enable(!suspend, dfs_control_path);
+            tracing = !suspend;
+        }
+        if (dump_requested && !ring_dumping) {
+            pthread_t dump_thread;
+            dump_requested = false;
+            ring_dumping = true;
+            if (pthread_create(&dump_thread, NULL, ring_dump, NULL) == 0) {
+                pthread_detach(dump_thread);
+            } else {
+                ALOGE("Failed to start the dump.");
+                ring_dumping = false;
+            }
+        }
+        usleep(tracing_check_period);
+    }
+
+    dfs_enable(false, dfs_control_path);
+    tracing = false;
+    for (int i = 0; i < ring_cpus; i++) {
+        if (cpu_rings[i].thread) {
+            pthread_join(cpu_rings[i].thread, NULL);
+        }
+    }
+}
+
 /*
  * Start logging when cpu usage is high. Meanwhile, moniter the cpu usage and
  * stop logging when it drops down.
@@ -426,7 +973,13 @@ static void start(void) {
     dfs_set_property(tag, apps, true);
     dfs_poke_binder();
 
+    if (ring_size_mb) {
+        start_ring();
+        return;
+    }
+
     get_cpu_stat(&old_cpu);
+    init_psi();
     sleep(check_period);
 
     while (!quit && !err) {
@@ -450,7 +1003,9 @@ static void start(void) {
  */
 static void request_dump_trace()
 {
-    if (!tracing) {
+    if (ring_size_mb) {
+        dump_requested = true;
+    } else if (!tracing) {
         dump_trace();
     } else if (!dump_requested) {
         dump_requested = true;
@@ -510,8 +1065,14 @@ static void show_help(void) {
                        "separated list of cmdlines\n"
                     "   -t N        cpu threshold for logging to start "
                         "(uint = 0.01%%, min = 5000, max = 9999, default = 9990)\n"
+                    "   -c N        also start logging when tasks are stalled on cpu "
+                        "N of the time (uint = 0.01%%, from /proc/pressure)\n"
+                    "   -i N        same for io\n"
+                    "   -m N        same for memory\n"
                     "   -s N        use a trace buffer size of N KB "
                         "default to 2048KB\n"
+                    "   -r N        keep tracing into an on-disk ring of N MB "
+                        "per cpu (min = 1, max = 256)\n"
                     "   -h          show helps\n");
     fprintf(stdout, "Categoris includes:\n"
                     "   am         - activity manager\n"
@@ -538,7 +1099,7 @@ static void show_help(void) {
 static int get_options(int argc, char *argv[]) {
     int opt = 0;
     int threshold;
-    while ((opt = getopt(argc, argv, "a:s:t:h")) >= 0) {
+    while ((opt = getopt(argc, argv, "a:c:i:m:r:s:t:h")) >= 0) {
         switch(opt) {
             case 'a':
                 apps = optarg;
@@ -551,6 +1112,24 @@ static int get_options(int argc, char *argv[]) {
                 else
                     buf_size_kb = optarg;
                 break;
+            case 'c':
+            case 'i':
+            case 'm':
+                threshold = atoi(optarg);
+                if (threshold > 10000 || threshold < 1) {
+                    fprintf(stderr, "stall threshold should be 1-10000\n");
+                    return 1;
+                }
+                psi_stats[opt == 'c' ? 0 : opt == 'i' ? 1 : 2].threshold = threshold;
+                break;
+            case 'r':
+                ring_size_mb = atoi(optarg);
+                if (ring_size_mb > max_ring_size || ring_size_mb < min_ring_size) {
+                    fprintf(stderr, "ring size should be %d-%d MB\n",
+                            min_ring_size, max_ring_size);
+                    return 1;
+                }
+                break;
             case 't':
                 threshold = atoi(optarg);
                 if (threshold > 9999 || threshold < 5000) {
@@ -4,7 +4,7 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := ANRdaemon.cpp
-LOCAL_C_INCLUDES += external/zlib
+LOCAL_C_INCLUDES += external/zlib external/lz4/lib
 LOCAL_MODULE := anrd
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
 LOCAL_MODULE_TAGS := debug
@@ -13,6 +13,7 @@ LOCAL_SHARED_LIBRARIES := \
     libcutils \
     libutils \
     libz
+LOCAL_STATIC_LIBRARIES := liblz4
 include $(BUILD_EXECUTABLE)
 
 endif
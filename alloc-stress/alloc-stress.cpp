@@ -9,8 +9,15 @@
 #include <tuple>
 #include <numeric>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
 #include <string>
 #include <fstream>
+#include <random>
+#include <deque>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -85,6 +92,10 @@ public:
         int error = read(m_readFd, &v, sizeof(T));
         ASSERT_TRUE(error >= 0);
     }
+    template <typename T> bool recv_ret_error(T& v) {
+        int error = read(m_readFd, &v, sizeof(T));
+        return (error != sizeof(T));
+    }
     static Pipe makePipeFromFds(int readFd, int writeFd) {
         return Pipe(readFd, writeFd);
     }
@@ -101,7 +112,8 @@ public:
     }
 };
 
-void createProcess(Pipe pipe, const char *exName, const char *arg)
+pid_t createProcess(Pipe pipe, const char *exName, const char *arg,
+                    const vector<string> &patternArgs)
 {
     pipe.preserveOverFork(true);
     pid_t pid = fork();
@@ -111,20 +123,24 @@ void createProcess(Pipe pipe, const char *exName, const char *arg)
         char writeFdStr[16];
         snprintf(readFdStr, sizeof(readFdStr), "%d", pipe.getReadFd());
         snprintf(writeFdStr, sizeof(writeFdStr), "%d", pipe.getWriteFd());
-        execl(exName, exName, "--worker", arg, readFdStr, writeFdStr, 0);
+        vector<const char*> args = { exName, "--worker", arg, readFdStr, writeFdStr };
+        for (auto &patternArg : patternArgs)
+            args.push_back(patternArg.c_str());
+        args.push_back(nullptr);
+        execv(exName, const_cast<char**>(args.data()));
         ASSERT_TRUE(0);
     }
     // parent process
     else if (pid > 0) {
         pipe.preserveOverFork(false);
-        return;
+        return pid;
     }
     else {
         ASSERT_TRUE(0);
     }
+    return -1;
 }
 
-
 static void write_oomadj_to_lmkd(int oomadj) {
     // Connect to lmkd and store our oom_adj
     int lmk_procprio_cmd[4];
@@ -172,55 +188,345 @@ static void create_memcg() {
 }
 #endif
 
-size_t s = 4 * (1 << 20);
-void *gptr;
+enum class PatternKind {
+    FIXED,      // chunks of one size, kept until killed
+    SIZES,      // chunks of random sizes, log-uniform between min and max
+    SWEEP,      // a working set that grows each step and is touched again in full
+    GRALLOC,    // graphics buffers from gralloc, like ION carveouts
+    FILE,       // dirty pages of a shared file mapping
+};
+
+struct Pattern {
+    PatternKind kind = PatternKind::FIXED;
+    // Bytes allocated per step, and the chunk size range of SIZES
+    size_t size = 4 * (1 << 20);
+    size_t minSize = 16;
+    size_t maxSize = 1 << 20;
+    // Steps per second
+    unsigned int rate = 100;
+    // SWEEP stops growing at this many bytes, 0 grows until killed
+    size_t workingSet = 0;
+    // Steps a child runs before it is stopped, 0 runs until killed
+    unsigned int maxSteps = 0;
+    unsigned int seed = 1;
+    string fileDir = "/data/local/tmp";
+};
+
+// What a child sends back after each step
+struct StepReport {
+    uint64_t bytes;
+    // Time to get the memory, and to write every page of it
+    uint64_t allocNs;
+    uint64_t touchNs;
+};
+
+static const char *patternNames[] = { "fixed", "sizes", "sweep", "gralloc", "file" };
+
+static size_t parseSize(const char *str) {
+    char *end;
+    size_t size = strtoull(str, &end, 0);
+    switch (*end) {
+        case 'g': case 'G': size <<= 10; // fall through
+        case 'm': case 'M': size <<= 10; // fall through
+        case 'k': case 'K': size <<= 10; end++; break;
+    }
+    ASSERT_TRUE(*end == '\0' && size > 0);
+    return size;
+}
+
+// Parses the pattern options in argv[first..argc), and appends them to args
+// so the parent can pass them on to its children.
+static Pattern parsePattern(int first, int argc, char *argv[], vector<string> *args) {
+    Pattern pattern;
+    for (int i = first; i < argc; i++) {
+        string opt = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << opt << endl;
+            exit(EXIT_FAILURE);
+        }
+        const char *val = argv[++i];
+        if (opt == "--pattern") {
+            size_t kind;
+            for (kind = 0; kind < sizeof(patternNames) / sizeof(patternNames[0]); kind++) {
+                if (string(val) == patternNames[kind])
+                    break;
+            }
+            ASSERT_TRUE(kind < sizeof(patternNames) / sizeof(patternNames[0]));
+            pattern.kind = static_cast<PatternKind>(kind);
+        } else if (opt == "--size") {
+            pattern.size = parseSize(val);
+        } else if (opt == "--min-size") {
+            pattern.minSize = parseSize(val);
+        } else if (opt == "--max-size") {
+            pattern.maxSize = parseSize(val);
+        } else if (opt == "--rate") {
+            pattern.rate = atoi(val);
+        } else if (opt == "--working-set") {
+            pattern.workingSet = parseSize(val);
+        } else if (opt == "--steps") {
+            pattern.maxSteps = atoi(val);
+        } else if (opt == "--seed") {
+            pattern.seed = atoi(val);
+        } else if (opt == "--file-dir") {
+            pattern.fileDir = val;
+        } else {
+            cerr << "unknown option " << opt << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (args) {
+            args->push_back(opt);
+            args->push_back(val);
+        }
+    }
+    ASSERT_TRUE(pattern.rate > 0 && pattern.minSize <= pattern.maxSize);
+    return pattern;
+}
+
+static uint64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Writes every page, so the memory is really used rather than only mapped
+static void touch(void *ptr, size_t size, long long seed) {
+    char *p = (char*)ptr;
+    memset(p, (int)seed >> 10, size);
+    for (size_t i = 0; i + sizeof(long long) <= size; i += 4096) {
+        *((long long*)&p[i]) = seed + i;
+    }
+}
+
+class PatternEngine {
+    const Pattern &m_pattern;
+    mt19937 m_rand;
+    // SWEEP keeps its chunks to touch them again, the others only leak them
+    deque<pair<void*, size_t>> m_chunks;
+    size_t m_workingSet = 0;
+    long long m_allocCount = 0;
+    int m_fileIndex = 0;
+    const hw_module_t *m_grallocModule = nullptr;
+    alloc_device_t *m_allocDevice = nullptr;
+
+    void *allocChunk(size_t size) {
+        void *ptr = malloc(size);
+        ASSERT_TRUE(ptr);
+        return ptr;
+    }
+
+    // Memory from gralloc is usually not counted in the RSS of the process,
+    // like the buffers of a camera or the display.
+    void *allocGralloc(size_t size, uint64_t *allocNs) {
+        if (!m_allocDevice) {
+            ASSERT_TRUE(hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &m_grallocModule) == 0);
+            ASSERT_TRUE(gralloc_open(m_grallocModule, &m_allocDevice) == 0);
+        }
+        const int width = 1024;
+        int height = (size + width * 4 - 1) / (width * 4);
+        int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+        buffer_handle_t handle;
+        int stride;
+        uint64_t start = nowNs();
+        ASSERT_TRUE(m_allocDevice->alloc(m_allocDevice, width, height, HAL_PIXEL_FORMAT_RGBA_8888,
+                                         usage, &handle, &stride) == 0);
+        *allocNs = nowNs() - start;
+
+        const gralloc_module_t *module = (const gralloc_module_t*)m_grallocModule;
+        void *vaddr;
+        ASSERT_TRUE(module->lock(module, handle, usage, 0, 0, width, height, &vaddr) == 0);
+        touch(vaddr, (size_t)stride * height * 4, m_allocCount);
+        module->unlock(module, handle);
+        return vaddr;
+    }
+
+    // Dirty shared file pages have to be written back before they can be
+    // reclaimed, which puts pressure on the page cache rather than on anon.
+    void *allocFile(size_t size) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/alloc-stress.%d.%d", m_pattern.fileDir.c_str(),
+                 getpid(), m_fileIndex++);
+        int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        ASSERT_TRUE(fd >= 0);
+        // The file goes away with the last mapping, when the child is killed
+        unlink(path);
+        ASSERT_TRUE(ftruncate(fd, size) == 0);
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        ASSERT_TRUE(ptr != MAP_FAILED);
+        return ptr;
+    }
+
+public:
+    PatternEngine(const Pattern &pattern) : m_pattern{pattern}, m_rand{pattern.seed} {}
+
+    StepReport step() {
+        StepReport report = {};
+        uint64_t start;
+
+        switch (m_pattern.kind) {
+        case PatternKind::FIXED:
+        case PatternKind::FILE:
+        case PatternKind::SWEEP: {
+            start = nowNs();
+            void *ptr = m_pattern.kind == PatternKind::FILE ?
+                    allocFile(m_pattern.size) : allocChunk(m_pattern.size);
+            report.allocNs = nowNs() - start;
+            start = nowNs();
+            touch(ptr, m_pattern.size, m_allocCount);
+            if (m_pattern.kind == PatternKind::SWEEP) {
+                m_chunks.emplace_back(ptr, m_pattern.size);
+                m_workingSet += m_pattern.size;
+                if (m_pattern.workingSet && m_workingSet > m_pattern.workingSet) {
+                    free(m_chunks.front().first);
+                    m_workingSet -= m_chunks.front().second;
+                    m_chunks.pop_front();
+                }
+                // Touching the older chunks again faults back what was
+                // swapped out since the last step
+                for (auto &chunk : m_chunks)
+                    touch(chunk.first, chunk.second, m_allocCount);
+            }
+            report.touchNs = nowNs() - start;
+            report.bytes = m_pattern.size;
+            break;
+        }
+        case PatternKind::SIZES: {
+            // Log-uniform sizes, so small chunks are as common as they are
+            // in real heaps while large ones still make up most of the bytes
+            uniform_real_distribution<double> dist(log((double)m_pattern.minSize),
+                                                   log((double)m_pattern.maxSize));
+            while (report.bytes < m_pattern.size) {
+                size_t size = (size_t)exp(dist(m_rand));
+                start = nowNs();
+                void *ptr = allocChunk(size);
+                report.allocNs += nowNs() - start;
+                start = nowNs();
+                touch(ptr, size, m_allocCount);
+                report.touchNs += nowNs() - start;
+                report.bytes += size;
+            }
+            break;
+        }
+        case PatternKind::GRALLOC:
+            start = nowNs();
+            allocGralloc(m_pattern.size, &report.allocNs);
+            report.touchNs = nowNs() - start - report.allocNs;
+            report.bytes = m_pattern.size;
+            break;
+        }
+        m_allocCount += report.bytes;
+        return report;
+    }
+};
+
+// Alloc latencies of one child, to print percentiles
+struct LatencyStats {
+    vector<uint64_t> allocNs;
+    vector<uint64_t> touchNs;
+
+    void add(const StepReport &report) {
+        allocNs.push_back(report.allocNs);
+        touchNs.push_back(report.touchNs);
+    }
+    static uint64_t percentile(vector<uint64_t> &values, double fraction) {
+        if (values.empty())
+            return 0;
+        size_t index = min(values.size() - 1, (size_t)(values.size() * fraction));
+        nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+};
+
+static void usage(const char *name) {
+    cerr << "Usage: " << name << " [--pattern fixed|sizes|sweep|gralloc|file] [--size SIZE]\n"
+            "       [--min-size SIZE] [--max-size SIZE] [--rate STEPS_PER_SEC]\n"
+            "       [--working-set SIZE] [--steps N] [--seed N] [--file-dir DIR]\n"
+            "Starts children with oom_adj from 1000 down to 0, one after the other.\n"
+            "Each allocates SIZE bytes (default 4M) per step with the given pattern\n"
+            "until it is killed, or until N steps. Sizes take a k, m or g suffix.\n"
+            "  fixed    chunks of SIZE\n"
+            "  sizes    chunks between --min-size and --max-size, log-uniform\n"
+            "  sweep    chunks of SIZE, and every step writes all of them again;\n"
+            "           with --working-set, the oldest are freed past it\n"
+            "  gralloc  graphics buffers of SIZE\n"
+            "  file     shared mappings of files in --file-dir (/data/local/tmp)\n";
+}
+
 int main(int argc, char *argv[])
 {
-    if ((argc > 1) && (std::string(argv[1]) == "--worker")) {
+    if ((argc > 4) && (std::string(argv[1]) == "--worker")) {
 #ifdef ENABLE_MEM_CGROUPS
         create_memcg();
 #endif
         write_oomadj_to_lmkd(atoi(argv[2]));
         Pipe p{atoi(argv[3]), atoi(argv[4])};
+        Pattern pattern = parsePattern(5, argc, argv, nullptr);
+        PatternEngine engine{pattern};
 
-        long long allocCount = 0;
+        uint64_t interval = 1000000000ULL / pattern.rate;
+        uint64_t next = nowNs();
         while (1) {
             p.wait();
-            char *ptr = (char*)malloc(s);
-            memset(ptr, (int)allocCount >> 10, s);
-            for (int i = 0; i < s; i+= 4096) {
-                *((long long*)&ptr[i]) = allocCount + i;
-            }
-            usleep(10 * 1000);
-            gptr = ptr;
-            //cout << "total alloc: " << allocCount / (1<<20)<< " adj: " << argv[2]<< endl;;
-            //cout << "ptr: " << (long long)(void*)ptr << endl;;
-            p.signal();
-            allocCount += s;
+            StepReport report = engine.step();
+            next += interval;
+            uint64_t now = nowNs();
+            if (next > now)
+                usleep((next - now) / 1000);
+            else
+                next = now;
+            p.send(report);
         }
     } else {
-        cout << "parent:" << argc << endl;
+        if (argc > 1 && (string(argv[1]) == "-h" || string(argv[1]) == "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        vector<string> patternArgs;
+        Pattern pattern = parsePattern(1, argc, argv, &patternArgs);
+        cout << "parent:" << argc << " pattern: " << patternNames[(int)pattern.kind] << endl;
 
         write_oomadj_to_lmkd(-1000);
         for (int i = 1000; i >= 0; i -= 100) {
             auto pipes = Pipe::createPipePair();
             char arg[16];
             snprintf(arg, sizeof(arg), "%d", i);
-            createProcess(std::move(std::get<1>(pipes)), argv[0], arg);
+            uint64_t start = nowNs();
+            pid_t pid = createProcess(std::move(std::get<1>(pipes)), argv[0], arg, patternArgs);
             Pipe &p = std::get<0>(pipes);
 
             size_t t = 0;
+            unsigned int steps = 0;
+            bool killed = false;
+            LatencyStats stats;
             while (1) {
-                //;cout << getpid() << ":" << "parent signal" << endl;
+                StepReport report;
+                if (pattern.maxSteps && steps == pattern.maxSteps) {
+                    kill(pid, SIGKILL);
+                    waitpid(pid, nullptr, 0);
+                    break;
+                }
                 p.signal();
-                if (p.wait_ret_error()) {
+                if (p.recv_ret_error(report)) {
                     int status;
-                    waitpid(0, &status, 0);
+                    waitpid(pid, &status, 0);
+                    killed = true;
                     break;
                 }
-                t += s;
+                stats.add(report);
+                t += report.bytes;
+                steps++;
             }
-            cout << "adj: " << i << " sz: " << t / (1 << 20) << endl;
+            double elapsed = (nowNs() - start) / 1e9;
+            cout << "adj: " << i << " sz: " << t / (1 << 20)
+                 << " steps: " << steps
+                 << " alloc_us p50/p99/max: "
+                 << LatencyStats::percentile(stats.allocNs, 0.5) / 1000 << "/"
+                 << LatencyStats::percentile(stats.allocNs, 0.99) / 1000 << "/"
+                 << LatencyStats::percentile(stats.allocNs, 1.0) / 1000
+                 << " touch_us p50/p99/max: "
+                 << LatencyStats::percentile(stats.touchNs, 0.5) / 1000 << "/"
+                 << LatencyStats::percentile(stats.touchNs, 0.99) / 1000 << "/"
+                 << LatencyStats::percentile(stats.touchNs, 1.0) / 1000
+                 << (killed ? " killed_after: " : " stopped_after: ") << elapsed << "s" << endl;
         }
     }
     return 0;
@@ -22,8 +22,10 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <cutils/properties.h>
 #include <fs_mgr.h>
 #include <hardware/hardware.h>
 #include <hardware/boot_control.h>
@@ -92,43 +94,145 @@ int module_markBootSuccessful(boot_control_module_t *module)
   return 0;
 }
 
-#define COPY_BUF_SIZE 1024*1024
+#define COPY_BUF_SIZE (4*1024*1024)
+// Buffers, offsets and sizes are aligned to this for O_DIRECT.
+#define COPY_ALIGNMENT 4096
+// Blocks of the destination are only rewritten if they differ from the
+// source, compared this many bytes at a time.
+#define COMPARE_BLOCK_SIZE (64*1024)
 
-static bool copy_data(int src_fd, int dst_fd, size_t num_bytes)
+static bool read_fully(int fd, char *buf, size_t count, off_t offset)
 {
-  char copy_buf[COPY_BUF_SIZE];
-  size_t remaining;
-
-  remaining = num_bytes;
-  while (remaining > 0) {
-    size_t num_to_read = remaining > COPY_BUF_SIZE ? COPY_BUF_SIZE : remaining;
+  while (count > 0) {
     ssize_t num_read;
     do {
-      num_read = read(src_fd, copy_buf, num_to_read);
+      num_read = pread(fd, buf, count, offset);
     } while (num_read == -1 && errno == EINTR);
     if (num_read <= 0) {
-      fprintf(stderr, "Error reading %zd bytes from source: %s\n",
-              num_to_read, strerror(errno));
+      fprintf(stderr, "Error reading %zd bytes at offset %" PRId64 ": %s\n",
+              count, (int64_t) offset, num_read == 0 ? "EOF" : strerror(errno));
+      return false;
+    }
+    buf += num_read;
+    offset += num_read;
+    count -= num_read;
+  }
+  return true;
+}
+
+static bool write_fully(int fd, const char *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t num_written;
+    do {
+      num_written = pwrite(fd, buf, count, offset);
+    } while (num_written == -1 && errno == EINTR);
+    if (num_written <= 0) {
+      fprintf(stderr, "Error writing %zd bytes to destination: %s\n",
+              count, strerror(errno));
       return false;
     }
-    size_t num_to_write = num_read;
-    while (num_to_write > 0) {
-      size_t offset = num_read - num_to_write;
-      ssize_t num_written;
-      do {
-        num_written = write(dst_fd, copy_buf + offset, num_to_write);
-      } while (num_written == -1 && errno == EINTR);
-      if (num_written <= 0) {
-        fprintf(stderr, "Error writing %zd bytes to destination: %s\n",
-                num_to_write, strerror(errno));
-        return false;
+    buf += num_written;
+    offset += num_written;
+    count -= num_written;
+  }
+  return true;
+}
+
+// Makes the destination equal to the source. Both are read a chunk at a
+// time and only the runs of blocks that differ are written, so that
+// setting the same slot active again, or a slot whose boot image barely
+// changed, costs reads rather than writes to flash.
+static bool copy_data(int src_fd, int dst_fd, size_t num_bytes,
+                      uint64_t *out_written)
+{
+  char *src_buf = NULL, *dst_buf = NULL;
+  bool ret = false;
+  size_t pos;
+
+  if (posix_memalign((void **) &src_buf, COPY_ALIGNMENT, COPY_BUF_SIZE) != 0 ||
+      posix_memalign((void **) &dst_buf, COPY_ALIGNMENT, COPY_BUF_SIZE) != 0) {
+    fprintf(stderr, "Error allocating copy buffers.\n");
+    goto out;
+  }
+
+  *out_written = 0;
+  for (pos = 0; pos < num_bytes; pos += COPY_BUF_SIZE) {
+    size_t len = num_bytes - pos > COPY_BUF_SIZE ? COPY_BUF_SIZE : num_bytes - pos;
+    size_t block, run_start = len;
+
+    if (!read_fully(src_fd, src_buf, len, pos) ||
+        !read_fully(dst_fd, dst_buf, len, pos))
+      goto out;
+
+    for (block = 0; block < len; block += COMPARE_BLOCK_SIZE) {
+      size_t block_len = len - block > COMPARE_BLOCK_SIZE ? COMPARE_BLOCK_SIZE : len - block;
+      bool differs = memcmp(src_buf + block, dst_buf + block, block_len) != 0;
+      if (differs && run_start == len) {
+        run_start = block;
+      } else if (!differs && run_start != len) {
+        if (!write_fully(dst_fd, src_buf + run_start, block - run_start,
+                         pos + run_start))
+          goto out;
+        *out_written += block - run_start;
+        run_start = len;
       }
-      num_to_write -= num_written;
     }
-    remaining -= num_read;
+    if (run_start != len) {
+      if (!write_fully(dst_fd, src_buf + run_start, len - run_start,
+                       pos + run_start))
+        goto out;
+      *out_written += len - run_start;
+    }
   }
+  ret = true;
 
-  return true;
+out:
+  free(src_buf);
+  free(dst_buf);
+  return ret;
+}
+
+// Reads the destination back and checks that it matches the source.
+static bool verify_data(int src_fd, int dst_fd, size_t num_bytes)
+{
+  char *src_buf = NULL, *dst_buf = NULL;
+  bool ret = false;
+  size_t pos;
+
+  if (posix_memalign((void **) &src_buf, COPY_ALIGNMENT, COPY_BUF_SIZE) != 0 ||
+      posix_memalign((void **) &dst_buf, COPY_ALIGNMENT, COPY_BUF_SIZE) != 0) {
+    fprintf(stderr, "Error allocating verification buffers.\n");
+    goto out;
+  }
+
+  for (pos = 0; pos < num_bytes; pos += COPY_BUF_SIZE) {
+    size_t len = num_bytes - pos > COPY_BUF_SIZE ? COPY_BUF_SIZE : num_bytes - pos;
+    if (!read_fully(src_fd, src_buf, len, pos) ||
+        !read_fully(dst_fd, dst_buf, len, pos))
+      goto out;
+    if (memcmp(src_buf, dst_buf, len) != 0) {
+      fprintf(stderr, "Destination differs from source after offset %zd.\n", pos);
+      errno = EIO;
+      goto out;
+    }
+  }
+  ret = true;
+
+out:
+  free(src_buf);
+  free(dst_buf);
+  return ret;
+}
+
+// Bypasses the page cache when the size allows it: the copy is read once,
+// and a verification then reads what reached the device.
+static void try_direct_io(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) {
+    fprintf(stderr, "WARNING: Error enabling O_DIRECT: %s\n", strerror(errno));
+  }
 }
 
 int module_setActiveBootSlot(boot_control_module_t *module, unsigned slot)
@@ -187,7 +291,13 @@ int module_setActiveBootSlot(boot_control_module_t *module, unsigned slot)
     return -EINVAL;
   }
 
-  if (!copy_data(src_fd, dst_fd, src_size)) {
+  if (src_size % COPY_ALIGNMENT == 0) {
+    try_direct_io(src_fd);
+    try_direct_io(dst_fd);
+  }
+
+  uint64_t num_written;
+  if (!copy_data(src_fd, dst_fd, src_size, &num_written)) {
     close(src_fd);
     close(dst_fd);
     return -errno;
@@ -196,6 +306,19 @@ int module_setActiveBootSlot(boot_control_module_t *module, unsigned slot)
   if (fsync(dst_fd) != 0) {
     fprintf(stderr, "Error calling fsync on destination: %s\n",
             strerror(errno));
+    close(src_fd);
+    close(dst_fd);
+    return -errno;
+  }
+  fprintf(stderr, "Copied \"%s\" to \"boot\": %" PRIu64 " of %" PRIu64
+          " bytes differed.\n", src_name, num_written, src_size);
+
+  char verify[PROPERTY_VALUE_MAX];
+  property_get("ro.bootctrl.verify_copy", verify, "0");
+  if ((!strcmp(verify, "1") || !strcmp(verify, "true")) &&
+      !verify_data(src_fd, dst_fd, src_size)) {
+    close(src_fd);
+    close(dst_fd);
     return -errno;
   }
 
@@ -17,11 +17,25 @@ LOCAL_PATH:= $(call my-dir)
 # Create the cppreopts that does the copy
 include $(CLEAR_VARS)
 
+LOCAL_MODULE:= cppreopts
+LOCAL_INIT_RC := cppreopts.rc
+LOCAL_SRC_FILES := cppreopts.cpp
+
+LOCAL_STATIC_LIBRARIES := libpreopt2cachename
+LOCAL_SHARED_LIBRARIES := libbase liblog
+
+LOCAL_CFLAGS := -Werror -Wall
+
+include $(BUILD_EXECUTABLE)
+
+# The shell version, which runs preopt2cachename and cp for each file. Products installing it get
+# the binary too, which init runs instead.
+include $(CLEAR_VARS)
+
 LOCAL_MODULE:= cppreopts.sh
 LOCAL_MODULE_CLASS := EXECUTABLES
-LOCAL_INIT_RC := cppreopts.rc
 LOCAL_SRC_FILES := cppreopts.sh
 
-LOCAL_REQUIRED_MODULES := preopt2cachename
+LOCAL_REQUIRED_MODULES := preopt2cachename cppreopts
 
 include $(BUILD_PREBUILT)
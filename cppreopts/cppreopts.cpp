@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "preopt2cachename.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// Present on the partition if it was built to contain preopted files.
+static const char* kMarkerFile = "system-other-odex-marker";
+
+// An odex file on the mounted partition, and where it goes in the dalvik cache.
+struct PreoptFile {
+  std::string odex_file;
+  std::string dest_name;
+};
+
+// Collects the odex files under dir, mapping them to their cache names as if the partition
+// mounted at mountpoint was /system.
+static void FindOdexFiles(const std::string& mountpoint, const std::string& dir,
+                          std::vector<PreoptFile>* files) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    PLOG(WARNING) << "Unable to open directory " << dir;
+    return;
+  }
+  dirent* entry;
+  while ((entry = readdir(d)) != nullptr) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    std::string path = dir + "/" + name;
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(path.c_str(), &st) != 0) {
+        continue;
+      }
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (type == DT_DIR) {
+      FindOdexFiles(mountpoint, path, files);
+    } else if (type == DT_REG && android::base::EndsWith(name, ".odex")) {
+      std::string real_odex_name = "/system" + path.substr(mountpoint.size());
+      std::string dest_name(kDalvikCacheDir);
+      if (!OdexToCacheFile(real_odex_name, dest_name)) {
+        LOG(INFO) << "Unable to figure out destination for " << path;
+        continue;
+      }
+      files->push_back(PreoptFile{path, dest_name});
+    }
+  }
+  closedir(d);
+}
+
+// Copies size bytes from in_fd to out_fd, in the kernel if possible, as the files are usually on
+// different file systems.
+static bool CopyFileData(int in_fd, int out_fd, off64_t size) {
+  off64_t copied = 0;
+#if defined(__NR_copy_file_range)
+  while (copied < size) {
+    ssize_t ret = syscall(__NR_copy_file_range, in_fd, nullptr, out_fd, nullptr,
+                          static_cast<size_t>(size - copied), 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      // Not supported by the kernel, or across file systems before Linux 5.3.
+      break;
+    }
+    copied += ret;
+  }
+#endif
+  while (copied < size) {
+    ssize_t ret = sendfile(out_fd, in_fd, nullptr, static_cast<size_t>(size - copied));
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    copied += ret;
+  }
+  // Both fds are at offset 'copied', whichever way the data went.
+  while (copied < size) {
+    char buf[65536];
+    ssize_t n = TEMP_FAILURE_RETRY(read(in_fd, buf, sizeof(buf)));
+    if (n <= 0) {
+      return false;
+    }
+    if (!android::base::WriteFully(out_fd, buf, n)) {
+      return false;
+    }
+    copied += n;
+  }
+  return true;
+}
+
+// Writes the data of odex_file to temp_name, sharing its blocks or its inode if the file system
+// allows it, and copying it otherwise.
+static bool WriteTempFile(const std::string& odex_file, const std::string& temp_name) {
+  android::base::unique_fd in_fd(TEMP_FAILURE_RETRY(open(odex_file.c_str(),
+                                                         O_RDONLY | O_CLOEXEC)));
+  struct stat in_st;
+  if (in_fd == -1 || fstat(in_fd, &in_st) != 0) {
+    PLOG(WARNING) << "Unable to open odex file " << odex_file;
+    return false;
+  }
+  struct stat dir_st;
+  std::string dest_dir = temp_name.substr(0, temp_name.rfind('/'));
+  if (stat(dest_dir.c_str(), &dir_st) == 0 && dir_st.st_dev == in_st.st_dev &&
+      link(odex_file.c_str(), temp_name.c_str()) == 0) {
+    return true;
+  }
+  android::base::unique_fd out_fd(TEMP_FAILURE_RETRY(
+      open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
+  if (out_fd == -1) {
+    PLOG(WARNING) << "Unable to create " << temp_name;
+    return false;
+  }
+  if (ioctl(out_fd, FICLONE, in_fd.get()) != 0 && !CopyFileData(in_fd, out_fd, in_st.st_size)) {
+    PLOG(WARNING) << "Unable to copy odex file " << odex_file << " to " << temp_name;
+    return false;
+  }
+  // Only the data of this file needs to be on disk before the rename, not that of the whole
+  // system as sync would do.
+  if (fsync(out_fd) != 0) {
+    PLOG(WARNING) << "Unable to sync " << temp_name;
+    return false;
+  }
+  return true;
+}
+
+// Installs the odex file through a temporary file and a rename, so the preopted file appears
+// atomically in the file system.
+static bool InstallFile(const PreoptFile& file) {
+  std::string temp_name = file.dest_name + ".tmp";
+  unlink(temp_name.c_str());
+  if (!WriteTempFile(file.odex_file, temp_name)) {
+    unlink(temp_name.c_str());
+    return false;
+  }
+  if (rename(temp_name.c_str(), file.dest_name.c_str()) != 0) {
+    PLOG(WARNING) << "Unable to rename temporary odex file from " << temp_name << " to "
+                  << file.dest_name;
+    unlink(temp_name.c_str());
+    return false;
+  }
+  LOG(INFO) << "Copied odex file from " << file.odex_file << " to " << file.dest_name;
+  return true;
+}
+
+// Copies the preopted files of the system_other partition mounted at mountpoint to the dalvik
+// cache on first boot. The partition is walked once and the files installed on several threads,
+// instead of running preopt2cachename and cp for each file as cppreopts.sh does.
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    LOG(ERROR) << "Usage: cppreopts <preopts-mount-point>";
+    return 1;
+  }
+  // Create files with 644 (global read) permissions.
+  umask(022);
+
+  std::string mountpoint = argv[1];
+  while (mountpoint.size() > 1 && mountpoint.back() == '/') {
+    mountpoint.pop_back();
+  }
+  if (access((mountpoint + "/" + kMarkerFile).c_str(), F_OK) != 0) {
+    LOG(INFO) << "system_other partition does not appear have been built to contain preopted "
+              << "files.";
+    return 1;
+  }
+  LOG(INFO) << "cppreopts from " << mountpoint;
+
+  std::vector<PreoptFile> files;
+  FindOdexFiles(mountpoint, mountpoint, &files);
+  // Big files first, so that no thread is left with a big file at the end.
+  std::vector<std::pair<off64_t, size_t>> order;
+  for (size_t i = 0; i < files.size(); ++i) {
+    struct stat st;
+    order.push_back(std::make_pair(
+        stat(files[i].odex_file.c_str(), &st) == 0 ? st.st_size : 0, i));
+  }
+  std::sort(order.rbegin(), order.rend());
+
+  size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+  thread_count = std::min(thread_count, files.size());
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back([&]() {
+      for (size_t j = next++; j < order.size(); j = next++) {
+        InstallFile(files[order[j].second]);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return 0;
+}
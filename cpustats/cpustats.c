@@ -29,29 +29,55 @@
  * SUCH DAMAGE.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_BUF_SIZE 64
+#define NS_PER_SEC 1000000000LL
 
 struct freq_info {
     unsigned freq;
     long unsigned time;
 };
 
+struct idle_info {
+    char name[MAX_BUF_SIZE];
+    long unsigned time; /* usec */
+    long unsigned usage;
+};
+
 struct cpu_info {
     long unsigned utime, ntime, stime, itime, iowtime, irqtime, sirqtime;
     struct freq_info *freqs;
     int freq_count;
+    struct idle_info *idles;
+    int idle_count;
+};
+
+/*
+ * Files kept open by the fast mode, re-read from offset 0 at each update.
+ */
+struct cpu_files {
+    int freq_fd;
+    int *idle_time_fds;
+    int *idle_usage_fds;
 };
 
 #define die(...) { fprintf(stderr, __VA_ARGS__); exit(EXIT_FAILURE); }
 
 static struct cpu_info old_total_cpu, new_total_cpu, *old_cpus, *new_cpus;
-static int cpu_count, delay, iterations;
-static char minimal, aggregate_freq_stats;
+static int cpu_count, iterations;
+static long long delay_ns;
+static char minimal, aggregate_freq_stats, fast;
+
+static int stat_fd;
+static struct cpu_files *cpu_files;
+static char *read_buf;
+static size_t read_buf_size;
 
 static int get_cpu_count();
 static int get_cpu_count_from_file(char *filename);
@@ -63,18 +89,27 @@ static void print_cpu_stats(char *label, struct cpu_info *new_cpu, struct cpu_in
 static void print_freq_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu);
 static void read_stats();
 static void read_freq_stats(int cpu);
+static void open_fast_files();
+static void close_fast_files();
+static void read_stats_fast();
+static void read_freq_stats_fast(int cpu);
+static void read_idle_stats_fast(int cpu);
+static void print_idle_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu);
+static void wait_interval(struct timespec *next);
 static char should_aggregate_freq_stats();
 static char should_print_freq_stats();
 static void usage(char *cmd);
 
 int main(int argc, char *argv[]) {
     struct cpu_info *tmp_cpus, tmp_total_cpu;
+    struct timespec next;
     int i, freq_count;
 
-    delay = 3;
+    delay_ns = 3 * NS_PER_SEC;
     iterations = -1;
     minimal = 0;
     aggregate_freq_stats = 0;
+    fast = 0;
 
     for (i = 0; i < argc; i++) {
         if (!strcmp(argv[i], "-n")) {
@@ -92,12 +127,16 @@ int main(int argc, char *argv[]) {
                 usage(argv[0]);
                 exit(EXIT_FAILURE);
             }
-            delay = atoi(argv[++i]);
+            delay_ns = atof(argv[++i]) * NS_PER_SEC;
+            if (delay_ns <= 0) die("Option -d expects a positive delay.\n");
             continue;
         }
         if (!strcmp(argv[i], "-m")) {
             minimal = 1;
         }
+        if (!strcmp(argv[i], "-f")) {
+            fast = 1;
+        }
         if (!strcmp(argv[i], "-h")) {
             usage(argv[0]);
             exit(EXIT_SUCCESS);
@@ -117,6 +156,11 @@ int main(int argc, char *argv[]) {
         if (!new_cpus[i].freqs) die("Could not allocate struct freq_info\n");
         old_cpus[i].freqs = malloc(sizeof(struct freq_info) * old_cpus[i].freq_count);
         if (!old_cpus[i].freqs) die("Could not allocate struct freq_info\n");
+        old_cpus[i].idle_count = new_cpus[i].idle_count = 0;
+        old_cpus[i].idles = new_cpus[i].idles = NULL;
+    }
+    if (fast) {
+        open_fast_files();
     }
 
     // Read stats without aggregating freq stats in the total cpu
@@ -134,6 +178,7 @@ int main(int argc, char *argv[]) {
         read_stats();
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &next);
     while ((iterations == -1) || (iterations-- > 0)) {
         // Swap new and old cpu buffers;
         tmp_total_cpu = old_total_cpu;
@@ -144,12 +189,15 @@ int main(int argc, char *argv[]) {
         old_cpus = new_cpus;
         new_cpus = tmp_cpus;
 
-        sleep(delay);
+        wait_interval(&next);
         read_stats();
         print_stats();
     }
 
     // Clean up
+    if (fast) {
+        close_fast_files();
+    }
     if (aggregate_freq_stats) {
         free(new_total_cpu.freqs);
         free(old_total_cpu.freqs);
@@ -157,6 +205,8 @@ int main(int argc, char *argv[]) {
     for (i = 0; i < cpu_count; i++) {
         free(new_cpus[i].freqs);
         free(old_cpus[i].freqs);
+        free(new_cpus[i].idles);
+        free(old_cpus[i].idles);
     }
     free(new_cpus);
     free(old_cpus);
@@ -236,6 +286,11 @@ static void read_stats() {
     char scanline[MAX_BUF_SIZE];
     int i;
 
+    if (fast) {
+        read_stats_fast();
+        return;
+    }
+
     file = fopen("/proc/stat", "r");
     if (!file) die("Could not open /proc/stat.\n");
     fscanf(file, "cpu  %lu %lu %lu %lu %lu %lu %lu %*d %*d %*d\n",
@@ -285,6 +340,246 @@ static void read_freq_stats(int cpu) {
         fclose(file);
 }
 
+/*
+ * Open the files read by the fast mode and find the idle states of each cpu.
+ */
+static void open_fast_files() {
+    char filename[MAX_BUF_SIZE * 2];
+    FILE *file;
+    int i, j, fd;
+
+    stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    if (stat_fd < 0) die("Could not open /proc/stat.\n");
+
+    /* Large enough for the cpu lines of /proc/stat, the only ones parsed */
+    read_buf_size = 256 + 128 * cpu_count;
+    read_buf = malloc(read_buf_size);
+    if (!read_buf) die("Could not allocate read buffer\n");
+
+    cpu_files = calloc(cpu_count, sizeof(struct cpu_files));
+    if (!cpu_files) die("Could not allocate struct cpu_files\n");
+
+    for (i = 0; i < cpu_count; i++) {
+        sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/stats/time_in_state", i);
+        cpu_files[i].freq_fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+        for (j = 0; ; j++) {
+            sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/time", i, j);
+            if (access(filename, R_OK)) break;
+        }
+        if (!j) continue;
+
+        new_cpus[i].idle_count = old_cpus[i].idle_count = j;
+        new_cpus[i].idles = calloc(j, sizeof(struct idle_info));
+        old_cpus[i].idles = calloc(j, sizeof(struct idle_info));
+        cpu_files[i].idle_time_fds = malloc(sizeof(int) * j);
+        cpu_files[i].idle_usage_fds = malloc(sizeof(int) * j);
+        if (!new_cpus[i].idles || !old_cpus[i].idles || !cpu_files[i].idle_time_fds ||
+                !cpu_files[i].idle_usage_fds) {
+            die("Could not allocate struct idle_info\n");
+        }
+
+        for (j = 0; j < new_cpus[i].idle_count; j++) {
+            sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name", i, j);
+            file = fopen(filename, "r");
+            if (file) {
+                if (fscanf(file, "%63s", new_cpus[i].idles[j].name) != 1) {
+                    sprintf(new_cpus[i].idles[j].name, "state%d", j);
+                }
+                fclose(file);
+            } else {
+                sprintf(new_cpus[i].idles[j].name, "state%d", j);
+            }
+            strcpy(old_cpus[i].idles[j].name, new_cpus[i].idles[j].name);
+
+            sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/time", i, j);
+            fd = open(filename, O_RDONLY | O_CLOEXEC);
+            cpu_files[i].idle_time_fds[j] = fd;
+            sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/usage", i, j);
+            fd = open(filename, O_RDONLY | O_CLOEXEC);
+            cpu_files[i].idle_usage_fds[j] = fd;
+        }
+    }
+}
+
+static void close_fast_files() {
+    int i, j;
+
+    for (i = 0; i < cpu_count; i++) {
+        if (cpu_files[i].freq_fd >= 0) close(cpu_files[i].freq_fd);
+        for (j = 0; j < new_cpus[i].idle_count; j++) {
+            if (cpu_files[i].idle_time_fds[j] >= 0) close(cpu_files[i].idle_time_fds[j]);
+            if (cpu_files[i].idle_usage_fds[j] >= 0) close(cpu_files[i].idle_usage_fds[j]);
+        }
+        free(cpu_files[i].idle_time_fds);
+        free(cpu_files[i].idle_usage_fds);
+    }
+    free(cpu_files);
+    free(read_buf);
+    close(stat_fd);
+}
+
+/*
+ * Read a whole file from offset 0 in read_buf, growing it as needed, or only
+ * its beginning if partial is set. Returns the length read, or -1.
+ */
+static ssize_t pread_file(int fd, char partial) {
+    ssize_t len;
+
+    if (fd < 0) return -1;
+    while (1) {
+        len = pread(fd, read_buf, read_buf_size - 1, 0);
+        if (len < 0) return -1;
+        if (partial || (size_t)len < read_buf_size - 1) break;
+        read_buf_size *= 2;
+        read_buf = realloc(read_buf, read_buf_size);
+        if (!read_buf) die("Could not allocate read buffer\n");
+    }
+    read_buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Parse the decimal number at p, after any blanks. Returns the end of the
+ * number, or NULL if there is none.
+ */
+static const char *scan_ulong(const char *p, long unsigned *value) {
+    long unsigned v = 0;
+
+    while (*p == ' ' || *p == '\t' || *p == '\n') p++;
+    if (*p < '0' || *p > '9') return NULL;
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    *value = v;
+    return p;
+}
+
+/*
+ * Read a file holding a single number with pread.
+ */
+static int pread_ulong(int fd, long unsigned *value) {
+    char buf[32];
+    ssize_t len;
+
+    if (fd < 0) return -1;
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) return -1;
+    buf[len] = '\0';
+    return scan_ulong(buf, value) ? 0 : -1;
+}
+
+/*
+ * Read the CPU, frequency and idle stats for all cpus from the open files.
+ */
+static void read_stats_fast() {
+    struct cpu_info *cpu;
+    const char *p;
+    long unsigned id;
+    int i;
+
+    /* CPUs missing from /proc/stat are offline, their times do not move */
+    for (i = 0; i < cpu_count; i++) {
+        new_cpus[i].utime = old_cpus[i].utime;
+        new_cpus[i].ntime = old_cpus[i].ntime;
+        new_cpus[i].stime = old_cpus[i].stime;
+        new_cpus[i].itime = old_cpus[i].itime;
+        new_cpus[i].iowtime = old_cpus[i].iowtime;
+        new_cpus[i].irqtime = old_cpus[i].irqtime;
+        new_cpus[i].sirqtime = old_cpus[i].sirqtime;
+    }
+
+    if (pread_file(stat_fd, 1) < 0) die("Could not read /proc/stat.\n");
+    p = read_buf;
+    while (!strncmp(p, "cpu", 3)) {
+        p += 3;
+        if (*p == ' ') {
+            cpu = &new_total_cpu;
+        } else {
+            p = scan_ulong(p, &id);
+            if (!p || id >= (long unsigned)cpu_count) die("Unexpected cpu in /proc/stat.\n");
+            cpu = &new_cpus[id];
+        }
+        if (!(p = scan_ulong(p, &cpu->utime)) || !(p = scan_ulong(p, &cpu->ntime)) ||
+                !(p = scan_ulong(p, &cpu->stime)) || !(p = scan_ulong(p, &cpu->itime)) ||
+                !(p = scan_ulong(p, &cpu->iowtime)) || !(p = scan_ulong(p, &cpu->irqtime)) ||
+                !(p = scan_ulong(p, &cpu->sirqtime))) {
+            die("Unexpected input in /proc/stat.\n");
+        }
+        p = strchr(p, '\n');
+        if (!p) break;
+        p++;
+    }
+
+    if (aggregate_freq_stats) {
+        for (i = 0; i < new_total_cpu.freq_count; i++) {
+            new_total_cpu.freqs[i].time = 0;
+        }
+    }
+    for (i = 0; i < cpu_count; i++) {
+        read_freq_stats_fast(i);
+        read_idle_stats_fast(i);
+    }
+}
+
+/*
+ * Read the frequency stats for a given cpu from its open time_in_state.
+ */
+static void read_freq_stats_fast(int cpu) {
+    const char *p = NULL;
+    long unsigned freq;
+    int i;
+
+    if (pread_file(cpu_files[cpu].freq_fd, 0) >= 0) {
+        p = read_buf;
+    }
+    for (i = 0; i < new_cpus[cpu].freq_count; i++) {
+        if (p && (p = scan_ulong(p, &freq)) && (p = scan_ulong(p, &new_cpus[cpu].freqs[i].time))) {
+            new_cpus[cpu].freqs[i].freq = freq;
+        } else {
+            /* The CPU has been off lined for some reason */
+            new_cpus[cpu].freqs[i].freq = old_cpus[cpu].freqs[i].freq;
+            new_cpus[cpu].freqs[i].time = old_cpus[cpu].freqs[i].time;
+        }
+        if (aggregate_freq_stats) {
+            new_total_cpu.freqs[i].freq = new_cpus[cpu].freqs[i].freq;
+            new_total_cpu.freqs[i].time += new_cpus[cpu].freqs[i].time;
+        }
+    }
+}
+
+/*
+ * Read the idle state residency for a given cpu.
+ */
+static void read_idle_stats_fast(int cpu) {
+    struct idle_info *new_idle, *old_idle;
+    int i;
+
+    for (i = 0; i < new_cpus[cpu].idle_count; i++) {
+        new_idle = &new_cpus[cpu].idles[i];
+        old_idle = &old_cpus[cpu].idles[i];
+        if (pread_ulong(cpu_files[cpu].idle_time_fds[i], &new_idle->time)) {
+            new_idle->time = old_idle->time;
+        }
+        if (pread_ulong(cpu_files[cpu].idle_usage_fds[i], &new_idle->usage)) {
+            new_idle->usage = old_idle->usage;
+        }
+    }
+}
+
+/*
+ * Sleep until the next update, keeping the updates delay_ns apart however
+ * long reading and printing took.
+ */
+static void wait_interval(struct timespec *next) {
+    long long ns = next->tv_nsec + delay_ns;
+
+    next->tv_sec += ns / NS_PER_SEC;
+    next->tv_nsec = ns % NS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL)) {
+    }
+}
+
 /*
  * Get the sum of the cpu time from all categories.
  */
@@ -333,6 +628,7 @@ static void print_cpu_stats(char *label, struct cpu_info *new_cpu, struct cpu_in
         if (print_freq) {
             print_freq_stats(new_cpu, old_cpu);
         }
+        print_idle_stats(new_cpu, old_cpu);
     } else {
         printf("%s,%ld,%ld,%ld,%ld,%ld,%ld,%ld", label,
                 new_cpu->utime - old_cpu->utime,
@@ -343,6 +639,7 @@ static void print_cpu_stats(char *label, struct cpu_info *new_cpu, struct cpu_in
                 new_cpu->irqtime - old_cpu->irqtime,
                 new_cpu->sirqtime - old_cpu->sirqtime);
         print_freq_stats(new_cpu, old_cpu);
+        print_idle_stats(new_cpu, old_cpu);
         printf("\n");
     }
 }
@@ -378,6 +675,39 @@ static void print_freq_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu)
     }
 }
 
+/*
+ * Print the idle state residency, in usec, and entries of a single CPU.
+ */
+static void print_idle_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu) {
+    long int delta_time, total_delta_time;
+    int i;
+
+    if (new_cpu->idle_count > 0) {
+        if (!minimal) {
+            total_delta_time = 0;
+            printf("  ");
+            for (i = 0; i < new_cpu->idle_count; i++) {
+                delta_time = new_cpu->idles[i].time - old_cpu->idles[i].time;
+                total_delta_time += delta_time;
+                printf("%s %ldus (%ld)", new_cpu->idles[i].name, delta_time,
+                        new_cpu->idles[i].usage - old_cpu->idles[i].usage);
+                if (i + 1 != new_cpu->idle_count) {
+                    printf(" + \n  ");
+                } else {
+                    printf(" = ");
+                }
+            }
+            printf("%ldus\n", total_delta_time);
+        } else {
+            for (i = 0; i < new_cpu->idle_count; i++) {
+                printf(",%s,%ld,%ld", new_cpu->idles[i].name,
+                        new_cpu->idles[i].time - old_cpu->idles[i].time,
+                        new_cpu->idles[i].usage - old_cpu->idles[i].usage);
+            }
+        }
+    }
+}
+
 /*
  * Determine if frequency stats should be printed.
  *
@@ -427,10 +757,12 @@ static char should_aggregate_freq_stats() {
  * Print the usage message.
  */
 static void usage(char *cmd) {
-    fprintf(stderr, "Usage %s [ -n iterations ] [ -d delay ] [ -c cpu ] [ -m ] [ -h ]\n"
+    fprintf(stderr, "Usage %s [ -n iterations ] [ -d delay ] [ -c cpu ] [ -m ] [ -f ] [ -h ]\n"
             "    -n num  Updates to show before exiting.\n"
-            "    -d num  Seconds to wait between updates.\n"
+            "    -d num  Seconds to wait between updates, 0.1 for 100ms.\n"
             "    -m      Display minimal output.\n"
+            "    -f      Keep the stats files open and read them with pread, for\n"
+            "            short delays. Also displays the idle state residency.\n"
             "    -h      Display this help screen.\n",
             cmd);
 }
@@ -11,3 +11,16 @@ LOCAL_MODULE := crypto
 
 include $(BUILD_EXECUTABLE)
 endif
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -O2 -Wall -Werror
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crypto
+LOCAL_SRC_FILES := crypto_throughput.cpp
+LOCAL_SHARED_LIBRARIES := libcrypto
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := debug
+LOCAL_MODULE := crypto_throughput
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+#include <openssl/evp.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+#define SECTOR_SIZE 4096
+#define BLOCK_SIZE 16
+#define BLOCKS_PER_SECTOR (SECTOR_SIZE / BLOCK_SIZE)
+#define GCM_IV_SIZE 12
+#define GCM_TAG_SIZE 16
+#define NSEC_PER_SEC 1000000000ULL
+#define MAX_CPUS 64
+
+// Contains information about benchmark options.
+typedef struct {
+    int seconds;
+    int max_cpus;
+} command_data_t;
+
+enum { MODE_XTS, MODE_GCM };
+
+/* Encrypts 4K sectors with one implementation. Each thread has its own. */
+class SectorCipher {
+public:
+    virtual ~SectorCipher() {}
+    /* key has 2 * key_bits for XTS, key_bits for GCM. */
+    virtual bool init(int mode, int key_bits, const uint8_t *key) = 0;
+    /* out has room for the GCM tag. */
+    virtual bool encrypt(const uint8_t *in, uint8_t *out, uint64_t sector) = 0;
+};
+
+static void sector_iv(uint64_t sector, uint8_t *iv, size_t len) {
+    memset(iv, 0, len);
+    memcpy(iv, &sector, sizeof(sector));
+}
+
+/* Multiplies an XTS tweak by x in GF(2^128). */
+static void xts_next_tweak(uint8_t *t) {
+    uint8_t carry = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        uint8_t next = t[i] >> 7;
+        t[i] = (t[i] << 1) | carry;
+        carry = next;
+    }
+    if (carry) {
+        t[0] ^= 0x87;
+    }
+}
+
+/*
+ * BoringSSL. XTS is built on ECB over the whole sector, which keeps the
+ * AES units as busy as the library can, with the tweaks computed apart;
+ * GCM is the library's own.
+ */
+class BoringSslCipher : public SectorCipher {
+public:
+    BoringSslCipher() : ctx_(EVP_CIPHER_CTX_new()), tweak_ctx_(EVP_CIPHER_CTX_new()) {}
+    ~BoringSslCipher() override {
+        EVP_CIPHER_CTX_free(ctx_);
+        EVP_CIPHER_CTX_free(tweak_ctx_);
+    }
+
+    bool init(int mode, int key_bits, const uint8_t *key) override {
+        mode_ = mode;
+        if (mode == MODE_GCM) {
+            const EVP_CIPHER *cipher = key_bits == 128 ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+            return EVP_EncryptInit_ex(ctx_, cipher, NULL, key, NULL) == 1;
+        }
+        const EVP_CIPHER *cipher = key_bits == 128 ? EVP_aes_128_ecb() : EVP_aes_256_ecb();
+        if (EVP_EncryptInit_ex(ctx_, cipher, NULL, key, NULL) != 1 ||
+            EVP_EncryptInit_ex(tweak_ctx_, cipher, NULL, key + key_bits / 8, NULL) != 1) {
+            return false;
+        }
+        EVP_CIPHER_CTX_set_padding(ctx_, 0);
+        EVP_CIPHER_CTX_set_padding(tweak_ctx_, 0);
+        return true;
+    }
+
+    bool encrypt(const uint8_t *in, uint8_t *out, uint64_t sector) override {
+        int len;
+        if (mode_ == MODE_GCM) {
+            uint8_t iv[GCM_IV_SIZE];
+            sector_iv(sector, iv, sizeof(iv));
+            return EVP_EncryptInit_ex(ctx_, NULL, NULL, NULL, iv) == 1 &&
+                   EVP_EncryptUpdate(ctx_, out, &len, in, SECTOR_SIZE) == 1 &&
+                   EVP_EncryptFinal_ex(ctx_, out + len, &len) == 1 &&
+                   EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE,
+                                       out + SECTOR_SIZE) == 1;
+        }
+
+        uint8_t t[BLOCK_SIZE];
+        sector_iv(sector, t, sizeof(t));
+        if (EVP_EncryptUpdate(tweak_ctx_, t, &len, t, BLOCK_SIZE) != 1) {
+            return false;
+        }
+        for (int i = 0; i < BLOCKS_PER_SECTOR; i++) {
+            memcpy(tweaks_[i], t, BLOCK_SIZE);
+            xts_next_tweak(t);
+        }
+        xor_words(out, in, (const uint8_t *)tweaks_);
+        if (EVP_EncryptUpdate(ctx_, out, &len, out, SECTOR_SIZE) != 1) {
+            return false;
+        }
+        xor_words(out, out, (const uint8_t *)tweaks_);
+        return true;
+    }
+
+private:
+    static void xor_words(uint8_t *out, const uint8_t *a, const uint8_t *b) {
+        for (int i = 0; i < SECTOR_SIZE; i += sizeof(uint64_t)) {
+            uint64_t x, y;
+            memcpy(&x, a + i, sizeof(x));
+            memcpy(&y, b + i, sizeof(y));
+            x ^= y;
+            memcpy(out + i, &x, sizeof(x));
+        }
+    }
+
+    EVP_CIPHER_CTX *ctx_;
+    EVP_CIPHER_CTX *tweak_ctx_;
+    int mode_ = MODE_XTS;
+    uint8_t tweaks_[BLOCKS_PER_SECTOR][BLOCK_SIZE];
+};
+
+/*
+ * The kernel crypto API through AF_ALG, which uses whatever the kernel
+ * registered for xts(aes) and gcm(aes): the CPU, or a crypto engine. Each
+ * sector is a sendmsg and a read.
+ */
+class AfAlgCipher : public SectorCipher {
+public:
+    ~AfAlgCipher() override {
+        if (op_fd_ >= 0) close(op_fd_);
+        if (tfm_fd_ >= 0) close(tfm_fd_);
+    }
+
+    bool init(int mode, int key_bits, const uint8_t *key) override {
+        struct sockaddr_alg sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.salg_family = AF_ALG;
+        mode_ = mode;
+        if (mode == MODE_GCM) {
+            strcpy((char *)sa.salg_type, "aead");
+            strcpy((char *)sa.salg_name, "gcm(aes)");
+        } else {
+            strcpy((char *)sa.salg_type, "skcipher");
+            strcpy((char *)sa.salg_name, "xts(aes)");
+        }
+        int key_len = (mode == MODE_GCM ? 1 : 2) * key_bits / 8;
+
+        tfm_fd_ = socket(AF_ALG, SOCK_SEQPACKET, 0);
+        if (tfm_fd_ < 0 || bind(tfm_fd_, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+            setsockopt(tfm_fd_, SOL_ALG, ALG_SET_KEY, key, key_len) != 0) {
+            return false;
+        }
+        if (mode == MODE_GCM &&
+            setsockopt(tfm_fd_, SOL_ALG, ALG_SET_AEAD_AUTHSIZE, NULL, GCM_TAG_SIZE) != 0) {
+            return false;
+        }
+        op_fd_ = accept(tfm_fd_, NULL, 0);
+        return op_fd_ >= 0;
+    }
+
+    bool encrypt(const uint8_t *in, uint8_t *out, uint64_t sector) override {
+        size_t iv_len = mode_ == MODE_GCM ? GCM_IV_SIZE : BLOCK_SIZE;
+        char cbuf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + BLOCK_SIZE) +
+                  CMSG_SPACE(sizeof(uint32_t))];
+        struct msghdr msg;
+        struct iovec iov;
+        struct cmsghdr *cmsg;
+
+        memset(cbuf, 0, sizeof(cbuf));
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (void *)in;
+        iov.iov_len = SECTOR_SIZE;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(uint32_t)) +
+                             CMSG_SPACE(sizeof(struct af_alg_iv) + iv_len);
+        if (mode_ == MODE_GCM) {
+            msg.msg_controllen += CMSG_SPACE(sizeof(uint32_t));
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_OP;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        *(uint32_t *)CMSG_DATA(cmsg) = ALG_OP_ENCRYPT;
+
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_IV;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + iv_len);
+        struct af_alg_iv *iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+        iv->ivlen = iv_len;
+        sector_iv(sector, iv->iv, iv_len);
+
+        if (mode_ == MODE_GCM) {
+            cmsg = CMSG_NXTHDR(&msg, cmsg);
+            cmsg->cmsg_level = SOL_ALG;
+            cmsg->cmsg_type = ALG_SET_AEAD_ASSOCLEN;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+            *(uint32_t *)CMSG_DATA(cmsg) = 0;
+        }
+
+        size_t out_len = SECTOR_SIZE + (mode_ == MODE_GCM ? GCM_TAG_SIZE : 0);
+        return sendmsg(op_fd_, &msg, 0) == SECTOR_SIZE &&
+               read(op_fd_, out, out_len) == (ssize_t)out_len;
+    }
+
+private:
+    int tfm_fd_ = -1;
+    int op_fd_ = -1;
+    int mode_ = MODE_XTS;
+};
+
+#if defined(__aarch64__)
+/*
+ * XTS with the ARMv8 Crypto Extensions, the instructions the garbage
+ * loops of crypto time, four blocks at a time so that the AESE/AESMC
+ * pairs of independent blocks overlap.
+ */
+class ArmCeCipher : public SectorCipher {
+public:
+    bool init(int mode, int key_bits, const uint8_t *key) override {
+        if (mode != MODE_XTS) {
+            return false;
+        }
+        rounds_ = key_bits == 128 ? 10 : 14;
+        expand_key(key, key_bits, rk1_);
+        expand_key(key + key_bits / 8, key_bits, rk2_);
+        return true;
+    }
+
+    bool encrypt(const uint8_t *in, uint8_t *out, uint64_t sector) override {
+        uint8_t iv[BLOCK_SIZE];
+        sector_iv(sector, iv, sizeof(iv));
+        uint8x16_t t = encrypt_block(vld1q_u8(iv), rk2_);
+
+        for (int i = 0; i < BLOCKS_PER_SECTOR; i += 4) {
+            uint8x16_t t0 = t, t1 = next_tweak(t0), t2 = next_tweak(t1), t3 = next_tweak(t2);
+            t = next_tweak(t3);
+            uint8x16_t b0 = veorq_u8(vld1q_u8(in + (i + 0) * BLOCK_SIZE), t0);
+            uint8x16_t b1 = veorq_u8(vld1q_u8(in + (i + 1) * BLOCK_SIZE), t1);
+            uint8x16_t b2 = veorq_u8(vld1q_u8(in + (i + 2) * BLOCK_SIZE), t2);
+            uint8x16_t b3 = veorq_u8(vld1q_u8(in + (i + 3) * BLOCK_SIZE), t3);
+            for (int r = 0; r < rounds_ - 1; r++) {
+                b0 = vaesmcq_u8(vaeseq_u8(b0, rk1_[r]));
+                b1 = vaesmcq_u8(vaeseq_u8(b1, rk1_[r]));
+                b2 = vaesmcq_u8(vaeseq_u8(b2, rk1_[r]));
+                b3 = vaesmcq_u8(vaeseq_u8(b3, rk1_[r]));
+            }
+            b0 = veorq_u8(vaeseq_u8(b0, rk1_[rounds_ - 1]), rk1_[rounds_]);
+            b1 = veorq_u8(vaeseq_u8(b1, rk1_[rounds_ - 1]), rk1_[rounds_]);
+            b2 = veorq_u8(vaeseq_u8(b2, rk1_[rounds_ - 1]), rk1_[rounds_]);
+            b3 = veorq_u8(vaeseq_u8(b3, rk1_[rounds_ - 1]), rk1_[rounds_]);
+            vst1q_u8(out + (i + 0) * BLOCK_SIZE, veorq_u8(b0, t0));
+            vst1q_u8(out + (i + 1) * BLOCK_SIZE, veorq_u8(b1, t1));
+            vst1q_u8(out + (i + 2) * BLOCK_SIZE, veorq_u8(b2, t2));
+            vst1q_u8(out + (i + 3) * BLOCK_SIZE, veorq_u8(b3, t3));
+        }
+        return true;
+    }
+
+private:
+    /* AESE with a zero key is SubBytes, and ShiftRows does not move the
+     * bytes of a word duplicated in every column. */
+    static uint32_t sub_word(uint32_t w) {
+        uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(w));
+        v = vaeseq_u8(v, vdupq_n_u8(0));
+        return vgetq_lane_u32(vreinterpretq_u32_u8(v), 0);
+    }
+
+    void expand_key(const uint8_t *key, int key_bits, uint8x16_t *rk) {
+        uint32_t w[60];
+        int nk = key_bits / 32;
+        int total = 4 * (rounds_ + 1);
+        uint8_t rcon = 1;
+
+        memcpy(w, key, key_bits / 8);
+        for (int i = nk; i < total; i++) {
+            uint32_t temp = w[i - 1];
+            if (i % nk == 0) {
+                temp = sub_word((temp >> 8) | (temp << 24)) ^ rcon;
+                rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0);
+            } else if (nk > 6 && i % nk == 4) {
+                temp = sub_word(temp);
+            }
+            w[i] = w[i - nk] ^ temp;
+        }
+        for (int r = 0; r <= rounds_; r++) {
+            rk[r] = vld1q_u8((const uint8_t *)&w[4 * r]);
+        }
+    }
+
+    uint8x16_t encrypt_block(uint8x16_t b, const uint8x16_t *rk) {
+        for (int r = 0; r < rounds_ - 1; r++) {
+            b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+        }
+        return veorq_u8(vaeseq_u8(b, rk[rounds_ - 1]), rk[rounds_]);
+    }
+
+    static uint8x16_t next_tweak(uint8x16_t t) {
+        uint8_t b[BLOCK_SIZE];
+        vst1q_u8(b, t);
+        xts_next_tweak(b);
+        return vld1q_u8(b);
+    }
+
+    int rounds_ = 0;
+    uint8x16_t rk1_[15];
+    uint8x16_t rk2_[15];
+};
+#endif
+
+typedef struct {
+    const char *name;
+    int mode;
+    int key_bits;
+    SectorCipher *(*create)();
+} bench_t;
+
+static SectorCipher *create_boringssl() { return new BoringSslCipher; }
+static SectorCipher *create_af_alg() { return new AfAlgCipher; }
+#if defined(__aarch64__)
+static SectorCipher *create_arm_ce() { return new ArmCeCipher; }
+#endif
+
+static const bench_t benches[] = {
+    { "boringssl aes-128-xts", MODE_XTS, 128, create_boringssl },
+    { "boringssl aes-256-xts", MODE_XTS, 256, create_boringssl },
+    { "boringssl aes-128-gcm", MODE_GCM, 128, create_boringssl },
+    { "boringssl aes-256-gcm", MODE_GCM, 256, create_boringssl },
+    { "af_alg aes-128-xts", MODE_XTS, 128, create_af_alg },
+    { "af_alg aes-256-xts", MODE_XTS, 256, create_af_alg },
+    { "af_alg aes-128-gcm", MODE_GCM, 128, create_af_alg },
+    { "af_alg aes-256-gcm", MODE_GCM, 256, create_af_alg },
+#if defined(__aarch64__)
+    { "armv8-ce aes-128-xts", MODE_XTS, 128, create_arm_ce },
+    { "armv8-ce aes-256-xts", MODE_XTS, 256, create_arm_ce },
+#endif
+};
+
+static const uint8_t test_key[64] = {
+    0x27, 0x18, 0x28, 0x18, 0x28, 0x45, 0x90, 0x45, 0x23, 0x53, 0x60, 0x28, 0x74, 0x71, 0x35, 0x26,
+    0x62, 0x49, 0x77, 0x57, 0x24, 0x70, 0x93, 0x69, 0x99, 0x59, 0x57, 0x49, 0x66, 0x96, 0x76, 0x27,
+    0x31, 0x41, 0x59, 0x26, 0x53, 0x58, 0x97, 0x93, 0x23, 0x84, 0x62, 0x64, 0x33, 0x83, 0x27, 0x95,
+    0x02, 0x88, 0x41, 0x97, 0x16, 0x93, 0x99, 0x37, 0x51, 0x05, 0x82, 0x09, 0x74, 0x94, 0x45, 0x92,
+};
+
+typedef struct {
+    const bench_t *bench;
+    int cpu;
+    int seconds;
+    pthread_barrier_t *barrier;
+    uint64_t sectors;
+    uint64_t ns;
+    bool failed;
+} worker_t;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void *worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(w->cpu, &cpuset);
+    sched_setaffinity(0, sizeof(cpuset), &cpuset);
+
+    SectorCipher *cipher = w->bench->create();
+    uint8_t *in = (uint8_t *)malloc(SECTOR_SIZE);
+    uint8_t *out = (uint8_t *)malloc(SECTOR_SIZE + GCM_TAG_SIZE);
+    w->failed = !cipher->init(w->bench->mode, w->bench->key_bits, test_key) || !in || !out;
+    if (in) memset(in, 0x5a, SECTOR_SIZE);
+
+    pthread_barrier_wait(w->barrier);
+    if (!w->failed) {
+        uint64_t begin = now_ns(), end = begin + w->seconds * NSEC_PER_SEC, now = begin;
+        uint64_t sector = 0;
+        /* Check the time every 64 sectors to keep it out of the loop. */
+        while (now < end && !w->failed) {
+            for (int i = 0; i < 64; i++) {
+                if (!cipher->encrypt(in, out, sector++)) {
+                    w->failed = true;
+                    break;
+                }
+            }
+            now = now_ns();
+        }
+        w->sectors = sector;
+        w->ns = now - begin;
+    }
+
+    delete cipher;
+    free(in);
+    free(out);
+    return NULL;
+}
+
+/* Runs the bench on each of cpus at once, returns the total MB/s or a
+ * negative value if it failed. */
+static double run(const bench_t *bench, const int *cpus, int num_cpus, int seconds) {
+    pthread_t threads[MAX_CPUS];
+    worker_t workers[MAX_CPUS];
+    pthread_barrier_t barrier;
+    double mb_per_sec = 0;
+    bool failed = false;
+
+    pthread_barrier_init(&barrier, NULL, num_cpus);
+    for (int i = 0; i < num_cpus; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].bench = bench;
+        workers[i].cpu = cpus[i];
+        workers[i].seconds = seconds;
+        workers[i].barrier = &barrier;
+        pthread_create(&threads[i], NULL, worker, &workers[i]);
+    }
+    for (int i = 0; i < num_cpus; i++) {
+        pthread_join(threads[i], NULL);
+        if (workers[i].failed || !workers[i].ns) {
+            failed = true;
+        } else {
+            mb_per_sec += (double)workers[i].sectors * SECTOR_SIZE / (1 << 20) *
+                          NSEC_PER_SEC / workers[i].ns;
+        }
+    }
+    pthread_barrier_destroy(&barrier);
+    return failed ? -1 : mb_per_sec;
+}
+
+/* Every implementation must give the same XTS ciphertext. */
+static bool verify(const bench_t *bench, const uint8_t *expected) {
+    uint8_t in[SECTOR_SIZE], out[SECTOR_SIZE + GCM_TAG_SIZE];
+    SectorCipher *cipher = bench->create();
+    bool ok = false;
+
+    memset(in, 0x5a, sizeof(in));
+    if (cipher->init(bench->mode, bench->key_bits, test_key) && cipher->encrypt(in, out, 7)) {
+        ok = !memcmp(out, expected, SECTOR_SIZE + (bench->mode == MODE_GCM ? GCM_TAG_SIZE : 0));
+    }
+    delete cipher;
+    return ok;
+}
+
+void usage() {
+    printf("--------------------------------------------------------------------------------\n");
+    printf("Usage:");
+    printf("	crypto_throughput [--seconds SECONDS] [--max_cpus N]\n\n");
+    printf("Encrypts 4K sectors with AES-XTS and AES-GCM through BoringSSL, the kernel crypto\n"
+           "API (AF_ALG) and, on arm64, the ARMv8 Crypto Extensions, on each online cpu alone\n"
+           "and then on all of them at once, and prints the throughput in MB/s.\n");
+    printf("Lock the cpu frequencies before invoking this benchmark for stable numbers.\n");
+    printf("--------------------------------------------------------------------------------\n");
+}
+
+int processOptions(int argc, char **argv, command_data_t *cmd_data) {
+    cmd_data->seconds = 1;
+    cmd_data->max_cpus = MAX_CPUS;
+    for (int i = 1; i < argc; i++) {
+        int *save_value = NULL;
+        if (strcmp(argv[i], "--seconds") == 0) {
+            save_value = &cmd_data->seconds;
+        } else if (strcmp(argv[i], "--max_cpus") == 0) {
+            save_value = &cmd_data->max_cpus;
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+        if (i == argc - 1 || !isdigit(argv[i + 1][0])) {
+            printf("The option %s requires one argument.\n", argv[i]);
+            return -1;
+        }
+        *save_value = (int)strtol(argv[++i], NULL, 0);
+    }
+    if (cmd_data->seconds <= 0 || cmd_data->max_cpus <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    command_data_t cmd_data;
+    int cpus[MAX_CPUS];
+    int num_cpus = 0;
+    cpu_set_t online;
+
+    if (processOptions(argc, argv, &cmd_data) == -1) {
+        usage();
+        return -1;
+    }
+
+    if (sched_getaffinity(0, sizeof(online), &online) != 0) {
+        perror("sched_getaffinity failed");
+        return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && num_cpus < MAX_CPUS && num_cpus < cmd_data.max_cpus;
+         cpu++) {
+        if (CPU_ISSET(cpu, &online)) {
+            cpus[num_cpus++] = cpu;
+        }
+    }
+
+    /* The reference ciphertexts of BoringSSL, for the other paths. */
+    uint8_t expected[4][SECTOR_SIZE + GCM_TAG_SIZE];
+    for (int i = 0; i < 4; i++) {
+        uint8_t in[SECTOR_SIZE];
+        SectorCipher *cipher = benches[i].create();
+        memset(in, 0x5a, sizeof(in));
+        if (!cipher->init(benches[i].mode, benches[i].key_bits, test_key) ||
+            !cipher->encrypt(in, expected[i], 7)) {
+            fprintf(stderr, "%s failed\n", benches[i].name);
+            return -1;
+        }
+        delete cipher;
+    }
+
+    printf("%-22s", "MB/s");
+    for (int i = 0; i < num_cpus; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "cpu%d", cpus[i]);
+        printf(" %8s", name);
+    }
+    printf(" %9s\n", "all cpus");
+
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        const bench_t *bench = &benches[b];
+        int ref = (bench->mode == MODE_GCM ? 2 : 0) + (bench->key_bits == 256 ? 1 : 0);
+        printf("%-22s", bench->name);
+        if (!verify(bench, expected[ref])) {
+            printf(" unavailable or wrong output\n");
+            continue;
+        }
+        for (int i = 0; i < num_cpus; i++) {
+            printf(" %8.1f", run(bench, &cpus[i], 1, cmd_data.seconds));
+            fflush(stdout);
+        }
+        printf(" %9.1f\n", run(bench, cpus, num_cpus, cmd_data.seconds));
+    }
+    return 0;
+}
@@ -13,6 +13,8 @@ libext4_utils_src_files := \
     sha1.c \
     wipe.c \
     crc16.c \
+    crc32c.c \
+    metadata_csum.c \
     ext4_sb.c
 
 #
@@ -178,6 +180,16 @@ LOCAL_STATIC_LIBRARIES += \
 include $(BUILD_HOST_EXECUTABLE)
 
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := ext4_verify.c
+LOCAL_MODULE := ext4_verify
+LOCAL_STATIC_LIBRARIES += \
+    libext4_utils_host \
+    libsparse_host \
+    libz
+include $(BUILD_HOST_EXECUTABLE)
+
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := mkuserimg.sh
 LOCAL_SRC_FILES := mkuserimg.sh
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct xattr_list_element {
 	struct ext4_inode *inode;
@@ -28,6 +29,232 @@ struct xattr_list_element {
 	struct xattr_list_element *next;
 };
 
+/* Number of regions allocated at a time by region_alloc */
+#define REGION_POOL_SLAB 256
+
+/* Regions are allocated from slabs and kept on a free list when they are
+   released, instead of going through malloc for each one */
+static struct region *region_free_list;
+
+static struct region *region_alloc()
+{
+	struct region *reg;
+	int i;
+
+	if (region_free_list == NULL) {
+		struct region *slab = malloc(REGION_POOL_SLAB * sizeof(struct region));
+		if (slab == NULL)
+			critical_error_errno("malloc");
+
+		for (i = 0; i < REGION_POOL_SLAB; i++) {
+			slab[i].next = region_free_list;
+			region_free_list = &slab[i];
+		}
+	}
+
+	reg = region_free_list;
+	region_free_list = reg->next;
+	return reg;
+}
+
+static void region_free(struct region *reg)
+{
+	reg->next = region_free_list;
+	region_free_list = reg;
+}
+
+/* Free extent index. The free space in a block group is the holes between
+   its consecutive chunks, and the allocator picks the smallest hole that
+   fits an allocation, or the largest one if none does, preferring the
+   first one in block group and chunk order among holes of the same size.
+   The non-empty holes are kept in a treap ordered by size and position, so
+   that finding the hole takes O(log n) time instead of scanning every
+   chunk of every block group. */
+struct hole_node {
+	u32 size;
+	u32 bg;
+	u32 chunk; /* index of the chunk before the hole */
+	u32 priority;
+	int left;
+	int right;
+};
+
+static struct {
+	bool valid; /* false after chunks are added */
+	struct hole_node *nodes;
+	u32 *bg_first_node; /* index of the node for the first hole in a bg */
+	int root;
+	u32 seed;
+} hole_index;
+
+static u32 hole_size(struct block_group_info *bg, u32 chunk)
+{
+	return bg->chunks[chunk + 1].block -
+		(bg->chunks[chunk].block + bg->chunks[chunk].len);
+}
+
+/* Returns true if node a comes before node b */
+static bool hole_less(const struct hole_node *a, const struct hole_node *b)
+{
+	if (a->size != b->size)
+		return a->size < b->size;
+	if (a->bg != b->bg)
+		return a->bg < b->bg;
+	return a->chunk < b->chunk;
+}
+
+/* Splits the tree at t into nodes before key and the rest */
+static void hole_split(int t, const struct hole_node *key, int *left, int *right)
+{
+	struct hole_node *nodes = hole_index.nodes;
+
+	if (t < 0) {
+		*left = -1;
+		*right = -1;
+	} else if (hole_less(&nodes[t], key)) {
+		hole_split(nodes[t].right, key, &nodes[t].right, right);
+		*left = t;
+	} else {
+		hole_split(nodes[t].left, key, left, &nodes[t].left);
+		*right = t;
+	}
+}
+
+/* Merges two trees where all nodes in left come before the ones in right */
+static int hole_merge(int left, int right)
+{
+	struct hole_node *nodes = hole_index.nodes;
+
+	if (left < 0)
+		return right;
+	if (right < 0)
+		return left;
+
+	if (nodes[left].priority > nodes[right].priority) {
+		nodes[left].right = hole_merge(nodes[left].right, right);
+		return left;
+	} else {
+		nodes[right].left = hole_merge(left, nodes[right].left);
+		return right;
+	}
+}
+
+static void hole_insert(int n)
+{
+	int left, right;
+
+	hole_index.nodes[n].left = -1;
+	hole_index.nodes[n].right = -1;
+	hole_split(hole_index.root, &hole_index.nodes[n], &left, &right);
+	hole_index.root = hole_merge(hole_merge(left, n), right);
+}
+
+static void hole_remove(int n)
+{
+	struct hole_node *nodes = hole_index.nodes;
+	int *link = &hole_index.root;
+
+	while (*link != n) {
+		if (*link < 0)
+			critical_error("free extent index is corrupted");
+		if (hole_less(&nodes[n], &nodes[*link]))
+			link = &nodes[*link].left;
+		else
+			link = &nodes[*link].right;
+	}
+
+	*link = hole_merge(nodes[n].left, nodes[n].right);
+}
+
+/* Returns the first hole of at least len blocks, or -1 */
+static int hole_lower_bound(u32 len)
+{
+	struct hole_node *nodes = hole_index.nodes;
+	int t = hole_index.root;
+	int found = -1;
+
+	while (t >= 0) {
+		if (nodes[t].size >= len) {
+			found = t;
+			t = nodes[t].left;
+		} else {
+			t = nodes[t].right;
+		}
+	}
+
+	return found;
+}
+
+/* Returns the first of the largest holes, or -1 */
+static int hole_largest()
+{
+	struct hole_node *nodes = hole_index.nodes;
+	int t = hole_index.root;
+
+	if (t < 0)
+		return -1;
+
+	while (nodes[t].right >= 0)
+		t = nodes[t].right;
+
+	return hole_lower_bound(nodes[t].size);
+}
+
+static void hole_index_free()
+{
+	free(hole_index.nodes);
+	free(hole_index.bg_first_node);
+	memset(&hole_index, 0, sizeof(hole_index));
+}
+
+/* Builds the free extent index from the chunks in each block group, which
+   must be sorted */
+static void hole_index_build()
+{
+	struct block_group_info *bgs = aux_info.bgs;
+	unsigned int i;
+	int j;
+	u32 count = 0;
+
+	hole_index_free();
+
+	hole_index.bg_first_node = calloc(aux_info.groups, sizeof(u32));
+	if (hole_index.bg_first_node == NULL)
+		critical_error_errno("calloc");
+
+	for (i = 0; i < aux_info.groups; i++) {
+		hole_index.bg_first_node[i] = count;
+		if (bgs[i].chunk_count > 1)
+			count += bgs[i].chunk_count - 1;
+	}
+
+	hole_index.nodes = calloc(count, sizeof(struct hole_node));
+	if (count && hole_index.nodes == NULL)
+		critical_error_errno("calloc");
+
+	hole_index.root = -1;
+	hole_index.seed = 1;
+
+	for (i = 0; i < aux_info.groups; i++) {
+		for (j = 0; j + 1 < bgs[i].chunk_count; j++) {
+			int n = hole_index.bg_first_node[i] + j;
+			struct hole_node *node = &hole_index.nodes[n];
+
+			node->size = hole_size(&bgs[i], j);
+			node->bg = i;
+			node->chunk = j;
+			/* any sequence will do, this one keeps images reproducible */
+			hole_index.seed = hole_index.seed * 1103515245 + 12345;
+			node->priority = hole_index.seed;
+
+			if (node->size > 0)
+				hole_insert(n);
+		}
+	}
+
+	hole_index.valid = true;
+}
+
 struct block_allocation *create_allocation()
 {
 	struct block_allocation *alloc = malloc(sizeof(struct block_allocation));
@@ -149,7 +376,7 @@ void append_region(struct block_allocation *alloc,
 		u32 block, u32 len, int bg_num)
 {
 	struct region *reg;
-	reg = malloc(sizeof(struct region));
+	reg = region_alloc();
 	reg->block = block;
 	reg->len = len;
 	reg->bg = bg_num;
@@ -254,13 +481,14 @@ void reduce_allocation(struct block_allocation *alloc, u32 len)
 			len -= last_reg->len;
 			if (reg) {
 				reg->next = NULL;
+				alloc->list.last = reg;
 			} else {
 				alloc->list.first = NULL;
 				alloc->list.last = NULL;
 				alloc->list.iter = NULL;
 				alloc->list.partial_iter = 0;
 			}
-			free(last_reg);
+			region_free(last_reg);
 		}
 	}
 }
@@ -317,6 +545,8 @@ void block_allocator_init()
 {
 	unsigned int i;
 
+	hole_index_free();
+
 	aux_info.bgs = calloc(sizeof(struct block_group_info), aux_info.groups);
 	if (aux_info.bgs == NULL)
 		critical_error_errno("calloc");
@@ -334,6 +564,7 @@ void block_allocator_free()
 		free(aux_info.bgs[i].inode_table);
 	}
 	free(aux_info.bgs);
+	hole_index_free();
 }
 
 /* Allocate a single block and return its block number */
@@ -351,50 +582,39 @@ u32 allocate_block()
 
 static struct region *ext4_allocate_best_fit_partial(u32 len)
 {
-	unsigned int i, j;
-	unsigned int found_bg = 0, found_prev_chunk = 0, found_block = 0;
-	u32 found_allocate_len = 0;
-	bool minimize = false;
 	struct block_group_info *bgs = aux_info.bgs;
+	struct hole_node *node;
 	struct region *reg;
+	u32 found_bg, found_prev_chunk, found_block, found_allocate_len;
+	int n;
 
-	for (i = 0; i < aux_info.groups; i++) {
-		for (j = 1; j < bgs[i].chunk_count; j++) {
-			u32 hole_start, hole_size;
-			hole_start = bgs[i].chunks[j-1].block + bgs[i].chunks[j-1].len;
-			hole_size =  bgs[i].chunks[j].block - hole_start;
-			if (hole_size == len) {
-				// Perfect fit i.e. right between 2 chunks no need to keep searching
-				found_bg = i;
-				found_prev_chunk = j - 1;
-				found_block = hole_start;
-				found_allocate_len = hole_size;
-				goto done;
-			} else if (hole_size > len && (found_allocate_len == 0 || (found_allocate_len > hole_size))) {
-				found_bg = i;
-				found_prev_chunk = j - 1;
-				found_block = hole_start;
-				found_allocate_len = hole_size;
-				minimize = true;
-			} else if (!minimize) {
-				if (found_allocate_len < hole_size) {
-					found_bg = i;
-					found_prev_chunk = j - 1;
-					found_block = hole_start;
-					found_allocate_len = hole_size;
-				}
-			}
-		}
-	}
+	if (!hole_index.valid)
+		hole_index_build();
+
+	n = hole_lower_bound(len);
+	if (n < 0)
+		n = hole_largest();
 
-	if (found_allocate_len == 0) {
+	if (n < 0) {
 		error("failed to allocate %u blocks, out of space?", len);
 		return NULL;
 	}
+
+	node = &hole_index.nodes[n];
+	found_bg = node->bg;
+	found_prev_chunk = node->chunk;
+	found_block = bgs[found_bg].chunks[found_prev_chunk].block +
+			bgs[found_bg].chunks[found_prev_chunk].len;
+	found_allocate_len = node->size;
 	if (found_allocate_len > len) found_allocate_len = len;
-done:
+
 	// reclaim allocated space in chunk
+	hole_remove(n);
 	bgs[found_bg].chunks[found_prev_chunk].len += found_allocate_len;
+	node->size -= found_allocate_len;
+	if (node->size > 0)
+		hole_insert(n);
+
 	if (reserve_blocks(&bgs[found_bg],
 				found_bg,
 				found_block,
@@ -403,7 +623,7 @@ done:
 		return NULL;
 	}
 	bgs[found_bg].data_blocks_used += found_allocate_len;
-	reg = malloc(sizeof(struct region));
+	reg = region_alloc();
 	reg->block = found_block + bgs[found_bg].first_block;
 	reg->len = found_allocate_len;
 	reg->next = NULL;
@@ -533,6 +753,15 @@ u32 get_free_blocks(u32 bg)
 	return aux_info.bgs[bg].free_blocks;
 }
 
+/* Returns 1 if a block is used by the filesystem, 0 if it is free */
+int block_is_allocated(u32 block)
+{
+	u32 bg = (block - aux_info.first_data_block) / info.blocks_per_group;
+	u32 bit = (block - aux_info.first_data_block) % info.blocks_per_group;
+
+	return (aux_info.bgs[bg].block_bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
 int last_region(struct block_allocation *alloc)
 {
 	return (alloc->list.iter == NULL);
@@ -559,7 +788,7 @@ static struct region *do_split_allocation(struct block_allocation *alloc, u32 le
 		return NULL;
 
 	if (len > 0) {
-		new = malloc(sizeof(struct region));
+		new = region_alloc();
 
 		new->bg = reg->bg;
 		new->block = reg->block + len;
@@ -670,6 +899,23 @@ struct ext4_inode *get_inode(u32 inode)
 		info.inode_size);
 }
 
+/* Returns the number of an inode returned by get_inode, or 0 */
+u32 get_inode_num(struct ext4_inode *inode)
+{
+	u32 bg;
+	u8 *table;
+
+	for (bg = 0; bg < aux_info.groups; bg++) {
+		table = aux_info.bgs[bg].inode_table;
+		if (table && (u8 *)inode >= table &&
+				(u8 *)inode < table + info.inodes_per_group * info.inode_size)
+			return bg * info.inodes_per_group +
+				((u8 *)inode - table) / info.inode_size + 1;
+	}
+
+	return 0;
+}
+
 struct ext4_xattr_header *get_xattr_block_for_inode(struct ext4_inode *inode)
 {
 	struct ext4_xattr_header *block = xattr_list_find(inode);
@@ -770,14 +1016,14 @@ void free_alloc(struct block_allocation *alloc)
 	reg = alloc->list.first;
 	while (reg) {
 		struct region *next = reg->next;
-		free(reg);
+		region_free(reg);
 		reg = next;
 	}
 
 	reg = alloc->oob_list.first;
 	while (reg) {
 		struct region *next = reg->next;
-		free(reg);
+		region_free(reg);
 		reg = next;
 	}
 
@@ -787,6 +1033,7 @@ void free_alloc(struct block_allocation *alloc)
 void reserve_bg_chunk(int bg, u32 start_block, u32 size) {
 	struct block_group_info *bgs = aux_info.bgs;
 	int chunk_count;
+	hole_index.valid = false;
 	if (bgs[bg].chunk_count == bgs[bg].max_chunk_count) {
 		bgs[bg].max_chunk_count *= 2;
 		bgs[bg].chunks = realloc(bgs[bg].chunks, bgs[bg].max_chunk_count * sizeof(struct region));
@@ -69,6 +69,7 @@ struct block_allocation *allocate_blocks(u32 len);
 int block_allocation_num_regions(struct block_allocation *alloc);
 int block_allocation_len(struct block_allocation *alloc);
 struct ext4_inode *get_inode(u32 inode);
+u32 get_inode_num(struct ext4_inode *inode);
 struct ext4_xattr_header *get_xattr_block_for_inode(struct ext4_inode *inode);
 void reduce_allocation(struct block_allocation *alloc, u32 len);
 u32 get_block(struct block_allocation *alloc, u32 block);
@@ -76,6 +77,7 @@ u32 get_oob_block(struct block_allocation *alloc, u32 block);
 void get_next_region(struct block_allocation *alloc);
 void get_region(struct block_allocation *alloc, u32 *block, u32 *len);
 u32 get_free_blocks(u32 bg);
+int block_is_allocated(u32 block);
 u32 get_free_inodes(u32 bg);
 u32 reserve_inodes(int bg, u32 inodes);
 void add_directory(u32 inode);
@@ -15,6 +15,8 @@
  */
 
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -26,6 +28,7 @@
 
 #define XATTR_SELINUX_SUFFIX "selinux"
 #define XATTR_CAPS_SUFFIX "capability"
+#define XATTR_DATA_SUFFIX "data"
 
 #include "ext4_utils.h"
 #include "make_ext4fs.h"
@@ -33,6 +36,8 @@
 #include "contents.h"
 #include "extent.h"
 #include "indirect.h"
+#include "metadata_csum.h"
+#include "sha1.h"
 
 #ifdef USE_MINGW
 #define S_IFLNK 0  /* used by make_link, not needed under mingw */
@@ -47,12 +52,13 @@ struct block_allocation* get_saved_allocation_chain() {
 static u32 dentry_size(u32 entries, struct dentry *dentries)
 {
 	u32 len = 24;
+	u32 space = dir_block_space();
 	unsigned int i;
 	unsigned int dentry_len;
 
 	for (i = 0; i < entries; i++) {
 		dentry_len = 8 + EXT4_ALIGN(strlen(dentries[i].filename), 4);
-		if (len % info.block_size + dentry_len > info.block_size)
+		if (len % info.block_size + dentry_len > space)
 			len += info.block_size - (len % info.block_size);
 		len += dentry_len;
 	}
@@ -68,15 +74,15 @@ static struct ext4_dir_entry_2 *add_dentry(u8 *data, u32 *offset,
 	u16 rec_len = 8 + EXT4_ALIGN(name_len, 4);
 	struct ext4_dir_entry_2 *dentry;
 
-	u32 start_block = *offset / info.block_size;
-	u32 end_block = (*offset + rec_len - 1) / info.block_size;
-	if (start_block != end_block) {
-		/* Adding this dentry will cross a block boundary, so pad the previous
-		   dentry to the block boundary */
+	u32 space = dir_block_space();
+	if (*offset % info.block_size + rec_len > space) {
+		/* Adding this dentry will cross a block boundary (or run into the
+		   checksum tail), so pad the previous dentry to the end of the
+		   space for entries and start a new block */
 		if (!prev)
 			critical_error("no prev");
-		prev->rec_len += end_block * info.block_size - *offset;
-		*offset = end_block * info.block_size;
+		prev->rec_len += space - *offset % info.block_size;
+		*offset = EXT4_ALIGN(*offset, info.block_size);
 	}
 
 	dentry = (struct ext4_dir_entry_2 *)(data + *offset);
@@ -169,11 +175,39 @@ u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	}
 
 	/* pad the last dentry out to the end of the block */
-	dentry->rec_len += len - offset;
+	dentry->rec_len += len - (info.block_size - dir_block_space()) - offset;
+
+	if (has_metadata_csum()) {
+		for (i = 0; i < blocks; i++)
+			ext4_init_dir_block_tail(data + i * info.block_size);
+		csum_add_dir_blocks(inode_num, data, blocks);
+	}
 
 	return inode_num;
 }
 
+static int read_all(int fd, u8 *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Files that fit in i_block are stored there with the inline_data feature,
+   instead of taking a whole data block */
+static bool file_fits_inline(u64 len)
+{
+	return (info.feat_incompat & EXT4_FEATURE_INCOMPAT_INLINE_DATA) &&
+		len > 0 && len <= sizeof(((struct ext4_inode *)0)->i_block);
+}
+
 /* Creates a file on disk.  Returns the inode number of the new file */
 u32 make_file(const char *filename, u64 len)
 {
@@ -192,10 +226,17 @@ u32 make_file(const char *filename, u64 len)
 		return EXT4_ALLOCATE_FAILED;
 	}
 
-	if (len > 0) {
+	if (file_fits_inline(len)) {
+		if (inode_set_inline_data(inode_num, filename, len) < 0) {
+			error("failed to store %s inline", filename);
+			return EXT4_ALLOCATE_FAILED;
+		}
+	} else if (len > 0) {
 		struct block_allocation* alloc = inode_allocate_file_extents(inode, len, filename);
 		if (alloc) {
-			alloc->filename = strdup(filename);
+			/* a preallocation from the base fs already has the name */
+			if (alloc->filename == NULL)
+				alloc->filename = strdup(filename);
 			alloc->next = saved_allocation_head;
 			saved_allocation_head = alloc;
 		}
@@ -208,6 +249,146 @@ u32 make_file(const char *filename, u64 len)
 	return inode_num;
 }
 
+/* A file created by make_shared_file, whose data blocks can be used by later
+   files with the same contents */
+struct shared_file {
+	u8 digest[SHA1_DIGEST_LENGTH];
+	u64 len;
+	u32 inode_num;
+	char *filename;
+	struct shared_file *next;
+};
+
+#define SHARED_FILE_BUCKETS 4096
+
+static struct shared_file *shared_files[SHARED_FILE_BUCKETS];
+
+static struct shared_file **shared_file_bucket(const u8 *digest)
+{
+	return &shared_files[(digest[0] | digest[1] << 8) % SHARED_FILE_BUCKETS];
+}
+
+/* Compares the contents of two files of len bytes, so that a digest
+   collision can't make a file share the blocks of a different one */
+static bool files_equal(const char *filename1, const char *filename2, u64 len)
+{
+	static u8 buf1[65536], buf2[65536];
+	bool equal = false;
+	int fd1, fd2;
+
+	fd1 = open(filename1, O_RDONLY);
+	fd2 = open(filename2, O_RDONLY);
+	if (fd1 < 0 || fd2 < 0)
+		goto out;
+
+	while (len > 0) {
+		size_t chunk = len < sizeof(buf1) ? len : sizeof(buf1);
+
+		if (read_all(fd1, buf1, chunk) < 0 || read_all(fd2, buf2, chunk) < 0 ||
+				memcmp(buf1, buf2, chunk) != 0)
+			goto out;
+		len -= chunk;
+	}
+	equal = true;
+
+out:
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+	return equal;
+}
+
+/* Creates a file on disk like make_file, but if an earlier file created by
+   this function has the same size and digest of its contents, and the
+   contents are really the same, the new inode points to the data blocks of
+   that file instead of copying them.  The image must have the
+   shared_blocks feature, which makes it read-only.  Returns the inode number
+   of the new file */
+u32 make_shared_file(const char *filename, u64 len, const u8 *digest)
+{
+	struct shared_file **bucket = shared_file_bucket(digest);
+	struct shared_file *shared;
+	struct ext4_inode *inode;
+	struct ext4_inode *src;
+	u32 inode_num;
+
+	/* an inline file has no blocks to share, and needs its own
+	   system.data attribute */
+	if (file_fits_inline(len))
+		return make_file(filename, len);
+
+	for (shared = *bucket; shared; shared = shared->next) {
+		if (shared->len == len &&
+				memcmp(shared->digest, digest, SHA1_DIGEST_LENGTH) == 0 &&
+				files_equal(shared->filename, filename, len))
+			break;
+	}
+
+	if (shared == NULL) {
+		inode_num = make_file(filename, len);
+		if (inode_num == EXT4_ALLOCATE_FAILED)
+			return inode_num;
+
+		shared = malloc(sizeof(struct shared_file));
+		if (shared == NULL)
+			critical_error_errno("malloc");
+		memcpy(shared->digest, digest, SHA1_DIGEST_LENGTH);
+		shared->len = len;
+		shared->inode_num = inode_num;
+		shared->filename = strdup(filename);
+		if (shared->filename == NULL)
+			critical_error_errno("strdup");
+		shared->next = *bucket;
+		*bucket = shared;
+
+		return inode_num;
+	}
+
+	inode_num = allocate_inode(info);
+	if (inode_num == EXT4_ALLOCATE_FAILED) {
+		error("failed to allocate inode\n");
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	inode = get_inode(inode_num);
+	src = get_inode(shared->inode_num);
+	if (inode == NULL || src == NULL) {
+		error("failed to get inode %u", inode == NULL ? inode_num : shared->inode_num);
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	/* The blocks stay in the saved allocation chain of the first file only,
+	   so that each block is listed once in the block list and base fs
+	   outputs */
+	memcpy(inode->i_block, src->i_block, sizeof(inode->i_block));
+	inode->i_size_lo = src->i_size_lo;
+	inode->i_size_high = src->i_size_high;
+	inode->i_blocks_lo = src->i_blocks_lo;
+	inode->i_blocks_high = src->i_blocks_high;
+	inode->i_flags = src->i_flags;
+
+	inode->i_mode = S_IFREG;
+	inode->i_links_count = 1;
+
+	return inode_num;
+}
+
+/* Releases the files remembered by make_shared_file */
+void free_shared_files()
+{
+	int i;
+
+	for (i = 0; i < SHARED_FILE_BUCKETS; i++) {
+		while (shared_files[i]) {
+			struct shared_file *next = shared_files[i]->next;
+			free(shared_files[i]->filename);
+			free(shared_files[i]);
+			shared_files[i] = next;
+		}
+	}
+}
+
 /* Creates a file on disk.  Returns the inode number of the new file */
 u32 make_link(const char *link)
 {
@@ -335,6 +516,21 @@ static void xattr_assert_sane(struct ext4_xattr_entry *entry)
 	}
 }
 
+/*
+ * Compares an xattr entry with the name of another one, in the order
+ * described above xattr_assert_sane()
+ */
+static int xattr_compare(struct ext4_xattr_entry *entry, int name_index,
+		const char *name, size_t name_len)
+{
+	int cmp = entry->e_name_index - name_index;
+	if (cmp == 0)
+		cmp = entry->e_name_len - (int) name_len;
+	if (cmp == 0)
+		cmp = memcmp(entry->e_name, name, name_len);
+	return cmp;
+}
+
 #define NAME_HASH_SHIFT 5
 #define VALUE_HASH_SHIFT 16
 
@@ -386,7 +582,16 @@ static struct ext4_xattr_entry* xattr_addto_range(
 	if (needed_size > available_size)
 		return NULL;
 
-	struct ext4_xattr_entry *new_entry = xattr_get_last(first);
+	struct ext4_xattr_entry *last = xattr_get_last(first);
+	char *val = (char *) last + available_size - EXT4_XATTR_SIZE(value_len);
+
+	/* insert the entry in sorted order, so the attributes can be added in
+	   any order; the values are found through their offsets, and stay */
+	struct ext4_xattr_entry *new_entry = first;
+	while (new_entry != last && xattr_compare(new_entry, name_index, name, name_len) < 0)
+		new_entry = EXT4_XATTR_NEXT(new_entry);
+	memmove((char *) new_entry + EXT4_XATTR_LEN(name_len), new_entry,
+		(char *) last - (char *) new_entry);
 	memset(new_entry, 0, EXT4_XATTR_LEN(name_len));
 
 	new_entry->e_name_len = name_len;
@@ -395,12 +600,14 @@ static struct ext4_xattr_entry* xattr_addto_range(
 	new_entry->e_value_block = 0;
 	new_entry->e_value_size = cpu_to_le32(value_len);
 
-	char *val = (char *) new_entry + available_size - EXT4_XATTR_SIZE(value_len);
-	size_t e_value_offs = val - (char *) block_start;
+	/* like the kernel, empty values have no space or offset */
+	if (value_len > 0) {
+		size_t e_value_offs = val - (char *) block_start;
 
-	new_entry->e_value_offs = cpu_to_le16(e_value_offs);
-	memset(val, 0, EXT4_XATTR_SIZE(value_len));
-	memcpy(val, value, value_len);
+		new_entry->e_value_offs = cpu_to_le16(e_value_offs);
+		memset(val, 0, EXT4_XATTR_SIZE(value_len));
+		memcpy(val, value, value_len);
+	}
 
 	xattr_assert_sane(first);
 	return new_entry;
@@ -489,3 +696,36 @@ int inode_set_capabilities(u32 inode_num, uint64_t capabilities) {
 	return xattr_add(inode_num, EXT4_XATTR_INDEX_SECURITY,
 		XATTR_CAPS_SUFFIX, &cap_data, sizeof(cap_data));
 }
+
+/* Stores the len bytes of a file in i_block of an inode, with the inline_data
+   feature.  The kernel also requires an in-inode system.data attribute for
+   any part that doesn't fit, which is empty here */
+int inode_set_inline_data(u32 inode_num, const char *filename, u64 len)
+{
+	struct ext4_inode *inode = get_inode(inode_num);
+	int fd;
+	int ret;
+
+	if (!inode || len > sizeof(inode->i_block))
+		return -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		error_errno("open %s", filename);
+		return -1;
+	}
+	ret = read_all(fd, (u8 *)inode->i_block, len);
+	close(fd);
+	if (ret < 0) {
+		error("failed to read %s", filename);
+		return -1;
+	}
+
+	if (xattr_addto_inode(inode, EXT4_XATTR_INDEX_SYSTEM, XATTR_DATA_SUFFIX, "", 0) < 0)
+		return -1;
+
+	inode->i_flags |= EXT4_INLINE_DATA_FL;
+	inode->i_size_lo = len;
+
+	return 0;
+}
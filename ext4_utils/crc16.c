@@ -46,12 +46,44 @@ static u16 crc16_tab[] = {
 		0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
 };
 
+/* crc16_tab8[k][i] is the crc of byte i followed by k zero bytes, for
+   slicing-by-8 */
+static u16 crc16_tab8[8][256];
+static int crc16_tab8_ready;
+
+static void crc16_init_tab8(void)
+{
+        int i, j;
+
+        for (i = 0; i < 256; i++) {
+                crc16_tab8[0][i] = crc16_tab[i];
+                for (j = 1; j < 8; j++)
+                        crc16_tab8[j][i] = (crc16_tab8[j - 1][i] >> 8) ^
+                                crc16_tab[crc16_tab8[j - 1][i] & 0xFF];
+        }
+
+        crc16_tab8_ready = 1;
+}
+
 u16 ext4_crc16(u16 crc_in, const void *buf, int size)
 {
         const u8 *p = buf;
         u16 crc = crc_in;
 
-        while (size--)
+        if (!crc16_tab8_ready)
+                crc16_init_tab8();
+
+        while (size >= 8) {
+                crc = crc16_tab8[7][(crc ^ p[0]) & 0xFF] ^
+                        crc16_tab8[6][((crc >> 8) ^ p[1]) & 0xFF] ^
+                        crc16_tab8[5][p[2]] ^ crc16_tab8[4][p[3]] ^
+                        crc16_tab8[3][p[4]] ^ crc16_tab8[2][p[5]] ^
+                        crc16_tab8[1][p[6]] ^ crc16_tab8[0][p[7]];
+                p += 8;
+                size -= 8;
+        }
+
+        while (size-- > 0)
                 crc = crc16_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
         return crc;
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* CRC32c (Castagnoli) for the metadata_csum feature.  Like the kernel's
+ * crc32c_le, there is no final inversion, so a checksum can be computed in
+ * pieces by passing the previous result as crc. */
+
+#include "ext4_utils.h"
+
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 __attribute__((target("sse4.2")))
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARMV8
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+typedef u32 (*crc32c_func_t)(u32 crc, const u8 *p, int size);
+
+static crc32c_func_t crc32c_func;
+
+/* crc32c_tab[k][i] is the crc of byte i followed by k zero bytes */
+static u32 crc32c_tab[8][256];
+
+static void crc32c_init_tab(void)
+{
+	u32 i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc32c_tab[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_tab[j][i] = (crc32c_tab[j - 1][i] >> 8) ^
+				crc32c_tab[0][crc32c_tab[j - 1][i] & 0xFF];
+}
+
+/* Slicing-by-8: eight independent table lookups per 8 bytes instead of a
+   chain of eight dependent ones */
+static u32 crc32c_sb8(u32 crc, const u8 *p, int size)
+{
+	u32 lo, hi;
+
+	while (size >= 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo = le32_to_cpu(lo) ^ crc;
+		hi = le32_to_cpu(hi);
+		crc = crc32c_tab[7][lo & 0xFF] ^
+			crc32c_tab[6][(lo >> 8) & 0xFF] ^
+			crc32c_tab[5][(lo >> 16) & 0xFF] ^
+			crc32c_tab[4][lo >> 24] ^
+			crc32c_tab[3][hi & 0xFF] ^
+			crc32c_tab[2][(hi >> 8) & 0xFF] ^
+			crc32c_tab[1][(hi >> 16) & 0xFF] ^
+			crc32c_tab[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+
+	while (size-- > 0)
+		crc = crc32c_tab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(CRC32C_SSE42)
+static CRC32C_SSE42 u32 crc32c_sse42(u32 crc, const u8 *p, int size)
+{
+#if defined(__x86_64__)
+	unsigned long long crc64 = crc;
+	unsigned long long v64;
+
+	while (size >= 8) {
+		memcpy(&v64, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v64);
+		p += 8;
+		size -= 8;
+	}
+	crc = (u32)crc64;
+#endif
+
+	u32 v;
+
+	while (size >= 4) {
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+		p += 4;
+		size -= 4;
+	}
+
+	while (size-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#elif defined(CRC32C_ARMV8)
+static u32 crc32c_armv8(u32 crc, const u8 *p, int size)
+{
+	uint64_t v;
+
+	while (size >= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		size -= 8;
+	}
+
+	while (size-- > 0)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/* Picks the crc32 instructions if the cpu has them, otherwise the tables */
+static crc32c_func_t crc32c_select(void)
+{
+#if defined(CRC32C_SSE42)
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42;
+#elif defined(CRC32C_ARMV8)
+	return crc32c_armv8;
+#endif
+
+	crc32c_init_tab();
+	return crc32c_sb8;
+}
+
+u32 ext4_crc32c(u32 crc, const void *buf, int size)
+{
+	if (!crc32c_func)
+		crc32c_func = crc32c_select();
+
+	return crc32c_func(crc, buf, size);
+}
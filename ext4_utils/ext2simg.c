@@ -53,64 +53,115 @@ static void usage(char *path)
 	fprintf(stderr, "  -S don't use sparse output format\n");
 }
 
+/* Largest read of consecutive block bitmaps, in blocks */
+#define MAX_BITMAP_READ_BLOCKS 256
+
+/*
+ * Reads the block bitmaps of all groups into bitmaps, the bitmap of group i
+ * at i * block_size.  The bitmaps of consecutive groups are usually
+ * consecutive on disk, all the more with flex_bg, so they are read in runs
+ * rather than one block at a time.
+ */
+static void read_block_bitmaps(int fd, u8 *bitmaps)
+{
+	unsigned int i, n;
+	off64_t ret;
+
+	for (i = 0; i < aux_info.groups; i += n) {
+		u64 first = aux_info.bg_desc[i].bg_block_bitmap;
+		size_t len, done;
+
+		for (n = 1; i + n < aux_info.groups && n < MAX_BITMAP_READ_BLOCKS; n++)
+			if (aux_info.bg_desc[i + n].bg_block_bitmap != first + n)
+				break;
+
+		ret = lseek64(fd, (u64)info.block_size * first, SEEK_SET);
+		if (ret < 0)
+			critical_error_errno("failed to seek to block group bitmap %d", i);
+
+		len = (size_t)info.block_size * n;
+		for (done = 0; done < len; done += ret) {
+			ret = read(fd, bitmaps + (size_t)info.block_size * i + done,
+					len - done);
+			if (ret < 0)
+				critical_error_errno("failed to read block group bitmap %d", i);
+			if (ret == 0)
+				critical_error("failed to read all of block group bitmap %d", i);
+		}
+	}
+}
+
+/* Loads 64 bits of a bitmap, bit 0 being the lowest bit of the first byte */
+static u64 bitmap_word(const u8 *bitmap, u32 word)
+{
+	const u8 *p = bitmap + word * 8;
+	u64 val = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+/*
+ * Returns the first bit at or after bit and before end that is set (or
+ * clear if !set), or end if there is none, looking at 64 bits at a time.
+ * The bitmap is a block long, so it holds a whole number of words.
+ */
+static u32 bitmap_find_next(const u8 *bitmap, u32 bit, u32 end, int set)
+{
+	while (bit < end) {
+		u64 word = bitmap_word(bitmap, bit / 64);
+
+		if (!set)
+			word = ~word;
+		word >>= bit % 64;
+		if (word) {
+			bit += __builtin_ctzll(word);
+			return bit < end ? bit : end;
+		}
+		bit = (bit / 64 + 1) * 64;
+	}
+	return end;
+}
+
 static int build_sparse_ext(int fd, const char *filename)
 {
 	unsigned int i;
-	unsigned int block;
-	int start_contiguous_block;
-	u8 *block_bitmap;
-	off64_t ret;
+	u32 block, start_block, end_block;
+	u8 *bitmaps;
 
-	block_bitmap = malloc(info.block_size);
-	if (!block_bitmap)
-		critical_error("failed to allocate block bitmap");
+	bitmaps = malloc((size_t)info.block_size * aux_info.groups);
+	if (!bitmaps)
+		critical_error("failed to allocate block bitmaps");
 
 	if (aux_info.first_data_block > 0)
 		sparse_file_add_file(ext4_sparse_file, filename, 0,
 				info.block_size * aux_info.first_data_block, 0);
 
+	read_block_bitmaps(fd, bitmaps);
+
 	for (i = 0; i < aux_info.groups; i++) {
 		u32 first_block = aux_info.first_data_block + i * info.blocks_per_group;
 		u32 last_block = min(info.blocks_per_group, aux_info.len_blocks - first_block);
+		const u8 *block_bitmap = bitmaps + (size_t)info.block_size * i;
 
-		ret = lseek64(fd, (u64)info.block_size * aux_info.bg_desc[i].bg_block_bitmap,
-				SEEK_SET);
-		if (ret < 0)
-			critical_error_errno("failed to seek to block group bitmap %d", i);
-
-		ret = read(fd, block_bitmap, info.block_size);
-		if (ret < 0)
-			critical_error_errno("failed to read block group bitmap %d", i);
-		if (ret != (int)info.block_size)
-			critical_error("failed to read all of block group bitmap %d", i);
-
-		start_contiguous_block = -1;
-		for (block = 0; block < last_block; block++) {
-			if (start_contiguous_block >= 0) {
-				if (!bitmap_get_bit(block_bitmap, block)) {
-					u32 start_block = first_block + start_contiguous_block;
-					u32 len_blocks = block - start_contiguous_block;
-
-					sparse_file_add_file(ext4_sparse_file, filename,
-							(u64)info.block_size * start_block,
-							info.block_size * len_blocks, start_block);
-					start_contiguous_block = -1;
-				}
-			} else {
-				if (bitmap_get_bit(block_bitmap, block))
-					start_contiguous_block = block;
-			}
-		}
+		/* add each run of used blocks */
+		for (block = 0; block < last_block; block = end_block) {
+			start_block = bitmap_find_next(block_bitmap, block, last_block, 1);
+			if (start_block == last_block)
+				break;
+			end_block = bitmap_find_next(block_bitmap, start_block, last_block, 0);
 
-		if (start_contiguous_block >= 0) {
-			u32 start_block = first_block + start_contiguous_block;
-			u32 len_blocks = last_block - start_contiguous_block;
 			sparse_file_add_file(ext4_sparse_file, filename,
-					(u64)info.block_size * start_block,
-					info.block_size * len_blocks, start_block);
+					(u64)info.block_size * (first_block + start_block),
+					info.block_size * (end_block - start_block),
+					first_block + start_block);
 		}
 	}
 
+	free(bitmaps);
+
 	return 0;
 }
 
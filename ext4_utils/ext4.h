@@ -164,6 +164,7 @@ struct ext4_group_desc
 #define EXT4_EXTENTS_FL 0x00080000  
 #define EXT4_EA_INODE_FL 0x00200000  
 #define EXT4_EOFBLOCKS_FL 0x00400000  
+#define EXT4_INLINE_DATA_FL 0x10000000
 #define EXT4_RESERVED_FL 0x80000000  
 
 #define EXT4_FL_USER_VISIBLE 0x004BDFFF  
@@ -264,7 +265,8 @@ struct ext4_inode {
  __le16 l_i_file_acl_high;
  __le16 l_i_uid_high;
  __le16 l_i_gid_high;
- __u32 l_i_reserved2;
+ __le16 l_i_checksum_lo;
+ __le16 l_i_reserved;
  } linux2;
  struct {
  __le16 h_i_reserved1;
@@ -280,7 +282,7 @@ struct ext4_inode {
  } masix2;
  } osd2;
  __le16 i_extra_isize;
- __le16 i_pad1;
+ __le16 i_checksum_hi;
  __le32 i_ctime_extra;
  __le32 i_mtime_extra;
  __le32 i_atime_extra;
@@ -316,7 +318,7 @@ struct move_extent {
 #define i_gid_low i_gid
 #define i_uid_high osd2.linux2.l_i_uid_high
 #define i_gid_high osd2.linux2.l_i_gid_high
-#define i_reserved2 osd2.linux2.l_i_reserved2
+#define i_checksum_lo osd2.linux2.l_i_checksum_lo
 
 #define EXT4_VALID_FS 0x0001  
 #define EXT4_ERROR_FS 0x0002  
@@ -444,12 +446,15 @@ struct ext4_super_block {
  __le64 s_mmp_block;
  __le32 s_raid_stripe_width;
  __u8 s_log_groups_per_flex;
- __u8 s_reserved_char_pad2;
+ __u8 s_checksum_type;
  __le16 s_reserved_pad;
  __le64 s_kbytes_written;
- __u32 s_reserved[160];
+ __u32 s_reserved[159];
+ __le32 s_checksum;
 };
 
+#define EXT4_CRC32C_CHKSUM 1
+
 #define EXT4_SB(sb) (sb)
 
 #define NEXT_ORPHAN(inode) EXT4_I(inode)->i_dtime
@@ -492,6 +497,8 @@ struct ext4_super_block {
 #define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
 #define EXT4_FEATURE_RO_COMPAT_DIR_NLINK 0x0020
 #define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE 0x0040
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT4_FEATURE_RO_COMPAT_SHARED_BLOCKS 0x4000
 
 #define EXT4_FEATURE_INCOMPAT_COMPRESSION 0x0001
 #define EXT4_FEATURE_INCOMPAT_FILETYPE 0x0002
@@ -504,6 +511,7 @@ struct ext4_super_block {
 #define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
 #define EXT4_FEATURE_INCOMPAT_EA_INODE 0x0400  
 #define EXT4_FEATURE_INCOMPAT_DIRDATA 0x1000  
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA 0x8000
 
 #define EXT4_FEATURE_COMPAT_SUPP EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT4_FEATURE_INCOMPAT_SUPP (EXT4_FEATURE_INCOMPAT_FILETYPE|   EXT4_FEATURE_INCOMPAT_RECOVER|   EXT4_FEATURE_INCOMPAT_META_BG|   EXT4_FEATURE_INCOMPAT_EXTENTS|   EXT4_FEATURE_INCOMPAT_64BIT|   EXT4_FEATURE_INCOMPAT_FLEX_BG)
@@ -546,6 +554,14 @@ struct ext4_dir_entry_2 {
  char name[EXT4_NAME_LEN];
 };
 
+struct ext4_dir_entry_tail {
+ __le32 det_reserved_zero1;
+ __le16 det_rec_len;
+ __u8 det_reserved_zero2;
+ __u8 det_reserved_ft;
+ __le32 det_checksum;
+};
+
 #define EXT4_FT_UNKNOWN 0
 #define EXT4_FT_REG_FILE 1
 #define EXT4_FT_DIR 2
@@ -557,6 +573,8 @@ struct ext4_dir_entry_2 {
 
 #define EXT4_FT_MAX 8
 
+#define EXT4_FT_DIR_CSUM 0xDE
+
 #define EXT4_DIR_PAD 4
 #define EXT4_DIR_ROUND (EXT4_DIR_PAD - 1)
 #define EXT4_DIR_REC_LEN(name_len) (((name_len) + 8 + EXT4_DIR_ROUND) &   ~EXT4_DIR_ROUND)
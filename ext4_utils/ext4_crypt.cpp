@@ -27,6 +27,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <cutils/properties.h>
@@ -57,6 +63,8 @@ struct ext4_encryption_policy {
 
 #define HEX_LOOKUP "0123456789abcdef"
 
+static const size_t MAX_POLICY_THREADS = 8;
+
 bool e4crypt_is_native() {
     char value[PROPERTY_VALUE_MAX];
     property_get("ro.crypto.type", value, "none");
@@ -71,12 +79,19 @@ static void policy_to_hex(const char* policy, char* hex) {
     hex[EXT4_KEY_DESCRIPTOR_SIZE_HEX - 1] = '\0';
 }
 
-static bool is_dir_empty(const char *dirname, bool *is_empty)
+// Reads the directory through a duplicate of fd, leaving fd open.
+static bool is_dir_empty(int fd, const char *dirname, bool *is_empty)
 {
     int n = 0;
-    auto dirp = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(dirname), closedir);
+    int dir_fd = dup(fd);
+    if (dir_fd == -1) {
+        PLOG(ERROR) << "Unable to read directory: " << dirname;
+        return false;
+    }
+    auto dirp = std::unique_ptr<DIR, int (*)(DIR*)>(fdopendir(dir_fd), closedir);
     if (!dirp) {
         PLOG(ERROR) << "Unable to read directory: " << dirname;
+        close(dir_fd);
         return false;
     }
     for (;;) {
@@ -101,18 +116,8 @@ static bool is_dir_empty(const char *dirname, bool *is_empty)
     return true;
 }
 
-static bool e4crypt_policy_set(const char *directory, const char *policy,
-                               size_t policy_length, int contents_encryption_mode) {
-    if (policy_length != EXT4_KEY_DESCRIPTOR_SIZE) {
-        LOG(ERROR) << "Policy wrong length: " << policy_length;
-        return false;
-    }
-    int fd = open(directory, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
-    if (fd == -1) {
-        PLOG(ERROR) << "Failed to open directory " << directory;
-        return false;
-    }
-
+static bool e4crypt_policy_set(int fd, const char *directory, const char *policy,
+                               int contents_encryption_mode) {
     ext4_encryption_policy eep;
     eep.version = 0;
     eep.contents_encryption_mode = contents_encryption_mode;
@@ -121,10 +126,8 @@ static bool e4crypt_policy_set(const char *directory, const char *policy,
     memcpy(eep.master_key_descriptor, policy, EXT4_KEY_DESCRIPTOR_SIZE);
     if (ioctl(fd, EXT4_IOC_SET_ENCRYPTION_POLICY, &eep)) {
         PLOG(ERROR) << "Failed to set encryption policy for " << directory;
-        close(fd);
         return false;
     }
-    close(fd);
 
     char policy_hex[EXT4_KEY_DESCRIPTOR_SIZE_HEX];
     policy_to_hex(policy, policy_hex);
@@ -132,27 +135,14 @@ static bool e4crypt_policy_set(const char *directory, const char *policy,
     return true;
 }
 
-static bool e4crypt_policy_get(const char *directory, char *policy,
-                               size_t policy_length, int contents_encryption_mode) {
-    if (policy_length != EXT4_KEY_DESCRIPTOR_SIZE) {
-        LOG(ERROR) << "Policy wrong length: " << policy_length;
-        return false;
-    }
-
-    int fd = open(directory, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
-    if (fd == -1) {
-        PLOG(ERROR) << "Failed to open directory " << directory;
-        return false;
-    }
-
+static bool e4crypt_policy_get(int fd, const char *directory, char *policy,
+                               int contents_encryption_mode) {
     ext4_encryption_policy eep;
     memset(&eep, 0, sizeof(ext4_encryption_policy));
     if (ioctl(fd, EXT4_IOC_GET_ENCRYPTION_POLICY, &eep) != 0) {
         PLOG(ERROR) << "Failed to get encryption policy for " << directory;
-        close(fd);
-        return -1;
+        return false;
     }
-    close(fd);
 
     if ((eep.version != 0)
             || (eep.contents_encryption_mode != contents_encryption_mode)
@@ -166,14 +156,10 @@ static bool e4crypt_policy_get(const char *directory, char *policy,
     return true;
 }
 
-static bool e4crypt_policy_check(const char *directory, const char *policy,
-                                 size_t policy_length, int contents_encryption_mode) {
-    if (policy_length != EXT4_KEY_DESCRIPTOR_SIZE) {
-        LOG(ERROR) << "Policy wrong length: " << policy_length;
-        return false;
-    }
+static bool e4crypt_policy_check(int fd, const char *directory, const char *policy,
+                                 int contents_encryption_mode) {
     char existing_policy[EXT4_KEY_DESCRIPTOR_SIZE];
-    if (!e4crypt_policy_get(directory, existing_policy, EXT4_KEY_DESCRIPTOR_SIZE,
+    if (!e4crypt_policy_get(fd, directory, existing_policy,
                             contents_encryption_mode)) return false;
     char existing_policy_hex[EXT4_KEY_DESCRIPTOR_SIZE_HEX];
 
@@ -191,26 +177,83 @@ static bool e4crypt_policy_check(const char *directory, const char *policy,
     return true;
 }
 
-int e4crypt_policy_ensure(const char *directory, const char *policy,
-                          size_t policy_length, const char* contents_encryption_mode) {
-    int mode = 0;
+static bool parse_mode(const char* contents_encryption_mode, int* mode) {
     if (!strcmp(contents_encryption_mode, "software")) {
-        mode = EXT4_ENCRYPTION_MODE_AES_256_XTS;
+        *mode = EXT4_ENCRYPTION_MODE_AES_256_XTS;
     } else if (!strcmp(contents_encryption_mode, "ice")) {
-        mode = EXT4_ENCRYPTION_MODE_PRIVATE;
+        *mode = EXT4_ENCRYPTION_MODE_PRIVATE;
     } else {
         LOG(ERROR) << "Invalid encryption mode";
-        return -1;
+        return false;
+    }
+    return true;
+}
+
+// Sets the policy of an empty directory, or checks the one it has, with a
+// single open of the directory for the readdir and the ioctl.
+static bool e4crypt_policy_ensure_one(const char *directory, const char *policy, int mode) {
+    int fd = open(directory, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to open directory " << directory;
+        return false;
     }
 
     bool is_empty;
-    if (!is_dir_empty(directory, &is_empty)) return -1;
-    if (is_empty) {
-        if (!e4crypt_policy_set(directory, policy, policy_length,
-                                mode)) return -1;
-    } else {
-        if (!e4crypt_policy_check(directory, policy, policy_length,
-                                  mode)) return -1;
+    bool ok = is_dir_empty(fd, directory, &is_empty);
+    if (ok) {
+        if (is_empty) {
+            ok = e4crypt_policy_set(fd, directory, policy, mode);
+        } else {
+            ok = e4crypt_policy_check(fd, directory, policy, mode);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+int e4crypt_policy_ensure(const char *directory, const char *policy,
+                          size_t policy_length, const char* contents_encryption_mode) {
+    int mode = 0;
+    if (!parse_mode(contents_encryption_mode, &mode)) return -1;
+    if (policy_length != EXT4_KEY_DESCRIPTOR_SIZE) {
+        LOG(ERROR) << "Policy wrong length: " << policy_length;
+        return -1;
     }
+
+    if (!e4crypt_policy_ensure_one(directory, policy, mode)) return -1;
     return 0;
 }
+
+int e4crypt_policy_ensure_dirs(const char* const* directories, size_t count,
+                               const char *policy, size_t policy_length,
+                               const char* contents_encryption_mode) {
+    int mode = 0;
+    if (!parse_mode(contents_encryption_mode, &mode)) return -1;
+    if (policy_length != EXT4_KEY_DESCRIPTOR_SIZE) {
+        LOG(ERROR) << "Policy wrong length: " << policy_length;
+        return -1;
+    }
+
+    // Most of the time goes to waiting on the inode reads of the readdir
+    // and the ioctls, so a few threads overlap them well past the core count.
+    size_t num_threads = std::min(count, MAX_POLICY_THREADS);
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            if (!e4crypt_policy_ensure_one(directories[i], policy, mode)) {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return failed ? -1 : 0;
+}
@@ -26,6 +26,12 @@ int e4crypt_policy_ensure(const char *directory,
                           const char* policy, size_t policy_length,
                           const char* contents_encryption_mode);
 
+/* Does e4crypt_policy_ensure for each of the directories, several at a time.
+ * Returns -1 if any of them failed, after trying all of them. */
+int e4crypt_policy_ensure_dirs(const char* const* directories, size_t count,
+                               const char* policy, size_t policy_length,
+                               const char* contents_encryption_mode);
+
 static const char* e4crypt_unencrypted_folder = "/unencrypted";
 static const char* e4crypt_key_ref = "/unencrypted/ref";
 static const char* e4crypt_key_mode = "/unencrypted/mode";
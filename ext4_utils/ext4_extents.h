@@ -51,6 +51,10 @@ struct ext4_extent_header {
  __le32 eh_generation;
 };
 
+struct ext4_extent_tail {
+ __le32 et_checksum;
+};
+
 #define EXT4_EXT_MAGIC 0xf30a
 
 struct ext4_ext_path {
@@ -81,6 +85,7 @@ struct ext4_ext_path {
 #define EXT_LAST_EXTENT(__hdr__)   (EXT_FIRST_EXTENT((__hdr__)) + le16_to_cpu((__hdr__)->eh_entries) - 1)
 #define EXT_LAST_INDEX(__hdr__)   (EXT_FIRST_INDEX((__hdr__)) + le16_to_cpu((__hdr__)->eh_entries) - 1)
 #define EXT_MAX_EXTENT(__hdr__)   (EXT_FIRST_EXTENT((__hdr__)) + le16_to_cpu((__hdr__)->eh_max) - 1)
+#define EXT4_EXTENT_TAIL_OFFSET(hdr)   (sizeof(struct ext4_extent_header) +   (sizeof(struct ext4_extent) * le16_to_cpu((hdr)->eh_max)))
 #define EXT_MAX_INDEX(__hdr__)   (EXT_FIRST_INDEX((__hdr__)) + le16_to_cpu((__hdr__)->eh_max) - 1)
 
 #endif
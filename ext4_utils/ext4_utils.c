@@ -18,6 +18,7 @@
 #include "allocate.h"
 #include "indirect.h"
 #include "extent.h"
+#include "metadata_csum.h"
 #include "sha1.h"
 
 #include <sparse/sparse.h>
@@ -29,8 +30,10 @@
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef USE_MINGW
 #include <winsock2.h>
@@ -41,10 +44,24 @@
 
 #if defined(__linux__)
 #include <linux/fs.h>
+#include <sys/syscall.h>
 #elif defined(__APPLE__) && defined(__MACH__)
 #include <sys/disk.h>
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Regions of file data queued by queue_file_data are coalesced into one
+   chunk of the sparse image if they are at most FILE_DATA_SMALL bytes and
+   at most FILE_DATA_MAX_GAP free blocks apart, up to FILE_DATA_RUN bytes
+   per chunk and FILE_DATA_MAX_BUFFERED bytes in all */
+#define FILE_DATA_SMALL (64 * 1024)
+#define FILE_DATA_MAX_GAP 4
+#define FILE_DATA_RUN (1024 * 1024)
+#define FILE_DATA_MAX_BUFFERED (64 * 1024 * 1024)
+
 int force = 0;
 struct fs_info info;
 struct fs_aux_info aux_info;
@@ -53,6 +70,19 @@ struct block_allocation *base_fs_allocations = NULL;
 
 jmp_buf setjmp_env;
 
+/* A region of a file to be written to the image at block */
+struct file_data {
+	char *filename; /* shared by the consecutive regions of a file */
+	bool owns_filename;
+	int64_t offset;
+	unsigned int len;
+	u32 block;
+};
+
+static struct file_data *file_data;
+static int file_data_count;
+static int file_data_size;
+
 /* Definition from RFC-4122 */
 struct uuid {
     u32 time_low;
@@ -158,6 +188,8 @@ void write_sb(int fd, unsigned long long offset, struct ext4_super_block *sb)
 {
 	off64_t ret;
 
+	ext4_update_sb_csum(sb);
+
 	ret = lseek64(fd, offset, SEEK_SET);
 	if (ret < 0)
 		critical_error_errno("failed to seek to superblock");
@@ -169,10 +201,486 @@ void write_sb(int fd, unsigned long long offset, struct ext4_super_block *sb)
 		critical_error("failed to write all of superblock");
 }
 
+/* Queues len bytes at offset in a file to be written to the image at block.
+   Unlike sparse_file_add_file, which makes libsparse open and read the file
+   again for each region, the queued regions are written by write_ext4_image
+   with one open per file, either copied straight into a raw image or with
+   small files next to each other merged into one chunk of a sparse image. */
+void queue_file_data(const char *filename, int64_t offset, unsigned int len,
+		u32 block)
+{
+	struct file_data *data;
+
+	if (file_data_count == file_data_size) {
+		int size = file_data_size ? file_data_size * 2 : 1024;
+		data = realloc(file_data, size * sizeof(struct file_data));
+		if (data == NULL)
+			critical_error_errno("realloc");
+		file_data = data;
+		file_data_size = size;
+	}
+
+	data = &file_data[file_data_count];
+	if (file_data_count > 0 &&
+			strcmp(file_data[file_data_count - 1].filename, filename) == 0) {
+		data->filename = file_data[file_data_count - 1].filename;
+		data->owns_filename = false;
+	} else {
+		data->filename = strdup(filename);
+		if (data->filename == NULL)
+			critical_error_errno("strdup");
+		data->owns_filename = true;
+	}
+	data->offset = offset;
+	data->len = len;
+	data->block = block;
+	file_data_count++;
+}
+
+/* Releases the regions queued by queue_file_data */
+void free_file_data()
+{
+	int i;
+
+	for (i = 0; i < file_data_count; i++)
+		if (file_data[i].owns_filename)
+			free(file_data[i].filename);
+
+	free(file_data);
+	file_data = NULL;
+	file_data_count = 0;
+	file_data_size = 0;
+}
+
+/* Opens the file of a queued region, reusing fd if it is already open for
+   the previous region */
+static int open_file_data(int i, int fd)
+{
+	if (fd >= 0 && !file_data[i].owns_filename)
+		return fd;
+
+	if (fd >= 0)
+		close(fd);
+
+	fd = open(file_data[i].filename, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		critical_error_errno("failed to open %s", file_data[i].filename);
+
+	return fd;
+}
+
+/* Reads len bytes from the current position of fd, returns -1 with errno
+   set if there is an error or 0 if the file ends first */
+static int read_fully(int fd, u8 *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret;
+		buf += ret;
+		len -= ret;
+	}
+	return 1;
+}
+
+static void read_file_data(int fd, int i, u8 *buf)
+{
+	int ret;
+
+	if (lseek64(fd, file_data[i].offset, SEEK_SET) < 0)
+		critical_error_errno("failed to seek in %s", file_data[i].filename);
+
+	ret = read_fully(fd, buf, file_data[i].len);
+	if (ret < 0)
+		critical_error_errno("failed to read %s", file_data[i].filename);
+	if (ret == 0)
+		critical_error("unexpected end of %s", file_data[i].filename);
+}
+
+/* Appends the part of queued region i that starts block blocks into it and
+   is len blocks long to the queue being rebuilt in kept */
+static void keep_file_data(struct file_data *kept, int *kept_count, int i,
+		u32 block, u32 len)
+{
+	struct file_data *data = &kept[(*kept_count)++];
+	u64 offset = (u64)block * info.block_size;
+
+	*data = file_data[i];
+	data->owns_filename = *kept_count == 1 ||
+			kept[*kept_count - 2].filename != data->filename;
+	data->offset += offset;
+	data->block += block;
+	data->len = min((u64)len * info.block_size, file_data[i].len - offset);
+}
+
+/* Compares the blocks of queued region i with the same blocks in the image
+   prev_fd, where the data should be followed by zeros to the end of the last
+   block, and appends the runs of blocks that differ to kept.  Returns the
+   number of blocks that are the same. */
+static u32 compare_file_data(int i, int fd, int prev_fd,
+		struct file_data *kept, int *kept_count)
+{
+	static u8 buf[65536], prev_buf[65536];
+	u32 blocks = DIV_ROUND_UP(file_data[i].len, info.block_size);
+	u32 blocks_per_buf = sizeof(buf) / info.block_size;
+	u64 left = file_data[i].len;
+	u32 changed_start = 0;
+	u32 changed = 0;
+	u32 same = 0;
+	u32 block;
+	int ret;
+
+	if (lseek64(fd, file_data[i].offset, SEEK_SET) < 0)
+		critical_error_errno("failed to seek in %s", file_data[i].filename);
+	if (lseek64(prev_fd, (off64_t)file_data[i].block * info.block_size, SEEK_SET) < 0)
+		critical_error_errno("failed to seek in the previous image");
+
+	for (block = 0; block < blocks; ) {
+		u32 count = min(blocks - block, blocks_per_buf);
+		size_t chunk = count * info.block_size;
+		size_t from_file = min(left, chunk);
+		u32 j;
+
+		ret = read_fully(fd, buf, from_file);
+		if (ret < 0)
+			critical_error_errno("failed to read %s", file_data[i].filename);
+		if (ret == 0)
+			critical_error("unexpected end of %s", file_data[i].filename);
+		memset(buf + from_file, 0, chunk - from_file);
+
+		ret = read_fully(prev_fd, prev_buf, chunk);
+		if (ret < 0)
+			critical_error_errno("failed to read the previous image");
+		if (ret == 0)
+			critical_error("unexpected end of the previous image");
+
+		for (j = 0; j < count; j++, block++) {
+			size_t off = j * info.block_size;
+
+			if (memcmp(buf + off, prev_buf + off, info.block_size) != 0) {
+				if (changed == 0)
+					changed_start = block;
+				changed++;
+				continue;
+			}
+
+			same++;
+			if (changed > 0) {
+				keep_file_data(kept, kept_count, i, changed_start, changed);
+				changed = 0;
+			}
+		}
+
+		left -= from_file;
+	}
+
+	if (changed > 0)
+		keep_file_data(kept, kept_count, i, changed_start, changed);
+
+	return same;
+}
+
+/* Adds zero fill chunks for the free blocks of the image that are not zero
+   in the image prev_fd, so that writing the image over the previous one
+   gives the same result as writing the whole image */
+static void clear_free_blocks(int prev_fd)
+{
+	static u8 buf[65536];
+	u32 blocks_per_buf = sizeof(buf) / info.block_size;
+	u32 fill_start = 0;
+	u32 fill_len = 0;
+	u32 block = 0;
+
+	while (block < aux_info.len_blocks) {
+		u32 count = 0;
+		u32 j;
+
+		if (block_is_allocated(block)) {
+			block++;
+			continue;
+		}
+
+#ifdef SEEK_DATA
+		/* skip holes in the previous image, which read as zeros */
+		off64_t data = lseek64(prev_fd, (off64_t)block * info.block_size, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data > (off64_t)block * info.block_size) {
+			block = data / info.block_size;
+			continue;
+		}
+#endif
+
+		while (count < blocks_per_buf && block + count < aux_info.len_blocks &&
+				!block_is_allocated(block + count))
+			count++;
+
+		if (lseek64(prev_fd, (off64_t)block * info.block_size, SEEK_SET) < 0 ||
+				read_fully(prev_fd, buf, count * info.block_size) <= 0)
+			critical_error_errno("failed to read the previous image");
+
+		for (j = 0; j < count; j++) {
+			u8 *data_block = buf + j * info.block_size;
+			bool zero = data_block[0] == 0 &&
+					memcmp(data_block, data_block + 1, info.block_size - 1) == 0;
+
+			if (!zero && fill_len > 0 && fill_start + fill_len == block + j) {
+				fill_len++;
+			} else if (!zero) {
+				if (fill_len > 0)
+					sparse_file_add_fill(ext4_sparse_file, 0,
+							fill_len * info.block_size, fill_start);
+				fill_start = block + j;
+				fill_len = 1;
+			}
+		}
+
+		block += count;
+	}
+
+	if (fill_len > 0)
+		sparse_file_add_fill(ext4_sparse_file, 0, fill_len * info.block_size,
+				fill_start);
+}
+
+/* Turns the image into a delta against the image built previously with the
+   same block placement (see extract_base_fs_allocations), read from
+   prev_fd: blocks of queued regions that already hold the same data are
+   dropped, so that they are skipped in a sparse image, and free blocks that
+   are not zero in the previous image are cleared.  Returns the number of
+   blocks of file data that were dropped. */
+u32 drop_unchanged_file_data(int prev_fd)
+{
+	struct file_data *kept;
+	int kept_count = 0;
+	int kept_size = file_data_count + 1;
+	u32 dropped = 0;
+	int in_fd = -1;
+	int owner = -1;
+	int owner_kept = 0;
+	int i;
+
+	kept = malloc(kept_size * sizeof(struct file_data));
+	if (kept == NULL)
+		critical_error_errno("malloc");
+
+	for (i = 0; i <= file_data_count; i++) {
+		/* free the filename of the previous file if all of it was
+		   dropped */
+		if (i == file_data_count || file_data[i].owns_filename) {
+			if (owner >= 0 && owner_kept == kept_count)
+				free(file_data[owner].filename);
+			owner = i;
+			owner_kept = kept_count;
+		}
+		if (i == file_data_count)
+			break;
+
+		/* a region is split in at most half of its blocks plus one */
+		int most = DIV_ROUND_UP(file_data[i].len, info.block_size) / 2 + 1;
+
+		if (kept_count + most > kept_size) {
+			struct file_data *tmp;
+			kept_size = (kept_count + most) * 2;
+			tmp = realloc(kept, kept_size * sizeof(struct file_data));
+			if (tmp == NULL)
+				critical_error_errno("realloc");
+			kept = tmp;
+		}
+
+		in_fd = open_file_data(i, in_fd);
+		dropped += compare_file_data(i, in_fd, prev_fd, kept, &kept_count);
+	}
+
+	if (in_fd >= 0)
+		close(in_fd);
+
+	free(file_data);
+	file_data = kept;
+	file_data_count = kept_count;
+	file_data_size = kept_size;
+
+	clear_free_blocks(prev_fd);
+
+	return dropped;
+}
+
+/* Copies len bytes at in_offset in in_fd to out_offset in out_fd, in the
+   kernel if possible */
+static void copy_file_data(int in_fd, off64_t in_offset, int out_fd,
+		off64_t out_offset, unsigned int len, const char *filename)
+{
+#if defined(__linux__) && defined(__NR_copy_file_range)
+	static bool copy_file_range_failed = false;
+
+	while (len > 0 && !copy_file_range_failed) {
+		loff_t in_off = in_offset;
+		loff_t out_off = out_offset;
+		ssize_t ret = syscall(__NR_copy_file_range, in_fd, &in_off, out_fd,
+				&out_off, (size_t)len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			/* not supported by the kernel or the file systems, or the
+			   files are on different file systems */
+			if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+					errno == EOPNOTSUPP || errno == EBADF) {
+				copy_file_range_failed = true;
+				break;
+			}
+			critical_error_errno("failed to copy %s", filename);
+		}
+		if (ret == 0)
+			critical_error("unexpected end of %s", filename);
+		in_offset += ret;
+		out_offset += ret;
+		len -= ret;
+	}
+#endif
+
+	if (len > 0 && (lseek64(in_fd, in_offset, SEEK_SET) < 0 ||
+			lseek64(out_fd, out_offset, SEEK_SET) < 0))
+		critical_error_errno("failed to seek to copy %s", filename);
+
+	while (len > 0) {
+		u8 buf[65536];
+		unsigned int chunk = min(len, sizeof(buf));
+		ssize_t ret = read(in_fd, buf, chunk);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			critical_error_errno("failed to read %s", filename);
+		if (ret == 0)
+			critical_error("unexpected end of %s", filename);
+		chunk = ret;
+		if (write(out_fd, buf, chunk) != (ssize_t)chunk)
+			critical_error_errno("failed to write image");
+		len -= chunk;
+	}
+}
+
+/* Copies the queued regions to a raw image that starts at base in fd, after
+   libsparse has written everything else and left holes for them */
+static void write_file_data_raw(int fd, off64_t base)
+{
+	int in_fd = -1;
+	int i;
+
+	for (i = 0; i < file_data_count; i++) {
+		in_fd = open_file_data(i, in_fd);
+		copy_file_data(in_fd, file_data[i].offset, fd,
+				base + (off64_t)file_data[i].block * info.block_size,
+				file_data[i].len, file_data[i].filename);
+	}
+
+	if (in_fd >= 0)
+		close(in_fd);
+}
+
+/* Returns true if the blocks in [start, end) are all free, so nothing else
+   is written there */
+static bool blocks_are_free(u32 start, u32 end)
+{
+	for (; start < end; start++)
+		if (block_is_allocated(start))
+			return false;
+	return true;
+}
+
+/* Adds the queued regions to ext4_sparse_file, merging runs of small regions
+   close to each other into one data chunk.  Free blocks between the regions,
+   such as the spare block that extent allocation returns after each file,
+   are written as zeros instead of being skipped.  Returns the buffers of the
+   merged chunks, terminated by NULL, which must be freed after the image has
+   been written. */
+static u8 **add_file_data_sparse()
+{
+	u8 **buffers = calloc(file_data_count + 1, sizeof(u8 *));
+	int buffer_count = 0;
+	u64 buffered = 0;
+	int in_fd = -1;
+	int i = 0;
+
+	if (buffers == NULL)
+		critical_error_errno("calloc");
+
+	while (i < file_data_count) {
+		u32 end = file_data[i].block + DIV_ROUND_UP(file_data[i].len, info.block_size);
+		u64 run_len = (u64)(end - file_data[i].block) * info.block_size;
+		int run = 1;
+
+		while (i + run < file_data_count && file_data[i + run - 1].len <= FILE_DATA_SMALL &&
+				file_data[i + run].len <= FILE_DATA_SMALL &&
+				file_data[i + run].block >= end &&
+				file_data[i + run].block - end <= FILE_DATA_MAX_GAP) {
+			u32 next_end = file_data[i + run].block +
+					DIV_ROUND_UP(file_data[i + run].len, info.block_size);
+			u64 len = (u64)(next_end - end) * info.block_size;
+			if (run_len + len > FILE_DATA_RUN ||
+					buffered + run_len + len > FILE_DATA_MAX_BUFFERED ||
+					!blocks_are_free(end, file_data[i + run].block))
+				break;
+			run_len += len;
+			end = next_end;
+			run++;
+		}
+
+		if (run == 1) {
+			sparse_file_add_file(ext4_sparse_file, file_data[i].filename,
+					file_data[i].offset, file_data[i].len, file_data[i].block);
+			i++;
+			continue;
+		}
+
+		/* the gaps after the end of each file are already zero */
+		u32 start = file_data[i].block;
+		u8 *buf = calloc(run_len, 1);
+		if (buf == NULL)
+			critical_error_errno("calloc");
+		buffers[buffer_count++] = buf;
+		buffered += run_len;
+
+		for (; run > 0; run--, i++) {
+			in_fd = open_file_data(i, in_fd);
+			read_file_data(in_fd, i,
+					buf + (u64)(file_data[i].block - start) * info.block_size);
+		}
+
+		sparse_file_add_data(ext4_sparse_file, buf, run_len, start);
+	}
+
+	if (in_fd >= 0)
+		close(in_fd);
+
+	return buffers;
+}
+
 /* Write the filesystem image to a file */
 void write_ext4_image(int fd, int gz, int sparse, int crc)
 {
+	off64_t base = -1;
+	u8 **buffers = NULL;
+	int i;
+
+	/* the regions of queued files are left as holes in a raw image and
+	   copied afterwards, unless fd can't seek */
+	if (!gz && !sparse && !crc)
+		base = lseek64(fd, 0, SEEK_CUR);
+
+	if (base < 0)
+		buffers = add_file_data_sparse();
+
 	sparse_file_write(ext4_sparse_file, fd, gz, sparse, crc);
+
+	if (base >= 0)
+		write_file_data_raw(fd, base);
+
+	for (i = 0; buffers && buffers[i]; i++)
+		free(buffers[i]);
+	free(buffers);
+	free_file_data();
 }
 
 /* Compute the rest of the parameters of the filesystem from the basic info */
@@ -314,6 +822,8 @@ void ext4_fill_in_sb(int real_uuid)
 	sb->s_raid_stripe_width = 0;
 	sb->s_log_groups_per_flex = 0;
 	sb->s_kbytes_written = 0;
+	if (info.feat_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)
+		sb->s_checksum_type = EXT4_CRC32C_CHKSUM;
 
 	for (i = 0; i < aux_info.groups; i++) {
 		u64 group_start_block = aux_info.first_data_block + i *
@@ -346,6 +856,8 @@ void ext4_fill_in_sb(int real_uuid)
 
 void ext4_queue_sb(void)
 {
+	ext4_update_sb_csum(aux_info.sb);
+
 	/* The write_data* functions expect only block aligned calls.
 	 * This is not an issue, except when we write out the super
 	 * block on a system with a block size > 1K.  So, we need to
@@ -453,7 +965,6 @@ void ext4_update_free()
 	for (i = 0; i < aux_info.groups; i++) {
 		u32 bg_free_blocks = get_free_blocks(i);
 		u32 bg_free_inodes = get_free_inodes(i);
-		u16 crc;
 
 		aux_info.bg_desc[i].bg_free_blocks_count = bg_free_blocks;
 		aux_info.sb->s_free_blocks_count_lo += bg_free_blocks;
@@ -465,10 +976,7 @@ void ext4_update_free()
 
 		aux_info.bg_desc[i].bg_flags = get_bg_flags(i);
 
-		crc = ext4_crc16(~0, aux_info.sb->s_uuid, sizeof(aux_info.sb->s_uuid));
-		crc = ext4_crc16(crc, &i, sizeof(i));
-		crc = ext4_crc16(crc, &aux_info.bg_desc[i], offsetof(struct ext2_group_desc, bg_checksum));
-		aux_info.bg_desc[i].bg_checksum = crc;
+		aux_info.bg_desc[i].bg_checksum = ext4_group_desc_csum(i, &aux_info.bg_desc[i]);
 	}
 }
 
@@ -94,8 +94,10 @@ struct ext2_group_desc {
 	u16 bg_free_inodes_count;
 	u16 bg_used_dirs_count;
 	u16 bg_flags;
-	u32 bg_reserved[2];
-	u16 bg_reserved16;
+	u32 bg_exclude_bitmap;
+	u16 bg_block_bitmap_csum;
+	u16 bg_inode_bitmap_csum;
+	u16 bg_itable_unused;
 	u16 bg_checksum;
 };
 
@@ -138,6 +140,10 @@ void bitmap_clear_bit(u8 *bitmap, u32 bit);
 int ext4_bg_has_super_block(int bg);
 void read_sb(int fd, struct ext4_super_block *sb);
 void write_sb(int fd, unsigned long long offset, struct ext4_super_block *sb);
+void queue_file_data(const char *filename, int64_t offset, unsigned int len,
+		u32 block);
+void free_file_data(void);
+u32 drop_unchanged_file_data(int prev_fd);
 void write_ext4_image(int fd, int gz, int sparse, int crc);
 void ext4_create_fs_aux_info(void);
 void ext4_free_fs_aux_info(void);
@@ -152,6 +158,7 @@ u64 get_file_size(int fd);
 u64 parse_num(const char *arg);
 void ext4_parse_sb_info(struct ext4_super_block *sb);
 u16 ext4_crc16(u16 crc_in, const void *buf, int size);
+u32 ext4_crc32c(u32 crc, const void *buf, int size);
 
 typedef void (*fs_config_func_t)(const char *path, int dir, const char *target_out_path,
         unsigned *uid, unsigned *gid, unsigned *mode, uint64_t *capabilities);
@@ -162,7 +169,8 @@ int make_ext4fs_internal(int fd, const char *directory, const char *_target_out_
 						 const char *mountpoint, fs_config_func_t fs_config_func, int gzip,
 						 int sparse, int crc, int wipe, int real_uuid,
 						 struct selabel_handle *sehnd, int verbose, time_t fixed_time,
-						 FILE* block_list_file, FILE* base_alloc_file_in, FILE* base_alloc_file_out);
+						 FILE* block_list_file, FILE* base_alloc_file_in, FILE* base_alloc_file_out,
+						 FILE* access_order_file, int share_blocks, int prev_image_fd);
 
 int read_ext(int fd, int verbose);
 
@@ -0,0 +1,921 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checks an ext4 image without mounting it:
+ *  - the blocks used by the filesystem metadata and by inodes, including
+ *    extent tree and indirect blocks, match the block bitmaps, and no block
+ *    is used twice
+ *  - the free block, free inode and directory counts of each block group and
+ *    the superblock match the bitmaps, and i_blocks of each inode matches the
+ *    blocks it uses
+ *  - optionally, the contents of regular files match a manifest in the format
+ *    written by sha1sum
+ * The image is mapped into memory, and block groups and manifest entries are
+ * checked by a pool of threads. */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "ext4_utils.h"
+#include "ext4_extents.h"
+#include "sha1.h"
+
+#define VERIFY_MAX_THREADS 64
+
+/* Deepest extent tree the kernel creates */
+#define EXT4_MAX_EXTENT_DEPTH 5
+
+/* The inode block count is in units of 512 byte blocks unless the inode has
+   EXT4_HUGE_FILE_FL */
+#define INODE_BLOCK_SIZE 512
+
+struct manifest_entry {
+	char *path;
+	u8 digest[SHA1_DIGEST_LENGTH];
+};
+
+/* What a walk over the blocks of an inode does with them */
+enum walk_mode {
+	WALK_MARK,	/* mark the blocks in used_blocks, and count them */
+	WALK_READ,	/* pass the data blocks to data_func in logical order */
+};
+
+struct inode_walk;
+
+/* Called with each run of data blocks of an inode, data is NULL for
+   uninitialized extents, which read as zeros.  Returns false to stop the
+   walk. */
+typedef bool (*data_func_t)(struct inode_walk *w, u64 logical, const u8 *data,
+		u32 len);
+
+struct inode_walk {
+	enum walk_mode mode;
+	u32 inode_num;
+	struct ext4_inode *inode;
+	u64 blocks;
+	u32 duplicates;
+	bool bad;
+	bool stop;
+	data_func_t data_func;
+	void *priv;
+};
+
+static int verbose = 0;
+
+/* The whole image, mapped read only */
+static const u8 *image;
+
+/* Blocks found in use by metadata or inodes, one bit per block */
+static u8 *used_blocks;
+
+static struct manifest_entry *manifest;
+static u32 manifest_entries;
+
+static u32 next_item;
+static u64 free_blocks;
+static u64 free_inodes;
+static u32 problems;
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const u8 zero_block[EXT4_MAX_BLOCK_SIZE];
+
+static void usage(char *path)
+{
+	fprintf(stderr, "%s [ options ] <image or block device>\n", path);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -j <threads> number of threads (default: one per cpu)\n");
+	fprintf(stderr, "  -m <manifest> check file contents against the output of\n");
+	fprintf(stderr, "     sha1sum, run in the directory the image was built from\n");
+	fprintf(stderr, "  -v verbose output\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Sparse images must be converted with simg2img first.\n");
+}
+
+/* Reports a problem with the image, safe to call from any thread */
+static void report(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&report_mutex);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	problems++;
+	pthread_mutex_unlock(&report_mutex);
+}
+
+static inline const u8 *get_block(u64 block)
+{
+	return image + block * info.block_size;
+}
+
+/* Blocks that may be used by inodes: inside the filesystem and not the
+   superblock */
+static inline bool valid_range(u64 block, u64 len)
+{
+	return block > aux_info.first_data_block && len <= aux_info.len_blocks &&
+		block <= aux_info.len_blocks - len;
+}
+
+/* Marks a block in use, returns true if it already was */
+static inline bool mark_block_used(u64 block)
+{
+	u8 bit = 1 << (block % 8);
+
+	return __atomic_fetch_or(&used_blocks[block / 8], bit, __ATOMIC_RELAXED) & bit;
+}
+
+static inline bool block_used(u64 block)
+{
+	return bitmap_get_bit(used_blocks, block);
+}
+
+static bool inode_table_valid(u32 bg)
+{
+	return valid_range(aux_info.bg_desc[bg].bg_inode_table, aux_info.inode_table_blocks);
+}
+
+/* Returns an inode, or NULL if its inode table is outside the filesystem */
+static struct ext4_inode *get_verify_inode(u32 inode_num)
+{
+	u32 bg = (inode_num - 1) / info.inodes_per_group;
+	u32 index = (inode_num - 1) % info.inodes_per_group;
+
+	if (!inode_table_valid(bg))
+		return NULL;
+
+	return (struct ext4_inode *)(get_block(aux_info.bg_desc[bg].bg_inode_table) +
+			(u64)index * info.inode_size);
+}
+
+static u64 inode_size(struct ext4_inode *inode)
+{
+	return ((u64)inode->i_size_high << 32) | inode->i_size_lo;
+}
+
+/* Adds a run of blocks of the inode being walked, data blocks if logical is
+   not NULL.  Returns false if the blocks are outside the filesystem. */
+static bool add_blocks(struct inode_walk *w, const u64 *logical, u64 block,
+		u32 len, bool uninit)
+{
+	u32 i;
+
+	if (!valid_range(block, len)) {
+		if (w->mode == WALK_MARK)
+			report("inode %u: blocks %"PRIu64"-%"PRIu64" are outside the filesystem",
+					w->inode_num, block, block + len - 1);
+		w->bad = true;
+		return false;
+	}
+
+	if (w->mode == WALK_MARK) {
+		for (i = 0; i < len; i++)
+			if (mark_block_used(block + i))
+				w->duplicates++;
+		w->blocks += len;
+	} else if (logical && !w->stop) {
+		if (!w->data_func(w, *logical, uninit ? NULL : get_block(block), len))
+			w->stop = true;
+	}
+
+	return true;
+}
+
+static void walk_extent_node(struct inode_walk *w, struct ext4_extent_header *hdr,
+		u32 max_entries, int depth)
+{
+	u32 i;
+
+	if (hdr->eh_magic != EXT4_EXT_MAGIC || hdr->eh_entries > hdr->eh_max ||
+			hdr->eh_max > max_entries || hdr->eh_depth != depth ||
+			depth > EXT4_MAX_EXTENT_DEPTH) {
+		if (w->mode == WALK_MARK)
+			report("inode %u: bad extent header", w->inode_num);
+		w->bad = true;
+		return;
+	}
+
+	if (depth == 0) {
+		struct ext4_extent *extent = EXT_FIRST_EXTENT(hdr);
+
+		for (i = 0; i < hdr->eh_entries && !w->stop; i++, extent++) {
+			u64 start = ((u64)extent->ee_start_hi << 32) | extent->ee_start_lo;
+			u64 logical = extent->ee_block;
+			u32 len = extent->ee_len;
+			bool uninit = len > EXT_INIT_MAX_LEN;
+
+			if (uninit)
+				len -= EXT_INIT_MAX_LEN;
+			add_blocks(w, &logical, start, len, uninit);
+		}
+	} else {
+		struct ext4_extent_idx *idx = EXT_FIRST_INDEX(hdr);
+
+		for (i = 0; i < hdr->eh_entries && !w->stop; i++, idx++) {
+			u64 leaf = ((u64)idx->ei_leaf_hi << 32) | idx->ei_leaf_lo;
+
+			if (!add_blocks(w, NULL, leaf, 1, false))
+				continue;
+			walk_extent_node(w, (struct ext4_extent_header *)get_block(leaf),
+					(info.block_size - sizeof(struct ext4_extent_header)) /
+					sizeof(struct ext4_extent), depth - 1);
+		}
+	}
+}
+
+/* Walks the blocks under a block pointer of the given level, level 0 being a
+   data block and 1 an indirect block */
+static void walk_indirect(struct inode_walk *w, u32 block, int level, u64 logical)
+{
+	const u32 *ptrs;
+	u64 span = 1;
+	u32 i;
+
+	if (level == 0) {
+		add_blocks(w, &logical, block, 1, false);
+		return;
+	}
+
+	if (!add_blocks(w, NULL, block, 1, false))
+		return;
+
+	for (i = 1; i < (u32)level; i++)
+		span *= aux_info.blocks_per_ind;
+
+	ptrs = (const u32 *)get_block(block);
+	for (i = 0; i < aux_info.blocks_per_ind && !w->stop; i++)
+		if (ptrs[i])
+			walk_indirect(w, ptrs[i], level - 1, logical + i * span);
+}
+
+/* Symlinks shorter than i_block keep their target there instead of in a
+   data block */
+static bool is_fast_symlink(struct ext4_inode *inode)
+{
+	return S_ISLNK(inode->i_mode) && inode_size(inode) < sizeof(inode->i_block);
+}
+
+static void walk_inode(struct inode_walk *w)
+{
+	struct ext4_inode *inode = w->inode;
+	u64 logical;
+	int i;
+
+	if (w->inode_num == EXT4_RESIZE_INO) {
+		/* The resize inode maps the reserved group descriptor blocks,
+		   which are counted as metadata, through a double indirect
+		   block */
+		if (w->mode == WALK_MARK && inode->i_block[EXT4_DIND_BLOCK])
+			add_blocks(w, NULL, inode->i_block[EXT4_DIND_BLOCK], 1, false);
+		return;
+	}
+
+	if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode) &&
+			!(S_ISLNK(inode->i_mode) && !is_fast_symlink(inode)))
+		return;
+
+	/* Inline data is kept in i_block instead of in data blocks */
+	if (inode->i_flags & EXT4_INLINE_DATA_FL)
+		return;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		struct ext4_extent_header *hdr = (struct ext4_extent_header *)inode->i_block;
+
+		walk_extent_node(w, hdr, (sizeof(inode->i_block) -
+				sizeof(struct ext4_extent_header)) / sizeof(struct ext4_extent),
+				hdr->eh_depth);
+		return;
+	}
+
+	for (i = 0; i < EXT4_NDIR_BLOCKS && !w->stop; i++) {
+		if (inode->i_block[i])
+			walk_indirect(w, inode->i_block[i], 0, i);
+	}
+
+	logical = EXT4_NDIR_BLOCKS;
+	for (i = 1; i <= 3 && !w->stop; i++) {
+		if (inode->i_block[EXT4_IND_BLOCK + i - 1])
+			walk_indirect(w, inode->i_block[EXT4_IND_BLOCK + i - 1], i, logical);
+		logical += i == 1 ? aux_info.blocks_per_ind :
+			i == 2 ? aux_info.blocks_per_dind : aux_info.blocks_per_tind;
+	}
+}
+
+/* Marks the superblocks, group descriptors, bitmaps and inode tables in use */
+static void mark_metadata(void)
+{
+	u32 bg;
+	u64 i;
+
+	for (i = 0; i <= aux_info.first_data_block; i++)
+		mark_block_used(i);
+
+	for (bg = 0; bg < aux_info.groups; bg++) {
+		struct ext2_group_desc *desc = &aux_info.bg_desc[bg];
+		u64 start = aux_info.first_data_block + (u64)bg * info.blocks_per_group;
+		u64 regions[3][2] = {
+			{ desc->bg_block_bitmap, 1 },
+			{ desc->bg_inode_bitmap, 1 },
+			{ desc->bg_inode_table, aux_info.inode_table_blocks },
+		};
+		u32 dups = 0;
+		int r;
+
+		if (ext4_bg_has_super_block(bg)) {
+			for (i = bg ? 0 : 1; i < 1 + aux_info.bg_desc_blocks +
+					info.bg_desc_reserve_blocks; i++)
+				dups += mark_block_used(start + i);
+		}
+
+		for (r = 0; r < 3; r++) {
+			if (!valid_range(regions[r][0], regions[r][1])) {
+				report("group %u: metadata blocks %"PRIu64"-%"PRIu64" are outside the filesystem",
+						bg, regions[r][0], regions[r][0] + regions[r][1] - 1);
+				continue;
+			}
+			for (i = 0; i < regions[r][1]; i++)
+				dups += mark_block_used(regions[r][0] + i);
+		}
+
+		if (dups)
+			report("group %u: %u metadata blocks overlap other metadata", bg, dups);
+	}
+}
+
+static bool inode_bitmap_valid(u32 bg)
+{
+	return !(aux_info.bg_desc[bg].bg_flags & EXT4_BG_INODE_UNINIT) &&
+		valid_range(aux_info.bg_desc[bg].bg_inode_bitmap, 1) && inode_table_valid(bg);
+}
+
+/* Checks the inode counts of a block group, and marks the blocks of its
+   inodes in use */
+static void check_group_inodes(u32 bg)
+{
+	struct ext2_group_desc *desc = &aux_info.bg_desc[bg];
+	const u8 *bitmap;
+	u32 used = 0, dirs = 0;
+	u32 first_ino = EXT4_FIRST_INO(aux_info.sb);
+	u32 i;
+
+	if (!inode_bitmap_valid(bg)) {
+		if (desc->bg_free_inodes_count != info.inodes_per_group || desc->bg_used_dirs_count)
+			report("group %u: inode table is uninitialized but has inodes in use", bg);
+		__atomic_fetch_add(&free_inodes, desc->bg_free_inodes_count, __ATOMIC_RELAXED);
+		return;
+	}
+
+	bitmap = get_block(desc->bg_inode_bitmap);
+
+	for (i = 0; i < info.inodes_per_group; i++) {
+		struct inode_walk w;
+		u64 i_blocks;
+
+		if (!bitmap_get_bit((u8 *)bitmap, i))
+			continue;
+
+		memset(&w, 0, sizeof(w));
+		w.mode = WALK_MARK;
+		w.inode_num = bg * info.inodes_per_group + i + 1;
+		w.inode = get_verify_inode(w.inode_num);
+
+		used++;
+		if (S_ISDIR(w.inode->i_mode))
+			dirs++;
+
+		if (w.inode->i_links_count == 0) {
+			if (w.inode_num >= first_ino)
+				report("inode %u: in use but has no links", w.inode_num);
+			continue;
+		}
+
+		walk_inode(&w);
+
+		if (w.inode->i_file_acl_lo) {
+			/* xattr blocks may be shared between inodes */
+			if (valid_range(w.inode->i_file_acl_lo, 1)) {
+				mark_block_used(w.inode->i_file_acl_lo);
+				w.blocks++;
+			} else {
+				report("inode %u: xattr block %u is outside the filesystem",
+						w.inode_num, w.inode->i_file_acl_lo);
+				w.bad = true;
+			}
+		}
+
+		if (w.duplicates)
+			report("inode %u: %u blocks are also used by other inodes or metadata",
+					w.inode_num, w.duplicates);
+
+		i_blocks = w.inode->i_blocks_lo;
+		if (info.feat_ro_compat & EXT4_FEATURE_RO_COMPAT_HUGE_FILE)
+			i_blocks |= (u64)w.inode->osd2.linux2.l_i_blocks_high << 32;
+		if (!(w.inode->i_flags & EXT4_HUGE_FILE_FL))
+			i_blocks /= info.block_size / INODE_BLOCK_SIZE;
+
+		if (!w.bad && w.inode_num != EXT4_RESIZE_INO && i_blocks != w.blocks)
+			report("inode %u: i_blocks is %"PRIu64" blocks but the inode uses %"PRIu64,
+					w.inode_num, i_blocks, w.blocks);
+	}
+
+	if (used != info.inodes_per_group - desc->bg_free_inodes_count)
+		report("group %u: free inode count is %u but the bitmap has %u free",
+				bg, desc->bg_free_inodes_count, info.inodes_per_group - used);
+
+	if (dirs != desc->bg_used_dirs_count)
+		report("group %u: directory count is %u but %u directories are in use",
+				bg, desc->bg_used_dirs_count, dirs);
+
+	__atomic_fetch_add(&free_inodes, info.inodes_per_group - used, __ATOMIC_RELAXED);
+}
+
+/* Compares the block bitmap of a group with the blocks found in use */
+static void check_group_blocks(u32 bg)
+{
+	struct ext2_group_desc *desc = &aux_info.bg_desc[bg];
+	u64 start = aux_info.first_data_block + (u64)bg * info.blocks_per_group;
+	u32 blocks = min(info.blocks_per_group, aux_info.len_blocks - start);
+	u32 not_marked = 0, not_used = 0, used = 0;
+	u64 first_not_marked = 0, first_not_used = 0;
+	const u8 *bitmap;
+	u32 i;
+
+	if (desc->bg_flags & EXT4_BG_BLOCK_UNINIT)
+		return;
+
+	if (!valid_range(desc->bg_block_bitmap, 1))
+		return;
+
+	bitmap = get_block(desc->bg_block_bitmap);
+
+	for (i = 0; i < blocks; i++) {
+		bool marked = bitmap_get_bit((u8 *)bitmap, i);
+		bool in_use = block_used(start + i);
+
+		if (marked)
+			used++;
+
+		if (in_use && !marked) {
+			if (!not_marked++)
+				first_not_marked = start + i;
+		} else if (!in_use && marked) {
+			if (!not_used++)
+				first_not_used = start + i;
+		}
+	}
+
+	if (not_marked)
+		report("group %u: %u blocks in use are free in the bitmap, first %"PRIu64,
+				bg, not_marked, first_not_marked);
+
+	if (not_used)
+		report("group %u: %u unused blocks are in use in the bitmap, first %"PRIu64,
+				bg, not_used, first_not_used);
+
+	if (blocks - used != desc->bg_free_blocks_count)
+		report("group %u: free block count is %u but the bitmap has %u free",
+				bg, desc->bg_free_blocks_count, blocks - used);
+
+	__atomic_fetch_add(&free_blocks, blocks - used, __ATOMIC_RELAXED);
+}
+
+struct lookup_ctx {
+	const char *name;
+	size_t len;
+	u32 found;
+};
+
+static bool lookup_data(struct inode_walk *w, u64 logical, const u8 *data, u32 len)
+{
+	struct lookup_ctx *ctx = w->priv;
+	const u8 *end;
+
+	if (!data)
+		return true;
+
+	for (end = data + (u64)len * info.block_size; data < end; data += info.block_size) {
+		u32 offset = 0;
+
+		while (offset + 8 <= info.block_size) {
+			struct ext4_dir_entry_2 *dirent = (struct ext4_dir_entry_2 *)(data + offset);
+
+			if (dirent->rec_len < 8 || offset + dirent->rec_len > info.block_size ||
+					dirent->name_len + 8u > dirent->rec_len)
+				break;
+
+			if (dirent->inode && dirent->name_len == ctx->len &&
+					!memcmp(dirent->name, ctx->name, ctx->len)) {
+				ctx->found = dirent->inode;
+				return false;
+			}
+
+			offset += dirent->rec_len;
+		}
+	}
+
+	return true;
+}
+
+/* Returns the inode number of a path relative to the root directory, or 0 */
+static u32 lookup_path(const char *path)
+{
+	u32 inode_num = EXT4_ROOT_INO;
+
+	while (*path) {
+		const char *slash = strchr(path, '/');
+		struct lookup_ctx ctx;
+		struct inode_walk w;
+
+		memset(&w, 0, sizeof(w));
+		w.mode = WALK_READ;
+		w.inode_num = inode_num;
+		w.inode = get_verify_inode(inode_num);
+		w.data_func = lookup_data;
+		w.priv = &ctx;
+
+		if (!w.inode || !S_ISDIR(w.inode->i_mode))
+			return 0;
+
+		ctx.name = path;
+		ctx.len = slash ? (size_t)(slash - path) : strlen(path);
+		ctx.found = 0;
+
+		walk_inode(&w);
+
+		if (ctx.found == 0 || ctx.found > info.inodes)
+			return 0;
+
+		inode_num = ctx.found;
+		path += ctx.len;
+		while (*path == '/')
+			path++;
+	}
+
+	return inode_num;
+}
+
+struct hash_ctx {
+	SHA1_CTX sha;
+	u64 size;
+	u64 hashed;
+	bool bad;
+};
+
+static void hash_zeros(struct hash_ctx *ctx, u64 len)
+{
+	while (len > 0) {
+		u32 n = min(len, sizeof(zero_block));
+
+		SHA1Update(&ctx->sha, zero_block, n);
+		ctx->hashed += n;
+		len -= n;
+	}
+}
+
+static bool hash_data(struct inode_walk *w, u64 logical, const u8 *data, u32 len)
+{
+	struct hash_ctx *ctx = w->priv;
+	u64 offset = logical * info.block_size;
+	u64 bytes = (u64)len * info.block_size;
+
+	if (offset < ctx->hashed) {
+		ctx->bad = true;
+		return false;
+	}
+
+	if (offset >= ctx->size)
+		return false;
+
+	hash_zeros(ctx, offset - ctx->hashed);
+
+	bytes = min(bytes, ctx->size - offset);
+	if (data) {
+		while (bytes > 0) {
+			u32 n = min(bytes, 1U << 30);
+
+			SHA1Update(&ctx->sha, data, n);
+			ctx->hashed += n;
+			data += n;
+			bytes -= n;
+		}
+	} else {
+		hash_zeros(ctx, bytes);
+	}
+
+	return true;
+}
+
+static void check_manifest_entry(struct manifest_entry *entry)
+{
+	u8 digest[SHA1_DIGEST_LENGTH];
+	struct hash_ctx ctx;
+	struct inode_walk w;
+	u32 inode_num;
+
+	inode_num = lookup_path(entry->path);
+	if (!inode_num) {
+		report("%s: not found", entry->path);
+		return;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.mode = WALK_READ;
+	w.inode_num = inode_num;
+	w.inode = get_verify_inode(inode_num);
+	w.data_func = hash_data;
+	w.priv = &ctx;
+
+	if (!w.inode || !S_ISREG(w.inode->i_mode)) {
+		report("%s: not a regular file", entry->path);
+		return;
+	}
+
+	SHA1Init(&ctx.sha);
+	ctx.size = inode_size(w.inode);
+	ctx.hashed = 0;
+	ctx.bad = false;
+
+	if (w.inode->i_flags & EXT4_INLINE_DATA_FL) {
+		/* only the part in i_block is checked, make_ext4fs doesn't store
+		   more inline */
+		u64 len = min(ctx.size, sizeof(w.inode->i_block));
+
+		SHA1Update(&ctx.sha, (const u8 *)w.inode->i_block, len);
+		ctx.hashed = len;
+	} else {
+		walk_inode(&w);
+	}
+
+	if (w.bad || ctx.bad) {
+		report("%s: inode %u has a bad block map", entry->path, inode_num);
+		return;
+	}
+
+	hash_zeros(&ctx, ctx.size - ctx.hashed);
+	SHA1Final(digest, &ctx.sha);
+
+	if (memcmp(digest, entry->digest, sizeof(digest)))
+		report("%s: contents do not match the manifest", entry->path);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Reads a manifest in the format written by sha1sum: a hex digest, a space,
+   a space or '*', and a path, which may start with "./" or "/" */
+static void read_manifest(const char *filename)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	u32 lineno = 0;
+	u32 size = 0;
+
+	f = fopen(filename, "r");
+	if (!f)
+		critical_error_errno("failed to open %s", filename);
+
+	while ((len = getline(&line, &line_size, f)) >= 0) {
+		struct manifest_entry *entry;
+		char *path;
+		int i;
+
+		lineno++;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (len == 0)
+			continue;
+
+		if (manifest_entries == size) {
+			size = size ? size * 2 : 256;
+			manifest = realloc(manifest, size * sizeof(struct manifest_entry));
+			if (!manifest)
+				critical_error_errno("realloc");
+		}
+		entry = &manifest[manifest_entries];
+
+		for (i = 0; i < SHA1_DIGEST_LENGTH * 2; i++) {
+			int v = hex_value(line[i]);
+			if (v < 0)
+				break;
+			if (i % 2)
+				entry->digest[i / 2] |= v;
+			else
+				entry->digest[i / 2] = v << 4;
+		}
+
+		if (i != SHA1_DIGEST_LENGTH * 2 || line[i] != ' ' ||
+				(line[i + 1] != ' ' && line[i + 1] != '*') || !line[i + 2])
+			critical_error("%s:%u: expected a sha1 digest and a path", filename, lineno);
+
+		path = &line[i + 2];
+		if (path[0] == '.' && path[1] == '/')
+			path += 2;
+		while (*path == '/')
+			path++;
+
+		entry->path = strdup(path);
+		if (!entry->path)
+			critical_error_errno("strdup");
+		manifest_entries++;
+	}
+
+	free(line);
+	fclose(f);
+}
+
+static void *inode_thread(void *arg)
+{
+	u32 bg;
+
+	(void)arg;
+	while ((bg = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < aux_info.groups)
+		check_group_inodes(bg);
+
+	return NULL;
+}
+
+static void *block_thread(void *arg)
+{
+	u32 bg;
+
+	(void)arg;
+	while ((bg = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < aux_info.groups)
+		check_group_blocks(bg);
+
+	return NULL;
+}
+
+static void *manifest_thread(void *arg)
+{
+	u32 i;
+
+	(void)arg;
+	while ((i = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < manifest_entries)
+		check_manifest_entry(&manifest[i]);
+
+	return NULL;
+}
+
+/* Runs func on num_threads threads, including the calling thread */
+static void run_threads(void *(*func)(void *), int num_threads)
+{
+	pthread_t threads[VERIFY_MAX_THREADS];
+	int started = 0;
+	int i;
+
+	next_item = 0;
+
+	for (i = 1; i < num_threads; i++) {
+		if (pthread_create(&threads[started], NULL, func, NULL) != 0)
+			break;
+		started++;
+	}
+
+	func(NULL);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static int verify_num_threads()
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads < 1)
+		return 1;
+	if (threads > VERIFY_MAX_THREADS)
+		return VERIFY_MAX_THREADS;
+	return threads;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	const char *in = NULL;
+	const char *manifest_file = NULL;
+	int num_threads = verify_num_threads();
+	u64 image_size;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "j:m:v")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_threads = atoi(optarg);
+			if (num_threads < 1 || num_threads > VERIFY_MAX_THREADS) {
+				fprintf(stderr, "Number of threads must be between 1 and %d\n",
+						VERIFY_MAX_THREADS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'm':
+			manifest_file = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Expected image or block device after options\n");
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	in = argv[optind++];
+
+	if (optind < argc) {
+		fprintf(stderr, "Unexpected argument: %s\n", argv[optind]);
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (setjmp(setjmp_env))
+		return EXIT_FAILURE;
+
+	fd = open(in, O_RDONLY);
+	if (fd < 0)
+		critical_error_errno("failed to open %s", in);
+
+	read_ext(fd, verbose);
+
+	if (info.feat_incompat & (EXT4_FEATURE_INCOMPAT_META_BG | EXT4_FEATURE_INCOMPAT_64BIT))
+		critical_error("meta_bg and 64bit filesystems are not supported");
+
+	image_size = is_block_device_fd(fd) ? get_block_device_size(fd) : get_file_size(fd);
+	if (image_size < aux_info.len_blocks * info.block_size)
+		critical_error("%s is %"PRIu64" bytes, smaller than the filesystem", in, image_size);
+
+	image = mmap64(NULL, aux_info.len_blocks * info.block_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED)
+		critical_error_errno("failed to map %s", in);
+
+	used_blocks = calloc(DIV_ROUND_UP(aux_info.len_blocks, 8), 1);
+	if (!used_blocks)
+		critical_error_errno("calloc");
+
+	if (manifest_file)
+		read_manifest(manifest_file);
+
+	mark_metadata();
+
+	run_threads(inode_thread, num_threads);
+	run_threads(block_thread, num_threads);
+
+	if (free_blocks != aux_info.sb->s_free_blocks_count_lo)
+		report("superblock: free block count is %u but the groups have %"PRIu64" free",
+				aux_info.sb->s_free_blocks_count_lo, free_blocks);
+
+	if (free_inodes != aux_info.sb->s_free_inodes_count)
+		report("superblock: free inode count is %u but the groups have %"PRIu64" free",
+				aux_info.sb->s_free_inodes_count, free_inodes);
+
+	if (manifest_entries)
+		run_threads(manifest_thread, num_threads);
+
+	if (verbose || problems)
+		printf("%s: %u problems found, checked %u groups and %u manifest entries\n",
+				in, problems, aux_info.groups, manifest_entries);
+
+	munmap((void *)image, aux_info.len_blocks * info.block_size);
+	close(fd);
+
+	return problems ? EXIT_FAILURE : EXIT_SUCCESS;
+}
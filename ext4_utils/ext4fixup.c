@@ -18,6 +18,7 @@
 #include "ext4_extents.h"
 #include "allocate.h"
 #include "ext4fixup.h"
+#include "metadata_csum.h"
 
 #include <sparse/sparse.h>
 
@@ -73,6 +74,34 @@ static int new_inodes_per_group = 0;
 
 static int no_write_fixup_state = 0;
 
+/* Metadata is read from the device in aligned chunks of this many blocks,
+ * and the most recently used chunks are kept.  Inode tables are read
+ * sequentially this way, and so are directory blocks, which make_ext4fs and
+ * the kernel place close together.  The superblocks and group descriptors
+ * are never read or written through the cache.
+ *
+ * Written blocks stay in the cache until their chunk is evicted or
+ * flush_writes() is called, and then go out in as few writes as possible:
+ * dirty blocks separated by at most WRITE_MAX_GAP clean blocks are written
+ * together.  flush_writes() writes the chunks in block order, and is called
+ * before the fixup state changes, so each state still starts with all
+ * earlier writes done.
+ */
+#define CACHE_CHUNK_BLOCKS 64
+#define CACHE_CHUNKS       16
+#define WRITE_MAX_GAP      4
+
+struct cache_chunk {
+    unsigned long long start;
+    unsigned int blocks; /* 0 if the chunk is unused */
+    unsigned long long dirty; /* one bit per block */
+    unsigned long long last_used;
+    unsigned char *data;
+};
+
+static struct cache_chunk cache_chunks[CACHE_CHUNKS];
+static unsigned long long cache_clock = 0;
+
 static int compute_new_inum(unsigned int old_inum)
 {
     unsigned int group, offset;
@@ -163,72 +192,216 @@ static int set_fs_fixup_state(int fd, int state)
     return 0;
 }
 
-static int read_inode(int fd, unsigned int inum, struct ext4_inode *inode)
+/* Reads count consecutive blocks starting at block_num */
+static void read_blocks(int fd, unsigned long long block_num, unsigned int count, void *buf)
 {
-    unsigned int bg_num, bg_offset;
-    off64_t inode_offset;
-    int len;
+    unsigned char *p = buf;
+    size_t left = (size_t)count * info.block_size;
+    ssize_t len;
 
-    bg_num = (inum-1) / info.inodes_per_group;
-    bg_offset = (inum-1) % info.inodes_per_group;
+    if (lseek64(fd, block_num * info.block_size, SEEK_SET) < 0) {
+        critical_error_errno("failed to seek to block %lld\n", block_num);
+    }
 
-    inode_offset = ((unsigned long long)aux_info.bg_desc[bg_num].bg_inode_table * info.block_size) +
-                    (bg_offset * info.inode_size);
+    while (left > 0) {
+        len = read(fd, p, left);
+        if (len <= 0) {
+            critical_error_errno("failed to read block %lld\n", block_num);
+        }
+        p += len;
+        left -= len;
+    }
+}
+
+/* Writes count consecutive blocks starting at block_num */
+static void write_blocks(int fd, unsigned long long block_num, unsigned int count, const void *buf)
+{
+    const unsigned char *p = buf;
+    size_t left = (size_t)count * info.block_size;
+    ssize_t len;
+
+    if (lseek64(fd, block_num * info.block_size, SEEK_SET) < 0) {
+        critical_error_errno("failed to seek to block %lld\n", block_num);
+    }
 
-    if (lseek64(fd, inode_offset, SEEK_SET) < 0) {
-        critical_error_errno("failed to seek to inode %d\n", inum);
+    while (left > 0) {
+        len = write(fd, p, left);
+        if (len <= 0) {
+            critical_error_errno("failed to write block %lld\n", block_num);
+        }
+        p += len;
+        left -= len;
     }
+}
+
+/* Writes the dirty blocks of a chunk */
+static void write_chunk(int fd, struct cache_chunk *chunk)
+{
+    unsigned int first, last, next;
 
-    len=read(fd, inode, sizeof(*inode));
-    if (len != sizeof(*inode)) {
-        critical_error_errno("failed to read inode %d\n", inum);
+    first = 0;
+    while (chunk->dirty) {
+        while (!(chunk->dirty & (1ULL << first))) {
+            first++;
+        }
+
+        /* Extend the run over short gaps of clean blocks */
+        last = first;
+        for (next = first + 1; next < chunk->blocks && next - last <= WRITE_MAX_GAP + 1; next++) {
+            if (chunk->dirty & (1ULL << next)) {
+                last = next;
+            }
+        }
+
+        write_blocks(fd, chunk->start + first, last - first + 1,
+                     chunk->data + (unsigned long long)first * info.block_size);
+
+        chunk->dirty &= ~(((last == 63) ? ~0ULL : ((1ULL << (last + 1)) - 1)) &
+                          ~((1ULL << first) - 1));
+        first = last + 1;
     }
+}
 
+static int compare_chunks(const void *a, const void *b)
+{
+    const struct cache_chunk *ca = *(const struct cache_chunk * const *)a;
+    const struct cache_chunk *cb = *(const struct cache_chunk * const *)b;
+
+    if (ca->start != cb->start) {
+        return ca->start < cb->start ? -1 : 1;
+    }
     return 0;
 }
 
-static int read_block(int fd, unsigned long long block_num, void *block)
+/* Writes all dirty blocks in the cache, in block order */
+static void flush_writes(int fd)
 {
-    off64_t off;
-    unsigned int len;
+    struct cache_chunk *dirty[CACHE_CHUNKS];
+    unsigned int i, n = 0;
 
-    off = block_num * info.block_size;
+    for (i = 0; i < CACHE_CHUNKS; i++) {
+        if (cache_chunks[i].dirty) {
+            dirty[n++] = &cache_chunks[i];
+        }
+    }
 
-    if (lseek64(fd, off, SEEK_SET) , 0) {
-        critical_error_errno("failed to seek to block %lld\n", block_num);
+    qsort(dirty, n, sizeof(dirty[0]), compare_chunks);
+
+    for (i = 0; i < n; i++) {
+        write_chunk(fd, dirty[i]);
+    }
+}
+
+/* Returns a pointer to the cached contents of block_num, reading the chunk
+ * around it into the least recently used slot if needed
+ */
+static unsigned char *get_cached_block(int fd, unsigned long long block_num)
+{
+    struct cache_chunk *chunk = NULL;
+    unsigned int i;
+
+    for (i = 0; i < CACHE_CHUNKS; i++) {
+        struct cache_chunk *c = &cache_chunks[i];
+
+        if (c->blocks && block_num >= c->start && block_num < c->start + c->blocks) {
+            chunk = c;
+            break;
+        }
     }
 
-    len=read(fd, block, info.block_size);
-    if (len != info.block_size) {
-        critical_error_errno("failed to read block %lld\n", block_num);
+    if (!chunk) {
+        if (block_num >= aux_info.len_blocks) {
+            critical_error("block %lld is past the end of the filesystem\n", block_num);
+        }
+
+        for (i = 0; i < CACHE_CHUNKS; i++) {
+            struct cache_chunk *c = &cache_chunks[i];
+
+            if (!chunk || !c->blocks || (chunk->blocks && c->last_used < chunk->last_used)) {
+                chunk = c;
+            }
+        }
+
+        if (!chunk->data) {
+            chunk->data = malloc(CACHE_CHUNK_BLOCKS * info.block_size);
+            if (!chunk->data) {
+                critical_error("failed to allocate memory for block cache\n");
+            }
+        }
+
+        write_chunk(fd, chunk);
+
+        chunk->blocks = 0;
+        chunk->start = block_num - block_num % CACHE_CHUNK_BLOCKS;
+        if (aux_info.len_blocks - chunk->start < CACHE_CHUNK_BLOCKS) {
+            read_blocks(fd, chunk->start, aux_info.len_blocks - chunk->start, chunk->data);
+            chunk->blocks = aux_info.len_blocks - chunk->start;
+        } else {
+            read_blocks(fd, chunk->start, CACHE_CHUNK_BLOCKS, chunk->data);
+            chunk->blocks = CACHE_CHUNK_BLOCKS;
+        }
     }
 
+    chunk->last_used = ++cache_clock;
+
+    return chunk->data + (block_num - chunk->start) * info.block_size;
+}
+
+static int read_inode(int fd, unsigned int inum, struct ext4_inode *inode)
+{
+    unsigned int bg_num, bg_offset;
+    unsigned long long inode_offset;
+
+    bg_num = (inum-1) / info.inodes_per_group;
+    bg_offset = (inum-1) % info.inodes_per_group;
+
+    inode_offset = ((unsigned long long)aux_info.bg_desc[bg_num].bg_inode_table * info.block_size) +
+                    ((unsigned long long)bg_offset * info.inode_size);
+
+    memcpy(inode, get_cached_block(fd, inode_offset / info.block_size) +
+           inode_offset % info.block_size, sizeof(*inode));
+
+    return 0;
+}
+
+static int read_block(int fd, unsigned long long block_num, void *block)
+{
+    memcpy(block, get_cached_block(fd, block_num), info.block_size);
+
     return 0;
 }
 
 static int write_block(int fd, unsigned long long block_num, void *block)
 {
-    off64_t off;
-    unsigned int len;
+    struct cache_chunk *chunk;
 
     if (no_write) {
         return 0;
     }
 
-    off = block_num * info.block_size;
+    memcpy(get_cached_block(fd, block_num), block, info.block_size);
 
-    if (lseek64(fd, off, SEEK_SET) < 0) {
-        critical_error_errno("failed to seek to block %lld\n", block_num);
-    }
-
-    len=write(fd, block, info.block_size);
-    if (len != info.block_size) {
-        critical_error_errno("failed to write block %lld\n", block_num);
-    }
+    /* get_cached_block() leaves the block's chunk most recently used */
+    for (chunk = cache_chunks; chunk->last_used != cache_clock; chunk++)
+        ;
+    chunk->dirty |= 1ULL << (block_num - chunk->start);
 
     return 0;
 }
 
+/* Drops the block cache, including blocks that were not written yet */
+static void free_fixup_io(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < CACHE_CHUNKS; i++) {
+        free(cache_chunks[i].data);
+        cache_chunks[i].data = NULL;
+        cache_chunks[i].blocks = 0;
+        cache_chunks[i].dirty = 0;
+    }
+}
+
 static void check_inode_bitmap(int fd, unsigned int bg_num)
 {
     unsigned int inode_bitmap_block_num;
@@ -285,8 +458,14 @@ static int update_superblocks_and_bg_desc(int fd, int state)
            aux_info.bg_desc[i].bg_free_inodes_count += (new_inodes_per_group - sb.s_inodes_per_group);
        }
        check_inode_bitmap(fd, i);
+       if (info.feat_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+                                  EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+           aux_info.bg_desc[i].bg_checksum = ext4_group_desc_csum(i, &aux_info.bg_desc[i]);
+       }
     }
 
+    flush_writes(fd);
+
     /* First some sanity checks */
     if ((sb.s_inodes_count + total_new_inodes) != (new_inodes_per_group * num_block_groups)) {
         critical_error("Failed sanity check on new inode count\n");
@@ -517,7 +696,8 @@ static int is_entry_dir(int fd, struct ext4_dir_entry_2 *dirp, int pass)
     return ret;
 }
 
-static int recurse_dir(int fd, struct ext4_inode *inode, char *dirbuf, int dirsize, int mode)
+static int recurse_dir(int fd, unsigned int inum, struct ext4_inode *inode, char *dirbuf,
+                       int dirsize, int mode)
 {
     unsigned long long *block_list;
     unsigned int num_blocks;
@@ -590,6 +770,13 @@ static int recurse_dir(int fd, struct ext4_inode *inode, char *dirbuf, int dirsi
             break;
         }
 
+        if (dirp->inode == 0 && dirp->rec_len == sizeof(struct ext4_dir_entry_tail) &&
+            dirp->file_type == EXT4_FT_DIR_CSUM) {
+            /* Not an entry, but the checksum at the end of a block */
+            dirp = (struct ext4_dir_entry_2*)((char *)dirp + dirp->rec_len);
+            continue;
+        }
+
         if (dirp->inode == 0) {
             /* This is the last entry in the directory */
             break;
@@ -633,7 +820,7 @@ static int recurse_dir(int fd, struct ext4_inode *inode, char *dirbuf, int dirsi
                 critical_error("failed to allocate memory for tmp_dirbuf\n");
             }
 
-            recurse_dir(fd, &tmp_inode, tmp_dirbuf, tmp_dirsize, mode);
+            recurse_dir(fd, dirp->inode & 0x7fffffff, &tmp_inode, tmp_dirbuf, tmp_dirsize, mode);
 
             free(tmp_dirbuf);
         }
@@ -666,6 +853,10 @@ static int recurse_dir(int fd, struct ext4_inode *inode, char *dirbuf, int dirsi
 
     /* Write out all the blocks for this directory */
     for (i = 0; i < num_blocks; i++) {
+        if (has_metadata_csum()) {
+            ext4_update_dir_block_csum(inum, inode->i_generation,
+                                       (u8 *)dirbuf + (i * info.block_size));
+        }
         write_block(fd, block_list[i], dirbuf + (i * info.block_size));
         if ((bail_phase == mode) && (bail_loc == 2) && (bail_count <= count)) {
             critical_error("Bailing at phase %d, loc 2 and count %d\n", mode, count);
@@ -696,6 +887,9 @@ int ext4fixup_internal(char *fsdev, int v_flag, int n_flag,
     verbose = v_flag;
     no_write = n_flag;
 
+    /* Drop state left by an earlier call that failed */
+    free_fixup_io();
+
     bail_phase = stop_phase;
     bail_loc = stop_loc;
     bail_count = stop_count;
@@ -741,6 +935,14 @@ int ext4fixup_internal(char *fsdev, int v_flag, int n_flag,
     /* Compute what the new value of inodes_per_blockgroup will be when we're done */
     new_inodes_per_group=EXT4_ALIGN(info.inodes_per_group,(info.block_size/info.inode_size));
 
+    /* Inode, bitmap and extent block checksums depend on inode numbers, so
+     * only the directory, group descriptor and superblock checksums are kept
+     * up to date, which is enough as long as no inode is renumbered.
+     */
+    if (has_metadata_csum() && (new_inodes_per_group != (int)info.inodes_per_group)) {
+        critical_error("can't renumber inodes of a filesystem with metadata_csum\n");
+    }
+
     read_inode(fd, EXT4_ROOT_INO, &root_inode);
 
     if (!S_ISDIR(root_inode.i_mode)) {
@@ -774,7 +976,7 @@ int ext4fixup_internal(char *fsdev, int v_flag, int n_flag,
     if (get_fs_fixup_state(fd) == STATE_UNSET) {
         verbose = 0;
         no_write = 1;
-        recurse_dir(fd, &root_inode, dirbuf, dirsize, SANITY_CHECK_PASS);
+        recurse_dir(fd, EXT4_ROOT_INO, &root_inode, dirbuf, dirsize, SANITY_CHECK_PASS);
         update_superblocks_and_bg_desc(fd, STATE_UNSET);
         verbose = v_flag;
         no_write = n_flag;
@@ -784,14 +986,16 @@ int ext4fixup_internal(char *fsdev, int v_flag, int n_flag,
 
     if (get_fs_fixup_state(fd) == STATE_MARKING_INUMS) {
         count = 0; /* Reset debugging counter */
-        if (!recurse_dir(fd, &root_inode, dirbuf, dirsize, MARK_INODE_NUMS)) {
+        if (!recurse_dir(fd, EXT4_ROOT_INO, &root_inode, dirbuf, dirsize, MARK_INODE_NUMS)) {
+            flush_writes(fd);
             set_fs_fixup_state(fd, STATE_UPDATING_INUMS);
         }
     }
 
     if (get_fs_fixup_state(fd) == STATE_UPDATING_INUMS) {
         count = 0; /* Reset debugging counter */
-        if (!recurse_dir(fd, &root_inode, dirbuf, dirsize, UPDATE_INODE_NUMS)) {
+        if (!recurse_dir(fd, EXT4_ROOT_INO, &root_inode, dirbuf, dirsize, UPDATE_INODE_NUMS)) {
+            flush_writes(fd);
             set_fs_fixup_state(fd, STATE_UPDATING_SB);
         }
     }
@@ -807,6 +1011,7 @@ int ext4fixup_internal(char *fsdev, int v_flag, int n_flag,
 
     close(fd);
     free(dirbuf);
+    free_fixup_io();
 
     return 0;
 }
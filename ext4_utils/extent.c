@@ -16,6 +16,7 @@
 
 #include "ext4_utils.h"
 #include "extent.h"
+#include "metadata_csum.h"
 
 #include <sparse/sparse.h>
 
@@ -64,8 +65,7 @@ static void extent_create_backing_file(struct block_allocation *alloc,
 
 		len = min(region_len * info.block_size, backing_len);
 
-		sparse_file_add_file(ext4_sparse_file, filename, offset, len,
-				region_block);
+		queue_file_data(filename, offset, len, region_block);
 		offset += len;
 		backing_len -= len;
 	}
@@ -146,6 +146,7 @@ static struct block_allocation *do_inode_allocate_extents(
 
 		sparse_file_add_data(ext4_sparse_file, data, info.block_size,
 				extent_block);
+		csum_add_extent_block(inode, data);
 
 		if (((int)(info.block_size - sizeof(struct ext4_extent_header) /
 				sizeof(struct ext4_extent))) < allocation_len) {
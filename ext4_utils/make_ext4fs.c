@@ -18,6 +18,8 @@
 #include "ext4_utils.h"
 #include "allocate.h"
 #include "contents.h"
+#include "metadata_csum.h"
+#include "sha1.h"
 #include "wipe.h"
 
 #include <sparse/sparse.h>
@@ -72,6 +74,7 @@
 
 #else
 
+#include <pthread.h>
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 
@@ -136,142 +139,478 @@ static u32 build_default_directory_structure(const char *dir_path,
 }
 
 #ifndef USE_MINGW
-/* Read a local directory and create the same tree in the generated filesystem.
-   Calls itself recursively with each directory in the given directory.
-   full_path is an absolute or relative path, with a trailing slash, to the
-   directory on disk that should be copied, or NULL if this is a directory
-   that does not exist on disk (e.g. lost+found).
-   dir_path is an absolute path, with trailing slash, to the same directory
-   if the image were mounted at the specified mount point */
-static u32 build_directory_structure(const char *full_path, const char *dir_path, const char *target_out_path,
-		u32 dir_inode, fs_config_func_t fs_config_func,
-		struct selabel_handle *sehnd, int verbose, time_t fixed_time)
-{
-	int entries = 0;
+/* Maximum number of threads that read the staging directory */
+#define WALK_MAX_THREADS 32
+
+/* The staging directory is copied in two passes. walk_directory reads the
+   whole tree into memory with a pool of threads, doing the lstat, readlink,
+   fs_config and SELinux label lookups for each entry, and then
+   build_directory_structure allocates inodes and blocks for it on a single
+   thread, in the same order as if the tree had been read while building it,
+   so that the image doesn't depend on the order in which the threads ran.
+   The walker threads can't report errors, because error() longjmps, so they
+   are recorded with the entries and reported in the second pass. */
+struct walk_dir;
+
+struct walk_entry {
+	int lstat_errno;
+	bool label_failed;
+	bool unknown_type;
+	/* digest of the contents of a regular file, if hashed */
+	bool hashed;
+	u8 digest[SHA1_DIGEST_LENGTH];
+	struct walk_dir *subdir;
+};
+
+struct walk_dir {
+	char *full_path;
+	char *dir_path;
+	int scandir_errno;
+	int entries;
 	struct dentry *dentries;
+	struct walk_entry *walk;
+};
+
+struct walk_ctx {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* selabel_lookup is not thread-safe */
+	pthread_mutex_t label_mutex;
+	struct walk_dir **queue;
+	int queued;
+	int queue_size;
+	int active;
+	bool out_of_memory;
+	const char *target_out_path;
+	fs_config_func_t fs_config_func;
+	struct selabel_handle *sehnd;
+	time_t fixed_time;
+	bool hash_contents;
+};
+
+static struct walk_dir *walk_dir_alloc(const char *full_path, const char *dir_path)
+{
+	struct walk_dir *dir = calloc(1, sizeof(struct walk_dir));
+	if (dir == NULL)
+		return NULL;
+
+	if ((full_path && asprintf(&dir->full_path, "%s/", full_path) < 0) ||
+			asprintf(&dir->dir_path, "%s/", dir_path) < 0) {
+		free(dir->full_path);
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+static void walk_dir_free(struct walk_dir *dir)
+{
+	int i;
+
+	if (dir == NULL)
+		return;
+
+	for (i = 0; i < dir->entries; i++) {
+		free(dir->dentries[i].path);
+		free(dir->dentries[i].full_path);
+		free(dir->dentries[i].link);
+		free((void *)dir->dentries[i].filename);
+		free(dir->dentries[i].secon);
+		walk_dir_free(dir->walk[i].subdir);
+	}
+
+	free(dir->dentries);
+	free(dir->walk);
+	free(dir->full_path);
+	free(dir->dir_path);
+	free(dir);
+}
+
+/* adds a directory for the walker threads to read, called with ctx->mutex
+   held */
+static bool walk_queue_push(struct walk_ctx *ctx, struct walk_dir *dir)
+{
+	if (ctx->queued == ctx->queue_size) {
+		int size = ctx->queue_size ? ctx->queue_size * 2 : 64;
+		struct walk_dir **queue = realloc(ctx->queue, size * sizeof(struct walk_dir *));
+		if (queue == NULL)
+			return false;
+		ctx->queue = queue;
+		ctx->queue_size = size;
+	}
+
+	ctx->queue[ctx->queued++] = dir;
+	pthread_cond_signal(&ctx->cond);
+	return true;
+}
+
+/* Computes the SHA1 digest of the contents of a file, returns false if the
+   file can't be read */
+static bool walk_hash_file(const char *filename, u8 *digest)
+{
+	u8 buf[16384];
+	SHA1_CTX ctx;
+	ssize_t ret;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return false;
+
+	SHA1Init(&ctx);
+	while ((ret = read(fd, buf, sizeof(buf))) != 0) {
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return false;
+		}
+		SHA1Update(&ctx, buf, ret);
+	}
+	SHA1Final(digest, &ctx);
+
+	close(fd);
+	return true;
+}
+
+/* Reads the entries of a directory and their metadata into dir, and queues
+   its subdirectories. Returns false if memory allocation fails. */
+static bool walk_scan_dir(struct walk_ctx *ctx, struct walk_dir *dir)
+{
 	struct dirent **namelist = NULL;
 	struct stat stat;
-	int ret;
+	int entries;
 	int i;
-	u32 inode;
-	u32 entry_inode;
-	u32 dirs = 0;
-	bool needs_lost_and_found = false;
+	bool ok = true;
 
-	if (full_path) {
-		entries = scandir(full_path, &namelist, filter_dot, (void*)alphasort);
-		if (entries < 0) {
+	if (dir->full_path == NULL)
+		return true;
+
+	entries = scandir(dir->full_path, &namelist, filter_dot, (void*)alphasort);
+	if (entries < 0) {
 #ifdef __GLIBC__
-			/* The scandir function implemented in glibc has a bug that makes it
-			   erroneously fail with ENOMEM under certain circumstances.
-			   As a workaround we can retry the scandir call with the same arguments.
-			   GLIBC BZ: https://sourceware.org/bugzilla/show_bug.cgi?id=17804 */
-			if (errno == ENOMEM)
-				entries = scandir(full_path, &namelist, filter_dot, (void*)alphasort);
+		/* The scandir function implemented in glibc has a bug that makes it
+		   erroneously fail with ENOMEM under certain circumstances.
+		   As a workaround we can retry the scandir call with the same arguments.
+		   GLIBC BZ: https://sourceware.org/bugzilla/show_bug.cgi?id=17804 */
+		if (errno == ENOMEM)
+			entries = scandir(dir->full_path, &namelist, filter_dot, (void*)alphasort);
 #endif
-			if (entries < 0) {
-				error_errno("scandir");
-				return EXT4_ALLOCATE_FAILED;
-			}
+		if (entries < 0) {
+			dir->scandir_errno = errno;
+			return true;
 		}
 	}
 
-	if (dir_inode == 0) {
-		/* root directory, check if lost+found already exists */
+	dir->dentries = calloc(entries, sizeof(struct dentry));
+	dir->walk = calloc(entries, sizeof(struct walk_entry));
+	if (entries && (dir->dentries == NULL || dir->walk == NULL)) {
 		for (i = 0; i < entries; i++)
-			if (strcmp(namelist[i]->d_name, "lost+found") == 0)
-				break;
-		if (i == entries)
-			needs_lost_and_found = true;
+			free(namelist[i]);
+		free(namelist);
+		return false;
 	}
-
-	dentries = calloc(entries, sizeof(struct dentry));
-	if (dentries == NULL)
-		critical_error_errno("malloc");
+	dir->entries = entries;
 
 	for (i = 0; i < entries; i++) {
-		dentries[i].filename = strdup(namelist[i]->d_name);
-		if (dentries[i].filename == NULL)
-			critical_error_errno("strdup");
-
-		asprintf(&dentries[i].path, "%s%s", dir_path, namelist[i]->d_name);
-		asprintf(&dentries[i].full_path, "%s%s", full_path, namelist[i]->d_name);
+		struct dentry *dentry = &dir->dentries[i];
+		struct walk_entry *walk = &dir->walk[i];
+
+		dentry->filename = strdup(namelist[i]->d_name);
+		if (dentry->filename == NULL ||
+				asprintf(&dentry->path, "%s%s", dir->dir_path, namelist[i]->d_name) < 0 ||
+				asprintf(&dentry->full_path, "%s%s", dir->full_path, namelist[i]->d_name) < 0) {
+			ok = false;
+			break;
+		}
 
 		free(namelist[i]);
+		namelist[i] = NULL;
 
-		ret = lstat(dentries[i].full_path, &stat);
-		if (ret < 0) {
-			error_errno("lstat");
-			i--;
-			entries--;
+		if (lstat(dentry->full_path, &stat) < 0) {
+			walk->lstat_errno = errno;
 			continue;
 		}
 
-		dentries[i].size = stat.st_size;
-		dentries[i].mode = stat.st_mode & (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
-		if (fixed_time == -1) {
-			dentries[i].mtime = stat.st_mtime;
+		dentry->size = stat.st_size;
+		dentry->mode = stat.st_mode & (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
+		if (ctx->fixed_time == -1) {
+			dentry->mtime = stat.st_mtime;
 		} else {
-			dentries[i].mtime = fixed_time;
+			dentry->mtime = ctx->fixed_time;
 		}
-		uint64_t capabilities;
-		if (fs_config_func != NULL) {
 #ifdef ANDROID
+		if (ctx->fs_config_func != NULL) {
 			unsigned int mode = 0;
 			unsigned int uid = 0;
 			unsigned int gid = 0;
-			int dir = S_ISDIR(stat.st_mode);
-			fs_config_func(dentries[i].path, dir, target_out_path, &uid, &gid, &mode, &capabilities);
-			dentries[i].mode = mode;
-			dentries[i].uid = uid;
-			dentries[i].gid = gid;
-			dentries[i].capabilities = capabilities;
-#else
-			error("can't set android permissions - built without android support");
-#endif
-		}
-#ifndef USE_MINGW
-		if (sehnd) {
-			if (selabel_lookup(sehnd, &dentries[i].secon, dentries[i].path, stat.st_mode) < 0) {
-				error("cannot lookup security context for %s", dentries[i].path);
-			}
-
-			if (dentries[i].secon && verbose)
-				printf("Labeling %s as %s\n", dentries[i].path, dentries[i].secon);
+			uint64_t capabilities;
+			int is_dir = S_ISDIR(stat.st_mode);
+			ctx->fs_config_func(dentry->path, is_dir, ctx->target_out_path, &uid, &gid, &mode, &capabilities);
+			dentry->mode = mode;
+			dentry->uid = uid;
+			dentry->gid = gid;
+			dentry->capabilities = capabilities;
 		}
 #endif
+		if (ctx->sehnd) {
+			pthread_mutex_lock(&ctx->label_mutex);
+			if (selabel_lookup(ctx->sehnd, &dentry->secon, dentry->path, stat.st_mode) < 0)
+				walk->label_failed = true;
+			pthread_mutex_unlock(&ctx->label_mutex);
+		}
 
 		if (S_ISREG(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_REG_FILE;
+			dentry->file_type = EXT4_FT_REG_FILE;
+			if (ctx->hash_contents && stat.st_size > 0)
+				walk->hashed = walk_hash_file(dentry->full_path, walk->digest);
 		} else if (S_ISDIR(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_DIR;
-			dirs++;
+			dentry->file_type = EXT4_FT_DIR;
+			walk->subdir = walk_dir_alloc(dentry->full_path, dentry->path);
+			if (walk->subdir == NULL) {
+				ok = false;
+				break;
+			}
+			pthread_mutex_lock(&ctx->mutex);
+			ok = walk_queue_push(ctx, walk->subdir);
+			pthread_mutex_unlock(&ctx->mutex);
+			if (!ok)
+				break;
 		} else if (S_ISCHR(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_CHRDEV;
+			dentry->file_type = EXT4_FT_CHRDEV;
 		} else if (S_ISBLK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_BLKDEV;
+			dentry->file_type = EXT4_FT_BLKDEV;
 		} else if (S_ISFIFO(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_FIFO;
+			dentry->file_type = EXT4_FT_FIFO;
 		} else if (S_ISSOCK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_SOCK;
+			dentry->file_type = EXT4_FT_SOCK;
 		} else if (S_ISLNK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_SYMLINK;
-			dentries[i].link = calloc(info.block_size, 1);
-			readlink(dentries[i].full_path, dentries[i].link, info.block_size - 1);
+			dentry->file_type = EXT4_FT_SYMLINK;
+			dentry->link = calloc(info.block_size, 1);
+			if (dentry->link == NULL) {
+				ok = false;
+				break;
+			}
+			readlink(dentry->full_path, dentry->link, info.block_size - 1);
 		} else {
-			error("unknown file type on %s", dentries[i].path);
-			i--;
-			entries--;
+			walk->unknown_type = true;
 		}
 	}
+
+	for (i = 0; i < entries; i++)
+		free(namelist[i]);
 	free(namelist);
 
+	return ok;
+}
+
+static void *walk_thread(void *arg)
+{
+	struct walk_ctx *ctx = arg;
+	struct walk_dir *dir;
+
+	pthread_mutex_lock(&ctx->mutex);
+	while (true) {
+		while (ctx->queued == 0 && ctx->active > 0 && !ctx->out_of_memory)
+			pthread_cond_wait(&ctx->cond, &ctx->mutex);
+
+		if (ctx->queued == 0 || ctx->out_of_memory)
+			break;
+
+		dir = ctx->queue[--ctx->queued];
+		ctx->active++;
+		pthread_mutex_unlock(&ctx->mutex);
+
+		bool ok = walk_scan_dir(ctx, dir);
+
+		pthread_mutex_lock(&ctx->mutex);
+		ctx->active--;
+		if (!ok)
+			ctx->out_of_memory = true;
+		if (ctx->active == 0 || !ok)
+			pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	return NULL;
+}
+
+static int walk_num_threads()
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads < 1)
+		return 1;
+	if (threads > WALK_MAX_THREADS)
+		return WALK_MAX_THREADS;
+	return threads;
+}
+
+/* Reads the directory tree at full_path, an absolute or relative path with a
+   trailing slash, into memory using a pool of threads. dir_path is the same
+   directory if the image were mounted at the specified mount point. If
+   hash_contents is set, regular files are also hashed for
+   make_shared_file. */
+static struct walk_dir *walk_directory(const char *full_path, const char *dir_path,
+		const char *target_out_path, fs_config_func_t fs_config_func,
+		struct selabel_handle *sehnd, time_t fixed_time, bool hash_contents)
+{
+	struct walk_ctx ctx;
+	pthread_t threads[WALK_MAX_THREADS];
+	int num_threads = walk_num_threads();
+	int started = 0;
+	int i;
+
+	struct walk_dir *root = calloc(1, sizeof(struct walk_dir));
+	if (root == NULL)
+		critical_error_errno("malloc");
+	root->full_path = strdup(full_path);
+	root->dir_path = strdup(dir_path);
+	if (root->full_path == NULL || root->dir_path == NULL)
+		critical_error_errno("strdup");
+
+#ifndef ANDROID
+	if (fs_config_func != NULL)
+		error("can't set android permissions - built without android support");
+#endif
+
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.mutex, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	pthread_mutex_init(&ctx.label_mutex, NULL);
+	ctx.target_out_path = target_out_path;
+	ctx.fs_config_func = fs_config_func;
+	ctx.sehnd = sehnd;
+	ctx.fixed_time = fixed_time;
+	ctx.hash_contents = hash_contents;
+
+	if (!walk_queue_push(&ctx, root))
+		critical_error_errno("malloc");
+
+	/* the calling thread is one of the walkers */
+	for (i = 1; i < num_threads; i++) {
+		if (pthread_create(&threads[started], NULL, walk_thread, &ctx) != 0)
+			break;
+		started++;
+	}
+
+	walk_thread(&ctx);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&ctx.label_mutex);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.mutex);
+	free(ctx.queue);
+
+	if (ctx.out_of_memory) {
+		walk_dir_free(root);
+		errno = ENOMEM;
+		critical_error_errno("malloc");
+	}
+
+	return root;
+}
+
+/* Create the tree read by walk_directory in the generated filesystem.
+   Calls itself recursively with each directory in the given directory.
+   dir is NULL for a directory that does not exist on disk
+   (e.g. lost+found). */
+static u32 build_directory_structure(struct walk_dir *dir, const char *dir_path,
+		u32 dir_inode, struct selabel_handle *sehnd, int verbose)
+{
+	int entries = 0;
+	struct dentry *dentries = NULL;
+	struct walk_entry *walk = NULL;
+	int ret;
+	int i;
+	u32 inode;
+	u32 entry_inode;
+	u32 dirs = 0;
+	bool needs_lost_and_found = false;
+
+	if (dir) {
+		if (dir->scandir_errno) {
+			errno = dir->scandir_errno;
+			error_errno("scandir");
+			return EXT4_ALLOCATE_FAILED;
+		}
+		entries = dir->entries;
+		dentries = dir->dentries;
+		walk = dir->walk;
+	}
+
+	if (dir_inode == 0) {
+		/* root directory, check if lost+found already exists */
+		for (i = 0; i < entries; i++)
+			if (strcmp(dentries[i].filename, "lost+found") == 0)
+				break;
+		if (i == entries)
+			needs_lost_and_found = true;
+	}
+
+	/* report the errors found while reading the directory, and drop the
+	   entries that can't be copied */
+	for (i = 0; i < entries; ) {
+		bool skip = false;
+
+		if (walk[i].lstat_errno) {
+			errno = walk[i].lstat_errno;
+			error_errno("lstat");
+			skip = true;
+		} else {
+			if (walk[i].label_failed)
+				error("cannot lookup security context for %s", dentries[i].path);
+
+			if (dentries[i].secon && verbose)
+				printf("Labeling %s as %s\n", dentries[i].path, dentries[i].secon);
+
+			if (walk[i].unknown_type) {
+				error("unknown file type on %s", dentries[i].path);
+				skip = true;
+			}
+		}
+
+		if (skip) {
+			free(dentries[i].path);
+			free(dentries[i].full_path);
+			free(dentries[i].link);
+			free((void *)dentries[i].filename);
+			free(dentries[i].secon);
+			walk_dir_free(walk[i].subdir);
+			entries--;
+			memmove(&dentries[i], &dentries[i + 1], (entries - i) * sizeof(struct dentry));
+			memmove(&walk[i], &walk[i + 1], (entries - i) * sizeof(struct walk_entry));
+			continue;
+		}
+
+		if (dentries[i].file_type == EXT4_FT_DIR)
+			dirs++;
+		i++;
+	}
+
+	if (dir)
+		dir->entries = entries;
+
 	if (needs_lost_and_found) {
 		/* insert a lost+found directory at the beginning of the dentries */
 		struct dentry *tmp = calloc(entries + 1, sizeof(struct dentry));
-		memset(tmp, 0, sizeof(struct dentry));
+		struct walk_entry *tmp_walk = calloc(entries + 1, sizeof(struct walk_entry));
+		if (tmp == NULL || tmp_walk == NULL)
+			critical_error_errno("malloc");
 		memcpy(tmp + 1, dentries, entries * sizeof(struct dentry));
+		memcpy(tmp_walk + 1, walk, entries * sizeof(struct walk_entry));
+		free(dentries);
+		free(walk);
 		dentries = tmp;
+		walk = tmp_walk;
+		if (dir) {
+			dir->dentries = dentries;
+			dir->walk = walk;
+		}
 
 		dentries[0].filename = strdup("lost+found");
 		asprintf(&dentries[0].path, "%slost+found", dir_path);
@@ -287,27 +626,26 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 		}
 		entries++;
 		dirs++;
+		if (dir)
+			dir->entries = entries;
 	}
 
 	inode = make_directory(dir_inode, entries, dentries, dirs);
 
 	for (i = 0; i < entries; i++) {
 		if (dentries[i].file_type == EXT4_FT_REG_FILE) {
-			entry_inode = make_file(dentries[i].full_path, dentries[i].size);
+			if (walk[i].hashed)
+				entry_inode = make_shared_file(dentries[i].full_path,
+						dentries[i].size, walk[i].digest);
+			else
+				entry_inode = make_file(dentries[i].full_path, dentries[i].size);
 		} else if (dentries[i].file_type == EXT4_FT_DIR) {
-			char *subdir_full_path = NULL;
 			char *subdir_dir_path;
-			if (dentries[i].full_path) {
-				ret = asprintf(&subdir_full_path, "%s/", dentries[i].full_path);
-				if (ret < 0)
-					critical_error_errno("asprintf");
-			}
 			ret = asprintf(&subdir_dir_path, "%s/", dentries[i].path);
 			if (ret < 0)
 				critical_error_errno("asprintf");
-			entry_inode = build_directory_structure(subdir_full_path, subdir_dir_path, target_out_path,
-					inode, fs_config_func, sehnd, verbose, fixed_time);
-			free(subdir_full_path);
+			entry_inode = build_directory_structure(walk[i].subdir, subdir_dir_path,
+					inode, sehnd, verbose);
 			free(subdir_dir_path);
 		} else if (dentries[i].file_type == EXT4_FT_SYMLINK) {
 			entry_inode = make_link(dentries[i].link);
@@ -337,14 +675,11 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 		if (ret)
 			error("failed to set capability on %s\n", dentries[i].path);
 
-		free(dentries[i].path);
-		free(dentries[i].full_path);
-		free(dentries[i].link);
-		free((void *)dentries[i].filename);
-		free(dentries[i].secon);
+		/* the subdirectory is done, release it early */
+		walk_dir_free(walk[i].subdir);
+		walk[i].subdir = NULL;
 	}
 
-	free(dentries);
 	return inode;
 }
 #endif
@@ -416,6 +751,8 @@ void reset_ext4fs_info() {
 		sparse_file_destroy(ext4_sparse_file);
 		ext4_sparse_file = NULL;
 	}
+	free_file_data();
+	free_metadata_csums();
 }
 
 int make_ext4fs_sparse_fd(int fd, long long len,
@@ -433,7 +770,7 @@ int make_ext4fs_sparse_fd_directory(int fd, long long len,
 
 	return make_ext4fs_internal(fd, directory, NULL, mountpoint, NULL,
 								0, 1, 0, 0, 0,
-								sehnd, 0, -1, NULL, NULL, NULL);
+								sehnd, 0, -1, NULL, NULL, NULL, NULL, 0, -1);
 }
 
 int make_ext4fs(const char *filename, long long len,
@@ -460,7 +797,7 @@ int make_ext4fs_directory(const char *filename, long long len,
 
 	status = make_ext4fs_internal(fd, directory, NULL, mountpoint, NULL,
 								  0, 0, 0, 1, 0,
-								  sehnd, 0, -1, NULL, NULL, NULL);
+								  sehnd, 0, -1, NULL, NULL, NULL, NULL, 0, -1);
 	close(fd);
 
 	return status;
@@ -659,6 +996,189 @@ static void extract_base_fs_allocations(const char *directory, const char *mount
 #undef err_msg
 }
 
+/* A file read during boot, and how much of it was read */
+struct access_entry {
+	char *filename;
+	u32 order;
+	u64 end;
+};
+
+static int compare_access_names(const void *a, const void *b) {
+	const struct access_entry *e1 = a;
+	const struct access_entry *e2 = b;
+	int ret = strcmp(e1->filename, e2->filename);
+	if (ret)
+		return ret;
+	return e1->order < e2->order ? -1 : e1->order > e2->order;
+}
+
+static int compare_access_order(const void *a, const void *b) {
+	const struct access_entry *e1 = a;
+	const struct access_entry *e2 = b;
+	return e1->order < e2->order ? -1 : e1->order > e2->order;
+}
+
+/* Reads a list of the files read during boot, as captured from the page cache
+   or the mm_filemap tracepoints, and allocates one contiguous run of blocks
+   holding the part of each file that was read, in the order the files were
+   first read.  Readahead during a cold boot then reads the image mostly
+   sequentially, and the small files read together end up next to each
+   other.  Each line of the list is
+       <path> [<offset> [<length>]]
+   with the path on the device, and the byte range that was read; a line
+   without a range stands for the whole file, and one without a length for
+   one block.  The rest of a file that was only read up to some offset is
+   allocated as usual when the file is created */
+static void extract_access_order_allocations(const char *directory, const char *mountpoint,
+										FILE* access_order_file) {
+#ifndef USE_MINGW
+	struct access_entry *entries = NULL;
+	struct block_allocation *hot, *fs_alloc, *last_alloc = NULL;
+	struct region *reg;
+	u32 reg_used = 0;
+	size_t count = 0, max_count = 0;
+	size_t i, j;
+	u64 total_blocks = 0;
+	char *line = NULL;
+	size_t line_len = 0;
+
+	while (getline(&line, &line_len, access_order_file) != -1) {
+		char *name = malloc(strlen(line) + 1);
+		u64 offset, length;
+		int n;
+
+		if (name == NULL)
+			critical_error_errno("malloc");
+		n = sscanf(line, "%s %"SCNu64" %"SCNu64, name, &offset, &length);
+		if (n < 1 || name[0] == '#' || strlen(name) < strlen(mountpoint) ||
+				strncmp(name, mountpoint, strlen(mountpoint))) {
+			free(name);
+			continue;
+		}
+
+		if (count == max_count) {
+			max_count = max_count ? max_count * 2 : 256;
+			entries = realloc(entries, max_count * sizeof(struct access_entry));
+			if (entries == NULL)
+				critical_error_errno("realloc");
+		}
+		entries[count].filename = name;
+		entries[count].order = count;
+		if (n == 1)
+			entries[count].end = UINT64_MAX;
+		else if (n == 2)
+			entries[count].end = offset + info.block_size;
+		else
+			entries[count].end = offset + length;
+		count++;
+	}
+	free(line);
+
+	/* keep the first line of each file, with the furthest offset read */
+	qsort(entries, count, sizeof(struct access_entry), compare_access_names);
+	for (i = 0, j = 0; i < count; i++) {
+		if (j > 0 && !strcmp(entries[j - 1].filename, entries[i].filename)) {
+			if (entries[i].end > entries[j - 1].end)
+				entries[j - 1].end = entries[i].end;
+			free(entries[i].filename);
+		} else {
+			entries[j++] = entries[i];
+		}
+	}
+	count = j;
+	qsort(entries, count, sizeof(struct access_entry), compare_access_order);
+
+	/* replace the ranges with the number of blocks read from each file */
+	for (i = 0; i < count; i++) {
+		char *real_file_name;
+		struct stat st;
+		u64 end = 0;
+
+		if (asprintf(&real_file_name, "%s%s", directory,
+				entries[i].filename + strlen(mountpoint)) < 0)
+			critical_error_errno("asprintf");
+		free(entries[i].filename);
+		entries[i].filename = real_file_name;
+
+		if (!lstat(real_file_name, &st) && S_ISREG(st.st_mode))
+			end = entries[i].end < (u64)st.st_size ? entries[i].end : (u64)st.st_size;
+		entries[i].end = DIV_ROUND_UP(end, info.block_size);
+		total_blocks += entries[i].end;
+	}
+
+	if (total_blocks == 0 || total_blocks > aux_info.len_blocks ||
+			(hot = allocate_blocks(total_blocks)) == NULL) {
+		if (total_blocks)
+			fprintf(stderr, "Warning: failed to allocate %"PRIu64" blocks for the files "
+					"in the access order list, ignoring it\n", total_blocks);
+		goto out;
+	}
+
+	printf("Placing %"PRIu64" blocks of %zu files in access order in %d regions\n",
+			total_blocks, count, block_allocation_num_regions(hot));
+
+	/* hand out the blocks to the files, which pick them up from the base fs
+	   allocations when they are created */
+	reg = hot->list.first;
+	for (i = 0; i < count; i++) {
+		u32 blocks = entries[i].end;
+
+		if (blocks == 0)
+			continue;
+
+		fs_alloc = create_allocation();
+		fs_alloc->filename = entries[i].filename;
+		entries[i].filename = NULL;
+		while (blocks) {
+			u32 len = reg->len - reg_used;
+			if (len > blocks)
+				len = blocks;
+			append_region(fs_alloc, reg->block + reg_used, len, reg->bg);
+			blocks -= len;
+			reg_used += len;
+			if (reg_used == reg->len) {
+				reg = reg->next;
+				reg_used = 0;
+			}
+		}
+
+		if (last_alloc)
+			last_alloc->next = fs_alloc;
+		else
+			base_fs_allocations = fs_alloc;
+		last_alloc = fs_alloc;
+	}
+
+	/* the blocks now belong to the allocations of the files */
+	free_alloc(hot);
+
+out:
+	for (i = 0; i < count; i++)
+		free(entries[i].filename);
+	free(entries);
+#else
+    return;
+#endif
+}
+
+/* Releases the blocks of the base fs allocations no file was created for,
+   like the blocks of a file that got the blocks of another file with the
+   same contents, so they don't stay allocated without an owner */
+static void free_unused_base_fs_allocations() {
+	struct block_allocation *p = base_fs_allocations;
+
+	while (p) {
+		struct block_allocation *pn = p->next;
+		int len = block_allocation_len(p);
+		if (len > 0)
+			reduce_allocation(p, len);
+		free(p->filename);
+		free_alloc(p);
+		p = pn;
+	}
+	base_fs_allocations = NULL;
+}
+
 void generate_base_alloc_file_out(FILE* base_alloc_file_out, char* dir, char* mountpoint,
 								  struct block_allocation* p)
 {
@@ -682,7 +1202,8 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 						 const char *_mountpoint, fs_config_func_t fs_config_func, int gzip,
 						 int sparse, int crc, int wipe, int real_uuid,
 						 struct selabel_handle *sehnd, int verbose, time_t fixed_time,
-						 FILE* block_list_file, FILE* base_alloc_file_in, FILE* base_alloc_file_out)
+						 FILE* block_list_file, FILE* base_alloc_file_in, FILE* base_alloc_file_out,
+						 FILE* access_order_file, int share_blocks, int prev_image_fd)
 {
 	u32 root_inode_num;
 	u16 root_mode;
@@ -716,6 +1237,23 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 		return EXIT_FAILURE;
 	}
 
+	/* An incremental image only holds the blocks that differ from the
+	   previous image, and skips the rest */
+	if (prev_image_fd >= 0) {
+		if (!sparse) {
+			fprintf(stderr, "An incremental image must be sparse\n");
+			return EXIT_FAILURE;
+		}
+		if (wipe) {
+			fprintf(stderr, "An incremental image can't be written after wiping\n");
+			return EXIT_FAILURE;
+		}
+		if (get_file_size(prev_image_fd) != (u64)info.len) {
+			fprintf(stderr, "The previous image must be a raw image of the same size\n");
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (info.block_size <= 0)
 		info.block_size = compute_block_size();
 
@@ -739,6 +1277,14 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 	if (info.inode_size <= 0)
 		info.inode_size = 256;
 
+	/* Inline data needs room for the system.data attribute in the inode */
+	if ((info.feat_incompat & EXT4_FEATURE_INCOMPAT_INLINE_DATA) &&
+			info.inode_size <= EXT4_GOOD_OLD_INODE_SIZE) {
+		fprintf(stderr, "Warning: inline data needs inodes larger than %d bytes, ignoring -n\n",
+				EXT4_GOOD_OLD_INODE_SIZE);
+		info.feat_incompat &= ~EXT4_FEATURE_INCOMPAT_INLINE_DATA;
+	}
+
 	if (info.label == NULL)
 		info.label = "";
 
@@ -750,13 +1296,35 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 
 	info.feat_ro_compat |=
 			EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER |
-			EXT4_FEATURE_RO_COMPAT_LARGE_FILE |
-			EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+			EXT4_FEATURE_RO_COMPAT_LARGE_FILE;
+
+	/* metadata_csum replaces the crc16 group descriptor checksums */
+	if (!(info.feat_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM))
+		info.feat_ro_compat |= EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
 
 	info.feat_incompat |=
 			EXT4_FEATURE_INCOMPAT_EXTENTS |
 			EXT4_FEATURE_INCOMPAT_FILETYPE;
 
+	/* Files with the same contents can only share blocks if the image is
+	   never written to, and a base fs maps each file to its own blocks */
+	if (share_blocks && !info.no_journal) {
+		fprintf(stderr, "Warning: sharing blocks needs an image without a journal (-J), copying files instead\n");
+		share_blocks = 0;
+	}
+	if (share_blocks && base_alloc_file_in) {
+		fprintf(stderr, "Warning: can't share blocks with a base fs (-d), copying files instead\n");
+		share_blocks = 0;
+	}
+	if (share_blocks)
+		info.feat_ro_compat |= EXT4_FEATURE_RO_COMPAT_SHARED_BLOCKS;
+
+	/* A base fs already decides where the files go */
+	if (access_order_file && base_alloc_file_in) {
+		fprintf(stderr, "Warning: can't place files in access order with a base fs (-d), ignoring -A\n");
+		access_order_file = NULL;
+	}
+
 
 	info.bg_desc_reserve_blocks = compute_bg_desc_reserve_blocks();
 
@@ -784,6 +1352,9 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 	if (base_alloc_file_in) {
 		extract_base_fs_allocations(directory, mountpoint, base_alloc_file_in);
 	}
+	if (access_order_file && directory) {
+		extract_access_order_allocations(directory, mountpoint, access_order_file);
+	}
 	if (reserve_inodes(0, 10) == EXT4_ALLOCATE_FAILED)
 		error("failed to reserve first 10 inodes");
 
@@ -798,10 +1369,14 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 	assert(!directory);
 	root_inode_num = build_default_directory_structure(mountpoint, sehnd);
 #else
-	if (directory)
-		root_inode_num = build_directory_structure(directory, mountpoint, target_out_directory, 0,
-			fs_config_func, sehnd, verbose, fixed_time);
-	else
+	if (directory) {
+		struct walk_dir *root = walk_directory(directory, mountpoint, target_out_directory,
+			fs_config_func, sehnd, fixed_time, share_blocks);
+		root_inode_num = build_directory_structure(root, mountpoint, 0, sehnd, verbose);
+		walk_dir_free(root);
+		free_shared_files();
+		free_unused_base_fs_allocations();
+	} else
 		root_inode_num = build_default_directory_structure(mountpoint, sehnd);
 #endif
 
@@ -825,6 +1400,8 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 	}
 #endif
 
+	ext4_update_metadata_csums();
+
 	ext4_update_free();
 
     ext4_queue_sb();
@@ -860,6 +1437,11 @@ int make_ext4fs_internal(int fd, const char *_directory, const char *_target_out
 		wipe_block_device(fd, info.len);
 	}
 
+	if (prev_image_fd >= 0) {
+		u32 unchanged = drop_unchanged_file_data(prev_image_fd);
+		printf("Skipped %u unchanged blocks of file data\n", unchanged);
+	}
+
 	write_ext4_image(fd, gzip, sparse, crc);
 
 	sparse_file_destroy(ext4_sparse_file);
@@ -56,8 +56,9 @@ static void usage(char *path)
 	fprintf(stderr, "    [ -g <blocks per group> ] [ -i <inodes> ] [ -I <inode size> ]\n");
 	fprintf(stderr, "    [ -L <label> ] [ -f ] [ -a <android mountpoint> ] [ -u ]\n");
 	fprintf(stderr, "    [ -S file_contexts ] [ -C fs_config ] [ -T timestamp ]\n");
-	fprintf(stderr, "    [ -z | -s ] [ -w ] [ -c ] [ -J ] [ -v ] [ -B <block_list_file> ]\n");
+	fprintf(stderr, "    [ -z | -s ] [ -w ] [ -c ] [ -J ] [ -e ] [ -m ] [ -n ] [ -v ] [ -B <block_list_file> ]\n");
 	fprintf(stderr, "    [ -d <base_alloc_file_in> ] [ -D <base_alloc_file_out> ]\n");
+	fprintf(stderr, "    [ -A <access_order_file> ] [ -P <prev_image> ]\n");
 	fprintf(stderr, "    <filename> [[<directory>] <target_out_directory>]\n");
 }
 
@@ -75,6 +76,7 @@ int main(int argc, char **argv)
 	int crc = 0;
 	int wipe = 0;
 	int real_uuid = 0;
+	int share_blocks = 0;
 	int fd;
 	int exitcode;
 	int verbose = 0;
@@ -83,11 +85,13 @@ int main(int argc, char **argv)
 	FILE* block_list_file = NULL;
 	FILE* base_alloc_file_in = NULL;
 	FILE* base_alloc_file_out = NULL;
+	FILE* access_order_file = NULL;
+	int prev_image_fd = -1;
 #ifndef USE_MINGW
 	struct selinux_opt seopts[] = { { SELABEL_OPT_PATH, "" } };
 #endif
 
-	while ((opt = getopt(argc, argv, "l:j:b:g:i:I:L:a:S:T:C:B:d:D:fwzJsctvu")) != -1) {
+	while ((opt = getopt(argc, argv, "l:j:b:g:i:I:L:a:S:T:C:B:d:D:A:P:fwzJemnsctvu")) != -1) {
 		switch (opt) {
 		case 'l':
 			info.len = parse_num(optarg);
@@ -134,6 +138,15 @@ int main(int argc, char **argv)
 		case 'J':
 			info.no_journal = 1;
 			break;
+		case 'e':
+			share_blocks = 1;
+			break;
+		case 'm':
+			info.feat_ro_compat |= EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+			break;
+		case 'n':
+			info.feat_incompat |= EXT4_FEATURE_INCOMPAT_INLINE_DATA;
+			break;
 		case 'c':
 			crc = 1;
 			break;
@@ -183,6 +196,20 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'A':
+			access_order_file = fopen(optarg, "r");
+			if (access_order_file == NULL) {
+				fprintf(stderr, "failed to open access_order_file: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'P':
+			prev_image_fd = open(optarg, O_RDONLY | O_BINARY);
+			if (prev_image_fd < 0) {
+				fprintf(stderr, "failed to open prev_image: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default: /* '?' */
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
@@ -255,7 +282,8 @@ int main(int argc, char **argv)
 
 	exitcode = make_ext4fs_internal(fd, directory, target_out_directory, mountpoint, fs_config_func, gzip,
 		sparse, crc, wipe, real_uuid, sehnd, verbose, fixed_time,
-		block_list_file, base_alloc_file_in, base_alloc_file_out);
+		block_list_file, base_alloc_file_in, base_alloc_file_out, access_order_file,
+		share_blocks, prev_image_fd);
 	close(fd);
 	if (block_list_file)
 		fclose(block_list_file);
@@ -263,6 +291,10 @@ int main(int argc, char **argv)
 		fclose(base_alloc_file_out);
 	if (base_alloc_file_in)
 		fclose(base_alloc_file_in);
+	if (access_order_file)
+		fclose(access_order_file);
+	if (prev_image_fd >= 0)
+		close(prev_image_fd);
 	if (exitcode && strcmp(filename, "-"))
 		unlink(filename);
 	return exitcode;
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checksums for the metadata_csum feature.  They are crc32c, seeded with the
+ * crc32c of the filesystem uuid, and for blocks that belong to an inode
+ * further seeded with the inode number and generation, the same way the
+ * kernel and e2fsprogs compute them. */
+
+#include "ext4_utils.h"
+#include "allocate.h"
+#include "metadata_csum.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Directory and extent blocks are checksummed once the image is complete,
+   as their contents (for example the inode numbers of directory entries)
+   are filled in after the blocks are created */
+struct csum_blocks {
+	u32 inode_num;
+	struct ext4_inode *inode;
+	u8 *data;
+	u32 blocks;
+	struct csum_blocks *next;
+};
+
+static struct csum_blocks *dir_blocks;
+static struct csum_blocks *extent_blocks;
+
+static u32 csum_seed(void)
+{
+	return ext4_crc32c(~0, aux_info.sb->s_uuid, sizeof(aux_info.sb->s_uuid));
+}
+
+static u32 inode_csum_seed(u32 inode_num, u32 generation)
+{
+	u32 le_inode_num = cpu_to_le32(inode_num);
+	u32 le_generation = cpu_to_le32(generation);
+	u32 crc;
+
+	crc = ext4_crc32c(csum_seed(), &le_inode_num, sizeof(le_inode_num));
+	return ext4_crc32c(crc, &le_generation, sizeof(le_generation));
+}
+
+/* Returns the checksum of a block group descriptor, crc16 with gdt_csum and
+   the low 16 bits of crc32c with metadata_csum */
+u16 ext4_group_desc_csum(u32 group, struct ext2_group_desc *desc)
+{
+	u32 le_group = cpu_to_le32(group);
+	u16 zero = 0;
+	u32 crc32;
+	u16 crc;
+
+	if (has_metadata_csum()) {
+		crc32 = ext4_crc32c(csum_seed(), &le_group, sizeof(le_group));
+		crc32 = ext4_crc32c(crc32, desc, offsetof(struct ext2_group_desc, bg_checksum));
+		crc32 = ext4_crc32c(crc32, &zero, sizeof(zero));
+		return crc32 & 0xFFFF;
+	}
+
+	crc = ext4_crc16(~0, aux_info.sb->s_uuid, sizeof(aux_info.sb->s_uuid));
+	crc = ext4_crc16(crc, &le_group, sizeof(le_group));
+	crc = ext4_crc16(crc, desc, offsetof(struct ext2_group_desc, bg_checksum));
+	return crc;
+}
+
+/* Updates the checksum of a primary or backup superblock, if it has one */
+void ext4_update_sb_csum(struct ext4_super_block *sb)
+{
+	if (!(sb->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM))
+		return;
+
+	sb->s_checksum = ext4_crc32c(~0, sb, offsetof(struct ext4_super_block, s_checksum));
+}
+
+/* Fills in the fake directory entry at the end of a directory block that
+   holds its checksum */
+void ext4_init_dir_block_tail(u8 *block)
+{
+	struct ext4_dir_entry_tail *tail = (struct ext4_dir_entry_tail *)
+		(block + info.block_size - sizeof(struct ext4_dir_entry_tail));
+
+	memset(tail, 0, sizeof(*tail));
+	tail->det_rec_len = sizeof(*tail);
+	tail->det_reserved_ft = EXT4_FT_DIR_CSUM;
+}
+
+void ext4_update_dir_block_csum(u32 inode_num, u32 generation, u8 *block)
+{
+	u32 len = info.block_size - sizeof(struct ext4_dir_entry_tail);
+	struct ext4_dir_entry_tail *tail = (struct ext4_dir_entry_tail *)(block + len);
+
+	tail->det_checksum = ext4_crc32c(inode_csum_seed(inode_num, generation),
+			block, len);
+}
+
+static void csum_blocks_add(struct csum_blocks **list, u32 inode_num,
+		struct ext4_inode *inode, u8 *data, u32 blocks)
+{
+	struct csum_blocks *c = malloc(sizeof(struct csum_blocks));
+	if (!c)
+		critical_error_errno("malloc");
+
+	c->inode_num = inode_num;
+	c->inode = inode;
+	c->data = data;
+	c->blocks = blocks;
+	c->next = *list;
+	*list = c;
+}
+
+/* Remembers the blocks of a directory so that their checksums can be
+   computed by ext4_update_metadata_csums */
+void csum_add_dir_blocks(u32 inode_num, u8 *data, u32 blocks)
+{
+	if (has_metadata_csum())
+		csum_blocks_add(&dir_blocks, inode_num, NULL, data, blocks);
+}
+
+/* Remembers an extent tree block of an inode so that its checksum can be
+   computed by ext4_update_metadata_csums */
+void csum_add_extent_block(struct ext4_inode *inode, u8 *data)
+{
+	if (has_metadata_csum())
+		csum_blocks_add(&extent_blocks, 0, inode, data, 1);
+}
+
+static void update_extent_block_csum(struct ext4_inode *inode, u8 *data)
+{
+	struct ext4_extent_header *hdr = (struct ext4_extent_header *)data;
+	u32 len = EXT4_EXTENT_TAIL_OFFSET(hdr);
+	struct ext4_extent_tail *tail = (struct ext4_extent_tail *)(data + len);
+
+	tail->et_checksum = ext4_crc32c(
+			inode_csum_seed(get_inode_num(inode), inode->i_generation),
+			data, len);
+}
+
+static void update_xattr_block_csum(struct ext4_inode *inode)
+{
+	struct ext4_xattr_header *hdr = get_xattr_block_for_inode(inode);
+	u64 le_block = inode->i_file_acl_lo;
+	u32 crc;
+
+	if (!hdr)
+		return;
+
+	hdr->h_checksum = 0;
+	crc = ext4_crc32c(csum_seed(), &le_block, sizeof(le_block));
+	hdr->h_checksum = ext4_crc32c(crc, hdr, info.block_size);
+}
+
+/* The inode checksum is split between i_checksum_lo and, if the inode has
+   room for it, i_checksum_hi */
+static void update_inode_csum(u32 inode_num, struct ext4_inode *inode)
+{
+	int has_hi = info.inode_size > EXT4_GOOD_OLD_INODE_SIZE &&
+		inode->i_extra_isize >= offsetof(struct ext4_inode, i_checksum_hi) +
+			sizeof(inode->i_checksum_hi) - EXT4_GOOD_OLD_INODE_SIZE;
+	u32 crc;
+
+	inode->i_checksum_lo = 0;
+	if (has_hi)
+		inode->i_checksum_hi = 0;
+
+	crc = ext4_crc32c(inode_csum_seed(inode_num, inode->i_generation),
+			inode, info.inode_size);
+
+	inode->i_checksum_lo = crc & 0xFFFF;
+	if (has_hi)
+		inode->i_checksum_hi = crc >> 16;
+}
+
+/* Computes the checksums of all inodes, directory blocks, extent blocks,
+   xattr blocks, bitmaps and backup superblocks.  Called once the contents of
+   the filesystem are final, before ext4_update_free computes the group
+   descriptor checksums and ext4_queue_sb the superblock checksum. */
+void ext4_update_metadata_csums(void)
+{
+	struct csum_blocks *c;
+	u32 seed;
+	u32 bg;
+	u32 i;
+
+	if (!has_metadata_csum())
+		return;
+
+	for (c = dir_blocks; c; c = c->next) {
+		struct ext4_inode *inode = get_inode(c->inode_num);
+		for (i = 0; i < c->blocks; i++)
+			ext4_update_dir_block_csum(c->inode_num, inode->i_generation,
+					c->data + i * info.block_size);
+	}
+
+	for (c = extent_blocks; c; c = c->next)
+		update_extent_block_csum(c->inode, c->data);
+
+	seed = csum_seed();
+
+	for (bg = 0; bg < aux_info.groups; bg++) {
+		struct block_group_info *bgi = &aux_info.bgs[bg];
+
+		for (i = 0; i < info.inodes_per_group; i++) {
+			u32 inode_num = bg * info.inodes_per_group + i + 1;
+			struct ext4_inode *inode;
+
+			if (!bitmap_get_bit(bgi->inode_bitmap, i))
+				continue;
+
+			inode = get_inode(inode_num);
+			if (inode->i_file_acl_lo)
+				update_xattr_block_csum(inode);
+			update_inode_csum(inode_num, inode);
+		}
+
+		aux_info.bg_desc[bg].bg_block_bitmap_csum = ext4_crc32c(seed,
+				bgi->block_bitmap, info.blocks_per_group / 8) & 0xFFFF;
+		aux_info.bg_desc[bg].bg_inode_bitmap_csum = ext4_crc32c(seed,
+				bgi->inode_bitmap, info.inodes_per_group / 8) & 0xFFFF;
+
+		if (aux_info.backup_sb[bg])
+			ext4_update_sb_csum(aux_info.backup_sb[bg]);
+	}
+}
+
+void free_metadata_csums(void)
+{
+	struct csum_blocks *c;
+
+	while (dir_blocks) {
+		c = dir_blocks;
+		dir_blocks = c->next;
+		free(c);
+	}
+
+	while (extent_blocks) {
+		c = extent_blocks;
+		extent_blocks = c->next;
+		free(c);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METADATA_CSUM_H_
+#define _METADATA_CSUM_H_
+
+#include "ext4_utils.h"
+
+static inline int has_metadata_csum(void)
+{
+	return (info.feat_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) != 0;
+}
+
+/* Space at the start of each directory block for entries, the rest is the
+   checksum tail */
+static inline u32 dir_block_space(void)
+{
+	if (has_metadata_csum())
+		return info.block_size - sizeof(struct ext4_dir_entry_tail);
+	return info.block_size;
+}
+
+u16 ext4_group_desc_csum(u32 group, struct ext2_group_desc *desc);
+void ext4_update_sb_csum(struct ext4_super_block *sb);
+void ext4_init_dir_block_tail(u8 *block);
+void ext4_update_dir_block_csum(u32 inode_num, u32 generation, u8 *block);
+void csum_add_dir_blocks(u32 inode_num, u8 *data, u32 blocks);
+void csum_add_extent_block(struct ext4_inode *inode, u8 *data);
+void ext4_update_metadata_csums(void);
+void free_metadata_csums(void);
+
+#endif
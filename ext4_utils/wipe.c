@@ -22,7 +22,10 @@
 #if defined(__linux__)
 
 #include <linux/fs.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #ifndef BLKDISCARD
 #define BLKDISCARD _IO(0x12,119)
@@ -32,35 +35,284 @@
 #define BLKSECDISCARD _IO(0x12,125)
 #endif
 
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+/* A single discard of a whole partition can keep some eMMC and UFS parts
+ * busy for minutes, so the range is wiped in chunks of this size, which also
+ * gives the caller progress to report.
+ */
+#define WIPE_DEFAULT_CHUNK (64ULL << 20)
+#define WIPE_MAX_THREADS 16
+#define WIPE_CACHE_SIZE 8
+
+static const unsigned long wipe_requests[WIPE_METHODS] = {
+	BLKSECDISCARD,
+	BLKDISCARD,
+	BLKZEROOUT,
+};
+
+static const char *wipe_names[WIPE_METHODS] = {
+	"secure discard",
+	"discard",
+	"zeroout",
+};
+
+/* Method that last worked on each device */
+static struct {
+	dev_t dev;
+	enum wipe_method method;
+} method_cache[WIPE_CACHE_SIZE];
+static int method_cache_count;
+static pthread_mutex_t method_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct wipe_job {
+	int fd;
+	unsigned long request;
+	u64 start;
+	u64 end;
+	u64 base;		/* start rounded down to a chunk */
+	u64 chunk_size;
+	u64 chunks;
+	u64 next_chunk;
+	u64 done;
+	int err;
+	pthread_mutex_t mutex;	/* protects done, err and progress calls */
+	const struct wipe_options *opts;
+};
+
+static int cached_method(dev_t dev, enum wipe_method *method)
+{
+	int i, found = 0;
+
+	pthread_mutex_lock(&method_cache_mutex);
+	for (i = 0; i < method_cache_count; i++) {
+		if (method_cache[i].dev == dev) {
+			*method = method_cache[i].method;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&method_cache_mutex);
+	return found;
+}
+
+static void cache_method(dev_t dev, enum wipe_method method)
+{
+	int i;
+
+	pthread_mutex_lock(&method_cache_mutex);
+	for (i = 0; i < method_cache_count; i++)
+		if (method_cache[i].dev == dev)
+			break;
+	if (i == method_cache_count) {
+		if (method_cache_count < WIPE_CACHE_SIZE)
+			method_cache_count++;
+		else
+			i = method_cache_count - 1;
+	}
+	method_cache[i].dev = dev;
+	method_cache[i].method = method;
+	pthread_mutex_unlock(&method_cache_mutex);
+}
+
+/* Reads a queue attribute of a disk, or of the disk holding a partition */
+static int read_queue_attr(dev_t dev, const char *name, u64 *value)
+{
+	static const char *formats[] = {
+		"/sys/dev/block/%u:%u/queue/%s",
+		"/sys/dev/block/%u:%u/../queue/%s",
+	};
+	char path[128];
+	unsigned long long v;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		FILE *f;
+		int ret;
+
+		snprintf(path, sizeof(path), formats[i], major(dev), minor(dev), name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		ret = fscanf(f, "%llu", &v);
+		fclose(f);
+		if (ret == 1) {
+			*value = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int wipe_chunk(struct wipe_job *job, unsigned long request, u64 chunk)
+{
+	u64 range[2];
+	u64 start = job->base + chunk * job->chunk_size;
+	u64 end = start + job->chunk_size;
+
+	if (start < job->start)
+		start = job->start;
+	if (end > job->end)
+		end = job->end;
+
+	range[0] = start;
+	range[1] = end - start;
+	if (ioctl(job->fd, request, &range) < 0)
+		return -errno;
+
+	pthread_mutex_lock(&job->mutex);
+	job->done += end - start;
+	if (job->opts->progress)
+		job->opts->progress(job->done, job->end - job->start,
+				job->opts->cookie);
+	pthread_mutex_unlock(&job->mutex);
+	return 0;
+}
+
+static void *wipe_thread(void *arg)
+{
+	struct wipe_job *job = arg;
+	u64 chunk;
+
+	while ((chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) <
+			job->chunks) {
+		int ret;
+
+		if (__atomic_load_n(&job->err, __ATOMIC_RELAXED))
+			break;
+		ret = wipe_chunk(job, job->request, chunk);
+		if (ret < 0) {
+			__atomic_store_n(&job->err, ret, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Tries the allowed methods in order on the first chunk, skipping those the
+ * queue limits say the device lacks. */
+static int probe_method(struct wipe_job *job, dev_t dev, enum wipe_method *method)
+{
+	u64 discard_max = 0;
+	int has_limits = read_queue_attr(dev, "discard_max_bytes", &discard_max) == 0;
+	int m;
+
+	for (m = 0; m < WIPE_METHODS; m++) {
+		if (!(job->opts->methods & WIPE_ALLOW(m)))
+			continue;
+		if (m == WIPE_DISCARD && has_limits && discard_max == 0)
+			continue;
+		if (wipe_chunk(job, wipe_requests[m], 0) == 0) {
+			*method = m;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int wipe_block_device_range(int fd, u64 start, u64 len,
+		const struct wipe_options *opts, enum wipe_method *used)
+{
+	pthread_t threads[WIPE_MAX_THREADS];
+	struct wipe_job job;
+	struct stat st;
+	enum wipe_method method;
+	u64 granularity = 0;
+	long num_threads;
+	int started = 0;
+	int i;
+
+	if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode) || opts->methods == 0)
+		return -1;
+	if (len == 0) {
+		if (used)
+			*used = __builtin_ctz(opts->methods);
+		return 0;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.fd = fd;
+	job.start = start;
+	job.end = start + len;
+	job.opts = opts;
+
+	/* chunk boundaries must fall on the discard granularity, or the
+	 * device may ignore the partial units on each side */
+	job.chunk_size = opts->chunk_size ? opts->chunk_size : WIPE_DEFAULT_CHUNK;
+	if (read_queue_attr(st.st_rdev, "discard_granularity", &granularity) == 0 &&
+			granularity > 1)
+		job.chunk_size = EXT4_ALIGN(job.chunk_size, granularity);
+	job.base = start - start % job.chunk_size;
+	job.chunks = DIV_ROUND_UP(job.end - job.base, job.chunk_size);
+	pthread_mutex_init(&job.mutex, NULL);
+
+	if (cached_method(st.st_rdev, &method) &&
+			(opts->methods & WIPE_ALLOW(method))) {
+		job.next_chunk = 0;
+	} else if (probe_method(&job, st.st_rdev, &method) == 0) {
+		cache_method(st.st_rdev, method);
+		job.next_chunk = 1;
+	} else {
+		pthread_mutex_destroy(&job.mutex);
+		return -1;
+	}
+	job.request = wipe_requests[method];
+
+	num_threads = opts->threads > 0 ? opts->threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_threads > WIPE_MAX_THREADS)
+		num_threads = WIPE_MAX_THREADS;
+	if ((u64)num_threads > job.chunks)
+		num_threads = job.chunks;
+
+	for (i = 1; i < num_threads; i++) {
+		if (pthread_create(&threads[started], NULL, wipe_thread, &job) != 0)
+			break;
+		started++;
+	}
+	wipe_thread(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&job.mutex);
+	if (job.err) {
+		warn("%s failed: %s", wipe_names[method], strerror(-job.err));
+		return -1;
+	}
+	if (used)
+		*used = method;
+	return 0;
+}
+
 int wipe_block_device(int fd, s64 len)
 {
 #ifndef SUPPRESS_EMMC_WIPE
-	u64 range[2];
-	int ret;
+	struct wipe_options opts;
+	enum wipe_method used;
 
 	if (!is_block_device_fd(fd)) {
 		// Wiping only makes sense on a block device.
 		return 0;
 	}
 
+	// Zeroing out is left to callers that ask for it, as it may end up
+	// writing the whole partition.
+	memset(&opts, 0, sizeof(opts));
+	opts.methods = WIPE_ALLOW(WIPE_DISCARD);
 #ifndef NO_SECURE_DISCARD
-	range[0] = 0;
-	range[1] = len;
-	ret = ioctl(fd, BLKSECDISCARD, &range);
-	if (ret < 0) {
+	opts.methods |= WIPE_ALLOW(WIPE_SECURE_DISCARD);
 #endif /* NO_SECURE_DISCARD */
-		range[0] = 0;
-		range[1] = len;
-		ret = ioctl(fd, BLKDISCARD, &range);
-		if (ret < 0) {
-			warn("Discard failed\n");
-			return 1;
-		} else {
-			warn("Wipe via secure discard failed, used discard instead\n");
-			return 0;
-		}
-#ifndef NO_SECURE_DISCARD
+
+	if (wipe_block_device_range(fd, 0, len, &opts, &used) < 0) {
+		warn("Discard failed\n");
+		return 1;
 	}
+#ifndef NO_SECURE_DISCARD
+	if (used != WIPE_SECURE_DISCARD)
+		warn("Wipe via secure discard failed, used discard instead\n");
 #endif /* NO_SECURE_DISCARD */
 	return 0;
 #else
@@ -75,6 +327,13 @@ int wipe_block_device(int fd, s64 len)
 
 #else  /* WIPE_IS_SUPPORTED */
 
+int wipe_block_device_range(int fd, u64 start, u64 len,
+		const struct wipe_options *opts, enum wipe_method *used)
+{
+	/* Wiping is not supported on this platform. */
+	return -1;
+}
+
 int wipe_block_device(int fd, s64 len)
 {
 	/* Wiping is not supported on this platform. */
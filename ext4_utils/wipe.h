@@ -32,6 +32,37 @@ extern "C" {
 #  define WIPE_IS_SUPPORTED 0
 #endif
 
+/* Ways of wiping a range of a block device, from the one that erases most
+ * thoroughly. WIPE_ZEROOUT lets the kernel use write-same or write-zeroes
+ * when the device offloads them, and falls back to writing zeroes.
+ */
+enum wipe_method {
+	WIPE_SECURE_DISCARD,
+	WIPE_DISCARD,
+	WIPE_ZEROOUT,
+	WIPE_METHODS,
+};
+
+#define WIPE_ALLOW(method) (1u << (method))
+
+typedef void (*wipe_progress_fn)(u64 done, u64 total, void *cookie);
+
+struct wipe_options {
+	unsigned int methods;	/* WIPE_ALLOW() mask, tried in enum order */
+	int threads;		/* 0 for one per cpu */
+	u64 chunk_size;		/* 0 for the default */
+	wipe_progress_fn progress;	/* called after each chunk, may be NULL */
+	void *cookie;
+};
+
+/* Wipes len bytes at start in aligned chunks issued from several threads.
+ * The first allowed method that the device accepts is used for the whole
+ * range, and remembered for the device so later calls skip the probing.
+ * Returns 0 and stores the method in *used if not NULL, or -1.
+ */
+int wipe_block_device_range(int fd, u64 start, u64 len,
+		const struct wipe_options *opts, enum wipe_method *used);
+
 int wipe_block_device(int fd, s64 len);
 
 #ifdef __cplusplus
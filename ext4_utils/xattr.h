@@ -5,6 +5,7 @@
 
 #define EXT4_XATTR_MAGIC 0xEA020000
 #define EXT4_XATTR_INDEX_SECURITY 6
+#define EXT4_XATTR_INDEX_SYSTEM 7
 
 struct ext4_xattr_header {
     __le32  h_magic;
@@ -88,13 +88,27 @@ struct selabel_handle;
 struct f2fs_configuration config;
 struct sparse_file *f2fs_sparse_file;
 
-struct buf_item {
-	void *buf;
-	size_t len;
-	struct buf_item *next;
+/*
+ * Data handed to the sparse file must stay around until it is written out,
+ * so writes are copied into large arena chunks rather than one allocation
+ * each. Contiguous writes that land next to each other in an arena are handed
+ * to libsparse as one extent, and runs of zero blocks become fill chunks.
+ */
+#define SPARSE_ARENA_SIZE (1024 * 1024)
+
+struct sparse_arena {
+	struct sparse_arena *next;
+	size_t size;
+	size_t used;
+	char data[];
 };
 
-struct buf_item *buf_list;
+struct sparse_arena *arena_list;
+
+/* extent copied into the head arena but not yet added to the sparse file */
+static char *pending_buf;
+static __u64 pending_offset;
+static size_t pending_len;
 
 static int dev_write_fd(void *buf, __u64 offset, size_t len)
 {
@@ -110,33 +124,128 @@ static int dev_write_fd(void *buf, __u64 offset, size_t len)
 
 void flush_sparse_buffs()
 {
-	while (buf_list) {
-		struct buf_item *bi = buf_list;
-		buf_list = buf_list->next;
-		free(bi->buf);
-		free(bi);
+	while (arena_list) {
+		struct sparse_arena *arena = arena_list;
+		arena_list = arena_list->next;
+		free(arena);
 	}
+	pending_buf = NULL;
+	pending_len = 0;
 }
 
-static int dev_write_sparse(void *buf, __u64 byte_offset, size_t byte_len)
+static int flush_pending_extent(void)
 {
-	struct buf_item *bi = calloc(1, sizeof(struct buf_item));
+	int ret = 0;
 
-	if (bi == NULL) {
-		return -ENOMEM;
+	if (pending_len) {
+		ret = sparse_file_add_data(f2fs_sparse_file, pending_buf,
+				pending_len, pending_offset / F2FS_BLKSIZE);
+	}
+	pending_buf = NULL;
+	pending_len = 0;
+	return ret;
+}
+
+/* returns len bytes of arena space, right after the previous ones if they fit */
+static char *arena_alloc(size_t len)
+{
+	struct sparse_arena *arena = arena_list;
+	char *p;
+
+	if (arena == NULL || arena->size - arena->used < len) {
+		size_t size = MAX(len, SPARSE_ARENA_SIZE);
+
+		arena = malloc(sizeof(*arena) + size);
+		if (arena == NULL)
+			return NULL;
+		arena->size = size;
+		arena->used = 0;
+		arena->next = arena_list;
+		arena_list = arena;
+	}
+	p = arena->data + arena->used;
+	arena->used += len;
+	return p;
+}
+
+static int is_zero_block(const char *buf)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, F2FS_BLKSIZE - 1) == 0;
+}
+
+/* adds data blocks to the pending extent, starting a new one if needed */
+static int add_data_blocks(const char *buf, __u64 byte_offset, size_t byte_len)
+{
+	char *p;
+
+	if (pending_len && pending_offset + pending_len != byte_offset) {
+		int ret = flush_pending_extent();
+		if (ret)
+			return ret;
 	}
-	bi->buf = malloc(byte_len);
-	if (bi->buf == NULL) {
-		free(bi);
+
+	p = arena_alloc(byte_len);
+	if (p == NULL)
 		return -ENOMEM;
+	memcpy(p, buf, byte_len);
+
+	if (pending_len && pending_buf + pending_len == p) {
+		pending_len += byte_len;
+		return 0;
+	}
+
+	if (pending_len) {
+		int ret = flush_pending_extent();
+		if (ret)
+			return ret;
 	}
+	pending_buf = p;
+	pending_offset = byte_offset;
+	pending_len = byte_len;
+	return 0;
+}
 
-	bi->len = byte_len;
-	memcpy(bi->buf, buf, byte_len);
-	bi->next = buf_list;
-	buf_list = bi;
+static int dev_write_sparse(void *buf, __u64 byte_offset, size_t byte_len)
+{
+	const char *data = buf;
+	size_t pos = 0;
+
+	/* partial blocks can't be merged or filled, add them as they are */
+	if (byte_offset % F2FS_BLKSIZE || byte_len % F2FS_BLKSIZE) {
+		char *p;
+		int ret = flush_pending_extent();
+
+		if (ret)
+			return ret;
+		p = arena_alloc(byte_len);
+		if (p == NULL)
+			return -ENOMEM;
+		memcpy(p, buf, byte_len);
+		return sparse_file_add_data(f2fs_sparse_file, p, byte_len,
+				byte_offset / F2FS_BLKSIZE);
+	}
 
-	sparse_file_add_data(f2fs_sparse_file, bi->buf, byte_len, byte_offset/F2FS_BLKSIZE);
+	while (pos < byte_len) {
+		int zero = is_zero_block(data + pos);
+		size_t run = F2FS_BLKSIZE;
+		int ret;
+
+		while (pos + run < byte_len &&
+				is_zero_block(data + pos + run) == zero)
+			run += F2FS_BLKSIZE;
+
+		if (zero) {
+			ret = flush_pending_extent();
+			if (ret == 0)
+				ret = sparse_file_add_fill(f2fs_sparse_file, 0, run,
+						(byte_offset + pos) / F2FS_BLKSIZE);
+		} else {
+			ret = add_data_blocks(data + pos, byte_offset + pos, run);
+		}
+		if (ret)
+			return ret;
+		pos += run;
+	}
 	return 0;
 }
 
@@ -147,6 +256,7 @@ void init_sparse_file(unsigned int block_size, int64_t len)
 
 void finalize_sparse_file(int fd)
 {
+	flush_pending_extent();
 	sparse_file_write(f2fs_sparse_file, fd, /*gzip*/0, /*sparse*/1, /*crc*/0);
 	sparse_file_destroy(f2fs_sparse_file);
 }
@@ -492,59 +492,131 @@ int f2fs_test_bit(unsigned int nr, const char *p)
     return (mask & *addr) != 0;
 }
 
-int run_on_used_blocks(u64 startblock, struct f2fs_info *info, int (*func)(u64 pos, void *data), void *data) {
-    struct f2fs_sit_block sit_block_cache;
-    struct f2fs_sit_entry * sit_entry;
-    u64 sit_block_num_cur = 0, segnum = 0, block_offset;
-    u64 block;
-    unsigned int used, found, started = 0, i;
-
-    block = startblock;
-    while (block < info->total_blocks) {
-        /* TODO: Save only relevant portions of metadata */
-        if (block < info->main_blkaddr) {
-            if (func(block, data)) {
-                SLOGI("func error");
-                return -1;
-            }
-        } else {
-            /* Main Section */
-            segnum = (block - info->main_blkaddr)/info->blocks_per_segment;
-
-            /* check the SIT entries in the journal */
-            found = 0;
-            for(i = 0; i < le16_to_cpu(info->journal->n_sits); i++) {
-                if (le32_to_cpu(segno_in_journal(info->journal, i)) == segnum) {
-                    sit_entry = &sit_in_journal(info->journal, i);
-                    found = 1;
-                    break;
-                }
-            }
+/* Returns the first bit at or after offset that is set, or clear if set is 0,
+ * in a bitmap of size bits, or size if there is none. f2fs bitmaps number
+ * bits from the top of each byte, so loading them as big-endian words keeps
+ * bit order, and whole words are skipped with a count of leading zeros.
+ * size must be a multiple of 64.
+ */
+static unsigned int find_next_bit_be(const unsigned char *p, unsigned int size,
+        unsigned int offset, int set)
+{
+    while (offset < size) {
+        unsigned int word_start = offset & ~63U;
+        const unsigned char *w = p + word_start / 8;
+        u64 word = ((u64)w[0] << 56) | ((u64)w[1] << 48) | ((u64)w[2] << 40) |
+                ((u64)w[3] << 32) | ((u64)w[4] << 24) | ((u64)w[5] << 16) |
+                ((u64)w[6] << 8) | (u64)w[7];
+
+        if (!set)
+            word = ~word;
+        word &= ~0ULL >> (offset - word_start);
+        if (word)
+            return word_start + __builtin_clzll(word);
+
+        offset = word_start + 64;
+    }
+    return size;
+}
 
-            /* get SIT entry from SIT section */
-            if (!found) {
-                sit_block_num_cur = segnum / SIT_ENTRY_PER_BLOCK;
-                sit_entry = &info->sit_blocks[sit_block_num_cur].entries[segnum % SIT_ENTRY_PER_BLOCK];
-            }
+static struct f2fs_sit_entry *get_sit_entry(struct f2fs_info *info, u64 segnum)
+{
+    unsigned int i;
 
-            block_offset = (block - info->main_blkaddr) % info->blocks_per_segment;
+    /* check the SIT entries in the journal */
+    for(i = 0; i < le16_to_cpu(info->journal->n_sits); i++) {
+        if (le32_to_cpu(segno_in_journal(info->journal, i)) == segnum)
+            return &sit_in_journal(info->journal, i);
+    }
 
-            if (block_offset == 0 && GET_SIT_VBLOCKS(sit_entry) == 0) {
-                block += info->blocks_per_segment;
-                continue;
-            }
+    /* get SIT entry from SIT section */
+    return &info->sit_blocks[segnum / SIT_ENTRY_PER_BLOCK].entries[segnum % SIT_ENTRY_PER_BLOCK];
+}
 
-            used = f2fs_test_bit(block_offset, (char *)sit_entry->valid_map);
-            if(used)
-                if (func(block, data))
+/*
+ * Calls func for each run of used blocks from startblock on, in block order.
+ * Runs are as long as possible: the metadata area before the main area is
+ * one run, and runs of valid blocks continue across segments.
+ */
+int run_on_used_extents(u64 startblock, struct f2fs_info *info,
+        int (*func)(u64 pos, u64 len, void *data), void *data)
+{
+    struct f2fs_sit_entry *sit_entry;
+    u64 run_start = 0, run_len = 0;
+    u64 segnum, seg_start, seg_blocks;
+    unsigned int first, last;
+
+    if (startblock < info->main_blkaddr) {
+        run_start = startblock;
+        run_len = (info->main_blkaddr < info->total_blocks ? info->main_blkaddr
+                : info->total_blocks) - startblock;
+        startblock = info->main_blkaddr;
+    }
+
+    /* Main Section */
+    for (segnum = (startblock - info->main_blkaddr) / info->blocks_per_segment;
+            info->main_blkaddr + segnum * info->blocks_per_segment < info->total_blocks;
+            segnum++) {
+        seg_start = info->main_blkaddr + segnum * info->blocks_per_segment;
+        seg_blocks = info->total_blocks - seg_start;
+        if (seg_blocks > info->blocks_per_segment)
+            seg_blocks = info->blocks_per_segment;
+
+        sit_entry = get_sit_entry(info, segnum);
+        if (GET_SIT_VBLOCKS(sit_entry) == 0)
+            continue;
+
+        first = startblock > seg_start ? startblock - seg_start : 0;
+        while ((first = find_next_bit_be(sit_entry->valid_map,
+                        SIT_VBLOCK_MAP_SIZE * 8, first, 1)) < seg_blocks) {
+            last = find_next_bit_be(sit_entry->valid_map, SIT_VBLOCK_MAP_SIZE * 8,
+                    first, 0);
+            if (last > seg_blocks)
+                last = seg_blocks;
+
+            if (run_len && run_start + run_len == seg_start + first) {
+                run_len += last - first;
+            } else {
+                if (run_len && func(run_start, run_len, data))
                     return -1;
+                run_start = seg_start + first;
+                run_len = last - first;
+            }
+            first = last;
         }
+    }
+
+    if (run_len && func(run_start, run_len, data))
+        return -1;
+
+    return 0;
+}
 
-        block++;
+struct used_blocks_ctx {
+    int (*func)(u64 pos, void *data);
+    void *data;
+};
+
+static int run_on_extent_blocks(u64 pos, u64 len, void *data)
+{
+    struct used_blocks_ctx *ctx = data;
+    u64 i;
+
+    for (i = 0; i < len; i++) {
+        if (ctx->func(pos + i, ctx->data)) {
+            SLOGI("func error");
+            return -1;
+        }
     }
     return 0;
 }
 
+int run_on_used_blocks(u64 startblock, struct f2fs_info *info, int (*func)(u64 pos, void *data), void *data) {
+    struct used_blocks_ctx ctx = { func, data };
+
+    return run_on_used_extents(startblock, info, run_on_extent_blocks, &ctx);
+}
+
 struct privdata
 {
     int count;
@@ -557,43 +629,51 @@ struct privdata
 };
 
 
+/* Blocks copied per read and write */
+#define COPY_BUF_BLOCKS 256
+
 /*
  * This is a simple test program. It performs a block to block copy of a
  * filesystem, replacing blocks identified as unused with 0's.
  */
 
-int copy_used(u64 pos, void *data)
+int copy_used(u64 pos, u64 len, void *data)
 {
     struct privdata *d = data;
-    char *buf;
-    int pdone = (pos * 100) / d->info->total_blocks;
+    int pdone = ((pos + len) * 100) / d->info->total_blocks;
     if (pdone > d->done) {
         d->done = pdone;
         printf("Done with %d percent\n", d->done);
     }
 
-    d->count++;
-    buf = d->buf;
-    if(read_structure_blk(d->infd, (unsigned long long)pos, d->buf, 1)) {
-        printf("Error reading!!!\n");
-        return -1;
-    }
+    d->count += len;
+    while (len > 0) {
+        u64 n = len < COPY_BUF_BLOCKS ? len : COPY_BUF_BLOCKS;
+        off64_t ret;
 
-    off64_t ret;
-    ret = lseek64(d->outfd, pos * F2FS_BLKSIZE, SEEK_SET);
-    if (ret < 0) {
-        SLOGE("failed to seek\n");
-        return ret;
-    }
+        if(read_structure_blk(d->infd, (unsigned long long)pos, d->buf, n)) {
+            printf("Error reading!!!\n");
+            return -1;
+        }
 
-    ret = write(d->outfd, d->buf, F2FS_BLKSIZE);
-    if (ret < 0) {
-        SLOGE("failed to write\n");
-        return ret;
-    }
-    if (ret != F2FS_BLKSIZE) {
-        SLOGE("failed to read all\n");
-        return -1;
+        ret = lseek64(d->outfd, pos * F2FS_BLKSIZE, SEEK_SET);
+        if (ret < 0) {
+            SLOGE("failed to seek\n");
+            return ret;
+        }
+
+        ret = write(d->outfd, d->buf, n * F2FS_BLKSIZE);
+        if (ret < 0) {
+            SLOGE("failed to write\n");
+            return ret;
+        }
+        if (ret != (off64_t)(n * F2FS_BLKSIZE)) {
+            SLOGE("failed to write all\n");
+            return -1;
+        }
+
+        pos += n;
+        len -= n;
     }
     return 0;
 }
@@ -625,7 +705,7 @@ int main(int argc, char **argv)
         printf("Failed to generate info!");
         return -1;
     }
-    char *buf = malloc(F2FS_BLKSIZE);
+    char *buf = malloc(COPY_BUF_BLOCKS * F2FS_BLKSIZE);
     char *zbuf = calloc(1, F2FS_BLKSIZE);
     d.buf = buf;
     d.zbuf = zbuf;
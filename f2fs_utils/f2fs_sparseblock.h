@@ -68,6 +68,8 @@ struct f2fs_info *generate_f2fs_info(int fd);
 void free_f2fs_info(struct f2fs_info *info);
 unsigned int get_f2fs_filesystem_size_sec(char *dev);
 int run_on_used_blocks(u64 startblock, struct f2fs_info *info, int (*func)(u64 pos, void *data), void *data);
+int run_on_used_extents(u64 startblock, struct f2fs_info *info,
+        int (*func)(u64 pos, u64 len, void *data), void *data);
 
 #ifdef __cplusplus
 }
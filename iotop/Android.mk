@@ -17,12 +17,14 @@ include $(CLEAR_VARS)
 
 LOCAL_CLANG := true
 
-LOCAL_SRC_FILES := iotop.cpp tasklist.cpp taskstats.cpp
+LOCAL_SRC_FILES := fileio.cpp iotop.cpp tasklist.cpp taskstats.cpp
 
 LOCAL_MODULE := iotop
 
 LOCAL_MODULE_TAGS := debug
 
+LOCAL_STATIC_LIBRARIES := libtaskstats
+
 LOCAL_SHARED_LIBRARIES := libnl libbase
 
 LOCAL_CFLAGS := -Wall -Werror
@@ -0,0 +1,438 @@
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "fileio.h"
+
+// How long readers wait for more data before reading the pages the kernel
+// is still writing to.
+constexpr int kPollTimeoutMs = 100;
+
+// Requests whose start or end wasn't seen are forgotten after this long.
+constexpr uint64_t kRequestTimeoutNs = 10000000000ULL;
+
+// Types of ring buffer events, see events/header_event
+constexpr uint32_t kTypeDataMax = 28;
+constexpr uint32_t kTypePadding = 29;
+constexpr uint32_t kTypeTimeExtend = 30;
+constexpr uint32_t kTypeTimeStamp = 31;
+constexpr int kTimeDeltaBits = 27;
+
+// Flags in the commit field of ring buffer pages
+constexpr uint64_t kMissedEvents = 1ULL << 31;
+constexpr uint64_t kMissedStored = 1ULL << 30;
+constexpr uint64_t kCommitMask = (1ULL << 27) - 1;
+
+static const char* kEventDir = "android_fs";
+
+// Finds a field in a format file, with lines like:
+//   field:loff_t offset;	offset:16;	size:8;	signed:1;
+template<typename Field>
+static bool FindField(const std::string& format, const std::string& name, Field& field) {
+  for (size_t pos = format.find("field:"); pos != std::string::npos;
+       pos = format.find("field:", pos + 1)) {
+    size_t end = format.find(';', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    size_t start = format.find_last_of(" :", end) + 1;
+    unsigned offset, size;
+    if (format.compare(start, end - start, name) == 0 &&
+        sscanf(format.c_str() + end, "; offset:%u; size:%u;", &offset, &size) == 2) {
+      field.offset = offset;
+      field.size = size;
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename Field>
+static uint64_t ReadValue(const char* data, size_t size, const Field& field) {
+  if (field.offset + field.size > size) {
+    return 0;
+  }
+  switch (field.size) {
+  case 2: {
+    uint16_t value;
+    memcpy(&value, data + field.offset, sizeof(value));
+    return value;
+  }
+  case 4: {
+    uint32_t value;
+    memcpy(&value, data + field.offset, sizeof(value));
+    return value;
+  }
+  case 8: {
+    uint64_t value;
+    memcpy(&value, data + field.offset, sizeof(value));
+    return value;
+  }
+  default:
+    return 0;
+  }
+}
+
+// Reads a __data_loc string field, whose value holds the offset of the string
+// in the event in its low 16 bits, and its length in the high ones.
+template<typename Field>
+static std::string ReadString(const char* data, size_t size, const Field& field) {
+  uint64_t loc = ReadValue(data, size, field);
+  size_t offset = loc & 0xffff;
+  size_t length = (loc >> 16) & 0xffff;
+  if (offset + length > size) {
+    return "";
+  }
+  return std::string(data + offset, strnlen(data + offset, length));
+}
+
+void FileIoStatistics::Add(const FileIoStatistics& other) {
+  read_bytes_ += other.read_bytes_;
+  write_bytes_ += other.write_bytes_;
+  completed_ += other.completed_;
+  latency_ns_ += other.latency_ns_;
+  max_latency_ns_ = std::max(max_latency_ns_, other.max_latency_ns_);
+}
+
+FileIoTracer::~FileIoTracer() {
+  Stop();
+}
+
+bool FileIoTracer::ReadEventFormat(const std::string& name, bool start, bool write) {
+  std::string format;
+  std::string path = instance_ + "/events/" + kEventDir + "/" + name + "/format";
+  if (!android::base::ReadFileToString(path, &format)) {
+    return false;
+  }
+
+  EventFormat event;
+  event.start = start;
+  event.write = write;
+  size_t id = format.find("\nID: ");
+  bool found = id != std::string::npos &&
+      FindField(format, "ino", event.ino) && FindField(format, "offset", event.offset);
+  if (start) {
+    found = found && FindField(format, "pathbuf", event.path) &&
+        FindField(format, "cmdline", event.comm) && FindField(format, "pid", event.pid) &&
+        FindField(format, "bytes", event.bytes);
+  }
+  if (!found) {
+    LOG(ERROR) << "Unexpected format of " << path;
+    return false;
+  }
+  event.id = atoi(format.c_str() + id + 5);
+  formats_.push_back(event);
+
+  return android::base::WriteStringToFile("1", instance_ + "/events/" + kEventDir + "/" +
+                                          name + "/enable");
+}
+
+bool FileIoTracer::Start() {
+  for (const char* root : {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"}) {
+    if (access(android::base::StringPrintf("%s/instances", root).c_str(), F_OK) == 0) {
+      instance_ = android::base::StringPrintf("%s/instances/iotop", root);
+      break;
+    }
+  }
+  if (instance_.empty()) {
+    LOG(ERROR) << "Unable to find tracefs";
+    return false;
+  }
+  // An instance left by an iotop that was killed is reused.
+  if (mkdir(instance_.c_str(), 0755) == -1 && errno != EEXIST) {
+    PLOG(ERROR) << "Unable to create " << instance_;
+    instance_.clear();
+    return false;
+  }
+
+  std::string header;
+  Field data;
+  if (!android::base::ReadFileToString(instance_ + "/events/header_page", &header) ||
+      !FindField(header, "timestamp", page_timestamp_) ||
+      !FindField(header, "commit", page_commit_) || !FindField(header, "data", data)) {
+    LOG(ERROR) << "Unable to read the layout of trace buffer pages";
+    Stop();
+    return false;
+  }
+  page_data_offset_ = data.offset;
+  page_size_ = data.offset + data.size;
+
+  if (!ReadEventFormat("android_fs_dataread_start", true, false) ||
+      !ReadEventFormat("android_fs_dataread_end", false, false)) {
+    LOG(ERROR) << "Unable to enable the android_fs tracepoints (does your kernel have them?)";
+    Stop();
+    return false;
+  }
+  // Writes of files are only traced by some kernels.
+  if (ReadEventFormat("android_fs_datawrite_start", true, true)) {
+    ReadEventFormat("android_fs_datawrite_end", false, true);
+  }
+
+  // Wake up the readers as soon as a page has data, rather than once the
+  // buffers are half full.
+  std::string buffer_percent = instance_ + "/buffer_percent";
+  if (access(buffer_percent.c_str(), F_OK) == 0) {
+    android::base::WriteStringToFile("0", buffer_percent);
+  }
+
+  for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF); cpu++) {
+    std::string path =
+        android::base::StringPrintf("%s/per_cpu/cpu%d/trace_pipe_raw", instance_.c_str(), cpu);
+    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1) {
+      fds_.push_back(fd);
+      readers_.emplace_back(&FileIoTracer::ReadCpu, this, fd);
+    }
+  }
+  if (fds_.empty()) {
+    LOG(ERROR) << "Unable to open the trace buffers of " << instance_;
+    Stop();
+    return false;
+  }
+  return true;
+}
+
+void FileIoTracer::Stop() {
+  if (instance_.empty()) {
+    return;
+  }
+  for (const char* name : {"android_fs_dataread_start", "android_fs_dataread_end",
+                           "android_fs_datawrite_start", "android_fs_datawrite_end"}) {
+    std::string enable = instance_ + "/events/" + kEventDir + "/" + name + "/enable";
+    if (access(enable.c_str(), F_OK) == 0) {
+      android::base::WriteStringToFile("0", enable);
+    }
+  }
+
+  stop_ = true;
+  for (std::thread& reader : readers_) {
+    reader.join();
+  }
+  readers_.clear();
+  for (int fd : fds_) {
+    close(fd);
+  }
+  fds_.clear();
+
+  formats_.clear();
+  rmdir(instance_.c_str());
+  instance_.clear();
+}
+
+void FileIoTracer::ReadCpu(int fd) {
+  std::vector<char> page(page_size_);
+  pollfd pfd = {fd, POLLIN, 0};
+
+  while (true) {
+    ssize_t n = read(fd, page.data(), page.size());
+    if (n > 0) {
+      std::lock_guard<std::mutex> guard(lock_);
+      ProcessPage(page.data(), n);
+      continue;
+    }
+    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+      PLOG(ERROR) << "Unable to read trace buffer";
+      return;
+    }
+    if (stop_) {
+      return;
+    }
+    poll(&pfd, 1, kPollTimeoutMs);
+  }
+}
+
+// Goes through the events of a page read from trace_pipe_raw.  Event
+// headers hold the time since the previous event, or since the time stamp
+// of the page for the first one.
+void FileIoTracer::ProcessPage(const char* page, size_t size) {
+  if (size < page_data_offset_) {
+    return;
+  }
+  uint64_t time_ns = ReadValue(page, size, page_timestamp_);
+  uint64_t commit = ReadValue(page, size, page_commit_);
+  const char* p = page + page_data_offset_;
+  const char* end = p + (commit & kCommitMask);
+  if (static_cast<size_t>(end - page) > size) {
+    return;
+  }
+
+  if (commit & kMissedEvents) {
+    // The number of events missed may be stored after the data.
+    long missed = 1;
+    if ((commit & kMissedStored) && static_cast<size_t>(end - page) + sizeof(missed) <= size) {
+      memcpy(&missed, end, sizeof(missed));
+    }
+    lost_events_ += missed;
+  }
+
+  while (end - p >= 4) {
+    uint32_t header;
+    memcpy(&header, p, sizeof(header));
+    p += 4;
+    uint32_t type_len = header & 0x1f;
+    uint64_t delta = header >> 5;
+
+    uint32_t array = 0;
+    if (type_len == 0 || type_len > kTypeDataMax) {
+      if (end - p < 4) {
+        break;
+      }
+      memcpy(&array, p, sizeof(array));
+    }
+
+    if (type_len == kTypeTimeExtend) {
+      time_ns += (static_cast<uint64_t>(array) << kTimeDeltaBits) | delta;
+      p += 4;
+      continue;
+    }
+    if (type_len == kTypeTimeStamp) {
+      time_ns = (static_cast<uint64_t>(array) << kTimeDeltaBits) | delta;
+      p += 4;
+      continue;
+    }
+    time_ns += delta;
+    if (type_len == kTypePadding) {
+      if (array == 0 || array > static_cast<size_t>(end - p)) {
+        break;
+      }
+      p += array;
+      continue;
+    }
+
+    size_t length;
+    if (type_len == 0) {
+      // Large events store their length, itself included, first.
+      if (array < 4) {
+        break;
+      }
+      p += 4;
+      length = (array - 4 + 3) & ~3U;
+    } else {
+      length = type_len * 4;
+    }
+    if (length > static_cast<size_t>(end - p)) {
+      break;
+    }
+    ProcessEvent(time_ns, p, length);
+    p += length;
+  }
+}
+
+void FileIoTracer::ProcessEvent(uint64_t time_ns, const char* data, size_t size) {
+  uint16_t id;
+  if (size < sizeof(id)) {
+    return;
+  }
+  memcpy(&id, data, sizeof(id));
+  auto event = std::find_if(formats_.begin(), formats_.end(),
+                            [id](const EventFormat& e) { return e.id == id; });
+  if (event == formats_.end()) {
+    return;
+  }
+  last_time_ns_ = std::max(last_time_ns_, time_ns);
+
+  RequestKey key = {ReadValue(data, size, event->ino), ReadValue(data, size, event->offset),
+                    event->write};
+  if (!event->start) {
+    auto it = started_.find(key);
+    if (it != started_.end()) {
+      Complete(it->second, time_ns);
+      started_.erase(it);
+    } else {
+      ended_[key] = time_ns;
+    }
+    return;
+  }
+
+  Request request;
+  request.time_ns = time_ns;
+  request.task_file = TaskFile(ReadValue(data, size, event->pid),
+                               ReadString(data, size, event->path));
+  request.comm = ReadString(data, size, event->comm);
+
+  FileIoStatistics& stats = stats_[request.task_file];
+  stats.pid_ = request.task_file.first;
+  stats.path_ = request.task_file.second;
+  stats.comm_ = request.comm;
+  uint64_t bytes = ReadValue(data, size, event->bytes);
+  if (event->write) {
+    stats.write_bytes_ += bytes;
+  } else {
+    stats.read_bytes_ += bytes;
+  }
+
+  auto it = ended_.find(key);
+  if (it != ended_.end() && it->second >= time_ns) {
+    Complete(request, it->second);
+    ended_.erase(it);
+  } else {
+    started_[key] = request;
+  }
+}
+
+void FileIoTracer::Complete(const Request& request, uint64_t end_ns) {
+  FileIoStatistics& stats = stats_[request.task_file];
+  if (stats.path_.empty()) {
+    stats.pid_ = request.task_file.first;
+    stats.path_ = request.task_file.second;
+    stats.comm_ = request.comm;
+  }
+  uint64_t latency = end_ns - request.time_ns;
+  stats.completed_++;
+  stats.latency_ns_ += latency;
+  stats.max_latency_ns_ = std::max(stats.max_latency_ns_, latency);
+}
+
+uint64_t FileIoTracer::Collect(std::vector<FileIoStatistics>& stats) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  stats.clear();
+  for (auto& it : stats_) {
+    stats.push_back(std::move(it.second));
+  }
+  stats_.clear();
+
+  for (auto it = started_.begin(); it != started_.end();) {
+    if (it->second.time_ns + kRequestTimeoutNs < last_time_ns_) {
+      it = started_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto it = ended_.begin(); it != ended_.end();) {
+    if (it->second + kRequestTimeoutNs < last_time_ns_) {
+      it = ended_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  uint64_t lost = lost_events_;
+  lost_events_ = 0;
+  return lost;
+}
@@ -0,0 +1,154 @@
+// Copyright (C) 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+#ifndef _IOTOP_FILEIO_H
+#define _IOTOP_FILEIO_H
+
+// Data reads and writes of a task on a file, from the android_fs
+// tracepoints.  Latencies are those of the requests whose end was seen.
+class FileIoStatistics {
+public:
+  FileIoStatistics() = default;
+  FileIoStatistics(pid_t pid, const std::string& comm, const std::string& path)
+      : comm_(comm), path_(path), pid_(pid) {}
+  void Add(const FileIoStatistics&);
+
+  pid_t pid() const { return pid_; }
+  const std::string& comm() const { return comm_; }
+  const std::string& path() const { return path_; }
+  uint64_t read() const { return read_bytes_; }
+  uint64_t write() const { return write_bytes_; }
+  uint64_t read_write() const { return read_bytes_ + write_bytes_; }
+  uint64_t latency_avg() const { return completed_ ? latency_ns_ / completed_ : 0; }
+  uint64_t latency_max() const { return max_latency_ns_; }
+
+  void set_pid(pid_t pid) { pid_ = pid; }
+  void set_comm(const std::string& comm) { comm_ = comm; }
+
+private:
+  friend class FileIoTracer;
+
+  std::string comm_;
+  std::string path_;
+  pid_t pid_ = 0;
+
+  uint64_t read_bytes_ = 0;
+  uint64_t write_bytes_ = 0;
+  uint64_t completed_ = 0;
+  uint64_t latency_ns_ = 0;
+  uint64_t max_latency_ns_ = 0;
+};
+
+class FileIoTracer {
+public:
+  FileIoTracer() = default;
+  ~FileIoTracer();
+
+  // Enables the android_fs tracepoints in a trace instance of our own, and
+  // reads its per-cpu buffers in binary on a thread each.
+  bool Start();
+  void Stop();
+
+  // Moves the statistics gathered since the last call to stats, and returns
+  // the number of events the kernel dropped meanwhile.
+  uint64_t Collect(std::vector<FileIoStatistics>& stats);
+
+private:
+  struct Field {
+    size_t offset = 0;
+    size_t size = 0;
+  };
+
+  struct EventFormat {
+    int id = -1;
+    bool start = false;
+    bool write = false;
+    // Only set for start events
+    Field path;
+    Field comm;
+    Field pid;
+    Field bytes;
+    // Set for all events
+    Field ino;
+    Field offset;
+  };
+
+  // A request is matched with its end by inode, offset and direction.
+  struct RequestKey {
+    uint64_t ino;
+    uint64_t offset;
+    bool write;
+    bool operator==(const RequestKey& other) const {
+      return ino == other.ino && offset == other.offset && write == other.write;
+    }
+  };
+  struct RequestKeyHash {
+    size_t operator()(const RequestKey& key) const {
+      return std::hash<uint64_t>()(key.ino * 31 + key.offset) ^ key.write;
+    }
+  };
+  using TaskFile = std::pair<pid_t, std::string>;
+  struct TaskFileHash {
+    size_t operator()(const TaskFile& key) const {
+      return std::hash<std::string>()(key.second) * 31 + key.first;
+    }
+  };
+  struct Request {
+    uint64_t time_ns;
+    TaskFile task_file;
+    std::string comm;
+  };
+
+  bool ReadEventFormat(const std::string& name, bool start, bool write);
+  void ReadCpu(int fd);
+  void ProcessPage(const char* page, size_t size);
+  void ProcessEvent(uint64_t time_ns, const char* data, size_t size);
+  void Complete(const Request& request, uint64_t end_ns);
+
+  std::string instance_;
+  Field page_timestamp_;
+  Field page_commit_;
+  size_t page_data_offset_ = 0;
+  size_t page_size_ = 0;
+  std::vector<EventFormat> formats_;
+
+  std::vector<std::thread> readers_;
+  std::vector<int> fds_;
+  std::atomic<bool> stop_{false};
+
+  // Protects everything below
+  std::mutex lock_;
+  std::unordered_map<TaskFile, FileIoStatistics, TaskFileHash> stats_;
+  // Starts without an end, and ends read before their start from the buffer
+  // of another cpu
+  std::unordered_map<RequestKey, Request, RequestKeyHash> started_;
+  std::unordered_map<RequestKey, uint64_t, RequestKeyHash> ended_;
+  uint64_t last_time_ns_ = 0;
+  uint64_t lost_events_ = 0;
+};
+
+#endif // _IOTOP_FILEIO_H
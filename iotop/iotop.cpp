@@ -16,6 +16,7 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <algorithm>
 #include <map>
@@ -24,11 +25,16 @@
 
 #include <android-base/logging.h>
 
+#include "fileio.h"
 #include "tasklist.h"
 #include "taskstats.h"
 
 constexpr uint64_t NSEC_PER_SEC = 1000000000;
 
+// With --listen, the threads of all processes are scanned again every
+// kRescanCycles refreshes, new processes on every refresh.
+constexpr int kRescanCycles = 10;
+
 static uint64_t BytesToKB(uint64_t bytes) {
   return (bytes + 1024-1) / 1024;
 }
@@ -38,18 +44,130 @@ static float TimeToTgidPercent(uint64_t ns, int time, const TaskStatistics& stat
   return std::min(percent, 99.99f);
 }
 
+static uint64_t BootTimeMs() {
+  timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Writes one CSV line for each task that did IO or was delayed since the
+// last refresh, see iotop_log.py
+static void WriteLog(FILE* log, uint64_t time_ms, const std::vector<TaskStatistics>& stats) {
+  for (const TaskStatistics& statistics : stats) {
+    if (statistics.read_write() == 0 && statistics.delay_total() == 0) {
+      continue;
+    }
+    std::string comm = statistics.comm();
+    std::replace(comm.begin(), comm.end(), ',', '_');
+    fprintf(log, "%" PRIu64 ",%d,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+        ",%" PRIu64 "\n",
+        time_ms,
+        statistics.pid(),
+        comm.c_str(),
+        statistics.read(),
+        statistics.write(),
+        statistics.delay_io(),
+        statistics.delay_swap(),
+        statistics.delay_sched(),
+        statistics.delay_mem());
+  }
+  fflush(log);
+}
+
+static float NsToMs(uint64_t ns) {
+  return ns / 1000000.0f;
+}
+
+// Prints the reads and writes of each file by the tasks shown above them,
+// from the android_fs tracepoints.  With processes, the threads of each
+// process are merged.
+static void PrintFiles(std::vector<FileIoStatistics>& files, uint64_t lost_events,
+                       const std::vector<TaskStatistics>& stats,
+                       const std::map<pid_t, std::vector<pid_t>>& tgid_map, bool processes,
+                       int delay_div, int limit) {
+  if (processes) {
+    std::unordered_map<pid_t, pid_t> pid_to_tgid;
+    for (auto& tgid_it : tgid_map) {
+      for (pid_t pid : tgid_it.second) {
+        pid_to_tgid[pid] = tgid_it.first;
+      }
+    }
+    std::unordered_map<pid_t, const TaskStatistics*> tgid_stats;
+    for (const TaskStatistics& statistics : stats) {
+      tgid_stats[statistics.pid()] = &statistics;
+    }
+
+    std::map<std::pair<pid_t, std::string>, FileIoStatistics> merged;
+    for (FileIoStatistics& file : files) {
+      auto tgid_it = pid_to_tgid.find(file.pid());
+      if (tgid_it != pid_to_tgid.end()) {
+        file.set_pid(tgid_it->second);
+        auto stats_it = tgid_stats.find(tgid_it->second);
+        if (stats_it != tgid_stats.end()) {
+          file.set_comm(stats_it->second->comm());
+        }
+      }
+      auto it = merged.find({file.pid(), file.path()});
+      if (it == merged.end()) {
+        merged.insert({{file.pid(), file.path()}, file});
+      } else {
+        it->second.Add(file);
+      }
+    }
+    files.clear();
+    for (auto& it : merged) {
+      files.push_back(it.second);
+    }
+  }
+
+  std::sort(files.begin(), files.end(), [](const FileIoStatistics& a, const FileIoStatistics& b) {
+    if (a.read_write() != b.read_write()) {
+      return a.read_write() > b.read_write();
+    }
+    return a.pid() < b.pid();
+  });
+
+  printf("\n%6s %-16s %6s %6s %8s %8s  %s\n", "PID", "Command", "read", "write", "avg ms",
+         "max ms", "File");
+  int n = limit;
+  for (const FileIoStatistics& file : files) {
+    if (n == 0) {
+      break;
+    } else if (n > 0) {
+      n--;
+    }
+    printf("%6d %-16s %6" PRIu64 " %6" PRIu64 " %8.2f %8.2f  %s\n",
+        file.pid(),
+        file.comm().c_str(),
+        BytesToKB(file.read()) / delay_div,
+        BytesToKB(file.write()) / delay_div,
+        NsToMs(file.latency_avg()),
+        NsToMs(file.latency_max()),
+        file.path().c_str());
+  }
+  if (lost_events) {
+    printf("(%" PRIu64 " trace events lost)\n", lost_events);
+  }
+}
+
 static void usage(char* myname) {
   printf(
-      "Usage: %s [-h] [-P] [-d <delay>] [-n <cycles>] [-s <column>]\n"
+      "Usage: %s [-h] [-P] [-L] [-f] [-l <file>] [-d <delay>] [-n <cycles>] [-s <column>]\n"
       "   -a  Show byte count instead of rate\n"
       "   -d  Set the delay between refreshes in seconds.\n"
+      "   -f  Also show the files read and written by each task, with the\n"
+      "       latency of the requests, from the android_fs tracepoints.\n"
       "   -h  Display this help screen.\n"
+      "   -l  Log the IO and delays of the tasks at each refresh to a CSV file,\n"
+      "       without displaying them. Aggregate the log with iotop_log.py.\n"
+      "   -L  Listen for task exits and only scan new processes on each refresh,\n"
+      "       rescanning all threads every %d refreshes. Cheaper with many threads.\n"
       "   -m  Set the number of processes or threads to show\n"
       "   -n  Set the number of refreshes before exiting.\n"
       "   -P  Show processes instead of the default threads.\n"
       "   -s  Set the column to sort by:\n"
       "       pid, read, write, total, io, swap, sched, mem or delay.\n",
-      myname);
+      myname, kRescanCycles);
 }
 
 using Sorter = std::function<void(std::vector<TaskStatistics>&)>;
@@ -100,9 +218,12 @@ static Sorter GetSorter(const std::string field) {
 int main(int argc, char* argv[]) {
   bool accumulated = false;
   bool processes = false;
+  bool listen = false;
+  bool files = false;
   int delay = 1;
   int cycles = -1;
   int limit = -1;
+  FILE* log = nullptr;
   Sorter sorter = GetSorter("total");
 
   android::base::InitLogging(argv, android::base::StderrLogger);
@@ -112,14 +233,17 @@ int main(int argc, char* argv[]) {
     static const option longopts[] = {
         {"accumulated", 0, 0, 'a'},
         {"delay", required_argument, 0, 'd'},
+        {"files", 0, 0, 'f'},
         {"help", 0, 0, 'h'},
         {"limit", required_argument, 0, 'm'},
+        {"listen", 0, 0, 'L'},
+        {"log", required_argument, 0, 'l'},
         {"iter", required_argument, 0, 'n'},
         {"sort", required_argument, 0, 's'},
         {"processes", 0, 0, 'P'},
         {0, 0, 0, 0},
     };
-    c = getopt_long(argc, argv, "ad:hm:n:Ps:", longopts, NULL);
+    c = getopt_long(argc, argv, "ad:fhl:Lm:n:Ps:", longopts, NULL);
     if (c < 0) {
       break;
     }
@@ -130,9 +254,24 @@ int main(int argc, char* argv[]) {
     case 'd':
       delay = atoi(optarg);
       break;
+    case 'f':
+      files = true;
+      break;
     case 'h':
       usage(argv[0]);
       return(EXIT_SUCCESS);
+    case 'l':
+      log = fopen(optarg, "we");
+      if (log == nullptr) {
+        PLOG(ERROR) << "Failed to open log file \"" << optarg << "\"";
+        return(EXIT_FAILURE);
+      }
+      fprintf(log, "time_ms,pid,comm,read_bytes,write_bytes,"
+          "delay_io_ns,delay_swap_ns,delay_sched_ns,delay_mem_ns\n");
+      break;
+    case 'L':
+      listen = true;
+      break;
     case 'm':
       limit = atoi(optarg);
       break;
@@ -159,62 +298,167 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (files && log) {
+    LOG(ERROR) << "--files can't be used with --log";
+    return(EXIT_FAILURE);
+  }
+
   std::map<pid_t, std::vector<pid_t>> tgid_map;
 
   TaskstatsSocket taskstats_socket;
   taskstats_socket.Open();
 
+  TaskstatsSocket exit_socket;
+  if (listen) {
+    exit_socket.Open();
+    if (!exit_socket.RegisterExitListener()) {
+      LOG(FATAL) << "failed to listen for task exits";
+    }
+  }
+
+  FileIoTracer file_tracer;
+  if (files && !file_tracer.Start()) {
+    return(EXIT_FAILURE);
+  }
+  std::vector<FileIoStatistics> file_stats;
+
   std::unordered_map<pid_t, TaskStatistics> pid_stats;
   std::unordered_map<pid_t, TaskStatistics> tgid_stats;
   std::vector<TaskStatistics> stats;
 
+  std::vector<pid_t> pids;
+  std::vector<pid_t> tgids;
+  std::unordered_map<pid_t, TaskStatistics> pid_stats_new;
+  std::unordered_map<pid_t, TaskStatistics> tgid_stats_new;
+  std::unordered_map<pid_t, TaskStatistics> pid_exits;
+  std::unordered_map<pid_t, TaskStatistics> tgid_exits;
+
   bool first = true;
   bool second = true;
+  int scans = 0;
+
+  // Delta of a task since the last refresh, from its final statistics if
+  // it exited since, or else from its current ones.  Tasks that exited are
+  // forgotten, false is returned for those gone without final statistics.
+  auto update_stats = [](pid_t pid, std::unordered_map<pid_t, TaskStatistics>& current,
+                         std::unordered_map<pid_t, TaskStatistics>& exits,
+                         std::unordered_map<pid_t, TaskStatistics>& previous,
+                         TaskStatistics& delta, bool& alive) {
+    auto it = exits.find(pid);
+    alive = it == exits.end();
+    if (alive) {
+      it = current.find(pid);
+      if (it == current.end()) {
+        alive = false;
+        previous.erase(pid);
+        return false;
+      }
+    }
+    delta = previous[pid].Update(it->second);
+    if (!alive) {
+      exits.erase(it);
+      previous.erase(pid);
+    }
+    return true;
+  };
 
   while (true) {
     stats.clear();
-    if (!TaskList::Scan(tgid_map)) {
+    bool scanned;
+    if (listen && scans++ % kRescanCycles != 0) {
+      scanned = TaskList::Update(tgid_map);
+    } else {
+      scanned = TaskList::Scan(tgid_map);
+    }
+    if (!scanned) {
       LOG(FATAL) << "failed to scan tasks";
     }
+
+    pids.clear();
+    tgids.clear();
     for (auto& tgid_it : tgid_map) {
-      pid_t tgid = tgid_it.first;
-      std::vector<pid_t>& pid_list = tgid_it.second;
+      tgids.push_back(tgid_it.first);
+      pids.insert(pids.end(), tgid_it.second.begin(), tgid_it.second.end());
+    }
+    pid_stats_new.clear();
+    tgid_stats_new.clear();
+    if (processes && !taskstats_socket.GetTgidStats(tgids, tgid_stats_new)) {
+      LOG(FATAL) << "failed to get process statistics";
+    }
+    if (!taskstats_socket.GetPidStats(pids, pid_stats_new)) {
+      LOG(FATAL) << "failed to get thread statistics";
+    }
+
+    // After the requests, so the tasks that are gone have their final
+    // statistics
+    pid_exits.clear();
+    tgid_exits.clear();
+    if (listen) {
+      exit_socket.ReadExits(pid_exits, tgid_exits);
+    }
+
+    for (auto tgid_it = tgid_map.begin(); tgid_it != tgid_map.end();) {
+      pid_t tgid = tgid_it->first;
+      std::vector<pid_t>& pid_list = tgid_it->second;
 
-      TaskStatistics tgid_stats_new;
       TaskStatistics tgid_stats_delta;
+      bool tgid_alive = true;
 
       if (processes) {
         // If printing processes, collect stats for the tgid which will
         // hold delay accounting data across all threads, including
         // ones that have exited.
-        if (!taskstats_socket.GetTgidStats(tgid, tgid_stats_new)) {
+        if (!update_stats(tgid, tgid_stats_new, tgid_exits, tgid_stats, tgid_stats_delta,
+                          tgid_alive)) {
+          tgid_it = tgid_map.erase(tgid_it);
           continue;
         }
-        tgid_stats_delta = tgid_stats[tgid].Update(tgid_stats_new);
       }
 
       // Collect per-thread stats
-      for (pid_t pid : pid_list) {
-        TaskStatistics pid_stats_new;
-        if (!taskstats_socket.GetPidStats(pid, pid_stats_new)) {
-          continue;
+      for (auto pid_it = pid_list.begin(); pid_it != pid_list.end();) {
+        TaskStatistics pid_stats_delta;
+        bool alive;
+
+        if (update_stats(*pid_it, pid_stats_new, pid_exits, pid_stats, pid_stats_delta, alive)) {
+          if (processes) {
+            tgid_stats_delta.AddPidToTgid(pid_stats_delta);
+          } else {
+            stats.push_back(pid_stats_delta);
+          }
         }
 
-        TaskStatistics pid_stats_delta = pid_stats[pid].Update(pid_stats_new);
-
-        if (processes) {
-          tgid_stats_delta.AddPidToTgid(pid_stats_delta);
+        if (alive) {
+          ++pid_it;
         } else {
-          stats.push_back(pid_stats_delta);
+          pid_it = pid_list.erase(pid_it);
         }
       }
 
       if (processes) {
         stats.push_back(tgid_stats_delta);
       }
+
+      if (tgid_alive) {
+        ++tgid_it;
+      } else {
+        tgid_it = tgid_map.erase(tgid_it);
+      }
+    }
+
+    // Tasks that exited and are no longer in the task list, most of them
+    // started since the last refresh and have all their statistics in it.
+    auto& exits = processes ? tgid_exits : pid_exits;
+    auto& previous = processes ? tgid_stats : pid_stats;
+    for (auto& exit_it : exits) {
+      stats.push_back(previous[exit_it.first].Update(exit_it.second));
+      previous.erase(exit_it.first);
     }
 
-    if (!first) {
+    if (!first && log) {
+      WriteLog(log, BootTimeMs(), stats);
+      if (cycles > 0 && --cycles == 0) break;
+    } else if (!first) {
       sorter(stats);
       if (!second) {
         printf("\n");
@@ -270,13 +514,25 @@ int main(int argc, char* argv[]) {
           BytesToKB(total_write) / delay_div,
           BytesToKB(total_read_write) / delay_div);
 
+      if (files) {
+        uint64_t lost_events = file_tracer.Collect(file_stats);
+        PrintFiles(file_stats, lost_events, stats, tgid_map, processes, delay_div, limit);
+      }
+
       second = false;
 
       if (cycles > 0 && --cycles == 0) break;
     }
+    if (first && files) {
+      // Only the I/O since the first refresh is shown.
+      file_tracer.Collect(file_stats);
+    }
     first = false;
     sleep(delay);
   }
 
+  if (log) {
+    fclose(log);
+  }
   return 0;
 }
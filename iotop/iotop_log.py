@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2016 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Aggregates the log written by iotop --log.
+
+By default prints the totals of each command over the whole log, largest
+IO first. --pid totals by thread or process instead, --timeline prints the
+totals of all the tasks at each refresh, and --start/--end restrict the
+log to a window of CLOCK_BOOTTIME milliseconds.
+"""
+
+import argparse
+import csv
+import sys
+
+COUNTERS = ['read_bytes', 'write_bytes', 'delay_io_ns', 'delay_swap_ns',
+            'delay_sched_ns', 'delay_mem_ns']
+
+
+def read_log(path, start, end):
+    with open(path) as f:
+        for row in csv.DictReader(f):
+            time_ms = int(row['time_ms'])
+            if start is not None and time_ms < start:
+                continue
+            if end is not None and time_ms > end:
+                continue
+            for counter in COUNTERS:
+                row[counter] = int(row[counter])
+            row['time_ms'] = time_ms
+            yield row
+
+
+def add(totals, key, row):
+    total = totals.setdefault(key, dict.fromkeys(COUNTERS, 0))
+    for counter in COUNTERS:
+        total[counter] += row[counter]
+
+
+def print_totals(title, totals, limit, by_io=True):
+    print('%-24s %10s %10s %10s %9s %9s %9s %9s' % (
+        title, 'read KiB', 'write KiB', 'total KiB', 'io ms', 'swap ms', 'sched ms', 'mem ms'))
+    if by_io:
+        rows = sorted(totals.items(),
+                      key=lambda kv: kv[1]['read_bytes'] + kv[1]['write_bytes'], reverse=True)
+    else:
+        rows = sorted(totals.items(), key=lambda kv: int(kv[0]))
+    if limit:
+        rows = rows[:limit]
+    for key, t in rows:
+        print('%-24s %10d %10d %10d %9d %9d %9d %9d' % (
+            key, t['read_bytes'] // 1024, t['write_bytes'] // 1024,
+            (t['read_bytes'] + t['write_bytes']) // 1024,
+            t['delay_io_ns'] // 1000000, t['delay_swap_ns'] // 1000000,
+            t['delay_sched_ns'] // 1000000, t['delay_mem_ns'] // 1000000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('log', metavar='LOG', help='file written by iotop --log')
+    parser.add_argument('--pid', action='store_true', help='total by pid instead of command')
+    parser.add_argument('--timeline', action='store_true', help='total at each refresh')
+    parser.add_argument('--start', type=int, help='first time to include, in ms')
+    parser.add_argument('--end', type=int, help='last time to include, in ms')
+    parser.add_argument('-m', '--limit', type=int, default=0, help='number of rows to show')
+    args = parser.parse_args()
+
+    totals = {}
+    for row in read_log(args.log, args.start, args.end):
+        if args.timeline:
+            key = str(row['time_ms'])
+        elif args.pid:
+            key = '%s (%s)' % (row['pid'], row['comm'])
+        else:
+            key = row['comm']
+        add(totals, key, row)
+
+    if args.timeline:
+        print_totals('time ms', totals, args.limit, by_io=False)
+        return 0
+
+    print_totals('pid (command)' if args.pid else 'command', totals, args.limit)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -20,6 +20,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -56,6 +57,32 @@ bool TaskList::Scan(std::map<pid_t, std::vector<pid_t>>& tgid_map) {
   });
 }
 
+bool TaskList::Update(std::map<pid_t, std::vector<pid_t>>& tgid_map) {
+  std::set<pid_t> tgids;
+  if (!ScanPidsInDir("/proc", [&tgids](pid_t tgid) { tgids.insert(tgid); })) {
+    return false;
+  }
+
+  for (auto it = tgid_map.begin(); it != tgid_map.end();) {
+    if (tgids.count(it->first)) {
+      ++it;
+    } else {
+      it = tgid_map.erase(it);
+    }
+  }
+
+  for (pid_t tgid : tgids) {
+    if (tgid_map.count(tgid) == 0) {
+      std::vector<pid_t> pid_list;
+      if (ScanPid(tgid, pid_list)) {
+        tgid_map.insert({tgid, pid_list});
+      }
+    }
+  }
+
+  return true;
+}
+
 bool TaskList::ScanPid(pid_t tgid, std::vector<pid_t>& pid_list) {
   std::string filename = android::base::StringPrintf("/proc/%d/task", tgid);
 
@@ -21,6 +21,9 @@
 class TaskList {
 public:
   static bool Scan(std::map<pid_t, std::vector<pid_t>>&);
+  // Only scans the threads of the processes that are new since the last
+  // scan, and drops the processes that are gone.
+  static bool Update(std::map<pid_t, std::vector<pid_t>>&);
 
 private:
   TaskList() {}
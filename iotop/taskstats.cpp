@@ -13,155 +13,125 @@
 // limitations under the License.
 
 #include <linux/taskstats.h>
-#include <netlink/socket.h>
-#include <netlink/genl/ctrl.h>
-#include <netlink/genl/genl.h>
 
-#include <algorithm>
+#include <string.h>
+
 #include <memory>
+#include <string>
 
 #include <android-base/logging.h>
+#include <taskstats/taskstats.h>
 
 #include "taskstats.h"
 
 TaskstatsSocket::TaskstatsSocket()
-    : nl_(nullptr, nl_socket_free), family_id_(0) {
+    : sock_(nullptr, ts_socket_close) {
 }
 
 bool TaskstatsSocket::Open() {
-  std::unique_ptr<nl_sock, decltype(&nl_socket_free)> nl(
-      nl_socket_alloc(), nl_socket_free);
-  if (!nl.get()) {
-    LOG(FATAL) << "Failed to allocate netlink socket";
+  ts_socket_t* sock;
+  int ret = ts_socket_open(&sock);
+  if (ret == EPROTONOSUPPORT) {
+    LOG(FATAL) << "Unable to determine taskstats family id (does your kernel support taskstats?)";
+  } else if (ret) {
+    LOG(FATAL) << strerror(ret) << std::endl << "Unable to open netlink socket (are you root?)";
   }
 
-  int ret = genl_connect(nl.get());
-  if (ret < 0) {
-    LOG(FATAL) << nl_geterror(ret) << std::endl << "Unable to open netlink socket (are you root?)";
-  }
+  sock_.reset(sock);
+
+  return true;
+}
+
+void TaskstatsSocket::Close() {
+  sock_.reset();
+}
 
-  int family_id = genl_ctrl_resolve(nl.get(), TASKSTATS_GENL_NAME);
-  if (family_id < 0) {
-    LOG(FATAL) << nl_geterror(family_id) << std::endl << "Unable to determine taskstats family id (does your kernel support taskstats?)";
+bool TaskstatsSocket::GetStats(int pid, int type, TaskStatistics& stats) {
+  taskstats taskstats_stats = taskstats();
+  int ret = ts_get_stats(sock_.get(), type, pid, &taskstats_stats);
+  if (ret && ret != ESRCH) {
+    return false;
   }
 
-  nl_ = std::move(nl);
-  family_id_ = family_id;
+  stats = TaskStatistics(taskstats_stats);
 
   return true;
 }
 
-void TaskstatsSocket::Close() {
-  nl_.reset();
+bool TaskstatsSocket::GetPidStats(int pid, TaskStatistics& stats) {
+  return GetStats(pid, TASKSTATS_CMD_ATTR_PID, stats);
 }
 
-struct TaskStatsRequest {
-  pid_t requested_pid;
-  taskstats stats;
-};
-
-static pid_t ParseAggregateTaskStats(nlattr* attr, int attr_size,
-                                     taskstats* stats) {
-  pid_t received_pid = -1;
-  nla_for_each_attr(attr, attr, attr_size, attr_size) {
-    switch (nla_type(attr)) {
-    case TASKSTATS_TYPE_PID:
-    case TASKSTATS_TYPE_TGID:
-      received_pid = nla_get_u32(attr);
-      break;
-    case TASKSTATS_TYPE_STATS:
-    {
-      int len = static_cast<int>(sizeof(*stats));
-      len = std::min(len, nla_len(attr));
-      nla_memcpy(stats, attr, len);
-      return received_pid;
-    }
-    default:
-      LOG(ERROR) << "unexpected attribute inside AGGR";
-      return -1;
-    }
+bool TaskstatsSocket::GetTgidStats(int tgid, TaskStatistics& stats) {
+  bool ret = GetStats(tgid, TASKSTATS_CMD_ATTR_TGID, stats);
+  if (ret) {
+    stats.set_pid(tgid);
   }
-
-  return -1;
+  return ret;
 }
 
-static int ParseTaskStats(nl_msg* msg, void* arg) {
-  TaskStatsRequest* taskstats_request = static_cast<TaskStatsRequest*>(arg);
-  genlmsghdr* gnlh = static_cast<genlmsghdr*>(nlmsg_data(nlmsg_hdr(msg)));
-  nlattr* attr = genlmsg_attrdata(gnlh, 0);
-  int remaining = genlmsg_attrlen(gnlh, 0);
-
-  nla_for_each_attr(attr, attr, remaining, remaining) {
-    switch (nla_type(attr)) {
-    case TASKSTATS_TYPE_AGGR_PID:
-    case TASKSTATS_TYPE_AGGR_TGID:
-    {
-      nlattr* nested_attr = static_cast<nlattr*>(nla_data(attr));
-      taskstats stats;
-      pid_t ret;
-
-      ret = ParseAggregateTaskStats(nested_attr, nla_len(attr), &stats);
-      if (ret < 0) {
-        LOG(ERROR) << "Bad AGGR_PID contents";
-      } else if (ret == taskstats_request->requested_pid) {
-        taskstats_request->stats = stats;
-      } else {
-        LOG(WARNING) << "got taskstats for unexpected pid " << ret <<
-            " (expected " << taskstats_request->requested_pid << ", continuing...";
-      }
-      break;
-    }
-    case TASKSTATS_TYPE_NULL:
-      break;
-    default:
-      LOG(ERROR) << "unexpected attribute in taskstats";
+struct TaskStatsMaps {
+  std::unordered_map<pid_t, TaskStatistics>* pid_stats;
+  std::unordered_map<pid_t, TaskStatistics>* tgid_stats;
+};
+
+static void AddTaskStats(int type, pid_t pid, const taskstats* stats, void* arg) {
+  TaskStatsMaps* maps = static_cast<TaskStatsMaps*>(arg);
+  if (type == TASKSTATS_TYPE_PID) {
+    if (maps->pid_stats) {
+      (*maps->pid_stats)[pid] = TaskStatistics(*stats);
     }
+  } else if (maps->tgid_stats) {
+    TaskStatistics tgid_stats(*stats);
+    tgid_stats.set_pid(pid);
+    (*maps->tgid_stats)[pid] = tgid_stats;
   }
-  return NL_OK;
 }
 
-bool TaskstatsSocket::GetStats(int pid, int type, TaskStatistics& stats) {
-  TaskStatsRequest taskstats_request = TaskStatsRequest();
-  taskstats_request.requested_pid = pid;
-
-  std::unique_ptr<nl_msg, decltype(&nlmsg_free)> message(nlmsg_alloc(),
-                                                         nlmsg_free);
+bool TaskstatsSocket::GetStatsBatch(const std::vector<pid_t>& ids, int type,
+                                    std::unordered_map<pid_t, TaskStatistics>& stats) {
+  TaskStatsMaps maps = TaskStatsMaps();
+  if (type == TASKSTATS_CMD_ATTR_PID) {
+    maps.pid_stats = &stats;
+  } else {
+    maps.tgid_stats = &stats;
+  }
 
-  genlmsg_put(message.get(), NL_AUTO_PID, NL_AUTO_SEQ, family_id_, 0, 0,
-              TASKSTATS_CMD_GET, TASKSTATS_VERSION);
-  nla_put_u32(message.get(), type, pid);
+  return ts_get_stats_batch(sock_.get(), type, ids.data(), ids.size(), AddTaskStats,
+                            &maps) == 0;
+}
 
-  int result = nl_send_auto_complete(nl_.get(), message.get());
-  if (result < 0) {
-    return false;
-  }
+bool TaskstatsSocket::GetPidStats(const std::vector<pid_t>& pids,
+                                  std::unordered_map<pid_t, TaskStatistics>& stats) {
+  return GetStatsBatch(pids, TASKSTATS_CMD_ATTR_PID, stats);
+}
 
-  std::unique_ptr<nl_cb, decltype(&nl_cb_put)> callbacks(
-      nl_cb_alloc(NL_CB_DEFAULT), nl_cb_put);
-  nl_cb_set(callbacks.get(), NL_CB_VALID, NL_CB_CUSTOM, &ParseTaskStats,
-            static_cast<void*>(&taskstats_request));
+bool TaskstatsSocket::GetTgidStats(const std::vector<pid_t>& tgids,
+                                   std::unordered_map<pid_t, TaskStatistics>& stats) {
+  return GetStatsBatch(tgids, TASKSTATS_CMD_ATTR_TGID, stats);
+}
 
-  result = nl_recvmsgs(nl_.get(), callbacks.get());
-  if (result < 0) {
+bool TaskstatsSocket::RegisterExitListener() {
+  int ret = ts_register_exits(sock_.get(), nullptr);
+  if (ret) {
+    LOG(ERROR) << strerror(ret) << std::endl << "Unable to register for task exits";
     return false;
   }
-  nl_wait_for_ack(nl_.get());
-
-  stats = TaskStatistics(taskstats_request.stats);
-
   return true;
 }
 
-bool TaskstatsSocket::GetPidStats(int pid, TaskStatistics& stats) {
-  return GetStats(pid, TASKSTATS_CMD_ATTR_PID, stats);
-}
+bool TaskstatsSocket::ReadExits(std::unordered_map<pid_t, TaskStatistics>& pid_stats,
+                                std::unordered_map<pid_t, TaskStatistics>& tgid_stats) {
+  TaskStatsMaps maps = { &pid_stats, &tgid_stats };
+  size_t dropped = 0;
 
-bool TaskstatsSocket::GetTgidStats(int tgid, TaskStatistics& stats) {
-  bool ret = GetStats(tgid, TASKSTATS_CMD_ATTR_TGID, stats);
-  if (ret) {
-    stats.set_pid(tgid);
+  ts_read_exits(sock_.get(), AddTaskStats, &maps, &dropped);
+  if (dropped) {
+    // The exits lost are handled like those of tasks that were not followed
+    LOG(WARNING) << "dropped task exit notifications";
   }
-  return ret;
+
+  return true;
 }
 
 TaskStatistics::TaskStatistics(const taskstats& taskstats_stats) {
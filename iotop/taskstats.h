@@ -14,13 +14,15 @@
 
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <stdint.h>
 
 #ifndef _IOTOP_TASKSTATS_H
 #define _IOTOP_TASKSTATS_H
 
-struct nl_sock;
+struct ts_socket;
 struct taskstats;
 
 class TaskStatistics {
@@ -85,10 +87,23 @@ public:
 
   bool GetPidStats(int, TaskStatistics&);
   bool GetTgidStats(int, TaskStatistics&);
+
+  // Get the statistics of many pids or tgids, with the requests sent in
+  // batches of netlink messages.  Tasks that are gone have no entry.
+  bool GetPidStats(const std::vector<pid_t>&, std::unordered_map<pid_t, TaskStatistics>&);
+  bool GetTgidStats(const std::vector<pid_t>&, std::unordered_map<pid_t, TaskStatistics>&);
+
+  // Register to receive the final statistics of the tasks exiting on any
+  // cpu, which ReadExits then returns without blocking.  Exits of whole
+  // thread groups also have the statistics of the tgid.
+  bool RegisterExitListener();
+  bool ReadExits(std::unordered_map<pid_t, TaskStatistics>& pid_stats,
+                 std::unordered_map<pid_t, TaskStatistics>& tgid_stats);
 private:
   bool GetStats(int, int, TaskStatistics& stats);
-  std::unique_ptr<nl_sock, void(*)(nl_sock*)> nl_;
-  int family_id_;
+  bool GetStatsBatch(const std::vector<pid_t>&, int,
+                     std::unordered_map<pid_t, TaskStatistics>&);
+  std::unique_ptr<ts_socket, void(*)(ts_socket*)> sock_;
 };
 
 #endif // _IOTOP_TASKSTATS_H
@@ -1,6 +1,7 @@
 #ifndef _SYS_KEXEC_H
 #define _SYS_KEXEC_H
 
+#include <errno.h>
 #include <sys/cdefs.h>
 #include <linux/kexec.h>
 #include <unistd.h>
@@ -12,6 +13,14 @@
 #define KEXEC_TYPE_DEFAULT 0
 #define KEXEC_TYPE_CRASH   1
 
+/* kexec_file_load flags, missing from older kernel headers */
+#ifndef KEXEC_FILE_ON_CRASH
+#define KEXEC_FILE_ON_CRASH     0x00000002
+#endif
+#ifndef KEXEC_FILE_NO_INITRAMFS
+#define KEXEC_FILE_NO_INITRAMFS 0x00000004
+#endif
+
 /*
  * Prototypes
  */
@@ -21,4 +30,20 @@ static inline long kexec_load(unsigned int entry, unsigned long nr_segments,
    return syscall(__NR_kexec_load, entry, nr_segments, segment, flags);
 }
 
+/*
+ * The kernel parses and verifies the images itself. Not all architectures
+ * have it, in which case it fails with ENOSYS.
+ */
+static inline long kexec_file_load(int kernel_fd, int initrd_fd,
+                unsigned long cmdline_len, const char *cmdline,
+                unsigned long flags) {
+#ifdef __NR_kexec_file_load
+   return syscall(__NR_kexec_file_load, kernel_fd, initrd_fd, cmdline_len,
+                  cmdline, flags);
+#else
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
 #endif /* _SYS_KEXEC_H */
@@ -1,15 +1,20 @@
 #include <errno.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/reboot.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <linux/reboot.h>
 
 #include "kexec.h"
 
@@ -23,6 +28,24 @@
 
 #define ROUND_TO_PAGE(address,pagesize) ((address + pagesize - 1) & (~(pagesize - 1)))
 
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+/*
+ * Images staged in a manifest, with the checksum computed when they were
+ * staged. An image whose size and modification time did not change since
+ * is loaded without reading it all again.
+ */
+struct staged_image {
+    char path[PATH_MAX];
+    uint64_t checksum;
+    long long size;
+    struct timespec mtime;
+};
+
+static struct staged_image *staged;
+static int staged_count;
+
 /*
  * Gives file position and resets current position to begining of file
  */
@@ -33,6 +56,254 @@ int get_file_size(int f)
     return st.st_size;
 }
 
+static long long now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * 64 bit FNV-1a, to detect images corrupted or replaced after staging
+ */
+static int checksum_file(int fd, long long size, uint64_t *checksum)
+{
+    const unsigned char *data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    long long i;
+
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_POPULATE | MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return -1;
+        }
+        for (i = 0; i < size; i++) {
+            hash = (hash ^ data[i]) * 0x100000001b3ULL;
+        }
+        munmap((void *) data, size);
+    }
+    *checksum = hash;
+    return 0;
+}
+
+static int read_manifest(const char *manifest)
+{
+    FILE *f;
+    struct staged_image image;
+
+    f = fopen(manifest, "r");
+    if (!f) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while (fscanf(f, "%" SCNx64 " %lld %ld.%ld %4095[^\n]", &image.checksum, &image.size,
+                  &image.mtime.tv_sec, &image.mtime.tv_nsec, image.path) == 5) {
+        struct staged_image *grown = realloc(staged, (staged_count + 1) * sizeof(*staged));
+        if (!grown) {
+            fclose(f);
+            return -1;
+        }
+        staged = grown;
+        staged[staged_count++] = image;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int write_manifest(const char *manifest)
+{
+    char tmp[PATH_MAX];
+    FILE *f;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", manifest);
+    f = fopen(tmp, "w");
+    if (!f) {
+        return -1;
+    }
+    for (i = 0; i < staged_count; i++) {
+        fprintf(f, "%016" PRIx64 " %lld %ld.%09ld %s\n", staged[i].checksum, staged[i].size,
+                (long) staged[i].mtime.tv_sec, staged[i].mtime.tv_nsec, staged[i].path);
+    }
+    if (fflush(f) || fsync(fileno(f))) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return rename(tmp, manifest);
+}
+
+static struct staged_image *find_staged(const char *path)
+{
+    int i;
+
+    for (i = 0; i < staged_count; i++) {
+        if (!strcmp(staged[i].path, path)) {
+            return &staged[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Checksums the images and records them in the manifest, replacing
+ * earlier entries of the same paths
+ */
+int stage_images(const char *manifest, int count, char *paths[])
+{
+    struct staged_image image, *entry;
+    struct stat st;
+    long long start;
+    int i, fd;
+
+    if (read_manifest(manifest)) {
+        fprintf(stderr, "Unable to read manifest %s: %s\n", manifest, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!realpath(paths[i], image.path)) {
+            fprintf(stderr, "Unable to find %s: %s\n", paths[i], strerror(errno));
+            return 1;
+        }
+        start = now_ns(CLOCK_MONOTONIC);
+        fd = open(image.path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) ||
+            checksum_file(fd, st.st_size, &image.checksum)) {
+            fprintf(stderr, "Unable to read %s: %s\n", image.path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+        image.size = st.st_size;
+        image.mtime = st.st_mtim;
+
+        entry = find_staged(image.path);
+        if (!entry) {
+            entry = realloc(staged, (staged_count + 1) * sizeof(*staged));
+            if (!entry) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            staged = entry;
+            entry = &staged[staged_count++];
+        }
+        *entry = image;
+        printf("Staged %s: %lld bytes, checksum %016" PRIx64 " in %lld ms\n", image.path,
+               image.size, image.checksum, (now_ns(CLOCK_MONOTONIC) - start) / NSEC_PER_MSEC);
+    }
+
+    if (write_manifest(manifest)) {
+        fprintf(stderr, "Unable to write manifest %s: %s\n", manifest, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Checks an image against the manifest, if one was given. Images that
+ * were modified since they were staged are checksummed again.
+ */
+int verify_image(const char *manifest, const char *path, int fd)
+{
+    char real[PATH_MAX];
+    struct staged_image *image;
+    struct stat st;
+    uint64_t checksum;
+
+    if (!manifest) {
+        return 0;
+    }
+    if (!realpath(path, real) || !(image = find_staged(real))) {
+        fprintf(stderr, "%s is not staged in %s\n", path, manifest);
+        return 1;
+    }
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "Unable to stat %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (st.st_size == image->size &&
+        st.st_mtim.tv_sec == image->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == image->mtime.tv_nsec) {
+        return 0;
+    }
+    if (checksum_file(fd, st.st_size, &checksum) || checksum != image->checksum) {
+        fprintf(stderr, "%s changed since it was staged\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Records when kexecload was invoked and how long loading took, for
+ * report_timestamp to read back from the new kernel
+ */
+void write_timestamp(const char *timestamp, long long invoked, long long loaded)
+{
+    FILE *f;
+
+    f = fopen(timestamp, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to write %s: %s\n", timestamp, strerror(errno));
+        return;
+    }
+    fprintf(f, "%lld %lld\n", invoked, loaded);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+}
+
+/*
+ * Prints the time from the invocation recorded in timestamp to the start
+ * of the running kernel and of its init. The kernel start is derived from
+ * the realtime clock, which the new kernel usually sets from the RTC, so it
+ * is only accurate to about a second unless the clock was synchronized.
+ */
+int report_timestamp(const char *timestamp)
+{
+    FILE *f;
+    long long invoked, loaded, booted, init_ticks;
+    char stat[1024], *p;
+    int i;
+
+    f = fopen(timestamp, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to read %s: %s\n", timestamp, strerror(errno));
+        return 1;
+    }
+    if (fscanf(f, "%lld %lld", &invoked, &loaded) != 2) {
+        fprintf(stderr, "Malformed timestamp file %s\n", timestamp);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    booted = now_ns(CLOCK_REALTIME) - now_ns(CLOCK_BOOTTIME);
+
+    // starttime is the 22nd field, after the command in parentheses
+    init_ticks = -1;
+    f = fopen("/proc/1/stat", "r");
+    if (f) {
+        if (fgets(stat, sizeof(stat), f) && (p = strrchr(stat, ')'))) {
+            for (i = 2; i < 22 && p; i++) {
+                p = strchr(p + 1, ' ');
+            }
+            if (p) {
+                init_ticks = strtoll(p + 1, NULL, 10);
+            }
+        }
+        fclose(f);
+    }
+
+    printf("Load: %lld ms\n", (loaded - invoked) / NSEC_PER_MSEC);
+    printf("Invocation to kernel start: %lld ms\n", (booted - invoked) / NSEC_PER_MSEC);
+    if (init_ticks >= 0) {
+        printf("Invocation to init: %lld ms\n",
+               (booted + init_ticks * NSEC_PER_SEC / sysconf(_SC_CLK_TCK) - invoked) /
+               NSEC_PER_MSEC);
+    }
+    return 0;
+}
+
 int test_kexeccall() {
     int rv;
 
@@ -52,13 +323,70 @@ void usage(void)
 {
     fprintf(stderr,
             "usage: kexecload [ <option> ] <atags path> <kernel path>\n"
+            "       kexecload -f [ <option> ] <kernel path>\n"
+            "       kexecload -m <manifest> -S <image path>...\n"
+            "       kexecload -R <timestamp file>\n"
             "\n"
             "options:\n"
             "  -t                                       tests syscall\n"
             "  -s <start address>                       specify start address of kernel\n"
+            "  -e, --exec                               load as the next kernel instead of the\n"
+            "                                           crash kernel, and reboot into it\n"
+            "  -f, --file                               load with kexec_file_load\n"
+            "  -r, --ramdisk <path>                     ramdisk for kexec_file_load\n"
+            "  -c, --cmdline <command line>             command line for kexec_file_load\n"
+            "  -m, --manifest <path>                    only load images staged in manifest\n"
+            "  -S, --stage                              checksum images into the manifest\n"
+            "  -T, --timestamp <path>                   record invocation and load times\n"
+            "  -R, --report <path>                      print times from invocation to the\n"
+            "                                           start of this kernel and its init\n"
         );
 }
 
+/*
+ * Loads the kernel and ramdisk with kexec_file_load
+ */
+int file_load(const char *kernel, const char *ramdisk, const char *cmdline,
+              const char *manifest, int exec)
+{
+    int kernel_fd, ramdisk_fd = -1;
+    unsigned long flags = exec ? 0 : KEXEC_FILE_ON_CRASH;
+
+    kernel_fd = open(kernel, O_RDONLY);
+    if (kernel_fd < 0) {
+        fprintf(stderr, "Error during opening of the kernel file %s\n", strerror(errno));
+        return 1;
+    }
+    if (ramdisk) {
+        ramdisk_fd = open(ramdisk, O_RDONLY);
+        if (ramdisk_fd < 0) {
+            fprintf(stderr, "Error during opening of the ramdisk file %s\n", strerror(errno));
+            return 1;
+        }
+    } else {
+        flags |= KEXEC_FILE_NO_INITRAMFS;
+    }
+
+    if (verify_image(manifest, kernel, kernel_fd) ||
+        (ramdisk && verify_image(manifest, ramdisk, ramdisk_fd))) {
+        return 1;
+    }
+
+    // The length includes the terminating NUL
+    if (kexec_file_load(kernel_fd, ramdisk_fd, cmdline ? strlen(cmdline) + 1 : 0,
+                        cmdline, flags) != 0) {
+        fprintf(stderr, "Kexec_file_load failed with errno %d (%s)\n", errno, strerror(errno));
+        return 1;
+    }
+
+    close(kernel_fd);
+    if (ramdisk_fd >= 0) {
+        close(ramdisk_fd);
+    }
+    printf("Done! Kexec loaded\n");
+    return 0;
+}
+
 /*
  * Loads kexec into the kernel and sets kexec on crash
  */
@@ -76,22 +404,57 @@ int main(int argc, char *argv[])
     int page_size = getpagesize();
     void *start_address = (void *)START_ADDRESS;
     int c;
+    long long invoked = now_ns(CLOCK_REALTIME);
+    int exec = 0, use_file_load = 0, stage = 0;
+    const char *ramdisk = NULL, *cmdline = NULL;
+    const char *manifest = NULL, *timestamp = NULL;
 
     const struct option longopts[] = {
         {"start_address", required_argument, 0, 's'},
         {"test", 0, 0, 't'},
         {"help", 0, 0, 'h'},
+        {"exec", 0, 0, 'e'},
+        {"file", 0, 0, 'f'},
+        {"ramdisk", required_argument, 0, 'r'},
+        {"cmdline", required_argument, 0, 'c'},
+        {"manifest", required_argument, 0, 'm'},
+        {"stage", 0, 0, 'S'},
+        {"timestamp", required_argument, 0, 'T'},
+        {"report", required_argument, 0, 'R'},
         {0, 0, 0, 0}
     };
 
     while (1) {
         int option_index = 0;
-        c = getopt_long(argc, argv, "s:th", longopts, NULL);
+        c = getopt_long(argc, argv, "s:thefr:c:m:ST:R:", longopts, NULL);
         if (c < 0) {
             break;
         }
         /* Alphabetical cases */
         switch (c) {
+        case 'R':
+            return report_timestamp(optarg);
+        case 'S':
+            stage = 1;
+            break;
+        case 'T':
+            timestamp = optarg;
+            break;
+        case 'c':
+            cmdline = optarg;
+            break;
+        case 'e':
+            exec = 1;
+            break;
+        case 'f':
+            use_file_load = 1;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'r':
+            ramdisk = optarg;
+            break;
         case 's':
             start_address = (void *) strtoul(optarg, 0, 16);
             break;
@@ -111,6 +474,30 @@ int main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
+    if (stage) {
+        if (!manifest || argc < 1) {
+            usage();
+            return 1;
+        }
+        return stage_images(manifest, argc, argv);
+    }
+
+    if (manifest && read_manifest(manifest)) {
+        fprintf(stderr, "Unable to read manifest %s: %s\n", manifest, strerror(errno));
+        return 1;
+    }
+
+    if (use_file_load) {
+        if (argc < 1) {
+            usage();
+            return 1;
+        }
+        if (file_load(argv[0], ramdisk, cmdline, manifest, exec)) {
+            return 1;
+        }
+        goto loaded;
+    }
+
     if (argc < 2) {
         usage();
         return 1;
@@ -124,6 +511,11 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (verify_image(manifest, argv[0], atag_file) ||
+        verify_image(manifest, argv[1], zimage_file)) {
+        return 1;
+    }
+
     atag_size = ROUND_TO_PAGE(get_file_size(atag_file), page_size);
     zimage_size = ROUND_TO_PAGE(get_file_size(zimage_file), page_size);
 
@@ -151,7 +543,8 @@ int main(int argc, char *argv[])
     segment[1].memsz = atag_size;
 
     rv = kexec_load(((uintptr_t) start_address + KEXEC_ARM_ZIMAGE_OFFSET),
-                    2, (void *) segment, KEXEC_ARCH_DEFAULT | KEXEC_ON_CRASH);
+                    2, (void *) segment,
+                    KEXEC_ARCH_DEFAULT | (exec ? 0 : KEXEC_ON_CRASH));
 
     if (rv != 0) {
         fprintf(stderr, "Kexec_load returned non-zero exit code: %d with errno %d\n", rv, errno);
@@ -161,7 +554,18 @@ int main(int argc, char *argv[])
     printf("Done! Kexec loaded\n");
     printf("New kernel should start at 0x%08x\n", START_ADDRESS + KEXEC_ARM_ZIMAGE_OFFSET);
 
+loaded:
+    if (timestamp) {
+        write_timestamp(timestamp, invoked, now_ns(CLOCK_REALTIME));
+    }
+
+    if (exec) {
+        sync();
+        reboot(LINUX_REBOOT_CMD_KEXEC);
+        fprintf(stderr, "Reboot into the new kernel failed: %s\n", strerror(errno));
+        return 1;
+    }
+
     return 0;
 
 }
-
@@ -15,7 +15,7 @@
 LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := ksminfo.c lookup3.c
+LOCAL_SRC_FILES := ksminfo.c
 LOCAL_SHARED_LIBRARIES := libpagemap
 LOCAL_MODULE := ksminfo
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
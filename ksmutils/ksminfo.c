@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <pagemap/pagemap.h>
@@ -36,6 +37,13 @@
 #define PR_SORTED       1
 #define PR_VERBOSE      2
 #define PR_ALL          4
+#define PR_SAVINGS      8
+
+/* Pages are read from the process READ_BATCH at a time */
+#define READ_BATCH    64
+
+/* Initial size of the hash tables, which must be a power of two */
+#define TABLE_INITIAL 1024
 
 struct vaddr {
     unsigned long addr;
@@ -45,16 +53,27 @@ struct vaddr {
 
 struct ksm_page {
     uint64_t count;
-    uint32_t hash;
+    uint64_t hash;
     struct vaddr *vaddr;
     size_t vaddr_len, vaddr_size;
     size_t vaddr_count;
+    /* Physical frames with this content, counted with PR_SAVINGS only */
+    size_t num_frames;
     uint16_t pattern;
 };
 
+/* Open addressing tables, with linear probing.  table maps page hashes to
+ * indices in pages, and frames holds the PFNs (plus one, so that 0 marks
+ * an empty slot) of the frames seen so far. */
 struct ksm_pages {
     struct ksm_page *pages;
     size_t len, size;
+
+    size_t *table;
+    size_t table_size;
+
+    uint64_t *frames;
+    size_t frames_len, frames_size;
 };
 
 static void usage(char *myname);
@@ -64,7 +83,7 @@ static void print_pages(struct ksm_pages *kp, uint8_t pr_flags);
 static void free_pages(struct ksm_pages *kp, uint8_t pr_flags);
 static bool is_pattern(uint8_t *data, size_t len);
 static int cmp_pages(const void *a, const void *b);
-extern uint32_t hashword(const uint32_t *, size_t, int32_t);
+static uint64_t hash_page(const uint64_t *data, size_t len);
 
 int main(int argc, char *argv[]) {
     pm_kernel_t *ker;
@@ -84,7 +103,7 @@ int main(int argc, char *argv[]) {
 
     opterr = 0;
     do {
-        int c = getopt(argc, argv, "hvsa");
+        int c = getopt(argc, argv, "hvsap");
         if (c == -1)
             break;
 
@@ -98,6 +117,9 @@ int main(int argc, char *argv[]) {
             case 'v':
                 pr_flags |= PR_VERBOSE;
                 break;
+            case 'p':
+                pr_flags |= PR_SAVINGS;
+                break;
             case 'h':
                 usage(argv[0]);
                 exit(EXIT_SUCCESS);
@@ -146,7 +168,7 @@ int main(int argc, char *argv[]) {
         printf("%s (%u):\n", cmdline, *pids);
     }
 
-    printf("Warning: this tool only compares the KSM CRCs of pages, there is a chance of "
+    printf("Warning: this tool only compares the hashes of pages, there is a chance of "
             "collisions\n");
 
     for (i = 0; i < num_procs; i++) {
@@ -187,39 +209,238 @@ exit:
     return rc;
 }
 
+/*
+ * Find the page with the given hash, or the empty slot where it belongs.
+ */
+static size_t *find_page(struct ksm_pages *kp, uint64_t hash) {
+    size_t mask = kp->table_size - 1;
+    size_t i;
+
+    for (i = hash & mask; kp->table[i] != SIZE_MAX; i = (i + 1) & mask) {
+        if (kp->pages[kp->table[i]].hash == hash) break;
+    }
+    return &kp->table[i];
+}
+
+static int grow_table(struct ksm_pages *kp) {
+    size_t old_size = kp->table_size;
+    size_t *old_table = kp->table;
+    size_t i;
+
+    kp->table_size = old_size ? old_size * 2 : TABLE_INITIAL;
+    kp->table = malloc(kp->table_size * sizeof(*kp->table));
+    if (kp->table == NULL) {
+        kp->table = old_table;
+        kp->table_size = old_size;
+        return -1;
+    }
+    memset(kp->table, 0xff, kp->table_size * sizeof(*kp->table));
+
+    for (i = 0; i < old_size; i++) {
+        if (old_table[i] != SIZE_MAX) {
+            *find_page(kp, kp->pages[old_table[i]].hash) = old_table[i];
+        }
+    }
+    free(old_table);
+    return 0;
+}
+
+/*
+ * Add a PFN to the frames seen so far. Returns 1 if it is new, 0 if it was
+ * already seen, and -1 on failure.
+ */
+static int add_frame(struct ksm_pages *kp, uint64_t pfn) {
+    size_t mask, i;
+
+    if (kp->frames_len * 2 >= kp->frames_size) {
+        size_t old_size = kp->frames_size;
+        uint64_t *old_frames = kp->frames;
+        size_t size = old_size ? old_size * 2 : TABLE_INITIAL;
+        uint64_t *frames = calloc(size, sizeof(*frames));
+
+        if (frames == NULL) {
+            return -1;
+        }
+        kp->frames = frames;
+        kp->frames_size = size;
+        kp->frames_len = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old_frames[i]) {
+                add_frame(kp, old_frames[i] - 1);
+            }
+        }
+        free(old_frames);
+    }
+
+    mask = kp->frames_size - 1;
+    for (i = (pfn * 0x9e3779b97f4a7c15ULL) >> 32 & mask; kp->frames[i]; i = (i + 1) & mask) {
+        if (kp->frames[i] == pfn + 1) return 0;
+    }
+    kp->frames[i] = pfn + 1;
+    kp->frames_len++;
+    return 1;
+}
+
+/*
+ * Read the given pages of a process into data, as few system calls as
+ * possible. Pages that process_vm_readv cannot read, for example because
+ * their map is not readable, are read through /proc/<pid>/mem. Returns
+ * false for each page that could not be read at all.
+ */
+static void read_batch(pid_t pid, int fd, size_t pagesize, const unsigned long *vaddrs,
+                       size_t num, uint8_t *data, bool *ok) {
+    struct iovec local;
+    struct iovec remote[READ_BATCH];
+    size_t num_remote = 0;
+    ssize_t len;
+    size_t i, done;
+
+    for (i = 0; i < num; i++) {
+        if (num_remote > 0 && (unsigned long)remote[num_remote - 1].iov_base +
+                remote[num_remote - 1].iov_len == vaddrs[i]) {
+            remote[num_remote - 1].iov_len += pagesize;
+        } else {
+            remote[num_remote].iov_base = (void *)vaddrs[i];
+            remote[num_remote].iov_len = pagesize;
+            num_remote++;
+        }
+    }
+
+    local.iov_base = data;
+    local.iov_len = num * pagesize;
+    len = process_vm_readv(pid, &local, 1, remote, num_remote, 0);
+    done = len > 0 ? len / pagesize : 0;
+
+    for (i = 0; i < num; i++) {
+        ok[i] = i < done ||
+                pread(fd, data + i * pagesize, pagesize, vaddrs[i]) == (ssize_t)pagesize;
+        if (!ok[i]) {
+            fprintf(stderr, "warning: could not read page at 0x%08lx\n", vaddrs[i]);
+        }
+    }
+}
+
+static int add_page(struct ksm_pages *kp, pid_t pid, unsigned long vaddr, uint64_t pfn,
+                    uint8_t *data, pm_kernel_t *ker, uint8_t pr_flags) {
+    struct ksm_page *cur_page;
+    uint64_t hash;
+    size_t *slot;
+    int new_frame;
+
+    if (kp->len * 2 >= kp->table_size && grow_table(kp) < 0) {
+        fprintf(stderr, "warning: not enough memory to grow the page table\n");
+        return -1;
+    }
+
+    hash = hash_page((uint64_t *)data, pm_kernel_pagesize(ker) / sizeof(uint64_t));
+    slot = find_page(kp, hash);
+
+    if (*slot == SIZE_MAX) {
+        if (kp->len == kp->size) {
+            size_t size = kp->size ? kp->size * 2 : GROWTH_FACTOR;
+            struct ksm_page *tmp = realloc(kp->pages, size * sizeof(*kp->pages));
+            if (tmp == NULL) {
+                fprintf(stderr, "warning: not enough memory to realloc pages struct\n");
+                return -1;
+            }
+            memset(&tmp[kp->len], 0, sizeof(tmp[kp->len]) * (size - kp->len));
+            kp->pages = tmp;
+            kp->size = size;
+        }
+        if (pm_kernel_count(ker, pfn, &kp->pages[kp->len].count)) {
+            fprintf(stderr, "error reading page count\n");
+            return -1;
+        }
+        kp->pages[kp->len].hash = hash;
+        kp->pages[kp->len].pattern =
+                is_pattern(data, pm_kernel_pagesize(ker)) ? data[0] : NO_PATTERN;
+        *slot = kp->len++;
+    }
+
+    cur_page = &kp->pages[*slot];
+
+    if (pr_flags & PR_SAVINGS) {
+        new_frame = add_frame(kp, pfn);
+        if (new_frame < 0) {
+            fprintf(stderr, "warning: not enough memory to grow the frame table\n");
+            return -1;
+        }
+        cur_page->num_frames += new_frame;
+    }
+
+    if (pr_flags & PR_VERBOSE) {
+        if (cur_page->vaddr_len > 0 &&
+                cur_page->vaddr[cur_page->vaddr_len - 1].pid == pid &&
+                cur_page->vaddr[cur_page->vaddr_len - 1].addr ==
+                vaddr - (cur_page->vaddr[cur_page->vaddr_len - 1].num_pages *
+                pm_kernel_pagesize(ker))) {
+            cur_page->vaddr[cur_page->vaddr_len - 1].num_pages++;
+        } else {
+            if (cur_page->vaddr_len == cur_page->vaddr_size) {
+                struct vaddr *tmp = realloc(cur_page->vaddr,
+                        (cur_page->vaddr_size + GROWTH_FACTOR) * sizeof(*(cur_page->vaddr)));
+                if (tmp == NULL) {
+                    fprintf(stderr, "warning: not enough memory to realloc vaddr array\n");
+                    return -1;
+                }
+                memset(&tmp[cur_page->vaddr_len], 0, sizeof(tmp[cur_page->vaddr_len]) * GROWTH_FACTOR);
+                cur_page->vaddr = tmp;
+                cur_page->vaddr_size += GROWTH_FACTOR;
+            }
+            cur_page->vaddr[cur_page->vaddr_len].addr = vaddr;
+            cur_page->vaddr[cur_page->vaddr_len].num_pages = 1;
+            cur_page->vaddr[cur_page->vaddr_len].pid = pid;
+            cur_page->vaddr_len++;
+        }
+    }
+    cur_page->vaddr_count++;
+
+    return 0;
+}
+
 static int read_pages(struct ksm_pages *kp, pm_map_t **maps, size_t num_maps, uint8_t pr_flags) {
-    size_t i, j, k;
+    size_t i, j, k, n;
+    pm_pagemap_iter_t *iter;
     uint64_t *pagemap;
-    size_t map_len;
-    uint64_t flags;
+    size_t index, map_len;
+    uint64_t *pfns = NULL, *flags = NULL;
+    unsigned long *vaddrs = NULL;
+    bool ok[READ_BATCH];
     pm_kernel_t *ker;
     int error;
-    unsigned long vaddr;
     int fd;
-    off_t off;
     char filename[MAX_FILENAME];
-    uint32_t *data;
-    uint32_t hash;
+    uint8_t *data;
     int rc = 0;
-    struct ksm_page *cur_page;
     pid_t pid;
+    size_t pagesize;
 
     if (num_maps == 0)
         return 0;
 
     pid = pm_process_pid(maps[0]->proc);
     ker = maps[0]->proc->ker;
+    pagesize = pm_kernel_pagesize(ker);
     error = snprintf(filename, MAX_FILENAME, "/proc/%d/mem", pid);
     if (error < 0 || error >= MAX_FILENAME) {
         return -1;
     }
 
-    data = malloc(pm_kernel_pagesize(ker));
-    if (data == NULL) {
-        fprintf(stderr, "warning: not enough memory to malloc data buffer\n");
+    if (pm_pagemap_iter_create(&iter)) {
+        fprintf(stderr, "warning: not enough memory to read pagemaps\n");
         return -1;
     }
 
+    data = malloc(READ_BATCH * pagesize);
+    pfns = malloc(PM_PAGEMAP_WINDOW * sizeof(*pfns));
+    flags = malloc(PM_PAGEMAP_WINDOW * sizeof(*flags));
+    vaddrs = malloc(PM_PAGEMAP_WINDOW * sizeof(*vaddrs));
+    if (data == NULL || pfns == NULL || flags == NULL || vaddrs == NULL) {
+        fprintf(stderr, "warning: not enough memory to malloc data buffer\n");
+        rc = -1;
+        goto err_open;
+    }
+
     fd = open(filename, O_RDONLY);
     if (fd < 0) {
         fprintf(stderr, "warning: could not open %s\n", filename);
@@ -227,116 +448,62 @@ static int read_pages(struct ksm_pages *kp, pm_map_t **maps, size_t num_maps, ui
         goto err_open;
     }
 
-    for (i = 0; i < num_maps; i++) {
-        error = pm_map_pagemap(maps[i], &pagemap, &map_len);
-        if (error) {
-            fprintf(stderr, "warning: could not read the pagemap of %d\n",
-                    pm_process_pid(maps[i]->proc));
-            continue;
-        }
-        for (j = 0; j < map_len; j++) {
-            error = pm_kernel_flags(ker, PM_PAGEMAP_PFN(pagemap[j]), &flags);
-            if (error) {
-                fprintf(stderr, "warning: could not read flags for pfn at address 0x%016" PRIx64 "\n",
-                        pagemap[i]);
-                continue;
-            }
-            if (!(flags & PM_PAGE_KSM)) {
-                continue;
-            }
-            vaddr = pm_map_start(maps[i]) + j * pm_kernel_pagesize(ker);
-            off = lseek(fd, vaddr, SEEK_SET);
-            if (off == (off_t)-1) {
-                fprintf(stderr, "warning: could not lseek to 0x%08lx\n", vaddr);
+    for (i = 0; i < num_maps && !rc; i++) {
+        error = pm_pagemap_iter_start(iter, maps[i]);
+        while (!error && !rc) {
+            error = pm_pagemap_iter_next(iter, &pagemap, &index, &map_len);
+            if (error || !map_len)
+                break;
+            if (!pagemap)
                 continue;
+
+            /* Look up the flags of the whole window at once */
+            for (j = 0, n = 0; j < map_len; j++) {
+                if (PM_PAGEMAP_PRESENT(pagemap[j]) && !PM_PAGEMAP_SWAPPED(pagemap[j]))
+                    pfns[n++] = PM_PAGEMAP_PFN(pagemap[j]);
             }
-            ssize_t len = read(fd, data, pm_kernel_pagesize(ker));
-            if (len != pm_kernel_pagesize(ker)) {
-                fprintf(stderr, "warning: could not read page at 0x%08lx\n", vaddr);
+            if (pm_kernel_flags_list(ker, pfns, n, flags)) {
+                fprintf(stderr, "warning: could not read the flags of %d's pages\n", pid);
                 continue;
             }
 
-            hash = hashword(data, pm_kernel_pagesize(ker) / sizeof(*data), 17);
-
-            for (k = 0; k < kp->len; k++) {
-                if (kp->pages[k].hash == hash) break;
-            }
-
-            if (k == kp->len) {
-                if (kp->len == kp->size) {
-                    struct ksm_page *tmp = realloc(kp->pages,
-                            (kp->size + GROWTH_FACTOR) * sizeof(*kp->pages));
-                    if (tmp == NULL) {
-                        fprintf(stderr, "warning: not enough memory to realloc pages struct\n");
-                        free(pagemap);
-                        rc = -1;
-                        goto err_realloc;
-                    }
-                    memset(&tmp[k], 0, sizeof(tmp[k]) * GROWTH_FACTOR);
-                    kp->pages = tmp;
-                    kp->size += GROWTH_FACTOR;
+            /* Pages already merged by KSM and, to find what KSM could merge,
+             * other anonymous pages */
+            for (j = 0, k = 0, n = 0; j < map_len; j++) {
+                if (!PM_PAGEMAP_PRESENT(pagemap[j]) || PM_PAGEMAP_SWAPPED(pagemap[j]))
+                    continue;
+                if ((flags[k++] & PM_PAGE_KSM) ||
+                        ((pr_flags & PR_SAVINGS) && (flags[k - 1] & PM_PAGE_ANON))) {
+                    pfns[n] = PM_PAGEMAP_PFN(pagemap[j]);
+                    vaddrs[n++] = pm_map_start(maps[i]) + (index + j) * pagesize;
                 }
-                rc = pm_kernel_count(ker, PM_PAGEMAP_PFN(pagemap[j]), &kp->pages[kp->len].count);
-                if (rc) {
-                    fprintf(stderr, "error reading page count\n");
-                    free(pagemap);
-                    goto err_count;
-                }
-                kp->pages[kp->len].hash = hash;
-                kp->pages[kp->len].pattern =
-                        is_pattern((uint8_t *)data, pm_kernel_pagesize(ker)) ?
-                        (data[0] & 0xFF) : NO_PATTERN;
-                kp->len++;
             }
 
-            cur_page = &kp->pages[k];
-
-            if (pr_flags & PR_VERBOSE) {
-                if (cur_page->vaddr_len > 0 &&
-                        cur_page->vaddr[cur_page->vaddr_len - 1].pid == pid &&
-                        cur_page->vaddr[cur_page->vaddr_len - 1].addr ==
-                        vaddr - (cur_page->vaddr[cur_page->vaddr_len - 1].num_pages *
-                        pm_kernel_pagesize(ker))) {
-                    cur_page->vaddr[cur_page->vaddr_len - 1].num_pages++;
-                } else {
-                    if (cur_page->vaddr_len == cur_page->vaddr_size) {
-                        struct vaddr *tmp = realloc(cur_page->vaddr,
-                                (cur_page->vaddr_size + GROWTH_FACTOR) * sizeof(*(cur_page->vaddr)));
-                        if (tmp == NULL) {
-                            fprintf(stderr, "warning: not enough memory to realloc vaddr array\n");
-                            free(pagemap);
-                            rc = -1;
-                            goto err_realloc;
-                        }
-                        memset(&tmp[cur_page->vaddr_len], 0, sizeof(tmp[cur_page->vaddr_len]) * GROWTH_FACTOR);
-                        cur_page->vaddr = tmp;
-                        cur_page->vaddr_size += GROWTH_FACTOR;
+            for (j = 0; j < n && !rc; j += READ_BATCH) {
+                size_t num = n - j < READ_BATCH ? n - j : READ_BATCH;
+
+                read_batch(pid, fd, pagesize, vaddrs + j, num, data, ok);
+
+                for (k = 0; k < num && !rc; k++) {
+                    if (ok[k]) {
+                        rc = add_page(kp, pid, vaddrs[j + k], pfns[j + k], data + k * pagesize,
+                                      ker, pr_flags);
                     }
-                    cur_page->vaddr[cur_page->vaddr_len].addr = vaddr;
-                    cur_page->vaddr[cur_page->vaddr_len].num_pages = 1;
-                    cur_page->vaddr[cur_page->vaddr_len].pid = pid;
-                    cur_page->vaddr_len++;
                 }
             }
-            cur_page->vaddr_count++;
         }
-        free(pagemap);
-    }
-    goto no_err;
-
-err_realloc:
-err_count:
-    if (pr_flags & PR_VERBOSE) {
-        for (i = 0; i < kp->len; i++) {
-            free(kp->pages[i].vaddr);
+        if (error) {
+            fprintf(stderr, "warning: could not read the pagemap of %d\n", pid);
         }
     }
-    free(kp->pages);
 
-no_err:
     close(fd);
 err_open:
+    free(vaddrs);
+    free(flags);
+    free(pfns);
     free(data);
+    pm_pagemap_iter_destroy(iter);
     return rc;
 }
 
@@ -344,18 +511,29 @@ static void print_pages(struct ksm_pages *kp, uint8_t pr_flags) {
     size_t i, j, k;
     char suffix[13];
     int index;
+    size_t savings = 0;
 
     for (i = 0; i < kp->len; i++) {
+        /* Only contents found in more than one frame could be merged */
+        if (pr_flags & PR_SAVINGS) {
+            if (kp->pages[i].num_frames < 2) {
+                continue;
+            }
+            savings += kp->pages[i].num_frames - 1;
+        }
+
         if (kp->pages[i].pattern != NO_PATTERN) {
             printf("0x%02x byte pattern: ", kp->pages[i].pattern);
         } else {
-            printf("KSM CRC 0x%08x:", kp->pages[i].hash);
+            printf("KSM hash 0x%016" PRIx64 ":", kp->pages[i].hash);
         }
         printf(" %4zu page", kp->pages[i].vaddr_count);
         if (kp->pages[i].vaddr_count > 1) {
             printf("s");
         }
-        if (!(pr_flags & PR_ALL)) {
+        if (pr_flags & PR_SAVINGS) {
+            printf(" in %zu frames", kp->pages[i].num_frames);
+        } else if (!(pr_flags & PR_ALL)) {
             printf(" (%" PRIu64 " reference", kp->pages[i].count);
             if (kp->pages[i].count > 1) {
                 printf("s");
@@ -383,6 +561,11 @@ static void print_pages(struct ksm_pages *kp, uint8_t pr_flags) {
             }
         }
     }
+
+    if (pr_flags & PR_SAVINGS) {
+        printf("Potential savings from merging identical pages: %zu pages (%zu kB)\n",
+                savings, savings * (size_t)getpagesize() / 1024);
+    }
 }
 
 static void free_pages(struct ksm_pages *kp, uint8_t pr_flags) {
@@ -394,13 +577,17 @@ static void free_pages(struct ksm_pages *kp, uint8_t pr_flags) {
         }
     }
     free(kp->pages);
+    free(kp->table);
+    free(kp->frames);
 }
 
 static void usage(char *myname) {
-    fprintf(stderr, "Usage: %s [-s | -v | -a | -h ] <pid>\n"
+    fprintf(stderr, "Usage: %s [-s | -v | -a | -p | -h ] <pid>\n"
                     "    -s  Sort pages by usage count.\n"
                     "    -v  Verbose: print virtual addresses.\n"
                     "    -a  Display all the KSM pages in the system. Ignore the pid argument.\n"
+                    "    -p  Potential savings: also compare anonymous pages not merged by KSM,\n"
+                    "        and only display the contents found in more than one page frame.\n"
                     "    -h  Display this help screen.\n",
     myname);
 }
@@ -413,6 +600,55 @@ static int cmp_pages(const void *a, const void *b) {
     return cmp ? cmp : pg_b->count - pg_a->count;
 }
 
+/*
+ * A 64 bit hash of a page, computed over four independent lanes of 64 bit
+ * words, so that it runs at several bytes per cycle. len is in words, and a
+ * multiple of four.
+ */
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t word) {
+    acc += word * HASH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_PRIME1;
+}
+
+static uint64_t hash_page(const uint64_t *data, size_t len) {
+    uint64_t v1 = HASH_PRIME1 + HASH_PRIME2;
+    uint64_t v2 = HASH_PRIME2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -HASH_PRIME1;
+    uint64_t h;
+    size_t i;
+
+    for (i = 0; i < len; i += 4) {
+        v1 = hash_round(v1, data[i]);
+        v2 = hash_round(v2, data[i + 1]);
+        v3 = hash_round(v3, data[i + 2]);
+        v4 = hash_round(v4, data[i + 3]);
+    }
+
+    h = ((v1 << 1) | (v1 >> 63)) + ((v2 << 7) | (v2 >> 57)) +
+            ((v3 << 12) | (v3 >> 52)) + ((v4 << 18) | (v4 >> 46));
+    h ^= hash_round(0, v1);
+    h = h * HASH_PRIME1 + HASH_PRIME3;
+    h ^= hash_round(0, v2);
+    h = h * HASH_PRIME1 + HASH_PRIME3;
+    h ^= hash_round(0, v3);
+    h = h * HASH_PRIME1 + HASH_PRIME3;
+    h ^= hash_round(0, v4);
+    h = h * HASH_PRIME1 + HASH_PRIME3;
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
 static bool is_pattern(uint8_t *data, size_t len) {
     size_t i;
     uint8_t first_byte = data[0];
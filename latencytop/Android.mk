@@ -17,6 +17,8 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := latencytop.c
 
+LOCAL_STATIC_LIBRARIES := libtaskstats
+
 LOCAL_MODULE := latencytop
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
@@ -23,37 +23,24 @@
 #include <string.h>
 #include <unistd.h>
 
-#define MAX_LINE 512
+#include <taskstats/taskstats.h>
+
 #define MAX_FILENAME 64
 
-const char *EXPECTED_VERSION = "Latency Top version : v0.1\n";
 const char *SYSCTL_FILE = "/proc/sys/kernel/latencytop";
 const char *GLOBAL_STATS_FILE = "/proc/latency_stats";
 const char *THREAD_STATS_FILE_FORMAT = "/proc/%d/task/%d/latency";
 
-struct latency_entry {
-    struct latency_entry *next;
-    unsigned long count;
-    unsigned long max;
-    unsigned long total;
-    char reason[MAX_LINE];
-};
-
 static inline void check_latencytop() { }
 
-static struct latency_entry *read_global_stats(struct latency_entry *list, int erase);
-static struct latency_entry *read_process_stats(struct latency_entry *list, int erase, int pid);
-static struct latency_entry *read_thread_stats(struct latency_entry *list, int erase, int pid, int tid, int fatal);
-
-static struct latency_entry *alloc_latency_entry(void);
-static void free_latency_entry(struct latency_entry *e);
+static void read_global_stats(ts_latency_t *lat, int erase);
+static void read_process_stats(ts_latency_t *lat, int erase, int pid);
+static void read_thread_stats(ts_latency_t *lat, int erase, int pid, int tid, int fatal);
 
 static void set_latencytop(int on);
-static struct latency_entry *read_latency_file(FILE *f, struct latency_entry *list);
-static void erase_latency_file(FILE *f);
+static void read_latency_file(FILE *f, ts_latency_t *lat);
 
-static struct latency_entry *find_latency_entry(struct latency_entry *e, char *reason);
-static void print_latency_entries(struct latency_entry *head);
+static void print_latency_entries(const ts_latency_t *lat);
 
 static void signal_handler(int sig);
 static void disable_latencytop(void);
@@ -64,10 +51,8 @@ static int lat_cmp(const void *a, const void *b);
 static void clear_screen(void);
 static void usage(const char *cmd);
 
-struct latency_entry *free_entries;
-
 int main(int argc, char *argv[]) {
-    struct latency_entry *e;
+    ts_latency_t *lat;
     int delay, iterations;
     int pid, tid;
     int count, erase;
@@ -126,7 +111,10 @@ int main(int argc, char *argv[]) {
 
     check_latencytop();
 
-    free_entries = NULL;
+    if (ts_latency_create(&lat)) {
+        fprintf(stderr, "Could not allocate latency table: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     signal(SIGINT, &signal_handler);
     signal(SIGTERM, &signal_handler);
@@ -142,15 +130,15 @@ int main(int argc, char *argv[]) {
 
         sleep(delay);
 
-        e = NULL;
+        ts_latency_clear(lat);
         if (pid) {
             if (tid) {
-                e = read_thread_stats(e, erase, pid, tid, 1);
+                read_thread_stats(lat, erase, pid, tid, 1);
             } else {
-                e = read_process_stats(e, erase, pid);
+                read_process_stats(lat, erase, pid);
             }
         } else {
-            e = read_global_stats(e, erase);
+            read_global_stats(lat, erase);
         }
         erase = 0;
 
@@ -164,17 +152,17 @@ int main(int argc, char *argv[]) {
         } else {
             printf("Latencies across all processes:\n");
         }
-        print_latency_entries(e);
+        print_latency_entries(lat);
     }
 
     set_latencytop(0);
+    ts_latency_destroy(lat);
 
     return 0;
 }
 
-static struct latency_entry *read_global_stats(struct latency_entry *list, int erase) {
+static void read_global_stats(ts_latency_t *lat, int erase) {
     FILE *f;
-    struct latency_entry *e;
 
     if (erase) {
         f = fopen(GLOBAL_STATS_FILE, "w");
@@ -192,18 +180,15 @@ static struct latency_entry *read_global_stats(struct latency_entry *list, int e
         exit(EXIT_FAILURE);
     }
 
-    e = read_latency_file(f, list);
+    read_latency_file(f, lat);
 
     fclose(f);
-
-    return e;
 }
 
-static struct latency_entry *read_process_stats(struct latency_entry *list, int erase, int pid) {
+static void read_process_stats(ts_latency_t *lat, int erase, int pid) {
     char dirname[MAX_FILENAME];
     DIR *dir;
     struct dirent *ent;
-    struct latency_entry *e;
     int tid;
 
     sprintf(dirname, "/proc/%d/task", pid);
@@ -214,25 +199,21 @@ static struct latency_entry *read_process_stats(struct latency_entry *list, int
         exit(EXIT_FAILURE);
     }
 
-    e = list;
     while ((ent = readdir(dir))) {
         if (!isdigit(ent->d_name[0]))
             continue;
 
         tid = atoi(ent->d_name);
 
-        e = read_thread_stats(e, erase, pid, tid, 0);
+        read_thread_stats(lat, erase, pid, tid, 0);
     }
 
     closedir(dir);
-
-    return e;
 }
 
-static struct latency_entry *read_thread_stats(struct latency_entry *list, int erase, int pid, int tid, int fatal) {
+static void read_thread_stats(ts_latency_t *lat, int erase, int pid, int tid, int fatal) {
     char filename[MAX_FILENAME];
     FILE *f;
-    struct latency_entry *e;
 
     sprintf(filename, THREAD_STATS_FILE_FORMAT, pid, tid);
 
@@ -244,65 +225,27 @@ static struct latency_entry *read_thread_stats(struct latency_entry *list, int e
                 fprintf(stderr, "Perhaps the process or thread has terminated?\n");
                 exit(EXIT_FAILURE);
             } else {
-                return list;
+                return;
             }
         }
         fprintf(f, "erase\n");
         fclose(f);
     }
     
-    f = fopen(GLOBAL_STATS_FILE, "r");
+    f = fopen(filename, "r");
     if (!f) {
         if (fatal) {
             fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
             fprintf(stderr, "Perhaps the process or thread has terminated?\n");
             exit(EXIT_FAILURE);
         } else {
-            return list;
+            return;
         }
     }
 
-    e = read_latency_file(f, list);
+    read_latency_file(f, lat);
 
     fclose(f);
-
-    return e;
-}
-
-static struct latency_entry *alloc_latency_entry(void) {
-    struct latency_entry *e;
-
-    if (free_entries) {
-        e = free_entries;
-        free_entries = free_entries->next;
-    } else {
-        e = calloc(1, sizeof(struct latency_entry));
-        if (!e) {
-            fprintf(stderr, "Could not allocate latency entry: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    return e;
-}
-
-static void free_latency_entry(struct latency_entry *e) {
-    e->next = free_entries;
-    free_entries = e;
-}
-
-static struct latency_entry *find_latency_entry(struct latency_entry *head, char *reason) {
-    struct latency_entry *e;
-
-    e = head;
-
-    while (e) {
-        if (!strcmp(e->reason, reason))
-            return e;
-        e = e->next;
-    }
-
-    return NULL;
 }
 
 static void set_latencytop(int on) {
@@ -319,77 +262,35 @@ static void set_latencytop(int on) {
     fclose(f);
 }
 
-static void erase_latency_file(FILE *f) {
-    fprintf(f, "erase\n");
-}
-
-static struct latency_entry *read_latency_file(FILE *f, struct latency_entry *list) {
-    struct latency_entry *e, *head;
-    char line[MAX_LINE];
-    unsigned long count, max, total;
-    char reason[MAX_LINE];
-
-    head = list;
+static void read_latency_file(FILE *f, ts_latency_t *lat) {
+    int err;
 
-    if (!fgets(line, MAX_LINE, f)) {
-        fprintf(stderr, "Could not read latency file version: %s\n", strerror(errno));
+    err = ts_latency_read(lat, f);
+    if (err == EINVAL) {
+        fprintf(stderr, "Unexpected latency file version\n");
         exit(EXIT_FAILURE);
-    }
-
-    if (strcmp(line, EXPECTED_VERSION) != 0) {
-        fprintf(stderr, "Expected version: %s\n", EXPECTED_VERSION);
-        fprintf(stderr, "But got version: %s", line);
+    } else if (err) {
+        fprintf(stderr, "Could not read latency file: %s\n", strerror(err));
         exit(EXIT_FAILURE);
     }
-
-    while (fgets(line, MAX_LINE, f)) {
-        sscanf(line, "%ld %ld %ld %s", &count, &total, &max, reason);
-        if (max > 0 || total > 0) {
-            e = find_latency_entry(head, reason);
-            if (e) {
-                e->count += count;
-                if (max > e->max)
-                    e->max = max;
-                e->total += total;
-            } else {
-                e = alloc_latency_entry();
-                e->count = count;
-                e->max = max;
-                e->total = total;
-                strcpy(e->reason, reason);
-                e->next = head;
-                head = e;
-            }
-        }
-    }
-
-    return head;
 }
 
-static void print_latency_entries(struct latency_entry *head) {
-    struct latency_entry *e, **array;
+static void print_latency_entries(const ts_latency_t *lat) {
+    const ts_latency_entry_t *e, **array;
     unsigned long average;
-    int i, count;
-
-    e = head;
-    count = 0;
-    while (e) {
-        count++;
-        e = e->next;
-    }
+    size_t i, count;
 
-    e = head;
-    array = calloc(count, sizeof(struct latency_entry *));
-    if (!array) {
+    count = ts_latency_count(lat);
+    array = calloc(count, sizeof(ts_latency_entry_t *));
+    if (count && !array) {
         fprintf(stderr, "Error allocating array: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     for (i = 0; i < count; i++) {
-        array[i] = e;
-        e = e->next;
+        array[i] = ts_latency_entry(lat, i);
     }
 
-    qsort(array, count, sizeof(struct latency_entry *), &lat_cmp);
+    qsort(array, count, sizeof(ts_latency_entry_t *), &lat_cmp);
 
     printf("%10s  %10s  %7s  %s\n", "Maximum", "Average", "Count", "Reason");
     for (i = 0; i < count; i++) {
@@ -434,10 +335,10 @@ static int numcmp(const long long a, const long long b) {
 }
 
 static int lat_cmp(const void *a, const void *b) {
-    const struct latency_entry *pa, *pb;
+    const ts_latency_entry_t *pa, *pb;
 
-    pa = (*((struct latency_entry **)a));
-    pb = (*((struct latency_entry **)b));
+    pa = (*((const ts_latency_entry_t **)a));
+    pb = (*((const ts_latency_entry_t **)b));
 
     return numcmp(pb->max, pa->max);
 }
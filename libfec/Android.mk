@@ -14,7 +14,9 @@ common_src_files := \
     fec_open.cpp \
     fec_read.cpp \
     fec_verity.cpp \
-    fec_process.cpp
+    fec_process.cpp \
+    fec_readahead.cpp \
+    fec_tree_cache.cpp
 
 common_static_libraries := \
     libmincrypt \
@@ -32,6 +34,7 @@ LOCAL_MODULE := libfec
 LOCAL_SRC_FILES := $(common_src_files)
 LOCAL_STATIC_LIBRARIES := \
     libfec_rs \
+    libjobpool \
     libext4_utils_static \
     libsquashfs_utils \
     libcutils \
@@ -39,7 +42,7 @@ LOCAL_STATIC_LIBRARIES := \
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
-LOCAL_CFLAGS := $(common_cflags) -D_GNU_SOURCE -DFEC_NO_KLOG
+LOCAL_CFLAGS := $(common_cflags) -D_GNU_SOURCE -DFEC_NO_KLOG -DFEC_NO_TRACE
 LOCAL_C_INCLUDES := $(common_c_includes)
 LOCAL_CLANG := true
 ifeq ($(HOST_OS),linux)
@@ -50,6 +53,7 @@ LOCAL_MODULE := libfec_host
 LOCAL_SRC_FILES := $(common_src_files)
 LOCAL_STATIC_LIBRARIES := \
     libfec_rs_host \
+    libjobpool_host \
     libext4_utils_host \
     libsquashfs_utils_host \
     $(common_static_libraries)
@@ -399,9 +399,14 @@ static void reset_handle(fec_handle *f)
     f->data_size = 0;
     f->pos = 0;
     f->size = 0;
+    f->pool = NULL;
+    f->readahead = NULL;
+    f->parity_cache.clear();
+    verity_cache_free(f);
 
     memset(&f->ecc, 0, sizeof(f->ecc));
     memset(&f->verity, 0, sizeof(f->verity));
+    memset(&f->stats, 0, sizeof(f->stats));
 }
 
 /* closes and flushes `f->fd' and releases any memory allocated for `f' */
@@ -409,6 +414,11 @@ int fec_close(struct fec_handle *f)
 {
     check(f);
 
+    /* stop worker threads before the file and metadata go away; the
+       read-ahead thread uses the workers, so it goes first */
+    readahead_free(f);
+    process_free(f);
+
     if (f->fd != -1) {
         if (f->mode & O_RDWR && fdatasync(f->fd) == -1) {
             warn("fdatasync failed: %s", strerror(errno));
@@ -420,6 +430,12 @@ int fec_close(struct fec_handle *f)
     if (f->verity.hash) {
         delete[] f->verity.hash;
     }
+    if (f->verity.hash_parent) {
+        delete[] f->verity.hash_parent;
+    }
+    if (f->verity.hash_loaded) {
+        delete[] f->verity.hash_loaded;
+    }
     if (f->verity.salt) {
         delete[] f->verity.salt;
     }
@@ -427,6 +443,7 @@ int fec_close(struct fec_handle *f)
         delete[] f->verity.table;
     }
 
+    pthread_mutex_destroy(&f->hash_mutex);
     pthread_mutex_destroy(&f->mutex);
 
     reset_handle(f);
@@ -503,6 +520,29 @@ int fec_get_status(struct fec_handle *f, struct fec_status *s)
     return 0;
 }
 
+/* populates `s' from the runtime statistics of `f' */
+int fec_get_stats(struct fec_handle *f, struct fec_stats *s)
+{
+    check(f);
+    check(s);
+
+    s->bytes_read = __atomic_load_n(&f->stats.bytes_read, __ATOMIC_RELAXED);
+    s->blocks_verified = __atomic_load_n(&f->stats.blocks_verified,
+                            __ATOMIC_RELAXED);
+    s->blocks_corrected = __atomic_load_n(&f->stats.blocks_corrected,
+                            __ATOMIC_RELAXED);
+    s->decode_failures = __atomic_load_n(&f->stats.decode_failures,
+                            __ATOMIC_RELAXED);
+    s->cache_hits = __atomic_load_n(&f->stats.cache_hits, __ATOMIC_RELAXED);
+    s->cache_misses = __atomic_load_n(&f->stats.cache_misses,
+                        __ATOMIC_RELAXED);
+    s->io_ns = __atomic_load_n(&f->stats.io_ns, __ATOMIC_RELAXED);
+    s->hash_ns = __atomic_load_n(&f->stats.hash_ns, __ATOMIC_RELAXED);
+    s->decode_ns = __atomic_load_n(&f->stats.decode_ns, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
 /* opens `path' using given options and returns a fec_handle in `handle' if
    successful */
 int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
@@ -515,6 +555,8 @@ int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
     debug("path = %s, mode = %d, flags = %d, roots = %d", path, mode, flags,
         roots);
 
+    trace_scope("fec_open");
+
     if (mode & (O_CREAT | O_TRUNC | O_EXCL | O_WRONLY)) {
         /* only reading and updating existing files is supported */
         error("failed to open '%s': (unsupported mode %d)", path, mode);
@@ -542,6 +584,11 @@ int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
         return -1;
     }
 
+    if (unlikely(pthread_mutex_init(&f->hash_mutex, NULL) != 0)) {
+        error("failed to create a mutex: %s", strerror(errno));
+        return -1;
+    }
+
     f->fd = TEMP_FAILURE_RETRY(open(path, mode | O_CLOEXEC));
 
     if (f->fd == -1) {
@@ -562,6 +609,14 @@ int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
 
     if (load_verity(f.get()) == -1) {
         debug("verity metadata not found from '%s'", path);
+    } else if ((f->flags & FEC_VERITY_CACHE) && f->verity.hash &&
+                verity_cache_init(f.get()) == -1) {
+        return -1;
+    }
+
+    if ((f->flags & FEC_READAHEAD) && (f->verity.hash || f->ecc.start) &&
+            readahead_init(f.get()) == -1) {
+        return -1;
     }
 
     *handle = f.release();
@@ -19,6 +19,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <list>
 #include <memory>
 #include <new>
 #include <pthread.h>
@@ -26,6 +27,7 @@
 #include <string>
 #include <string.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
@@ -34,14 +36,35 @@
 #include <openssl/sha.h>
 #include <fec/io.h>
 #include <fec/ecc.h>
+#include <jobpool/jobpool.h>
 
 /* processing parameters */
 #define WORK_MIN_THREADS 1
 #define WORK_MAX_THREADS 64
+#define WORK_MIN_BLOCKS 32 /* smallest range queued for a worker */
+#define WORK_TASKS_PER_THREAD 4
+
+/* ecc parameters */
+#define ECC_PARITY_CACHE_SIZE (1024 * 1024) /* bytes of parity to keep */
 
 /* verity parameters */
 #define VERITY_CACHE_BLOCKS 4096
 #define VERITY_NO_CACHE UINT64_MAX
+#define VERITY_DEFAULT_CACHE_SIZE (4 * 1024 * 1024) /* FEC_VERITY_CACHE */
+
+/* FEC_READAHEAD parameters */
+#define READAHEAD_WINDOWS 4
+#define READAHEAD_WINDOW_SIZE (1024 * 1024)
+#define READAHEAD_MIN_SEQUENTIAL 2 /* reads in a row before reading ahead */
+
+/* FEC_VERITY_TREE_CACHE parameters */
+#define TREE_CACHE_DIR "/dev/fec" /* tmpfs from early boot, also in recovery */
+#define TREE_CACHE_MAGIC 0xFEC7EE00
+#define TREE_CACHE_VERSION 1
+#define TREE_CACHE_CHUNK_BLOCKS 256 /* blocks hashed per worker task */
+
+/* verity hashing */
+#define VERITY_CHECK_BATCH 16 /* blocks hashed per verity_hash_blocks call */
 
 /* verity definitions */
 #define VERITY_METADATA_SIZE (8 * FEC_BLOCKSIZE)
@@ -82,6 +105,15 @@ struct verity_info {
     uint64_t hash_data_offset;
     uint64_t hash_start;
     uint8_t *hash;
+    /* FEC_VERITY_LAZY: hashes of the blocks of `hash', verified when the
+       handle is opened, and one bit for each block of `hash' that has been
+       loaded and verified against them since */
+    uint8_t *hash_parent;
+    uint64_t *hash_loaded;
+    /* the hash tree level verify_tree is checking, and the verified hashes
+       of its blocks on the level above */
+    uint64_t tree_level_offset;
+    const uint8_t *tree_parent;
     uint32_t salt_size;
     uint8_t *salt;
     uint64_t data_blocks;
@@ -96,17 +128,49 @@ struct verity_block_info {
     bool valid;
 };
 
+/* a corrected block, see `verity_cache_get' */
+struct verity_block {
+    uint64_t index;
+    std::unique_ptr<uint8_t[]> data;
+};
+
+/* FEC_VERITY_CACHE state */
+struct verity_cache {
+    /* one bit for each data block that has passed verification */
+    std::unique_ptr<uint64_t[]> verified;
+    uint64_t verified_blocks;
+    /* corrected blocks, most recently used first */
+    std::list<verity_block> blocks;
+    size_t max_blocks;
+};
+
+/* parity bytes for an RS block, see `get_parity' */
+struct ecc_parity {
+    uint64_t rsb;
+    std::unique_ptr<uint8_t[]> data;
+};
+
+/* FEC_READAHEAD thread and buffers */
+struct readahead_info;
+
 struct fec_handle {
     ecc_info ecc;
     int fd;
     int flags; /* additional flags passed to fec_open */
     int mode; /* mode for open(2) */
-    pthread_mutex_t mutex;
+    pthread_mutex_t mutex; /* protects `pool', `parity_cache' and
+                              `cache.blocks' */
+    pthread_mutex_t hash_mutex; /* serializes FEC_VERITY_LAZY loads */
     uint64_t errors;
     uint64_t data_size;
     uint64_t pos;
     uint64_t size;
     verity_info verity;
+    jobpool *pool; /* started on the first read that needs workers */
+    readahead_info *readahead;
+    std::list<ecc_parity> parity_cache; /* most recently used first */
+    verity_cache cache;
+    fec_stats stats; /* updated atomically */
 };
 
 /* I/O helpers */
@@ -122,6 +186,21 @@ typedef ssize_t (*read_func)(fec_handle *f, uint8_t *dest, size_t count,
 extern ssize_t process(fec_handle *f, uint8_t *buf, size_t count,
         uint64_t offset, read_func func);
 
+extern ssize_t process_ranges(fec_handle *f, const fec_iovec *iov,
+        size_t iovcnt, read_func func);
+
+extern ssize_t ecc_read_block(fec_handle *f, uint8_t *dest, uint64_t offset,
+        size_t *errors);
+
+extern jobpool *process_get_pool(fec_handle *f);
+extern void process_free(fec_handle *f);
+
+extern int readahead_init(fec_handle *f);
+extern void readahead_free(fec_handle *f);
+
+extern ssize_t readahead_process(fec_handle *f, uint8_t *buf, size_t count,
+        uint64_t offset, read_func func);
+
 /* verity functions */
 extern uint64_t verity_get_size(uint64_t file_size, uint32_t *verity_levels,
         uint32_t *level_hashes);
@@ -131,6 +210,67 @@ extern int verity_parse_header(fec_handle *f, uint64_t offset);
 extern bool verity_check_block(fec_handle *f, const uint8_t *expected,
         const uint8_t *block);
 
+extern const uint8_t *verity_get_hash(fec_handle *f, uint64_t index,
+        bool load);
+
+extern size_t verity_check_blocks(fec_handle *f, const uint8_t *expected,
+        const uint8_t *blocks, size_t count);
+
+extern int verity_cache_init(fec_handle *f);
+extern void verity_cache_free(fec_handle *f);
+
+extern bool verity_cache_is_verified(fec_handle *f, uint64_t index);
+extern void verity_cache_set_verified(fec_handle *f, uint64_t index);
+
+extern bool verity_cache_get(fec_handle *f, uint64_t index, uint8_t *data);
+extern void verity_cache_put(fec_handle *f, uint64_t index,
+        const uint8_t *data);
+
+extern int tree_cache_load(fec_handle *f, const uint8_t *root);
+extern void tree_cache_save(fec_handle *f, const uint8_t *root);
+
+/* fec_stats helpers */
+static inline uint64_t stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define stats_add(f, field, value) \
+    __sync_fetch_and_add(&(f)->stats.field, (uint64_t)(value))
+
+#define stats_add_time(f, field, start) \
+    stats_add(f, field, stats_now() - (start))
+
+/* ATRACE markers for the slow paths: opening a handle, checking the hash
+   tree, and correcting corrupted blocks, which show up in boot traces when
+   dm-verity falls back to libfec */
+#ifdef FEC_NO_TRACE
+    #define trace_begin(name)
+    #define trace_end()
+    #define trace_scope(name)
+#else
+    #define ATRACE_TAG ATRACE_TAG_ALWAYS
+    #include <cutils/trace.h>
+
+    #define trace_begin(name) ATRACE_BEGIN(name)
+    #define trace_end() ATRACE_END()
+
+    class fec_trace_scope {
+    public:
+        explicit fec_trace_scope(const char *name) {
+            ATRACE_BEGIN(name);
+        }
+
+        ~fec_trace_scope() {
+            ATRACE_END();
+        }
+    };
+
+    #define trace_scope(name) fec_trace_scope __trace_scope(name)
+#endif
+
 /* helper macros */
 #ifndef unlikely
     #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -14,32 +14,119 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include "fec_private.h"
 
+/* a call to process, split into block aligned ranges run by the workers */
 struct process_info {
-    int id;
     fec_handle *f;
     uint8_t *buf;
     size_t count;
     uint64_t offset;
     read_func func;
-    ssize_t rc;
+    /* updated atomically, as ranges finish on different workers */
+    ssize_t nread;
     size_t errors;
+    size_t failed; /* ranges that couldn't be read */
 };
 
-/* thread function  */
-static void * __process(void *cookie)
+/* reads the blocks [first, last) that overlap the call */
+static void process_range(void *cookie, int, uint64_t first, uint64_t last)
 {
     process_info *p = static_cast<process_info *>(cookie);
+    uint64_t pos = first * FEC_BLOCKSIZE;
+    uint64_t end = last * FEC_BLOCKSIZE;
+
+    if (pos < p->offset) {
+        pos = p->offset;
+    }
+
+    if (end > p->offset + p->count) {
+        end = p->offset + p->count;
+    }
+
+    debug("[%" PRIu64 ", %" PRIu64 ")", pos, end);
+
+    size_t errors = 0;
+    ssize_t rc = p->func(p->f, &p->buf[pos - p->offset], (size_t)(end - pos),
+                    pos, &errors);
+
+    if (rc == -1) {
+        __sync_fetch_and_add(&p->failed, 1);
+    } else {
+        __sync_fetch_and_add(&p->nread, rc);
+        __sync_fetch_and_add(&p->errors, errors);
+    }
+}
+
+/* returns the worker pool of `f', starting it if needed */
+static jobpool *get_pool(fec_handle *f, int threads)
+{
+    pthread_mutex_lock(&f->mutex);
+
+    if (!f->pool) {
+        f->pool = jobpool_new(threads, NULL, 0);
+
+        if (f->pool) {
+            debug("started %d threads", jobpool_threads(f->pool));
+        }
+    }
+
+    jobpool *pool = f->pool;
+    pthread_mutex_unlock(&f->mutex);
+
+    return pool;
+}
+
+/* stops the worker threads of `f', if any */
+void process_free(fec_handle *f)
+{
+    if (f->pool) {
+        jobpool_free(f->pool);
+        f->pool = NULL;
+    }
+}
+
+/* returns the number of worker threads to use */
+static int get_threads()
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < WORK_MIN_THREADS) {
+        threads = WORK_MIN_THREADS;
+    } else if (threads > WORK_MAX_THREADS) {
+        threads = WORK_MAX_THREADS;
+    }
+
+    return threads;
+}
+
+/* returns the number of blocks each worker task should read when `blocks'
+   blocks are split between `threads' threads */
+static size_t get_blocks_per_task(uint64_t blocks, int threads)
+{
+    /* a few ranges per thread so that workers that hit corrupted blocks don't
+       hold up the whole read, as idle workers take over their ranges, but
+       not so small that queueing dominates */
+    size_t blocks_per_task = fec_div_round_up(blocks,
+                                threads * WORK_TASKS_PER_THREAD);
+
+    if (blocks_per_task < WORK_MIN_BLOCKS) {
+        blocks_per_task = WORK_MIN_BLOCKS;
+    }
 
-    debug("thread %d: [%" PRIu64 ", %" PRIu64 ")", p->id, p->offset,
-        p->offset + p->count);
+    return blocks_per_task;
+}
 
-    p->rc = p->func(p->f, p->buf, p->count, p->offset, &p->errors);
-    return p;
+/* returns the worker pool of `f' for other parallel work, starting it if
+   needed, or NULL if no threads are available */
+jobpool *process_get_pool(fec_handle *f)
+{
+    return get_pool(f, get_threads());
 }
 
-/* launches a maximum number of threads to process a read */
+/* splits a read into block aligned ranges and runs them in the worker pool */
 ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
         read_func func)
 {
@@ -51,87 +138,241 @@ ssize_t process(fec_handle *f, uint8_t *buf, size_t count, uint64_t offset,
         return 0;
     }
 
-    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = get_threads();
 
-    if (threads < WORK_MIN_THREADS) {
-        threads = WORK_MIN_THREADS;
-    } else if (threads > WORK_MAX_THREADS) {
-        threads = WORK_MAX_THREADS;
+    uint64_t first = offset / FEC_BLOCKSIZE;
+    uint64_t last = fec_div_round_up(offset + count, FEC_BLOCKSIZE);
+    size_t blocks = (size_t)(last - first);
+    size_t blocks_per_task = get_blocks_per_task(blocks, threads);
+
+    process_info info;
+    info.f = f;
+    info.buf = buf;
+    info.count = count;
+    info.offset = offset;
+    info.func = func;
+    info.nread = 0;
+    info.errors = 0;
+    info.failed = 0;
+
+    jobpool *pool = NULL;
+
+    if (blocks > blocks_per_task) {
+        pool = get_pool(f, threads);
     }
 
-    uint64_t start = (offset / FEC_BLOCKSIZE) * FEC_BLOCKSIZE;
-    size_t blocks = fec_div_round_up(count, FEC_BLOCKSIZE);
+    if (pool) {
+        debug("%zu blocks, %zu blocks per task (total %zu bytes)", blocks,
+            blocks_per_task, count);
 
-    if ((size_t)threads > blocks) {
-        threads = (int)blocks;
+        jobpool_for(pool, first, last, blocks_per_task, process_range, &info);
+    } else {
+        /* small reads, or no threads available */
+        for (uint64_t i = first; i < last; i += blocks_per_task) {
+            process_range(&info, 0, i, std::min(i + blocks_per_task, last));
+        }
     }
 
-    size_t count_per_thread = fec_div_round_up(blocks, threads) * FEC_BLOCKSIZE;
-    size_t left = count;
-    uint64_t pos = offset;
-    uint64_t end = start + count_per_thread;
+    /* the FEC_READAHEAD thread can process at the same time */
+    __sync_fetch_and_add(&f->errors, info.errors);
 
-    debug("%d threads, %zu bytes per thread (total %zu)", threads,
-        count_per_thread, count);
+    if (info.failed) {
+        errno = EIO;
+        return -1;
+    }
 
-    std::vector<pthread_t> handles;
-    process_info info[threads];
-    ssize_t rc = 0;
+    return info.nread;
+}
 
-    /* start threads to process queue */
-    for (int i = 0; i < threads; ++i) {
-        check(left > 0);
+/* a run of consecutive blocks needed by a call to process_ranges, and the
+   number of blocks in the spans before it */
+struct process_span {
+    uint64_t first;
+    uint64_t blocks;
+    uint64_t index;
+};
 
-        info[i].id = i;
-        info[i].f = f;
-        info[i].buf = &buf[pos - offset];
-        info[i].count = (size_t)(end - pos);
-        info[i].offset = pos;
-        info[i].func = func;
-        info[i].rc = -1;
-        info[i].errors = 0;
+/* a call to process_ranges; tasks are ranges of the span blocks numbered
+   from zero, so a task can read blocks from more than one span */
+struct process_ranges_info {
+    fec_handle *f;
+    read_func func;
+    std::vector<fec_iovec> ranges; /* sorted by offset */
+    std::vector<uint64_t> range_ends; /* largest end of ranges[0..i] */
+    std::vector<process_span> spans;
+    size_t blocks_per_task;
+    jobpool *pool;
+    uint8_t *buf; /* for tasks run without the pool */
+    /* updated atomically, as tasks finish on different workers */
+    ssize_t nread;
+    size_t errors;
+    size_t failed;
+};
 
-        if (info[i].count > left) {
-            info[i].count = left;
+/* copies the data read from [pos, end) to the ranges that overlap it */
+static size_t copy_to_ranges(process_ranges_info *p, const uint8_t *data,
+        uint64_t pos, uint64_t end)
+{
+    size_t copied = 0;
+
+    /* ranges before the first one that ends past `pos' can't overlap */
+    size_t i = std::upper_bound(p->range_ends.begin(), p->range_ends.end(),
+                    pos) - p->range_ends.begin();
+
+    for (; i < p->ranges.size() && p->ranges[i].offset < end; ++i) {
+        const fec_iovec& range = p->ranges[i];
+        uint64_t from = std::max(pos, range.offset);
+        uint64_t to = std::min(end, range.offset + range.count);
+
+        if (from < to) {
+            memcpy((uint8_t *)range.buf + (from - range.offset),
+                &data[from - pos], (size_t)(to - from));
+            copied += (size_t)(to - from);
         }
+    }
+
+    return copied;
+}
 
-        pthread_t thread;
+/* reads the span blocks [first, last) and copies them to the ranges */
+static void process_ranges_task(void *cookie, int worker, uint64_t first,
+        uint64_t last)
+{
+    process_ranges_info *p = static_cast<process_ranges_info *>(cookie);
+    uint8_t *buf = p->buf;
 
-        if (pthread_create(&thread, NULL, __process, &info[i]) != 0) {
-            error("failed to create thread: %s", strerror(errno));
-            rc = -1;
-        } else {
-            handles.push_back(thread);
+    if (p->pool) {
+        buf = static_cast<uint8_t *>(jobpool_scratch(p->pool, worker,
+                    p->blocks_per_task * FEC_BLOCKSIZE));
+    }
+
+    if (unlikely(!buf)) {
+        __sync_fetch_and_add(&p->failed, 1);
+        return;
+    }
+
+    /* the span that contains `first' */
+    auto span = std::upper_bound(p->spans.begin(), p->spans.end(), first,
+                    [](uint64_t index, const process_span& s) {
+                        return index < s.index;
+                    }) - 1;
+
+    while (first < last) {
+        uint64_t blocks = std::min(last, span->index + span->blocks) - first;
+        uint64_t pos = (span->first + first - span->index) * FEC_BLOCKSIZE;
+        /* the ranges are within the data, but the last block may not be */
+        uint64_t end = std::min(pos + blocks * FEC_BLOCKSIZE,
+                            p->f->data_size);
+
+        debug("[%" PRIu64 ", %" PRIu64 ")", pos, end);
+
+        size_t errors = 0;
+
+        if (p->func(p->f, buf, (size_t)(end - pos), pos, &errors) == -1) {
+            __sync_fetch_and_add(&p->failed, 1);
+            return;
         }
 
-        pos = end;
-        end  += count_per_thread;
-        left -= info[i].count;
+        __sync_fetch_and_add(&p->nread, copy_to_ranges(p, buf, pos, end));
+        __sync_fetch_and_add(&p->errors, errors);
+
+        first += blocks;
+        ++span;
     }
+}
 
-    check(left == 0);
+/* reads `iovcnt' ranges within the data, coalescing the blocks they share
+   or that are next to each other, and runs the blocks in the worker pool */
+ssize_t process_ranges(fec_handle *f, const fec_iovec *iov, size_t iovcnt,
+        read_func func)
+{
+    check(f);
+    check(iov || iovcnt == 0);
+    check(func);
+
+    process_ranges_info info;
+    info.f = f;
+    info.func = func;
+    info.ranges.assign(iov, iov + iovcnt);
+    info.pool = NULL;
+    info.buf = NULL;
+    info.nread = 0;
+    info.errors = 0;
+    info.failed = 0;
+
+    std::sort(info.ranges.begin(), info.ranges.end(),
+        [](const fec_iovec& a, const fec_iovec& b) {
+            return a.offset < b.offset;
+        });
+
+    uint64_t blocks = 0;
+    uint64_t range_end = 0;
 
-    ssize_t nread = 0;
+    for (const auto& range : info.ranges) {
+        check(range.offset + range.count <= f->data_size);
 
-    /* wait for all threads to complete */
-    for (auto thread : handles) {
-        process_info *p = NULL;
+        uint64_t first = range.offset / FEC_BLOCKSIZE;
+        uint64_t last = fec_div_round_up(range.offset + range.count,
+                            FEC_BLOCKSIZE);
 
-        if (pthread_join(thread, (void **)&p) != 0) {
-            error("failed to join thread: %s", strerror(errno));
-            rc = -1;
-        } else if (!p || p->rc == -1) {
-            rc = -1;
+        range_end = std::max(range_end, range.offset + range.count);
+        info.range_ends.push_back(range_end);
+
+        if (first == last) {
+            continue;
+        }
+
+        if (!info.spans.empty() &&
+                first <= info.spans.back().first + info.spans.back().blocks) {
+            process_span& span = info.spans.back();
+
+            if (last > span.first + span.blocks) {
+                blocks += last - (span.first + span.blocks);
+                span.blocks = last - span.first;
+            }
         } else {
-            nread += p->rc;
-            f->errors += p->errors;
+            info.spans.push_back({ first, last - first, blocks });
+            blocks += last - first;
         }
     }
 
-    if (rc == -1) {
+    if (blocks == 0) {
+        return 0;
+    }
+
+    int threads = get_threads();
+    info.blocks_per_task = get_blocks_per_task(blocks, threads);
+
+    if (blocks > info.blocks_per_task) {
+        info.pool = get_pool(f, threads);
+    }
+
+    std::unique_ptr<uint8_t[]> buf;
+
+    if (info.pool) {
+        debug("%zu ranges, %zu spans, %" PRIu64 " blocks, %zu blocks per "
+            "task", iovcnt, info.spans.size(), blocks, info.blocks_per_task);
+
+        jobpool_for(info.pool, 0, blocks, info.blocks_per_task,
+            process_ranges_task, &info);
+    } else {
+        /* few blocks, or no threads available */
+        buf.reset(new (std::nothrow) uint8_t[info.blocks_per_task *
+                                             FEC_BLOCKSIZE]);
+        info.buf = buf.get();
+
+        for (uint64_t i = 0; i < blocks; i += info.blocks_per_task) {
+            process_ranges_task(&info, 0, i,
+                std::min(i + info.blocks_per_task, blocks));
+        }
+    }
+
+    __sync_fetch_and_add(&f->errors, info.errors);
+
+    if (info.failed) {
         errno = EIO;
         return -1;
     }
 
-    return nread;
+    return info.nread;
 }
@@ -75,29 +75,88 @@ static inline bool is_erasure(fec_handle *f, uint64_t offset,
        been corrupted, but knowing whether any of them is can be useful as
        well, because often the entire block is corrupted */
 
-    uint64_t n = offset / FEC_BLOCKSIZE;
+    const uint8_t *hash = verity_get_hash(f, offset / FEC_BLOCKSIZE, true);
 
-    return !verity_check_block(f, &f->verity.hash[n * SHA256_DIGEST_LENGTH],
-                data);
+    return hash && !verity_check_block(f, hash, data);
 }
 
 /* check if `offset' is within a block expected to contain zeros */
 static inline bool is_zero(fec_handle *f, uint64_t offset)
 {
-    verity_info *v = &f->verity;
-
-    if (!v->hash || unlikely(offset >= f->data_size)) {
+    if (unlikely(offset >= f->data_size)) {
         return false;
     }
 
-    uint64_t hash_offset = (offset / FEC_BLOCKSIZE) * SHA256_DIGEST_LENGTH;
+    /* don't load hashes with FEC_VERITY_LAZY just to skip reading a block */
+    const uint8_t *hash = verity_get_hash(f, offset / FEC_BLOCKSIZE, false);
+
+    return hash && !memcmp(f->verity.zero_hash, hash, SHA256_DIGEST_LENGTH);
+}
+
+/* asks the kernel to start reading the block at `offset' in the background */
+static inline void prefetch(fec_handle *f, uint64_t offset)
+{
+#if defined(__linux__)
+    posix_fadvise64(f->fd, offset, FEC_BLOCKSIZE, POSIX_FADV_WILLNEED);
+#else
+    (void)f;
+    (void)offset;
+#endif
+}
 
-    if (unlikely(hash_offset >
-            v->hash_data_blocks * FEC_BLOCKSIZE - SHA256_DIGEST_LENGTH)) {
+/* copies the parity bytes of the RS block `rsb' to `dest', reading them from
+   the file only if they are not in the parity cache */
+static bool get_parity(fec_handle *f, uint64_t rsb, uint8_t *dest)
+{
+    ecc_info *e = &f->ecc;
+    size_t size = e->roots * FEC_BLOCKSIZE;
+
+    pthread_mutex_lock(&f->mutex);
+
+    for (auto it = f->parity_cache.begin(); it != f->parity_cache.end();
+            ++it) {
+        if (it->rsb == rsb) {
+            memcpy(dest, it->data.get(), size);
+            /* move to front */
+            f->parity_cache.splice(f->parity_cache.begin(), f->parity_cache,
+                it);
+            pthread_mutex_unlock(&f->mutex);
+            return true;
+        }
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+
+    if (!raw_pread(f, dest, size, e->start + rsb * e->roots)) {
         return false;
     }
 
-    return !memcmp(v->zero_hash, &v->hash[hash_offset], SHA256_DIGEST_LENGTH);
+    ecc_parity entry;
+    entry.rsb = rsb;
+    entry.data.reset(new (std::nothrow) uint8_t[size]);
+
+    if (unlikely(!entry.data)) {
+        return true; /* not cached, but we have the data */
+    }
+
+    memcpy(entry.data.get(), dest, size);
+
+    size_t max_entries = ECC_PARITY_CACHE_SIZE / size;
+
+    if (max_entries < 1) {
+        max_entries = 1;
+    }
+
+    pthread_mutex_lock(&f->mutex);
+
+    f->parity_cache.push_front(std::move(entry));
+
+    while (f->parity_cache.size() > max_entries) {
+        f->parity_cache.pop_back();
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+    return true;
 }
 
 /* reads and decodes a single block starting from `offset', returns the number
@@ -119,6 +178,17 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
     /* verity is required to check for erasures */
     check(!use_erasures || f->verity.hash);
 
+    /* the data blocks of an RS block are `rounds' blocks apart, so let the
+       kernel start reading all of them before we wait for the first one */
+    for (int i = 0; i < e->rsn; ++i) {
+        uint64_t interleaved = fec_ecc_interleave(rsb * e->rsn + i, e->rsn,
+                                    e->rounds);
+
+        if (likely(interleaved < e->start) && !is_zero(f, interleaved)) {
+            prefetch(f, interleaved);
+        }
+    }
+
     for (int i = 0; i < e->rsn; ++i) {
         uint64_t interleaved = fec_ecc_interleave(rsb * e->rsn + i, e->rsn,
                                     e->rounds);
@@ -153,16 +223,23 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
 
     check(data_index >= 0);
 
+    /* parity bytes for the RS block are stored contiguously, so get all of
+       them at once to the end of `ecc_data' instead of a pread per byte */
+    uint8_t *parity = &ecc_data[FEC_RSM * FEC_BLOCKSIZE];
+
+    if (!get_parity(f, rsb, parity)) {
+        error("failed to read ecc data: %s", strerror(errno));
+        return -1;
+    }
+
     size_t nerrs = 0;
     uint8_t copy[FEC_RSM];
+    uint64_t start = stats_now();
 
     for (int i = 0; i < FEC_BLOCKSIZE; ++i) {
         /* copy parity data */
-        if (!raw_pread(f, &ecc_data[i * FEC_RSM + e->rsn], e->roots,
-                e->start + (i + rsb) * e->roots)) {
-            error("failed to read ecc data: %s", strerror(errno));
-            return -1;
-        }
+        memcpy(&ecc_data[i * FEC_RSM + e->rsn], &parity[i * e->roots],
+            e->roots);
 
         /* for debugging decoding failures, because decode_rs_char can mangle
            ecc_data */
@@ -184,6 +261,9 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
                 debug("RS block %" PRIu64 ": decoding failed", rsb);
             }
 
+            stats_add_time(f, decode_ns, start);
+            stats_add(f, decode_failures, 1);
+
             errno = EIO;
             return -1;
         } else if (unlikely(rc > 0)) {
@@ -194,6 +274,8 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
         dest[i] = ecc_data[i * FEC_RSM + data_index];
     }
 
+    stats_add_time(f, decode_ns, start);
+
     if (nerrs) {
         warn("RS block %" PRIu64 ": corrected %zu errors", rsb, nerrs);
         *errors += nerrs;
@@ -216,7 +298,9 @@ static int ecc_init(fec_handle *f, rs_unique_ptr& rs,
         return -1;
     }
 
-    ecc_data.reset(new (std::nothrow) uint8_t[FEC_RSM * FEC_BLOCKSIZE]);
+    /* an interleaved RS block, followed by its parity bytes */
+    ecc_data.reset(new (std::nothrow) uint8_t[(FEC_RSM + f->ecc.roots) *
+                                              FEC_BLOCKSIZE]);
 
     if (unlikely(!ecc_data)) {
         error("failed to allocate ecc buffer");
@@ -227,6 +311,32 @@ static int ecc_init(fec_handle *f, rs_unique_ptr& rs,
     return 0;
 }
 
+/* reads and decodes the block at `offset' without erasure detection, also
+   past `f->data_size', which makes it usable for the hash tree; returns the
+   number of corrected bytes in `errors' */
+ssize_t ecc_read_block(fec_handle *f, uint8_t *dest, uint64_t offset,
+        size_t *errors)
+{
+    check(f);
+    check(dest);
+    check(errors);
+
+    if (!f->ecc.start || offset >= f->ecc.start) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rs_unique_ptr rs(NULL, free_rs_char);
+    std::unique_ptr<uint8_t[]> ecc_data;
+
+    if (ecc_init(f, rs, ecc_data) == -1) {
+        return -1;
+    }
+
+    return __ecc_read(f, rs.get(), dest, offset, false, ecc_data.get(),
+                errors);
+}
+
 /* reads `count' bytes from `offset' and corrects possible errors without
    erasure detection, returning the number of corrected bytes in `errors' */
 static ssize_t ecc_read(fec_handle *f, uint8_t *dest, size_t count,
@@ -254,12 +364,18 @@ static ssize_t ecc_read(fec_handle *f, uint8_t *dest, size_t count,
     uint8_t data[FEC_BLOCKSIZE];
 
     while (left > 0) {
+        size_t block_errors = *errors;
+
         /* there's no erasure detection without verity metadata */
         if (__ecc_read(f, rs.get(), data, curr * FEC_BLOCKSIZE, false,
                 ecc_data.get(), errors) == -1) {
             return -1;
         }
 
+        if (*errors != block_errors) {
+            stats_add(f, blocks_corrected, 1);
+        }
+
         size_t copy = FEC_BLOCKSIZE - coff;
 
         if (copy > left) {
@@ -304,13 +420,16 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
     size_t left = count;
     uint8_t data[FEC_BLOCKSIZE];
 
-    uint64_t max_hash_block = (f->verity.hash_data_blocks * FEC_BLOCKSIZE -
-                                SHA256_DIGEST_LENGTH) / SHA256_DIGEST_LENGTH;
-
     while (left > 0) {
-        check(curr <= max_hash_block);
+        const uint8_t *hash = verity_get_hash(f, curr, true);
+
+        if (unlikely(!hash)) {
+            error("[%" PRIu64 ", %" PRIu64 "): no valid hash for block %"
+                PRIu64, offset, offset + count, curr);
+            errno = EIO;
+            return -1;
+        }
 
-        uint8_t *hash = &f->verity.hash[curr * SHA256_DIGEST_LENGTH];
         uint64_t curr_offset = curr * FEC_BLOCKSIZE;
 
         bool expect_zeros = is_zero(f, curr_offset);
@@ -322,13 +441,27 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
             goto valid;
         }
 
+        /* blocks corrected earlier, if FEC_VERITY_CACHE is enabled */
+        if (verity_cache_get(f, curr, data)) {
+            stats_add(f, cache_hits, 1);
+            goto valid;
+        }
+
         /* copy raw data without error correction */
         if (!raw_pread(f, data, FEC_BLOCKSIZE, curr_offset)) {
             error("failed to read: %s", strerror(errno));
             return -1;
         }
 
+        if (verity_cache_is_verified(f, curr)) {
+            stats_add(f, cache_hits, 1);
+            goto valid;
+        } else if (f->flags & FEC_VERITY_CACHE) {
+            stats_add(f, cache_misses, 1);
+        }
+
         if (likely(verity_check_block(f, hash, data))) {
+            verity_cache_set_verified(f, curr);
             goto valid;
         }
 
@@ -349,11 +482,14 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
                 offset, offset + count, curr);
         }
 
+        trace_begin("fec_correct_block");
+
         /* try to correct without erasures first, because checking for
            erasure locations is slower */
         if (__ecc_read(f, rs.get(), data, curr_offset, false, ecc_data.get(),
                 errors) == FEC_BLOCKSIZE &&
             verity_check_block(f, hash, data)) {
+            trace_end();
             goto corrected;
         }
 
@@ -361,9 +497,12 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
         if (__ecc_read(f, rs.get(), data, curr_offset, true, ecc_data.get(),
                 errors) == FEC_BLOCKSIZE &&
             verity_check_block(f, hash, data)) {
+            trace_end();
             goto corrected;
         }
 
+        trace_end();
+
         error("[%" PRIu64 ", %" PRIu64 "): corrupted block %" PRIu64
             " (offset %" PRIu64 ") cannot be recovered",
             offset, offset + count, curr, curr_offset);
@@ -373,11 +512,18 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
         return -1;
 
 corrected:
+        stats_add(f, blocks_corrected, 1);
+
         /* update the corrected block to the file if we are in r/w mode */
-        if (f->mode & O_RDWR &&
-                !raw_pwrite(f, data, FEC_BLOCKSIZE, curr_offset)) {
-            error("failed to write: %s", strerror(errno));
-            return -1;
+        if (f->mode & O_RDWR) {
+            if (!raw_pwrite(f, data, FEC_BLOCKSIZE, curr_offset)) {
+                error("failed to write: %s", strerror(errno));
+                return -1;
+            }
+
+            verity_cache_set_verified(f, curr);
+        } else {
+            verity_cache_put(f, curr, data);
         }
 
 valid:
@@ -474,11 +620,13 @@ bool raw_pread(fec_handle *f, void *buf, size_t count, uint64_t offset)
 
     uint8_t *p = (uint8_t *)buf;
     size_t remaining = count;
+    uint64_t start = stats_now();
 
     while (remaining > 0) {
         ssize_t n = TEMP_FAILURE_RETRY(pread64(f->fd, p, remaining, offset));
 
         if (n <= 0) {
+            stats_add_time(f, io_ns, start);
             return false;
         }
 
@@ -487,6 +635,7 @@ bool raw_pread(fec_handle *f, void *buf, size_t count, uint64_t offset)
         offset += n;
     }
 
+    stats_add_time(f, io_ns, start);
     return true;
 }
 
@@ -498,11 +647,13 @@ bool raw_pwrite(fec_handle *f, const void *buf, size_t count, uint64_t offset)
 
     const uint8_t *p = (const uint8_t *)buf;
     size_t remaining = count;
+    uint64_t start = stats_now();
 
     while (remaining > 0) {
         ssize_t n = TEMP_FAILURE_RETRY(pwrite64(f->fd, p, remaining, offset));
 
         if (n <= 0) {
+            stats_add_time(f, io_ns, start);
             return false;
         }
 
@@ -511,12 +662,13 @@ bool raw_pwrite(fec_handle *f, const void *buf, size_t count, uint64_t offset)
         offset += n;
     }
 
+    stats_add_time(f, io_ns, start);
     return true;
 }
 
 /* reads up to `count' bytes starting from `offset' using error correction and
    integrity validation, if available */
-ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
+static ssize_t __fec_pread(struct fec_handle *f, void *buf, size_t count,
         uint64_t offset)
 {
     check(f);
@@ -527,15 +679,29 @@ ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
         return -1;
     }
 
+    read_func func = verity_read;
+
     if (f->verity.hash) {
-        return process(f, (uint8_t *)buf,
-                    get_max_count(offset, count, f->data_size), offset,
-                    verity_read);
+        count = get_max_count(offset, count, f->data_size);
+
+        if (f->readahead) {
+            return readahead_process(f, (uint8_t *)buf, count, offset, func);
+        }
+
+        return process(f, (uint8_t *)buf, count, offset, func);
     } else if (f->ecc.start) {
         check(f->ecc.start < f->size);
 
         count = get_max_count(offset, count, f->data_size);
-        ssize_t rc = process(f, (uint8_t *)buf, count, offset, ecc_read);
+        func = ecc_read;
+
+        ssize_t rc;
+
+        if (f->readahead) {
+            rc = readahead_process(f, (uint8_t *)buf, count, offset, func);
+        } else {
+            rc = process(f, (uint8_t *)buf, count, offset, func);
+        }
 
         if (rc >= 0) {
             return rc;
@@ -553,3 +719,102 @@ ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
 
     return -1;
 }
+
+ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
+        uint64_t offset)
+{
+    check(f);
+
+    ssize_t rc = __fec_pread(f, buf, count, offset);
+
+    if (rc > 0) {
+        stats_add(f, bytes_read, rc);
+    }
+
+    return rc;
+}
+
+/* reads `iovcnt' ranges, which can be in any order and overlap, as if each
+   was read with `fec_pread', but blocks shared by the ranges are only read
+   and corrected once, and the blocks of all the ranges are split between the
+   workers together; returns the total number of bytes read */
+static ssize_t __fec_preadv(struct fec_handle *f, const struct fec_iovec *iov,
+        int iovcnt)
+{
+    check(f);
+    check(iov || iovcnt == 0);
+    check(iovcnt >= 0);
+
+    uint64_t max = f->size;
+
+    if (f->verity.hash || f->ecc.start) {
+        max = f->data_size;
+    }
+
+    /* ranges past `max' are shortened like in fec_pread, and empty ones are
+       dropped */
+    std::vector<fec_iovec> ranges;
+    size_t total = 0;
+
+    ranges.reserve(iovcnt);
+
+    for (int i = 0; i < iovcnt; ++i) {
+        check(iov[i].buf || iov[i].count == 0);
+
+        if (unlikely(iov[i].offset > UINT64_MAX - iov[i].count)) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+
+        fec_iovec range = iov[i];
+        range.count = get_max_count(range.offset, range.count, max);
+
+        if (unlikely(range.count > SSIZE_MAX - total)) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+
+        if (range.count > 0) {
+            ranges.push_back(range);
+            total += range.count;
+        }
+    }
+
+    /* FEC_READAHEAD is meant for sequential reads, so it's not used here */
+    if (f->verity.hash) {
+        return process_ranges(f, ranges.data(), ranges.size(), verity_read);
+    } else if (f->ecc.start) {
+        check(f->ecc.start < f->size);
+
+        ssize_t rc = process_ranges(f, ranges.data(), ranges.size(),
+                        ecc_read);
+
+        if (rc >= 0) {
+            return rc;
+        }
+
+        /* return raw data if pure ecc read fails, as in fec_pread */
+    }
+
+    for (const auto& range : ranges) {
+        if (!raw_pread(f, range.buf, range.count, range.offset)) {
+            return -1;
+        }
+    }
+
+    return total;
+}
+
+ssize_t fec_preadv(struct fec_handle *f, const struct fec_iovec *iov,
+        int iovcnt)
+{
+    check(f);
+
+    ssize_t rc = __fec_preadv(f, iov, iovcnt);
+
+    if (rc > 0) {
+        stats_add(f, bytes_read, rc);
+    }
+
+    return rc;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fec_private.h"
+
+enum readahead_window_state {
+    READAHEAD_EMPTY,
+    READAHEAD_QUEUED,
+    READAHEAD_FILLING,
+    READAHEAD_READY,
+    READAHEAD_FAILED
+};
+
+/* a range of data read ahead of the caller */
+struct readahead_window {
+    readahead_window_state state;
+    read_func func; /* data is only valid for reads with the same function */
+    uint64_t start;
+    size_t size;
+    std::unique_ptr<uint8_t[]> data;
+};
+
+/* FEC_READAHEAD state: once reads look sequential, a thread reads the
+   following windows with the same function the caller uses, so that the
+   caller can copy verified data instead of waiting for I/O and hashing */
+struct readahead_info {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued; /* signaled when windows are queued or on exit */
+    pthread_cond_t filled; /* signaled when a window has been read */
+    bool exiting;
+    uint64_t next; /* where the next sequential read would start */
+    int sequential; /* number of sequential reads in a row */
+    readahead_window windows[READAHEAD_WINDOWS];
+};
+
+/* releases `ra' after its thread has stopped */
+static void free_readahead(readahead_info *ra)
+{
+    pthread_cond_destroy(&ra->filled);
+    pthread_cond_destroy(&ra->queued);
+    pthread_mutex_destroy(&ra->mutex);
+    delete ra;
+}
+
+/* returns the queued window with the lowest offset, or NULL */
+static readahead_window *next_queued(readahead_info *ra)
+{
+    readahead_window *next = NULL;
+
+    for (auto& w : ra->windows) {
+        if (w.state == READAHEAD_QUEUED && (!next || w.start < next->start)) {
+            next = &w;
+        }
+    }
+
+    return next;
+}
+
+/* thread function */
+static void * __readahead(void *cookie)
+{
+    fec_handle *f = static_cast<fec_handle *>(cookie);
+    readahead_info *ra = f->readahead;
+
+    pthread_mutex_lock(&ra->mutex);
+
+    while (true) {
+        readahead_window *w = NULL;
+
+        while (!ra->exiting && (w = next_queued(ra)) == NULL) {
+            pthread_cond_wait(&ra->queued, &ra->mutex);
+        }
+
+        if (ra->exiting) {
+            break;
+        }
+
+        w->state = READAHEAD_FILLING;
+        pthread_mutex_unlock(&ra->mutex);
+
+        debug("[%" PRIu64 ", %" PRIu64 ")", w->start, w->start + w->size);
+        ssize_t rc = process(f, w->data.get(), w->size, w->start, w->func);
+
+        pthread_mutex_lock(&ra->mutex);
+
+        if (rc == (ssize_t)w->size) {
+            w->state = READAHEAD_READY;
+        } else {
+            w->state = READAHEAD_FAILED;
+        }
+
+        pthread_cond_broadcast(&ra->filled);
+    }
+
+    pthread_mutex_unlock(&ra->mutex);
+    return NULL;
+}
+
+/* returns the window that contains `offset', or NULL */
+static readahead_window *find_window(readahead_info *ra, uint64_t offset)
+{
+    for (auto& w : ra->windows) {
+        if (w.state != READAHEAD_EMPTY && offset >= w.start &&
+                offset - w.start < w.size) {
+            return &w;
+        }
+    }
+
+    return NULL;
+}
+
+/* copies as much of [offset, offset + count) from read windows to `buf' as
+   possible, waiting for windows that are being read; returns the number of
+   bytes copied */
+static size_t copy_windows(readahead_info *ra, uint8_t *buf, size_t count,
+        uint64_t offset, read_func func)
+{
+    size_t copied = 0;
+
+    while (copied < count) {
+        readahead_window *w = find_window(ra, offset + copied);
+
+        if (!w || w->func != func || w->state == READAHEAD_QUEUED ||
+                w->state == READAHEAD_FAILED) {
+            break;
+        }
+
+        if (w->state == READAHEAD_FILLING) {
+            pthread_cond_wait(&ra->filled, &ra->mutex);
+            continue;
+        }
+
+        size_t n = w->size - (size_t)(offset + copied - w->start);
+
+        if (n > count - copied) {
+            n = count - copied;
+        }
+
+        memcpy(&buf[copied], &w->data[offset + copied - w->start], n);
+        copied += n;
+    }
+
+    return copied;
+}
+
+/* releases windows the caller is done with and queues new ones */
+static void update_windows(fec_handle *f, readahead_info *ra, uint64_t offset,
+        size_t count, read_func func)
+{
+    uint64_t end = offset + count;
+    bool sequential = (offset == ra->next);
+
+    ra->next = end;
+
+    if (sequential) {
+        ++ra->sequential;
+    } else {
+        ra->sequential = 0;
+    }
+
+    for (auto& w : ra->windows) {
+        if (w.state == READAHEAD_FILLING) {
+            continue;
+        }
+
+        /* drop windows behind the caller, and everything else if the
+           caller jumped somewhere */
+        if (!sequential || w.start + w.size <= end) {
+            w.state = READAHEAD_EMPTY;
+        }
+    }
+
+    if (ra->sequential < READAHEAD_MIN_SEQUENTIAL) {
+        return;
+    }
+
+    uint64_t next = end;
+
+    for (const auto& w : ra->windows) {
+        if (w.state != READAHEAD_EMPTY && w.start + w.size > next) {
+            next = w.start + w.size;
+        }
+    }
+
+    bool queued = false;
+
+    for (auto& w : ra->windows) {
+        if (w.state != READAHEAD_EMPTY || next >= f->data_size) {
+            continue;
+        }
+
+        w.start = next;
+        w.size = READAHEAD_WINDOW_SIZE;
+
+        if (w.size > f->data_size - next) {
+            w.size = (size_t)(f->data_size - next);
+        }
+
+        w.state = READAHEAD_QUEUED;
+        w.func = func;
+        next += w.size;
+        queued = true;
+    }
+
+    if (queued) {
+        pthread_cond_signal(&ra->queued);
+    }
+}
+
+/* like process, but uses data read ahead by the FEC_READAHEAD thread if
+   available, and queues more if the caller reads sequentially */
+ssize_t readahead_process(fec_handle *f, uint8_t *buf, size_t count,
+        uint64_t offset, read_func func)
+{
+    check(f);
+    check(f->readahead);
+
+    readahead_info *ra = f->readahead;
+
+    pthread_mutex_lock(&ra->mutex);
+
+    size_t copied = copy_windows(ra, buf, count, offset, func);
+    update_windows(f, ra, offset, count, func);
+
+    pthread_mutex_unlock(&ra->mutex);
+
+    if (copied == count) {
+        return count;
+    }
+
+    ssize_t rc = process(f, &buf[copied], count - copied, offset + copied,
+                    func);
+
+    if (rc == -1) {
+        return -1;
+    }
+
+    return copied + rc;
+}
+
+/* starts the FEC_READAHEAD thread for `f' */
+int readahead_init(fec_handle *f)
+{
+    check(f);
+    check(!f->readahead);
+
+    readahead_info *ra = new (std::nothrow) readahead_info;
+
+    if (!ra) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ra->exiting = false;
+    ra->next = UINT64_MAX;
+    ra->sequential = 0;
+
+    for (auto& w : ra->windows) {
+        w.state = READAHEAD_EMPTY;
+        w.func = NULL;
+        w.start = 0;
+        w.size = 0;
+        w.data.reset(new (std::nothrow) uint8_t[READAHEAD_WINDOW_SIZE]);
+
+        if (!w.data) {
+            delete ra;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->queued, NULL);
+    pthread_cond_init(&ra->filled, NULL);
+
+    f->readahead = ra;
+
+    if (pthread_create(&ra->thread, NULL, __readahead, f) != 0) {
+        error("failed to create thread: %s", strerror(errno));
+        f->readahead = NULL;
+        free_readahead(ra);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* stops the FEC_READAHEAD thread of `f', if any */
+void readahead_free(fec_handle *f)
+{
+    readahead_info *ra = f->readahead;
+
+    if (!ra) {
+        return;
+    }
+
+    pthread_mutex_lock(&ra->mutex);
+    ra->exiting = true;
+    pthread_cond_broadcast(&ra->queued);
+    pthread_mutex_unlock(&ra->mutex);
+
+    if (pthread_join(ra->thread, NULL) != 0) {
+        error("failed to join thread: %s", strerror(errno));
+    }
+
+    f->readahead = NULL;
+    free_readahead(ra);
+}
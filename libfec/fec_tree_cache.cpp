@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <android-base/file.h>
+
+#include "fec_private.h"
+
+/* FEC_VERITY_TREE_CACHE keeps the data hashes of verified hash trees in
+   files named after the root hash, so that opening the same image again
+   only needs to read one file instead of reading and checking every level
+   of the tree */
+static char tree_cache_dir[PATH_MAX] = TREE_CACHE_DIR;
+
+/* a cache file is this header, followed by the `hash_data_blocks' blocks of
+   data hashes on the lowest level of the hash tree */
+struct tree_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    uint64_t data_blocks;
+    uint64_t hash_start;
+    uint32_t hash_data_blocks;
+    uint32_t salt_size;
+    /* SHA-256 of the header with this field zeroed, the salt, and the
+       SHA-256 of each TREE_CACHE_CHUNK_BLOCKS blocks of data hashes, so
+       truncated, corrupted or mismatching files are not used */
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+} __attribute__ ((packed));
+
+/* chunks of data hashes to compute digests for */
+struct digest_info {
+    const uint8_t *hashes;
+    uint64_t blocks;
+    uint8_t *digests;
+};
+
+/* sets the directory for FEC_VERITY_TREE_CACHE files */
+int fec_set_tree_cache_dir(const char *dir)
+{
+    check(dir);
+
+    if (strlen(dir) >= sizeof(tree_cache_dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(tree_cache_dir, dir);
+    return 0;
+}
+
+/* returns the cache file for the hash tree with the root hash `root' */
+static std::string get_path(const uint8_t *root)
+{
+    std::string path(tree_cache_dir);
+    path += '/';
+
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", root[i]);
+        path += hex;
+    }
+
+    return path;
+}
+
+/* computes the digests of the chunks [first, last) */
+static void digest_chunks(void *cookie, int, uint64_t first, uint64_t last)
+{
+    digest_info *d = static_cast<digest_info *>(cookie);
+
+    for (uint64_t i = first; i < last; ++i) {
+        uint64_t block = i * TREE_CACHE_CHUNK_BLOCKS;
+        uint64_t blocks = std::min<uint64_t>(TREE_CACHE_CHUNK_BLOCKS,
+                            d->blocks - block);
+
+        SHA256(&d->hashes[block * FEC_BLOCKSIZE], blocks * FEC_BLOCKSIZE,
+            &d->digests[i * SHA256_DIGEST_LENGTH]);
+    }
+}
+
+/* fills in the cache file header for the hash tree of `f' with the root hash
+   `root' and the data hashes `hashes'; the chunks are hashed by the workers,
+   so that checking a cache file isn't slower than verifying the tree in
+   parallel would be */
+static int init_header(fec_handle *f, const uint8_t *root,
+        const uint8_t *hashes, tree_cache_header *header)
+{
+    verity_info *v = &f->verity;
+    uint64_t chunks = fec_div_round_up(v->hash_data_blocks,
+                        TREE_CACHE_CHUNK_BLOCKS);
+    std::unique_ptr<uint8_t[]> digests(
+        new (std::nothrow) uint8_t[chunks * SHA256_DIGEST_LENGTH]);
+
+    if (!digests) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    digest_info info;
+    info.hashes = hashes;
+    info.blocks = v->hash_data_blocks;
+    info.digests = digests.get();
+
+    jobpool *pool = chunks > 1 ? process_get_pool(f) : NULL;
+
+    if (pool) {
+        jobpool_for(pool, 0, chunks, 1, digest_chunks, &info);
+    } else {
+        digest_chunks(&info, 0, 0, chunks);
+    }
+
+    memset(header, 0, sizeof(*header));
+    header->magic = TREE_CACHE_MAGIC;
+    header->version = TREE_CACHE_VERSION;
+    memcpy(header->root, root, SHA256_DIGEST_LENGTH);
+    header->data_blocks = v->data_blocks;
+    header->hash_start = v->hash_start;
+    header->hash_data_blocks = v->hash_data_blocks;
+    header->salt_size = v->salt_size;
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, header, sizeof(*header));
+    SHA256_Update(&ctx, v->salt, v->salt_size);
+    SHA256_Update(&ctx, digests.get(), chunks * SHA256_DIGEST_LENGTH);
+    SHA256_Final(header->digest, &ctx);
+
+    return 0;
+}
+
+/* reads the data hashes for the hash tree of `f' from the cache file `fd',
+   returns NULL if the file doesn't match the tree */
+static uint8_t *read_cache(fec_handle *f, const uint8_t *root, int fd)
+{
+    size_t size = (size_t)f->verity.hash_data_blocks * FEC_BLOCKSIZE;
+    struct stat st;
+
+    /* only trust files nobody else could have written */
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        warn("ignoring cached hash tree: unexpected owner or mode");
+        return NULL;
+    }
+
+    if ((uint64_t)st.st_size != sizeof(tree_cache_header) + size) {
+        debug("ignoring cached hash tree: unexpected size");
+        return NULL;
+    }
+
+    tree_cache_header header;
+    std::unique_ptr<uint8_t[]> hashes(new (std::nothrow) uint8_t[size]);
+
+    if (!hashes ||
+            !android::base::ReadFully(fd, &header, sizeof(header)) ||
+            !android::base::ReadFully(fd, hashes.get(), size)) {
+        warn("failed to read cached hash tree: %s", strerror(errno));
+        return NULL;
+    }
+
+    tree_cache_header expected;
+
+    if (init_header(f, root, hashes.get(), &expected) == -1) {
+        return NULL;
+    }
+
+    if (memcmp(&header, &expected, sizeof(header))) {
+        warn("ignoring invalid cached hash tree");
+        return NULL;
+    }
+
+    return hashes.release();
+}
+
+/* loads the data hashes for the hash tree of `f' with the root hash `root'
+   to `f->verity.hash' from the cache, if an earlier open saved them; the
+   hash tree offsets must already be calculated */
+int tree_cache_load(fec_handle *f, const uint8_t *root)
+{
+    check(f);
+    check(root);
+    check(!f->verity.hash);
+
+    std::string path = get_path(root);
+    int fd = TEMP_FAILURE_RETRY(open(path.c_str(),
+                O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+
+    if (fd == -1) {
+        debug("no cached hash tree in %s: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    trace_scope("fec_tree_cache_load");
+
+    f->verity.hash = read_cache(f, root, fd);
+    TEMP_FAILURE_RETRY(close(fd));
+
+    return f->verity.hash ? 0 : -1;
+}
+
+/* saves the verified data hashes of `f' to the cache; the file is written
+   under a temporary name and renamed, so other handles opening the image at
+   the same time either find a complete file or none */
+void tree_cache_save(fec_handle *f, const uint8_t *root)
+{
+    verity_info *v = &f->verity;
+
+    /* with FEC_VERITY_LAZY, the data hashes haven't all been checked */
+    if (!v->hash || v->hash_loaded) {
+        return;
+    }
+
+    if (mkdir(tree_cache_dir, 0700) == -1 && errno != EEXIST) {
+        warn("failed to create %s: %s", tree_cache_dir, strerror(errno));
+        return;
+    }
+
+    tree_cache_header header;
+
+    if (init_header(f, root, v->hash, &header) == -1) {
+        return;
+    }
+
+    std::string path = get_path(root);
+    std::string temp = path + ".XXXXXX";
+    int fd = mkostemp(&temp[0], O_CLOEXEC);
+
+    if (fd == -1) {
+        warn("failed to create %s: %s", temp.c_str(), strerror(errno));
+        return;
+    }
+
+    bool ok = android::base::WriteFully(fd, &header, sizeof(header)) &&
+        android::base::WriteFully(fd, v->hash,
+            (size_t)v->hash_data_blocks * FEC_BLOCKSIZE);
+
+    TEMP_FAILURE_RETRY(close(fd));
+
+    if (!ok || rename(temp.c_str(), path.c_str()) == -1) {
+        warn("failed to write %s: %s", path.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return;
+    }
+
+    debug("cached hash tree in %s", path.c_str());
+}
@@ -115,26 +115,51 @@ uint64_t verity_get_size(uint64_t file_size, uint32_t *verity_levels,
     return total * FEC_BLOCKSIZE;
 }
 
-/* computes a SHA-256 salted with `f->verity.salt' from a FEC_BLOCKSIZE byte
-   buffer `block', and copies the hash to `hash' */
-static inline int verity_hash(fec_handle *f, const uint8_t *block,
-        uint8_t *hash)
+/* computes SHA-256 hashes salted with `f->verity.salt' for `count'
+   consecutive FEC_BLOCKSIZE byte blocks in `blocks', and copies them to
+   `hashes'; the salt is only hashed once for all the blocks */
+static int verity_hash_blocks(fec_handle *f, const uint8_t *blocks,
+        size_t count, uint8_t *hashes)
 {
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-
     check(f);
     check(f->verity.salt);
-    SHA256_Update(&ctx, f->verity.salt, f->verity.salt_size);
+    check(blocks);
+    check(hashes);
 
-    check(block);
-    SHA256_Update(&ctx, block, FEC_BLOCKSIZE);
+    uint64_t start = stats_now();
+
+    SHA256_CTX salted;
+    SHA256_Init(&salted);
+    SHA256_Update(&salted, f->verity.salt, f->verity.salt_size);
 
-    check(hash);
-    SHA256_Final(hash, &ctx);
+    for (size_t i = 0; i < count; ++i) {
+        SHA256_CTX ctx = salted;
+
+        SHA256_Update(&ctx, &blocks[i * FEC_BLOCKSIZE], FEC_BLOCKSIZE);
+        SHA256_Final(&hashes[i * SHA256_DIGEST_LENGTH], &ctx);
+    }
+
+    stats_add_time(f, hash_ns, start);
     return 0;
 }
 
+/* computes a SHA-256 salted with `f->verity.salt' from a FEC_BLOCKSIZE byte
+   buffer `block', and copies the hash to `hash' */
+static inline int verity_hash(fec_handle *f, const uint8_t *block,
+        uint8_t *hash)
+{
+    return verity_hash_blocks(f, block, 1, hash);
+}
+
+/* returns true if `block' is a zero block that is expected to be one, which
+   is much cheaper to check than computing the hash */
+static inline bool is_zero_block(fec_handle *f, const uint8_t *expected,
+        const uint8_t *block)
+{
+    return f->verity.salt && !memcmp(expected, f->verity.zero_hash,
+                SHA256_DIGEST_LENGTH) && fec_is_zero(block, FEC_BLOCKSIZE);
+}
+
 /* computes a verity hash for FEC_BLOCKSIZE bytes from buffer `block' and
    compares it to the expected value in `expected' */
 bool verity_check_block(fec_handle *f, const uint8_t *expected,
@@ -142,6 +167,14 @@ bool verity_check_block(fec_handle *f, const uint8_t *expected,
 {
     check(f);
     check(block);
+    check(expected);
+
+    stats_add(f, blocks_verified, 1);
+
+    /* zero blocks are common in file system images */
+    if (is_zero_block(f, expected, block)) {
+        return true;
+    }
 
     uint8_t hash[SHA256_DIGEST_LENGTH];
 
@@ -150,46 +183,335 @@ bool verity_check_block(fec_handle *f, const uint8_t *expected,
         return false;
     }
 
-    check(expected);
     return !memcmp(expected, hash, SHA256_DIGEST_LENGTH);
 }
 
-/* reads a verity hash and the corresponding data block using error correction,
-   if available */
-static bool ecc_read_hashes(fec_handle *f, uint64_t hash_offset,
-        uint8_t *hash, uint64_t data_offset, uint8_t *data)
+/* checks `count' consecutive FEC_BLOCKSIZE byte blocks in `blocks' against
+   the consecutive hashes in `expected', and returns the number of blocks
+   from the start that are valid */
+size_t verity_check_blocks(fec_handle *f, const uint8_t *expected,
+        const uint8_t *blocks, size_t count)
+{
+    uint8_t hashes[VERITY_CHECK_BATCH * SHA256_DIGEST_LENGTH];
+    size_t valid = 0;
+
+    while (valid < count) {
+        size_t n = count - valid;
+
+        if (n > VERITY_CHECK_BATCH) {
+            n = VERITY_CHECK_BATCH;
+        }
+
+        const uint8_t *e = &expected[valid * SHA256_DIGEST_LENGTH];
+        const uint8_t *b = &blocks[valid * FEC_BLOCKSIZE];
+
+        if (verity_hash_blocks(f, b, n, hashes) == -1) {
+            error("failed to hash");
+            return valid;
+        }
+
+        for (size_t i = 0; i < n; ++i, ++valid) {
+            if (memcmp(&e[i * SHA256_DIGEST_LENGTH],
+                    &hashes[i * SHA256_DIGEST_LENGTH],
+                    SHA256_DIGEST_LENGTH) &&
+                !is_zero_block(f, &e[i * SHA256_DIGEST_LENGTH],
+                    &b[i * FEC_BLOCKSIZE])) {
+                /* the invalid block was checked too */
+                stats_add(f, blocks_verified, valid + 1);
+                return valid;
+            }
+        }
+    }
+
+    stats_add(f, blocks_verified, valid);
+    return valid;
+}
+
+/* allocates the FEC_VERITY_CACHE state for `f', using at most the memory
+   limit encoded in `f->flags' */
+int verity_cache_init(fec_handle *f)
 {
     check(f);
+    check(f->verity.hash);
 
-    if (hash && fec_pread(f, hash, SHA256_DIGEST_LENGTH, hash_offset) !=
-                    SHA256_DIGEST_LENGTH) {
-        error("failed to read hash tree: offset %" PRIu64 ": %s", hash_offset,
-            strerror(errno));
+    verity_cache *c = &f->cache;
+    size_t max_size = ((f->flags >> 16) & 0xff) * 1024 * 1024;
+
+    if (!max_size) {
+        max_size = VERITY_DEFAULT_CACHE_SIZE;
+    }
+
+    uint64_t blocks = fec_div_round_up(f->data_size, FEC_BLOCKSIZE);
+    uint64_t words = fec_div_round_up(blocks, 64);
+
+    /* the bitmap is the cheaper half of the cache, so it gets priority */
+    if (words * sizeof(uint64_t) <= max_size) {
+        c->verified.reset(new (std::nothrow) uint64_t[words]());
+
+        if (c->verified) {
+            c->verified_blocks = blocks;
+            max_size -= words * sizeof(uint64_t);
+        }
+    }
+
+    c->max_blocks = max_size / FEC_BLOCKSIZE;
+
+    debug("%" PRIu64 " verified blocks, %zu corrected blocks",
+        c->verified_blocks, c->max_blocks);
+
+    return 0;
+}
+
+/* releases the FEC_VERITY_CACHE state for `f' */
+void verity_cache_free(fec_handle *f)
+{
+    f->cache.verified.reset();
+    f->cache.verified_blocks = 0;
+    f->cache.blocks.clear();
+    f->cache.max_blocks = 0;
+}
+
+/* returns true if the data block `index' has already passed verification */
+bool verity_cache_is_verified(fec_handle *f, uint64_t index)
+{
+    verity_cache *c = &f->cache;
+
+    if (!c->verified || index >= c->verified_blocks) {
+        return false;
+    }
+
+    uint64_t word = __atomic_load_n(&c->verified[index / 64],
+                        __ATOMIC_RELAXED);
+
+    return word & (1ULL << (index % 64));
+}
+
+/* marks the data block `index' as verified */
+void verity_cache_set_verified(fec_handle *f, uint64_t index)
+{
+    verity_cache *c = &f->cache;
+
+    if (!c->verified || index >= c->verified_blocks) {
+        return;
+    }
+
+    __atomic_fetch_or(&c->verified[index / 64], 1ULL << (index % 64),
+        __ATOMIC_RELAXED);
+}
+
+/* copies the corrected contents of the data block `index' to `data', if the
+   block is in the cache */
+bool verity_cache_get(fec_handle *f, uint64_t index, uint8_t *data)
+{
+    verity_cache *c = &f->cache;
+
+    if (!c->max_blocks) {
         return false;
     }
 
+    bool found = false;
+    pthread_mutex_lock(&f->mutex);
+
+    for (auto it = c->blocks.begin(); it != c->blocks.end(); ++it) {
+        if (it->index == index) {
+            memcpy(data, it->data.get(), FEC_BLOCKSIZE);
+            /* move to front */
+            c->blocks.splice(c->blocks.begin(), c->blocks, it);
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+    return found;
+}
+
+/* adds the corrected contents of the data block `index' to the cache */
+void verity_cache_put(fec_handle *f, uint64_t index, const uint8_t *data)
+{
+    verity_cache *c = &f->cache;
+
+    if (!c->max_blocks) {
+        return;
+    }
+
+    verity_block block;
+    block.index = index;
+    block.data.reset(new (std::nothrow) uint8_t[FEC_BLOCKSIZE]);
+
+    if (unlikely(!block.data)) {
+        return;
+    }
+
+    memcpy(block.data.get(), data, FEC_BLOCKSIZE);
+
+    pthread_mutex_lock(&f->mutex);
+
+    c->blocks.push_front(std::move(block));
+
+    while (c->blocks.size() > c->max_blocks) {
+        c->blocks.pop_back();
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/* reads the hash tree block at `offset' using error correction, checks it
+   against `expected', and in r/w mode, writes the corrected block back */
+static bool correct_tree_block(fec_handle *f, const uint8_t *expected,
+        uint8_t *data, uint64_t offset, size_t *errors)
+{
+    check(f);
+    check(expected);
     check(data);
 
-    if (fec_pread(f, data, FEC_BLOCKSIZE, data_offset) != FEC_BLOCKSIZE) {
-        error("failed to read hash tree: data_offset %" PRIu64 ": %s",
-            data_offset, strerror(errno));
+    if (!f->ecc.start) {
+        error("invalid hash tree block at offset %" PRIu64 ", no ecc",
+            offset);
+        return false;
+    }
+
+    trace_scope("fec_correct_tree_block");
+
+    if (ecc_read_block(f, data, offset, errors) != FEC_BLOCKSIZE ||
+            !verity_check_block(f, expected, data)) {
+        error("invalid hash tree block at offset %" PRIu64, offset);
+        return false;
+    }
+
+    stats_add(f, blocks_corrected, 1);
+
+    if (f->mode & O_RDWR && !raw_pwrite(f, data, FEC_BLOCKSIZE, offset)) {
+        error("failed to rewrite hash tree block: %s", strerror(errno));
         return false;
     }
 
     return true;
 }
 
+/* read_func for verify_tree: reads `count' bytes of the hash tree level
+   that is being verified from `offset' to `dest', checks the blocks against
+   their hashes on the level above, and corrects the ones that don't match */
+static ssize_t verify_tree_blocks(fec_handle *f, uint8_t *dest, size_t count,
+        uint64_t offset, size_t *errors)
+{
+    check(f);
+    check(dest);
+    check(errors);
+
+    verity_info *v = &f->verity;
+
+    check(v->tree_parent);
+    check(offset >= v->tree_level_offset);
+    check(offset % FEC_BLOCKSIZE == 0);
+    check(count % FEC_BLOCKSIZE == 0);
+
+    const uint8_t *expected = &v->tree_parent[(offset - v->tree_level_offset) /
+                                    FEC_BLOCKSIZE * SHA256_DIGEST_LENGTH];
+    size_t blocks = count / FEC_BLOCKSIZE;
+
+    /* ecc reads are very I/O intensive, so read the raw blocks and do error
+       correcting only for the ones that don't validate */
+    bool raw = raw_pread(f, dest, count, offset);
+
+    if (!raw) {
+        warn("failed to read hashes: %s", strerror(errno));
+    }
+
+    for (size_t i = 0; i < blocks; ++i) {
+        if (raw) {
+            i += verity_check_blocks(f, &expected[i * SHA256_DIGEST_LENGTH],
+                    &dest[i * FEC_BLOCKSIZE], blocks - i);
+
+            if (i == blocks) {
+                break;
+            }
+        }
+
+        if (!correct_tree_block(f, &expected[i * SHA256_DIGEST_LENGTH],
+                &dest[i * FEC_BLOCKSIZE], offset + i * FEC_BLOCKSIZE,
+                errors)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+/* loads block `n' of `f->verity.hash', which FEC_VERITY_LAZY defers until
+   the hashes in it are needed */
+static int load_hash_block(fec_handle *f, uint64_t n)
+{
+    verity_info *v = &f->verity;
+    uint64_t bit = 1ULL << (n % 64);
+    int rc = 0;
+
+    pthread_mutex_lock(&f->hash_mutex);
+
+    if (!(__atomic_load_n(&v->hash_loaded[n / 64], __ATOMIC_ACQUIRE) & bit)) {
+        trace_scope("fec_load_hash_block");
+
+        uint8_t *block = &v->hash[n * FEC_BLOCKSIZE];
+        const uint8_t *expected = &v->hash_parent[n * SHA256_DIGEST_LENGTH];
+        uint64_t offset = v->hash_data_offset + n * FEC_BLOCKSIZE;
+        size_t errors = 0;
+
+        debug("loading hash block %" PRIu64, n);
+
+        if ((raw_pread(f, block, FEC_BLOCKSIZE, offset) &&
+                verity_check_block(f, expected, block)) ||
+            correct_tree_block(f, expected, block, offset, &errors)) {
+            __atomic_fetch_or(&v->hash_loaded[n / 64], bit, __ATOMIC_RELEASE);
+        } else {
+            rc = -1;
+        }
+
+        __sync_fetch_and_add(&f->errors, errors);
+    }
+
+    pthread_mutex_unlock(&f->hash_mutex);
+    return rc;
+}
+
+/* returns the expected hash for data block `index', or NULL if there isn't
+   one; with FEC_VERITY_LAZY, the hash tree block that contains it is loaded
+   and verified first if `load' is true, and NULL is returned if it hasn't
+   been loaded yet otherwise */
+const uint8_t *verity_get_hash(fec_handle *f, uint64_t index, bool load)
+{
+    verity_info *v = &f->verity;
+    uint64_t offset = index * SHA256_DIGEST_LENGTH;
+
+    if (!v->hash || offset >= (uint64_t)v->hash_data_blocks * FEC_BLOCKSIZE) {
+        return NULL;
+    }
+
+    if (v->hash_loaded) {
+        uint64_t n = offset / FEC_BLOCKSIZE;
+
+        if (!(__atomic_load_n(&v->hash_loaded[n / 64], __ATOMIC_ACQUIRE) &
+                (1ULL << (n % 64))) && (!load || load_hash_block(f, n) == -1)) {
+            return NULL;
+        }
+    }
+
+    return &v->hash[offset];
+}
+
 /* reads the verity hash tree, validates it against the root hash in `root',
    corrects errors if necessary, and copies valid data blocks for later use
-   to `f->verity.hash' */
+   to `f->verity.hash'; each level is checked in parallel against the one
+   above it, and with FEC_VERITY_LAZY, blocks on the lowest level are only
+   checked when they are first needed; with FEC_VERITY_TREE_CACHE, the
+   data hashes verified by an earlier open are used if they are cached */
 static int verify_tree(fec_handle *f, const uint8_t *root)
 {
-    uint8_t data[FEC_BLOCKSIZE];
-    uint8_t hash[SHA256_DIGEST_LENGTH];
-
     check(f);
     check(root);
 
+    trace_scope("fec_verify_tree");
+
     verity_info *v = &f->verity;
     uint32_t levels = 0;
 
@@ -205,23 +527,6 @@ static int verify_tree(fec_handle *f, const uint8_t *root)
 
     v->hash_data_offset = data_offset;
 
-    /* validate the root hash */
-    if (!raw_pread(f, data, FEC_BLOCKSIZE, hash_offset) ||
-            !verity_check_block(f, root, data)) {
-        /* try to correct */
-        if (!ecc_read_hashes(f, 0, NULL, hash_offset, data) ||
-                !verity_check_block(f, root, data)) {
-            error("root hash invalid");
-            return -1;
-        } else if (f->mode & O_RDWR &&
-                    !raw_pwrite(f, data, FEC_BLOCKSIZE, hash_offset)) {
-            error("failed to rewrite the root block: %s", strerror(errno));
-            return -1;
-        }
-    }
-
-    debug("root hash valid");
-
     /* calculate the number of hashes on each level */
     uint32_t hashes[levels];
 
@@ -248,71 +553,100 @@ static int verify_tree(fec_handle *f, const uint8_t *root)
     check(v->hash_data_offset + v->hash_data_blocks * FEC_BLOCKSIZE <=
         f->data_size);
 
-    /* copy data hashes to memory in case they are corrupted, so we don't
-       have to correct them every time they are needed */
-    std::unique_ptr<uint8_t[]> data_hashes(
-       new (std::nothrow) uint8_t[f->verity.hash_data_blocks * FEC_BLOCKSIZE]);
+    if ((f->flags & FEC_VERITY_TREE_CACHE) && tree_cache_load(f, root) == 0) {
+        debug("using cached hash tree");
+        return 0;
+    }
+
+    /* the verified level above the one being checked, starting from the
+       root block */
+    std::unique_ptr<uint8_t[]> parent(
+        new (std::nothrow) uint8_t[FEC_BLOCKSIZE]);
 
-    if (!data_hashes) {
+    if (!parent) {
         errno = ENOMEM;
         return -1;
     }
 
-    /* validate the rest of the hash tree */
+    /* validate the root hash */
+    if (!raw_pread(f, parent.get(), FEC_BLOCKSIZE, hash_offset) ||
+            !verity_check_block(f, root, parent.get())) {
+        size_t errors = 0;
+
+        /* try to correct */
+        bool valid = correct_tree_block(f, root, parent.get(), hash_offset,
+                        &errors);
+
+        f->errors += errors;
+
+        if (!valid) {
+            error("root hash invalid");
+            return -1;
+        }
+    }
+
+    debug("root hash valid");
+
+    /* validate the rest of the hash tree one level at a time; blocks on the
+       same level only depend on the level above, so they are read and
+       checked by the worker threads in parallel, and the data hashes on the
+       lowest level are kept in memory in case they are corrupted, so we
+       don't have to correct them every time they are needed */
     data_offset = hash_offset + FEC_BLOCKSIZE;
 
     for (uint32_t i = 1; i < levels; ++i) {
         uint32_t blocks = hashes[levels - i];
+        std::unique_ptr<uint8_t[]> level(
+            new (std::nothrow) uint8_t[blocks * FEC_BLOCKSIZE]);
+
+        if (!level) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (i == levels - 1 && (f->flags & FEC_VERITY_LAZY)) {
+            check(data_offset == v->hash_data_offset);
 
-        for (uint32_t j = 0; j < blocks; ++j) {
-            /* ecc reads are very I/O intensive, so read raw hash tree and do
-               error correcting only if it doesn't validate */
-            if (!raw_pread(f, hash, SHA256_DIGEST_LENGTH,
-                    hash_offset + j * SHA256_DIGEST_LENGTH) ||
-                !raw_pread(f, data, FEC_BLOCKSIZE,
-                    data_offset + j * FEC_BLOCKSIZE)) {
-                error("failed to read hashes: %s", strerror(errno));
+            v->hash_loaded = new (std::nothrow)
+                                uint64_t[fec_div_round_up(blocks, 64)]();
+
+            if (!v->hash_loaded) {
+                errno = ENOMEM;
                 return -1;
             }
 
-            if (!verity_check_block(f, hash, data)) {
-                /* try to correct */
-                if (!ecc_read_hashes(f,
-                        hash_offset + j * SHA256_DIGEST_LENGTH, hash,
-                        data_offset + j * FEC_BLOCKSIZE, data) ||
-                    !verity_check_block(f, hash, data)) {
-                    error("invalid hash tree: hash_offset %" PRIu64 ", "
-                        "data_offset %" PRIu64 ", block %u",
-                        hash_offset, data_offset, j);
-                    return -1;
-                }
-
-                /* update the corrected blocks to the file if we are in r/w
-                   mode */
-                if (f->mode & O_RDWR) {
-                    if (!raw_pwrite(f, hash, SHA256_DIGEST_LENGTH,
-                            hash_offset + j * SHA256_DIGEST_LENGTH) ||
-                        !raw_pwrite(f, data, FEC_BLOCKSIZE,
-                            data_offset + j * FEC_BLOCKSIZE)) {
-                        error("failed to write hashes: %s", strerror(errno));
-                        return -1;
-                    }
-                }
-            }
+            debug("deferring %u hash blocks", blocks);
 
-            if (blocks == v->hash_data_blocks) {
-                memcpy(data_hashes.get() + j * FEC_BLOCKSIZE, data,
-                    FEC_BLOCKSIZE);
-            }
+            v->hash_parent = parent.release();
+            v->hash = level.release();
+            return 0;
         }
 
-        hash_offset = data_offset;
+        v->tree_level_offset = data_offset;
+        v->tree_parent = parent.get();
+
+        ssize_t rc = process(f, level.get(), blocks * FEC_BLOCKSIZE,
+                        data_offset, verify_tree_blocks);
+
+        v->tree_parent = NULL;
+
+        if (rc != (ssize_t)blocks * FEC_BLOCKSIZE) {
+            error("invalid hash tree: level %u", levels - i);
+            return -1;
+        }
+
+        parent.swap(level);
         data_offset += blocks * FEC_BLOCKSIZE;
     }
 
     debug("valid");
 
-    v->hash = data_hashes.release();
+    v->hash = parent.release();
+
+    if (f->flags & FEC_VERITY_TREE_CACHE) {
+        tree_cache_save(f, root);
+    }
+
     return 0;
 }
 
@@ -434,12 +768,8 @@ static int parse_table(fec_handle *f, uint64_t offset, uint32_t size)
     v->table = table.release();
 
     if (!(f->flags & FEC_VERITY_DISABLE)) {
-        if (verify_tree(f, root) == -1) {
-            return -1;
-        }
-
-        check(v->hash);
-
+        /* needed by verity_check_block, so compute it before the tree is
+           verified */
         uint8_t zero_block[FEC_BLOCKSIZE];
         memset(zero_block, 0, FEC_BLOCKSIZE);
 
@@ -447,6 +777,12 @@ static int parse_table(fec_handle *f, uint64_t offset, uint32_t size)
             error("failed to hash");
             return -1;
         }
+
+        if (verify_tree(f, root) == -1) {
+            return -1;
+        }
+
+        check(v->hash);
     }
 
     return 0;
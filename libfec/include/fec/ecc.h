@@ -17,6 +17,7 @@
 #ifndef ___FEC_ECC_H___
 #define ___FEC_ECC_H___
 
+#include <string.h>
 #include <fec/io.h>
 
 #ifdef __cplusplus
@@ -62,6 +63,29 @@ inline uint64_t fec_ecc_get_size(uint64_t file_size, int roots)
                 + FEC_BLOCKSIZE;
 }
 
+/* returns true if all `size' bytes starting from `data' are zeros; checks 64
+   bytes at a time, which compilers turn into a few vector instructions */
+inline bool fec_is_zero(const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+
+    for (; i + 64 <= size; i += 64) {
+        uint64_t w[8];
+        memcpy(w, &data[i], sizeof(w));
+
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) {
+            return false;
+        }
+    }
+
+    for (; i < size; ++i) {
+        if (data[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -59,6 +59,20 @@ struct fec_status {
     uint64_t size;
 };
 
+/* counters since the handle was opened, see fec_get_stats; times are summed
+   over the threads reading in parallel */
+struct fec_stats {
+    uint64_t bytes_read; /* returned by fec_read, fec_pread and fec_preadv */
+    uint64_t blocks_verified; /* checked against verity hashes */
+    uint64_t blocks_corrected; /* recovered with ecc, or known to be zeros */
+    uint64_t decode_failures; /* RS blocks ecc couldn't decode */
+    uint64_t cache_hits; /* FEC_VERITY_CACHE lookups */
+    uint64_t cache_misses;
+    uint64_t io_ns; /* reading and writing the file */
+    uint64_t hash_ns; /* computing verity hashes */
+    uint64_t decode_ns; /* RS decoding */
+};
+
 struct fec_ecc_metadata {
     bool valid;
     uint32_t roots;
@@ -76,13 +90,29 @@ struct fec_verity_metadata {
     uint32_t table_length;
 };
 
+/* a range for fec_preadv */
+struct fec_iovec {
+    void *buf;
+    size_t count;
+    uint64_t offset;
+};
+
 /* flags for fec_open */
 enum {
     FEC_FS_EXT4 = 1 << 0,
     FEC_FS_SQUASH = 1 << 1,
-    FEC_VERITY_DISABLE = 1 << 8
+    FEC_VERITY_DISABLE = 1 << 8,
+    FEC_VERITY_CACHE = 1 << 9,
+    FEC_READAHEAD = 1 << 10,
+    FEC_VERITY_LAZY = 1 << 11,
+    FEC_VERITY_TREE_CACHE = 1 << 12
 };
 
+/* enables FEC_VERITY_CACHE with a memory limit of `mb' MiB (1-255), instead
+   of the default limit */
+#define FEC_VERITY_CACHE_SIZE(mb) \
+    (FEC_VERITY_CACHE | (((mb) & 0xff) << 16))
+
 struct fec_handle;
 
 /* file access */
@@ -93,6 +123,10 @@ extern int fec_close(struct fec_handle *f);
 
 extern int fec_verity_set_status(struct fec_handle *f, bool enabled);
 
+/* sets the directory where FEC_VERITY_TREE_CACHE keeps verified hash trees,
+   instead of the default; not thread-safe, call before opening handles */
+extern int fec_set_tree_cache_dir(const char *dir);
+
 extern int fec_verity_get_metadata(struct fec_handle *f,
         struct fec_verity_metadata *data);
 
@@ -101,6 +135,8 @@ extern int fec_ecc_get_metadata(struct fec_handle *f,
 
 extern int fec_get_status(struct fec_handle *f, struct fec_status *s);
 
+extern int fec_get_stats(struct fec_handle *f, struct fec_stats *s);
+
 extern int fec_seek(struct fec_handle *f, int64_t offset, int whence);
 
 extern ssize_t fec_read(struct fec_handle *f, void *buf, size_t count);
@@ -108,6 +144,9 @@ extern ssize_t fec_read(struct fec_handle *f, void *buf, size_t count);
 extern ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
         uint64_t offset);
 
+extern ssize_t fec_preadv(struct fec_handle *f, const struct fec_iovec *iov,
+        int iovcnt);
+
 #ifdef __cplusplus
 } /* extern "C" */
 
@@ -158,10 +197,18 @@ namespace fec {
             return fec_pread(handle_.get(), buf, count, offset);
         }
 
+        ssize_t preadv(const fec_iovec *iov, int iovcnt) {
+            return fec_preadv(handle_.get(), iov, iovcnt);
+        }
+
         bool get_status(fec_status& status) {
             return !fec_get_status(handle_.get(), &status);
         }
 
+        bool get_stats(fec_stats& stats) {
+            return !fec_get_stats(handle_.get(), &stats);
+        }
+
         bool get_verity_metadata(fec_verity_metadata& data) {
             return !fec_verity_get_metadata(handle_.get(), &data);
         }
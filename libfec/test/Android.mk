@@ -10,6 +10,7 @@ LOCAL_SRC_FILES := test_read.cpp
 LOCAL_MODULE_TAGS := optional
 LOCAL_STATIC_LIBRARIES := \
     libfec_host \
+    libjobpool_host \
     libfec_rs_host \
     libcrypto_static \
     libext4_utils_host \
@@ -29,4 +30,25 @@ LOCAL_CFLAGS := -Wall -Werror -D_GNU_SOURCE
 LOCAL_C_INCLUDES += external/fec
 include $(BUILD_HOST_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SANITIZE := integer
+LOCAL_MODULE := fec_test_bench
+LOCAL_SRC_FILES := test_bench.cpp
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES := \
+    libfec_host \
+    libjobpool_host \
+    libfec_rs_host \
+    libcrypto_static \
+    libext4_utils_host \
+    libsquashfs_utils_host \
+    libbase
+LOCAL_CFLAGS := -Wall -Werror -D_GNU_SOURCE
+LOCAL_C_INCLUDES += external/fec
+# fault injection wraps the pread64 calls libfec makes
+LOCAL_LDFLAGS := -Wl,--wrap=pread64
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
 endif # HOST_OS == linux
@@ -0,0 +1,739 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Generates an image with verity metadata and ecc, corrupts an increasing
+   share of its blocks, and measures fec_pread (or fec_preadv, with -v)
+   throughput and latency for each corruption rate. Data read back is compared to the original, so a
+   mismatch is reported as a failure. Faults can be injected as flipped
+   bytes, overwritten blocks, or I/O errors: libfec reads with pread64,
+   which is wrapped at link time (-Wl,--wrap=pread64) to fail reads of
+   selected blocks with EIO. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <openssl/sha.h>
+#include <fec/io.h>
+#include <fec/ecc.h>
+
+extern "C" {
+    #include <fec.h>
+}
+
+#define VERITY_METADATA_SIZE (8 * FEC_BLOCKSIZE)
+#define VERITY_MAGIC 0xB001B001
+#define VERITY_VERSION 0
+#define VERITY_SIGNATURE_SIZE 256
+
+struct verity_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t signature[VERITY_SIGNATURE_SIZE];
+    uint32_t length;
+} __attribute__ ((packed));
+
+enum {
+    PATTERN_BYTES,  /* one byte flipped in each corrupted block */
+    PATTERN_BLOCKS, /* corrupted blocks overwritten with random data */
+    PATTERN_EIO     /* reads of corrupted blocks fail with EIO */
+};
+
+struct options {
+    uint64_t size;
+    int roots;
+    size_t bufsize;
+    int batch; /* reads per fec_preadv call, or 0 to use fec_pread */
+    int pattern;
+    std::vector<double> rates;
+    int passes;
+    bool random_order;
+    int flags;
+    unsigned seed;
+    std::string path;
+    std::string tree_cache; /* FEC_VERITY_TREE_CACHE directory, if set */
+};
+
+/* the generated image: data, hash tree, verity metadata, and ecc */
+struct bench_image {
+    std::vector<uint8_t> contents;
+    uint64_t data_size;
+    /* data and hash tree blocks, which are the ones corrupted */
+    uint64_t target_blocks;
+};
+
+/* pread64 fault injection state */
+static struct {
+    dev_t dev;
+    ino_t ino;
+    std::atomic<int> fd;
+    std::atomic<uint64_t> injected;
+    const std::vector<bool> *bad;
+} faults;
+
+extern "C" ssize_t __real_pread64(int fd, void *buf, size_t count,
+        off64_t offset);
+
+/* returns true if `fd' refers to the image */
+static bool is_image_fd(int fd)
+{
+    if (fd == faults.fd) {
+        return true;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_dev != faults.dev ||
+            st.st_ino != faults.ino) {
+        return false;
+    }
+
+    faults.fd = fd;
+    return true;
+}
+
+extern "C" ssize_t __wrap_pread64(int fd, void *buf, size_t count,
+        off64_t offset)
+{
+    if (faults.bad && count > 0 && is_image_fd(fd)) {
+        uint64_t first = offset / FEC_BLOCKSIZE;
+        uint64_t last = (offset + count - 1) / FEC_BLOCKSIZE;
+
+        for (uint64_t b = first; b <= last && b < faults.bad->size(); ++b) {
+            if ((*faults.bad)[b]) {
+                ++faults.injected;
+                errno = EIO;
+                return -1;
+            }
+        }
+    }
+
+    return __real_pread64(fd, buf, count, offset);
+}
+
+static int usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [ <options> ] <image>\n"
+        "options:\n"
+        "  -s <MiB>        size of the data area (default: 64)\n"
+        "  -r <roots>      number of parity bytes (default: %d)\n"
+        "  -b <KiB>        bytes per fec_pread (default: 64)\n"
+        "  -v <reads>      batch reads into fec_preadv calls of <reads> ranges\n"
+        "  -p <pattern>    bytes, blocks, or eio (default: blocks)\n"
+        "  -c <rates>      comma separated fractions of corrupted blocks\n"
+        "                  (default: 0,0.0001,0.001,0.01)\n"
+        "  -n <passes>     passes over the data for each rate (default: 1)\n"
+        "  -x              read in random order instead of sequentially\n"
+        "  -C              open with FEC_VERITY_CACHE\n"
+        "  -L              open with FEC_VERITY_LAZY\n"
+        "  -R              open with FEC_READAHEAD\n"
+        "  -T <dir>        open with FEC_VERITY_TREE_CACHE, caching in <dir>\n"
+        "  -S <seed>       seed for data and corruption (default: 1)\n"
+        "<image> is overwritten with the generated image\n",
+        name, FEC_DEFAULT_ROOTS);
+    return 1;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static std::string to_hex(const uint8_t *data, size_t size)
+{
+    std::string hex;
+    char buf[3];
+
+    for (size_t i = 0; i < size; ++i) {
+        snprintf(buf, sizeof(buf), "%02x", data[i]);
+        hex += buf;
+    }
+
+    return hex;
+}
+
+static void hash_block(const uint8_t *salt, size_t salt_size,
+        const uint8_t *block, uint8_t *hash)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, salt, salt_size);
+    SHA256_Update(&ctx, block, FEC_BLOCKSIZE);
+    SHA256_Final(hash, &ctx);
+}
+
+/* builds a dm-verity hash tree for `data', top level first, the way
+   build_verity_tree does, and returns the root hash in `root' */
+static void build_tree(const uint8_t *data, uint64_t size,
+        const uint8_t *salt, size_t salt_size, std::vector<uint8_t>& tree,
+        uint8_t *root)
+{
+    std::vector<std::vector<uint8_t>> levels;
+    const uint8_t *level = data;
+    uint64_t blocks = size / FEC_BLOCKSIZE;
+
+    do {
+        std::vector<uint8_t> hashes(fec_round_up(blocks * SHA256_DIGEST_LENGTH,
+                                        FEC_BLOCKSIZE));
+
+        for (uint64_t i = 0; i < blocks; ++i) {
+            hash_block(salt, salt_size, &level[i * FEC_BLOCKSIZE],
+                &hashes[i * SHA256_DIGEST_LENGTH]);
+        }
+
+        levels.push_back(std::move(hashes));
+        level = levels.back().data();
+        blocks = levels.back().size() / FEC_BLOCKSIZE;
+    } while (blocks > 1);
+
+    hash_block(salt, salt_size, level, root);
+
+    tree.clear();
+
+    for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+        tree.insert(tree.end(), it->begin(), it->end());
+    }
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size,
+        uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pwrite64(fd, data, size, offset));
+
+        if (n <= 0) {
+            return false;
+        }
+
+        data += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+/* generates random data followed by its hash tree, verity metadata, and
+   ecc for all of them, like `fec --verity' would, to `o.path' */
+static bool generate_image(const options& o, std::mt19937_64& rng,
+        bench_image& img)
+{
+    img.data_size = o.size;
+    img.contents.resize(o.size);
+
+    for (uint64_t i = 0; i < o.size; i += sizeof(uint64_t)) {
+        uint64_t v = rng();
+        memcpy(&img.contents[i], &v, sizeof(v));
+    }
+
+    uint8_t salt[SHA256_DIGEST_LENGTH];
+    uint8_t root[SHA256_DIGEST_LENGTH];
+
+    for (auto& b : salt) {
+        b = (uint8_t)rng();
+    }
+
+    std::vector<uint8_t> tree;
+    build_tree(img.contents.data(), o.size, salt, sizeof(salt), tree, root);
+
+    img.contents.insert(img.contents.end(), tree.begin(), tree.end());
+    img.target_blocks = img.contents.size() / FEC_BLOCKSIZE;
+
+    uint64_t data_blocks = o.size / FEC_BLOCKSIZE;
+    char table[1024];
+    int len = snprintf(table, sizeof(table),
+                "1 /dev/block/bench /dev/block/bench %u %u %" PRIu64 " %"
+                PRIu64 " sha256 %s %s", FEC_BLOCKSIZE, FEC_BLOCKSIZE,
+                data_blocks, data_blocks,
+                to_hex(root, sizeof(root)).c_str(),
+                to_hex(salt, sizeof(salt)).c_str());
+
+    std::vector<uint8_t> metadata(VERITY_METADATA_SIZE);
+    verity_header *header = (verity_header *)metadata.data();
+
+    header->magic = VERITY_MAGIC;
+    header->version = VERITY_VERSION;
+    header->length = len;
+    memcpy(&metadata[sizeof(verity_header)], table, len);
+
+    img.contents.insert(img.contents.end(), metadata.begin(),
+        metadata.end());
+
+    /* ecc for the data, tree, and metadata */
+    uint64_t inp_size = img.contents.size();
+    int rsn = FEC_RSM - o.roots;
+    uint64_t rounds = fec_div_round_up(inp_size / FEC_BLOCKSIZE, rsn);
+    std::vector<uint8_t> ecc(rounds * FEC_BLOCKSIZE * o.roots);
+    void *rs = init_rs_char(FEC_PARAMS(o.roots));
+
+    if (!rs) {
+        fprintf(stderr, "failed to initialize RS\n");
+        return false;
+    }
+
+    uint8_t codeword[FEC_RSM];
+
+    for (uint64_t c = 0; c < rounds * FEC_BLOCKSIZE; ++c) {
+        for (int j = 0; j < rsn; ++j) {
+            uint64_t offset = fec_ecc_interleave(c * rsn + j, rsn, rounds);
+            codeword[j] = offset < inp_size ? img.contents[offset] : 0;
+        }
+
+        encode_rs_char(rs, codeword, &ecc[c * o.roots]);
+    }
+
+    free_rs_char(rs);
+
+    uint8_t block[FEC_BLOCKSIZE] = {0};
+    fec_header *ecc_header = (fec_header *)block;
+
+    ecc_header->magic = FEC_MAGIC;
+    ecc_header->version = FEC_VERSION;
+    ecc_header->size = sizeof(fec_header);
+    ecc_header->roots = o.roots;
+    ecc_header->fec_size = ecc.size();
+    ecc_header->inp_size = inp_size;
+    SHA256(ecc.data(), ecc.size(), ecc_header->hash);
+
+    img.contents.insert(img.contents.end(), ecc.begin(), ecc.end());
+    img.contents.insert(img.contents.end(), block, block + sizeof(block));
+
+    int fd = TEMP_FAILURE_RETRY(open(o.path.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+
+    if (fd == -1 || !write_all(fd, img.contents.data(), img.contents.size(),
+                        0)) {
+        fprintf(stderr, "failed to write %s: %s\n", o.path.c_str(),
+            strerror(errno));
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+/* picks `count' distinct blocks to corrupt out of `img.target_blocks' */
+static std::vector<uint64_t> pick_blocks(const bench_image& img,
+        uint64_t count, std::mt19937_64& rng)
+{
+    std::vector<uint64_t> blocks(img.target_blocks);
+
+    for (uint64_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = i;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        std::swap(blocks[i], blocks[i + rng() % (blocks.size() - i)]);
+    }
+
+    blocks.resize(count);
+    return blocks;
+}
+
+/* corrupts `blocks' in the image file according to `o.pattern' */
+static bool corrupt(const options& o, int fd, const std::vector<uint64_t>&
+        blocks, std::vector<bool>& bad, std::mt19937_64& rng)
+{
+    uint8_t block[FEC_BLOCKSIZE];
+
+    for (auto b : blocks) {
+        uint64_t offset = b * FEC_BLOCKSIZE;
+
+        switch (o.pattern) {
+        case PATTERN_BYTES: {
+                uint64_t i = rng() % FEC_BLOCKSIZE;
+                uint8_t value;
+
+                if (__real_pread64(fd, &value, 1, offset + i) != 1) {
+                    return false;
+                }
+
+                value ^= (uint8_t)(1 + rng() % 255);
+
+                if (!write_all(fd, &value, 1, offset + i)) {
+                    return false;
+                }
+            }
+            break;
+        case PATTERN_BLOCKS:
+            for (auto& v : block) {
+                v = (uint8_t)rng();
+            }
+
+            if (!write_all(fd, block, sizeof(block), offset)) {
+                return false;
+            }
+            break;
+        case PATTERN_EIO:
+            bad[b] = true;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* restores corrupted blocks from the original contents */
+static bool restore(const bench_image& img, int fd,
+        const std::vector<uint64_t>& blocks, std::vector<bool>& bad)
+{
+    for (auto b : blocks) {
+        bad[b] = false;
+
+        if (!write_all(fd, &img.contents[b * FEC_BLOCKSIZE], FEC_BLOCKSIZE,
+                b * FEC_BLOCKSIZE)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct run_result {
+    uint64_t bytes;
+    uint64_t elapsed_ns;
+    uint64_t failed;
+    uint64_t mismatched;
+    uint64_t corrected;
+    /* false if libfec failed to load verity metadata and only used ecc */
+    bool verity;
+    std::vector<uint64_t> latencies_ns;
+    uint64_t open_ns;
+    struct fec_stats stats;
+};
+
+/* reads the data area `o.passes' times with fec_pread, or with fec_preadv
+   in batches of `o.batch' reads */
+static bool run(const options& o, const bench_image& img,
+        std::mt19937_64& rng, run_result& r)
+{
+    struct fec_handle *f = NULL;
+
+    faults.fd = -1;
+
+    uint64_t open_start = now_ns();
+
+    if (fec_open(&f, o.path.c_str(), O_RDONLY, o.flags, o.roots) == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", o.path.c_str(),
+            strerror(errno));
+        return false;
+    }
+
+    r.open_ns = now_ns() - open_start;
+
+    struct fec_verity_metadata metadata;
+    r.verity = (fec_verity_get_metadata(f, &metadata) == 0);
+
+    std::vector<uint64_t> offsets;
+
+    for (uint64_t offset = 0; offset < img.data_size; offset += o.bufsize) {
+        offsets.push_back(offset);
+    }
+
+    size_t batch = std::max(o.batch, 1);
+    std::vector<uint8_t> buf(o.bufsize * batch);
+    std::vector<struct fec_iovec> iov(batch);
+    uint64_t start = now_ns();
+
+    for (int pass = 0; pass < o.passes; ++pass) {
+        if (o.random_order) {
+            std::shuffle(offsets.begin(), offsets.end(), rng);
+        }
+
+        for (size_t i = 0; i < offsets.size(); i += batch) {
+            size_t reads = std::min(batch, offsets.size() - i);
+            size_t total = 0;
+
+            for (size_t j = 0; j < reads; ++j) {
+                iov[j].buf = &buf[j * o.bufsize];
+                iov[j].count = std::min<uint64_t>(o.bufsize,
+                                    img.data_size - offsets[i + j]);
+                iov[j].offset = offsets[i + j];
+                total += iov[j].count;
+            }
+
+            uint64_t t = now_ns();
+            ssize_t n;
+
+            if (o.batch) {
+                n = fec_preadv(f, iov.data(), reads);
+            } else {
+                n = fec_pread(f, iov[0].buf, iov[0].count, iov[0].offset);
+            }
+
+            r.latencies_ns.push_back(now_ns() - t);
+
+            if (n != (ssize_t)total) {
+                ++r.failed;
+                continue;
+            }
+
+            bool matched = true;
+
+            for (size_t j = 0; j < reads; ++j) {
+                if (memcmp(iov[j].buf, &img.contents[iov[j].offset],
+                        iov[j].count)) {
+                    matched = false;
+                }
+            }
+
+            if (matched) {
+                r.bytes += total;
+            } else {
+                ++r.mismatched;
+            }
+        }
+    }
+
+    r.elapsed_ns = now_ns() - start;
+
+    struct fec_status s;
+
+    if (fec_get_status(f, &s) == 0) {
+        r.corrected = s.errors;
+    }
+
+    fec_get_stats(f, &r.stats);
+
+    fec_close(f);
+    return true;
+}
+
+static double percentile_us(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    return sorted[(size_t)(p * (sorted.size() - 1))] / 1000.0;
+}
+
+static bool parse_rates(const char *arg, std::vector<double>& rates)
+{
+    rates.clear();
+
+    while (*arg) {
+        char *end;
+        double rate = strtod(arg, &end);
+
+        if (end == arg || rate < 0 || rate > 1 || (*end && *end != ',')) {
+            return false;
+        }
+
+        rates.push_back(rate);
+        arg = *end ? end + 1 : end;
+    }
+
+    return !rates.empty();
+}
+
+int main(int argc, char **argv)
+{
+    options o;
+
+    o.size = 64 * 1024 * 1024;
+    o.roots = FEC_DEFAULT_ROOTS;
+    o.bufsize = 64 * 1024;
+    o.batch = 0;
+    o.pattern = PATTERN_BLOCKS;
+    o.rates = { 0, 0.0001, 0.001, 0.01 };
+    o.passes = 1;
+    o.random_order = false;
+    o.flags = 0;
+    o.seed = 1;
+
+    int c;
+
+    while ((c = getopt(argc, argv, "s:r:b:v:p:c:n:xCLRT:S:h")) != -1) {
+        switch (c) {
+        case 's':
+            o.size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+            break;
+        case 'r':
+            o.roots = atoi(optarg);
+            break;
+        case 'b':
+            o.bufsize = strtoul(optarg, NULL, 0) * 1024;
+            break;
+        case 'v':
+            o.batch = atoi(optarg);
+            break;
+        case 'p':
+            if (!strcmp(optarg, "bytes")) {
+                o.pattern = PATTERN_BYTES;
+            } else if (!strcmp(optarg, "blocks")) {
+                o.pattern = PATTERN_BLOCKS;
+            } else if (!strcmp(optarg, "eio")) {
+                o.pattern = PATTERN_EIO;
+            } else {
+                return usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if (!parse_rates(optarg, o.rates)) {
+                return usage(argv[0]);
+            }
+            break;
+        case 'n':
+            o.passes = atoi(optarg);
+            break;
+        case 'x':
+            o.random_order = true;
+            break;
+        case 'C':
+            o.flags |= FEC_VERITY_CACHE;
+            break;
+        case 'L':
+            o.flags |= FEC_VERITY_LAZY;
+            break;
+        case 'R':
+            o.flags |= FEC_READAHEAD;
+            break;
+        case 'T':
+            o.flags |= FEC_VERITY_TREE_CACHE;
+            o.tree_cache = optarg;
+            break;
+        case 'S':
+            o.seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || !o.size || o.roots <= 0 ||
+            o.roots >= FEC_RSM || !o.bufsize || o.batch < 0 ||
+            o.passes <= 0) {
+        return usage(argv[0]);
+    }
+
+    o.path = argv[optind];
+
+    if (!o.tree_cache.empty() &&
+            fec_set_tree_cache_dir(o.tree_cache.c_str()) == -1) {
+        return usage(argv[0]);
+    }
+
+    std::mt19937_64 rng(o.seed);
+    bench_image img;
+
+    if (!generate_image(o, rng, img)) {
+        return 1;
+    }
+
+    int fd = TEMP_FAILURE_RETRY(open(o.path.c_str(), O_RDWR | O_CLOEXEC));
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", o.path.c_str(),
+            strerror(errno));
+        return 1;
+    }
+
+    faults.dev = st.st_dev;
+    faults.ino = st.st_ino;
+
+    std::vector<bool> bad(img.target_blocks, false);
+    faults.bad = &bad;
+
+    printf("%" PRIu64 " MiB, RS(255, %d), %zu KiB reads, %s",
+        o.size / (1024 * 1024), FEC_RSM - o.roots, o.bufsize / 1024,
+        o.random_order ? "random" : "sequential");
+
+    if (o.batch) {
+        printf(", %d reads per fec_preadv", o.batch);
+    }
+
+    printf("\n");
+    printf("%10s %8s %8s %10s %10s %10s %10s %10s %10s %8s %8s %6s\n",
+        "rate", "blocks", "open ms", "MB/s", "p50 us", "p90 us", "p99 us",
+        "max us", "corrected", "failed", "wrong", "verity");
+
+    bool ok = true;
+
+    for (auto rate : o.rates) {
+        std::vector<uint64_t> blocks = pick_blocks(img,
+            (uint64_t)(rate * img.target_blocks + 0.5), rng);
+
+        if (!corrupt(o, fd, blocks, bad, rng)) {
+            fprintf(stderr, "failed to corrupt %s: %s\n", o.path.c_str(),
+                strerror(errno));
+            return 1;
+        }
+
+        /* read from storage rather than the page cache, as far as an
+           unprivileged process can */
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        run_result r = {};
+        faults.injected = 0;
+
+        if (!run(o, img, rng, r)) {
+            return 1;
+        }
+
+        std::sort(r.latencies_ns.begin(), r.latencies_ns.end());
+
+        printf("%10g %8zu %8.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10"
+            PRIu64 " %8" PRIu64 " %8" PRIu64 " %6s\n", rate, blocks.size(),
+            r.open_ns / 1e6, r.elapsed_ns ? r.bytes * 1000.0 / r.elapsed_ns : 0.0,
+            percentile_us(r.latencies_ns, 0.50),
+            percentile_us(r.latencies_ns, 0.90),
+            percentile_us(r.latencies_ns, 0.99),
+            percentile_us(r.latencies_ns, 1.0), r.corrected, r.failed,
+            r.mismatched, r.verity ? "yes" : "no");
+        printf("%10s io %.1f ms, hashing %.1f ms, decoding %.1f ms, %" PRIu64
+            " blocks verified, %" PRIu64 " corrected, %" PRIu64
+            " RS failures, cache %" PRIu64 "/%" PRIu64 " hits\n", "",
+            r.stats.io_ns / 1e6, r.stats.hash_ns / 1e6,
+            r.stats.decode_ns / 1e6, r.stats.blocks_verified,
+            r.stats.blocks_corrected, r.stats.decode_failures,
+            r.stats.cache_hits, r.stats.cache_hits + r.stats.cache_misses);
+
+        /* failed reads are expected once corruption exceeds what RS can
+           correct, but with verity, reads must never return wrong data;
+           without it, RS can miscorrect blocks with too many errors */
+        if (r.mismatched && r.verity) {
+            ok = false;
+        }
+
+        if (!restore(img, fd, blocks, bad)) {
+            fprintf(stderr, "failed to restore %s: %s\n", o.path.c_str(),
+                strerror(errno));
+            return 1;
+        }
+    }
+
+    close(fd);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ___JOBPOOL_H___
+#define ___JOBPOOL_H___
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* worker threads that stay around between parallel loops, shared by the
+   tools that split large images into block ranges */
+struct jobpool;
+
+/* runs the range [first, last) of a loop on worker `worker' */
+typedef void (*jobpool_func)(void *cookie, int worker, uint64_t first,
+                             uint64_t last);
+
+/* starts `threads' workers, or one per online cpu if `threads' is not
+   positive; if `cpus' is not NULL, worker i is pinned to
+   cpus[i % cpu_count] where the platform allows it. returns NULL if not even
+   one worker can be started */
+extern struct jobpool *jobpool_new(int threads, const int *cpus,
+                                   size_t cpu_count);
+
+/* stops the workers, which must not be running a loop, and frees the pool */
+extern void jobpool_free(struct jobpool *pool);
+
+/* returns the number of workers, so callers can size per-worker state */
+extern int jobpool_threads(const struct jobpool *pool);
+
+/* splits [begin, end) into ranges of `grain' items and runs `func' on each
+   of them in the workers, returning once all are done. ranges are dealt to
+   the workers' queues in order, and a worker with an empty queue steals the
+   last range of another one, so workers slowed down by I/O or bad blocks
+   simply process fewer ranges. more than one thread can run loops on the
+   same pool at the same time */
+extern void jobpool_for(struct jobpool *pool, uint64_t begin, uint64_t end,
+                        uint64_t grain, jobpool_func func, void *cookie);
+
+/* returns a buffer of at least `size' bytes owned by `worker', zero-filled
+   when first allocated and kept between loops, or NULL if out of memory;
+   only to be called by `func' running on that worker */
+extern void *jobpool_scratch(struct jobpool *pool, int worker, size_t size);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* ___JOBPOOL_H___ */
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <deque>
+#include <new>
+#include <vector>
+
+#include <jobpool/jobpool.h>
+
+/* a call to jobpool_for */
+struct jobpool_loop {
+    jobpool_func func;
+    void *cookie;
+    uint64_t pending; /* ranges not done yet, updated atomically */
+};
+
+struct jobpool_range {
+    jobpool_loop *loop;
+    uint64_t first;
+    uint64_t last;
+};
+
+struct jobpool_worker {
+    jobpool *pool;
+    int id;
+    int cpu; /* cpu to pin the worker to, or -1 */
+    bool started;
+    pthread_t thread;
+    pthread_mutex_t mutex; /* protects `ranges' */
+    std::deque<jobpool_range> ranges;
+    uint8_t *scratch;
+    size_t scratch_size;
+};
+
+struct jobpool {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued; /* signaled when ranges are queued or on exit */
+    pthread_cond_t finished; /* signaled when a loop has no ranges left */
+    std::vector<jobpool_worker *> workers;
+    /* ranges in the queues of all workers; increased with `mutex' held once
+       ranges are queued, and decreased atomically when one is taken */
+    int64_t queued_ranges;
+    bool exiting;
+};
+
+static bool pop_range(jobpool_worker *w, bool front, jobpool_range *range)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&w->mutex);
+
+    if (!w->ranges.empty()) {
+        if (front) {
+            *range = w->ranges.front();
+            w->ranges.pop_front();
+        } else {
+            *range = w->ranges.back();
+            w->ranges.pop_back();
+        }
+        found = true;
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+    return found;
+}
+
+/* takes the next range of `w' in order, or steals the last range of another
+   worker, which is the furthest from what that worker is processing */
+static bool take_range(jobpool_worker *w, jobpool_range *range)
+{
+    jobpool *pool = w->pool;
+    size_t n = pool->workers.size();
+    bool found = pop_range(w, true, range);
+
+    for (size_t i = 1; !found && i < n; ++i) {
+        found = pop_range(pool->workers[(w->id + i) % n], false, range);
+    }
+
+    if (found) {
+        __sync_fetch_and_sub(&pool->queued_ranges, 1);
+    }
+
+    return found;
+}
+
+static void pin_worker(jobpool_worker *w)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+
+    /* best effort: the cpu may be offline or outside our cpuset */
+    sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void)w;
+#endif
+}
+
+/* thread function */
+static void * worker_main(void *cookie)
+{
+    jobpool_worker *w = static_cast<jobpool_worker *>(cookie);
+    jobpool *pool = w->pool;
+
+    if (w->cpu >= 0) {
+        pin_worker(w);
+    }
+
+    while (true) {
+        jobpool_range range;
+
+        if (take_range(w, &range)) {
+            jobpool_loop *loop = range.loop;
+
+            loop->func(loop->cookie, w->id, range.first, range.last);
+
+            /* the caller checks `pending' with the mutex held before waiting,
+               so taking it here can't miss the caller going to sleep */
+            if (__sync_sub_and_fetch(&loop->pending, 1) == 0) {
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_broadcast(&pool->finished);
+                pthread_mutex_unlock(&pool->mutex);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while (!pool->exiting &&
+                __atomic_load_n(&pool->queued_ranges, __ATOMIC_ACQUIRE) <= 0) {
+            pthread_cond_wait(&pool->queued, &pool->mutex);
+        }
+
+        bool exiting = pool->exiting;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (exiting) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void free_worker(jobpool_worker *w)
+{
+    pthread_mutex_destroy(&w->mutex);
+    free(w->scratch);
+    delete w;
+}
+
+void jobpool_free(jobpool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->exiting = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->mutex);
+
+    /* workers look at each other's queues until they exit */
+    for (auto w : pool->workers) {
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+    }
+
+    for (auto w : pool->workers) {
+        free_worker(w);
+    }
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->mutex);
+    delete pool;
+}
+
+jobpool *jobpool_new(int threads, const int *cpus, size_t cpu_count)
+{
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+
+    jobpool *pool = new (std::nothrow) jobpool;
+
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->queued_ranges = 0;
+    pool->exiting = false;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    /* workers look at each other's queues, so all of them are created before
+       the first one starts */
+    for (int i = 0; i < threads; ++i) {
+        jobpool_worker *w = new (std::nothrow) jobpool_worker;
+
+        if (!w) {
+            break;
+        }
+
+        w->pool = pool;
+        w->id = i;
+        w->cpu = (cpus && cpu_count) ? cpus[i % cpu_count] : -1;
+        w->started = false;
+        w->scratch = NULL;
+        w->scratch_size = 0;
+        pthread_mutex_init(&w->mutex, NULL);
+        pool->workers.push_back(w);
+    }
+
+    /* the queue of a worker that couldn't start is emptied by the others, so
+       the pool is usable as long as one worker runs */
+    size_t started = 0;
+
+    for (auto w : pool->workers) {
+        w->started = pthread_create(&w->thread, NULL, worker_main, w) == 0;
+
+        if (w->started) {
+            ++started;
+        }
+    }
+
+    if (started == 0) {
+        jobpool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int jobpool_threads(const jobpool *pool)
+{
+    return (int)pool->workers.size();
+}
+
+void jobpool_for(jobpool *pool, uint64_t begin, uint64_t end,
+        uint64_t grain, jobpool_func func, void *cookie)
+{
+    if (begin >= end) {
+        return;
+    }
+
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    uint64_t count = (end - begin - 1) / grain + 1;
+    size_t n = pool->workers.size();
+
+    jobpool_loop loop;
+    loop.func = func;
+    loop.cookie = cookie;
+    loop.pending = count;
+
+    /* worker i gets ranges i, i + n, ... so that together the workers
+       progress through the loop roughly in order */
+    for (size_t i = 0; i < n && i < count; ++i) {
+        jobpool_worker *w = pool->workers[i];
+
+        pthread_mutex_lock(&w->mutex);
+
+        for (uint64_t r = i; r < count; r += n) {
+            jobpool_range range;
+            range.loop = &loop;
+            range.first = begin + r * grain;
+            range.last = (end - range.first > grain) ?
+                            range.first + grain : end;
+            w->ranges.push_back(range);
+        }
+
+        pthread_mutex_unlock(&w->mutex);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    __sync_fetch_and_add(&pool->queued_ranges, (int64_t)count);
+    pthread_cond_broadcast(&pool->queued);
+
+    while (__atomic_load_n(&loop.pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&pool->finished, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void *jobpool_scratch(jobpool *pool, int worker, size_t size)
+{
+    jobpool_worker *w = pool->workers[worker];
+
+    if (size > w->scratch_size) {
+        uint8_t *scratch = (uint8_t *)realloc(w->scratch, size);
+
+        if (!scratch) {
+            return NULL;
+        }
+
+        memset(&scratch[w->scratch_size], 0, size - w->scratch_size);
+        w->scratch = scratch;
+        w->scratch_size = size;
+    }
+
+    return w->scratch;
+}
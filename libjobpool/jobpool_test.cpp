@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <jobpool/jobpool.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+struct LoopState {
+  jobpool* pool;
+  std::vector<std::atomic<int>>* hits;
+};
+
+static void CountHits(void* cookie, int worker, uint64_t first, uint64_t last) {
+  LoopState* state = static_cast<LoopState*>(cookie);
+  int* ranges = static_cast<int*>(jobpool_scratch(state->pool, worker, sizeof(int)));
+  ASSERT_TRUE(ranges != nullptr);
+  (*ranges)++;
+  for (uint64_t i = first; i < last; ++i) {
+    (*state->hits)[i]++;
+  }
+}
+
+static void RunLoop(jobpool* pool, uint64_t begin, uint64_t end, uint64_t grain) {
+  std::vector<std::atomic<int>> hits(end);
+  LoopState state = {pool, &hits};
+  jobpool_for(pool, begin, end, grain, CountHits, &state);
+  for (uint64_t i = 0; i < end; ++i) {
+    ASSERT_EQ(i < begin ? 0 : 1, hits[i]) << i;
+  }
+}
+
+TEST(jobpool, runs_each_item_once) {
+  jobpool* pool = jobpool_new(4, nullptr, 0);
+  ASSERT_TRUE(pool != nullptr);
+  ASSERT_EQ(4, jobpool_threads(pool));
+  RunLoop(pool, 0, 1, 16);
+  RunLoop(pool, 3, 10007, 64);
+  RunLoop(pool, 0, 100, 0);
+  jobpool_free(pool);
+}
+
+TEST(jobpool, concurrent_loops) {
+  int cpus[] = {0};
+  jobpool* pool = jobpool_new(0, cpus, 1);
+  ASSERT_TRUE(pool != nullptr);
+  std::thread other([pool]() { RunLoop(pool, 0, 5000, 7); });
+  RunLoop(pool, 0, 20000, 100);
+  other.join();
+  jobpool_free(pool);
+}
+
+TEST(jobpool, scratch_is_kept) {
+  jobpool* pool = jobpool_new(2, nullptr, 0);
+  ASSERT_TRUE(pool != nullptr);
+  for (int i = 0; i < 10; ++i) {
+    RunLoop(pool, 0, 1000, 10);
+  }
+  // Scratch buffers are only used by their workers while loops run.
+  int ranges = 0;
+  for (int worker = 0; worker < jobpool_threads(pool); ++worker) {
+    ranges += *static_cast<int*>(jobpool_scratch(pool, worker, sizeof(int)));
+  }
+  ASSERT_EQ(10 * 100, ranges);
+  jobpool_free(pool);
+}
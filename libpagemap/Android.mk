@@ -19,6 +19,9 @@ pagemap_src_files := \
     pm_process.c \
     pm_map.c \
     pm_memusage.c \
+    pm_snapshot.c \
+    pm_idle.c \
+    pm_composition.c \
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := libpagemap
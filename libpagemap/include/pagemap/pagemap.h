@@ -74,6 +74,8 @@ typedef struct pm_kernel   pm_kernel_t;
 typedef struct pm_process  pm_process_t;
 typedef struct pm_map      pm_map_t;
 
+typedef struct pm_kernel_cache pm_kernel_cache_t;
+
 /* pm_kernel_t holds the state necessary to interface to the kernel's pagemap
  * system on a global level. */
 struct pm_kernel {
@@ -81,6 +83,9 @@ struct pm_kernel {
     int kpageflags_fd;
 
     int pagesize;
+
+    /* Values read from kpagecount and kpageflags, if caching is enabled */
+    pm_kernel_cache_t *cache;
 };
 
 /* pm_process_t holds the state necessary to interface to a particular process'
@@ -94,6 +99,9 @@ struct pm_process {
     int num_maps;
 
     int pagemap_fd;
+
+    /* Set once smaps has been read to find the maps that can be skipped */
+    int smaps_read;
 };
 
 /* pm_map_t holds the state necessary to access information about a particular
@@ -107,6 +115,9 @@ struct pm_map {
     int flags;
 
     char *name;
+
+    /* Set if smaps reported no resident or swapped pages in the map */
+    int smaps_empty;
 };
 
 /* Create a pm_kernel_t. */
@@ -127,6 +138,24 @@ int pm_kernel_count(pm_kernel_t *ker, uint64_t pfn, uint64_t *count_out);
  * The count is returned through *flags_out. */
 int pm_kernel_flags(pm_kernel_t *ker, uint64_t pfn, uint64_t *flags_out);
 
+/* Get the map counts of n physical frames, in the same order as pfns.
+ * The PFNs are sorted and read in as few reads as possible. */
+int pm_kernel_counts(pm_kernel_t *ker, const uint64_t *pfns, size_t n,
+                     uint64_t *counts_out);
+
+/* Get the page flags of n physical frames, in the same order as pfns. */
+int pm_kernel_flags_list(pm_kernel_t *ker, const uint64_t *pfns, size_t n,
+                         uint64_t *flags_out);
+
+/* Cache the map counts and page flags read from the kernel, so that pages
+ * shared between maps and processes are only read once during a scan of
+ * many processes.  The cached values are a snapshot and are not updated:
+ * call pm_kernel_cache_clear() before starting a new scan. */
+int pm_kernel_cache_enable(pm_kernel_t *ker);
+
+/* Drop all cached values.  Caching stays enabled. */
+int pm_kernel_cache_clear(pm_kernel_t *ker);
+
 #define PM_PAGE_LOCKED     (1 <<  0)
 #define PM_PAGE_ERROR      (1 <<  1)
 #define PM_PAGE_REFERENCED (1 <<  2)
@@ -157,6 +186,65 @@ int pm_kernel_flags(pm_kernel_t *ker, uint64_t pfn, uint64_t *flags_out);
 /* for kernels >= 3.4 */
 #define PM_PAGE_THP           (1 << 22)
 
+/* for kernels >= 4.0 */
+#define PM_PAGE_BALLOON       (1 << 23)
+#define PM_PAGE_ZERO_PAGE     (1 << 24)
+
+/* for kernels >= 4.3 */
+#define PM_PAGE_IDLE          (1 << 25)
+
+/* kernel internal flags, reported by kpageflags as well */
+#define PM_PAGE_RESERVED      (1ULL << 32)
+#define PM_PAGE_MLOCKED       (1ULL << 33)
+
+/* Types of physical pages counted by pm_kernel_composition.  Each page is
+ * counted under the first type in this order that matches its flags. */
+enum {
+    /* No memory at this PFN, or memory hot-removed or ballooned out */
+    PM_COMPOSITION_NOPAGE,
+    /* The first page of a free block of the buddy allocator */
+    PM_COMPOSITION_BUDDY,
+    /* The shared zero page, or a huge zero page */
+    PM_COMPOSITION_ZERO,
+    PM_COMPOSITION_SLAB,
+    /* Anonymous pages merged by KSM */
+    PM_COMPOSITION_KSM,
+    PM_COMPOSITION_ANON,
+    /* Page cache and shmem pages */
+    PM_COMPOSITION_FILE,
+    /* Pages with other flags, like reserved or page table pages */
+    PM_COMPOSITION_KERNEL,
+    /* Pages with no flags, which are either the rest of a free block of
+     * the buddy allocator, or kernel allocations the kernel has no flag
+     * for */
+    PM_COMPOSITION_NOFLAGS,
+    PM_COMPOSITION_TYPES
+};
+
+/* Number of buckets of the sharing histogram of pm_composition_t. */
+#define PM_COMPOSITION_SHARING 8
+
+typedef struct pm_composition pm_composition_t;
+
+/* Composition of all physical memory, in pages. */
+struct pm_composition {
+    /* PFNs scanned, from 0 to the highest PFN the kernel reports */
+    uint64_t pfns;
+    uint64_t pages[PM_COMPOSITION_TYPES];
+    /* Pages of transparent huge pages, and mlocked pages, of any type */
+    uint64_t thp;
+    uint64_t mlocked;
+    /* Pages mapped by page tables, by map count: sharing[0] counts the
+     * pages mapped once, sharing[i] those mapped 2^(i-1) + 1 to 2^i times,
+     * and the last bucket those mapped more often. */
+    uint64_t sharing[PM_COMPOSITION_SHARING];
+};
+
+/* Read the flags and map counts of all physical memory sequentially, in
+ * large chunks, and count the pages by type and by map count in a single
+ * pass.  The page cache of ker is neither used nor filled. */
+int pm_kernel_composition(pm_kernel_t *ker, pm_composition_t *comp_out);
+
 /* Destroy a pm_kernel_t. */
 int pm_kernel_destroy(pm_kernel_t *ker);
 
@@ -201,6 +289,11 @@ int pm_process_pagemap_range(pm_process_t *proc,
  * modified or destroyed. */
 int pm_process_maps(pm_process_t *proc, pm_map_t ***maps_out, size_t *len);
 
+/* Read the maps of a process again, for a process that is kept open while
+ * its address space changes.  Maps returned earlier by pm_process_maps are
+ * destroyed; the pagemap file stays open. */
+int pm_process_refresh(pm_process_t *proc);
+
 /* Destroy a pm_process_t. */
 int pm_process_destroy(pm_process_t *proc);
 
@@ -220,6 +313,31 @@ int pm_process_destroy(pm_process_t *proc);
  * caller. */
 int pm_map_pagemap(pm_map_t *map, uint64_t **pagemap_out, size_t *len);
 
+typedef struct pm_pagemap_iter pm_pagemap_iter_t;
+
+/* Most pagemap entries a pm_pagemap_iter_t returns at once. */
+#define PM_PAGEMAP_WINDOW 4096
+
+/* Create a pm_pagemap_iter_t, which reads the pagemap of a map a window at
+ * a time into a buffer that is reused across windows and maps. */
+int pm_pagemap_iter_create(pm_pagemap_iter_t **iter_out);
+
+/* Start reading the pagemap of a map.  For maps larger than a window, the
+ * process' smaps may be read, once, to find the maps with no resident or
+ * swapped pages, whose pagemap is then not read at all. */
+int pm_pagemap_iter_start(pm_pagemap_iter_t *iter, pm_map_t *map);
+
+/* Get the next window of the map's pagemap.  The entries for the *len
+ * pages starting at page *index_out of the map are returned through
+ * *entries_out, which is valid until the next call.  If *entries_out is
+ * NULL, none of these pages are resident or swapped.  *len is 0 once the
+ * whole map has been read. */
+int pm_pagemap_iter_next(pm_pagemap_iter_t *iter, uint64_t **entries_out,
+                         size_t *index_out, size_t *len);
+
+/* Destroy a pm_pagemap_iter_t. */
+int pm_pagemap_iter_destroy(pm_pagemap_iter_t *iter);
+
 /* Get the memory usage of this map alone. */
 int pm_map_usage(pm_map_t *map, pm_memusage_t *usage_out);
 
@@ -231,6 +349,145 @@ int pm_map_usage_flags(pm_map_t *map, pm_memusage_t *usage_out,
 /* Get the working set of this map alone. */
 int pm_map_workingset(pm_map_t *map, pm_memusage_t *ws_out);
 
+typedef struct pm_snapshot pm_snapshot_t;
+
+/* Take a snapshot of the memory usage of a set of processes.  The pagemaps
+ * of all the processes are read first, then the map count of each page
+ * they map is read once, in PFN order, however many processes map it.
+ * Process i of the snapshot is pids[i]. */
+int pm_snapshot_create(pm_kernel_t *ker, const pid_t *pids, size_t num_pids,
+                       pm_snapshot_t **snap_out);
+
+/* Take a snapshot as pm_snapshot_create does, reading the processes and the
+ * kernel's page tables on the given number of threads. */
+int pm_snapshot_create_threads(pm_kernel_t *ker, const pid_t *pids,
+                               size_t num_pids, int threads,
+                               pm_snapshot_t **snap_out);
+
+/* Get the number of processes in a snapshot. */
+size_t pm_snapshot_num_processes(pm_snapshot_t *snap);
+
+/* Get process i of a snapshot, or NULL if it could not be read (for
+ * example, because it exited).  The process belongs to the snapshot, and
+ * its maps are numbered in the order pm_process_maps returns them. */
+pm_process_t *pm_snapshot_process(pm_snapshot_t *snap, size_t i);
+
+/* Get the memory usage of process i, as pm_process_usage_flags does. */
+int pm_snapshot_process_usage_flags(pm_snapshot_t *snap, size_t i,
+                                    pm_memusage_t *usage_out,
+                                    uint64_t flags_mask,
+                                    uint64_t required_flags);
+
+/* Get the working set of process i. */
+int pm_snapshot_process_workingset(pm_snapshot_t *snap, size_t i,
+                                   pm_memusage_t *ws_out);
+
+/* Get the memory usage of map number map of process i alone. */
+int pm_snapshot_map_usage_flags(pm_snapshot_t *snap, size_t i, size_t map,
+                                pm_memusage_t *usage_out,
+                                uint64_t flags_mask, uint64_t required_flags);
+
+/* Get the working set of map number map of process i alone. */
+int pm_snapshot_map_workingset(pm_snapshot_t *snap, size_t i, size_t map,
+                               pm_memusage_t *ws_out);
+
+/* Get the proportional and unique swap of process i.  The first call counts
+ * the references to every swap slot from all the processes of the
+ * snapshot, and computes the swap usage of all of them at once, so that
+ * pm_proportional_swap_t is not needed. */
+int pm_snapshot_process_swapusage(pm_snapshot_t *snap, size_t i,
+                                  pm_swapusage_t *su_out);
+
+typedef struct pm_snapshot_page pm_snapshot_page_t;
+
+/* A resident or swapped page of a map in a snapshot. */
+struct pm_snapshot_page {
+    /* Index of the page within the map */
+    size_t index;
+    /* Entry of the process' pagemap */
+    uint64_t pagemap;
+    /* Map count and flags of the physical frame, if the page is resident */
+    uint64_t count;
+    uint64_t flags;
+};
+
+/* Get the resident and swapped pages of map number map of process i, in
+ * address order.  The array is returned through *pages_out, and should be
+ * freed by the caller. */
+int pm_snapshot_map_pages(pm_snapshot_t *snap, size_t i, size_t map,
+                          pm_snapshot_page_t **pages_out, size_t *len);
+
+typedef struct pm_map_table pm_map_table_t;
+
+/* Usage of all maps of a process, with one array per column indexed by map
+ * number, so that the maps of a large process can be sorted and totalled
+ * without a structure per map.  All values are in bytes.  Pages mapped by
+ * more than one process count as shared, the others as private. */
+struct pm_map_table {
+    size_t num_maps;
+    uint64_t *vss;
+    uint64_t *rss;
+    uint64_t *pss;
+    uint64_t *uss;
+    uint64_t *swap;
+    uint64_t *shared_clean;
+    uint64_t *shared_dirty;
+    uint64_t *private_clean;
+    uint64_t *private_dirty;
+};
+
+/* Get the usage of every map of process i in one pass over its pages.  If
+ * workingset is set, only referenced pages are counted, and vss is the size
+ * of the referenced pages as with pm_snapshot_map_workingset().  The table
+ * is returned through *table_out, and should be destroyed by the caller. */
+int pm_snapshot_map_table(pm_snapshot_t *snap, size_t i, int workingset,
+                          pm_map_table_t **table_out);
+
+/* Destroy a table from pm_snapshot_map_table. */
+int pm_map_table_destroy(pm_map_table_t *table);
+
+/* Destroy a snapshot and its processes. */
+int pm_snapshot_destroy(pm_snapshot_t *snap);
+
+typedef struct pm_idle pm_idle_t;
+
+/* Number of buckets of an idle age histogram.  The last bucket counts the
+ * pages idle for that many scans or more. */
+#define PM_IDLE_AGES 8
+
+typedef struct pm_idle_histogram pm_idle_histogram_t;
+
+/* Number of resident pages by the number of scans they have been idle
+ * for.  pages[0] counts the pages accessed since the previous scan. */
+struct pm_idle_histogram {
+    size_t pages[PM_IDLE_AGES];
+};
+
+/* Create a pm_idle_t, which estimates working sets with the kernel's idle
+ * page tracking (/sys/kernel/mm/page_idle/bitmap).  Unlike
+ * pm_process_workingset, it does not clear the referenced bits that
+ * reclaim relies on, and it tracks for how many scans each page has been
+ * idle. */
+int pm_idle_create(pm_kernel_t *ker, pm_idle_t **idle_out);
+
+/* Start a new scan.  Each page is aged once per scan, however many maps
+ * and processes it is scanned through.  The first scan of a page only
+ * marks it idle, and counts it as accessed. */
+int pm_idle_next_scan(pm_idle_t *idle);
+
+/* Age the resident pages of a map, mark them idle again, and return
+ * their histogram through *hist_out. */
+int pm_idle_scan_map(pm_idle_t *idle, pm_map_t *map,
+                     pm_idle_histogram_t *hist_out);
+
+/* Age the resident pages of all maps of a process, as pm_idle_scan_map
+ * does. */
+int pm_idle_scan_process(pm_idle_t *idle, pm_process_t *proc,
+                         pm_idle_histogram_t *hist_out);
+
+/* Destroy a pm_idle_t. */
+int pm_idle_destroy(pm_idle_t *idle);
+
 __END_DECLS
 
 #endif
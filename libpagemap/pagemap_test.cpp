@@ -14,9 +14,14 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #include <pagemap/pagemap.h>
 
 #include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -46,3 +51,312 @@ TEST(pagemap, maps) {
   pm_process_destroy(process);
   pm_kernel_destroy(kernel);
 }
+
+TEST(pagemap, refresh) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  pm_process_t* process;
+  ASSERT_EQ(0, pm_process_create(kernel, getpid(), &process));
+
+  size_t page_size = getpagesize();
+  // Shared maps are never merged with their neighbours.
+  void* p = mmap(NULL, 4 * page_size, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  ASSERT_NE(MAP_FAILED, p);
+  memset(p, 1, 4 * page_size);
+
+  // The map is only seen once the process is refreshed.
+  uint64_t start = reinterpret_cast<uintptr_t>(p);
+  auto find_map = [&]() {
+    for (int i = 0; i < process->num_maps; i++) {
+      if (process->maps[i]->start <= start && start < process->maps[i]->end) return true;
+    }
+    return false;
+  };
+  ASSERT_FALSE(find_map());
+  ASSERT_EQ(0, pm_process_refresh(process));
+  ASSERT_TRUE(find_map());
+
+  pm_memusage_t usage;
+  pm_memusage_zero(&usage);
+  ASSERT_EQ(0, pm_process_usage(process, &usage));
+  ASSERT_GE(usage.uss, 4 * page_size);
+
+  munmap(p, 4 * page_size);
+  pm_process_destroy(process);
+  pm_kernel_destroy(kernel);
+}
+
+TEST(pagemap, kernel_counts) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  pm_process_t* process;
+  ASSERT_EQ(0, pm_process_create(kernel, getpid(), &process));
+
+  pm_map_t** maps;
+  size_t num_maps;
+  ASSERT_EQ(0, pm_process_maps(process, &maps, &num_maps));
+
+  std::vector<uint64_t> pfns;
+  for (size_t i = 0; i < num_maps; i++) {
+    uint64_t* pagemap;
+    size_t len;
+    ASSERT_EQ(0, pm_map_pagemap(maps[i], &pagemap, &len));
+    for (size_t j = 0; j < len; j++) {
+      if (PM_PAGEMAP_PRESENT(pagemap[j])) pfns.push_back(PM_PAGEMAP_PFN(pagemap[j]));
+    }
+    free(pagemap);
+  }
+  ASSERT_FALSE(pfns.empty());
+
+  std::vector<uint64_t> counts(pfns.size());
+  std::vector<uint64_t> flags(pfns.size());
+  ASSERT_EQ(0, pm_kernel_counts(kernel, pfns.data(), pfns.size(), counts.data()));
+  ASSERT_EQ(0, pm_kernel_flags_list(kernel, pfns.data(), pfns.size(), flags.data()));
+
+  // Once cached, single lookups return exactly what the batch read.
+  ASSERT_EQ(0, pm_kernel_cache_enable(kernel));
+  ASSERT_EQ(0, pm_kernel_counts(kernel, pfns.data(), pfns.size(), counts.data()));
+  ASSERT_EQ(0, pm_kernel_flags_list(kernel, pfns.data(), pfns.size(), flags.data()));
+  for (size_t i = 0; i < pfns.size(); i++) {
+    uint64_t count, page_flags;
+    ASSERT_EQ(0, pm_kernel_count(kernel, pfns[i], &count));
+    ASSERT_EQ(0, pm_kernel_flags(kernel, pfns[i], &page_flags));
+    ASSERT_EQ(counts[i], count);
+    ASSERT_EQ(flags[i], page_flags);
+  }
+  ASSERT_EQ(0, pm_kernel_cache_clear(kernel));
+
+  free(maps);
+  pm_process_destroy(process);
+  pm_kernel_destroy(kernel);
+}
+
+TEST(pagemap, composition) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  // Touch some anonymous memory, so that there is at least one page of it.
+  size_t page_size = getpagesize();
+  char* p = reinterpret_cast<char*>(mmap(NULL, 4 * page_size, PROT_READ | PROT_WRITE,
+                                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+  ASSERT_NE(MAP_FAILED, p);
+  memset(p, 1, 4 * page_size);
+
+  pm_composition_t comp;
+  ASSERT_EQ(0, pm_kernel_composition(kernel, &comp));
+  ASSERT_NE(0U, comp.pfns);
+
+  // Every page is counted under exactly one type.
+  uint64_t pages = 0;
+  for (size_t i = 0; i < PM_COMPOSITION_TYPES; i++) pages += comp.pages[i];
+  ASSERT_EQ(comp.pfns, pages);
+  ASSERT_NE(0U, comp.pages[PM_COMPOSITION_ANON] + comp.pages[PM_COMPOSITION_KSM]);
+
+  uint64_t mapped = 0;
+  for (size_t i = 0; i < PM_COMPOSITION_SHARING; i++) mapped += comp.sharing[i];
+  ASSERT_NE(0U, mapped);
+  ASSERT_LE(mapped, comp.pfns);
+
+  munmap(p, 4 * page_size);
+  pm_kernel_destroy(kernel);
+}
+
+TEST(pagemap, pagemap_iter) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  // A large reservation with nothing in it, and a map with every other
+  // page touched, both spanning several windows.
+  size_t pagesize = pm_kernel_pagesize(kernel);
+  size_t num_pages = 4 * PM_PAGEMAP_WINDOW + 5;
+  void* reserved = mmap(nullptr, num_pages * pagesize, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  ASSERT_NE(MAP_FAILED, reserved);
+  char* touched = static_cast<char*>(mmap(nullptr, num_pages * pagesize, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(MAP_FAILED, touched);
+  for (size_t i = 0; i < num_pages; i += 2) touched[i * pagesize] = 1;
+
+  pm_process_t* process;
+  ASSERT_EQ(0, pm_process_create(kernel, getpid(), &process));
+
+  pm_pagemap_iter_t* iter;
+  ASSERT_EQ(0, pm_pagemap_iter_create(&iter));
+
+  size_t found = 0;
+  for (int i = 0; i < process->num_maps; i++) {
+    pm_map_t* map = process->maps[i];
+    if (pm_map_start(map) != reinterpret_cast<uintptr_t>(reserved) &&
+        pm_map_start(map) != reinterpret_cast<uintptr_t>(touched)) {
+      continue;
+    }
+    found++;
+
+    // The windows cover the map in order, and match its whole pagemap.
+    uint64_t* pagemap;
+    size_t len;
+    ASSERT_EQ(0, pm_map_pagemap(map, &pagemap, &len));
+    ASSERT_EQ(num_pages, len);
+
+    ASSERT_EQ(0, pm_pagemap_iter_start(iter, map));
+    size_t next = 0;
+    for (;;) {
+      uint64_t* entries;
+      size_t index, window_len;
+      ASSERT_EQ(0, pm_pagemap_iter_next(iter, &entries, &index, &window_len));
+      if (window_len == 0) break;
+      ASSERT_EQ(next, index);
+      for (size_t j = 0; j < window_len; j++) {
+        if (entries) {
+          ASSERT_EQ(pagemap[index + j], entries[j]);
+        } else {
+          ASSERT_FALSE(PM_PAGEMAP_PRESENT(pagemap[index + j]));
+          ASSERT_FALSE(PM_PAGEMAP_SWAPPED(pagemap[index + j]));
+        }
+      }
+      next += window_len;
+    }
+    ASSERT_EQ(num_pages, next);
+    free(pagemap);
+
+    pm_memusage_t usage;
+    pm_memusage_zero(&usage);
+    ASSERT_EQ(0, pm_map_usage(map, &usage));
+    ASSERT_EQ(num_pages * pagesize, usage.vss);
+    if (pm_map_start(map) == reinterpret_cast<uintptr_t>(touched)) {
+      ASSERT_EQ((num_pages + 1) / 2 * pagesize, usage.rss + usage.swap);
+    } else {
+      ASSERT_EQ(0U, usage.rss);
+    }
+  }
+  ASSERT_EQ(2U, found);
+
+  pm_pagemap_iter_destroy(iter);
+  pm_process_destroy(process);
+  munmap(touched, num_pages * pagesize);
+  munmap(reserved, num_pages * pagesize);
+  pm_kernel_destroy(kernel);
+}
+
+TEST(pagemap, snapshot) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  pid_t pids[] = { getpid(), -1 };
+  pm_snapshot_t* snapshot;
+  ASSERT_EQ(0, pm_snapshot_create(kernel, pids, 2, &snapshot));
+  ASSERT_EQ(2U, pm_snapshot_num_processes(snapshot));
+  ASSERT_TRUE(pm_snapshot_process(snapshot, 1) == nullptr);
+
+  pm_process_t* process = pm_snapshot_process(snapshot, 0);
+  ASSERT_TRUE(process != nullptr);
+
+  pm_memusage_t usage;
+  pm_memusage_zero(&usage);
+  ASSERT_EQ(0, pm_snapshot_process_usage_flags(snapshot, 0, &usage, 0, 0));
+  ASSERT_NE(0U, usage.rss);
+
+  // The process' usage is the sum of the usage of its maps.
+  pm_memusage_t total;
+  pm_memusage_zero(&total);
+  for (int i = 0; i < process->num_maps; i++) {
+    pm_memusage_t map_usage;
+    pm_memusage_zero(&map_usage);
+    ASSERT_EQ(0, pm_snapshot_map_usage_flags(snapshot, 0, i, &map_usage, 0, 0));
+    pm_memusage_add(&total, &map_usage);
+  }
+  ASSERT_EQ(usage.vss, total.vss);
+  ASSERT_EQ(usage.rss, total.rss);
+  ASSERT_EQ(usage.pss, total.pss);
+  ASSERT_EQ(usage.uss, total.uss);
+
+  pm_snapshot_destroy(snapshot);
+  pm_kernel_destroy(kernel);
+}
+
+TEST(pagemap, snapshot_map_table) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  pid_t pid = getpid();
+  pm_snapshot_t* snapshot;
+  ASSERT_EQ(0, pm_snapshot_create(kernel, &pid, 1, &snapshot));
+
+  pm_process_t* process = pm_snapshot_process(snapshot, 0);
+  ASSERT_TRUE(process != nullptr);
+
+  pm_map_table_t* table;
+  ASSERT_EQ(0, pm_snapshot_map_table(snapshot, 0, 0, &table));
+  ASSERT_EQ(static_cast<size_t>(process->num_maps), table->num_maps);
+
+  // The table has the same usage as pm_snapshot_map_usage_flags, and all
+  // resident pages of each map are in one of the four page classes (as are
+  // pages without a map count, which are not in rss).
+  for (size_t i = 0; i < table->num_maps; i++) {
+    pm_memusage_t map_usage;
+    pm_memusage_zero(&map_usage);
+    ASSERT_EQ(0, pm_snapshot_map_usage_flags(snapshot, 0, i, &map_usage, 0, 0));
+    ASSERT_EQ(map_usage.vss, table->vss[i]);
+    ASSERT_EQ(map_usage.rss, table->rss[i]);
+    ASSERT_EQ(map_usage.pss, table->pss[i]);
+    ASSERT_EQ(map_usage.uss, table->uss[i]);
+    ASSERT_EQ(map_usage.swap, table->swap[i]);
+    ASSERT_LE(table->rss[i],
+              table->shared_clean[i] + table->shared_dirty[i] +
+              table->private_clean[i] + table->private_dirty[i]);
+  }
+  pm_map_table_destroy(table);
+
+  ASSERT_EQ(0, pm_snapshot_map_table(snapshot, 0, 1, &table));
+  for (size_t i = 0; i < table->num_maps; i++) {
+    pm_memusage_t ws;
+    pm_memusage_zero(&ws);
+    ASSERT_EQ(0, pm_snapshot_map_workingset(snapshot, 0, i, &ws));
+    ASSERT_EQ(ws.vss, table->vss[i]);
+    ASSERT_EQ(ws.rss, table->rss[i]);
+    ASSERT_EQ(ws.pss, table->pss[i]);
+    ASSERT_EQ(ws.uss, table->uss[i]);
+  }
+  pm_map_table_destroy(table);
+
+  pm_snapshot_destroy(snapshot);
+  pm_kernel_destroy(kernel);
+}
+
+TEST(pagemap, idle) {
+  pm_kernel_t* kernel;
+  ASSERT_EQ(0, pm_kernel_create(&kernel));
+
+  pm_idle_t* idle;
+  int error = pm_idle_create(kernel, &idle);
+  if (error == ENOENT) {
+    // The kernel does not have idle page tracking.
+    pm_kernel_destroy(kernel);
+    return;
+  }
+  ASSERT_EQ(0, error);
+
+  pm_process_t* process;
+  ASSERT_EQ(0, pm_process_create(kernel, getpid(), &process));
+
+  // The first scan marks every page idle and counts it as accessed.
+  pm_idle_histogram_t hist;
+  ASSERT_EQ(0, pm_idle_scan_process(idle, process, &hist));
+  ASSERT_NE(0U, hist.pages[0]);
+  for (size_t i = 1; i < PM_IDLE_AGES; i++) ASSERT_EQ(0U, hist.pages[i]);
+
+  // Scanning again within the same scan does not age any page.
+  ASSERT_EQ(0, pm_idle_scan_process(idle, process, &hist));
+  for (size_t i = 1; i < PM_IDLE_AGES; i++) ASSERT_EQ(0U, hist.pages[i]);
+
+  ASSERT_EQ(0, pm_idle_next_scan(idle));
+  ASSERT_EQ(0, pm_idle_scan_process(idle, process, &hist));
+  for (size_t i = 2; i < PM_IDLE_AGES; i++) ASSERT_EQ(0U, hist.pages[i]);
+
+  pm_process_destroy(process);
+  pm_idle_destroy(idle);
+  pm_kernel_destroy(kernel);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pagemap/pagemap.h>
+
+/* kpageflags and kpagecount are read COMPOSITION_CHUNK PFNs at a time,
+ * which is 512KB of each file.  Reads past the highest PFN return 0
+ * bytes, which ends the scan. */
+#define COMPOSITION_CHUNK 65536
+
+static int page_type(uint64_t flags, uint64_t count) {
+    if (flags & (PM_PAGE_NOPAGE | PM_PAGE_BALLOON))
+        return PM_COMPOSITION_NOPAGE;
+    if (flags & PM_PAGE_BUDDY)
+        return PM_COMPOSITION_BUDDY;
+    if (flags & PM_PAGE_ZERO_PAGE)
+        return PM_COMPOSITION_ZERO;
+    if (flags & PM_PAGE_SLAB)
+        return PM_COMPOSITION_SLAB;
+    if (flags & PM_PAGE_KSM)
+        return PM_COMPOSITION_KSM;
+    if (flags & PM_PAGE_ANON)
+        return PM_COMPOSITION_ANON;
+    if (flags & (PM_PAGE_LRU | PM_PAGE_MMAP | PM_PAGE_SWAPBACKED |
+                 PM_PAGE_UNEVICTABLE) || count)
+        return PM_COMPOSITION_FILE;
+    if (flags)
+        return PM_COMPOSITION_KERNEL;
+    return PM_COMPOSITION_NOFLAGS;
+}
+
+static int sharing_bucket(uint64_t count) {
+    int bucket = 0;
+
+    for (count--; count && bucket < PM_COMPOSITION_SHARING - 1; count >>= 1)
+        bucket++;
+
+    return bucket;
+}
+
+/* Reads up to n values of the PFNs starting at pfn, and returns how many
+ * were read, or -1 with errno set */
+static ssize_t read_chunk(int fd, uint64_t pfn, size_t n, uint64_t *out) {
+    size_t done = 0;
+
+    while (done < n * sizeof(uint64_t)) {
+        ssize_t ret = pread64(fd, (char *)out + done, n * sizeof(uint64_t) - done,
+                              pfn * sizeof(uint64_t) + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+
+    return done / sizeof(uint64_t);
+}
+
+int pm_kernel_composition(pm_kernel_t *ker, pm_composition_t *comp_out) {
+    uint64_t *flags, *counts;
+    uint64_t pfn = 0;
+    int error = 0;
+
+    if (!ker || !comp_out)
+        return -1;
+
+    flags = malloc(COMPOSITION_CHUNK * sizeof(*flags));
+    counts = malloc(COMPOSITION_CHUNK * sizeof(*counts));
+    if (!flags || !counts) {
+        error = errno;
+        goto out;
+    }
+
+    memset(comp_out, 0, sizeof(*comp_out));
+
+    for (;;) {
+        ssize_t num_flags, num_counts, n, i;
+
+        num_flags = read_chunk(ker->kpageflags_fd, pfn, COMPOSITION_CHUNK, flags);
+        num_counts = read_chunk(ker->kpagecount_fd, pfn, COMPOSITION_CHUNK, counts);
+        if (num_flags < 0 || num_counts < 0) {
+            error = errno;
+            goto out;
+        }
+
+        /* Both files end at the same PFN, unless memory was hot-added
+         * between the reads */
+        n = num_flags < num_counts ? num_flags : num_counts;
+        if (n == 0)
+            break;
+
+        for (i = 0; i < n; i++) {
+            comp_out->pages[page_type(flags[i], counts[i])]++;
+            if (flags[i] & PM_PAGE_THP)
+                comp_out->thp++;
+            if (flags[i] & PM_PAGE_MLOCKED)
+                comp_out->mlocked++;
+            if (counts[i])
+                comp_out->sharing[sharing_bucket(counts[i])]++;
+        }
+
+        comp_out->pfns += n;
+        pfn += n;
+        if (n < COMPOSITION_CHUNK)
+            break;
+    }
+
+out:
+    free(flags);
+    free(counts);
+
+    return error;
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pagemap/pagemap.h>
+
+/* The idle page bitmap holds one bit per PFN, in 64 bit words.  Reading a
+ * word tells which of its pages have not been accessed since they were
+ * marked idle, and writing set bits marks pages idle.  Zero bits are
+ * ignored on writes, so pages of other maps in the same word are left
+ * alone. */
+#define PAGE_IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+
+/* Words are read and written in runs of up to IDLE_RUN_MAX words.  The
+ * kernel checks every page of each word read, so runs only continue
+ * across gaps of up to IDLE_RUN_GAP words. */
+#define IDLE_RUN_MAX 512
+#define IDLE_RUN_GAP 2
+
+/* The age and the scan it was last updated in are kept for each PFN, in
+ * chunks of IDLE_CHUNK PFNs allocated the first time a PFN in the chunk
+ * is scanned.  The low bits of each entry hold the age, the rest the
+ * scan. */
+#define IDLE_CHUNK_SHIFT 9
+#define IDLE_CHUNK (1 << IDLE_CHUNK_SHIFT)
+#define AGE_BITS 8
+#define AGE_MAX ((1 << AGE_BITS) - 1)
+
+struct pm_idle {
+    int bitmap_fd;
+
+    uint32_t scan;
+
+    uint32_t **chunks;
+    size_t num_chunks;
+};
+
+int pm_idle_create(pm_kernel_t *ker, pm_idle_t **idle_out) {
+    pm_idle_t *idle;
+    int error;
+
+    if (!ker || !idle_out)
+        return -1;
+
+    idle = calloc(1, sizeof(*idle));
+    if (!idle)
+        return errno;
+
+    idle->bitmap_fd = open(PAGE_IDLE_BITMAP, O_RDWR);
+    if (idle->bitmap_fd < 0) {
+        error = errno;
+        free(idle);
+        return error;
+    }
+
+    idle->scan = 1;
+
+    *idle_out = idle;
+
+    return 0;
+}
+
+int pm_idle_next_scan(pm_idle_t *idle) {
+    if (!idle)
+        return -1;
+
+    /* Scan numbers wrap around, skipping 0, which marks PFNs that have
+     * never been scanned */
+    idle->scan = (idle->scan + 1) & (UINT32_MAX >> AGE_BITS);
+    if (!idle->scan)
+        idle->scan = 1;
+
+    return 0;
+}
+
+static uint32_t *get_state(pm_idle_t *idle, uint64_t pfn) {
+    uint64_t c = pfn >> IDLE_CHUNK_SHIFT;
+
+    if (c >= idle->num_chunks) {
+        uint32_t **chunks;
+        size_t num_chunks;
+
+        if (c >= SIZE_MAX / 2 / sizeof(*chunks)) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        num_chunks = c + 1;
+        if (num_chunks < idle->num_chunks * 2)
+            num_chunks = idle->num_chunks * 2;
+
+        chunks = realloc(idle->chunks, num_chunks * sizeof(*chunks));
+        if (!chunks)
+            return NULL;
+        memset(chunks + idle->num_chunks, 0,
+               (num_chunks - idle->num_chunks) * sizeof(*chunks));
+
+        idle->chunks = chunks;
+        idle->num_chunks = num_chunks;
+    }
+
+    if (!idle->chunks[c])
+        idle->chunks[c] = calloc(IDLE_CHUNK, sizeof(uint32_t));
+    if (!idle->chunks[c])
+        return NULL;
+
+    return &idle->chunks[c][pfn & (IDLE_CHUNK - 1)];
+}
+
+static int cmp_pfn(const void *a, const void *b) {
+    uint64_t pa = *(const uint64_t *)a, pb = *(const uint64_t *)b;
+
+    if (pa < pb) return -1;
+    if (pa > pb) return 1;
+    return 0;
+}
+
+/* Updates the age of a page from its idle bit, unless it has already been
+ * updated in this scan through another map, and adds it to hist */
+static int age_page(pm_idle_t *idle, uint64_t pfn, int is_idle,
+                    pm_idle_histogram_t *hist) {
+    uint32_t *state = get_state(idle, pfn);
+    uint32_t age;
+
+    if (!state)
+        return errno;
+
+    age = *state & AGE_MAX;
+    if ((*state >> AGE_BITS) != idle->scan) {
+        if (!is_idle)
+            age = 0;
+        else if (age < AGE_MAX)
+            age++;
+        *state = (idle->scan << AGE_BITS) | age;
+    }
+
+    if (hist)
+        hist->pages[age < PM_IDLE_AGES - 1 ? age : PM_IDLE_AGES - 1]++;
+
+    return 0;
+}
+
+/* Reads the idle bits of a sorted list of PFNs in runs of words, ages the
+ * pages, and marks them all idle again */
+static int scan_pfns(pm_idle_t *idle, const uint64_t *pfns, size_t n,
+                     pm_idle_histogram_t *hist) {
+    uint64_t words[IDLE_RUN_MAX];
+    uint64_t first, last;
+    ssize_t size, ret;
+    size_t i, j, k;
+    int error;
+
+    for (i = 0; i < n; i = j) {
+        first = pfns[i] / 64;
+        last = first;
+
+        for (j = i + 1; j < n; j++) {
+            uint64_t word = pfns[j] / 64;
+            if (word - first >= IDLE_RUN_MAX || word - last > IDLE_RUN_GAP)
+                break;
+            last = word;
+        }
+
+        size = (last - first + 1) * sizeof(uint64_t);
+        ret = pread64(idle->bitmap_fd, words, size, first * sizeof(uint64_t));
+        if (ret < 0)
+            return errno;
+        if (ret < size)
+            return EINVAL;
+
+        for (k = i; k < j; k++) {
+            uint64_t bit = 1ULL << (pfns[k] % 64);
+
+            error = age_page(idle, pfns[k],
+                             (words[pfns[k] / 64 - first] & bit) != 0, hist);
+            if (error)
+                return error;
+        }
+
+        memset(words, 0, size);
+        for (k = i; k < j; k++)
+            words[pfns[k] / 64 - first] |= 1ULL << (pfns[k] % 64);
+
+        ret = pwrite64(idle->bitmap_fd, words, size, first * sizeof(uint64_t));
+        if (ret < 0)
+            return errno;
+        if (ret < size)
+            return EINVAL;
+    }
+
+    return 0;
+}
+
+/* Appends the resident PFNs of a map to *pfns */
+static int map_pfns(pm_pagemap_iter_t *iter, pm_map_t *map, uint64_t **pfns,
+                    size_t *num_pfns, size_t *pfns_size) {
+    uint64_t *pagemap;
+    size_t index, len, i;
+    int error;
+
+    error = pm_pagemap_iter_start(iter, map);
+    while (!error) {
+        error = pm_pagemap_iter_next(iter, &pagemap, &index, &len);
+        if (error || !len)
+            break;
+        if (!pagemap)
+            continue;
+
+        if (*num_pfns + len > *pfns_size) {
+            size_t size = *pfns_size ? *pfns_size : PM_PAGEMAP_WINDOW;
+            uint64_t *new_pfns;
+
+            while (size < *num_pfns + len)
+                size *= 2;
+            new_pfns = realloc(*pfns, size * sizeof(uint64_t));
+            if (!new_pfns)
+                return errno;
+            *pfns = new_pfns;
+            *pfns_size = size;
+        }
+
+        for (i = 0; i < len; i++) {
+            if (PM_PAGEMAP_PRESENT(pagemap[i]) &&
+                    !PM_PAGEMAP_SWAPPED(pagemap[i]))
+                (*pfns)[(*num_pfns)++] = PM_PAGEMAP_PFN(pagemap[i]);
+        }
+    }
+
+    return error;
+}
+
+static int scan_maps(pm_idle_t *idle, pm_map_t **maps, size_t num_maps,
+                     pm_idle_histogram_t *hist_out) {
+    pm_idle_histogram_t hist;
+    pm_pagemap_iter_t *iter;
+    uint64_t *pfns = NULL;
+    size_t num_pfns = 0, pfns_size = 0;
+    size_t i, j;
+    int error;
+
+    memset(&hist, 0, sizeof(hist));
+
+    error = pm_pagemap_iter_create(&iter);
+    if (error)
+        return error;
+
+    for (i = 0; i < num_maps && !error; i++)
+        error = map_pfns(iter, maps[i], &pfns, &num_pfns, &pfns_size);
+
+    pm_pagemap_iter_destroy(iter);
+
+    if (!error && num_pfns) {
+        /* A page mapped twice is only counted once */
+        qsort(pfns, num_pfns, sizeof(uint64_t), cmp_pfn);
+        for (i = 1, j = 1; i < num_pfns; i++) {
+            if (pfns[i] != pfns[j - 1])
+                pfns[j++] = pfns[i];
+        }
+        num_pfns = j;
+
+        error = scan_pfns(idle, pfns, num_pfns, &hist);
+    }
+
+    free(pfns);
+
+    if (!error && hist_out)
+        memcpy(hist_out, &hist, sizeof(hist));
+
+    return error;
+}
+
+int pm_idle_scan_map(pm_idle_t *idle, pm_map_t *map,
+                     pm_idle_histogram_t *hist_out) {
+    if (!idle || !map)
+        return -1;
+
+    return scan_maps(idle, &map, 1, hist_out);
+}
+
+int pm_idle_scan_process(pm_idle_t *idle, pm_process_t *proc,
+                         pm_idle_histogram_t *hist_out) {
+    if (!idle || !proc)
+        return -1;
+
+    return scan_maps(idle, proc->maps, proc->num_maps, hist_out);
+}
+
+int pm_idle_destroy(pm_idle_t *idle) {
+    size_t i;
+
+    if (!idle)
+        return -1;
+
+    for (i = 0; i < idle->num_chunks; i++)
+        free(idle->chunks[i]);
+    free(idle->chunks);
+    close(idle->bitmap_fd);
+    free(idle);
+
+    return 0;
+}
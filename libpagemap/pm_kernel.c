@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -113,34 +114,267 @@ int pm_kernel_pids(pm_kernel_t *ker, pid_t **pids_out, size_t *len) {
     return 0;
 }
 
-int pm_kernel_count(pm_kernel_t *ker, uint64_t pfn, uint64_t *count_out) {
-    off64_t off;
+/* kpagecount and kpageflags hold one uint64_t per PFN.  Lookups of many
+ * PFNs are sorted and read in runs of up to PFN_RUN_MAX PFNs.  A run
+ * continues across a gap of up to PFN_RUN_GAP PFNs that are not needed,
+ * as the kernel fills in each PFN read and a wide gap costs more than
+ * starting another read. */
+#define PFN_RUN_MAX 1024
+#define PFN_RUN_GAP 4
 
-    if (!ker || !count_out)
-        return -1;
+/* The cache is indexed by PFN, in chunks of PFN_CHUNK PFNs allocated the
+ * first time a PFN in the chunk is looked up. */
+#define PFN_CHUNK_SHIFT 9
+#define PFN_CHUNK (1 << PFN_CHUNK_SHIFT)
 
-    off = lseek64(ker->kpagecount_fd, pfn * sizeof(uint64_t), SEEK_SET);
-    if (off == (off_t)-1)
-        return errno;
-    if (read(ker->kpagecount_fd, count_out, sizeof(uint64_t)) <
-        (ssize_t)sizeof(uint64_t))
+struct pfn_chunk {
+    uint64_t valid[PFN_CHUNK / 64];
+    uint64_t data[PFN_CHUNK];
+};
+
+struct pfn_cache {
+    struct pfn_chunk **chunks;
+    size_t num_chunks;
+};
+
+struct pm_kernel_cache {
+    struct pfn_cache count;
+    struct pfn_cache flags;
+};
+
+struct pfn_index {
+    uint64_t pfn;
+    size_t index;
+};
+
+static int cmp_pfn_index(const void *a, const void *b) {
+    const struct pfn_index *pa = a, *pb = b;
+
+    if (pa->pfn < pb->pfn) return -1;
+    if (pa->pfn > pb->pfn) return 1;
+    return 0;
+}
+
+static int read_pfn_range(int fd, uint64_t pfn, size_t n, uint64_t *out) {
+    ssize_t ret;
+
+    ret = pread64(fd, out, n * sizeof(uint64_t), pfn * sizeof(uint64_t));
+    if (ret < 0)
         return errno;
+    if (ret < (ssize_t)(n * sizeof(uint64_t)))
+        return EINVAL;
 
     return 0;
 }
 
+static int read_pfns_uncached(int fd, const uint64_t *pfns, size_t n,
+                              uint64_t *out) {
+    uint64_t buf[PFN_RUN_MAX];
+    struct pfn_index *sorted;
+    size_t i, j, k;
+    int error = 0;
+
+    if (n == 0)
+        return 0;
+    if (n == 1)
+        return read_pfn_range(fd, pfns[0], 1, out);
+
+    sorted = malloc(n * sizeof(*sorted));
+    if (!sorted)
+        return errno;
+
+    for (i = 0, j = 1; i < n; i++) {
+        sorted[i].pfn = pfns[i];
+        sorted[i].index = i;
+        if (i && pfns[i] < pfns[i - 1])
+            j = 0;
+    }
+    if (!j)
+        qsort(sorted, n, sizeof(*sorted), cmp_pfn_index);
+
+    for (i = 0; i < n; i = j) {
+        uint64_t first = sorted[i].pfn;
+
+        for (j = i + 1; j < n; j++) {
+            if (sorted[j].pfn - first >= PFN_RUN_MAX ||
+                    sorted[j].pfn - sorted[j - 1].pfn > PFN_RUN_GAP)
+                break;
+        }
+
+        error = read_pfn_range(fd, first, sorted[j - 1].pfn - first + 1, buf);
+        if (error)
+            break;
+
+        for (k = i; k < j; k++)
+            out[sorted[k].index] = buf[sorted[k].pfn - first];
+    }
+
+    free(sorted);
+
+    return error;
+}
+
+static struct pfn_chunk *get_pfn_chunk(struct pfn_cache *cache,
+                                       uint64_t pfn) {
+    uint64_t c = pfn >> PFN_CHUNK_SHIFT;
+
+    if (c >= cache->num_chunks) {
+        struct pfn_chunk **chunks;
+        size_t num_chunks;
+
+        if (c >= SIZE_MAX / 2 / sizeof(*chunks)) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        num_chunks = c + 1;
+        if (num_chunks < cache->num_chunks * 2)
+            num_chunks = cache->num_chunks * 2;
+
+        chunks = realloc(cache->chunks, num_chunks * sizeof(*chunks));
+        if (!chunks)
+            return NULL;
+        memset(chunks + cache->num_chunks, 0,
+               (num_chunks - cache->num_chunks) * sizeof(*chunks));
+
+        cache->chunks = chunks;
+        cache->num_chunks = num_chunks;
+    }
+
+    if (!cache->chunks[c])
+        cache->chunks[c] = calloc(1, sizeof(struct pfn_chunk));
+
+    return cache->chunks[c];
+}
+
+/* Looks the PFNs up in the cache, and reads the ones not found there
+ * together with read_pfns_uncached */
+static int read_pfns_cached(int fd, struct pfn_cache *cache,
+                            const uint64_t *pfns, size_t n, uint64_t *out) {
+    struct pfn_chunk *chunk;
+    uint64_t *miss_pfns = NULL;
+    size_t *miss_index = NULL;
+    size_t num_misses = 0;
+    size_t i, bit;
+    int error = 0;
+
+    for (i = 0; i < n; i++) {
+        chunk = get_pfn_chunk(cache, pfns[i]);
+        if (!chunk) {
+            error = errno;
+            goto out;
+        }
+
+        bit = pfns[i] & (PFN_CHUNK - 1);
+        if (chunk->valid[bit / 64] & (1ULL << (bit % 64))) {
+            out[i] = chunk->data[bit];
+            continue;
+        }
+
+        if (!miss_pfns) {
+            miss_pfns = malloc((n - i) * sizeof(*miss_pfns));
+            miss_index = malloc((n - i) * sizeof(*miss_index));
+            if (!miss_pfns || !miss_index) {
+                error = errno;
+                goto out;
+            }
+        }
+
+        miss_pfns[num_misses] = pfns[i];
+        miss_index[num_misses] = i;
+        num_misses++;
+    }
+
+    if (!num_misses)
+        goto out;
+
+    /* The values are read into miss_pfns, which is no longer needed once
+     * read_pfns_uncached has sorted it */
+    error = read_pfns_uncached(fd, miss_pfns, num_misses, miss_pfns);
+    if (error)
+        goto out;
+
+    for (i = 0; i < num_misses; i++) {
+        uint64_t pfn = pfns[miss_index[i]];
+
+        chunk = cache->chunks[pfn >> PFN_CHUNK_SHIFT];
+        bit = pfn & (PFN_CHUNK - 1);
+        chunk->data[bit] = miss_pfns[i];
+        chunk->valid[bit / 64] |= 1ULL << (bit % 64);
+        out[miss_index[i]] = miss_pfns[i];
+    }
+
+out:
+    free(miss_pfns);
+    free(miss_index);
+
+    return error;
+}
+
+static void free_pfn_cache(struct pfn_cache *cache) {
+    size_t i;
+
+    for (i = 0; i < cache->num_chunks; i++)
+        free(cache->chunks[i]);
+    free(cache->chunks);
+
+    cache->chunks = NULL;
+    cache->num_chunks = 0;
+}
+
+int pm_kernel_counts(pm_kernel_t *ker, const uint64_t *pfns, size_t n,
+                     uint64_t *counts_out) {
+    if (!ker || (n && (!pfns || !counts_out)))
+        return -1;
+
+    if (ker->cache)
+        return read_pfns_cached(ker->kpagecount_fd, &ker->cache->count, pfns,
+                                n, counts_out);
+
+    return read_pfns_uncached(ker->kpagecount_fd, pfns, n, counts_out);
+}
+
+int pm_kernel_flags_list(pm_kernel_t *ker, const uint64_t *pfns, size_t n,
+                         uint64_t *flags_out) {
+    if (!ker || (n && (!pfns || !flags_out)))
+        return -1;
+
+    if (ker->cache)
+        return read_pfns_cached(ker->kpageflags_fd, &ker->cache->flags, pfns,
+                                n, flags_out);
+
+    return read_pfns_uncached(ker->kpageflags_fd, pfns, n, flags_out);
+}
+
+int pm_kernel_count(pm_kernel_t *ker, uint64_t pfn, uint64_t *count_out) {
+    return pm_kernel_counts(ker, &pfn, 1, count_out);
+}
+
 int pm_kernel_flags(pm_kernel_t *ker, uint64_t pfn, uint64_t *flags_out) {
-    off64_t off;
+    return pm_kernel_flags_list(ker, &pfn, 1, flags_out);
+}
+
+int pm_kernel_cache_enable(pm_kernel_t *ker) {
+    if (!ker)
+        return -1;
+
+    if (!ker->cache) {
+        ker->cache = calloc(1, sizeof(*ker->cache));
+        if (!ker->cache)
+            return errno;
+    }
 
-    if (!ker || !flags_out)
+    return 0;
+}
+
+int pm_kernel_cache_clear(pm_kernel_t *ker) {
+    if (!ker)
         return -1;
 
-    off = lseek64(ker->kpageflags_fd, pfn * sizeof(uint64_t), SEEK_SET);
-    if (off == (off_t)-1)
-        return errno;
-    if (read(ker->kpageflags_fd, flags_out, sizeof(uint64_t)) <
-        (ssize_t)sizeof(uint64_t))
-        return errno;
+    if (ker->cache) {
+        free_pfn_cache(&ker->cache->count);
+        free_pfn_cache(&ker->cache->flags);
+    }
 
     return 0;
 }
@@ -152,6 +386,8 @@ int pm_kernel_destroy(pm_kernel_t *ker) {
     close(ker->kpagecount_fd);
     close(ker->kpageflags_fd);
 
+    pm_kernel_cache_clear(ker);
+    free(ker->cache);
     free(ker);
 
     return 0;
@@ -14,8 +14,12 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <pagemap/pagemap.h>
 
@@ -27,60 +31,284 @@ int pm_map_pagemap(pm_map_t *map, uint64_t **pagemap_out, size_t *len) {
                                     pagemap_out, len);
 }
 
+struct pm_pagemap_iter {
+    pm_map_t *map;
+
+    /* Next page of the map to read, and number of pages in the map */
+    size_t next;
+    size_t num_pages;
+
+    uint64_t window[PM_PAGEMAP_WINDOW];
+};
+
+#define MAX_FILENAME 64
+
+/* Reads the Rss and Swap of each map of a process from its smaps, and
+ * marks the maps that have neither.  Maps that are no longer in smaps, or
+ * whose size changed, are left unmarked. */
+static int read_smaps(pm_process_t *proc) {
+    char filename[MAX_FILENAME];
+    char *line = NULL;
+    size_t line_length = 0;
+    FILE *smaps_f;
+    pm_map_t *map = NULL;
+    uint64_t start, end;
+    size_t rss = 0, swap = 0;
+    int have_rss = 0, have_swap = 0;
+    int m = 0;
+    int error;
+
+    error = snprintf(filename, MAX_FILENAME, "/proc/%d/smaps", proc->pid);
+    if (error < 0 || error >= MAX_FILENAME)
+        return (error < 0) ? (errno) : (-1);
+
+    smaps_f = fopen(filename, "r");
+    if (!smaps_f)
+        return errno;
+
+    for (;;) {
+        int eof = getline(&line, &line_length, smaps_f) == -1;
+        int header = !eof &&
+                sscanf(line, "%" SCNx64 "-%" SCNx64 " ", &start, &end) == 2;
+
+        if (eof || header) {
+            if (map && have_rss && have_swap)
+                map->smaps_empty = !rss && !swap;
+            if (eof)
+                break;
+
+            /* smaps lists the maps in the same order as maps */
+            while (m < proc->num_maps && proc->maps[m]->start < start)
+                m++;
+            map = NULL;
+            if (m < proc->num_maps && proc->maps[m]->start == start &&
+                    proc->maps[m]->end == end)
+                map = proc->maps[m];
+            have_rss = have_swap = 0;
+        } else if (sscanf(line, "Rss: %zu kB", &rss) == 1) {
+            have_rss = 1;
+        } else if (sscanf(line, "Swap: %zu kB", &swap) == 1) {
+            have_swap = 1;
+        }
+    }
+
+    free(line);
+    fclose(smaps_f);
+
+    return 0;
+}
+
+int pm_pagemap_iter_create(pm_pagemap_iter_t **iter_out) {
+    pm_pagemap_iter_t *iter;
+
+    if (!iter_out)
+        return -1;
+
+    iter = calloc(1, sizeof(*iter));
+    if (!iter)
+        return errno;
+
+    *iter_out = iter;
+
+    return 0;
+}
+
+int pm_pagemap_iter_start(pm_pagemap_iter_t *iter, pm_map_t *map) {
+    pm_process_t *proc;
+
+    if (!iter || !map)
+        return -1;
+
+    proc = map->proc;
+
+    iter->map = map;
+    iter->next = 0;
+    iter->num_pages = (map->end - map->start) / proc->ker->pagesize;
+
+    /* Reading smaps costs about as much as reading the pagemap of the
+     * pages it covers, so it is only worth it for processes with maps too
+     * large to read in one window.  If it cannot be read, every map's
+     * pagemap is read. */
+    if (iter->num_pages > PM_PAGEMAP_WINDOW && !proc->smaps_read) {
+        proc->smaps_read = 1;
+        read_smaps(proc);
+    }
+
+    return 0;
+}
+
+int pm_pagemap_iter_next(pm_pagemap_iter_t *iter, uint64_t **entries_out,
+                         size_t *index_out, size_t *len) {
+    pm_map_t *map;
+    size_t num;
+    off64_t off;
+    ssize_t ret;
+
+    if (!iter || !iter->map || !entries_out || !index_out || !len)
+        return -1;
+
+    map = iter->map;
+
+    *entries_out = NULL;
+    *index_out = iter->next;
+    *len = 0;
+
+    if (iter->next >= iter->num_pages)
+        return 0;
+
+    /* Maps that fit in one window are always read, so that a map past the
+     * end of the pagemap (probably vectors) still reads as empty */
+    if (map->smaps_empty && iter->num_pages > PM_PAGEMAP_WINDOW) {
+        *len = iter->num_pages;
+        iter->next = iter->num_pages;
+        return 0;
+    }
+
+    num = iter->num_pages - iter->next;
+    if (num > PM_PAGEMAP_WINDOW)
+        num = PM_PAGEMAP_WINDOW;
+
+    off = (map->start / map->proc->ker->pagesize + iter->next) *
+            sizeof(uint64_t);
+    ret = pread64(map->proc->pagemap_fd, iter->window, num * sizeof(uint64_t),
+                  off);
+    if (ret < 0)
+        return errno;
+
+    num = ret / sizeof(uint64_t);
+    if (!num) {
+        /* EOF, mapping is not in userspace mapping range (probably
+         * vectors) */
+        iter->next = iter->num_pages;
+        return 0;
+    }
+
+    *entries_out = iter->window;
+    *len = num;
+    iter->next += num;
+
+    return 0;
+}
+
+int pm_pagemap_iter_destroy(pm_pagemap_iter_t *iter) {
+    if (!iter)
+        return -1;
+
+    free(iter);
+
+    return 0;
+}
+
+/* Adds the usage of a window of a map's pagemap to *usage.  pfns, counts
+ * and flags have room for a full window. */
+static int usage_window(pm_map_t *map, const uint64_t *pagemap, size_t len,
+                        uint64_t flags_mask, uint64_t required_flags,
+                        uint64_t *pfns, uint64_t *counts, uint64_t *flags,
+                        pm_memusage_t *usage) {
+    size_t num_pfns, num_counts, i, j, k;
+    uint64_t count;
+    int error;
+
+    /* Look up the resident pages all at once, so that the kernel's
+     * kpageflags and kpagecount are read in a few large reads */
+    num_pfns = 0;
+    for (i = 0; i < len; i++) {
+        if (PM_PAGEMAP_PRESENT(pagemap[i]) && !PM_PAGEMAP_SWAPPED(pagemap[i]))
+            pfns[num_pfns++] = PM_PAGEMAP_PFN(pagemap[i]);
+    }
+
+    num_counts = num_pfns;
+    if (flags_mask) {
+        error = pm_kernel_flags_list(map->proc->ker, pfns, num_pfns, flags);
+        if (error) return error;
+
+        /* Only the counts of pages with the required flags are needed */
+        num_counts = 0;
+        for (i = 0; i < num_pfns; i++) {
+            if ((flags[i] & flags_mask) == required_flags)
+                pfns[num_counts++] = pfns[i];
+        }
+    }
+
+    error = pm_kernel_counts(map->proc->ker, pfns, num_counts, counts);
+    if (error) return error;
+
+    for (i = 0, j = 0, k = 0; i < len; i++) {
+        usage->vss += map->proc->ker->pagesize;
+
+        if (!PM_PAGEMAP_PRESENT(pagemap[i]) &&
+                !PM_PAGEMAP_SWAPPED(pagemap[i]))
+            continue;
+
+        if (!PM_PAGEMAP_SWAPPED(pagemap[i])) {
+            if (flags_mask && (flags[k++] & flags_mask) != required_flags)
+                continue;
+
+            count = counts[j++];
+
+            usage->rss += (count >= 1) ? map->proc->ker->pagesize : (0);
+            usage->pss += (count >= 1) ? (map->proc->ker->pagesize / count) : (0);
+            usage->uss += (count == 1) ? (map->proc->ker->pagesize) : (0);
+        } else {
+            usage->swap += map->proc->ker->pagesize;
+            pm_memusage_pswap_add_offset(usage, PM_PAGEMAP_SWAP_OFFSET(pagemap[i]));
+        }
+    }
+
+    return 0;
+}
+
 int pm_map_usage_flags(pm_map_t *map, pm_memusage_t *usage_out,
                         uint64_t flags_mask, uint64_t required_flags) {
+    pm_pagemap_iter_t *iter;
     uint64_t *pagemap;
-    size_t len, i;
-    uint64_t count;
+    uint64_t *pfns = NULL, *counts = NULL, *flags = NULL;
+    size_t index, len;
     pm_memusage_t usage;
     int error;
 
     if (!map || !usage_out)
         return -1;
 
-    error = pm_map_pagemap(map, &pagemap, &len);
+    error = pm_pagemap_iter_create(&iter);
     if (error) return error;
 
+    pfns = malloc(PM_PAGEMAP_WINDOW * sizeof(uint64_t));
+    counts = malloc(PM_PAGEMAP_WINDOW * sizeof(uint64_t));
+    if (flags_mask)
+        flags = malloc(PM_PAGEMAP_WINDOW * sizeof(uint64_t));
+    if (!pfns || !counts || (flags_mask && !flags)) {
+        error = errno;
+        goto out;
+    }
+
     pm_memusage_zero(&usage);
     pm_memusage_pswap_init_handle(&usage, usage_out->p_swap);
 
-    for (i = 0; i < len; i++) {
-        usage.vss += map->proc->ker->pagesize;
+    error = pm_pagemap_iter_start(iter, map);
+    while (!error) {
+        error = pm_pagemap_iter_next(iter, &pagemap, &index, &len);
+        if (error || !len)
+            break;
 
-        if (!PM_PAGEMAP_PRESENT(pagemap[i]) &&
-                !PM_PAGEMAP_SWAPPED(pagemap[i]))
+        if (!pagemap) {
+            /* Nothing is resident or swapped */
+            usage.vss += len * map->proc->ker->pagesize;
             continue;
-
-        if (!PM_PAGEMAP_SWAPPED(pagemap[i])) {
-            if (flags_mask) {
-                uint64_t flags;
-                error = pm_kernel_flags(map->proc->ker, PM_PAGEMAP_PFN(pagemap[i]),
-                                        &flags);
-                if (error) goto out;
-
-                if ((flags & flags_mask) != required_flags)
-                    continue;
-            }
-
-            error = pm_kernel_count(map->proc->ker, PM_PAGEMAP_PFN(pagemap[i]),
-                                    &count);
-            if (error) goto out;
-
-            usage.rss += (count >= 1) ? map->proc->ker->pagesize : (0);
-            usage.pss += (count >= 1) ? (map->proc->ker->pagesize / count) : (0);
-            usage.uss += (count == 1) ? (map->proc->ker->pagesize) : (0);
-        } else {
-            usage.swap += map->proc->ker->pagesize;
-            pm_memusage_pswap_add_offset(&usage, PM_PAGEMAP_SWAP_OFFSET(pagemap[i]));
         }
+
+        error = usage_window(map, pagemap, len, flags_mask, required_flags,
+                             pfns, counts, flags, &usage);
     }
+    if (error) goto out;
 
     memcpy(usage_out, &usage, sizeof(usage));
 
-    error = 0;
-
 out:
-    free(pagemap);
+    free(flags);
+    free(counts);
+    free(pfns);
+    pm_pagemap_iter_destroy(iter);
 
     return error;
 }
@@ -90,45 +318,76 @@ int pm_map_usage(pm_map_t *map, pm_memusage_t *usage_out) {
 }
 
 int pm_map_workingset(pm_map_t *map, pm_memusage_t *ws_out) {
+    pm_pagemap_iter_t *iter;
     uint64_t *pagemap;
-    size_t len, i;
-    uint64_t count, flags;
+    uint64_t *pfns = NULL, *counts = NULL, *flags = NULL;
+    size_t index, len, num_counts, i, j;
+    uint64_t count;
     pm_memusage_t ws;
     int error;
 
     if (!map || !ws_out)
         return -1;
 
-    error = pm_map_pagemap(map, &pagemap, &len);
+    error = pm_pagemap_iter_create(&iter);
     if (error) return error;
 
+    pfns = malloc(PM_PAGEMAP_WINDOW * sizeof(uint64_t));
+    counts = malloc(PM_PAGEMAP_WINDOW * sizeof(uint64_t));
+    flags = malloc(PM_PAGEMAP_WINDOW * sizeof(uint64_t));
+    if (!pfns || !counts || !flags)
+        goto out;
+
     pm_memusage_zero(&ws);
 
-    for (i = 0; i < len; i++) {
-        error = pm_kernel_flags(map->proc->ker, PM_PAGEMAP_PFN(pagemap[i]),
-                                &flags);
-        if (error) goto out;
+    error = pm_pagemap_iter_start(iter, map);
+    while (!error) {
+        error = pm_pagemap_iter_next(iter, &pagemap, &index, &len);
+        if (error || !len)
+            break;
 
-        if (!(flags & PM_PAGE_REFERENCED))
+        /* Pages that are neither resident nor swapped are not in the
+         * working set */
+        if (!pagemap)
             continue;
 
-        error = pm_kernel_count(map->proc->ker, PM_PAGEMAP_PFN(pagemap[i]),
-                                &count);
-        if (error) goto out;
+        for (i = 0; i < len; i++)
+            pfns[i] = PM_PAGEMAP_PFN(pagemap[i]);
+
+        error = pm_kernel_flags_list(map->proc->ker, pfns, len, flags);
+        if (error) break;
+
+        num_counts = 0;
+        for (i = 0; i < len; i++) {
+            if (flags[i] & PM_PAGE_REFERENCED)
+                pfns[num_counts++] = pfns[i];
+        }
+
+        error = pm_kernel_counts(map->proc->ker, pfns, num_counts, counts);
+        if (error) break;
+
+        for (i = 0, j = 0; i < len; i++) {
+            if (!(flags[i] & PM_PAGE_REFERENCED))
+                continue;
 
-        ws.vss += map->proc->ker->pagesize;
-        if( PM_PAGEMAP_SWAPPED(pagemap[i]) ) continue;
-        ws.rss += (count >= 1) ? (map->proc->ker->pagesize) : (0);
-        ws.pss += (count >= 1) ? (map->proc->ker->pagesize / count) : (0);
-        ws.uss += (count == 1) ? (map->proc->ker->pagesize) : (0);
+            count = counts[j++];
+
+            ws.vss += map->proc->ker->pagesize;
+            if( PM_PAGEMAP_SWAPPED(pagemap[i]) ) continue;
+            ws.rss += (count >= 1) ? (map->proc->ker->pagesize) : (0);
+            ws.pss += (count >= 1) ? (map->proc->ker->pagesize / count) : (0);
+            ws.uss += (count == 1) ? (map->proc->ker->pagesize) : (0);
+        }
     }
+    if (error) goto out;
 
     memcpy(ws_out, &ws, sizeof(ws));
 
-    error = 0;
-
 out:
-    free(pagemap);
+    free(flags);
+    free(counts);
+    free(pfns);
+    pm_pagemap_iter_destroy(iter);
 
     return 0;
 }
@@ -223,6 +223,32 @@ int pm_process_workingset(pm_process_t *proc,
     return 0;
 }
 
+int pm_process_refresh(pm_process_t *proc) {
+    pm_map_t **maps;
+    int num_maps;
+    int error;
+    int i;
+
+    if (!proc)
+        return -1;
+
+    maps = proc->maps;
+    num_maps = proc->num_maps;
+
+    /* read_maps only replaces the maps once it has read all of them */
+    error = read_maps(proc);
+    if (error)
+        return error;
+
+    for (i = 0; i < num_maps; i++)
+        pm_map_destroy(maps[i]);
+    free(maps);
+
+    proc->smaps_read = 0;
+
+    return 0;
+}
+
 int pm_process_destroy(pm_process_t *proc) {
     int i;
 
@@ -0,0 +1,981 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pagemap/pagemap.h>
+
+/* A snapshot keeps, for each map, only the pagemap entries of pages that
+ * are resident or swapped, as the pagemaps of all processes are held at
+ * once and most of a process' address space is usually not mapped in.
+ * Resident pages refer to an entry of a table of the distinct PFNs mapped
+ * by any process, with their count and flags. */
+
+struct snapshot_map {
+    size_t num_pages;
+    size_t first;
+    size_t num_entries;
+};
+
+struct snapshot_process {
+    pm_process_t *proc;
+    int error;
+
+    struct snapshot_map *maps;
+
+    /* Page index within the map, pagemap entry and, for resident pages,
+     * index in the PFN table of each entry */
+    uint32_t *offsets;
+    uint64_t *entries;
+    uint32_t *pages;
+    size_t num_entries;
+    size_t entries_size;
+
+    /* Proportional and unique swap, once the swap slots are counted */
+    pm_swapusage_t swap;
+};
+
+struct pm_snapshot {
+    pm_kernel_t *ker;
+    int threads;
+
+    struct snapshot_process *procs;
+    size_t num_procs;
+
+    /* Distinct resident PFNs, sorted, with their counts and flags.  The
+     * flags are only read when they are first needed. */
+    uint64_t *pfns;
+    uint64_t *counts;
+    uint64_t *flags;
+    size_t num_pfns;
+
+    /* Set once the swap usage of all processes is computed */
+    int swap_counted;
+};
+
+static int cmp_pfn(const void *a, const void *b) {
+    uint64_t pa = *(const uint64_t *)a, pb = *(const uint64_t *)b;
+
+    if (pa < pb) return -1;
+    if (pa > pb) return 1;
+    return 0;
+}
+
+static int add_entry(struct snapshot_process *sp, uint32_t offset,
+                     uint64_t entry) {
+    if (sp->num_entries == sp->entries_size) {
+        size_t size = sp->entries_size ? sp->entries_size * 2 : 1024;
+        uint32_t *offsets, *pages;
+        uint64_t *entries;
+
+        offsets = realloc(sp->offsets, size * sizeof(*offsets));
+        if (!offsets)
+            return errno;
+        sp->offsets = offsets;
+
+        entries = realloc(sp->entries, size * sizeof(*entries));
+        if (!entries)
+            return errno;
+        sp->entries = entries;
+
+        pages = realloc(sp->pages, size * sizeof(*pages));
+        if (!pages)
+            return errno;
+        sp->pages = pages;
+
+        sp->entries_size = size;
+    }
+
+    sp->offsets[sp->num_entries] = offset;
+    sp->entries[sp->num_entries] = entry;
+    sp->pages[sp->num_entries] = 0;
+    sp->num_entries++;
+
+    return 0;
+}
+
+/* Reads the pagemaps of all maps of a process, keeping the entries of
+ * resident and swapped pages, and appends the resident PFNs to *pfns */
+static int read_process(struct snapshot_process *sp, uint64_t **pfns,
+                        size_t *num_pfns, size_t *pfns_size) {
+    pm_process_t *proc = sp->proc;
+    pm_pagemap_iter_t *iter;
+    uint64_t *pagemap;
+    size_t index, len, i;
+    int m;
+    int error;
+
+    sp->maps = calloc(proc->num_maps ? proc->num_maps : 1, sizeof(*sp->maps));
+    if (!sp->maps)
+        return errno;
+
+    error = pm_pagemap_iter_create(&iter);
+    if (error)
+        return error;
+
+    for (m = 0; m < proc->num_maps && !error; m++) {
+        struct snapshot_map *sm = &sp->maps[m];
+
+        sm->first = sp->num_entries;
+
+        error = pm_pagemap_iter_start(iter, proc->maps[m]);
+        while (!error) {
+            error = pm_pagemap_iter_next(iter, &pagemap, &index, &len);
+            if (error || !len)
+                break;
+
+            sm->num_pages += len;
+            if (!pagemap)
+                continue;
+
+            for (i = 0; i < len; i++) {
+                if (!PM_PAGEMAP_PRESENT(pagemap[i]) &&
+                        !PM_PAGEMAP_SWAPPED(pagemap[i]))
+                    continue;
+
+                error = add_entry(sp, index + i, pagemap[i]);
+                if (error)
+                    break;
+
+                if (PM_PAGEMAP_SWAPPED(pagemap[i]))
+                    continue;
+
+                if (*num_pfns == *pfns_size) {
+                    size_t size = *pfns_size ? *pfns_size * 2 : 4096;
+                    uint64_t *new_pfns = realloc(*pfns, size * sizeof(uint64_t));
+                    if (!new_pfns) {
+                        error = errno;
+                        break;
+                    }
+                    *pfns = new_pfns;
+                    *pfns_size = size;
+                }
+                (*pfns)[(*num_pfns)++] = PM_PAGEMAP_PFN(pagemap[i]);
+            }
+        }
+
+        sm->num_entries = sp->num_entries - sm->first;
+    }
+
+    pm_pagemap_iter_destroy(iter);
+
+    return error;
+}
+
+static size_t find_pfn(pm_snapshot_t *snap, uint64_t pfn) {
+    size_t lo = 0, hi = snap->num_pfns;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (snap->pfns[mid] <= pfn)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Each pass of pm_snapshot_create_threads is split between the workers.
+ * Every worker has its own pm_kernel_t, so that the workers share no
+ * file descriptors and no cache. */
+struct snapshot_worker {
+    pm_snapshot_t *snap;
+    pm_kernel_t *ker;
+    int error;
+
+    /* Processes are handed out one at a time, as they differ in size */
+    const pid_t *pids;
+    size_t *next_proc;
+
+    /* Resident PFNs of the processes this worker read */
+    uint64_t *pfns;
+    size_t num_pfns;
+    size_t pfns_size;
+
+    /* Slice of the PFN table this worker reads counts or flags of */
+    size_t first_pfn;
+    size_t num_table_pfns;
+    uint64_t *table;
+};
+
+static size_t next_process(struct snapshot_worker *w) {
+    return __atomic_fetch_add(w->next_proc, 1, __ATOMIC_RELAXED);
+}
+
+static void *read_processes_worker(void *arg) {
+    struct snapshot_worker *w = arg;
+    pm_snapshot_t *snap = w->snap;
+    size_t i;
+    int error;
+
+    while ((i = next_process(w)) < snap->num_procs) {
+        struct snapshot_process *sp = &snap->procs[i];
+
+        error = pm_process_create(w->ker, w->pids[i], &sp->proc);
+        if (error) {
+            sp->proc = NULL;
+            sp->error = error;
+            continue;
+        }
+        sp->proc->ker = snap->ker;
+
+        sp->error = read_process(sp, &w->pfns, &w->num_pfns, &w->pfns_size);
+
+        /* The pagemap has been read, and the snapshot may hold more
+         * processes than there are file descriptors */
+        close(sp->proc->pagemap_fd);
+        sp->proc->pagemap_fd = -1;
+    }
+
+    return NULL;
+}
+
+static void *read_counts_worker(void *arg) {
+    struct snapshot_worker *w = arg;
+
+    w->error = pm_kernel_counts(w->ker, w->snap->pfns + w->first_pfn,
+                                w->num_table_pfns, w->table + w->first_pfn);
+    return NULL;
+}
+
+static void *read_flags_worker(void *arg) {
+    struct snapshot_worker *w = arg;
+
+    w->error = pm_kernel_flags_list(w->ker, w->snap->pfns + w->first_pfn,
+                                    w->num_table_pfns, w->table + w->first_pfn);
+    return NULL;
+}
+
+static void *find_pages_worker(void *arg) {
+    struct snapshot_worker *w = arg;
+    pm_snapshot_t *snap = w->snap;
+    size_t i, k;
+
+    while ((i = next_process(w)) < snap->num_procs) {
+        struct snapshot_process *sp = &snap->procs[i];
+
+        for (k = 0; k < sp->num_entries; k++) {
+            if (!PM_PAGEMAP_SWAPPED(sp->entries[k]))
+                sp->pages[k] = find_pfn(snap, PM_PAGEMAP_PFN(sp->entries[k]));
+        }
+    }
+
+    return NULL;
+}
+
+/* Runs fn on all workers, the first one on the calling thread, and returns
+ * the first error any of them reported */
+static int run_workers(struct snapshot_worker *workers, int num_workers,
+                       void *(*fn)(void *)) {
+    pthread_t threads[num_workers];
+    int started, i;
+    int error = 0;
+
+    for (i = 0; i < num_workers; i++)
+        workers[i].error = 0;
+
+    for (started = 1; started < num_workers; started++) {
+        if (pthread_create(&threads[started], NULL, fn, &workers[started]))
+            break;
+    }
+
+    /* Workers that could not be started are run here instead */
+    for (i = started; i < num_workers; i++)
+        fn(&workers[i]);
+    fn(&workers[0]);
+
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < num_workers && !error; i++)
+        error = workers[i].error;
+
+    return error;
+}
+
+/* Splits the PFN table between the workers and reads either the counts
+ * or the flags of each slice into table */
+static int read_table(pm_snapshot_t *snap, struct snapshot_worker *workers,
+                      int num_workers, uint64_t *table,
+                      void *(*fn)(void *)) {
+    size_t per_worker = (snap->num_pfns + num_workers - 1) / num_workers;
+    int i;
+
+    for (i = 0; i < num_workers; i++) {
+        struct snapshot_worker *w = &workers[i];
+
+        w->first_pfn = per_worker * i;
+        if (w->first_pfn > snap->num_pfns)
+            w->first_pfn = snap->num_pfns;
+        w->num_table_pfns = snap->num_pfns - w->first_pfn;
+        if (w->num_table_pfns > per_worker)
+            w->num_table_pfns = per_worker;
+        w->table = table;
+    }
+
+    return run_workers(workers, num_workers, fn);
+}
+
+static void free_workers(struct snapshot_worker *workers, int num_workers) {
+    int i;
+
+    for (i = 0; i < num_workers; i++) {
+        free(workers[i].pfns);
+        if (i)
+            pm_kernel_destroy(workers[i].ker);
+    }
+    free(workers);
+}
+
+static struct snapshot_worker *create_workers(pm_snapshot_t *snap,
+                                              int num_workers) {
+    struct snapshot_worker *workers;
+    int i;
+    int error;
+
+    workers = calloc(num_workers, sizeof(*workers));
+    if (!workers)
+        return NULL;
+
+    for (i = 0; i < num_workers; i++) {
+        workers[i].snap = snap;
+        if (!i) {
+            workers[i].ker = snap->ker;
+            continue;
+        }
+
+        error = pm_kernel_create(&workers[i].ker);
+        if (error) {
+            free_workers(workers, i);
+            errno = error > 0 ? error : EINVAL;
+            return NULL;
+        }
+    }
+
+    return workers;
+}
+
+int pm_snapshot_create(pm_kernel_t *ker, const pid_t *pids, size_t num_pids,
+                       pm_snapshot_t **snap_out) {
+    return pm_snapshot_create_threads(ker, pids, num_pids, 1, snap_out);
+}
+
+int pm_snapshot_create_threads(pm_kernel_t *ker, const pid_t *pids,
+                               size_t num_pids, int threads,
+                               pm_snapshot_t **snap_out) {
+    struct snapshot_worker *workers;
+    pm_snapshot_t *snap;
+    uint64_t *pfns;
+    size_t num_pfns, next_proc;
+    size_t i, j;
+    int error;
+
+    if (!ker || (num_pids && !pids) || threads < 1 || !snap_out)
+        return -1;
+
+    snap = calloc(1, sizeof(*snap));
+    if (!snap)
+        return errno;
+
+    snap->ker = ker;
+    snap->threads = threads;
+    snap->procs = calloc(num_pids ? num_pids : 1, sizeof(*snap->procs));
+    if (!snap->procs) {
+        error = errno;
+        free(snap);
+        return error;
+    }
+    snap->num_procs = num_pids;
+
+    workers = create_workers(snap, threads);
+    if (!workers) {
+        error = errno;
+        goto fail;
+    }
+
+    /* Read the pagemaps of all processes before any page counts, so that
+     * pages mapped by many processes are only looked up once */
+    next_proc = 0;
+    for (i = 0; i < (size_t)threads; i++) {
+        workers[i].pids = pids;
+        workers[i].next_proc = &next_proc;
+    }
+    run_workers(workers, threads, read_processes_worker);
+
+    num_pfns = 0;
+    for (i = 0; i < (size_t)threads; i++)
+        num_pfns += workers[i].num_pfns;
+
+    pfns = workers[0].pfns;
+    workers[0].pfns = NULL;
+    if (threads > 1 && num_pfns) {
+        uint64_t *all = realloc(pfns, num_pfns * sizeof(uint64_t));
+        if (!all) {
+            error = errno;
+            free(pfns);
+            goto fail_workers;
+        }
+        pfns = all;
+
+        j = workers[0].num_pfns;
+        for (i = 1; i < (size_t)threads; i++) {
+            memcpy(pfns + j, workers[i].pfns,
+                   workers[i].num_pfns * sizeof(uint64_t));
+            j += workers[i].num_pfns;
+            free(workers[i].pfns);
+            workers[i].pfns = NULL;
+        }
+    }
+
+    if (num_pfns) {
+        qsort(pfns, num_pfns, sizeof(uint64_t), cmp_pfn);
+        for (i = 1, j = 1; i < num_pfns; i++) {
+            if (pfns[i] != pfns[j - 1])
+                pfns[j++] = pfns[i];
+        }
+        num_pfns = j;
+    }
+
+    snap->pfns = pfns;
+    snap->num_pfns = num_pfns;
+
+    snap->counts = malloc((num_pfns ? num_pfns : 1) * sizeof(uint64_t));
+    if (!snap->counts) {
+        error = errno;
+        goto fail_workers;
+    }
+
+    error = read_table(snap, workers, threads, snap->counts,
+                       read_counts_worker);
+    if (error)
+        goto fail_workers;
+
+    next_proc = 0;
+    run_workers(workers, threads, find_pages_worker);
+
+    free_workers(workers, threads);
+
+    *snap_out = snap;
+
+    return 0;
+
+fail_workers:
+    free_workers(workers, threads);
+fail:
+    pm_snapshot_destroy(snap);
+    return error;
+}
+
+static int read_flags(pm_snapshot_t *snap) {
+    struct snapshot_worker *workers;
+    int error;
+
+    if (snap->flags)
+        return 0;
+
+    snap->flags = malloc((snap->num_pfns ? snap->num_pfns : 1) *
+                         sizeof(uint64_t));
+    if (!snap->flags)
+        return errno;
+
+    workers = create_workers(snap, snap->threads);
+    if (!workers) {
+        error = errno;
+    } else {
+        error = read_table(snap, workers, snap->threads, snap->flags,
+                           read_flags_worker);
+        free_workers(workers, snap->threads);
+    }
+
+    if (error) {
+        free(snap->flags);
+        snap->flags = NULL;
+    }
+
+    return error;
+}
+
+size_t pm_snapshot_num_processes(pm_snapshot_t *snap) {
+    return snap ? snap->num_procs : 0;
+}
+
+pm_process_t *pm_snapshot_process(pm_snapshot_t *snap, size_t i) {
+    if (!snap || i >= snap->num_procs)
+        return NULL;
+
+    return snap->procs[i].proc;
+}
+
+static int get_map(pm_snapshot_t *snap, size_t i, size_t map,
+                   struct snapshot_process **sp_out,
+                   struct snapshot_map **sm_out) {
+    struct snapshot_process *sp;
+
+    if (!snap || i >= snap->num_procs)
+        return -1;
+
+    sp = &snap->procs[i];
+    if (sp->error)
+        return sp->error;
+    if (map >= (size_t)sp->proc->num_maps)
+        return -1;
+
+    *sp_out = sp;
+    *sm_out = &sp->maps[map];
+
+    return 0;
+}
+
+static void map_usage(pm_snapshot_t *snap, struct snapshot_process *sp,
+                      struct snapshot_map *sm, pm_memusage_t *usage,
+                      uint64_t flags_mask, uint64_t required_flags) {
+    size_t pagesize = snap->ker->pagesize;
+    uint64_t count;
+    size_t k;
+
+    usage->vss += sm->num_pages * pagesize;
+
+    for (k = sm->first; k < sm->first + sm->num_entries; k++) {
+        if (PM_PAGEMAP_SWAPPED(sp->entries[k])) {
+            usage->swap += pagesize;
+            pm_memusage_pswap_add_offset(usage,
+                    PM_PAGEMAP_SWAP_OFFSET(sp->entries[k]));
+            continue;
+        }
+
+        if (flags_mask &&
+                (snap->flags[sp->pages[k]] & flags_mask) != required_flags)
+            continue;
+
+        count = snap->counts[sp->pages[k]];
+
+        usage->rss += (count >= 1) ? pagesize : (0);
+        usage->pss += (count >= 1) ? (pagesize / count) : (0);
+        usage->uss += (count == 1) ? (pagesize) : (0);
+    }
+}
+
+static void map_workingset(pm_snapshot_t *snap, struct snapshot_process *sp,
+                           struct snapshot_map *sm, pm_memusage_t *ws) {
+    size_t pagesize = snap->ker->pagesize;
+    uint64_t count;
+    size_t k;
+
+    for (k = sm->first; k < sm->first + sm->num_entries; k++) {
+        if (PM_PAGEMAP_SWAPPED(sp->entries[k]) ||
+                !(snap->flags[sp->pages[k]] & PM_PAGE_REFERENCED))
+            continue;
+
+        count = snap->counts[sp->pages[k]];
+
+        ws->vss += pagesize;
+        ws->rss += (count >= 1) ? (pagesize) : (0);
+        ws->pss += (count >= 1) ? (pagesize / count) : (0);
+        ws->uss += (count == 1) ? (pagesize) : (0);
+    }
+}
+
+int pm_snapshot_map_usage_flags(pm_snapshot_t *snap, size_t i, size_t map,
+                                pm_memusage_t *usage_out,
+                                uint64_t flags_mask, uint64_t required_flags) {
+    struct snapshot_process *sp;
+    struct snapshot_map *sm;
+    pm_memusage_t usage;
+    int error;
+
+    if (!usage_out)
+        return -1;
+
+    error = get_map(snap, i, map, &sp, &sm);
+    if (error) return error;
+
+    if (flags_mask) {
+        error = read_flags(snap);
+        if (error) return error;
+    }
+
+    pm_memusage_zero(&usage);
+    pm_memusage_pswap_init_handle(&usage, usage_out->p_swap);
+
+    map_usage(snap, sp, sm, &usage, flags_mask, required_flags);
+
+    memcpy(usage_out, &usage, sizeof(usage));
+
+    return 0;
+}
+
+int pm_snapshot_map_workingset(pm_snapshot_t *snap, size_t i, size_t map,
+                               pm_memusage_t *ws_out) {
+    struct snapshot_process *sp;
+    struct snapshot_map *sm;
+    pm_memusage_t ws;
+    int error;
+
+    if (!ws_out)
+        return -1;
+
+    error = get_map(snap, i, map, &sp, &sm);
+    if (error) return error;
+
+    error = read_flags(snap);
+    if (error) return error;
+
+    pm_memusage_zero(&ws);
+
+    map_workingset(snap, sp, sm, &ws);
+
+    memcpy(ws_out, &ws, sizeof(ws));
+
+    return 0;
+}
+
+int pm_snapshot_process_usage_flags(pm_snapshot_t *snap, size_t i,
+                                    pm_memusage_t *usage_out,
+                                    uint64_t flags_mask,
+                                    uint64_t required_flags) {
+    struct snapshot_process *sp;
+    pm_memusage_t usage;
+    int m;
+    int error;
+
+    if (!snap || i >= snap->num_procs || !usage_out)
+        return -1;
+
+    sp = &snap->procs[i];
+    if (sp->error)
+        return sp->error;
+
+    if (flags_mask) {
+        error = read_flags(snap);
+        if (error) return error;
+    }
+
+    pm_memusage_zero(&usage);
+    pm_memusage_pswap_init_handle(&usage, usage_out->p_swap);
+
+    for (m = 0; m < sp->proc->num_maps; m++)
+        map_usage(snap, sp, &sp->maps[m], &usage, flags_mask, required_flags);
+
+    memcpy(usage_out, &usage, sizeof(usage));
+
+    return 0;
+}
+
+int pm_snapshot_process_workingset(pm_snapshot_t *snap, size_t i,
+                                   pm_memusage_t *ws_out) {
+    struct snapshot_process *sp;
+    pm_memusage_t ws;
+    int m;
+    int error;
+
+    if (!snap || i >= snap->num_procs || !ws_out)
+        return -1;
+
+    sp = &snap->procs[i];
+    if (sp->error)
+        return sp->error;
+
+    error = read_flags(snap);
+    if (error) return error;
+
+    pm_memusage_zero(&ws);
+    pm_memusage_pswap_init_handle(&ws, ws_out->p_swap);
+
+    for (m = 0; m < sp->proc->num_maps; m++)
+        map_workingset(snap, sp, &sp->maps[m], &ws);
+
+    memcpy(ws_out, &ws, sizeof(ws));
+
+    return 0;
+}
+
+#define SWAP_TYPES 32
+
+/* Counts the references to each swap slot from all processes, in one flat
+ * array per swap device indexed by swap offset, and computes the swap
+ * usage of every process from them. */
+static int count_swap(pm_snapshot_t *snap) {
+    uint32_t *refs[SWAP_TYPES];
+    uint64_t max_offset[SWAP_TYPES];
+    size_t pagesize = snap->ker->pagesize;
+    uint64_t entry, type, offset;
+    size_t i, k;
+    int error = 0;
+
+    if (snap->swap_counted)
+        return 0;
+
+    memset(refs, 0, sizeof(refs));
+    memset(max_offset, 0, sizeof(max_offset));
+
+    for (i = 0; i < snap->num_procs; i++) {
+        struct snapshot_process *sp = &snap->procs[i];
+
+        for (k = 0; !sp->error && k < sp->num_entries; k++) {
+            entry = sp->entries[k];
+            if (!PM_PAGEMAP_SWAPPED(entry))
+                continue;
+            type = PM_PAGEMAP_SWAP_TYPE(entry);
+            offset = PM_PAGEMAP_SWAP_OFFSET(entry);
+            if (offset + 1 > max_offset[type])
+                max_offset[type] = offset + 1;
+        }
+    }
+
+    for (type = 0; type < SWAP_TYPES && !error; type++) {
+        if (!max_offset[type])
+            continue;
+        if (max_offset[type] > SIZE_MAX / sizeof(uint32_t)) {
+            error = EINVAL;
+            break;
+        }
+        refs[type] = calloc(max_offset[type], sizeof(uint32_t));
+        if (!refs[type])
+            error = errno;
+    }
+    if (error)
+        goto out;
+
+    for (i = 0; i < snap->num_procs; i++) {
+        struct snapshot_process *sp = &snap->procs[i];
+
+        for (k = 0; !sp->error && k < sp->num_entries; k++) {
+            entry = sp->entries[k];
+            if (PM_PAGEMAP_SWAPPED(entry))
+                refs[PM_PAGEMAP_SWAP_TYPE(entry)][PM_PAGEMAP_SWAP_OFFSET(entry)]++;
+        }
+    }
+
+    for (i = 0; i < snap->num_procs; i++) {
+        struct snapshot_process *sp = &snap->procs[i];
+
+        for (k = 0; !sp->error && k < sp->num_entries; k++) {
+            uint32_t count;
+
+            entry = sp->entries[k];
+            if (!PM_PAGEMAP_SWAPPED(entry))
+                continue;
+            count = refs[PM_PAGEMAP_SWAP_TYPE(entry)][PM_PAGEMAP_SWAP_OFFSET(entry)];
+            sp->swap.proportional += pagesize / count;
+            sp->swap.unique += (count == 1) ? pagesize : 0;
+        }
+    }
+
+    snap->swap_counted = 1;
+
+out:
+    for (type = 0; type < SWAP_TYPES; type++)
+        free(refs[type]);
+
+    return error;
+}
+
+int pm_snapshot_process_swapusage(pm_snapshot_t *snap, size_t i,
+                                  pm_swapusage_t *su_out) {
+    struct snapshot_process *sp;
+    int error;
+
+    if (!snap || i >= snap->num_procs || !su_out)
+        return -1;
+
+    sp = &snap->procs[i];
+    if (sp->error)
+        return sp->error;
+
+    error = count_swap(snap);
+    if (error) return error;
+
+    memcpy(su_out, &sp->swap, sizeof(sp->swap));
+
+    return 0;
+}
+
+int pm_snapshot_map_pages(pm_snapshot_t *snap, size_t i, size_t map,
+                          pm_snapshot_page_t **pages_out, size_t *len) {
+    struct snapshot_process *sp;
+    struct snapshot_map *sm;
+    pm_snapshot_page_t *pages;
+    size_t k;
+    int error;
+
+    if (!pages_out || !len)
+        return -1;
+
+    error = get_map(snap, i, map, &sp, &sm);
+    if (error) return error;
+
+    error = read_flags(snap);
+    if (error) return error;
+
+    pages = calloc(sm->num_entries ? sm->num_entries : 1, sizeof(*pages));
+    if (!pages)
+        return errno;
+
+    for (k = 0; k < sm->num_entries; k++) {
+        size_t e = sm->first + k;
+
+        pages[k].index = sp->offsets[e];
+        pages[k].pagemap = sp->entries[e];
+        if (!PM_PAGEMAP_SWAPPED(sp->entries[e])) {
+            pages[k].count = snap->counts[sp->pages[e]];
+            pages[k].flags = snap->flags[sp->pages[e]];
+        }
+    }
+
+    *pages_out = pages;
+    *len = sm->num_entries;
+
+    return 0;
+}
+
+#define MAP_TABLE_COLUMNS 9
+
+int pm_snapshot_map_table(pm_snapshot_t *snap, size_t i, int workingset,
+                          pm_map_table_t **table_out) {
+    struct snapshot_process *sp;
+    pm_map_table_t *table;
+    size_t pagesize, num_maps, m, k;
+    uint64_t *columns;
+    uint64_t count, flags;
+    int error;
+
+    if (!snap || i >= snap->num_procs || !table_out)
+        return -1;
+
+    sp = &snap->procs[i];
+    if (sp->error)
+        return sp->error;
+
+    /* Needed for the dirty bit even outside of the working set */
+    error = read_flags(snap);
+    if (error) return error;
+
+    num_maps = sp->proc->num_maps;
+    table = calloc(1, sizeof(*table));
+    if (!table)
+        return errno;
+
+    /* All columns are in one allocation, starting with vss */
+    columns = calloc((num_maps ? num_maps : 1) * MAP_TABLE_COLUMNS,
+                     sizeof(uint64_t));
+    if (!columns) {
+        error = errno;
+        free(table);
+        return error;
+    }
+
+    table->num_maps = num_maps;
+    table->vss = columns;
+    table->rss = columns + num_maps;
+    table->pss = columns + 2 * num_maps;
+    table->uss = columns + 3 * num_maps;
+    table->swap = columns + 4 * num_maps;
+    table->shared_clean = columns + 5 * num_maps;
+    table->shared_dirty = columns + 6 * num_maps;
+    table->private_clean = columns + 7 * num_maps;
+    table->private_dirty = columns + 8 * num_maps;
+
+    pagesize = snap->ker->pagesize;
+
+    for (m = 0; m < num_maps; m++) {
+        struct snapshot_map *sm = &sp->maps[m];
+
+        if (!workingset)
+            table->vss[m] = sm->num_pages * pagesize;
+
+        for (k = sm->first; k < sm->first + sm->num_entries; k++) {
+            if (PM_PAGEMAP_SWAPPED(sp->entries[k])) {
+                if (!workingset)
+                    table->swap[m] += pagesize;
+                continue;
+            }
+
+            count = snap->counts[sp->pages[k]];
+            flags = snap->flags[sp->pages[k]];
+
+            if (workingset) {
+                if (!(flags & PM_PAGE_REFERENCED))
+                    continue;
+                table->vss[m] += pagesize;
+            }
+
+            if (count >= 1) {
+                table->rss[m] += pagesize;
+                table->pss[m] += pagesize / count;
+            }
+
+            if (count > 1) {
+                if (flags & PM_PAGE_DIRTY)
+                    table->shared_dirty[m] += pagesize;
+                else
+                    table->shared_clean[m] += pagesize;
+            } else {
+                if (count == 1)
+                    table->uss[m] += pagesize;
+                if (flags & PM_PAGE_DIRTY)
+                    table->private_dirty[m] += pagesize;
+                else
+                    table->private_clean[m] += pagesize;
+            }
+        }
+    }
+
+    *table_out = table;
+
+    return 0;
+}
+
+int pm_map_table_destroy(pm_map_table_t *table) {
+    if (!table)
+        return -1;
+
+    free(table->vss);
+    free(table);
+
+    return 0;
+}
+
+int pm_snapshot_destroy(pm_snapshot_t *snap) {
+    size_t i;
+
+    if (!snap)
+        return -1;
+
+    for (i = 0; i < snap->num_procs; i++) {
+        struct snapshot_process *sp = &snap->procs[i];
+
+        if (sp->proc)
+            pm_process_destroy(sp->proc);
+        free(sp->maps);
+        free(sp->offsets);
+        free(sp->entries);
+        free(sp->pages);
+    }
+
+    free(snap->procs);
+    free(snap->pfns);
+    free(snap->counts);
+    free(snap->flags);
+    free(snap);
+
+    return 0;
+}
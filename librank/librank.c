@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -65,6 +66,7 @@ declare_sort(swap);
 
 #define INIT_LIBRARIES 16
 #define INIT_MAPPINGS 4
+#define INIT_BUCKETS 256
 
 static int order;
 
@@ -72,6 +74,46 @@ struct library_info **libraries;
 size_t libraries_count;
 size_t libraries_size;
 
+/* Libraries are looked up for every map of every process, so they are also
+ * kept in a hash table by name, chained through library_info.next. */
+struct library_info **library_buckets;
+size_t library_buckets_count;
+
+static size_t hash_name(const char *name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void add_library_to_buckets(struct library_info *library) {
+    size_t bucket = hash_name(library->name) & (library_buckets_count - 1);
+
+    library->next = library_buckets[bucket];
+    library_buckets[bucket] = library;
+}
+
+/* Doubles the number of buckets once there are as many libraries, so that
+ * chains stay short. */
+static void grow_library_buckets(void) {
+    size_t i;
+
+    free(library_buckets);
+    library_buckets_count = library_buckets_count ? 2 * library_buckets_count : INIT_BUCKETS;
+    library_buckets = calloc(library_buckets_count, sizeof(struct library_info *));
+    if (!library_buckets) {
+        fprintf(stderr, "Couldn't allocate library hash table: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < libraries_count; i++)
+        add_library_to_buckets(libraries[i]);
+}
+
 struct library_info *get_library(const char *name, bool all) {
     size_t i;
     struct library_info *library;
@@ -86,9 +128,12 @@ struct library_info *get_library(const char *name, bool all) {
         }
     }
 
-    for (i = 0; i < libraries_count; i++) {
-        if (!strcmp(libraries[i]->name, name))
-            return libraries[i];
+    if (library_buckets_count) {
+        library = library_buckets[hash_name(name) & (library_buckets_count - 1)];
+        for (; library; library = library->next) {
+            if (!strcmp(library->name, name))
+                return library;
+        }
     }
 
     if (libraries_count >= libraries_size) {
@@ -121,17 +166,23 @@ struct library_info *get_library(const char *name, bool all) {
 
     libraries[libraries_count++] = library;
 
+    if (libraries_count > library_buckets_count)
+        grow_library_buckets();
+    else
+        add_library_to_buckets(library);
+
     return library;
 }
 
 struct mapping_info *get_mapping(struct library_info *library, struct process_info *proc) {
     struct mapping_info *mapping;
-    size_t i;
 
-    for (i = 0; i < library->mappings_count; i++) {
-        if (library->mappings[i]->proc == proc)
-            return library->mappings[i];
-    }
+    /* All maps of a process are added before those of the next process, so
+     * the process can only have a mapping of the library if it is the last
+     * one added. */
+    if (library->mappings_count &&
+            library->mappings[library->mappings_count - 1]->proc == proc)
+        return library->mappings[library->mappings_count - 1];
 
     if (library->mappings_count >= library->mappings_size) {
         library->mappings = realloc(library->mappings,
@@ -203,6 +254,7 @@ int main(int argc, char *argv[]) {
 
     pm_kernel_t *ker;
     pm_process_t *proc;
+    pm_snapshot_t *snap;
 
     pid_t *pids;
     size_t num_procs;
@@ -331,9 +383,17 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    /* All processes are read before any page is looked up, so that pages
+     * shared between processes are only read from the kernel once */
+    error = pm_snapshot_create(ker, pids, num_procs, &snap);
+    if (error) {
+        fprintf(stderr, "Error reading processes.\n");
+        exit(EXIT_FAILURE);
+    }
+
     for (i = 0; i < num_procs; i++) {
-        error = pm_process_create(ker, pids[i], &proc);
-        if (error) {
+        proc = pm_snapshot_process(snap, i);
+        if (!proc) {
             fprintf(stderr, "warning: could not create process interface for %d\n", pids[i]);
             continue;
         }
@@ -359,8 +419,8 @@ int main(int argc, char *argv[]) {
 
             mi = get_mapping(li, pi);
 
-            error = pm_map_usage_flags(maps[j], &map_usage, flags_mask,
-                                       required_flags);
+            error = pm_snapshot_map_usage_flags(snap, i, j, &map_usage,
+                                                flags_mask, required_flags);
             if (error) {
                 fprintf(stderr, "Error getting map memory usage of "
                                 "map %s in process %d.\n",
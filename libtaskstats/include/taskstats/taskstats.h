@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TASKSTATS_TASKSTATS_H
+#define _TASKSTATS_TASKSTATS_H
+
+#include <stdio.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <linux/taskstats.h>
+
+__BEGIN_DECLS
+
+/*
+ * Per-task delay accounting, from the taskstats netlink family and from the
+ * latencytop files in /proc. Functions return 0 on success or an errno.
+ */
+
+typedef struct ts_socket ts_socket_t;
+
+/* Called with the statistics of the thread pid (type TASKSTATS_TYPE_PID) or
+ * of the thread group pid (type TASKSTATS_TYPE_TGID). */
+typedef void (*ts_stats_fn)(int type, pid_t pid, const struct taskstats *stats, void *arg);
+
+/* Opens a taskstats socket. Its request and receive buffers are allocated
+ * once and reused by every query, so keep it open across refreshes. */
+int ts_socket_open(ts_socket_t **sock_out);
+void ts_socket_close(ts_socket_t *sock);
+
+/* Gets the statistics of one task. attr is TASKSTATS_CMD_ATTR_PID or
+ * TASKSTATS_CMD_ATTR_TGID. Returns ESRCH if the task is gone. */
+int ts_get_stats(ts_socket_t *sock, int attr, pid_t pid, struct taskstats *stats);
+
+/* Gets the statistics of many tasks, sending the requests in batches of
+ * TS_BATCH_SIZE in one message each. fn is called for each task that still
+ * exists; the ones that are gone are skipped. */
+#define TS_BATCH_SIZE 64
+int ts_get_stats_batch(ts_socket_t *sock, int attr, const pid_t *pids, size_t num_pids,
+                       ts_stats_fn fn, void *arg);
+
+/* Registers the socket for the final statistics of the tasks exiting on
+ * cpumask ("0-3" or NULL for all the cpus). The socket becomes nonblocking
+ * and should not be used for queries anymore. */
+int ts_register_exits(ts_socket_t *sock, const char *cpumask);
+/* Calls fn for each exit received since the last call, without blocking.
+ * Exits of whole thread groups also call fn for the tgid. Exits lost to a
+ * full receive buffer are counted in dropped, if not NULL. */
+int ts_read_exits(ts_socket_t *sock, ts_stats_fn fn, void *arg, size_t *dropped);
+
+/*
+ * Latency totals by reason, read from /proc/latency_stats or
+ * /proc/<pid>/task/<tid>/latency. Entries are found by a hash of their
+ * reason and recycled by ts_latency_clear, so a table kept across refreshes
+ * stops allocating once it has seen all the reasons.
+ */
+
+#define TS_LATENCY_REASON_MAX 512
+
+typedef struct ts_latency_entry ts_latency_entry_t;
+struct ts_latency_entry {
+    unsigned long count;
+    unsigned long max;   /* usec */
+    unsigned long total; /* usec */
+    char reason[TS_LATENCY_REASON_MAX];
+};
+
+typedef struct ts_latency ts_latency_t;
+
+int ts_latency_create(ts_latency_t **lat_out);
+void ts_latency_destroy(ts_latency_t *lat);
+/* Removes all the entries. */
+void ts_latency_clear(ts_latency_t *lat);
+
+/* Adds the entries of a latency file. Returns EINVAL if the file does not
+ * have the expected version. */
+int ts_latency_read(ts_latency_t *lat, FILE *f);
+
+/* Entries in the order they were first added. Pointers are valid until the
+ * table is cleared. */
+size_t ts_latency_count(const ts_latency_t *lat);
+const ts_latency_entry_t *ts_latency_entry(const ts_latency_t *lat, size_t i);
+
+__END_DECLS
+
+#endif /* _TASKSTATS_TASKSTATS_H */
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <taskstats/taskstats.h>
+
+#define EXPECTED_VERSION "Latency Top version : v0.1\n"
+/* A power of 2, well above the number of reasons of a kernel */
+#define NUM_BUCKETS 1024
+
+struct latency_node {
+    ts_latency_entry_t entry;
+    uint32_t hash;
+    struct latency_node *next; /* in its bucket or in the free list */
+};
+
+struct ts_latency {
+    struct latency_node *buckets[NUM_BUCKETS];
+    struct latency_node **nodes;
+    size_t count;
+    size_t capacity;
+    struct latency_node *free_nodes;
+};
+
+/* FNV-1a */
+static uint32_t hash_reason(const char *reason) {
+    uint32_t hash = 2166136261u;
+
+    while (*reason) {
+        hash ^= (unsigned char)*reason++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int ts_latency_create(ts_latency_t **lat_out) {
+    ts_latency_t *lat;
+
+    if (!lat_out)
+        return EINVAL;
+
+    lat = calloc(1, sizeof(*lat));
+    if (!lat)
+        return ENOMEM;
+
+    *lat_out = lat;
+    return 0;
+}
+
+void ts_latency_destroy(ts_latency_t *lat) {
+    struct latency_node *node;
+
+    if (!lat)
+        return;
+
+    ts_latency_clear(lat);
+    while ((node = lat->free_nodes)) {
+        lat->free_nodes = node->next;
+        free(node);
+    }
+    free(lat->nodes);
+    free(lat);
+}
+
+void ts_latency_clear(ts_latency_t *lat) {
+    size_t i;
+
+    for (i = 0; i < lat->count; i++) {
+        lat->nodes[i]->next = lat->free_nodes;
+        lat->free_nodes = lat->nodes[i];
+    }
+    lat->count = 0;
+    memset(lat->buckets, 0, sizeof(lat->buckets));
+}
+
+static struct latency_node *find_node(ts_latency_t *lat, const char *reason, uint32_t hash) {
+    struct latency_node *node;
+
+    for (node = lat->buckets[hash & (NUM_BUCKETS - 1)]; node; node = node->next) {
+        if (node->hash == hash && !strcmp(node->entry.reason, reason))
+            return node;
+    }
+    return NULL;
+}
+
+static struct latency_node *add_node(ts_latency_t *lat, const char *reason, uint32_t hash) {
+    struct latency_node *node;
+    size_t bucket = hash & (NUM_BUCKETS - 1);
+
+    if (lat->count == lat->capacity) {
+        size_t capacity = lat->capacity ? lat->capacity * 2 : 64;
+        struct latency_node **nodes = realloc(lat->nodes, capacity * sizeof(*nodes));
+        if (!nodes)
+            return NULL;
+        lat->nodes = nodes;
+        lat->capacity = capacity;
+    }
+
+    if (lat->free_nodes) {
+        node = lat->free_nodes;
+        lat->free_nodes = node->next;
+    } else {
+        node = malloc(sizeof(*node));
+        if (!node)
+            return NULL;
+    }
+
+    memset(&node->entry, 0, offsetof(ts_latency_entry_t, reason));
+    strcpy(node->entry.reason, reason);
+    node->hash = hash;
+    node->next = lat->buckets[bucket];
+    lat->buckets[bucket] = node;
+    lat->nodes[lat->count++] = node;
+    return node;
+}
+
+int ts_latency_read(ts_latency_t *lat, FILE *f) {
+    char line[TS_LATENCY_REASON_MAX];
+    char reason[TS_LATENCY_REASON_MAX];
+    unsigned long count, max, total;
+
+    if (!lat || !f)
+        return EINVAL;
+
+    if (!fgets(line, sizeof(line), f))
+        return errno ? errno : EIO;
+    if (strcmp(line, EXPECTED_VERSION))
+        return EINVAL;
+
+    while (fgets(line, sizeof(line), f)) {
+        struct latency_node *node;
+        uint32_t hash;
+
+        /* The reason is the first function of the backtrace */
+        if (sscanf(line, "%lu %lu %lu %511s", &count, &total, &max, reason) != 4)
+            continue;
+        if (!max && !total)
+            continue;
+
+        hash = hash_reason(reason);
+        node = find_node(lat, reason, hash);
+        if (!node) {
+            node = add_node(lat, reason, hash);
+            if (!node)
+                return ENOMEM;
+        }
+        node->entry.count += count;
+        if (max > node->entry.max)
+            node->entry.max = max;
+        node->entry.total += total;
+    }
+    return 0;
+}
+
+size_t ts_latency_count(const ts_latency_t *lat) {
+    return lat->count;
+}
+
+const ts_latency_entry_t *ts_latency_entry(const ts_latency_t *lat, size_t i) {
+    return i < lat->count ? &lat->nodes[i]->entry : NULL;
+}
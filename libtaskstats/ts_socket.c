@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <netlink/genl/ctrl.h>
+#include <netlink/genl/genl.h>
+#include <netlink/socket.h>
+
+#include <taskstats/taskstats.h>
+
+/* A request is a genl header and one u32 attribute, its reply about 500
+ * bytes, and an exit notification two replies in one message. */
+#define TS_REQUEST_SIZE NLMSG_ALIGN(NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + sizeof(uint32_t)))
+#define TS_RECV_SIZE 16384
+/* The replies to a batch are queued until they are read, and each one takes
+ * a few KB of the socket's buffer */
+#define TS_BATCH_BUFFER_SIZE (TS_BATCH_SIZE * 4096)
+/* Exits come in bursts, like when an app is killed */
+#define TS_EXITS_BUFFER_SIZE (1024 * 1024)
+
+/* libnl is only used to connect and resolve the family, the messages are
+ * built in and parsed from buffers owned by the socket. */
+struct ts_socket {
+    struct nl_sock *nl;
+    int fd;
+    int family_id;
+    uint32_t seq;
+    char send_buf[TS_BATCH_SIZE * TS_REQUEST_SIZE];
+    char recv_buf[TS_RECV_SIZE];
+};
+
+int ts_socket_open(ts_socket_t **sock_out) {
+    ts_socket_t *sock;
+    int err;
+
+    if (!sock_out)
+        return EINVAL;
+
+    sock = calloc(1, sizeof(*sock));
+    if (!sock)
+        return ENOMEM;
+
+    sock->nl = nl_socket_alloc();
+    if (!sock->nl) {
+        free(sock);
+        return ENOMEM;
+    }
+
+    if (genl_connect(sock->nl) < 0) {
+        err = errno ? errno : ECONNREFUSED;
+        goto fail;
+    }
+
+    sock->family_id = genl_ctrl_resolve(sock->nl, TASKSTATS_GENL_NAME);
+    if (sock->family_id < 0) {
+        err = EPROTONOSUPPORT;
+        goto fail;
+    }
+
+    nl_socket_set_buffer_size(sock->nl, TS_BATCH_BUFFER_SIZE, 0);
+    sock->fd = nl_socket_get_fd(sock->nl);
+    *sock_out = sock;
+    return 0;
+
+fail:
+    nl_socket_free(sock->nl);
+    free(sock);
+    return err;
+}
+
+void ts_socket_close(ts_socket_t *sock) {
+    if (!sock)
+        return;
+    nl_socket_free(sock->nl);
+    free(sock);
+}
+
+/* Builds a TASKSTATS_CMD_GET with one attribute at buf, without NLM_F_ACK:
+ * each request gets either its reply or an error. */
+static size_t put_request(ts_socket_t *sock, char *buf, int attr, const void *data,
+                          size_t size) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct genlmsghdr *gnlh = (struct genlmsghdr *)NLMSG_DATA(nlh);
+    struct nlattr *na = (struct nlattr *)((char *)gnlh + GENL_HDRLEN);
+
+    na->nla_type = attr;
+    na->nla_len = NLA_HDRLEN + size;
+    memcpy((char *)na + NLA_HDRLEN, data, size);
+
+    nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(na->nla_len));
+    nlh->nlmsg_type = sock->family_id;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = ++sock->seq;
+    nlh->nlmsg_pid = 0;
+
+    gnlh->cmd = TASKSTATS_CMD_GET;
+    gnlh->version = TASKSTATS_VERSION;
+    gnlh->reserved = 0;
+
+    return NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static int send_requests(ts_socket_t *sock, size_t len) {
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+    if (sendto(sock->fd, sock->send_buf, len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0)
+        return errno;
+    return 0;
+}
+
+/* Calls fn for the AGGR_PID and AGGR_TGID attributes of a reply. */
+static void parse_reply(struct nlmsghdr *nlh, ts_stats_fn fn, void *arg) {
+    struct nlattr *na = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+    int remaining = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+    for (; remaining >= NLA_HDRLEN && na->nla_len >= NLA_HDRLEN && na->nla_len <= remaining;
+         remaining -= NLA_ALIGN(na->nla_len),
+         na = (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len))) {
+        int type = na->nla_type & NLA_TYPE_MASK;
+        struct nlattr *nested;
+        int nested_remaining;
+        struct taskstats stats;
+        pid_t pid = -1;
+        int have_stats = 0;
+
+        if (type != TASKSTATS_TYPE_AGGR_PID && type != TASKSTATS_TYPE_AGGR_TGID)
+            continue;
+
+        nested = (struct nlattr *)((char *)na + NLA_HDRLEN);
+        nested_remaining = na->nla_len - NLA_HDRLEN;
+        for (; nested_remaining >= NLA_HDRLEN && nested->nla_len >= NLA_HDRLEN &&
+               nested->nla_len <= nested_remaining;
+             nested_remaining -= NLA_ALIGN(nested->nla_len),
+             nested = (struct nlattr *)((char *)nested + NLA_ALIGN(nested->nla_len))) {
+            void *data = (char *)nested + NLA_HDRLEN;
+            size_t len = nested->nla_len - NLA_HDRLEN;
+
+            switch (nested->nla_type & NLA_TYPE_MASK) {
+            case TASKSTATS_TYPE_PID:
+            case TASKSTATS_TYPE_TGID:
+                memcpy(&pid, data, sizeof(uint32_t));
+                break;
+            case TASKSTATS_TYPE_STATS:
+                /* The kernel's struct may be older or newer than ours */
+                memset(&stats, 0, sizeof(stats));
+                memcpy(&stats, data, len < sizeof(stats) ? len : sizeof(stats));
+                have_stats = 1;
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (pid >= 0 && have_stats)
+            fn(type == TASKSTATS_TYPE_AGGR_PID ? TASKSTATS_TYPE_PID : TASKSTATS_TYPE_TGID,
+               pid, &stats, arg);
+    }
+}
+
+/* Reads one datagram and parses its messages, counting the replies and the
+ * errors in responses. Returns 0, EAGAIN if there is nothing to read or an
+ * errno. */
+static int receive(ts_socket_t *sock, int flags, ts_stats_fn fn, void *arg,
+                   size_t *responses) {
+    struct nlmsghdr *nlh;
+    ssize_t len;
+
+    len = recv(sock->fd, sock->recv_buf, sizeof(sock->recv_buf), flags);
+    if (len < 0)
+        return errno == EWOULDBLOCK ? EAGAIN : errno;
+
+    for (nlh = (struct nlmsghdr *)sock->recv_buf; NLMSG_OK(nlh, (size_t)len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+        if (nlh->nlmsg_type == NLMSG_ERROR || nlh->nlmsg_type == NLMSG_DONE) {
+            /* Requests for tasks that are gone get an error instead */
+            (*responses)++;
+        } else if (nlh->nlmsg_type == sock->family_id) {
+            (*responses)++;
+            parse_reply(nlh, fn, arg);
+        }
+    }
+    return 0;
+}
+
+int ts_get_stats_batch(ts_socket_t *sock, int attr, const pid_t *pids, size_t num_pids,
+                       ts_stats_fn fn, void *arg) {
+    size_t start, i, len, responses, expected;
+    int err;
+
+    if (!sock || (!pids && num_pids) || !fn)
+        return EINVAL;
+
+    responses = 0;
+    for (start = 0; start < num_pids; start += TS_BATCH_SIZE) {
+        size_t end = start + TS_BATCH_SIZE < num_pids ? start + TS_BATCH_SIZE : num_pids;
+
+        /* All the requests of the batch go in one send */
+        len = 0;
+        for (i = start; i < end; i++) {
+            uint32_t pid = pids[i];
+            len += put_request(sock, sock->send_buf + len, attr, &pid, sizeof(pid));
+        }
+        err = send_requests(sock, len);
+        if (err)
+            return err;
+
+        expected = responses + (end - start);
+        while (responses < expected) {
+            err = receive(sock, 0, fn, arg, &responses);
+            if (err && err != EINTR)
+                return err;
+        }
+    }
+    return 0;
+}
+
+struct single_stats {
+    struct taskstats *stats;
+    int found;
+};
+
+static void copy_stats(int type, pid_t pid, const struct taskstats *stats, void *arg) {
+    struct single_stats *single = arg;
+
+    *single->stats = *stats;
+    single->found = 1;
+}
+
+int ts_get_stats(ts_socket_t *sock, int attr, pid_t pid, struct taskstats *stats) {
+    struct single_stats single = { .stats = stats };
+    int err;
+
+    if (!stats)
+        return EINVAL;
+
+    err = ts_get_stats_batch(sock, attr, &pid, 1, copy_stats, &single);
+    if (err)
+        return err;
+    return single.found ? 0 : ESRCH;
+}
+
+int ts_register_exits(ts_socket_t *sock, const char *cpumask) {
+    char all_cpus[32];
+    struct nlmsghdr *nlh;
+    size_t len;
+    ssize_t recv_len;
+    int err;
+
+    if (!sock)
+        return EINVAL;
+
+    if (!cpumask) {
+        snprintf(all_cpus, sizeof(all_cpus), "0-%ld", sysconf(_SC_NPROCESSORS_CONF) - 1);
+        cpumask = all_cpus;
+    }
+    if (strlen(cpumask) + 1 > sizeof(sock->send_buf) - TS_REQUEST_SIZE)
+        return EINVAL;
+
+    len = put_request(sock, sock->send_buf, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpumask,
+                      strlen(cpumask) + 1);
+    nlh = (struct nlmsghdr *)sock->send_buf;
+    nlh->nlmsg_flags |= NLM_F_ACK;
+    err = send_requests(sock, len);
+    if (err)
+        return err;
+
+    recv_len = recv(sock->fd, sock->recv_buf, sizeof(sock->recv_buf), 0);
+    if (recv_len < 0)
+        return errno;
+    nlh = (struct nlmsghdr *)sock->recv_buf;
+    if (NLMSG_OK(nlh, (size_t)recv_len) && nlh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *nlerr = NLMSG_DATA(nlh);
+        if (nlerr->error)
+            return -nlerr->error;
+    }
+
+    nl_socket_set_buffer_size(sock->nl, TS_EXITS_BUFFER_SIZE, 0);
+    nl_socket_set_nonblocking(sock->nl);
+    return 0;
+}
+
+int ts_read_exits(ts_socket_t *sock, ts_stats_fn fn, void *arg, size_t *dropped) {
+    size_t responses = 0;
+    int err;
+
+    if (!sock || !fn)
+        return EINVAL;
+
+    while (1) {
+        err = receive(sock, MSG_DONTWAIT, fn, arg, &responses);
+        if (err == EAGAIN)
+            return 0;
+        if (err == ENOBUFS) {
+            /* The receive buffer overflowed, the exits lost are handled
+             * like those of tasks that were not followed */
+            if (dropped)
+                (*dropped)++;
+            continue;
+        }
+        if (err && err != EINTR)
+            return err;
+    }
+}
@@ -3,6 +3,7 @@ import subprocess
 import matplotlib.pyplot as plt
 import time
 import argparse
+import json
 
 parser = argparse.ArgumentParser(description="Graph memcpy perf")
 parser.add_argument("--files", nargs='+', type=str, help="files to graph", default=None)
@@ -20,11 +21,19 @@ for arg in args.files:
 	f = open(arg)
 	size = []
 	perf = []
-	for line in f:
-		# size: 11430912, perf: 6.76051GB/s, iter: 5
-		line_split = line.split(",")
-		size.append(float(line_split[0].split(":")[1]))
-		perf.append(float(line_split[1].split(":")[1].split("G")[0]))
+	if f.read(1) == "{":
+		# memcpy-perf --json
+		f.seek(0)
+		for point in json.load(f)["sweep"]:
+			size.append(point["size"])
+			perf.append(point["gb_per_sec"])
+	else:
+		f.seek(0)
+		for line in f:
+			# size: 11430912, perf: 6.76051GB/s, iter: 5
+			line_split = line.split(",")
+			size.append(float(line_split[0].split(":")[1]))
+			perf.append(float(line_split[1].split(":")[1].split("G")[0]))
 
 	line, = ax.plot(size, perf, '-',  linewidth=0.2, label=arg)
 
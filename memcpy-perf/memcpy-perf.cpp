@@ -4,9 +4,14 @@
 #include <algorithm>
 #include <numeric>
 #include <stdlib.h>
+#include <string.h>
 #include <memory>
 #include <cmath>
 #include <string>
+#include <atomic>
+#include <thread>
+#include <sched.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -16,8 +21,15 @@ const size_t samples = 2048;
 size_t size_per_test = 64 * (1ull << 20);
 size_t tot_sum = 0;
 
+// Sizes and offsets of the misalignment matrix
+const size_t align_sizes[] = { 64, 4096, 256 * 1024 };
+const size_t align_max_offset = 16;
+const size_t align_size_per_test = 16 * (1ull << 20);
+
 void __attribute__((noinline)) memcpy_noinline(void *dst, void *src, size_t size);
 void __attribute__((noinline)) memset_noinline(void *dst, int value, size_t size);
+void __attribute__((noinline)) memcpy_nt_noinline(void *dst, void *src, size_t size);
+void __attribute__((noinline)) memset_nt_noinline(void *dst, int value, size_t size);
 uint64_t __attribute__((noinline)) sum(volatile void *src, size_t size);
 
 enum BenchType {
@@ -26,26 +38,200 @@ enum BenchType {
     SumBench,
 };
 
+static const char *bench_names[] = { "memcpy", "memset", "sum" };
+
+struct Options {
+    BenchType type = MemcpyBench;
+    // Non-temporal stores, for memcpy and memset
+    bool nt = false;
+    bool align = false;
+    bool threads = false;
+    bool json = false;
+};
+
+struct SweepPoint {
+    size_t size;
+    double gb_per_sec;
+    size_t iter;
+};
+
+// Runs one benchmark of size bytes, repeated to cover about bytes_per_test,
+// and returns its bandwidth. memcpy counts both the read and the write.
+static double run_bench(const Options &opts, uint8_t *dst, uint8_t *src, size_t cur_size,
+                        size_t bytes_per_test, size_t *iter)
+{
+    chrono::time_point<chrono::high_resolution_clock> copy_start, copy_end;
+    size_t iter_per_size = max<size_t>(1, bytes_per_test / cur_size);
+
+    // run benchmark
+    switch (opts.type) {
+        case MemsetBench: {
+            auto set = opts.nt ? memset_nt_noinline : memset_noinline;
+            memcpy_noinline(src, dst, cur_size);
+            set(dst, 0xdeadbeef, cur_size);
+            copy_start = chrono::high_resolution_clock::now();
+            for (int i = 0; i < iter_per_size; i++) {
+                set(dst, 0xdeadbeef, cur_size);
+            }
+            copy_end = chrono::high_resolution_clock::now();
+            break;
+        }
+        case MemcpyBench: {
+            auto copy = opts.nt ? memcpy_nt_noinline : memcpy_noinline;
+            copy(dst, src, cur_size);
+            copy(src, dst, cur_size);
+            copy_start = chrono::high_resolution_clock::now();
+            for (int i = 0; i < iter_per_size; i++) {
+                copy(dst, src, cur_size);
+            }
+            copy_end = chrono::high_resolution_clock::now();
+            break;
+        }
+        case SumBench: {
+            uint64_t s = 0;
+            s += sum(src, cur_size);
+            copy_start = chrono::high_resolution_clock::now();
+            for (int i = 0; i < iter_per_size; i++) {
+                s += sum(src, cur_size);
+            }
+            copy_end = chrono::high_resolution_clock::now();
+            tot_sum += s;
+            break;
+        }
+    }
+
+    double ns_per_copy = chrono::duration_cast<chrono::nanoseconds>(copy_end - copy_start).count() / double(iter_per_size);
+    double gb_per_sec = ((double)cur_size / (1ull<<30)) / (ns_per_copy / 1.0E9);
+    if (opts.type == MemcpyBench)
+        gb_per_sec *= 2.0;
+    if (iter)
+        *iter = iter_per_size;
+    return gb_per_sec;
+}
+
+// Finds the sizes where the bandwidth of the sweep drops off a plateau:
+// at each point, the median bandwidth of the window of points before is
+// compared with that of the window after, and the largest ratios above
+// 1.25, at least a factor of two in size apart, are taken as the ends of
+// the cache levels, smallest first.
+static vector<size_t> detect_cache_levels(const vector<SweepPoint> &sweep)
+{
+    const size_t window = sweep.size() / 32;
+    const double min_drop = 1.25;
+    const size_t max_levels = 4;
+    if (window == 0 || sweep.size() < window * 2 + 1)
+        return {};
+
+    auto median = [&](size_t begin, size_t end) {
+        vector<double> values;
+        for (size_t i = begin; i < end; i++)
+            values.push_back(sweep[i].gb_per_sec);
+        nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        return values[values.size() / 2];
+    };
+    vector<pair<double, size_t>> drops;
+    for (size_t i = window; i + window <= sweep.size(); i++) {
+        double after = median(i, i + window);
+        if (after > 0)
+            drops.emplace_back(median(i - window, i) / after, i);
+    }
+    sort(drops.begin(), drops.end(), greater<pair<double, size_t>>());
+
+    vector<size_t> levels;
+    for (auto &drop : drops) {
+        if (drop.first < min_drop || levels.size() == max_levels)
+            break;
+        size_t size = sweep[drop.second].size;
+        bool close = false;
+        for (size_t level : levels)
+            close |= size < level * 2 && level < size * 2;
+        if (!close)
+            levels.push_back(size);
+    }
+    sort(levels.begin(), levels.end());
+    return levels;
+}
+
+// Runs the benchmark on 1 to all cpus at once, each thread pinned to its
+// own cpu with its own buffers of size_end bytes, and returns the total
+// bandwidth for each thread count.
+static vector<double> run_threads(const Options &opts)
+{
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    vector<double> results;
+    for (int n = 1; n <= cpus; n++) {
+        atomic<int> ready{0};
+        vector<double> gb_per_sec(n);
+        vector<thread> threads;
+        for (int t = 0; t < n; t++) {
+            threads.emplace_back([&, t]() {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(t, &set);
+                sched_setaffinity(0, sizeof(set), &set);
+                unique_ptr<uint8_t[]> src(new uint8_t[size_end]);
+                unique_ptr<uint8_t[]> dst(new uint8_t[size_end]);
+                memset(src.get(), 1, size_end);
+                memset(dst.get(), 1, size_end);
+                // Start together, so the threads compete for the whole run
+                ready++;
+                while (ready < n)
+                    ;
+                gb_per_sec[t] = run_bench(opts, dst.get(), src.get(), size_end,
+                                          size_per_test * 4, nullptr);
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        results.push_back(accumulate(gb_per_sec.begin(), gb_per_sec.end(), 0.0));
+    }
+    return results;
+}
+
+static void usage()
+{
+    cerr << "memcpy_perf [--memcpy|--memset|--sum] [--nt] [--align] [--threads] [--json]" << endl
+         << "  --nt       use non-temporal stores for memcpy and memset" << endl
+         << "  --align    also measure every src and dst offset from 0 to "
+         << align_max_offset - 1 << endl
+         << "  --threads  also measure the total bandwidth of 1 to all cpus" << endl
+         << "  --json     print all results as one JSON object" << endl;
+}
+
 int main(int argc, char *argv[])
 {
-    BenchType type;
+    Options opts;
     if (argc <= 1) {
-        cerr << "memcpy_perf [--memcpy|--memset|--sum]" << endl;
+        usage();
         return 0;
     }
-    if (string(argv[1]) == string("--memcpy")) {
-        type = MemcpyBench;
-    } else if (string(argv[1]) == string("--memset")) {
-        type = MemsetBench;
-    } else if (string(argv[1]) == string("--sum")) {
-        type = SumBench;
-    } else {
-        type = MemcpyBench;
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg == "--memcpy") {
+            opts.type = MemcpyBench;
+        } else if (arg == "--memset") {
+            opts.type = MemsetBench;
+        } else if (arg == "--sum") {
+            opts.type = SumBench;
+        } else if (arg == "--nt") {
+            opts.nt = true;
+        } else if (arg == "--align") {
+            opts.align = true;
+        } else if (arg == "--threads") {
+            opts.threads = true;
+        } else if (arg == "--json") {
+            opts.json = true;
+        } else {
+            usage();
+            return 1;
+        }
     }
+    if (opts.type == SumBench)
+        opts.nt = false;
 
-    unique_ptr<uint8_t[]> src(new uint8_t[size_end]);
-    unique_ptr<uint8_t[]> dst(new uint8_t[size_end]);
-    memset(src.get(), 1, size_end);
+    unique_ptr<uint8_t[]> src(new uint8_t[size_end + align_max_offset]);
+    unique_ptr<uint8_t[]> dst(new uint8_t[size_end + align_max_offset]);
+    memset(src.get(), 1, size_end + align_max_offset);
 
     double start_pow = log10(size_start);
     double end_pow = log10(size_end);
@@ -54,52 +240,87 @@ int main(int argc, char *argv[])
     //cout << "src: " << (uintptr_t)src.get() << endl;
     //cout << "dst: " <<  (uintptr_t)dst.get() << endl;
 
+    vector<SweepPoint> sweep;
     for (double cur_pow = start_pow; cur_pow <= end_pow; cur_pow += pow_inc) {
-        chrono::time_point<chrono::high_resolution_clock> copy_start, copy_end;
-
-        size_t cur_size = (size_t)pow(10.0, cur_pow);
-        size_t iter_per_size = size_per_test / cur_size;
-
-        // run benchmark
-        switch (type) {
-            case MemsetBench: {
-                memcpy_noinline(src.get(), dst.get(), cur_size);
-                memset_noinline(dst.get(), 0xdeadbeef, cur_size);
-                copy_start = chrono::high_resolution_clock::now();
-                for (int i = 0; i < iter_per_size; i++) {
-                    memset_noinline(dst.get(), 0xdeadbeef, cur_size);
+        SweepPoint point;
+        point.size = (size_t)pow(10.0, cur_pow);
+        point.gb_per_sec = run_bench(opts, dst.get(), src.get(), point.size, size_per_test,
+                                     &point.iter);
+        sweep.push_back(point);
+        if (!opts.json)
+            cout << "size: " << point.size << ", perf: " << point.gb_per_sec << "GB/s, iter: " << point.iter << endl;
+    }
+    vector<size_t> levels = detect_cache_levels(sweep);
+
+    vector<double> align;
+    if (opts.align) {
+        for (size_t size : align_sizes) {
+            for (size_t src_offset = 0; src_offset < align_max_offset; src_offset++) {
+                for (size_t dst_offset = 0; dst_offset < align_max_offset; dst_offset++) {
+                    align.push_back(run_bench(opts, dst.get() + dst_offset, src.get() + src_offset,
+                                              size, align_size_per_test, nullptr));
                 }
-                copy_end = chrono::high_resolution_clock::now();
-                break;
             }
-            case MemcpyBench: {
-                memcpy_noinline(dst.get(), src.get(), cur_size);
-                memcpy_noinline(src.get(), dst.get(), cur_size);
-                copy_start = chrono::high_resolution_clock::now();
-                for (int i = 0; i < iter_per_size; i++) {
-                    memcpy_noinline(dst.get(), src.get(), cur_size);
-                }
-                copy_end = chrono::high_resolution_clock::now();
-                break;
+        }
+    }
+
+    vector<double> threads;
+    if (opts.threads)
+        threads = run_threads(opts);
+
+    if (!opts.json) {
+        // On stderr, so the output still graphs with graph_memcpy.py
+        for (size_t i = 0; i < levels.size(); i++)
+            cerr << "cache level " << i + 1 << ": up to about " << levels[i] << " bytes" << endl;
+        size_t n = 0;
+        for (size_t i = 0; i < align.size() / (align_max_offset * align_max_offset); i++) {
+            cerr << "align size " << align_sizes[i] << " (rows src offset, columns dst offset):" << endl;
+            for (size_t s = 0; s < align_max_offset; s++) {
+                for (size_t d = 0; d < align_max_offset; d++)
+                    cerr << " " << align[n++];
+                cerr << endl;
             }
-            case SumBench: {
-                uint64_t s = 0;
-                s += sum(src.get(), cur_size);
-                copy_start = chrono::high_resolution_clock::now();
-                for (int i = 0; i < iter_per_size; i++) {
-                    s += sum(src.get(), cur_size);
+        }
+        for (size_t i = 0; i < threads.size(); i++)
+            cerr << "threads: " << i + 1 << ", perf: " << threads[i] << "GB/s" << endl;
+        return 0;
+    }
+
+    cout << "{" << endl;
+    cout << "  \"bench\": \"" << bench_names[opts.type] << "\"," << endl;
+    cout << "  \"nontemporal\": " << (opts.nt ? "true" : "false") << "," << endl;
+    cout << "  \"sweep\": [" << endl;
+    for (size_t i = 0; i < sweep.size(); i++) {
+        cout << "    {\"size\": " << sweep[i].size << ", \"gb_per_sec\": " << sweep[i].gb_per_sec
+             << ", \"iter\": " << sweep[i].iter << "}" << (i + 1 < sweep.size() ? "," : "") << endl;
+    }
+    cout << "  ]," << endl;
+    cout << "  \"cache_levels\": [";
+    for (size_t i = 0; i < levels.size(); i++)
+        cout << (i ? ", " : "") << levels[i];
+    cout << "]";
+    if (opts.align) {
+        cout << "," << endl << "  \"alignment\": [" << endl;
+        size_t n = 0;
+        for (size_t i = 0; i < align.size() / (align_max_offset * align_max_offset); i++) {
+            for (size_t s = 0; s < align_max_offset; s++) {
+                for (size_t d = 0; d < align_max_offset; d++, n++) {
+                    cout << "    {\"size\": " << align_sizes[i] << ", \"src_offset\": " << s
+                         << ", \"dst_offset\": " << d << ", \"gb_per_sec\": " << align[n] << "}"
+                         << (n + 1 < align.size() ? "," : "") << endl;
                 }
-                copy_end = chrono::high_resolution_clock::now();
-                tot_sum += s;
-                break;
             }
         }
-
-        double ns_per_copy = chrono::duration_cast<chrono::nanoseconds>(copy_end - copy_start).count() / double(iter_per_size);
-        double gb_per_sec = ((double)cur_size / (1ull<<30)) / (ns_per_copy / 1.0E9);
-        if (type == MemcpyBench)
-            gb_per_sec *= 2.0;
-        cout << "size: " << cur_size << ", perf: " << gb_per_sec << "GB/s, iter: " << iter_per_size << endl;
+        cout << "  ]";
+    }
+    if (opts.threads) {
+        cout << "," << endl << "  \"threads\": [" << endl;
+        for (size_t i = 0; i < threads.size(); i++) {
+            cout << "    {\"threads\": " << i + 1 << ", \"gb_per_sec\": " << threads[i] << "}"
+                 << (i + 1 < threads.size() ? "," : "") << endl;
+        }
+        cout << "  ]";
     }
+    cout << endl << "}" << endl;
     return 0;
 }
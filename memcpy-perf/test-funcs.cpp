@@ -1,3 +1,5 @@
+#include <stdint.h>
+#include <string.h>
 #include <string>
 
 void __attribute__((noinline)) memcpy_noinline(void *dst, void *src, size_t size)
@@ -19,3 +21,70 @@ uint64_t __attribute__((noinline)) sum(volatile void *src, size_t size)
         sum += src_ptr[i];
     return sum;
 }
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__clang__)
+static inline void store_nt(uint64_t *dst, uint64_t value)
+{
+    __builtin_nontemporal_store(value, dst);
+}
+#elif defined(__x86_64__)
+static inline void store_nt(uint64_t *dst, uint64_t value)
+{
+    _mm_stream_si64((long long*)dst, value);
+}
+#else
+static inline void store_nt(uint64_t *dst, uint64_t value)
+{
+    *dst = value;
+}
+#endif
+
+// Non-temporal stores on x86 are weakly ordered, so fence them like a
+// real streaming copy would.
+static inline void fence_nt()
+{
+#if defined(__x86_64__)
+    _mm_sfence();
+#endif
+}
+
+// Bytes up to the next 8 byte boundary of dst, which the non-temporal
+// loops copy or set with plain stores.
+static inline size_t nt_head(void *dst, size_t size)
+{
+    size_t head = (8 - ((uintptr_t)dst & 7)) & 7;
+    return head < size ? head : size;
+}
+
+void __attribute__((noinline)) memcpy_nt_noinline(void *dst, void *src, size_t size)
+{
+    size_t head = nt_head(dst, size);
+    memcpy(dst, src, head);
+    uint64_t *dst_ptr = (uint64_t*)((uint8_t*)dst + head);
+    uint8_t *src_ptr = (uint8_t*)src + head;
+    size_t len = (size - head) / sizeof(uint64_t);
+    for (size_t i = 0; i < len; i++) {
+        uint64_t value;
+        memcpy(&value, src_ptr + i * sizeof(uint64_t), sizeof(value));
+        store_nt(dst_ptr + i, value);
+    }
+    memcpy(dst_ptr + len, src_ptr + len * sizeof(uint64_t), (size - head) % sizeof(uint64_t));
+    fence_nt();
+}
+
+void __attribute__((noinline)) memset_nt_noinline(void *dst, int value, size_t size)
+{
+    size_t head = nt_head(dst, size);
+    memset(dst, value, head);
+    uint64_t *dst_ptr = (uint64_t*)((uint8_t*)dst + head);
+    uint64_t value64 = 0x0101010101010101ull * (uint8_t)value;
+    size_t len = (size - head) / sizeof(uint64_t);
+    for (size_t i = 0; i < len; i++)
+        store_nt(dst_ptr + i, value64);
+    memset(dst_ptr + len, value, (size - head) % sizeof(uint64_t));
+    fence_nt();
+}
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include <new>
@@ -56,10 +57,8 @@ class AllocAction : public Action {
 
 class MallocAction : public AllocAction {
  public:
-  MallocAction(uintptr_t key_pointer, const char* line) : AllocAction(key_pointer) {
-    if (sscanf(line, "%zu", &size_) != 1) {
-      is_error_ = true;
-    }
+  MallocAction(uintptr_t key_pointer, size_t size) : AllocAction(key_pointer) {
+    size_ = size;
   }
 
   uint64_t Execute(Pointers* pointers) override {
@@ -76,10 +75,9 @@ class MallocAction : public AllocAction {
 
 class CallocAction : public AllocAction {
  public:
-  CallocAction(uintptr_t key_pointer, const char* line) : AllocAction(key_pointer) {
-    if (sscanf(line, "%zu %zu", &n_elements_, &size_) != 2) {
-      is_error_ = true;
-    }
+  CallocAction(uintptr_t key_pointer, size_t n_elements, size_t size)
+      : AllocAction(key_pointer), n_elements_(n_elements) {
+    size_ = size;
   }
 
   uint64_t Execute(Pointers* pointers) override {
@@ -99,10 +97,9 @@ class CallocAction : public AllocAction {
 
 class ReallocAction : public AllocAction {
  public:
-  ReallocAction(uintptr_t key_pointer, const char* line) : AllocAction(key_pointer) {
-    if (sscanf(line, "%" SCNxPTR " %zu", &old_pointer_, &size_) != 2) {
-      is_error_ = true;
-    }
+  ReallocAction(uintptr_t key_pointer, uintptr_t old_pointer, size_t size)
+      : AllocAction(key_pointer), old_pointer_(old_pointer) {
+    size_ = size;
   }
 
   bool DoesFree() override { return old_pointer_ != 0; }
@@ -129,10 +126,9 @@ class ReallocAction : public AllocAction {
 
 class MemalignAction : public AllocAction {
  public:
-  MemalignAction(uintptr_t key_pointer, const char* line) : AllocAction(key_pointer) {
-    if (sscanf(line, "%zu %zu", &align_, &size_) != 2) {
-      is_error_ = true;
-    }
+  MemalignAction(uintptr_t key_pointer, size_t align, size_t size)
+      : AllocAction(key_pointer), align_(align) {
+    size_ = size;
   }
 
   uint64_t Execute(Pointers* pointers) override {
@@ -176,25 +172,94 @@ size_t Action::MaxActionSize() {
   return MAX(max, sizeof(FreeAction));
 }
 
-Action* Action::CreateAction(uintptr_t key_pointer, const char* type,
-                             const char* line, void* action_memory) {
-  Action* action = nullptr;
+bool Action::ParseAction(const char* type, const char* line, ActionEntry* entry) {
+  uintptr_t old_pointer;
+  size_t n;
+  entry->size = 0;
+  entry->arg = 0;
   if (strcmp(type, "malloc") == 0) {
-    action = new (action_memory) MallocAction(key_pointer, line);
+    entry->type = ACTION_MALLOC;
+    if (sscanf(line, "%zu", &n) != 1) {
+      return false;
+    }
+    entry->size = n;
+    return true;
   } else if (strcmp(type, "free") == 0) {
-    action = new (action_memory) FreeAction(key_pointer);
+    entry->type = ACTION_FREE;
+    return true;
   } else if (strcmp(type, "calloc") == 0) {
-    action = new (action_memory) CallocAction(key_pointer, line);
+    entry->type = ACTION_CALLOC;
+    size_t size;
+    if (sscanf(line, "%zu %zu", &n, &size) != 2) {
+      return false;
+    }
+    entry->arg = n;
+    entry->size = size;
+    return true;
   } else if (strcmp(type, "realloc") == 0) {
-    action = new (action_memory) ReallocAction(key_pointer, line);
+    entry->type = ACTION_REALLOC;
+    if (sscanf(line, "%" SCNxPTR " %zu", &old_pointer, &n) != 2) {
+      return false;
+    }
+    entry->arg = old_pointer;
+    entry->size = n;
+    return true;
   } else if (strcmp(type, "memalign") == 0) {
-    action = new (action_memory) MemalignAction(key_pointer, line);
+    entry->type = ACTION_MEMALIGN;
+    size_t size;
+    if (sscanf(line, "%zu %zu", &n, &size) != 2) {
+      return false;
+    }
+    entry->arg = n;
+    entry->size = size;
+    return true;
   } else if (strcmp(type, "thread_done") == 0) {
-    action = new (action_memory) EndThreadAction();
+    entry->type = ACTION_THREAD_DONE;
+    return true;
   }
+  return false;
+}
+
+bool Action::ParseLine(const char* line, ActionEntry* entry) {
+  pid_t tid;
+  int line_pos = 0;
+  char type[128];
+  uintptr_t key_pointer;
+
+  if (sscanf(line, "%d: %127s %" SCNxPTR " %n", &tid, type, &key_pointer, &line_pos) != 3) {
+    return false;
+  }
+  entry->tid = tid;
+  entry->key_pointer = key_pointer;
+  return ParseAction(type, line + line_pos, entry);
+}
 
-  if (action == nullptr || action->IsError()) {
+Action* Action::CreateAction(uintptr_t key_pointer, const char* type,
+                             const char* line, void* action_memory) {
+  ActionEntry entry;
+  if (!ParseAction(type, line, &entry)) {
     return nullptr;
   }
-  return action;
+  entry.tid = 0;
+  entry.key_pointer = key_pointer;
+  return CreateAction(entry, action_memory);
+}
+
+Action* Action::CreateAction(const ActionEntry& entry, void* action_memory) {
+  uintptr_t key_pointer = entry.key_pointer;
+  switch (entry.type) {
+    case ACTION_MALLOC:
+      return new (action_memory) MallocAction(key_pointer, entry.size);
+    case ACTION_FREE:
+      return new (action_memory) FreeAction(key_pointer);
+    case ACTION_CALLOC:
+      return new (action_memory) CallocAction(key_pointer, entry.arg, entry.size);
+    case ACTION_REALLOC:
+      return new (action_memory) ReallocAction(key_pointer, entry.arg, entry.size);
+    case ACTION_MEMALIGN:
+      return new (action_memory) MemalignAction(key_pointer, entry.arg, entry.size);
+    case ACTION_THREAD_DONE:
+      return new (action_memory) EndThreadAction();
+  }
+  return nullptr;
 }
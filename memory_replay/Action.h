@@ -21,6 +21,26 @@
 
 class Pointers;
 
+enum ActionType : uint32_t {
+  ACTION_MALLOC = 0,
+  ACTION_CALLOC,
+  ACTION_REALLOC,
+  ACTION_MEMALIGN,
+  ACTION_FREE,
+  ACTION_THREAD_DONE,
+};
+
+// An action with its arguments already parsed, as stored in compiled dumps.
+struct ActionEntry {
+  int32_t tid;
+  uint32_t type;
+  uint64_t key_pointer;
+  uint64_t size;
+  // The number of elements for calloc, the old pointer for realloc and
+  // the alignment for memalign.
+  uint64_t arg;
+};
+
 class Action {
  public:
   Action() {}
@@ -28,8 +48,6 @@ class Action {
 
   virtual uint64_t Execute(Pointers* pointers) = 0;
 
-  bool IsError() { return is_error_; };
-
   virtual bool EndThread() { return false; }
 
   virtual bool DoesFree() { return false; }
@@ -37,9 +55,14 @@ class Action {
   static size_t MaxActionSize();
   static Action* CreateAction(uintptr_t key_pointer, const char* type,
                               const char* line, void* action_memory);
+  static Action* CreateAction(const ActionEntry& entry, void* action_memory);
 
- protected:
-  bool is_error_ = false;
+  // Parses the type and the arguments of an action from a dump line into
+  // an entry. Does not set the tid or the key pointer.
+  static bool ParseAction(const char* type, const char* line, ActionEntry* entry);
+  // Parses a whole dump line of the form:
+  //   <tid>: <action_type> <pointer> [<arguments>]
+  static bool ParseLine(const char* line, ActionEntry* entry);
 };
 
 #endif // _MEMORY_REPLAY_ACTION_H
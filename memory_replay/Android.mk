@@ -2,11 +2,15 @@ LOCAL_PATH := $(call my-dir)
 
 memory_replay_src_files := \
 	Action.cpp \
+	CompiledDump.cpp \
+	LatencyStats.cpp \
 	LineBuffer.cpp \
 	NativeInfo.cpp \
+	ParallelReplay.cpp \
 	Pointers.cpp \
 	Thread.cpp \
 	Threads.cpp \
+	Timeline.cpp \
 
 include $(CLEAR_VARS)
 
@@ -29,13 +33,39 @@ LOCAL_MODULE_HOST_OS := linux
 LOCAL_LDLIBS := -lrt
 include $(BUILD_HOST_EXECUTABLE)
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := Compare.cpp compare_main.cpp
+LOCAL_CFLAGS := -Wall -Wextra -Werror
+LOCAL_MODULE_TAGS := debug
+LOCAL_MODULE := memory_replay_compare
+LOCAL_MULTILIB := both
+LOCAL_MODULE_STEM_32 := $(LOCAL_MODULE)32
+LOCAL_MODULE_STEM_64 := $(LOCAL_MODULE)64
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := Compare.cpp compare_main.cpp
+LOCAL_CFLAGS := -Wall -Wextra -Werror
+LOCAL_MODULE_TAGS := debug
+LOCAL_MODULE := memory_replay_compare
+LOCAL_MODULE_HOST_OS := linux
+include $(BUILD_HOST_EXECUTABLE)
+
 memory_replay_test_src_files := \
+	Compare.cpp \
 	tests/ActionTest.cpp \
+	tests/CompareTest.cpp \
+	tests/CompiledDumpTest.cpp \
+	tests/LatencyStatsTest.cpp \
 	tests/LineBufferTest.cpp \
 	tests/NativeInfoTest.cpp \
+	tests/ParallelReplayTest.cpp \
 	tests/PointersTest.cpp \
 	tests/ThreadTest.cpp \
 	tests/ThreadsTest.cpp \
+	tests/TimelineTest.cpp \
 
 include $(CLEAR_VARS)
 
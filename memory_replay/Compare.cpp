@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "Compare.h"
+
+bool ParseReplayOutput(const std::string& output, RunResult* result) {
+  const char* label = "Total Allocation/Free Time: ";
+  size_t pos = output.find(label);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  return sscanf(output.c_str() + pos + strlen(label), "%" SCNu64 "ns",
+                &result->time_nsecs) == 1;
+}
+
+bool ParseTimelineCsv(const std::string& csv, RunResult* result) {
+  size_t num_samples = 0;
+  uint64_t peak_pss_bytes = 0;
+  uint64_t pss_bytes = 0;
+  // Skip the header line.
+  for (size_t pos = csv.find('\n'); pos != std::string::npos; pos = csv.find('\n', pos + 1)) {
+    if (sscanf(csv.c_str() + pos + 1, "%*[^,],%*u,%" SCNu64 ",", &pss_bytes) != 1) {
+      continue;
+    }
+    if (pss_bytes > peak_pss_bytes) {
+      peak_pss_bytes = pss_bytes;
+    }
+    num_samples++;
+  }
+  if (num_samples == 0) {
+    return false;
+  }
+  result->peak_pss_bytes = peak_pss_bytes;
+  result->final_pss_bytes = pss_bytes;
+  return true;
+}
+
+double RunStats::Mean() const {
+  if (values_.empty()) {
+    return 0;
+  }
+  double sum = 0;
+  for (double value : values_) {
+    sum += value;
+  }
+  return sum / values_.size();
+}
+
+double RunStats::StdDev() const {
+  if (values_.size() < 2) {
+    return 0;
+  }
+  double mean = Mean();
+  double sum = 0;
+  for (double value : values_) {
+    sum += (value - mean) * (value - mean);
+  }
+  return sqrt(sum / (values_.size() - 1));
+}
+
+double RunStats::ConfidenceInterval95() const {
+  // Two sided 97.5% quantiles of the t distribution for 1 to 30 degrees
+  // of freedom; past that the normal quantile is close enough.
+  static constexpr double kT975[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+  };
+  size_t n = values_.size();
+  if (n < 2) {
+    return 0;
+  }
+  size_t df = n - 1;
+  double t = df <= sizeof(kT975) / sizeof(kT975[0]) ? kT975[df - 1] : 1.960;
+  return t * StdDev() / sqrt(n);
+}
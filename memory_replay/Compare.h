@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORY_REPLAY_COMPARE_H
+#define _MEMORY_REPLAY_COMPARE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+// The numbers memory_replay_compare takes from one run of memory_replay.
+struct RunResult {
+  uint64_t time_nsecs = 0;
+  uint64_t peak_pss_bytes = 0;
+  uint64_t final_pss_bytes = 0;
+};
+
+// Takes the total allocation time from the output of memory_replay. Returns
+// false if it is not there.
+bool ParseReplayOutput(const std::string& output, RunResult* result);
+
+// Takes the peak and final PSS from a timeline written by memory_replay
+// --timeline. Returns false if it has no samples.
+bool ParseTimelineCsv(const std::string& csv, RunResult* result);
+
+// The mean of repeated runs, and the half width of its 95% confidence
+// interval, from the Student t distribution.
+class RunStats {
+ public:
+  void Add(double value) { values_.push_back(value); }
+
+  size_t count() const { return values_.size(); }
+  double Mean() const;
+  double StdDev() const;
+  // Zero with fewer than two values.
+  double ConfidenceInterval95() const;
+
+ private:
+  std::vector<double> values_;
+};
+
+#endif // _MEMORY_REPLAY_COMPARE_H
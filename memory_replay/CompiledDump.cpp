@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <unordered_set>
+
+#include "Action.h"
+#include "CompiledDump.h"
+#include "LineBuffer.h"
+
+static char g_buffer[65535];
+
+// Entries are written out in batches of this many.
+static constexpr size_t ENTRY_BATCH = 4096;
+
+static void WriteAll(int fd, const void* data, size_t len, off_t offset) {
+  const char* p = reinterpret_cast<const char*>(data);
+  while (len > 0) {
+    ssize_t bytes = TEMP_FAILURE_RETRY(pwrite(fd, p, len, offset));
+    if (bytes <= 0) {
+      err(1, "Failed to write compiled dump");
+    }
+    p += bytes;
+    len -= bytes;
+    offset += bytes;
+  }
+}
+
+void CompileDump(int dump_fd, int out_fd) {
+  lseek(dump_fd, 0, SEEK_SET);
+  LineBuffer line_buf(dump_fd, g_buffer, sizeof(g_buffer));
+
+  CompiledDumpHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPILED_DUMP_MAGIC, sizeof(header.magic));
+  header.version = COMPILED_DUMP_VERSION;
+  header.entry_size = sizeof(ActionEntry);
+
+  static ActionEntry entries[ENTRY_BATCH];
+  size_t num_batched = 0;
+  off_t offset = sizeof(header);
+  size_t num_allocs = 0;
+  std::unordered_set<pid_t> threads;
+
+  char* line;
+  size_t line_len;
+  while (line_buf.GetLine(&line, &line_len)) {
+    ActionEntry* entry = &entries[num_batched];
+    if (!Action::ParseLine(line, entry)) {
+      errx(1, "Unparseable line found: %s", line);
+    }
+
+    if (entry->type == ACTION_FREE) {
+      if (entry->key_pointer != 0) {
+        num_allocs--;
+      }
+    } else if (entry->type != ACTION_THREAD_DONE) {
+      num_allocs++;
+      if (num_allocs > header.max_allocs) {
+        header.max_allocs = num_allocs;
+      }
+      if (entry->type == ACTION_REALLOC && entry->arg != 0) {
+        num_allocs--;
+      }
+    }
+
+    if (entry->type == ACTION_THREAD_DONE) {
+      threads.erase(entry->tid);
+    } else {
+      threads.insert(entry->tid);
+      if (threads.size() > header.max_threads) {
+        header.max_threads = threads.size();
+      }
+    }
+
+    header.num_entries++;
+    if (++num_batched == ENTRY_BATCH) {
+      WriteAll(out_fd, entries, sizeof(entries), offset);
+      offset += sizeof(entries);
+      num_batched = 0;
+    }
+  }
+  WriteAll(out_fd, entries, num_batched * sizeof(ActionEntry), offset);
+
+  // The header is written last, so that an interrupted compile does not
+  // leave a file that looks complete.
+  WriteAll(out_fd, &header, sizeof(header), 0);
+}
+
+CompiledDump::~CompiledDump() {
+  if (memory_ != nullptr) {
+    munmap(memory_, size_);
+    memory_ = nullptr;
+  }
+}
+
+bool CompiledDump::Map(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(CompiledDumpHeader)) {
+    return false;
+  }
+
+  CompiledDumpHeader header;
+  if (TEMP_FAILURE_RETRY(pread(fd, &header, sizeof(header), 0)) != sizeof(header) ||
+      memcmp(header.magic, COMPILED_DUMP_MAGIC, sizeof(header.magic)) != 0) {
+    return false;
+  }
+  if (header.version != COMPILED_DUMP_VERSION || header.entry_size != sizeof(ActionEntry) ||
+      header.num_entries > (st.st_size - sizeof(header)) / sizeof(ActionEntry)) {
+    errx(1, "Unsupported or truncated compiled dump");
+  }
+
+  size_ = st.st_size;
+  memory_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (memory_ == MAP_FAILED) {
+    memory_ = nullptr;
+    err(1, "Failed to map compiled dump");
+  }
+  // The entries are only read once, in order.
+  madvise(memory_, size_, MADV_SEQUENTIAL);
+
+  header_ = reinterpret_cast<const CompiledDumpHeader*>(memory_);
+  entries_ = reinterpret_cast<const ActionEntry*>(header_ + 1);
+  return true;
+}
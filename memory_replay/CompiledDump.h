@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORY_REPLAY_COMPILED_DUMP_H
+#define _MEMORY_REPLAY_COMPILED_DUMP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Action.h"
+
+// A compiled dump holds the actions of a text dump already parsed, so that
+// replaying it does not include the time to parse the dump. The file is a
+// CompiledDumpHeader followed by num_entries ActionEntry structures, in the
+// byte order of the machine that compiled it.
+constexpr char COMPILED_DUMP_MAGIC[8] = { 'M', 'R', 'C', 'O', 'M', 'P', 'I', 'L' };
+constexpr uint32_t COMPILED_DUMP_VERSION = 1;
+
+struct CompiledDumpHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t num_entries;
+  // The most allocations alive at the same time.
+  uint64_t max_allocs;
+  // The most threads alive at the same time.
+  uint64_t max_threads;
+};
+
+// Parses the text dump in dump_fd and writes it to out_fd as a compiled
+// dump. Exits on unparseable lines, like replaying the text dump does.
+void CompileDump(int dump_fd, int out_fd);
+
+class CompiledDump {
+ public:
+  CompiledDump() {}
+  virtual ~CompiledDump();
+
+  // Maps the compiled dump in fd. Returns false if fd does not hold a
+  // compiled dump.
+  bool Map(int fd);
+
+  const ActionEntry* entries() { return entries_; }
+  size_t num_entries() { return header_->num_entries; }
+  size_t max_allocs() { return header_->max_allocs; }
+  size_t max_threads() { return header_->max_threads; }
+
+ private:
+  void* memory_ = nullptr;
+  size_t size_ = 0;
+  const CompiledDumpHeader* header_ = nullptr;
+  const ActionEntry* entries_ = nullptr;
+};
+
+#endif // _MEMORY_REPLAY_COMPILED_DUMP_H
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <new>
+
+#include "LatencyStats.h"
+
+void Histogram::Merge(const Histogram& other) {
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  if (other.max_ > max_) {
+    max_ = other.max_;
+  }
+}
+
+uint64_t Histogram::BucketMax(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t Histogram::Percentile(double fraction) const {
+  uint64_t target = ceil(fraction * count_);
+  if (target < 1) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    seen += counts_[i];
+    if (seen >= target) {
+      uint64_t value = BucketMax(i);
+      return value < max_ ? value : max_;
+    }
+  }
+  return max_;
+}
+
+static void* MapZeroed(size_t size) {
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (memory == MAP_FAILED) {
+    err(1, "Failed to map in memory for latency stats: map size %zu\n", size);
+  }
+  return memory;
+}
+
+static constexpr size_t SizeHistogramsSize() {
+  return LatencyStats::NUM_TYPES * LatencyStats::NUM_SIZE_CLASSES * sizeof(Histogram);
+}
+
+LatencyStats* LatencyStats::Create(bool size_classes) {
+  LatencyStats* stats = new (MapZeroed(sizeof(LatencyStats))) LatencyStats();
+  if (size_classes) {
+    stats->size_histograms_ = reinterpret_cast<Histogram*>(MapZeroed(SizeHistogramsSize()));
+  }
+  return stats;
+}
+
+void LatencyStats::Destroy(LatencyStats* stats) {
+  if (stats->size_histograms_ != nullptr) {
+    munmap(stats->size_histograms_, SizeHistogramsSize());
+  }
+  munmap(stats, sizeof(LatencyStats));
+}
+
+void LatencyStats::Merge(const LatencyStats& other) {
+  for (int i = 0; i < NUM_TYPES; i++) {
+    histograms_[i].Merge(other.histograms_[i]);
+  }
+  if (size_histograms_ != nullptr && other.size_histograms_ != nullptr) {
+    for (int i = 0; i < NUM_TYPES * NUM_SIZE_CLASSES; i++) {
+      size_histograms_[i].Merge(other.size_histograms_[i]);
+    }
+  }
+}
+
+void LatencyStats::Clear() {
+  for (int i = 0; i < NUM_TYPES; i++) {
+    histograms_[i] = Histogram();
+  }
+  if (size_histograms_ != nullptr) {
+    for (int i = 0; i < NUM_TYPES * NUM_SIZE_CLASSES; i++) {
+      size_histograms_[i] = Histogram();
+    }
+  }
+}
+
+static void PrintHistogram(const char* name, const Histogram& histogram) {
+  printf("%-12s %10" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n", name,
+         histogram.count(), histogram.Percentile(0.5), histogram.Percentile(0.99),
+         histogram.Percentile(0.999), histogram.max());
+}
+
+void LatencyStats::Print() {
+  static const char* names[NUM_TYPES] = { "malloc", "calloc", "realloc", "memalign", "free" };
+
+  printf("%-12s %10s %9s %9s %9s %9s\n", "Latency (ns)", "Count", "p50", "p99", "p99.9", "Max");
+  for (int type = 0; type < NUM_TYPES; type++) {
+    if (histograms_[type].count() == 0) {
+      continue;
+    }
+    PrintHistogram(names[type], histograms_[type]);
+    if (size_histograms_ == nullptr) {
+      continue;
+    }
+    for (int size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+      const Histogram& histogram = size_histograms_[type * NUM_SIZE_CLASSES + size_class];
+      if (histogram.count() == 0) {
+        continue;
+      }
+      char name[32];
+      if (size_class == NUM_SIZE_CLASSES - 1) {
+        snprintf(name, sizeof(name), "  > %u", 1U << (size_class + 3));
+      } else {
+        snprintf(name, sizeof(name), "  <= %u", 1U << (size_class + 4));
+      }
+      PrintHistogram(name, histogram);
+    }
+  }
+}
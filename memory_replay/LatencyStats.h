@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORY_REPLAY_LATENCY_STATS_H
+#define _MEMORY_REPLAY_LATENCY_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Action.h"
+
+// A histogram of latencies in nanoseconds, with buckets of the same
+// relative width, like an HDR histogram: values below 2^SUB_BUCKET_BITS
+// have a bucket each, and every power of two above is split in
+// 2^SUB_BUCKET_BITS buckets, so values are kept to about 3%.
+class Histogram {
+ public:
+  static constexpr int SUB_BUCKET_BITS = 5;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  // Values of 2^MAX_EXPONENT ns (about a day) and more share the last
+  // bucket.
+  static constexpr int MAX_EXPONENT = 47;
+  static constexpr int NUM_BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  void Add(uint64_t value) {
+    counts_[BucketIndex(value)]++;
+    count_++;
+    if (value > max_) {
+      max_ = value;
+    }
+  }
+  void Merge(const Histogram& other);
+
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+  // The value below or at which a fraction of the values are, to the
+  // precision of the buckets.
+  uint64_t Percentile(double fraction) const;
+
+  static int BucketIndex(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= MAX_EXPONENT) {
+      return NUM_BUCKETS - 1;
+    }
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+  }
+  // The highest value that falls in a bucket.
+  static uint64_t BucketMax(int index);
+
+ private:
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+  uint64_t counts_[NUM_BUCKETS] = {};
+};
+
+// The latencies of the actions of a thread, by action type and, if
+// enabled, by size class. The time of a free of a null pointer is not
+// recorded, since it does not call free.
+class LatencyStats {
+ public:
+  static constexpr int NUM_TYPES = ACTION_THREAD_DONE;
+  // Size classes are powers of two from 16 bytes up to 4MB, and one for
+  // larger sizes. Frees do not have a size.
+  static constexpr int NUM_SIZE_CLASSES = 20;
+
+  // The stats are mapped rather than allocated, so that they do not show
+  // up in the native heap of the replay.
+  static LatencyStats* Create(bool size_classes);
+  static void Destroy(LatencyStats* stats);
+
+  void Add(const ActionEntry& entry, uint64_t nsecs) {
+    if (entry.type >= NUM_TYPES || (entry.type == ACTION_FREE && entry.key_pointer == 0)) {
+      return;
+    }
+    histograms_[entry.type].Add(nsecs);
+    if (size_histograms_ != nullptr && entry.type != ACTION_FREE) {
+      uint64_t size = entry.size;
+      if (entry.type == ACTION_CALLOC) {
+        size *= entry.arg;
+      }
+      size_histograms_[entry.type * NUM_SIZE_CLASSES + SizeClass(size)].Add(nsecs);
+    }
+  }
+  void Merge(const LatencyStats& other);
+  void Clear();
+  void Print();
+
+  const Histogram& histogram(int type) { return histograms_[type]; }
+
+  static int SizeClass(uint64_t size) {
+    if (size <= 16) {
+      return 0;
+    }
+    int size_class = 64 - __builtin_clzll(size - 1) - 4;
+    return size_class < NUM_SIZE_CLASSES ? size_class : NUM_SIZE_CLASSES - 1;
+  }
+
+ private:
+  LatencyStats() {}
+
+  Histogram histograms_[NUM_TYPES];
+  // NUM_TYPES * NUM_SIZE_CLASSES histograms, or nullptr.
+  Histogram* size_histograms_ = nullptr;
+};
+
+#endif // _MEMORY_REPLAY_LATENCY_STATS_H
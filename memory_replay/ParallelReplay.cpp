@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "Action.h"
+#include "NativeInfo.h"
+#include "ParallelReplay.h"
+#include "Pointers.h"
+
+// How many times a waiting thread checks for a change before sleeping.
+static constexpr int EVENT_SPINS = 1000;
+
+void Event::Wait(uint32_t gen) {
+  for (int i = 0; i < EVENT_SPINS; i++) {
+    if (gen_.load(std::memory_order_acquire) != gen) {
+      return;
+    }
+  }
+  waiters_.fetch_add(1);
+  syscall(__NR_futex, &gen_, FUTEX_WAIT_PRIVATE, gen, nullptr, nullptr, 0);
+  waiters_.fetch_sub(1);
+}
+
+void Event::Signal() {
+  gen_.fetch_add(1);
+  if (waiters_.load() != 0) {
+    syscall(__NR_futex, &gen_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+}
+
+void Worker::Push(const QueuedAction& action) {
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+  while (true) {
+    uint32_t gen = queue_event_.Get();
+    if (tail - head_.load(std::memory_order_acquire) < QUEUE_SIZE) {
+      break;
+    }
+    queue_event_.Wait(gen);
+  }
+  queue_[tail % QUEUE_SIZE] = action;
+  tail_.store(tail + 1, std::memory_order_release);
+  queue_event_.Signal();
+}
+
+void Worker::WaitForEmpty() {
+  while (true) {
+    uint32_t gen = queue_event_.Get();
+    if (head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed)) {
+      break;
+    }
+    queue_event_.Wait(gen);
+  }
+}
+
+void* Worker::Run() {
+  while (true) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while (true) {
+      uint32_t gen = queue_event_.Get();
+      if (tail_.load(std::memory_order_acquire) != head) {
+        break;
+      }
+      queue_event_.Wait(gen);
+    }
+
+    const QueuedAction& queued = queue_[head % QUEUE_SIZE];
+    if (queued.dep_seq != 0) {
+      replay_->WaitForCompleted(queued.dep_worker, queued.dep_seq);
+    }
+
+    Action* action = Action::CreateAction(queued.entry, action_memory_);
+    uint64_t time_nsecs = action->Execute(&replay_->pointers_);
+    total_time_nsecs_ += time_nsecs;
+    stats_->Add(queued.entry, time_nsecs);
+    bool end_thread = action->EndThread();
+
+    completed_.store(queued.seq + 1, std::memory_order_release);
+    completed_event_.Signal();
+    head_.store(head + 1, std::memory_order_release);
+    queue_event_.Signal();
+
+    if (end_thread) {
+      return nullptr;
+    }
+  }
+}
+
+static void* WorkerRunner(void* data) {
+  return reinterpret_cast<Worker*>(data)->Run();
+}
+
+ParallelReplay::ParallelReplay(size_t max_allocs, size_t max_threads, bool size_classes)
+    : pointers_(max_allocs), size_classes_(size_classes) {
+  size_t pagesize = getpagesize();
+  workers_size_ = (max_threads * sizeof(Worker) + pagesize - 1) & ~(pagesize - 1);
+  max_workers_ = workers_size_ / sizeof(Worker);
+  void* memory = mmap(nullptr, workers_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (memory == MAP_FAILED) {
+    err(1, "Failed to map in memory for workers: map size %zu, max threads %zu\n",
+        workers_size_, max_workers_);
+  }
+  workers_ = new (memory) Worker[max_workers_];
+
+  // Keep the table at most half full.
+  size_t num_allocations = 1024;
+  while (num_allocations < 2 * max_allocs) {
+    num_allocations *= 2;
+  }
+  allocations_size_ = num_allocations * sizeof(Allocation);
+  allocations_mask_ = num_allocations - 1;
+  memory = mmap(nullptr, allocations_size_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (memory == MAP_FAILED) {
+    err(1, "Failed to map in memory for allocations: %zu total_allocs\n", max_allocs);
+  }
+  allocations_ = reinterpret_cast<Allocation*>(memory);
+  stats_ = LatencyStats::Create(size_classes_);
+
+  printf("Maximum threads available:   %zu\n", max_workers_);
+  printf("Maximum allocations in dump: %zu\n", max_allocs);
+  printf("Total pointers available:    %zu\n", pointers_.max_pointers());
+  printf("Replaying threads in parallel\n");
+  printf("\n");
+
+  PrintNativeInfo("Initial ");
+}
+
+ParallelReplay::~ParallelReplay() {
+  if (workers_ != nullptr) {
+    for (size_t i = 0; i < max_workers_; i++) {
+      if (workers_[i].stats_ != nullptr) {
+        LatencyStats::Destroy(workers_[i].stats_);
+      }
+      workers_[i].~Worker();
+    }
+    munmap(workers_, workers_size_);
+    workers_ = nullptr;
+  }
+  if (allocations_ != nullptr) {
+    munmap(allocations_, allocations_size_);
+    allocations_ = nullptr;
+  }
+  if (stats_ != nullptr) {
+    LatencyStats::Destroy(stats_);
+    stats_ = nullptr;
+  }
+}
+
+Worker* ParallelReplay::FindWorker(pid_t tid) {
+  size_t index = tid % max_workers_;
+  for (size_t entries = 0; entries < max_workers_; entries++) {
+    if (workers_[index].tid_ == tid) {
+      return workers_ + index;
+    }
+    if (++index == max_workers_) {
+      index = 0;
+    }
+  }
+  return nullptr;
+}
+
+Worker* ParallelReplay::CreateWorker(pid_t tid) {
+  Worker* worker = FindWorker(0);
+  if (worker == nullptr) {
+    // Reuse the workers of the threads that are done.
+    for (size_t i = 0; i < max_workers_; i++) {
+      if (workers_[i].tid_ == -1) {
+        JoinWorker(workers_ + i);
+      }
+    }
+    worker = FindWorker(0);
+    if (worker == nullptr) {
+      err(1, "Too many threads created, current max %zu.\n", max_workers_);
+    }
+  }
+
+  worker->tid_ = tid;
+  worker->replay_ = this;
+  if (worker->stats_ == nullptr) {
+    worker->stats_ = LatencyStats::Create(size_classes_);
+  }
+  if (pthread_create(&worker->thread_id_, nullptr, WorkerRunner, worker) != 0) {
+    err(1, "Failed to create thread %d: %s\n", tid, strerror(errno));
+  }
+  return worker;
+}
+
+void ParallelReplay::JoinWorker(Worker* worker) {
+  int ret = pthread_join(worker->thread_id_, nullptr);
+  if (ret != 0) {
+    fprintf(stderr, "pthread_join failed: %s\n", strerror(ret));
+    exit(1);
+  }
+  total_time_nsecs_ += worker->total_time_nsecs_;
+  worker->total_time_nsecs_ = 0;
+  stats_->Merge(*worker->stats_);
+  worker->stats_->Clear();
+  worker->tid_ = 0;
+}
+
+void ParallelReplay::WaitForCompleted(uint32_t index, uint64_t seq) {
+  Worker* worker = workers_ + index;
+  while (true) {
+    uint32_t gen = worker->completed_event_.Get();
+    if (worker->completed_.load(std::memory_order_acquire) >= seq) {
+      break;
+    }
+    worker->completed_event_.Wait(gen);
+  }
+}
+
+static size_t HashPointer(uint64_t key_pointer) {
+  return (key_pointer >> 4) * UINT64_C(0x9e3779b97f4a7c15) >> 17;
+}
+
+void ParallelReplay::AddAllocation(uint64_t key_pointer, uint32_t worker, uint64_t seq) {
+  size_t index = HashPointer(key_pointer) & allocations_mask_;
+  for (size_t entries = 0; entries <= allocations_mask_; entries++) {
+    Allocation* allocation = allocations_ + index;
+    if (allocation->key_pointer == 0 || allocation->key_pointer == key_pointer) {
+      allocation->key_pointer = key_pointer;
+      allocation->worker = worker;
+      allocation->seq = seq;
+      return;
+    }
+    index = (index + 1) & allocations_mask_;
+  }
+  err(1, "No empty entry found for 0x%" PRIx64 "\n", key_pointer);
+}
+
+bool ParallelReplay::RemoveAllocation(uint64_t key_pointer, Allocation* allocation) {
+  size_t index = HashPointer(key_pointer) & allocations_mask_;
+  while (allocations_[index].key_pointer != key_pointer) {
+    if (allocations_[index].key_pointer == 0) {
+      return false;
+    }
+    index = (index + 1) & allocations_mask_;
+  }
+  *allocation = allocations_[index];
+
+  // Move back the entries after it that would no longer be found.
+  size_t hole = index;
+  while (true) {
+    index = (index + 1) & allocations_mask_;
+    if (allocations_[index].key_pointer == 0) {
+      break;
+    }
+    size_t home = HashPointer(allocations_[index].key_pointer) & allocations_mask_;
+    if (((index - home) & allocations_mask_) >= ((index - hole) & allocations_mask_)) {
+      allocations_[hole] = allocations_[index];
+      hole = index;
+    }
+  }
+  allocations_[hole].key_pointer = 0;
+  return true;
+}
+
+void ParallelReplay::SetTimeline(Timeline* timeline) {
+  timeline_ = timeline;
+  timeline_->Start();
+}
+
+void ParallelReplay::Run(const ActionEntry& entry) {
+  uint64_t seq = num_actions_++;
+  if (timeline_ != nullptr) {
+    timeline_->SetActions(num_actions_);
+  } else if ((num_actions_ % 100000) == 0) {
+    printf("  At line %" PRIu64 ":\n", num_actions_);
+    PrintNativeInfo("    ");
+  }
+  if (entry.type > ACTION_THREAD_DONE) {
+    err(1, "Cannot create action %" PRIu64 " of type %u\n", num_actions_, entry.type);
+  }
+
+  Worker* worker = FindWorker(entry.tid);
+  if (worker == nullptr) {
+    worker = CreateWorker(entry.tid);
+  }
+  uint32_t index = worker - workers_;
+
+  QueuedAction queued;
+  queued.entry = entry;
+  queued.seq = seq;
+  queued.dep_seq = 0;
+  queued.dep_worker = 0;
+
+  uint64_t freed = 0;
+  if (entry.type == ACTION_FREE) {
+    freed = entry.key_pointer;
+  } else if (entry.type == ACTION_REALLOC) {
+    freed = entry.arg;
+  }
+  if (freed != 0) {
+    Allocation allocation;
+    if (!RemoveAllocation(freed, &allocation)) {
+      err(1, "No pointer value found for 0x%" PRIx64 "\n", freed);
+    }
+    // Actions of the same thread already run in order.
+    if (allocation.worker != index) {
+      queued.dep_seq = allocation.seq + 1;
+      queued.dep_worker = allocation.worker;
+    }
+  }
+  if (entry.type != ACTION_FREE && entry.type != ACTION_THREAD_DONE && entry.key_pointer != 0) {
+    AddAllocation(entry.key_pointer, index, seq);
+  }
+
+  worker->Push(queued);
+
+  if (entry.type == ACTION_THREAD_DONE) {
+    worker->tid_ = -1;
+  }
+}
+
+void ParallelReplay::Finish() {
+  // Wait for all threads to stop processing actions.
+  for (size_t i = 0; i < max_workers_; i++) {
+    if (workers_[i].tid_ != 0) {
+      workers_[i].WaitForEmpty();
+    }
+  }
+  if (timeline_ != nullptr) {
+    timeline_->Stop();
+  }
+
+  PrintNativeInfo("Final ");
+
+  // End the threads still running, and free any outstanding pointers.
+  for (size_t i = 0; i < max_workers_; i++) {
+    Worker* worker = workers_ + i;
+    if (worker->tid_ > 0) {
+      QueuedAction queued;
+      memset(&queued, 0, sizeof(queued));
+      queued.entry.type = ACTION_THREAD_DONE;
+      queued.seq = num_actions_++;
+      worker->Push(queued);
+    }
+    if (worker->tid_ != 0) {
+      JoinWorker(worker);
+    }
+  }
+  pointers_.FreeAll();
+
+  // Print out the total time making all allocation calls.
+  printf("Total Allocation/Free Time: %" PRIu64 "ns %0.2fs\n",
+         total_time_nsecs_, total_time_nsecs_/1000000000.0);
+  pointers_.PrintStats();
+  printf("\n");
+  stats_->Print();
+}
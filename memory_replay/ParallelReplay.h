@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORY_REPLAY_PARALLEL_REPLAY_H
+#define _MEMORY_REPLAY_PARALLEL_REPLAY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+#include "Action.h"
+#include "LatencyStats.h"
+#include "Pointers.h"
+#include "Timeline.h"
+
+// A counter that threads wait on to change. Waiting spins briefly and then
+// sleeps on a futex; signalling only makes a system call if a thread is
+// asleep. The condition being waited for must be checked after Get() and
+// before Wait(), so that no signal is lost.
+class Event {
+ public:
+  uint32_t Get() { return gen_.load(std::memory_order_acquire); }
+  void Wait(uint32_t gen);
+  void Signal();
+
+ private:
+  std::atomic<uint32_t> gen_{0};
+  std::atomic<uint32_t> waiters_{0};
+};
+
+struct QueuedAction {
+  ActionEntry entry;
+  // The position of the action in the dump.
+  uint64_t seq;
+  // If not zero, the action waits until worker dep_worker has completed
+  // the action at position dep_seq - 1, which allocated what it frees.
+  uint64_t dep_seq;
+  uint32_t dep_worker;
+};
+
+class ParallelReplay;
+
+// Runs the actions of one thread of the dump, in order, from a single
+// producer, single consumer queue filled by the dispatcher.
+class Worker {
+ public:
+  static constexpr size_t QUEUE_SIZE = 1024;
+
+  void Push(const QueuedAction& action);
+  void WaitForEmpty();
+  void* Run();
+
+ private:
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  Event queue_event_;
+
+  // One past the position of the last action completed, across all the
+  // threads that used this worker. Only grows.
+  alignas(64) std::atomic<uint64_t> completed_{0};
+  Event completed_event_;
+
+  // Only used by the dispatcher. tid_ is 0 for an unused worker and -1
+  // once the thread has been sent thread_done.
+  pid_t tid_ = 0;
+  pthread_t thread_id_;
+
+  uint64_t total_time_nsecs_ = 0;
+  LatencyStats* stats_ = nullptr;
+  ParallelReplay* replay_ = nullptr;
+
+  uint8_t action_memory_[128];
+  QueuedAction queue_[QUEUE_SIZE];
+
+  friend class ParallelReplay;
+};
+
+// Replays a dump with the threads of the dump running as concurrently as
+// they did when it was recorded. The dispatcher only hands out actions:
+// each dump thread gets a worker and a queue, and a free only waits for
+// the action that made the allocation it frees, instead of for every
+// thread to be idle.
+class ParallelReplay {
+ public:
+  ParallelReplay(size_t max_allocs, size_t max_threads, bool size_classes);
+  virtual ~ParallelReplay();
+
+  // Starts sampling the memory of the replay into the timeline. The
+  // timeline replaces the native info printed every 100000 actions.
+  void SetTimeline(Timeline* timeline);
+
+  void Run(const ActionEntry& entry);
+  void Finish();
+
+  size_t max_threads() { return max_workers_; }
+
+ private:
+  struct Allocation {
+    uint64_t key_pointer;
+    uint64_t seq;
+    uint32_t worker;
+  };
+
+  Worker* FindWorker(pid_t tid);
+  Worker* CreateWorker(pid_t tid);
+  void JoinWorker(Worker* worker);
+  void WaitForCompleted(uint32_t worker, uint64_t seq);
+
+  void AddAllocation(uint64_t key_pointer, uint32_t worker, uint64_t seq);
+  bool RemoveAllocation(uint64_t key_pointer, Allocation* allocation);
+
+  Pointers pointers_;
+
+  Worker* workers_ = nullptr;
+  size_t workers_size_ = 0;
+  size_t max_workers_ = 0;
+
+  // The allocations made so far that have not been freed, by the pointer
+  // recorded in the dump, in an open addressing table.
+  Allocation* allocations_ = nullptr;
+  size_t allocations_size_ = 0;
+  size_t allocations_mask_ = 0;
+
+  uint64_t num_actions_ = 0;
+  Timeline* timeline_ = nullptr;
+  uint64_t total_time_nsecs_ = 0;
+  bool size_classes_ = false;
+  LatencyStats* stats_ = nullptr;
+
+  friend class Worker;
+};
+
+#endif // _MEMORY_REPLAY_PARALLEL_REPLAY_H
@@ -28,10 +28,15 @@
 
 Pointers::Pointers(size_t max_allocs) {
   size_t pagesize = getpagesize();
-  // Create a mmap that contains a 4:1 ratio of allocations to entries.
-  // Align to a page.
-  pointers_size_ = (max_allocs * 4 * sizeof(pointer_data) + pagesize - 1) & ~(pagesize - 1);
-  max_pointers_ = pointers_size_ / sizeof(pointer_data);
+  // Create a mmap that contains at least a 4:1 ratio of entries to
+  // allocations, rounded up to a power of two and to a page.
+  max_pointers_ = pagesize / sizeof(pointer_data);
+  hash_shift_ = 64 - __builtin_ctzll(max_pointers_);
+  while (max_pointers_ < max_allocs * 4) {
+    max_pointers_ *= 2;
+    hash_shift_--;
+  }
+  pointers_size_ = max_pointers_ * sizeof(pointer_data);
   void* memory = mmap(nullptr, pointers_size_, PROT_READ | PROT_WRITE,
                       MAP_ANON | MAP_PRIVATE, -1, 0);
   if (memory == MAP_FAILED) {
@@ -69,47 +74,71 @@ void* Pointers::Remove(uintptr_t key_pointer) {
   }
 
   void* pointer = data->pointer;
-  atomic_store(&data->key_pointer, uintptr_t(0));
+  atomic_store(&data->key_pointer, TOMBSTONE);
 
   return pointer;
 }
 
 pointer_data* Pointers::Find(uintptr_t key_pointer) {
+  size_t mask = max_pointers_ - 1;
   size_t index = GetHash(key_pointer);
-  for (size_t entries = max_pointers_; entries != 0; entries--) {
-    if (atomic_load(&pointers_[index].key_pointer) == key_pointer) {
+  for (size_t entries = 0; entries < max_pointers_; entries++) {
+    uintptr_t value = atomic_load(&pointers_[index].key_pointer);
+    if (value == key_pointer) {
+      AddProbes(entries + 1);
       return pointers_ + index;
     }
-    if (++index == max_pointers_) {
-      index = 0;
+    // An add takes the first entry that is empty or a tombstone, and an
+    // entry never becomes empty again, so the key is not past this one.
+    if (value == EMPTY) {
+      break;
     }
+    index = (index + 1) & mask;
   }
   return nullptr;
 }
 
 pointer_data* Pointers::FindEmpty(uintptr_t key_pointer) {
+  size_t mask = max_pointers_ - 1;
   size_t index = GetHash(key_pointer);
   for (size_t entries = 0; entries < max_pointers_; entries++) {
-    uintptr_t empty = 0;
-    if (atomic_compare_exchange_strong(&pointers_[index].key_pointer, &empty,
-        uintptr_t(1))) {
+    uintptr_t value = atomic_load(&pointers_[index].key_pointer);
+    if ((value == EMPTY || value == TOMBSTONE) &&
+        atomic_compare_exchange_strong(&pointers_[index].key_pointer, &value, RESERVED)) {
+      AddProbes(entries + 1);
       return pointers_ + index;
     }
-    if (++index == max_pointers_) {
-      index = 0;
-    }
+    index = (index + 1) & mask;
   }
   return nullptr;
 }
 
 size_t Pointers::GetHash(uintptr_t key_pointer) {
-  return key_pointer % max_pointers_;
+  // Fibonacci hashing: the top bits of the product depend on all of the
+  // bits of the key, including the low ones that alignment leaves zero.
+  return (static_cast<uint64_t>(key_pointer) * 0x9e3779b97f4a7c15ULL) >> hash_shift_;
+}
+
+void Pointers::AddProbes(uint64_t probes) {
+  lookups_.fetch_add(1, std::memory_order_relaxed);
+  total_probes_.fetch_add(probes, std::memory_order_relaxed);
+  uint64_t max_probes = max_probes_.load(std::memory_order_relaxed);
+  while (probes > max_probes &&
+         !max_probes_.compare_exchange_weak(max_probes, probes, std::memory_order_relaxed)) {
+  }
 }
 
 void Pointers::FreeAll() {
   for (size_t i = 0; i < max_pointers_; i++) {
-    if (atomic_load(&pointers_[i].key_pointer) != 0) {
+    uintptr_t value = atomic_load(&pointers_[i].key_pointer);
+    if (value != EMPTY && value != TOMBSTONE) {
       free(pointers_[i].pointer);
     }
   }
 }
+
+void Pointers::PrintStats() {
+  uint64_t lookups = this->lookups();
+  printf("Pointer lookups: %" PRIu64 ", average probes %0.2f, max probes %" PRIu64 "\n",
+         lookups, lookups ? static_cast<double>(total_probes()) / lookups : 0.0, max_probes());
+}
@@ -20,11 +20,21 @@
 #include <stdatomic.h>
 #include <stdint.h>
 
+#include <atomic>
+
 struct pointer_data {
   std::atomic_uintptr_t key_pointer;
   void* pointer;
 };
 
+// An open addressing table of the pointers allocated by the replay, keyed
+// by the pointers in the dump. The table has a power of two entries, and
+// a key is hashed by multiplying it with a 64 bit constant and keeping the
+// top bits, so that aligned pointers spread over the whole table.
+//
+// A removed entry becomes a tombstone rather than empty, so a lookup can
+// stop at the first empty entry. Tombstones are reused by later adds.
+
 class Pointers {
  public:
   Pointers(size_t max_allocs);
@@ -38,14 +48,34 @@ class Pointers {
 
   void FreeAll();
 
+  // Number of lookups done by Add and Remove, the entries they looked at
+  // in total and the most one of them looked at.
+  uint64_t lookups() { return lookups_.load(std::memory_order_relaxed); }
+  uint64_t total_probes() { return total_probes_.load(std::memory_order_relaxed); }
+  uint64_t max_probes() { return max_probes_.load(std::memory_order_relaxed); }
+
+  void PrintStats();
+
  private:
   pointer_data* FindEmpty(uintptr_t key_pointer);
   pointer_data* Find(uintptr_t key_pointer);
   size_t GetHash(uintptr_t key_pointer);
+  void AddProbes(uint64_t probes);
+
+  // Values of key_pointer that are not keys. Pointers in a dump are at
+  // least 8 byte aligned, so they are never 1 or 2.
+  static constexpr uintptr_t EMPTY = 0;
+  static constexpr uintptr_t RESERVED = 1;
+  static constexpr uintptr_t TOMBSTONE = 2;
 
   pointer_data* pointers_ = nullptr;
   size_t pointers_size_ = 0;
   size_t max_pointers_ = 0;
+  int hash_shift_ = 0;
+
+  std::atomic<uint64_t> lookups_{0};
+  std::atomic<uint64_t> total_probes_{0};
+  std::atomic<uint64_t> max_probes_{0};
 };
 
 #endif // _MEMORY_REPLAY_POINTERS_H
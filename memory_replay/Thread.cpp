@@ -58,5 +58,16 @@ void Thread::ClearPending() {
 }
 
 Action* Thread::CreateAction(uintptr_t key_pointer, const char* type, const char* line) {
-  return Action::CreateAction(key_pointer, type, line, action_memory_);
+  ActionEntry entry;
+  if (!Action::ParseAction(type, line, &entry)) {
+    return nullptr;
+  }
+  entry.tid = tid_;
+  entry.key_pointer = key_pointer;
+  return CreateAction(entry);
+}
+
+Action* Thread::CreateAction(const ActionEntry& entry) {
+  entry_ = entry;
+  return Action::CreateAction(entry, action_memory_);
 }
@@ -21,7 +21,9 @@
 #include <stdint.h>
 #include <sys/types.h>
 
-class Action;
+#include "Action.h"
+#include "LatencyStats.h"
+
 class Pointers;
 
 constexpr size_t ACTION_MEMORY_SIZE = 128;
@@ -37,7 +39,13 @@ class Thread {
   void ClearPending();
 
   Action* CreateAction(uintptr_t key_pointer, const char* type, const char* line);
-  void AddTimeNsecs(uint64_t nsecs) { total_time_nsecs_ += nsecs; }
+  Action* CreateAction(const ActionEntry& entry);
+  void AddTimeNsecs(uint64_t nsecs) {
+    total_time_nsecs_ += nsecs;
+    if (stats_ != nullptr) {
+      stats_->Add(entry_, nsecs);
+    }
+  }
 
   void set_pointers(Pointers* pointers) { pointers_ = pointers; }
   Pointers* pointers() { return pointers_; }
@@ -52,6 +60,7 @@ class Thread {
   pthread_t thread_id_;
   pid_t tid_ = 0;
   uint64_t total_time_nsecs_ = 0;
+  LatencyStats* stats_ = nullptr;
 
   Pointers* pointers_ = nullptr;
 
@@ -59,6 +68,8 @@ class Thread {
   // at a time.
   static constexpr size_t ACTION_SIZE = 128;
   uint8_t action_memory_[ACTION_SIZE];
+  // The action being run, for its latency.
+  ActionEntry entry_;
 
   friend class Threads;
 };
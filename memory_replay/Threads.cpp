@@ -27,6 +27,7 @@
 #include <new>
 
 #include "Action.h"
+#include "LatencyStats.h"
 #include "Thread.h"
 #include "Threads.h"
 
@@ -45,8 +46,8 @@ void* ThreadRunner(void* data) {
   return nullptr;
 }
 
-Threads::Threads(Pointers* pointers, size_t max_threads)
-    : pointers_(pointers), max_threads_(max_threads) {
+Threads::Threads(Pointers* pointers, size_t max_threads, bool size_classes)
+    : pointers_(pointers), max_threads_(max_threads), size_classes_(size_classes) {
   size_t pagesize = getpagesize();
   data_size_ = (max_threads_ * sizeof(Thread) + pagesize - 1) & ~(pagesize - 1);
   max_threads_ = data_size_ / sizeof(Thread);
@@ -63,14 +64,24 @@ Threads::Threads(Pointers* pointers, size_t max_threads)
   }
 
   threads_ = new (memory) Thread[max_threads_];
+  stats_ = LatencyStats::Create(size_classes_);
 }
 
 Threads::~Threads() {
   if (threads_) {
+    for (size_t i = 0; i < max_threads_; i++) {
+      if (threads_[i].stats_ != nullptr) {
+        LatencyStats::Destroy(threads_[i].stats_);
+      }
+    }
     munmap(threads_, data_size_);
     threads_ = nullptr;
     data_size_ = 0;
   }
+  if (stats_) {
+    LatencyStats::Destroy(stats_);
+    stats_ = nullptr;
+  }
 }
 
 Thread* Threads::CreateThread(pid_t tid) {
@@ -85,6 +96,9 @@ Thread* Threads::CreateThread(pid_t tid) {
   thread->tid_ = tid;
   thread->pointers_ = pointers_;
   thread->total_time_nsecs_ = 0;
+  if (thread->stats_ == nullptr) {
+    thread->stats_ = LatencyStats::Create(size_classes_);
+  }
   if (pthread_create(&thread->thread_id_, nullptr, ThreadRunner, thread) == -1) {
     err(1, "Failed to create thread %d: %s\n", tid, strerror(errno));
   }
@@ -144,6 +158,8 @@ void Threads::Finish(Thread* thread) {
     exit(1);
   }
   total_time_nsecs_ += thread->total_time_nsecs_;
+  stats_->Merge(*thread->stats_);
+  thread->stats_->Clear();
   thread->tid_ = 0;
   num_threads_--;
 }
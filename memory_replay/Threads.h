@@ -20,12 +20,13 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+class LatencyStats;
 class Pointers;
 class Thread;
 
 class Threads {
  public:
-  Threads(Pointers* pointers, size_t max_threads);
+  Threads(Pointers* pointers, size_t max_threads, bool size_classes = false);
   virtual ~Threads();
 
   Thread* CreateThread(pid_t tid);
@@ -37,6 +38,8 @@ class Threads {
   size_t num_threads() { return num_threads_; }
   size_t max_threads() { return max_threads_; }
   uint64_t total_time_nsecs() { return total_time_nsecs_; }
+  // The latencies of the threads that finished.
+  LatencyStats* stats() { return stats_; }
 
  private:
   Pointers* pointers_ = nullptr;
@@ -45,6 +48,8 @@ class Threads {
   size_t max_threads_ = 0;
   size_t num_threads_= 0;
   uint64_t total_time_nsecs_ = 0;
+  bool size_classes_ = false;
+  LatencyStats* stats_ = nullptr;
 
   Thread* FindEmptyEntry(pid_t tid);
   size_t GetHashEntry(pid_t tid);
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "NativeInfo.h"
+#include "Timeline.h"
+
+static uint64_t nanotime() {
+  struct timespec t;
+  t.tv_sec = t.tv_nsec = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return static_cast<uint64_t>(t.tv_sec) * 1000000000LL + t.tv_nsec;
+}
+
+bool ParseRollupPss(const char* data, uint64_t* pss_bytes) {
+  for (const char* line = data; line != nullptr; line = strchr(line, '\n')) {
+    if (*line == '\n') {
+      line++;
+    }
+    uint64_t pss_kB;
+    if (sscanf(line, "Pss: %" SCNu64, &pss_kB) == 1) {
+      *pss_bytes = pss_kB * 1024;
+      return true;
+    }
+  }
+  return false;
+}
+
+Timeline::Timeline(uint64_t interval_nsecs, size_t max_samples)
+    : interval_nsecs_(interval_nsecs), max_samples_(max_samples) {
+  if (max_samples_ < 2) {
+    max_samples_ = 2;
+  }
+  size_t pagesize = getpagesize();
+  samples_size_ = (max_samples_ * sizeof(Sample) + pagesize - 1) & ~(pagesize - 1);
+  void* memory = mmap(nullptr, samples_size_, PROT_READ | PROT_WRITE,
+                      MAP_ANON | MAP_PRIVATE, -1, 0);
+  if (memory == MAP_FAILED) {
+    err(1, "Unable to allocate data for timeline: %zu samples\n", max_samples_);
+  }
+  // Make sure that all of the PSS for this is counted right away.
+  memset(memory, 0, samples_size_);
+  samples_ = reinterpret_cast<Sample*>(memory);
+
+  rollup_fd_ = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+  if (rollup_fd_ != -1) {
+    statm_fd_ = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    uint64_t pss_bytes, va_bytes;
+    if (statm_fd_ == -1 || !ReadRollup(&pss_bytes, &va_bytes)) {
+      close(rollup_fd_);
+      rollup_fd_ = -1;
+    }
+  }
+
+  pthread_mutex_init(&mutex_, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond_, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+Timeline::~Timeline() {
+  Stop();
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+  if (rollup_fd_ != -1) {
+    close(rollup_fd_);
+  }
+  if (statm_fd_ != -1) {
+    close(statm_fd_);
+  }
+  if (samples_ != nullptr) {
+    munmap(samples_, samples_size_);
+    samples_ = nullptr;
+  }
+}
+
+void Timeline::Start() {
+  num_samples_ = 0;
+  stop_ = false;
+  start_nsecs_ = nanotime();
+  int error = pthread_create(&thread_id_, nullptr, SamplerRunner, this);
+  if (error != 0) {
+    err(1, "Failed to create timeline thread: %s\n", strerror(error));
+  }
+  running_ = true;
+}
+
+void Timeline::Stop() {
+  if (!running_) {
+    return;
+  }
+  pthread_mutex_lock(&mutex_);
+  stop_ = true;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_id_, nullptr);
+  running_ = false;
+
+  // One last sample of the state the replay ended in.
+  TakeSample(nanotime());
+}
+
+void* Timeline::SamplerRunner(void* data) {
+  Timeline* timeline = reinterpret_cast<Timeline*>(data);
+  uint64_t next_nsecs = timeline->start_nsecs_;
+
+  pthread_mutex_lock(&timeline->mutex_);
+  while (!timeline->stop_) {
+    pthread_mutex_unlock(&timeline->mutex_);
+    timeline->TakeSample(nanotime());
+    next_nsecs += timeline->interval_nsecs_;
+    pthread_mutex_lock(&timeline->mutex_);
+
+    struct timespec deadline;
+    deadline.tv_sec = next_nsecs / 1000000000;
+    deadline.tv_nsec = next_nsecs % 1000000000;
+    while (!timeline->stop_ &&
+           pthread_cond_timedwait(&timeline->cond_, &timeline->mutex_, &deadline) != ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&timeline->mutex_);
+  return nullptr;
+}
+
+bool Timeline::ReadRollup(uint64_t* pss_bytes, uint64_t* va_bytes) {
+  char buffer[4096];
+  ssize_t bytes = TEMP_FAILURE_RETRY(pread(rollup_fd_, buffer, sizeof(buffer) - 1, 0));
+  if (bytes <= 0) {
+    return false;
+  }
+  buffer[bytes] = '\0';
+  if (!ParseRollupPss(buffer, pss_bytes)) {
+    return false;
+  }
+
+  bytes = TEMP_FAILURE_RETRY(pread(statm_fd_, buffer, sizeof(buffer) - 1, 0));
+  if (bytes <= 0) {
+    return false;
+  }
+  buffer[bytes] = '\0';
+  uint64_t va_pages;
+  if (sscanf(buffer, "%" SCNu64, &va_pages) != 1) {
+    return false;
+  }
+  *va_bytes = va_pages * getpagesize();
+  return true;
+}
+
+void Timeline::TakeSample(uint64_t now_nsecs) {
+  if (num_samples_ == max_samples_) {
+    for (size_t i = 1; i < max_samples_ / 2; i++) {
+      samples_[i] = samples_[i * 2];
+    }
+    num_samples_ = max_samples_ / 2;
+    interval_nsecs_ *= 2;
+  }
+
+  Sample* sample = &samples_[num_samples_];
+  sample->time_nsecs = now_nsecs - start_nsecs_;
+  sample->actions = actions_.load(std::memory_order_relaxed);
+  if (rollup_fd_ != -1) {
+    if (!ReadRollup(&sample->pss_bytes, &sample->va_bytes)) {
+      return;
+    }
+  } else {
+    int smaps_fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+    if (smaps_fd == -1) {
+      return;
+    }
+    size_t pss_bytes, va_bytes;
+    GetNativeInfo(smaps_fd, &pss_bytes, &va_bytes);
+    sample->pss_bytes = pss_bytes;
+    sample->va_bytes = va_bytes;
+  }
+  num_samples_++;
+}
+
+bool Timeline::WriteCsv(int fd) {
+  if (dprintf(fd, "time_ms,actions,pss_bytes,va_bytes\n") < 0) {
+    return false;
+  }
+  for (size_t i = 0; i < num_samples_; i++) {
+    const Sample& sample = samples_[i];
+    if (dprintf(fd, "%" PRIu64 ".%03" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                sample.time_nsecs / 1000000, sample.time_nsecs / 1000 % 1000,
+                sample.actions, sample.pss_bytes, sample.va_bytes) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMORY_REPLAY_TIMELINE_H
+#define _MEMORY_REPLAY_TIMELINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+// Samples the memory used by the replay from a thread of its own, at a
+// fixed interval, so that the replay threads are not stopped to read /proc.
+// The samples are kept in a buffer mapped before the replay starts, and are
+// written out as CSV once it is done.
+//
+// When /proc/self/smaps_rollup is present, a sample is the PSS of the whole
+// process from it and the VA size from /proc/self/statm, which the kernel
+// produces without walking every map into text. Otherwise it is the native
+// PSS and VA size summed from /proc/self/smaps, as in PrintNativeInfo.
+class Timeline {
+ public:
+  struct Sample {
+    uint64_t time_nsecs;
+    uint64_t actions;
+    uint64_t pss_bytes;
+    uint64_t va_bytes;
+  };
+
+  static constexpr size_t DEFAULT_MAX_SAMPLES = 16384;
+
+  Timeline(uint64_t interval_nsecs, size_t max_samples = DEFAULT_MAX_SAMPLES);
+  virtual ~Timeline();
+
+  void Start();
+  void Stop();
+
+  // Called by the dispatch thread for every action, only a relaxed store.
+  void SetActions(uint64_t actions) { actions_.store(actions, std::memory_order_relaxed); }
+
+  bool WriteCsv(int fd);
+
+  bool rollup() { return rollup_fd_ != -1; }
+  size_t num_samples() { return num_samples_; }
+  const Sample* samples() { return samples_; }
+  // When the buffer fills up, every other sample is dropped and the
+  // interval doubles, so a long replay still fits.
+  uint64_t interval_nsecs() { return interval_nsecs_; }
+
+ private:
+  static void* SamplerRunner(void* data);
+  void TakeSample(uint64_t now_nsecs);
+  bool ReadRollup(uint64_t* pss_bytes, uint64_t* va_bytes);
+
+  uint64_t interval_nsecs_;
+  size_t max_samples_;
+  Sample* samples_ = nullptr;
+  size_t samples_size_ = 0;
+  size_t num_samples_ = 0;
+  uint64_t start_nsecs_ = 0;
+
+  int rollup_fd_ = -1;
+  int statm_fd_ = -1;
+
+  std::atomic<uint64_t> actions_{0};
+
+  pthread_t thread_id_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  bool running_ = false;
+  bool stop_ = false;
+};
+
+// Parses the Pss line of the text of /proc/pid/smaps_rollup. Returns false
+// if there is none.
+bool ParseRollupPss(const char* data, uint64_t* pss_bytes);
+
+#endif // _MEMORY_REPLAY_TIMELINE_H
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "Compare.h"
+
+// Runs memory_replay on one dump with several allocators, each run in a
+// child process of its own, and compares the allocation time and the PSS
+// of the runs.
+
+#if !defined(__ANDROID__)
+static const char* kDefaultReplay = "memory_replay";
+#elif defined(__LP64__)
+static const char* kDefaultReplay = "memory_replay64";
+#else
+static const char* kDefaultReplay = "memory_replay32";
+#endif
+
+constexpr size_t DEFAULT_RUNS = 5;
+constexpr unsigned int DEFAULT_TIMELINE_INTERVAL_MSECS = 10;
+
+struct Allocator {
+  std::string name;
+  // Preloaded into the replay if not empty.
+  std::string preload;
+  std::string replay;
+
+  RunStats time_msecs;
+  RunStats peak_pss_mb;
+  RunStats final_pss_mb;
+};
+
+struct Options {
+  size_t runs = DEFAULT_RUNS;
+  bool pin = false;
+  cpu_set_t cpus;
+  bool parallel = false;
+  unsigned int interval_msecs = DEFAULT_TIMELINE_INTERVAL_MSECS;
+};
+
+static bool ParseCpus(const char* list, cpu_set_t* cpus) {
+  CPU_ZERO(cpus);
+  const char* p = list;
+  while (*p != '\0') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return false;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return false;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return false;
+    }
+    p = end;
+  }
+  return CPU_COUNT(cpus) != 0;
+}
+
+static std::string ReadFd(int fd) {
+  std::string data;
+  char buffer[4096];
+  ssize_t bytes;
+  while ((bytes = TEMP_FAILURE_RETRY(read(fd, buffer, sizeof(buffer)))) > 0) {
+    data.append(buffer, bytes);
+  }
+  return data;
+}
+
+static const char* TempDir() {
+  const char* dir = getenv("TMPDIR");
+  if (dir != nullptr) {
+    return dir;
+  }
+#if defined(__ANDROID__)
+  return "/data/local/tmp";
+#else
+  return "/tmp";
+#endif
+}
+
+static RunResult RunReplay(const Allocator& allocator, const char* dump, const Options& options) {
+  std::string timeline = std::string(TempDir()) + "/memory_replay_compare.XXXXXX";
+  int timeline_fd = mkstemp(&timeline[0]);
+  if (timeline_fd == -1) {
+    err(1, "Cannot create %s", timeline.c_str());
+  }
+
+  int pipe_fds[2];
+  if (pipe(pipe_fds) == -1) {
+    err(1, "Cannot create pipe");
+  }
+
+  std::string interval = std::to_string(options.interval_msecs);
+  std::vector<const char*> args = { allocator.replay.c_str() };
+  if (options.parallel) {
+    args.push_back("--parallel");
+  }
+  args.insert(args.end(), { "--timeline", timeline.c_str(), "--timeline-interval",
+                            interval.c_str(), dump, nullptr });
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    err(1, "Cannot fork");
+  }
+  if (pid == 0) {
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (options.pin && sched_setaffinity(0, sizeof(options.cpus), &options.cpus) == -1) {
+      fprintf(stderr, "Cannot pin to the cpus: %s\n", strerror(errno));
+      _exit(1);
+    }
+    if (allocator.preload.empty()) {
+      unsetenv("LD_PRELOAD");
+    } else {
+      setenv("LD_PRELOAD", allocator.preload.c_str(), 1);
+    }
+    execvp(args[0], const_cast<char**>(args.data()));
+    fprintf(stderr, "Cannot run %s: %s\n", args[0], strerror(errno));
+    _exit(127);
+  }
+
+  close(pipe_fds[1]);
+  std::string output = ReadFd(pipe_fds[0]);
+  close(pipe_fds[0]);
+
+  int status;
+  if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == -1) {
+    err(1, "Cannot wait for %s", args[0]);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    errx(1, "%s for %s failed with status 0x%x:\n%s", args[0], allocator.name.c_str(), status,
+         output.c_str());
+  }
+
+  RunResult result;
+  if (!ParseReplayOutput(output, &result)) {
+    errx(1, "No allocation time in the output of %s for %s:\n%s", args[0],
+         allocator.name.c_str(), output.c_str());
+  }
+  std::string csv = ReadFd(timeline_fd);
+  close(timeline_fd);
+  unlink(timeline.c_str());
+  if (!ParseTimelineCsv(csv, &result)) {
+    errx(1, "No timeline samples from %s for %s", args[0], allocator.name.c_str());
+  }
+  return result;
+}
+
+static void PrintStats(const RunStats& stats) {
+  printf(" %10.2f +- %-8.2f", stats.Mean(), stats.ConfidenceInterval95());
+}
+
+static void Usage(const char* name) {
+  fprintf(stderr, "Usage: %s [-n RUNS] [-c CPUS] [-i MSECS] [-p] DUMP ALLOCATOR...\n", name);
+  fprintf(stderr, "Replays DUMP RUNS times (default %zu) with every ALLOCATOR, each run in a\n"
+                  "new process, alternating between the allocators, and prints the mean\n"
+                  "allocation time and peak and final PSS with 95%% confidence intervals.\n"
+                  "ALLOCATOR is one of:\n"
+                  "  NAME           %s as is\n"
+                  "  NAME=LIB       %s with LIB in LD_PRELOAD\n"
+                  "  NAME:REPLAY    the REPLAY binary, linked with another allocator\n"
+                  "  -c CPUS  pin the replays to CPUS, like 2 or 4-7 or 0,2\n"
+                  "  -i MSECS sample the PSS every MSECS (default %u)\n"
+                  "  -p       replay with --parallel\n"
+                  "Using a compiled dump keeps the time to parse the dump out of the runs.\n",
+          DEFAULT_RUNS, kDefaultReplay, kDefaultReplay, DEFAULT_TIMELINE_INTERVAL_MSECS);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:i:p")) != -1) {
+    switch (opt) {
+      case 'n':
+        options.runs = atoi(optarg);
+        if (options.runs == 0) {
+          Usage(basename(argv[0]));
+          return 1;
+        }
+        break;
+      case 'c':
+        if (!ParseCpus(optarg, &options.cpus)) {
+          fprintf(stderr, "Bad cpu list: %s\n", optarg);
+          return 1;
+        }
+        options.pin = true;
+        break;
+      case 'i':
+        options.interval_msecs = atoi(optarg);
+        if (options.interval_msecs == 0) {
+          Usage(basename(argv[0]));
+          return 1;
+        }
+        break;
+      case 'p':
+        options.parallel = true;
+        break;
+      default:
+        Usage(basename(argv[0]));
+        return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    Usage(basename(argv[0]));
+    return 1;
+  }
+
+  const char* dump = argv[optind];
+  std::vector<Allocator> allocators;
+  for (int i = optind + 1; i < argc; i++) {
+    Allocator allocator;
+    std::string spec(argv[i]);
+    size_t pos = spec.find_first_of("=:");
+    allocator.name = spec.substr(0, pos);
+    allocator.replay = kDefaultReplay;
+    if (pos != std::string::npos) {
+      if (spec[pos] == '=') {
+        allocator.preload = spec.substr(pos + 1);
+      } else {
+        allocator.replay = spec.substr(pos + 1);
+      }
+    }
+    allocators.push_back(allocator);
+  }
+
+  // Alternating between the allocators spreads any drift of the machine,
+  // like thermal throttling, over all of them.
+  for (size_t run = 1; run <= options.runs; run++) {
+    for (Allocator& allocator : allocators) {
+      RunResult result = RunReplay(allocator, dump, options);
+      allocator.time_msecs.Add(result.time_nsecs / 1000000.0);
+      allocator.peak_pss_mb.Add(result.peak_pss_bytes / (1024 * 1024.0));
+      allocator.final_pss_mb.Add(result.final_pss_bytes / (1024 * 1024.0));
+      fprintf(stderr, "Run %zu/%zu %s: %0.2fms, peak PSS %0.2fMB, final PSS %0.2fMB\n",
+              run, options.runs, allocator.name.c_str(), result.time_nsecs / 1000000.0,
+              result.peak_pss_bytes / (1024 * 1024.0), result.final_pss_bytes / (1024 * 1024.0));
+    }
+  }
+
+  printf("%-16s %-22s %-22s %-22s %s\n", "Allocator", "Time (ms)", "Peak PSS (MB)",
+         "Final PSS (MB)", "Time");
+  double base_time = allocators[0].time_msecs.Mean();
+  for (const Allocator& allocator : allocators) {
+    printf("%-16s", allocator.name.c_str());
+    PrintStats(allocator.time_msecs);
+    PrintStats(allocator.peak_pss_mb);
+    PrintStats(allocator.final_pss_mb);
+    printf(" %+0.1f%%\n", base_time ? (allocator.time_msecs.Mean() / base_time - 1) * 100 : 0.0);
+  }
+  printf("Means of %zu runs, +- the half width of the 95%% confidence interval.\n"
+         "Time is relative to %s.\n", options.runs, allocators[0].name.c_str());
+
+  return 0;
+}
@@ -27,11 +27,15 @@
 #include <unistd.h>
 
 #include "Action.h"
+#include "CompiledDump.h"
+#include "LatencyStats.h"
 #include "LineBuffer.h"
 #include "NativeInfo.h"
+#include "ParallelReplay.h"
 #include "Pointers.h"
 #include "Thread.h"
 #include "Threads.h"
+#include "Timeline.h"
 
 static char g_buffer[65535];
 
@@ -66,52 +70,45 @@ size_t GetMaxAllocs(int fd) {
   return num_allocs;
 }
 
-void ProcessDump(int fd, size_t max_allocs, size_t max_threads) {
-  lseek(fd, 0, SEEK_SET);
-  Pointers pointers(max_allocs);
-  Threads threads(&pointers, max_threads);
-
-  printf("Maximum threads available:   %zu\n", threads.max_threads());
-  printf("Maximum allocations in dump: %zu\n", max_allocs);
-  printf("Total pointers available:    %zu\n", pointers.max_pointers());
-  printf("\n");
+class Replay {
+ public:
+  Replay(size_t max_allocs, size_t max_threads, bool size_classes)
+      : pointers_(max_allocs), threads_(&pointers_, max_threads, size_classes) {
+    printf("Maximum threads available:   %zu\n", threads_.max_threads());
+    printf("Maximum allocations in dump: %zu\n", max_allocs);
+    printf("Total pointers available:    %zu\n", pointers_.max_pointers());
+    printf("\n");
 
-  PrintNativeInfo("Initial ");
+    PrintNativeInfo("Initial ");
+  }
 
-  LineBuffer line_buf(fd, g_buffer, sizeof(g_buffer));
-  char* line;
-  size_t line_len;
-  size_t line_number = 0;
-  while (line_buf.GetLine(&line, &line_len)) {
-    pid_t tid;
-    int line_pos = 0;
-    char type[128];
-    uintptr_t key_pointer;
+  // Starts sampling the memory of the replay into the timeline. The
+  // timeline replaces the native info printed every 100000 actions.
+  void SetTimeline(Timeline* timeline) {
+    timeline_ = timeline;
+    timeline_->Start();
+  }
 
-    // Every line is of this format:
-    //   <tid>: <action_type> <pointer>
-    // Some actions have extra arguments which will be used and verified
-    // when creating the Action object.
-    if (sscanf(line, "%d: %s %" SCNxPTR " %n", &tid, type, &key_pointer, &line_pos) != 3) {
-      err(1, "Unparseable line found: %s\n", line);
-    }
-    line_number++;
-    if ((line_number % 100000) == 0) {
-      printf("  At line %zu:\n", line_number);
+  void Run(const ActionEntry& entry) {
+    num_actions_++;
+    if (timeline_ != nullptr) {
+      timeline_->SetActions(num_actions_);
+    } else if ((num_actions_ % 100000) == 0) {
+      printf("  At line %zu:\n", num_actions_);
       PrintNativeInfo("    ");
     }
-    Thread* thread = threads.FindThread(tid);
+    Thread* thread = threads_.FindThread(entry.tid);
     if (thread == nullptr) {
-      thread = threads.CreateThread(tid);
+      thread = threads_.CreateThread(entry.tid);
     }
 
     // Wait for the thread to complete any previous actions before handling
     // the next action.
     thread->WaitForReady();
 
-    Action* action = thread->CreateAction(key_pointer, type, line + line_pos);
+    Action* action = thread->CreateAction(entry);
     if (action == nullptr) {
-      err(1, "Cannot create action from line: %s\n", line);
+      err(1, "Cannot create action %zu of type %u\n", num_actions_, entry.type);
     }
 
     bool does_free = action->DoesFree();
@@ -119,7 +116,7 @@ void ProcessDump(int fd, size_t max_allocs, size_t max_threads) {
       // Make sure that any other threads doing allocations are complete
       // before triggering the action. Otherwise, another thread could
       // be creating the allocation we are going to free.
-      threads.WaitForAllToQuiesce();
+      threads_.WaitForAllToQuiesce();
     }
 
     // Tell the thread to execute the action.
@@ -127,7 +124,7 @@ void ProcessDump(int fd, size_t max_allocs, size_t max_threads) {
 
     if (action->EndThread()) {
       // Wait for the thread to finish and clear the thread entry.
-      threads.Finish(thread);
+      threads_.Finish(thread);
     }
 
     // Wait for this action to complete. This avoids a race where
@@ -137,32 +134,149 @@ void ProcessDump(int fd, size_t max_allocs, size_t max_threads) {
       thread->WaitForReady();
     }
   }
-  // Wait for all threads to stop processing actions.
-  threads.WaitForAllToQuiesce();
 
-  PrintNativeInfo("Final ");
+  void Finish() {
+    // Wait for all threads to stop processing actions.
+    threads_.WaitForAllToQuiesce();
+    if (timeline_ != nullptr) {
+      timeline_->Stop();
+    }
+
+    PrintNativeInfo("Final ");
+
+    // Free any outstanding pointers.
+    // This allows us to run a tool like valgrind to verify that no memory
+    // is leaked and everything is accounted for during a run.
+    threads_.FinishAll();
+    pointers_.FreeAll();
+
+    // Print out the total time making all allocation calls.
+    printf("Total Allocation/Free Time: %" PRIu64 "ns %0.2fs\n",
+           threads_.total_time_nsecs(), threads_.total_time_nsecs()/1000000000.0);
+    pointers_.PrintStats();
+    printf("\n");
+    threads_.stats()->Print();
+  }
+
+ private:
+  Pointers pointers_;
+  Threads threads_;
+  size_t num_actions_ = 0;
+  Timeline* timeline_ = nullptr;
+};
+
+template <class ReplayType>
+void ProcessDump(int fd, size_t max_allocs, size_t max_threads, bool size_classes,
+                 Timeline* timeline) {
+  lseek(fd, 0, SEEK_SET);
+  ReplayType replay(max_allocs, max_threads, size_classes);
+  if (timeline != nullptr) {
+    replay.SetTimeline(timeline);
+  }
+
+  LineBuffer line_buf(fd, g_buffer, sizeof(g_buffer));
+  char* line;
+  size_t line_len;
+  while (line_buf.GetLine(&line, &line_len)) {
+    // Every line is of this format:
+    //   <tid>: <action_type> <pointer>
+    // Some actions have extra arguments which will be used and verified
+    // when creating the Action object.
+    ActionEntry entry;
+    if (!Action::ParseLine(line, &entry)) {
+      err(1, "Unparseable line found: %s\n", line);
+    }
+    replay.Run(entry);
+  }
+  replay.Finish();
+}
 
-  // Free any outstanding pointers.
-  // This allows us to run a tool like valgrind to verify that no memory
-  // is leaked and everything is accounted for during a run.
-  threads.FinishAll();
-  pointers.FreeAll();
+template <class ReplayType>
+void ProcessCompiledDump(CompiledDump* dump, size_t max_threads, bool size_classes,
+                         Timeline* timeline) {
+  ReplayType replay(dump->max_allocs(), max_threads, size_classes);
+  if (timeline != nullptr) {
+    replay.SetTimeline(timeline);
+  }
 
-  // Print out the total time making all allocation calls.
-  printf("Total Allocation/Free Time: %" PRIu64 "ns %0.2fs\n",
-         threads.total_time_nsecs(), threads.total_time_nsecs()/1000000000.0);
+  const ActionEntry* entries = dump->entries();
+  for (size_t i = 0; i < dump->num_entries(); i++) {
+    replay.Run(entries[i]);
+  }
+  replay.Finish();
 }
 
 constexpr size_t DEFAULT_MAX_THREADS = 512;
+constexpr unsigned int DEFAULT_TIMELINE_INTERVAL_MSECS = 100;
+
+static void Usage(const char* name) {
+  fprintf(stderr, "Usage: %s [--parallel] [--size-classes] [--timeline CSV_FILE]\n"
+                  "       [--timeline-interval MSECS] MEMORY_LOG_FILE [MAX_THREADS]\n", name);
+  fprintf(stderr, "       %s --compile MEMORY_LOG_FILE COMPILED_FILE\n", name);
+  fprintf(stderr, "MEMORY_LOG_FILE can be a text dump or a compiled dump. Compiled dumps\n"
+                  "are replayed without parsing each action.\n"
+                  "With --parallel, the threads of the dump run concurrently, and a free\n"
+                  "only waits for the allocation it frees.\n"
+                  "With --size-classes, latencies are also shown by allocation size.\n"
+                  "With --timeline, the memory of the replay is sampled every\n"
+                  "--timeline-interval msecs (default %u) from another thread, and\n"
+                  "written to CSV_FILE at the end.\n", DEFAULT_TIMELINE_INTERVAL_MSECS);
+}
 
 int main(int argc, char** argv) {
+  if (argc == 4 && strcmp(argv[1], "--compile") == 0) {
+    int dump_fd = open(argv[2], O_RDONLY);
+    if (dump_fd == -1) {
+      fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(errno));
+      return 1;
+    }
+    int out_fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+      fprintf(stderr, "Failed to create %s: %s\n", argv[3], strerror(errno));
+      return 1;
+    }
+
+    printf("Compiling: %s\n", argv[2]);
+    CompileDump(dump_fd, out_fd);
+
+    close(out_fd);
+    close(dump_fd);
+    return 0;
+  }
+
+  bool parallel = false;
+  bool size_classes = false;
+  const char* timeline_file = nullptr;
+  unsigned int timeline_interval_msecs = DEFAULT_TIMELINE_INTERVAL_MSECS;
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strcmp(argv[arg], "--parallel") == 0) {
+      parallel = true;
+    } else if (strcmp(argv[arg], "--size-classes") == 0) {
+      size_classes = true;
+    } else if (strcmp(argv[arg], "--timeline") == 0 && arg + 1 < argc) {
+      timeline_file = argv[++arg];
+    } else if (strcmp(argv[arg], "--timeline-interval") == 0 && arg + 1 < argc &&
+               atoi(argv[arg + 1]) > 0) {
+      timeline_interval_msecs = atoi(argv[++arg]);
+    } else {
+      fprintf(stderr, "Unknown option or missing value: %s.\n", argv[arg]);
+      Usage(basename(argv[0]));
+      return 1;
+    }
+  }
+  // Drop the options, keeping the program name.
+  argv[arg - 1] = argv[0];
+  argc -= arg - 1;
+  argv += arg - 1;
+
   if (argc != 2 && argc != 3) {
     if (argc > 3) {
       fprintf(stderr, "Only two arguments are expected.\n");
     } else {
       fprintf(stderr, "Requires at least one argument.\n");
     }
-    fprintf(stderr, "Usage: %s MEMORY_LOG_FILE [MAX_THREADS]\n", basename(argv[0]));
+    Usage(basename(argv[0]));
     return 1;
   }
 
@@ -177,15 +291,55 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  Timeline* timeline = nullptr;
+  int timeline_fd = -1;
+  if (timeline_file != nullptr) {
+    timeline_fd = open(timeline_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (timeline_fd == -1) {
+      fprintf(stderr, "Failed to create %s: %s\n", timeline_file, strerror(errno));
+      return 1;
+    }
+    timeline = new Timeline(timeline_interval_msecs * 1000000ULL);
+  }
+
   printf("Processing: %s\n", argv[1]);
 
-  // Do a first pass to get the total number of allocations used at one
-  // time to allow a single mmap that can hold the maximum number of
-  // pointers needed at once.
-  size_t max_allocs = GetMaxAllocs(dump_fd);
-  ProcessDump(dump_fd, max_allocs, max_threads);
+  CompiledDump compiled;
+  if (compiled.Map(dump_fd)) {
+    if (argc == 2 && compiled.max_threads() > max_threads) {
+      max_threads = compiled.max_threads();
+    }
+    if (parallel) {
+      ProcessCompiledDump<ParallelReplay>(&compiled, max_threads, size_classes, timeline);
+    } else {
+      ProcessCompiledDump<Replay>(&compiled, max_threads, size_classes, timeline);
+    }
+  } else {
+    // Do a first pass to get the total number of allocations used at one
+    // time to allow a single mmap that can hold the maximum number of
+    // pointers needed at once.
+    size_t max_allocs = GetMaxAllocs(dump_fd);
+    if (parallel) {
+      ProcessDump<ParallelReplay>(dump_fd, max_allocs, max_threads, size_classes, timeline);
+    } else {
+      ProcessDump<Replay>(dump_fd, max_allocs, max_threads, size_classes, timeline);
+    }
+  }
 
   close(dump_fd);
 
+  if (timeline != nullptr) {
+    if (!timeline->WriteCsv(timeline_fd)) {
+      fprintf(stderr, "Failed to write %s: %s\n", timeline_file, strerror(errno));
+      return 1;
+    }
+    printf("Timeline: %zu samples of the %s every %" PRIu64 "ms written to %s\n",
+           timeline->num_samples(),
+           timeline->rollup() ? "process PSS" : "native PSS", timeline->interval_nsecs() / 1000000,
+           timeline_file);
+    close(timeline_fd);
+    delete timeline;
+  }
+
   return 0;
 }
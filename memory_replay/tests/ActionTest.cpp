@@ -166,3 +166,17 @@ TEST(ActionTest, endthread) {
 
   action->Execute(nullptr);
 }
+
+TEST(ActionTest, parse_line) {
+  ActionEntry entry;
+  ASSERT_TRUE(Action::ParseLine("1234: realloc 0xb000 0xa000 100", &entry));
+  ASSERT_EQ(1234, entry.tid);
+  ASSERT_EQ(ACTION_REALLOC, entry.type);
+  ASSERT_EQ(0xb000U, entry.key_pointer);
+  ASSERT_EQ(0xa000U, entry.arg);
+  ASSERT_EQ(100U, entry.size);
+
+  ASSERT_FALSE(Action::ParseLine("1234: malloc 0xb000", &entry));
+  ASSERT_FALSE(Action::ParseLine("1234: unknown 0xb000 100", &entry));
+  ASSERT_FALSE(Action::ParseLine("garbage", &entry));
+}
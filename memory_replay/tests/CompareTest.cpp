@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "Compare.h"
+
+TEST(CompareTest, parse_replay_output) {
+  std::string output =
+      "Final Native PSS: 94208 bytes 0.09MB\n"
+      "Final Native VA Space: 270336 bytes 0.26MB\n"
+      "Total Allocation/Free Time: 52938579ns 0.05s\n"
+      "Pointer lookups: 788823, average probes 1.01, max probes 3\n";
+  RunResult result;
+  ASSERT_TRUE(ParseReplayOutput(output, &result));
+  ASSERT_EQ(52938579U, result.time_nsecs);
+
+  ASSERT_FALSE(ParseReplayOutput("Final Native PSS: 94208 bytes 0.09MB\n", &result));
+}
+
+TEST(CompareTest, parse_timeline_csv) {
+  std::string csv =
+      "time_ms,actions,pss_bytes,va_bytes\n"
+      "0.146,2,69673984,90849280\n"
+      "20.060,7344,99829632,157958144\n"
+      "40.056,14514,70796288,460439552\n";
+  RunResult result;
+  ASSERT_TRUE(ParseTimelineCsv(csv, &result));
+  ASSERT_EQ(99829632U, result.peak_pss_bytes);
+  ASSERT_EQ(70796288U, result.final_pss_bytes);
+
+  ASSERT_FALSE(ParseTimelineCsv("time_ms,actions,pss_bytes,va_bytes\n", &result));
+}
+
+TEST(CompareTest, run_stats) {
+  RunStats stats;
+  ASSERT_EQ(0, stats.Mean());
+  ASSERT_EQ(0, stats.ConfidenceInterval95());
+
+  stats.Add(10);
+  ASSERT_EQ(10, stats.Mean());
+  ASSERT_EQ(0, stats.ConfidenceInterval95());
+
+  stats.Add(12);
+  stats.Add(14);
+  ASSERT_DOUBLE_EQ(12, stats.Mean());
+  ASSERT_DOUBLE_EQ(2, stats.StdDev());
+  // t(0.975, 2) * 2 / sqrt(3)
+  ASSERT_NEAR(4.303 * 2 / 1.7320508, stats.ConfidenceInterval95(), 0.001);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <android-base/test_utils.h>
+
+#include "Action.h"
+#include "CompiledDump.h"
+
+TEST(CompiledDumpTest, compile) {
+  TemporaryFile dump_file;
+  ASSERT_TRUE(dump_file.fd != -1);
+  std::string dump_data =
+      "100: malloc 0x1000 48\n"
+      "200: calloc 0x2000 32 8\n"
+      "100: realloc 0x3000 0x1000 150\n"
+      "200: memalign 0x4000 16 64\n"
+      "100: free 0x3000\n"
+      "300: free 0x0\n"
+      "300: thread_done 0x0\n";
+  ASSERT_TRUE(TEMP_FAILURE_RETRY(
+      write(dump_file.fd, dump_data.c_str(), dump_data.size())) != -1);
+
+  TemporaryFile compiled_file;
+  ASSERT_TRUE(compiled_file.fd != -1);
+  CompileDump(dump_file.fd, compiled_file.fd);
+
+  CompiledDump dump;
+  ASSERT_TRUE(dump.Map(compiled_file.fd));
+  ASSERT_EQ(7U, dump.num_entries());
+  ASSERT_EQ(3U, dump.max_allocs());
+  ASSERT_EQ(3U, dump.max_threads());
+
+  const ActionEntry* entries = dump.entries();
+  ASSERT_EQ(100, entries[0].tid);
+  ASSERT_EQ(ACTION_MALLOC, entries[0].type);
+  ASSERT_EQ(0x1000U, entries[0].key_pointer);
+  ASSERT_EQ(48U, entries[0].size);
+
+  ASSERT_EQ(ACTION_CALLOC, entries[1].type);
+  ASSERT_EQ(32U, entries[1].arg);
+  ASSERT_EQ(8U, entries[1].size);
+
+  ASSERT_EQ(ACTION_REALLOC, entries[2].type);
+  ASSERT_EQ(0x3000U, entries[2].key_pointer);
+  ASSERT_EQ(0x1000U, entries[2].arg);
+  ASSERT_EQ(150U, entries[2].size);
+
+  ASSERT_EQ(ACTION_MEMALIGN, entries[3].type);
+  ASSERT_EQ(16U, entries[3].arg);
+  ASSERT_EQ(64U, entries[3].size);
+
+  ASSERT_EQ(ACTION_FREE, entries[4].type);
+  ASSERT_EQ(ACTION_FREE, entries[5].type);
+  ASSERT_EQ(300, entries[6].tid);
+  ASSERT_EQ(ACTION_THREAD_DONE, entries[6].type);
+}
+
+TEST(CompiledDumpTest, text_dump) {
+  TemporaryFile dump_file;
+  ASSERT_TRUE(dump_file.fd != -1);
+  std::string dump_data = "100: malloc 0x1000 48\n";
+  ASSERT_TRUE(TEMP_FAILURE_RETRY(
+      write(dump_file.fd, dump_data.c_str(), dump_data.size())) != -1);
+
+  CompiledDump dump;
+  ASSERT_FALSE(dump.Map(dump_file.fd));
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Action.h"
+#include "LatencyStats.h"
+
+TEST(LatencyStatsTest, bucket_index) {
+  for (uint64_t value = 0; value < Histogram::SUB_BUCKETS; value++) {
+    ASSERT_EQ(static_cast<int>(value), Histogram::BucketIndex(value));
+    ASSERT_EQ(value, Histogram::BucketMax(value));
+  }
+  // Every value is in the bucket below its bucket max, and within about 3%.
+  for (uint64_t value = Histogram::SUB_BUCKETS; value < 1000000; value += value / 7 + 1) {
+    int index = Histogram::BucketIndex(value);
+    ASSERT_LE(value, Histogram::BucketMax(index)) << value;
+    ASSERT_GT(value, Histogram::BucketMax(index - 1)) << value;
+    ASSERT_LE(Histogram::BucketMax(index) - value, value / Histogram::SUB_BUCKETS) << value;
+  }
+  ASSERT_EQ(Histogram::NUM_BUCKETS - 1, Histogram::BucketIndex(UINT64_MAX));
+}
+
+TEST(LatencyStatsTest, percentile) {
+  Histogram histogram;
+  ASSERT_EQ(0U, histogram.Percentile(0.5));
+
+  for (uint64_t value = 1; value <= 1000; value++) {
+    histogram.Add(value);
+  }
+  ASSERT_EQ(1000U, histogram.count());
+  ASSERT_EQ(1000U, histogram.max());
+
+  uint64_t p50 = histogram.Percentile(0.5);
+  ASSERT_GE(p50, 500U);
+  ASSERT_LE(p50, 500U + 500U / Histogram::SUB_BUCKETS);
+  uint64_t p99 = histogram.Percentile(0.99);
+  ASSERT_GE(p99, 990U);
+  ASSERT_LE(p99, 1000U);
+  ASSERT_EQ(1000U, histogram.Percentile(1.0));
+
+  Histogram other;
+  other.Add(1000000);
+  histogram.Merge(other);
+  ASSERT_EQ(1001U, histogram.count());
+  ASSERT_EQ(1000000U, histogram.max());
+  ASSERT_EQ(1000000U, histogram.Percentile(1.0));
+}
+
+TEST(LatencyStatsTest, size_class) {
+  ASSERT_EQ(0, LatencyStats::SizeClass(0));
+  ASSERT_EQ(0, LatencyStats::SizeClass(16));
+  ASSERT_EQ(1, LatencyStats::SizeClass(17));
+  ASSERT_EQ(1, LatencyStats::SizeClass(32));
+  ASSERT_EQ(2, LatencyStats::SizeClass(33));
+  ASSERT_EQ(18, LatencyStats::SizeClass(4 * 1024 * 1024));
+  ASSERT_EQ(LatencyStats::NUM_SIZE_CLASSES - 1, LatencyStats::SizeClass(4 * 1024 * 1024 + 1));
+  ASSERT_EQ(LatencyStats::NUM_SIZE_CLASSES - 1, LatencyStats::SizeClass(UINT64_MAX));
+}
+
+TEST(LatencyStatsTest, add) {
+  LatencyStats* stats = LatencyStats::Create(true);
+  ASSERT_TRUE(stats != nullptr);
+
+  ActionEntry entry = {};
+  entry.type = ACTION_MALLOC;
+  entry.size = 100;
+  stats->Add(entry, 50);
+  entry.type = ACTION_FREE;
+  entry.key_pointer = 0x1000;
+  stats->Add(entry, 20);
+  // A free of a null pointer is not recorded.
+  entry.key_pointer = 0;
+  stats->Add(entry, 20);
+  entry.type = ACTION_THREAD_DONE;
+  stats->Add(entry, 20);
+
+  ASSERT_EQ(1U, stats->histogram(ACTION_MALLOC).count());
+  ASSERT_EQ(1U, stats->histogram(ACTION_FREE).count());
+  ASSERT_EQ(0U, stats->histogram(ACTION_CALLOC).count());
+
+  LatencyStats* total = LatencyStats::Create(true);
+  ASSERT_TRUE(total != nullptr);
+  total->Merge(*stats);
+  total->Merge(*stats);
+  ASSERT_EQ(2U, total->histogram(ACTION_MALLOC).count());
+  ASSERT_EQ(50U, total->histogram(ACTION_MALLOC).max());
+
+  stats->Clear();
+  ASSERT_EQ(0U, stats->histogram(ACTION_MALLOC).count());
+  ASSERT_EQ(0U, stats->histogram(ACTION_FREE).count());
+
+  LatencyStats::Destroy(stats);
+  LatencyStats::Destroy(total);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Action.h"
+#include "ParallelReplay.h"
+
+static ActionEntry Entry(pid_t tid, uint32_t type, uint64_t key_pointer,
+                         uint64_t size = 0, uint64_t arg = 0) {
+  ActionEntry entry;
+  entry.tid = tid;
+  entry.type = type;
+  entry.key_pointer = key_pointer;
+  entry.size = size;
+  entry.arg = arg;
+  return entry;
+}
+
+TEST(ParallelReplayTest, cross_thread_frees) {
+  ParallelReplay replay(1000, 4, false);
+
+  // Each thread frees what the previous one allocated, so every free
+  // depends on an action of another thread.
+  for (size_t i = 0; i < 1000; i++) {
+    pid_t tid = 100 + i % 3;
+    replay.Run(Entry(tid, ACTION_MALLOC, 0x1000 + i * 16, 32));
+    if (i > 0) {
+      replay.Run(Entry(tid, ACTION_FREE, 0x1000 + (i - 1) * 16));
+    }
+  }
+  replay.Run(Entry(100, ACTION_REALLOC, 0x100000, 64, 0x1000 + 999 * 16));
+  replay.Run(Entry(101, ACTION_FREE, 0x100000));
+  replay.Finish();
+}
+
+TEST(ParallelReplayTest, reuse_threads) {
+  ParallelReplay replay(10, 1, true);
+  ASSERT_LE(1U, replay.max_threads());
+
+  // More threads than workers are replayed, as long as they do not all
+  // run at the same time.
+  for (size_t i = 0; i < 3 * replay.max_threads(); i++) {
+    pid_t tid = 200 + i;
+    replay.Run(Entry(tid, ACTION_CALLOC, 0x2000 + i * 16, 8, 4));
+    replay.Run(Entry(tid, ACTION_FREE, 0x2000 + i * 16));
+    replay.Run(Entry(tid, ACTION_THREAD_DONE, 0));
+  }
+  replay.Finish();
+}
@@ -16,6 +16,8 @@
 
 #include <gtest/gtest.h>
 
+#include <vector>
+
 #include "Pointers.h"
 
 TEST(PointersTest, smoke) {
@@ -41,14 +43,21 @@ TEST(PointersTest, readd_pointer) {
 TEST(PointersTest, expect_collision) {
   Pointers pointers(2);
 
-  // This assumes the simple hash being used will result in a collision
-  // hitting the same entry.
-  pointers.Add(0x1234, reinterpret_cast<void*>(0xabcd));
-  pointers.Add(0x11234, reinterpret_cast<void*>(0xabcf));
-  void* memory_pointer = pointers.Remove(0x11234);
-  ASSERT_EQ(reinterpret_cast<void*>(0xabcf), memory_pointer);
-  memory_pointer = pointers.Remove(0x1234);
-  ASSERT_EQ(reinterpret_cast<void*>(0xabcd), memory_pointer);
+  // With scattered keys filling half of the entries, some of them have
+  // to share an entry and be probed for.
+  size_t num_keys = pointers.max_pointers() / 2;
+  std::vector<uintptr_t> keys;
+  uintptr_t key = 0x1234;
+  for (size_t i = 0; i < num_keys; i++) {
+    key = key * 1103515245 + 12345;
+    keys.push_back((key & 0xffffff) << 4);
+    pointers.Add(keys[i], reinterpret_cast<void*>(0xabcd + i));
+  }
+  ASSERT_LT(1U, pointers.max_probes());
+  for (size_t i = 0; i < num_keys; i++) {
+    void* memory_pointer = pointers.Remove(keys[i]);
+    ASSERT_EQ(reinterpret_cast<void*>(0xabcd + i), memory_pointer);
+  }
 }
 
 TEST(PointersTest, multiple_add_removes) {
@@ -77,6 +86,45 @@ TEST(PointersTest, multiple_add_removes) {
   ASSERT_EQ(reinterpret_cast<void*>(0x2abcd), memory_pointer);
 }
 
+TEST(PointersTest, power_of_two) {
+  for (size_t allocs : {1, 100, 1000, 12345}) {
+    Pointers pointers(allocs);
+    size_t max_pointers = pointers.max_pointers();
+    ASSERT_GE(max_pointers, allocs * 4);
+    ASSERT_EQ(0U, max_pointers & (max_pointers - 1)) << max_pointers;
+  }
+}
+
+TEST(PointersTest, reuse_tombstones) {
+  Pointers pointers(16);
+
+  // Fill the whole table and empty it twice, so the second time every
+  // entry is a tombstone.
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < pointers.max_pointers(); i++) {
+      pointers.Add(0x10000 + i * 16, reinterpret_cast<void*>(i + 1));
+    }
+    for (size_t i = 0; i < pointers.max_pointers(); i++) {
+      ASSERT_EQ(reinterpret_cast<void*>(i + 1), pointers.Remove(0x10000 + i * 16));
+    }
+  }
+}
+
+TEST(PointersTest, aligned_probes) {
+  Pointers pointers(1000);
+
+  // Pointers that are all 16 byte aligned should not cluster.
+  for (size_t i = 0; i < 1000; i++) {
+    pointers.Add(0x7f0000000000 + i * 16, reinterpret_cast<void*>(i + 1));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    ASSERT_EQ(reinterpret_cast<void*>(i + 1), pointers.Remove(0x7f0000000000 + i * 16));
+  }
+  ASSERT_EQ(2000U, pointers.lookups());
+  ASSERT_LT(pointers.total_probes(), 2000U * 2);
+  ASSERT_LT(pointers.max_probes(), 16U);
+}
+
 static void TestNoEntriesLeft() {
   Pointers pointers(1);
 
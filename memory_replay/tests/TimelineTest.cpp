@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <android-base/test_utils.h>
+
+#include "Timeline.h"
+
+TEST(TimelineTest, parse_rollup_pss) {
+  std::string rollup_data =
+      "00400000-7ffd1b1fe000 ---p 00000000 00:00 0                              [rollup]\n"
+      "Rss:                9708 kB\n"
+      "Pss:                4529 kB\n"
+      "Pss_Anon:           2164 kB\n"
+      "Shared_Clean:       5356 kB\n";
+  uint64_t pss_bytes = 0;
+  ASSERT_TRUE(ParseRollupPss(rollup_data.c_str(), &pss_bytes));
+  ASSERT_EQ(4529U * 1024, pss_bytes);
+
+  ASSERT_FALSE(ParseRollupPss("Rss:                9708 kB\n", &pss_bytes));
+}
+
+TEST(TimelineTest, samples) {
+  Timeline timeline(1000000);
+  timeline.Start();
+  timeline.SetActions(10);
+  usleep(20000);
+  timeline.SetActions(20);
+  timeline.Stop();
+
+  size_t num_samples = timeline.num_samples();
+  ASSERT_LE(2U, num_samples);
+  const Timeline::Sample* samples = timeline.samples();
+  ASSERT_EQ(20U, samples[num_samples - 1].actions);
+  for (size_t i = 0; i < num_samples; i++) {
+    ASSERT_NE(0U, samples[i].pss_bytes) << i;
+    ASSERT_NE(0U, samples[i].va_bytes) << i;
+    if (i > 0) {
+      ASSERT_LE(samples[i - 1].time_nsecs, samples[i].time_nsecs) << i;
+    }
+  }
+
+  TemporaryFile csv_file;
+  ASSERT_TRUE(csv_file.fd != -1);
+  ASSERT_TRUE(timeline.WriteCsv(csv_file.fd));
+  ASSERT_TRUE(lseek(csv_file.fd, 0, SEEK_SET) != off_t(-1));
+  char buffer[4096];
+  ssize_t bytes = read(csv_file.fd, buffer, sizeof(buffer) - 1);
+  ASSERT_LT(0, bytes);
+  buffer[bytes] = '\0';
+  std::string csv(buffer);
+  ASSERT_EQ(0U, csv.find("time_ms,actions,pss_bytes,va_bytes\n0.")) << csv;
+}
+
+TEST(TimelineTest, downsample) {
+  Timeline timeline(1000000, 4);
+  timeline.Start();
+  usleep(50000);
+  timeline.Stop();
+
+  // The buffer filled up at least twice, every time halving the samples
+  // kept and doubling the interval.
+  ASSERT_LE(2U, timeline.num_samples());
+  ASSERT_GE(4U, timeline.num_samples());
+  ASSERT_LE(4000000U, timeline.interval_nsecs());
+  ASSERT_EQ(0U, timeline.samples()[0].time_nsecs / 1000000);
+}
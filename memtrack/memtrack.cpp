@@ -72,7 +72,7 @@ bool FileData::isAvail(size_t bytes_needed) {
   while (cur_idx_ + bytes_needed >= len_) {
     bytes = read(fd_, data_ + len_, max_ - len_);
     if (bytes == 0 || bytes == -1) {
-      read_complete_;
+      read_complete_ = true;
       break;
     }
     len_ += bytes;
@@ -116,6 +116,7 @@ bool FileData::getPss(size_t *pss) {
 const char *ProcessInfo::kProc = "/proc/";
 const char *ProcessInfo::kCmdline = "/cmdline";
 const char *ProcessInfo::kSmaps = "/smaps";
+const char *ProcessInfo::kSmapsRollup = "/smaps_rollup";
 
 ProcessInfo::ProcessInfo() {
   memcpy(proc_file_, kProc, kProcLen);
@@ -124,6 +125,20 @@ ProcessInfo::ProcessInfo() {
 ProcessInfo::~ProcessInfo() {
 }
 
+bool ProcessInfo::readPss(size_t *pss_kb) {
+  FileData data(proc_file_, buffer_, sizeof(buffer_));
+  if (!data.isOpen()) {
+    return false;
+  }
+
+  size_t pss;
+  *pss_kb = 0;
+  while (data.getPss(&pss)) {
+    *pss_kb += pss;
+  }
+  return true;
+}
+
 bool ProcessInfo::getInformation(int pid, char *pid_str, size_t pid_str_len) {
   memcpy(proc_file_ + kProcLen, pid_str, pid_str_len);
   memcpy(proc_file_ + kProcLen + pid_str_len, kCmdline, kCmdlineLen);
@@ -140,14 +155,13 @@ bool ProcessInfo::getInformation(int pid, char *pid_str, size_t pid_str_len) {
     return false;
   }
 
-  memcpy(proc_file_ + kProcLen + pid_str_len, kSmaps, kSmapsLen);
-  FileData smaps(proc_file_, buffer_, sizeof(buffer_));
-
+  // Only the total PSS is needed, which smaps_rollup has on a single line,
+  // without a walk through every map. Older kernels only have smaps.
   cur_process_info_t process_info;
-  size_t pss_kb;
-  process_info.pss_kb = 0;
-  while (smaps.getPss(&pss_kb)) {
-    process_info.pss_kb += pss_kb;
+  memcpy(proc_file_ + kProcLen + pid_str_len, kSmapsRollup, kSmapsRollupLen);
+  if (!readPss(&process_info.pss_kb)) {
+    memcpy(proc_file_ + kProcLen + pid_str_len, kSmaps, kSmapsLen);
+    readPss(&process_info.pss_kb);
   }
 
   if (cur_.count(cmd_name_) == 0) {
@@ -38,6 +38,9 @@ public:
   // Check if there is at least bytes available in the file data.
   bool isAvail(size_t bytes);
 
+  // Check if the file could be opened.
+  bool isOpen() const { return fd_ >= 0; }
+
 private:
   int fd_;
   char *data_;
@@ -84,6 +87,10 @@ public:
   void dumpToLog();
 
 private:
+  // Sum the PSS values in the file named by proc_file_. If the file cannot
+  // be opened, return false.
+  bool readPss(size_t *pss_kb);
+
   static const size_t kBufferLen = 4096;
   static const size_t kCmdNameLen = 1024;
 
@@ -96,6 +103,9 @@ private:
   static const char *kSmaps;
   static const size_t kSmapsLen = 7;  // Includes \0 at end of string.
 
+  static const char *kSmapsRollup;
+  static const size_t kSmapsRollupLen = 14;  // Includes \0 at end of string.
+
   static const char *kStatus;
   static const size_t kStatusLen = 8;  // Includes \0 at end of string.
 
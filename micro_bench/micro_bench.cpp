@@ -16,17 +16,25 @@
 
 /*
  * Micro-benchmarking of sleep/cpu speed/memcpy/memset/memory reads/strcmp.
+ *
+ * Benchmarks are added with REGISTER_BENCHMARK, which may be used from any
+ * file linked in to micro_bench.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <math.h>
 #include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
 
 // The default size of data that will be manipulated in each iteration of
 // a memory benchmark. Can be modified with the --data_size option.
@@ -47,6 +55,25 @@
 // Default memory alignment of malloc.
 #define DEFAULT_MALLOC_MEMORY_ALIGNMENT   8
 
+// The maximum number of benchmarks that can be registered.
+#define MAX_BENCHMARKS    64
+
+// Samples further than this many (scaled) median absolute deviations from
+// the median are dropped. Can be modified with --outlier_threshold.
+#define DEFAULT_OUTLIER_THRESHOLD   3
+
+// A benchmark fails against its baseline when it is this many percent
+// slower. Can be modified with --threshold.
+#define DEFAULT_BASELINE_THRESHOLD  5
+
+// The maximum number of cpus that benchmarks run on at once.
+#define MAX_CPUS    64
+
+// The warmup ends at the first window of this many samples whose median
+// is within WARMUP_TOLERANCE of the median of the second half of the run.
+#define WARMUP_WINDOW     5
+#define WARMUP_TOLERANCE  0.05
+
 // Contains information about benchmark options.
 typedef struct {
     bool print_average;
@@ -58,12 +85,28 @@ typedef struct {
     int src_or_mask;
 
     int cpu_to_lock;
+    // Run the benchmark on all of these cpus at once, instead of on
+    // cpu_to_lock; NULL if not set.
+    const char *cpus;
+    bool cluster_sweep;
+    bool record_freq;
+    // Frequency in kHz to lock the cpus to, or 0.
+    int lock_freq;
 
     int data_size;
     int dst_str_size;
     int cold_data_size;
     int cold_stride_size;
 
+    // Number of iterations dropped before computing the statistics, or -1
+    // to detect the end of the warmup.
+    int warmup;
+    int outlier_threshold;
+
+    const char *baseline_file;
+    const char *save_baseline_file;
+    int baseline_threshold;
+
     int args[MAX_ARGS];
     int num_args;
 } command_data_t;
@@ -74,14 +117,59 @@ typedef void *(*memset_func_t)(void *, int, size_t);
 typedef int (*strcmp_func_t)(const char *, const char *);
 typedef char *(*str_func_t)(char *, const char *);
 typedef size_t (*strlen_func_t)(const char *);
+typedef void *(*memchr_func_t)(const void *, int, size_t);
+typedef int (*memcmp_func_t)(const void *, const void *, size_t);
+typedef char *(*strchr_func_t)(const char *, int);
+typedef size_t (*wcslen_func_t)(const wchar_t *);
+typedef int (*wcscmp_func_t)(const wchar_t *, const wchar_t *);
+typedef wchar_t *(*wcscpy_func_t)(wchar_t *, const wchar_t *);
+
+typedef int (*benchmark_func_t)(const char *, const command_data_t &, void_func_t func);
 
 // Struct that contains a mapping of benchmark name to benchmark function.
 typedef struct {
     const char *name;
-    int (*ptr)(const char *, const command_data_t &, void_func_t func);
+    benchmark_func_t ptr;
     void_func_t func;
 } function_t;
 
+// All registered benchmarks, in the order they were registered.
+static function_t function_table[MAX_BENCHMARKS];
+static size_t num_functions;
+
+void registerBenchmark(const char *name, benchmark_func_t ptr, void_func_t func) {
+    if (num_functions == MAX_BENCHMARKS) {
+        fprintf(stderr, "Too many benchmarks, cannot register %s.\n", name);
+        abort();
+    }
+    function_table[num_functions].name = name;
+    function_table[num_functions].ptr = ptr;
+    function_table[num_functions].func = func;
+    num_functions++;
+}
+
+struct BenchmarkRegistrar {
+    BenchmarkRegistrar(const char *name, benchmark_func_t ptr, void_func_t func) {
+        registerBenchmark(name, ptr, func);
+    }
+};
+
+#define REGISTRAR_NAME2(line) benchmark_registrar_##line
+#define REGISTRAR_NAME(line) REGISTRAR_NAME2(line)
+
+// Registers the benchmark NAME, which runs BENCH on FUNC, the function
+// under test (or NULL). For example:
+//   REGISTER_BENCHMARK("memchr", benchmarkMemchr, memchr);
+#define REGISTER_BENCHMARK(name, bench, func) \
+    static BenchmarkRegistrar REGISTRAR_NAME(__LINE__)( \
+            name, bench, (void_func_t)(func))
+
+// Set when a benchmark is slower than its baseline.
+static bool baseline_failed;
+
+// The mean of the last benchmark, as printed by reportStats, or NAN.
+static double last_mean = NAN;
+
 // Get the current time in nanoseconds.
 uint64_t nanoTime() {
   struct timespec t;
@@ -192,16 +280,260 @@ static void inline printColdSummary(
         double running_avg, double square_avg, double min, double max) {
     printf("  %s %zux%zux%zu bytes average %.2f MB/s std dev %.4f min %.2f MB/s max %.2f MB/s\n",
            name, copies, num_buffers, size, running_avg/1024.0,
-           computeStdDev(running_avg, square_avg)/1024.0, min/1024.0, max/1024.0);
+           computeStdDev(square_avg, running_avg)/1024.0, min/1024.0, max/1024.0);
+}
+
+static int compareDouble(const void *a, const void *b) {
+    double da = *reinterpret_cast<const double*>(a);
+    double db = *reinterpret_cast<const double*>(b);
+    return (da > db) - (da < db);
+}
+
+// Returns the median of the n values, which are sorted in place.
+static double computeMedian(double *values, size_t n) {
+    qsort(values, n, sizeof(double), compareDouble);
+    if (n % 2)
+        return values[n / 2];
+    return (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Returns the number of samples at the start of a run that are still
+// warming up caches, branch predictors and cpu frequency: the samples
+// before the first window whose median is within WARMUP_TOLERANCE of the
+// median of the second half of the run. At most half of the run is
+// dropped.
+static size_t detectWarmup(const double *samples, size_t num_samples) {
+    size_t window = num_samples / 4;
+    if (window > WARMUP_WINDOW)
+        window = WARMUP_WINDOW;
+    if (window == 0)
+        return 0;
+
+    size_t half = num_samples / 2;
+    double *values = reinterpret_cast<double*>(malloc(num_samples * sizeof(double)));
+    if (!values)
+        return 0;
+    memcpy(values, samples + half, (num_samples - half) * sizeof(double));
+    double steady = computeMedian(values, num_samples - half);
+
+    size_t warmup = half;
+    for (size_t i = 0; i < half; i++) {
+        memcpy(values, samples + i, window * sizeof(double));
+        if (fabs(computeMedian(values, window) - steady) <= WARMUP_TOLERANCE * steady) {
+            warmup = i;
+            break;
+        }
+    }
+    free(values);
+    return warmup;
+}
+
+// Returns the half width of the 95% confidence interval of the mean.
+static double computeConfidenceInterval(double std_dev, size_t n) {
+    // Two sided 97.5% quantiles of the t distribution for 1 to 30 degrees
+    // of freedom; past that the normal quantile is close enough.
+    static const double t975[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (n < 2)
+        return 0.0;
+    size_t df = n - 1;
+    double t = df <= sizeof(t975)/sizeof(t975[0]) ? t975[df - 1] : 1.960;
+    return t * std_dev / sqrt(n);
+}
+
+// The result of one benchmark, as stored in a baseline file.
+typedef struct {
+    double mean;
+    double ci;
+    size_t samples;
+} result_t;
+
+// The baseline file has one line per benchmark:
+//   NAME NUM_BYTES MEAN CI SAMPLES
+// with the mean and the half width of its 95% confidence interval in MB/s,
+// or in seconds for sleep.
+static bool readBaseline(const char *file, const char *name, int size, result_t *result) {
+    FILE *fp = fopen(file, "r");
+    if (!fp)
+        return false;
+    char line[256];
+    char line_name[128];
+    int line_size;
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        found = sscanf(line, "%127s %d %lf %lf %zu", line_name, &line_size,
+                       &result->mean, &result->ci, &result->samples) == 5 &&
+                strcmp(line_name, name) == 0 && line_size == size;
+    }
+    fclose(fp);
+    return found;
+}
+
+// Writes the result to the baseline file, replacing the line of the same
+// benchmark and size if there is one, so that one file can hold the
+// baseline of many runs.
+static bool saveBaseline(const char *file, const char *name, int size, const result_t &result) {
+    char *old_data = NULL;
+    size_t old_size = 0;
+    FILE *fp = fopen(file, "r");
+    if (fp) {
+        char buf[4096];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            char *data = reinterpret_cast<char*>(realloc(old_data, old_size + len + 1));
+            if (!data) {
+                free(old_data);
+                fclose(fp);
+                return false;
+            }
+            old_data = data;
+            memcpy(old_data + old_size, buf, len);
+            old_size += len;
+        }
+        fclose(fp);
+    }
+
+    fp = fopen(file, "w");
+    if (!fp) {
+        free(old_data);
+        return false;
+    }
+    bool replaced = false;
+    if (old_data) {
+        old_data[old_size] = '\0';
+        char *save_ptr;
+        for (char *line = strtok_r(old_data, "\n", &save_ptr); line;
+             line = strtok_r(NULL, "\n", &save_ptr)) {
+            char line_name[128];
+            int line_size;
+            if (sscanf(line, "%127s %d", line_name, &line_size) == 2 &&
+                strcmp(line_name, name) == 0 && line_size == size) {
+                if (replaced)
+                    continue;
+                fprintf(fp, "%s %d %f %f %zu\n", name, size, result.mean, result.ci,
+                        result.samples);
+                replaced = true;
+            } else {
+                fprintf(fp, "%s\n", line);
+            }
+        }
+        free(old_data);
+    }
+    if (!replaced)
+        fprintf(fp, "%s %d %f %f %zu\n", name, size, result.mean, result.ci, result.samples);
+    return fclose(fp) == 0;
 }
 
-#define MAINLOOP(cmd_data, BENCH, COMPUTE_AVG, PRINT_ITER, PRINT_AVG) \
+// Prints the mean of the samples with its 95% confidence interval, after
+// dropping the warmup and the outliers, and compares it with the baseline.
+// A benchmark fails only if it is more than the threshold slower than the
+// baseline and the two confidence intervals do not overlap, so that noise
+// on either run does not fail it.
+static void reportStats(const char *name, const command_data_t &cmd_data, bool rate,
+                        const double *samples, int num_samples) {
+    if (!samples || num_samples <= 0)
+        return;
+
+    size_t warmup;
+    if (cmd_data.warmup >= 0) {
+        warmup = cmd_data.warmup < num_samples ? cmd_data.warmup : num_samples - 1;
+    } else {
+        warmup = detectWarmup(samples, num_samples);
+    }
+    size_t n = num_samples - warmup;
+    // In MB/s, or in seconds.
+    double scale = rate ? 1/1024.0 : 1.0;
+    const char *unit = rate ? "MB/s" : "seconds";
+
+    double *values = reinterpret_cast<double*>(malloc(n * sizeof(double)));
+    if (!values)
+        return;
+    memcpy(values, samples + warmup, n * sizeof(double));
+    double median = computeMedian(values, n);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = fabs(samples[warmup + i] - median);
+    }
+    // Scaled so that it estimates the standard deviation of normal samples.
+    // When most samples are nearly the same, it is kept from going below 1%
+    // of the median, so that ordinary jitter is not dropped.
+    double mad = 1.4826 * computeMedian(values, n);
+    if (mad < 0.01 * median)
+        mad = 0.01 * median;
+
+    size_t kept = 0;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double value = samples[warmup + i];
+        if (cmd_data.outlier_threshold > 0 &&
+            fabs(value - median) > cmd_data.outlier_threshold * mad) {
+            continue;
+        }
+        values[kept++] = value;
+        sum += value;
+    }
+    double mean = sum / kept;
+    double square_sum = 0.0;
+    for (size_t i = 0; i < kept; i++) {
+        square_sum += (values[i] - mean) * (values[i] - mean);
+    }
+    double std_dev = kept > 1 ? sqrt(square_sum / (kept - 1)) : 0.0;
+    free(values);
+
+    result_t result;
+    result.mean = mean * scale;
+    result.ci = computeConfidenceInterval(std_dev, kept) * scale;
+    result.samples = kept;
+    last_mean = result.mean;
+    printf("  %s mean %.6g %s +- %.6g (95%% confidence) median %.6g %s, "
+           "%zu samples, %zu warmup, %zu outliers\n",
+           name, result.mean, unit, result.ci, median * scale, unit, kept, warmup,
+           n - kept);
+
+    int size = cmd_data.args[0];
+    if (cmd_data.baseline_file) {
+        result_t base;
+        if (!readBaseline(cmd_data.baseline_file, name, size, &base)) {
+            printf("  %s %d: no baseline in %s\n", name, size, cmd_data.baseline_file);
+        } else {
+            double change = (result.mean - base.mean) / base.mean * 100.0;
+            // Positive when slower.
+            double slower = rate ? -change : change;
+            bool overlap = rate ? result.mean + result.ci >= base.mean - base.ci
+                                : result.mean - result.ci <= base.mean + base.ci;
+            bool failed = slower > cmd_data.baseline_threshold && !overlap;
+            printf("  %s %d: baseline %.6g %s +- %.6g, change %+.2f%%: %s\n", name, size,
+                   base.mean, unit, base.ci, change,
+                   failed ? "FAIL" : slower > cmd_data.baseline_threshold ?
+                           "PASS (within noise)" : "PASS");
+            if (failed)
+                baseline_failed = true;
+        }
+    }
+    if (cmd_data.save_baseline_file &&
+        !saveBaseline(cmd_data.save_baseline_file, name, size, result)) {
+        perror("Unable to save the baseline");
+    }
+}
+
+// RATE is true when COMPUTE_AVG is a throughput in KB/s, and false when
+// it is a time in seconds. Each value is kept for reportStats when the
+// average is printed.
+#define MAINLOOP(name, cmd_data, RATE, BENCH, COMPUTE_AVG, PRINT_ITER, PRINT_AVG) \
     uint64_t time_ns;                                                 \
     int iters = cmd_data.args[1];                                     \
     bool print_average = cmd_data.print_average;                      \
     bool print_each_iter = cmd_data.print_each_iter;                  \
     double min = 0.0, max = 0.0, running_avg = 0.0, square_avg = 0.0; \
     double avg;                                                       \
+    double *samples = NULL;                                           \
+    if (print_average && iters > 0) {                                 \
+        samples = reinterpret_cast<double*>(malloc(iters * sizeof(double))); \
+        if (!samples)                                                 \
+            return -1;                                                \
+    }                                                                 \
     for (int i = 0; iters == -1 || i < iters; i++) {                  \
         time_ns = nanoTime();                                         \
         BENCH;                                                        \
@@ -216,6 +548,9 @@ static void inline printColdSummary(
             if (avg > max) {                                          \
                 max = avg;                                            \
             }                                                         \
+            if (samples) {                                            \
+                samples[i] = avg;                                     \
+            }                                                         \
         }                                                             \
         if (print_each_iter) {                                        \
             PRINT_ITER;                                               \
@@ -223,12 +558,14 @@ static void inline printColdSummary(
     }                                                                 \
     if (print_average) {                                              \
         PRINT_AVG;                                                    \
-    }
+        reportStats(name, cmd_data, RATE, samples, iters);            \
+    }                                                                 \
+    free(samples);
 
 #define MAINLOOP_DATA(name, cmd_data, size, BENCH)                    \
     size_t copies = cmd_data.data_size/size;                          \
     size_t j;                                                         \
-    MAINLOOP(cmd_data,                                                \
+    MAINLOOP(name, cmd_data, true,                                    \
              for (j = 0; j < copies; j++) {                           \
                  BENCH;                                               \
              },                                                       \
@@ -253,7 +590,7 @@ static void inline printColdSummary(
         return -1;                                                            \
     }                                                                         \
     size_t j, k;                                                              \
-    MAINLOOP(cmd_data,                                                        \
+    MAINLOOP(name, cmd_data, true,                                            \
              for (j = 0; j < copies; j++) {                                   \
                  for (k = 0; k < num_incrs; k++) {                            \
                      BENCH;                                                   \
@@ -378,9 +715,9 @@ static void inline printColdSummary(
                       buf2 += buf2_stride_incr;                               \
                   });
 
-int benchmarkSleep(const char* /*name*/, const command_data_t &cmd_data, void_func_t /*func*/) {
+int benchmarkSleep(const char *name, const command_data_t &cmd_data, void_func_t /*func*/) {
     int delay = cmd_data.args[0];
-    MAINLOOP(cmd_data, sleep(delay),
+    MAINLOOP(name, cmd_data, false, sleep(delay),
              (double)time_ns/NS_PER_SEC,
              printf("sleep(%d) took %.06f seconds\n", delay, avg);,
              printf("  sleep(%d) average %.06f seconds std dev %f min %.06f seconds max %0.6f seconds\n", \
@@ -584,25 +921,150 @@ int benchmarkStrcpyCold(const char *name, const command_data_t &cmd_data, void_f
     return 0;
 }
 
-// Create the mapping structure.
-function_t function_table[] = {
-    { "memcpy", benchmarkMemcpy, reinterpret_cast<void_func_t>(memcpy) },
-    { "memcpy_cold", benchmarkMemcpyCold, reinterpret_cast<void_func_t>(memcpy) },
-    { "memmove_forward", benchmarkMemcpy, reinterpret_cast<void_func_t>(memmove) },
-    { "memmove_backward", benchmarkMemmoveBackwards, reinterpret_cast<void_func_t>(memmove) },
-    { "memread", benchmarkMemread, NULL },
-    { "memset", benchmarkMemset, reinterpret_cast<void_func_t>(memset) },
-    { "memset_cold", benchmarkMemsetCold, reinterpret_cast<void_func_t>(memset) },
-    { "sleep", benchmarkSleep, NULL },
-    { "strcat", benchmarkStrcat, reinterpret_cast<void_func_t>(strcat) },
-    { "strcat_cold", benchmarkStrcatCold, reinterpret_cast<void_func_t>(strcat) },
-    { "strcmp", benchmarkStrcmp, reinterpret_cast<void_func_t>(strcmp) },
-    { "strcmp_cold", benchmarkStrcmpCold, reinterpret_cast<void_func_t>(strcmp) },
-    { "strcpy", benchmarkStrcpy, reinterpret_cast<void_func_t>(strcpy) },
-    { "strcpy_cold", benchmarkStrcpyCold, reinterpret_cast<void_func_t>(strcpy) },
-    { "strlen", benchmarkStrlen, reinterpret_cast<void_func_t>(strlen) },
-    { "strlen_cold", benchmarkStrlenCold, reinterpret_cast<void_func_t>(strlen) },
-};
+int benchmarkMemchr(const char *name, const command_data_t &cmd_data, void_func_t func) {
+    memchr_func_t memchr_func = reinterpret_cast<memchr_func_t>(func);
+
+    void *result;
+    BENCH_ONE_BUF(name, cmd_data,
+                  memset(buf, 'a', size); \
+                  buf[size-1] = 'b',
+                  result = memchr_func(buf, 'b', size); \
+                  if (result != buf + size - 1) { \
+                      printf("%s failed, did not find the last byte\n", name); \
+                      return -1; \
+                  });
+
+    return 0;
+}
+
+int benchmarkMemcmp(const char *name, const command_data_t &cmd_data, void_func_t func) {
+    memcmp_func_t memcmp_func = reinterpret_cast<memcmp_func_t>(func);
+
+    int retval;
+    BENCH_TWO_BUFS(name, cmd_data,
+                   memset(buf1, 'a', size); \
+                   memset(buf2, 'a', size),
+                   retval = memcmp_func(buf1, buf2, size); \
+                   if (retval != 0) printf("%s failed, return value %d\n", name, retval));
+
+    return 0;
+}
+
+int benchmarkStrchr(const char *name, const command_data_t &cmd_data, void_func_t func) {
+    strchr_func_t strchr_func = reinterpret_cast<strchr_func_t>(func);
+
+    char *result;
+    // initString only uses printable characters, so the whole string is
+    // searched for the tab.
+    BENCH_ONE_BUF(name, cmd_data,
+                  initString(buf, size),
+                  result = strchr_func(reinterpret_cast<char*>(buf), '\t'); \
+                  if (result) { \
+                      printf("%s failed, found a character not in the string\n", name); \
+                      return -1; \
+                  });
+
+    return 0;
+}
+
+void initWideString(uint8_t *buf, size_t size) {
+    wchar_t *str = reinterpret_cast<wchar_t*>(buf);
+    size_t len = size / sizeof(wchar_t);
+    for (size_t i = 0; i < len - 1; i++) {
+        str[i] = static_cast<wchar_t>(32 + (i % 96));
+    }
+    str[len-1] = L'\0';
+}
+
+// The wide character benchmarks take NUM_BYTES, which must hold at least
+// two characters, and use strings of NUM_BYTES / sizeof(wchar_t) - 1
+// characters.
+static bool checkWideSize(const char *name, const command_data_t &cmd_data) {
+    if (cmd_data.args[0] < static_cast<int>(2 * sizeof(wchar_t))) {
+        printf("%s requires NUM_BYTES to be at least %zu.\n", name, 2 * sizeof(wchar_t));
+        return false;
+    }
+    return true;
+}
+
+int benchmarkWcslen(const char *name, const command_data_t &cmd_data, void_func_t func) {
+    wcslen_func_t wcslen_func = reinterpret_cast<wcslen_func_t>(func);
+
+    if (!checkWideSize(name, cmd_data))
+        return -1;
+    size_t real_len;
+    BENCH_ONE_BUF(name, cmd_data,
+                  initWideString(buf, size),
+                  real_len = wcslen_func(reinterpret_cast<wchar_t*>(buf)); \
+                  if (real_len + 1 != size / sizeof(wchar_t)) { \
+                      printf("%s failed, expected %zu, got %zu\n", name, \
+                             size / sizeof(wchar_t) - 1, real_len); \
+                      return -1; \
+                  });
+
+    return 0;
+}
+
+int benchmarkWcscmp(const char *name, const command_data_t &cmd_data, void_func_t func) {
+    wcscmp_func_t wcscmp_func = reinterpret_cast<wcscmp_func_t>(func);
+
+    if (!checkWideSize(name, cmd_data))
+        return -1;
+    int retval;
+    BENCH_TWO_BUFS(name, cmd_data,
+                   initWideString(buf1, size); \
+                   initWideString(buf2, size),
+                   retval = wcscmp_func(reinterpret_cast<wchar_t*>(buf1), reinterpret_cast<wchar_t*>(buf2)); \
+                   if (retval != 0) printf("%s failed, return value %d\n", name, retval));
+
+    return 0;
+}
+
+int benchmarkWcscpy(const char *name, const command_data_t &cmd_data, void_func_t func) {
+    wcscpy_func_t wcscpy_func = reinterpret_cast<wcscpy_func_t>(func);
+
+    if (!checkWideSize(name, cmd_data))
+        return -1;
+    BENCH_TWO_BUFS(name, cmd_data,
+                   initWideString(buf1, size); \
+                   memset(buf2, 0, size),
+                   wcscpy_func(reinterpret_cast<wchar_t*>(buf2), reinterpret_cast<wchar_t*>(buf1)));
+
+    return 0;
+}
+
+// memchr and strchr are overloaded for const in C++, so they are
+// registered through these.
+static void *memchrFunc(const void *s, int c, size_t n) {
+    return const_cast<void*>(memchr(s, c, n));
+}
+
+static char *strchrFunc(const char *s, int c) {
+    return const_cast<char*>(strchr(s, c));
+}
+
+REGISTER_BENCHMARK("memcpy", benchmarkMemcpy, memcpy);
+REGISTER_BENCHMARK("memcpy_cold", benchmarkMemcpyCold, memcpy);
+REGISTER_BENCHMARK("memmove_forward", benchmarkMemcpy, memmove);
+REGISTER_BENCHMARK("memmove_backward", benchmarkMemmoveBackwards, memmove);
+REGISTER_BENCHMARK("memread", benchmarkMemread, NULL);
+REGISTER_BENCHMARK("memset", benchmarkMemset, memset);
+REGISTER_BENCHMARK("memset_cold", benchmarkMemsetCold, memset);
+REGISTER_BENCHMARK("sleep", benchmarkSleep, NULL);
+REGISTER_BENCHMARK("strcat", benchmarkStrcat, strcat);
+REGISTER_BENCHMARK("strcat_cold", benchmarkStrcatCold, strcat);
+REGISTER_BENCHMARK("strcmp", benchmarkStrcmp, strcmp);
+REGISTER_BENCHMARK("strcmp_cold", benchmarkStrcmpCold, strcmp);
+REGISTER_BENCHMARK("strcpy", benchmarkStrcpy, strcpy);
+REGISTER_BENCHMARK("strcpy_cold", benchmarkStrcpyCold, strcpy);
+REGISTER_BENCHMARK("strlen", benchmarkStrlen, strlen);
+REGISTER_BENCHMARK("strlen_cold", benchmarkStrlenCold, strlen);
+REGISTER_BENCHMARK("memchr", benchmarkMemchr, memchrFunc);
+REGISTER_BENCHMARK("memcmp", benchmarkMemcmp, memcmp);
+REGISTER_BENCHMARK("strchr", benchmarkStrchr, strchrFunc);
+REGISTER_BENCHMARK("wcslen", benchmarkWcslen, wcslen);
+REGISTER_BENCHMARK("wcscmp", benchmarkWcscmp, wcscmp);
+REGISTER_BENCHMARK("wcscpy", benchmarkWcscpy, wcscpy);
 
 void usage() {
     printf("Usage:\n");
@@ -611,7 +1073,11 @@ void usage() {
     printf("              [--src_align ALIGN] [--src_or_mask OR_MASK]\n");
     printf("              [--dst_align ALIGN] [--dst_or_mask OR_MASK]\n");
     printf("              [--dst_str_size SIZE] [--cold_data_size DATA_BYTES]\n");
-    printf("              [--cold_stride_size SIZE]\n");
+    printf("              [--cold_stride_size SIZE] [--warmup ITERS]\n");
+    printf("              [--outlier_threshold MADS] [--baseline FILE]\n");
+    printf("              [--save_baseline FILE] [--threshold PERCENT]\n");
+    printf("              [--cpus LIST | --cluster_sweep] [--record_freq]\n");
+    printf("              [--lock_freq KHZ]\n");
     printf("    --data_size DATA_BYTES\n");
     printf("      For the data benchmarks (memcpy/memset/memread) the approximate\n");
     printf("      size of data, in bytes, that will be manipulated in each iteration.\n");
@@ -647,6 +1113,35 @@ void usage() {
     printf("      For _cold benchmarks, use this as the minimum stride between iterations.\n");
     printf("      The default is 4096 bytes and the number should be larger than the amount of data\n");
     printf("      pulled in to the cache by each run of the benchmark.\n");
+    printf("    --warmup ITERS\n");
+    printf("      With --print_average, leave out the first ITERS iterations. The default\n");
+    printf("      is to leave out the iterations until the results settle.\n");
+    printf("    --outlier_threshold MADS\n");
+    printf("      With --print_average, leave out the iterations further than MADS median\n");
+    printf("      absolute deviations from the median. The default is %d, 0 keeps all.\n",
+           DEFAULT_OUTLIER_THRESHOLD);
+    printf("    --baseline FILE\n");
+    printf("      Compare the mean with the one saved in FILE for the same command and\n");
+    printf("      NUM_BYTES, and exit with 1 if it is slower by more than the threshold\n");
+    printf("      and the 95%% confidence intervals do not overlap. Implies --print_average.\n");
+    printf("    --save_baseline FILE\n");
+    printf("      Save the mean to FILE, replacing an earlier result of the same command\n");
+    printf("      and NUM_BYTES. Implies --print_average.\n");
+    printf("    --threshold PERCENT\n");
+    printf("      The slowdown against the baseline that fails. The default is %d.\n",
+           DEFAULT_BASELINE_THRESHOLD);
+    printf("    --cpus LIST\n");
+    printf("      Run the benchmark on each of the cpus in LIST at once, such as 0-3,6,\n");
+    printf("      to measure the contention for the shared caches and memory. With\n");
+    printf("      --print_average, the total of the means is printed. Requires ITERS.\n");
+    printf("    --cluster_sweep\n");
+    printf("      For each cpufreq cluster, such as the big and the little cores, run the\n");
+    printf("      benchmark on 1 to all of its cpus at once. Requires ITERS.\n");
+    printf("    --record_freq\n");
+    printf("      Print the frequency of each cpu used before and after each run.\n");
+    printf("    --lock_freq KHZ\n");
+    printf("      Lock the cpus used to KHZ through cpufreq during each run, restoring the\n");
+    printf("      limits afterwards. This requires root.\n");
     printf("    ITERS\n");
     printf("      The number of iterations to execute each benchmark. If not\n");
     printf("      passed in then run forever.\n");
@@ -661,9 +1156,19 @@ void usage() {
     printf("  micro_bench [--src_align ALIGN] [--src_or_mask OR_MASK] [--dst_align ALIGN] [--dst_or_mask OR_MASK] strcmp NUM_BYTES [ITERS]\n");
     printf("  micro_bench [--src_align ALIGN] [--src_or_mask OR_MASK] [--dst_align ALIGN] [--dst_or_mask] strcpy NUM_BYTES [ITERS]\n");
     printf("  micro_bench [--dst_align ALIGN] [--dst_or_mask OR_MASK] strlen NUM_BYTES [ITERS]\n");
+    printf("  micro_bench [--dst_align ALIGN] [--dst_or_mask OR_MASK] memchr NUM_BYTES [ITERS]\n");
+    printf("  micro_bench [--src_align ALIGN] [--src_or_mask OR_MASK] [--dst_align ALIGN] [--dst_or_mask OR_MASK] memcmp NUM_BYTES [ITERS]\n");
+    printf("  micro_bench [--dst_align ALIGN] [--dst_or_mask OR_MASK] strchr NUM_BYTES [ITERS]\n");
+    printf("  micro_bench [--src_align ALIGN] [--src_or_mask OR_MASK] [--dst_align ALIGN] [--dst_or_mask OR_MASK] wcslen|wcscmp|wcscpy NUM_BYTES [ITERS]\n");
     printf("\n");
     printf("  In addition, memcpy/memcpy/memset/strcat/strcpy/strlen have _cold versions\n");
     printf("  that will execute the function on a buffer not in the cache.\n");
+    printf("\n");
+    printf("  Commands:");
+    for (size_t i = 0; i < num_functions; i++) {
+        printf("%s %s", (i % 6) ? "" : "\n   ", function_table[i].name);
+    }
+    printf("\n");
 }
 
 function_t *processOptions(int argc, char **argv, command_data_t *cmd_data) {
@@ -678,10 +1183,19 @@ function_t *processOptions(int argc, char **argv, command_data_t *cmd_data) {
     cmd_data->dst_or_mask = 0;
     cmd_data->num_args = 0;
     cmd_data->cpu_to_lock = -1;
+    cmd_data->cpus = NULL;
+    cmd_data->cluster_sweep = false;
+    cmd_data->record_freq = false;
+    cmd_data->lock_freq = 0;
     cmd_data->data_size = DEFAULT_DATA_SIZE;
     cmd_data->dst_str_size = -1;
     cmd_data->cold_data_size = DEFAULT_COLD_DATA_SIZE;
     cmd_data->cold_stride_size = DEFAULT_COLD_STRIDE_SIZE;
+    cmd_data->warmup = -1;
+    cmd_data->outlier_threshold = DEFAULT_OUTLIER_THRESHOLD;
+    cmd_data->baseline_file = NULL;
+    cmd_data->save_baseline_file = NULL;
+    cmd_data->baseline_threshold = DEFAULT_BASELINE_THRESHOLD;
     for (int i = 0; i < MAX_ARGS; i++) {
         cmd_data->args[i] = -1;
     }
@@ -693,6 +1207,18 @@ function_t *processOptions(int argc, char **argv, command_data_t *cmd_data) {
                 cmd_data->print_average = true;
             } else if (strcmp(argv[i], "--no_print_each_iter") == 0) {
                 cmd_data->print_each_iter = false;
+            } else if (strcmp(argv[i], "--cluster_sweep") == 0) {
+                cmd_data->cluster_sweep = true;
+            } else if (strcmp(argv[i], "--record_freq") == 0) {
+                cmd_data->record_freq = true;
+            } else if (strcmp(argv[i], "--lock_freq") == 0) {
+                save_value = &cmd_data->lock_freq;
+            } else if (strcmp(argv[i], "--cpus") == 0) {
+                if (i == argc - 1) {
+                    printf("The option %s requires one argument.\n", argv[i]);
+                    return NULL;
+                }
+                cmd_data->cpus = argv[++i];
             } else if (strcmp(argv[i], "--dst_align") == 0) {
                 save_value = &cmd_data->dst_align;
             } else if (strcmp(argv[i], "--src_align") == 0) {
@@ -711,6 +1237,24 @@ function_t *processOptions(int argc, char **argv, command_data_t *cmd_data) {
                 save_value = &cmd_data->cold_data_size;
             } else if (strcmp(argv[i], "--cold_stride_size") == 0) {
                 save_value = &cmd_data->cold_stride_size;
+            } else if (strcmp(argv[i], "--warmup") == 0) {
+                save_value = &cmd_data->warmup;
+            } else if (strcmp(argv[i], "--outlier_threshold") == 0) {
+                save_value = &cmd_data->outlier_threshold;
+            } else if (strcmp(argv[i], "--threshold") == 0) {
+                save_value = &cmd_data->baseline_threshold;
+            } else if (strcmp(argv[i], "--baseline") == 0 ||
+                       strcmp(argv[i], "--save_baseline") == 0) {
+                if (i == argc - 1) {
+                    printf("The option %s requires one argument.\n", argv[i]);
+                    return NULL;
+                }
+                if (strcmp(argv[i], "--baseline") == 0) {
+                    cmd_data->baseline_file = argv[++i];
+                } else {
+                    cmd_data->save_baseline_file = argv[++i];
+                }
+                cmd_data->print_average = true;
             } else {
                 printf("Unknown option %s\n", argv[i]);
                 return NULL;
@@ -728,7 +1272,7 @@ function_t *processOptions(int argc, char **argv, command_data_t *cmd_data) {
                 *save_value = (int)strtol(argv[++i], NULL, 0);
             }
         } else if (!command) {
-            for (size_t j = 0; j < sizeof(function_table)/sizeof(function_t); j++) {
+            for (size_t j = 0; j < num_functions; j++) {
                 if (strcmp(argv[i], function_table[j].name) == 0) {
                     command = &function_table[j];
                     break;
@@ -777,23 +1321,40 @@ function_t *processOptions(int argc, char **argv, command_data_t *cmd_data) {
     } else if (cmd_data->dst_or_mask > cmd_data->dst_align) {
         printf("The value of --src_or_mask cannot be larger that --src_align.\n");
         return NULL;
+    } else if ((cmd_data->baseline_file || cmd_data->save_baseline_file) &&
+               cmd_data->num_args != 2) {
+        printf("The --baseline and --save_baseline options require ITERS.\n");
+        return NULL;
+    } else if ((cmd_data->cpus || cmd_data->cluster_sweep) && cmd_data->num_args != 2) {
+        printf("The --cpus and --cluster_sweep options require ITERS.\n");
+        return NULL;
+    } else if (cmd_data->cpus && cmd_data->cluster_sweep) {
+        printf("The --cpus and --cluster_sweep options cannot be used together.\n");
+        return NULL;
+    } else if ((cmd_data->cpus || cmd_data->cluster_sweep) &&
+               (cmd_data->baseline_file || cmd_data->save_baseline_file)) {
+        printf("The --baseline and --save_baseline options only work on one cpu.\n");
+        return NULL;
+    } else if (cmd_data->lock_freq < 0) {
+        printf("The --lock_freq option must be a positive number.\n");
+        return NULL;
+    } else if (cmd_data->outlier_threshold < 0) {
+        printf("The --outlier_threshold option must be greater than or equal to 0.\n");
+        return NULL;
     }
 
     return command;
 }
 
-bool raisePriorityAndLock(int cpu_to_lock) {
+// Returns cpu_to_lock if it is one the process can run on, or the last such
+// cpu if cpu_to_lock is -1; returns -1 if there is none.
+int findCpuToLock(int cpu_to_lock) {
     cpu_set_t cpuset;
 
-    if (setpriority(PRIO_PROCESS, 0, -20)) {
-        perror("Unable to raise priority of process.\n");
-        return false;
-    }
-
     CPU_ZERO(&cpuset);
     if (sched_getaffinity(0, sizeof(cpuset), &cpuset) != 0) {
         perror("sched_getaffinity failed");
-        return false;
+        return -1;
     }
 
     if (cpu_to_lock < 0) {
@@ -803,13 +1364,27 @@ bool raisePriorityAndLock(int cpu_to_lock) {
                 cpu_to_lock = i;
             }
         }
-    } else if (!CPU_ISSET(cpu_to_lock, &cpuset)) {
+    } else if (cpu_to_lock >= CPU_SETSIZE || !CPU_ISSET(cpu_to_lock, &cpuset)) {
         printf("Cpu %d does not exist.\n", cpu_to_lock);
-        return false;
+        return -1;
     }
 
     if (cpu_to_lock < 0) {
         printf("Cannot find any valid cpu to lock.\n");
+    }
+    return cpu_to_lock;
+}
+
+bool raisePriorityAndLock(int cpu_to_lock) {
+    cpu_set_t cpuset;
+
+    if (setpriority(PRIO_PROCESS, 0, -20)) {
+        perror("Unable to raise priority of process.\n");
+        return false;
+    }
+
+    cpu_to_lock = findCpuToLock(cpu_to_lock);
+    if (cpu_to_lock < 0) {
         return false;
     }
 
@@ -823,6 +1398,305 @@ bool raisePriorityAndLock(int cpu_to_lock) {
     return true;
 }
 
+typedef struct {
+    int cpus[MAX_CPUS];
+    int num_cpus;
+} cpu_list_t;
+
+// Parses a list of cpus such as "0-3,6" or, as in the cpufreq files,
+// "0 1 2 3". Returns false if the list is not valid.
+static bool parseCpuList(const char *str, cpu_list_t *list) {
+    list->num_cpus = 0;
+    while (*str) {
+        if (*str == ',' || isspace(*str)) {
+            str++;
+            continue;
+        }
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0)
+            return false;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first)
+                return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (list->num_cpus == MAX_CPUS)
+                return false;
+            list->cpus[list->num_cpus++] = cpu;
+        }
+        str = end;
+    }
+    return list->num_cpus > 0;
+}
+
+// Reads a value in kHz from the cpufreq directory of the cpu, returns -1
+// if there is none.
+static int readCpuFreq(int cpu, const char *file) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/%s", cpu, file);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    int khz;
+    if (fscanf(fp, "%d", &khz) != 1)
+        khz = -1;
+    fclose(fp);
+    return khz;
+}
+
+// Writes with open and write, so that it can be called from the signal
+// handler that restores the locked frequencies.
+static bool writeCpuFreq(int cpu, const char *file, int khz) {
+    char path[128];
+    char value[16];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/%s", cpu, file);
+    int len = snprintf(value, sizeof(value), "%d", khz);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return false;
+    bool written = write(fd, value, len) == len;
+    close(fd);
+    return written;
+}
+
+// The cpufreq limits saved by lockCpuFreqs, to be restored after the run.
+static cpu_list_t locked_cpus;
+static int saved_min_freq[MAX_CPUS];
+static int saved_max_freq[MAX_CPUS];
+
+static void restoreCpuFreqs() {
+    for (int i = 0; i < locked_cpus.num_cpus; i++) {
+        int cpu = locked_cpus.cpus[i];
+        // Lower the minimum first, so that the maximum can go below the
+        // locked frequency.
+        writeCpuFreq(cpu, "scaling_min_freq", readCpuFreq(cpu, "cpuinfo_min_freq"));
+        writeCpuFreq(cpu, "scaling_max_freq", saved_max_freq[i]);
+        writeCpuFreq(cpu, "scaling_min_freq", saved_min_freq[i]);
+    }
+    locked_cpus.num_cpus = 0;
+}
+
+static void restoreCpuFreqsAndExit(int sig) {
+    restoreCpuFreqs();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static bool lockCpuFreqs(const cpu_list_t &cpus, int khz) {
+    locked_cpus.num_cpus = 0;
+    for (int i = 0; i < cpus.num_cpus; i++) {
+        int cpu = cpus.cpus[i];
+        int min_freq = readCpuFreq(cpu, "scaling_min_freq");
+        int max_freq = readCpuFreq(cpu, "scaling_max_freq");
+        if (min_freq < 0 || max_freq < 0) {
+            printf("Cpu %d has no cpufreq limits to lock.\n", cpu);
+            restoreCpuFreqs();
+            return false;
+        }
+        saved_min_freq[locked_cpus.num_cpus] = min_freq;
+        saved_max_freq[locked_cpus.num_cpus] = max_freq;
+        locked_cpus.cpus[locked_cpus.num_cpus++] = cpu;
+
+        writeCpuFreq(cpu, "scaling_min_freq", readCpuFreq(cpu, "cpuinfo_min_freq"));
+        if (!writeCpuFreq(cpu, "scaling_max_freq", khz) ||
+            !writeCpuFreq(cpu, "scaling_min_freq", khz)) {
+            printf("Unable to lock cpu %d to %d kHz.\n", cpu, khz);
+            restoreCpuFreqs();
+            return false;
+        }
+    }
+    return true;
+}
+
+static void printCpuFreqs(const cpu_list_t &cpus, const int *before) {
+    for (int i = 0; i < cpus.num_cpus; i++) {
+        int cpu = cpus.cpus[i];
+        int after = readCpuFreq(cpu, "scaling_cur_freq");
+        if (before[i] < 0 || after < 0) {
+            printf("  cpu %d: frequency unknown, no cpufreq\n", cpu);
+        } else {
+            printf("  cpu %d: %d kHz before, %d kHz after\n", cpu, before[i], after);
+        }
+    }
+}
+
+// Runs the benchmark on all of the cpus at once, in one process per cpu.
+// The processes start together, and the output of each is printed after
+// all of them are done.
+static int runOnCpus(function_t *command, const command_data_t &cmd_data,
+                     const cpu_list_t &cpus) {
+    // A counter that the processes wait on before starting, followed by the
+    // mean of each.
+    size_t shared_size = sizeof(int) + cpus.num_cpus * sizeof(double);
+    void *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap failed");
+        return -1;
+    }
+    volatile int *ready = reinterpret_cast<volatile int*>(shared);
+    double *means = reinterpret_cast<double*>(reinterpret_cast<int*>(shared) + 1);
+
+    pid_t pids[MAX_CPUS];
+    FILE *outputs[MAX_CPUS];
+    int started = 0;
+    fflush(stdout);
+    for (; started < cpus.num_cpus; started++) {
+        means[started] = NAN;
+        outputs[started] = tmpfile();
+        if (!outputs[started]) {
+            perror("Unable to create the output file");
+            break;
+        }
+        pids[started] = fork();
+        if (pids[started] == -1) {
+            perror("fork failed");
+            fclose(outputs[started]);
+            break;
+        }
+        if (pids[started] == 0) {
+            dup2(fileno(outputs[started]), STDOUT_FILENO);
+            bool locked = raisePriorityAndLock(cpus.cpus[started]);
+            __sync_fetch_and_add(ready, 1);
+            if (!locked) {
+                exit(-1);
+            }
+            while (*ready < cpus.num_cpus) {
+            }
+            int ret = (*command->ptr)(command->name, cmd_data, command->func);
+            means[started] = last_mean;
+            exit(ret);
+        }
+    }
+    if (started < cpus.num_cpus) {
+        // Let the processes that did start run.
+        __sync_fetch_and_add(ready, cpus.num_cpus - started);
+    }
+
+    int ret = started == cpus.num_cpus ? 0 : -1;
+    double total = 0.0;
+    for (int i = 0; i < started; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            ret = -1;
+        }
+        printf("cpu %d:\n", cpus.cpus[i]);
+        rewind(outputs[i]);
+        char line[512];
+        while (fgets(line, sizeof(line), outputs[i])) {
+            fputs(line, stdout);
+        }
+        fclose(outputs[i]);
+        total += means[i];
+    }
+    if (cmd_data.print_average && ret == 0) {
+        printf("  %s total %.6g %s on %d cpus\n", command->name, total,
+               strcmp(command->name, "sleep") ? "MB/s" : "seconds", cpus.num_cpus);
+    }
+    munmap(shared, shared_size);
+    return ret;
+}
+
+// Runs the benchmark on the cpus, recording or locking their frequency
+// around the run as requested. A single cpu runs in this process.
+static int runBenchmark(function_t *command, const command_data_t &cmd_data,
+                        const cpu_list_t &cpus, bool multi) {
+    if (cmd_data.lock_freq && !lockCpuFreqs(cpus, cmd_data.lock_freq)) {
+        return -1;
+    }
+    int before[MAX_CPUS];
+    for (int i = 0; i < cpus.num_cpus; i++) {
+        before[i] = readCpuFreq(cpus.cpus[i], "scaling_cur_freq");
+    }
+
+    int ret;
+    if (multi) {
+        ret = runOnCpus(command, cmd_data, cpus);
+    } else if (!raisePriorityAndLock(cpus.cpus[0])) {
+        ret = -1;
+    } else {
+        ret = (*command->ptr)(command->name, cmd_data, command->func);
+    }
+
+    if (cmd_data.record_freq) {
+        printCpuFreqs(cpus, before);
+    }
+    restoreCpuFreqs();
+    return ret;
+}
+
+// Groups the cpus the process can run on by cpufreq policy, which on
+// big.LITTLE is one per cluster. Without cpufreq, all of them are one
+// cluster.
+static int findClusters(cpu_list_t *clusters, int max_clusters) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+        perror("sched_getaffinity failed");
+        return 0;
+    }
+
+    int first_cpus[MAX_CPUS];
+    int num_clusters = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cpuset))
+            continue;
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/related_cpus", cpu);
+        int first_cpu = -1;
+        FILE *fp = fopen(path, "r");
+        if (fp) {
+            char buf[256];
+            cpu_list_t related;
+            if (fgets(buf, sizeof(buf), fp) && parseCpuList(buf, &related))
+                first_cpu = related.cpus[0];
+            fclose(fp);
+        }
+
+        int i;
+        for (i = 0; i < num_clusters && first_cpus[i] != first_cpu; i++) {
+        }
+        if (i == num_clusters) {
+            if (num_clusters == max_clusters)
+                continue;
+            first_cpus[num_clusters] = first_cpu;
+            clusters[num_clusters++].num_cpus = 0;
+        }
+        if (clusters[i].num_cpus < MAX_CPUS)
+            clusters[i].cpus[clusters[i].num_cpus++] = cpu;
+    }
+    return num_clusters;
+}
+
+static int clusterSweep(function_t *command, const command_data_t &cmd_data) {
+    cpu_list_t clusters[MAX_CPUS];
+    int num_clusters = findClusters(clusters, MAX_CPUS);
+    if (num_clusters == 0) {
+        printf("Cannot find any cpus.\n");
+        return -1;
+    }
+
+    int ret = 0;
+    for (int c = 0; c < num_clusters && ret == 0; c++) {
+        const cpu_list_t &cluster = clusters[c];
+        for (int n = 1; n <= cluster.num_cpus && ret == 0; n++) {
+            cpu_list_t cpus = cluster;
+            cpus.num_cpus = n;
+            printf("cluster %d (cpus %d-%d, max %d kHz): %d cpus\n", c, cluster.cpus[0],
+                   cluster.cpus[cluster.num_cpus - 1],
+                   readCpuFreq(cluster.cpus[0], "cpuinfo_max_freq"), n);
+            fflush(stdout);
+            ret = runBenchmark(command, cmd_data, cpus, true);
+        }
+    }
+    return ret;
+}
+
 int main(int argc, char **argv) {
     command_data_t cmd_data;
 
@@ -832,10 +1706,39 @@ int main(int argc, char **argv) {
       return -1;
     }
 
-    if (!raisePriorityAndLock(cmd_data.cpu_to_lock)) {
-      return -1;
+    cpu_list_t cpus;
+    if (cmd_data.cpus) {
+        if (!parseCpuList(cmd_data.cpus, &cpus)) {
+            printf("The --cpus option must be a list of cpus such as 0-3,6.\n");
+            return -1;
+        }
+        for (int i = 0; i < cpus.num_cpus; i++) {
+            if (findCpuToLock(cpus.cpus[i]) < 0) {
+                return -1;
+            }
+        }
+    } else if (!cmd_data.cluster_sweep) {
+        cpus.cpus[0] = findCpuToLock(cmd_data.cpu_to_lock);
+        if (cpus.cpus[0] < 0) {
+            return -1;
+        }
+        cpus.num_cpus = 1;
+    }
+
+    if (cmd_data.lock_freq) {
+        signal(SIGINT, restoreCpuFreqsAndExit);
+        signal(SIGTERM, restoreCpuFreqsAndExit);
     }
 
     printf("%s\n", command->name);
-    return (*command->ptr)(command->name, cmd_data, command->func);
+    int ret;
+    if (cmd_data.cluster_sweep) {
+        ret = clusterSweep(command, cmd_data);
+    } else {
+        ret = runBenchmark(command, cmd_data, cpus, cmd_data.cpus != NULL);
+    }
+    if (ret == 0 && baseline_failed) {
+        return 1;
+    }
+    return ret;
 }
@@ -145,20 +145,88 @@ const uLongf * ZEXPORT get_crc_table()
 #define DO4(buf)  DO2(buf); DO2(buf);
 #define DO8(buf)  DO4(buf); DO4(buf);
 
-/* ========================================================================= */
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#include <string.h>
+
+/* ========================================================================
+ * ARMv8 has instructions for this very polynomial (unlike the crc32
+ * instruction of SSE 4.2, which uses the Castagnoli one).
+ */
 uLong ZEXPORT crc32(crc, buf, len)
     uLong crc;
     const Bytef *buf;
     uInt len;
 {
+    unsigned int c = (unsigned int)crc ^ 0xffffffffU;
+    while (len >= 8)
+    {
+      unsigned long long v;
+      memcpy(&v, buf, sizeof(v));
+      c = __crc32d(c, v);
+      buf += 8;
+      len -= 8;
+    }
+    while (len--)
+      c = __crc32b(c, *buf++);
+    return c ^ 0xffffffffU;
+}
+#else
+/* ========================================================================
+ * Tables for slicing-by-8: crc_tables[k][n] is the CRC of byte n followed by
+ * k zero bytes, so eight bytes are folded in at once with independent
+ * lookups, instead of with eight dependent steps. Made from crc_table on
+ * first use.
+ */
+local unsigned int crc_tables[8][256];
+local int crc_tables_empty = 1;
+
+local void make_crc_tables()
+{
+  uLong c;
+  int n, k;
+
 #ifdef DYNAMIC_CRC_TABLE
-    if (crc_table_empty)
-      make_crc_table();
+  if (crc_table_empty)
+    make_crc_table();
 #endif
+  for (n = 0; n < 256; n++)
+  {
+    c = crc_table[n];
+    crc_tables[0][n] = c;
+    for (k = 1; k < 8; k++)
+    {
+      c = crc_table[c & 0xff] ^ (c >> 8);
+      crc_tables[k][n] = c;
+    }
+  }
+  crc_tables_empty = 0;
+}
+
+/* little endian load, whatever the byte order of the host */
+#define LOAD32(buf) ((unsigned int)(buf)[0] | (unsigned int)(buf)[1] << 8 | \
+    (unsigned int)(buf)[2] << 16 | (unsigned int)(buf)[3] << 24)
+
+/* ========================================================================= */
+uLong ZEXPORT crc32(crc, buf, len)
+    uLong crc;
+    const Bytef *buf;
+    uInt len;
+{
+    unsigned int lo, hi;
+
+    if (crc_tables_empty)
+      make_crc_tables();
     crc = crc ^ 0xffffffffL;
     while (len >= 8)
     {
-      DO8(buf);
+      lo = (unsigned int)crc ^ LOAD32(buf);
+      hi = LOAD32(buf + 4);
+      crc = crc_tables[7][lo & 0xff] ^ crc_tables[6][(lo >> 8) & 0xff] ^
+            crc_tables[5][(lo >> 16) & 0xff] ^ crc_tables[4][lo >> 24] ^
+            crc_tables[3][hi & 0xff] ^ crc_tables[2][(hi >> 8) & 0xff] ^
+            crc_tables[1][(hi >> 16) & 0xff] ^ crc_tables[0][hi >> 24];
+      buf += 8;
       len -= 8;
     }
     if (len) do {
@@ -166,6 +234,7 @@ uLong ZEXPORT crc32(crc, buf, len)
     } while (--len);
     return crc ^ 0xffffffffL;
 }
+#endif
 
 #if (CONFIG_COMMANDS & CFG_CMD_JFFS2) || \
 	((CONFIG_COMMANDS & CFG_CMD_NAND) && !defined(CFG_NAND_LEGACY))
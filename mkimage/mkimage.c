@@ -142,6 +142,7 @@ table_entry_t comp_name[] = {
 };
 
 static	void	copy_file (int, const char *, int);
+static	void	write_data (int, const void *, size_t);
 static	void	usage	(void);
 static	void	print_header (image_header_t *);
 static	void	print_type (image_header_t *);
@@ -160,6 +161,13 @@ static	int	get_type(char *);
 char	*datafile;
 char	*imagefile;
 
+/*
+ * CRC and size of the data written after the header so far, so that
+ * the header can be filled in without reading the image back.
+ */
+static unsigned long data_crc = 0;
+static unsigned long data_size = 0;
+
 int dflag    = 0;
 int eflag    = 0;
 int lflag    = 0;
@@ -408,11 +416,7 @@ NXTARG:		;
 				size = 0;
 			}
 
-			if (write(ifd, (char *)&size, sizeof(size)) != sizeof(size)) {
-				fprintf (stderr, "%s: Write error on %s: %s\n",
-					cmdname, imagefile, strerror(errno));
-				exit (EXIT_FAILURE);
-			}
+			write_data (ifd, &size, sizeof(size));
 
 			if (!file) {
 				break;
@@ -453,25 +457,16 @@ NXTARG:		;
 		exit (EXIT_FAILURE);
 	}
 
-	ptr = (unsigned char *)mmap(0, sbuf.st_size,
-				    PROT_READ|PROT_WRITE, MAP_SHARED, ifd, 0);
-	if (ptr == (unsigned char *)MAP_FAILED) {
-		fprintf (stderr, "%s: Can't map %s: %s\n",
-			cmdname, imagefile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	hdr = (image_header_t *)ptr;
-
-	checksum = crc32 (0,
-			  (const char *)(ptr + sizeof(image_header_t)),
-			  sbuf.st_size - sizeof(image_header_t)
-			 );
+	/*
+	 * The data CRC was computed while the data was written,
+	 * so only the header is left to write.
+	 */
+	checksum = data_crc;
 
 	/* Build new header */
 	hdr->ih_magic = htonl(IH_MAGIC);
 	hdr->ih_time  = htonl(sbuf.st_mtime);
-	hdr->ih_size  = htonl(sbuf.st_size - sizeof(image_header_t));
+	hdr->ih_size  = htonl(data_size);
 	hdr->ih_load  = htonl(addr);
 	hdr->ih_ep    = htonl(ep);
 	hdr->ih_dcrc  = htonl(checksum);
@@ -488,7 +483,12 @@ NXTARG:		;
 
 	print_header (hdr);
 
-	(void) munmap((void *)ptr, sbuf.st_size);
+	if (lseek(ifd, 0, SEEK_SET) != 0 ||
+	    write(ifd, hdr, sizeof(image_header_t)) != sizeof(image_header_t)) {
+		fprintf (stderr, "%s: Write error on %s: %s\n",
+			cmdname, imagefile, strerror(errno));
+		exit (EXIT_FAILURE);
+	}
 
 	/* We're a bit of paranoid */
 	(void) fsync (ifd);
@@ -565,23 +565,43 @@ copy_file (int ifd, const char *datafile, int pad)
 	}
 
 	size = sbuf.st_size - offset;
-	if (write(ifd, ptr + offset, size) != size) {
-		fprintf (stderr, "%s: Write error on %s: %s\n",
-			cmdname, imagefile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
+	write_data (ifd, ptr + offset, size);
 
 	if (pad && ((tail = size % 4) != 0)) {
+		write_data (ifd, &zero, 4-tail);
+	}
+
+	(void) munmap((void *)ptr, sbuf.st_size);
+	(void) close (dfd);
+}
 
-		if (write(ifd, (char *)&zero, 4-tail) != 4-tail) {
+/*
+ * Write data after the header, adding it to the data CRC on the way.
+ * Large buffers go in chunks, so that each chunk is still in the cache
+ * when it is checksummed after being written.
+ */
+#define WRITE_CHUNK	(1024 * 1024)
+
+static void
+write_data (int ifd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		size_t n = (len > WRITE_CHUNK) ? WRITE_CHUNK : len;
+		ssize_t ret = write(ifd, p, n);
+
+		if (ret <= 0) {
 			fprintf (stderr, "%s: Write error on %s: %s\n",
 				cmdname, imagefile, strerror(errno));
 			exit (EXIT_FAILURE);
 		}
-	}
 
-	(void) munmap((void *)ptr, sbuf.st_size);
-	(void) close (dfd);
+		data_crc = crc32 (data_crc, p, ret);
+		data_size += ret;
+		p += ret;
+		len -= ret;
+	}
 }
 
 void
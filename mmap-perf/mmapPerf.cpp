@@ -6,8 +6,11 @@
 #include <iostream>
 #include <vector>
 #include <tuple>
+#include <chrono>
+#include <sstream>
 
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -152,4 +155,184 @@ static void benchLinearWrite(benchmark::State& state) {
 }
 BENCHMARK(benchLinearWrite);
 
+// Page fault benchmarks. Every iteration touches the next page of a fresh
+// mapping. Items are the faults the kernel counted, so items/s is faults
+// per second; the label also gives faults per page and the time per
+// fault, since with populate, readahead or huge pages one fault is not one
+// page.
+static const size_t faultChunk = 64 * (1ull << 20);
+static const size_t faultChunkPages = faultChunk / pageSize;
+
+struct FaultConfig {
+    const char *name;
+    bool file;
+    // File pages are evicted from the page cache before every chunk, so
+    // faults read from storage
+    bool cold;
+    int flags;
+    int advice;
+};
+
+static const FaultConfig faultConfigs[] = {
+    { "anon",                false, false, 0,            -1 },
+    { "anon_populate",       false, false, MAP_POPULATE, -1 },
+    { "anon_hugepage",       false, false, 0,            MADV_HUGEPAGE },
+    { "anon_nohugepage",     false, false, 0,            MADV_NOHUGEPAGE },
+    { "file_warm",           true,  false, 0,            -1 },
+    { "file_cold",           true,  true,  0,            -1 },
+    { "file_cold_populate",  true,  true,  MAP_POPULATE, -1 },
+    { "file_cold_willneed",  true,  true,  0,            MADV_WILLNEED },
+    { "file_cold_seq",       true,  true,  0,            MADV_SEQUENTIAL },
+    { "file_cold_random",    true,  true,  0,            MADV_RANDOM },
+};
+
+static uint64_t threadFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+static uint64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A file of the given size with junk in every page, written back so its
+// pages can be dropped from the page cache.
+static int createFaultFile(const string &name, size_t size) {
+    int fd = open(name.c_str(), O_CREAT | O_RDWR, S_IRWXU);
+    if (fd < 0) {
+        cout << "Error: open failed for " << name << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+    unlink(name.c_str());
+    fallocate(fd, 0, 0, size);
+    vector<uint8_t> page(pageSize);
+    for (size_t offset = 0; offset < size; offset += pageSize) {
+        fillPageJunk(page.data());
+        pwrite(fd, page.data(), pageSize, offset);
+    }
+    fsync(fd);
+    return fd;
+}
+
+static void reportFaults(benchmark::State& state, uint64_t faults, uint64_t ns, const char *name) {
+    state.SetItemsProcessed(faults);
+    stringstream label;
+    label << name << " faults/page=" << (double)faults / state.iterations()
+          << " ns/fault=" << (faults ? ns / faults : 0);
+    state.SetLabel(label.str());
+}
+
+static void benchFault(benchmark::State& state) {
+    const FaultConfig &config = faultConfigs[state.range_x()];
+    Fd fileFd;
+    if (config.file)
+        fileFd.set(createFaultFile("/data/local/tmp/mmap_test", faultChunk));
+
+    uint8_t *ptr = nullptr;
+    size_t page = faultChunkPages;
+    uint64_t faults = 0, ns = 0, start = 0, startFaults = 0;
+    while (state.KeepRunning()) {
+        if (page == faultChunkPages) {
+            state.PauseTiming();
+            if (ptr) {
+                ns += nowNs() - start;
+                faults += threadFaults() - startFaults;
+                munmap(ptr, faultChunk);
+            }
+            if (config.cold)
+                posix_fadvise(fileFd.get(), 0, faultChunk, POSIX_FADV_DONTNEED);
+            state.ResumeTiming();
+
+            // Mapping the chunk is timed, since MAP_POPULATE and
+            // MADV_WILLNEED do their faulting there
+            start = nowNs();
+            startFaults = threadFaults();
+            ptr = (uint8_t*)mmap(nullptr, faultChunk, PROT_READ | PROT_WRITE,
+                                 (config.file ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS) | config.flags,
+                                 config.file ? fileFd.get() : -1, 0);
+            if (ptr == MAP_FAILED) {
+                cout << "Error: mmap failed: " << strerror(errno) << endl;
+                exit(1);
+            }
+            if (config.advice >= 0)
+                madvise(ptr, faultChunk, config.advice);
+            page = 0;
+        }
+        ptr[page * pageSize] = dummy;
+        page++;
+    }
+    if (ptr) {
+        ns += nowNs() - start;
+        faults += threadFaults() - startFaults;
+        munmap(ptr, faultChunk);
+    }
+    reportFaults(state, faults, ns, config.name);
+}
+BENCHMARK(benchFault)->DenseRange(0, sizeof(faultConfigs) / sizeof(faultConfigs[0]) - 1);
+
+// Threads faulting in their own slices of one mapping, contending on the
+// mmap_sem of the process.
+static uint8_t *sharedFaultPtr;
+static Fd sharedFaultFd;
+
+static void benchFaultShared(benchmark::State& state, bool file) {
+    size_t size = faultChunk * state.threads;
+    if (state.thread_index == 0) {
+        if (file)
+            sharedFaultFd.set(createFaultFile("/data/local/tmp/mmap_test", size));
+        sharedFaultPtr = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                        file ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS,
+                                        file ? sharedFaultFd.get() : -1, 0);
+    }
+
+    uint8_t *slice = nullptr;
+    size_t page = 0;
+    uint64_t faults = 0, ns = 0, start = 0, startFaults = 0;
+    while (state.KeepRunning()) {
+        if (!slice) {
+            slice = sharedFaultPtr + faultChunk * state.thread_index;
+            start = nowNs();
+            startFaults = threadFaults();
+        }
+        if (page == faultChunkPages) {
+            // Zapping the slice takes the mmap_sem too, but it is not
+            // counted in the time per fault
+            ns += nowNs() - start;
+            faults += threadFaults() - startFaults;
+            madvise(slice, faultChunk, MADV_DONTNEED);
+            start = nowNs();
+            startFaults = threadFaults();
+            page = 0;
+        }
+        slice[page * pageSize] = dummy;
+        page++;
+    }
+    if (slice) {
+        ns += nowNs() - start;
+        faults += threadFaults() - startFaults;
+    }
+    reportFaults(state, faults, ns, file ? "file_warm" : "anon");
+
+    if (state.thread_index == 0) {
+        munmap(sharedFaultPtr, size);
+        sharedFaultPtr = nullptr;
+        if (file) {
+            close(sharedFaultFd.get());
+            sharedFaultFd.set(-1);
+        }
+    }
+}
+
+static void benchFaultSharedAnon(benchmark::State& state) {
+    benchFaultShared(state, false);
+}
+BENCHMARK(benchFaultSharedAnon)->ThreadRange(1, 8);
+
+static void benchFaultSharedFile(benchmark::State& state) {
+    benchFaultShared(state, true);
+}
+BENCHMARK(benchFaultSharedFile)->ThreadRange(1, 8);
+
 BENCHMARK_MAIN()
@@ -24,7 +24,12 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <thread>
+
+#include <android-base/stringprintf.h>
 
 
 namespace {
@@ -50,6 +55,28 @@ bool parseNetworkHandle(const char *arg, net_handle_t *nethandle) {
     return false;
 }
 
+bool parsePositiveInt(const char *arg, int *value) {
+    if (arg == nullptr || !isdigit(arg[0])) {
+        return false;
+    }
+
+    char *end = nullptr;
+    const long v = strtol(arg, &end, 10);
+    if (end == nullptr || *end != '\0' || v <= 0 || v > 1000000) {
+        return false;
+    }
+    *value = static_cast<int>(v);
+    return true;
+}
+
+std::string usecToString(uint64_t usec) {
+    if (usec < 1000) {
+        return android::base::StringPrintf("%lluus",
+                                           static_cast<unsigned long long>(usec));
+    }
+    return android::base::StringPrintf("%.1fms", usec / 1000.0);
+}
+
 }  // namespace
 
 
@@ -58,9 +85,15 @@ void printUsage(const char *progname) {
               << " [--nethandle <nethandle>]"
               << " [--mode explicit|process]"
               << " [--family unspec|ipv4|ipv6]"
+              << " [--duration <seconds> [--concurrency <n>]]"
               << " <argument>"
               << std::endl;
     std::cerr << std::endl;
+    std::cerr << "With --duration, probe repeatedly with <n> concurrent probes "
+              << "per network, and print latency histograms for each network. "
+              << "--nethandle can then be given more than once to compare "
+              << "networks."
+              << std::endl;
     std::cerr << "Learn nethandle values from 'dumpsys connectivity --short' "
               << "or 'dumpsys connectivity --diag'"
               << std::endl;
@@ -80,6 +113,23 @@ bool Arguments::parseArguments(int argc, const char* argv[]) {
                           << std::endl;
                 break;
             }
+            nethandles.push_back(nethandle);
+        } else if (strEqual(argv[i], "--concurrency")) {
+            i++;
+            if (argc == i) break;
+            if (!parsePositiveInt(argv[i], &concurrency)) {
+                std::cerr << "Failed to parse concurrency: '" << argv[i] << "'"
+                          << std::endl;
+                break;
+            }
+        } else if (strEqual(argv[i], "--duration")) {
+            i++;
+            if (argc == i) break;
+            if (!parsePositiveInt(argv[i], &duration)) {
+                std::cerr << "Failed to parse duration: '" << argv[i] << "'"
+                          << std::endl;
+                break;
+            }
         } else if (strEqual(argv[i], "--family")) {
             i++;
             if (argc == i) break;
@@ -110,6 +160,17 @@ bool Arguments::parseArguments(int argc, const char* argv[]) {
         }
     }
 
+    if (nethandles.empty()) {
+        nethandles.push_back(nethandle);
+    }
+
+    if (arg1 != nullptr && duration > 0 && api_mode == ApiMode::PROCESS &&
+        nethandles.size() > 1) {
+        std::cerr << "Only one network can be benchmarked in process mode."
+                  << std::endl;
+        return false;
+    }
+
     if (arg1 != nullptr) {
         return true;
     }
@@ -133,3 +194,160 @@ std::string inetSockaddrToString(const sockaddr* sa) {
     }
     return (is_ipv6 ? "[" : "") + std::string(host) + (is_ipv6 ? "]:" : ":") + std::string(port);
 }
+
+
+LatencyHistogram::LatencyHistogram()
+        : buckets_(), count_(0), sum_(0), min_(UINT64_MAX), max_(0) {}
+
+void LatencyHistogram::add(uint64_t usec) {
+    // Bucket i holds [2^i, 2^(i+1)) microseconds, bucket 0 also holds 0.
+    const int bucket = std::min(63 - __builtin_clzll(usec | 1), kBuckets - 1);
+    buckets_[bucket]++;
+    count_++;
+    sum_ += usec;
+    min_ = std::min(min_, usec);
+    max_ = std::max(max_, usec);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; i++) {
+        buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+    const uint64_t rank = static_cast<uint64_t>(count_ * percent / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += buckets_[i];
+        if (seen > 0 && seen >= rank) {
+            return std::min(uint64_t(2) << i, max_);
+        }
+    }
+    return max_;
+}
+
+void LatencyHistogram::print(const std::string& name) const {
+    if (count_ == 0) {
+        return;
+    }
+
+    std::cout << "  " << name << ": " << count_ << " samples"
+              << ", min " << usecToString(min_)
+              << ", avg " << usecToString(sum_ / count_)
+              << ", p50 <= " << usecToString(percentile(50))
+              << ", p90 <= " << usecToString(percentile(90))
+              << ", p99 <= " << usecToString(percentile(99))
+              << ", max " << usecToString(max_)
+              << std::endl;
+
+    int first = 0;
+    int last = kBuckets - 1;
+    while (buckets_[first] == 0) first++;
+    while (buckets_[last] == 0) last--;
+    const uint64_t most = *std::max_element(buckets_ + first, buckets_ + last + 1);
+
+    static const int kBarWidth = 40;
+    for (int i = first; i <= last; i++) {
+        const uint64_t low = (i == 0) ? 0 : (uint64_t(1) << i);
+        std::cout << android::base::StringPrintf(
+                "    %10s - %-10s %8llu ",
+                usecToString(low).c_str(),
+                usecToString(uint64_t(2) << i).c_str(),
+                static_cast<unsigned long long>(buckets_[i]))
+                  << std::string(buckets_[i] * kBarWidth / most, '#')
+                  << std::endl;
+    }
+}
+
+
+LatencyHistogram& ProbeStats::latency(const std::string& step) {
+    for (auto& entry : latencies) {
+        if (entry.first == step) {
+            return entry.second;
+        }
+    }
+    latencies.emplace_back(step, LatencyHistogram());
+    return latencies.back().second;
+}
+
+void ProbeStats::merge(const ProbeStats& other) {
+    probes += other.probes;
+    for (const auto& entry : other.latencies) {
+        latency(entry.first).merge(entry.second);
+    }
+    for (const auto& entry : other.failures) {
+        failures[entry.first] += entry.second;
+    }
+}
+
+
+uint64_t nowUsec() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+int runBenchmark(const Arguments& args, const ProbeFunction& probe) {
+    const size_t networks = args.nethandles.size();
+    // One ProbeStats per thread, threads of network n at
+    // [n * concurrency, (n + 1) * concurrency).
+    std::vector<ProbeStats> thread_stats(networks * args.concurrency);
+    std::vector<std::thread> threads;
+
+    const uint64_t start = nowUsec();
+    const uint64_t deadline = start + args.duration * UINT64_C(1000000);
+    for (size_t i = 0; i < thread_stats.size(); i++) {
+        const net_handle_t nethandle = args.nethandles[i / args.concurrency];
+        ProbeStats* stats = &thread_stats[i];
+        threads.emplace_back([&probe, nethandle, stats, deadline]() {
+            while (nowUsec() < deadline) {
+                probe(nethandle, stats);
+                stats->probes++;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const double seconds = (nowUsec() - start) / 1e6;
+
+    for (size_t n = 0; n < networks; n++) {
+        ProbeStats stats;
+        for (int i = 0; i < args.concurrency; i++) {
+            stats.merge(thread_stats[n * args.concurrency + i]);
+        }
+
+        uint64_t failed = 0;
+        std::string failures;
+        for (const auto& entry : stats.failures) {
+            failed += entry.second;
+            failures += android::base::StringPrintf(
+                    "%s%s=%llu", failures.empty() ? "" : " ",
+                    entry.first.c_str(),
+                    static_cast<unsigned long long>(entry.second));
+        }
+
+        std::cout << "# nethandle " << args.nethandles[n] << ": "
+                  << stats.probes << " probes in "
+                  << android::base::StringPrintf("%.1fs (%.1f/s)", seconds,
+                                                 stats.probes / seconds)
+                  << " with concurrency " << args.concurrency
+                  << ", " << failed << " failed";
+        if (failed > 0) {
+            std::cout << " (" << failures << ")";
+        }
+        std::cout << std::endl;
+
+        for (const auto& entry : stats.latencies) {
+            entry.second.print(entry.first);
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
@@ -18,10 +18,15 @@
 #ifndef SYSTEM_EXTRAS_MULTINETWORK_COMMON_H_
 #define SYSTEM_EXTRAS_MULTINETWORK_COMMON_H_
 
+#include <stdint.h>
 #include <sys/cdefs.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <functional>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 #include <android/multinetwork.h>
 
 enum class ApiMode {
@@ -34,7 +39,9 @@ struct Arguments {
     Arguments() : nethandle(NETWORK_UNSPECIFIED),
                   api_mode(ApiMode::EXPLICIT),
                   family(AF_UNSPEC),
-                  arg1(nullptr) {}
+                  arg1(nullptr),
+                  concurrency(1),
+                  duration(0) {}
     ~Arguments();
 
     bool parseArguments(int argc, const char* argv[]);
@@ -43,6 +50,12 @@ struct Arguments {
     ApiMode api_mode;
     sa_family_t family;
     const char* arg1;
+
+    // Benchmark mode, if duration is non-zero: every network given with
+    // --nethandle is probed by |concurrency| threads for |duration| seconds.
+    std::vector<net_handle_t> nethandles;
+    int concurrency;
+    int duration;
 };
 
 
@@ -53,6 +66,62 @@ void printUsage(const char *progname);
 std::string inetSockaddrToString(const sockaddr* sa);
 
 
+// Latencies of one step of a probe, in power-of-two buckets of
+// microseconds. Not thread-safe: each probing thread fills its own and they
+// are merged once the threads are done.
+class LatencyHistogram {
+  public:
+    LatencyHistogram();
+
+    void add(uint64_t usec);
+    void merge(const LatencyHistogram& other);
+
+    uint64_t count() const { return count_; }
+    // Upper bound of the bucket holding the |percent|th percentile.
+    uint64_t percentile(double percent) const;
+
+    void print(const std::string& name) const;
+
+  private:
+    static const int kBuckets = 32;  // Up to 2^32us, over an hour.
+
+    uint64_t buckets_[kBuckets];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+
+// Results of the probes of one network.
+struct ProbeStats {
+    ProbeStats() : probes(0) {}
+
+    // Histograms are kept in the order in which the steps were first timed,
+    // which is the order of the steps in a probe.
+    LatencyHistogram& latency(const std::string& step);
+    void fail(const std::string& step) { failures[step]++; }
+    void merge(const ProbeStats& other);
+
+    uint64_t probes;
+    std::vector<std::pair<std::string, LatencyHistogram>> latencies;
+    std::map<std::string, uint64_t> failures;
+};
+
+
+// Microseconds since some unspecified point, for timing probe steps.
+uint64_t nowUsec();
+
+// Runs a single probe of the given network, timing its steps into |stats|.
+typedef std::function<void(net_handle_t, ProbeStats*)> ProbeFunction;
+
+// Runs |probe| in args.concurrency threads per network in args.nethandles,
+// all networks at the same time so that they are compared under the same
+// conditions, until args.duration seconds are up. Then prints the
+// latencies of each network.
+int runBenchmark(const Arguments& args, const ProbeFunction& probe);
+
+
 struct FdAutoCloser {
     FdAutoCloser() : fd(-1) {}
     /* not explicit */ FdAutoCloser(int fd) : fd(fd) {}
@@ -29,12 +29,60 @@
 #include "common.h"
 
 
+// Times one resolution of args.arg1 on |nethandle|. In process mode, the
+// process network has already been set.
+void probeDns(const struct Arguments& args, net_handle_t nethandle,
+              struct ProbeStats* stats) {
+    const struct addrinfo hints = {
+            .ai_family = args.family,
+            .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *result = nullptr;
+
+    const uint64_t start = nowUsec();
+    const int rval = (args.api_mode == ApiMode::EXPLICIT)
+            ? android_getaddrinfofornetwork(nethandle, args.arg1, nullptr,
+                                            &hints, &result)
+            : getaddrinfo(args.arg1, nullptr, &hints, &result);
+    if (rval != 0) {
+        stats->fail("dns");
+        return;
+    }
+    stats->latency("dns").add(nowUsec() - start);
+    freeaddrinfo(result);
+}
+
+
+int benchmarkDns(const struct Arguments& args) {
+    if (args.api_mode == ApiMode::PROCESS &&
+        args.nethandle != NETWORK_UNSPECIFIED) {
+        const int rval = android_setprocnetwork(args.nethandle);
+        if (rval != 0) {
+            std::cerr << "android_setprocnetwork returned " << rval
+                      << std::endl;
+            return rval;
+        }
+    }
+
+    std::cout << "# Resolving " << args.arg1 << " for " << args.duration
+              << "s" << std::endl;
+    return runBenchmark(args, [&args](net_handle_t nethandle,
+                                      struct ProbeStats* stats) {
+        probeDns(args, nethandle, stats);
+    });
+}
+
+
 int main(int argc, const char* argv[]) {
     int rval = -1;
 
     struct Arguments args;
     if (!args.parseArguments(argc, argv)) { return rval; }
 
+    if (args.duration > 0) {
+        return benchmarkDns(args);
+    }
+
     const struct addrinfo hints = {
             .ai_family = args.family,
             .ai_socktype = SOCK_DGRAM,
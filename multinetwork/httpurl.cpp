@@ -91,10 +91,15 @@ bool parseUrl(const struct Arguments& args, struct Parameters* parameters) {
 
     // TODO: find the request portion to send (before '#...').
 
-    std::cerr << "Resolving hostname=" << parameters->hostname
-              << ", port=" << parameters->port
-              << std::endl;
+    return true;
+}
+
 
+// Resolves parameters->hostname into parameters->ss, on |nethandle| in
+// explicit mode and on the process network otherwise. Returns the
+// getaddrinfo() error.
+int resolveHostname(const struct Arguments& args, net_handle_t nethandle,
+                    struct Parameters* parameters) {
     struct addrinfo hints = {
             .ai_family = args.family,
             .ai_socktype = SOCK_STREAM,
@@ -104,7 +109,7 @@ bool parseUrl(const struct Arguments& args, struct Parameters* parameters) {
     int rval = -1;
     switch (args.api_mode) {
         case ApiMode::EXPLICIT:
-            rval = android_getaddrinfofornetwork(args.nethandle,
+            rval = android_getaddrinfofornetwork(nethandle,
                                                  parameters->hostname.c_str(),
                                                  parameters->port.c_str(),
                                                  &hints, &result);
@@ -116,23 +121,34 @@ bool parseUrl(const struct Arguments& args, struct Parameters* parameters) {
             break;
         default:
             // Unreachable.
-            std::cerr << "Unknown api mode." << std::endl;
-            return false;
+            return EAI_FAIL;
     }
 
+    if (rval == 0) {
+        memcpy(&(parameters->ss), result[0].ai_addr, result[0].ai_addrlen);
+        freeaddrinfo(result);
+    }
+    return rval;
+}
+
+
+bool resolveUrl(const struct Arguments& args, struct Parameters* parameters) {
+    std::cerr << "Resolving hostname=" << parameters->hostname
+              << ", port=" << parameters->port
+              << std::endl;
+
+    const int rval = resolveHostname(args, args.nethandle, parameters);
     if (rval != 0) {
         std::cerr << "DNS resolution failure; gaierror=" << rval
                   << " [" << gai_strerror(rval) << "]"
                   << std::endl;
-        return rval;
+        return false;
     }
 
-    memcpy(&(parameters->ss), result[0].ai_addr, result[0].ai_addrlen);
     std::cerr << "Connecting to: "
-              << inetSockaddrToString(result[0].ai_addr)
+              << inetSockaddrToString(
+                         reinterpret_cast<const sockaddr*>(&(parameters->ss)))
               << std::endl;
-
-    freeaddrinfo(result);
     return true;
 }
 
@@ -164,13 +180,30 @@ int makeTcpSocket(sa_family_t address_family, net_handle_t nethandle) {
 }
 
 
+int connectTo(int fd, const struct Parameters& parameters) {
+    return connect(fd,
+                   reinterpret_cast<const struct sockaddr *>(&(parameters.ss)),
+                   (parameters.ss.ss_family == AF_INET6)
+                           ? sizeof(struct sockaddr_in6)
+                           : sizeof(struct sockaddr_in));
+}
+
+
+std::string makeRequest(const struct Parameters& parameters) {
+    return android::base::StringPrintf(
+            "GET %s HTTP/1.1\r\n"
+            "Host: %s\r\n"
+            "Accept: */*\r\n"
+            "Connection: close\r\n"
+            "User-Agent: httpurl/0.0\r\n"
+            "\r\n",
+            parameters.path.c_str(), parameters.host.c_str());
+}
+
+
 int doHttpQuery(int fd, const struct Parameters& parameters) {
     int rval = -1;
-    if (connect(fd,
-                reinterpret_cast<const struct sockaddr *>(&(parameters.ss)),
-                (parameters.ss.ss_family == AF_INET6)
-                        ? sizeof(struct sockaddr_in6)
-                        : sizeof(struct sockaddr_in)) != 0) {
+    if (connectTo(fd, parameters) != 0) {
         int errnum = errno;
         std::cerr << "Failed to connect; errno=" << errnum
                   << " [" << strerror(errnum) << "]"
@@ -178,14 +211,7 @@ int doHttpQuery(int fd, const struct Parameters& parameters) {
         return -1;
     }
 
-    const std::string request(android::base::StringPrintf(
-            "GET %s HTTP/1.1\r\n"
-            "Host: %s\r\n"
-            "Accept: */*\r\n"
-            "Connection: close\r\n"
-            "User-Agent: httpurl/0.0\r\n"
-            "\r\n",
-            parameters.path.c_str(), parameters.host.c_str()));
+    const std::string request(makeRequest(parameters));
     const ssize_t sent = write(fd, request.c_str(), request.size());
     if (sent != static_cast<ssize_t>(request.size())) {
         std::cerr << "Sent only " << sent << "/" << request.size() << " bytes"
@@ -213,6 +239,73 @@ int doHttpQuery(int fd, const struct Parameters& parameters) {
 }
 
 
+// Times the steps of one query of the URL in |url| on |nethandle|: the
+// resolution of its hostname, the TCP connection, the first byte of the
+// response after the request is sent, and the whole query until the server
+// closes the connection.
+void probeHttp(const struct Arguments& args, const struct Parameters& url,
+               net_handle_t nethandle, struct ProbeStats* stats) {
+    struct Parameters parameters(url);
+
+    const uint64_t start = nowUsec();
+    if (resolveHostname(args, nethandle, &parameters) != 0) {
+        stats->fail("dns");
+        return;
+    }
+    stats->latency("dns").add(nowUsec() - start);
+
+    struct FdAutoCloser closer = makeTcpSocket(
+            parameters.ss.ss_family,
+            (args.api_mode == ApiMode::EXPLICIT) ? nethandle
+                                                 : NETWORK_UNSPECIFIED);
+    if (closer.fd < 0) {
+        stats->fail("socket");
+        return;
+    }
+
+    const uint64_t connecting = nowUsec();
+    if (connectTo(closer.fd, parameters) != 0) {
+        stats->fail("connect");
+        return;
+    }
+    stats->latency("connect").add(nowUsec() - connecting);
+
+    const std::string request(makeRequest(parameters));
+    if (write(closer.fd, request.c_str(), request.size()) !=
+        static_cast<ssize_t>(request.size())) {
+        stats->fail("send");
+        return;
+    }
+
+    const uint64_t sent = nowUsec();
+    char buf[4*1024];
+    ssize_t rval = recv(closer.fd, buf, sizeof(buf), 0);
+    if (rval <= 0) {
+        stats->fail("ttfb");
+        return;
+    }
+    stats->latency("ttfb").add(nowUsec() - sent);
+
+    while ((rval = recv(closer.fd, buf, sizeof(buf), 0)) > 0) {}
+    if (rval < 0) {
+        stats->fail("total");
+        return;
+    }
+    stats->latency("total").add(nowUsec() - start);
+}
+
+
+int benchmarkHttp(const struct Arguments& args,
+                  const struct Parameters& url) {
+    std::cout << "# Querying http://" << url.host << url.path << " for "
+              << args.duration << "s" << std::endl;
+    return runBenchmark(args, [&args, &url](net_handle_t nethandle,
+                                            struct ProbeStats* stats) {
+        probeHttp(args, url, nethandle, stats);
+    });
+}
+
+
 int main(int argc, const char* argv[]) {
     int rval = -1;
 
@@ -233,6 +326,12 @@ int main(int argc, const char* argv[]) {
     struct Parameters parameters;
     if (!parseUrl(args, &parameters)) { return -1; }
 
+    if (args.duration > 0) {
+        return benchmarkHttp(args, parameters);
+    }
+
+    if (!resolveUrl(args, &parameters)) { return -1; }
+
     // TODO: Fall back from IPv6 to IPv4 if ss.ss_family is AF_UNSPEC.
     // This will involve changes to parseUrl() as well.
     struct FdAutoCloser closer = makeTcpSocket(
@@ -11,3 +11,12 @@ LOCAL_MODULE:= dumpcache
 
 include $(BUILD_EXECUTABLE)
 
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= pagecachetrace.c
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := debug
+LOCAL_MODULE:= pagecachetrace
+
+include $(BUILD_EXECUTABLE)
@@ -1,4 +1,4 @@
-#include <ftw.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -6,108 +6,422 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <ctype.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
-// Initial size of the array holding struct file_info
+// Initial size of the arrays holding struct file_info
 #define INITIAL_NUM_FILES 512
 
-// Max number of file descriptors to use for ntfw
-#define MAX_NUM_FD 1
+// Initial size of the queue of directories to scan
+#define INITIAL_NUM_DIRS 64
+
+// Default number of threads scanning directories
+#define DEFAULT_NUM_THREADS 4
+
+// cachestat(2) reports the residency of a file without mapping it, on
+// kernels >= 6.5. Older kernels fall back to mmap and mincore.
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+struct cachestat_range {
+    uint64_t off;
+    uint64_t len;
+};
+
+struct cachestat {
+    uint64_t nr_cache;
+    uint64_t nr_dirty;
+    uint64_t nr_writeback;
+    uint64_t nr_evicted;
+    uint64_t nr_recently_evicted;
+};
 
 struct file_info {
     char *name;
     size_t file_size;
     size_t num_cached_pages;
+    struct timespec mtime;
+};
+
+struct file_list {
+    struct file_info **files;
+    size_t num_files;
+    size_t files_size;
+};
+
+// Directories waiting to be scanned, shared by the scanning threads. The
+// scan is over when the queue is empty and no thread is scanning a
+// directory, as only those could add more.
+struct dir_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **dirs;
+    size_t num_dirs;
+    size_t dirs_size;
+    int busy;
+};
+
+struct scanner {
+    pthread_t thread;
+    struct dir_queue *queue;
+    struct file_list files;
 };
 
 // Size of pages on this system
 static int g_page_size;
 
-// Total number of cached pages found so far
-static size_t g_total_cached = 0;
-
-// Total number of files scanned so far
-static size_t g_num_files = 0;
+// Whether cachestat(2) is available
+static volatile int g_use_cachestat = 1;
 
-// Scanned files and their associated cached page counts
-static struct file_info **g_files;
+// Snapshot whose counts are reused for files with the same size and mtime
+static struct file_list g_previous;
 
-// Current size of files array
-size_t g_files_size;
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        fprintf(stderr, "Couldn't allocate memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
 
-static struct file_info *get_file_info(const char* fpath, size_t file_size) {
-    struct file_info *info;
-    if (g_num_files >= g_files_size) {
-        g_files = realloc(g_files, 2 * g_files_size * sizeof(struct file_info*));
-        if (!g_files) {
+static void add_file(struct file_list *list, struct file_info *info) {
+    if (list->num_files >= list->files_size) {
+        list->files_size = list->files_size ? 2 * list->files_size : INITIAL_NUM_FILES;
+        list->files = realloc(list->files, list->files_size * sizeof(struct file_info*));
+        if (!list->files) {
             fprintf(stderr, "Couldn't allocate space for files array: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
-        g_files_size = 2 * g_files_size;
     }
 
-    info = calloc(1, sizeof(*info));
+    list->files[list->num_files++] = info;
+}
+
+static struct file_info *new_file_info(const char *fpath, size_t file_size,
+                                       const struct timespec *mtime) {
+    struct file_info *info = calloc(1, sizeof(*info));
     if (!info) {
         fprintf(stderr, "Couldn't allocate space for file struct: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    info->name = malloc(strlen(fpath) + 1);
+    info->name = strdup(fpath);
     if (!info->name) {
         fprintf(stderr, "Couldn't allocate space for file struct: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    strcpy(info->name, fpath);
 
-    info->num_cached_pages = 0;
     info->file_size = file_size;
-
-    g_files[g_num_files++] = info;
+    info->mtime = *mtime;
 
     return info;
 }
 
-static int store_num_cached(const char* fpath, const struct stat *sb) {
-    int fd;
-    fd = open (fpath, O_RDONLY);
+static void push_dir(struct dir_queue *queue, char *path) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->num_dirs >= queue->dirs_size) {
+        queue->dirs_size = queue->dirs_size ? 2 * queue->dirs_size : INITIAL_NUM_DIRS;
+        queue->dirs = realloc(queue->dirs, queue->dirs_size * sizeof(char*));
+        if (!queue->dirs) {
+            fprintf(stderr, "Couldn't allocate space for directory queue: %s\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    queue->dirs[queue->num_dirs++] = path;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    if (fd == -1) {
-        printf("Could not open file.");
-        return -1;
+// Returns the next directory to scan, or NULL once the scan is over.
+static char *pop_dir(struct dir_queue *queue) {
+    char *path = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->num_dirs == 0 && queue->busy > 0) {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    if (queue->num_dirs > 0) {
+        path = queue->dirs[--queue->num_dirs];
+        queue->busy++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return path;
+}
+
+static void done_dir(struct dir_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    if (--queue->busy == 0 && queue->num_dirs == 0) {
+        pthread_cond_broadcast(&queue->cond);
     }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int cmpnames(const void *a, const void *b) {
+    return strcmp((*((struct file_info**)a))->name, (*((struct file_info**)b))->name);
+}
+
+// Finds a file in a list sorted by name.
+static struct file_info *find_file(struct file_list *list, const char *fpath) {
+    struct file_info key;
+    struct file_info *keyp = &key;
+    struct file_info **found;
+
+    key.name = (char *)fpath;
+    found = bsearch(&keyp, list->files, list->num_files, sizeof(list->files[0]), &cmpnames);
+    return found ? *found : NULL;
+}
 
-    void* mapped_addr = mmap(NULL, sb->st_size, PROT_NONE, MAP_SHARED, fd, 0);
+static long count_cached(int fd, size_t file_size) {
+    size_t num_file_pages = (file_size + g_page_size - 1) / g_page_size;
+    long num_cached = 0;
 
-    if (mapped_addr != MAP_FAILED) {
-        // Calculate bit-vector size
-        size_t num_file_pages = (sb->st_size + g_page_size - 1) / g_page_size;
-        unsigned char* mincore_data = calloc(1, num_file_pages);
-        int ret = mincore(mapped_addr, sb->st_size, mincore_data);
-        int num_cached = 0;
-        unsigned int page = 0;
+    if (file_size == 0) {
+        return 0;
+    }
+
+    if (g_use_cachestat) {
+        struct cachestat_range range = { 0, 0 };
+        struct cachestat cs;
+
+        if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0) {
+            return cs.nr_cache;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        g_use_cachestat = 0;
+    }
+
+    // Mapping the file with PROT_NONE does not fault any page in, so that
+    // mincore only reports what was already cached.
+    void* mapped_addr = mmap(NULL, file_size, PROT_NONE, MAP_SHARED, fd, 0);
+    if (mapped_addr == MAP_FAILED) {
+        return -1;
+    }
+
+    unsigned char* mincore_data = xmalloc(num_file_pages);
+    if (mincore(mapped_addr, file_size, mincore_data) == 0) {
+        size_t page;
         for (page = 0; page < num_file_pages; page++) {
-           if (mincore_data[page]) num_cached++;
+            if (mincore_data[page] & 1) num_cached++;
+        }
+    } else {
+        num_cached = -1;
+    }
+    free(mincore_data);
+    munmap(mapped_addr, file_size);
+
+    return num_cached;
+}
+
+static void scan_file(struct scanner *s, int dir_fd, const char *name, const char *fpath,
+                      const struct stat *sb) {
+    struct file_info *info;
+    struct file_info *prev = find_file(&g_previous, fpath);
+    long num_cached;
+
+    if (prev && prev->file_size == (size_t)sb->st_size &&
+            prev->mtime.tv_sec == sb->st_mtim.tv_sec &&
+            prev->mtime.tv_nsec == sb->st_mtim.tv_nsec) {
+        num_cached = prev->num_cached_pages;
+    } else {
+        // Opening a file must not update its atime, which would dirty the
+        // inode of every file scanned.
+        int fd = openat(dir_fd, name, O_RDONLY | O_NOATIME | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1 && errno == EPERM) {
+            fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd == -1) {
+            return;
         }
-        if (num_cached > 0) {
-            struct file_info *info = get_file_info(fpath, sb->st_size);
-            info->num_cached_pages += num_cached;
-            g_total_cached += num_cached;
+        num_cached = count_cached(fd, sb->st_size);
+        close(fd);
+        if (num_cached < 0) {
+            return;
         }
-        munmap(mapped_addr, sb->st_size);
     }
 
-    close(fd);
+    info = new_file_info(fpath, sb->st_size, &sb->st_mtim);
+    info->num_cached_pages = num_cached;
+    add_file(&s->files, info);
+}
+
+// Scans the files of a directory, and queues its subdirectories. Symbolic
+// links are not followed, so that no file is counted twice.
+static void scan_dir(struct scanner *s, const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    size_t path_len = strlen(path);
+
+    if (!dir) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat sb;
+        char *fpath;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        if (entry->d_type != DT_DIR && entry->d_type != DT_REG &&
+                entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+
+        fpath = xmalloc(path_len + strlen(entry->d_name) + 2);
+        sprintf(fpath, "%s%s%s", path, path[path_len - 1] == '/' ? "" : "/", entry->d_name);
+
+        if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+            free(fpath);
+            continue;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            push_dir(s->queue, fpath);
+            continue;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            scan_file(s, dirfd(dir), entry->d_name, fpath, &sb);
+        }
+        free(fpath);
+    }
+
+    closedir(dir);
+}
+
+static void *scan_thread(void *arg) {
+    struct scanner *s = arg;
+    char *path;
+
+    while ((path = pop_dir(s->queue)) != NULL) {
+        scan_dir(s, path);
+        free(path);
+        done_dir(s->queue);
+    }
+
+    return NULL;
+}
+
+// Scans the given directories on num_threads threads, and returns all the
+// files found in *files.
+static void scan(char **dirs, int num_dirs, int num_threads, struct file_list *files) {
+    struct dir_queue queue;
+    struct scanner *scanners = calloc(num_threads, sizeof(*scanners));
+    int i;
+    size_t j;
+
+    if (!scanners) {
+        fprintf(stderr, "Couldn't allocate scanners: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    for (i = num_dirs - 1; i >= 0; i--) {
+        push_dir(&queue, strdup(dirs[i]));
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        scanners[i].queue = &queue;
+        if (pthread_create(&scanners[i].thread, NULL, scan_thread, &scanners[i])) {
+            fprintf(stderr, "Couldn't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(scanners[i].thread, NULL);
+        for (j = 0; j < scanners[i].files.num_files; j++) {
+            add_file(files, scanners[i].files.files[j]);
+        }
+        free(scanners[i].files.files);
+    }
+
+    free(queue.dirs);
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+    free(scanners);
+}
+
+// Snapshots hold one line per file:
+//   <cached pages> <size> <mtime seconds>.<mtime nanoseconds> <path>
+static int write_snapshot(const char *fname, struct file_list *list) {
+    FILE *f = fopen(fname, "w");
+    size_t i;
+
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < list->num_files; i++) {
+        struct file_info *info = list->files[i];
+        // A newline in the name would break the format.
+        if (strchr(info->name, '\n')) {
+            continue;
+        }
+        fprintf(f, "%zu %zu %lld.%09ld %s\n", info->num_cached_pages, info->file_size,
+                (long long)info->mtime.tv_sec, info->mtime.tv_nsec, info->name);
+    }
+
+    if (fclose(f)) {
+        fprintf(stderr, "Couldn't write %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-static int scan_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    if (typeflag == FTW_F) {
-        store_num_cached(fpath, sb);
+// Reads a snapshot, sorted by name.
+static int read_snapshot(const char *fname, struct file_list *list) {
+    FILE *f = fopen(fname, "r");
+    char *line = NULL;
+    size_t line_len = 0;
+    ssize_t len;
+
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    while ((len = getline(&line, &line_len, f)) != -1) {
+        size_t num_cached, file_size;
+        long long sec;
+        long nsec;
+        int name_pos;
+        struct timespec mtime;
+
+        if (len > 0 && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if (sscanf(line, "%zu %zu %lld.%ld %n", &num_cached, &file_size, &sec, &nsec,
+                   &name_pos) != 4) {
+            fprintf(stderr, "%s: bad line: %s\n", fname, line);
+            continue;
+        }
+        mtime.tv_sec = sec;
+        mtime.tv_nsec = nsec;
+
+        struct file_info *info = new_file_info(line + name_pos, file_size, &mtime);
+        info->num_cached_pages = num_cached;
+        add_file(list, info);
     }
+
+    free(line);
+    fclose(f);
+
+    qsort(list->files, list->num_files, sizeof(list->files[0]), &cmpnames);
     return 0;
 }
 
@@ -122,32 +436,168 @@ static int cmpfiles(const void *a, const void *b) {
             (*((struct file_info**)b))->num_cached_pages);
 }
 
-int main()
+struct file_diff {
+    const char *name;
+    size_t old_cached;
+    size_t new_cached;
+};
+
+static int cmpdiffs(const void *a, const void *b) {
+    const struct file_diff *da = a;
+    const struct file_diff *db = b;
+    long long delta_a = (long long)da->new_cached - (long long)da->old_cached;
+    long long delta_b = (long long)db->new_cached - (long long)db->old_cached;
+
+    if (delta_a != delta_b) return delta_a < delta_b ? -1 : 1;
+    return strcmp(da->name, db->name);
+}
+
+// Prints the files whose number of cached pages changed between two
+// snapshots.
+static int diff_snapshots(const char *old_fname, const char *new_fname) {
+    struct file_list old_list, new_list;
+    struct file_diff *diffs;
+    size_t num_diffs = 0;
+    size_t old_total = 0, new_total = 0;
+    size_t i, j;
+
+    memset(&old_list, 0, sizeof(old_list));
+    memset(&new_list, 0, sizeof(new_list));
+    if (read_snapshot(old_fname, &old_list) || read_snapshot(new_fname, &new_list)) {
+        return EXIT_FAILURE;
+    }
+
+    diffs = xmalloc((old_list.num_files + new_list.num_files + 1) * sizeof(*diffs));
+    for (i = 0, j = 0; i < old_list.num_files || j < new_list.num_files;) {
+        struct file_info *old_info = i < old_list.num_files ? old_list.files[i] : NULL;
+        struct file_info *new_info = j < new_list.num_files ? new_list.files[j] : NULL;
+        int cmp = !old_info ? 1 : !new_info ? -1 : strcmp(old_info->name, new_info->name);
+        struct file_diff *d = &diffs[num_diffs];
+
+        d->name = cmp <= 0 ? old_info->name : new_info->name;
+        d->old_cached = cmp <= 0 ? old_info->num_cached_pages : 0;
+        d->new_cached = cmp >= 0 ? new_info->num_cached_pages : 0;
+        if (cmp <= 0) i++;
+        if (cmp >= 0) j++;
+
+        old_total += d->old_cached;
+        new_total += d->new_cached;
+        if (d->old_cached != d->new_cached) {
+            num_diffs++;
+        }
+    }
+
+    qsort(diffs, num_diffs, sizeof(diffs[0]), &cmpdiffs);
+
+    for (i = 0; i < num_diffs; i++) {
+        long long delta = (long long)diffs[i].new_cached - (long long)diffs[i].old_cached;
+        fprintf(stdout, "%s: %+lld cached pages (%+.2f MB, %zu -> %zu pages)\n", diffs[i].name,
+                delta, (float) (delta * g_page_size) / 1024 / 1024,
+                diffs[i].old_cached, diffs[i].new_cached);
+    }
+
+    fprintf(stdout, "TOTAL CACHED: %zu -> %zu pages (%+f MB)\n", old_total, new_total,
+            (float) (((long long)new_total - (long long)old_total) * g_page_size) / 1024 / 1024);
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [ -j <threads> ] [ -o <snapshot> ] [ -u <snapshot> ] [ <dir>... ]\n"
+            "       %s -d <old snapshot> <new snapshot>\n"
+            "    -j  Scan directories on this many threads (default %d).\n"
+            "    -o  Write a snapshot of the number of cached pages of every file.\n"
+            "    -u  Reuse the counts of a previous snapshot for the files whose size\n"
+            "        and mtime did not change, instead of querying them.\n"
+            "    -d  Show the files whose number of cached pages changed between two\n"
+            "        snapshots.\n"
+            "    The default directories are /system, /vendor and /data.\n",
+            cmd, cmd, DEFAULT_NUM_THREADS);
+}
+
+int main(int argc, char *argv[])
 {
+    static char *default_dirs[] = { "/system/", "/vendor/", "/data/" };
+    struct file_list files;
     size_t i;
+    size_t total_cached = 0;
+    int num_threads = DEFAULT_NUM_THREADS;
+    const char *snapshot = NULL;
+    const char *previous = NULL;
+    int diff = 0;
+    int opt;
+
     g_page_size = getpagesize();
 
-    g_files = malloc(INITIAL_NUM_FILES * sizeof(struct file_info*));
-    g_files_size = INITIAL_NUM_FILES;
+    while ((opt = getopt(argc, argv, "j:o:u:dh")) != -1) {
+        switch (opt) {
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                snapshot = optarg;
+                break;
+            case 'u':
+                previous = optarg;
+                break;
+            case 'd':
+                diff = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (diff) {
+        if (argc - optind != 2) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return diff_snapshots(argv[optind], argv[optind + 1]);
+    }
+
+    memset(&g_previous, 0, sizeof(g_previous));
+    if (previous && read_snapshot(previous, &g_previous)) {
+        return EXIT_FAILURE;
+    }
 
     // Walk filesystem trees
-    nftw("/system/", &scan_entry, MAX_NUM_FD, 0);
-    nftw("/vendor/", &scan_entry, MAX_NUM_FD, 0);
-    nftw("/data/", &scan_entry, MAX_NUM_FD, 0);
+    memset(&files, 0, sizeof(files));
+    if (optind < argc) {
+        scan(argv + optind, argc - optind, num_threads, &files);
+    } else {
+        scan(default_dirs, sizeof(default_dirs) / sizeof(default_dirs[0]), num_threads, &files);
+    }
+
+    if (snapshot && write_snapshot(snapshot, &files)) {
+        return EXIT_FAILURE;
+    }
 
     // Sort entries
-    qsort(g_files, g_num_files, sizeof(g_files[0]), &cmpfiles);
+    qsort(files.files, files.num_files, sizeof(files.files[0]), &cmpfiles);
 
     // Dump entries
-    for (i = 0; i < g_num_files; i++) {
-        struct file_info *info = g_files[i];
+    for (i = 0; i < files.num_files; i++) {
+        struct file_info *info = files.files[i];
+        if (info->num_cached_pages == 0) {
+            continue;
+        }
+        total_cached += info->num_cached_pages;
         fprintf(stdout, "%s: %zu cached pages (%.2f MB, %zu%% of total file size.)\n", info->name,
                 info->num_cached_pages,
                 (float) (info->num_cached_pages * g_page_size) / 1024 / 1024,
                 (100 * info->num_cached_pages * g_page_size) / info->file_size);
     }
 
-    fprintf(stdout, "TOTAL CACHED: %zu pages (%f MB)\n", g_total_cached,
-            (float) (g_total_cached * 4096) / 1024 / 1024);
+    fprintf(stdout, "TOTAL CACHED: %zu pages (%f MB)\n", total_cached,
+            (float) (total_cached * g_page_size) / 1024 / 1024);
     return 0;
 }
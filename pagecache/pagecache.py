@@ -23,13 +23,14 @@ class PagecacheStats():
     self._file_pages = {}
     self._total_pages_added = 0
     self._total_pages_removed = 0
+    self._total_pages_refaulted = 0
 
   def add_page(self, device_number, inode, offset):
     # See if we can find the page in our lookup table
     if (device_number, inode) in self._inode_to_filename:
       filename, filesize = self._inode_to_filename[(device_number, inode)]
       if filename not in self._file_pages:
-        self._file_pages[filename] = [1, 0]
+        self._file_pages[filename] = [1, 0, 0]
       else:
         self._file_pages[filename][0] += 1
 
@@ -42,7 +43,7 @@ class PagecacheStats():
     if (device_number, inode) in self._inode_to_filename:
       filename, filesize = self._inode_to_filename[(device_number, inode)]
       if filename not in self._file_pages:
-        self._file_pages[filename] = [0, 1]
+        self._file_pages[filename] = [0, 1, 0]
       else:
         self._file_pages[filename][1] += 1
 
@@ -51,6 +52,22 @@ class PagecacheStats():
       if filename not in self._file_size:
         self._file_size[filename] = filesize
 
+  def add_file_pages(self, filename, filesize, added, removed, refaulted):
+    """Accounts for pages counted on the device by pagecachetrace."""
+    if filename not in self._file_pages:
+      self._file_pages[filename] = [added, removed, refaulted]
+    else:
+      self._file_pages[filename][0] += added
+      self._file_pages[filename][1] += removed
+      self._file_pages[filename][2] += refaulted
+
+    self._total_pages_added += added
+    self._total_pages_removed += removed
+    self._total_pages_refaulted += refaulted
+
+    if filename not in self._file_size:
+      self._file_size[filename] = filesize
+
   def pages_to_mb(self, num_pages):
     return "%.2f" % round(num_pages * PAGE_SIZE / 1024.0 / 1024.0, 2)
 
@@ -65,21 +82,23 @@ class PagecacheStats():
     self._file_pages.clear()
     self._total_pages_added = 0;
     self._total_pages_removed = 0;
+    self._total_pages_refaulted = 0;
 
   def print_stats(self):
     # Create new merged dict
     sorted_added = sorted(self._file_pages.items(), key=operator.itemgetter(1), reverse=True)
-    row_format = "{:<70}{:<12}{:<14}{:<9}"
-    print row_format.format('NAME', 'ADDED (MB)', 'REMOVED (MB)', 'SIZE (MB)')
+    row_format = "{:<70}{:<12}{:<14}{:<16}{:<9}"
+    print row_format.format('NAME', 'ADDED (MB)', 'REMOVED (MB)', 'REFAULTED (MB)', 'SIZE (MB)')
     for filename, added in sorted_added:
       filesize = self._file_size[filename]
       added = self._file_pages[filename][0]
       removed = self._file_pages[filename][1]
+      refaulted = self._file_pages[filename][2]
       if (filename > 64):
         filename = filename[-64:]
-      print row_format.format(filename, self.pages_to_mb(added), self.pages_to_mb(removed), self.bytes_to_mb(filesize))
+      print row_format.format(filename, self.pages_to_mb(added), self.pages_to_mb(removed), self.pages_to_mb(refaulted), self.bytes_to_mb(filesize))
 
-    print row_format.format('TOTAL', self.pages_to_mb(self._total_pages_added), self.pages_to_mb(self._total_pages_removed), '')
+    print row_format.format('TOTAL', self.pages_to_mb(self._total_pages_added), self.pages_to_mb(self._total_pages_removed), self.pages_to_mb(self._total_pages_refaulted), '')
 
   def print_stats_curses(self, pad):
     sorted_added = sorted(self._file_pages.items(), key=operator.itemgetter(1), reverse=True)
@@ -88,18 +107,21 @@ class PagecacheStats():
     pad.addstr(0, 2, 'NAME'.ljust(68), curses.A_REVERSE)
     pad.addstr(0, 70, 'ADDED (MB)'.ljust(12), curses.A_REVERSE)
     pad.addstr(0, 82, 'REMOVED (MB)'.ljust(14), curses.A_REVERSE)
-    pad.addstr(0, 96, 'SIZE (MB)'.ljust(9), curses.A_REVERSE)
+    pad.addstr(0, 96, 'REFAULTED (MB)'.ljust(16), curses.A_REVERSE)
+    pad.addstr(0, 112, 'SIZE (MB)'.ljust(9), curses.A_REVERSE)
     y = 1
     for filename, added_removed in sorted_added:
       filesize = self._file_size[filename]
       added  = self._file_pages[filename][0]
       removed = self._file_pages[filename][1]
+      refaulted = self._file_pages[filename][2]
       if (filename > 64):
         filename = filename[-64:]
       pad.addstr(y, 2, filename)
       pad.addstr(y, 70, self.pages_to_mb(added).rjust(10))
       pad.addstr(y, 80, self.pages_to_mb(removed).rjust(14))
-      pad.addstr(y, 96, self.bytes_to_mb(filesize).rjust(9))
+      pad.addstr(y, 96, self.pages_to_mb(refaulted).rjust(14))
+      pad.addstr(y, 112, self.bytes_to_mb(filesize).rjust(9))
       y += 1
       if y == height - 2:
         pad.addstr(y, 4, "<more...>")
@@ -108,6 +130,7 @@ class PagecacheStats():
     pad.addstr(y, 2, 'TOTAL'.ljust(74), curses.A_REVERSE)
     pad.addstr(y, 70, str(self.pages_to_mb(self._total_pages_added)).rjust(10), curses.A_REVERSE)
     pad.addstr(y, 80, str(self.pages_to_mb(self._total_pages_removed)).rjust(14), curses.A_REVERSE)
+    pad.addstr(y, 96, str(self.pages_to_mb(self._total_pages_refaulted)).rjust(14), curses.A_REVERSE)
     pad.refresh(0,0, 0,0, height,width)
 
 class FileReaderThread(threading.Thread):
@@ -243,6 +266,13 @@ def parse_atrace_line(line, pagecache_stats, app_name):
     elif m.group(1) == 'mm_filemap_delete_from_page_cache':
       pagecache_stats.remove_page(device_number, inode, m.group(4))
 
+def parse_pagecachetrace_line(line, pagecache_stats, app_name):
+  # Files whose counts changed, as "<added> <removed> <refaulted> <size> <path>"
+  m = re.match('(\d+) (\d+) (\d+) (\d+) (.*)', line.rstrip('\r\n'))
+  if m != None:
+    pagecache_stats.add_file_pages(m.group(5), m.group(4), int(m.group(1)),
+                                   int(m.group(2)), int(m.group(3)))
+
 def build_inode_lookup_table(inode_dump):
   inode2filename = {}
   text = inode_dump.splitlines()
@@ -282,7 +312,8 @@ def read_and_parse_trace_file(trace_file, pagecache_stats, app_name):
     parse_atrace_line(line, pagecache_stats, app_name)
   pagecache_stats.print_stats();
 
-def read_and_parse_trace_data_live(stdout, stderr, pagecache_stats, app_name):
+def read_and_parse_trace_data_live(stdout, stderr, pagecache_stats, app_name,
+                                   parse_line=parse_atrace_line):
   # Start reading trace data
   stdout_queue = Queue.Queue(maxsize=128)
   stderr_queue = Queue.Queue()
@@ -320,7 +351,7 @@ def read_and_parse_trace_data_live(stdout, stderr, pagecache_stats, app_name):
       while True:
         try:
           line = stdout_queue.get(True, STATS_UPDATE_INTERVAL)
-          parse_atrace_line(line, pagecache_stats, app_name)
+          parse_line(line, pagecache_stats, app_name)
         except Queue.Empty:
           break
 
@@ -363,15 +394,37 @@ def parse_options(argv):
                     help='Show stats from a trace file, instead of running live.')
   parser.add_option('-a', dest='app_name', type='string',
                     help='filter a particular app')
+  parser.add_option('-n', dest='native', action='store_true',
+                    help='Count pages on the device with pagecachetrace, which'
+                    ' reads the binary trace buffers and resolves inodes'
+                    ' itself, instead of parsing atrace output.')
 
   options, categories = parser.parse_args(argv[1:])
   if options.inode_dump_file and options.inode_data_file:
     parser.error('options -d and -i can\'t be used at the same time')
+  if options.native and (options.app_name or options.trace_file or
+                         options.inode_dump_file or options.inode_data_file):
+    parser.error('option -n can\'t be used with -a, -f, -d or -i')
   return (options, categories)
 
 def main():
   options, categories = parse_options(sys.argv)
 
+  if options.native:
+    trace_cmd = AdbUtils.construct_adb_shell_command(
+        ['pagecachetrace', '-s', str(int(STATS_UPDATE_INTERVAL * 1000))],
+        options.device_serial)
+    try:
+      trace = subprocess.Popen(trace_cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+          stderr=subprocess.PIPE)
+    except OSError as error:
+      print >> sys.stderr, ('The command failed')
+      sys.exit(1)
+
+    read_and_parse_trace_data_live(trace.stdout, trace.stderr, PagecacheStats({}), None,
+                                   parse_pagecachetrace_line)
+    return
+
   # Load inode data for this device
   inode_data = get_inode_data(options.inode_data_file, options.inode_dump_file,
       options.device_serial)
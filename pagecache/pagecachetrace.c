@@ -0,0 +1,848 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+// Trace instance used by the tool, so that its buffers and events don't
+// disturb other tracefs users like atrace.
+#define INSTANCE_NAME "pagecachetrace"
+
+#define ADD_EVENT "filemap/mm_filemap_add_to_page_cache"
+#define DELETE_EVENT "filemap/mm_filemap_delete_from_page_cache"
+
+// How long the readers wait for the kernel before reading the buffers anyway,
+// to read pages the kernel is still writing to
+#define POLL_TIMEOUT_MS 100
+
+// Initial sizes of the hash tables, powers of 2
+#define INITIAL_NUM_INODES 4096
+#define INITIAL_NUM_PAGES 16
+
+// Types of ring buffer events, see events/header_event
+#define RB_TYPE_DATA_MAX 28
+#define RB_TYPE_PADDING 29
+
+// Flags in the commit field of ring buffer pages
+#define RB_MISSED_EVENTS (1ULL << 31)
+#define RB_MISSED_STORED (1ULL << 30)
+#define RB_COMMIT_MASK ((1ULL << 27) - 1)
+
+struct field {
+    size_t offset;
+    size_t size;
+};
+
+struct event_format {
+    int id;
+    struct field ino;
+    struct field index;
+    struct field dev;
+    // Number of pages is 1 << order, size is 0 on kernels without folios
+    struct field order;
+    size_t min_size;
+};
+
+// Page indices, as index + 1 so that 0 marks a free slot
+struct page_set {
+    uint64_t *slots;
+    size_t size;
+    size_t count;
+};
+
+struct inode_stats {
+    dev_t dev;
+    uint64_t ino;
+    char *path;
+    size_t file_size;
+    uint64_t added;
+    uint64_t removed;
+    uint64_t refaulted;
+    // Counts at the last summary
+    uint64_t last_added;
+    uint64_t last_removed;
+    uint64_t last_refaulted;
+    // Pages deleted from the page cache, a page added again is a refault
+    struct page_set evicted;
+};
+
+struct inode_table {
+    struct inode_stats **slots;
+    size_t size;
+    size_t count;
+};
+
+struct cpu_reader {
+    pthread_t thread;
+    int fd;
+};
+
+static char g_instance[PATH_MAX];
+
+// Layout of ring buffer pages, see events/header_page
+static struct field g_commit;
+static size_t g_data_offset;
+static size_t g_buffer_page_size;
+
+static struct event_format g_add_format;
+static struct event_format g_delete_format;
+
+// Everything below is protected by g_lock
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode_table g_inodes;
+static uint64_t g_total_added;
+static uint64_t g_total_removed;
+static uint64_t g_total_refaulted;
+static uint64_t g_lost_events;
+
+static volatile sig_atomic_t g_interrupted;
+static volatile int g_readers_stop;
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        fprintf(stderr, "Couldn't allocate memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void *xcalloc(size_t num, size_t size) {
+    void *ptr = calloc(num, size);
+    if (!ptr) {
+        fprintf(stderr, "Couldn't allocate memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static uint64_t hash64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void page_set_insert(struct page_set *set, uint64_t value) {
+    size_t mask = set->size - 1;
+    size_t i;
+
+    for (i = hash64(value) & mask; set->slots[i]; i = (i + 1) & mask) {
+        if (set->slots[i] == value) {
+            return;
+        }
+    }
+    set->slots[i] = value;
+    set->count++;
+}
+
+static void page_set_add(struct page_set *set, uint64_t index) {
+    if (2 * (set->count + 1) > set->size) {
+        struct page_set grown;
+        size_t i;
+
+        grown.size = set->size ? 2 * set->size : INITIAL_NUM_PAGES;
+        grown.slots = xcalloc(grown.size, sizeof(uint64_t));
+        grown.count = 0;
+        for (i = 0; i < set->size; i++) {
+            if (set->slots[i]) {
+                page_set_insert(&grown, set->slots[i]);
+            }
+        }
+        free(set->slots);
+        *set = grown;
+    }
+    page_set_insert(set, index + 1);
+}
+
+// Removes a page from the set, returns whether it was in it.
+static int page_set_remove(struct page_set *set, uint64_t index) {
+    size_t mask = set->size - 1;
+    size_t i, j;
+
+    if (set->count == 0) {
+        return 0;
+    }
+    for (i = hash64(index + 1) & mask; set->slots[i] != index + 1; i = (i + 1) & mask) {
+        if (!set->slots[i]) {
+            return 0;
+        }
+    }
+
+    // Move back the entries after the removed one that can't be found past
+    // the free slot otherwise.
+    for (j = (i + 1) & mask; set->slots[j]; j = (j + 1) & mask) {
+        size_t home = hash64(set->slots[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->slots[i] = 0;
+    set->count--;
+    return 1;
+}
+
+static uint64_t inode_hash(dev_t dev, uint64_t ino) {
+    return hash64(ino ^ ((uint64_t)dev << 40) ^ ((uint64_t)dev >> 24));
+}
+
+static void inode_table_insert(struct inode_table *table, struct inode_stats *s) {
+    size_t mask = table->size - 1;
+    size_t i;
+
+    for (i = inode_hash(s->dev, s->ino) & mask; table->slots[i]; i = (i + 1) & mask) {
+    }
+    table->slots[i] = s;
+    table->count++;
+}
+
+// Returns the stats of an inode, added with no counts if it wasn't there.
+static struct inode_stats *get_inode(dev_t dev, uint64_t ino) {
+    size_t mask = g_inodes.size - 1;
+    size_t i;
+    struct inode_stats *s;
+
+    for (i = inode_hash(dev, ino) & mask; g_inodes.slots[i]; i = (i + 1) & mask) {
+        s = g_inodes.slots[i];
+        if (s->dev == dev && s->ino == ino) {
+            return s;
+        }
+    }
+
+    if (2 * (g_inodes.count + 1) > g_inodes.size) {
+        struct inode_table grown;
+
+        grown.size = 2 * g_inodes.size;
+        grown.slots = xcalloc(grown.size, sizeof(struct inode_stats*));
+        grown.count = 0;
+        for (i = 0; i < g_inodes.size; i++) {
+            if (g_inodes.slots[i]) {
+                inode_table_insert(&grown, g_inodes.slots[i]);
+            }
+        }
+        free(g_inodes.slots);
+        g_inodes = grown;
+    }
+
+    s = xcalloc(1, sizeof(*s));
+    s->dev = dev;
+    s->ino = ino;
+    inode_table_insert(&g_inodes, s);
+    return s;
+}
+
+static int add_path(const char *fpath, const struct stat *sb, int typeflag,
+                    struct FTW *ftwbuf) {
+    struct inode_stats *s;
+
+    (void)ftwbuf;
+    if (typeflag == FTW_F && S_ISREG(sb->st_mode)) {
+        s = get_inode(sb->st_dev, sb->st_ino);
+        // Hard links keep the first path found
+        if (!s->path) {
+            s->path = strdup(fpath);
+            s->file_size = sb->st_size;
+        }
+    }
+    return 0;
+}
+
+// Resolves the inodes of the files under the given directories to their
+// paths once, before tracing, as the kernel only reports inode numbers.
+static void scan_paths(char **dirs, int num_dirs) {
+    int i;
+
+    for (i = 0; i < num_dirs; i++) {
+        nftw(dirs[i], add_path, 64, FTW_PHYS);
+    }
+}
+
+static int read_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t len = 0;
+    ssize_t n;
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while ((size_t)len < size - 1 &&
+            (n = TEMP_FAILURE_RETRY(read(fd, buf + len, size - 1 - len))) > 0) {
+        len += n;
+    }
+    close(fd);
+    buf[len] = '\0';
+    return 0;
+}
+
+static int write_file(const char *path, const char *value) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    size_t len = strlen(value);
+
+    if (fd == -1 || TEMP_FAILURE_RETRY(write(fd, value, len)) != (ssize_t)len) {
+        fprintf(stderr, "Couldn't write %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Finds a field in the contents of a format file, with lines like:
+//   field:unsigned long i_ino;	offset:16;	size:8;	signed:0;
+static int find_field(const char *format, const char *name, struct field *f) {
+    const char *line = format;
+    size_t name_len = strlen(name);
+
+    while ((line = strstr(line, "field:")) != NULL) {
+        const char *end = strchr(line, ';');
+        const char *p;
+        unsigned offset, size;
+
+        if (!end) {
+            break;
+        }
+        for (p = end; p > line && p[-1] != ' ' && p[-1] != ':'; p--) {
+        }
+        if ((size_t)(end - p) == name_len && !strncmp(p, name, name_len) &&
+                sscanf(end, "; offset:%u; size:%u;", &offset, &size) == 2) {
+            f->offset = offset;
+            f->size = size;
+            return 0;
+        }
+        line = end;
+    }
+    return -1;
+}
+
+static int read_header_page(void) {
+    char path[PATH_MAX];
+    char format[4096];
+    struct field data;
+
+    snprintf(path, sizeof(path), "%s/events/header_page", g_instance);
+    if (read_file(path, format, sizeof(format))) {
+        return -1;
+    }
+    if (find_field(format, "commit", &g_commit) || find_field(format, "data", &data) ||
+            (g_commit.size != 4 && g_commit.size != 8)) {
+        fprintf(stderr, "Unexpected format of %s\n", path);
+        return -1;
+    }
+    g_data_offset = data.offset;
+    g_buffer_page_size = data.offset + data.size;
+    return 0;
+}
+
+static int read_event_format(const char *event, struct event_format *fmt) {
+    char path[PATH_MAX];
+    char format[8192];
+    const char *id;
+
+    snprintf(path, sizeof(path), "%s/events/%s/format", g_instance, event);
+    if (read_file(path, format, sizeof(format))) {
+        return -1;
+    }
+    id = strstr(format, "\nID: ");
+    if (!id || find_field(format, "i_ino", &fmt->ino) ||
+            find_field(format, "index", &fmt->index) ||
+            find_field(format, "s_dev", &fmt->dev)) {
+        fprintf(stderr, "Unexpected format of %s\n", path);
+        return -1;
+    }
+    fmt->id = atoi(id + 5);
+    if (find_field(format, "order", &fmt->order)) {
+        fmt->order.size = 0;
+    }
+
+    fmt->min_size = fmt->ino.offset + fmt->ino.size;
+    if (fmt->index.offset + fmt->index.size > fmt->min_size) {
+        fmt->min_size = fmt->index.offset + fmt->index.size;
+    }
+    if (fmt->dev.offset + fmt->dev.size > fmt->min_size) {
+        fmt->min_size = fmt->dev.offset + fmt->dev.size;
+    }
+    if (fmt->order.offset + fmt->order.size > fmt->min_size) {
+        fmt->min_size = fmt->order.offset + fmt->order.size;
+    }
+    return 0;
+}
+
+static uint64_t read_value(const char *data, const struct field *f) {
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    switch (f->size) {
+        case 1:
+            memcpy(&v8, data + f->offset, 1);
+            return v8;
+        case 2:
+            memcpy(&v16, data + f->offset, 2);
+            return v16;
+        case 4:
+            memcpy(&v32, data + f->offset, 4);
+            return v32;
+        case 8:
+            memcpy(&v64, data + f->offset, 8);
+            return v64;
+        default:
+            return 0;
+    }
+}
+
+static void process_event(const char *data, size_t len) {
+    const struct event_format *fmt;
+    struct inode_stats *s;
+    uint16_t type;
+    uint64_t kdev, index, order, pages = 1;
+    uint64_t i;
+
+    if (len < sizeof(type)) {
+        return;
+    }
+    memcpy(&type, data, sizeof(type));
+    if (type == g_add_format.id) {
+        fmt = &g_add_format;
+    } else if (type == g_delete_format.id) {
+        fmt = &g_delete_format;
+    } else {
+        return;
+    }
+    if (len < fmt->min_size) {
+        return;
+    }
+
+    // Pages of shmem and other files without a backing device are skipped.
+    kdev = read_value(data, &fmt->dev);
+    if (kdev == 0) {
+        return;
+    }
+    s = get_inode(makedev(kdev >> 20, kdev & ((1U << 20) - 1)), read_value(data, &fmt->ino));
+    index = read_value(data, &fmt->index);
+    order = read_value(data, &fmt->order);
+    if (order < 16) {
+        pages = 1ULL << order;
+    }
+
+    // Folios may be added and deleted with different sizes, so each of their
+    // pages is tracked.
+    if (fmt == &g_add_format) {
+        s->added += pages;
+        g_total_added += pages;
+        for (i = 0; i < pages; i++) {
+            if (page_set_remove(&s->evicted, index + i)) {
+                s->refaulted++;
+                g_total_refaulted++;
+            }
+        }
+    } else {
+        s->removed += pages;
+        g_total_removed += pages;
+        for (i = 0; i < pages; i++) {
+            page_set_add(&s->evicted, index + i);
+        }
+    }
+}
+
+// Counts the events of a page read from trace_pipe_raw.
+static void process_page(const char *page, size_t len) {
+    uint64_t commit = read_value(page, &g_commit);
+    const char *p = page + g_data_offset;
+    const char *end = p + (commit & RB_COMMIT_MASK);
+
+    if (len < g_data_offset || (size_t)(end - page) > len) {
+        return;
+    }
+
+    if (commit & RB_MISSED_EVENTS) {
+        long missed = 1;
+        // The number of events missed may be stored after the data.
+        if ((commit & RB_MISSED_STORED) && (size_t)(end - page) + sizeof(missed) <= len) {
+            memcpy(&missed, end, sizeof(missed));
+        }
+        g_lost_events += missed;
+    }
+
+    while (end - p >= 4) {
+        uint32_t header;
+        uint32_t type_len;
+        uint32_t length;
+
+        memcpy(&header, p, sizeof(header));
+        p += 4;
+        type_len = header & 0x1f;
+
+        if (type_len == 0) {
+            // Large events store their length, itself included, first.
+            if (end - p < 4) {
+                break;
+            }
+            memcpy(&length, p, sizeof(length));
+            p += 4;
+            if (length < 4) {
+                break;
+            }
+            length = (length - 4 + 3) & ~3U;
+        } else if (type_len <= RB_TYPE_DATA_MAX) {
+            length = type_len * 4;
+        } else if (type_len == RB_TYPE_PADDING) {
+            if (end - p < 4) {
+                break;
+            }
+            memcpy(&length, p, sizeof(length));
+            if (length == 0 || length > (size_t)(end - p)) {
+                break;
+            }
+            p += length;
+            continue;
+        } else {
+            // Time extends and absolute time stamps
+            p += 4;
+            continue;
+        }
+
+        if (length > (size_t)(end - p)) {
+            break;
+        }
+        process_event(p, length);
+        p += length;
+    }
+}
+
+static void *reader_thread(void *arg) {
+    struct cpu_reader *r = arg;
+    char *page = xmalloc(g_buffer_page_size);
+    struct pollfd pfd;
+
+    pfd.fd = r->fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        ssize_t n = read(r->fd, page, g_buffer_page_size);
+
+        if (n > 0) {
+            pthread_mutex_lock(&g_lock);
+            process_page(page, n);
+            pthread_mutex_unlock(&g_lock);
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "Couldn't read trace buffer: %s\n", strerror(errno));
+            break;
+        }
+        // Only stop once the buffer is empty.
+        if (g_readers_stop) {
+            break;
+        }
+        poll(&pfd, 1, POLL_TIMEOUT_MS);
+    }
+
+    free(page);
+    return NULL;
+}
+
+static void format_name(const struct inode_stats *s, char *buf, size_t size) {
+    if (s->path) {
+        snprintf(buf, size, "%s", s->path);
+    } else {
+        snprintf(buf, size, "dev %u:%u ino %llu", major(s->dev), minor(s->dev),
+                 (unsigned long long)s->ino);
+    }
+}
+
+// Summaries list the files whose counts changed since the previous one,
+// followed by the totals since tracing started:
+//   <added pages> <removed pages> <refaulted pages> <file size> <path>
+//   TOTAL <added pages> <removed pages> <refaulted pages> <lost events>
+static void print_summary(void) {
+    char name[PATH_MAX];
+    size_t i;
+
+    pthread_mutex_lock(&g_lock);
+    for (i = 0; i < g_inodes.size; i++) {
+        struct inode_stats *s = g_inodes.slots[i];
+
+        if (!s || (s->added == s->last_added && s->removed == s->last_removed)) {
+            continue;
+        }
+        format_name(s, name, sizeof(name));
+        fprintf(stdout, "%llu %llu %llu %zu %s\n",
+                (unsigned long long)(s->added - s->last_added),
+                (unsigned long long)(s->removed - s->last_removed),
+                (unsigned long long)(s->refaulted - s->last_refaulted), s->file_size, name);
+        s->last_added = s->added;
+        s->last_removed = s->removed;
+        s->last_refaulted = s->refaulted;
+    }
+    fprintf(stdout, "TOTAL %llu %llu %llu %llu\n", (unsigned long long)g_total_added,
+            (unsigned long long)g_total_removed, (unsigned long long)g_total_refaulted,
+            (unsigned long long)g_lost_events);
+    pthread_mutex_unlock(&g_lock);
+    fflush(stdout);
+}
+
+static int cmpadded(const void *a, const void *b) {
+    const struct inode_stats *sa = *(struct inode_stats * const *)a;
+    const struct inode_stats *sb = *(struct inode_stats * const *)b;
+
+    if (sa->added != sb->added) return sa->added < sb->added ? -1 : 1;
+    if (sa->removed != sb->removed) return sa->removed < sb->removed ? -1 : 1;
+    return 0;
+}
+
+static float pages_to_mb(uint64_t pages) {
+    return (float) (pages * getpagesize()) / 1024 / 1024;
+}
+
+static void print_totals(void) {
+    struct inode_stats **files = xmalloc((g_inodes.count + 1) * sizeof(struct inode_stats*));
+    char name[PATH_MAX];
+    size_t num_files = 0;
+    size_t i;
+
+    for (i = 0; i < g_inodes.size; i++) {
+        struct inode_stats *s = g_inodes.slots[i];
+        if (s && (s->added || s->removed)) {
+            files[num_files++] = s;
+        }
+    }
+    qsort(files, num_files, sizeof(files[0]), &cmpadded);
+
+    for (i = 0; i < num_files; i++) {
+        struct inode_stats *s = files[i];
+        format_name(s, name, sizeof(name));
+        fprintf(stdout, "%s: %llu pages added (%.2f MB), %llu removed, %llu refaulted\n", name,
+                (unsigned long long)s->added, pages_to_mb(s->added),
+                (unsigned long long)s->removed, (unsigned long long)s->refaulted);
+    }
+    fprintf(stdout, "TOTAL: %llu pages added (%.2f MB), %llu removed, %llu refaulted\n",
+            (unsigned long long)g_total_added, pages_to_mb(g_total_added),
+            (unsigned long long)g_total_removed, (unsigned long long)g_total_refaulted);
+    free(files);
+}
+
+static int set_events(const char *value) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/events/%s/enable", g_instance, ADD_EVENT);
+    if (write_file(path, value)) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/events/%s/enable", g_instance, DELETE_EVENT);
+    return write_file(path, value);
+}
+
+static int create_instance(void) {
+    static const char *roots[] = { "/sys/kernel/tracing", "/sys/kernel/debug/tracing" };
+    size_t i;
+
+    for (i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+        snprintf(g_instance, sizeof(g_instance), "%s/instances", roots[i]);
+        if (access(g_instance, F_OK) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof(roots) / sizeof(roots[0])) {
+        fprintf(stderr, "Couldn't find tracefs\n");
+        return -1;
+    }
+
+    // An instance left by a run that was killed is reused.
+    strcat(g_instance, "/" INSTANCE_NAME);
+    if (mkdir(g_instance, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Couldn't create %s: %s\n", g_instance, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    g_interrupted = 1;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [ -b <kb> ] [ -s <ms> ] [ -t <seconds> ] [ <dir>... ]\n"
+            "    Counts the pages added to and deleted from the page cache of each file,\n"
+            "    and the pages added again after being deleted (refaults), until\n"
+            "    interrupted.\n"
+            "    -b  Size of the trace buffer of each cpu in KB.\n"
+            "    -s  Instead of a table at the end, print the files whose counts\n"
+            "        changed every <ms> milliseconds, as lines of\n"
+            "          <added> <removed> <refaulted> <file size> <path>\n"
+            "        followed by\n"
+            "          TOTAL <added> <removed> <refaulted> <lost events>\n"
+            "    -t  Stop after this many seconds.\n"
+            "    Files are named after their paths under the given directories, by\n"
+            "    default /system, /vendor and /data.\n",
+            cmd);
+}
+
+int main(int argc, char *argv[])
+{
+    static char *default_dirs[] = { "/system/", "/vendor/", "/data/" };
+    struct cpu_reader *readers;
+    struct sigaction sa;
+    char path[PATH_MAX];
+    struct timespec start, now;
+    const char *buffer_size = NULL;
+    long interval_ms = 0;
+    double duration = 0;
+    int num_cpus, num_readers = 0;
+    int ret = EXIT_FAILURE;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "b:s:t:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                buffer_size = optarg;
+                break;
+            case 's':
+                interval_ms = atol(optarg);
+                if (interval_ms < 1) {
+                    fprintf(stderr, "Invalid interval: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                duration = atof(optarg);
+                if (duration <= 0) {
+                    fprintf(stderr, "Invalid duration: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    g_inodes.size = INITIAL_NUM_INODES;
+    g_inodes.slots = xcalloc(g_inodes.size, sizeof(struct inode_stats*));
+    if (optind < argc) {
+        scan_paths(argv + optind, argc - optind);
+    } else {
+        scan_paths(default_dirs, sizeof(default_dirs) / sizeof(default_dirs[0]));
+    }
+
+    if (create_instance()) {
+        return EXIT_FAILURE;
+    }
+    if (read_header_page() || read_event_format(ADD_EVENT, &g_add_format) ||
+            read_event_format(DELETE_EVENT, &g_delete_format)) {
+        goto out;
+    }
+    if (buffer_size) {
+        snprintf(path, sizeof(path), "%s/buffer_size_kb", g_instance);
+        if (write_file(path, buffer_size)) {
+            goto out;
+        }
+    }
+
+    // Wake up the readers as soon as a page has data, rather than once the
+    // buffers are half full, so that bursts of events don't fill them up. The
+    // file is missing on kernels that always do so.
+    snprintf(path, sizeof(path), "%s/buffer_percent", g_instance);
+    if (access(path, F_OK) == 0 && write_file(path, "0")) {
+        goto out;
+    }
+
+    num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    readers = xcalloc(num_cpus, sizeof(*readers));
+    for (i = 0; i < num_cpus; i++) {
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/per_cpu/cpu%d/trace_pipe_raw", g_instance, i);
+        fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        readers[num_readers].fd = fd;
+        if (pthread_create(&readers[num_readers].thread, NULL, reader_thread,
+                           &readers[num_readers])) {
+            fprintf(stderr, "Couldn't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+        num_readers++;
+    }
+    if (num_readers == 0) {
+        fprintf(stderr, "Couldn't open the trace buffers in %s\n", g_instance);
+        free(readers);
+        goto out;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (set_events("1") == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (!g_interrupted) {
+            double elapsed, wait;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+            if (duration && elapsed >= duration) {
+                break;
+            }
+            wait = interval_ms ? interval_ms / 1e3 : 1;
+            if (duration && duration - elapsed < wait) {
+                wait = duration - elapsed;
+            }
+            usleep(wait * 1e6);
+            if (interval_ms) {
+                print_summary();
+            }
+        }
+        ret = EXIT_SUCCESS;
+    }
+    set_events("0");
+
+    g_readers_stop = 1;
+    for (i = 0; i < num_readers; i++) {
+        pthread_join(readers[i].thread, NULL);
+        close(readers[i].fd);
+    }
+    free(readers);
+
+    if (ret == EXIT_SUCCESS) {
+        if (interval_ms) {
+            print_summary();
+        } else {
+            print_totals();
+        }
+        if (g_lost_events) {
+            fprintf(stderr, "Lost %llu events, try a larger buffer with -b\n",
+                    (unsigned long long)g_lost_events);
+        }
+    }
+
+out:
+    rmdir(g_instance);
+    return ret;
+}
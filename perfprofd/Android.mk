@@ -7,6 +7,24 @@ perfprofd_cppflags := \
   -Werror \
   -std=gnu++11 \
 
+#
+# simpleperf record engine, linked in for in-process profile collection
+# (see inprocess_recorder.h). libsimpleperf is only built for the
+# primary arch, hence LOCAL_MULTILIB := first below.
+#
+perfprofd_simpleperf_static_libraries := \
+  libsimpleperf \
+  libbacktrace_offline \
+  liblzma \
+  libziparchive \
+  libz \
+
+perfprofd_simpleperf_shared_libraries := \
+  libbacktrace \
+  libunwind \
+  libutils \
+  libLLVM \
+
 #
 # Static library containing guts of AWP daemon.
 #
@@ -18,7 +36,8 @@ LOCAL_MODULE_CLASS := STATIC_LIBRARIES
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
 LOCAL_MODULE_TAGS := debug
 proto_header_dir := $(call local-generated-sources-dir)/proto/$(LOCAL_PATH)
-LOCAL_C_INCLUDES += $(proto_header_dir) $(LOCAL_PATH)/quipper/kernel-headers
+LOCAL_C_INCLUDES += $(proto_header_dir) $(LOCAL_PATH)/quipper/kernel-headers \
+  system/extras/simpleperf
 LOCAL_STATIC_LIBRARIES := libbase
 LOCAL_EXPORT_C_INCLUDE_DIRS += $(proto_header_dir)
 LOCAL_SRC_FILES :=  \
@@ -29,11 +48,16 @@ LOCAL_SRC_FILES :=  \
 	quipper/perf_reader.cc \
 	quipper/perf_parser.cc \
 	perf_data_converter.cc \
+	profile_merger.cc \
+	symbol_cache.cc \
 	configreader.cc \
 	cpuconfig.cc \
+	inprocess_recorder.cc \
+	overhead_governor.cc \
 	perfprofdcore.cc \
 
 LOCAL_CPPFLAGS += $(perfprofd_cppflags)
+LOCAL_MULTILIB := first
 include $(BUILD_STATIC_LIBRARY)
 
 #
@@ -58,8 +82,10 @@ LOCAL_CLANG := true
 LOCAL_CPP_EXTENSION := .cc
 LOCAL_CXX_STL := libc++
 LOCAL_SRC_FILES := perfprofdmain.cc
-LOCAL_STATIC_LIBRARIES := libperfprofdcore libperfprofdutils
-LOCAL_SHARED_LIBRARIES := liblog libprotobuf-cpp-lite libbase
+LOCAL_STATIC_LIBRARIES := libperfprofdcore libperfprofdutils \
+  $(perfprofd_simpleperf_static_libraries)
+LOCAL_SHARED_LIBRARIES := liblog libprotobuf-cpp-lite libbase \
+  $(perfprofd_simpleperf_shared_libraries)
 LOCAL_SYSTEM_SHARED_LIBRARIES := libc libstdc++
 LOCAL_CPPFLAGS += $(perfprofd_cppflags)
 LOCAL_CFLAGS := -Wall -Werror -std=gnu++11
@@ -68,8 +94,11 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
 LOCAL_MODULE_TAGS := debug
 LOCAL_SHARED_LIBRARIES += libcutils
 LOCAL_INIT_RC := perfprofd.rc
+LOCAL_MULTILIB := first
 include $(BUILD_EXECUTABLE)
 
 # Clean temp vars
 perfprofd_cppflags :=
+perfprofd_simpleperf_static_libraries :=
+perfprofd_simpleperf_shared_libraries :=
 proto_header_dir :=
@@ -80,6 +80,25 @@ void ConfigReader::addDefaultEntries()
   // Full path to 'perf' executable.
   addStringEntry("perf_path", "/system/xbin/simpleperf");
 
+  // If set to 1, collect profiles with the simpleperf record engine
+  // linked into perfprofd, instead of running the 'perf' executable
+  // above. Samples then go straight from the kernel ring buffers to
+  // the profile encoder, with no perf.data file written to flash.
+  addUnsignedEntry("inprocess_collection", 0, 0, 1);
+
+  // If set to 1, run 'perf record -o -' and convert its piped output
+  // while it is recording, instead of reading perf.data once perf is
+  // done. The perf executable must support piped output.
+  addUnsignedEntry("pipe_perf_output", 0, 0, 1);
+
+  // Events to sample, as a comma separated list of perf event names.
+  // Several events (e.g. "cpu-cycles,instructions,cache-misses,
+  // branch-misses") are sampled together as one perf event group, each
+  // with the sampling period below, and profiles then carry the count of
+  // each event per address, so efficiency (like instructions per cycle)
+  // can be computed per function along with hot spots.
+  addStringEntry("event_types", "cpu-cycles");
+
   // Desired sampling period (passed to perf -c option). Small
   // sampling periods can perturb the collected profiles, so enforce
   // min/max.
@@ -89,6 +108,13 @@ void ConfigReader::addDefaultEntries()
   // record -a' run).
   addUnsignedEntry("sample_duration", 3, 2, 600);
 
+  // Maximum cpu overhead of profile collection, in thousandths of a
+  // core (10 means 1%), measured as the cpu time used by perfprofd and
+  // perf over the wall time of each collection. If a collection goes
+  // over budget or loses samples, the sampling period of the next ones
+  // is increased (and their duration extended). 0 disables this.
+  addUnsignedEntry("max_overhead_permille", 0, 0, 1000);
+
   // If this parameter is non-zero it will cause perfprofd to
   // exit immediately if the build type is not userdebug or eng.
   // Currently defaults to 1 (true).
@@ -107,10 +133,27 @@ void ConfigReader::addDefaultEntries()
   // to collect, but we just overwrite the most recent profile.
   addUnsignedEntry("max_unprocessed_profiles", 10, 1, UINT32_MAX);
 
+  // Number of collections merged into each profile handed to the
+  // uploader. Above 1, samples of successive collections are added
+  // together (keyed by program, load module build id and address), and
+  // flat samples are stored as delta encoded address arrays.
+  addUnsignedEntry("merge_profiles", 1, 1, 1000);
+
+  // If set, symbolize profiles on the device, keeping the symbols of
+  // the libraries seen so far in this directory (keyed by build id),
+  // up to 'symbol_cache_max_size' kilobytes.
+  addStringEntry("symbol_cache_dir", "");
+  addUnsignedEntry("symbol_cache_max_size", 8192, 64, UINT32_MAX);
+
   // If set to 1, pass the -g option when invoking 'perf' (requests
   // stack traces as opposed to flat profile).
   addUnsignedEntry("stack_profile", 0, 0, 1);
 
+  // With stack_profile, maximum number of distinct call stacks kept per
+  // profile. When more are seen, samples of the rarest stacks are counted
+  // by their leaf address only. 0 counts all samples by leaf address.
+  addUnsignedEntry("max_stack_count", 10000, 0, UINT32_MAX);
+
   // For unit testing only: if set to 1, emit info messages on config
   // file parsing.
   addUnsignedEntry("trace_config_read", 0, 0, 1);
@@ -0,0 +1,338 @@
+/*
+**
+** Copyright 2016, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "inprocess_recorder.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <sys/utsname.h>
+#include <chrono>
+
+#include <android-base/strings.h>
+
+// simpleperf record engine
+#include "environment.h"
+#include "event_selection_set.h"
+#include "event_type.h"
+#include "record.h"
+#include "record_file.h"
+#include "thread_tree.h"
+
+#include "perfprofdutils.h"
+
+//
+// Number of pages of each per-cpu ring buffer (not counting the
+// metadata page), same as the 'simpleperf record' default.
+//
+static const size_t kMmapPages = 16;
+
+InProcessRecorder::InProcessRecorder()
+    : sampling_period_(0),
+      stack_profile_(false)
+{
+}
+
+InProcessRecorder::~InProcessRecorder()
+{
+}
+
+bool InProcessRecorder::openEvents(const std::vector<std::string> &event_type_names,
+                                   unsigned sampling_period,
+                                   bool stack_profile,
+                                   const std::vector<int> &cpus)
+{
+  // Close event files of the old configuration first, so that we
+  // don't hold two sets of ring buffers at the same time.
+  event_selection_set_.reset();
+  event_types_.clear();
+  event_type_names_.clear();
+  cpus_.clear();
+
+  std::vector<EventTypeAndModifier> event_types;
+  for (auto &name : event_type_names) {
+    std::unique_ptr<EventTypeAndModifier> event_type = ParseEventType(name);
+    if (event_type == nullptr) {
+      return false;
+    }
+    event_types.push_back(*event_type);
+  }
+  // Several events are sampled as one group, so that they are scheduled
+  // on the PMU together and their counts can be compared.
+  std::unique_ptr<EventSelectionSet> set(new EventSelectionSet);
+  if (!set->AddEventGroup(event_types)) {
+    return false;
+  }
+  set->SetSamplePeriod(sampling_period);
+  set->SampleIdAll();
+  if (stack_profile) {
+    set->EnableFpCallChainSampling();
+  }
+  // Events are enabled only while a collection is in progress.
+  set->SetEnableOnDemand();
+  if (!set->OpenEventFilesForCpus(cpus) ||
+      !set->MmapEventFiles(kMmapPages)) {
+    W_ALOGE("unable to open perf event files for %s",
+            android::base::Join(event_type_names, ',').c_str());
+    return false;
+  }
+  event_selection_set_ = std::move(set);
+  event_types_ = std::move(event_types);
+  event_type_names_ = event_type_names;
+  sampling_period_ = sampling_period;
+  stack_profile_ = stack_profile;
+  cpus_ = cpus;
+  return true;
+}
+
+bool InProcessRecorder::writeAttrSection()
+{
+  std::vector<AttrWithId> attr_ids;
+  for (auto &event_type : event_types_) {
+    AttrWithId attr_id;
+    attr_id.attr = event_selection_set_->FindEventAttrByType(event_type);
+    const std::vector<std::unique_ptr<EventFd>> *fds =
+        event_selection_set_->FindEventFdsByType(event_type);
+    for (auto &fd : *fds) {
+      attr_id.ids.push_back(fd->Id());
+    }
+    attr_ids.push_back(attr_id);
+  }
+  return writer_->WriteAttrSection(attr_ids);
+}
+
+bool InProcessRecorder::processRecord(Record *record)
+{
+  UpdateRecordForEmbeddedElfPath(record);
+  BuildThreadTree(*record, thread_tree_.get());
+  if (record->type() == PERF_RECORD_SAMPLE) {
+    //
+    // Remember the files hit by samples, so that we only look up
+    // build ids for those.
+    //
+    const SampleRecord &r = *static_cast<SampleRecord *>(record);
+    bool in_kernel = ((r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) ==
+                      PERF_RECORD_MISC_KERNEL);
+    const ThreadEntry *thread =
+        thread_tree_->FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+    const MapEntry *map = thread_tree_->FindMap(thread, r.ip_data.ip, in_kernel);
+    if (in_kernel) {
+      hit_kernel_modules_.insert(map->dso->Path());
+    } else {
+      hit_user_files_.insert(map->dso->Path());
+    }
+  }
+  return writer_->WriteRecord(*record);
+}
+
+bool InProcessRecorder::dumpKernelAndModuleMmaps()
+{
+  KernelMmap kernel_mmap;
+  std::vector<KernelMmap> module_mmaps;
+  GetKernelAndModuleMmaps(&kernel_mmap, &module_mmaps);
+
+  const perf_event_attr &attr =
+      *event_selection_set_->FindEventAttrByType(event_types_[0]);
+  MmapRecord mmap_record =
+      CreateMmapRecord(attr, true, UINT_MAX, 0, kernel_mmap.start_addr,
+                       kernel_mmap.len, 0, kernel_mmap.filepath);
+  if (!processRecord(&mmap_record)) {
+    return false;
+  }
+  for (auto &module_mmap : module_mmaps) {
+    MmapRecord mmap_record =
+        CreateMmapRecord(attr, true, UINT_MAX, 0, module_mmap.start_addr,
+                         module_mmap.len, 0, module_mmap.filepath);
+    if (!processRecord(&mmap_record)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool InProcessRecorder::dumpThreadCommAndMmaps()
+{
+  std::vector<ThreadComm> thread_comms;
+  if (!GetThreadComms(&thread_comms)) {
+    return false;
+  }
+  const perf_event_attr &attr =
+      *event_selection_set_->FindEventAttrByType(event_types_[0]);
+
+  // Processes, with their executable mappings
+  for (auto &thread : thread_comms) {
+    if (thread.pid != thread.tid) {
+      continue;
+    }
+    CommRecord record = CreateCommRecord(attr, thread.pid, thread.tid, thread.comm);
+    if (!processRecord(&record)) {
+      return false;
+    }
+    std::vector<ThreadMmap> thread_mmaps;
+    if (!GetThreadMmapsInProcess(thread.pid, &thread_mmaps)) {
+      // The process may exit before we get its info.
+      continue;
+    }
+    for (auto &thread_mmap : thread_mmaps) {
+      if (!thread_mmap.executable) {
+        continue;
+      }
+      MmapRecord record =
+          CreateMmapRecord(attr, false, thread.pid, thread.tid,
+                           thread_mmap.start_addr, thread_mmap.len,
+                           thread_mmap.pgoff, thread_mmap.name);
+      if (!processRecord(&record)) {
+        return false;
+      }
+    }
+  }
+
+  // Threads other than the main thread of each process
+  for (auto &thread : thread_comms) {
+    if (thread.pid == thread.tid) {
+      continue;
+    }
+    ForkRecord fork_record =
+        CreateForkRecord(attr, thread.pid, thread.tid, thread.pid, thread.pid);
+    if (!processRecord(&fork_record)) {
+      return false;
+    }
+    CommRecord comm_record =
+        CreateCommRecord(attr, thread.pid, thread.tid, thread.comm);
+    if (!processRecord(&comm_record)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool InProcessRecorder::collectRecords(const char *data, size_t size)
+{
+  const perf_event_attr &attr =
+      *event_selection_set_->FindEventAttrByType(event_types_[0]);
+  std::vector<std::unique_ptr<Record>> records =
+      ReadRecordsFromBuffer(attr, data, size);
+  for (auto &r : records) {
+    if (!processRecord(r.get())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool InProcessRecorder::writeFeatures()
+{
+  if (!writer_->WriteFeatureHeader(3)) {
+    return false;
+  }
+  std::vector<BuildIdRecord> build_id_records;
+  GetBuildIdRecordsOfHitFiles(hit_kernel_modules_, hit_user_files_,
+                              &build_id_records);
+  if (!writer_->WriteBuildIdFeature(build_id_records)) {
+    return false;
+  }
+  utsname uname_buf;
+  if (TEMP_FAILURE_RETRY(uname(&uname_buf)) != 0) {
+    return false;
+  }
+  return writer_->WriteFeatureString(PerfFileFormat::FEAT_OSRELEASE,
+                                     uname_buf.release) &&
+      writer_->WriteFeatureString(PerfFileFormat::FEAT_ARCH,
+                                  uname_buf.machine);
+}
+
+bool InProcessRecorder::record(const std::vector<std::string> &event_types,
+                               unsigned sampling_period,
+                               bool stack_profile,
+                               unsigned duration,
+                               std::vector<char> *perf_data)
+{
+  //
+  // Reuse the event files and ring buffers of the previous collection
+  // if possible. CPUs brought online since then (e.g. by
+  // HardwireCpuHelper) need event files of their own, so reopen if
+  // the set of online cpus has changed.
+  //
+  std::vector<int> cpus = GetOnlineCpus();
+  if (event_selection_set_ == nullptr ||
+      event_types != event_type_names_ ||
+      sampling_period != sampling_period_ ||
+      stack_profile != stack_profile_ ||
+      cpus != cpus_) {
+    if (!openEvents(event_types, sampling_period, stack_profile, cpus)) {
+      return false;
+    }
+  }
+
+  if (thread_tree_ == nullptr) {
+    thread_tree_.reset(new simpleperf::ThreadTree);
+  }
+  thread_tree_->Clear();
+  hit_kernel_modules_.clear();
+  hit_user_files_.clear();
+
+  writer_ = RecordFileWriter::CreateInstance(perf_data);
+  bool ok = writeAttrSection() &&
+      dumpKernelAndModuleMmaps() &&
+      dumpThreadCommAndMmaps() &&
+      event_selection_set_->EnableEvents();
+  if (ok) {
+    //
+    // Drain the ring buffers until the collection period is over. The
+    // records are parsed and written to the in-memory perf.data right
+    // away, so the ring buffers never need to be larger than for the
+    // 'simpleperf record' executable.
+    //
+    std::vector<pollfd> pollfds;
+    event_selection_set_->PreparePollForEventFiles(&pollfds);
+    auto callback = [this](const char *data, size_t size) {
+      return collectRecords(data, size);
+    };
+    auto end_time = std::chrono::steady_clock::now() +
+        std::chrono::seconds(duration);
+    while (true) {
+      if (!event_selection_set_->ReadMmapEventData(callback)) {
+        ok = false;
+        break;
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (now >= end_time) {
+        break;
+      }
+      auto timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+          end_time - now).count() + 1;
+      poll(pollfds.data(), pollfds.size(), static_cast<int>(timeout_ms));
+    }
+    // Disable first, then pick up what was written before that.
+    if (!event_selection_set_->DisableEvents()) {
+      ok = false;
+    }
+    if (!event_selection_set_->ReadMmapEventData(callback)) {
+      ok = false;
+    }
+  }
+  ok = ok && writeFeatures();
+  if (!writer_->Close()) {
+    ok = false;
+  }
+  writer_.reset();
+  if (!ok) {
+    W_ALOGE("in-process perf record failed");
+    // Start from fresh event files next time.
+    event_selection_set_.reset();
+  }
+  return ok;
+}
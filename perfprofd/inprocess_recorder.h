@@ -0,0 +1,94 @@
+/*
+**
+** Copyright 2016, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef SYSTEM_EXTRAS_PERFPROFD_INPROCESS_RECORDER_H_
+#define SYSTEM_EXTRAS_PERFPROFD_INPROCESS_RECORDER_H_
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+class EventSelectionSet;
+class RecordFileWriter;
+struct EventTypeAndModifier;
+struct Record;
+namespace simpleperf {
+class ThreadTree;
+}
+
+//
+// Collects system-wide profiles with the simpleperf record engine
+// linked into the daemon, as opposed to forking and exec'ing
+// 'simpleperf record'. The perf event files and their mapped ring
+// buffers stay open (disabled) from one collection to the next, and
+// each collection is written to an in-memory perf.data image instead
+// of a file on flash. Example:
+//
+//       InProcessRecorder recorder;
+//       std::vector<char> perf_data;
+//       if (recorder.record({"cpu-cycles"}, period, false, duration,
+//                           &perf_data)) {
+//         ... = convert(perf_data.data(), perf_data.size());
+//       }
+//
+class InProcessRecorder {
+ public:
+  InProcessRecorder();
+  ~InProcessRecorder();
+
+  // Sample all cpus for 'duration' seconds, taking a sample every
+  // 'sampling_period' occurrences of each event of 'event_types' (sampled
+  // as one perf event group if more than one), with frame pointer based
+  // call chains if 'stack_profile' is set. On success 'perf_data' holds the
+  // contents of a perf.data file. Its capacity is kept, so a buffer
+  // passed in for each collection is only grown, not reallocated.
+  bool record(const std::vector<std::string> &event_types,
+              unsigned sampling_period,
+              bool stack_profile,
+              unsigned duration,
+              std::vector<char> *perf_data);
+
+ private:
+  bool openEvents(const std::vector<std::string> &event_type_names,
+                  unsigned sampling_period,
+                  bool stack_profile,
+                  const std::vector<int> &cpus);
+  bool writeAttrSection();
+  bool dumpKernelAndModuleMmaps();
+  bool dumpThreadCommAndMmaps();
+  bool collectRecords(const char *data, size_t size);
+  bool processRecord(Record *record);
+  bool writeFeatures();
+
+  // Event files, opened for the configuration below. They are reopened
+  // only when the configuration or the set of online cpus changes.
+  std::vector<EventTypeAndModifier> event_types_;
+  std::vector<std::string> event_type_names_;
+  std::unique_ptr<EventSelectionSet> event_selection_set_;
+  unsigned sampling_period_;
+  bool stack_profile_;
+  std::vector<int> cpus_;
+
+  // State of the collection in progress.
+  std::unique_ptr<RecordFileWriter> writer_;
+  std::unique_ptr<simpleperf::ThreadTree> thread_tree_;
+  std::set<std::string> hit_kernel_modules_;
+  std::set<std::string> hit_user_files_;
+};
+
+#endif
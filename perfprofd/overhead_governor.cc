@@ -0,0 +1,153 @@
+/*
+**
+** Copyright 2016, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "overhead_governor.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <algorithm>
+
+#include "perfprofdutils.h"
+
+//
+// Limits on the adjustments: the sampling period is never stretched
+// by more than kMaxPeriodScale (profiles get too sparse beyond that),
+// and the duration never extended by more than kMaxDurationScale or
+// past kMaxDuration seconds (the maximum 'sample_duration' setting).
+//
+static const double kMaxPeriodScale = 64.0;
+static const double kMaxDurationScale = 4.0;
+static const unsigned kMaxDuration = 600;
+
+//
+// Aim below the budget, so that normal variations between
+// collections don't push the overhead over it.
+//
+static const double kTargetFraction = 0.8;
+
+static uint64_t timeval_to_us(const struct timeval &tv)
+{
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+//
+// Cpu time (user + system) used by the daemon itself, e.g. for
+// in-process recording and for encoding, and by its reaped children,
+// i.e. the 'perf record' runs.
+//
+static uint64_t get_cpu_time_us()
+{
+  uint64_t total = 0;
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    total += timeval_to_us(usage.ru_utime) + timeval_to_us(usage.ru_stime);
+  }
+  if (getrusage(RUSAGE_CHILDREN, &usage) == 0) {
+    total += timeval_to_us(usage.ru_utime) + timeval_to_us(usage.ru_stime);
+  }
+  return total;
+}
+
+static uint64_t get_wall_time_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+OverheadGovernor::OverheadGovernor()
+    : period_scale_(1.0),
+      start_cpu_us_(0),
+      start_wall_us_(0),
+      total_samples_(0),
+      lost_samples_(0)
+{
+}
+
+void OverheadGovernor::adjust(unsigned budget_permille,
+                              unsigned *sampling_period,
+                              unsigned *duration) const
+{
+  if (budget_permille == 0 || period_scale_ <= 1.0) {
+    return;
+  }
+  double period = *sampling_period * period_scale_;
+  *sampling_period = static_cast<unsigned>(std::min(period, double(UINT_MAX)));
+
+  // Extend the duration by the square root of the period scale: this
+  // keeps the overhead the same, and recovers part of the samples.
+  double duration_scale = std::min(sqrt(period_scale_), kMaxDurationScale);
+  double extended = *duration * duration_scale;
+  *duration = static_cast<unsigned>(
+      std::max(double(*duration), std::min(extended, double(kMaxDuration))));
+}
+
+void OverheadGovernor::beginCollection()
+{
+  start_cpu_us_ = get_cpu_time_us();
+  start_wall_us_ = get_wall_time_us();
+  total_samples_ = 0;
+  lost_samples_ = 0;
+}
+
+void OverheadGovernor::noteSamples(uint64_t total_samples,
+                                   uint64_t lost_samples)
+{
+  total_samples_ += total_samples;
+  lost_samples_ += lost_samples;
+}
+
+void OverheadGovernor::endCollection(unsigned budget_permille)
+{
+  if (budget_permille == 0) {
+    period_scale_ = 1.0;
+    return;
+  }
+  uint64_t cpu_us = get_cpu_time_us() - start_cpu_us_;
+  uint64_t wall_us = get_wall_time_us() - start_wall_us_;
+  double overhead =
+      (wall_us != 0 ? static_cast<double>(cpu_us) * 1000.0 / wall_us : 0.0);
+
+  //
+  // The cost of a collection is mostly proportional to the number of
+  // samples, so scaling the period by overhead / target brings the
+  // overhead to the target, up or down.
+  //
+  double target = budget_permille * kTargetFraction;
+  double scale = period_scale_ * overhead / target;
+
+  //
+  // Dropped samples mean the ring buffers overflowed: whatever the
+  // overhead, sample less often, at least in proportion.
+  //
+  if (lost_samples_ != 0) {
+    double lost_scale = static_cast<double>(total_samples_ + lost_samples_) /
+        std::max<uint64_t>(total_samples_, 1);
+    scale = std::max(scale, period_scale_ * std::max(lost_scale, 2.0));
+  }
+  scale = std::max(1.0, std::min(scale, kMaxPeriodScale));
+
+  if (scale != period_scale_) {
+    W_ALOGI("profiling overhead %.1f permille of a core (budget %u), "
+            "%" PRIu64 " lost samples: sampling period scale %.2f -> %.2f",
+            overhead, budget_permille, lost_samples_, period_scale_, scale);
+    period_scale_ = scale;
+  }
+}
@@ -0,0 +1,68 @@
+/*
+**
+** Copyright 2016, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef SYSTEM_EXTRAS_PERFPROFD_OVERHEAD_GOVERNOR_H_
+#define SYSTEM_EXTRAS_PERFPROFD_OVERHEAD_GOVERNOR_H_
+
+#include <stdint.h>
+
+//
+// Keeps the cost of profile collection within a budget. The cpu time
+// used by the daemon and its children (perf) is measured for each
+// collection and compared to the wall time of the collection; if this
+// exceeds the budget, or if the kernel had to drop samples, the
+// sampling period of the next collections is stretched, and their
+// duration extended to make up for part of the lost samples. When the
+// measured overhead is below the budget, the configured settings are
+// restored. Usage:
+//
+//       governor.adjust(budget, &period, &duration);
+//       governor.beginCollection();
+//       ... record with 'period' and 'duration', then
+//       governor.noteSamples(total, lost);
+//       governor.endCollection(budget);
+//
+class OverheadGovernor {
+ public:
+  OverheadGovernor();
+
+  // Scale the configured sampling period and duration of the next
+  // collection. 'budget_permille' is the allowed overhead in
+  // thousandths of a core; 0 disables the governor.
+  void adjust(unsigned budget_permille,
+              unsigned *sampling_period,
+              unsigned *duration) const;
+
+  // Bracket a collection, to measure its cpu and wall time.
+  void beginCollection();
+  void endCollection(unsigned budget_permille);
+
+  // Record the number of samples taken and dropped by the collection.
+  void noteSamples(uint64_t total_samples, uint64_t lost_samples);
+
+  // Current sampling period multiplier (1.0 when within budget).
+  double periodScale() const { return period_scale_; }
+
+ private:
+  double period_scale_;
+  uint64_t start_cpu_us_;
+  uint64_t start_wall_us_;
+  uint64_t total_samples_;
+  uint64_t lost_samples_;
+};
+
+#endif
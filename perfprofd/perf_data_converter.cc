@@ -1,9 +1,23 @@
 
 #include "perf_data_converter.h"
 #include "quipper/perf_parser.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 using std::map;
+using std::pair;
+using std::vector;
 
 namespace wireless_android_logging_awp {
 
@@ -27,61 +41,398 @@ struct RangeTarget {
 
 struct BinaryProfile {
   map<uint64, uint64> address_count_map;
+  // Per-event counts of the addresses, if more than one event is sampled.
+  map<uint64, vector<uint64>> address_event_count_map;
   map<RangeTarget, uint64> range_count_map;
 };
 
-wireless_android_play_playlog::AndroidPerfProfile
-RawPerfDataToAndroidPerfProfile(const string &perf_file) {
-  wireless_android_play_playlog::AndroidPerfProfile ret;
-  quipper::PerfParser parser;
-  if (!parser.ReadFile(perf_file) || !parser.ParseRawEvents()) {
-    return ret;
+typedef map<string, BinaryProfile> ModuleProfileMap;
+typedef map<string, ModuleProfileMap> ProgramProfileMap;
+
+// Samples of a perf.data recording several events (like an event group)
+// are told apart by their sample id, each event having its own ids.
+class EventIndexer {
+ public:
+  explicit EventIndexer(const quipper::PerfParser &parser)
+      : parser_(parser), indexed_attrs_(0) {}
+
+  size_t EventCount() const {
+    return parser_.attrs().size();
   }
 
-  typedef map<string, BinaryProfile> ModuleProfileMap;
-  typedef map<string, ModuleProfileMap> ProgramProfileMap;
-  ProgramProfileMap name_profile_map;
-  uint64 total_samples = 0;
-  for (const auto &event : parser.parsed_events()) {
-    if (!event.raw_event ||
-        event.raw_event->header.type != PERF_RECORD_SAMPLE) {
-      continue;
-    }
-    string dso_name = event.dso_and_offset.dso_name();
-    string program_name;
-    if (dso_name == "[kernel.kallsyms]_text") {
-      program_name = "kernel";
-      dso_name = "[kernel.kallsyms]";
-    } else if (event.command() == "") {
-      program_name = "unknown_program";
-    } else {
-      program_name = event.command();
-    }
-    name_profile_map[program_name][dso_name].address_count_map[
-        event.dso_and_offset.offset()]++;
-    total_samples++;
-    for (size_t i = 1; i < event.branch_stack.size(); i++) {
-      if (dso_name == event.branch_stack[i - 1].to.dso_name()) {
-        uint64 start = event.branch_stack[i].to.offset();
-        uint64 end = event.branch_stack[i - 1].from.offset();
-        uint64 to = event.branch_stack[i - 1].to.offset();
-        // The interval between two taken branches should not be too large.
-        if (end < start || end - start > (1 << 20)) {
-          LOG(WARNING) << "Bogus LBR data: " << start << "->" << end;
-          continue;
+  // Return the index in parser.attrs() of the event of a sample, or 0 if
+  // there is only one event.
+  size_t GetEventIndex(const quipper::ParsedEvent &event) {
+    const auto &attrs = parser_.attrs();
+    if (attrs.size() <= 1) {
+      return 0;
+    }
+    // Attrs of piped data are read along with the events.
+    if (indexed_attrs_ != attrs.size()) {
+      id_to_index_.clear();
+      for (size_t i = 0; i < attrs.size(); ++i) {
+        for (u64 id : attrs[i].ids) {
+          id_to_index_[id] = i;
+        }
+      }
+      indexed_attrs_ = attrs.size();
+    }
+    struct perf_sample sample_info;
+    PerfSampleCustodian custodian(sample_info);
+    if (!parser_.ReadPerfSampleInfo(*event.raw_event, &sample_info)) {
+      return 0;
+    }
+    auto it = id_to_index_.find(sample_info.id);
+    return it != id_to_index_.end() ? it->second : 0;
+  }
+
+ private:
+  const quipper::PerfParser &parser_;
+  size_t indexed_attrs_;
+  map<u64, size_t> id_to_index_;
+};
+
+// A frame of a call stack: the name of its load module, interned in a
+// StackTable, and the offset of its address in the module.
+typedef pair<const string *, uint64> StackFrame;
+
+// The program of a sample with a call chain, and the frames of its stack
+// from the leaf. Names are interned, so they compare by pointer.
+struct StackKey {
+  const string *program;
+  vector<StackFrame> frames;
+
+  bool operator==(const StackKey &k) const {
+    return program == k.program && frames == k.frames;
+  }
+};
+
+struct StackKeyHash {
+  size_t operator()(const StackKey &k) const {
+    size_t hash = std::hash<const string *>()(k.program);
+    for (const auto &frame : k.frames) {
+      hash = hash * 31 + std::hash<const string *>()(frame.first);
+      hash = hash * 31 + std::hash<uint64>()(frame.second);
+    }
+    return hash;
+  }
+};
+
+struct StackCounts {
+  StackCounts() : count(0) {}
+
+  uint64 count;
+  // Per-event counts of the stack, if more than one event is sampled.
+  vector<uint64> event_counts;
+};
+
+// Samples with call chains, counted once per distinct stack instead of
+// once per sample, so memory grows with the number of stacks rather than
+// with the length of the collection. The table keeps at most 'max_stacks'
+// stacks: when it is full, a sweep evicts the stacks hit by at most
+// eviction_threshold_ samples, and their samples are then counted by their
+// leaf address only. The threshold doubles whenever a sweep frees less
+// than a quarter of the table, so sweeps stay rare as hot stacks pile up.
+class StackTable {
+ public:
+  typedef std::unordered_map<StackKey, StackCounts, StackKeyHash> StackMap;
+
+  explicit StackTable(size_t max_stacks)
+      : max_stacks_(max_stacks), eviction_threshold_(1),
+        unstacked_samples_(0) {}
+
+  const string *Intern(const string &s) {
+    return &*strings_.insert(s).first;
+  }
+
+  // Count a sample of stack 'key' and event 'event_index' out of
+  // 'event_count'. Stacks evicted to make room are moved to 'evicted'.
+  // Return false if there is no room for the stack, then the sample
+  // should be counted by its leaf address.
+  bool AddSample(const StackKey &key, size_t event_index, size_t event_count,
+                 vector<pair<StackKey, StackCounts>> *evicted) {
+    auto it = stacks_.find(key);
+    if (it == stacks_.end()) {
+      if (max_stacks_ == 0) {
+        unstacked_samples_++;
+        return false;
+      }
+      if (stacks_.size() >= max_stacks_) {
+        Sweep(evicted);
+        if (stacks_.size() >= max_stacks_) {
+          unstacked_samples_++;
+          return false;
         }
-        name_profile_map[program_name][dso_name].range_count_map[
-            RangeTarget(start, end, to)]++;
       }
+      it = stacks_.insert(std::make_pair(key, StackCounts())).first;
     }
+    StackCounts &counts = it->second;
+    counts.count++;
+    if (event_count > 1) {
+      if (counts.event_counts.size() < event_count) {
+        counts.event_counts.resize(event_count);
+      }
+      counts.event_counts[event_index]++;
+    }
+    return true;
+  }
+
+  const StackMap &stacks() const {
+    return stacks_;
   }
 
+  // Number of samples with call chains counted by their leaf address only.
+  uint64 unstacked_samples() const {
+    return unstacked_samples_;
+  }
+
+ private:
+  void Sweep(vector<pair<StackKey, StackCounts>> *evicted) {
+    size_t old_size = stacks_.size();
+    for (auto it = stacks_.begin(); it != stacks_.end();) {
+      if (it->second.count <= eviction_threshold_) {
+        unstacked_samples_ += it->second.count;
+        evicted->push_back(std::make_pair(it->first, std::move(it->second)));
+        it = stacks_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (old_size - stacks_.size() < old_size / 4) {
+      eviction_threshold_ *= 2;
+    }
+  }
+
+  const size_t max_stacks_;
+  uint64 eviction_threshold_;
+  uint64 unstacked_samples_;
+  std::set<string> strings_;
+  StackMap stacks_;
+};
+
+// Samples of one perf.data, aggregated as they are parsed.
+struct SampleAggregator {
+  SampleAggregator(const quipper::PerfParser &parser, size_t max_stack_count)
+      : event_indexer(parser), stack_table(max_stack_count),
+        total_samples(0) {}
+
+  EventIndexer event_indexer;
+  ProgramProfileMap name_profile_map;
+  StackTable stack_table;
+  // Interned load module names of the DSOs seen, as most frames are in a
+  // few of them.
+  map<const quipper::DSOInfo *, const string *> module_names;
+  uint64 total_samples;
+};
+
+static const string *GetModuleName(
+    const quipper::ParsedEvent::DSOAndOffset &dso_and_offset,
+    SampleAggregator *aggregator) {
+  auto it = aggregator->module_names.find(dso_and_offset.dso_info_);
+  if (it != aggregator->module_names.end()) {
+    return it->second;
+  }
+  string name = dso_and_offset.dso_name();
+  if (name == "[kernel.kallsyms]_text") {
+    name = "[kernel.kallsyms]";
+  }
+  const string *interned = aggregator->stack_table.Intern(name);
+  aggregator->module_names[dso_and_offset.dso_info_] = interned;
+  return interned;
+}
+
+// Count 'count' samples of an address by its leaf, 'event_counts' of them
+// being of each event if more than one event is sampled.
+static void AddLeafCounts(BinaryProfile *profile, uint64 offset, uint64 count,
+                          const vector<uint64> &event_counts) {
+  profile->address_count_map[offset] += count;
+  if (!event_counts.empty()) {
+    vector<uint64> &counts = profile->address_event_count_map[offset];
+    if (counts.size() < event_counts.size()) {
+      counts.resize(event_counts.size());
+    }
+    for (size_t i = 0; i < event_counts.size(); ++i) {
+      counts[i] += event_counts[i];
+    }
+  }
+}
+
+static void AddSampleToProfile(const quipper::ParsedEvent &event,
+                               SampleAggregator *aggregator) {
+  const string &dso_name = *GetModuleName(event.dso_and_offset, aggregator);
+  string program_name;
+  if (event.dso_and_offset.dso_name() == "[kernel.kallsyms]_text") {
+    program_name = "kernel";
+  } else if (event.command() == "") {
+    program_name = "unknown_program";
+  } else {
+    program_name = event.command();
+  }
+  aggregator->total_samples++;
+  size_t event_count = aggregator->event_indexer.EventCount();
+  size_t event_index = aggregator->event_indexer.GetEventIndex(event);
+  BinaryProfile &profile =
+      aggregator->name_profile_map[program_name][dso_name];
+  bool stacked = false;
+  if (!event.callchain.empty()) {
+    StackKey key;
+    key.program = aggregator->stack_table.Intern(program_name);
+    key.frames.reserve(event.callchain.size() + 1);
+    key.frames.push_back(StackFrame(&dso_name, event.dso_and_offset.offset()));
+    for (const auto &frame : event.callchain) {
+      key.frames.push_back(
+          StackFrame(GetModuleName(frame, aggregator), frame.offset()));
+    }
+    vector<pair<StackKey, StackCounts>> evicted;
+    stacked = aggregator->stack_table.AddSample(key, event_index, event_count,
+                                                &evicted);
+    for (const auto &stack : evicted) {
+      const StackFrame &leaf = stack.first.frames[0];
+      AddLeafCounts(
+          &aggregator->name_profile_map[*stack.first.program][*leaf.first],
+          leaf.second, stack.second.count, stack.second.event_counts);
+    }
+  }
+  if (!stacked) {
+    vector<uint64> event_counts;
+    if (event_count > 1) {
+      event_counts.resize(event_index + 1);
+      event_counts[event_index] = 1;
+    }
+    AddLeafCounts(&profile, event.dso_and_offset.offset(), 1, event_counts);
+  }
+  for (size_t i = 1; i < event.branch_stack.size(); i++) {
+    if (dso_name == event.branch_stack[i - 1].to.dso_name()) {
+      uint64 start = event.branch_stack[i].to.offset();
+      uint64 end = event.branch_stack[i - 1].from.offset();
+      uint64 to = event.branch_stack[i - 1].to.offset();
+      // The interval between two taken branches should not be too large.
+      if (end < start || end - start > (1 << 20)) {
+        LOG(WARNING) << "Bogus LBR data: " << start << "->" << end;
+        continue;
+      }
+      profile.range_count_map[RangeTarget(start, end, to)]++;
+    }
+  }
+}
+
+// Parse perf.data contents in memory, aggregating each sample as soon as
+// it is parsed instead of keeping parsed events of the whole file.
+static bool ParsePerfDataAndAggregate(const char *data, size_t size,
+                                      quipper::PerfParser *parser,
+                                      SampleAggregator *aggregator) {
+  if (!parser->ReadFromPointer(data, size)) {
+    return false;
+  }
+  return parser->ParseRawEventsWithCallback(
+      [&](const quipper::ParsedEvent &event) {
+        AddSampleToProfile(event, aggregator);
+      });
+}
+
+// Read the perf.data file through a read-only mapping instead of a copy in
+// memory. Pages of the mapping are backed by the file, so the kernel can
+// drop them under memory pressure.
+static bool ReadPerfDataAndAggregate(const string &perf_file,
+                                     quipper::PerfParser *parser,
+                                     SampleAggregator *aggregator) {
+  int fd = open(perf_file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << "failed to open " << perf_file << ": " << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    LOG(ERROR) << "failed to stat " << perf_file << ": " << strerror(errno);
+    close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    LOG(ERROR) << perf_file << " is empty";
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "failed to mmap " << perf_file << ": " << strerror(errno);
+    return false;
+  }
+  bool result = ParsePerfDataAndAggregate(static_cast<const char *>(data),
+                                          size, parser, aggregator);
+  munmap(data, size);
+  return result;
+}
+
+// Parse piped perf data from a file descriptor, aggregating samples as
+// they are read.
+static bool ParsePipedPerfDataAndAggregate(int fd,
+                                           quipper::PerfParser *parser,
+                                           SampleAggregator *aggregator) {
+  return parser->ParsePipedDataWithCallback(
+      fd, [&](const quipper::ParsedEvent &event) {
+        AddSampleToProfile(event, aggregator);
+      });
+}
+
+// Order stacks by their frames, for a stable output.
+static bool StackLess(const StackTable::StackMap::value_type *a,
+                      const StackTable::StackMap::value_type *b) {
+  return std::lexicographical_compare(
+      a->first.frames.begin(), a->first.frames.end(),
+      b->first.frames.begin(), b->first.frames.end(),
+      [](const StackFrame &x, const StackFrame &y) {
+        if (*x.first != *y.first) {
+          return *x.first < *y.first;
+        }
+        return x.second < y.second;
+      });
+}
+
+// Set the per-event counts of an address sample from 'event_counts', which
+// may be null or short if some events have no samples, and add them to
+// 'event_total_samples'.
+static void SetEventCounts(const vector<uint64> *event_counts,
+                           wireless_android_play_playlog::AddressSample *sample,
+                           vector<uint64> *event_total_samples) {
+  for (size_t i = 0; i < event_total_samples->size(); ++i) {
+    uint64 count = 0;
+    if (event_counts != nullptr && i < event_counts->size()) {
+      count = (*event_counts)[i];
+    }
+    sample->add_event_counts(count);
+    (*event_total_samples)[i] += count;
+  }
+}
+
+static wireless_android_play_playlog::AndroidPerfProfile
+AggregatedSamplesToAndroidPerfProfile(const quipper::PerfParser &parser,
+                                      const SampleAggregator &aggregator) {
+  wireless_android_play_playlog::AndroidPerfProfile ret;
+  const ProgramProfileMap &name_profile_map = aggregator.name_profile_map;
+
   map<string, int> name_id_map;
   for (const auto &program_profile : name_profile_map) {
     for (const auto &module_profile : program_profile.second) {
       name_id_map[module_profile.first] = 0;
     }
   }
+  // Stacks by program and leaf module. Frames of the stacks can be in
+  // modules with no leaf samples.
+  map<pair<string, string>, vector<const StackTable::StackMap::value_type *>>
+      module_stacks;
+  for (const auto &stack : aggregator.stack_table.stacks()) {
+    const StackKey &key = stack.first;
+    module_stacks[std::make_pair(*key.program, *key.frames[0].first)]
+        .push_back(&stack);
+    for (const auto &frame : key.frames) {
+      name_id_map[*frame.first] = 0;
+    }
+  }
+  for (auto &stacks : module_stacks) {
+    std::sort(stacks.second.begin(), stacks.second.end(), StackLess);
+  }
   int current_index = 0;
   for (auto iter = name_id_map.begin(); iter != name_id_map.end(); ++iter) {
     iter->second = current_index++;
@@ -89,7 +440,13 @@ RawPerfDataToAndroidPerfProfile(const string &perf_file) {
 
   map<string, string> name_buildid_map;
   parser.GetFilenamesToBuildIDs(&name_buildid_map);
-  ret.set_total_samples(total_samples);
+  ret.set_total_samples(aggregator.total_samples);
+  if (parser.stats().num_lost_samples != 0) {
+    ret.set_lost_samples(parser.stats().num_lost_samples);
+  }
+  if (aggregator.stack_table.unstacked_samples() != 0) {
+    ret.set_unstacked_samples(aggregator.stack_table.unstacked_samples());
+  }
   for (const auto &name_id : name_id_map) {
     auto load_module = ret.add_load_modules();
     load_module->set_name(name_id.first);
@@ -103,6 +460,10 @@ RawPerfDataToAndroidPerfProfile(const string &perf_file) {
       }
     }
   }
+  // Names of the events are added by the caller, which knows what it
+  // asked perf to sample.
+  size_t event_count = parser.attrs().size();
+  vector<uint64> event_total_samples(event_count > 1 ? event_count : 0);
   for (const auto &program_profile : name_profile_map) {
     auto program = ret.add_programs();
     program->set_name(program_profile.first);
@@ -114,6 +475,30 @@ RawPerfDataToAndroidPerfProfile(const string &perf_file) {
         auto address_samples = module->add_address_samples();
         address_samples->add_address(addr_count.first);
         address_samples->set_count(addr_count.second);
+        if (!event_total_samples.empty()) {
+          auto it = module_profile.second.address_event_count_map.find(
+              addr_count.first);
+          SetEventCounts(
+              it != module_profile.second.address_event_count_map.end()
+                  ? &it->second : nullptr,
+              address_samples, &event_total_samples);
+        }
+      }
+      auto ms = module_stacks.find(
+          std::make_pair(program_profile.first, module_profile.first));
+      if (ms != module_stacks.end()) {
+        for (const auto *stack : ms->second) {
+          auto address_samples = module->add_address_samples();
+          for (const auto &frame : stack->first.frames) {
+            address_samples->add_address(frame.second);
+            address_samples->add_load_module_id(name_id_map[*frame.first]);
+          }
+          address_samples->set_count(stack->second.count);
+          if (!event_total_samples.empty()) {
+            SetEventCounts(&stack->second.event_counts, address_samples,
+                           &event_total_samples);
+          }
+        }
       }
       for (const auto &range_count : module_profile.second.range_count_map) {
         auto range_samples = module->add_range_samples();
@@ -124,7 +509,42 @@ RawPerfDataToAndroidPerfProfile(const string &perf_file) {
       }
     }
   }
+  for (uint64 total : event_total_samples) {
+    ret.add_event_total_samples(total);
+  }
   return ret;
 }
 
+wireless_android_play_playlog::AndroidPerfProfile
+RawPerfDataToAndroidPerfProfile(const string &perf_file,
+                                size_t max_stack_count) {
+  quipper::PerfParser parser;
+  SampleAggregator aggregator(parser, max_stack_count);
+  if (!ReadPerfDataAndAggregate(perf_file, &parser, &aggregator)) {
+    return wireless_android_play_playlog::AndroidPerfProfile();
+  }
+  return AggregatedSamplesToAndroidPerfProfile(parser, aggregator);
+}
+
+wireless_android_play_playlog::AndroidPerfProfile
+RawPerfDataToAndroidPerfProfile(const char *perf_data, size_t size,
+                                size_t max_stack_count) {
+  quipper::PerfParser parser;
+  SampleAggregator aggregator(parser, max_stack_count);
+  if (!ParsePerfDataAndAggregate(perf_data, size, &parser, &aggregator)) {
+    return wireless_android_play_playlog::AndroidPerfProfile();
+  }
+  return AggregatedSamplesToAndroidPerfProfile(parser, aggregator);
+}
+
+wireless_android_play_playlog::AndroidPerfProfile
+PipedPerfDataToAndroidPerfProfile(int fd, size_t max_stack_count) {
+  quipper::PerfParser parser;
+  SampleAggregator aggregator(parser, max_stack_count);
+  if (!ParsePipedPerfDataAndAggregate(fd, &parser, &aggregator)) {
+    return wireless_android_play_playlog::AndroidPerfProfile();
+  }
+  return AggregatedSamplesToAndroidPerfProfile(parser, aggregator);
+}
+
 }  // namespace wireless_android_logging_awp
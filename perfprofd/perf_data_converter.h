@@ -7,8 +7,22 @@
 
 namespace wireless_android_logging_awp {
 
+// Samples with call chains are counted per distinct stack, keeping at
+// most 'max_stack_count' stacks. Samples of stacks that don't fit, or all
+// samples if 'max_stack_count' is 0, are counted by their leaf address.
 wireless_android_play_playlog::AndroidPerfProfile
-RawPerfDataToAndroidPerfProfile(const std::string &perf_file);
+RawPerfDataToAndroidPerfProfile(const std::string &perf_file,
+                                size_t max_stack_count = 0);
+
+// Same as above, for perf.data contents already in memory.
+wireless_android_play_playlog::AndroidPerfProfile
+RawPerfDataToAndroidPerfProfile(const char *perf_data, size_t size,
+                                size_t max_stack_count = 0);
+
+// Same as above, for piped perf data ('perf record -o -') read from 'fd'
+// until the end of the stream. Samples are converted as they are read.
+wireless_android_play_playlog::AndroidPerfProfile
+PipedPerfDataToAndroidPerfProfile(int fd, size_t max_stack_count = 0);
 
 }  // namespace wireless_android_logging_awp
 
@@ -32,17 +32,23 @@
 #include <sstream>
 #include <map>
 #include <set>
+#include <vector>
 #include <cctype>
 
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <cutils/properties.h>
 
 #include "perfprofdcore.h"
 #include "perfprofdutils.h"
 #include "perf_data_converter.h"
+#include "profile_merger.h"
+#include "symbol_cache.h"
 #include "cpuconfig.h"
 #include "configreader.h"
+#include "inprocess_recorder.h"
+#include "overhead_governor.h"
 
 //
 // Perf profiling daemon -- collects system-wide profiles using
@@ -101,6 +107,29 @@ static int is_debug_build = -1;
 //
 static unsigned short random_seed[3];
 
+//
+// Recorder used when the "inprocess_collection" option is set, along
+// with the buffer receiving its perf.data contents. Both live for the
+// lifetime of the daemon, so that perf event files, ring buffers and
+// buffer memory are reused from one collection to the next.
+//
+static InProcessRecorder *inprocess_recorder = nullptr;
+static std::vector<char> inprocess_perf_data;
+
+//
+// Measures the cost of each collection, and scales the sampling
+// period and duration of the next ones to stay within the budget set
+// by 'max_overhead_permille'.
+//
+static OverheadGovernor overhead_governor;
+
+//
+// Symbol cache used to symbolize profiles on the device, if a
+// 'symbol_cache_dir' is configured. Kept for the lifetime of the
+// daemon, since the same libraries show up in every profile.
+//
+static SymbolCache *symbol_cache = nullptr;
+
 //
 // SIGHUP handler. Sending SIGHUP to the daemon can be used to break it
 // out of a sleep() call so as to trigger a new collection (debugging)
@@ -162,6 +191,8 @@ const char *profile_result_to_string(PROFILE_RESULT result)
   switch(result) {
     case OK_PROFILE_COLLECTION:
       return "profile collection succeeded";
+    case OK_PROFILE_MERGED:
+      return "profile merged into pending profile";
     case ERR_FORK_FAILED:
       return "fork() system call failed";
     case ERR_PERF_RECORD_FAILED:
@@ -207,9 +238,11 @@ static CKPROFILE_RESULT check_profiling_enabled(ConfigReader &config)
     return DONT_PROFILE_MISSING_SEMAPHORE;
   }
 
-  // Check for existence of simpleperf/perf executable
+  // Check for existence of simpleperf/perf executable (not needed if
+  // we record in-process)
   std::string pp = config.getStringValue("perf_path");
-  if (access(pp.c_str(), R_OK|X_OK) == -1) {
+  if (!config.getUnsignedValue("inprocess_collection") &&
+      access(pp.c_str(), R_OK|X_OK) == -1) {
     W_ALOGW("unable to access/execute %s", pp.c_str());
     return DONT_PROFILE_MISSING_PERF_EXECUTABLE;
   }
@@ -410,6 +443,24 @@ unsigned collect_cpu_utilization()
   return busy_delta * 100 / total_delta;
 }
 
+//
+// Return the events to sample, from the "event_types" config entry.
+//
+static std::vector<std::string> get_event_types(const ConfigReader &config)
+{
+  std::vector<std::string> event_types;
+  for (auto &name : android::base::Split(config.getStringValue("event_types"), ",")) {
+    name = android::base::Trim(name);
+    if (!name.empty()) {
+      event_types.push_back(name);
+    }
+  }
+  if (event_types.empty()) {
+    event_types.push_back("cpu-cycles");
+  }
+  return event_types;
+}
+
 static void annotate_encoded_perf_profile(wireless_android_play_playlog::AndroidPerfProfile *profile,
                                           const ConfigReader &config,
                                           unsigned cpu_utilization)
@@ -460,23 +511,34 @@ static void annotate_encoded_perf_profile(wireless_android_play_playlog::Android
   } else {
     W_ALOGE("Failed to read /sys/power/wake_unlock (%s)", strerror(errno));
   }
+
+  //
+  // Name the events of the per-event sample counts, in the order they
+  // were passed to perf.
+  //
+  std::vector<std::string> event_types = get_event_types(config);
+  if (event_types.size() > 1 &&
+      profile->event_total_samples_size() == static_cast<int>(event_types.size())) {
+    for (const auto &name : event_types) {
+      profile->add_event_names(name);
+    }
+  }
 }
 
 inline char* string_as_array(std::string* str) {
   return str->empty() ? NULL : &*str->begin();
 }
 
-PROFILE_RESULT encode_to_proto(const std::string &data_file_path,
-                               const char *encoded_file_path,
-                               const ConfigReader &config,
-                               unsigned cpu_utilization)
+//
+// Annotate a profile converted from perf.data, serialize it and write
+// it to the file specified by "encoded_file_path".
+//
+static PROFILE_RESULT write_encoded_profile(
+    wireless_android_play_playlog::AndroidPerfProfile &encodedProfile,
+    const char *encoded_file_path,
+    const ConfigReader &config,
+    unsigned cpu_utilization)
 {
-  //
-  // Open and read perf.data file
-  //
-  const wireless_android_play_playlog::AndroidPerfProfile &encodedProfile =
-      wireless_android_logging_awp::RawPerfDataToAndroidPerfProfile(data_file_path);
-
   //
   // Issue error if no samples
   //
@@ -484,12 +546,54 @@ PROFILE_RESULT encode_to_proto(const std::string &data_file_path,
     return ERR_PERF_ENCODE_FAILED;
   }
 
+  overhead_governor.noteSamples(encodedProfile.total_samples(),
+                                encodedProfile.lost_samples());
+
   // All of the info in 'encodedProfile' is derived from the perf.data file;
   // here we tack display status, cpu utilization, system load, etc.
-  wireless_android_play_playlog::AndroidPerfProfile &prof =
-      const_cast<wireless_android_play_playlog::AndroidPerfProfile&>
-      (encodedProfile);
-  annotate_encoded_perf_profile(&prof, config, cpu_utilization);
+  annotate_encoded_perf_profile(&encodedProfile, config, cpu_utilization);
+
+  //
+  // If several collections go into each profile, add the samples of
+  // the pending one (written by the previous collections with this
+  // sequence number) and switch to the delta encoded address form.
+  //
+  PROFILE_RESULT result = OK_PROFILE_COLLECTION;
+  unsigned merge_count = config.getUnsignedValue("merge_profiles");
+  if (merge_count > 1) {
+    std::string pending;
+    wireless_android_play_playlog::AndroidPerfProfile pendingProfile;
+    if (android::base::ReadFileToString(encoded_file_path, &pending) &&
+        pendingProfile.ParseFromString(pending)) {
+      wireless_android_logging_awp::MergeAndroidPerfProfile(encodedProfile,
+                                                            &pendingProfile);
+      encodedProfile.Swap(&pendingProfile);
+    } else {
+      wireless_android_logging_awp::CompactAndroidPerfProfile(&encodedProfile);
+    }
+    unsigned merged = (encodedProfile.has_merged_profiles() ?
+                       encodedProfile.merged_profiles() : 1);
+    if (merged < merge_count) {
+      result = OK_PROFILE_MERGED;
+    }
+  }
+
+  //
+  // Attach function ids, after merging so that they refer to the
+  // function names of the merged load modules.
+  //
+  std::string symbol_cache_dir = config.getStringValue("symbol_cache_dir");
+  if (!symbol_cache_dir.empty()) {
+    uint64_t max_size =
+        config.getUnsignedValue("symbol_cache_max_size") * UINT64_C(1024);
+    if (symbol_cache == nullptr ||
+        symbol_cache->cacheDir() != symbol_cache_dir ||
+        symbol_cache->maxSize() != max_size) {
+      delete symbol_cache;
+      symbol_cache = new SymbolCache(symbol_cache_dir, max_size);
+    }
+    symbol_cache->symbolize(&encodedProfile);
+  }
 
   //
   // Serialize protobuf to array
@@ -502,37 +606,96 @@ PROFILE_RESULT encode_to_proto(const std::string &data_file_path,
   encodedProfile.SerializeWithCachedSizesToArray(dtarget);
 
   //
-  // Open file and write encoded data to it
+  // Open file and write encoded data to it. Write to a temporary file
+  // first and rename it, so that a pending profile is never seen half
+  // written, nor lost if the write fails.
   //
-  FILE *fp = fopen(encoded_file_path, "w");
+  std::string tmp_path(encoded_file_path);
+  tmp_path += ".tmp";
+  FILE *fp = fopen(tmp_path.c_str(), "w");
   if (!fp) {
     return ERR_OPEN_ENCODED_FILE_FAILED;
   }
   size_t fsiz = size;
   if (fwrite(dtarget, fsiz, 1, fp) != 1) {
     fclose(fp);
+    unlink(tmp_path.c_str());
+    return ERR_WRITE_ENCODED_FILE_FAILED;
+  }
+  if (fclose(fp) != 0 || rename(tmp_path.c_str(), encoded_file_path) != 0) {
+    unlink(tmp_path.c_str());
     return ERR_WRITE_ENCODED_FILE_FAILED;
   }
-  fclose(fp);
   chmod(encoded_file_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 
-  return OK_PROFILE_COLLECTION;
+  return result;
+}
+
+PROFILE_RESULT encode_to_proto(const std::string &data_file_path,
+                               const char *encoded_file_path,
+                               const ConfigReader &config,
+                               unsigned cpu_utilization)
+{
+  //
+  // Open and read perf.data file
+  //
+  wireless_android_play_playlog::AndroidPerfProfile encodedProfile =
+      wireless_android_logging_awp::RawPerfDataToAndroidPerfProfile(
+          data_file_path, config.getUnsignedValue("max_stack_count"));
+
+  return write_encoded_profile(encodedProfile, encoded_file_path,
+                               config, cpu_utilization);
+}
+
+//
+// Same as encode_to_proto, for perf.data contents recorded in-process.
+//
+static PROFILE_RESULT encode_buffer_to_proto(const std::vector<char> &perf_data,
+                                             const char *encoded_file_path,
+                                             const ConfigReader &config,
+                                             unsigned cpu_utilization)
+{
+  wireless_android_play_playlog::AndroidPerfProfile encodedProfile =
+      wireless_android_logging_awp::RawPerfDataToAndroidPerfProfile(
+          perf_data.data(), perf_data.size(),
+          config.getUnsignedValue("max_stack_count"));
+
+  return write_encoded_profile(encodedProfile, encoded_file_path,
+                               config, cpu_utilization);
 }
 
 //
 // Invoke "perf record". Return value is OK_PROFILE_COLLECTION for
 // success, or some other error code if something went wrong.
 //
+// If 'piped_profile' is non-null, perf writes its output to a pipe
+// instead of 'data_file_path', and the samples are converted into
+// 'piped_profile' while perf is still recording, keeping at most
+// 'max_stack_count' call stacks.
+//
 static PROFILE_RESULT invoke_perf(const std::string &perf_path,
+                                  const std::vector<std::string> &event_types,
                                   unsigned sampling_period,
                                   const char *stack_profile_opt,
                                   unsigned duration,
                                   const std::string &data_file_path,
-                                  const std::string &perf_stderr_path)
+                                  const std::string &perf_stderr_path,
+                                  unsigned max_stack_count,
+                                  wireless_android_play_playlog::AndroidPerfProfile *piped_profile)
 {
+  int pipe_fds[2] = { -1, -1 };
+  if (piped_profile != nullptr && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+    W_ALOGE("pipe2 failed: %s", strerror(errno));
+    return ERR_PERF_RECORD_FAILED;
+  }
+
   pid_t pid = fork();
 
   if (pid == -1) {
+    if (piped_profile != nullptr) {
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+    }
     return ERR_FORK_FAILED;
   }
 
@@ -547,17 +710,26 @@ static PROFILE_RESULT invoke_perf(const std::string &perf_path,
     } else {
       W_ALOGW("unable to open %s for writing", perf_stderr_path.c_str());
     }
+    if (piped_profile != nullptr) {
+      dup2(pipe_fds[1], STDOUT_FILENO);
+    }
 
     // marshall arguments
-    constexpr unsigned max_args = 12;
+    constexpr unsigned max_args = 14;
     const char *argv[max_args];
     unsigned slot = 0;
     argv[slot++] = perf_path.c_str();
     argv[slot++] = "record";
 
-    // -o perf.data
+    // -o perf.data, or -o - to write to stdout
     argv[slot++] = "-o";
-    argv[slot++] = data_file_path.c_str();
+    argv[slot++] = (piped_profile != nullptr ? "-" : data_file_path.c_str());
+
+    // -e event, or --group event1,event2,... to sample several events
+    // together
+    argv[slot++] = (event_types.size() > 1 ? "--group" : "-e");
+    std::string e_str = android::base::Join(event_types, ',');
+    argv[slot++] = e_str.c_str();
 
     // -c N
     argv[slot++] = "-c";
@@ -595,6 +767,19 @@ static PROFILE_RESULT invoke_perf(const std::string &perf_path,
 
   } else {
     // parent
+    if (piped_profile != nullptr) {
+      close(pipe_fds[1]);
+      *piped_profile =
+          wireless_android_logging_awp::PipedPerfDataToAndroidPerfProfile(
+              pipe_fds[0], max_stack_count);
+      // Read whatever the converter left, so perf doesn't block on a
+      // full pipe if the conversion stopped early.
+      char buf[4096];
+      while (TEMP_FAILURE_RETRY(read(pipe_fds[0], buf, sizeof(buf))) > 0) {
+      }
+      close(pipe_fds[0]);
+    }
+
     int st = 0;
     pid_t reaped = TEMP_FAILURE_RETRY(waitpid(pid, &st, 0));
 
@@ -697,20 +882,17 @@ static bool post_process(const ConfigReader &config, int current_seq)
 }
 
 //
-// Collect a perf profile. Steps for this operation are:
+// Record a perf profile with the given sampling period and duration.
+// Steps for this operation are:
 // - kick off 'perf record'
 // - read perf.data, convert to protocol buf
 //
-static PROFILE_RESULT collect_profile(const ConfigReader &config, int seq)
+static PROFILE_RESULT record_profile(const ConfigReader &config,
+                                     int seq,
+                                     unsigned period,
+                                     unsigned duration,
+                                     unsigned cpu_utilization)
 {
-  //
-  // Collect cpu utilization if enabled
-  //
-  unsigned cpu_utilization = 0;
-  if (config.getUnsignedValue("collect_cpu_utilization")) {
-    cpu_utilization = collect_cpu_utilization();
-  }
-
   //
   // Form perf.data file name, perf error output file name
   //
@@ -744,39 +926,97 @@ static PROFILE_RESULT collect_profile(const ConfigReader &config, int seq)
   // destructor (invoked when this routine terminates) will then
   // restart the service again when needed.
   //
-  unsigned duration = config.getUnsignedValue("sample_duration");
   unsigned hardwire = config.getUnsignedValue("hardwire_cpus");
   unsigned max_duration = config.getUnsignedValue("hardwire_cpus_max_duration");
   bool take_action = (hardwire && duration <= max_duration);
   HardwireCpuHelper helper(take_action);
 
+  std::string path = android::base::StringPrintf(
+      "%s.encoded.%d", data_file_path.c_str(), seq);
+
+  //
+  // Record in-process if requested: no fork/exec, and the samples are
+  // converted from memory instead of from a perf.data file.
+  //
+  if (config.getUnsignedValue("inprocess_collection")) {
+    if (inprocess_recorder == nullptr) {
+      inprocess_recorder = new InProcessRecorder;
+    }
+    bool stack_profile = (config.getUnsignedValue("stack_profile") != 0);
+    if (!inprocess_recorder->record(get_event_types(config), period,
+                                    stack_profile, duration,
+                                    &inprocess_perf_data)) {
+      return ERR_PERF_RECORD_FAILED;
+    }
+    return encode_buffer_to_proto(inprocess_perf_data, path.c_str(),
+                                  config, cpu_utilization);
+  }
+
   //
   // Invoke perf
   //
   const char *stack_profile_opt =
       (config.getUnsignedValue("stack_profile") != 0 ? "-g" : nullptr);
   std::string perf_path = config.getStringValue("perf_path");
-  unsigned period = config.getUnsignedValue("sampling_period");
 
+  //
+  // With piped output, perf.data is converted while perf is recording
+  // and never written to disk.
+  //
+  bool piped = (config.getUnsignedValue("pipe_perf_output") != 0);
+  wireless_android_play_playlog::AndroidPerfProfile piped_profile;
   PROFILE_RESULT ret = invoke_perf(perf_path.c_str(),
+                                  get_event_types(config),
                                   period,
                                   stack_profile_opt,
                                   duration,
                                   data_file_path,
-                                  perf_stderr_path);
+                                  perf_stderr_path,
+                                  config.getUnsignedValue("max_stack_count"),
+                                  piped ? &piped_profile : nullptr);
   if (ret != OK_PROFILE_COLLECTION) {
     return ret;
   }
+  if (piped) {
+    return write_encoded_profile(piped_profile, path.c_str(),
+                                 config, cpu_utilization);
+  }
 
   //
   // Read the resulting perf.data file, encode into protocol buffer, then write
   // the result to the file perf.data.encoded
   //
-  std::string path = android::base::StringPrintf(
-      "%s.encoded.%d", data_file_path.c_str(), seq);
   return encode_to_proto(data_file_path, path.c_str(), config, cpu_utilization);
 }
 
+//
+// Collect a perf profile, with the sampling period and duration set
+// by the overhead governor.
+//
+static PROFILE_RESULT collect_profile(const ConfigReader &config, int seq)
+{
+  //
+  // Collect cpu utilization if enabled
+  //
+  unsigned cpu_utilization = 0;
+  if (config.getUnsignedValue("collect_cpu_utilization")) {
+    cpu_utilization = collect_cpu_utilization();
+  }
+
+  unsigned budget = config.getUnsignedValue("max_overhead_permille");
+  unsigned period = config.getUnsignedValue("sampling_period");
+  unsigned duration = config.getUnsignedValue("sample_duration");
+  overhead_governor.adjust(budget, &period, &duration);
+
+  overhead_governor.beginCollection();
+  PROFILE_RESULT result =
+      record_profile(config, seq, period, duration, cpu_utilization);
+  if (result == OK_PROFILE_COLLECTION || result == OK_PROFILE_MERGED) {
+    overhead_governor.endCollection(budget);
+  }
+  return result;
+}
+
 //
 // Assuming that we want to collect a profile every N seconds,
 // randomly partition N into two sub-intervals.
@@ -901,7 +1141,10 @@ int perfprofd_main(int argc, char** argv)
       // Kick off the profiling run...
       W_ALOGI("initiating profile collection");
       PROFILE_RESULT result = collect_profile(config, seq);
-      if (result != OK_PROFILE_COLLECTION) {
+      if (result == OK_PROFILE_MERGED) {
+        W_ALOGI("profile collection complete (%s)",
+                profile_result_to_string(result));
+      } else if (result != OK_PROFILE_COLLECTION) {
         W_ALOGI("profile collection failed (%s)",
                 profile_result_to_string(result));
       } else {
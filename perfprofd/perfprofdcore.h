@@ -45,6 +45,10 @@ typedef enum {
   // Success
   OK_PROFILE_COLLECTION,
 
+  // Success, the profile was merged into the pending one, which needs
+  // more collections before it is handed to the uploader
+  OK_PROFILE_MERGED,
+
   // Fork system call failed (lo mem?)
   ERR_FORK_FAILED,
 
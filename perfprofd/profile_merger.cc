@@ -0,0 +1,297 @@
+
+#include "profile_merger.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::vector;
+using google::protobuf::int32;
+using google::protobuf::int64;
+using google::protobuf::uint64;
+using wireless_android_play_playlog::AndroidPerfProfile;
+using wireless_android_play_playlog::LoadModuleSamples;
+
+namespace wireless_android_logging_awp {
+
+// A load module is identified by its name and build id, as the same name can
+// refer to different binaries across collections (e.g. after an update).
+typedef std::pair<string, string> ModuleKey;
+
+struct StackKey {
+  vector<uint64> addresses;
+  vector<ModuleKey> modules;
+
+  bool operator<(const StackKey &r) const {
+    return std::tie(addresses, modules) < std::tie(r.addresses, r.modules);
+  }
+};
+
+typedef std::tuple<uint64, uint64, uint64> RangeKey;
+
+struct ModuleSamples {
+  map<uint64, int64> address_counts;
+  map<StackKey, int64> stack_counts;
+  map<RangeKey, int64> range_counts;
+  // Per-event counts, indexed like the event names of the merged profile.
+  map<uint64, vector<int64>> address_event_counts;
+  map<StackKey, vector<int64>> stack_event_counts;
+};
+
+typedef map<ModuleKey, ModuleSamples> ModuleSamplesMap;
+typedef map<string, ModuleSamplesMap> ProgramSamplesMap;
+
+static ModuleKey GetModuleKey(const AndroidPerfProfile &profile, int32 id) {
+  if (id < 0 || id >= profile.load_modules_size()) {
+    return ModuleKey();
+  }
+  const auto &module = profile.load_modules(id);
+  return ModuleKey(module.name(), module.build_id());
+}
+
+// Add the per-event counts of a sample, listed in the order of the event
+// names of its profile, to 'into'. event_map maps those events to the
+// events of the merged profile.
+template <typename Iterator>
+static void AddEventCounts(Iterator counts, size_t count_size,
+                           const vector<size_t> &event_map,
+                           vector<int64> *into) {
+  for (size_t i = 0; i < count_size && i < event_map.size(); ++i, ++counts) {
+    if (into->size() <= event_map[i]) {
+      into->resize(event_map[i] + 1);
+    }
+    (*into)[event_map[i]] += *counts;
+  }
+}
+
+static void AddProfile(const AndroidPerfProfile &profile,
+                       const vector<size_t> &event_map,
+                       ProgramSamplesMap *programs) {
+  size_t event_count = profile.event_names_size();
+  for (const auto &program : profile.programs()) {
+    ModuleSamplesMap &modules = (*programs)[program.name()];
+    for (const auto &module : program.modules()) {
+      ModuleSamples &samples =
+          modules[GetModuleKey(profile, module.load_module_id())];
+      uint64 address = 0;
+      int count_size = module.address_counts_size();
+      for (int i = 0; i < module.address_deltas_size() && i < count_size;
+           ++i) {
+        address += module.address_deltas(i);
+        samples.address_counts[address] += module.address_counts(i);
+        size_t event_begin = i * event_count;
+        if (event_count > 1 &&
+            event_begin + event_count <=
+                static_cast<size_t>(module.address_event_counts_size())) {
+          AddEventCounts(module.address_event_counts().begin() + event_begin,
+                         event_count, event_map,
+                         &samples.address_event_counts[address]);
+        }
+      }
+      for (const auto &sample : module.address_samples()) {
+        if (sample.address_size() == 1 && sample.load_module_id_size() == 0) {
+          samples.address_counts[sample.address(0)] += sample.count();
+          if (sample.event_counts_size() > 0) {
+            AddEventCounts(sample.event_counts().begin(),
+                           sample.event_counts_size(), event_map,
+                           &samples.address_event_counts[sample.address(0)]);
+          }
+          continue;
+        }
+        StackKey key;
+        key.addresses.assign(sample.address().begin(), sample.address().end());
+        for (int32 id : sample.load_module_id()) {
+          key.modules.push_back(GetModuleKey(profile, id));
+        }
+        samples.stack_counts[key] += sample.count();
+        if (sample.event_counts_size() > 0) {
+          AddEventCounts(sample.event_counts().begin(),
+                         sample.event_counts_size(), event_map,
+                         &samples.stack_event_counts[key]);
+        }
+      }
+      for (const auto &range : module.range_samples()) {
+        RangeKey key(range.start(), range.end(), range.to());
+        samples.range_counts[key] += range.count();
+      }
+    }
+  }
+}
+
+// Append the per-event counts of an address or a stack to 'into', as
+// event_count entries.
+template <typename Key, typename RepeatedField>
+static void AppendEventCounts(const map<Key, vector<int64>> &event_counts,
+                              const Key &key, size_t event_count,
+                              RepeatedField *into) {
+  auto it = event_counts.find(key);
+  for (size_t i = 0; i < event_count; ++i) {
+    bool found = (it != event_counts.end() && i < it->second.size());
+    into->Add(found ? it->second[i] : 0);
+  }
+}
+
+static void BuildProfile(const ProgramSamplesMap &programs,
+                         size_t event_count,
+                         AndroidPerfProfile *profile) {
+  profile->clear_programs();
+  profile->clear_load_modules();
+
+  // Assign load module ids in key order, as the converter does by name.
+  map<ModuleKey, int32> module_ids;
+  for (const auto &program : programs) {
+    for (const auto &module : program.second) {
+      module_ids[module.first] = 0;
+      for (const auto &stack : module.second.stack_counts) {
+        for (const auto &key : stack.first.modules) {
+          module_ids[key] = 0;
+        }
+      }
+    }
+  }
+  int32 next_id = 0;
+  for (auto &module_id : module_ids) {
+    module_id.second = next_id++;
+    auto load_module = profile->add_load_modules();
+    load_module->set_name(module_id.first.first);
+    if (!module_id.first.second.empty()) {
+      load_module->set_build_id(module_id.first.second);
+    }
+  }
+
+  for (const auto &program : programs) {
+    auto program_samples = profile->add_programs();
+    program_samples->set_name(program.first);
+    for (const auto &module : program.second) {
+      LoadModuleSamples *module_samples = program_samples->add_modules();
+      module_samples->set_load_module_id(module_ids[module.first]);
+      uint64 prev_address = 0;
+      for (const auto &address_count : module.second.address_counts) {
+        module_samples->add_address_deltas(address_count.first - prev_address);
+        module_samples->add_address_counts(address_count.second);
+        prev_address = address_count.first;
+        if (event_count > 1) {
+          AppendEventCounts(module.second.address_event_counts,
+                            address_count.first, event_count,
+                            module_samples->mutable_address_event_counts());
+        }
+      }
+      for (const auto &stack_count : module.second.stack_counts) {
+        auto sample = module_samples->add_address_samples();
+        for (uint64 address : stack_count.first.addresses) {
+          sample->add_address(address);
+        }
+        for (const auto &key : stack_count.first.modules) {
+          sample->add_load_module_id(module_ids[key]);
+        }
+        sample->set_count(stack_count.second);
+        if (event_count > 1) {
+          AppendEventCounts(module.second.stack_event_counts,
+                            stack_count.first, event_count,
+                            sample->mutable_event_counts());
+        }
+      }
+      for (const auto &range_count : module.second.range_counts) {
+        auto range = module_samples->add_range_samples();
+        range->set_start(std::get<0>(range_count.first));
+        range->set_end(std::get<1>(range_count.first));
+        range->set_to(std::get<2>(range_count.first));
+        range->set_count(range_count.second);
+      }
+    }
+  }
+}
+
+// Return the map from the events of a profile to themselves.
+static vector<size_t> IdentityEventMap(const AndroidPerfProfile &profile) {
+  vector<size_t> event_map;
+  for (int i = 0; i < profile.event_names_size(); ++i) {
+    event_map.push_back(i);
+  }
+  return event_map;
+}
+
+void MergeAndroidPerfProfile(const AndroidPerfProfile &from,
+                             AndroidPerfProfile *into) {
+  // The events of the merged profile are those of 'into', followed by
+  // those only sampled in 'from'.
+  vector<string> event_names(into->event_names().begin(),
+                             into->event_names().end());
+  vector<size_t> from_event_map;
+  for (const auto &name : from.event_names()) {
+    auto it = std::find(event_names.begin(), event_names.end(), name);
+    from_event_map.push_back(it - event_names.begin());
+    if (it == event_names.end()) {
+      event_names.push_back(name);
+    }
+  }
+  vector<int64> event_total_samples;
+  AddEventCounts(into->event_total_samples().begin(),
+                 into->event_total_samples_size(), IdentityEventMap(*into),
+                 &event_total_samples);
+  AddEventCounts(from.event_total_samples().begin(),
+                 from.event_total_samples_size(), from_event_map,
+                 &event_total_samples);
+
+  ProgramSamplesMap programs;
+  AddProfile(*into, IdentityEventMap(*into), &programs);
+  AddProfile(from, from_event_map, &programs);
+  BuildProfile(programs, event_names.size(), into);
+
+  into->clear_event_names();
+  into->clear_event_total_samples();
+  if (event_names.size() > 1) {
+    event_total_samples.resize(event_names.size());
+    for (size_t i = 0; i < event_names.size(); ++i) {
+      into->add_event_names(event_names[i]);
+      into->add_event_total_samples(event_total_samples[i]);
+    }
+  }
+
+  into->set_total_samples(into->total_samples() + from.total_samples());
+  if (from.has_lost_samples()) {
+    into->set_lost_samples(into->lost_samples() + from.lost_samples());
+  }
+  if (from.has_unstacked_samples()) {
+    into->set_unstacked_samples(into->unstacked_samples() +
+                                from.unstacked_samples());
+  }
+  int32 merged = (into->has_merged_profiles() ? into->merged_profiles() : 1) +
+      (from.has_merged_profiles() ? from.merged_profiles() : 1);
+  into->set_merged_profiles(merged);
+
+  if (from.has_event()) {
+    into->set_event(from.event());
+  }
+  if (from.has_display_on()) {
+    into->set_display_on(from.display_on());
+  }
+  if (from.has_sys_load_average()) {
+    into->set_sys_load_average(from.sys_load_average());
+  }
+  if (from.has_camera_active()) {
+    into->set_camera_active(from.camera_active());
+  }
+  if (from.has_booting()) {
+    into->set_booting(from.booting());
+  }
+  if (from.has_on_charger()) {
+    into->set_on_charger(from.on_charger());
+  }
+  if (from.has_cpu_utilization()) {
+    into->set_cpu_utilization(from.cpu_utilization());
+  }
+}
+
+void CompactAndroidPerfProfile(AndroidPerfProfile *profile) {
+  ProgramSamplesMap programs;
+  AddProfile(*profile, IdentityEventMap(*profile), &programs);
+  BuildProfile(programs, profile->event_names_size(), profile);
+}
+
+}  // namespace wireless_android_logging_awp
@@ -0,0 +1,28 @@
+#ifndef WIRELESS_ANDROID_LOGGING_AWP_PROFILE_MERGER_H_
+#define WIRELESS_ANDROID_LOGGING_AWP_PROFILE_MERGER_H_
+
+#include "perf_profile.pb.h"
+
+namespace wireless_android_logging_awp {
+
+// Merges the samples of 'from' into 'into', so that successive collections
+// can be accumulated in a single profile. Programs are matched by name, load
+// modules by name and build id, and samples by address stack or by range.
+// Per-event counts are matched by event name; the merged profile has the
+// events of 'into' followed by those only sampled in 'from'.
+// Annotations (display_on, cpu_utilization, ...) are taken from 'from', as
+// the latest collection. Single address samples of 'into' end up in the
+// compact form, see CompactAndroidPerfProfile().
+void MergeAndroidPerfProfile(
+    const wireless_android_play_playlog::AndroidPerfProfile &from,
+    wireless_android_play_playlog::AndroidPerfProfile *into);
+
+// Moves address samples with a single address and no load_module_id into the
+// delta encoded address_deltas/address_counts arrays of their module. This
+// takes a few bytes per address instead of a nested message.
+void CompactAndroidPerfProfile(
+    wireless_android_play_playlog::AndroidPerfProfile *profile);
+
+}  // namespace wireless_android_logging_awp
+
+#endif  // WIRELESS_ANDROID_LOGGING_AWP_PROFILE_MERGER_H_
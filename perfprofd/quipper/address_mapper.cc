@@ -10,6 +10,59 @@ namespace quipper {
 
 AddressMapper::AddressMapper(const AddressMapper& source) {
   mappings_ = source.mappings_;
+  RebuildIndexes();
+}
+
+AddressMapper& AddressMapper::operator=(const AddressMapper& source) {
+  if (this != &source) {
+    mappings_ = source.mappings_;
+    RebuildIndexes();
+  }
+  return *this;
+}
+
+void AddressMapper::RebuildIndexes() {
+  real_addr_index_.clear();
+  free_space_index_.clear();
+  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
+    real_addr_index_[iter->real_addr] = iter;
+    if (iter->unmapped_space_after != 0)
+      free_space_index_[iter->mapped_addr] = iter;
+  }
+}
+
+void AddressMapper::InsertRange(MappingList::iterator pos,
+                                const MappedRange& range) {
+  MappingList::iterator iter = mappings_.insert(pos, range);
+  real_addr_index_[range.real_addr] = iter;
+  if (range.unmapped_space_after != 0)
+    free_space_index_[range.mapped_addr] = iter;
+}
+
+void AddressMapper::EraseRange(MappingList::iterator iter) {
+  real_addr_index_.erase(iter->real_addr);
+  free_space_index_.erase(iter->mapped_addr);
+  mappings_.erase(iter);
+}
+
+void AddressMapper::SetUnmappedSpaceAfter(MappingList::iterator iter,
+                                          uint64_t space) {
+  iter->unmapped_space_after = space;
+  if (space != 0)
+    free_space_index_[iter->mapped_addr] = iter;
+  else
+    free_space_index_.erase(iter->mapped_addr);
+}
+
+const AddressMapper::MappedRange* AddressMapper::FindRange(
+    uint64_t real_addr) const {
+  RealAddrIndex::const_iterator it = real_addr_index_.upper_bound(real_addr);
+  if (it == real_addr_index_.begin())
+    return NULL;
+  --it;
+  if (!it->second->ContainsAddress(real_addr))
+    return NULL;
+  return &*it->second;
 }
 
 bool AddressMapper::Map(const uint64_t real_addr,
@@ -45,11 +98,17 @@ bool AddressMapper::MapWithID(const uint64_t real_addr,
 
   // Check for collision with an existing mapping.  This must be an overlap that
   // does not result in one range being completely covered by another
-  MappingList::iterator iter;
   MappingList mappings_to_delete;
   bool old_range_found = false;
   MappedRange old_range;
-  for (iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
+  // Only the mapping before |real_addr| in real space and the mappings
+  // starting inside the new range can intersect it.
+  RealAddrIndex::iterator index_iter = real_addr_index_.upper_bound(real_addr);
+  if (index_iter != real_addr_index_.begin())
+    --index_iter;
+  for (; index_iter != real_addr_index_.end() &&
+         index_iter->first <= real_addr + size - 1; ++index_iter) {
+    MappingList::iterator iter = index_iter->second;
     if (!iter->Intersects(range))
       continue;
     // Quit if existing ranges that collide aren't supposed to be removed.
@@ -106,7 +165,7 @@ bool AddressMapper::MapWithID(const uint64_t real_addr,
   if (mappings_.empty()) {
     range.mapped_addr = 0;
     range.unmapped_space_after = kuint64max - range.size;
-    mappings_.push_back(range);
+    InsertRange(mappings_.end(), range);
     return true;
   }
 
@@ -114,21 +173,22 @@ bool AddressMapper::MapWithID(const uint64_t real_addr,
   if (mappings_.begin()->mapped_addr >= range.size) {
     range.mapped_addr = 0;
     range.unmapped_space_after = mappings_.begin()->mapped_addr - range.size;
-    mappings_.push_front(range);
+    InsertRange(mappings_.begin(), range);
     return true;
   }
 
   // Otherwise, search through the existing mappings for a free block after one
   // of them.
-  for (iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
+  for (auto& free_space : free_space_index_) {
+    MappingList::iterator iter = free_space.second;
     if (iter->unmapped_space_after < range.size)
       continue;
 
     range.mapped_addr = iter->mapped_addr + iter->size;
     range.unmapped_space_after = iter->unmapped_space_after - range.size;
-    iter->unmapped_space_after = 0;
+    SetUnmappedSpaceAfter(iter, 0);
 
-    mappings_.insert(++iter, range);
+    InsertRange(++iter, range);
     return true;
   }
 
@@ -153,14 +213,11 @@ void AddressMapper::DumpToLog() const {
 bool AddressMapper::GetMappedAddress(const uint64_t real_addr,
                                      uint64_t* mapped_addr) const {
   CHECK(mapped_addr);
-  MappingList::const_iterator iter;
-  for (iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    if (!iter->ContainsAddress(real_addr))
-      continue;
-    *mapped_addr = iter->mapped_addr + real_addr - iter->real_addr;
-    return true;
-  }
-  return false;
+  const MappedRange* range = FindRange(real_addr);
+  if (range == NULL)
+    return false;
+  *mapped_addr = range->mapped_addr + real_addr - range->real_addr;
+  return true;
 }
 
 bool AddressMapper::GetMappedIDAndOffset(const uint64_t real_addr,
@@ -168,15 +225,12 @@ bool AddressMapper::GetMappedIDAndOffset(const uint64_t real_addr,
                                          uint64_t* offset) const {
   CHECK(id);
   CHECK(offset);
-  MappingList::const_iterator iter;
-  for (iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    if (!iter->ContainsAddress(real_addr))
-      continue;
-    *id = iter->id;
-    *offset = real_addr - iter->real_addr + iter->offset_base;
-    return true;
-  }
-  return false;
+  const MappedRange* range = FindRange(real_addr);
+  if (range == NULL)
+    return false;
+  *id = range->id;
+  *offset = real_addr - range->real_addr + range->offset_base;
+  return true;
 }
 
 uint64_t AddressMapper::GetMaxMappedLength() const {
@@ -193,25 +247,22 @@ uint64_t AddressMapper::GetMaxMappedLength() const {
 }
 
 bool AddressMapper::Unmap(const MappedRange& range) {
-  MappingList::iterator iter;
-  // TODO(sque): this is highly inefficient since Unmap() is called from a
-  // function that has already iterated to the right place within |mappings_|.
-  // For a first revision, I am sacrificing efficiency for of clarity, due to
-  // the trickiness of removing elements using iterators.
-  for (iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    if (range.real_addr == iter->real_addr && range.size == iter->size) {
-      // Add the freed up space to the free space counter of the previous
-      // mapped region, if it exists.
-      if (iter != mappings_.begin()) {
-        --iter;
-        iter->unmapped_space_after += range.size + range.unmapped_space_after;
-        ++iter;
-      }
-      mappings_.erase(iter);
-      return true;
-    }
+  RealAddrIndex::iterator index_iter = real_addr_index_.find(range.real_addr);
+  if (index_iter == real_addr_index_.end() ||
+      index_iter->second->size != range.size)
+    return false;
+  MappingList::iterator iter = index_iter->second;
+  // Add the freed up space to the free space counter of the previous mapped
+  // region, if it exists. Use the space after the mapping in |mappings_|,
+  // which may have grown since |range| was copied.
+  if (iter != mappings_.begin()) {
+    MappingList::iterator prev = iter;
+    --prev;
+    SetUnmappedSpaceAfter(prev, prev->unmapped_space_after + iter->size +
+                                    iter->unmapped_space_after);
   }
-  return false;
+  EraseRange(iter);
+  return true;
 }
 
 }  // namespace quipper
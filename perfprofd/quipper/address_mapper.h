@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include <list>
+#include <map>
 
 namespace quipper {
 
@@ -19,6 +20,7 @@ class AddressMapper {
   // is useful for copying mappings from parent to child process upon fork(). It
   // is also useful to copy kernel mappings to any process that is created.
   AddressMapper(const AddressMapper& source);
+  AddressMapper& operator=(const AddressMapper& source);
 
   // Maps a new address range to quipper space.
   // |remove_existing_mappings| indicates whether to remove old mappings that
@@ -110,16 +112,39 @@ class AddressMapper {
     }
   };
 
-  // TODO(sque): implement with set or map to improve searching.
   typedef std::list<MappedRange> MappingList;
+  // Mappings don't overlap in real space, so they can be indexed by the start
+  // of their real address ranges.
+  typedef std::map<uint64_t, MappingList::iterator> RealAddrIndex;
 
   // Removes an existing address mapping.
   // Returns true if successful, false if no mapped address range was found.
   bool Unmap(const MappedRange& range);
 
-  // Container for all the existing mappings.
+  // Inserts |range| before |pos| in |mappings_|, and updates the indexes.
+  void InsertRange(MappingList::iterator pos, const MappedRange& range);
+  // Removes the mapping at |iter|, and updates the indexes.
+  void EraseRange(MappingList::iterator iter);
+  // Updates |unmapped_space_after| of the mapping at |iter|.
+  void SetUnmappedSpaceAfter(MappingList::iterator iter, uint64_t space);
+  // Rebuilds the indexes from |mappings_|.
+  void RebuildIndexes();
+
+  // Returns the mapping containing |real_addr|, or NULL if there is none.
+  const MappedRange* FindRange(uint64_t real_addr) const;
+
+  // Container for all the existing mappings, sorted by quipper space address.
   MappingList mappings_;
 
+  // Index of |mappings_| in real space, so lookups and collision checks
+  // don't scan all mappings.
+  RealAddrIndex real_addr_index_;
+
+  // Mappings followed by unmapped quipper space, sorted by quipper space
+  // address. New ranges are placed in the first free block that fits, and
+  // there are usually few such blocks.
+  std::map<uint64_t, MappingList::iterator> free_space_index_;
+
   bool CheckMappings() const;
 };
 
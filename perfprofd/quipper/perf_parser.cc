@@ -18,17 +18,71 @@ namespace quipper {
 
 namespace {
 
-struct EventAndTime {
-  ParsedEvent* event;
+// Below this average length of time-ordered runs, sorting is cheaper than
+// merging the runs.
+const size_t kMinAverageRunLengthToMerge = 8;
+
+struct RunHead {
   uint64_t time;
+  size_t run;
+  size_t index;
+};
+
+// Orders run heads for a min-heap. Ties are broken by run, so events with
+// the same time keep their order in the file.
+struct RunHeadGreater {
+  bool operator()(const RunHead& h1, const RunHead& h2) const {
+    if (h1.time != h2.time)
+      return h1.time > h2.time;
+    return h1.run > h2.run;
+  }
 };
 
-// Returns true if |e1| has an earlier timestamp than |e2|.  The args are const
-// pointers instead of references because of the way this function is used when
-// calling std::stable_sort.
-bool CompareParsedEventTimes(const std::unique_ptr<EventAndTime>& e1,
-                             const std::unique_ptr<EventAndTime>& e2) {
-  return (e1->time < e2->time);
+// Returns the indices of |times| in the order std::stable_sort would put
+// them. perf writes events to perf.data in chunks from per-cpu buffers, so
+// the times are mostly long increasing runs. The runs are merged in
+// O(n log k) for k runs, and the events are only sorted when the runs are
+// too short for merging to pay off.
+std::vector<size_t> SortIndicesByTime(const std::vector<uint64_t>& times) {
+  std::vector<size_t> run_starts;
+  for (size_t i = 0; i < times.size(); ++i) {
+    if (i == 0 || times[i] < times[i - 1])
+      run_starts.push_back(i);
+  }
+  std::vector<size_t> indices;
+  indices.reserve(times.size());
+  if (run_starts.size() <= 1 ||
+      run_starts.size() * kMinAverageRunLengthToMerge > times.size()) {
+    for (size_t i = 0; i < times.size(); ++i)
+      indices.push_back(i);
+    if (run_starts.size() > 1) {
+      std::stable_sort(indices.begin(), indices.end(),
+                       [&times](size_t i1, size_t i2) {
+                         return times[i1] < times[i2];
+                       });
+    }
+    return indices;
+  }
+  std::vector<RunHead> heap;
+  heap.reserve(run_starts.size());
+  for (size_t run = 0; run < run_starts.size(); ++run) {
+    heap.push_back(RunHead{times[run_starts[run]], run, run_starts[run]});
+  }
+  std::make_heap(heap.begin(), heap.end(), RunHeadGreater());
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), RunHeadGreater());
+    RunHead& head = heap.back();
+    indices.push_back(head.index);
+    size_t run_end = (head.run + 1 < run_starts.size())
+                         ? run_starts[head.run + 1] : times.size();
+    if (++head.index < run_end) {
+      head.time = times[head.index];
+      std::push_heap(heap.begin(), heap.end(), RunHeadGreater());
+    } else {
+      heap.pop_back();
+    }
+  }
+  return indices;
 }
 
 // Kernel MMAP entry pid appears as -1
@@ -99,6 +153,65 @@ bool PerfParser::ParseRawEvents() {
   return true;
 }
 
+bool PerfParser::ParseRawEventsWithCallback(
+    const std::function<void(const ParsedEvent&)>& callback) {
+  process_mappers_.clear();
+  parsed_events_.clear();
+  parsed_events_sorted_by_time_.clear();
+
+  // Sort indices of events instead of ParsedEvents, in the same order as
+  // MaybeSortParsedEvents().
+  std::vector<uint64_t> times(events_.size());
+  if (sample_type_ & PERF_SAMPLE_TIME) {
+    for (size_t i = 0; i < events_.size(); ++i) {
+      struct perf_sample sample_info;
+      PerfSampleCustodian custodian(sample_info);
+      CHECK(ReadPerfSampleInfo(*events_[i], &sample_info));
+      times[i] = sample_info.time;
+    }
+  }
+
+  StartProcessingEvents();
+  for (size_t index : SortIndicesByTime(times)) {
+    ParsedEvent parsed_event;
+    parsed_event.raw_event = events_[index].get();
+    // With no ParsedEvents kept, mmap events are identified by their index
+    // in |events_|.
+    if (!ProcessEvent(&parsed_event, index))
+      return false;
+    if (parsed_event.raw_event->header.type == PERF_RECORD_SAMPLE)
+      callback(parsed_event);
+  }
+  return FinishProcessingEvents();
+}
+
+bool PerfParser::ParsePipedDataWithCallback(
+    int fd, const std::function<void(const ParsedEvent&)>& callback) {
+  process_mappers_.clear();
+  parsed_events_.clear();
+  parsed_events_sorted_by_time_.clear();
+  events_.clear();
+
+  StartProcessingEvents();
+  auto handler = [&]() {
+    ParsedEvent parsed_event;
+    parsed_event.raw_event = events_.back().get();
+    // As in ParseRawEventsWithCallback(), mmap events are identified by their
+    // index in |events_|.
+    if (!ProcessEvent(&parsed_event, events_.size() - 1))
+      return false;
+    uint32_t type = parsed_event.raw_event->header.type;
+    if (type == PERF_RECORD_SAMPLE)
+      callback(parsed_event);
+    if (type != PERF_RECORD_MMAP && type != PERF_RECORD_MMAP2)
+      events_.pop_back();
+    return true;
+  };
+  if (!ReadPipedEvents(fd, handler))
+    return false;
+  return FinishProcessingEvents();
+}
+
 void PerfParser::MaybeSortParsedEvents() {
   if (!(sample_type_ & PERF_SAMPLE_TIME)) {
     parsed_events_sorted_by_time_.resize(parsed_events_.size());
@@ -107,33 +220,32 @@ void PerfParser::MaybeSortParsedEvents() {
     }
     return;
   }
-  std::vector<std::unique_ptr<EventAndTime>> events_and_times;
-  events_and_times.resize(parsed_events_.size());
+  std::vector<uint64_t> times(parsed_events_.size());
   for (size_t i = 0; i < parsed_events_.size(); ++i) {
-    std::unique_ptr<EventAndTime> event_and_time(new EventAndTime);
-
-    // Store the timestamp and event pointer in an array.
-    event_and_time->event = &parsed_events_[i];
-
     struct perf_sample sample_info;
     PerfSampleCustodian custodian(sample_info);
     CHECK(ReadPerfSampleInfo(*parsed_events_[i].raw_event, &sample_info));
-    event_and_time->time = sample_info.time;
-
-    events_and_times[i] = std::move(event_and_time);
+    times[i] = sample_info.time;
   }
-  // Sort the events based on timestamp, and then populate the sorted event
-  // vector in sorted order.
-  std::stable_sort(events_and_times.begin(), events_and_times.end(),
-                   CompareParsedEventTimes);
-
-  parsed_events_sorted_by_time_.resize(events_and_times.size());
-  for (unsigned int i = 0; i < events_and_times.size(); ++i) {
-    parsed_events_sorted_by_time_[i] = events_and_times[i]->event;
+  // Populate the sorted event vector in order of timestamps.
+  std::vector<size_t> indices = SortIndicesByTime(times);
+  parsed_events_sorted_by_time_.resize(indices.size());
+  for (size_t i = 0; i < indices.size(); ++i) {
+    parsed_events_sorted_by_time_[i] = &parsed_events_[indices[i]];
   }
 }
 
 bool PerfParser::ProcessEvents() {
+  StartProcessingEvents();
+  // NB: Not necessarily actually sorted by time.
+  for (unsigned int i = 0; i < parsed_events_sorted_by_time_.size(); ++i) {
+    if (!ProcessEvent(parsed_events_sorted_by_time_[i], i))
+      return false;
+  }
+  return FinishProcessingEvents();
+}
+
+void PerfParser::StartProcessingEvents() {
   memset(&stats_, 0, sizeof(stats_));
 
   stats_.did_remap = false;   // Explicitly clear the remap flag.
@@ -145,82 +257,86 @@ bool PerfParser::ProcessEvents() {
   commands_.insert(kSwapperCommandName);
   pidtid_to_comm_map_[std::make_pair(kSwapperPid, kSwapperPid)] =
       &(*commands_.find(kSwapperCommandName));
+}
 
-  // NB: Not necessarily actually sorted by time.
-  for (unsigned int i = 0; i < parsed_events_sorted_by_time_.size(); ++i) {
-    ParsedEvent& parsed_event = *parsed_events_sorted_by_time_[i];
-    event_t& event = *parsed_event.raw_event;
-    switch (event.header.type) {
-      case PERF_RECORD_SAMPLE:
-        // SAMPLE doesn't have any fields to log at a fixed,
-        // previously-endian-swapped location. This used to log ip.
-        VLOG(1) << "SAMPLE";
-        ++stats_.num_sample_events;
-
-        if (MapSampleEvent(&parsed_event)) {
-          ++stats_.num_sample_events_mapped;
-        }
-        break;
-      case PERF_RECORD_MMAP: {
-        VLOG(1) << "MMAP: " << event.mmap.filename;
-        ++stats_.num_mmap_events;
-        // Use the array index of the current mmap event as a unique identifier.
-        CHECK(MapMmapEvent(&event.mmap, i)) << "Unable to map MMAP event!";
-        // No samples in this MMAP region yet, hopefully.
-        parsed_event.num_samples_in_mmap_region = 0;
-        DSOInfo dso_info;
-        // TODO(sque): Add Build ID as well.
-        dso_info.name = event.mmap.filename;
-        dso_set_.insert(dso_info);
-        break;
-      }
-      case PERF_RECORD_MMAP2: {
-        VLOG(1) << "MMAP2: " << event.mmap2.filename;
-        ++stats_.num_mmap_events;
-        // Use the array index of the current mmap event as a unique identifier.
-        CHECK(MapMmapEvent(&event.mmap2, i)) << "Unable to map MMAP2 event!";
-        // No samples in this MMAP region yet, hopefully.
-        parsed_event.num_samples_in_mmap_region = 0;
-        DSOInfo dso_info;
-        // TODO(sque): Add Build ID as well.
-        dso_info.name = event.mmap2.filename;
-        dso_set_.insert(dso_info);
-        break;
+bool PerfParser::ProcessEvent(ParsedEvent* parsed_event, uint64_t id) {
+  event_t& event = *parsed_event->raw_event;
+  switch (event.header.type) {
+    case PERF_RECORD_SAMPLE:
+      // SAMPLE doesn't have any fields to log at a fixed,
+      // previously-endian-swapped location. This used to log ip.
+      VLOG(1) << "SAMPLE";
+      ++stats_.num_sample_events;
+
+      if (MapSampleEvent(parsed_event)) {
+        ++stats_.num_sample_events_mapped;
       }
-      case PERF_RECORD_FORK:
-        VLOG(1) << "FORK: " << event.fork.ppid << ":" << event.fork.ptid
-                << " -> " << event.fork.pid << ":" << event.fork.tid;
-        ++stats_.num_fork_events;
-        CHECK(MapForkEvent(event.fork)) << "Unable to map FORK event!";
-        break;
-      case PERF_RECORD_EXIT:
-        // EXIT events have the same structure as FORK events.
-        VLOG(1) << "EXIT: " << event.fork.ppid << ":" << event.fork.ptid;
-        ++stats_.num_exit_events;
-        break;
-      case PERF_RECORD_COMM:
-        VLOG(1) << "COMM: " << event.comm.pid << ":" << event.comm.tid << ": "
-                << event.comm.comm;
-        ++stats_.num_comm_events;
-        CHECK(MapCommEvent(event.comm));
-        commands_.insert(event.comm.comm);
-        pidtid_to_comm_map_[std::make_pair(event.comm.pid, event.comm.tid)] =
-            &(*commands_.find(event.comm.comm));
-        break;
-      case PERF_RECORD_LOST:
-      case PERF_RECORD_THROTTLE:
-      case PERF_RECORD_UNTHROTTLE:
-      case PERF_RECORD_READ:
-      case PERF_RECORD_MAX:
-        VLOG(1) << "Parsed event type: " << event.header.type
-                << ". Doing nothing.";
-        break;
-      default:
-        LOG(ERROR) << "Unknown event type: " << event.header.type;
-        return false;
+      break;
+    case PERF_RECORD_MMAP: {
+      VLOG(1) << "MMAP: " << event.mmap.filename;
+      ++stats_.num_mmap_events;
+      // |id| is the unique identifier of the mmap event.
+      CHECK(MapMmapEvent(&event.mmap, id)) << "Unable to map MMAP event!";
+      // No samples in this MMAP region yet, hopefully.
+      parsed_event->num_samples_in_mmap_region = 0;
+      DSOInfo dso_info;
+      // TODO(sque): Add Build ID as well.
+      dso_info.name = event.mmap.filename;
+      dso_set_.insert(dso_info);
+      break;
     }
+    case PERF_RECORD_MMAP2: {
+      VLOG(1) << "MMAP2: " << event.mmap2.filename;
+      ++stats_.num_mmap_events;
+      // |id| is the unique identifier of the mmap event.
+      CHECK(MapMmapEvent(&event.mmap2, id)) << "Unable to map MMAP2 event!";
+      // No samples in this MMAP region yet, hopefully.
+      parsed_event->num_samples_in_mmap_region = 0;
+      DSOInfo dso_info;
+      // TODO(sque): Add Build ID as well.
+      dso_info.name = event.mmap2.filename;
+      dso_set_.insert(dso_info);
+      break;
+    }
+    case PERF_RECORD_FORK:
+      VLOG(1) << "FORK: " << event.fork.ppid << ":" << event.fork.ptid
+              << " -> " << event.fork.pid << ":" << event.fork.tid;
+      ++stats_.num_fork_events;
+      CHECK(MapForkEvent(event.fork)) << "Unable to map FORK event!";
+      break;
+    case PERF_RECORD_EXIT:
+      // EXIT events have the same structure as FORK events.
+      VLOG(1) << "EXIT: " << event.fork.ppid << ":" << event.fork.ptid;
+      ++stats_.num_exit_events;
+      break;
+    case PERF_RECORD_COMM:
+      VLOG(1) << "COMM: " << event.comm.pid << ":" << event.comm.tid << ": "
+              << event.comm.comm;
+      ++stats_.num_comm_events;
+      CHECK(MapCommEvent(event.comm));
+      commands_.insert(event.comm.comm);
+      pidtid_to_comm_map_[std::make_pair(event.comm.pid, event.comm.tid)] =
+          &(*commands_.find(event.comm.comm));
+      break;
+    case PERF_RECORD_LOST:
+      VLOG(1) << "LOST: " << event.lost.lost;
+      stats_.num_lost_samples += event.lost.lost;
+      break;
+    case PERF_RECORD_THROTTLE:
+    case PERF_RECORD_UNTHROTTLE:
+    case PERF_RECORD_READ:
+    case PERF_RECORD_MAX:
+      VLOG(1) << "Parsed event type: " << event.header.type
+              << ". Doing nothing.";
+      break;
+    default:
+      LOG(ERROR) << "Unknown event type: " << event.header.type;
+      return false;
   }
+  return true;
+}
 
+bool PerfParser::FinishProcessingEvents() {
   // Print stats collected from parsing.
   DLOG(INFO) << "Parser processed: "
             << stats_.num_mmap_events << " MMAP/MMAP2 events, "
@@ -428,10 +544,19 @@ bool PerfParser::MapIPAndPidAndGetNameAndOffset(
     if (dso_and_offset) {
       uint64_t id = kuint64max;
       CHECK(mapper->GetMappedIDAndOffset(ip, &id, &dso_and_offset->offset_));
-      // Make sure the ID points to a valid event.
-      CHECK_LE(id, parsed_events_sorted_by_time_.size());
-      ParsedEvent* parsed_event = parsed_events_sorted_by_time_[id];
-      const event_t* raw_event = parsed_event->raw_event;
+      ParsedEvent* parsed_event = NULL;
+      const event_t* raw_event;
+      if (parsed_events_sorted_by_time_.empty()) {
+        // Events are parsed by ParseRawEventsWithCallback(), which uses
+        // indices of |events_| as IDs.
+        CHECK_LT(id, events_.size());
+        raw_event = events_[id].get();
+      } else {
+        // Make sure the ID points to a valid event.
+        CHECK_LE(id, parsed_events_sorted_by_time_.size());
+        parsed_event = parsed_events_sorted_by_time_[id];
+        raw_event = parsed_event->raw_event;
+      }
 
       DSOInfo dso_info;
       if (raw_event->header.type == PERF_RECORD_MMAP) {
@@ -448,7 +573,8 @@ bool PerfParser::MapIPAndPidAndGetNameAndOffset(
       CHECK(dso_iter != dso_set_.end());
       dso_and_offset->dso_info_ = &(*dso_iter);
 
-      ++parsed_event->num_samples_in_mmap_region;
+      if (parsed_event)
+        ++parsed_event->num_samples_in_mmap_region;
     }
     if (options_.do_remap)
       *new_ip = mapped_addr;
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 
+#include <functional>
 #include <map>
 #include <set>
 #include <string>
@@ -111,6 +112,10 @@ struct PerfEventStats {
   // indicated by |did_remap|.
   uint32_t num_sample_events_mapped;
 
+  // Number of samples the kernel dropped because the ring buffer was
+  // full, as reported by LOST events.
+  uint64_t num_lost_samples;
+
   // Whether address remapping was enabled during event parsing.
   bool did_remap;
 };
@@ -142,6 +147,22 @@ class PerfParser : public PerfReader {
   // Gets parsed event/sample info from raw event data.
   bool ParseRawEvents();
 
+  // Like ParseRawEvents(), but passes each parsed sample event to |callback|
+  // instead of keeping a ParsedEvent for every event. The ParsedEvent is only
+  // valid during the callback. This saves the memory of parsed_events() when
+  // samples are only aggregated. |discard_unused_events| is ignored, and
+  // parsed_events() is left empty.
+  bool ParseRawEventsWithCallback(
+      const std::function<void(const ParsedEvent&)>& callback);
+
+  // Like ParseRawEventsWithCallback(), but reads piped perf data from |fd|
+  // (see ReadFromPipe()) and parses each event as soon as it is read, so
+  // samples are aggregated while perf is still recording. Events are
+  // processed in the order they are written, not sorted by time. Only
+  // MMAP/MMAP2 events are kept in events(), since samples refer to them.
+  bool ParsePipedDataWithCallback(
+      int fd, const std::function<void(const ParsedEvent&)>& callback);
+
   const std::vector<ParsedEvent>& parsed_events() const {
     return parsed_events_;
   }
@@ -170,6 +191,12 @@ class PerfParser : public PerfReader {
 
   // Used for processing events.  e.g. remapping with synthetic addresses.
   bool ProcessEvents();
+  // ProcessEvents() is split into these steps, so events can also be processed
+  // one at a time by ParseRawEventsWithCallback(). |id| identifies an mmap
+  // event in sample events mapped to it later.
+  void StartProcessingEvents();
+  bool ProcessEvent(ParsedEvent* parsed_event, uint64_t id);
+  bool FinishProcessingEvents();
   template <typename MMapEventT>
   bool MapMmapEvent(MMapEventT* event, uint64_t id) {
     return MapMmapEvent(id,
@@ -5,8 +5,11 @@
 #include "perf_reader.h"
 
 #include <byteswap.h>
+#include <errno.h>
 #include <limits.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <bitset>
 #include <cstdio>
 #include <cstdlib>
@@ -619,6 +622,48 @@ size_t WritePerfSampleToData(const perf_event_type event_type,
   return (array - initial_array_ptr) * sizeof(uint64_t);
 }
 
+// Reads a stream from a file descriptor, such as the read end of a pipe,
+// through a fixed size buffer.
+class BufferedFdReader {
+ public:
+  explicit BufferedFdReader(int fd)
+      : fd_(fd), buffer_(kBufferSize), pos_(0), end_(0) {}
+
+  // Reads |size| bytes into |dest|, waiting for them to be written to the
+  // stream if needed. Returns the number of bytes read, which is less than
+  // |size| only at the end of the stream or on error.
+  size_t Read(void* dest, size_t size) {
+    char* out = static_cast<char*>(dest);
+    size_t done = 0;
+    while (done < size) {
+      if (pos_ == end_) {
+        ssize_t n = read(fd_, buffer_.data(), buffer_.size());
+        if (n == -1 && errno == EINTR)
+          continue;
+        if (n == -1)
+          LOG(ERROR) << "Error reading perf data: " << strerror(errno);
+        if (n <= 0)
+          break;
+        pos_ = 0;
+        end_ = n;
+      }
+      size_t n = std::min(size - done, end_ - pos_);
+      memcpy(out + done, buffer_.data() + pos_, n);
+      pos_ += n;
+      done += n;
+    }
+    return done;
+  }
+
+ private:
+  static const size_t kBufferSize = 64 * 1024;
+
+  int fd_;
+  std::vector<char> buffer_;
+  size_t pos_;
+  size_t end_;
+};
+
 }  // namespace
 
 PerfReader::~PerfReader() {
@@ -680,6 +725,119 @@ bool PerfReader::ReadFromPointer(const char* perf_data, size_t size) {
   return false;
 }
 
+bool PerfReader::ReadFromPipe(int fd) {
+  return ReadPipedEvents(fd, [] { return true; });
+}
+
+bool PerfReader::ReadPipedEvents(int fd,
+                                 const std::function<bool()>& event_handler) {
+  BufferedFdReader reader(fd);
+  perf_pipe_file_header pipe_header;
+  if (reader.Read(&pipe_header, sizeof(pipe_header)) != sizeof(pipe_header)) {
+    LOG(ERROR) << "Not enough data to read the perf data header.";
+    return false;
+  }
+  const ConstBufferWithSize header_data = {
+    reinterpret_cast<const char*>(&pipe_header), sizeof(pipe_header)
+  };
+  if (!ReadHeader(header_data))
+    return false;
+  if (piped_header_.size != sizeof(piped_header_)) {
+    LOG(ERROR) << "Perf data is not in piped format.";
+    return false;
+  }
+  DLOG(INFO) << "Perf data is in piped format.";
+
+  // Holds one event at a time: the size of an event fits in 16 bits.
+  std::vector<u64> event_buffer((1 << 16) / sizeof(u64));
+  char* event_data = reinterpret_cast<char*>(event_buffer.data());
+  while (true) {
+    perf_event_header header;
+    size_t n = reader.Read(&header, sizeof(header));
+    if (n == 0)
+      break;  // End of the stream, between two events.
+    if (n != sizeof(header)) {
+      LOG(ERROR) << "Not enough data to read a perf event header.";
+      return false;
+    }
+    u32 type = header.type;
+    u16 size = header.size;
+    if (is_cross_endian_) {
+      ByteSwap(&type);
+      ByteSwap(&size);
+    }
+    if (size < sizeof(header)) {
+      LOG(ERROR) << "Invalid perf event size " << size;
+      return false;
+    }
+    memcpy(event_data, &header, sizeof(header));
+    if (reader.Read(event_data + sizeof(header), size - sizeof(header)) !=
+        size - sizeof(header)) {
+      LOG(ERROR) << "Not enough data to read a perf event.";
+      return false;
+    }
+    const ConstBufferWithSize data = { event_data, size };
+
+    switch (type) {
+    case PERF_RECORD_HEADER_ATTR:
+      if (!ReadAttrEventBlock(data, sizeof(header), size - sizeof(header)))
+        return false;
+      break;
+    case PERF_RECORD_HEADER_EVENT_TYPE: {
+      size_t offset = sizeof(header);
+      if (!ReadEventType(data, &offset))
+        return false;
+      break;
+    }
+    case PERF_RECORD_HEADER_TRACING_DATA: {
+      // The tracing data follows the event, see ReadTracingMetadataEvent().
+      const tracing_data_event* event =
+          reinterpret_cast<const tracing_data_event*>(event_data);
+      u32 tracing_size = MaybeSwap(event->size, is_cross_endian_);
+      std::vector<char> tracing_event(size + tracing_size);
+      memcpy(tracing_event.data(), event_data, size);
+      if (reader.Read(tracing_event.data() + size, tracing_size) !=
+          tracing_size) {
+        LOG(ERROR) << "Not enough data to read tracing data.";
+        return false;
+      }
+      const ConstBufferWithSize tracing_data = {
+        tracing_event.data(), tracing_event.size()
+      };
+      if (!ReadTracingMetadataEvent(tracing_data, 0))
+        return false;
+      break;
+    }
+    case PERF_RECORD_HEADER_BUILD_ID:
+      if (!ReadBuildIDMetadata(data, HEADER_BUILD_ID, 0, size))
+        return false;
+      break;
+    case PERF_RECORD_FINISHED_ROUND:
+      break;
+    case PERF_RECORD_SAMPLE:
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2:
+    case PERF_RECORD_FORK:
+    case PERF_RECORD_EXIT:
+    case PERF_RECORD_COMM:
+    case PERF_RECORD_LOST:
+    case PERF_RECORD_THROTTLE:
+    case PERF_RECORD_UNTHROTTLE:
+      if (!ReadPerfEventBlock(*reinterpret_cast<const event_t*>(event_data)) ||
+          !event_handler()) {
+        return false;
+      }
+      break;
+    default:
+      VLOG(1) << "Skipping unsupported event type " << type;
+      break;
+    }
+  }
+
+  DLOG(INFO) << "Number of events stored: " << events_.size();
+  return true;
+}
+
 bool PerfReader::Localize(
     const std::map<string, string>& build_ids_to_filenames) {
   std::map<string, string> perfized_build_ids_to_filenames;
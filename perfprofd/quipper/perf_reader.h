@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 
+#include <functional>
 #include <map>
 #include <set>
 #include <string>
@@ -92,6 +93,11 @@ class PerfReader {
   bool ReadFromString(const string& str);
   bool ReadFromPointer(const char* perf_data, size_t size);
 
+  // Reads piped perf data, as written by 'perf record -o -', from |fd| until
+  // the end of the stream. Events are read as they are written to the
+  // stream, so this can run while perf is still recording.
+  bool ReadFromPipe(int fd);
+
   // TODO(rohinmshah): GetSize should not use RegenerateHeader (so that it can
   // be const).  Ideally, RegenerateHeader would be deleted and instead of
   // having out_header_ as an instance variable, it would be computed
@@ -205,8 +211,11 @@ class PerfReader {
   bool ReadNUMATopologyMetadata(const ConstBufferWithSize& data, u32 type,
                                 size_t offset, size_t size);
 
-  // Read perf data from piped perf output data.
-  bool ReadPipedData(const ConstBufferWithSize& data);
+  // Reads piped perf data from |fd|, buffering at most one event besides a
+  // fixed size read buffer. |event_handler| is called after each kernel
+  // event is appended to |events_|, and may remove it from there. Reading
+  // stops with an error if the handler returns false.
+  bool ReadPipedEvents(int fd, const std::function<bool()>& event_handler);
   bool ReadTracingMetadataEvent(const ConstBufferWithSize& data, size_t offset);
 
   // Like WriteToPointer, but does not check if the buffer is large enough.
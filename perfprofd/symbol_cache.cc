@@ -0,0 +1,199 @@
+/*
+**
+** Copyright 2016, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include "symbol_cache.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+#include <algorithm>
+#include <vector>
+
+#include "perf_profile.pb.h"
+#include "perfprofdutils.h"
+
+// simpleperf
+#include "utils.h"
+
+using wireless_android_play_playlog::AndroidPerfProfile;
+
+//
+// Maximum number of Dso objects kept in memory. When reached, they
+// are all dropped; symbols are then reloaded from the cache files.
+//
+static const size_t kMaxDsos = 512;
+
+// Function id of addresses not in any known function.
+static const int kUnknownFunction = -1;
+
+SymbolCache::SymbolCache(const std::string &cache_dir, uint64_t max_size)
+    : cache_dir_(cache_dir),
+      max_size_(max_size)
+{
+  Dso::SetSymbolCacheDir(cache_dir_);
+  // Keep names as in the ELF files, the server demangles them.
+  Dso::SetDemangle(false);
+}
+
+SymbolCache::~SymbolCache()
+{
+  // Dsos refer to context_, drop them first.
+  dsos_.clear();
+}
+
+Dso *SymbolCache::findDso(const DsoKey &key, bool *hit)
+{
+  auto it = dsos_.find(key);
+  if (it != dsos_.end()) {
+    *hit = true;
+    return it->second.get();
+  }
+  if (dsos_.size() >= kMaxDsos) {
+    dsos_.clear();
+  }
+  BuildId build_id(key.second);
+  context_.build_id_map[key.first] = build_id;
+  std::string cache_path = Dso::GetSymbolCachePath(build_id);
+  *hit = IsRegularFile(cache_path);
+  if (*hit) {
+    // Mark the file as recently used, for trimCache().
+    utime(cache_path.c_str(), nullptr);
+  }
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_ELF_FILE, key.first, &context_);
+  Dso *result = dso.get();
+  dsos_[key] = std::move(dso);
+  return result;
+}
+
+void SymbolCache::symbolize(AndroidPerfProfile *profile)
+{
+  //
+  // Look up the Dso of each load module that has a build id. Kernel
+  // symbols come from /proc/kallsyms and have no stable build id, so
+  // they are left to the server.
+  //
+  int hits = 0;
+  int misses = 0;
+  std::vector<Dso *> dsos(profile->load_modules_size(), nullptr);
+  std::vector<std::map<std::string, int>> function_ids(dsos.size());
+  for (int i = 0; i < profile->load_modules_size(); ++i) {
+    auto *load_module = profile->mutable_load_modules(i);
+    load_module->clear_function_names();
+    const std::string &name = load_module->name();
+    if (load_module->build_id().empty() || name.empty() || name[0] == '[') {
+      continue;
+    }
+    bool hit = false;
+    dsos[i] = findDso(DsoKey(name, load_module->build_id()), &hit);
+    if (hit) {
+      ++hits;
+    } else {
+      ++misses;
+    }
+  }
+
+  //
+  // Addresses are offsets in the load module files; executable
+  // segments usually start at file offset 0, so this is the address
+  // relative to the first executable segment.
+  //
+  auto lookup = [&](int module_id, uint64_t address) {
+    if (module_id < 0 || static_cast<size_t>(module_id) >= dsos.size() ||
+        dsos[module_id] == nullptr) {
+      return kUnknownFunction;
+    }
+    Dso *dso = dsos[module_id];
+    const Symbol *symbol = dso->FindSymbol(address + dso->MinVirtualAddress());
+    if (symbol == nullptr) {
+      return kUnknownFunction;
+    }
+    auto &ids = function_ids[module_id];
+    auto it = ids.find(symbol->Name());
+    if (it != ids.end()) {
+      return it->second;
+    }
+    int id = ids.size();
+    ids[symbol->Name()] = id;
+    profile->mutable_load_modules(module_id)->add_function_names(symbol->Name());
+    return id;
+  };
+
+  for (auto &program : *profile->mutable_programs()) {
+    for (auto &module : *program.mutable_modules()) {
+      int module_id = module.load_module_id();
+      module.clear_address_function_ids();
+      uint64_t address = 0;
+      for (uint64_t delta : module.address_deltas()) {
+        address += delta;
+        module.add_address_function_ids(lookup(module_id, address));
+      }
+      for (auto &sample : *module.mutable_address_samples()) {
+        sample.clear_function_id();
+        for (int k = 0; k < sample.address_size(); ++k) {
+          int frame_module_id = (k < sample.load_module_id_size() ?
+                                 sample.load_module_id(k) : module_id);
+          sample.add_function_id(lookup(frame_module_id, sample.address(k)));
+        }
+      }
+    }
+  }
+
+  profile->set_symbol_cache_hits(hits);
+  profile->set_symbol_cache_misses(misses);
+  profile->set_symbol_cache_size(trimCache());
+}
+
+uint64_t SymbolCache::trimCache()
+{
+  struct CacheFile {
+    std::string path;
+    time_t mtime;
+    uint64_t size;
+  };
+  std::vector<std::string> names;
+  GetEntriesInDir(cache_dir_, &names, nullptr);
+  std::vector<CacheFile> files;
+  uint64_t total_size = 0;
+  for (auto &name : names) {
+    std::string path = cache_dir_ + "/" + name;
+    struct stat statb;
+    if (stat(path.c_str(), &statb) == 0) {
+      files.push_back({path, statb.st_mtime, static_cast<uint64_t>(statb.st_size)});
+      total_size += statb.st_size;
+    }
+  }
+  if (total_size <= max_size_) {
+    return total_size;
+  }
+  // Remove the least recently used files first.
+  std::sort(files.begin(), files.end(),
+            [](const CacheFile &a, const CacheFile &b) {
+              return a.mtime < b.mtime;
+            });
+  for (auto &file : files) {
+    if (total_size <= max_size_) {
+      break;
+    }
+    if (unlink(file.path.c_str()) == 0) {
+      total_size -= file.size;
+    } else {
+      W_ALOGW("unable to remove symbol cache file %s", file.path.c_str());
+    }
+  }
+  return total_size;
+}
@@ -0,0 +1,67 @@
+/*
+**
+** Copyright 2016, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef SYSTEM_EXTRAS_PERFPROFD_SYMBOL_CACHE_H_
+#define SYSTEM_EXTRAS_PERFPROFD_SYMBOL_CACHE_H_
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "dso.h"
+
+namespace wireless_android_play_playlog {
+class AndroidPerfProfile;
+}
+
+//
+// Symbolizes profiles on the device, so that the server only has to
+// look up the functions that could not be found here. Symbols are
+// read with simpleperf's Dso loader, which keeps the symbols of each
+// build id in a file of 'cache_dir' once an ELF file has been parsed.
+// The same libraries show up in every profile, so most lookups are
+// served from the Dso objects kept in memory across profiles, or from
+// the cache files. The cache directory is kept below 'max_size' bytes
+// by removing the least recently used files.
+//
+class SymbolCache {
+ public:
+  SymbolCache(const std::string &cache_dir, uint64_t max_size);
+  ~SymbolCache();
+
+  const std::string &cacheDir() const { return cache_dir_; }
+  uint64_t maxSize() const { return max_size_; }
+
+  // Fill in the function names of the load modules with a build id, the
+  // function ids of their samples, and the cache statistics.
+  void symbolize(wireless_android_play_playlog::AndroidPerfProfile *profile);
+
+ private:
+  typedef std::pair<std::string, std::string> DsoKey;
+
+  Dso *findDso(const DsoKey &key, bool *hit);
+  uint64_t trimCache();
+
+  std::string cache_dir_;
+  uint64_t max_size_;
+  DsoContext context_;
+  std::map<DsoKey, std::unique_ptr<Dso>> dsos_;
+};
+
+#endif
@@ -34,14 +34,34 @@ include $(CLEAR_VARS)
 LOCAL_CLANG := true
 LOCAL_CPP_EXTENSION := .cc
 LOCAL_CXX_STL := libc++
-LOCAL_STATIC_LIBRARIES := libperfprofdcore libperfprofdmockutils libgtest libbase
-LOCAL_SHARED_LIBRARIES := libprotobuf-cpp-lite
-LOCAL_C_INCLUDES += system/extras/perfprofd external/protobuf/src
+LOCAL_STATIC_LIBRARIES := libperfprofdcore libperfprofdmockutils libgtest libbase \
+  libsimpleperf libbacktrace_offline liblzma libziparchive libz
+LOCAL_SHARED_LIBRARIES := libprotobuf-cpp-lite \
+  libbacktrace libunwind libutils libLLVM liblog
+LOCAL_C_INCLUDES += system/extras/perfprofd system/extras/simpleperf \
+  system/extras/perfprofd/quipper/kernel-headers external/protobuf/src
 LOCAL_SRC_FILES := perfprofd_test.cc
 LOCAL_CPPFLAGS += $(perfprofd_test_cppflags)
 LOCAL_SHARED_LIBRARIES += libcutils
 LOCAL_MODULE := perfprofd_test
+LOCAL_MULTILIB := first
 include $(BUILD_NATIVE_TEST)
 
+#
+# Benchmark of quipper's AddressMapper
+#
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CXX_STL := libc++
+LOCAL_STATIC_LIBRARIES := libperfprofdcore libbase
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_C_INCLUDES += system/extras/perfprofd
+LOCAL_SRC_FILES := address_mapper_benchmark.cc
+LOCAL_CPPFLAGS += $(perfprofd_test_cppflags)
+LOCAL_MULTILIB := first
+LOCAL_MODULE := perfprofd_address_mapper_benchmark
+include $(BUILD_NATIVE_BENCHMARK)
+
 # Clean temp vars
 perfprofd_test_cppflags :=
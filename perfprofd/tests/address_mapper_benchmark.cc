@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark_api.h>
+
+#include <random>
+#include <vector>
+
+#include "quipper/address_mapper.h"
+
+struct Mapping {
+  uint64_t addr;
+  uint64_t len;
+};
+
+// Mappings laid out like the address space of an app: mapping_count files and anonymous regions
+// of random sizes, with gaps between them.
+static std::vector<Mapping> CreateMappings(size_t mapping_count) {
+  std::mt19937_64 random(0);
+  std::vector<Mapping> mappings;
+  uint64_t addr = 0x70000000;
+  for (size_t i = 0; i < mapping_count; ++i) {
+    uint64_t len = (1 + random() % 64) * 4096;
+    mappings.push_back(Mapping{addr, len});
+    addr += len + (random() % 4) * 4096;
+  }
+  return mappings;
+}
+
+static std::vector<uint64_t> CreateLookupAddrs(const std::vector<Mapping>& mappings) {
+  std::mt19937_64 random(1);
+  std::vector<uint64_t> addrs(4096);
+  for (auto& addr : addrs) {
+    const Mapping& mapping = mappings[random() % mappings.size()];
+    addr = mapping.addr + random() % mapping.len;
+  }
+  return addrs;
+}
+
+// Keeps the compiler from dropping lookups whose results are unused.
+volatile uint64_t mapped_offset_sum;
+
+// Cost of adding all mappings of a process, as done for its mmap events.
+static void BM_address_mapper_map(benchmark::State& state) {
+  std::vector<Mapping> mappings = CreateMappings(state.range_x());
+  while (state.KeepRunning()) {
+    quipper::AddressMapper mapper;
+    for (size_t i = 0; i < mappings.size(); ++i) {
+      mapper.MapWithID(mappings[i].addr, mappings[i].len, i, 0, true);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * mappings.size());
+}
+BENCHMARK(BM_address_mapper_map)->Arg(10)->Arg(100)->Arg(1000)->Arg(10000);
+
+// Cost of looking up one sample address, as done for each sample and callchain entry.
+static void BM_address_mapper_lookup(benchmark::State& state) {
+  std::vector<Mapping> mappings = CreateMappings(state.range_x());
+  std::vector<uint64_t> addrs = CreateLookupAddrs(mappings);
+  quipper::AddressMapper mapper;
+  for (size_t i = 0; i < mappings.size(); ++i) {
+    mapper.MapWithID(mappings[i].addr, mappings[i].len, i, 0, true);
+  }
+  size_t i = 0;
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    uint64_t id;
+    uint64_t offset;
+    if (mapper.GetMappedIDAndOffset(addrs[i++ % addrs.size()], &id, &offset)) {
+      sum += offset;
+    }
+  }
+  mapped_offset_sum = sum;
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_address_mapper_lookup)->Arg(10)->Arg(100)->Arg(1000)->Arg(10000);
+
+// The linear scan used by AddressMapper before mappings were indexed by address, for comparison.
+static void BM_linear_scan_lookup(benchmark::State& state) {
+  std::vector<Mapping> mappings = CreateMappings(state.range_x());
+  std::vector<uint64_t> addrs = CreateLookupAddrs(mappings);
+  size_t i = 0;
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    uint64_t addr = addrs[i++ % addrs.size()];
+    for (auto& mapping : mappings) {
+      if (addr >= mapping.addr && addr <= mapping.addr + mapping.len - 1) {
+        sum += addr - mapping.addr;
+        break;
+      }
+    }
+  }
+  mapped_offset_sum = sum;
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_linear_scan_lookup)->Arg(10)->Arg(100)->Arg(1000)->Arg(10000);
+
+BENCHMARK_MAIN()
@@ -23,17 +23,28 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dlfcn.h>
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 
 #include "perfprofdcore.h"
 #include "configreader.h"
 #include "perfprofdutils.h"
 #include "perfprofdmockutils.h"
+#include "overhead_governor.h"
+#include "symbol_cache.h"
+#include "perf_data_converter.h"
+#include "profile_merger.h"
+#include "quipper/perf_reader.h"
 
 #include "perf_profile.pb.h"
 #include "google/protobuf/text_format.h"
 
+// simpleperf
+#include "build_id.h"
+#include "read_elf.h"
+
 //
 // Set to argv[0] on startup
 //
@@ -481,6 +492,47 @@ TEST_F(PerfProfdTest, ConfigFileParsing)
                      expected, "ConfigFileParsing");
 }
 
+TEST_F(PerfProfdTest, OverheadGovernor)
+{
+  OverheadGovernor governor;
+  unsigned period = 500000;
+  unsigned duration = 3;
+
+  // No adjustment before any over-budget collection
+  governor.adjust(10, &period, &duration);
+  EXPECT_EQ(500000u, period);
+  EXPECT_EQ(3u, duration);
+
+  // A collection spinning on the cpu is way over a 1% budget
+  governor.beginCollection();
+  volatile unsigned spin = 0;
+  for (unsigned i = 0; i < 100000000; ++i) {
+    spin += i;
+  }
+  governor.noteSamples(1000, 0);
+  governor.endCollection(10);
+  EXPECT_GT(governor.periodScale(), 1.0);
+  governor.adjust(10, &period, &duration);
+  EXPECT_GT(period, 500000u);
+  EXPECT_GT(duration, 3u);
+
+  // Lost samples stretch the period even with a generous budget
+  OverheadGovernor lossy_governor;
+  lossy_governor.beginCollection();
+  lossy_governor.noteSamples(1000, 3000);
+  lossy_governor.endCollection(1000);
+  EXPECT_GE(lossy_governor.periodScale(), 4.0);
+
+  // Disabling the governor restores the configured settings
+  governor.endCollection(0);
+  EXPECT_EQ(1.0, governor.periodScale());
+  period = 500000;
+  duration = 3;
+  governor.adjust(10, &period, &duration);
+  EXPECT_EQ(500000u, period);
+  EXPECT_EQ(3u, duration);
+}
+
 TEST_F(PerfProfdTest, ProfileCollectionAnnotations)
 {
   unsigned util1 = collect_cpu_utilization();
@@ -570,6 +622,306 @@ TEST_F(PerfProfdTest, BasicRunWithCannedPerf)
   }
 }
 
+TEST_F(PerfProfdTest, MergedRunWithCannedPerf)
+{
+  //
+  // Encode the canned perf.data file twice with merging of two
+  // collections per profile: the first one is left pending, the
+  // second one completes the profile, with doubled sample counts
+  // in delta encoded form.
+  //
+  std::string input_perf_data(test_dir);
+  input_perf_data += "/canned.perf.data";
+
+  ConfigReader config;
+  config.overrideUnsignedEntry("collect_cpu_utilization", 0);
+  config.overrideUnsignedEntry("collect_charging_state", 0);
+  config.overrideUnsignedEntry("collect_camera_active", 0);
+  config.overrideUnsignedEntry("merge_profiles", 2);
+
+  PROFILE_RESULT result =
+      encode_to_proto(input_perf_data, encoded_file_path(0).c_str(), config, 0);
+  EXPECT_EQ(OK_PROFILE_MERGED, result);
+  wireless_android_play_playlog::AndroidPerfProfile pendingProfile;
+  readEncodedProfile("MergedRunWithCannedPerf", pendingProfile);
+
+  result =
+      encode_to_proto(input_perf_data, encoded_file_path(0).c_str(), config, 0);
+  EXPECT_EQ(OK_PROFILE_COLLECTION, result);
+  wireless_android_play_playlog::AndroidPerfProfile encodedProfile;
+  readEncodedProfile("MergedRunWithCannedPerf", encodedProfile);
+
+  EXPECT_EQ(2, encodedProfile.merged_profiles());
+  EXPECT_EQ(2 * pendingProfile.total_samples(), encodedProfile.total_samples());
+  EXPECT_EQ(29, encodedProfile.programs_size());
+  EXPECT_EQ(pendingProfile.load_modules_size(),
+            encodedProfile.load_modules_size());
+
+  // Same addresses as in BasicRunWithCannedPerf, each counted twice
+  { const auto &lm1 = encodedProfile.programs(0).modules(0);
+    EXPECT_EQ(9, lm1.load_module_id());
+    EXPECT_EQ(0, lm1.address_samples_size());
+    ASSERT_EQ(1, lm1.address_deltas_size());
+    ASSERT_EQ(1, lm1.address_counts_size());
+    EXPECT_EQ(296100u, lm1.address_deltas(0));
+    EXPECT_EQ(2, lm1.address_counts(0));
+  }
+  { const auto &lm2 = encodedProfile.programs(2).modules(0);
+    EXPECT_EQ(2, lm2.load_module_id());
+    ASSERT_EQ(2, lm2.address_deltas_size());
+    ASSERT_EQ(2, lm2.address_counts_size());
+    EXPECT_EQ(28030244u, lm2.address_deltas(0));
+    EXPECT_EQ(29657840u - 28030244u, lm2.address_deltas(1));
+    EXPECT_EQ(2, lm2.address_counts(0));
+    EXPECT_EQ(2, lm2.address_counts(1));
+  }
+}
+
+//
+// Add a single address sample with per-event counts to 'profile'.
+//
+static void addEventSample(wireless_android_play_playlog::AndroidPerfProfile &profile,
+                           uint64_t address,
+                           const std::vector<int64_t> &event_counts)
+{
+  if (profile.programs_size() == 0) {
+    profile.add_load_modules()->set_name("/system/lib/libc.so");
+    profile.add_programs()->set_name("app");
+    profile.mutable_programs(0)->add_modules()->set_load_module_id(0);
+  }
+  auto sample = profile.mutable_programs(0)->mutable_modules(0)->add_address_samples();
+  sample->add_address(address);
+  int64_t count = 0;
+  for (int64_t event_count : event_counts) {
+    sample->add_event_counts(event_count);
+    count += event_count;
+  }
+  sample->set_count(count);
+  profile.set_total_samples(profile.total_samples() + count);
+}
+
+TEST_F(PerfProfdTest, MergeEventCounts)
+{
+  //
+  // Per-event counts are merged by event name, and the merged profile
+  // lists the events of both profiles.
+  //
+  wireless_android_play_playlog::AndroidPerfProfile into;
+  into.add_event_names("cpu-cycles");
+  into.add_event_names("instructions");
+  into.add_event_total_samples(4);
+  into.add_event_total_samples(6);
+  addEventSample(into, 0x1000, {3, 5});
+  addEventSample(into, 0x2000, {1, 1});
+
+  wireless_android_play_playlog::AndroidPerfProfile from;
+  from.add_event_names("instructions");
+  from.add_event_names("cache-misses");
+  from.add_event_total_samples(2);
+  from.add_event_total_samples(1);
+  addEventSample(from, 0x1000, {2, 1});
+
+  wireless_android_logging_awp::MergeAndroidPerfProfile(from, &into);
+
+  ASSERT_EQ(3, into.event_names_size());
+  EXPECT_EQ("cpu-cycles", into.event_names(0));
+  EXPECT_EQ("instructions", into.event_names(1));
+  EXPECT_EQ("cache-misses", into.event_names(2));
+  ASSERT_EQ(3, into.event_total_samples_size());
+  EXPECT_EQ(4, into.event_total_samples(0));
+  EXPECT_EQ(8, into.event_total_samples(1));
+  EXPECT_EQ(1, into.event_total_samples(2));
+
+  const auto &module = into.programs(0).modules(0);
+  ASSERT_EQ(2, module.address_deltas_size());
+  EXPECT_EQ(11, module.address_counts(0));
+  EXPECT_EQ(2, module.address_counts(1));
+  ASSERT_EQ(6, module.address_event_counts_size());
+  EXPECT_EQ(3, module.address_event_counts(0));
+  EXPECT_EQ(7, module.address_event_counts(1));
+  EXPECT_EQ(1, module.address_event_counts(2));
+  EXPECT_EQ(1, module.address_event_counts(3));
+  EXPECT_EQ(1, module.address_event_counts(4));
+  EXPECT_EQ(0, module.address_event_counts(5));
+}
+
+extern "C" int symbol_cache_test_function(int x)
+{
+  return x * 3 + 1;
+}
+
+TEST_F(PerfProfdTest, SymbolCache)
+{
+  //
+  // Symbolize a sample in this test executable: the first lookup
+  // parses the ELF file, a second cache finds its symbols in the
+  // cache directory.
+  //
+  Dl_info info;
+  ASSERT_NE(0, dladdr(reinterpret_cast<void *>(symbol_cache_test_function),
+                      &info));
+  uint64_t offset =
+      reinterpret_cast<uintptr_t>(symbol_cache_test_function) -
+      reinterpret_cast<uintptr_t>(info.dli_fbase);
+  BuildId build_id;
+  ASSERT_TRUE(GetBuildIdFromElfFile(info.dli_fname, &build_id));
+
+  wireless_android_play_playlog::AndroidPerfProfile profile;
+  auto load_module = profile.add_load_modules();
+  load_module->set_name(info.dli_fname);
+  load_module->set_build_id(build_id.ToString().substr(2));
+  auto module = profile.add_programs()->add_modules();
+  module->set_load_module_id(0);
+  module->add_address_deltas(offset);
+  module->add_address_counts(1);
+  auto sample = module->add_address_samples();
+  sample->add_address(offset);
+  sample->add_address(offset);
+  sample->set_count(1);
+
+  std::string cache_dir = dest_dir + "/symbols";
+  {
+    SymbolCache cache(cache_dir, 1024 * 1024);
+    cache.symbolize(&profile);
+  }
+  EXPECT_EQ(0, profile.symbol_cache_hits());
+  EXPECT_EQ(1, profile.symbol_cache_misses());
+  EXPECT_LT(0, profile.symbol_cache_size());
+  ASSERT_EQ(1, profile.load_modules(0).function_names_size());
+  EXPECT_STREQ("symbol_cache_test_function",
+               profile.load_modules(0).function_names(0).c_str());
+  ASSERT_EQ(1, module->address_function_ids_size());
+  EXPECT_EQ(0, module->address_function_ids(0));
+  ASSERT_EQ(2, sample->function_id_size());
+  EXPECT_EQ(0, sample->function_id(0));
+  EXPECT_EQ(0, sample->function_id(1));
+
+  {
+    SymbolCache cache(cache_dir, 1024 * 1024);
+    cache.symbolize(&profile);
+  }
+  EXPECT_EQ(1, profile.symbol_cache_hits());
+  EXPECT_EQ(0, profile.symbol_cache_misses());
+  ASSERT_EQ(1, profile.load_modules(0).function_names_size());
+
+  // A cache too small for the symbols of this executable is emptied
+  {
+    SymbolCache cache(cache_dir, 1);
+    cache.symbolize(&profile);
+  }
+  EXPECT_EQ(0, profile.symbol_cache_size());
+}
+
+//
+// Write the contents of a perf.data file in the piped format of
+// 'perf record -o -': a pipe header, then attr events, the kernel
+// events and the build id events.
+//
+static void writePipedPerfData(const quipper::PerfReader &reader,
+                               const std::string &path)
+{
+  std::string out;
+  struct perf_pipe_file_header header;
+  header.magic = kPerfMagic;
+  header.size = sizeof(header);
+  out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const auto &attr : reader.attrs()) {
+    struct perf_event_header event_header;
+    event_header.type = PERF_RECORD_HEADER_ATTR;
+    event_header.misc = 0;
+    event_header.size = sizeof(event_header) + sizeof(attr.attr) +
+        attr.ids.size() * sizeof(attr.ids[0]);
+    out.append(reinterpret_cast<const char *>(&event_header),
+               sizeof(event_header));
+    out.append(reinterpret_cast<const char *>(&attr.attr), sizeof(attr.attr));
+    out.append(reinterpret_cast<const char *>(attr.ids.data()),
+               attr.ids.size() * sizeof(attr.ids[0]));
+  }
+  for (const auto &event : reader.events()) {
+    out.append(reinterpret_cast<const char *>(event.get()),
+               event->header.size);
+  }
+  for (const auto *event : reader.build_id_events()) {
+    struct build_id_event copy = *event;
+    copy.header.type = PERF_RECORD_HEADER_BUILD_ID;
+    out.append(reinterpret_cast<const char *>(&copy), sizeof(copy));
+    out.append(event->filename, event->header.size - sizeof(copy));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(out, path));
+}
+
+TEST_F(PerfProfdTest, PipedCannedPerf)
+{
+  //
+  // Converting the canned perf.data as piped data must give the same
+  // profile as converting the file.
+  //
+  std::string input_perf_data(test_dir);
+  input_perf_data += "/canned.perf.data";
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.ReadFile(input_perf_data));
+  std::string piped_perf_data = dest_dir + "/canned.pipe.data";
+  writePipedPerfData(reader, piped_perf_data);
+
+  int fd = open(piped_perf_data.c_str(), O_RDONLY);
+  ASSERT_NE(-1, fd);
+  wireless_android_play_playlog::AndroidPerfProfile piped =
+      wireless_android_logging_awp::PipedPerfDataToAndroidPerfProfile(fd);
+  close(fd);
+  wireless_android_play_playlog::AndroidPerfProfile expected =
+      wireless_android_logging_awp::RawPerfDataToAndroidPerfProfile(
+          input_perf_data);
+  EXPECT_EQ(expected.total_samples(), piped.total_samples());
+  EXPECT_EQ(expected.SerializeAsString(), piped.SerializeAsString());
+}
+
+// Return the sum of the counts of address samples in 'profile', and the
+// number of them that are call stacks.
+static uint64_t countAddressSamples(
+    const wireless_android_play_playlog::AndroidPerfProfile &profile,
+    int *stack_count)
+{
+  uint64_t total = 0;
+  *stack_count = 0;
+  for (const auto &program : profile.programs()) {
+    for (const auto &module : program.modules()) {
+      for (const auto &sample : module.address_samples()) {
+        total += sample.count();
+        if (sample.address_size() > 1) {
+          (*stack_count)++;
+        }
+      }
+    }
+  }
+  return total;
+}
+
+TEST_F(PerfProfdTest, BoundedStackTable)
+{
+  //
+  // However many stacks the converter keeps, every sample is counted
+  // once, either in its stack or by its leaf address.
+  //
+  std::string input_perf_data(test_dir);
+  input_perf_data += "/canned.perf.data";
+  wireless_android_play_playlog::AndroidPerfProfile leaf_only =
+      wireless_android_logging_awp::RawPerfDataToAndroidPerfProfile(
+          input_perf_data, 0);
+  int stack_count;
+  EXPECT_EQ(static_cast<uint64_t>(leaf_only.total_samples()),
+            countAddressSamples(leaf_only, &stack_count));
+  EXPECT_EQ(0, stack_count);
+  for (size_t max_stack_count : {1, 16, 10000}) {
+    wireless_android_play_playlog::AndroidPerfProfile profile =
+        wireless_android_logging_awp::RawPerfDataToAndroidPerfProfile(
+            input_perf_data, max_stack_count);
+    EXPECT_EQ(leaf_only.total_samples(), profile.total_samples());
+    EXPECT_EQ(static_cast<uint64_t>(profile.total_samples()),
+              countAddressSamples(profile, &stack_count));
+    EXPECT_LE(static_cast<size_t>(stack_count), max_stack_count);
+  }
+}
+
 TEST_F(PerfProfdTest, BasicRunWithLivePerf)
 {
   //
@@ -685,6 +1037,69 @@ TEST_F(PerfProfdTest, MultipleRunWithLivePerf)
                      expected, "BasicRunWithLivePerf", true);
 }
 
+TEST_F(PerfProfdTest, MultipleRunWithInProcessPerf)
+{
+  //
+  // Exercise in-process collection, which links the simpleperf
+  // record engine instead of running the perf executable. The perf
+  // event files opened by the first collection are reused by the
+  // second one.
+  //
+  PerfProfdRunner runner;
+  runner.addToConfig("only_debug_build=0");
+  std::string ddparam("destination_directory="); ddparam += dest_dir;
+  runner.addToConfig(ddparam);
+  std::string cfparam("config_directory="); cfparam += test_dir;
+  runner.addToConfig(cfparam);
+  runner.addToConfig("main_loop_iterations=2");
+  runner.addToConfig("use_fixed_seed=12345678");
+  runner.addToConfig("max_unprocessed_profiles=100");
+  runner.addToConfig("collection_interval=9999");
+  runner.addToConfig("sample_duration=2");
+  runner.addToConfig("inprocess_collection=1");
+  // the perf executable isn't needed
+  runner.addToConfig("perf_path=/does/not/exist");
+
+  // Create semaphore file
+  runner.create_semaphore_file();
+
+  // Kick off daemon
+  int daemon_main_return_code = runner.invoke();
+
+  // Check return code from daemon
+  EXPECT_EQ(0, daemon_main_return_code);
+
+  // Read and decode the resulting perf.data.encoded file
+  wireless_android_play_playlog::AndroidPerfProfile encodedProfile;
+  readEncodedProfile("MultipleRunWithInProcessPerf", encodedProfile);
+  EXPECT_LT(0, encodedProfile.programs_size());
+  EXPECT_EQ(0, access(encoded_file_path(1).c_str(), F_OK));
+
+  // No perf.data file is written
+  std::string perf_data_path(dest_dir);
+  perf_data_path += "/perf.data";
+  EXPECT_NE(0, access(perf_data_path.c_str(), F_OK));
+
+  // Verify log contents
+  const std::string expected = RAW_RESULT(
+      I: starting Android Wide Profiling daemon
+      I: config file path set to /data/nativetest/perfprofd_test/perfprofd.conf
+      I: random seed set to 12345678
+      I: sleep 674 seconds
+      I: initiating profile collection
+      I: profile collection complete
+      I: sleep 9325 seconds
+      I: sleep 4974 seconds
+      I: initiating profile collection
+      I: profile collection complete
+      I: sleep 5025 seconds
+      I: finishing Android Wide Profiling daemon
+                                          );
+  // check to make sure log excerpt matches
+  compareLogMessages(mock_perfprofdutils_getlogged(),
+                     expected, "MultipleRunWithInProcessPerf", true);
+}
+
 int main(int argc, char **argv) {
   executable_path = argv[0];
   // switch to / before starting testing (perfprofd
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Prints what all physical memory is used for, from the flags and map
+ * counts of every page, read in one pass over /proc/kpageflags and
+ * /proc/kpagecount. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pagemap/pagemap.h>
+
+static const char *type_names[PM_COMPOSITION_TYPES] = {
+    [PM_COMPOSITION_NOPAGE] = "nopage",
+    [PM_COMPOSITION_BUDDY] = "buddy",
+    [PM_COMPOSITION_ZERO] = "zero",
+    [PM_COMPOSITION_SLAB] = "slab",
+    [PM_COMPOSITION_KSM] = "ksm",
+    [PM_COMPOSITION_ANON] = "anon",
+    [PM_COMPOSITION_FILE] = "file",
+    [PM_COMPOSITION_KERNEL] = "kernel",
+    [PM_COMPOSITION_NOFLAGS] = "noflags",
+};
+
+static void usage(char *myname) {
+    fprintf(stderr, "Usage: %s [ -t | -h ]\n"
+                    "    -t  Also print how long the scan took.\n"
+                    "    -h  Display this help screen.\n",
+    myname);
+}
+
+static void print_row(const char *name, uint64_t pages, uint64_t total,
+                      size_t page_size) {
+    printf("%-10s %12" PRIu64 " %10" PRIu64 "K %6.2f%%\n", name, pages,
+           pages * (page_size / 1024), total ? 100.0 * pages / total : 0.0);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    pm_kernel_t *ker;
+    pm_composition_t comp;
+    size_t page_size;
+    uint64_t start, mapped = 0;
+    int show_time = 0;
+    int error;
+    int c;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "th")) != -1) {
+        switch (c) {
+        case 't':
+            show_time = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    error = pm_kernel_create(&ker);
+    if (error) {
+        fprintf(stderr, "Error creating kernel interface -- "
+                        "does this kernel have pagemap?\n");
+        exit(EXIT_FAILURE);
+    }
+    page_size = pm_kernel_pagesize(ker);
+
+    start = now_ns();
+    error = pm_kernel_composition(ker, &comp);
+    if (error) {
+        fprintf(stderr, "Error reading page flags: %s\n", strerror(error));
+        pm_kernel_destroy(ker);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-10s %12s %11s %7s\n", "Type", "Pages", "Size", "Share");
+    for (i = 0; i < PM_COMPOSITION_TYPES; i++)
+        print_row(type_names[i], comp.pages[i], comp.pfns, page_size);
+    print_row("total", comp.pfns, comp.pfns, page_size);
+    printf("\n");
+    print_row("thp", comp.thp, comp.pfns, page_size);
+    print_row("mlocked", comp.mlocked, comp.pfns, page_size);
+
+    for (i = 0; i < PM_COMPOSITION_SHARING; i++)
+        mapped += comp.sharing[i];
+
+    printf("\n%-10s %12s %11s %7s\n", "Mappings", "Pages", "Size", "Share");
+    for (i = 0; i < PM_COMPOSITION_SHARING; i++) {
+        char name[16];
+
+        if (i == 0)
+            snprintf(name, sizeof(name), "1");
+        else if (i == 1)
+            snprintf(name, sizeof(name), "2");
+        else if (i == PM_COMPOSITION_SHARING - 1)
+            snprintf(name, sizeof(name), "%u+", (1U << (i - 1)) + 1);
+        else
+            snprintf(name, sizeof(name), "%u-%u", (1U << (i - 1)) + 1, 1U << i);
+        print_row(name, comp.sharing[i], mapped, page_size);
+    }
+
+    if (show_time)
+        printf("\nScanned %" PRIu64 " pages in %" PRIu64 " ms\n", comp.pfns,
+               (now_ns() - start) / 1000000);
+
+    pm_kernel_destroy(ker);
+
+    return EXIT_SUCCESS;
+}
@@ -14,6 +14,23 @@
 
 LOCAL_PATH:= $(call my-dir)
 
+# The odex to dalvik cache name mapping, shared with cppreopts
+include $(CLEAR_VARS)
+
+LOCAL_MODULE:= libpreopt2cachename
+
+LOCAL_SRC_FILES := \
+    cachename.cpp
+
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+
+LOCAL_SHARED_LIBRARIES := \
+    libbase
+
+LOCAL_CFLAGS := -Werror -Wall
+
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE:= preopt2cachename
@@ -21,6 +38,9 @@ LOCAL_MODULE:= preopt2cachename
 LOCAL_SRC_FILES := \
     preopt2cachename.cpp
 
+LOCAL_STATIC_LIBRARIES := \
+    libpreopt2cachename
+
 LOCAL_SHARED_LIBRARIES := \
     libsysutils \
     liblog \
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PREOPT2CACHENAME_H_
+#define PREOPT2CACHENAME_H_
+
+#include <string>
+
+extern const char* kDalvikCacheDir;
+
+// Do the overall transformation from odex_file_location to output_file_location, the file in the
+// dalvik cache where the runtime looks for an odex file it can't find at odex_file_location.
+// Prior to this output_file_location is kDalvikCacheDir.
+bool OdexToCacheFile(const std::string& odex_file_location,
+                     /*out*/std::string& output_file_location);
+
+#endif  // PREOPT2CACHENAME_H_
@@ -22,56 +22,46 @@
 
 #include <pagemap/pagemap.h>
 
-/* Information about a single mapping */
-struct map_info {
-    pm_map_t *map;
-    pm_memusage_t usage;
-    /* page counts */
-    unsigned long shared_clean;
-    unsigned long shared_dirty;
-    unsigned long private_clean;
-    unsigned long private_dirty;
-};
-
 /* display the help screen */
 static void usage(const char *cmd);
 
-/* qsort compare function to compare maps by PSS */
-int comp_pss(const void *a, const void *b);
+/* Column of the map table to sort by, for comp_maps */
+static const uint64_t *sort_column;
+
+/* qsort compare function to order map numbers by sort_column, largest
+ * first, and in mapping order when equal */
+int comp_maps(const void *a, const void *b);
 
 int main(int argc, char *argv[]) {
     pid_t pid;
 
     /* libpagemap context */
     pm_kernel_t *ker;
-    int pagesize; /* cached for speed */
+    pm_snapshot_t *snap;
     pm_process_t *proc;
 
     /* maps and such */
     pm_map_t **maps; size_t num_maps;
-
-    struct map_info **mis;
-    struct map_info *mi;
-
-    /* pagemap information */
-    uint64_t *pagemap; size_t num_pages;
-    unsigned long address; uint64_t mapentry;
-    uint64_t count, flags;
+    pm_map_table_t *table;
+    size_t *order;
 
     /* totals */
-    unsigned long total_shared_clean, total_shared_dirty, total_private_clean, total_private_dirty;
-    pm_memusage_t total_usage;
+    uint64_t total_vss, total_rss, total_pss, total_uss;
+    uint64_t total_shared_clean, total_shared_dirty, total_private_clean, total_private_dirty;
 
     /* command-line options */
     int ws;
 #define WS_OFF (0)
 #define WS_ONLY (1)
 #define WS_RESET (2)
-    int (*compfn)(const void *a, const void *b);
+    int sort;
+#define SORT_MAPS (0)
+#define SORT_PSS (1)
+#define SORT_USS (2)
     int hide_zeros;
 
     /* temporary variables */
-    size_t i, j;
+    size_t i, m;
     char *endptr;
     int error;
 
@@ -81,13 +71,14 @@ int main(int argc, char *argv[]) {
     }
 
     ws = WS_OFF;
-    compfn = NULL;
+    sort = SORT_MAPS;
     hide_zeros = 0;
     for (i = 1; i < (size_t)(argc - 1); i++) {
         if (!strcmp(argv[i], "-w")) { ws = WS_ONLY; continue; }
         if (!strcmp(argv[i], "-W")) { ws = WS_RESET; continue; }
-        if (!strcmp(argv[i], "-m")) { compfn = NULL; continue; }
-        if (!strcmp(argv[i], "-p")) { compfn = &comp_pss; continue; }
+        if (!strcmp(argv[i], "-m")) { sort = SORT_MAPS; continue; }
+        if (!strcmp(argv[i], "-p")) { sort = SORT_PSS; continue; }
+        if (!strcmp(argv[i], "-u")) { sort = SORT_USS; continue; }
         if (!strcmp(argv[i], "-h")) { hide_zeros = 1; continue; }
         fprintf(stderr, "Invalid argument \"%s\".\n", argv[i]);
         usage(argv[0]);
@@ -107,10 +98,14 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    pagesize = pm_kernel_pagesize(ker);
-
-    error = pm_process_create(ker, pid, &proc);
+    error = pm_snapshot_create(ker, &pid, 1, &snap);
     if (error) {
+        fprintf(stderr, "error reading process.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    proc = pm_snapshot_process(snap, 0);
+    if (!proc) {
         fprintf(stderr, "error creating process interface -- "
                         "does process %d really exist?\n", pid);
         exit(EXIT_FAILURE);
@@ -125,19 +120,33 @@ int main(int argc, char *argv[]) {
         exit(EXIT_SUCCESS);
     }
 
-    /* get maps, and allocate our map_info array */
     error = pm_process_maps(proc, &maps, &num_maps);
     if (error) {
         fprintf(stderr, "error listing maps.\n");
         exit(EXIT_FAILURE);
     }
 
-    mis = (struct map_info **)calloc(num_maps, sizeof(struct map_info *));
-    if (!mis) {
-        fprintf(stderr, "error allocating map_info array: %s\n", strerror(errno));
+    /* get the usage of all maps in one pass over the snapshot */
+    error = pm_snapshot_map_table(snap, 0, ws == WS_ONLY, &table);
+    if (error) {
+        fprintf(stderr, "error getting usage for maps.\n");
         exit(EXIT_FAILURE);
     }
 
+    /* sort map numbers rather than the table, which stays in mapping order */
+    order = (size_t *)calloc(num_maps ? num_maps : 1, sizeof(size_t));
+    if (!order) {
+        fprintf(stderr, "error allocating map order: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (m = 0; m < num_maps; m++)
+        order[m] = m;
+
+    if (sort != SORT_MAPS) {
+        sort_column = (sort == SORT_PSS) ? table->pss : table->uss;
+        qsort(order, num_maps, sizeof(order[0]), &comp_maps);
+    }
+
     /* print header */
     if (ws == WS_ONLY) {
         printf("%7s  %7s  %7s  %7s  %7s  %7s  %7s  %s\n",
@@ -151,119 +160,46 @@ int main(int argc, char *argv[]) {
                "-------", "-------", "-------", "-------", "-------", "-------", "-------", "-------", "");
     }
 
-    /* zero things */
-    pm_memusage_zero(&total_usage);
+    total_vss = total_rss = total_pss = total_uss = 0;
     total_shared_clean = total_shared_dirty = total_private_clean = total_private_dirty = 0;
 
     for (i = 0; i < num_maps; i++) {
-        mi = (struct map_info *)calloc(1, sizeof(struct map_info));
-        if (!mi) {
-            fprintf(stderr, "error allocating map_info: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        mi->map = maps[i];
-
-        /* get, and sum, memory usage */
-
-        if (ws == WS_ONLY)
-            error = pm_map_workingset(mi->map, &mi->usage);
-        else
-            error = pm_map_usage(mi->map, &mi->usage);
-        if (error) {
-            fflush(stdout);
-            fprintf(stderr, "error getting usage for map.\n");
-            continue;
-        }
-
-        pm_memusage_add(&total_usage, &mi->usage);
-
-        /* get, and sum, individual page counts */
-
-        error = pm_map_pagemap(mi->map, &pagemap, &num_pages);
-        if (error) {
-            fflush(stdout);
-            fprintf(stderr, "error getting pagemap for map.\n");
-            continue;
-        }
-
-        mi->shared_clean = mi->shared_dirty = mi->private_clean = mi->private_dirty = 0;
-
-        for (j = 0; j < num_pages; j++) {
-            address = pm_map_start(mi->map) + j * ker->pagesize;
-            mapentry = pagemap[j];
-
-            if (PM_PAGEMAP_PRESENT(mapentry) && !PM_PAGEMAP_SWAPPED(mapentry)) {
-
-                error = pm_kernel_count(ker, PM_PAGEMAP_PFN(mapentry), &count);
-                if (error) {
-                    fflush(stdout);
-                    fprintf(stderr, "error getting count for frame.\n");
-                }
-
-                error = pm_kernel_flags(ker, PM_PAGEMAP_PFN(mapentry), &flags);
-                if (error) {
-                    fflush(stdout);
-                    fprintf(stderr, "error getting flags for frame.\n");
-                }
-
-                if ((ws != WS_ONLY) || (flags & PM_PAGE_REFERENCED)) {
-                    if (count > 1) {
-                        if (flags & PM_PAGE_DIRTY)
-                            mi->shared_dirty++;
-                        else
-                            mi->shared_clean++;
-                    } else {
-                        if (flags & PM_PAGE_DIRTY)
-                            mi->private_dirty++;
-                        else
-                            mi->private_clean++;
-                    }
-                }
-            }
-        }
-
-        total_shared_clean += mi->shared_clean;
-        total_shared_dirty += mi->shared_dirty;
-        total_private_clean += mi->private_clean;
-        total_private_dirty += mi->private_dirty;
-
-        /* add to array */
-        mis[i] = mi;
-    }
-
-    /* sort the array, if requested (compfn == NULL for original order) */
-    if (compfn)
-        qsort(mis, num_maps, sizeof(mis[0]), compfn);
-
-    for (i = 0; i < num_maps; i++) {
-        mi = mis[i];
-
-        if ((!mi) || (hide_zeros && !mi->usage.rss))
+        m = order[i];
+
+        total_vss += table->vss[m];
+        total_rss += table->rss[m];
+        total_pss += table->pss[m];
+        total_uss += table->uss[m];
+        total_shared_clean += table->shared_clean[m];
+        total_shared_dirty += table->shared_dirty[m];
+        total_private_clean += table->private_clean[m];
+        total_private_dirty += table->private_dirty[m];
+
+        if (hide_zeros && !table->rss[m])
             continue;
 
         if (ws == WS_ONLY) {
             printf("%6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %s\n",
-                (long)mi->usage.rss / 1024,
-                (long)mi->usage.pss / 1024,
-                (long)mi->usage.uss / 1024,
-                mi->shared_clean * pagesize / 1024,
-                mi->shared_dirty * pagesize / 1024,
-                mi->private_clean * pagesize / 1024,
-                mi->private_dirty * pagesize / 1024,
-                pm_map_name(mi->map)
+                (long)(table->rss[m] / 1024),
+                (long)(table->pss[m] / 1024),
+                (long)(table->uss[m] / 1024),
+                (long)(table->shared_clean[m] / 1024),
+                (long)(table->shared_dirty[m] / 1024),
+                (long)(table->private_clean[m] / 1024),
+                (long)(table->private_dirty[m] / 1024),
+                pm_map_name(maps[m])
             );
         } else {
             printf("%6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %s\n",
-                (long)mi->usage.vss / 1024,
-                (long)mi->usage.rss / 1024,
-                (long)mi->usage.pss / 1024,
-                (long)mi->usage.uss / 1024,
-                mi->shared_clean * pagesize / 1024,
-                mi->shared_dirty * pagesize / 1024,
-                mi->private_clean * pagesize / 1024,
-                mi->private_dirty * pagesize / 1024,
-                pm_map_name(mi->map)
+                (long)(table->vss[m] / 1024),
+                (long)(table->rss[m] / 1024),
+                (long)(table->pss[m] / 1024),
+                (long)(table->uss[m] / 1024),
+                (long)(table->shared_clean[m] / 1024),
+                (long)(table->shared_dirty[m] / 1024),
+                (long)(table->private_clean[m] / 1024),
+                (long)(table->private_dirty[m] / 1024),
+                pm_map_name(maps[m])
             );
         }
     }
@@ -273,51 +209,59 @@ int main(int argc, char *argv[]) {
         printf("%7s  %7s  %7s  %7s  %7s  %7s  %7s  %s\n",
                "-------", "-------", "-------", "-------", "-------", "-------", "-------", "");
         printf("%6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %s\n",
-            (long)total_usage.rss / 1024,
-            (long)total_usage.pss / 1024,
-            (long)total_usage.uss / 1024,
-            total_shared_clean * pagesize / 1024,
-            total_shared_dirty * pagesize / 1024,
-            total_private_clean * pagesize / 1024,
-            total_private_dirty * pagesize / 1024,
+            (long)(total_rss / 1024),
+            (long)(total_pss / 1024),
+            (long)(total_uss / 1024),
+            (long)(total_shared_clean / 1024),
+            (long)(total_shared_dirty / 1024),
+            (long)(total_private_clean / 1024),
+            (long)(total_private_dirty / 1024),
             "TOTAL"
         );
     } else {
         printf("%7s  %7s  %7s  %7s  %7s  %7s  %7s  %7s  %s\n",
                "-------", "-------", "-------", "-------", "-------", "-------", "-------", "-------", "");
         printf("%6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %6ldK  %s\n",
-            (long)total_usage.vss / 1024,
-            (long)total_usage.rss / 1024,
-            (long)total_usage.pss / 1024,
-            (long)total_usage.uss / 1024,
-            total_shared_clean * pagesize / 1024,
-            total_shared_dirty * pagesize / 1024,
-            total_private_clean * pagesize / 1024,
-            total_private_dirty * pagesize / 1024,
+            (long)(total_vss / 1024),
+            (long)(total_rss / 1024),
+            (long)(total_pss / 1024),
+            (long)(total_uss / 1024),
+            (long)(total_shared_clean / 1024),
+            (long)(total_shared_dirty / 1024),
+            (long)(total_private_clean / 1024),
+            (long)(total_private_dirty / 1024),
             "TOTAL"
         );
     }
 
+    free(order);
+    pm_map_table_destroy(table);
+    pm_snapshot_destroy(snap);
+    pm_kernel_destroy(ker);
+
     return 0;
 }
 
 static void usage(const char *cmd) {
-    fprintf(stderr, "Usage: %s [ -w | -W ] [ -p | -m ] [ -h ] pid\n"
+    fprintf(stderr, "Usage: %s [ -w | -W ] [ -p | -u | -m ] [ -h ] pid\n"
                     "    -w  Displays statistics for the working set only.\n"
                     "    -W  Resets the working set of the process.\n"
                     "    -p  Sort by PSS.\n"
+                    "    -u  Sort by USS.\n"
                     "    -m  Sort by mapping order (as read from /proc).\n"
                     "    -h  Hide maps with no RSS.\n",
         cmd);
 }
 
-int comp_pss(const void *a, const void *b) {
-    struct map_info *ma, *mb;
+int comp_maps(const void *a, const void *b) {
+    size_t ma, mb;
 
-    ma = *((struct map_info **)a);
-    mb = *((struct map_info **)b);
+    ma = *((const size_t *)a);
+    mb = *((const size_t *)b);
 
-    if (mb->usage.pss < ma->usage.pss) return -1;
-    if (mb->usage.pss > ma->usage.pss) return 1;
+    if (sort_column[mb] < sort_column[ma]) return -1;
+    if (sort_column[mb] > sort_column[ma]) return 1;
+    if (ma < mb) return -1;
+    if (ma > mb) return 1;
     return 0;
 }
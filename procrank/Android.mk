@@ -15,7 +15,7 @@
 LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := procrank.c
+LOCAL_SRC_FILES := procrank.c daemon.c
 LOCAL_CFLAGS := -Wall -Wextra -Wformat=2 -Werror
 LOCAL_SHARED_LIBRARIES := libpagemap
 LOCAL_MODULE := procrank
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pagemap/pagemap.h>
+
+#include "procrank.h"
+#include "procrank_ring.h"
+
+/* A process that is sampled.  Its pm_process_t is kept open between
+ * samples, and its pages are only read again when the RSS in
+ * /proc/pid/stat changes. */
+struct tracked {
+    pid_t pid;
+    uint64_t start_time;
+    uint64_t rss;
+    pm_process_t *proc;
+    pm_memusage_t usage;
+    char name[PROCRANK_RING_NAME_LEN];
+};
+
+struct daemon {
+    const struct daemon_options *opts;
+    pm_kernel_t *ker;
+
+    /* Sorted by pid */
+    struct tracked **procs;
+    size_t num_procs;
+
+    struct procrank_ring_header *ring;
+    size_t ring_size;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static int cmp_pid(const void *a, const void *b) {
+    pid_t pa = *(const pid_t *)a, pb = *(const pid_t *)b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static int cmp_pss(const void *a, const void *b) {
+    const struct tracked *ta = *(struct tracked * const *)a;
+    const struct tracked *tb = *(struct tracked * const *)b;
+
+    return (ta->usage.pss < tb->usage.pss) - (ta->usage.pss > tb->usage.pss);
+}
+
+/* Reads the start time and the RSS of a process from /proc/pid/stat.  The
+ * start time tells a process from an earlier one with the same pid. */
+static int read_stat(pid_t pid, uint64_t *start_time, uint64_t *rss) {
+    char filename[32];
+    char buf[1024];
+    ssize_t len;
+    char *p;
+    int fd;
+
+    snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return len < 0 ? errno : EINVAL;
+    buf[len] = '\0';
+
+    /* The name may contain spaces and parentheses, fields start after the
+     * last ')' */
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u"
+                     " %*u %*d %*d %*d %*d %*d %*d %" SCNu64 " %*u %" SCNu64,
+                     start_time, rss) != 2)
+        return EINVAL;
+
+    return 0;
+}
+
+static int open_ring(struct daemon *d) {
+    const struct daemon_options *opts = d->opts;
+    struct procrank_ring_header *ring;
+    size_t slot_size, size;
+    int fd, error;
+
+    slot_size = PROCRANK_RING_SLOT_SIZE(opts->max_procs);
+    size = sizeof(*ring) + slot_size * opts->num_slots;
+
+    fd = open(opts->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return errno;
+
+    /* Truncating first drops the samples of an earlier run */
+    if (ftruncate(fd, 0) || ftruncate(fd, size)) {
+        error = errno;
+        close(fd);
+        return error;
+    }
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    error = errno;
+    close(fd);
+    if (ring == MAP_FAILED)
+        return error;
+
+    ring->version = PROCRANK_RING_VERSION;
+    ring->num_slots = opts->num_slots;
+    ring->slot_size = slot_size;
+    ring->max_procs = opts->max_procs;
+    ring->interval_ms = opts->interval_ms;
+    ring->samples = 0;
+    __atomic_store_n(&ring->magic, PROCRANK_RING_MAGIC, __ATOMIC_RELEASE);
+
+    d->ring = ring;
+    d->ring_size = size;
+
+    return 0;
+}
+
+static void destroy_tracked(struct tracked *t) {
+    if (t->proc)
+        pm_process_destroy(t->proc);
+    free(t);
+}
+
+/* Matches the running processes with the tracked ones.  Processes that
+ * exited are dropped and new ones are added, without a pm_process_t. */
+static int update_pids(struct daemon *d) {
+    struct tracked **procs;
+    pid_t *pids;
+    size_t num_pids, num, i, j;
+    int error;
+
+    error = pm_kernel_pids(d->ker, &pids, &num_pids);
+    if (error)
+        return error;
+    qsort(pids, num_pids, sizeof(pids[0]), cmp_pid);
+
+    procs = calloc(num_pids ? num_pids : 1, sizeof(procs[0]));
+    if (!procs) {
+        error = errno;
+        free(pids);
+        return error;
+    }
+
+    for (i = 0, j = 0, num = 0; i < num_pids; i++) {
+        while (j < d->num_procs && d->procs[j]->pid < pids[i])
+            destroy_tracked(d->procs[j++]);
+
+        if (j < d->num_procs && d->procs[j]->pid == pids[i]) {
+            procs[num++] = d->procs[j++];
+            continue;
+        }
+
+        /* A process that cannot be added now is added on the next sample */
+        procs[num] = calloc(1, sizeof(*procs[num]));
+        if (!procs[num])
+            continue;
+        procs[num]->pid = pids[i];
+        procs[num]->start_time = UINT64_MAX;
+        num++;
+    }
+
+    for (; j < d->num_procs; j++)
+        destroy_tracked(d->procs[j]);
+    free(d->procs);
+    free(pids);
+
+    d->procs = procs;
+    d->num_procs = num;
+
+    return 0;
+}
+
+/* Reads the usage of a process again if it is new, its RSS changed, or on
+ * a full scan.  Returns 1 if it was read, 0 if the last usage was kept, or
+ * an error if the process could not be read; it then has no usage. */
+static int scan_process(struct daemon *d, struct tracked *t, bool full) {
+    uint64_t start_time, rss;
+    int error;
+
+    error = read_stat(t->pid, &start_time, &rss);
+    if (error)
+        goto fail;
+
+    if (start_time != t->start_time) {
+        if (t->proc) {
+            pm_process_destroy(t->proc);
+            t->proc = NULL;
+        }
+        getprocname(t->pid, t->name, sizeof(t->name));
+    } else if (rss == t->rss && !full) {
+        return 0;
+    }
+
+    t->start_time = start_time;
+    t->rss = rss;
+
+    if (!t->proc)
+        error = pm_process_create(d->ker, t->pid, &t->proc);
+    else
+        error = pm_process_refresh(t->proc);
+    if (error)
+        goto fail;
+
+    pm_memusage_zero(&t->usage);
+    error = pm_process_usage_flags(t->proc, &t->usage, d->opts->flags_mask,
+                                   d->opts->required_flags);
+    if (error)
+        goto fail;
+
+    return 1;
+
+fail:
+    /* Processes that cannot be read, like those of other users when not
+     * running as root, are only tried again when their RSS changes */
+    pm_memusage_zero(&t->usage);
+    if (t->proc) {
+        pm_process_destroy(t->proc);
+        t->proc = NULL;
+    }
+    return error;
+}
+
+static void publish(struct daemon *d, struct tracked **order, size_t num,
+                    uint32_t num_rescanned) {
+    struct procrank_ring_header *ring = d->ring;
+    struct procrank_ring_slot *slot;
+    struct timespec now;
+    uint64_t sample;
+    size_t i;
+
+    clock_gettime(CLOCK_BOOTTIME, &now);
+
+    sample = ring->samples;
+    slot = procrank_ring_slot(ring, sample);
+
+    __atomic_store_n(&slot->seq, 2 * sample + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->sample = sample;
+    slot->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    slot->num_procs = num < ring->max_procs ? num : ring->max_procs;
+    slot->num_rescanned = num_rescanned;
+    slot->num_dropped = num - slot->num_procs;
+    for (i = 0; i < slot->num_procs; i++) {
+        struct procrank_ring_proc *p = &slot->procs[i];
+
+        p->pid = order[i]->pid;
+        p->vss = order[i]->usage.vss;
+        p->rss = order[i]->usage.rss;
+        p->pss = order[i]->usage.pss;
+        p->uss = order[i]->usage.uss;
+        p->swap = order[i]->usage.swap;
+        strlcpy(p->name, order[i]->name, sizeof(p->name));
+    }
+
+    __atomic_store_n(&slot->seq, 2 * (sample + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->samples, sample + 1, __ATOMIC_RELEASE);
+}
+
+static int sample(struct daemon *d, bool full) {
+    struct tracked **order;
+    uint32_t num_rescanned = 0;
+    size_t num = 0, i;
+    int error;
+
+    error = update_pids(d);
+    if (error)
+        return error;
+
+    order = malloc((d->num_procs ? d->num_procs : 1) * sizeof(order[0]));
+    if (!order)
+        return errno;
+
+    for (i = 0; i < d->num_procs && !stop; i++) {
+        if (scan_process(d, d->procs[i], full) > 0)
+            num_rescanned++;
+        if (d->procs[i]->usage.vss)
+            order[num++] = d->procs[i];
+    }
+
+    /* A sample interrupted by a signal is not published */
+    if (!stop) {
+        qsort(order, num, sizeof(order[0]), cmp_pss);
+        publish(d, order, num, num_rescanned);
+    }
+
+    free(order);
+
+    return 0;
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+int run_daemon(const struct daemon_options *opts) {
+    struct daemon d;
+    struct sigaction sa;
+    struct rlimit rl;
+    struct timespec next;
+    uint64_t n;
+    size_t i;
+    int error;
+
+    memset(&d, 0, sizeof(d));
+    d.opts = opts;
+
+    /* Each tracked process keeps its pagemap open */
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    error = pm_kernel_create(&d.ker);
+    if (error) {
+        fprintf(stderr, "Error creating kernel interface -- "
+                        "does this kernel have pagemap?\n");
+        return error;
+    }
+
+    error = open_ring(&d);
+    if (error) {
+        fprintf(stderr, "Error creating \"%s\": %s\n", opts->path,
+                strerror(error));
+        pm_kernel_destroy(d.ker);
+        return error;
+    }
+
+    /* Without SA_RESTART, the signals also end the sleep between samples */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (n = 0; !stop; n++) {
+        error = sample(&d, opts->full_scan && n % opts->full_scan == 0);
+        if (error) {
+            fprintf(stderr, "Error sampling processes: %s\n", strerror(error));
+            break;
+        }
+
+        timespec_add_ms(&next, opts->interval_ms);
+        while (!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                        &next, NULL) == EINTR)
+            ;
+    }
+
+    for (i = 0; i < d.num_procs; i++)
+        destroy_tracked(d.procs[i]);
+    free(d.procs);
+    munmap(d.ring, d.ring_size);
+    pm_kernel_destroy(d.ker);
+
+    return error;
+}
@@ -26,14 +26,16 @@
 
 #include <pagemap/pagemap.h>
 
+#include "procrank.h"
+
 struct proc_info {
     pid_t pid;
     pm_memusage_t usage;
+    pm_swapusage_t swap_usage;
     uint64_t wss;
 };
 
 static void usage(char *myname);
-static int getprocname(pid_t pid, char *buf, int len);
 static int numcmp(uint64_t a, uint64_t b);
 
 #define declare_sort(field) \
@@ -176,6 +178,7 @@ static uint64_t get_zram_mem_used() {
 int main(int argc, char *argv[]) {
     pm_kernel_t *ker;
     pm_process_t *proc;
+    pm_snapshot_t *snap;
     pid_t *pids;
     struct proc_info **procs;
     size_t num_procs;
@@ -195,18 +198,25 @@ int main(int argc, char *argv[]) {
     #define WS_ONLY  1
     #define WS_RESET 2
     int ws;
+    int threads;
+    struct daemon_options daemon;
 
     int arg;
     size_t i, j;
 
     uint64_t mem[MEMINFO_COUNT] = { };
-    pm_proportional_swap_t *p_swap;
     float zram_cr = 0.0;
 
     signal(SIGPIPE, SIG_IGN);
     compfn = &sort_by_pss;
     order = -1;
     ws = WS_OFF;
+    threads = 1;
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.interval_ms = 60000;
+    daemon.num_slots = 16;
+    daemon.max_procs = 1024;
+    daemon.full_scan = 10;
 
     for (arg = 1; arg < argc; arg++) {
         if (!strcmp(argv[arg], "-v")) { compfn = &sort_by_vss; continue; }
@@ -221,13 +231,67 @@ int main(int argc, char *argv[]) {
         if (!strcmp(argv[arg], "-W")) { ws = WS_RESET; continue; }
         if (!strcmp(argv[arg], "-R")) { order *= -1; continue; }
         if (!strcmp(argv[arg], "-h")) { usage(argv[0]); exit(0); }
+        if (!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+            threads = atoi(argv[++arg]);
+            if (threads < 1) {
+                fprintf(stderr, "Invalid number of threads \"%s\".\n", argv[arg]);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!strcmp(argv[arg], "-D") && arg + 1 < argc) {
+            daemon.path = argv[++arg];
+            continue;
+        }
+        if (!strcmp(argv[arg], "-i") && arg + 1 < argc) {
+            daemon.interval_ms = atof(argv[++arg]) * 1000;
+            if (!daemon.interval_ms) {
+                fprintf(stderr, "Invalid interval \"%s\".\n", argv[arg]);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!strcmp(argv[arg], "-n") && arg + 1 < argc) {
+            daemon.num_slots = atoi(argv[++arg]);
+            if (daemon.num_slots < 2) {
+                fprintf(stderr, "Invalid number of samples \"%s\".\n", argv[arg]);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!strcmp(argv[arg], "-m") && arg + 1 < argc) {
+            daemon.max_procs = atoi(argv[++arg]);
+            if (daemon.max_procs < 1) {
+                fprintf(stderr, "Invalid number of processes \"%s\".\n", argv[arg]);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!strcmp(argv[arg], "-F") && arg + 1 < argc) {
+            daemon.full_scan = atoi(argv[++arg]);
+            continue;
+        }
         fprintf(stderr, "Invalid argument \"%s\".\n", argv[arg]);
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    if (daemon.path) {
+        if (ws != WS_OFF) {
+            fprintf(stderr, "-w and -W cannot be used with -D.\n");
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        daemon.flags_mask = flags_mask;
+        daemon.required_flags = required_flags;
+        exit(run_daemon(&daemon) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
     get_mem_info(mem);
-    p_swap = pm_memusage_pswap_create(mem[MEMINFO_SWAP_TOTAL] * 1024);
 
     error = pm_kernel_create(&ker);
     if (error) {
@@ -242,6 +306,17 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    /* All processes are read before any page is looked up, so that pages
+     * shared between processes are only read from the kernel once */
+    snap = NULL;
+    if (ws != WS_RESET) {
+        error = pm_snapshot_create_threads(ker, pids, num_procs, threads, &snap);
+        if (error) {
+            fprintf(stderr, "Error reading processes.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     procs = calloc(num_procs, sizeof(struct proc_info*));
     if (procs == NULL) {
         fprintf(stderr, "calloc: %s", strerror(errno));
@@ -256,38 +331,50 @@ int main(int argc, char *argv[]) {
         }
         procs[i]->pid = pids[i];
         pm_memusage_zero(&procs[i]->usage);
-        pm_memusage_pswap_init_handle(&procs[i]->usage, p_swap);
-        error = pm_process_create(ker, pids[i], &proc);
-        if (error) {
-            fprintf(stderr, "warning: could not create process interface for %d\n", pids[i]);
+        memset(&procs[i]->swap_usage, 0, sizeof(procs[i]->swap_usage));
+
+        if (ws == WS_RESET) {
+            error = pm_process_create(ker, pids[i], &proc);
+            if (error) {
+                fprintf(stderr, "warning: could not create process interface for %d\n", pids[i]);
+                continue;
+            }
+            error = pm_process_workingset(proc, NULL, 1);
+            if (error) {
+                fprintf(stderr, "warning: could not read usage for %d\n", pids[i]);
+            }
+            pm_process_destroy(proc);
             continue;
         }
 
-        switch (ws) {
-        case WS_OFF:
-            error = pm_process_usage_flags(proc, &procs[i]->usage, flags_mask,
-                                           required_flags);
-            break;
-        case WS_ONLY:
-            error = pm_process_workingset(proc, &procs[i]->usage, 0);
-            break;
-        case WS_RESET:
-            error = pm_process_workingset(proc, NULL, 1);
-            break;
+        if (!pm_snapshot_process(snap, i)) {
+            fprintf(stderr, "warning: could not create process interface for %d\n", pids[i]);
+            continue;
         }
 
+        if (ws == WS_ONLY)
+            error = pm_snapshot_process_workingset(snap, i, &procs[i]->usage);
+        else
+            error = pm_snapshot_process_usage_flags(snap, i, &procs[i]->usage,
+                                                    flags_mask, required_flags);
+
         if (error) {
             fprintf(stderr, "warning: could not read usage for %d\n", pids[i]);
         }
 
-        if (ws != WS_RESET && procs[i]->usage.swap) {
+        if (procs[i]->usage.swap) {
+            /* The swap slots of all processes are counted on the first
+             * call */
+            error = pm_snapshot_process_swapusage(snap, i, &procs[i]->swap_usage);
+            if (error) {
+                fprintf(stderr, "warning: could not read swap usage for %d\n", pids[i]);
+            }
             has_swap = true;
         }
-
-        pm_process_destroy(proc);
     }
 
     free(pids);
+    pm_snapshot_destroy(snap);
 
     if (ws == WS_RESET) exit(0);
 
@@ -373,17 +460,15 @@ int main(int argc, char *argv[]) {
         }
 
         if (has_swap) {
-            pm_swapusage_t su;
+            pm_swapusage_t *su = &procs[i]->swap_usage;
 
-            pm_memusage_pswap_get_usage(&procs[i]->usage, &su);
             printf("%6zuK  ", procs[i]->usage.swap / 1024);
-            printf("%6zuK  ", su.proportional / 1024);
-            printf("%6zuK  ", su.unique / 1024);
-            total_pswap += su.proportional;
-            total_uswap += su.unique;
-            pm_memusage_pswap_free(&procs[i]->usage);
+            printf("%6zuK  ", su->proportional / 1024);
+            printf("%6zuK  ", su->unique / 1024);
+            total_pswap += su->proportional;
+            total_uswap += su->unique;
             if (has_zram) {
-                size_t zpswap = su.proportional * zram_cr;
+                size_t zpswap = su->proportional * zram_cr;
                 printf("%6zuK  ", zpswap / 1024);
                 total_zswap += zpswap;
             }
@@ -395,7 +480,6 @@ int main(int argc, char *argv[]) {
     }
 
     free(procs);
-    pm_memusage_pswap_destroy(p_swap);
 
     /* Print the separator line */
     printf("%5s  ", "");
@@ -453,7 +537,8 @@ int main(int argc, char *argv[]) {
 }
 
 static void usage(char *myname) {
-    fprintf(stderr, "Usage: %s [ -W ] [ -v | -r | -p | -u | -s | -h ]\n"
+    fprintf(stderr, "Usage: %s [ -W ] [ -v | -r | -p | -u | -s | -h ] [ -j N ]\n"
+                    "       %s -D FILE [ -i SECS ] [ -n N ] [ -m N ] [ -F N ] [ -c | -C | -k ]\n"
                     "    -v  Sort by VSS.\n"
                     "    -r  Sort by RSS.\n"
                     "    -p  Sort by PSS.\n"
@@ -466,8 +551,16 @@ static void usage(char *myname) {
                     "    -k  Only show pages collapsed by KSM\n"
                     "    -w  Display statistics for working set only.\n"
                     "    -W  Reset working set of all processes.\n"
+                    "    -j  Scan processes on N threads.\n"
+                    "    -D  Run as a daemon, publishing a sample of all processes to\n"
+                    "        FILE every interval (see procrank_ring.h).  Processes\n"
+                    "        whose RSS did not change keep their last usage.\n"
+                    "    -i  Seconds between samples with -D (default 60).\n"
+                    "    -n  Number of samples kept in FILE (default 16).\n"
+                    "    -m  Most processes in a sample, by PSS (default 1024).\n"
+                    "    -F  Read all processes every N samples (default 10, 0 for never).\n"
                     "    -h  Display this help screen.\n",
-    myname);
+    myname, myname);
 }
 
 /*
@@ -484,7 +577,7 @@ static void usage(char *myname) {
  *   2 on failure to open proc cmdline entry
  *   3 on failure to read proc cmdline entry
  */
-static int getprocname(pid_t pid, char *buf, int len) {
+int getprocname(pid_t pid, char *buf, int len) {
     char *filename;
     FILE *f;
     int rc = 0;
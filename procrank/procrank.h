@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROCRANK_H
+#define _PROCRANK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct daemon_options {
+    const char *path;
+    unsigned int interval_ms;
+    unsigned int num_slots;
+    unsigned int max_procs;
+    /* Every full_scan samples, all processes are read again even if their
+     * RSS did not change; 0 never does. */
+    unsigned int full_scan;
+    uint64_t flags_mask;
+    uint64_t required_flags;
+};
+
+/* Samples the memory usage of all processes every interval_ms until
+ * SIGINT or SIGTERM, publishing the samples to the ring described in
+ * procrank_ring.h. */
+int run_daemon(const struct daemon_options *opts);
+
+int getprocname(pid_t pid, char *buf, int len);
+
+#endif
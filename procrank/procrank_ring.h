@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROCRANK_RING_H
+#define _PROCRANK_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Layout of the file that "procrank -D" publishes its samples to.  The file
+ * starts with a header, followed by num_slots slots of slot_size bytes.
+ * Sample n is written to slot n % num_slots.
+ *
+ * Clients map the file shared and read it without any system call.  Each
+ * slot is protected by a sequence count: it is odd while the daemon writes
+ * the slot, and 2 * (n + 1) once sample n is complete.  A client copies the
+ * slot and keeps the copy if the count was the same, and even, before and
+ * after; procrank_ring_read does that for the latest sample. */
+
+#define PROCRANK_RING_MAGIC   0x4b4e5250 /* "PRNK" */
+#define PROCRANK_RING_VERSION 1
+
+#define PROCRANK_RING_NAME_LEN 64
+
+struct procrank_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    /* Most processes a slot holds.  If there are more, the ones with the
+     * largest PSS are kept. */
+    uint32_t max_procs;
+    uint32_t interval_ms;
+    /* Number of samples published so far */
+    uint64_t samples;
+};
+
+struct procrank_ring_proc {
+    int32_t pid;
+    uint32_t reserved;
+    /* Sizes in bytes */
+    uint64_t vss;
+    uint64_t rss;
+    uint64_t pss;
+    uint64_t uss;
+    uint64_t swap;
+    char name[PROCRANK_RING_NAME_LEN];
+};
+
+struct procrank_ring_slot {
+    uint64_t seq;
+    uint64_t sample;
+    /* CLOCK_BOOTTIME at which the sample was taken */
+    uint64_t time_ns;
+    uint32_t num_procs;
+    /* Processes of this sample whose pages were read again; the others had
+     * the same RSS as in the previous sample and their usage was kept. */
+    uint32_t num_rescanned;
+    /* Processes left out because there were more than max_procs */
+    uint32_t num_dropped;
+    uint32_t reserved;
+    struct procrank_ring_proc procs[];
+};
+
+#define PROCRANK_RING_SLOT_SIZE(max_procs) \
+    (sizeof(struct procrank_ring_slot) + \
+     (max_procs) * sizeof(struct procrank_ring_proc))
+
+static inline struct procrank_ring_slot *
+procrank_ring_slot(struct procrank_ring_header *hdr, uint64_t sample) {
+    return (struct procrank_ring_slot *)((char *)(hdr + 1) +
+            (sample % hdr->num_slots) * hdr->slot_size);
+}
+
+/* Copies the latest complete sample to *out, which must hold slot_size
+ * bytes.  Returns 0, or -1 if no sample has been published yet. */
+static inline int procrank_ring_read(struct procrank_ring_header *hdr,
+                                     struct procrank_ring_slot *out) {
+    for (;;) {
+        uint64_t samples = __atomic_load_n(&hdr->samples, __ATOMIC_ACQUIRE);
+        struct procrank_ring_slot *slot;
+        uint64_t seq;
+
+        if (!samples)
+            return -1;
+
+        slot = procrank_ring_slot(hdr, samples - 1);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != 2 * samples)
+            continue;
+
+        memcpy(out, slot, hdr->slot_size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+}
+
+#endif
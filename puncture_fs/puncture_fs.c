@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,11 +28,16 @@
 #include <logwrap/logwrap.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 #include <utils/Log.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 #define MAX_IO_WRITE_CHUNK_SIZE 0x100000
+#define MAX_THREADS 16
+#define MAX_HOLE_SIZES 16
+/* ext4 reports its free chunks by buddy order up to 2^13 blocks. */
+#define MB_ORDERS 14
 
 #ifndef min
 #define min(a,b) ((a) < (b) ? (a) : (b))
@@ -38,13 +45,92 @@
 
 typedef unsigned long u64;
 
+/* The hole sizes to punch, picked at random by weight. */
+struct hole_profile {
+    int count;
+    u64 sizes[MAX_HOLE_SIZES];
+    u64 weights[MAX_HOLE_SIZES];  /* cumulative */
+    u64 average;
+};
+
+/* One writer: it lays out its share of the free space in its own pair of
+ * directories, which ext4 spreads over different block groups. */
+struct puncture_job {
+    pthread_t thread;
+    u64 total_size;
+    u64 total_hole_size;
+    const struct hole_profile *profile;
+    bool fast_fill;
+    unsigned int seed;
+    u64 first_file_id;
+    char stay_dir[FILENAME_MAX];
+    char delete_dir[FILENAME_MAX];
+    volatile u64 done;
+    bool ok;
+};
+
 static void usage(const char * const progname) {
     fprintf(stderr,
-            "Usage: %s [-s <seed>] -h <hole size in bytes> -t <total hole size in bytes> "
-            "path\n",
+            "Usage: %s [-s <seed>] [-f] [-j <threads>] [-r] "
+            "-h <hole size>[:<weight>][,...] -t <total hole size> path\n"
+            "  -h  size of the holes in bytes, or a list of sizes with relative\n"
+            "      weights, e.g. 4k:60,64k:30,1m:10 (k, m and g suffixes accepted)\n"
+            "  -t  total size of the holes in bytes\n"
+            "  -f  allocate the files with fallocate instead of writing them\n"
+            "  -j  number of parallel writers, each in its own directories (default 1)\n"
+            "  -r  only print the free space extent report of the filesystem\n",
             progname);
 }
 
+static u64 parse_size(const char *str, char **end) {
+    u64 size = strtoull(str, end, 10);
+
+    switch (**end) {
+        case 'g': case 'G':
+            size <<= 10;
+            /* fall through */
+        case 'm': case 'M':
+            size <<= 10;
+            /* fall through */
+        case 'k': case 'K':
+            size <<= 10;
+            (*end)++;
+            break;
+    }
+    return size;
+}
+
+static bool parse_hole_profile(const char *arg, struct hole_profile *profile) {
+    const char *p = arg;
+    u64 total_weight = 0, weighted = 0;
+
+    profile->count = 0;
+    while (*p) {
+        char *end;
+        u64 size = parse_size(p, &end);
+        u64 weight = 1;
+
+        if (*end == ':') {
+            weight = strtoull(end + 1, &end, 10);
+        }
+        if (size == 0 || weight == 0 || (*end && *end != ',') ||
+                profile->count == MAX_HOLE_SIZES) {
+            fprintf(stderr, "\nInvalid hole size: %s\n", arg);
+            return false;
+        }
+        total_weight += weight;
+        weighted += size * weight;
+        profile->sizes[profile->count] = size;
+        profile->weights[profile->count++] = total_weight;
+        p = *end ? end + 1 : end;
+    }
+    if (!profile->count) {
+        return false;
+    }
+    profile->average = weighted / total_weight;
+    return true;
+}
+
 static u64 get_free_space(const char * const path) {
     struct statvfs s;
 
@@ -57,31 +143,45 @@ static u64 get_free_space(const char * const path) {
     }
 }
 
-static u64 get_random_num(const u64 start, const u64 end) {
-    if (end - start <= 0)
+static u64 get_random_num(const u64 start, const u64 end, unsigned int *seed) {
+    if (end <= start)
         return start;
     assert(RAND_MAX >= 0x7FFFFFFF);
     if ((end - start) > 0x7FFFFFFF)
-        return start + (((u64)random() << 31) | (u64)random()) % (end - start);
-    return start + (random() % (end - start));
+        return start + (((u64)rand_r(seed) << 31) | (u64)rand_r(seed)) % (end - start);
+    return start + (rand_r(seed) % (end - start));
 }
 
 static char get_random_char() {
     return 'A' + random() % ('Z' - 'A');
 }
 
+static u64 get_random_hole_size(const struct hole_profile *profile, unsigned int *seed) {
+    u64 pick = get_random_num(0, profile->weights[profile->count - 1], seed);
+    int i = 0;
+
+    while (pick >= profile->weights[i]) {
+        ++i;
+    }
+    return profile->sizes[i];
+}
+
 static bool create_unique_file(const char * const dir_path, const u64 size,
                                const u64 id, char * const base,
-                               const u64 base_length) {
+                               const u64 base_length, const bool fast_fill,
+                               unsigned int *seed) {
     u64 length = 0;
     int fd;
     char file_path[FILENAME_MAX];
     bool ret = true;
 
-    base[random() % min(base_length, size)] = get_random_char();
+    if (size == 0) {
+        return true;
+    }
+    base[rand_r(seed) % min(base_length, size)] = 'A' + rand_r(seed) % ('Z' - 'A');
 
     sprintf(file_path, "%s/file_%lu", dir_path, id);
-    fd = open(file_path, O_WRONLY | O_CREAT | O_SYNC, 0777);
+    fd = open(file_path, O_WRONLY | O_CREAT | (fast_fill ? 0 : O_SYNC), 0777);
     if (fd < 0) {
         // We suppress ENOSPC erros as that is common as we approach the
         // last few MBs of the fs as we don't account for the size of the newly
@@ -91,6 +191,21 @@ static bool create_unique_file(const char * const dir_path, const u64 size,
         }
         return false;
     }
+    /* fallocate takes the blocks in one call without writing them, which
+     * ages the allocator the same way in a fraction of the time. */
+    if (fast_fill) {
+        if (fallocate(fd, 0, 0, size) == 0) {
+            goto done;
+        }
+        if (errno != EOPNOTSUPP) {
+            if (errno != 28) {
+                fprintf(stderr, "\nerrno: %d. Failed to allocate %lu bytes to %s\n",
+                        errno, size, file_path);
+            }
+            ret = false;
+            goto done;
+        }
+    }
     while (length + base_length < size) {
         if (write(fd, base, base_length) < 0) {
             if (errno != 28) {
@@ -136,57 +251,118 @@ static bool create_unique_dir(char *dir, const char * const root_path) {
     return true;
 }
 
-static bool puncture_fs (const char * const path, const u64 total_size,
-                         const u64 hole_size, const u64 total_hole_size) {
-    u64 increments = (hole_size * total_size) / total_hole_size;
-    u64 hole_max;
+static void *puncture_worker(void *arg) {
+    struct puncture_job *job = arg;
+    const struct hole_profile *profile = job->profile;
+    u64 increments = (profile->average * job->total_size) / job->total_hole_size;
+    u64 hole_max, hole_size;
     u64 starting_max = 0;
     u64 ending_max = increments;
-    char stay_dir[FILENAME_MAX], delete_dir[FILENAME_MAX];
-    char *rm_bin_argv[] = { "/system/bin/rm", "-rf", ""};
-    u64 file_id = 1;
+    u64 file_id = job->first_file_id;
     char *base_file_data;
     u64 i = 0;
 
-    if (!create_unique_dir(stay_dir, path) ||
-        !create_unique_dir(delete_dir, path)) {
-        return false;
-    }
-
     base_file_data = (char*) malloc(MAX_IO_WRITE_CHUNK_SIZE);
+    if (!base_file_data) {
+        job->ok = false;
+        job->done = job->total_size;
+        return NULL;
+    }
     for (i = 0; i < MAX_IO_WRITE_CHUNK_SIZE; ++i) {
-        base_file_data[i] = get_random_char();
+        base_file_data[i] = 'A' + rand_r(&job->seed) % ('Z' - 'A');
     }
-    fprintf(stderr, "\n");
-    while (ending_max <= total_size) {
-        fprintf(stderr, "\rSTAGE 1/2: %d%% Complete",
-                (int) (100.0 * starting_max / total_size));
-        hole_max = get_random_num(starting_max, ending_max);
+    while (ending_max <= job->total_size) {
+        job->done = starting_max;
+        hole_size = get_random_hole_size(profile, &job->seed);
+        hole_max = get_random_num(starting_max, ending_max, &job->seed);
 
-        create_unique_file(stay_dir,
+        create_unique_file(job->stay_dir,
                            hole_max - starting_max,
                            file_id++,
                            base_file_data,
-                           MAX_IO_WRITE_CHUNK_SIZE);
-        create_unique_file(delete_dir,
+                           MAX_IO_WRITE_CHUNK_SIZE,
+                           job->fast_fill,
+                           &job->seed);
+        create_unique_file(job->delete_dir,
                            hole_size,
                            file_id++,
                            base_file_data,
-                           MAX_IO_WRITE_CHUNK_SIZE);
+                           MAX_IO_WRITE_CHUNK_SIZE,
+                           job->fast_fill,
+                           &job->seed);
 
         starting_max = hole_max + hole_size;
         ending_max += increments;
     }
-    create_unique_file(stay_dir,
-                       (ending_max - increments - starting_max),
-                       file_id++,
-                       base_file_data,
-                       MAX_IO_WRITE_CHUNK_SIZE);
+    if (ending_max - increments > starting_max) {
+        create_unique_file(job->stay_dir,
+                           (ending_max - increments - starting_max),
+                           file_id++,
+                           base_file_data,
+                           MAX_IO_WRITE_CHUNK_SIZE,
+                           job->fast_fill,
+                           &job->seed);
+    }
+    free(base_file_data);
+    job->done = job->total_size;
+    job->ok = true;
+    return NULL;
+}
+
+static bool puncture_fs (const char * const path, const u64 total_size,
+                         const struct hole_profile *profile, const u64 total_hole_size,
+                         const bool fast_fill, const int num_threads) {
+    struct puncture_job jobs[MAX_THREADS];
+    char *rm_bin_argv[2 + MAX_THREADS] = { "/system/bin/rm", "-rf" };
+    bool finished;
+    int i;
+
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < num_threads; ++i) {
+        if (!create_unique_dir(jobs[i].stay_dir, path) ||
+            !create_unique_dir(jobs[i].delete_dir, path)) {
+            return false;
+        }
+        jobs[i].total_size = total_size / num_threads;
+        jobs[i].total_hole_size = total_hole_size / num_threads;
+        jobs[i].profile = profile;
+        jobs[i].fast_fill = fast_fill;
+        jobs[i].seed = random();
+        /* Far enough apart that the file names of the writers never meet. */
+        jobs[i].first_file_id = 1 + (u64)i * (ULONG_MAX / MAX_THREADS);
+        rm_bin_argv[2 + i] = jobs[i].delete_dir;
+    }
+
+    fprintf(stderr, "\n");
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(&jobs[i].thread, NULL, puncture_worker, &jobs[i]) != 0) {
+            fprintf(stderr, "\nFailed to create writer %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    do {
+        u64 done = 0;
+
+        finished = true;
+        for (i = 0; i < num_threads; ++i) {
+            done += jobs[i].done;
+            finished &= jobs[i].done == jobs[i].total_size;
+        }
+        fprintf(stderr, "\rSTAGE 1/2: %d%% Complete", (int) (100.0 * done / total_size));
+        if (!finished) {
+            sleep(1);
+        }
+    } while (!finished);
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(jobs[i].thread, NULL);
+        if (!jobs[i].ok) {
+            fprintf(stderr, "\nWriter %d failed\n", i);
+            return false;
+        }
+    }
     fprintf(stderr, "\rSTAGE 1/2: 100%% Complete\n");
     fprintf(stderr, "\rSTAGE 2/2: 0%% Complete");
-    free(base_file_data);
-    rm_bin_argv[2] = delete_dir;
-    if (android_fork_execvp_ext(ARRAY_SIZE(rm_bin_argv), rm_bin_argv,
+    if (android_fork_execvp_ext(2 + num_threads, rm_bin_argv,
                                 NULL, 1, LOG_KLOG, 0, NULL, NULL, 0) < 0) {
         fprintf(stderr, "\nFailed to delete %s\n", rm_bin_argv[2]);
         return false;
@@ -195,6 +371,76 @@ static bool puncture_fs (const char * const path, const u64 total_size,
     return true;
 }
 
+/* Prints the free space of an ext4 filesystem by extent size, from the
+ * buddy counts of its block groups in /proc/fs/ext4/<dev>/mb_groups. */
+static bool print_free_space_report(const char * const path) {
+    struct stat st;
+    struct statvfs vfs;
+    char sys_path[PATH_MAX], dev_path[PATH_MAX], mb_path[PATH_MAX];
+    char line[512];
+    unsigned long long orders[MB_ORDERS] = { 0 };
+    unsigned long long free_blocks = 0, free_extents = 0, groups = 0;
+    FILE *fp;
+    int i;
+
+    if (stat(path, &st) < 0 || statvfs(path, &vfs) < 0) {
+        fprintf(stderr, "\nerrno: %d. Failed to stat %s\n", errno, path);
+        return false;
+    }
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u",
+             major(st.st_dev), minor(st.st_dev));
+    if (!realpath(sys_path, dev_path)) {
+        fprintf(stderr, "\nerrno: %d. Failed to find the device of %s\n", errno, path);
+        return false;
+    }
+    snprintf(mb_path, sizeof(mb_path), "/proc/fs/ext4/%s/mb_groups", strrchr(dev_path, '/') + 1);
+    fp = fopen(mb_path, "r");
+    if (!fp) {
+        fprintf(stderr, "\nNo free space report for %s: %s is not readable "
+                "(the report needs ext4)\n", path, mb_path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long group_free, group_frags;
+        char *p;
+
+        /* #0    : 4342  3     32726 [ 0     1     1 ... ] */
+        if (sscanf(line, "#%*u : %llu %llu", &group_free, &group_frags) != 2 ||
+                !(p = strchr(line, '['))) {
+            continue;
+        }
+        free_blocks += group_free;
+        free_extents += group_frags;
+        groups++;
+        p++;
+        for (i = 0; i < MB_ORDERS; ++i) {
+            char *end;
+            unsigned long long count = strtoull(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            orders[i] += count;
+            p = end;
+        }
+    }
+    fclose(fp);
+
+    printf("Free space of %s: %llu blocks of %lu bytes in %llu extents over %llu groups",
+           path, free_blocks, vfs.f_bsize, free_extents, groups);
+    if (free_extents) {
+        printf(", %llu KB per extent on average",
+               free_blocks * vfs.f_bsize / free_extents / 1024);
+    }
+    printf("\n%12s %12s %8s\n", "chunk size", "chunks", "% free");
+    for (i = 0; i < MB_ORDERS; ++i) {
+        unsigned long long blocks = orders[i] << i;
+        printf("%10lluKB %12llu %7.2f%%\n", ((unsigned long long)vfs.f_bsize << i) / 1024,
+               orders[i], free_blocks ? 100.0 * blocks / free_blocks : 0.0);
+    }
+    return true;
+}
+
 int main (const int argc, char ** const argv) {
     int opt;
     int mandatory_opt;
@@ -202,29 +448,50 @@ int main (const int argc, char ** const argv) {
     int seed = time(NULL);
 
     u64 total_size = 0;
-    u64 hole_size = 0;
+    struct hole_profile profile;
     u64 total_hole_size = 0;
+    bool fast_fill = false;
+    bool report_only = false;
+    int num_threads = 1;
+    char *end;
 
     mandatory_opt = 2;
-    while ((opt = getopt(argc, argv, "s:h:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "s:h:t:fj:r")) != -1) {
         switch(opt) {
             case 's':
                 seed = atoi(optarg);
                 break;
             case 'h':
-                hole_size = atoll(optarg);
+                if (!parse_hole_profile(optarg, &profile)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
                 mandatory_opt--;
                 break;
             case 't':
-                total_hole_size = atoll(optarg);
+                total_hole_size = parse_size(optarg, &end);
                 mandatory_opt--;
                 break;
+            case 'f':
+                fast_fill = true;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads < 1 || num_threads > MAX_THREADS) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                report_only = true;
+                mandatory_opt = 0;
+                break;
             default:
                 usage(argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
-    if (mandatory_opt) {
+    if (mandatory_opt > 0) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -241,6 +508,10 @@ int main (const int argc, char ** const argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (report_only) {
+        return print_free_space_report(path) ? 0 : EXIT_FAILURE;
+    }
+
     srandom(seed);
     fprintf(stderr, "\nRandom seed is: %d\n", seed);
 
@@ -248,15 +519,19 @@ int main (const int argc, char ** const argv) {
     if (!total_size) {
         exit(EXIT_FAILURE);
     }
-    if (total_size < total_hole_size || total_hole_size < hole_size) {
+    if (total_size < total_hole_size || total_hole_size < profile.average * num_threads) {
         fprintf(stderr, "\nInvalid sizes: total available size should be "
                         "larger than total hole size which is larger than "
-                        "hole size\n");
+                        "hole size (times the number of writers)\n");
         exit(EXIT_FAILURE);
     }
 
-    if (!puncture_fs(path, total_size, hole_size, total_hole_size)) {
+    if (!puncture_fs(path, total_size, &profile, total_hole_size, fast_fill, num_threads)) {
         exit(EXIT_FAILURE);
     }
+    /* ext4 only returns the blocks of the deleted files to the allocator
+     * once their transaction commits. */
+    sync();
+    print_free_space_report(path);
     return 0;
 }
@@ -18,15 +18,23 @@
 /* Opens /proc/sched_stat and diff's the counters.
    Currently support version 15, modify parse() to support other
    versions
+
+   With -p, samples /proc/<pid>/task/<tid>/schedstat of the threads of
+   processes instead and prints the percentiles of their run delays.
 */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <time.h>
 
 #define MAX_CPU 2
 
@@ -138,10 +146,356 @@ static int parse(const char *b) {
     return 0;
 }
 
+/*
+ * Run delays by task. The histograms have buckets of the same relative
+ * width: values below SUB_BUCKETS ns have a bucket each, and every power of
+ * two above is split in SUB_BUCKETS buckets, so percentiles are within 7%.
+ */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+/* Delays of 2^MAX_EXPONENT ns (about 18 minutes) and more share the last
+ * bucket. */
+#define MAX_EXPONENT 40
+#define NUM_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+#define MAX_PIDS 16
+
+struct histogram {
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+    unsigned int buckets[NUM_BUCKETS];
+};
+
+struct task {
+    pid_t tid;
+    int fd;  /* schedstat, kept open between samples; -1 once the task exited */
+    char comm[16];
+    unsigned long long run_delay;
+    unsigned long pcount;
+    struct histogram hist;
+};
+
+struct proc {
+    pid_t pid;
+    char comm[16];
+    struct task *tasks;
+    int num_tasks;
+    int max_tasks;
+    struct histogram hist;
+};
+
+static struct proc procs[MAX_PIDS];
+static int num_procs;
+static volatile sig_atomic_t stop;
+
+static int bucket_index(unsigned long long value) {
+    int exponent, shift;
+
+    if (value < SUB_BUCKETS)
+        return value;
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent >= MAX_EXPONENT)
+        return NUM_BUCKETS - 1;
+    shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+static unsigned long long bucket_max(int index) {
+    int shift;
+
+    if (index < SUB_BUCKETS)
+        return index;
+    shift = index / SUB_BUCKETS - 1;
+    return ((unsigned long long)(SUB_BUCKETS + index % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void hist_add(struct histogram *h, unsigned long long value, unsigned long count) {
+    h->buckets[bucket_index(value)] += count;
+    h->count += count;
+    h->total += value * count;
+    if (value > h->max)
+        h->max = value;
+}
+
+static unsigned long long hist_percentile(const struct histogram *h, double fraction) {
+    unsigned long long target = h->count * fraction;
+    unsigned long long seen = 0;
+    int i;
+
+    for (i = 0; i < NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target)
+            return bucket_max(i) < h->max ? bucket_max(i) : h->max;
+    }
+    return h->max;
+}
+
+static void read_comm(const char *path, char *comm, size_t size) {
+    int fd = open(path, O_RDONLY);
+    ssize_t len = 0;
+
+    if (fd >= 0) {
+        len = read(fd, comm, size - 1);
+        close(fd);
+    }
+    if (len < 0)
+        len = 0;
+    comm[len] = '\0';
+    comm[strcspn(comm, "\n")] = '\0';
+}
+
+/* Reads "<cpu time> <run delay> <timeslices>" with the fd already open. */
+static int read_task_schedstat(int fd, unsigned long long *run_delay, unsigned long *pcount) {
+    char buf[128];
+    char *p;
+    ssize_t len;
+
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+    strtoull(buf, &p, 10);
+    *run_delay = strtoull(p, &p, 10);
+    *pcount = strtoul(p, NULL, 10);
+    return 0;
+}
+
+/* Opens the schedstat of the threads that are new since the last scan. */
+static void scan_tasks(struct proc *proc) {
+    char path[64];
+    DIR *dir;
+    struct dirent *de;
+    struct task *task;
+    pid_t tid;
+    int i;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", proc->pid);
+    dir = opendir(path);
+    if (!dir)
+        return;
+    while ((de = readdir(dir))) {
+        if (!isdigit(de->d_name[0]))
+            continue;
+        tid = atoi(de->d_name);
+        for (i = 0; i < proc->num_tasks && proc->tasks[i].tid != tid; i++)
+            ;
+        if (i < proc->num_tasks)
+            continue;
+
+        if (proc->num_tasks == proc->max_tasks) {
+            int max_tasks = proc->max_tasks ? proc->max_tasks * 2 : 32;
+            struct task *tasks = realloc(proc->tasks, max_tasks * sizeof(*tasks));
+            if (!tasks)
+                break;
+            proc->tasks = tasks;
+            proc->max_tasks = max_tasks;
+        }
+        task = &proc->tasks[proc->num_tasks];
+        memset(task, 0, sizeof(*task));
+        task->tid = tid;
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/schedstat", proc->pid, tid);
+        task->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (task->fd < 0 || read_task_schedstat(task->fd, &task->run_delay, &task->pcount)) {
+            if (task->fd >= 0)
+                close(task->fd);
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", proc->pid, tid);
+        read_comm(path, task->comm, sizeof(task->comm));
+        proc->num_tasks++;
+    }
+    closedir(dir);
+}
+
+/*
+ * Adds the run delay of each thread since the last sample. The kernel only
+ * has the total, so the delay of the timeslices that started in a sample
+ * is their average: with samples shorter than timeslices, most have one.
+ */
+static void sample_tasks(struct proc *proc) {
+    unsigned long long run_delay;
+    unsigned long pcount;
+    struct task *task;
+    int i;
+
+    for (i = 0; i < proc->num_tasks; i++) {
+        task = &proc->tasks[i];
+        if (task->fd < 0)
+            continue;
+        if (read_task_schedstat(task->fd, &run_delay, &pcount)) {
+            close(task->fd);
+            task->fd = -1;
+            continue;
+        }
+        if (pcount > task->pcount) {
+            unsigned long slices = pcount - task->pcount;
+            unsigned long long delay = (run_delay - task->run_delay) / slices;
+            hist_add(&task->hist, delay, slices);
+            hist_add(&proc->hist, delay, slices);
+        }
+        task->run_delay = run_delay;
+        task->pcount = pcount;
+    }
+}
+
+static void print_hist(pid_t tid, const char *comm, const struct histogram *h) {
+    printf("%7d %-16s %8llu %9llu %9llu %9llu %9llu %9llu\n", tid, comm, h->count,
+           h->count ? h->total / h->count / 1000 : 0,
+           hist_percentile(h, 0.5) / 1000, hist_percentile(h, 0.9) / 1000,
+           hist_percentile(h, 0.99) / 1000, h->max / 1000);
+}
+
+static int task_cmp(const void *a, const void *b) {
+    const struct task *ta = a, *tb = b;
+    unsigned long long pa = hist_percentile(&ta->hist, 0.99);
+    unsigned long long pb = hist_percentile(&tb->hist, 0.99);
+
+    return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+/* Prints the threads with the worst p99, resets the histograms and drops
+ * the threads that exited. */
+static void print_tasks(int max_threads) {
+    struct proc *proc;
+    int i, j, n;
+
+    for (i = 0; i < num_procs; i++) {
+        proc = &procs[i];
+        qsort(proc->tasks, proc->num_tasks, sizeof(*proc->tasks), task_cmp);
+        printf("\nPID %d (%s): %d threads\n", proc->pid, proc->comm, proc->num_tasks);
+        printf("%7s %-16s %8s %9s %9s %9s %9s %9s\n", "TID", "COMM", "waits", "avg(us)",
+               "p50(us)", "p90(us)", "p99(us)", "max(us)");
+        print_hist(proc->pid, "(all)", &proc->hist);
+        for (j = 0; j < proc->num_tasks && (!max_threads || j < max_threads); j++) {
+            if (proc->tasks[j].hist.count)
+                print_hist(proc->tasks[j].tid, proc->tasks[j].comm, &proc->tasks[j].hist);
+        }
+
+        memset(&proc->hist, 0, sizeof(proc->hist));
+        for (j = n = 0; j < proc->num_tasks; j++) {
+            if (proc->tasks[j].fd < 0)
+                continue;
+            memset(&proc->tasks[j].hist, 0, sizeof(proc->tasks[j].hist));
+            proc->tasks[n++] = proc->tasks[j];
+        }
+        proc->num_tasks = n;
+    }
+    fflush(stdout);
+}
+
+static void signal_handler(int sig) {
+    stop = 1;
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Samples the threads every interval_ms and prints their histograms every
+ * report_ms, count times or until interrupted. New threads are picked up
+ * at each report.
+ */
+static int run_tasks(long interval_ms, long report_ms, int count, int max_threads) {
+    struct timespec next, report;
+    char path[64];
+    int i, reports = 0;
+
+    for (i = 0; i < num_procs; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/comm", procs[i].pid);
+        read_comm(path, procs[i].comm, sizeof(procs[i].comm));
+        scan_tasks(&procs[i]);
+        if (!procs[i].num_tasks) {
+            fprintf(stderr, "Could not read the threads of %d\n", procs[i].pid);
+            return -1;
+        }
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    report = next;
+    timespec_add_ms(&report, report_ms);
+    while (!stop) {
+        timespec_add_ms(&next, interval_ms);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        for (i = 0; i < num_procs; i++)
+            sample_tasks(&procs[i]);
+
+        if (next.tv_sec > report.tv_sec ||
+                (next.tv_sec == report.tv_sec && next.tv_nsec >= report.tv_nsec)) {
+            print_tasks(max_threads);
+            if (count && ++reports >= count)
+                return 0;
+            for (i = 0; i < num_procs; i++)
+                scan_tasks(&procs[i]);
+            timespec_add_ms(&report, report_ms);
+        }
+    }
+    print_tasks(max_threads);
+    return 0;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr, "Usage: %s [ -p pid [ -p pid ... ] [ -i ms ] [ -r ms ] [ -n count ] [ -m threads ] ]\n"
+                    "    Without -p, prints the scheduler statistics of each cpu every second.\n"
+                    "    -p pid      Sample the run delay of the threads of pid (up to %d).\n"
+                    "    -i ms       Sampling interval (default 10).\n"
+                    "    -r ms       Report interval (default 5000).\n"
+                    "    -n count    Number of reports (default 0 = until interrupted).\n"
+                    "    -m threads  Threads to show per process, worst p99 first (default 10, 0 = all).\n",
+            cmd, MAX_PIDS);
+}
+
 int main(int argc, char **argv) {
     int i;
     int fd;
     char buf[4096];
+    long interval_ms = 10, report_ms = 5000;
+    int count = 0, max_threads = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hi:m:n:p:r:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atol(optarg);
+            break;
+        case 'm':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            if (num_procs == MAX_PIDS) {
+                fprintf(stderr, "At most %d processes\n", MAX_PIDS);
+                return -1;
+            }
+            procs[num_procs++].pid = atoi(optarg);
+            break;
+        case 'r':
+            report_ms = atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (interval_ms <= 0 || report_ms < interval_ms) {
+        fprintf(stderr, "The report interval should be at least the sampling interval\n");
+        return -1;
+    }
+    if (num_procs)
+        return run_tasks(interval_ms, report_ms, count, max_threads);
 
     while (1) {
         fd = open("/proc/schedstat", O_RDONLY);
@@ -8,6 +8,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 struct mapinfo {
     mapinfo *next;
     unsigned start;
@@ -36,6 +41,40 @@ static int is_library(const char *name) {
             && name[len - 3] == '.' && name[len - 2] == 's' && name[len - 1] == 'o';
 }
 
+// smaps is read whole and split into lines in place, and the lines are
+// tokenized by hand: with sscanf, parsing took most of showmap's time.
+
+static bool is_hex(char c) {
+    return isdigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static const char* parse_hex(const char* p, unsigned long* value) {
+    unsigned long v = 0;
+
+    for (; is_hex(*p); p++) {
+        v = (v << 4) | (isdigit(*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+    }
+    *value = v;
+    return p;
+}
+
+static const char* skip_spaces(const char* p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+// Skips a field and the spaces after it. Returns NULL if the field is empty.
+static const char* skip_field(const char* p) {
+    const char* end = p;
+
+    while (*end && *end != ' ' && *end != '\t') {
+        end++;
+    }
+    return end == p ? NULL : skip_spaces(end);
+}
+
 // 6f000000-6f01e000 rwxp 00000000 00:0c 16389419   /android/lib/libcomposer.so
 // 012345678901234567890123456789012345678901234567890123456789
 // 0         1         2         3         4         5
@@ -44,20 +83,32 @@ static int parse_header(const char* line, const mapinfo* prev, mapinfo** mi) {
     unsigned long start;
     unsigned long end;
     char name[128];
-    int name_pos;
+    const char* p;
     int is_bss = 0;
 
-    if (sscanf(line, "%lx-%lx %*s %*x %*x:%*x %*d%n", &start, &end, &name_pos) != 2) {
-        *mi = NULL;
+    *mi = NULL;
+
+    p = parse_hex(line, &start);
+    if (p == line || *p != '-') {
+        return -1;
+    }
+    line = p + 1;
+    p = parse_hex(line, &end);
+    if (p == line || (*p != ' ' && *p != '\t')) {
         return -1;
     }
 
-    while (isspace(line[name_pos])) {
-        name_pos += 1;
+    // Permissions, offset, device and inode.
+    p = skip_spaces(p);
+    for (int i = 0; i < 4 && p; i++) {
+        p = skip_field(p);
+    }
+    if (!p) {
+        return -1;
     }
 
-    if (line[name_pos]) {
-        strlcpy(name, line + name_pos, sizeof(name));
+    if (*p) {
+        strlcpy(name, p, sizeof(name));
     } else {
         if (prev && start == prev->end && is_library(prev->name)) {
             // anonymous mappings immediately adjacent to shared libraries
@@ -87,56 +138,90 @@ static int parse_header(const char* line, const mapinfo* prev, mapinfo** mi) {
     return 0;
 }
 
+#define FIELD(name) name ":", sizeof(name ":") - 1
+
 static int parse_field(mapinfo* mi, const char* line) {
-    char field[64];
-    int len;
-
-    if (sscanf(line, "%63s %n", field, &len) == 1
-            && *field && field[strlen(field) - 1] == ':') {
-        int size;
-        if (sscanf(line + len, "%d kB", &size) == 1) {
-            if (!strcmp(field, "Size:")) {
-                mi->size = size;
-            } else if (!strcmp(field, "Rss:")) {
-                mi->rss = size;
-            } else if (!strcmp(field, "Pss:")) {
-                mi->pss = size;
-            } else if (!strcmp(field, "Shared_Clean:")) {
-                mi->shared_clean = size;
-            } else if (!strcmp(field, "Shared_Dirty:")) {
-                mi->shared_dirty = size;
-            } else if (!strcmp(field, "Private_Clean:")) {
-                mi->private_clean = size;
-            } else if (!strcmp(field, "Private_Dirty:")) {
-                mi->private_dirty = size;
-            } else if (!strcmp(field, "Swap:")) {
-                mi->swap = size;
-            }
-        }
+    const char* colon = line;
+
+    while (*colon && *colon != ' ' && *colon != '\t' && *colon != ':') {
+        colon++;
+    }
+    if (*colon != ':' || colon == line) {
+        return -1;
+    }
+    if (colon[1] && colon[1] != ' ' && colon[1] != '\t') {
+        return -1;
+    }
+
+    const char* p = skip_spaces(colon + 1);
+    if (!isdigit(*p)) {
         return 0;
     }
-    return -1;
-}
+    unsigned size = 0;
+    for (; isdigit(*p); p++) {
+        size = size * 10 + *p - '0';
+    }
 
-static int order_before(const mapinfo *a, const mapinfo *b, int sort_by_address) {
-    if (sort_by_address) {
-        return a->start < b->start
-                || (a->start == b->start && a->end < b->end);
-    } else {
-        return strcmp(a->name, b->name) < 0;
+    size_t len = colon + 1 - line;
+    unsigned* value = NULL;
+    switch (line[0]) {
+    case 'S':
+        if (len == sizeof("Size:") - 1 && !memcmp(line, FIELD("Size"))) {
+            value = &mi->size;
+        } else if (len == sizeof("Swap:") - 1 && !memcmp(line, FIELD("Swap"))) {
+            value = &mi->swap;
+        } else if (len == sizeof("Shared_Clean:") - 1 && !memcmp(line, FIELD("Shared_Clean"))) {
+            value = &mi->shared_clean;
+        } else if (len == sizeof("Shared_Dirty:") - 1 && !memcmp(line, FIELD("Shared_Dirty"))) {
+            value = &mi->shared_dirty;
+        }
+        break;
+    case 'R':
+        if (len == sizeof("Rss:") - 1 && !memcmp(line, FIELD("Rss"))) {
+            value = &mi->rss;
+        }
+        break;
+    case 'P':
+        if (len == sizeof("Pss:") - 1 && !memcmp(line, FIELD("Pss"))) {
+            value = &mi->pss;
+        } else if (len == sizeof("Private_Clean:") - 1 && !memcmp(line, FIELD("Private_Clean"))) {
+            value = &mi->private_clean;
+        } else if (len == sizeof("Private_Dirty:") - 1 && !memcmp(line, FIELD("Private_Dirty"))) {
+            value = &mi->private_dirty;
+        }
+        break;
+    }
+    if (value) {
+        *value = size;
     }
+    return 0;
+}
+
+static bool order_by_address(const mapinfo *a, const mapinfo *b) {
+    return a->start < b->start
+            || (a->start == b->start && a->end < b->end);
+}
+
+static bool order_by_name(const mapinfo *a, const mapinfo *b) {
+    return strcmp(a->name, b->name) < 0;
 }
 
-static void enqueue_map(mapinfo **head, mapinfo *map, int sort_by_address, int coalesce_by_name) {
-    mapinfo *prev = NULL;
-    mapinfo *current = *head;
+// Maps are coalesced through a hash table from name to the first map of
+// that name, and sorted once they have all been read.
+struct map_list {
+    std::vector<mapinfo*> maps;
+    std::unordered_map<std::string, mapinfo*> by_name;
+};
 
+static void enqueue_map(map_list *list, mapinfo *map, int coalesce_by_name) {
     if (!map) {
         return;
     }
 
-    for (;;) {
-        if (current && coalesce_by_name && !strcmp(map->name, current->name)) {
+    if (coalesce_by_name) {
+        auto inserted = list->by_name.emplace(map->name, map);
+        if (!inserted.second) {
+            mapinfo *current = inserted.first->second;
             current->size += map->size;
             current->rss += map->rss;
             current->pss += map->pss;
@@ -148,44 +233,71 @@ static void enqueue_map(mapinfo **head, mapinfo *map, int sort_by_address, int c
             current->is_bss &= map->is_bss;
             current->count++;
             free(map);
-            break;
+            return;
         }
+    }
 
-        if (!current || order_before(map, current, sort_by_address)) {
-            if (prev) {
-                prev->next = map;
-            } else {
-                *head = map;
+    list->maps.push_back(map);
+}
+
+static char *read_file(int fd) {
+    size_t size = 64 * 1024;
+    size_t len = 0;
+    char *data = reinterpret_cast<char*>(malloc(size));
+
+    while (data) {
+        if (len == size - 1) {
+            size *= 2;
+            char *new_data = reinterpret_cast<char*>(realloc(data, size));
+            if (!new_data) {
+                break;
             }
-            map->next = current;
-            break;
+            data = new_data;
         }
 
-        prev = current;
-        current = current->next;
+        ssize_t ret = TEMP_FAILURE_RETRY(read(fd, data + len, size - 1 - len));
+        if (ret <= 0) {
+            if (ret == 0) {
+                data[len] = 0;
+                return data;
+            }
+            break;
+        }
+        len += ret;
     }
+
+    free(data);
+    return NULL;
 }
 
 static mapinfo *load_maps(int pid, int sort_by_address, int coalesce_by_name)
 {
     char fn[128];
-    FILE *fp;
-    char line[1024];
-    mapinfo *head = NULL;
+    int fd;
+    char *data;
+    map_list list;
     mapinfo *current = NULL;
-    int len;
 
     snprintf(fn, sizeof(fn), "/proc/%d/smaps", pid);
-    fp = fopen(fn, "r");
-    if (fp == 0) {
+    fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         if (!quiet) fprintf(stderr, "cannot open /proc/%d/smaps: %s\n", pid, strerror(errno));
         return NULL;
     }
 
-    while (fgets(line, sizeof(line), fp) != 0) {
-        len = strlen(line);
-        if (line[len - 1] == '\n') {
-            line[--len] = 0;
+    data = read_file(fd);
+    close(fd);
+    if (!data) {
+        if (!quiet) fprintf(stderr, "could not read /proc/%d/smaps\n", pid);
+        return NULL;
+    }
+
+    for (char *line = data, *next_line; *line; line = next_line) {
+        next_line = strchr(line, '\n');
+        if (next_line) {
+            *next_line++ = 0;
+        } else {
+            next_line = line + strlen(line);
         }
 
         if (current != NULL && !parse_field(current, line)) {
@@ -194,7 +306,7 @@ static mapinfo *load_maps(int pid, int sort_by_address, int coalesce_by_name)
 
         mapinfo *next;
         if (!parse_header(line, current, &next)) {
-            enqueue_map(&head, current, sort_by_address, coalesce_by_name);
+            enqueue_map(&list, current, coalesce_by_name);
             current = next;
             continue;
         }
@@ -202,16 +314,24 @@ static mapinfo *load_maps(int pid, int sort_by_address, int coalesce_by_name)
         fprintf(stderr, "warning: could not parse map info line: %s\n", line);
     }
 
-    enqueue_map(&head, current, sort_by_address, coalesce_by_name);
+    enqueue_map(&list, current, coalesce_by_name);
 
-    fclose(fp);
+    free(data);
 
-    if (!head) {
+    if (list.maps.empty()) {
         if (!quiet) fprintf(stderr, "could not read /proc/%d/smaps\n", pid);
         return NULL;
     }
 
-    return head;
+    std::stable_sort(list.maps.begin(), list.maps.end(),
+                     sort_by_address ? order_by_address : order_by_name);
+
+    for (size_t i = 0; i + 1 < list.maps.size(); i++) {
+        list.maps[i]->next = list.maps[i + 1];
+    }
+    list.maps.back()->next = NULL;
+
+    return list.maps.front();
 }
 
 static void print_header()
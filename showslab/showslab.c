@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <ctype.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <time.h>
 
 #define STRINGIFY_ARG(a)        #a
 #define STRINGIFY(a)            STRINGIFY_ARG(a)
@@ -43,9 +45,66 @@ struct slab_stat {
 	unsigned long max_obj_size;	/* size of largest object */
 };
 
+/* state of a cache across the samples of the delta mode */
+struct slab_track {
+	char name[SLABINFO_NAME_LEN];	/* name of this cache */
+	unsigned long first_active_objs;	/* active objects at the first sample */
+	unsigned long prev_active_objs;	/* active objects at the previous sample */
+	unsigned long nr_active_objs;	/* active objects now */
+	unsigned long obj_size;		/* size of each object */
+	unsigned long size;		/* cache size in bytes */
+	int seen;			/* found in the last sample */
+};
+
 typedef int (*sort_t)(const struct slab_info *, const struct slab_info *);
 static sort_t sort_func;
 
+/*
+ * parse_slabinfo_line - parse one cache line of slabinfo into p.
+ * Returns zero on success.
+ */
+static int parse_slabinfo_line(const char *line, struct slab_info *p,
+			       unsigned long *nr_active_slabs)
+{
+	unsigned long pages_per_slab;
+	int ret;
+
+	ret = sscanf(line, "%" STRINGIFY(SLABINFO_NAME_LEN) "s"
+		     " %lu %lu %lu %lu %lu : tunables %*d %*d %*d : \
+		     slabdata %lu %lu %*d", p->name,
+		     &p->nr_active_objs, &p->nr_objs,
+		     &p->obj_size, &p->objs_per_slab,
+		     &pages_per_slab,
+		     nr_active_slabs,
+		     &p->nr_slabs);
+	if (ret != 8)
+		return -1;
+
+	p->nr_pages = p->nr_slabs * pages_per_slab;
+	p->use = p->nr_objs ? 100 * p->nr_active_objs / p->nr_objs : 0;
+	return 0;
+}
+
+/*
+ * check_slabinfo_version - check the first line of a slabinfo file.
+ * Returns zero if it is 2.0 or 2.1.
+ */
+static int check_slabinfo_version(const char *line)
+{
+	unsigned int major, minor;
+
+	if (sscanf(line, "slabinfo - version: %u.%u", &major, &minor) != 2) {
+		fprintf(stderr, "unable to parse slabinfo version!\n");
+		return -1;
+	}
+
+	if (major != 2 || minor > 1) {
+		fprintf(stderr, "we only support slabinfo 2.0 and 2.1!\n");
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * get_slabinfo - open, read, and parse a slabinfo 2.x file, which has the
  * following format:
@@ -62,7 +121,6 @@ static struct slab_info * get_slabinfo(struct slab_stat *stats)
 	struct slab_info *head = NULL, *p = NULL, *prev = NULL;
 	FILE *slabfile;
 	char line[SLABINFO_LINE_LEN];
-	unsigned int major, minor;
 
 	slabfile = fopen(SLABINFO_FILE, "r");
 	if (!slabfile) {
@@ -75,21 +133,13 @@ static struct slab_info * get_slabinfo(struct slab_stat *stats)
 		return NULL;
 	}
 
-	if (sscanf(line, "slabinfo - version: %u.%u", &major, &minor) != 2) {
-		fprintf(stderr, "unable to parse slabinfo version!\n");
+	if (check_slabinfo_version(line))
 		return NULL;
-	}
-
-	if (major != 2 || minor > 1) {
-		fprintf(stderr, "we only support slabinfo 2.0 and 2.1!\n");
-		return NULL;
-	}
 
 	stats->min_obj_size = INT_MAX;
 
 	while (fgets(line, SLABINFO_LINE_LEN, slabfile)) {
-		unsigned long nr_active_slabs, pages_per_slab;
-		int ret;
+		unsigned long nr_active_slabs;
 
 		if (line[0] == '#')
 			continue;
@@ -103,16 +153,7 @@ static struct slab_info * get_slabinfo(struct slab_stat *stats)
 		if (stats->nr_caches++ == 0)
 			head = prev = p;
 
-		ret = sscanf(line, "%" STRINGIFY(SLABINFO_NAME_LEN) "s"
-			     " %lu %lu %lu %lu %lu : tunables %*d %*d %*d : \
-			     slabdata %lu %lu %*d", p->name, 
-			     &p->nr_active_objs, &p->nr_objs, 
-			     &p->obj_size, &p->objs_per_slab,
-			     &pages_per_slab,
-			     &nr_active_slabs,
-			     &p->nr_slabs);
-
-		if (ret != 8) {
+		if (parse_slabinfo_line(line, p, &nr_active_slabs)) {
 			fprintf(stderr, "unrecognizable data in slabinfo!\n");
 			head = NULL;
 			break;
@@ -123,13 +164,8 @@ static struct slab_info * get_slabinfo(struct slab_stat *stats)
 		if (p->obj_size > stats->max_obj_size)
 			stats->max_obj_size = p->obj_size;
 
-		p->nr_pages = p->nr_slabs * pages_per_slab;
-
-		if (p->nr_objs) {
-			p->use = 100 * p->nr_active_objs / p->nr_objs;
+		if (p->nr_objs)
 			stats->nr_active_caches++;
-		} else
-			p->use = 0;
 
 		stats->nr_objs += p->nr_objs;
 		stats->nr_active_objs += p->nr_active_objs;
@@ -267,44 +303,314 @@ static sort_t set_sort_func(char key)
 	}
 }
 
+/*
+ * The delta mode keeps one slab_track per cache in an array that only
+ * grows when a new cache shows up, and the slabinfo file open with a read
+ * buffer that is reused, so that sampling does not allocate.
+ */
+static struct slab_track *tracks;
+static struct slab_track **sorted_tracks;	/* for printing, tracks stays in slabinfo order */
+static unsigned int nr_tracks, max_tracks;
+static char *read_buf;
+static size_t read_buf_size;
+
+/*
+ * find_track - return the tracked cache called name, adding it if new.
+ * Caches keep their order in slabinfo, so hint, the index of the cache in
+ * the previous sample, is usually right.
+ */
+static struct slab_track *find_track(const char *name, unsigned int hint)
+{
+	struct slab_track *t;
+	unsigned int i;
+
+	if (hint < nr_tracks && !strcmp(tracks[hint].name, name))
+		return &tracks[hint];
+	for (i = 0; i < nr_tracks; i++)
+		if (!strcmp(tracks[i].name, name))
+			return &tracks[i];
+
+	if (nr_tracks == max_tracks) {
+		unsigned int new_max = max_tracks ? max_tracks * 2 : 256;
+		struct slab_track **sorted;
+		t = realloc(tracks, new_max * sizeof(*t));
+		if (!t) {
+			perror("realloc");
+			return NULL;
+		}
+		tracks = t;
+		sorted = realloc(sorted_tracks, new_max * sizeof(*sorted));
+		if (!sorted) {
+			perror("realloc");
+			return NULL;
+		}
+		sorted_tracks = sorted;
+		max_tracks = new_max;
+	}
+	t = &tracks[nr_tracks++];
+	memset(t, 0, sizeof(*t));
+	strcpy(t->name, name);
+	return t;
+}
+
+/*
+ * read_slabinfo - read the whole file from fd into read_buf.
+ * Returns zero on success.
+ */
+static int read_slabinfo(int fd)
+{
+	size_t len = 0;
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		perror("lseek");
+		return -1;
+	}
+	while (1) {
+		if (len + SLABINFO_LINE_LEN >= read_buf_size) {
+			size_t new_size = read_buf_size ? read_buf_size * 2 : 65536;
+			char *buf = realloc(read_buf, new_size);
+			if (!buf) {
+				perror("realloc");
+				return -1;
+			}
+			read_buf = buf;
+			read_buf_size = new_size;
+		}
+		ret = read(fd, read_buf + len, read_buf_size - len - 1);
+		if (ret < 0) {
+			perror("read");
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	read_buf[len] = '\0';
+	return 0;
+}
+
+/*
+ * sample_slabinfo - update the tracked caches from a new sample.
+ * Returns zero on success.
+ */
+static int sample_slabinfo(int fd, unsigned long page_bytes, int first)
+{
+	struct slab_info info;
+	struct slab_track *t;
+	unsigned long nr_active_slabs;
+	unsigned int i, index = 0;
+	char *line, *next;
+
+	if (read_slabinfo(fd))
+		return -1;
+
+	line = read_buf;
+	next = strchr(line, '\n');
+	if (!next || check_slabinfo_version(line))
+		return -1;
+
+	for (i = 0; i < nr_tracks; i++)
+		tracks[i].seen = 0;
+
+	for (line = next + 1; *line; line = next + 1) {
+		next = strchr(line, '\n');
+		if (!next)
+			break;
+		if (line[0] == '#')
+			continue;
+		if (parse_slabinfo_line(line, &info, &nr_active_slabs)) {
+			fprintf(stderr, "unrecognizable data in slabinfo!\n");
+			return -1;
+		}
+
+		t = find_track(info.name, index++);
+		if (!t)
+			return -1;
+		/* a cache created after the first sample grew from nothing */
+		if (!t->seen && !t->obj_size && !first)
+			t->prev_active_objs = 0;
+		else
+			t->prev_active_objs = t->nr_active_objs;
+		t->nr_active_objs = info.nr_active_objs;
+		t->obj_size = info.obj_size;
+		t->size = info.nr_pages * page_bytes;
+		if (first) {
+			t->first_active_objs = t->nr_active_objs;
+			t->prev_active_objs = t->nr_active_objs;
+		}
+		t->seen = 1;
+	}
+	return 0;
+}
+
+/*
+ * track_growth - bytes of active objects gained since the first sample.
+ * Objects, rather than slabs, show a slow leak before it needs new pages.
+ */
+static long track_growth(const struct slab_track *t)
+{
+	return (long) (t->nr_active_objs - t->first_active_objs) * (long) t->obj_size;
+}
+
+static int track_cmp(const void *a, const void *b)
+{
+	const struct slab_track *ta = *(const struct slab_track **) a;
+	const struct slab_track *tb = *(const struct slab_track **) b;
+	long ga = track_growth(ta), gb = track_growth(tb);
+
+	return (ga < gb) ? 1 : (ga > gb) ? -1 : strcmp(ta->name, tb->name);
+}
+
+/*
+ * print_deltas - print the caches that grew the most since the first
+ * sample, with their net object rate over the last interval. slabinfo
+ * only has the objects in use, so frees cancel allocations in the rate.
+ */
+static void print_deltas(double elapsed, double interval, unsigned int nr_rows)
+{
+	long total_growth = 0, total_rate = 0;
+	unsigned int i, n;
+
+	/* Caches that went away are dropped. */
+	for (i = n = 0; i < nr_tracks; i++) {
+		if (!tracks[i].seen)
+			continue;
+		tracks[n] = tracks[i];
+		total_growth += track_growth(&tracks[n]);
+		total_rate += (long) (tracks[n].nr_active_objs - tracks[n].prev_active_objs);
+		sorted_tracks[n] = &tracks[n];
+		n++;
+	}
+	nr_tracks = n;
+	qsort(sorted_tracks, nr_tracks, sizeof(*sorted_tracks), track_cmp);
+
+	printf("\n%.1fs: %+.2fK since start, %+.1f objects/s\n", elapsed,
+	       total_growth / 1024.0, total_rate / interval);
+	printf("%8s %10s %10s %10s %10s %-23s\n",
+	       "ACTIVE", "OBJS/S", "OBJ GROWTH", "GROWTH", "CACHE SIZE", "NAME");
+	for (i = 0; i < nr_rows && i < nr_tracks; i++) {
+		const struct slab_track *t = sorted_tracks[i];
+		printf("%8lu %+10.1f %+10ld %+9.2fK %9.2fK %-23s\n",
+		       t->nr_active_objs,
+		       (long) (t->nr_active_objs - t->prev_active_objs) / interval,
+		       (long) (t->nr_active_objs - t->first_active_objs),
+		       track_growth(t) / 1024.0,
+		       t->size / 1024.0,
+		       t->name);
+	}
+	fflush(stdout);
+}
+
+/*
+ * run_deltas - sample slabinfo every interval seconds, count times or
+ * forever if count is zero, and print the growth of each cache.
+ */
+static int run_deltas(double interval, unsigned int count, unsigned int nr_rows)
+{
+	struct timespec start, next, now;
+	unsigned long page_bytes = getpagesize();
+	unsigned int i;
+	int fd;
+
+	fd = open(SLABINFO_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open");
+		return -1;
+	}
+	if (sample_slabinfo(fd, page_bytes, 1)) {
+		close(fd);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	for (i = 0; !count || i < count; i++) {
+		next.tv_sec += (time_t) interval;
+		next.tv_nsec += (long) ((interval - (time_t) interval) * 1e9);
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		if (sample_slabinfo(fd, page_bytes, 0)) {
+			close(fd);
+			return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		print_deltas(now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9,
+			     interval, nr_rows);
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [options]\n\n", cmd);
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -s S   specify sort criteria S\n");
+	fprintf(stderr, "  -n N   show N caches (default " STRINGIFY(DEF_NR_ROWS) ")\n");
+	fprintf(stderr, "  -d D   sample every D seconds and show the caches that\n"
+			"         grew the most since the first sample\n");
+	fprintf(stderr, "  -c C   stop after C samples with -d (default: never)\n");
+	fprintf(stderr, "  -h     display this help\n\n");
+	fprintf(stderr, "Valid sort criteria:\n");
+	fprintf(stderr, "  a: number of Active objects\n");
+	fprintf(stderr, "  c: Cache size\n");
+	fprintf(stderr, "  l: number of sLabs\n");
+	fprintf(stderr, "  n: Name\n");
+	fprintf(stderr, "  o: number of Objects\n");
+	fprintf(stderr, "  p: objects Per slab\n");
+	fprintf(stderr, "  s: object Size\n");
+	fprintf(stderr, "  u: cache Utilization\n");
+}
+
 int main(int argc, char *argv[])
 {
 	struct slab_info *list, *p;
 	struct slab_stat stats = { .nr_objs = 0 };
 	unsigned int page_size = getpagesize() / 1024, nr_rows = DEF_NR_ROWS, i;
+	unsigned int count = 0;
+	double interval = 0;
+	int opt;
 
 	sort_func = DEF_SORT_FUNC;
 
-	if (argc > 1) {
-		/* FIXME: Ugh. */
-		if (argc == 3 && !strcmp(argv[1], "-n")) {
+	while ((opt = getopt(argc, argv, "c:d:hn:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			count = (unsigned int) strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			interval = strtod(optarg, NULL);
+			if (interval <= 0) {
+				fprintf(stderr, "invalid interval %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
 			errno = 0;
-			nr_rows = (unsigned int) strtoul(argv[2], NULL, 0);
+			nr_rows = (unsigned int) strtoul(optarg, NULL, 0);
 			if (errno) {
 				perror("strtoul");
 				exit(EXIT_FAILURE);
 			}
-		}
-		else if (argc == 3 && !strcmp(argv[1], "-s"))
-			sort_func = set_sort_func(argv[2][0]) ? : DEF_SORT_FUNC;
-		else {
-			fprintf(stderr, "usage: %s [options]\n\n", argv[0]);
-			fprintf(stderr, "options:\n");
-			fprintf(stderr, "  -s S   specify sort criteria S\n");
-			fprintf(stderr, "  -h     display this help\n\n");
-			fprintf(stderr, "Valid sort criteria:\n");
-			fprintf(stderr, "  a: number of Active objects\n");
-			fprintf(stderr, "  c: Cache size\n");
-			fprintf(stderr, "  l: number of sLabs\n");
-			fprintf(stderr, "  n: Name\n");
-			fprintf(stderr, "  o: number of Objects\n");
-			fprintf(stderr, "  p: objects Per slab\n");
-			fprintf(stderr, "  s: object Size\n");
-			fprintf(stderr, "  u: cache Utilization\n");
+			break;
+		case 's':
+			sort_func = set_sort_func(optarg[0]) ? : DEF_SORT_FUNC;
+			break;
+		default:
+			usage(argv[0]);
 			exit(EXIT_FAILURE);
 		}
 	}
 
+	if (interval)
+		return run_deltas(interval, count, nr_rows) ? EXIT_FAILURE : EXIT_SUCCESS;
+
 	list = get_slabinfo (&stats);
 	if (!list)
 		exit(EXIT_FAILURE);
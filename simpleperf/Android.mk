@@ -69,7 +69,9 @@ simpleperf_ldlibs_host_linux := -lrt
 # libsimpleperf
 # =========================================================
 libsimpleperf_src_files := \
+  branch_aggregator.cpp \
   callchain.cpp \
+  cmd_build_index.cpp \
   cmd_dumprecord.cpp \
   cmd_help.cpp \
   cmd_report.cpp \
@@ -79,17 +81,21 @@ libsimpleperf_src_files := \
   event_type.cpp \
   perf_regs.cpp \
   read_apk.cpp \
+  read_dwarf.cpp \
   read_elf.cpp \
   record.cpp \
   record_file_reader.cpp \
   sample_tree.cpp \
   thread_tree.cpp \
+  tracing.cpp \
   utils.cpp \
 
 libsimpleperf_src_files_linux := \
+  cmd_filter.cpp \
   cmd_list.cpp \
   cmd_record.cpp \
   cmd_stat.cpp \
+  cmd_top.cpp \
   dwarf_unwind.cpp \
   environment.cpp \
   event_fd.cpp \
@@ -177,19 +183,25 @@ include $(BUILD_HOST_EXECUTABLE)
 # simpleperf_unit_test
 # =========================================================
 simpleperf_unit_test_src_files := \
+  branch_aggregator_test.cpp \
   cmd_report_test.cpp \
   command_test.cpp \
+  dso_test.cpp \
   gtest_main.cpp \
   read_apk_test.cpp \
+  read_dwarf_test.cpp \
   read_elf_test.cpp \
   record_test.cpp \
   sample_tree_test.cpp \
+  tracing_test.cpp \
 
 simpleperf_unit_test_src_files_linux := \
   cmd_dumprecord_test.cpp \
+  cmd_filter_test.cpp \
   cmd_list_test.cpp \
   cmd_record_test.cpp \
   cmd_stat_test.cpp \
+  cmd_top_test.cpp \
   environment_test.cpp \
   record_file_test.cpp \
   workload_test.cpp \
@@ -226,6 +238,38 @@ include $(LLVM_HOST_BUILD_MK)
 include $(BUILD_HOST_NATIVE_TEST)
 
 
+# simpleperf_benchmark
+# =========================================================
+simpleperf_benchmark_src_files := \
+  dso_benchmark.cpp \
+
+# simpleperf_benchmark target
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_MODULE := simpleperf_benchmark
+LOCAL_CPPFLAGS := $(simpleperf_cppflags_target)
+LOCAL_SRC_FILES := $(simpleperf_benchmark_src_files)
+LOCAL_STATIC_LIBRARIES := libsimpleperf $(simpleperf_static_libraries_target)
+LOCAL_SHARED_LIBRARIES := $(simpleperf_shared_libraries_target)
+LOCAL_MULTILIB := first
+include $(BUILD_NATIVE_BENCHMARK)
+
+# simpleperf_record_file_benchmark
+# =========================================================
+simpleperf_record_file_benchmark_src_files := \
+  record_file_benchmark.cpp \
+
+# simpleperf_record_file_benchmark target
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_MODULE := simpleperf_record_file_benchmark
+LOCAL_CPPFLAGS := $(simpleperf_cppflags_target)
+LOCAL_SRC_FILES := $(simpleperf_record_file_benchmark_src_files)
+LOCAL_STATIC_LIBRARIES := libsimpleperf $(simpleperf_static_libraries_target)
+LOCAL_SHARED_LIBRARIES := $(simpleperf_shared_libraries_target)
+LOCAL_MULTILIB := first
+include $(BUILD_NATIVE_BENCHMARK)
+
 # simpleperf_cpu_hotplug_test
 # =========================================================
 simpleperf_cpu_hotplug_test_src_files := \
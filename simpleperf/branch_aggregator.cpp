@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "branch_aggregator.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+// Bit of perf_branch_entry.mispred in BranchItem::flags.
+constexpr uint64_t BRANCH_FLAG_MISPREDICTED = 1;
+
+void BranchAggregator::AddBranchStack(const std::vector<BranchItem>& stack) {
+  for (size_t i = 0; i < stack.size(); ++i) {
+    const BranchItem& item = stack[i];
+    SymbolEdgeKey key;
+    key.from_dso = item.from_map->dso;
+    key.from_symbol = thread_tree_->FindSymbol(item.from_map, item.from_ip);
+    key.to_dso = item.to_map->dso;
+    key.to_symbol = thread_tree_->FindSymbol(item.to_map, item.to_ip);
+    SymbolEdgeCount& edge = symbol_edges_[key];
+    edge.count++;
+    if (item.flags & BRANCH_FLAG_MISPREDICTED) {
+      edge.mispredicted_count++;
+    }
+
+    // Address level counts are only meaningful for branches inside one binary.
+    if (item.from_map == item.to_map && item.from_map != thread_tree_->UnknownMap()) {
+      DsoBranchProfile& profile = dso_profiles_[item.from_map->dso];
+      uint64_t from = ThreadTree::GetVaddrInFile(item.from_map, item.from_ip);
+      uint64_t to = ThreadTree::GetVaddrInFile(item.to_map, item.to_ip);
+      profile.branch_counts[std::make_pair(from, to)]++;
+    }
+    // The code between the target of the older branch and the source of this branch is
+    // executed without a taken branch.
+    if (i + 1 < stack.size()) {
+      const BranchItem& older = stack[i + 1];
+      if (older.to_map == item.from_map && item.from_map != thread_tree_->UnknownMap() &&
+          older.to_ip <= item.from_ip) {
+        DsoBranchProfile& profile = dso_profiles_[item.from_map->dso];
+        uint64_t start = ThreadTree::GetVaddrInFile(item.from_map, older.to_ip);
+        uint64_t end = ThreadTree::GetVaddrInFile(item.from_map, item.from_ip);
+        profile.range_counts[std::make_pair(start, end)]++;
+      }
+    }
+  }
+}
+
+std::vector<SymbolEdge> BranchAggregator::GetSymbolEdges() const {
+  std::vector<SymbolEdge> edges;
+  edges.reserve(symbol_edges_.size());
+  for (auto& pair : symbol_edges_) {
+    const SymbolEdgeKey& key = pair.first;
+    edges.push_back(SymbolEdge{key.from_dso, key.from_symbol, key.to_dso, key.to_symbol,
+                               pair.second.count, pair.second.mispredicted_count});
+  }
+  std::sort(edges.begin(), edges.end(), [](const SymbolEdge& edge1, const SymbolEdge& edge2) {
+    if (edge1.count != edge2.count) {
+      return edge1.count > edge2.count;
+    }
+    // Break ties by names, so the order doesn't depend on addresses of symbols.
+    int result = strcmp(edge1.from_symbol->DemangledName(), edge2.from_symbol->DemangledName());
+    if (result != 0) {
+      return result < 0;
+    }
+    result = strcmp(edge1.to_symbol->DemangledName(), edge2.to_symbol->DemangledName());
+    if (result != 0) {
+      return result < 0;
+    }
+    if (edge1.from_dso->Path() != edge2.from_dso->Path()) {
+      return edge1.from_dso->Path() < edge2.from_dso->Path();
+    }
+    return edge1.to_dso->Path() < edge2.to_dso->Path();
+  });
+  return edges;
+}
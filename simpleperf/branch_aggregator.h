@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SIMPLE_PERF_BRANCH_AGGREGATOR_H_
+#define SIMPLE_PERF_BRANCH_AGGREGATOR_H_
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <android-base/macros.h>
+
+#include "thread_tree.h"
+
+// One taken branch in a branch stack sample.
+struct BranchItem {
+  uint64_t from_ip;
+  const MapEntry* from_map;
+  uint64_t to_ip;
+  const MapEntry* to_map;
+  uint64_t flags;  // Flags of perf_branch_entry.
+};
+
+// Taken branches between two symbols.
+struct SymbolEdge {
+  const Dso* from_dso;
+  const Symbol* from_symbol;
+  const Dso* to_dso;
+  const Symbol* to_symbol;
+  uint64_t count;
+  uint64_t mispredicted_count;
+};
+
+// Branch counts and executed address ranges in one binary. Addresses are virtual addresses in
+// the file, as used to look up symbols.
+struct DsoBranchProfile {
+  struct PairHash {
+    size_t operator()(const std::pair<uint64_t, uint64_t>& pair) const {
+      return pair.first * 31 + pair.second;
+    }
+  };
+  typedef std::unordered_map<std::pair<uint64_t, uint64_t>, uint64_t, PairHash> CountMap;
+
+  // [start, end] address ranges executed without a taken branch, that is, basic blocks
+  // ending at a branch source, and how many times they are executed.
+  CountMap range_counts;
+  // (from, to) addresses of taken branches, and how many times they are taken.
+  CountMap branch_counts;
+};
+
+// BranchAggregator aggregates branch stack (LBR) samples in dedicated hash tables, instead of
+// adding each branch as a SampleEntry. It counts taken branches between symbols, and the
+// branches and executed ranges of each binary, which is the input of feedback-directed
+// optimization tools like AutoFDO.
+class BranchAggregator {
+ public:
+  explicit BranchAggregator(ThreadTree* thread_tree) : thread_tree_(thread_tree) {
+  }
+
+  // Add the branch stack of one sample. Items are ordered from the most recent branch, as in
+  // PERF_SAMPLE_BRANCH_STACK.
+  void AddBranchStack(const std::vector<BranchItem>& stack);
+
+  // Return symbol edges sorted by count in descending order.
+  std::vector<SymbolEdge> GetSymbolEdges() const;
+
+  const std::unordered_map<const Dso*, DsoBranchProfile>& DsoProfiles() const {
+    return dso_profiles_;
+  }
+
+ private:
+  struct SymbolEdgeKey {
+    const Dso* from_dso;
+    const Symbol* from_symbol;
+    const Dso* to_dso;
+    const Symbol* to_symbol;
+
+    bool operator==(const SymbolEdgeKey& other) const {
+      return from_dso == other.from_dso && from_symbol == other.from_symbol &&
+             to_dso == other.to_dso && to_symbol == other.to_symbol;
+    }
+  };
+
+  struct SymbolEdgeKeyHash {
+    size_t operator()(const SymbolEdgeKey& key) const {
+      size_t hash = reinterpret_cast<uintptr_t>(key.from_dso);
+      hash = hash * 31 + reinterpret_cast<uintptr_t>(key.from_symbol);
+      hash = hash * 31 + reinterpret_cast<uintptr_t>(key.to_dso);
+      hash = hash * 31 + reinterpret_cast<uintptr_t>(key.to_symbol);
+      return hash;
+    }
+  };
+
+  struct SymbolEdgeCount {
+    uint64_t count;
+    uint64_t mispredicted_count;
+  };
+
+  ThreadTree* thread_tree_;
+  std::unordered_map<SymbolEdgeKey, SymbolEdgeCount, SymbolEdgeKeyHash> symbol_edges_;
+  std::unordered_map<const Dso*, DsoBranchProfile> dso_profiles_;
+
+  DISALLOW_COPY_AND_ASSIGN(BranchAggregator);
+};
+
+#endif  // SIMPLE_PERF_BRANCH_AGGREGATOR_H_
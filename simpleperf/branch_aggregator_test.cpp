@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "branch_aggregator.h"
+
+class BranchAggregatorTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    thread_tree.AddThread(1, 1, "p1");
+    thread_tree.AddThreadMap(1, 1, 0x1000, 0x1000, 0, 0, "branch_test_dso");
+    thread = thread_tree.FindThreadOrNew(1, 1);
+    map = thread_tree.FindMap(thread, 0x1000, false);
+    map->dso->SetSymbolsForTesting({Symbol("func1", 0x0, 0x100), Symbol("func2", 0x100, 0x100)});
+  }
+
+  BranchItem Branch(uint64_t from_ip, uint64_t to_ip, uint64_t flags = 0) {
+    return BranchItem{from_ip, map, to_ip, map, flags};
+  }
+
+  ThreadTree thread_tree;
+  const ThreadEntry* thread;
+  const MapEntry* map;
+};
+
+TEST_F(BranchAggregatorTest, symbol_edges) {
+  BranchAggregator aggregator(&thread_tree);
+  aggregator.AddBranchStack({Branch(0x1010, 0x1100), Branch(0x1110, 0x1000, 1)});
+  aggregator.AddBranchStack({Branch(0x1020, 0x1100)});
+  std::vector<SymbolEdge> edges = aggregator.GetSymbolEdges();
+  ASSERT_EQ(2u, edges.size());
+  ASSERT_STREQ("func1", edges[0].from_symbol->Name());
+  ASSERT_STREQ("func2", edges[0].to_symbol->Name());
+  ASSERT_EQ(2u, edges[0].count);
+  ASSERT_EQ(0u, edges[0].mispredicted_count);
+  ASSERT_STREQ("func2", edges[1].from_symbol->Name());
+  ASSERT_STREQ("func1", edges[1].to_symbol->Name());
+  ASSERT_EQ(1u, edges[1].count);
+  ASSERT_EQ(1u, edges[1].mispredicted_count);
+}
+
+TEST_F(BranchAggregatorTest, ranges_and_branches) {
+  BranchAggregator aggregator(&thread_tree);
+  // The most recent branch comes first. Code from the target of the older branch to the source
+  // of the newer one is executed as a range.
+  aggregator.AddBranchStack({Branch(0x1010, 0x1100), Branch(0x1110, 0x1000)});
+  aggregator.AddBranchStack({Branch(0x1110, 0x1000), Branch(0x1010, 0x1100)});
+  auto& profiles = aggregator.DsoProfiles();
+  ASSERT_EQ(1u, profiles.size());
+  const DsoBranchProfile& profile = profiles.begin()->second;
+  ASSERT_EQ(2u, profile.branch_counts.size());
+  ASSERT_EQ(2u, profile.branch_counts.at(std::make_pair(0x10, 0x100)));
+  ASSERT_EQ(2u, profile.branch_counts.at(std::make_pair(0x110, 0x0)));
+  ASSERT_EQ(2u, profile.range_counts.size());
+  ASSERT_EQ(1u, profile.range_counts.at(std::make_pair(0x0, 0x10)));
+  ASSERT_EQ(1u, profile.range_counts.at(std::make_pair(0x100, 0x110)));
+}
+
+TEST_F(BranchAggregatorTest, no_address_counts_for_unknown_map) {
+  BranchAggregator aggregator(&thread_tree);
+  const MapEntry* unknown_map = thread_tree.UnknownMap();
+  aggregator.AddBranchStack({BranchItem{0x5000, unknown_map, 0x6000, unknown_map, 0}});
+  ASSERT_TRUE(aggregator.DsoProfiles().empty());
+  ASSERT_EQ(1u, aggregator.GetSymbolEdges().size());
+}
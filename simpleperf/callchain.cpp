@@ -18,19 +18,58 @@
 
 #include <string.h>
 
+#include <algorithm>
 #include <queue>
 
 #include <android-base/logging.h>
 #include "sample_tree.h"
 
+static uint32_t GetNameHash(const SampleEntry* sample) {
+  // FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (const char* p = sample->symbol->Name(); *p != '\0'; ++p) {
+    hash = (hash ^ static_cast<unsigned char>(*p)) * 16777619u;
+  }
+  return hash;
+}
+
 static bool MatchSampleByName(const SampleEntry* sample1, const SampleEntry* sample2) {
-  return strcmp(sample1->symbol->Name(), sample2->symbol->Name()) == 0;
+  return sample1->symbol == sample2->symbol ||
+         strcmp(sample1->symbol->Name(), sample2->symbol->Name()) == 0;
+}
+
+CallChainNode* CallChainAllocator::AllocateNode() {
+  nodes_.emplace_back();
+  return &nodes_.back();
+}
+
+SampleEntry* const* CallChainAllocator::StoreChain(const std::vector<SampleEntry*>& chain,
+                                                   size_t start) {
+  size_t length = chain.size() - start;
+  if (length <= last_chain_length_ &&
+      std::equal(chain.begin() + start, chain.end(),
+                 last_chain_ + (last_chain_length_ - length))) {
+    return last_chain_ + (last_chain_length_ - length);
+  }
+  constexpr size_t CHAIN_CHUNK_SIZE = 4096;
+  if (static_cast<size_t>(chain_end_ - chain_cur_) < length) {
+    size_t chunk_size = std::max(CHAIN_CHUNK_SIZE, length);
+    chain_chunks_.emplace_back(new SampleEntry*[chunk_size]);
+    chain_cur_ = chain_chunks_.back().get();
+    chain_end_ = chain_cur_ + chunk_size;
+  }
+  SampleEntry** result = chain_cur_;
+  std::copy(chain.begin() + start, chain.end(), result);
+  chain_cur_ += length;
+  last_chain_ = result;
+  last_chain_length_ = length;
+  return result;
 }
 
 static size_t GetMatchingLengthInNode(const CallChainNode* node,
                                       const std::vector<SampleEntry*>& chain, size_t chain_start) {
   size_t i, j;
-  for (i = 0, j = chain_start; i < node->chain.size() && j < chain.size(); ++i, ++j) {
+  for (i = 0, j = chain_start; i < node->chain_length && j < chain.size(); ++i, ++j) {
     if (!MatchSampleByName(node->chain[i], chain[j])) {
       break;
     }
@@ -38,45 +77,51 @@ static size_t GetMatchingLengthInNode(const CallChainNode* node,
   return i;
 }
 
-static CallChainNode* FindMatchingNode(const std::vector<std::unique_ptr<CallChainNode>>& nodes,
+static CallChainNode* FindMatchingNode(const std::vector<CallChainNode*>& nodes,
                                        const SampleEntry* sample) {
+  uint32_t name_hash = GetNameHash(sample);
   for (auto& node : nodes) {
-    if (MatchSampleByName(node->chain.front(), sample)) {
-      return node.get();
+    if (node->name_hash == name_hash && MatchSampleByName(node->chain[0], sample)) {
+      return node;
     }
   }
   return nullptr;
 }
 
-static std::unique_ptr<CallChainNode> AllocateNode(const std::vector<SampleEntry*>& chain,
-                                                   size_t chain_start, uint64_t period,
-                                                   uint64_t children_period) {
-  std::unique_ptr<CallChainNode> node(new CallChainNode);
-  for (size_t i = chain_start; i < chain.size(); ++i) {
-    node->chain.push_back(chain[i]);
-  }
+static CallChainNode* AllocateNode(const std::vector<SampleEntry*>& chain, size_t chain_start,
+                                   uint64_t period, CallChainAllocator* allocator) {
+  CallChainNode* node = allocator->AllocateNode();
+  node->chain = allocator->StoreChain(chain, chain_start);
+  node->chain_length = chain.size() - chain_start;
+  node->name_hash = GetNameHash(node->chain[0]);
   node->period = period;
-  node->children_period = children_period;
+  node->children_period = 0;
   return node;
 }
 
-static void SplitNode(CallChainNode* parent, size_t parent_length) {
-  std::unique_ptr<CallChainNode> child =
-      AllocateNode(parent->chain, parent_length, parent->period, parent->children_period);
+static void SplitNode(CallChainNode* parent, size_t parent_length,
+                      CallChainAllocator* allocator) {
+  // The child takes the rest of the parent's path, so no samples are copied.
+  CallChainNode* child = allocator->AllocateNode();
+  child->chain = parent->chain + parent_length;
+  child->chain_length = parent->chain_length - parent_length;
+  child->name_hash = GetNameHash(child->chain[0]);
+  child->period = parent->period;
+  child->children_period = parent->children_period;
   child->children = std::move(parent->children);
   parent->period = 0;
   parent->children_period = child->period + child->children_period;
-  parent->chain.resize(parent_length);
+  parent->chain_length = parent_length;
   parent->children.clear();
-  parent->children.push_back(std::move(child));
+  parent->children.push_back(child);
 }
 
-void CallChainRoot::AddCallChain(const std::vector<SampleEntry*>& callchain, uint64_t period) {
+void CallChainRoot::AddCallChain(const std::vector<SampleEntry*>& callchain, uint64_t period,
+                                 CallChainAllocator* allocator) {
   children_period += period;
   CallChainNode* p = FindMatchingNode(children, callchain[0]);
   if (p == nullptr) {
-    std::unique_ptr<CallChainNode> new_node = AllocateNode(callchain, 0, period, 0);
-    children.push_back(std::move(new_node));
+    children.push_back(AllocateNode(callchain, 0, period, allocator));
     return;
   }
   size_t callchain_pos = 0;
@@ -85,8 +130,8 @@ void CallChainRoot::AddCallChain(const std::vector<SampleEntry*>& callchain, uin
     CHECK_GT(match_length, 0u);
     callchain_pos += match_length;
     bool find_child = true;
-    if (match_length < p->chain.size()) {
-      SplitNode(p, match_length);
+    if (match_length < p->chain_length) {
+      SplitNode(p, match_length, allocator);
       find_child = false;  // No need to find matching node in p->children.
     }
     if (callchain_pos == callchain.size()) {
@@ -101,24 +146,22 @@ void CallChainRoot::AddCallChain(const std::vector<SampleEntry*>& callchain, uin
         continue;
       }
     }
-    std::unique_ptr<CallChainNode> new_node = AllocateNode(callchain, callchain_pos, period, 0);
-    p->children.push_back(std::move(new_node));
+    p->children.push_back(AllocateNode(callchain, callchain_pos, period, allocator));
     break;
   }
 }
 
-static bool CompareNodeByPeriod(const std::unique_ptr<CallChainNode>& n1,
-                                const std::unique_ptr<CallChainNode>& n2) {
+static bool CompareNodeByPeriod(const CallChainNode* n1, const CallChainNode* n2) {
   uint64_t period1 = n1->period + n1->children_period;
   uint64_t period2 = n2->period + n2->children_period;
   return period1 > period2;
 }
 
 void CallChainRoot::SortByPeriod() {
-  std::queue<std::vector<std::unique_ptr<CallChainNode>>*> queue;
+  std::queue<std::vector<CallChainNode*>*> queue;
   queue.push(&children);
   while (!queue.empty()) {
-    std::vector<std::unique_ptr<CallChainNode>>* v = queue.front();
+    std::vector<CallChainNode*>* v = queue.front();
     queue.pop();
     std::sort(v->begin(), v->end(), CompareNodeByPeriod);
     for (auto& node : *v) {
@@ -17,26 +17,60 @@
 #ifndef SIMPLE_PERF_CALLCHAIN_H_
 #define SIMPLE_PERF_CALLCHAIN_H_
 
+#include <stdint.h>
+
+#include <deque>
 #include <memory>
 #include <vector>
 
+#include <android-base/macros.h>
+
 struct SampleEntry;
 
 struct CallChainNode {
   uint64_t period;
   uint64_t children_period;
-  std::vector<SampleEntry*> chain;
-  std::vector<std::unique_ptr<CallChainNode>> children;
+  // A compressed path of samples without branches. It is stored in CallChainAllocator, and may
+  // be shared with other nodes.
+  SampleEntry* const* chain;
+  uint32_t chain_length;
+  uint32_t name_hash;  // Hash of the symbol name of chain[0], to skip most name comparisons.
+  std::vector<CallChainNode*> children;
+};
+
+// CallChainAllocator owns the nodes and paths of all callchain trees in a SampleTree, and frees
+// them at once when it is destroyed.
+class CallChainAllocator {
+ public:
+  CallChainAllocator()
+      : chain_cur_(nullptr), chain_end_(nullptr), last_chain_(nullptr), last_chain_length_(0) {
+  }
+
+  CallChainNode* AllocateNode();
+  // Return a copy of chain[start, chain.size()). Callchains of a sample are added as suffixes of
+  // each other, so the copy is shared with the previous one if it ends with the same samples.
+  SampleEntry* const* StoreChain(const std::vector<SampleEntry*>& chain, size_t start);
+
+ private:
+  std::deque<CallChainNode> nodes_;
+  std::vector<std::unique_ptr<SampleEntry*[]>> chain_chunks_;
+  SampleEntry** chain_cur_;
+  SampleEntry** chain_end_;
+  SampleEntry* const* last_chain_;
+  size_t last_chain_length_;
+
+  DISALLOW_COPY_AND_ASSIGN(CallChainAllocator);
 };
 
 struct CallChainRoot {
   uint64_t children_period;
-  std::vector<std::unique_ptr<CallChainNode>> children;
+  std::vector<CallChainNode*> children;
 
   CallChainRoot() : children_period(0) {
   }
 
-  void AddCallChain(const std::vector<SampleEntry*>& callchain, uint64_t period);
+  void AddCallChain(const std::vector<SampleEntry*>& callchain, uint64_t period,
+                    CallChainAllocator* allocator);
   void SortByPeriod();
 };
 
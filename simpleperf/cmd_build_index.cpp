@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "command.h"
+#include "dso.h"
+
+class BuildIndexCommand : public Command {
+ public:
+  BuildIndexCommand()
+      : Command("build-index", "index elf files of a symfs directory by build id",
+                "Usage: simpleperf build-index <dir>\n"
+                "    Index elf files under <dir> by their build ids, and write the index to\n"
+                "    <dir>/simpleperf_build_id_index. Reports using <dir> as --symfs then find\n"
+                "    the file of a binary recorded with a build id from the index, wherever the\n"
+                "    file is placed under <dir>. Run it again after files under <dir> change.\n") {
+  }
+
+  bool Run(const std::vector<std::string>& args) override;
+};
+
+bool BuildIndexCommand::Run(const std::vector<std::string>& args) {
+  if (args.size() != 1) {
+    LOG(ERROR) << "malformed command line: build-index needs one directory";
+    return false;
+  }
+  size_t file_count;
+  if (!BuildIdIndex::Build(args[0], &file_count)) {
+    return false;
+  }
+  printf("Indexed %zu files under %s.\n", file_count, args[0].c_str());
+  return true;
+}
+
+void RegisterBuildIndexCommand() {
+  RegisterCommand("build-index", [] { return std::unique_ptr<Command>(new BuildIndexCommand); });
+}
@@ -148,6 +148,9 @@ static const std::string GetFeatureName(int feature) {
       {FEAT_BRANCH_STACK, "branch_stack"},
       {FEAT_PMU_MAPPINGS, "pmu_mappings"},
       {FEAT_GROUP_DESC, "group_desc"},
+      {FEAT_TRACEPOINT_FORMATS, "tracepoint_formats"},
+      {FEAT_SAMPLE_FREQ_CHANGES, "sample_freq_changes"},
+      {FEAT_KERNEL_SYMBOLS, "kernel_symbols"},
   };
   auto it = feature_name_map.find(feature);
   if (it != feature_name_map.end()) {
@@ -206,6 +209,10 @@ void DumpRecordCommand::DumpFeatureSection() {
     } else if (feature == FEAT_CMDLINE) {
       std::vector<std::string> cmdline = record_file_reader_->ReadCmdlineFeature();
       PrintIndented(1, "cmdline: %s\n", android::base::Join(cmdline, ' ').c_str());
+    } else if (feature == FEAT_SAMPLE_FREQ_CHANGES) {
+      for (auto& change : record_file_reader_->ReadSampleFreqChangesFeature()) {
+        PrintIndented(1, "time %" PRIu64 ": freq %" PRIu64 "\n", change.time, change.freq);
+      }
     }
   }
 }
@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "command.h"
+#include "environment.h"
+#include "record.h"
+#include "record_file.h"
+#include "thread_tree.h"
+#include "utils.h"
+
+using namespace PerfFileFormat;
+
+namespace {
+
+enum SplitType {
+  SPLIT_NONE,
+  SPLIT_BY_TIME,
+  SPLIT_BY_PID,
+};
+
+// An output file, and what is learned about its samples in the first pass.
+struct FilterOutput {
+  std::string filename;
+  std::unique_ptr<RecordFileWriter> writer;
+  // Processes having samples in the output. Only their comm, mmap, fork and exit records are
+  // written.
+  std::unordered_set<int> pids;
+  // Records after the last sample aren't needed.
+  uint64_t last_sample_time;
+  uint64_t sample_count;
+
+  FilterOutput() : last_sample_time(0), sample_count(0) {
+  }
+};
+
+class FilterCommand : public Command {
+ public:
+  FilterCommand()
+      : Command("filter", "filter and split perf record files",
+                "Usage: simpleperf filter [options]\n"
+                "    Copy samples selected by options from a perf record file to another one,\n"
+                "    with only the mmap and comm records of processes having samples kept.\n"
+                "    Options selecting samples can be combined.\n"
+                "    -i <file>     Specify path of the record file to filter, default is\n"
+                "                  perf.data.\n"
+                "    -o <file>     Specify path of the generated record file, default is\n"
+                "                  perf_filtered.data.\n"
+                "    --comms comm1,comm2,...\n"
+                "                  Keep only samples of selected comms.\n"
+                "    --cpu cpu_item1,cpu_item2,...\n"
+                "                  Keep only samples on selected cpus. cpu_item can be cpu\n"
+                "                  number like 1, or cpu range like 0-3.\n"
+                "    --dsos dso1,dso2,...\n"
+                "                  Keep only samples hitting selected dsos.\n"
+                "    --pids pid1,pid2,...\n"
+                "                  Keep only samples of selected pids.\n"
+                "    --split-by time:<seconds> | pid\n"
+                "                  Split kept samples into several files. time:<seconds>\n"
+                "                  writes samples of each period of seconds to\n"
+                "                  <output>.0, <output>.1, ... pid writes samples of each\n"
+                "                  process to <output>.<pid>.\n"
+                "    --tids tid1,tid2,...\n"
+                "                  Keep only samples of selected tids.\n"
+                "    --time-range [start],[end]\n"
+                "                  Keep only samples taken from start to end seconds after the\n"
+                "                  first sample, like 10.5,12.5 or 10.5, for all samples\n"
+                "                  after 10.5 seconds.\n"),
+        input_filename_("perf.data"),
+        output_filename_("perf_filtered.data"),
+        start_time_in_ns_(0),
+        end_time_in_ns_(std::numeric_limits<uint64_t>::max()),
+        split_type_(SPLIT_NONE),
+        split_interval_in_ns_(0),
+        first_sample_time_(0),
+        has_first_sample_time_(false) {
+  }
+
+  bool Run(const std::vector<std::string>& args);
+
+ private:
+  bool ParseOptions(const std::vector<std::string>& args);
+  bool CheckSampleType(const perf_event_attr& attr);
+  bool KeepSample(const SampleRecord& r);
+  FilterOutput* GetOutput(const SampleRecord& r);
+  bool ScanSamples();
+  bool CreateOutputFiles();
+  bool WriteRecords();
+  bool WriteRecord(const RecordView& view, const Record& record);
+  bool FinishOutputFiles();
+
+  std::string input_filename_;
+  std::string output_filename_;
+  std::unordered_set<int> pid_filter_;
+  std::unordered_set<int> tid_filter_;
+  std::unordered_set<std::string> comm_filter_;
+  std::unordered_set<std::string> dso_filter_;
+  std::unordered_set<int> cpu_filter_;
+  uint64_t start_time_in_ns_;  // Relative to the first sample.
+  uint64_t end_time_in_ns_;
+  SplitType split_type_;
+  uint64_t split_interval_in_ns_;
+
+  std::unique_ptr<RecordFileReader> reader_;
+  ThreadTree thread_tree_;
+  uint64_t first_sample_time_;
+  bool has_first_sample_time_;
+  // Outputs are indexed by split period for SPLIT_BY_TIME, and by pid for SPLIT_BY_PID.
+  std::map<uint64_t, FilterOutput> outputs_;
+};
+
+bool FilterCommand::Run(const std::vector<std::string>& args) {
+  if (!ParseOptions(args)) {
+    return false;
+  }
+  reader_ = RecordFileReader::CreateInstance(input_filename_);
+  if (reader_ == nullptr) {
+    return false;
+  }
+  if (!CheckSampleType(reader_->AttrSection()[0].attr)) {
+    return false;
+  }
+  // The first pass finds the outputs of kept samples and the processes they need, so the second
+  // pass can write the comm and mmap records of those processes before their samples.
+  if (!ScanSamples()) {
+    return false;
+  }
+  if (outputs_.empty()) {
+    LOG(ERROR) << "no samples in " << input_filename_ << " are selected";
+    return false;
+  }
+  if (!CreateOutputFiles() || !WriteRecords() || !FinishOutputFiles()) {
+    return false;
+  }
+  for (auto& pair : outputs_) {
+    LOG(INFO) << "Wrote " << pair.second.sample_count << " samples to "
+              << pair.second.filename;
+  }
+  return true;
+}
+
+static bool ParseSeconds(const std::string& s, uint64_t* time_in_ns) {
+  char* endptr;
+  double seconds = strtod(s.c_str(), &endptr);
+  if (s.empty() || *endptr != '\0' || seconds < 0) {
+    return false;
+  }
+  *time_in_ns = static_cast<uint64_t>(seconds * 1e9);
+  return true;
+}
+
+bool FilterCommand::ParseOptions(const std::vector<std::string>& args) {
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "-i") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      input_filename_ = args[i];
+    } else if (args[i] == "-o") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      output_filename_ = args[i];
+    } else if (args[i] == "--comms" || args[i] == "--dsos") {
+      std::unordered_set<std::string>& filter = (args[i] == "--comms" ? comm_filter_ : dso_filter_);
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      std::vector<std::string> strs = android::base::Split(args[i], ",");
+      filter.insert(strs.begin(), strs.end());
+    } else if (args[i] == "--cpu") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      std::vector<int> cpus = GetCpusFromString(args[i]);
+      if (cpus.empty()) {
+        LOG(ERROR) << "invalid argument for --cpu option: " << args[i];
+        return false;
+      }
+      cpu_filter_.insert(cpus.begin(), cpus.end());
+    } else if (args[i] == "--pids" || args[i] == "--tids") {
+      std::unordered_set<int>& filter = (args[i] == "--pids" ? pid_filter_ : tid_filter_);
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      for (const auto& s : android::base::Split(args[i], ",")) {
+        int id;
+        if (!android::base::ParseInt(s.c_str(), &id, 0)) {
+          LOG(ERROR) << "invalid id in " << args[i - 1] << " option: " << s;
+          return false;
+        }
+        filter.insert(id);
+      }
+    } else if (args[i] == "--split-by") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (args[i] == "pid") {
+        split_type_ = SPLIT_BY_PID;
+      } else if (android::base::StartsWith(args[i], "time:") &&
+                 ParseSeconds(args[i].substr(5), &split_interval_in_ns_) &&
+                 split_interval_in_ns_ != 0) {
+        split_type_ = SPLIT_BY_TIME;
+      } else {
+        LOG(ERROR) << "invalid argument for --split-by option: " << args[i];
+        return false;
+      }
+    } else if (args[i] == "--time-range") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      std::vector<std::string> strs = android::base::Split(args[i], ",");
+      if (strs.size() != 2 || (!strs[0].empty() && !ParseSeconds(strs[0], &start_time_in_ns_)) ||
+          (!strs[1].empty() && !ParseSeconds(strs[1], &end_time_in_ns_)) ||
+          start_time_in_ns_ > end_time_in_ns_) {
+        LOG(ERROR) << "invalid argument for --time-range option: " << args[i];
+        return false;
+      }
+    } else {
+      ReportUnknownOption(args, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FilterCommand::CheckSampleType(const perf_event_attr& attr) {
+  if (!(attr.sample_type & PERF_SAMPLE_TID)) {
+    LOG(ERROR) << input_filename_ << " doesn't record pids and tids of samples";
+    return false;
+  }
+  bool need_time = split_type_ == SPLIT_BY_TIME || start_time_in_ns_ != 0 ||
+                   end_time_in_ns_ != std::numeric_limits<uint64_t>::max();
+  if (need_time && !(attr.sample_type & PERF_SAMPLE_TIME)) {
+    LOG(ERROR) << input_filename_ << " doesn't record times of samples";
+    return false;
+  }
+  if (!cpu_filter_.empty() && !(attr.sample_type & PERF_SAMPLE_CPU)) {
+    LOG(ERROR) << input_filename_ << " doesn't record cpus of samples";
+    return false;
+  }
+  if (!dso_filter_.empty() && !(attr.sample_type & PERF_SAMPLE_IP)) {
+    LOG(ERROR) << input_filename_ << " doesn't record ips of samples";
+    return false;
+  }
+  return true;
+}
+
+bool FilterCommand::KeepSample(const SampleRecord& r) {
+  if (!has_first_sample_time_) {
+    first_sample_time_ = r.time_data.time;
+    has_first_sample_time_ = true;
+  }
+  if (!pid_filter_.empty() && pid_filter_.find(r.tid_data.pid) == pid_filter_.end()) {
+    return false;
+  }
+  if (!tid_filter_.empty() && tid_filter_.find(r.tid_data.tid) == tid_filter_.end()) {
+    return false;
+  }
+  if (!cpu_filter_.empty() && cpu_filter_.find(r.cpu_data.cpu) == cpu_filter_.end()) {
+    return false;
+  }
+  uint64_t time = r.time_data.time - std::min(r.time_data.time, first_sample_time_);
+  if (time < start_time_in_ns_ || time > end_time_in_ns_) {
+    return false;
+  }
+  if (comm_filter_.empty() && dso_filter_.empty()) {
+    return true;
+  }
+  const ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+  if (!comm_filter_.empty() && comm_filter_.find(thread->comm) == comm_filter_.end()) {
+    return false;
+  }
+  if (!dso_filter_.empty()) {
+    bool in_kernel = (r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL;
+    const MapEntry* map = thread_tree_.FindMap(thread, r.ip_data.ip, in_kernel);
+    if (dso_filter_.find(map->dso->Path()) == dso_filter_.end()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+FilterOutput* FilterCommand::GetOutput(const SampleRecord& r) {
+  uint64_t key = 0;
+  if (split_type_ == SPLIT_BY_TIME) {
+    key = (r.time_data.time - std::min(r.time_data.time, first_sample_time_)) /
+          split_interval_in_ns_;
+  } else if (split_type_ == SPLIT_BY_PID) {
+    key = r.tid_data.pid;
+  }
+  return &outputs_[key];
+}
+
+// Return the process a comm, mmap, fork or exit record changes.
+static bool GetRecordPid(const Record& record, int* pid) {
+  switch (record.type()) {
+    case PERF_RECORD_MMAP:
+      *pid = static_cast<const MmapRecord&>(record).data.pid;
+      return true;
+    case PERF_RECORD_MMAP2:
+      *pid = static_cast<const Mmap2Record&>(record).data.pid;
+      return true;
+    case PERF_RECORD_COMM:
+      *pid = static_cast<const CommRecord&>(record).data.pid;
+      return true;
+    case PERF_RECORD_FORK:
+    case PERF_RECORD_EXIT:
+      *pid = static_cast<const ExitOrForkRecord&>(record).data.pid;
+      return true;
+  }
+  return false;
+}
+
+bool FilterCommand::ScanSamples() {
+  // A forked process starts with the maps of its parent, so the records of parents are needed
+  // too.
+  std::unordered_map<int, int> parent_pids;
+  bool result = reader_->ReadDataSectionViews(
+      [&](const RecordView& view) {
+        std::unique_ptr<Record> record = view.Parse();
+        BuildThreadTree(*record, &thread_tree_);
+        if (record->type() == PERF_RECORD_FORK) {
+          auto& r = *static_cast<const ForkRecord*>(record.get());
+          if (r.data.pid != r.data.ppid) {
+            parent_pids[r.data.pid] = r.data.ppid;
+          }
+        } else if (record->type() == PERF_RECORD_SAMPLE) {
+          auto& r = *static_cast<const SampleRecord*>(record.get());
+          if (KeepSample(r)) {
+            FilterOutput* output = GetOutput(r);
+            output->pids.insert(r.tid_data.pid);
+            output->last_sample_time = std::max(output->last_sample_time, r.time_data.time);
+          }
+        }
+        return true;
+      },
+      false);
+  if (!result) {
+    return false;
+  }
+  for (auto& pair : outputs_) {
+    std::vector<int> pids(pair.second.pids.begin(), pair.second.pids.end());
+    for (int pid : pids) {
+      auto it = parent_pids.find(pid);
+      while (it != parent_pids.end() && pair.second.pids.insert(it->second).second) {
+        it = parent_pids.find(it->second);
+      }
+    }
+  }
+  return true;
+}
+
+bool FilterCommand::CreateOutputFiles() {
+  std::vector<AttrWithId> attr_ids;
+  for (auto& file_attr : reader_->AttrSection()) {
+    AttrWithId attr_id;
+    attr_id.attr = &file_attr.attr;
+    if (!reader_->ReadIdsForAttr(file_attr, &attr_id.ids)) {
+      return false;
+    }
+    attr_ids.push_back(attr_id);
+  }
+  for (auto& pair : outputs_) {
+    FilterOutput& output = pair.second;
+    output.filename = output_filename_;
+    if (split_type_ != SPLIT_NONE) {
+      output.filename += android::base::StringPrintf(".%" PRIu64, pair.first);
+    }
+    output.writer = RecordFileWriter::CreateInstance(output.filename);
+    if (output.writer == nullptr || !output.writer->WriteAttrSection(attr_ids)) {
+      return false;
+    }
+    // Splitting by pid can create many files, so only write few files on separate threads.
+    if (split_type_ != SPLIT_BY_PID && !output.writer->StartAsyncDataWriting(false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FilterCommand::WriteRecords() {
+  thread_tree_.Clear();
+  has_first_sample_time_ = false;
+  return reader_->ReadDataSectionViews(
+      [&](const RecordView& view) {
+        std::unique_ptr<Record> record = view.Parse();
+        BuildThreadTree(*record, &thread_tree_);
+        return WriteRecord(view, *record);
+      },
+      false);
+}
+
+bool FilterCommand::WriteRecord(const RecordView& view, const Record& record) {
+  // Copy the bytes of the input file when possible. Chunked samples refer to stack chunks not
+  // passed to us, so they are serialized again.
+  auto write = [&](FilterOutput& output) {
+    if (view.header()->type == SIMPLE_PERF_RECORD_CHUNKED_SAMPLE) {
+      return output.writer->WriteRecord(record);
+    }
+    return output.writer->WriteData(view.header(), view.size());
+  };
+  if (record.type() == PERF_RECORD_SAMPLE) {
+    auto& r = static_cast<const SampleRecord&>(record);
+    if (!KeepSample(r)) {
+      return true;
+    }
+    FilterOutput* output = GetOutput(r);
+    output->sample_count++;
+    return write(*output);
+  }
+  // Kernel maps are needed by all samples. Records not belonging to a process, like lost
+  // records, are kept in outputs they may affect.
+  int pid;
+  bool in_kernel = (record.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL;
+  bool for_all = (record.type() == PERF_RECORD_MMAP && in_kernel) || !GetRecordPid(record, &pid);
+  uint64_t time = record.Timestamp();
+  for (auto& pair : outputs_) {
+    FilterOutput& output = pair.second;
+    if (time > output.last_sample_time) {
+      continue;
+    }
+    if (for_all || output.pids.find(pid) != output.pids.end()) {
+      if (!write(output)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool FilterCommand::FinishOutputFiles() {
+  // Copy features of the input file, except the index of its compressed data section.
+  std::vector<int> features;
+  for (auto& pair : reader_->FeatureSectionDescriptors()) {
+    if (pair.first != FEAT_COMPRESSED_DATA) {
+      features.push_back(pair.first);
+    }
+  }
+  std::map<int, std::vector<char>> feature_data;
+  for (int feature : features) {
+    if (!reader_->ReadFeatureSection(feature, &feature_data[feature])) {
+      return false;
+    }
+  }
+  for (auto& pair : outputs_) {
+    RecordFileWriter* writer = pair.second.writer.get();
+    if (!writer->WriteFeatureHeader(features.size())) {
+      return false;
+    }
+    for (int feature : features) {
+      const std::vector<char>& data = feature_data[feature];
+      bool result;
+      if (feature == FEAT_KERNEL_SYMBOLS) {
+        // Written at an aligned offset, so it can be mapped in place.
+        result = writer->WriteKernelSymbolsFeature(std::string(data.begin(), data.end()));
+      } else {
+        result = writer->WriteFeature(feature, data);
+      }
+      if (!result) {
+        return false;
+      }
+    }
+    if (!writer->Close()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void RegisterFilterCommand() {
+  RegisterCommand("filter", [] { return std::unique_ptr<Command>(new FilterCommand); });
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <memory>
+#include <set>
+
+#include <android-base/test_utils.h>
+
+#include "command.h"
+#include "get_test_data.h"
+#include "record.h"
+#include "record_file.h"
+
+static std::unique_ptr<Command> FilterCmd() {
+  return CreateCommandInstance("filter");
+}
+
+static void GetSamplePids(const std::string& filename, std::set<int>* pids, size_t* mmap_count) {
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(filename);
+  ASSERT_TRUE(reader != nullptr);
+  *mmap_count = 0;
+  for (auto& record : reader->DataSection()) {
+    if (record->type() == PERF_RECORD_SAMPLE) {
+      pids->insert(static_cast<SampleRecord*>(record.get())->tid_data.pid);
+    } else if (record->type() == PERF_RECORD_MMAP || record->type() == PERF_RECORD_MMAP2) {
+      (*mmap_count)++;
+    }
+  }
+}
+
+TEST(cmd_filter, no_options) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(FilterCmd()->Run({"-i", GetTestData(PERF_DATA), "-o", tmpfile.path}));
+  std::set<int> pids;
+  size_t mmap_count;
+  GetSamplePids(tmpfile.path, &pids, &mmap_count);
+  ASSERT_FALSE(pids.empty());
+  ASSERT_NE(0u, mmap_count);
+}
+
+TEST(cmd_filter, pids_option) {
+  std::set<int> pids;
+  size_t input_mmap_count;
+  GetSamplePids(GetTestData(PERF_DATA), &pids, &input_mmap_count);
+  ASSERT_FALSE(pids.empty());
+  int pid = *pids.begin();
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(FilterCmd()->Run(
+      {"-i", GetTestData(PERF_DATA), "-o", tmpfile.path, "--pids", std::to_string(pid)}));
+  std::set<int> kept_pids;
+  size_t mmap_count;
+  GetSamplePids(tmpfile.path, &kept_pids, &mmap_count);
+  ASSERT_EQ(std::set<int>({pid}), kept_pids);
+  ASSERT_LE(mmap_count, input_mmap_count);
+  ASSERT_FALSE(FilterCmd()->Run(
+      {"-i", GetTestData(PERF_DATA), "-o", tmpfile.path, "--pids", "not_a_pid"}));
+}
+
+TEST(cmd_filter, split_by_pid_option) {
+  std::set<int> pids;
+  size_t mmap_count;
+  GetSamplePids(GetTestData(PERF_DATA), &pids, &mmap_count);
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(
+      FilterCmd()->Run({"-i", GetTestData(PERF_DATA), "-o", tmpfile.path, "--split-by", "pid"}));
+  for (int pid : pids) {
+    std::string filename = std::string(tmpfile.path) + "." + std::to_string(pid);
+    std::set<int> kept_pids;
+    GetSamplePids(filename, &kept_pids, &mmap_count);
+    ASSERT_EQ(std::set<int>({pid}), kept_pids);
+    unlink(filename.c_str());
+  }
+}
+
+TEST(cmd_filter, time_range_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(FilterCmd()->Run(
+      {"-i", GetTestData(PERF_DATA), "-o", tmpfile.path, "--time-range", "0,"}));
+  ASSERT_FALSE(FilterCmd()->Run(
+      {"-i", GetTestData(PERF_DATA), "-o", tmpfile.path, "--time-range", "2,1"}));
+}
@@ -30,15 +30,22 @@
 static void PrintEventTypesOfType(uint32_t type, const std::string& type_name,
                                   const std::vector<EventType>& event_types) {
   printf("List of %s:\n", type_name.c_str());
+  std::vector<const EventType*> types;
+  std::vector<perf_event_attr> attrs;
   for (auto& event_type : event_types) {
     if (event_type.type == type) {
       perf_event_attr attr = CreateDefaultPerfEventAttr(event_type);
       // Exclude kernel to list supported events even when
       // /proc/sys/kernel/perf_event_paranoid is 2.
       attr.exclude_kernel = 1;
-      if (IsEventAttrSupportedByKernel(attr)) {
-        printf("  %s\n", event_type.name.c_str());
-      }
+      types.push_back(&event_type);
+      attrs.push_back(attr);
+    }
+  }
+  std::vector<bool> supported = AreEventAttrsSupportedByKernel(attrs);
+  for (size_t i = 0; i < types.size(); ++i) {
+    if (supported[i]) {
+      printf("  %s\n", types[i]->name.c_str());
     }
   }
   printf("\n");
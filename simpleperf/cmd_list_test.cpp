@@ -17,6 +17,9 @@
 #include <gtest/gtest.h>
 
 #include "command.h"
+#include "event_attr.h"
+#include "event_fd.h"
+#include "event_type.h"
 
 class ListCommandTest : public ::testing::Test {
  protected:
@@ -39,3 +42,19 @@ TEST_F(ListCommandTest, one_option) {
 TEST_F(ListCommandTest, multiple_options) {
   ASSERT_TRUE(list_cmd->Run({"hw", "tracepoint"}));
 }
+
+TEST(list_cmd, cached_event_probing) {
+  std::vector<perf_event_attr> attrs;
+  for (auto& event_type : GetAllEventTypes()) {
+    if (event_type.type == PERF_TYPE_SOFTWARE || event_type.type == PERF_TYPE_HARDWARE) {
+      attrs.push_back(CreateDefaultPerfEventAttr(event_type));
+    }
+  }
+  // Probing in parallel and looking up cached results give the same answers.
+  std::vector<bool> supported = AreEventAttrsSupportedByKernel(attrs);
+  ASSERT_EQ(attrs.size(), supported.size());
+  for (size_t i = 0; i < attrs.size(); ++i) {
+    ASSERT_EQ(supported[i], IsEventAttrSupportedByKernel(attrs[i]));
+  }
+  ASSERT_EQ(supported, AreEventAttrsSupportedByKernel(attrs));
+}
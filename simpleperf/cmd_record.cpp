@@ -14,17 +14,28 @@
  * limitations under the License.
  */
 
-#include <libgen.h>
 #include <poll.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "command.h"
@@ -32,17 +43,39 @@
 #include "environment.h"
 #include "event_selection_set.h"
 #include "event_type.h"
-#include "read_apk.h"
 #include "read_elf.h"
 #include "record.h"
 #include "record_file.h"
 #include "scoped_signal_handler.h"
 #include "thread_tree.h"
+#include "tracing.h"
 #include "utils.h"
 #include "workload.h"
 
 static std::string default_measured_event_type = "cpu-cycles";
 
+// Max count of distinct samples kept in memory by `record --aggregate` before writing them.
+constexpr size_t MAX_AGGREGATED_SAMPLES = 65536;
+
+// How often `record --target-bandwidth` adjusts the sample frequency.
+constexpr uint64_t SAMPLE_FREQ_ADJUST_INTERVAL_IN_MS = 100;
+constexpr uint64_t MIN_ADAPTED_SAMPLE_FREQ = 10;
+// Above this usage of the kernel buffers, they are read slower than the kernel fills them.
+constexpr double HIGH_BUFFER_USAGE = 0.5;
+constexpr double LOW_BUFFER_USAGE = 0.125;
+
+// Max count of threads reading /proc for existing processes in `record -a`.
+constexpr size_t MAX_PROCESS_SCAN_JOBS = 8;
+// How often records of scanned processes are written while the scan is running.
+constexpr int PROCESS_SCAN_POLL_INTERVAL_IN_MS = 10;
+
+// Max size of records kept in memory by `record --snapshot`. Older records are written or
+// dropped early when it is reached, so bursts can't use unbounded memory.
+constexpr size_t MAX_SNAPSHOT_BUFFER_SIZE = 128 * 1024 * 1024;
+
+// How often online cpus are checked, to reopen event files on cpus coming back online.
+constexpr int CPU_HOTPLUG_CHECK_INTERVAL_IN_MS = 1000;
+
 static std::unordered_map<std::string, uint64_t> branch_sampling_type_map = {
     {"u", PERF_SAMPLE_BRANCH_USER},
     {"k", PERF_SAMPLE_BRANCH_KERNEL},
@@ -60,6 +93,442 @@ static void signal_handler(int) {
 // Used in cpu-hotplug test.
 bool system_wide_perf_event_open_failed = false;
 
+// SampleAggregator merges sample records that only differ in time, cpu and period into one
+// sample record carrying the summed period. The merged record keeps the time of the last sample
+// merged into it. It is used by `record --aggregate` to avoid writing every raw sample.
+class SampleAggregator {
+ public:
+  explicit SampleAggregator(size_t max_samples) : max_samples_(max_samples) {
+  }
+
+  // Return false if the sample can't be merged with others, then it should be written as is.
+  bool Add(const SampleRecord& r);
+  bool Empty() const {
+    return samples_.empty();
+  }
+  bool Full() const {
+    return samples_.size() >= max_samples_;
+  }
+  // Call callback for each merged sample in the order they were first added, and clear them.
+  bool Flush(std::function<bool(const SampleRecord&)> callback);
+
+ private:
+  const size_t max_samples_;
+  std::unordered_map<std::string, size_t> sample_index_;
+  std::vector<SampleRecord> samples_;
+  std::vector<char> key_buffer_;  // Reused to serialize keys of samples.
+};
+
+bool SampleAggregator::Add(const SampleRecord& r) {
+  const uint64_t required_types = PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD;
+  if ((r.sample_type & required_types) != required_types) {
+    return false;
+  }
+  // Samples carrying user stacks are unlikely to be equal, and are unwound later.
+  if ((r.sample_type & PERF_SAMPLE_STACK_USER) && !r.stack_user_data.data.empty()) {
+    return false;
+  }
+  SampleRecord key_record = r;
+  key_record.time_data.time = 0;
+  key_record.cpu_data.cpu = 0;
+  key_record.period_data.period = 0;
+  key_buffer_.clear();
+  key_record.AppendBinaryFormat(&key_buffer_);
+  std::string key(key_buffer_.begin(), key_buffer_.end());
+  auto it = sample_index_.find(key);
+  if (it == sample_index_.end()) {
+    sample_index_[key] = samples_.size();
+    samples_.push_back(r);
+  } else {
+    SampleRecord& sample = samples_[it->second];
+    sample.period_data.period += r.period_data.period;
+    sample.time_data.time = std::max(sample.time_data.time, r.time_data.time);
+  }
+  return true;
+}
+
+bool SampleAggregator::Flush(std::function<bool(const SampleRecord&)> callback) {
+  for (auto& sample : samples_) {
+    if (!callback(sample)) {
+      return false;
+    }
+  }
+  samples_.clear();
+  sample_index_.clear();
+  return true;
+}
+
+// SampleFreqController picks the sample frequency of `record --target-bandwidth`. It lowers the
+// frequency when data comes faster than the target bandwidth or the kernel buffers fill up, so
+// bursts don't lose samples. And it raises the frequency again when data comes slowly, up to the
+// frequency requested by the user, so quiet periods aren't undersampled.
+class SampleFreqController {
+ public:
+  SampleFreqController(uint64_t target_bytes_per_sec, uint64_t max_freq)
+      : target_bytes_per_sec_(target_bytes_per_sec), max_freq_(max_freq), freq_(max_freq) {
+  }
+
+  uint64_t Freq() const {
+    return freq_;
+  }
+
+  // Given the bytes read and the highest buffer usage seen in the last interval, return the
+  // frequency to use in the next interval.
+  uint64_t Adjust(uint64_t read_bytes, uint64_t interval_in_ns, double max_buffer_usage);
+
+ private:
+  const double target_bytes_per_sec_;
+  const uint64_t max_freq_;
+  uint64_t freq_;
+};
+
+uint64_t SampleFreqController::Adjust(uint64_t read_bytes, uint64_t interval_in_ns,
+                                      double max_buffer_usage) {
+  double bytes_per_sec = read_bytes * 1e9 / interval_in_ns;
+  double new_freq = freq_;
+  if (bytes_per_sec > target_bytes_per_sec_) {
+    new_freq = freq_ * target_bytes_per_sec_ / bytes_per_sec;
+  }
+  if (max_buffer_usage >= HIGH_BUFFER_USAGE) {
+    new_freq = std::min(new_freq, freq_ / 2.0);
+  } else if (max_buffer_usage < LOW_BUFFER_USAGE && bytes_per_sec < target_bytes_per_sec_ / 2) {
+    // Raise it at most twice per interval, as the data size doesn't always grow linearly with
+    // the frequency.
+    double scale = (bytes_per_sec == 0) ? 2.0 : target_bytes_per_sec_ / bytes_per_sec;
+    new_freq = freq_ * std::min(2.0, scale);
+  }
+  freq_ = std::max(MIN_ADAPTED_SAMPLE_FREQ, std::min(max_freq_, static_cast<uint64_t>(new_freq)));
+  return freq_;
+}
+
+// SnapshotBuffer keeps the records of the last duration_in_ns in memory for `record --snapshot`,
+// so samples are only written when recording stops. Older samples are dropped. Older records of
+// other types are passed to write_record instead, so the thread and map state the kept samples
+// refer to is still written, and in order. Records kept beyond max_size bytes are handled the
+// same way, however recent they are.
+class SnapshotBuffer {
+ public:
+  SnapshotBuffer(const perf_event_attr& attr, uint64_t duration_in_ns, size_t max_size,
+                 std::function<bool(Record*)> write_record)
+      : attr_(attr),
+        duration_in_ns_(duration_in_ns),
+        max_size_(max_size),
+        write_record_(write_record),
+        size_(0),
+        last_time_(0),
+        dropped_samples_(0) {
+  }
+
+  bool Add(const Record& r);
+  // Pass all kept records to write_record in the order they were added, and clear them.
+  bool Flush();
+  uint64_t DroppedSamples() const {
+    return dropped_samples_;
+  }
+
+ private:
+  struct Entry {
+    uint64_t time;
+    bool is_sample;
+    std::vector<char> data;
+  };
+
+  bool WriteEntry(const Entry& entry);
+
+  const perf_event_attr attr_;
+  const uint64_t duration_in_ns_;
+  const size_t max_size_;
+  std::function<bool(Record*)> write_record_;
+  std::deque<Entry> entries_;
+  size_t size_;
+  uint64_t last_time_;
+  uint64_t dropped_samples_;
+};
+
+bool SnapshotBuffer::Add(const Record& r) {
+  entries_.push_back(Entry{r.Timestamp(), r.type() == PERF_RECORD_SAMPLE, r.BinaryFormat()});
+  size_ += r.size();
+  last_time_ = std::max(last_time_, r.Timestamp());
+  while (!entries_.empty()) {
+    Entry& entry = entries_.front();
+    if (size_ <= max_size_ && entry.time + duration_in_ns_ >= last_time_) {
+      break;
+    }
+    if (entry.is_sample) {
+      dropped_samples_++;
+    } else if (!WriteEntry(entry)) {
+      return false;
+    }
+    size_ -= entry.data.size();
+    entries_.pop_front();
+  }
+  return true;
+}
+
+bool SnapshotBuffer::Flush() {
+  for (auto& entry : entries_) {
+    if (!WriteEntry(entry)) {
+      return false;
+    }
+  }
+  entries_.clear();
+  size_ = 0;
+  return true;
+}
+
+bool SnapshotBuffer::WriteEntry(const Entry& entry) {
+  std::vector<std::unique_ptr<Record>> records =
+      ReadRecordsFromBuffer(attr_, entry.data.data(), entry.data.size());
+  CHECK_EQ(1u, records.size());
+  return write_record_(records[0].get());
+}
+
+static bool SampleNeedsUnwinding(const SampleRecord& r) {
+  return (r.sample_type & PERF_SAMPLE_CALLCHAIN) && (r.sample_type & PERF_SAMPLE_REGS_USER) &&
+         (r.regs_user_data.reg_mask != 0) && (r.sample_type & PERF_SAMPLE_STACK_USER) &&
+         (!r.stack_user_data.data.empty());
+}
+
+// Replace the user stack and registers in the sample with the unwound callchain.
+static void UnwindSample(SampleRecord* sample, const ThreadEntry& thread,
+                         OfflineUnwinder* unwinder) {
+  SampleRecord& r = *sample;
+  RegSet regs = CreateRegSet(r.regs_user_data.reg_mask, r.regs_user_data.regs);
+  std::vector<char>& stack = r.stack_user_data.data;
+  std::vector<uint64_t> unwind_ips =
+      unwinder->UnwindCallChain(GetBuildArch(), thread, regs, stack);
+  r.callchain_data.ips.push_back(PERF_CONTEXT_USER);
+  r.callchain_data.ips.insert(r.callchain_data.ips.end(), unwind_ips.begin(), unwind_ips.end());
+  r.regs_user_data.abi = 0;
+  r.regs_user_data.reg_mask = 0;
+  r.regs_user_data.regs.clear();
+  r.stack_user_data.data.clear();
+  r.stack_user_data.dyn_size = 0;
+  r.AdjustSizeBasedOnData();
+}
+
+// ParallelUnwinder unwinds samples on worker threads, and passes records to write_record on a
+// writer thread in the order they are added. Each sample comes with a snapshot of its thread,
+// taken when the sample is added, so workers see the maps the sample was recorded with.
+class ParallelUnwinder {
+ public:
+  ParallelUnwinder(size_t jobs, std::function<bool(const Record&)> write_record)
+      : write_record_(write_record),
+        slots_(WINDOW_SIZE),
+        next_seq_(0),
+        next_write_seq_(0),
+        finished_(false),
+        write_failed_(false) {
+    for (size_t i = 0; i < jobs; ++i) {
+      unwinder_threads_.push_back(std::thread(&ParallelUnwinder::UnwinderThread, this));
+    }
+    writer_thread_ = std::thread(&ParallelUnwinder::WriterThread, this);
+  }
+
+  ~ParallelUnwinder() {
+    Finish();
+  }
+
+  // Add a record, and unwind it if thread isn't nullptr.
+  bool Add(std::unique_ptr<Record> record, std::shared_ptr<const ThreadEntry> thread);
+  // Wait until all records are written and stop the threads.
+  bool Finish();
+
+ private:
+  // Max count of records added but not written yet.
+  static constexpr size_t WINDOW_SIZE = 4096;
+
+  struct Slot {
+    std::unique_ptr<Record> record;
+    std::shared_ptr<const ThreadEntry> thread;
+    bool done;
+  };
+
+  void UnwinderThread();
+  void WriterThread();
+
+  const std::function<bool(const Record&)> write_record_;
+  std::vector<Slot> slots_;  // The record of seq is in slots_[seq % WINDOW_SIZE].
+  uint64_t next_seq_;
+  uint64_t next_write_seq_;
+  std::deque<uint64_t> unwind_jobs_;
+  bool finished_;
+  bool write_failed_;
+  std::mutex mutex_;
+  std::condition_variable job_cond_;
+  std::condition_variable done_cond_;
+  std::condition_variable slot_free_cond_;
+  std::vector<std::thread> unwinder_threads_;
+  std::thread writer_thread_;
+};
+
+bool ParallelUnwinder::Add(std::unique_ptr<Record> record,
+                           std::shared_ptr<const ThreadEntry> thread) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  slot_free_cond_.wait(lock, [&]() {
+    return next_seq_ - next_write_seq_ < WINDOW_SIZE || write_failed_;
+  });
+  if (write_failed_) {
+    return false;
+  }
+  Slot& slot = slots_[next_seq_ % WINDOW_SIZE];
+  slot.record = std::move(record);
+  slot.thread = std::move(thread);
+  slot.done = (slot.thread == nullptr);
+  if (slot.done) {
+    done_cond_.notify_one();
+  } else {
+    unwind_jobs_.push_back(next_seq_);
+    job_cond_.notify_one();
+  }
+  ++next_seq_;
+  return true;
+}
+
+bool ParallelUnwinder::Finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+      return !write_failed_;
+    }
+    finished_ = true;
+  }
+  job_cond_.notify_all();
+  done_cond_.notify_all();
+  for (auto& thread : unwinder_threads_) {
+    thread.join();
+  }
+  writer_thread_.join();
+  return !write_failed_;
+}
+
+void ParallelUnwinder::UnwinderThread() {
+  OfflineUnwinder unwinder;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    job_cond_.wait(lock, [&]() { return !unwind_jobs_.empty() || finished_; });
+    if (unwind_jobs_.empty()) {
+      break;
+    }
+    uint64_t seq = unwind_jobs_.front();
+    unwind_jobs_.pop_front();
+    Slot& slot = slots_[seq % WINDOW_SIZE];
+    lock.unlock();
+    UnwindSample(static_cast<SampleRecord*>(slot.record.get()), *slot.thread, &unwinder);
+    slot.thread = nullptr;
+    lock.lock();
+    slot.done = true;
+    if (seq == next_write_seq_) {
+      done_cond_.notify_one();
+    }
+  }
+}
+
+void ParallelUnwinder::WriterThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    done_cond_.wait(lock, [&]() {
+      return next_write_seq_ == next_seq_ ? finished_ : slots_[next_write_seq_ % WINDOW_SIZE].done;
+    });
+    if (next_write_seq_ == next_seq_) {
+      break;
+    }
+    Slot& slot = slots_[next_write_seq_ % WINDOW_SIZE];
+    bool failed = write_failed_;
+    lock.unlock();
+    // After a failure, keep dropping records so the reader and workers aren't blocked.
+    if (!failed && !write_record_(*slot.record)) {
+      failed = true;
+    }
+    slot.record = nullptr;
+    lock.lock();
+    write_failed_ = failed;
+    ++next_write_seq_;
+    slot_free_cond_.notify_one();
+  }
+}
+
+// ProcessScanner reads comms and executable maps of processes on worker threads, as reading
+// them one by one delays the start of `record -a` by seconds on devices running many processes.
+// Scanned processes are handed out in the order they finish, while the scan is still running.
+class ProcessScanner {
+ public:
+  struct Process {
+    pid_t pid;
+    std::vector<ThreadComm> threads;
+    std::vector<ThreadMmap> mmaps;  // Only executable maps.
+  };
+
+  ProcessScanner(size_t jobs, std::vector<pid_t> pids)
+      : pids_(std::move(pids)), next_pid_index_(0), running_jobs_(jobs), stopped_(false) {
+    for (size_t i = 0; i < jobs; ++i) {
+      scan_threads_.push_back(std::thread(&ProcessScanner::ScanThread, this));
+    }
+  }
+
+  ~ProcessScanner() {
+    stopped_ = true;
+    for (auto& thread : scan_threads_) {
+      thread.join();
+    }
+  }
+
+  // Move processes scanned so far to processes. If wait is true, wait for the scan to finish.
+  // Return true if all processes are scanned and handed out.
+  bool GetScannedProcesses(std::vector<Process>* processes, bool wait);
+
+ private:
+  void ScanThread();
+
+  const std::vector<pid_t> pids_;
+  std::atomic<size_t> next_pid_index_;
+  size_t running_jobs_;
+  std::atomic<bool> stopped_;
+  std::vector<Process> scanned_processes_;
+  std::mutex mutex_;
+  std::condition_variable finish_cond_;
+  std::vector<std::thread> scan_threads_;
+};
+
+bool ProcessScanner::GetScannedProcesses(std::vector<Process>* processes, bool wait) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (wait) {
+    finish_cond_.wait(lock, [&]() { return running_jobs_ == 0; });
+  }
+  processes->clear();
+  processes->swap(scanned_processes_);
+  return running_jobs_ == 0;
+}
+
+void ProcessScanner::ScanThread() {
+  while (!stopped_) {
+    size_t index = next_pid_index_++;
+    if (index >= pids_.size()) {
+      break;
+    }
+    Process process;
+    process.pid = pids_[index];
+    // The process may exit before we get its info.
+    if (!GetThreadCommsInProcess(process.pid, &process.threads)) {
+      continue;
+    }
+    std::vector<ThreadMmap> mmaps;
+    if (GetThreadMmapsInProcess(process.pid, &mmaps)) {
+      for (auto& mmap : mmaps) {
+        if (mmap.executable) {
+          process.mmaps.push_back(std::move(mmap));
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    scanned_processes_.push_back(std::move(process));
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--running_jobs_ == 0) {
+    finish_cond_.notify_all();
+  }
+}
+
 class RecordCommand : public Command {
  public:
   RecordCommand()
@@ -68,6 +537,10 @@ class RecordCommand : public Command {
             "Usage: simpleperf record [options] [command [command-args]]\n"
             "    Gather sampling information when running [command].\n"
             "    -a           System-wide collection.\n"
+            "    --aggregate  Merge samples that only differ in time, cpu and period while\n"
+            "                 recording, and write one sample with the summed period for them.\n"
+            "                 It makes perf.data much smaller for long recording. Sample counts\n"
+            "                 shown by the report command become counts of merged samples.\n"
             "    -b           Enable take branch stack sampling. Same as '-j any'\n"
             "    -c count     Set event sample period.\n"
             "    --call-graph fp | dwarf[,<dump_stack_size>]\n"
@@ -76,6 +549,13 @@ class RecordCommand : public Command {
             "    --cpu cpu_item1,cpu_item2,...\n"
             "                 Collect samples only on the selected cpus. cpu_item can be cpu\n"
             "                 number like 1, or cpu range like 0-3.\n"
+            "    --compress   Compress the data section of perf.data. It makes perf.data several\n"
+            "                 times smaller, at the cost of cpu time while recording.\n"
+            "    --dedup-stack\n"
+            "                 When the user's stack is kept in perf.data by `--no-unwind` or\n"
+            "                 `--post-unwind`, store it in chunks, and share chunks that are\n"
+            "                 unchanged since the previous sample of the same thread.\n"
+            "    --direct-io  Write the record file with O_DIRECT to bypass the page cache.\n"
             "    -e event1[:modifier1],event2[:modifier2],...\n"
             "                 Select the event list to sample. Use `simpleperf list` to find\n"
             "                 all possible event names. Modifiers can be added to define\n"
@@ -85,6 +565,11 @@ class RecordCommand : public Command {
             "    -f freq      Set event sample frequency.\n"
             "    -F freq      Same as '-f freq'.\n"
             "    -g           Same as '--call-graph dwarf'.\n"
+            "    --group event1[:modifier1],event2[:modifier2],...\n"
+            "                 Similar to -e option. But events specified in the same --group\n"
+            "                 option are sampled as a group, and scheduled in and out at the\n"
+            "                 same time. So the numbers of samples of each event at the same\n"
+            "                 places, like instructions and cpu-cycles, can be compared.\n"
             "    -j branch_filter1,branch_filter2,...\n"
             "                 Enable taken branch stack sampling. Each sample\n"
             "                 captures a series of consecutive taken branches.\n"
@@ -100,6 +585,10 @@ class RecordCommand : public Command {
             "    -m mmap_pages\n"
             "                 Set the size of the buffer used to receiving sample data from\n"
             "                 the kernel. It should be a power of 2. The default value is 16.\n"
+            "    --no-dump-kernel-symbols\n"
+            "                 Don't store symbols of the running kernel in perf.data. By\n"
+            "                 default they are stored when samples hit the kernel, so report\n"
+            "                 doesn't need to read /proc/kallsyms.\n"
             "    --no-inherit\n"
             "                 Don't record created child threads/processes.\n"
             "    --no-unwind  If `--call-graph dwarf` option is used, then the user's stack will\n"
@@ -108,13 +597,51 @@ class RecordCommand : public Command {
             "    -o record_file_name    Set record file name, default is perf.data.\n"
             "    -p pid1,pid2,...\n"
             "                 Record events on existing processes. Mutually exclusive with -a.\n"
+            "    --per-cpu-readers\n"
+            "                 Read sample data from the kernel on a thread bound to each cpu,\n"
+            "                 instead of reading all cpus on one thread. It can reduce lost\n"
+            "                 samples when recording many cpus at high frequency.\n"
             "    --post-unwind\n"
             "                 If `--call-graph dwarf` option is used, then the user's stack will\n"
             "                 be unwound while recording by default. But it may lose records as\n"
             "                 stacking unwinding can be time consuming. Use this option to unwind\n"
             "                 the user's stack after recording.\n"
+            "    --post-unwind-jobs <n>\n"
+            "                 Use n threads to unwind the user's stack after recording.\n"
+            "    --snapshot seconds\n"
+            "                 Keep samples of the last seconds in memory, and write nothing but\n"
+            "                 thread and map records older than that. When recording stops, on\n"
+            "                 SIGUSR1 as well as on SIGINT, SIGTERM or the command exiting, the\n"
+            "                 kept samples are written. So a monitor can record in the background\n"
+            "                 with little I/O, and send SIGUSR1 to get a profile of the seconds\n"
+            "                 before something bad happened.\n"
+            "    --start-profile-at-symbol function[@elf_file]\n"
+            "                 Start recording when the command first runs function, found in\n"
+            "                 elf_file or in the executable of the command. Event files and\n"
+            "                 buffers are prepared before the command starts, so recording\n"
+            "                 begins right at the function. Only the first thread of the command\n"
+            "                 is probed. It needs a kernel supporting uprobe events, and can only\n"
+            "                 be used when running a command.\n"
+            "    --symbol-cache <dir>\n"
+            "                 Keep symbols of the running kernel in dir, read from\n"
+            "                 /proc/kallsyms once per boot, instead of reading it each time\n"
+            "                 kernel symbols are stored in perf.data.\n"
             "    -t tid1,tid2,...\n"
-            "                 Record events on existing threads. Mutually exclusive with -a.\n"),
+            "                 Record events on existing threads. Mutually exclusive with -a.\n"
+            "    --target-bandwidth bytes_per_second\n"
+            "                 Adapt the sample frequency to read about bytes_per_second from the\n"
+            "                 kernel. The frequency is lowered when data comes faster or the\n"
+            "                 kernel buffers fill up, and raised again when data comes slower,\n"
+            "                 up to the frequency set by -f. The frequencies used are stored\n"
+            "                 in perf.data. It can't be used with -c.\n"
+            "    --trace-offcpu\n"
+            "                 Also record a sample with callchain each time a monitored thread\n"
+            "                 is scheduled off the cpu, from the sched:sched_switch tracepoint.\n"
+            "                 Report weights it by the time until the thread runs again, so\n"
+            "                 time blocked on binder, locks or I/O shows up next to time spent\n"
+            "                 on the cpu. The sampled event must be cpu-clock or task-clock,\n"
+            "                 and is cpu-clock by default. It can't be used with -b, -j,\n"
+            "                 --aggregate, --group or --target-bandwidth.\n"),
         use_sample_freq_(true),
         sample_freq_(4000),
         system_wide_collection_(false),
@@ -124,10 +651,23 @@ class RecordCommand : public Command {
         dump_stack_size_in_dwarf_sampling_(8192),
         unwind_dwarf_callchain_(true),
         post_unwind_(false),
+        aggregate_samples_(false),
+        compress_(false),
+        direct_io_(false),
+        dedup_stack_(false),
+        per_cpu_readers_(false),
+        post_unwind_jobs_(1),
+        target_bandwidth_(0),
+        snapshot_duration_in_ns_(0),
+        trace_offcpu_(false),
         child_inherit_(true),
+        dump_kernel_symbols_(true),
         perf_mmap_pages_(16),
         record_filename_("perf.data"),
-        sample_record_count_(0) {
+        sample_record_count_(0),
+        written_sample_record_count_(0),
+        read_bytes_(0),
+        max_buffer_usage_(0) {
     signaled = false;
     scoped_signal_handler_.reset(
         new ScopedSignalHandler({SIGCHLD, SIGINT, SIGTERM}, signal_handler));
@@ -145,11 +685,18 @@ class RecordCommand : public Command {
   std::unique_ptr<RecordFileWriter> CreateRecordFile(const std::string& filename);
   bool DumpKernelAndModuleMmaps();
   bool DumpThreadCommAndMmaps(bool all_threads, const std::vector<pid_t>& selected_threads);
+  bool DumpProcess(const ProcessScanner::Process& process);
+  bool DumpScannedProcesses(bool wait);
   bool CollectRecordsFromKernel(const char* data, size_t size);
+  bool AdjustSampleFreq();
+  bool OpenStartProbe(const std::string& workload_name, pid_t workload_pid);
+  bool CheckStartProbe(pid_t workload_pid, std::vector<pollfd>* pollfds);
   bool ProcessRecord(Record* record);
-  void UpdateRecordForEmbeddedElfPath(Record* record);
+  bool WriteRecord(Record* record);
+  bool FlushAggregatedSamples();
   void UnwindRecord(Record* record);
   bool PostUnwind(const std::vector<std::string>& args);
+  bool ParallelPostUnwind(RecordFileReader* reader);
   bool DumpAdditionalFeatures(const std::vector<std::string>& args);
   bool DumpBuildIdFeature();
   void CollectHitFileInfo(Record* record);
@@ -166,10 +713,29 @@ class RecordCommand : public Command {
   uint32_t dump_stack_size_in_dwarf_sampling_;
   bool unwind_dwarf_callchain_;
   bool post_unwind_;
+  bool aggregate_samples_;
+  bool compress_;
+  bool direct_io_;
+  bool dedup_stack_;
+  bool per_cpu_readers_;
+  size_t post_unwind_jobs_;
+  uint64_t target_bandwidth_;  // In bytes per second, 0 if the frequency isn't adapted.
+  uint64_t snapshot_duration_in_ns_;  // Set by --snapshot, 0 if records are written right away.
+  std::string start_symbol_;   // Set by --start-profile-at-symbol.
+  bool trace_offcpu_;
+  // A uprobe event on start_symbol_, closed once the symbol is hit.
+  std::unique_ptr<EventFd> start_probe_fd_;
   bool child_inherit_;
+  bool dump_kernel_symbols_;
   std::vector<pid_t> monitored_threads_;
   std::vector<int> cpus_;
   std::vector<EventTypeAndModifier> measured_event_types_;
+  // Event types added by --group options, as (index of the first one in measured_event_types_,
+  // number of event types).
+  std::vector<std::pair<size_t, size_t>> measured_event_groups_;
+  // Formats of measured tracepoint events, written in the tracepoint formats feature so report
+  // can decode fields in raw data of samples.
+  std::vector<TracingFormat> tracepoint_formats_;
   EventSelectionSet event_selection_set_;
 
   // mmap pages used by each perf event file, should be a power of 2.
@@ -177,14 +743,32 @@ class RecordCommand : public Command {
 
   std::unique_ptr<RecordCache> record_cache_;
   ThreadTree thread_tree_;
+  OfflineUnwinder offline_unwinder_;
   std::string record_filename_;
   std::unique_ptr<RecordFileWriter> record_file_writer_;
+  std::unique_ptr<SampleAggregator> sample_aggregator_;
+  std::unique_ptr<SnapshotBuffer> snapshot_buffer_;
+
+  // Scans existing processes in `record -a`. Until it finishes, records read from the kernel are
+  // kept in records_during_process_scan_, so they are written after records of the processes.
+  std::unique_ptr<ProcessScanner> process_scanner_;
+  std::vector<std::unique_ptr<Record>> records_during_process_scan_;
 
   std::set<std::string> hit_kernel_modules_;
   std::set<std::string> hit_user_files_;
 
   std::unique_ptr<ScopedSignalHandler> scoped_signal_handler_;
+  // Makes SIGUSR1 stop recording in `record --snapshot`.
+  std::unique_ptr<ScopedSignalHandler> snapshot_signal_handler_;
   uint64_t sample_record_count_;
+  uint64_t written_sample_record_count_;
+
+  // Used by --target-bandwidth.
+  std::unique_ptr<SampleFreqController> freq_controller_;
+  std::chrono::steady_clock::time_point last_freq_adjust_time_;
+  uint64_t read_bytes_;        // Read from the kernel since last_freq_adjust_time_.
+  double max_buffer_usage_;    // Seen since last_freq_adjust_time_.
+  std::vector<PerfFileFormat::SampleFreqChange> sample_freq_changes_;
 };
 
 bool RecordCommand::Run(const std::vector<std::string>& args) {
@@ -198,13 +782,20 @@ bool RecordCommand::Run(const std::vector<std::string>& args) {
     return false;
   }
   if (measured_event_types_.empty()) {
-    if (!AddMeasuredEventType(default_measured_event_type)) {
+    if (!AddMeasuredEventType(trace_offcpu_ ? "cpu-clock" : default_measured_event_type)) {
       return false;
     }
   }
   if (!SetEventSelection()) {
     return false;
   }
+  if (snapshot_duration_in_ns_ != 0) {
+    snapshot_buffer_.reset(new SnapshotBuffer(
+        *event_selection_set_.FindEventAttrByType(measured_event_types_[0]),
+        snapshot_duration_in_ns_, MAX_SNAPSHOT_BUFFER_SIZE,
+        [this](Record* r) { return WriteRecord(r); }));
+    snapshot_signal_handler_.reset(new ScopedSignalHandler({SIGUSR1}, signal_handler));
+  }
 
   // 2. Create workload.
   std::unique_ptr<Workload> workload;
@@ -217,7 +808,11 @@ bool RecordCommand::Run(const std::vector<std::string>& args) {
   if (!system_wide_collection_ && monitored_threads_.empty()) {
     if (workload != nullptr) {
       monitored_threads_.push_back(workload->GetPid());
-      event_selection_set_.SetEnableOnExec(true);
+      if (start_symbol_.empty()) {
+        event_selection_set_.SetEnableOnExec(true);
+      } else {
+        event_selection_set_.SetEnableOnDemand();
+      }
     } else {
       LOG(ERROR) << "No threads to monitor. Try `simpleperf help record` for help\n";
       return false;
@@ -239,8 +834,19 @@ bool RecordCommand::Run(const std::vector<std::string>& args) {
   if (!event_selection_set_.MmapEventFiles(perf_mmap_pages_)) {
     return false;
   }
+  if (per_cpu_readers_ && !event_selection_set_.StartPerCpuReaders()) {
+    return false;
+  }
+  if (!start_symbol_.empty() && !OpenStartProbe(workload_args[0], workload->GetPid())) {
+    return false;
+  }
   std::vector<pollfd> pollfds;
   event_selection_set_.PreparePollForEventFiles(&pollfds);
+  if (start_probe_fd_ != nullptr) {
+    pollfd poll_fd;
+    start_probe_fd_->PreparePollForMmapData(&poll_fd);
+    pollfds.push_back(poll_fd);
+  }
 
   // 4. Create perf.data.
   if (!CreateAndInitRecordFile()) {
@@ -253,16 +859,83 @@ bool RecordCommand::Run(const std::vector<std::string>& args) {
   }
   record_cache_.reset(
       new RecordCache(*event_selection_set_.FindEventAttrByType(measured_event_types_[0])));
+  if (aggregate_samples_) {
+    sample_aggregator_.reset(new SampleAggregator(MAX_AGGREGATED_SAMPLES));
+  }
+  int poll_timeout_in_ms = -1;
+  if (target_bandwidth_ != 0) {
+    freq_controller_.reset(new SampleFreqController(target_bandwidth_, sample_freq_));
+    last_freq_adjust_time_ = std::chrono::steady_clock::now();
+    sample_freq_changes_.push_back(PerfFileFormat::SampleFreqChange{0, sample_freq_});
+    poll_timeout_in_ms = SAMPLE_FREQ_ADJUST_INTERVAL_IN_MS;
+  } else {
+    poll_timeout_in_ms = CPU_HOTPLUG_CHECK_INTERVAL_IN_MS;
+  }
+  auto interval = std::chrono::milliseconds(CPU_HOTPLUG_CHECK_INTERVAL_IN_MS);
+  auto next_hotplug_check_time = std::chrono::steady_clock::now() + interval;
   auto callback = std::bind(&RecordCommand::CollectRecordsFromKernel, this, std::placeholders::_1,
                             std::placeholders::_2);
   while (true) {
+    if (start_probe_fd_ != nullptr && !CheckStartProbe(workload->GetPid(), &pollfds)) {
+      return false;
+    }
+    // Check buffer usage before reading, as reading empties the buffers.
+    if (freq_controller_ != nullptr) {
+      max_buffer_usage_ =
+          std::max(max_buffer_usage_, event_selection_set_.GetMaxMmapBufferUsage());
+    }
     if (!event_selection_set_.ReadMmapEventData(callback)) {
       return false;
     }
     if (signaled) {
       break;
     }
-    poll(&pollfds[0], pollfds.size(), -1);
+    if (freq_controller_ != nullptr && !AdjustSampleFreq()) {
+      return false;
+    }
+    if (std::chrono::steady_clock::now() >= next_hotplug_check_time) {
+      bool changed;
+      if (!event_selection_set_.HandleCpuHotplug(callback, &changed)) {
+        return false;
+      }
+      if (changed) {
+        pollfds.clear();
+        event_selection_set_.PreparePollForEventFiles(&pollfds);
+        if (start_probe_fd_ != nullptr) {
+          pollfd poll_fd;
+          start_probe_fd_->PreparePollForMmapData(&poll_fd);
+          pollfds.push_back(poll_fd);
+        }
+      }
+      next_hotplug_check_time = std::chrono::steady_clock::now() + interval;
+    }
+    if (process_scanner_ != nullptr) {
+      if (!DumpScannedProcesses(false)) {
+        return false;
+      }
+      if (process_scanner_ != nullptr) {
+        // Keep writing records of scanned processes even when no data comes from the kernel.
+        poll(&pollfds[0], pollfds.size(), PROCESS_SCAN_POLL_INTERVAL_IN_MS);
+        continue;
+      }
+    }
+    poll(&pollfds[0], pollfds.size(), poll_timeout_in_ms);
+  }
+  if (process_scanner_ != nullptr && !DumpScannedProcesses(true)) {
+    return false;
+  }
+  if (per_cpu_readers_) {
+    event_selection_set_.StopPerCpuReaders();
+    if (!event_selection_set_.ReadMmapEventData(callback)) {
+      return false;
+    }
+    for (auto& stat : event_selection_set_.GetPerCpuReaderStats()) {
+      LOG(VERBOSE) << "Reader of cpu " << stat.cpu << " read " << stat.read_bytes
+                   << " bytes, lost " << stat.lost_records << " records.";
+      if (stat.lost_records != 0) {
+        LOG(WARNING) << "Lost " << stat.lost_records << " records on cpu " << stat.cpu << ".";
+      }
+    }
   }
   std::vector<std::unique_ptr<Record>> records = record_cache_->PopAll();
   for (auto& r : records) {
@@ -270,11 +943,24 @@ bool RecordCommand::Run(const std::vector<std::string>& args) {
       return false;
     }
   }
+  if (snapshot_buffer_ != nullptr) {
+    if (!snapshot_buffer_->Flush()) {
+      return false;
+    }
+    LOG(VERBOSE) << "Drop " << snapshot_buffer_->DroppedSamples()
+                 << " samples recorded before the snapshot.";
+  }
+  if (!FlushAggregatedSamples()) {
+    return false;
+  }
 
   // 6. Dump additional features, and close record file.
   if (!DumpAdditionalFeatures(args)) {
     return false;
   }
+  LOG(VERBOSE) << "Reading records was blocked for "
+               << record_file_writer_->AsyncWriteBlockedTimeInNs() / 1000000
+               << " ms by writing the record file.";
   if (!record_file_writer_->Close()) {
     return false;
   }
@@ -286,6 +972,9 @@ bool RecordCommand::Run(const std::vector<std::string>& args) {
     }
   }
   LOG(VERBOSE) << "Record " << sample_record_count_ << " samples.";
+  if (aggregate_samples_) {
+    LOG(VERBOSE) << "Write " << written_sample_record_count_ << " aggregated samples.";
+  }
   return true;
 }
 
@@ -296,6 +985,8 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
   for (i = 0; i < args.size() && args[i].size() > 0 && args[i][0] == '-'; ++i) {
     if (args[i] == "-a") {
       system_wide_collection_ = true;
+    } else if (args[i] == "--aggregate") {
+      aggregate_samples_ = true;
     } else if (args[i] == "-b") {
       branch_sampling_ = branch_sampling_type_map["any"];
     } else if (args[i] == "-c") {
@@ -342,6 +1033,12 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
         return false;
       }
       cpus_ = GetCpusFromString(args[i]);
+    } else if (args[i] == "--compress") {
+      compress_ = true;
+    } else if (args[i] == "--dedup-stack") {
+      dedup_stack_ = true;
+    } else if (args[i] == "--direct-io") {
+      direct_io_ = true;
     } else if (args[i] == "-e") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -366,6 +1063,18 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
     } else if (args[i] == "-g") {
       fp_callchain_sampling_ = false;
       dwarf_callchain_sampling_ = true;
+    } else if (args[i] == "--group") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      size_t first = measured_event_types_.size();
+      for (auto& event_type : android::base::Split(args[i], ",")) {
+        if (!AddMeasuredEventType(event_type)) {
+          return false;
+        }
+      }
+      measured_event_groups_.push_back(
+          std::make_pair(first, measured_event_types_.size() - first));
     } else if (args[i] == "-j") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -390,6 +1099,8 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
         return false;
       }
       perf_mmap_pages_ = pages;
+    } else if (args[i] == "--no-dump-kernel-symbols") {
+      dump_kernel_symbols_ = false;
     } else if (args[i] == "--no-inherit") {
       child_inherit_ = false;
     } else if (args[i] == "--no-unwind") {
@@ -406,8 +1117,40 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
       if (!GetValidThreadsFromProcessString(args[i], &tid_set)) {
         return false;
       }
+    } else if (args[i] == "--per-cpu-readers") {
+      per_cpu_readers_ = true;
     } else if (args[i] == "--post-unwind") {
       post_unwind_ = true;
+    } else if (args[i] == "--post-unwind-jobs") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!android::base::ParseUint(args[i].c_str(), &post_unwind_jobs_) ||
+          post_unwind_jobs_ == 0) {
+        LOG(ERROR) << "Invalid argument for --post-unwind-jobs option: " << args[i];
+        return false;
+      }
+    } else if (args[i] == "--snapshot") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      char* endptr;
+      double seconds = strtod(args[i].c_str(), &endptr);
+      if (*endptr != '\0' || seconds <= 0) {
+        LOG(ERROR) << "Invalid argument for --snapshot option: " << args[i];
+        return false;
+      }
+      snapshot_duration_in_ns_ = static_cast<uint64_t>(seconds * 1e9);
+    } else if (args[i] == "--start-profile-at-symbol") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      start_symbol_ = args[i];
+    } else if (args[i] == "--symbol-cache") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      Dso::SetSymbolCacheDir(args[i]);
     } else if (args[i] == "-t") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -415,6 +1158,17 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
       if (!GetValidThreadsFromThreadString(args[i], &tid_set)) {
         return false;
       }
+    } else if (args[i] == "--target-bandwidth") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!android::base::ParseUint(args[i].c_str(), &target_bandwidth_) ||
+          target_bandwidth_ == 0) {
+        LOG(ERROR) << "Invalid argument for --target-bandwidth option: " << args[i];
+        return false;
+      }
+    } else if (args[i] == "--trace-offcpu") {
+      trace_offcpu_ = true;
     } else {
       ReportUnknownOption(args, i);
       return false;
@@ -438,6 +1192,32 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
       return false;
     }
   }
+  if (target_bandwidth_ != 0 && !use_sample_freq_) {
+    LOG(ERROR) << "--target-bandwidth can't be used with -c option.";
+    return false;
+  }
+  if (post_unwind_jobs_ > 1 && !post_unwind_) {
+    LOG(ERROR) << "--post-unwind-jobs is only used with `--post-unwind` option.";
+    return false;
+  }
+  if (dedup_stack_ && !(dwarf_callchain_sampling_ && (post_unwind_ || !unwind_dwarf_callchain_))) {
+    LOG(ERROR) << "--dedup-stack is only used with `--call-graph dwarf` option and one of "
+               << "`--no-unwind` and `--post-unwind` options.";
+    return false;
+  }
+  if (aggregate_samples_ && dwarf_callchain_sampling_ &&
+      (post_unwind_ || !unwind_dwarf_callchain_)) {
+    LOG(ERROR) << "--aggregate needs the user's stack to be unwound while recording.";
+    return false;
+  }
+
+  if (trace_offcpu_ && (branch_sampling_ != 0 || aggregate_samples_ ||
+                        !measured_event_groups_.empty() || target_bandwidth_ != 0)) {
+    // Report needs the time of every sample, and periods in ns for all of them.
+    LOG(ERROR) << "--trace-offcpu can't be used with -b, -j, --aggregate, --group or "
+               << "--target-bandwidth options.";
+    return false;
+  }
 
   monitored_threads_.insert(monitored_threads_.end(), tid_set.begin(), tid_set.end());
   if (system_wide_collection_ && !monitored_threads_.empty()) {
@@ -446,6 +1226,12 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
     return false;
   }
 
+  if (!start_symbol_.empty() && (system_wide_collection_ || !monitored_threads_.empty() ||
+                                 i == args.size())) {
+    LOG(ERROR) << "--start-profile-at-symbol can only be used when running a command.";
+    return false;
+  }
+
   if (non_option_args != nullptr) {
     non_option_args->clear();
     for (; i < args.size(); ++i) {
@@ -465,16 +1251,59 @@ bool RecordCommand::AddMeasuredEventType(const std::string& event_type_name) {
 }
 
 bool RecordCommand::SetEventSelection() {
-  for (auto& event_type : measured_event_types_) {
-    if (!event_selection_set_.AddEventType(event_type)) {
+  if (trace_offcpu_) {
+    // Off-cpu samples are weighted by time in ns, so on-cpu samples need periods in ns too.
+    const EventType& type = measured_event_types_[0].event_type;
+    if (measured_event_types_.size() != 1 || type.type != PERF_TYPE_SOFTWARE ||
+        (type.config != PERF_COUNT_SW_CPU_CLOCK && type.config != PERF_COUNT_SW_TASK_CLOCK)) {
+      LOG(ERROR) << "--trace-offcpu can only be used with one cpu-clock or task-clock event.";
       return false;
     }
   }
+  for (size_t i = 0; i < measured_event_types_.size();) {
+    size_t group_size = 1;
+    for (auto& group : measured_event_groups_) {
+      if (group.first == i) {
+        group_size = group.second;
+      }
+    }
+    std::vector<EventTypeAndModifier> group(measured_event_types_.begin() + i,
+                                            measured_event_types_.begin() + i + group_size);
+    if (!event_selection_set_.AddEventGroup(group)) {
+      return false;
+    }
+    i += group_size;
+  }
+  for (auto& event_type : measured_event_types_) {
+    if (event_type.event_type.type == PERF_TYPE_TRACEPOINT) {
+      TracingFormat format;
+      if (ReadTracingFormat(event_type.event_type.name, &format)) {
+        tracepoint_formats_.push_back(format);
+      } else {
+        LOG(WARNING) << "fields of " << event_type.name << " can't be decoded in report";
+      }
+    }
+  }
   if (use_sample_freq_) {
     event_selection_set_.SetSampleFreq(sample_freq_);
   } else {
     event_selection_set_.SetSamplePeriod(sample_period_);
   }
+  if (trace_offcpu_) {
+    // Added after setting the sample frequency, so every sched_switch is sampled. It gets the
+    // same sample type and callchain settings as the sampled event below, and its samples are
+    // read through the same per-cpu buffers.
+    std::unique_ptr<EventTypeAndModifier> sched_switch = ParseEventType("sched:sched_switch");
+    if (sched_switch == nullptr || !event_selection_set_.AddEventType(*sched_switch)) {
+      return false;
+    }
+    TracingFormat format;
+    if (!ReadTracingFormat(sched_switch->event_type.name, &format)) {
+      LOG(ERROR) << "can't read the format of " << sched_switch->name;
+      return false;
+    }
+    tracepoint_formats_.push_back(format);
+  }
   event_selection_set_.SampleIdAll();
   if (!event_selection_set_.SetBranchSampling(branch_sampling_)) {
     return false;
@@ -495,10 +1324,20 @@ bool RecordCommand::CreateAndInitRecordFile() {
   if (record_file_writer_ == nullptr) {
     return false;
   }
+  if (dedup_stack_) {
+    record_file_writer_->EnableStackDedup();
+  }
   if (!DumpKernelAndModuleMmaps()) {
     return false;
   }
-  if (!DumpThreadCommAndMmaps(system_wide_collection_, monitored_threads_)) {
+  if (system_wide_collection_) {
+    // Dump existing processes while recording, as the scan can take a long time.
+    size_t jobs = std::min<size_t>(MAX_PROCESS_SCAN_JOBS,
+                                   std::max(1u, std::thread::hardware_concurrency()));
+    process_scanner_.reset(new ProcessScanner(jobs, GetAllProcesses()));
+    return true;
+  }
+  if (!DumpThreadCommAndMmaps(false, monitored_threads_)) {
     return false;
   }
   return true;
@@ -526,6 +1365,13 @@ std::unique_ptr<RecordFileWriter> RecordCommand::CreateRecordFile(const std::str
   if (!writer->WriteAttrSection(attr_ids)) {
     return nullptr;
   }
+  // Write records on a separate thread, so slow storage doesn't delay reading kernel buffers.
+  if (!writer->StartAsyncDataWriting(direct_io_)) {
+    return nullptr;
+  }
+  if (compress_) {
+    writer->EnableCompression();
+  }
   return writer;
 }
 
@@ -622,13 +1468,75 @@ bool RecordCommand::DumpThreadCommAndMmaps(bool all_threads,
   return true;
 }
 
+bool RecordCommand::DumpProcess(const ProcessScanner::Process& process) {
+  const perf_event_attr* attr = event_selection_set_.FindEventAttrByType(measured_event_types_[0]);
+  CHECK(attr != nullptr);
+  for (auto& thread : process.threads) {
+    if (thread.tid != process.pid) {
+      continue;
+    }
+    CommRecord record = CreateCommRecord(*attr, thread.pid, thread.tid, thread.comm);
+    if (!ProcessRecord(&record)) {
+      return false;
+    }
+    for (auto& thread_mmap : process.mmaps) {
+      MmapRecord record =
+          CreateMmapRecord(*attr, false, thread.pid, thread.tid, thread_mmap.start_addr,
+                           thread_mmap.len, thread_mmap.pgoff, thread_mmap.name);
+      if (!ProcessRecord(&record)) {
+        return false;
+      }
+    }
+  }
+  for (auto& thread : process.threads) {
+    if (thread.tid == process.pid) {
+      continue;
+    }
+    ForkRecord fork_record = CreateForkRecord(*attr, thread.pid, thread.tid, thread.pid, thread.pid);
+    if (!ProcessRecord(&fork_record)) {
+      return false;
+    }
+    CommRecord comm_record = CreateCommRecord(*attr, thread.pid, thread.tid, thread.comm);
+    if (!ProcessRecord(&comm_record)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecordCommand::DumpScannedProcesses(bool wait) {
+  std::vector<ProcessScanner::Process> processes;
+  bool finished = process_scanner_->GetScannedProcesses(&processes, wait);
+  for (auto& process : processes) {
+    if (!DumpProcess(process)) {
+      return false;
+    }
+  }
+  if (!finished) {
+    return true;
+  }
+  process_scanner_.reset();
+  for (auto& r : records_during_process_scan_) {
+    if (!ProcessRecord(r.get())) {
+      return false;
+    }
+  }
+  records_during_process_scan_.clear();
+  return true;
+}
+
 bool RecordCommand::CollectRecordsFromKernel(const char* data, size_t size) {
+  read_bytes_ += size;
   record_cache_->Push(data, size);
   while (true) {
     std::unique_ptr<Record> r = record_cache_->Pop();
     if (r == nullptr) {
       break;
     }
+    if (process_scanner_ != nullptr) {
+      records_during_process_scan_.push_back(std::move(r));
+      continue;
+    }
     if (!ProcessRecord(r.get())) {
       return false;
     }
@@ -636,6 +1544,131 @@ bool RecordCommand::CollectRecordsFromKernel(const char* data, size_t size) {
   return true;
 }
 
+bool RecordCommand::AdjustSampleFreq() {
+  auto now = std::chrono::steady_clock::now();
+  uint64_t interval_in_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_freq_adjust_time_).count();
+  if (interval_in_ns < SAMPLE_FREQ_ADJUST_INTERVAL_IN_MS * 1000000) {
+    return true;
+  }
+  uint64_t old_freq = freq_controller_->Freq();
+  uint64_t freq = freq_controller_->Adjust(read_bytes_, interval_in_ns, max_buffer_usage_);
+  last_freq_adjust_time_ = now;
+  read_bytes_ = 0;
+  max_buffer_usage_ = 0;
+  if (freq == old_freq) {
+    return true;
+  }
+  if (!event_selection_set_.ChangeSampleFreq(freq)) {
+    return false;
+  }
+  LOG(DEBUG) << "change sample frequency from " << old_freq << " to " << freq;
+  // Records read so far were taken with the old frequency.
+  uint64_t time = record_cache_->LastTime();
+  if (sample_freq_changes_.back().time == time) {
+    sample_freq_changes_.back().freq = freq;
+  } else {
+    sample_freq_changes_.push_back(PerfFileFormat::SampleFreqChange{time, freq});
+  }
+  return true;
+}
+
+static bool FindExecutableInPath(const std::string& name, std::string* path) {
+  if (name.find('/') != std::string::npos) {
+    *path = name;
+    return true;
+  }
+  const char* env_path = getenv("PATH");
+  if (env_path != nullptr) {
+    for (auto& dir : android::base::Split(env_path, ":")) {
+      std::string file = (dir.empty() ? "." : dir) + "/" + name;
+      if (access(file.c_str(), X_OK) == 0) {
+        *path = file;
+        return true;
+      }
+    }
+  }
+  LOG(ERROR) << "can't find executable " << name;
+  return false;
+}
+
+// Open a uprobe event hit when the workload runs the function start_symbol_. It is opened before
+// the workload starts, so the first hit isn't missed. The kernel can't inherit uprobe events
+// defined by a file path, so only the first thread of the workload is probed.
+bool RecordCommand::OpenStartProbe(const std::string& workload_name, pid_t workload_pid) {
+  std::string symbol_name = start_symbol_;
+  std::string elf_path;
+  size_t at_pos = symbol_name.find('@');
+  if (at_pos != std::string::npos) {
+    elf_path = symbol_name.substr(at_pos + 1);
+    symbol_name = symbol_name.substr(0, at_pos);
+  } else if (!FindExecutableInPath(workload_name, &elf_path)) {
+    return false;
+  }
+  uint64_t vaddr = 0;
+  bool found = false;
+  ParseSymbolsFromElfFile(elf_path, BuildId(), [&](const ElfFileSymbol& symbol) {
+    if (symbol.is_func && symbol.name == symbol_name) {
+      vaddr = symbol.vaddr;
+      found = true;
+    }
+  });
+  if (!found) {
+    LOG(ERROR) << "can't find function " << symbol_name << " in " << elf_path;
+    return false;
+  }
+  uint64_t file_offset;
+  if (!ConvertVaddrToFileOffsetInElfFile(elf_path, vaddr, &file_offset)) {
+    return false;
+  }
+  std::string type_str;
+  uint32_t uprobe_type;
+  if (!android::base::ReadFileToString("/sys/bus/event_source/devices/uprobe/type", &type_str) ||
+      !android::base::ParseUint(android::base::Trim(type_str).c_str(), &uprobe_type)) {
+    LOG(ERROR) << "the kernel doesn't support uprobe events needed by --start-profile-at-symbol";
+    return false;
+  }
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = uprobe_type;
+  attr.config1 = reinterpret_cast<uintptr_t>(elf_path.c_str());  // The path of the probed file.
+  attr.config2 = file_offset;                                     // The offset of the probe.
+  attr.sample_period = 1;
+  attr.sample_type = PERF_SAMPLE_TIME;
+  attr.wakeup_events = 1;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  start_probe_fd_ = EventFd::OpenEventFile(attr, workload_pid, -1);
+  return start_probe_fd_ != nullptr && start_probe_fd_->MmapContent(1);
+}
+
+bool RecordCommand::CheckStartProbe(pid_t workload_pid, std::vector<pollfd>* pollfds) {
+  char* data;
+  if (start_probe_fd_->GetAvailableMmapData(&data) == 0) {
+    return true;
+  }
+  if (!event_selection_set_.EnableEvents()) {
+    return false;
+  }
+  LOG(VERBOSE) << "Start recording at " << start_symbol_;
+  start_probe_fd_ = nullptr;
+  pollfds->clear();
+  event_selection_set_.PreparePollForEventFiles(pollfds);
+  // The disabled events didn't record the comms and maps created before, so dump them now.
+  // The workload may have exited already, then there is nothing to dump.
+  std::vector<std::string> subdirs;
+  GetEntriesInDir(android::base::StringPrintf("/proc/%d/task", workload_pid), nullptr, &subdirs);
+  std::vector<pid_t> tids;
+  for (auto& name : subdirs) {
+    int tid;
+    if (android::base::ParseInt(name.c_str(), &tid, 0)) {
+      tids.push_back(tid);
+    }
+  }
+  return DumpThreadCommAndMmaps(false, tids);
+}
+
 bool RecordCommand::ProcessRecord(Record* record) {
   UpdateRecordForEmbeddedElfPath(record);
   BuildThreadTree(*record, &thread_tree_);
@@ -646,61 +1679,44 @@ bool RecordCommand::ProcessRecord(Record* record) {
   if (record->type() == PERF_RECORD_SAMPLE) {
     sample_record_count_++;
   }
-  bool result = record_file_writer_->WriteData(record->BinaryFormat());
-  return result;
+  if (snapshot_buffer_ != nullptr) {
+    return snapshot_buffer_->Add(*record);
+  }
+  return WriteRecord(record);
 }
 
-template<class RecordType>
-void UpdateMmapRecordForEmbeddedElfPath(RecordType* record) {
-  RecordType& r = *record;
-  bool in_kernel = ((r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL);
-  if (!in_kernel && r.data.pgoff != 0) {
-    // For the case of a shared library "foobar.so" embedded
-    // inside an APK, we rewrite the original MMAP from
-    // ["path.apk" offset=X] to ["path.apk!/foobar.so" offset=W]
-    // so as to make the library name explicit. This update is
-    // done here (as part of the record operation) as opposed to
-    // on the host during the report, since we want to report
-    // the correct library name even if the the APK in question
-    // is not present on the host. The new offset W is
-    // calculated to be with respect to the start of foobar.so,
-    // not to the start of path.apk.
-    EmbeddedElf* ee = ApkInspector::FindElfInApkByOffset(r.filename, r.data.pgoff);
-    if (ee != nullptr) {
-      // Compute new offset relative to start of elf in APK.
-      r.data.pgoff -= ee->entry_offset();
-      r.filename = GetUrlInApk(r.filename, ee->entry_name());
-      r.AdjustSizeBasedOnData();
+bool RecordCommand::WriteRecord(Record* record) {
+  if (record->type() == PERF_RECORD_SAMPLE) {
+    if (sample_aggregator_ != nullptr &&
+        sample_aggregator_->Add(*static_cast<SampleRecord*>(record))) {
+      return !sample_aggregator_->Full() || FlushAggregatedSamples();
     }
+    written_sample_record_count_++;
+  } else if (!FlushAggregatedSamples()) {
+    // Merged samples are written before any later mmap/comm/fork/exit record, so the report
+    // command sees the same thread and map state for them as for the raw samples.
+    return false;
   }
+  bool result = record_file_writer_->WriteRecord(*record);
+  return result;
 }
 
-void RecordCommand::UpdateRecordForEmbeddedElfPath(Record* record) {
-  if (record->type() == PERF_RECORD_MMAP) {
-    UpdateMmapRecordForEmbeddedElfPath(static_cast<MmapRecord*>(record));
-  } else if (record->type() == PERF_RECORD_MMAP2) {
-    UpdateMmapRecordForEmbeddedElfPath(static_cast<Mmap2Record*>(record));
+bool RecordCommand::FlushAggregatedSamples() {
+  if (sample_aggregator_ == nullptr || sample_aggregator_->Empty()) {
+    return true;
   }
+  return sample_aggregator_->Flush([this](const SampleRecord& r) {
+    written_sample_record_count_++;
+    return record_file_writer_->WriteRecord(r);
+  });
 }
 
 void RecordCommand::UnwindRecord(Record* record) {
   if (record->type() == PERF_RECORD_SAMPLE) {
     SampleRecord& r = *static_cast<SampleRecord*>(record);
-    if ((r.sample_type & PERF_SAMPLE_CALLCHAIN) && (r.sample_type & PERF_SAMPLE_REGS_USER) &&
-        (r.regs_user_data.reg_mask != 0) && (r.sample_type & PERF_SAMPLE_STACK_USER) &&
-        (!r.stack_user_data.data.empty())) {
+    if (SampleNeedsUnwinding(r)) {
       ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
-      RegSet regs = CreateRegSet(r.regs_user_data.reg_mask, r.regs_user_data.regs);
-      std::vector<char>& stack = r.stack_user_data.data;
-      std::vector<uint64_t> unwind_ips = UnwindCallChain(GetBuildArch(), *thread, regs, stack);
-      r.callchain_data.ips.push_back(PERF_CONTEXT_USER);
-      r.callchain_data.ips.insert(r.callchain_data.ips.end(), unwind_ips.begin(), unwind_ips.end());
-      r.regs_user_data.abi = 0;
-      r.regs_user_data.reg_mask = 0;
-      r.regs_user_data.regs.clear();
-      r.stack_user_data.data.clear();
-      r.stack_user_data.dyn_size = 0;
-      r.AdjustSizeBasedOnData();
+      UnwindSample(&r, *thread, &offline_unwinder_);
     }
   }
 }
@@ -716,13 +1732,27 @@ bool RecordCommand::PostUnwind(const std::vector<std::string>& args) {
   if (record_file_writer_ == nullptr) {
     return false;
   }
-  bool result = reader->ReadDataSection(
-      [this](std::unique_ptr<Record> record) {
-        BuildThreadTree(*record, &thread_tree_);
-        UnwindRecord(record.get());
-        return record_file_writer_->WriteData(record->BinaryFormat());
-      },
-      false);
+  bool result;
+  if (post_unwind_jobs_ > 1) {
+    result = ParallelPostUnwind(reader.get());
+  } else {
+    result = reader->ReadDataSectionViews(
+        [this](const RecordView& view) {
+          std::unique_ptr<Record> record = view.Parse();
+          BuildThreadTree(*record, &thread_tree_);
+          // Records not changed by unwinding are copied from the mapped file as they are,
+          // instead of being serialized again. Chunked samples refer to stack chunks that
+          // aren't passed to the callback, so they are always serialized.
+          if ((record->type() == PERF_RECORD_SAMPLE &&
+               SampleNeedsUnwinding(*static_cast<SampleRecord*>(record.get()))) ||
+              view.header()->type == SIMPLE_PERF_RECORD_CHUNKED_SAMPLE) {
+            UnwindRecord(record.get());
+            return record_file_writer_->WriteRecord(*record);
+          }
+          return record_file_writer_->WriteData(view.header(), view.size());
+        },
+        false);
+  }
   if (!result) {
     return false;
   }
@@ -744,8 +1774,56 @@ bool RecordCommand::PostUnwind(const std::vector<std::string>& args) {
   return true;
 }
 
+bool RecordCommand::ParallelPostUnwind(RecordFileReader* reader) {
+  ParallelUnwinder unwinder(post_unwind_jobs_, [this](const Record& record) {
+    return record_file_writer_->WriteRecord(record);
+  });
+  // Snapshots are shared by samples of a thread until its maps change.
+  std::unordered_map<int, std::shared_ptr<const ThreadEntry>> thread_snapshots;
+  bool result = reader->ReadDataSection(
+      [&](std::unique_ptr<Record> record) {
+        BuildThreadTree(*record, &thread_tree_);
+        std::shared_ptr<const ThreadEntry> thread;
+        if (record->type() == PERF_RECORD_SAMPLE &&
+            SampleNeedsUnwinding(*static_cast<SampleRecord*>(record.get()))) {
+          auto& r = *static_cast<SampleRecord*>(record.get());
+          ThreadEntry* entry = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+          std::shared_ptr<const ThreadEntry>& snapshot = thread_snapshots[entry->tid];
+          if (snapshot == nullptr || snapshot->maps_version != entry->maps_version) {
+            snapshot = std::make_shared<const ThreadEntry>(*entry);
+          }
+          thread = snapshot;
+        }
+        return unwinder.Add(std::move(record), thread);
+      },
+      false);
+  if (!unwinder.Finish()) {
+    result = false;
+  }
+  return result;
+}
+
 bool RecordCommand::DumpAdditionalFeatures(const std::vector<std::string>& args) {
-  size_t feature_count = (branch_sampling_ != 0 ? 5 : 4);
+  size_t feature_count = 4;
+  if (branch_sampling_ != 0) {
+    feature_count++;
+  }
+  if (!tracepoint_formats_.empty()) {
+    feature_count++;
+  }
+  if (!sample_freq_changes_.empty()) {
+    feature_count++;
+  }
+  std::string kernel_symbols;
+  if (dump_kernel_symbols_ &&
+      hit_kernel_modules_.find(DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID) != hit_kernel_modules_.end()) {
+    std::unique_ptr<Dso> kernel_dso = Dso::CreateDso(DSO_KERNEL);
+    if (kernel_dso->SymbolTableToBinary(&kernel_symbols)) {
+      feature_count++;
+    } else {
+      kernel_symbols.clear();
+    }
+  }
   if (!record_file_writer_->WriteFeatureHeader(feature_count)) {
     return false;
   }
@@ -776,53 +1854,23 @@ bool RecordCommand::DumpAdditionalFeatures(const std::vector<std::string>& args)
   if (branch_sampling_ != 0 && !record_file_writer_->WriteBranchStackFeature()) {
     return false;
   }
+  if (!tracepoint_formats_.empty() &&
+      !record_file_writer_->WriteTracepointFormatsFeature(tracepoint_formats_)) {
+    return false;
+  }
+  if (!sample_freq_changes_.empty() &&
+      !record_file_writer_->WriteSampleFreqChangesFeature(sample_freq_changes_)) {
+    return false;
+  }
+  if (!kernel_symbols.empty() && !record_file_writer_->WriteKernelSymbolsFeature(kernel_symbols)) {
+    return false;
+  }
   return true;
 }
 
 bool RecordCommand::DumpBuildIdFeature() {
   std::vector<BuildIdRecord> build_id_records;
-  BuildId build_id;
-  // Add build_ids for kernel/modules.
-  for (const auto& filename : hit_kernel_modules_) {
-    if (filename == DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID) {
-      if (!GetKernelBuildId(&build_id)) {
-        LOG(DEBUG) << "can't read build_id for kernel";
-        continue;
-      }
-      build_id_records.push_back(
-          CreateBuildIdRecord(true, UINT_MAX, build_id, DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID));
-    } else {
-      std::string path = filename;
-      std::string module_name = basename(&path[0]);
-      if (android::base::EndsWith(module_name, ".ko")) {
-        module_name = module_name.substr(0, module_name.size() - 3);
-      }
-      if (!GetModuleBuildId(module_name, &build_id)) {
-        LOG(DEBUG) << "can't read build_id for module " << module_name;
-        continue;
-      }
-      build_id_records.push_back(CreateBuildIdRecord(true, UINT_MAX, build_id, filename));
-    }
-  }
-  // Add build_ids for user elf files.
-  for (const auto& filename : hit_user_files_) {
-    if (filename == DEFAULT_EXECNAME_FOR_THREAD_MMAP) {
-      continue;
-    }
-    auto tuple = SplitUrlInApk(filename);
-    if (std::get<0>(tuple)) {
-      if (!GetBuildIdFromApkFile(std::get<1>(tuple), std::get<2>(tuple), &build_id)) {
-        LOG(DEBUG) << "can't read build_id from file " << filename;
-        continue;
-      }
-    } else {
-      if (!GetBuildIdFromElfFile(filename, &build_id)) {
-        LOG(DEBUG) << "can't read build_id from file " << filename;
-        continue;
-      }
-    }
-    build_id_records.push_back(CreateBuildIdRecord(false, UINT_MAX, build_id, filename));
-  }
+  GetBuildIdRecordsOfHitFiles(hit_kernel_modules_, hit_user_files_, &build_id_records);
   if (!record_file_writer_->WriteBuildIdFeature(build_id_records)) {
     return false;
   }
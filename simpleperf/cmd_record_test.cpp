@@ -19,7 +19,9 @@
 #include <android-base/stringprintf.h>
 #include <android-base/test_utils.h>
 
+#include <algorithm>
 #include <memory>
+#include <set>
 
 #include "command.h"
 #include "environment.h"
@@ -66,6 +68,11 @@ TEST(record_cmd, event_option) {
   ASSERT_TRUE(RunRecordCmd({"-e", "cpu-clock"}));
 }
 
+TEST(record_cmd, group_option) {
+  ASSERT_TRUE(RunRecordCmd({"--group", "cpu-clock,task-clock"}));
+  ASSERT_TRUE(RunRecordCmd({"-e", "page-faults", "--group", "cpu-clock,task-clock"}));
+}
+
 TEST(record_cmd, freq_option) {
   ASSERT_TRUE(RunRecordCmd({"-f", "99"}));
   ASSERT_TRUE(RunRecordCmd({"-F", "99"}));
@@ -166,6 +173,165 @@ TEST(record_cmd, post_unwind_option) {
       RunRecordCmd({"--call-graph", "dwarf", "--no-unwind", "--post-unwind"}));
 }
 
+TEST(record_cmd, post_unwind_jobs_option) {
+  if (IsDwarfCallChainSamplingSupported()) {
+    ASSERT_TRUE(RunRecordCmd({"--call-graph", "dwarf", "--post-unwind", "--post-unwind-jobs", "4"}));
+  } else {
+    GTEST_LOG_(INFO)
+        << "This test does nothing as dwarf callchain sampling is not supported on this device.";
+  }
+  ASSERT_FALSE(RunRecordCmd({"--post-unwind-jobs", "4"}));
+  ASSERT_FALSE(RunRecordCmd({"--call-graph", "dwarf", "--post-unwind", "--post-unwind-jobs", "0"}));
+}
+
+TEST(record_cmd, dedup_stack_option) {
+  if (IsDwarfCallChainSamplingSupported()) {
+    ASSERT_TRUE(RunRecordCmd({"--call-graph", "dwarf", "--no-unwind", "--dedup-stack"}));
+    ASSERT_TRUE(RunRecordCmd({"--call-graph", "dwarf", "--post-unwind", "--dedup-stack"}));
+    ASSERT_FALSE(RunRecordCmd({"--call-graph", "dwarf", "--dedup-stack"}));
+  } else {
+    GTEST_LOG_(INFO)
+        << "This test does nothing as dwarf callchain sampling is not supported on this device.";
+  }
+  ASSERT_FALSE(RunRecordCmd({"--dedup-stack"}));
+}
+
+TEST(record_cmd, aggregate_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"--aggregate", "-e", "cpu-clock", "-f", "4000"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<std::unique_ptr<Record>> records = reader->DataSection();
+  std::set<std::pair<uint32_t, uint64_t>> samples_between_other_records;
+  for (auto& record : records) {
+    if (record->type() != PERF_RECORD_SAMPLE) {
+      samples_between_other_records.clear();
+      continue;
+    }
+    auto& r = *static_cast<SampleRecord*>(record.get());
+    // Samples of the same ip in the same thread are merged unless other records come between.
+    ASSERT_TRUE(samples_between_other_records.insert(
+        std::make_pair(r.tid_data.tid, r.ip_data.ip)).second);
+  }
+  if (IsDwarfCallChainSamplingSupported()) {
+    ASSERT_TRUE(RunRecordCmd({"--aggregate", "--call-graph", "dwarf"}));
+    ASSERT_FALSE(RunRecordCmd({"--aggregate", "--call-graph", "dwarf", "--post-unwind"}));
+  }
+}
+
+TEST(record_cmd, snapshot_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"--snapshot", "0.1", "-e", "cpu-clock", "-f", "4000"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<std::unique_ptr<Record>> records = reader->DataSection();
+  uint64_t min_time = UINT64_MAX;
+  uint64_t max_time = 0;
+  bool has_mmap = false;
+  for (auto& record : records) {
+    if (record->type() == PERF_RECORD_SAMPLE) {
+      min_time = std::min(min_time, record->Timestamp());
+      max_time = std::max(max_time, record->Timestamp());
+    } else if (record->type() == PERF_RECORD_MMAP) {
+      has_mmap = true;
+    }
+  }
+  // Only samples of the last 0.1 seconds are kept, and the maps they refer to are still written.
+  ASSERT_TRUE(has_mmap);
+  if (max_time != 0) {
+    ASSERT_LE(max_time - min_time, 100000000u);
+  }
+  ASSERT_FALSE(RunRecordCmd({"--snapshot", "0"}));
+  ASSERT_FALSE(RunRecordCmd({"--snapshot", "1s"}));
+}
+
+TEST(record_cmd, compress_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"--compress", "-e", "cpu-clock"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_EQ(1u, reader->FeatureSectionDescriptors().count(PerfFileFormat::FEAT_COMPRESSED_DATA));
+  ASSERT_FALSE(reader->DataSection().empty());
+}
+
+TEST(record_cmd, direct_io_option) {
+  ASSERT_TRUE(RunRecordCmd({"--direct-io"}));
+}
+
+TEST(record_cmd, per_cpu_readers_option) {
+  ASSERT_TRUE(RunRecordCmd({"--per-cpu-readers"}));
+  if (IsRoot()) {
+    ASSERT_TRUE(RunRecordCmd({"--per-cpu-readers", "-a"}));
+  }
+}
+
+TEST(record_cmd, target_bandwidth_option) {
+  TemporaryFile tmpfile;
+  // A target this low makes the frequency drop as soon as any data is read. Run long enough for
+  // the frequency to be adjusted.
+  ASSERT_TRUE(RecordCmd()->Run({"-e", "cpu-clock", "-f", "4000", "--target-bandwidth", "1", "-o",
+                                tmpfile.path, "sleep", "0.5"}));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<SampleFreqChange> changes = reader->ReadSampleFreqChangesFeature();
+  ASSERT_GE(changes.size(), 2u);
+  ASSERT_EQ(4000u, changes[0].freq);
+  ASSERT_LT(changes[1].freq, 4000u);
+  for (size_t i = 1; i < changes.size(); ++i) {
+    ASSERT_LE(changes[i].freq, 4000u);
+    ASSERT_GE(changes[i].time, changes[i - 1].time);
+  }
+  ASSERT_FALSE(RunRecordCmd({"-c", "10000", "--target-bandwidth", "1000"}));
+  ASSERT_FALSE(RunRecordCmd({"--target-bandwidth", "0"}));
+}
+
+TEST(record_cmd, trace_offcpu_option) {
+  ASSERT_FALSE(RunRecordCmd({"--trace-offcpu", "-e", "cpu-cycles"}));
+  ASSERT_FALSE(RunRecordCmd({"--trace-offcpu", "--aggregate"}));
+  if (IsRoot()) {
+    TemporaryFile tmpfile;
+    ASSERT_TRUE(RunRecordCmd({"--trace-offcpu", "--call-graph", "fp"}, tmpfile.path));
+    std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+    ASSERT_TRUE(reader != nullptr);
+    ASSERT_EQ(2u, reader->AttrSection().size());
+    std::vector<TracingFormat> formats = reader->ReadTracepointFormatsFeature();
+    ASSERT_EQ(1u, formats.size());
+    ASSERT_EQ("sched:sched_switch", formats[0].FullName());
+    TemporaryFile report_file;
+    ASSERT_TRUE(CreateCommandInstance("report")->Run(
+        {"-i", tmpfile.path, "-g", "-o", report_file.path}));
+  }
+}
+
+TEST(record_cmd, start_profile_at_symbol_option) {
+  ASSERT_FALSE(RecordCmd()->Run({"--start-profile-at-symbol", "main", "-a", "sleep", "1"}));
+  ASSERT_FALSE(RecordCmd()->Run({"--start-profile-at-symbol", "main"}));
+  ASSERT_FALSE(RunRecordCmd({"--start-profile-at-symbol", "no_such_function_in_sleep"}));
+  if (!IsRoot()) {
+    GTEST_LOG_(INFO) << "This test needs root privileges to use uprobe events";
+    return;
+  }
+  // Record this test binary listing its tests, starting at its main function.
+  std::string exec_path;
+  ASSERT_TRUE(GetExecPath(&exec_path));
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RecordCmd()->Run({"--start-profile-at-symbol", "main", "-o", tmpfile.path,
+                                exec_path, "--gtest_list_tests"}));
+}
+
+TEST(record_cmd, no_dump_kernel_symbols_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"--no-dump-kernel-symbols"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_EQ(0u, reader->FeatureSectionDescriptors().count(FEAT_KERNEL_SYMBOLS));
+}
+
+TEST(record_cmd, symbol_cache_option) {
+  TemporaryDir tmpdir;
+  ASSERT_TRUE(RunRecordCmd({"--symbol-cache", tmpdir.path}));
+}
+
 TEST(record_cmd, existing_processes) {
   std::vector<std::unique_ptr<Workload>> workloads;
   CreateProcesses(2, &workloads);
@@ -16,12 +16,18 @@
 
 #include <inttypes.h>
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -29,6 +35,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
+#include "branch_aggregator.h"
 #include "command.h"
 #include "dwarf_unwind.h"
 #include "environment.h"
@@ -57,9 +64,13 @@ class Displayable {
   }
 
   virtual std::string Show(const SampleEntry& sample) const = 0;
-  void AdjustWidth(const SampleEntry& sample) {
-    size_t size = Show(sample).size();
-    width_ = std::max(width_, size);
+  // Append what Show() returns to s. Items shown on every report line override it to format
+  // into s directly, without building a temporary string.
+  virtual void AppendTo(const SampleEntry& sample, std::string* s) const {
+    s->append(Show(sample));
+  }
+  void AdjustWidth(size_t width) {
+    width_ = std::max(width_, width);
   }
 
  private:
@@ -67,6 +78,13 @@ class Displayable {
   size_t width_;
 };
 
+static void AppendPercentage(uint64_t period, uint64_t total_period, std::string* s) {
+  double percentage = (total_period != 0) ? 100.0 * period / total_period : 0.0;
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%.2lf%%", percentage);
+  s->append(buf, len);
+}
+
 class AccumulatedOverheadItem : public Displayable {
  public:
   AccumulatedOverheadItem(const SampleTree& sample_tree)
@@ -74,10 +92,13 @@ class AccumulatedOverheadItem : public Displayable {
   }
 
   std::string Show(const SampleEntry& sample) const override {
-    uint64_t period = sample.period + sample.accumulated_period;
-    uint64_t total_period = sample_tree_.TotalPeriod();
-    double percentage = (total_period != 0) ? 100.0 * period / total_period : 0.0;
-    return android::base::StringPrintf("%.2lf%%", percentage);
+    std::string s;
+    AppendTo(sample, &s);
+    return s;
+  }
+
+  void AppendTo(const SampleEntry& sample, std::string* s) const override {
+    AppendPercentage(sample.period + sample.accumulated_period, sample_tree_.TotalPeriod(), s);
   }
 
  private:
@@ -91,10 +112,13 @@ class SelfOverheadItem : public Displayable {
   }
 
   std::string Show(const SampleEntry& sample) const override {
-    uint64_t period = sample.period;
-    uint64_t total_period = sample_tree_.TotalPeriod();
-    double percentage = (total_period != 0) ? 100.0 * period / total_period : 0.0;
-    return android::base::StringPrintf("%.2lf%%", percentage);
+    std::string s;
+    AppendTo(sample, &s);
+    return s;
+  }
+
+  void AppendTo(const SampleEntry& sample, std::string* s) const override {
+    AppendPercentage(sample.period, sample_tree_.TotalPeriod(), s);
   }
 
  private:
@@ -111,12 +135,23 @@ class SampleCountItem : public Displayable {
   }
 };
 
+// Hash a null-terminated string with FNV-1a.
+static uint64_t HashString(const char* s) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *s != '\0'; ++s) {
+    hash = (hash ^ static_cast<unsigned char>(*s)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
 class Comparable {
  public:
   virtual ~Comparable() {
   }
 
   virtual int Compare(const SampleEntry& sample1, const SampleEntry& sample2) const = 0;
+  // Samples comparing equal in Compare() should have the same hash value.
+  virtual uint64_t Hash(const SampleEntry& sample) const = 0;
 };
 
 class PidItem : public Displayable, public Comparable {
@@ -128,6 +163,10 @@ class PidItem : public Displayable, public Comparable {
     return sample1.thread->pid - sample2.thread->pid;
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return sample.thread->pid;
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return android::base::StringPrintf("%d", sample.thread->pid);
   }
@@ -142,6 +181,10 @@ class TidItem : public Displayable, public Comparable {
     return sample1.thread->tid - sample2.thread->tid;
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return sample.thread->tid;
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return android::base::StringPrintf("%d", sample.thread->tid);
   }
@@ -153,12 +196,24 @@ class CommItem : public Displayable, public Comparable {
   }
 
   int Compare(const SampleEntry& sample1, const SampleEntry& sample2) const override {
+    // Comms are interned by ThreadTree, so equal comms usually share the same pointer.
+    if (sample1.thread_comm == sample2.thread_comm) {
+      return 0;
+    }
     return strcmp(sample1.thread_comm, sample2.thread_comm);
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return HashString(sample.thread_comm);
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return sample.thread_comm;
   }
+
+  void AppendTo(const SampleEntry& sample, std::string* s) const override {
+    s->append(sample.thread_comm);
+  }
 };
 
 class DsoItem : public Displayable, public Comparable {
@@ -170,9 +225,17 @@ class DsoItem : public Displayable, public Comparable {
     return strcmp(sample1.map->dso->Path().c_str(), sample2.map->dso->Path().c_str());
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return HashString(sample.map->dso->Path().c_str());
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return sample.map->dso->Path();
   }
+
+  void AppendTo(const SampleEntry& sample, std::string* s) const override {
+    s->append(sample.map->dso->Path());
+  }
 };
 
 class SymbolItem : public Displayable, public Comparable {
@@ -184,9 +247,85 @@ class SymbolItem : public Displayable, public Comparable {
     return strcmp(sample1.symbol->DemangledName(), sample2.symbol->DemangledName());
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return HashString(sample.symbol->DemangledName());
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return sample.symbol->DemangledName();
   }
+
+  void AppendTo(const SampleEntry& sample, std::string* s) const override {
+    s->append(sample.symbol->DemangledName());
+  }
+};
+
+// Sort by the source line of sample.ip, like "foo.cpp:10". Code inlined into other functions
+// also has the call sites it is inlined into, like "foo.h:5 inlined at foo.cpp:10".
+class SrclineItem : public Displayable, public Comparable {
+ public:
+  SrclineItem() : Displayable("Source Line") {
+  }
+
+  int Compare(const SampleEntry& sample1, const SampleEntry& sample2) const override {
+    SourceLine line1;
+    SourceLine line2;
+    bool found1 = FindSourceLine(sample1, &line1);
+    bool found2 = FindSourceLine(sample2, &line2);
+    while (found1 && found2) {
+      // Paths are shared by lines of the same file in a dso.
+      if (line1.file != line2.file) {
+        int result = strcmp(line1.file, line2.file);
+        if (result != 0) {
+          return result;
+        }
+      }
+      if (line1.line != line2.line) {
+        return line1.line < line2.line ? -1 : 1;
+      }
+      found1 = FindCallSite(sample1, &line1);
+      found2 = FindCallSite(sample2, &line2);
+    }
+    return static_cast<int>(found1) - static_cast<int>(found2);
+  }
+
+  uint64_t Hash(const SampleEntry& sample) const override {
+    uint64_t hash = 0;
+    SourceLine line;
+    for (bool found = FindSourceLine(sample, &line); found; found = FindCallSite(sample, &line)) {
+      hash = (hash * 31 + HashString(line.file)) * 31 + line.line;
+    }
+    return hash;
+  }
+
+  std::string Show(const SampleEntry& sample) const override {
+    std::string s;
+    AppendTo(sample, &s);
+    return s;
+  }
+
+  void AppendTo(const SampleEntry& sample, std::string* s) const override {
+    SourceLine line;
+    if (!FindSourceLine(sample, &line)) {
+      s->append("unknown");
+      return;
+    }
+    s->append(android::base::StringPrintf("%s:%u", line.file, line.line));
+    while (FindCallSite(sample, &line)) {
+      s->append(android::base::StringPrintf(" inlined at %s:%u", line.file, line.line));
+    }
+  }
+
+ private:
+  static bool FindSourceLine(const SampleEntry& sample, SourceLine* line) {
+    return sample.map->dso->FindSourceLine(ThreadTree::GetVaddrInFile(sample.map, sample.ip),
+                                           line);
+  }
+
+  static bool FindCallSite(const SampleEntry& sample, SourceLine* line) {
+    return line->inlined_call != SourceLine::NOT_INLINED &&
+           sample.map->dso->FindInlinedCallSite(line->inlined_call, line);
+  }
 };
 
 class DsoFromItem : public Displayable, public Comparable {
@@ -199,6 +338,10 @@ class DsoFromItem : public Displayable, public Comparable {
                   sample2.branch_from.map->dso->Path().c_str());
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return HashString(sample.branch_from.map->dso->Path().c_str());
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return sample.branch_from.map->dso->Path();
   }
@@ -220,6 +363,10 @@ class SymbolFromItem : public Displayable, public Comparable {
                   sample2.branch_from.symbol->DemangledName());
   }
 
+  uint64_t Hash(const SampleEntry& sample) const override {
+    return HashString(sample.branch_from.symbol->DemangledName());
+  }
+
   std::string Show(const SampleEntry& sample) const override {
     return sample.branch_from.symbol->DemangledName();
   }
@@ -231,6 +378,235 @@ class SymbolToItem : public SymbolItem {
   }
 };
 
+// Sort by the value of a field in raw data of tracepoint samples, like
+// "sched_switch:prev_comm". index is the position of the field in
+// SampleEntry::tracepoint_values.
+class TracepointFieldItem : public Displayable, public Comparable {
+ public:
+  TracepointFieldItem(const std::string& name, size_t index) : Displayable(name), index_(index) {
+  }
+
+  int Compare(const SampleEntry& sample1, const SampleEntry& sample2) const override {
+    const char* value1 = Value(sample1);
+    const char* value2 = Value(sample2);
+    return (value1 == value2) ? 0 : strcmp(value1, value2);
+  }
+
+  uint64_t Hash(const SampleEntry& sample) const override {
+    // Values are interned, so equal values have equal pointers.
+    return reinterpret_cast<uintptr_t>(Value(sample));
+  }
+
+  std::string Show(const SampleEntry& sample) const override {
+    return Value(sample);
+  }
+
+ private:
+  const char* Value(const SampleEntry& sample) const {
+    // Samples only used in callchains have no tracepoint values.
+    return (sample.tracepoint_values != nullptr) ? (*sample.tracepoint_values)[index_] : "";
+  }
+
+  const size_t index_;
+};
+
+struct ResolvedIp {
+  uint64_t ip;
+  const MapEntry* map;
+};
+
+// ResolvedSample is a sample whose thread, thread comm and maps are found in the ThreadTree
+// at the time of the sample. Aggregating it into a SampleTree doesn't need the ThreadTree to
+// stay at that state.
+struct ResolvedSample {
+  const ThreadEntry* thread;
+  const char* thread_comm;
+  uint64_t time;
+  uint64_t period;
+  bool is_branch_sample;
+  // For a normal sample, the sampled ip followed by the callchain ips. For a branch sample,
+  // pairs of branch from and branch to addresses.
+  std::vector<ResolvedIp> ips;
+  std::vector<uint64_t> branch_flags;
+  const std::vector<const char*>* tracepoint_values;
+};
+
+// ParallelSampleAggregator passes batches of resolved samples to worker threads. Each worker
+// aggregates samples into its own SampleTree, and the trees are merged in Finish().
+class ParallelSampleAggregator {
+ public:
+  ParallelSampleAggregator(size_t jobs, std::function<std::unique_ptr<SampleTree>()> create_tree,
+                           std::function<void(const ResolvedSample&, SampleTree*)> aggregate)
+      : aggregate_(aggregate), pending_size_(0), finished_(false) {
+    for (size_t i = 0; i < jobs; ++i) {
+      trees_.push_back(create_tree());
+    }
+    for (size_t i = 0; i < jobs; ++i) {
+      threads_.push_back(std::thread(&ParallelSampleAggregator::WorkerThread, this, trees_[i].get()));
+    }
+    max_queued_batches_ = jobs * 4;
+    pending_batch_.resize(kBatchSize);
+  }
+
+  ~ParallelSampleAggregator() {
+    StopWorkers();
+  }
+
+  // Return a sample in the pending batch to fill. The batch is sent to the workers when full.
+  ResolvedSample* NextSample() {
+    if (pending_size_ == pending_batch_.size()) {
+      SendPendingBatch();
+    }
+    return &pending_batch_[pending_size_++];
+  }
+
+  // Drop the sample returned by the last NextSample() call.
+  void DiscardSample() {
+    --pending_size_;
+  }
+
+  // Wait for workers to aggregate all samples, and merge their trees into sample_tree.
+  void Finish(SampleTree* sample_tree) {
+    SendPendingBatch();
+    StopWorkers();
+    for (auto& tree : trees_) {
+      sample_tree->Merge(*tree);
+    }
+  }
+
+ private:
+  static constexpr size_t kBatchSize = 1024;
+
+  void SendPendingBatch() {
+    if (pending_size_ == 0) {
+      return;
+    }
+    pending_batch_.resize(pending_size_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_not_full_cond_.wait(lock, [this]() { return batches_.size() < max_queued_batches_; });
+    batches_.push_back(std::move(pending_batch_));
+    queue_not_empty_cond_.notify_one();
+    lock.unlock();
+    if (!free_batches_.empty()) {
+      pending_batch_ = std::move(free_batches_.back());
+      free_batches_.pop_back();
+    } else {
+      pending_batch_.clear();
+    }
+    pending_batch_.resize(kBatchSize);
+    pending_size_ = 0;
+  }
+
+  void StopWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    queue_not_empty_cond_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+    threads_.clear();
+  }
+
+  void WorkerThread(SampleTree* sample_tree) {
+    while (true) {
+      std::vector<ResolvedSample> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_not_empty_cond_.wait(lock, [this]() { return !batches_.empty() || finished_; });
+        if (batches_.empty()) {
+          return;
+        }
+        batch = std::move(batches_.front());
+        batches_.pop_front();
+        queue_not_full_cond_.notify_one();
+      }
+      for (auto& sample : batch) {
+        aggregate_(sample, sample_tree);
+      }
+      // Give the batch back, so the ips vectors in it can be reused.
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_batches_.push_back(std::move(batch));
+    }
+  }
+
+  std::function<void(const ResolvedSample&, SampleTree*)> aggregate_;
+  std::vector<std::unique_ptr<SampleTree>> trees_;
+  std::vector<std::thread> threads_;
+  std::vector<ResolvedSample> pending_batch_;
+  size_t pending_size_;
+
+  std::mutex mutex_;
+  std::condition_variable queue_not_empty_cond_;
+  std::condition_variable queue_not_full_cond_;
+  std::deque<std::vector<ResolvedSample>> batches_;
+  std::vector<std::vector<ResolvedSample>> free_batches_;
+  size_t max_queued_batches_;
+  bool finished_;
+};
+
+// DsoPrefetcher loads dsos on worker threads, so the thread decoding records doesn't stall
+// on parsing each elf file the first time a sample hits it.
+class DsoPrefetcher {
+ public:
+  explicit DsoPrefetcher(size_t jobs) : finished_(false) {
+    for (size_t i = 0; i < jobs; ++i) {
+      threads_.push_back(std::thread(&DsoPrefetcher::WorkerThread, this));
+    }
+  }
+
+  ~DsoPrefetcher() {
+    Finish();
+  }
+
+  void Add(Dso* dso) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dsos_.push_back(dso);
+    cond_.notify_one();
+  }
+
+  // Wait for workers to load all added dsos.
+  void Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    cond_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+    threads_.clear();
+  }
+
+ private:
+  void WorkerThread() {
+    while (true) {
+      Dso* dso;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return !dsos_.empty() || finished_; });
+        if (dsos_.empty()) {
+          return;
+        }
+        dso = dsos_.front();
+        dsos_.pop_front();
+      }
+      dso->Preload();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Dso*> dsos_;
+  bool finished_;
+};
+
+// Number of entries shown for each window in --time-slice mode.
+constexpr size_t TIME_SLICE_TOP_ENTRIES = 5;
+constexpr size_t REPORT_BUFFER_FLUSH_SIZE = 1 << 20;
+
 static std::set<std::string> branch_sort_keys = {
     "dso_from", "dso_to", "symbol_from", "symbol_to",
 };
@@ -244,63 +620,145 @@ class ReportCommand : public Command {
             "    -b            Use the branch-to addresses in sampled take branches instead of\n"
             "                  the instruction addresses. Only valid for perf.data recorded with\n"
             "                  -b/-j option.\n"
+            "    --autofdo <file>\n"
+            "                  Write the taken branches and the address ranges executed between\n"
+            "                  them for each binary to <file>, in the text format read by\n"
+            "                  AutoFDO. Only valid with -b option.\n"
+            "    --branch-edges\n"
+            "                  Print how many times branches between each pair of symbols are\n"
+            "                  taken and mispredicted, instead of the default report. Only valid\n"
+            "                  with -b option.\n"
             "    --children    Print the overhead accumulated by appearing in the callchain.\n"
             "    --comms comm1,comm2,...\n"
             "                  Report only for selected comms.\n"
             "    --dsos dso1,dso2,...\n"
             "                  Report only for selected dsos.\n"
+            "    --export json\n"
+            "                  Write the aggregated entries and their call graphs as json instead\n"
+            "                  of the default report, for GUIs and scripts. Strings are interned\n"
+            "                  in a \"strings\" array and referred to by index. With -g, the call\n"
+            "                  graph of each entry is an array of nodes with the index of their\n"
+            "                  parents. Can't be used with -b, --format or --time-slice.\n"
+            "    --format folded\n"
+            "                  Print one line per distinct callchain instead of the default\n"
+            "                  report, like \"main;foo;bar 1234\", with functions from the\n"
+            "                  outermost caller to the sampled one, followed by the event count.\n"
+            "                  The output can be read by flamegraph tools. Needs perf.data\n"
+            "                  recorded with -g or --call-graph. Can't be used with -b, -g,\n"
+            "                  or --time-slice.\n"
             "    -g [callee|caller]\n"
             "                  Print call graph. If callee mode is used, the graph shows how\n"
             "                  functions are called from others. Otherwise, the graph shows how\n"
             "                  functions call others. Default is callee mode.\n"
             "    -i <file>     Specify path of record file, default is perf.data.\n"
+            "    --jobs <n>    Use n threads to look up symbols and aggregate samples.\n"
+            "                  Default is 1.\n"
             "    -n            Print the sample count for each item.\n"
             "    --no-demangle        Don't demangle symbol names.\n"
             "    -o report_file_name  Set report file name, default is stdout.\n"
             "    --pid pid1,pid2,...\n"
             "                  Report only for selected pids.\n"
+            "    --reorder-window <ms>\n"
+            "                  Sort records by time within windows of <ms> milliseconds while\n"
+            "                  reading them. Default is 1000. Use 0 to sort all records of the\n"
+            "                  file, which needs more memory.\n"
             "    --sort key1,key2,...\n"
             "                  Select the keys to sort and print the report. Possible keys\n"
-            "                  include pid, tid, comm, dso, symbol, dso_from, dso_to, symbol_from\n"
-            "                  symbol_to. dso_from, dso_to, symbol_from, symbol_to can only be\n"
-            "                  used with -b option. Default keys are \"comm,pid,tid,dso,symbol\"\n"
+            "                  include pid, tid, comm, dso, symbol, srcline, dso_from, dso_to,\n"
+            "                  symbol_from, symbol_to. dso_from, dso_to, symbol_from, symbol_to\n"
+            "                  can only be used with -b option. Default keys are\n"
+            "                  \"comm,pid,tid,dso,symbol\". srcline is the source file and line\n"
+            "                  from the DWARF line table of the dso, with the call sites of\n"
+            "                  inlined functions. Line tables are also saved in --symbol-cache.\n"
+            "                  For tracepoint events, a key can also be a field of the event,\n"
+            "                  like \"sched_switch:prev_comm\", decoded from raw data of samples.\n"
+            "    --symbol-cache <dir>\n"
+            "                  Save symbols of files with build ids in <dir>, and load them from\n"
+            "                  there in later reports instead of parsing the files again.\n"
             "    --symfs <dir> Look for files with symbols relative to this directory.\n"
             "    --tids tid1,tid2,...\n"
             "                  Report only for selected tids.\n"
+            "    --time-slice <ms>\n"
+            "                  Split samples into time windows of <ms> milliseconds, and print\n"
+            "                  one line per window with the top entries of that window. Each\n"
+            "                  window is printed as soon as it is complete. Can't be used with\n"
+            "                  -g. Samples are aggregated on the reading thread, so --jobs only\n"
+            "                  affects symbol preloading.\n"
             "    --vmlinux <file>\n"
-            "                  Parse kernel symbols from <file>.\n"),
+            "                  Parse kernel symbols from <file>.\n"
+            "For perf.data recorded with --trace-offcpu, samples taken when threads are\n"
+            "scheduled off the cpu are weighted by the time until the thread runs again, so the\n"
+            "overhead of each entry is its share of the time on and off the cpu.\n"),
         record_filename_("perf.data"),
         record_file_arch_(GetBuildArch()),
         use_branch_address_(false),
+        print_branch_edges_(false),
+        print_folded_stacks_(false),
+        export_json_(false),
+        use_periods_of_sample_freqs_(false),
+        trace_offcpu_(false),
+        has_next_pid_field_(false),
+        last_sample_time_(0),
+        offcpu_sample_count_(0),
+        offcpu_time_(0),
         accumulate_callchain_(false),
         print_callgraph_(false),
         callgraph_show_callee_(true),
+        jobs_(1),
+        time_slice_in_ns_(0),
+        reorder_window_in_ns_(RecordFileReader::DEFAULT_REORDER_WINDOW_IN_NS),
+        window_start_time_(0),
+        first_sample_time_(0),
+        report_file_(nullptr, fclose),
         report_fp_(nullptr) {
-    compare_sample_func_t compare_sample_callback = std::bind(
-        &ReportCommand::CompareSampleEntry, this, std::placeholders::_1, std::placeholders::_2);
-    sample_tree_ =
-        std::unique_ptr<SampleTree>(new SampleTree(&thread_tree_, compare_sample_callback));
+    thread_tree_.SetDsoContext(&dso_context_);
+    sample_tree_ = CreateSampleTree();
   }
 
   bool Run(const std::vector<std::string>& args);
 
  private:
+  // DiffCommand builds the SampleTrees of two record files with two ReportCommands.
+  friend class DiffCommand;
+
   bool ParseOptions(const std::vector<std::string>& args);
+  std::unique_ptr<SampleTree> CreateSampleTree();
+  bool OpenRecordFile();
+  bool FindTracepointFields();
+  const std::vector<const char*>* DecodeTracepointValues(const SampleRecord& r);
   bool ReadEventAttrFromRecordFile();
   void ReadSampleTreeFromRecordFile();
-  void ProcessRecord(std::unique_ptr<Record> record);
+  void ProcessRecord(const RecordView& view);
   void ProcessSampleRecord(const SampleRecord& r);
+  const MapEntry* FindBranchMap(const ThreadEntry* thread, uint64_t ip);
+  bool ResolveSample(const SampleRecord& r, ResolvedSample* sample);
+  void AddResolvedSample(ResolvedSample* sample);
+  bool ProcessOffCpuSample(const SampleRecord& r);
+  void EndOffCpuInterval(int tid, uint64_t time);
+  void FlushOffCpuSamples();
+  uint64_t GetPeriodOfSampleFreq(uint64_t time) const;
+  void AggregateSample(const ResolvedSample& sample, SampleTree* sample_tree);
+  void AggregateBranchStack(const ResolvedSample& sample);
   bool ReadFeaturesFromRecordFile();
   int CompareSampleEntry(const SampleEntry& sample1, const SampleEntry& sample2);
-  bool PrintReport();
+  uint64_t HashSampleEntry(const SampleEntry& sample);
+  void PrintReport();
   void PrintReportContext();
-  void CollectReportWidth();
-  void CollectReportEntryWidth(const SampleEntry& sample);
   void PrintReportHeader();
-  void PrintReportEntry(const SampleEntry& sample);
   void PrintCallGraph(const SampleEntry& sample);
-  void PrintCallGraphEntry(size_t depth, std::string prefix, const std::unique_ptr<CallChainNode>& node,
+  void PrintCallGraphEntry(size_t depth, std::string* prefix, const CallChainNode* node,
                            uint64_t parent_period, bool last);
+  void FlushReportBuffer(size_t min_size);
+  bool OpenReportFile();
+  void PrintTimeSliceHeader();
+  void AddSampleToTimeSlice(const ResolvedSample& sample);
+  void PrintTimeSlice();
+  void PrintBranchEdges();
+  bool WriteAutoFdoFile();
+  void PrintFoldedStacks();
+  void PrintFoldedStackNode(const CallChainNode* node, std::string* stack);
+  std::string GetEventTypeName() const;
+  void ExportJson();
 
   std::string record_filename_;
   ArchType record_file_arch_;
@@ -308,16 +766,80 @@ class ReportCommand : public Command {
   perf_event_attr event_attr_;
   std::vector<std::unique_ptr<Displayable>> displayable_items_;
   std::vector<Comparable*> comparable_items_;
+  // Symfs dir and build ids of the record file. Each ReportCommand has its own, so DiffCommand
+  // can read two record files at the same time.
+  DsoContext dso_context_;
   ThreadTree thread_tree_;
+  OfflineUnwinder offline_unwinder_;
   std::unique_ptr<SampleTree> sample_tree_;
   bool use_branch_address_;
+  bool print_branch_edges_;
+  bool print_folded_stacks_;
+  bool export_json_;
+  std::string autofdo_filename_;
+  // Aggregates branch stacks for --branch-edges and --autofdo.
+  std::unique_ptr<BranchAggregator> branch_aggregator_;
   std::string record_cmdline_;
+  // Sample frequencies used by `record --target-bandwidth`.
+  std::vector<PerfFileFormat::SampleFreqChange> sample_freq_changes_;
+  // Whether to weight samples by the period of the frequency used at their time, instead of the
+  // period in the samples.
+  bool use_periods_of_sample_freqs_;
+
+  // An off-cpu sample of a thread, from the sched:sched_switch event recorded by
+  // `record --trace-offcpu`. Its period is the time until the thread runs again, so it is kept
+  // here until then.
+  struct OffCpuSample {
+    bool pending;
+    // Set when the thread exits, so its last switch off the cpu isn't taken as blocking.
+    bool exited;
+    ResolvedSample sample;
+
+    OffCpuSample() : pending(false), exited(false) {
+    }
+  };
+  bool trace_offcpu_;
+  std::unordered_set<uint64_t> sched_switch_ids_;
+  TracingField next_pid_field_;
+  bool has_next_pid_field_;
+  std::unordered_map<int, OffCpuSample> offcpu_samples_;
+  uint64_t last_sample_time_;
+  uint64_t offcpu_sample_count_;
+  uint64_t offcpu_time_;
   bool accumulate_callchain_;
   bool print_callgraph_;
   bool callgraph_show_callee_;
+  std::unordered_set<int> pid_filter_;
+  std::unordered_set<int> tid_filter_;
+  std::unordered_set<std::string> comm_filter_;
+  std::unordered_set<std::string> dso_filter_;
+  size_t jobs_;
+  ResolvedSample resolved_sample_;
+  std::unique_ptr<ParallelSampleAggregator> aggregator_;
+  std::unordered_set<std::string> hit_files_;
+  std::unique_ptr<DsoPrefetcher> dso_prefetcher_;
+  // Displayable items of the sort keys, used to name entries in --time-slice mode.
+  std::vector<Displayable*> sort_key_items_;
+  // Tracepoint fields used as sort keys, as "<event>:<field>" and as found in the tracepoint
+  // formats feature of the record file.
+  std::vector<std::string> tracepoint_field_keys_;
+  std::vector<TracingField> tracepoint_fields_;
+  StringPool tracepoint_value_pool_;
+  std::set<std::vector<const char*>> tracepoint_value_sets_;
+  uint64_t time_slice_in_ns_;
+  uint64_t reorder_window_in_ns_;
+  // The SampleTree of the current window in --time-slice mode. Only one window is kept in
+  // memory at a time.
+  std::unique_ptr<SampleTree> window_tree_;
+  uint64_t window_start_time_;
+  uint64_t first_sample_time_;
 
   std::string report_filename_;
+  std::unique_ptr<FILE, decltype(&fclose)> report_file_;
   FILE* report_fp_;
+  // Report lines are formatted into report_buffer_, and written with one fwrite() when it
+  // grows past REPORT_BUFFER_FLUSH_SIZE, instead of with one fprintf() per field.
+  std::string report_buffer_;
 };
 
 bool ReportCommand::Run(const std::vector<std::string>& args) {
@@ -327,52 +849,88 @@ bool ReportCommand::Run(const std::vector<std::string>& args) {
   }
 
   // 2. Read record file and build SampleTree.
-  record_file_reader_ = RecordFileReader::CreateInstance(record_filename_);
-  if (record_file_reader_ == nullptr) {
+  if (!OpenRecordFile()) {
     return false;
   }
-  if (!ReadEventAttrFromRecordFile()) {
+  ScopedCurrentArch scoped_arch(record_file_arch_);
+  if (!OpenReportFile()) {
     return false;
   }
-  // Read features first to prepare build ids used when building SampleTree.
-  if (!ReadFeaturesFromRecordFile()) {
-    return false;
+  if (time_slice_in_ns_ != 0) {
+    // Windows are printed while reading the record file.
+    PrintTimeSliceHeader();
   }
-  ScopedCurrentArch scoped_arch(record_file_arch_);
   ReadSampleTreeFromRecordFile();
 
   // 3. Show collected information.
-  if (!PrintReport()) {
+  if (!autofdo_filename_.empty() && !WriteAutoFdoFile()) {
+    return false;
+  }
+  if (time_slice_in_ns_ != 0) {
+    PrintTimeSlice();
+  } else if (print_branch_edges_) {
+    PrintBranchEdges();
+  } else if (print_folded_stacks_) {
+    PrintFoldedStacks();
+  } else if (export_json_) {
+    ExportJson();
+  } else {
+    PrintReport();
+  }
+  fflush(report_fp_);
+  if (ferror(report_fp_) != 0) {
+    PLOG(ERROR) << "print report failed";
     return false;
   }
-
   return true;
 }
 
 bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
   bool demangle = true;
+  std::string symbol_cache_dir;
   std::string symfs_dir;
   std::string vmlinux;
   bool print_sample_count = false;
   std::vector<std::string> sort_keys = {"comm", "pid", "tid", "dso", "symbol"};
-  std::unordered_set<std::string> comm_filter;
-  std::unordered_set<std::string> dso_filter;
-  std::unordered_set<int> pid_filter;
-  std::unordered_set<int> tid_filter;
 
   for (size_t i = 0; i < args.size(); ++i) {
     if (args[i] == "-b") {
       use_branch_address_ = true;
+    } else if (args[i] == "--autofdo") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      autofdo_filename_ = args[i];
+    } else if (args[i] == "--branch-edges") {
+      print_branch_edges_ = true;
     } else if (args[i] == "--children") {
       accumulate_callchain_ = true;
     } else if (args[i] == "--comms" || args[i] == "--dsos") {
-      std::unordered_set<std::string>& filter = (args[i] == "--comms" ? comm_filter : dso_filter);
+      std::unordered_set<std::string>& filter = (args[i] == "--comms" ? comm_filter_ : dso_filter_);
       if (!NextArgumentOrError(args, &i)) {
         return false;
       }
       std::vector<std::string> strs = android::base::Split(args[i], ",");
       filter.insert(strs.begin(), strs.end());
 
+    } else if (args[i] == "--export") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (args[i] != "json") {
+        LOG(ERROR) << "Unknown argument with --export option: " << args[i];
+        return false;
+      }
+      export_json_ = true;
+    } else if (args[i] == "--format") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (args[i] != "folded") {
+        LOG(ERROR) << "Unknown argument with --format option: " << args[i];
+        return false;
+      }
+      print_folded_stacks_ = true;
     } else if (args[i] == "-g") {
       print_callgraph_ = true;
       accumulate_callchain_ = true;
@@ -393,6 +951,14 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
       }
       record_filename_ = args[i];
 
+    } else if (args[i] == "--jobs") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!android::base::ParseUint(args[i].c_str(), &jobs_) || jobs_ == 0) {
+        LOG(ERROR) << "Invalid argument for --jobs option: " << args[i];
+        return false;
+      }
     } else if (args[i] == "-n") {
       print_sample_count = true;
 
@@ -418,20 +984,46 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
         }
         ids.push_back(id);
       }
-      std::unordered_set<int>& filter = (args[i] == "--pids" ? pid_filter : tid_filter);
+      std::unordered_set<int>& filter = (args[i] == "--pids" ? pid_filter_ : tid_filter_);
       filter.insert(ids.begin(), ids.end());
 
+    } else if (args[i] == "--reorder-window") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      uint64_t reorder_window_in_ms;
+      if (!android::base::ParseUint(args[i].c_str(), &reorder_window_in_ms)) {
+        LOG(ERROR) << "Invalid argument for --reorder-window option: " << args[i];
+        return false;
+      }
+      reorder_window_in_ns_ = reorder_window_in_ms * 1000000;
     } else if (args[i] == "--sort") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
       }
       sort_keys = android::base::Split(args[i], ",");
+    } else if (args[i] == "--symbol-cache") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      symbol_cache_dir = args[i];
     } else if (args[i] == "--symfs") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
       }
       symfs_dir = args[i];
 
+    } else if (args[i] == "--time-slice") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      uint64_t time_slice_in_ms;
+      if (!android::base::ParseUint(args[i].c_str(), &time_slice_in_ms) ||
+          time_slice_in_ms == 0) {
+        LOG(ERROR) << "Invalid argument for --time-slice option: " << args[i];
+        return false;
+      }
+      time_slice_in_ns_ = time_slice_in_ms * 1000000;
     } else if (args[i] == "--vmlinux") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -443,13 +1035,34 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
     }
   }
 
+  if (time_slice_in_ns_ != 0 && print_callgraph_) {
+    LOG(ERROR) << "--time-slice option can't be used with -g option.";
+    return false;
+  }
+  if ((print_branch_edges_ || !autofdo_filename_.empty()) && !use_branch_address_) {
+    LOG(ERROR) << "--branch-edges and --autofdo options can only be used with -b option.";
+    return false;
+  }
+  if (print_folded_stacks_ && (use_branch_address_ || print_callgraph_ || time_slice_in_ns_ != 0)) {
+    LOG(ERROR) << "--format folded option can't be used with -b, -g or --time-slice options.";
+    return false;
+  }
+  if (export_json_ && (use_branch_address_ || print_folded_stacks_ || time_slice_in_ns_ != 0)) {
+    LOG(ERROR) << "--export option can't be used with -b, --format or --time-slice options.";
+    return false;
+  }
+  if (print_branch_edges_ || !autofdo_filename_.empty()) {
+    branch_aggregator_.reset(new BranchAggregator(&thread_tree_));
+  }
+
   Dso::SetDemangle(demangle);
-  if (!Dso::SetSymFsDir(symfs_dir)) {
+  if (!dso_context_.SetSymFsDir(symfs_dir)) {
     return false;
   }
   if (!vmlinux.empty()) {
     Dso::SetVmlinux(vmlinux);
   }
+  Dso::SetSymbolCacheDir(symbol_cache_dir);
 
   if (!accumulate_callchain_) {
     displayable_items_.push_back(
@@ -471,50 +1084,167 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
       PidItem* item = new PidItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "tid") {
       TidItem* item = new TidItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "comm") {
       CommItem* item = new CommItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "dso") {
       DsoItem* item = new DsoItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "symbol") {
       SymbolItem* item = new SymbolItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
+    } else if (key == "srcline") {
+      SrclineItem* item = new SrclineItem;
+      displayable_items_.push_back(std::unique_ptr<Displayable>(item));
+      comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "dso_from") {
       DsoFromItem* item = new DsoFromItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "dso_to") {
       DsoToItem* item = new DsoToItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "symbol_from") {
       SymbolFromItem* item = new SymbolFromItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else if (key == "symbol_to") {
       SymbolToItem* item = new SymbolToItem;
       displayable_items_.push_back(std::unique_ptr<Displayable>(item));
       comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
+    } else if (key.find(':') != std::string::npos) {
+      // The field is looked up after reading the record file.
+      TracepointFieldItem* item = new TracepointFieldItem(key, tracepoint_field_keys_.size());
+      tracepoint_field_keys_.push_back(key);
+      displayable_items_.push_back(std::unique_ptr<Displayable>(item));
+      comparable_items_.push_back(item);
+      sort_key_items_.push_back(item);
     } else {
       LOG(ERROR) << "Unknown sort key: " << key;
       return false;
     }
   }
-  sample_tree_->SetFilters(pid_filter, tid_filter, comm_filter, dso_filter);
+  sample_tree_->SetFilters(pid_filter_, tid_filter_, comm_filter_, dso_filter_);
+  return true;
+}
+
+std::unique_ptr<SampleTree> ReportCommand::CreateSampleTree() {
+  compare_sample_func_t compare_sample_callback = std::bind(
+      &ReportCommand::CompareSampleEntry, this, std::placeholders::_1, std::placeholders::_2);
+  hash_sample_func_t hash_sample_callback =
+      std::bind(&ReportCommand::HashSampleEntry, this, std::placeholders::_1);
+  std::unique_ptr<SampleTree> sample_tree(
+      new SampleTree(&thread_tree_, compare_sample_callback, hash_sample_callback));
+  sample_tree->SetFilters(pid_filter_, tid_filter_, comm_filter_, dso_filter_);
+  return sample_tree;
+}
+
+bool ReportCommand::OpenRecordFile() {
+  record_file_reader_ = RecordFileReader::CreateInstance(record_filename_);
+  if (record_file_reader_ == nullptr) {
+    return false;
+  }
+  record_file_reader_->SetReorderWindow(reorder_window_in_ns_);
+  if (!ReadEventAttrFromRecordFile()) {
+    return false;
+  }
+  // Read features first to prepare build ids used when building SampleTree.
+  if (!ReadFeaturesFromRecordFile()) {
+    return false;
+  }
+  return FindTracepointFields();
+}
+
+bool ReportCommand::FindTracepointFields() {
+  if (tracepoint_field_keys_.empty()) {
+    return true;
+  }
+  if (event_attr_.type != PERF_TYPE_TRACEPOINT) {
+    LOG(ERROR) << "sort key '" << tracepoint_field_keys_[0] << "' needs a record file of a"
+               << " tracepoint event.";
+    return false;
+  }
+  const TracingFormat* format = nullptr;
+  std::vector<TracingFormat> formats = record_file_reader_->ReadTracepointFormatsFeature();
+  for (auto& f : formats) {
+    if (f.id == event_attr_.config) {
+      format = &f;
+      break;
+    }
+  }
+  if (format == nullptr) {
+    LOG(ERROR) << record_filename_ << " doesn't have the format of the recorded tracepoint"
+               << " event.";
+    return false;
+  }
+  for (auto& key : tracepoint_field_keys_) {
+    size_t pos = key.rfind(':');
+    std::string event_name = key.substr(0, pos);
+    if (event_name != format->name && event_name != format->FullName()) {
+      LOG(ERROR) << "sort key '" << key << "' doesn't match the recorded event "
+                 << format->FullName();
+      return false;
+    }
+    const TracingField* field = format->FindField(key.substr(pos + 1));
+    if (field == nullptr) {
+      LOG(ERROR) << "tracepoint event " << format->FullName() << " has no field in sort key '"
+                 << key << "'";
+      return false;
+    }
+    tracepoint_fields_.push_back(*field);
+  }
   return true;
 }
 
+const std::vector<const char*>* ReportCommand::DecodeTracepointValues(const SampleRecord& r) {
+  const std::vector<char>& raw = r.raw_data.data;
+  std::vector<const char*> values;
+  for (auto& field : tracepoint_fields_) {
+    values.push_back(tracepoint_value_pool_.Intern(field.ValueToString(raw.data(), raw.size())));
+  }
+  return &*tracepoint_value_sets_.insert(values).first;
+}
+
 bool ReportCommand::ReadEventAttrFromRecordFile() {
   const std::vector<PerfFileFormat::FileAttr>& attrs = record_file_reader_->AttrSection();
-  if (attrs.size() != 1) {
+  if (attrs.size() == 2 && attrs[1].attr.type == PERF_TYPE_TRACEPOINT) {
+    // `record --trace-offcpu` adds sched:sched_switch after the sampled event.
+    std::vector<TracingFormat> formats = record_file_reader_->ReadTracepointFormatsFeature();
+    for (auto& format : formats) {
+      if (format.id == attrs[1].attr.config && format.FullName() == "sched:sched_switch") {
+        trace_offcpu_ = true;
+        const TracingField* field = format.FindField("next_pid");
+        if (field != nullptr) {
+          next_pid_field_ = *field;
+          has_next_pid_field_ = true;
+        }
+      }
+    }
+    std::vector<uint64_t> ids;
+    if (trace_offcpu_ && !record_file_reader_->ReadIdsForAttr(attrs[1], &ids)) {
+      return false;
+    }
+    sched_switch_ids_.insert(ids.begin(), ids.end());
+  }
+  if (attrs.size() != 1 && !trace_offcpu_) {
     LOG(ERROR) << "record file contains " << attrs.size() << " attrs";
     return false;
   }
@@ -528,112 +1258,358 @@ bool ReportCommand::ReadEventAttrFromRecordFile() {
 
 void ReportCommand::ReadSampleTreeFromRecordFile() {
   thread_tree_.AddThread(0, 0, "swapper");
-  record_file_reader_->ReadDataSection([this](std::unique_ptr<Record> record) {
-    ProcessRecord(std::move(record));
+  // The sample aggregator isn't needed if samples are only used in branch edges.
+  if (jobs_ > 1 && time_slice_in_ns_ == 0 && !print_branch_edges_) {
+    aggregator_.reset(new ParallelSampleAggregator(
+        jobs_, [this]() { return CreateSampleTree(); },
+        [this](const ResolvedSample& sample, SampleTree* sample_tree) {
+          AggregateSample(sample, sample_tree);
+        }));
+  }
+  // Files hit by samples are listed in the build id feature section. Load them on other
+  // threads as soon as mmap records refer to them.
+  if (jobs_ > 1 && !hit_files_.empty()) {
+    dso_prefetcher_.reset(new DsoPrefetcher(jobs_));
+    thread_tree_.SetDsoCreatedCallback([this](Dso* dso) {
+      if (hit_files_.find(dso->Path()) != hit_files_.end()) {
+        dso_prefetcher_->Add(dso);
+      }
+    });
+  }
+  record_file_reader_->ReadDataSectionViews([this](const RecordView& view) {
+    ProcessRecord(view);
     return true;
   });
+  FlushOffCpuSamples();
+  const RecordFileReader::ReorderStats& stats = record_file_reader_->GetReorderStats();
+  LOG(DEBUG) << "reordered records with at most " << stats.max_pending_records
+             << " pending records, " << stats.late_records << " records were out of order";
+  // Late samples are only attributed with the thread state of a later time. But late mmap
+  // and comm records change what earlier samples resolve to.
+  if (stats.late_non_sample_records != 0) {
+    LOG(WARNING) << stats.late_non_sample_records << " mmap or comm records in "
+                 << record_filename_ << " were out of order by more than the reorder window,"
+                 << " consider a larger --reorder-window";
+  }
+  if (dso_prefetcher_ != nullptr) {
+    thread_tree_.SetDsoCreatedCallback(nullptr);
+    dso_prefetcher_->Finish();
+    dso_prefetcher_.reset();
+  }
+  if (aggregator_ != nullptr) {
+    aggregator_->Finish(sample_tree_.get());
+    aggregator_.reset();
+  }
 }
 
-void ReportCommand::ProcessRecord(std::unique_ptr<Record> record) {
+void ReportCommand::ProcessRecord(const RecordView& view) {
+  // Only parse records used by BuildThreadTree() and sample records.
+  switch (view.type()) {
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2:
+    case PERF_RECORD_COMM:
+    case PERF_RECORD_FORK:
+    case PERF_RECORD_SAMPLE:
+      break;
+    case PERF_RECORD_EXIT:
+      if (trace_offcpu_) {
+        break;
+      }
+      return;
+    default:
+      return;
+  }
+  std::unique_ptr<Record> record = view.Parse();
   BuildThreadTree(*record, &thread_tree_);
   if (record->header.type == PERF_RECORD_SAMPLE) {
     ProcessSampleRecord(*static_cast<const SampleRecord*>(record.get()));
+  } else if (trace_offcpu_ &&
+             (record->header.type == PERF_RECORD_EXIT || record->header.type == PERF_RECORD_FORK)) {
+    auto& r = *static_cast<const ExitOrForkRecord*>(record.get());
+    auto it = offcpu_samples_.find(r.data.tid);
+    if (it != offcpu_samples_.end()) {
+      // A forked thread may reuse the tid of an exited one.
+      it->second.pending = false;
+      it->second.exited = (record->header.type == PERF_RECORD_EXIT);
+    } else if (record->header.type == PERF_RECORD_EXIT) {
+      offcpu_samples_[r.data.tid].exited = true;
+    }
   }
 }
 
 void ReportCommand::ProcessSampleRecord(const SampleRecord& r) {
-  if (use_branch_address_ && (r.sample_type & PERF_SAMPLE_BRANCH_STACK)) {
-    for (auto& item : r.branch_stack_data.stack) {
-      if (item.from != 0 && item.to != 0) {
-        sample_tree_->AddBranchSample(r.tid_data.pid, r.tid_data.tid, item.from, item.to,
-                                      item.flags, r.time_data.time, r.period_data.period);
-      }
+  if (trace_offcpu_ && ProcessOffCpuSample(r)) {
+    return;
+  }
+  if (aggregator_ != nullptr) {
+    ResolvedSample* sample = aggregator_->NextSample();
+    if (!ResolveSample(r, sample)) {
+      aggregator_->DiscardSample();
+    } else if (branch_aggregator_ != nullptr) {
+      AggregateBranchStack(*sample);
     }
-  } else {
-    bool in_kernel = (r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL;
-    SampleEntry* sample = sample_tree_->AddSample(r.tid_data.pid, r.tid_data.tid, r.ip_data.ip,
-                                                  r.time_data.time, r.period_data.period, in_kernel);
-    if (sample == nullptr) {
-      return;
+    return;
+  }
+  if (ResolveSample(r, &resolved_sample_)) {
+    if (branch_aggregator_ != nullptr) {
+      AggregateBranchStack(resolved_sample_);
+      if (print_branch_edges_ && time_slice_in_ns_ == 0) {
+        return;
+      }
     }
-    if (accumulate_callchain_) {
-      std::vector<uint64_t> ips;
-      if (r.sample_type & PERF_SAMPLE_CALLCHAIN) {
-        ips.insert(ips.end(), r.callchain_data.ips.begin(), r.callchain_data.ips.end());
-      }
-      // Use stack_user_data.data.size() instead of stack_user_data.dyn_size, to make up for
-      // the missing kernel patch in N9. See b/22612370.
-      if ((r.sample_type & PERF_SAMPLE_REGS_USER) && (r.regs_user_data.reg_mask != 0) &&
-          (r.sample_type & PERF_SAMPLE_STACK_USER) && (!r.stack_user_data.data.empty())) {
-        RegSet regs = CreateRegSet(r.regs_user_data.reg_mask, r.regs_user_data.regs);
-        std::vector<char> stack(r.stack_user_data.data.begin(),
-                                r.stack_user_data.data.begin() + r.stack_user_data.data.size());
-        std::vector<uint64_t> unwind_ips =
-            UnwindCallChain(ScopedCurrentArch::GetCurrentArch(), *sample->thread, regs, stack);
-        if (!unwind_ips.empty()) {
-          ips.push_back(PERF_CONTEXT_USER);
-          ips.insert(ips.end(), unwind_ips.begin(), unwind_ips.end());
-        }
+    if (time_slice_in_ns_ != 0) {
+      AddSampleToTimeSlice(resolved_sample_);
+    } else {
+      AggregateSample(resolved_sample_, sample_tree_.get());
+    }
+  }
+}
+
+// Return true if r is a sched_switch sample, which is kept until its period is known.
+bool ReportCommand::ProcessOffCpuSample(const SampleRecord& r) {
+  int tid = r.tid_data.tid;
+  uint64_t time = r.time_data.time;
+  last_sample_time_ = std::max(last_sample_time_, time);
+  // Any sample of a thread shows it has run again, so it ends the time the thread was off
+  // the cpu. So does a sched_switch to the thread, which is only seen when the thread switched
+  // from is also monitored, like in `record -a`.
+  EndOffCpuInterval(tid, time);
+  if (sched_switch_ids_.find(r.id_data.id) == sched_switch_ids_.end()) {
+    return false;
+  }
+  int64_t next_pid;
+  if (has_next_pid_field_ && next_pid_field_.ValueToInteger(r.raw_data.data.data(),
+                                                            r.raw_data.data.size(), &next_pid)) {
+    EndOffCpuInterval(static_cast<int>(next_pid), time);
+  }
+  // The idle threads are off the cpu only when the cpu is busy.
+  if (tid == 0) {
+    return true;
+  }
+  OffCpuSample& offcpu = offcpu_samples_[tid];
+  if (!offcpu.exited) {
+    // The vectors in offcpu.sample are reused for each switch of the thread.
+    offcpu.pending = ResolveSample(r, &offcpu.sample);
+  }
+  return true;
+}
+
+void ReportCommand::EndOffCpuInterval(int tid, uint64_t time) {
+  auto it = offcpu_samples_.find(tid);
+  if (it == offcpu_samples_.end() || !it->second.pending) {
+    return;
+  }
+  OffCpuSample& offcpu = it->second;
+  offcpu.pending = false;
+  if (time <= offcpu.sample.time) {
+    return;
+  }
+  offcpu.sample.period = time - offcpu.sample.time;
+  offcpu_sample_count_++;
+  offcpu_time_ += offcpu.sample.period;
+  AddResolvedSample(&offcpu.sample);
+}
+
+// Threads still off the cpu at the end of the recording are weighted until the last sample.
+void ReportCommand::FlushOffCpuSamples() {
+  for (auto& pair : offcpu_samples_) {
+    EndOffCpuInterval(pair.first, last_sample_time_);
+  }
+}
+
+// Aggregate a sample resolved outside of the ParallelSampleAggregator batches. The sample may
+// be swapped with a slot of the pending batch, so its contents are left unspecified.
+void ReportCommand::AddResolvedSample(ResolvedSample* sample) {
+  if (aggregator_ != nullptr) {
+    std::swap(*aggregator_->NextSample(), *sample);
+  } else if (time_slice_in_ns_ != 0) {
+    AddSampleToTimeSlice(*sample);
+  } else {
+    AggregateSample(*sample, sample_tree_.get());
+  }
+}
+
+uint64_t ReportCommand::GetPeriodOfSampleFreq(uint64_t time) const {
+  auto it = std::upper_bound(sample_freq_changes_.begin(), sample_freq_changes_.end(), time,
+                             [](uint64_t time, const PerfFileFormat::SampleFreqChange& change) {
+                               return time < change.time;
+                             });
+  if (it != sample_freq_changes_.begin()) {
+    --it;
+  }
+  // The period of cpu-clock and task-clock is in ns.
+  return std::max<uint64_t>(1, 1000000000 / it->freq);
+}
+
+const MapEntry* ReportCommand::FindBranchMap(const ThreadEntry* thread, uint64_t ip) {
+  const MapEntry* map = thread_tree_.FindMap(thread, ip, false);
+  if (map == thread_tree_.UnknownMap()) {
+    map = thread_tree_.FindMap(thread, ip, true);
+  }
+  return map;
+}
+
+bool ReportCommand::ResolveSample(const SampleRecord& r, ResolvedSample* sample) {
+  const ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+  sample->thread = thread;
+  sample->thread_comm = thread->comm;
+  sample->time = r.time_data.time;
+  sample->period = r.period_data.period;
+  if (use_periods_of_sample_freqs_) {
+    sample->period = GetPeriodOfSampleFreq(r.time_data.time);
+  }
+  sample->ips.clear();
+  sample->branch_flags.clear();
+  sample->tracepoint_values = nullptr;
+
+  if (use_branch_address_ && (r.sample_type & PERF_SAMPLE_BRANCH_STACK)) {
+    sample->is_branch_sample = true;
+    for (auto& item : r.branch_stack_data.stack) {
+      if (item.from != 0 && item.to != 0) {
+        sample->ips.push_back(ResolvedIp{item.from, FindBranchMap(thread, item.from)});
+        sample->ips.push_back(ResolvedIp{item.to, FindBranchMap(thread, item.to)});
+        sample->branch_flags.push_back(item.flags);
       }
+    }
+    return true;
+  }
+  sample->is_branch_sample = false;
+  if (!tracepoint_fields_.empty() && (r.sample_type & PERF_SAMPLE_RAW)) {
+    sample->tracepoint_values = DecodeTracepointValues(r);
+  }
+  bool in_kernel = (r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL;
+  const MapEntry* map = thread_tree_.FindMap(thread, r.ip_data.ip, in_kernel);
+  if (sample_tree_->IsFilteredOut(thread, thread->comm, map)) {
+    return false;
+  }
+  sample->ips.push_back(ResolvedIp{r.ip_data.ip, map});
+  if (!accumulate_callchain_ && !print_folded_stacks_) {
+    return true;
+  }
 
-      std::vector<SampleEntry*> callchain;
-      callchain.push_back(sample);
-
-      bool first_ip = true;
-      for (auto& ip : ips) {
-        if (ip >= PERF_CONTEXT_MAX) {
-          switch (ip) {
-            case PERF_CONTEXT_KERNEL:
-              in_kernel = true;
-              break;
-            case PERF_CONTEXT_USER:
-              in_kernel = false;
-              break;
-            default:
-              LOG(ERROR) << "Unexpected perf_context in callchain: " << ip;
-          }
-        } else {
-          if (first_ip) {
-            first_ip = false;
-            // Remove duplication with sampled ip.
-            if (ip == r.ip_data.ip) {
-              continue;
-            }
-          }
-          SampleEntry* sample =
-              sample_tree_->AddCallChainSample(r.tid_data.pid, r.tid_data.tid, ip, r.time_data.time,
-                                               r.period_data.period, in_kernel, callchain);
-          callchain.push_back(sample);
+  std::vector<uint64_t> ips;
+  if (r.sample_type & PERF_SAMPLE_CALLCHAIN) {
+    ips.insert(ips.end(), r.callchain_data.ips.begin(), r.callchain_data.ips.end());
+  }
+  // Use stack_user_data.data.size() instead of stack_user_data.dyn_size, to make up for
+  // the missing kernel patch in N9. See b/22612370.
+  if ((r.sample_type & PERF_SAMPLE_REGS_USER) && (r.regs_user_data.reg_mask != 0) &&
+      (r.sample_type & PERF_SAMPLE_STACK_USER) && (!r.stack_user_data.data.empty())) {
+    RegSet regs = CreateRegSet(r.regs_user_data.reg_mask, r.regs_user_data.regs);
+    std::vector<char> stack(r.stack_user_data.data.begin(),
+                            r.stack_user_data.data.begin() + r.stack_user_data.data.size());
+    std::vector<uint64_t> unwind_ips = offline_unwinder_.UnwindCallChain(
+        ScopedCurrentArch::GetCurrentArch(), *thread, regs, stack);
+    if (!unwind_ips.empty()) {
+      ips.push_back(PERF_CONTEXT_USER);
+      ips.insert(ips.end(), unwind_ips.begin(), unwind_ips.end());
+    }
+  }
+
+  bool first_ip = true;
+  for (auto& ip : ips) {
+    if (ip >= PERF_CONTEXT_MAX) {
+      switch (ip) {
+        case PERF_CONTEXT_KERNEL:
+          in_kernel = true;
+          break;
+        case PERF_CONTEXT_USER:
+          in_kernel = false;
+          break;
+        default:
+          LOG(ERROR) << "Unexpected perf_context in callchain: " << ip;
+      }
+    } else {
+      if (first_ip) {
+        first_ip = false;
+        // Remove duplication with sampled ip.
+        if (ip == r.ip_data.ip) {
+          continue;
         }
       }
+      sample->ips.push_back(ResolvedIp{ip, thread_tree_.FindMap(thread, ip, in_kernel)});
+    }
+  }
+  return true;
+}
 
-      if (print_callgraph_) {
-        std::set<SampleEntry*> added_set;
-        if (!callgraph_show_callee_) {
-          std::reverse(callchain.begin(), callchain.end());
-        }
-        while (callchain.size() >= 2) {
-          SampleEntry* sample = callchain[0];
-          callchain.erase(callchain.begin());
-          // Add only once for recursive calls on callchain.
-          if (added_set.find(sample) != added_set.end()) {
-            continue;
-          }
-          added_set.insert(sample);
-          sample_tree_->InsertCallChainForSample(sample, callchain, r.period_data.period);
-        }
+void ReportCommand::AggregateSample(const ResolvedSample& s, SampleTree* sample_tree) {
+  if (s.is_branch_sample) {
+    for (size_t i = 0; i < s.branch_flags.size(); ++i) {
+      const ResolvedIp& from = s.ips[i * 2];
+      const ResolvedIp& to = s.ips[i * 2 + 1];
+      sample_tree->AddBranchSample(s.thread, s.thread_comm, from.map, from.ip, to.map, to.ip,
+                                   s.branch_flags[i], s.time, s.period);
+    }
+    return;
+  }
+  SampleEntry* sample = sample_tree->AddSample(s.thread, s.thread_comm, s.ips[0].map,
+                                               s.ips[0].ip, s.time, s.period,
+                                               s.tracepoint_values);
+  if (sample == nullptr || (!accumulate_callchain_ && !print_folded_stacks_)) {
+    return;
+  }
+  std::vector<SampleEntry*> callchain;
+  callchain.push_back(sample);
+  for (size_t i = 1; i < s.ips.size(); ++i) {
+    SampleEntry* sample = sample_tree->AddCallChainSample(
+        s.thread, s.thread_comm, s.ips[i].map, s.ips[i].ip, s.time, s.period, callchain);
+    callchain.push_back(sample);
+  }
+
+  if (print_folded_stacks_) {
+    std::reverse(callchain.begin(), callchain.end());
+    sample_tree->AddStack(callchain, s.period);
+    return;
+  }
+  if (print_callgraph_) {
+    std::set<SampleEntry*> added_set;
+    if (!callgraph_show_callee_) {
+      std::reverse(callchain.begin(), callchain.end());
+    }
+    while (callchain.size() >= 2) {
+      SampleEntry* sample = callchain[0];
+      callchain.erase(callchain.begin());
+      // Add only once for recursive calls on callchain.
+      if (added_set.find(sample) != added_set.end()) {
+        continue;
       }
+      added_set.insert(sample);
+      sample_tree->InsertCallChainForSample(sample, callchain, s.period);
     }
   }
 }
 
+void ReportCommand::AggregateBranchStack(const ResolvedSample& s) {
+  if (!s.is_branch_sample) {
+    return;
+  }
+  std::vector<BranchItem> stack;
+  for (size_t i = 0; i < s.branch_flags.size(); ++i) {
+    const ResolvedIp& from = s.ips[i * 2];
+    const ResolvedIp& to = s.ips[i * 2 + 1];
+    // Use the same filters as branch samples in SampleTree.
+    if (sample_tree_->IsFilteredOut(s.thread, s.thread_comm, to.map)) {
+      continue;
+    }
+    stack.push_back(BranchItem{from.ip, from.map, to.ip, to.map, s.branch_flags[i]});
+  }
+  branch_aggregator_->AddBranchStack(stack);
+}
+
 bool ReportCommand::ReadFeaturesFromRecordFile() {
   std::vector<BuildIdRecord> records = record_file_reader_->ReadBuildIdFeature();
   std::vector<std::pair<std::string, BuildId>> build_ids;
   for (auto& r : records) {
     build_ids.push_back(std::make_pair(r.filename, r.build_id));
+    hit_files_.insert(r.filename);
+  }
+  dso_context_.SetBuildIds(build_ids);
+  const auto& section_map = record_file_reader_->FeatureSectionDescriptors();
+  auto it = section_map.find(PerfFileFormat::FEAT_KERNEL_SYMBOLS);
+  if (it != section_map.end()) {
+    dso_context_.SetKernelSymbolTable(record_filename_, it->second.offset, it->second.size);
   }
-  Dso::SetBuildIds(build_ids);
 
   std::string arch = record_file_reader_->ReadFeatureString(PerfFileFormat::FEAT_ARCH);
   if (!arch.empty()) {
@@ -647,6 +1623,13 @@ bool ReportCommand::ReadFeaturesFromRecordFile() {
   if (!cmdline.empty()) {
     record_cmdline_ = android::base::Join(cmdline, ' ');
   }
+  sample_freq_changes_ = record_file_reader_->ReadSampleFreqChangesFeature();
+  // The kernel drives cpu-clock and task-clock by hrtimers, and keeps reporting the period of the
+  // first frequency in their samples after `record --target-bandwidth` changes the frequency.
+  use_periods_of_sample_freqs_ =
+      !sample_freq_changes_.empty() && event_attr_.type == PERF_TYPE_SOFTWARE &&
+      (event_attr_.config == PERF_COUNT_SW_CPU_CLOCK ||
+       event_attr_.config == PERF_COUNT_SW_TASK_CLOCK);
   return true;
 }
 
@@ -660,8 +1643,19 @@ int ReportCommand::CompareSampleEntry(const SampleEntry& sample1, const SampleEn
   return 0;
 }
 
-bool ReportCommand::PrintReport() {
-  std::unique_ptr<FILE, decltype(&fclose)> file_handler(nullptr, fclose);
+uint64_t ReportCommand::HashSampleEntry(const SampleEntry& sample) {
+  uint64_t hash = 0;
+  for (auto& item : comparable_items_) {
+    hash = hash * 31 + item->Hash(sample);
+  }
+  // Mix the bits, as SampleHashTable uses the low bits to pick slots.
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+bool ReportCommand::OpenReportFile() {
   if (report_filename_.empty()) {
     report_fp_ = stdout;
   } else {
@@ -670,47 +1664,142 @@ bool ReportCommand::PrintReport() {
       PLOG(ERROR) << "failed to open file " << report_filename_;
       return false;
     }
-    file_handler.reset(report_fp_);
+    report_file_.reset(report_fp_);
   }
+  return true;
+}
+
+void ReportCommand::PrintReport() {
   PrintReportContext();
-  CollectReportWidth();
+  // Format each field of each entry once, into one buffer of cells. So column widths are known
+  // before the cells are padded into lines, without formatting them twice.
+  std::string cells;
+  std::vector<size_t> cell_ends;
+  std::vector<const SampleEntry*> samples;
+  sample_tree_->VisitAllSamples([&](const SampleEntry& sample) {
+    for (auto& item : displayable_items_) {
+      size_t start = cells.size();
+      item->AppendTo(sample, &cells);
+      item->AdjustWidth(cells.size() - start);
+      cell_ends.push_back(cells.size());
+    }
+    samples.push_back(&sample);
+  });
   PrintReportHeader();
-  sample_tree_->VisitAllSamples(
-      std::bind(&ReportCommand::PrintReportEntry, this, std::placeholders::_1));
-  fflush(report_fp_);
-  if (ferror(report_fp_) != 0) {
-    PLOG(ERROR) << "print report failed";
-    return false;
+  size_t cell_start = 0;
+  size_t cell_index = 0;
+  for (auto& sample : samples) {
+    for (size_t i = 0; i < displayable_items_.size(); ++i) {
+      size_t cell_end = cell_ends[cell_index++];
+      report_buffer_.append(cells, cell_start, cell_end - cell_start);
+      if (i + 1 != displayable_items_.size()) {
+        report_buffer_.append(displayable_items_[i]->Width() - (cell_end - cell_start) + 2, ' ');
+      }
+      cell_start = cell_end;
+    }
+    report_buffer_.push_back('\n');
+    if (print_callgraph_) {
+      PrintCallGraph(*sample);
+    }
+    FlushReportBuffer(REPORT_BUFFER_FLUSH_SIZE);
   }
-  return true;
+  FlushReportBuffer(0);
 }
 
-void ReportCommand::PrintReportContext() {
-  const EventType* event_type = FindEventTypeByConfig(event_attr_.type, event_attr_.config);
-  std::string event_type_name;
-  if (event_type != nullptr) {
-    event_type_name = event_type->name;
-  } else {
-    event_type_name =
-        android::base::StringPrintf("(type %u, config %llu)", event_attr_.type, event_attr_.config);
+void ReportCommand::FlushReportBuffer(size_t min_size) {
+  if (!report_buffer_.empty() && report_buffer_.size() >= min_size) {
+    fwrite(report_buffer_.data(), report_buffer_.size(), 1, report_fp_);
+    report_buffer_.clear();
   }
+}
+
+void ReportCommand::PrintTimeSliceHeader() {
   if (!record_cmdline_.empty()) {
     fprintf(report_fp_, "Cmdline: %s\n", record_cmdline_.c_str());
   }
-  fprintf(report_fp_, "Samples: %" PRIu64 " of event '%s'\n", sample_tree_->TotalSamples(),
-          event_type_name.c_str());
-  fprintf(report_fp_, "Event count: %" PRIu64 "\n\n", sample_tree_->TotalPeriod());
+  const EventType* event_type = FindEventTypeByConfig(event_attr_.type, event_attr_.config);
+  if (event_type != nullptr) {
+    fprintf(report_fp_, "Event: %s\n", event_type->name.c_str());
+  }
+  fprintf(report_fp_, "Time slice: %" PRIu64 " ms\n\n", time_slice_in_ns_ / 1000000);
+  fprintf(report_fp_, "%-12s  %-8s  %-16s  Top entries\n", "Time(ms)", "Samples", "Event count");
 }
 
-void ReportCommand::CollectReportWidth() {
-  sample_tree_->VisitAllSamples(
-      std::bind(&ReportCommand::CollectReportEntryWidth, this, std::placeholders::_1));
+void ReportCommand::AddSampleToTimeSlice(const ResolvedSample& sample) {
+  if (window_tree_ == nullptr) {
+    first_sample_time_ = sample.time;
+    window_start_time_ = sample.time;
+    window_tree_ = CreateSampleTree();
+  } else if (sample.time >= window_start_time_ + time_slice_in_ns_) {
+    // Records are read in time order, so the current window is complete.
+    PrintTimeSlice();
+    window_start_time_ += (sample.time - window_start_time_) / time_slice_in_ns_ *
+        time_slice_in_ns_;
+    window_tree_ = CreateSampleTree();
+  }
+  AggregateSample(sample, window_tree_.get());
 }
 
-void ReportCommand::CollectReportEntryWidth(const SampleEntry& sample) {
-  for (auto& item : displayable_items_) {
-    item->AdjustWidth(sample);
+void ReportCommand::PrintTimeSlice() {
+  if (window_tree_ == nullptr || window_tree_->TotalSamples() == 0) {
+    return;
   }
+  uint64_t total_period = window_tree_->TotalPeriod();
+  std::vector<std::string> entries;
+  window_tree_->VisitAllSamples([&](const SampleEntry& sample) {
+    if (entries.size() == TIME_SLICE_TOP_ENTRIES) {
+      return;
+    }
+    uint64_t period = sample.period + sample.accumulated_period;
+    double percentage = (total_period != 0) ? 100.0 * period / total_period : 0.0;
+    std::vector<std::string> names;
+    for (auto& item : sort_key_items_) {
+      names.push_back(item->Show(sample));
+    }
+    entries.push_back(android::base::StringPrintf("%.2lf%% %s", percentage,
+                                                  android::base::Join(names, ' ').c_str()));
+  });
+  double start_in_ms = (window_start_time_ - first_sample_time_) / 1e6;
+  fprintf(report_fp_, "%-12.3f  %-8" PRIu64 "  %-16" PRIu64 "  %s\n", start_in_ms,
+          window_tree_->TotalSamples(), total_period, android::base::Join(entries, "; ").c_str());
+  // Make each finished window visible to readers of the report file.
+  fflush(report_fp_);
+}
+
+std::string ReportCommand::GetEventTypeName() const {
+  const EventType* event_type = FindEventTypeByConfig(event_attr_.type, event_attr_.config);
+  if (event_type != nullptr) {
+    return event_type->name;
+  }
+  return android::base::StringPrintf("(type %u, config %llu)", event_attr_.type,
+                                     event_attr_.config);
+}
+
+void ReportCommand::PrintReportContext() {
+  std::string event_type_name = GetEventTypeName();
+  if (!record_cmdline_.empty()) {
+    fprintf(report_fp_, "Cmdline: %s\n", record_cmdline_.c_str());
+  }
+  fprintf(report_fp_, "Samples: %" PRIu64 " of event '%s'\n", sample_tree_->TotalSamples(),
+          event_type_name.c_str());
+  if (!sample_freq_changes_.empty()) {
+    // Overhead is weighted by event counts, so it doesn't depend on the frequency. But each
+    // sample stands for more events when the frequency is lower.
+    uint64_t min_freq = UINT64_MAX;
+    uint64_t max_freq = 0;
+    for (auto& change : sample_freq_changes_) {
+      min_freq = std::min(min_freq, change.freq);
+      max_freq = std::max(max_freq, change.freq);
+    }
+    fprintf(report_fp_, "Sample frequency: %" PRIu64 " - %" PRIu64 " Hz, changed %zu times\n",
+            min_freq, max_freq, sample_freq_changes_.size() - 1);
+  }
+  if (trace_offcpu_) {
+    // Both on-cpu and off-cpu samples are weighted in ns.
+    fprintf(report_fp_, "Off-cpu samples: %" PRIu64 ", off-cpu time: %.3f ms\n",
+            offcpu_sample_count_, offcpu_time_ / 1e6);
+  }
+  fprintf(report_fp_, "Event count: %" PRIu64 "\n\n", sample_tree_->TotalPeriod());
 }
 
 void ReportCommand::PrintReportHeader() {
@@ -724,60 +1813,532 @@ void ReportCommand::PrintReportHeader() {
   }
 }
 
-void ReportCommand::PrintReportEntry(const SampleEntry& sample) {
-  for (size_t i = 0; i < displayable_items_.size(); ++i) {
-    auto& item = displayable_items_[i];
-    if (i != displayable_items_.size() - 1) {
-      fprintf(report_fp_, "%-*s  ", static_cast<int>(item->Width()), item->Show(sample).c_str());
+void ReportCommand::PrintBranchEdges() {
+  if (!record_cmdline_.empty()) {
+    fprintf(report_fp_, "Cmdline: %s\n", record_cmdline_.c_str());
+  }
+  std::vector<SymbolEdge> edges = branch_aggregator_->GetSymbolEdges();
+  uint64_t total_count = 0;
+  for (auto& edge : edges) {
+    total_count += edge.count;
+  }
+  fprintf(report_fp_, "Taken branches: %" PRIu64 "\n\n", total_count);
+
+  std::vector<std::vector<std::string>> lines;
+  lines.push_back({"Overhead", "Count", "Mispredicted", "Source Shared Object", "Source Symbol",
+                   "Target Shared Object", "Target Symbol"});
+  for (auto& edge : edges) {
+    double percentage = 100.0 * edge.count / total_count;
+    double mispredicted = 100.0 * edge.mispredicted_count / edge.count;
+    lines.push_back({android::base::StringPrintf("%.2lf%%", percentage),
+                     android::base::StringPrintf("%" PRIu64, edge.count),
+                     android::base::StringPrintf("%.2lf%%", mispredicted), edge.from_dso->Path(),
+                     edge.from_symbol->DemangledName(), edge.to_dso->Path(),
+                     edge.to_symbol->DemangledName()});
+  }
+  std::vector<size_t> widths(lines[0].size(), 0);
+  for (auto& line : lines) {
+    for (size_t i = 0; i < line.size(); ++i) {
+      widths[i] = std::max(widths[i], line[i].size());
+    }
+  }
+  for (auto& line : lines) {
+    for (size_t i = 0; i + 1 < line.size(); ++i) {
+      fprintf(report_fp_, "%-*s  ", static_cast<int>(widths[i]), line[i].c_str());
+    }
+    fprintf(report_fp_, "%s\n", line.back().c_str());
+  }
+}
+
+bool ReportCommand::WriteAutoFdoFile() {
+  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(autofdo_filename_.c_str(), "w"), fclose);
+  if (fp == nullptr) {
+    PLOG(ERROR) << "failed to open file " << autofdo_filename_;
+    return false;
+  }
+  // Write binaries sorted by path, and counts sorted by addresses, so the output is stable.
+  std::vector<std::pair<const Dso*, const DsoBranchProfile*>> profiles;
+  for (auto& pair : branch_aggregator_->DsoProfiles()) {
+    profiles.push_back(std::make_pair(pair.first, &pair.second));
+  }
+  std::sort(profiles.begin(), profiles.end(),
+            [](const std::pair<const Dso*, const DsoBranchProfile*>& p1,
+               const std::pair<const Dso*, const DsoBranchProfile*>& p2) {
+              return p1.first->Path() < p2.first->Path();
+            });
+  auto sorted_counts = [](const DsoBranchProfile::CountMap& map) {
+    std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>> counts(map.begin(),
+                                                                           map.end());
+    std::sort(counts.begin(), counts.end());
+    return counts;
+  };
+  for (auto& pair : profiles) {
+    const Dso* dso = pair.first;
+    fprintf(fp.get(), "// %s\n", dso->Path().c_str());
+    BuildId build_id = dso_context_.GetExpectedBuildId(dso->Path());
+    if (!build_id.IsEmpty()) {
+      fprintf(fp.get(), "// build_id: %s\n", build_id.ToString().c_str());
+    }
+    auto ranges = sorted_counts(pair.second->range_counts);
+    fprintf(fp.get(), "%zu\n", ranges.size());
+    for (auto& range : ranges) {
+      fprintf(fp.get(), "%" PRIx64 "-%" PRIx64 ":%" PRIu64 "\n", range.first.first,
+              range.first.second, range.second);
+    }
+    auto branches = sorted_counts(pair.second->branch_counts);
+    fprintf(fp.get(), "%zu\n", branches.size());
+    for (auto& branch : branches) {
+      fprintf(fp.get(), "%" PRIx64 "->%" PRIx64 ":%" PRIu64 "\n", branch.first.first,
+              branch.first.second, branch.second);
+    }
+  }
+  if (fflush(fp.get()) != 0 || ferror(fp.get()) != 0) {
+    PLOG(ERROR) << "failed to write " << autofdo_filename_;
+    return false;
+  }
+  return true;
+}
+
+void ReportCommand::PrintFoldedStacks() {
+  // Walk the stack tree once. Each node appends its functions to a single buffer shared by the
+  // whole walk, and removes them when done, so no string is built per frame or per line.
+  std::string stack;
+  for (auto& child : sample_tree_->Stacks().children) {
+    PrintFoldedStackNode(child, &stack);
+  }
+}
+
+void ReportCommand::PrintFoldedStackNode(const CallChainNode* node, std::string* stack) {
+  size_t old_size = stack->size();
+  for (size_t i = 0; i < node->chain_length; ++i) {
+    if (!stack->empty()) {
+      stack->push_back(';');
+    }
+    stack->append(node->chain[i]->symbol->DemangledName());
+  }
+  if (node->period != 0) {
+    fprintf(report_fp_, "%s %" PRIu64 "\n", stack->c_str(), node->period);
+  }
+  for (auto& child : node->children) {
+    PrintFoldedStackNode(child, stack);
+  }
+  stack->resize(old_size);
+}
+
+static void AppendJsonString(const char* s, std::string* out) {
+  out->push_back('"');
+  for (; *s != '\0'; ++s) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      out->append(android::base::StringPrintf("\\u%04x", c));
     } else {
-      fprintf(report_fp_, "%s\n", item->Show(sample).c_str());
+      out->push_back(c);
     }
   }
-  if (print_callgraph_) {
-    PrintCallGraph(sample);
+  out->push_back('"');
+}
+
+// Strings in --export json output are written once, and referred to by their index. Names of
+// symbols are interned by pointer first, as they are shared by samples of the same symbol.
+class JsonStringTable {
+ public:
+  size_t Intern(const char* s) {
+    auto it = pointer_ids_.find(s);
+    if (it != pointer_ids_.end()) {
+      return it->second;
+    }
+    size_t id = Intern(std::string(s));
+    pointer_ids_[s] = id;
+    return id;
   }
+
+  size_t Intern(const std::string& s) {
+    auto it = ids_.find(s);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    size_t id = strings_.size();
+    strings_.push_back(&ids_.insert(std::make_pair(s, id)).first->first);
+    return id;
+  }
+
+  void AppendTo(std::string* out) const {
+    out->push_back('[');
+    for (size_t i = 0; i < strings_.size(); ++i) {
+      if (i != 0) {
+        out->push_back(',');
+      }
+      AppendJsonString(strings_[i]->c_str(), out);
+    }
+    out->push_back(']');
+  }
+
+ private:
+  std::unordered_map<const char*, size_t> pointer_ids_;
+  std::unordered_map<std::string, size_t> ids_;
+  std::vector<const std::string*> strings_;
+};
+
+// Append the nodes of a call graph in preorder, as [parent, period, children_period, [names]],
+// where parent is the index of the parent node or -1, and names are the functions of the
+// node's chain.
+static void AppendJsonCallGraphNodes(const std::vector<CallChainNode*>& nodes, int parent,
+                                     size_t* node_count, JsonStringTable* strings,
+                                     std::string* out) {
+  for (auto& node : nodes) {
+    if (*node_count != 0) {
+      out->push_back(',');
+    }
+    int index = (*node_count)++;
+    out->append(android::base::StringPrintf("[%d,%" PRIu64 ",%" PRIu64 ",[", parent, node->period,
+                                            node->children_period));
+    for (size_t i = 0; i < node->chain_length; ++i) {
+      if (i != 0) {
+        out->push_back(',');
+      }
+      out->append(std::to_string(strings->Intern(node->chain[i]->symbol->DemangledName())));
+    }
+    out->append("]]");
+    AppendJsonCallGraphNodes(node->children, index, node_count, strings, out);
+  }
+}
+
+// Write entries while walking the SampleTree, without formatting the text report. The string
+// table comes last, when all strings are known.
+void ReportCommand::ExportJson() {
+  JsonStringTable strings;
+  report_buffer_.append("{\"cmdline\":");
+  AppendJsonString(record_cmdline_.c_str(), &report_buffer_);
+  report_buffer_.append(",\"event\":");
+  AppendJsonString(GetEventTypeName().c_str(), &report_buffer_);
+  report_buffer_.append(android::base::StringPrintf(
+      ",\"samples\":%" PRIu64 ",\"event_count\":%" PRIu64 ",\"children\":%s,\"keys\":[",
+      sample_tree_->TotalSamples(), sample_tree_->TotalPeriod(),
+      accumulate_callchain_ ? "true" : "false"));
+  for (size_t i = 0; i < sort_key_items_.size(); ++i) {
+    if (i != 0) {
+      report_buffer_.push_back(',');
+    }
+    AppendJsonString(sort_key_items_[i]->Name().c_str(), &report_buffer_);
+  }
+  report_buffer_.append("],\"entries\":[");
+  bool first = true;
+  std::string value;
+  sample_tree_->VisitAllSamples([&](const SampleEntry& sample) {
+    report_buffer_.append(first ? "\n" : ",\n");
+    first = false;
+    report_buffer_.append(android::base::StringPrintf(
+        "{\"period\":%" PRIu64 ",\"accumulated_period\":%" PRIu64 ",\"sample_count\":%" PRIu64
+        ",\"keys\":[",
+        sample.period, sample.accumulated_period, sample.sample_count));
+    for (size_t i = 0; i < sort_key_items_.size(); ++i) {
+      value.clear();
+      sort_key_items_[i]->AppendTo(sample, &value);
+      if (i != 0) {
+        report_buffer_.push_back(',');
+      }
+      report_buffer_.append(std::to_string(strings.Intern(value)));
+    }
+    report_buffer_.push_back(']');
+    if (print_callgraph_) {
+      report_buffer_.append(android::base::StringPrintf(
+          ",\"symbol\":%zu,\"callgraph_period\":%" PRIu64 ",\"callgraph\":[",
+          strings.Intern(sample.symbol->DemangledName()), sample.callchain.children_period));
+      size_t node_count = 0;
+      AppendJsonCallGraphNodes(sample.callchain.children, -1, &node_count, &strings,
+                               &report_buffer_);
+      report_buffer_.push_back(']');
+    }
+    report_buffer_.push_back('}');
+    FlushReportBuffer(REPORT_BUFFER_FLUSH_SIZE);
+  });
+  report_buffer_.append("\n],\"strings\":");
+  strings.AppendTo(&report_buffer_);
+  report_buffer_.append("}\n");
+  FlushReportBuffer(0);
 }
 
 void ReportCommand::PrintCallGraph(const SampleEntry& sample) {
   std::string prefix = "       ";
-  fprintf(report_fp_, "%s|\n", prefix.c_str());
-  fprintf(report_fp_, "%s-- %s\n", prefix.c_str(), sample.symbol->DemangledName());
+  report_buffer_.append(prefix).append("|\n");
+  report_buffer_.append(prefix).append("-- ").append(sample.symbol->DemangledName()).append("\n");
   prefix.append(3, ' ');
   for (size_t i = 0; i < sample.callchain.children.size(); ++i) {
-    PrintCallGraphEntry(1, prefix, sample.callchain.children[i], sample.callchain.children_period,
+    PrintCallGraphEntry(1, &prefix, sample.callchain.children[i],
+                        sample.callchain.children_period,
                         (i + 1 == sample.callchain.children.size()));
   }
 }
 
-void ReportCommand::PrintCallGraphEntry(size_t depth, std::string prefix,
-                                        const std::unique_ptr<CallChainNode>& node,
+// prefix is shared by the whole walk. Each entry extends it for its children, and restores it
+// before returning.
+void ReportCommand::PrintCallGraphEntry(size_t depth, std::string* prefix,
+                                        const CallChainNode* node,
                                         uint64_t parent_period, bool last) {
   if (depth > 20) {
     LOG(WARNING) << "truncated callgraph at depth " << depth;
     return;
   }
-  prefix += "|";
-  fprintf(report_fp_, "%s\n", prefix.c_str());
+  size_t old_size = prefix->size();
+  prefix->push_back('|');
+  report_buffer_.append(*prefix).push_back('\n');
   if (last) {
-    prefix.back() = ' ';
+    prefix->back() = ' ';
   }
-  std::string percentage_s = "-- ";
+  report_buffer_.append(*prefix);
+  size_t percentage_size = 3;
   if (node->period + node->children_period != parent_period) {
-    double percentage = 100.0 * (node->period + node->children_period) / parent_period;
-    percentage_s = android::base::StringPrintf("--%.2lf%%-- ", percentage);
+    size_t start = report_buffer_.size();
+    report_buffer_.append("--");
+    AppendPercentage(node->period + node->children_period, parent_period, &report_buffer_);
+    report_buffer_.append("-- ");
+    percentage_size = report_buffer_.size() - start;
+  } else {
+    report_buffer_.append("-- ");
   }
-  fprintf(report_fp_, "%s%s%s\n", prefix.c_str(), percentage_s.c_str(), node->chain[0]->symbol->DemangledName());
-  prefix.append(percentage_s.size(), ' ');
-  for (size_t i = 1; i < node->chain.size(); ++i) {
-    fprintf(report_fp_, "%s%s\n", prefix.c_str(), node->chain[i]->symbol->DemangledName());
+  report_buffer_.append(node->chain[0]->symbol->DemangledName()).push_back('\n');
+  prefix->append(percentage_size, ' ');
+  for (size_t i = 1; i < node->chain_length; ++i) {
+    report_buffer_.append(*prefix).append(node->chain[i]->symbol->DemangledName()).push_back('\n');
   }
 
   for (size_t i = 0; i < node->children.size(); ++i) {
     PrintCallGraphEntry(depth + 1, prefix, node->children[i], node->children_period,
                         (i + 1 == node->children.size()));
   }
+  prefix->resize(old_size);
+}
+
+class DiffCommand : public Command {
+ public:
+  DiffCommand()
+      : Command(
+            "diff", "compare sampling information in two perf.data",
+            "Usage: simpleperf diff [options] <baseline_file> <new_file>\n"
+            "    Samples of both files are aggregated by the sort keys, and joined on them.\n"
+            "    Each line shows the overhead in both files, their difference, and the ratio\n"
+            "    of the event count in new_file to that in baseline_file.\n"
+            "    --comms comm1,comm2,...\n"
+            "                  Compare only selected comms.\n"
+            "    --dsos dso1,dso2,...\n"
+            "                  Compare only selected dsos.\n"
+            "    --jobs <n>    Use n threads to report each file. Default is 1. Both files\n"
+            "                  are always read at the same time.\n"
+            "    --no-demangle        Don't demangle symbol names.\n"
+            "    -o report_file_name  Set report file name, default is stdout.\n"
+            "    --pids pid1,pid2,...\n"
+            "                  Compare only selected pids.\n"
+            "    --sort key1,key2,...\n"
+            "                  Select the keys to join samples of the two files. Possible keys\n"
+            "                  include pid, tid, comm, dso, symbol, srcline. Default keys are\n"
+            "                  \"dso,symbol\".\n"
+            "    --symbol-cache <dir>\n"
+            "                  Save and load symbols of files with build ids in <dir>.\n"
+            "    --symfs <dir> Look for files with symbols of both files relative to <dir>.\n"
+            "    --symfs1 <dir>  Like --symfs, but only for baseline_file.\n"
+            "    --symfs2 <dir>  Like --symfs, but only for new_file.\n"
+            "    --tids tid1,tid2,...\n"
+            "                  Compare only selected tids.\n"
+            "    --vmlinux <file>\n"
+            "                  Parse kernel symbols from <file>.\n") {
+  }
+
+  bool Run(const std::vector<std::string>& args);
+
+ private:
+  struct DiffEntry {
+    uint64_t period[2];
+  };
+
+  void PrintDiff(FILE* fp, const std::map<std::vector<std::string>, DiffEntry>& entries);
+
+  std::unique_ptr<ReportCommand> reports_[2];
+};
+
+bool DiffCommand::Run(const std::vector<std::string>& args) {
+  // 1. Parse options. Most of them are passed to the ReportCommand of each file.
+  static const std::set<std::string> option_with_value = {
+      "--comms", "--dsos", "--jobs", "--pids", "--sort", "--symbol-cache", "--tids", "--vmlinux",
+  };
+  std::vector<std::string> report_args = {"--sort", "dso,symbol"};
+  std::vector<std::string> files;
+  std::string symfs_dirs[2];
+  std::string report_filename;
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (option_with_value.find(args[i]) != option_with_value.end()) {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      report_args.push_back(args[i - 1]);
+      report_args.push_back(args[i]);
+    } else if (args[i] == "--no-demangle") {
+      report_args.push_back(args[i]);
+    } else if (args[i] == "-o") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      report_filename = args[i];
+    } else if (args[i] == "--symfs" || args[i] == "--symfs1" || args[i] == "--symfs2") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (args[i - 1] != "--symfs2") {
+        symfs_dirs[0] = args[i];
+      }
+      if (args[i - 1] != "--symfs1") {
+        symfs_dirs[1] = args[i];
+      }
+    } else if (!args[i].empty() && args[i][0] == '-') {
+      ReportUnknownOption(args, i);
+      return false;
+    } else {
+      files.push_back(args[i]);
+    }
+  }
+  if (files.size() != 2) {
+    LOG(ERROR) << "diff needs two record files, but got " << files.size();
+    return false;
+  }
+
+  // 2. Read both record files at the same time, each into its own SampleTree.
+  for (size_t i = 0; i < 2; ++i) {
+    std::vector<std::string> file_args = report_args;
+    file_args.insert(file_args.end(), {"-i", files[i]});
+    if (!symfs_dirs[i].empty()) {
+      file_args.insert(file_args.end(), {"--symfs", symfs_dirs[i]});
+    }
+    reports_[i].reset(new ReportCommand());
+    if (!reports_[i]->ParseOptions(file_args) || !reports_[i]->OpenRecordFile()) {
+      return false;
+    }
+  }
+  // The current arch is shared by all threads, so both files should be recorded on the same
+  // arch.
+  if (reports_[0]->record_file_arch_ != reports_[1]->record_file_arch_) {
+    LOG(ERROR) << files[0] << " and " << files[1] << " are recorded on different archs";
+    return false;
+  }
+  ScopedCurrentArch scoped_arch(reports_[0]->record_file_arch_);
+  std::thread thread([this]() { reports_[1]->ReadSampleTreeFromRecordFile(); });
+  reports_[0]->ReadSampleTreeFromRecordFile();
+  thread.join();
+
+  // 3. Join samples of both files on the sort keys. Samples of different files refer to
+  // different dsos and symbols, so they are joined on the strings shown for the keys.
+  std::map<std::vector<std::string>, DiffEntry> entries;
+  for (size_t i = 0; i < 2; ++i) {
+    ReportCommand* report = reports_[i].get();
+    report->sample_tree_->VisitAllSamples([&](const SampleEntry& sample) {
+      std::vector<std::string> keys;
+      for (auto& item : report->sort_key_items_) {
+        keys.push_back(item->Show(sample));
+      }
+      auto it = entries.find(keys);
+      if (it == entries.end()) {
+        it = entries.insert(std::make_pair(keys, DiffEntry{{0, 0}})).first;
+      }
+      it->second.period[i] += sample.period;
+    });
+  }
+
+  // 4. Show the differences.
+  std::unique_ptr<FILE, decltype(&fclose)> file_handler(nullptr, fclose);
+  FILE* fp = stdout;
+  if (!report_filename.empty()) {
+    fp = fopen(report_filename.c_str(), "w");
+    if (fp == nullptr) {
+      PLOG(ERROR) << "failed to open file " << report_filename;
+      return false;
+    }
+    file_handler.reset(fp);
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    fprintf(fp, "%s: %s, Samples: %" PRIu64 ", Event count: %" PRIu64 "\n",
+            (i == 0 ? "Baseline" : "New"), files[i].c_str(),
+            reports_[i]->sample_tree_->TotalSamples(), reports_[i]->sample_tree_->TotalPeriod());
+  }
+  fprintf(fp, "\n");
+  PrintDiff(fp, entries);
+  fflush(fp);
+  if (ferror(fp) != 0) {
+    PLOG(ERROR) << "print diff failed";
+    return false;
+  }
+  return true;
+}
+
+void DiffCommand::PrintDiff(FILE* fp,
+                            const std::map<std::vector<std::string>, DiffEntry>& entries) {
+  uint64_t total_period[2];
+  for (size_t i = 0; i < 2; ++i) {
+    total_period[i] = reports_[i]->sample_tree_->TotalPeriod();
+  }
+  auto percentage = [&](const DiffEntry& entry, size_t i) {
+    return (total_period[i] != 0) ? 100.0 * entry.period[i] / total_period[i] : 0.0;
+  };
+
+  struct Line {
+    double delta;
+    std::vector<std::string> columns;
+  };
+  std::vector<Line> lines;
+  for (auto& pair : entries) {
+    const DiffEntry& entry = pair.second;
+    double percentage0 = percentage(entry, 0);
+    double percentage1 = percentage(entry, 1);
+    Line line;
+    line.delta = percentage1 - percentage0;
+    line.columns.push_back(android::base::StringPrintf("%.2lf%%", percentage0));
+    line.columns.push_back(android::base::StringPrintf("%.2lf%%", percentage1));
+    line.columns.push_back(android::base::StringPrintf("%+.2lf%%", line.delta));
+    line.columns.push_back(android::base::StringPrintf(
+        "%+" PRId64, static_cast<int64_t>(entry.period[1] - entry.period[0])));
+    if (entry.period[0] == 0) {
+      line.columns.push_back("-");
+    } else {
+      line.columns.push_back(android::base::StringPrintf(
+          "%.3lf", static_cast<double>(entry.period[1]) / entry.period[0]));
+    }
+    line.columns.insert(line.columns.end(), pair.first.begin(), pair.first.end());
+    lines.push_back(std::move(line));
+  }
+  // Show the largest changes first. entries are sorted by keys, so the order is stable.
+  std::stable_sort(lines.begin(), lines.end(), [](const Line& line1, const Line& line2) {
+    return std::abs(line1.delta) > std::abs(line2.delta);
+  });
+
+  std::vector<std::string> names = {"Baseline", "New", "Delta", "Period delta", "Ratio"};
+  for (auto& item : reports_[0]->sort_key_items_) {
+    names.push_back(item->Name());
+  }
+  std::vector<size_t> widths;
+  for (auto& name : names) {
+    widths.push_back(name.size());
+  }
+  for (auto& line : lines) {
+    for (size_t i = 0; i < line.columns.size(); ++i) {
+      widths[i] = std::max(widths[i], line.columns[i].size());
+    }
+  }
+  auto print_line = [&](const std::vector<std::string>& columns) {
+    for (size_t i = 0; i + 1 < columns.size(); ++i) {
+      fprintf(fp, "%-*s  ", static_cast<int>(widths[i]), columns[i].c_str());
+    }
+    fprintf(fp, "%s\n", columns.back().c_str());
+  };
+  print_line(names);
+  for (auto& line : lines) {
+    print_line(line.columns);
+  }
 }
 
 void RegisterReportCommand() {
   RegisterCommand("report", [] { return std::unique_ptr<Command>(new ReportCommand()); });
 }
+
+void RegisterDiffCommand() {
+  RegisterCommand("diff", [] { return std::unique_ptr<Command>(new DiffCommand()); });
+}
@@ -16,6 +16,7 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <set>
 #include <unordered_map>
 
@@ -29,6 +30,7 @@
 #include "perf_regs.h"
 #include "read_apk.h"
 #include "test_util.h"
+#include "utils.h"
 
 static std::unique_ptr<Command> ReportCmd() {
   return CreateCommandInstance("report");
@@ -99,6 +101,14 @@ TEST_F(ReportCommandTest, sort_option_more_than_one) {
   ASSERT_EQ(lines[line_index].find("Tid"), std::string::npos);
 }
 
+TEST_F(ReportCommandTest, sort_option_srcline) {
+  // The elf files of the test data have no line tables.
+  Report(PERF_DATA, {"--symfs", GetTestDataDir(), "--sort", "dso,srcline"});
+  ASSERT_TRUE(success);
+  ASSERT_NE(content.find("Source Line"), std::string::npos);
+  ASSERT_NE(content.find("unknown"), std::string::npos);
+}
+
 TEST_F(ReportCommandTest, children_option) {
   Report(CALLGRAPH_FP_PERF_DATA, {"--children", "--sort", "symbol"});
   ASSERT_TRUE(success);
@@ -254,6 +264,43 @@ TEST_F(ReportCommandTest, use_branch_address) {
             hit_set.end());
 }
 
+TEST_F(ReportCommandTest, branch_edges_option) {
+  Report(BRANCH_PERF_DATA, {"-b", "--branch-edges"});
+  ASSERT_TRUE(success);
+  ASSERT_NE(content.find("Taken branches:"), std::string::npos);
+  bool found = false;
+  for (const auto& line : lines) {
+    if (line.find("CalledFunc") != std::string::npos &&
+        line.find("GlobalFunc") != std::string::npos) {
+      found = true;
+    }
+  }
+  ASSERT_TRUE(found);
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--branch-edges"}));
+}
+
+TEST_F(ReportCommandTest, autofdo_option) {
+  TemporaryFile autofdo_file;
+  Report(BRANCH_PERF_DATA, {"-b", "--autofdo", autofdo_file.path});
+  ASSERT_TRUE(success);
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(autofdo_file.path, &data));
+  std::vector<std::string> autofdo_lines = android::base::Split(data, "\n");
+  auto it = std::find(autofdo_lines.begin(), autofdo_lines.end(), "// /elf");
+  ASSERT_NE(it, autofdo_lines.end());
+  // The build id line is followed by the range count, ranges, the branch count and branches.
+  it += 2;
+  ASSERT_LT(it, autofdo_lines.end());
+  size_t range_count = std::stoul(*it);
+  ASSERT_GT(range_count, 0u);
+  ASSERT_LT(it + range_count + 1, autofdo_lines.end());
+  ASSERT_NE(it[1].find('-'), std::string::npos);
+  it += range_count + 1;
+  size_t branch_count = std::stoul(*it);
+  ASSERT_GT(branch_count, 0u);
+  ASSERT_NE(it[1].find("->"), std::string::npos);
+}
+
 TEST_F(ReportCommandTest, report_symbols_of_nativelib_in_apk) {
   Report(NATIVELIB_IN_APK_PERF_DATA);
   ASSERT_TRUE(success);
@@ -261,6 +308,139 @@ TEST_F(ReportCommandTest, report_symbols_of_nativelib_in_apk) {
   ASSERT_NE(content.find("Func2"), std::string::npos);
 }
 
+TEST_F(ReportCommandTest, jobs_option) {
+  Report(CALLGRAPH_FP_PERF_DATA, {"-g"});
+  ASSERT_TRUE(success);
+  std::string single_thread_content = content;
+  Report(CALLGRAPH_FP_PERF_DATA, {"-g", "--jobs", "4"});
+  ASSERT_TRUE(success);
+  ASSERT_EQ(single_thread_content, content);
+  Report(PERF_DATA, {"--comms", "t1", "--jobs", "2"});
+  ASSERT_TRUE(success);
+  ASSERT_TRUE(AllItemsWithString(lines, {"t1"}));
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--jobs", "0"}));
+}
+
+TEST_F(ReportCommandTest, time_slice_option) {
+  Report(PERF_DATA, {"--time-slice", "1"});
+  ASSERT_TRUE(success);
+  ASSERT_NE(content.find("Time slice: 1 ms"), std::string::npos);
+  ASSERT_NE(content.find("GlobalFunc"), std::string::npos);
+  // The sample counts of all windows add up to the sample count of the whole report.
+  size_t header = 0;
+  while (header < lines.size() && lines[header].find("Time(ms)") != 0) {
+    ++header;
+  }
+  ASSERT_LT(header + 1, lines.size());
+  uint64_t window_samples = 0;
+  for (size_t i = header + 1; i < lines.size(); ++i) {
+    std::vector<std::string> items = android::base::Split(lines[i], " ");
+    items.erase(std::remove(items.begin(), items.end(), ""), items.end());
+    ASSERT_GE(items.size(), 2u);
+    window_samples += std::stoull(items[1]);
+  }
+  Report(PERF_DATA, {"-n"});
+  ASSERT_TRUE(success);
+  size_t pos = content.find("Samples: ");
+  ASSERT_NE(pos, std::string::npos);
+  ASSERT_EQ(std::stoull(content.substr(pos + strlen("Samples: "))), window_samples);
+
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--time-slice", "0"}));
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--time-slice", "1", "-g"}));
+}
+
+TEST_F(ReportCommandTest, folded_format_option) {
+  Report(CALLGRAPH_FP_PERF_DATA, {"--format", "folded"});
+  ASSERT_TRUE(success);
+  std::string folded_content = content;
+  // Each line is a callchain from the outermost caller, followed by its event count. The counts
+  // add up to the event count of the whole report.
+  uint64_t folded_period = 0;
+  bool has_caller = false;
+  for (auto& line : lines) {
+    size_t pos = line.rfind(' ');
+    ASSERT_NE(pos, std::string::npos);
+    folded_period += std::stoull(line.substr(pos + 1));
+    if (line.find(';') < pos) {
+      has_caller = true;
+    }
+  }
+  ASSERT_TRUE(has_caller);
+  Report(CALLGRAPH_FP_PERF_DATA);
+  ASSERT_TRUE(success);
+  size_t pos = content.find("Event count: ");
+  ASSERT_NE(pos, std::string::npos);
+  ASSERT_EQ(std::stoull(content.substr(pos + strlen("Event count: "))), folded_period);
+
+  Report(CALLGRAPH_FP_PERF_DATA, {"--format", "folded", "--jobs", "4"});
+  ASSERT_TRUE(success);
+  ASSERT_EQ(folded_content, content);
+
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--format", "text"}));
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--format", "folded", "-g"}));
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--format", "folded", "-b"}));
+}
+
+TEST_F(ReportCommandTest, export_json_option) {
+  Report(PERF_DATA, {"--export", "json"});
+  ASSERT_TRUE(success);
+  ASSERT_EQ('{', content[0]);
+  ASSERT_NE(content.find("\"keys\":[\"Command\",\"Pid\",\"Tid\",\"Shared Object\",\"Symbol\"]"),
+            std::string::npos);
+  ASSERT_NE(content.find("\"entries\":["), std::string::npos);
+  ASSERT_NE(content.find("\"GlobalFunc\""), std::string::npos);
+  ASSERT_EQ(content.find("\"callgraph\""), std::string::npos);
+
+  // Each call graph node is [parent, period, children_period, [names]].
+  Report(CALLGRAPH_FP_PERF_DATA, {"--export", "json", "-g"});
+  ASSERT_TRUE(success);
+  ASSERT_NE(content.find("\"callgraph\":[[-1,"), std::string::npos);
+  ASSERT_NE(content.find("\"children\":true"), std::string::npos);
+
+  ASSERT_FALSE(ReportCmd()->Run({"-i", GetTestData(PERF_DATA), "--export", "proto"}));
+  ASSERT_FALSE(ReportCmd()->Run(
+      {"-i", GetTestData(PERF_DATA), "--export", "json", "--format", "folded"}));
+}
+
+static std::unique_ptr<Command> DiffCmd() {
+  return CreateCommandInstance("diff");
+}
+
+TEST(diff_cmd, diff_same_file) {
+  TemporaryFile tmp_file;
+  ASSERT_TRUE(DiffCmd()->Run({"--symfs", GetTestDataDir(), "-o", tmp_file.path,
+                              GetTestData(PERF_DATA), GetTestData(PERF_DATA)}));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(tmp_file.path, &content));
+  ASSERT_NE(content.find("GlobalFunc"), std::string::npos);
+  std::vector<std::string> lines = android::base::Split(content, "\n");
+  size_t entry_count = 0;
+  for (auto& line : lines) {
+    if (line.find("/elf") != std::string::npos) {
+      ASSERT_NE(line.find(" +0.00% "), std::string::npos) << line;
+      ASSERT_NE(line.find(" 1.000 "), std::string::npos) << line;
+      entry_count++;
+    }
+  }
+  ASSERT_GT(entry_count, 0u);
+}
+
+TEST(diff_cmd, diff_two_files) {
+  TemporaryFile tmp_file;
+  ASSERT_TRUE(DiffCmd()->Run({"--symfs", GetTestDataDir(), "-o", tmp_file.path, "--sort",
+                              "comm,symbol", "--jobs", "2", GetTestData(PERF_DATA),
+                              GetTestData(CALLGRAPH_FP_PERF_DATA)}));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(tmp_file.path, &content));
+  ASSERT_NE(content.find("Baseline: " + GetTestData(PERF_DATA)), std::string::npos);
+  ASSERT_NE(content.find("New: " + GetTestData(CALLGRAPH_FP_PERF_DATA)), std::string::npos);
+  ASSERT_NE(content.find("Command"), std::string::npos);
+  ASSERT_NE(content.find("GlobalFunc"), std::string::npos);
+  ASSERT_FALSE(DiffCmd()->Run({GetTestData(PERF_DATA)}));
+  ASSERT_FALSE(DiffCmd()->Run({"--sort", "dso_from", GetTestData(PERF_DATA),
+                               GetTestData(PERF_DATA)}));
+}
+
 #if defined(__linux__)
 
 static std::unique_ptr<Command> RecordCmd() {
@@ -279,6 +459,25 @@ TEST_F(ReportCommandTest, dwarf_callgraph) {
   }
 }
 
+TEST_F(ReportCommandTest, symbol_cache_option) {
+  TemporaryFile tmp_file;
+  ASSERT_TRUE(RecordCmd()->Run({"-e", "cpu-clock", "-o", tmp_file.path, "sleep", SLEEP_SEC}));
+  TemporaryDir symbol_cache_dir;
+  // Use an empty symfs dir to read symbols of the files recorded on this machine.
+  ReportRaw(tmp_file.path, {"--symfs", "", "--symbol-cache", symbol_cache_dir.path});
+  ASSERT_TRUE(success);
+  std::string content_without_cache = content;
+  std::vector<std::string> files;
+  std::vector<std::string> subdirs;
+  GetEntriesInDir(symbol_cache_dir.path, &files, &subdirs);
+  ReportRaw(tmp_file.path, {"--symfs", "", "--symbol-cache", symbol_cache_dir.path});
+  ASSERT_TRUE(success);
+  ASSERT_EQ(content_without_cache, content);
+  for (auto& file : files) {
+    ASSERT_EQ(0, unlink((std::string(symbol_cache_dir.path) + "/" + file).c_str()));
+  }
+}
+
 TEST_F(ReportCommandTest, report_dwarf_callgraph_of_nativelib_in_apk) {
   // NATIVELIB_IN_APK_PERF_DATA is recorded on arm64, so can only report callgraph on arm64.
   if (GetBuildArch() == ARCH_ARM64) {
@@ -21,11 +21,13 @@
 
 #include <algorithm>
 #include <chrono>
+#include <map>
 #include <set>
 #include <string>
 #include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/strings.h>
 
 #include "command.h"
@@ -65,16 +67,29 @@ class StatCommand : public Command {
                 "                 how the event should be monitored. Possible modifiers are:\n"
                 "                   u - monitor user space events only\n"
                 "                   k - monitor kernel space events only\n"
+                "    --group event1[:modifier],event2[:modifier2],...\n"
+                "                 Similar to -e option. But events specified in the same --group\n"
+                "                 option are monitored as a group, and scheduled in and out at the\n"
+                "                 same time. So ratios between them, like cycles per instruction,\n"
+                "                 are computed from counts of the same time.\n"
+                "    --interval-ms ms\n"
+                "                 Also print counts of each ms milliseconds while counting.\n"
+                "                 Counters opened on the same thread and cpu are read together.\n"
                 "    --no-inherit\n"
                 "                 Don't stat created child threads/processes.\n"
                 "    -p pid1,pid2,...\n"
                 "                 Stat events on existing processes. Mutually exclusive with -a.\n"
+                "    --per-thread Also print counts of each monitored thread. Counts of threads\n"
+                "                 created while counting are added to the threads creating them,\n"
+                "                 unless --no-inherit is used.\n"
                 "    -t tid1,tid2,...\n"
                 "                 Stat events on existing threads. Mutually exclusive with -a.\n"
                 "    --verbose    Show result in verbose mode.\n"),
         verbose_mode_(false),
         system_wide_collection_(false),
-        child_inherit_(true) {
+        child_inherit_(true),
+        per_thread_(false),
+        interval_in_ms_(0) {
     signaled = false;
     scoped_signal_handler_.reset(
         new ScopedSignalHandler({SIGCHLD, SIGINT, SIGTERM}, signal_handler));
@@ -85,16 +100,24 @@ class StatCommand : public Command {
  private:
   bool ParseOptions(const std::vector<std::string>& args, std::vector<std::string>* non_option_args);
   bool AddMeasuredEventType(const std::string& event_type_name);
+  bool AddMeasuredEventGroup(const std::string& group_str);
   bool AddDefaultMeasuredEventTypes();
   bool SetEventSelection();
   bool ShowCounters(const std::vector<CountersInfo>& counters, double duration_in_sec);
+  void ShowPerThreadCounters(const std::vector<CountersInfo>& counters);
+  bool ShowIntervalCounters(const std::vector<CountersInfo>& counters,
+                            std::vector<CountersInfo>* last_counters, double start_in_sec,
+                            double end_in_sec);
 
   bool verbose_mode_;
   bool system_wide_collection_;
   bool child_inherit_;
+  bool per_thread_;
+  uint64_t interval_in_ms_;
   std::vector<pid_t> monitored_threads_;
   std::vector<int> cpus_;
   std::vector<EventTypeAndModifier> measured_event_types_;
+  std::vector<std::vector<EventTypeAndModifier>> measured_event_groups_;
   EventSelectionSet event_selection_set_;
 
   std::unique_ptr<ScopedSignalHandler> scoped_signal_handler_;
@@ -110,7 +133,7 @@ bool StatCommand::Run(const std::vector<std::string>& args) {
   if (!ParseOptions(args, &workload_args)) {
     return false;
   }
-  if (measured_event_types_.empty()) {
+  if (measured_event_types_.empty() && measured_event_groups_.empty()) {
     if (!AddDefaultMeasuredEventTypes()) {
       return false;
     }
@@ -142,6 +165,13 @@ bool StatCommand::Run(const std::vector<std::string>& args) {
     if (!event_selection_set_.OpenEventFilesForCpus(cpus_)) {
       return false;
     }
+  } else if (cpus_.empty()) {
+    // A thread counted on any cpu needs one event file instead of one per cpu, which matters
+    // for processes with hundreds of threads. Threads they create later are counted through
+    // inherit without opening more event files.
+    if (!event_selection_set_.OpenEventFilesForThreads(monitored_threads_)) {
+      return false;
+    }
   } else {
     if (!event_selection_set_.OpenEventFilesForThreadsOnCpus(monitored_threads_, cpus_)) {
       return false;
@@ -153,21 +183,54 @@ bool StatCommand::Run(const std::vector<std::string>& args) {
   if (workload != nullptr && !workload->Start()) {
     return false;
   }
+  std::vector<CountersInfo> counters;
+  std::vector<CountersInfo> last_counters;
+  double last_interval_end_in_sec = 0;
+  auto interval = std::chrono::milliseconds(interval_in_ms_);
+  auto next_interval_time = start_time + interval;
   while (!signaled) {
-    sleep(1);
+    if (interval_in_ms_ == 0) {
+      sleep(1);
+      continue;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_interval_time) {
+      // Returns early when a signal arrives.
+      usleep(std::chrono::duration_cast<std::chrono::microseconds>(next_interval_time - now)
+                 .count());
+      continue;
+    }
+    if (!event_selection_set_.ReadCounters(&counters)) {
+      return false;
+    }
+    double end_in_sec = std::chrono::duration<double>(now - start_time).count();
+    if (!ShowIntervalCounters(counters, &last_counters, last_interval_end_in_sec, end_in_sec)) {
+      return false;
+    }
+    last_interval_end_in_sec = end_in_sec;
+    next_interval_time += interval;
   }
   auto end_time = std::chrono::steady_clock::now();
 
   // 5. Read and print counters.
-  std::vector<CountersInfo> counters;
   if (!event_selection_set_.ReadCounters(&counters)) {
     return false;
   }
   double duration_in_sec =
       std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+  if (interval_in_ms_ != 0) {
+    if (!ShowIntervalCounters(counters, &last_counters, last_interval_end_in_sec,
+                              duration_in_sec)) {
+      return false;
+    }
+    printf("\n");
+  }
   if (!ShowCounters(counters, duration_in_sec)) {
     return false;
   }
+  if (per_thread_ && !system_wide_collection_) {
+    ShowPerThreadCounters(counters);
+  }
   return true;
 }
 
@@ -183,6 +246,21 @@ bool StatCommand::ParseOptions(const std::vector<std::string>& args,
         return false;
       }
       cpus_ = GetCpusFromString(args[i]);
+    } else if (args[i] == "--group") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!AddMeasuredEventGroup(args[i])) {
+        return false;
+      }
+    } else if (args[i] == "--interval-ms") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!android::base::ParseUint(args[i].c_str(), &interval_in_ms_) || interval_in_ms_ == 0) {
+        LOG(ERROR) << "Invalid argument for --interval-ms option: " << args[i];
+        return false;
+      }
     } else if (args[i] == "-e") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -195,6 +273,8 @@ bool StatCommand::ParseOptions(const std::vector<std::string>& args,
       }
     } else if (args[i] == "--no-inherit") {
       child_inherit_ = false;
+    } else if (args[i] == "--per-thread") {
+      per_thread_ = true;
     } else if (args[i] == "-p") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -241,12 +321,34 @@ bool StatCommand::AddMeasuredEventType(const std::string& event_type_name) {
   return true;
 }
 
+bool StatCommand::AddMeasuredEventGroup(const std::string& group_str) {
+  std::vector<EventTypeAndModifier> event_types;
+  for (auto& event_type_name : android::base::Split(group_str, ",")) {
+    std::unique_ptr<EventTypeAndModifier> event_type_modifier = ParseEventType(event_type_name);
+    if (event_type_modifier == nullptr) {
+      return false;
+    }
+    event_types.push_back(*event_type_modifier);
+  }
+  measured_event_groups_.push_back(event_types);
+  return true;
+}
+
 bool StatCommand::AddDefaultMeasuredEventTypes() {
+  std::vector<std::string> names;
+  std::vector<perf_event_attr> attrs;
   for (auto& name : default_measured_event_types) {
-    // It is not an error when some event types in the default list are not supported by the kernel.
     const EventType* type = FindEventTypeByName(name);
-    if (type != nullptr && IsEventAttrSupportedByKernel(CreateDefaultPerfEventAttr(*type))) {
-      AddMeasuredEventType(name);
+    if (type != nullptr) {
+      names.push_back(name);
+      attrs.push_back(CreateDefaultPerfEventAttr(*type));
+    }
+  }
+  // It is not an error when some event types in the default list are not supported by the kernel.
+  std::vector<bool> supported = AreEventAttrsSupportedByKernel(attrs);
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (supported[i]) {
+      AddMeasuredEventType(names[i]);
     }
   }
   if (measured_event_types_.empty()) {
@@ -262,7 +364,16 @@ bool StatCommand::SetEventSelection() {
       return false;
     }
   }
+  for (auto& event_group : measured_event_groups_) {
+    if (!event_selection_set_.AddEventGroup(event_group)) {
+      return false;
+    }
+  }
   event_selection_set_.SetInherit(child_inherit_);
+  if (interval_in_ms_ != 0) {
+    // Reading counters periodically shouldn't disturb the workload much.
+    event_selection_set_.EnableGroupRead();
+  }
   return true;
 }
 
@@ -286,17 +397,37 @@ static std::string ReadableCountValue(uint64_t count,
 
 struct CounterSummary {
   const EventTypeAndModifier* event_type;
+  size_t group_id;
   uint64_t count;
   double scale;
   std::string readable_count_str;
   std::string comment;
 };
 
+// Find the summary of another event type used to compute a ratio with summary. Prefer one
+// counted in the same event group, as they are scheduled at the same time.
+static const CounterSummary* FindRelatedSummary(const CounterSummary& summary,
+                                                const std::vector<CounterSummary>& summaries,
+                                                const std::string& type_name) {
+  const CounterSummary* result = nullptr;
+  for (auto& t : summaries) {
+    if (t.event_type->event_type.name == type_name &&
+        t.event_type->modifier == summary.event_type->modifier) {
+      if (t.group_id == summary.group_id) {
+        return &t;
+      }
+      if (result == nullptr) {
+        result = &t;
+      }
+    }
+  }
+  return result;
+}
+
 static std::string GetCommentForSummary(const CounterSummary& summary,
                                         const std::vector<CounterSummary>& summaries,
                                         double duration_in_sec) {
   const std::string& type_name = summary.event_type->event_type.name;
-  const std::string& modifier = summary.event_type->modifier;
   if (type_name == "task-clock") {
     double run_sec = summary.count / 1e9;
     double cpu_usage = run_sec / duration_in_sec;
@@ -310,11 +441,10 @@ static std::string GetCommentForSummary(const CounterSummary& summary,
     return android::base::StringPrintf("%lf GHz", hz / 1e9);
   }
   if (type_name == "instructions" && summary.count != 0) {
-    for (auto& t : summaries) {
-      if (t.event_type->event_type.name == "cpu-cycles" && t.event_type->modifier == modifier) {
-        double cycles_per_instruction = t.count * 1.0 / summary.count;
-        return android::base::StringPrintf("%lf cycles per instruction", cycles_per_instruction);
-      }
+    const CounterSummary* t = FindRelatedSummary(summary, summaries, "cpu-cycles");
+    if (t != nullptr) {
+      double cycles_per_instruction = t->count * 1.0 / summary.count;
+      return android::base::StringPrintf("%lf cycles per instruction", cycles_per_instruction);
     }
   }
   if (android::base::EndsWith(type_name, "-misses")) {
@@ -326,11 +456,10 @@ static std::string GetCommentForSummary(const CounterSummary& summary,
     } else {
       s = type_name.substr(0, type_name.size() - strlen("-misses")) + "s";
     }
-    for (auto& t : summaries) {
-      if (t.event_type->event_type.name == s && t.event_type->modifier == modifier && t.count != 0) {
-        double miss_rate = summary.count * 1.0 / t.count;
-        return android::base::StringPrintf("%lf%% miss rate", miss_rate * 100);
-      }
+    const CounterSummary* t = FindRelatedSummary(summary, summaries, s);
+    if (t != nullptr && t->count != 0) {
+      double miss_rate = summary.count * 1.0 / t->count;
+      return android::base::StringPrintf("%lf%% miss rate", miss_rate * 100);
     }
   }
   double rate = summary.count / duration_in_sec;
@@ -346,23 +475,8 @@ static std::string GetCommentForSummary(const CounterSummary& summary,
   return android::base::StringPrintf("%.3lf /sec", rate);
 }
 
-bool StatCommand::ShowCounters(const std::vector<CountersInfo>& counters, double duration_in_sec) {
-  printf("Performance counter statistics:\n\n");
-
-  if (verbose_mode_) {
-    for (auto& counters_info : counters) {
-      const EventTypeAndModifier* event_type = counters_info.event_type;
-      for (auto& counter_info : counters_info.counters) {
-        printf("%s(tid %d, cpu %d): count %s, time_enabled %" PRIu64 ", time running %" PRIu64
-               ", id %" PRIu64 "\n",
-               event_type->name.c_str(), counter_info.tid, counter_info.cpu,
-               ReadableCountValue(counter_info.counter.value, *event_type).c_str(),
-               counter_info.counter.time_enabled, counter_info.counter.time_running,
-               counter_info.counter.id);
-      }
-    }
-  }
-
+static std::vector<CounterSummary> SummarizeCounters(const std::vector<CountersInfo>& counters,
+                                                     double duration_in_sec) {
   std::vector<CounterSummary> summaries;
   for (auto& counters_info : counters) {
     uint64_t value_sum = 0;
@@ -385,6 +499,7 @@ bool StatCommand::ShowCounters(const std::vector<CountersInfo>& counters, double
     }
     CounterSummary summary;
     summary.event_type = counters_info.event_type;
+    summary.group_id = counters_info.group_id;
     summary.count = scaled_count;
     summary.scale = scale;
     summary.readable_count_str = ReadableCountValue(summary.count, *summary.event_type);
@@ -394,6 +509,27 @@ bool StatCommand::ShowCounters(const std::vector<CountersInfo>& counters, double
   for (auto& summary : summaries) {
     summary.comment = GetCommentForSummary(summary, summaries, duration_in_sec);
   }
+  return summaries;
+}
+
+bool StatCommand::ShowCounters(const std::vector<CountersInfo>& counters, double duration_in_sec) {
+  printf("Performance counter statistics:\n\n");
+
+  if (verbose_mode_) {
+    for (auto& counters_info : counters) {
+      const EventTypeAndModifier* event_type = counters_info.event_type;
+      for (auto& counter_info : counters_info.counters) {
+        printf("%s(tid %d, cpu %d): count %s, time_enabled %" PRIu64 ", time running %" PRIu64
+               ", id %" PRIu64 "\n",
+               event_type->name.c_str(), counter_info.tid, counter_info.cpu,
+               ReadableCountValue(counter_info.counter.value, *event_type).c_str(),
+               counter_info.counter.time_enabled, counter_info.counter.time_running,
+               counter_info.counter.id);
+      }
+    }
+  }
+
+  std::vector<CounterSummary> summaries = SummarizeCounters(counters, duration_in_sec);
 
   size_t count_column_width = 0;
   size_t name_column_width = 0;
@@ -415,6 +551,76 @@ bool StatCommand::ShowCounters(const std::vector<CountersInfo>& counters, double
   return true;
 }
 
+void StatCommand::ShowPerThreadCounters(const std::vector<CountersInfo>& counters) {
+  // Sum counts of each thread on all cpus, scaled like SummarizeCounters() does.
+  std::map<pid_t, std::vector<std::string>> thread_counts;
+  size_t count_column_width = 0;
+  for (size_t i = 0; i < counters.size(); ++i) {
+    std::map<pid_t, PerfCounter> sums;
+    for (auto& counter_info : counters[i].counters) {
+      PerfCounter& sum = sums[counter_info.tid];
+      sum.value += counter_info.counter.value;
+      sum.time_enabled += counter_info.counter.time_enabled;
+      sum.time_running += counter_info.counter.time_running;
+    }
+    for (auto& pair : sums) {
+      const PerfCounter& sum = pair.second;
+      uint64_t count = sum.value;
+      if (sum.time_running == 0) {
+        count = 0;
+      } else if (sum.time_running < sum.time_enabled) {
+        double scale = static_cast<double>(sum.time_enabled) / sum.time_running;
+        count = static_cast<uint64_t>(scale * sum.value);
+      }
+      std::vector<std::string>& counts = thread_counts[pair.first];
+      counts.resize(counters.size());
+      counts[i] = ReadableCountValue(count, *counters[i].event_type);
+      count_column_width = std::max(count_column_width, counts[i].size());
+    }
+  }
+  printf("\nPer thread counts:\n");
+  for (auto& pair : thread_counts) {
+    printf("\n  tid %d:\n", pair.first);
+    for (size_t i = 0; i < counters.size(); ++i) {
+      if (!pair.second[i].empty()) {
+        printf("    %*s  %s\n", static_cast<int>(count_column_width), pair.second[i].c_str(),
+               counters[i].event_type->name.c_str());
+      }
+    }
+  }
+}
+
+// Print counts since the last interval, scaled by time_enabled / time_running in the interval,
+// so multiplexing in earlier intervals doesn't affect later ones.
+bool StatCommand::ShowIntervalCounters(const std::vector<CountersInfo>& counters,
+                                       std::vector<CountersInfo>* last_counters,
+                                       double start_in_sec, double end_in_sec) {
+  std::vector<CountersInfo> deltas = counters;
+  if (!last_counters->empty()) {
+    for (size_t i = 0; i < deltas.size(); ++i) {
+      auto& delta_counters = deltas[i].counters;
+      const auto& prev_counters = (*last_counters)[i].counters;
+      for (size_t j = 0; j < delta_counters.size(); ++j) {
+        PerfCounter& counter = delta_counters[j].counter;
+        const PerfCounter& prev = prev_counters[j].counter;
+        counter.value -= prev.value;
+        counter.time_enabled -= prev.time_enabled;
+        counter.time_running -= prev.time_running;
+      }
+    }
+  }
+  *last_counters = counters;
+
+  std::vector<CounterSummary> summaries = SummarizeCounters(deltas, end_in_sec - start_in_sec);
+  for (auto& summary : summaries) {
+    printf("%10.3lf  %20s  %-25s   # %s   (%.0lf%%)\n", end_in_sec,
+           summary.readable_count_str.c_str(), summary.event_type->name.c_str(),
+           summary.comment.c_str(), 1.0 / summary.scale * 100);
+  }
+  fflush(stdout);
+  return true;
+}
+
 void RegisterStatCommand() {
   RegisterCommand("stat", [] { return std::unique_ptr<Command>(new StatCommand); });
 }
@@ -92,3 +92,25 @@ TEST(stat_cmd, cpu_option) {
     ASSERT_TRUE(StatCmd()->Run({"--cpu", "0", "-a", "sleep", "1"}));
   }
 }
+
+TEST(stat_cmd, interval_ms_option) {
+  ASSERT_TRUE(StatCmd()->Run(
+      {"-e", "cpu-clock,task-clock,page-faults", "--interval-ms", "100", "sleep", "1"}));
+  ASSERT_FALSE(StatCmd()->Run({"--interval-ms", "0", "sleep", "1"}));
+}
+
+TEST(stat_cmd, group_option) {
+  ASSERT_TRUE(StatCmd()->Run({"--group", "cpu-clock,page-faults", "sleep", "1"}));
+  ASSERT_TRUE(StatCmd()->Run({"-e", "task-clock", "--group", "cpu-clock,page-faults", "--group",
+                              "cpu-clock:u,context-switches", "--interval-ms", "200", "sleep",
+                              "1"}));
+}
+
+TEST(stat_cmd, per_thread_option) {
+  std::vector<std::unique_ptr<Workload>> workloads;
+  CreateProcesses(2, &workloads);
+  std::string pid_list =
+      android::base::StringPrintf("%d,%d", workloads[0]->GetPid(), workloads[1]->GetPid());
+  ASSERT_TRUE(StatCmd()->Run({"-p", pid_list, "--per-thread", "sleep", "1"}));
+  ASSERT_TRUE(StatCmd()->Run({"--per-thread", "--no-inherit", "sleep", "1"}));
+}
@@ -0,0 +1,541 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "command.h"
+#include "environment.h"
+#include "event_selection_set.h"
+#include "event_type.h"
+#include "record.h"
+#include "sample_tree.h"
+#include "scoped_signal_handler.h"
+#include "thread_tree.h"
+#include "utils.h"
+#include "workload.h"
+
+static std::string default_measured_event_type = "cpu-cycles";
+
+static volatile bool signaled;
+static void signal_handler(int) {
+  signaled = true;
+}
+
+// Samples in a refresh interval are aggregated by dso and symbol.
+static int CompareSampleBySymbol(const SampleEntry& sample1, const SampleEntry& sample2) {
+  if (sample1.map->dso != sample2.map->dso) {
+    return sample1.map->dso < sample2.map->dso ? -1 : 1;
+  }
+  if (sample1.symbol != sample2.symbol) {
+    return sample1.symbol < sample2.symbol ? -1 : 1;
+  }
+  return 0;
+}
+
+static uint64_t HashSampleBySymbol(const SampleEntry& sample) {
+  uint64_t hash = reinterpret_cast<uintptr_t>(sample.map->dso);
+  return hash * 31 + reinterpret_cast<uintptr_t>(sample.symbol);
+}
+
+class TopCommand : public Command {
+ public:
+  TopCommand()
+      : Command(
+            "top", "show the hottest functions while sampling",
+            "Usage: simpleperf top [options] [command [command-args]]\n"
+            "    Sample like the record command, and periodically print the functions taking\n"
+            "    the most samples, without writing perf.data. Stop with Ctrl-C, when\n"
+            "    [command] exits, or after --duration.\n"
+            "    -a           System-wide collection.\n"
+            "    -c count     Set event sample period.\n"
+            "    --cpu cpu_item1,cpu_item2,...\n"
+            "                 Collect samples only on the selected cpus. cpu_item can be cpu\n"
+            "                 number like 1, or cpu range like 0-3.\n"
+            "    --decay factor\n"
+            "                 Multiply the weight of earlier samples by factor at each refresh,\n"
+            "                 so the output follows recent changes. It is between 0 and 1.\n"
+            "                 0 shows only samples since the last refresh. Default is 0.5.\n"
+            "    --duration time_in_sec\n"
+            "                 Stop after time_in_sec seconds.\n"
+            "    -e event1[:modifier1],event2[:modifier2],...\n"
+            "                 Select the event list to sample. Use `simpleperf list` to find\n"
+            "                 all possible event names.\n"
+            "    -f freq      Set event sample frequency.\n"
+            "    -F freq      Same as '-f freq'.\n"
+            "    -m mmap_pages\n"
+            "                 Set the size of the buffer used to receiving sample data from\n"
+            "                 the kernel. It should be a power of 2. The default value is 16.\n"
+            "    --max-entries n\n"
+            "                 Print at most n functions at each refresh. Default is 20.\n"
+            "    --no-inherit\n"
+            "                 Don't sample created child threads/processes.\n"
+            "    -p pid1,pid2,...\n"
+            "                 Sample existing processes. Mutually exclusive with -a.\n"
+            "    --refresh-ms ms\n"
+            "                 Print the hottest functions every ms milliseconds. Default is\n"
+            "                 1000.\n"
+            "    -t tid1,tid2,...\n"
+            "                 Sample existing threads. Mutually exclusive with -a.\n"),
+        use_sample_freq_(true),
+        sample_freq_(4000),
+        system_wide_collection_(false),
+        child_inherit_(true),
+        perf_mmap_pages_(16),
+        refresh_ms_(1000),
+        max_entries_(20),
+        decay_(0.5),
+        duration_in_sec_(0),
+        interval_sample_count_(0),
+        lost_record_count_(0) {
+    signaled = false;
+    scoped_signal_handler_.reset(
+        new ScopedSignalHandler({SIGCHLD, SIGINT, SIGTERM}, signal_handler));
+  }
+
+  bool Run(const std::vector<std::string>& args);
+
+ private:
+  // The decayed weight of samples hitting a symbol.
+  struct TopEntry {
+    const Dso* dso;
+    const Symbol* symbol;
+    double weight;
+  };
+
+  bool ParseOptions(const std::vector<std::string>& args, std::vector<std::string>* non_option_args);
+  bool AddMeasuredEventType(const std::string& event_type_name);
+  bool SetEventSelection();
+  void AddExistingThreadsAndMaps();
+  bool ProcessRecords(const char* data, size_t size);
+  void Refresh(uint64_t interval_in_ms);
+
+  bool use_sample_freq_;
+  uint64_t sample_freq_;
+  uint64_t sample_period_;
+  bool system_wide_collection_;
+  bool child_inherit_;
+  std::vector<pid_t> monitored_threads_;
+  std::vector<int> cpus_;
+  std::vector<EventTypeAndModifier> measured_event_types_;
+  EventSelectionSet event_selection_set_;
+  size_t perf_mmap_pages_;
+  uint64_t refresh_ms_;
+  size_t max_entries_;
+  double decay_;
+  double duration_in_sec_;
+
+  ThreadTree thread_tree_;
+  // Samples since the last refresh, folded into top_entries_ at each refresh.
+  std::unique_ptr<SampleTree> sample_tree_;
+  // Keyed by dso and symbol, as the unknown symbol is shared by all dsos.
+  std::map<std::pair<const Dso*, const Symbol*>, TopEntry> top_entries_;
+  uint64_t interval_sample_count_;
+  uint64_t lost_record_count_;
+
+  std::unique_ptr<ScopedSignalHandler> scoped_signal_handler_;
+};
+
+bool TopCommand::Run(const std::vector<std::string>& args) {
+  if (!CheckPerfEventLimit()) {
+    return false;
+  }
+
+  // 1. Parse options, and use default measured event type if not given.
+  std::vector<std::string> workload_args;
+  if (!ParseOptions(args, &workload_args)) {
+    return false;
+  }
+  if (measured_event_types_.empty()) {
+    if (!AddMeasuredEventType(default_measured_event_type)) {
+      return false;
+    }
+  }
+  if (!SetEventSelection()) {
+    return false;
+  }
+
+  // 2. Create workload.
+  std::unique_ptr<Workload> workload;
+  if (!workload_args.empty()) {
+    workload = Workload::CreateWorkload(workload_args);
+    if (workload == nullptr) {
+      return false;
+    }
+  }
+  if (!system_wide_collection_ && monitored_threads_.empty()) {
+    if (workload != nullptr) {
+      monitored_threads_.push_back(workload->GetPid());
+      event_selection_set_.SetEnableOnExec(true);
+    } else {
+      LOG(ERROR) << "No threads to monitor. Try `simpleperf help top` for help\n";
+      return false;
+    }
+  }
+
+  // 3. Open perf_event_files, and create memory mapped buffers for them.
+  if (system_wide_collection_) {
+    if (!event_selection_set_.OpenEventFilesForCpus(cpus_)) {
+      return false;
+    }
+  } else {
+    if (!event_selection_set_.OpenEventFilesForThreadsOnCpus(monitored_threads_, cpus_)) {
+      return false;
+    }
+  }
+  if (!event_selection_set_.MmapEventFiles(perf_mmap_pages_)) {
+    return false;
+  }
+  std::vector<pollfd> pollfds;
+  event_selection_set_.PreparePollForEventFiles(&pollfds);
+  AddExistingThreadsAndMaps();
+  sample_tree_.reset(new SampleTree(&thread_tree_, CompareSampleBySymbol, HashSampleBySymbol));
+  thread_tree_.UpdatePerfMaps();
+
+  // 4. Read samples while the workload is running, and refresh the output periodically.
+  if (workload != nullptr && !workload->Start()) {
+    return false;
+  }
+  auto callback =
+      std::bind(&TopCommand::ProcessRecords, this, std::placeholders::_1, std::placeholders::_2);
+  auto start_time = std::chrono::steady_clock::now();
+  auto last_refresh_time = start_time;
+  auto refresh_period = std::chrono::milliseconds(refresh_ms_);
+  while (true) {
+    if (!event_selection_set_.ReadMmapEventData(callback)) {
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    bool timeout = duration_in_sec_ != 0 &&
+                   std::chrono::duration<double>(now - start_time).count() >= duration_in_sec_;
+    if (signaled || timeout) {
+      Refresh(std::chrono::duration_cast<std::chrono::milliseconds>(now - last_refresh_time)
+                  .count());
+      break;
+    }
+    if (now - last_refresh_time >= refresh_period) {
+      Refresh(std::chrono::duration_cast<std::chrono::milliseconds>(now - last_refresh_time)
+                  .count());
+      last_refresh_time = now;
+    }
+    auto wait_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+        last_refresh_time + refresh_period - now);
+    poll(&pollfds[0], pollfds.size(), std::max<int>(wait_time.count(), 1));
+  }
+  return true;
+}
+
+bool TopCommand::ParseOptions(const std::vector<std::string>& args,
+                              std::vector<std::string>* non_option_args) {
+  std::set<pid_t> tid_set;
+  size_t i;
+  for (i = 0; i < args.size() && args[i].size() > 0 && args[i][0] == '-'; ++i) {
+    if (args[i] == "-a") {
+      system_wide_collection_ = true;
+    } else if (args[i] == "-c") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      char* endptr;
+      sample_period_ = strtoull(args[i].c_str(), &endptr, 0);
+      if (*endptr != '\0' || sample_period_ == 0) {
+        LOG(ERROR) << "Invalid sample period: '" << args[i] << "'";
+        return false;
+      }
+      use_sample_freq_ = false;
+    } else if (args[i] == "--cpu") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      cpus_ = GetCpusFromString(args[i]);
+    } else if (args[i] == "--decay") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      char* endptr;
+      decay_ = strtod(args[i].c_str(), &endptr);
+      if (*endptr != '\0' || decay_ < 0 || decay_ > 1) {
+        LOG(ERROR) << "Invalid decay factor: '" << args[i] << "'";
+        return false;
+      }
+    } else if (args[i] == "--duration") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      char* endptr;
+      duration_in_sec_ = strtod(args[i].c_str(), &endptr);
+      if (*endptr != '\0' || duration_in_sec_ <= 0) {
+        LOG(ERROR) << "Invalid duration: '" << args[i] << "'";
+        return false;
+      }
+    } else if (args[i] == "-e") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      std::vector<std::string> event_types = android::base::Split(args[i], ",");
+      for (auto& event_type : event_types) {
+        if (!AddMeasuredEventType(event_type)) {
+          return false;
+        }
+      }
+    } else if (args[i] == "-f" || args[i] == "-F") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      char* endptr;
+      sample_freq_ = strtoull(args[i].c_str(), &endptr, 0);
+      if (*endptr != '\0' || sample_freq_ == 0) {
+        LOG(ERROR) << "Invalid sample frequency: '" << args[i] << "'";
+        return false;
+      }
+      use_sample_freq_ = true;
+    } else if (args[i] == "-m") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      char* endptr;
+      uint64_t pages = strtoull(args[i].c_str(), &endptr, 0);
+      if (*endptr != '\0' || !IsPowerOfTwo(pages)) {
+        LOG(ERROR) << "Invalid mmap_pages: '" << args[i] << "'";
+        return false;
+      }
+      perf_mmap_pages_ = pages;
+    } else if (args[i] == "--max-entries") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!android::base::ParseUint(args[i].c_str(), &max_entries_) || max_entries_ == 0) {
+        LOG(ERROR) << "Invalid argument for --max-entries option: " << args[i];
+        return false;
+      }
+    } else if (args[i] == "--no-inherit") {
+      child_inherit_ = false;
+    } else if (args[i] == "-p") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!GetValidThreadsFromProcessString(args[i], &tid_set)) {
+        return false;
+      }
+    } else if (args[i] == "--refresh-ms") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!android::base::ParseUint(args[i].c_str(), &refresh_ms_) || refresh_ms_ == 0) {
+        LOG(ERROR) << "Invalid argument for --refresh-ms option: " << args[i];
+        return false;
+      }
+    } else if (args[i] == "-t") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!GetValidThreadsFromThreadString(args[i], &tid_set)) {
+        return false;
+      }
+    } else {
+      ReportUnknownOption(args, i);
+      return false;
+    }
+  }
+
+  monitored_threads_.insert(monitored_threads_.end(), tid_set.begin(), tid_set.end());
+  if (system_wide_collection_ && !monitored_threads_.empty()) {
+    LOG(ERROR)
+        << "Sample system wide and existing processes/threads can't be used at the same time.";
+    return false;
+  }
+
+  if (non_option_args != nullptr) {
+    non_option_args->clear();
+    for (; i < args.size(); ++i) {
+      non_option_args->push_back(args[i]);
+    }
+  }
+  return true;
+}
+
+bool TopCommand::AddMeasuredEventType(const std::string& event_type_name) {
+  std::unique_ptr<EventTypeAndModifier> event_type_modifier = ParseEventType(event_type_name);
+  if (event_type_modifier == nullptr) {
+    return false;
+  }
+  measured_event_types_.push_back(*event_type_modifier);
+  return true;
+}
+
+bool TopCommand::SetEventSelection() {
+  for (auto& event_type : measured_event_types_) {
+    if (!event_selection_set_.AddEventType(event_type)) {
+      return false;
+    }
+  }
+  if (use_sample_freq_) {
+    event_selection_set_.SetSampleFreq(sample_freq_);
+  } else {
+    event_selection_set_.SetSamplePeriod(sample_period_);
+  }
+  event_selection_set_.SampleIdAll();
+  event_selection_set_.SetInherit(child_inherit_);
+  return true;
+}
+
+// Like RecordCommand::DumpKernelAndModuleMmaps() and DumpThreadCommAndMmaps(), but add the
+// threads and maps to thread_tree_ directly, as no records are written.
+void TopCommand::AddExistingThreadsAndMaps() {
+  KernelMmap kernel_mmap;
+  std::vector<KernelMmap> module_mmaps;
+  GetKernelAndModuleMmaps(&kernel_mmap, &module_mmaps);
+  thread_tree_.AddKernelMap(kernel_mmap.start_addr, kernel_mmap.len, 0, 0, kernel_mmap.filepath);
+  for (auto& module_mmap : module_mmaps) {
+    thread_tree_.AddKernelMap(module_mmap.start_addr, module_mmap.len, 0, 0, module_mmap.filepath);
+  }
+
+  std::vector<ThreadComm> thread_comms;
+  if (!GetThreadComms(&thread_comms)) {
+    return;
+  }
+  std::set<pid_t> selected_threads(monitored_threads_.begin(), monitored_threads_.end());
+  std::set<pid_t> selected_processes;
+  for (auto& thread : thread_comms) {
+    if (selected_threads.find(thread.tid) != selected_threads.end()) {
+      selected_processes.insert(thread.pid);
+    }
+  }
+  for (auto& thread : thread_comms) {
+    if (!system_wide_collection_ && selected_processes.find(thread.pid) == selected_processes.end()) {
+      continue;
+    }
+    if (thread.pid != thread.tid) {
+      thread_tree_.ForkThread(thread.pid, thread.tid, thread.pid, thread.pid);
+      thread_tree_.AddThread(thread.pid, thread.tid, thread.comm);
+      continue;
+    }
+    thread_tree_.AddThread(thread.pid, thread.tid, thread.comm);
+    std::vector<ThreadMmap> thread_mmaps;
+    if (!GetThreadMmapsInProcess(thread.pid, &thread_mmaps)) {
+      // The thread may exit before we get its info.
+      continue;
+    }
+    for (auto& thread_mmap : thread_mmaps) {
+      if (thread_mmap.executable) {
+        thread_tree_.AddThreadMap(thread.pid, thread.tid, thread_mmap.start_addr, thread_mmap.len,
+                                  thread_mmap.pgoff, 0, thread_mmap.name);
+      }
+    }
+  }
+}
+
+bool TopCommand::ProcessRecords(const char* data, size_t size) {
+  const perf_event_attr* attr = event_selection_set_.FindEventAttrByType(measured_event_types_[0]);
+  std::vector<std::unique_ptr<Record>> records = ReadRecordsFromBuffer(*attr, data, size);
+  for (auto& record : records) {
+    if (record->type() == PERF_RECORD_LOST) {
+      // The data of a lost record is {u64 id; u64 lost;}.
+      const std::vector<char>& lost_data = static_cast<UnknownRecord*>(record.get())->data;
+      if (lost_data.size() >= 2 * sizeof(uint64_t)) {
+        lost_record_count_ += *reinterpret_cast<const uint64_t*>(&lost_data[sizeof(uint64_t)]);
+      }
+    } else if (record->type() == PERF_RECORD_SAMPLE) {
+      const SampleRecord& r = *static_cast<SampleRecord*>(record.get());
+      bool in_kernel = (r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL;
+      sample_tree_->AddSample(r.tid_data.pid, r.tid_data.tid, r.ip_data.ip, r.time_data.time,
+                              r.period_data.period, in_kernel);
+      interval_sample_count_++;
+    } else {
+      BuildThreadTree(*record, &thread_tree_);
+    }
+  }
+  return true;
+}
+
+void TopCommand::Refresh(uint64_t interval_in_ms) {
+  for (auto& pair : top_entries_) {
+    pair.second.weight *= decay_;
+  }
+  sample_tree_->VisitAllSamples([this](const SampleEntry& sample) {
+    auto key = std::make_pair(sample.map->dso, sample.symbol);
+    auto it = top_entries_.find(key);
+    if (it == top_entries_.end()) {
+      it = top_entries_.insert(std::make_pair(key, TopEntry{sample.map->dso, sample.symbol, 0}))
+               .first;
+    }
+    it->second.weight += sample.period;
+  });
+  sample_tree_.reset(new SampleTree(&thread_tree_, CompareSampleBySymbol, HashSampleBySymbol));
+
+  std::vector<const TopEntry*> entries;
+  double total_weight = 0;
+  for (auto& pair : top_entries_) {
+    total_weight += pair.second.weight;
+  }
+  // Forget symbols whose weight has decayed to nothing, so the table doesn't keep growing.
+  for (auto it = top_entries_.begin(); it != top_entries_.end();) {
+    if (it->second.weight <= total_weight * 1e-6) {
+      it = top_entries_.erase(it);
+    } else {
+      entries.push_back(&it->second);
+      ++it;
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const TopEntry* e1, const TopEntry* e2) {
+    return e1->weight > e2->weight;
+  });
+  if (entries.size() > max_entries_) {
+    entries.resize(max_entries_);
+  }
+
+  if (isatty(STDOUT_FILENO)) {
+    // Clear the screen and move the cursor to the top.
+    printf("\033[H\033[2J");
+  }
+  printf("Samples: %" PRIu64 " in the last %" PRIu64 " ms, lost records: %" PRIu64 "\n\n",
+         interval_sample_count_, interval_in_ms, lost_record_count_);
+  size_t dso_width = strlen("Shared Object");
+  for (auto& entry : entries) {
+    dso_width = std::max(dso_width, entry->dso->Path().size());
+  }
+  printf("%-8s  %-*s  %s\n", "Overhead", static_cast<int>(dso_width), "Shared Object", "Symbol");
+  for (auto& entry : entries) {
+    std::string overhead = android::base::StringPrintf("%.2lf%%", 100.0 * entry->weight /
+                                                                      total_weight);
+    printf("%-8s  %-*s  %s\n", overhead.c_str(), static_cast<int>(dso_width),
+           entry->dso->Path().c_str(), entry->symbol->DemangledName());
+  }
+  fflush(stdout);
+  interval_sample_count_ = 0;
+}
+
+void RegisterTopCommand() {
+  RegisterCommand("top", [] { return std::unique_ptr<Command>(new TopCommand); });
+}
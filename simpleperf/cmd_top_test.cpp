@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "command.h"
+
+static std::unique_ptr<Command> TopCmd() {
+  return CreateCommandInstance("top");
+}
+
+TEST(top_cmd, workload) {
+  ASSERT_TRUE(TopCmd()->Run({"-e", "cpu-clock", "--refresh-ms", "100", "sleep", "1"}));
+}
+
+TEST(top_cmd, duration_option) {
+  ASSERT_TRUE(TopCmd()->Run({"-e", "cpu-clock", "--duration", "0.5", "-p",
+                             std::to_string(getpid())}));
+}
+
+TEST(top_cmd, decay_and_max_entries_option) {
+  ASSERT_TRUE(TopCmd()->Run(
+      {"-e", "cpu-clock", "--decay", "0", "--max-entries", "5", "--refresh-ms", "100", "sleep",
+       "1"}));
+  ASSERT_FALSE(TopCmd()->Run({"--decay", "2", "sleep", "1"}));
+  ASSERT_FALSE(TopCmd()->Run({"--max-entries", "0", "sleep", "1"}));
+  ASSERT_FALSE(TopCmd()->Run({"--refresh-ms", "0", "sleep", "1"}));
+}
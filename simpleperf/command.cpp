@@ -69,23 +69,31 @@ const std::vector<std::string> GetAllCommandNames() {
   return names;
 }
 
+extern void RegisterBuildIndexCommand();
+extern void RegisterDiffCommand();
 extern void RegisterDumpRecordCommand();
+extern void RegisterFilterCommand();
 extern void RegisterHelpCommand();
 extern void RegisterListCommand();
 extern void RegisterRecordCommand();
 extern void RegisterReportCommand();
 extern void RegisterStatCommand();
+extern void RegisterTopCommand();
 
 class CommandRegister {
  public:
   CommandRegister() {
+    RegisterBuildIndexCommand();
+    RegisterDiffCommand();
     RegisterDumpRecordCommand();
     RegisterHelpCommand();
     RegisterReportCommand();
 #if defined(__linux__)
+    RegisterFilterCommand();
     RegisterListCommand();
     RegisterRecordCommand();
     RegisterStatCommand();
+    RegisterTopCommand();
 #endif
   }
 };
@@ -31,11 +31,14 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/test_utils.h>
 
 #include "command.h"
 #include "event_attr.h"
 #include "event_fd.h"
 #include "event_type.h"
+#include "record.h"
+#include "record_file.h"
 
 static std::unique_ptr<Command> RecordCmd() {
   return CreateCommandInstance("record");
@@ -253,6 +256,38 @@ TEST(cpu_offline, offline_while_recording_on_another_cpu) {
   }
 }
 
+TEST(cpu_offline, record_on_cpu_coming_online) {
+  ScopedMpdecisionKiller scoped_mpdecision_killer;
+  CpuOnlineRestorer cpuonline_restorer;
+
+  if (GetCpuCount() == 1) {
+    GTEST_LOG_(INFO) << "This test does nothing, because there is only one cpu in the system.";
+    return;
+  }
+  // The cpu is offline when recording starts, and comes online while recording.
+  int test_cpu = GetCpuCount() - 1;
+  SetCpuOnline(test_cpu, false);
+  std::thread online_thread([&]() {
+    usleep(500000);
+    SetCpuOnline(test_cpu, true);
+  });
+  TemporaryFile tmpfile;
+  bool result = RecordCmd()->Run({"-a", "-e", "cpu-clock", "-o", tmpfile.path, "sleep", "4"});
+  online_thread.join();
+  ASSERT_TRUE(result);
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  bool has_sample_on_test_cpu = false;
+  for (auto& record : reader->DataSection()) {
+    if (record->type() == PERF_RECORD_SAMPLE &&
+        static_cast<SampleRecord*>(record.get())->cpu_data.cpu == static_cast<uint32_t>(test_cpu)) {
+      has_sample_on_test_cpu = true;
+      break;
+    }
+  }
+  ASSERT_TRUE(has_sample_on_test_cpu);
+}
+
 int main(int argc, char** argv) {
   InitLogging(argv, android::base::StderrLogger);
   testing::InitGoogleTest(&argc, argv);
@@ -16,46 +16,119 @@
 
 #include "dso.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <limits>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 
 #include "environment.h"
 #include "read_apk.h"
+#include "read_dwarf.h"
 #include "read_elf.h"
 #include "utils.h"
 
-static OneTimeFreeAllocator symbol_name_allocator;
+// Symbol names are interned, as the same names appear in many dsos.
+static StringPool symbol_name_pool;
+static std::mutex symbol_name_pool_mutex;
+
+static const char* AllocateSymbolName(const std::string& name) {
+  std::lock_guard<std::mutex> lock(symbol_name_pool_mutex);
+  return symbol_name_pool.Intern(name);
+}
 
 Symbol::Symbol(const std::string& name, uint64_t addr, uint64_t len)
-    : addr(addr),
-      len(len),
-      name_(symbol_name_allocator.AllocateString(name)),
-      demangled_name_(nullptr) {
+    : addr(addr), len(len), name_(AllocateSymbolName(name)), demangled_name_(nullptr) {
+}
+
+Symbol::Symbol(NameInSymbolCache, const char* name, uint64_t addr, uint64_t len)
+    : addr(addr), len(len), name_(name), demangled_name_(nullptr) {
+}
+
+Symbol::Symbol(const Symbol& symbol)
+    : addr(symbol.addr),
+      len(symbol.len),
+      name_(symbol.name_),
+      demangled_name_(symbol.demangled_name_.load()) {
+}
+
+Symbol& Symbol::operator=(const Symbol& symbol) {
+  addr = symbol.addr;
+  len = symbol.len;
+  name_ = symbol.name_;
+  demangled_name_ = symbol.demangled_name_.load();
+  return *this;
 }
 
 const char* Symbol::DemangledName() const {
-  if (demangled_name_ == nullptr) {
+  const char* result = demangled_name_.load(std::memory_order_acquire);
+  if (result == nullptr) {
     const std::string s = Dso::Demangle(name_);
-    if (s == name_) {
-      demangled_name_ = name_;
-    } else {
-      demangled_name_ = symbol_name_allocator.AllocateString(s);
+    result = (s == name_) ? name_ : AllocateSymbolName(s);
+    // If another thread demangled it first, both results are equal strings.
+    demangled_name_.store(result, std::memory_order_release);
+  }
+  return result;
+}
+
+bool DsoContext::SetSymFsDir(const std::string& symfs_dir) {
+  std::string dirname = symfs_dir;
+  if (!dirname.empty()) {
+    if (dirname.back() != '/') {
+      dirname.push_back('/');
     }
+    std::vector<std::string> files;
+    std::vector<std::string> subdirs;
+    GetEntriesInDir(symfs_dir, &files, &subdirs);
+    if (files.empty() && subdirs.empty()) {
+      LOG(ERROR) << "Invalid symfs_dir '" << symfs_dir << "'";
+      return false;
+    }
+  }
+  this->symfs_dir = dirname;
+  build_id_index = nullptr;
+  if (!dirname.empty()) {
+    build_id_index = BuildIdIndex::Open(dirname);
+  }
+  return true;
+}
+
+void DsoContext::SetBuildIds(const std::vector<std::pair<std::string, BuildId>>& build_ids) {
+  std::unordered_map<std::string, BuildId> map;
+  for (auto& pair : build_ids) {
+    LOG(DEBUG) << "build_id_map: " << pair.first << ", " << pair.second.ToString();
+    map.insert(pair);
+  }
+  build_id_map = std::move(map);
+}
+
+BuildId DsoContext::GetExpectedBuildId(const std::string& filename) const {
+  auto it = build_id_map.find(filename);
+  if (it != build_id_map.end()) {
+    return it->second;
   }
-  return demangled_name_;
+  return BuildId();
+}
+
+void DsoContext::SetKernelSymbolTable(const std::string& filename, uint64_t offset,
+                                      uint64_t size) {
+  kernel_symbol_table_file = filename;
+  kernel_symbol_table_offset = offset;
+  kernel_symbol_table_size = size;
 }
 
 bool Dso::demangle_ = true;
-std::string Dso::symfs_dir_;
+DsoContext Dso::default_context_;
 std::string Dso::vmlinux_;
-std::unordered_map<std::string, BuildId> Dso::build_id_map_;
-size_t Dso::dso_count_;
+std::string Dso::symbol_cache_dir_;
+std::atomic<size_t> Dso::dso_count_;
 
 void Dso::SetDemangle(bool demangle) {
   demangle_ = demangle;
@@ -89,21 +162,7 @@ std::string Dso::Demangle(const std::string& name) {
 }
 
 bool Dso::SetSymFsDir(const std::string& symfs_dir) {
-  std::string dirname = symfs_dir;
-  if (!dirname.empty()) {
-    if (dirname.back() != '/') {
-      dirname.push_back('/');
-    }
-    std::vector<std::string> files;
-    std::vector<std::string> subdirs;
-    GetEntriesInDir(symfs_dir, &files, &subdirs);
-    if (files.empty() && subdirs.empty()) {
-      LOG(ERROR) << "Invalid symfs_dir '" << symfs_dir << "'";
-      return false;
-    }
-  }
-  symfs_dir_ = dirname;
-  return true;
+  return default_context_.SetSymFsDir(symfs_dir);
 }
 
 void Dso::SetVmlinux(const std::string& vmlinux) {
@@ -111,38 +170,37 @@ void Dso::SetVmlinux(const std::string& vmlinux) {
 }
 
 void Dso::SetBuildIds(const std::vector<std::pair<std::string, BuildId>>& build_ids) {
-  std::unordered_map<std::string, BuildId> map;
-  for (auto& pair : build_ids) {
-    LOG(DEBUG) << "build_id_map: " << pair.first << ", " << pair.second.ToString();
-    map.insert(pair);
-  }
-  build_id_map_ = std::move(map);
+  default_context_.SetBuildIds(build_ids);
 }
 
-BuildId Dso::GetExpectedBuildId(const std::string& filename) {
-  auto it = build_id_map_.find(filename);
-  if (it != build_id_map_.end()) {
-    return it->second;
-  }
-  return BuildId();
+void Dso::SetSymbolCacheDir(const std::string& symbol_cache_dir) {
+  symbol_cache_dir_ = symbol_cache_dir;
 }
 
-std::unique_ptr<Dso> Dso::CreateDso(DsoType dso_type, const std::string& dso_path) {
+std::unique_ptr<Dso> Dso::CreateDso(DsoType dso_type, const std::string& dso_path,
+                                    const DsoContext* context) {
   std::string path = dso_path;
   if (dso_type == DSO_KERNEL) {
     path = "[kernel.kallsyms]";
   }
-  return std::unique_ptr<Dso>(new Dso(dso_type, path));
+  return std::unique_ptr<Dso>(
+      new Dso(dso_type, path, (context != nullptr) ? context : &default_context_));
 }
 
-Dso::Dso(DsoType type, const std::string& path)
-    : type_(type), path_(path), min_vaddr_(std::numeric_limits<uint64_t>::max()), is_loaded_(false) {
+Dso::Dso(DsoType type, const std::string& path, const DsoContext* context)
+    : type_(type),
+      path_(path),
+      context_(context),
+      min_vaddr_(0),
+      symbol_directory_base_(0),
+      symbol_directory_shift_(0),
+      perf_map_read_size_(0) {
   dso_count_++;
 }
 
 Dso::~Dso() {
   if (--dso_count_ == 0) {
-    symbol_name_allocator.Clear();
+    symbol_name_pool.Clear();
   }
 }
 
@@ -152,21 +210,61 @@ struct SymbolComparator {
   }
 };
 
+static bool CompareAddrToSymbol(uint64_t addr, const Symbol& symbol) {
+  return addr < symbol.addr;
+}
+
 std::string Dso::GetAccessiblePath() const {
-  return symfs_dir_ + path_;
+  if (context_->build_id_index != nullptr) {
+    BuildId build_id = GetExpectedBuildId(path_);
+    if (!build_id.IsEmpty()) {
+      const char* path = context_->build_id_index->FindPath(build_id);
+      if (path != nullptr) {
+        return context_->symfs_dir + path;
+      }
+    }
+  }
+  return context_->symfs_dir + path_;
 }
 
-const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
-  if (!is_loaded_) {
-    is_loaded_ = true;
+void Dso::LoadOnce() {
+  std::call_once(load_once_, [this]() {
     if (!Load()) {
       LOG(DEBUG) << "failed to load dso: " << path_;
-      return nullptr;
     }
-  }
+    BuildSymbolDirectory();
+  });
+}
+
+void Dso::SetSymbolsForTesting(const std::vector<Symbol>& symbols) {
+  std::call_once(load_once_, [&]() {
+    symbols_ = symbols;
+    std::sort(symbols_.begin(), symbols_.end(), SymbolComparator());
+    FixupSymbolLength();
+    BuildSymbolDirectory();
+  });
+}
+
+void Dso::Preload() {
+  MinVirtualAddress();
+  LoadOnce();
+}
 
-  auto it = std::upper_bound(symbols_.begin(), symbols_.end(), Symbol("", vaddr_in_dso, 0),
-                             SymbolComparator());
+const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
+  LoadOnce();
+
+  auto begin = symbols_.begin();
+  auto end = symbols_.end();
+  if (!symbol_directory_.empty() && vaddr_in_dso >= symbol_directory_base_) {
+    uint64_t bucket = (vaddr_in_dso - symbol_directory_base_) >> symbol_directory_shift_;
+    if (bucket + 1 < symbol_directory_.size()) {
+      begin += symbol_directory_[bucket];
+      end = symbols_.begin() + symbol_directory_[bucket + 1];
+    } else {
+      begin += symbol_directory_.back();
+    }
+  }
+  auto it = std::upper_bound(begin, end, vaddr_in_dso, CompareAddrToSymbol);
   if (it != symbols_.begin()) {
     --it;
     if (it->addr <= vaddr_in_dso && it->addr + it->len > vaddr_in_dso) {
@@ -177,8 +275,7 @@ const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
 }
 
 uint64_t Dso::MinVirtualAddress() {
-  if (min_vaddr_ == std::numeric_limits<uint64_t>::max()) {
-    min_vaddr_ = 0;
+  std::call_once(min_vaddr_once_, [this]() {
     if (type_ == DSO_ELF_FILE) {
       BuildId build_id = GetExpectedBuildId(GetAccessiblePath());
 
@@ -187,11 +284,34 @@ uint64_t Dso::MinVirtualAddress() {
         min_vaddr_ = addr;
       }
     }
-  }
+  });
   return min_vaddr_;
 }
 
 bool Dso::Load() {
+  BuildId build_id;
+  std::string cache_path;
+  if (type_ == DSO_KERNEL) {
+    if (LoadKernelSymbolTable()) {
+      return true;
+    }
+    cache_path = GetKernelSymbolCachePath(&build_id);
+    if (!cache_path.empty() && LoadSymbolCache(cache_path, build_id)) {
+      return true;
+    }
+  } else if (!symbol_cache_dir_.empty()) {
+    if (type_ == DSO_KERNEL_MODULE) {
+      build_id = GetExpectedBuildId(path_);
+    } else if (type_ == DSO_ELF_FILE) {
+      build_id = GetExpectedBuildId(GetAccessiblePath());
+    }
+    if (!build_id.IsEmpty()) {
+      cache_path = GetSymbolCachePath(build_id);
+      if (LoadSymbolCache(cache_path, build_id)) {
+        return true;
+      }
+    }
+  }
   bool result = false;
   switch (type_) {
     case DSO_KERNEL:
@@ -208,14 +328,51 @@ bool Dso::Load() {
       }
       break;
     }
+    case DSO_PERF_MAP:
+      result = LoadPerfMap();
+      break;
   }
   if (result) {
     std::sort(symbols_.begin(), symbols_.end(), SymbolComparator());
     FixupSymbolLength();
+    // LoadKernelModule() succeeds even if the file can't be read, so don't cache empty results.
+    if (!cache_path.empty() && !symbols_.empty()) {
+      SaveSymbolCache(cache_path, build_id);
+    }
   }
   return result;
 }
 
+// Map kernel symbols from the symbol table embedded in perf.data, instead of parsing and sorting
+// /proc/kallsyms.
+bool Dso::LoadKernelSymbolTable() {
+  if (!vmlinux_.empty() || context_->kernel_symbol_table_file.empty()) {
+    return false;
+  }
+  std::unique_ptr<MappedFile> file = MappedFile::Create(context_->kernel_symbol_table_file,
+                                                        context_->kernel_symbol_table_offset,
+                                                        context_->kernel_symbol_table_size);
+  return file != nullptr &&
+         LoadSymbolTable(std::move(file), GetExpectedBuildId(DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID),
+                         context_->kernel_symbol_table_file);
+}
+
+// Return the symbol cache file of /proc/kallsyms, or an empty string if symbols read from
+// /proc/kallsyms can't be cached: kernel addresses change each boot, so the file is keyed by the
+// boot id as well as the build id of the running kernel.
+std::string Dso::GetKernelSymbolCachePath(BuildId* build_id) const {
+  if (symbol_cache_dir_.empty() || !vmlinux_.empty()) {
+    return "";
+  }
+  BuildId expected_build_id = GetExpectedBuildId(DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID);
+  std::string boot_id;
+  if (!GetKernelBuildId(build_id) || !GetBootId(&boot_id) ||
+      (!expected_build_id.IsEmpty() && expected_build_id != *build_id)) {
+    return "";
+  }
+  return GetSymbolCachePath(*build_id) + "." + boot_id;
+}
+
 static bool IsKernelFunctionSymbol(const KernelSymbol& symbol) {
   return (symbol.type == 'T' || symbol.type == 't' || symbol.type == 'W' || symbol.type == 'w');
 }
@@ -284,7 +441,7 @@ static bool SymbolFilterForKernelModule(const ElfFileSymbol& elf_symbol) {
 bool Dso::LoadKernelModule() {
   BuildId build_id = GetExpectedBuildId(path_);
   ParseSymbolsFromElfFile(
-      symfs_dir_ + path_, build_id,
+      GetAccessiblePath(), build_id,
       std::bind(ElfFileSymbolCallback, std::placeholders::_1, this, SymbolFilterForKernelModule));
   return true;
 }
@@ -297,7 +454,7 @@ bool Dso::LoadElfFile() {
   bool loaded = false;
   BuildId build_id = GetExpectedBuildId(GetAccessiblePath());
 
-  if (symfs_dir_.empty()) {
+  if (context_->symfs_dir.empty()) {
     // Linux host can store debug shared libraries in /usr/lib/debug.
     loaded = ParseSymbolsFromElfFile(
         "/usr/lib/debug" + path_, build_id,
@@ -321,10 +478,123 @@ bool Dso::LoadEmbeddedElfFile() {
                                            this, SymbolFilterForDso));
 }
 
+// Parse complete lines of a perf map file in data, and return the size of the lines parsed.
+static size_t ParsePerfMapLines(const std::string& data, std::vector<Symbol>* symbols) {
+  size_t pos = 0;
+  while (true) {
+    size_t end = data.find('\n', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    // Lines are "<start> <size> <name>", with start and size in hex. Skip other lines.
+    const char* p = data.c_str() + pos;
+    char* endp;
+    if (isxdigit(*p)) {
+      uint64_t addr = strtoull(p, &endp, 16);
+      if (*endp == ' ' && isxdigit(endp[1])) {
+        uint64_t len = strtoull(endp + 1, &endp, 16);
+        if (*endp == ' ' && len != 0) {
+          const char* name = endp + 1;
+          symbols->emplace_back(std::string(name, data.c_str() + end), addr, len);
+        }
+      }
+    }
+    pos = end + 1;
+  }
+  return pos;
+}
+
+// JIT code caches reuse addresses of collected code, so of the symbols at the same address,
+// keep the one listed last.
+static void SortPerfMapSymbols(std::vector<Symbol>* symbols) {
+  std::stable_sort(symbols->begin(), symbols->end(), SymbolComparator());
+  std::vector<Symbol> result;
+  result.reserve(symbols->size());
+  for (auto& symbol : *symbols) {
+    if (!result.empty() && result.back().addr == symbol.addr) {
+      result.back() = symbol;
+    } else {
+      result.push_back(symbol);
+    }
+  }
+  symbols->swap(result);
+}
+
+size_t Dso::ReadPerfMapSymbols(std::vector<Symbol>* symbols) {
+  std::string path = GetAccessiblePath();
+  FILE* fp = fopen(path.c_str(), "re");
+  if (fp == nullptr) {
+    return 0;
+  }
+  std::string data;
+  if (fseek(fp, perf_map_read_size_, SEEK_SET) == 0) {
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      data.append(buf, n);
+    }
+  }
+  fclose(fp);
+  size_t old_size = symbols->size();
+  perf_map_read_size_ += ParsePerfMapLines(data, symbols);
+  return symbols->size() - old_size;
+}
+
+bool Dso::LoadPerfMap() {
+  perf_map_read_size_ = 0;
+  if (ReadPerfMapSymbols(&symbols_) == 0) {
+    return false;
+  }
+  SortPerfMapSymbols(&symbols_);
+  return true;
+}
+
+bool Dso::UpdatePerfMap() {
+  LoadOnce();
+  std::vector<Symbol> symbols = symbols_;
+  if (type_ != DSO_PERF_MAP || ReadPerfMapSymbols(&symbols) == 0) {
+    return false;
+  }
+  SortPerfMapSymbols(&symbols);
+  replaced_symbols_.push_back(std::move(symbols_));
+  symbols_ = std::move(symbols);
+  BuildSymbolDirectory();
+  return true;
+}
+
 void Dso::InsertSymbol(const Symbol& symbol) {
   symbols_.push_back(symbol);
 }
 
+void Dso::BuildSymbolDirectory() {
+  // A binary search over a few hundred symbols is cheap enough.
+  const size_t min_symbol_count = 256;
+  symbol_directory_.clear();
+  if (symbols_.size() < min_symbol_count) {
+    return;
+  }
+  // Use buckets of at least one page, and keep about one bucket per symbol, so the directory
+  // stays small even if symbols spread over a large address range, like kernel modules.
+  uint64_t base = symbols_.front().addr;
+  uint64_t max_offset = symbols_.back().addr - base;
+  uint32_t shift = 12;
+  while (shift < 63 && (max_offset >> shift) >= symbols_.size()) {
+    ++shift;
+  }
+  size_t bucket_count = (max_offset >> shift) + 1;
+  symbol_directory_.resize(bucket_count + 1);
+  size_t symbol_index = 0;
+  for (size_t i = 0; i <= bucket_count; ++i) {
+    while (symbol_index < symbols_.size() &&
+           ((symbols_[symbol_index].addr - base) >> shift) < i) {
+      ++symbol_index;
+    }
+    symbol_directory_[i] = symbol_index;
+  }
+  symbol_directory_base_ = base;
+  symbol_directory_shift_ = shift;
+}
+
 void Dso::FixupSymbolLength() {
   Symbol* prev_symbol = nullptr;
   for (auto& symbol : symbols_) {
@@ -337,3 +607,584 @@ void Dso::FixupSymbolLength() {
     prev_symbol->len = std::numeric_limits<unsigned long long>::max() - prev_symbol->addr;
   }
 }
+
+// A symbol cache file contains a SymbolCacheHeader, an array of SymbolCacheEntry sorted by addr,
+// and a string table of symbol names. The entries are the symbols after FixupSymbolLength(), so
+// they can be used without parsing or sorting.
+static const char SYMBOL_CACHE_MAGIC[8] = {'S', 'Y', 'M', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t SYMBOL_CACHE_VERSION = 1;
+
+struct SymbolCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dso_type;
+  uint64_t symbol_count;
+  uint64_t string_table_size;
+  unsigned char build_id[BUILD_ID_SIZE];
+  uint32_t reserved;
+};
+
+struct SymbolCacheEntry {
+  uint64_t addr;
+  uint64_t len;
+  uint64_t name_offset;
+};
+
+std::string Dso::GetSymbolCachePath(const BuildId& build_id) {
+  // Skip the "0x" prefix of the build id string.
+  return symbol_cache_dir_ + "/" + build_id.ToString().substr(2);
+}
+
+bool Dso::LoadSymbolCache(const std::string& path, const BuildId& build_id) {
+  if (!IsRegularFile(path)) {
+    return false;
+  }
+  std::unique_ptr<MappedFile> file = MappedFile::Create(path);
+  return file != nullptr && LoadSymbolTable(std::move(file), build_id, path);
+}
+
+// Use the symbols of a symbol table in place. If build_id is empty, the table can be of any
+// build id.
+bool Dso::LoadSymbolTable(std::unique_ptr<MappedFile> file, const BuildId& build_id,
+                          const std::string& source) {
+  const char* p = file->data();
+  size_t size = file->size();
+  if (size < sizeof(SymbolCacheHeader)) {
+    LOG(DEBUG) << "invalid symbol cache " << source;
+    return false;
+  }
+  const SymbolCacheHeader* header = reinterpret_cast<const SymbolCacheHeader*>(p);
+  if (memcmp(header->magic, SYMBOL_CACHE_MAGIC, sizeof(SYMBOL_CACHE_MAGIC)) != 0 ||
+      header->version != SYMBOL_CACHE_VERSION || header->dso_type != type_ ||
+      (!build_id.IsEmpty() && memcmp(header->build_id, build_id.Data(), BUILD_ID_SIZE) != 0) ||
+      header->symbol_count > (size - sizeof(SymbolCacheHeader)) / sizeof(SymbolCacheEntry) ||
+      header->string_table_size != size - sizeof(SymbolCacheHeader) -
+                                       header->symbol_count * sizeof(SymbolCacheEntry)) {
+    LOG(DEBUG) << "invalid symbol cache " << source;
+    return false;
+  }
+  const SymbolCacheEntry* entries = reinterpret_cast<const SymbolCacheEntry*>(header + 1);
+  const char* string_table = reinterpret_cast<const char*>(entries + header->symbol_count);
+  if (header->string_table_size > 0 && string_table[header->string_table_size - 1] != '\0') {
+    LOG(DEBUG) << "invalid symbol cache " << source;
+    return false;
+  }
+  std::vector<Symbol> symbols;
+  symbols.reserve(header->symbol_count);
+  for (uint64_t i = 0; i < header->symbol_count; ++i) {
+    if (entries[i].name_offset >= header->string_table_size) {
+      LOG(DEBUG) << "invalid symbol cache " << source;
+      return false;
+    }
+    symbols.push_back(Symbol(Symbol::NameInSymbolCache(), string_table + entries[i].name_offset,
+                             entries[i].addr, entries[i].len));
+  }
+  LOG(DEBUG) << "load " << symbols.size() << " symbols of " << path_ << " from " << source;
+  symbols_ = std::move(symbols);
+  symbol_cache_file_ = std::move(file);
+  return true;
+}
+
+bool Dso::SymbolTableToBinary(std::string* data) {
+  LoadOnce();
+  if (symbols_.empty()) {
+    return false;
+  }
+  BuildId build_id = GetExpectedBuildId(type_ == DSO_KERNEL ? DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID
+                                                            : GetAccessiblePath());
+  if (type_ == DSO_KERNEL && build_id.IsEmpty() && vmlinux_.empty()) {
+    GetKernelBuildId(&build_id);
+  }
+  *data = SymbolTableToBinary(build_id);
+  return true;
+}
+
+std::string Dso::SymbolTableToBinary(const BuildId& build_id) const {
+  SymbolCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SYMBOL_CACHE_MAGIC, sizeof(SYMBOL_CACHE_MAGIC));
+  header.version = SYMBOL_CACHE_VERSION;
+  header.dso_type = type_;
+  header.symbol_count = symbols_.size();
+  memcpy(header.build_id, build_id.Data(), BUILD_ID_SIZE);
+  std::vector<SymbolCacheEntry> entries;
+  std::string string_table;
+  for (const auto& symbol : symbols_) {
+    entries.push_back(SymbolCacheEntry{symbol.addr, symbol.len, string_table.size()});
+    string_table.append(symbol.Name());
+    string_table.push_back('\0');
+  }
+  header.string_table_size = string_table.size();
+  std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+  content.append(reinterpret_cast<const char*>(entries.data()),
+                 entries.size() * sizeof(SymbolCacheEntry));
+  content.append(string_table);
+  return content;
+}
+
+// Write to a temporary file first, so reports running at the same time never see a partial
+// cache file.
+static void WriteCacheFile(const std::string& path, const std::string& content) {
+  std::string tmp_path = path + android::base::StringPrintf(".%d.%p", getpid(), &content);
+  if (!MkdirWithParents(path) || !android::base::WriteStringToFile(content, tmp_path) ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "failed to write symbol cache " << path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+void Dso::SaveSymbolCache(const std::string& path, const BuildId& build_id) const {
+  WriteCacheFile(path, SymbolTableToBinary(build_id));
+}
+
+// A source line cache file, stored next to the symbol cache file of a dso, contains a
+// SourceLineCacheHeader, the offsets of file paths in the string table, the rows of the line
+// table sorted by addr, the inlined calls, the ranges of inlined calls sorted by addr, and a
+// string table of file paths. It is used in place, both when loaded from a file and when just
+// built from the DWARF sections of the dso.
+static const char SOURCE_LINE_CACHE_MAGIC[8] = {'S', 'R', 'C', 'L', 'I', 'N', 'E', 'S'};
+static const uint32_t SOURCE_LINE_CACHE_VERSION = 1;
+
+struct SourceLineCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t file_count;
+  uint64_t row_count;
+  uint64_t call_count;
+  uint64_t range_count;
+  uint64_t string_table_size;
+  unsigned char build_id[BUILD_ID_SIZE];
+  uint32_t reserved;
+};
+
+struct SourceLineCacheRow {
+  uint64_t addr;
+  uint32_t file;
+  uint32_t line;  // 0 if the code has no source line.
+};
+
+struct SourceLineCacheCall {
+  uint32_t file;
+  uint32_t line;
+  uint32_t parent;
+  uint32_t reserved;
+};
+
+struct SourceLineCacheRange {
+  uint64_t addr;
+  uint32_t call;
+  uint32_t reserved;
+};
+
+struct SourceLineTable {
+  std::unique_ptr<MappedFile> file;
+  std::string data;
+  const SourceLineCacheHeader* header;
+  const uint64_t* file_offsets;
+  const SourceLineCacheRow* rows;
+  const SourceLineCacheCall* calls;
+  const SourceLineCacheRange* ranges;
+  const char* string_table;
+};
+
+static_assert(NO_INLINED_CALL == SourceLine::NOT_INLINED, "calls are stored as parsed");
+
+static std::string SourceLinesToBinary(const DwarfLineInfo& info, const BuildId& build_id) {
+  SourceLineCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SOURCE_LINE_CACHE_MAGIC, sizeof(SOURCE_LINE_CACHE_MAGIC));
+  header.version = SOURCE_LINE_CACHE_VERSION;
+  header.file_count = info.files.size();
+  header.row_count = info.rows.size();
+  header.call_count = info.calls.size();
+  header.range_count = info.inlined_ranges.size();
+  memcpy(header.build_id, build_id.Data(), BUILD_ID_SIZE);
+  std::vector<uint64_t> file_offsets;
+  std::string string_table;
+  for (auto& file : info.files) {
+    file_offsets.push_back(string_table.size());
+    string_table.append(file);
+    string_table.push_back('\0');
+  }
+  header.string_table_size = string_table.size();
+  std::vector<SourceLineCacheRow> rows;
+  for (auto& row : info.rows) {
+    rows.push_back(SourceLineCacheRow{row.addr, row.file, row.line});
+  }
+  std::vector<SourceLineCacheCall> calls;
+  for (auto& call : info.calls) {
+    calls.push_back(SourceLineCacheCall{call.file, call.line, call.parent, 0});
+  }
+  std::vector<SourceLineCacheRange> ranges;
+  for (auto& range : info.inlined_ranges) {
+    ranges.push_back(SourceLineCacheRange{range.addr, range.call, 0});
+  }
+  std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+  content.append(reinterpret_cast<const char*>(file_offsets.data()),
+                 file_offsets.size() * sizeof(uint64_t));
+  content.append(reinterpret_cast<const char*>(rows.data()),
+                 rows.size() * sizeof(SourceLineCacheRow));
+  content.append(reinterpret_cast<const char*>(calls.data()),
+                 calls.size() * sizeof(SourceLineCacheCall));
+  content.append(reinterpret_cast<const char*>(ranges.data()),
+                 ranges.size() * sizeof(SourceLineCacheRange));
+  content.append(string_table);
+  return content;
+}
+
+// Point table at the parts of a source line cache in [p, p + size). Indexes in it are checked
+// here, so lookups don't need to.
+static bool ParseSourceLineTable(const char* p, size_t size, const BuildId& build_id,
+                                 SourceLineTable* table) {
+  if (size < sizeof(SourceLineCacheHeader)) {
+    return false;
+  }
+  const SourceLineCacheHeader* header = reinterpret_cast<const SourceLineCacheHeader*>(p);
+  if (memcmp(header->magic, SOURCE_LINE_CACHE_MAGIC, sizeof(SOURCE_LINE_CACHE_MAGIC)) != 0 ||
+      header->version != SOURCE_LINE_CACHE_VERSION ||
+      memcmp(header->build_id, build_id.Data(), BUILD_ID_SIZE) != 0) {
+    return false;
+  }
+  // Check the counts one by one, so their sum can't overflow.
+  size_t left = size - sizeof(SourceLineCacheHeader);
+  if (header->file_count > left / sizeof(uint64_t)) {
+    return false;
+  }
+  left -= header->file_count * sizeof(uint64_t);
+  if (header->row_count > left / sizeof(SourceLineCacheRow)) {
+    return false;
+  }
+  left -= header->row_count * sizeof(SourceLineCacheRow);
+  if (header->call_count > left / sizeof(SourceLineCacheCall)) {
+    return false;
+  }
+  left -= header->call_count * sizeof(SourceLineCacheCall);
+  if (header->range_count > left / sizeof(SourceLineCacheRange)) {
+    return false;
+  }
+  left -= header->range_count * sizeof(SourceLineCacheRange);
+  if (header->string_table_size != left ||
+      (left > 0 && p[size - 1] != '\0')) {
+    return false;
+  }
+  table->header = header;
+  table->file_offsets = reinterpret_cast<const uint64_t*>(header + 1);
+  table->rows = reinterpret_cast<const SourceLineCacheRow*>(table->file_offsets +
+                                                            header->file_count);
+  table->calls = reinterpret_cast<const SourceLineCacheCall*>(table->rows + header->row_count);
+  table->ranges = reinterpret_cast<const SourceLineCacheRange*>(table->calls +
+                                                                header->call_count);
+  table->string_table = reinterpret_cast<const char*>(table->ranges + header->range_count);
+  for (uint32_t i = 0; i < header->file_count; ++i) {
+    if (table->file_offsets[i] >= header->string_table_size) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < header->row_count; ++i) {
+    if ((table->rows[i].line != 0 && table->rows[i].file >= header->file_count) ||
+        (i > 0 && table->rows[i].addr < table->rows[i - 1].addr)) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < header->call_count; ++i) {
+    const SourceLineCacheCall& call = table->calls[i];
+    // Parents are added before their children.
+    if ((call.line != 0 && call.file >= header->file_count) ||
+        (call.parent != SourceLine::NOT_INLINED && call.parent >= i)) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < header->range_count; ++i) {
+    const SourceLineCacheRange& range = table->ranges[i];
+    if ((range.call != SourceLine::NOT_INLINED && range.call >= header->call_count) ||
+        (i > 0 && range.addr < table->ranges[i - 1].addr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool ReadDwarfSections(const std::string& filename, const BuildId& build_id,
+                              DwarfSections* sections) {
+  *sections = DwarfSections();
+  return ReadSectionsFromElfFile(filename, build_id,
+                                 {{".debug_abbrev", &sections->debug_abbrev},
+                                  {".debug_addr", &sections->debug_addr},
+                                  {".debug_info", &sections->debug_info},
+                                  {".debug_line", &sections->debug_line},
+                                  {".debug_line_str", &sections->debug_line_str},
+                                  {".debug_ranges", &sections->debug_ranges},
+                                  {".debug_rnglists", &sections->debug_rnglists},
+                                  {".debug_str", &sections->debug_str}}) &&
+         !sections->debug_line.empty();
+}
+
+bool Dso::LoadSourceLines() {
+  std::string path;
+  BuildId build_id;
+  if (type_ == DSO_ELF_FILE && !std::get<0>(SplitUrlInApk(path_))) {
+    path = GetAccessiblePath();
+    build_id = GetExpectedBuildId(path);
+  } else if (type_ == DSO_KERNEL_MODULE) {
+    path = GetAccessiblePath();
+    build_id = GetExpectedBuildId(path_);
+  } else if (type_ == DSO_KERNEL && !vmlinux_.empty()) {
+    path = vmlinux_;
+    build_id = GetExpectedBuildId(DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID);
+  } else {
+    return false;
+  }
+  std::unique_ptr<SourceLineTable> table(new SourceLineTable);
+  std::string cache_path;
+  if (!symbol_cache_dir_.empty() && !build_id.IsEmpty()) {
+    cache_path = GetSymbolCachePath(build_id) + ".srcline";
+    if (IsRegularFile(cache_path)) {
+      table->file = MappedFile::Create(cache_path);
+      if (table->file != nullptr &&
+          ParseSourceLineTable(table->file->data(), table->file->size(), build_id, table.get())) {
+        LOG(DEBUG) << "load " << table->header->row_count << " source lines of " << path_
+                   << " from " << cache_path;
+        source_lines_ = std::move(table);
+        return true;
+      }
+      LOG(DEBUG) << "invalid source line cache " << cache_path;
+      table->file.reset();
+    }
+  }
+  DwarfSections sections;
+  bool found = false;
+  if (type_ == DSO_ELF_FILE && context_->symfs_dir.empty()) {
+    // Linux host can store debug shared libraries in /usr/lib/debug.
+    found = ReadDwarfSections("/usr/lib/debug" + path_, build_id, &sections);
+  }
+  if (!found && !ReadDwarfSections(path, build_id, &sections)) {
+    return false;
+  }
+  DwarfLineInfo info;
+  if (!ParseDwarfLineInfo(sections, &info)) {
+    return false;
+  }
+  table->data = SourceLinesToBinary(info, build_id);
+  if (!ParseSourceLineTable(table->data.data(), table->data.size(), build_id, table.get())) {
+    LOG(ERROR) << "invalid source lines built for " << path_;
+    return false;
+  }
+  if (!cache_path.empty()) {
+    WriteCacheFile(cache_path, table->data);
+  }
+  source_lines_ = std::move(table);
+  return true;
+}
+
+static bool CompareAddrToSourceLineRow(uint64_t addr, const SourceLineCacheRow& row) {
+  return addr < row.addr;
+}
+
+static bool CompareAddrToSourceLineRange(uint64_t addr, const SourceLineCacheRange& range) {
+  return addr < range.addr;
+}
+
+bool Dso::FindSourceLine(uint64_t vaddr_in_dso, SourceLine* line) {
+  std::call_once(source_lines_once_, [this]() {
+    if (!LoadSourceLines()) {
+      LOG(DEBUG) << "no source lines for dso: " << path_;
+    }
+  });
+  const SourceLineTable* table = source_lines_.get();
+  if (table == nullptr) {
+    return false;
+  }
+  const SourceLineCacheRow* rows_end = table->rows + table->header->row_count;
+  const SourceLineCacheRow* row =
+      std::upper_bound(table->rows, rows_end, vaddr_in_dso, CompareAddrToSourceLineRow);
+  if (row == table->rows || (--row)->line == 0) {
+    return false;
+  }
+  line->file = table->string_table + table->file_offsets[row->file];
+  line->line = row->line;
+  line->inlined_call = SourceLine::NOT_INLINED;
+  const SourceLineCacheRange* ranges_end = table->ranges + table->header->range_count;
+  const SourceLineCacheRange* range =
+      std::upper_bound(table->ranges, ranges_end, vaddr_in_dso, CompareAddrToSourceLineRange);
+  if (range != table->ranges) {
+    line->inlined_call = (--range)->call;
+  }
+  return true;
+}
+
+bool Dso::FindInlinedCallSite(uint32_t inlined_call, SourceLine* line) {
+  // It is only called with inlined_call returned after the table is loaded.
+  const SourceLineTable* table = source_lines_.get();
+  if (table == nullptr || inlined_call >= table->header->call_count) {
+    return false;
+  }
+  const SourceLineCacheCall& call = table->calls[inlined_call];
+  if (call.line == 0) {
+    return false;
+  }
+  line->file = table->string_table + table->file_offsets[call.file];
+  line->line = call.line;
+  line->inlined_call = call.parent;
+  return true;
+}
+
+// A build id index file contains a BuildIdIndexHeader, a hash table of bucket_count
+// BuildIdIndex::Entry, and a string table of paths. bucket_count is a power of two, and an entry
+// is placed in the first free bucket from the one selected by its build id. The string table
+// starts with '\0', so a path_offset of 0 marks a free bucket.
+const char BuildIdIndex::FILENAME[] = "simpleperf_build_id_index";
+static const char BUILD_ID_INDEX_MAGIC[8] = {'B', 'U', 'I', 'L', 'D', 'I', 'D', 'X'};
+static const uint32_t BUILD_ID_INDEX_VERSION = 1;
+
+struct BuildIdIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t bucket_count;
+  uint64_t string_table_size;
+};
+
+struct BuildIdIndex::Entry {
+  unsigned char build_id[BUILD_ID_SIZE];
+  uint32_t path_offset;
+};
+
+// Build ids are hashes already, so their first bytes select buckets well.
+static uint32_t GetBuildIdBucket(const BuildId& build_id, uint32_t bucket_count) {
+  uint32_t value;
+  memcpy(&value, build_id.Data(), sizeof(value));
+  return value & (bucket_count - 1);
+}
+
+static void CollectElfFiles(const std::string& dir, const std::string& relative_dir,
+                            std::vector<std::pair<BuildId, std::string>>* files) {
+  std::vector<std::string> filenames;
+  std::vector<std::string> subdirs;
+  GetEntriesInDir(dir + relative_dir, &filenames, &subdirs);
+  std::sort(filenames.begin(), filenames.end());
+  std::sort(subdirs.begin(), subdirs.end());
+  for (auto& name : filenames) {
+    std::string path = relative_dir + name;
+    BuildId build_id;
+    if (path != BuildIdIndex::FILENAME && IsValidElfPath(dir + path) &&
+        GetBuildIdFromElfFile(dir + path, &build_id) && !build_id.IsEmpty()) {
+      files->push_back(std::make_pair(build_id, path));
+    }
+  }
+  for (auto& name : subdirs) {
+    CollectElfFiles(dir, relative_dir + name + "/", files);
+  }
+}
+
+bool BuildIdIndex::Build(const std::string& dir, size_t* file_count) {
+  std::string dirname = dir;
+  if (dirname.empty() || dirname.back() != '/') {
+    dirname.push_back('/');
+  }
+  std::vector<std::pair<BuildId, std::string>> files;
+  CollectElfFiles(dirname, "", &files);
+
+  BuildIdIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUILD_ID_INDEX_MAGIC, sizeof(BUILD_ID_INDEX_MAGIC));
+  header.version = BUILD_ID_INDEX_VERSION;
+  // Keep the table at most half full, so lookups probe few buckets.
+  header.bucket_count = 1;
+  while (header.bucket_count < files.size() * 2) {
+    header.bucket_count <<= 1;
+  }
+  std::vector<Entry> entries(header.bucket_count);
+  memset(entries.data(), 0, entries.size() * sizeof(Entry));
+  std::string string_table(1, '\0');
+  *file_count = 0;
+  for (auto& file : files) {
+    uint32_t bucket = GetBuildIdBucket(file.first, header.bucket_count);
+    bool duplicated = false;
+    while (entries[bucket].path_offset != 0) {
+      if (memcmp(entries[bucket].build_id, file.first.Data(), BUILD_ID_SIZE) == 0) {
+        duplicated = true;
+        break;
+      }
+      bucket = (bucket + 1) & (header.bucket_count - 1);
+    }
+    if (duplicated) {
+      LOG(DEBUG) << "skip " << file.second << ", which has the build id of "
+                 << (string_table.c_str() + entries[bucket].path_offset);
+      continue;
+    }
+    memcpy(entries[bucket].build_id, file.first.Data(), BUILD_ID_SIZE);
+    entries[bucket].path_offset = string_table.size();
+    string_table.append(file.second);
+    string_table.push_back('\0');
+    (*file_count)++;
+  }
+  header.string_table_size = string_table.size();
+  std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+  content.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+  content.append(string_table);
+
+  // Write to a temporary file first, so reports running at the same time never see a partial
+  // index.
+  std::string path = dirname + FILENAME;
+  std::string tmp_path = path + android::base::StringPrintf(".%d", getpid());
+  if (!android::base::WriteStringToFile(content, tmp_path) ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "failed to write build id index " << path;
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<BuildIdIndex> BuildIdIndex::Open(const std::string& dir) {
+  std::string path = dir + (dir.empty() || dir.back() != '/' ? "/" : "") + FILENAME;
+  if (!IsRegularFile(path)) {
+    return nullptr;
+  }
+  std::unique_ptr<MappedFile> file = MappedFile::Create(path);
+  if (file == nullptr) {
+    return nullptr;
+  }
+  size_t size = file->size();
+  const BuildIdIndexHeader* header = reinterpret_cast<const BuildIdIndexHeader*>(file->data());
+  if (size < sizeof(BuildIdIndexHeader) ||
+      memcmp(header->magic, BUILD_ID_INDEX_MAGIC, sizeof(BUILD_ID_INDEX_MAGIC)) != 0 ||
+      header->version != BUILD_ID_INDEX_VERSION || header->bucket_count == 0 ||
+      (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+      header->bucket_count > (size - sizeof(BuildIdIndexHeader)) / sizeof(Entry) ||
+      header->string_table_size !=
+          size - sizeof(BuildIdIndexHeader) - header->bucket_count * sizeof(Entry) ||
+      header->string_table_size == 0 || file->data()[size - 1] != '\0') {
+    LOG(WARNING) << "invalid build id index " << path;
+    return nullptr;
+  }
+  const Entry* entries = reinterpret_cast<const Entry*>(header + 1);
+  for (uint32_t i = 0; i < header->bucket_count; ++i) {
+    if (entries[i].path_offset >= header->string_table_size) {
+      LOG(WARNING) << "invalid build id index " << path;
+      return nullptr;
+    }
+  }
+  LOG(DEBUG) << "use build id index " << path;
+  return std::unique_ptr<BuildIdIndex>(new BuildIdIndex(std::move(file)));
+}
+
+BuildIdIndex::BuildIdIndex(std::unique_ptr<MappedFile> file) : file_(std::move(file)) {
+  const BuildIdIndexHeader* header = reinterpret_cast<const BuildIdIndexHeader*>(file_->data());
+  entries_ = reinterpret_cast<const Entry*>(header + 1);
+  bucket_count_ = header->bucket_count;
+  string_table_ = reinterpret_cast<const char*>(entries_ + bucket_count_);
+}
+
+BuildIdIndex::~BuildIdIndex() {
+}
+
+const char* BuildIdIndex::FindPath(const BuildId& build_id) const {
+  uint32_t bucket = GetBuildIdBucket(build_id, bucket_count_);
+  for (uint32_t i = 0; i < bucket_count_ && entries_[bucket].path_offset != 0; ++i) {
+    if (memcmp(entries_[bucket].build_id, build_id.Data(), BUILD_ID_SIZE) == 0) {
+      return string_table_ + entries_[bucket].path_offset;
+    }
+    bucket = (bucket + 1) & (bucket_count_ - 1);
+  }
+  return nullptr;
+}
@@ -17,11 +17,17 @@
 #ifndef SIMPLE_PERF_DSO_H_
 #define SIMPLE_PERF_DSO_H_
 
+#include <stdint.h>
+
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <android-base/macros.h>
+
 #include "build_id.h"
 
 struct Symbol {
@@ -29,25 +35,103 @@ struct Symbol {
   uint64_t len;
 
   Symbol(const std::string& name, uint64_t addr, uint64_t len);
+  Symbol(const Symbol& symbol);
+  Symbol& operator=(const Symbol& symbol);
+
   const char* Name() const {
     return name_;
   }
 
+  // It is thread-safe, as report can look up symbols on more than one thread.
   const char* DemangledName() const;
 
  private:
+  friend struct Dso;
+
+  // Used by Dso to refer to a name in a mapped symbol cache file, instead of copying it.
+  struct NameInSymbolCache {};
+  Symbol(NameInSymbolCache, const char* name, uint64_t addr, uint64_t len);
+
   const char* name_;
-  mutable const char* demangled_name_;
+  mutable std::atomic<const char*> demangled_name_;
 };
 
 enum DsoType {
   DSO_KERNEL,
   DSO_KERNEL_MODULE,
   DSO_ELF_FILE,
+  // Symbols of JIT code in a process, listed by the JIT compiler in /tmp/perf-<pid>.map as
+  // lines of "<start> <size> <name>" with absolute hex addresses.
+  DSO_PERF_MAP,
+};
+
+// A source line of code in a dso. If the code is inlined into another function, inlined_call
+// refers to the call it is inlined into, whose call site is found by Dso::FindInlinedCallSite().
+struct SourceLine {
+  static const uint32_t NOT_INLINED = UINT32_MAX;
+
+  const char* file;
+  uint32_t line;
+  uint32_t inlined_call;
 };
 
 struct KernelSymbol;
 struct ElfFileSymbol;
+class MappedFile;
+struct SourceLineTable;
+
+// An index file in a symfs directory mapping build ids to elf files in the directory, written
+// by the build-index command. It is a hash table used in place from the mapped file, so finding
+// the file of a dso in a big directory neither scans the directory nor reads elf files.
+class BuildIdIndex {
+ public:
+  static const char FILENAME[];
+
+  // Index elf files having build ids under dir, and write the index to dir/FILENAME.
+  static bool Build(const std::string& dir, size_t* file_count);
+  // Return nullptr if dir has no valid index.
+  static std::unique_ptr<BuildIdIndex> Open(const std::string& dir);
+
+  ~BuildIdIndex();
+
+  // Return the path of the file with build_id relative to the directory, or nullptr.
+  const char* FindPath(const BuildId& build_id) const;
+
+ private:
+  struct Entry;
+
+  explicit BuildIdIndex(std::unique_ptr<MappedFile> file);
+
+  std::unique_ptr<MappedFile> file_;
+  const Entry* entries_;
+  uint32_t bucket_count_;
+  const char* string_table_;
+
+  DISALLOW_COPY_AND_ASSIGN(BuildIdIndex);
+};
+
+// Where to find the files of dsos recorded in one perf.data, and the build ids they are
+// expected to have. Dsos use a default context changed by Dso::SetSymFsDir() and
+// Dso::SetBuildIds(), unless they are created with their own context, like when the diff
+// command reads two perf.data at the same time.
+struct DsoContext {
+  bool SetSymFsDir(const std::string& symfs_dir);
+  void SetBuildIds(const std::vector<std::pair<std::string, BuildId>>& build_ids);
+  BuildId GetExpectedBuildId(const std::string& filename) const;
+  // The kernel dso maps its symbols from [offset, offset + size) of filename, a symbol table
+  // written by Dso::SymbolTableToBinary() and embedded in perf.data, instead of reading
+  // /proc/kallsyms of the machine running the report.
+  void SetKernelSymbolTable(const std::string& filename, uint64_t offset, uint64_t size);
+
+  std::string symfs_dir;
+  // The index of symfs_dir, if it has one. Dsos with expected build ids in the index use the
+  // indexed files instead of the files at their recorded paths.
+  std::shared_ptr<BuildIdIndex> build_id_index;
+  std::unordered_map<std::string, BuildId> build_id_map;
+  std::string kernel_symbol_table_file;
+  uint64_t kernel_symbol_table_offset = 0;
+  uint64_t kernel_symbol_table_size = 0;
+};
 
 struct Dso {
  public:
@@ -56,52 +140,123 @@ struct Dso {
   static bool SetSymFsDir(const std::string& symfs_dir);
   static void SetVmlinux(const std::string& vmlinux);
   static void SetBuildIds(const std::vector<std::pair<std::string, BuildId>>& build_ids);
+  // Store symbols of dsos with known build ids in symbol_cache_dir, and load them from there
+  // instead of parsing elf files again in later runs. Symbols of the running kernel are stored
+  // there too, keyed by its build id and the boot id, as kernel addresses change each boot.
+  static void SetSymbolCacheDir(const std::string& symbol_cache_dir);
+  // Return the file in symbol_cache_dir holding the symbols of the dso with build_id.
+  static std::string GetSymbolCachePath(const BuildId& build_id);
 
-  static std::unique_ptr<Dso> CreateDso(DsoType dso_type, const std::string& dso_path = "");
+  // If context is nullptr, the default context is used. Otherwise it should outlive the dso.
+  static std::unique_ptr<Dso> CreateDso(DsoType dso_type, const std::string& dso_path = "",
+                                        const DsoContext* context = nullptr);
 
   ~Dso();
 
+  DsoType type() const {
+    return type_;
+  }
+
   // Return the path recorded in perf.data.
   const std::string& Path() const {
     return path_;
   }
 
-  // Return the accessible path. It may be the same as Path(), or
-  // return the path with prefix set by SetSymFsDir().
+  // Return the accessible path. It may be the same as Path(), return the path with prefix set
+  // by SetSymFsDir(), or the file with the expected build id in the index of the symfs dir.
   std::string GetAccessiblePath() const;
 
   // Return the minimum virtual address in program header.
   uint64_t MinVirtualAddress();
 
+  // MinVirtualAddress() and FindSymbol() load the dso lazily on first use, and can
+  // be called from more than one thread.
   const Symbol* FindSymbol(uint64_t vaddr_in_dso);
 
+  // Find the source line of the code at vaddr_in_dso in the DWARF line table of the dso. The
+  // table is parsed into a compact form on first use, which is stored next to the symbols of the
+  // dso in symbol_cache_dir. It can be called from more than one thread. Return false if the
+  // line isn't known.
+  bool FindSourceLine(uint64_t vaddr_in_dso, SourceLine* line);
+  // Find the call site of an inlined_call returned by FindSourceLine() or this function.
+  bool FindInlinedCallSite(uint32_t inlined_call, SourceLine* line);
+
+  // Load the dso now instead of on first use, to prefetch it on another thread.
+  void Preload();
+
+  // For DSO_PERF_MAP, add symbols of lines appended to the perf map file since it was last
+  // read, and return true if any are found. Symbols found before stay valid, as samples keep
+  // pointers to them. It shouldn't be called while other threads look up symbols.
+  bool UpdatePerfMap();
+
+  // Return the loaded symbols as a symbol table of sorted symbols followed by their names, the
+  // format of symbol cache files, which can be used without parsing or sorting. Return false if
+  // the dso has no symbols.
+  bool SymbolTableToBinary(std::string* data);
+
+  // For testing only. Use symbols instead of loading them from the dso.
+  void SetSymbolsForTesting(const std::vector<Symbol>& symbols);
+
  private:
-  static BuildId GetExpectedBuildId(const std::string& filename);
   static bool KernelSymbolCallback(const KernelSymbol& kernel_symbol, Dso* dso);
   static void VmlinuxSymbolCallback(const ElfFileSymbol& elf_symbol, Dso* dso);
   static void ElfFileSymbolCallback(const ElfFileSymbol& elf_symbol, Dso* dso,
                                     bool (*filter)(const ElfFileSymbol&));
 
   static bool demangle_;
-  static std::string symfs_dir_;
+  static DsoContext default_context_;
   static std::string vmlinux_;
-  static std::unordered_map<std::string, BuildId> build_id_map_;
-  static size_t dso_count_;
+  static std::string symbol_cache_dir_;
+  // Dsos can be created on more than one thread, like by the diff command.
+  static std::atomic<size_t> dso_count_;
 
-  Dso(DsoType type, const std::string& path);
+  Dso(DsoType type, const std::string& path, const DsoContext* context);
+  BuildId GetExpectedBuildId(const std::string& filename) const {
+    return context_->GetExpectedBuildId(filename);
+  }
+  void LoadOnce();
   bool Load();
   bool LoadKernel();
   bool LoadKernelModule();
   bool LoadElfFile();
   bool LoadEmbeddedElfFile();
+  bool LoadPerfMap();
+  size_t ReadPerfMapSymbols(std::vector<Symbol>* symbols);
   void InsertSymbol(const Symbol& symbol);
   void FixupSymbolLength();
+  void BuildSymbolDirectory();
+  bool LoadKernelSymbolTable();
+  std::string GetKernelSymbolCachePath(BuildId* build_id) const;
+  bool LoadSymbolTable(std::unique_ptr<MappedFile> file, const BuildId& build_id,
+                       const std::string& source);
+  bool LoadSymbolCache(const std::string& path, const BuildId& build_id);
+  std::string SymbolTableToBinary(const BuildId& build_id) const;
+  void SaveSymbolCache(const std::string& path, const BuildId& build_id) const;
+  bool LoadSourceLines();
 
   const DsoType type_;
   const std::string path_;
+  const DsoContext* context_;
   uint64_t min_vaddr_;
+  std::once_flag min_vaddr_once_;
   std::vector<Symbol> symbols_;
-  bool is_loaded_;
+  // symbol_directory_ splits the address range of symbols_ into buckets of
+  // (1 << symbol_directory_shift_) bytes. symbol_directory_[i] is the index of the first symbol
+  // starting at or after bucket i, so FindSymbol() only searches symbols of one bucket.
+  uint64_t symbol_directory_base_;
+  uint32_t symbol_directory_shift_;
+  std::vector<uint32_t> symbol_directory_;
+  std::once_flag load_once_;
+  // Keeps symbol names alive when symbols_ are loaded from a symbol cache file.
+  std::unique_ptr<MappedFile> symbol_cache_file_;
+  // For DSO_PERF_MAP, the size of the perf map file read, and symbol arrays replaced by
+  // UpdatePerfMap() but still referred to by samples.
+  uint64_t perf_map_read_size_;
+  std::vector<std::vector<Symbol>> replaced_symbols_;
+  std::once_flag source_lines_once_;
+  std::unique_ptr<SourceLineTable> source_lines_;
+
+  DISALLOW_COPY_AND_ASSIGN(Dso);
 };
 
 #endif  // SIMPLE_PERF_DSO_H_
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark_api.h>
+
+#include <algorithm>
+#include <random>
+
+#include "dso.h"
+
+// Symbols laid out like a big shared library: symbol_count functions of random sizes.
+static std::vector<Symbol> CreateSymbols(size_t symbol_count) {
+  std::mt19937_64 random(0);
+  std::vector<Symbol> symbols;
+  uint64_t addr = 0x10000;
+  for (size_t i = 0; i < symbol_count; ++i) {
+    uint64_t len = 16 + random() % 512;
+    symbols.push_back(Symbol("symbol", addr, len));
+    addr += len;
+  }
+  return symbols;
+}
+
+static std::vector<uint64_t> CreateLookupAddrs(const std::vector<Symbol>& symbols) {
+  std::mt19937_64 random(1);
+  uint64_t start = symbols.front().addr;
+  uint64_t end = symbols.back().addr + symbols.back().len;
+  std::vector<uint64_t> addrs(4096);
+  for (auto& addr : addrs) {
+    addr = start + random() % (end - start);
+  }
+  return addrs;
+}
+
+// Keeps the compiler from dropping lookups whose results are unused.
+volatile uint64_t symbol_addr_sum;
+
+static bool CompareAddrToSymbol(uint64_t addr, const Symbol& symbol) {
+  return addr < symbol.addr;
+}
+
+// The lookup used by Dso::FindSymbol() before the symbol directory was added.
+static void BM_find_symbol_binary_search(benchmark::State& state) {
+  std::vector<Symbol> symbols = CreateSymbols(state.range_x());
+  std::vector<uint64_t> addrs = CreateLookupAddrs(symbols);
+  size_t i = 0;
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    uint64_t addr = addrs[i++ % addrs.size()];
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), addr, CompareAddrToSymbol);
+    sum += (--it)->addr;
+  }
+  symbol_addr_sum = sum;
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_find_symbol_binary_search)->Arg(1000)->Arg(100000)->Arg(1000000);
+
+static void BM_find_symbol_in_dso(benchmark::State& state) {
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_ELF_FILE, "benchmark_dso");
+  std::vector<Symbol> symbols = CreateSymbols(state.range_x());
+  dso->SetSymbolsForTesting(symbols);
+  std::vector<uint64_t> addrs = CreateLookupAddrs(symbols);
+  size_t i = 0;
+  uint64_t sum = 0;
+  while (state.KeepRunning()) {
+    sum += dso->FindSymbol(addrs[i++ % addrs.size()])->addr;
+  }
+  symbol_addr_sum = sum;
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_find_symbol_in_dso)->Arg(1000)->Arg(100000)->Arg(1000000);
+
+BENCHMARK_MAIN()
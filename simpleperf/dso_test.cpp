@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <random>
+#include <set>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+
+#include "dso.h"
+#include "get_test_data.h"
+#include "utils.h"
+
+// Find the last symbol starting at or before vaddr, and check if it contains vaddr.
+static const Symbol* FindSymbolByScan(const std::vector<Symbol>& symbols, uint64_t vaddr) {
+  const Symbol* result = nullptr;
+  for (auto& symbol : symbols) {
+    if (symbol.addr <= vaddr) {
+      result = &symbol;
+    }
+  }
+  if (result != nullptr && result->addr + result->len > vaddr) {
+    return result;
+  }
+  return nullptr;
+}
+
+static void CheckFindSymbol(uint64_t addr_range, size_t symbol_count, uint64_t max_len) {
+  std::mt19937_64 random(symbol_count);
+  std::set<uint64_t> addrs;
+  while (addrs.size() < symbol_count) {
+    addrs.insert(0x1000 + random() % addr_range);
+  }
+  std::vector<Symbol> symbols;
+  for (auto addr : addrs) {
+    symbols.push_back(Symbol("symbol", addr, random() % max_len));
+  }
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_ELF_FILE, "test_dso");
+  dso->SetSymbolsForTesting(symbols);
+
+  // Symbols with len 0 are extended to the next symbol, like Dso::Load() does.
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    if (symbols[i].len == 0) {
+      symbols[i].len = (i + 1 < symbols.size() ? symbols[i + 1].addr : ULLONG_MAX) -
+                       symbols[i].addr;
+    }
+  }
+  for (size_t i = 0; i < 2000; ++i) {
+    uint64_t vaddr = random() % (addr_range + 0x2000);
+    const Symbol* expected = FindSymbolByScan(symbols, vaddr);
+    const Symbol* actual = dso->FindSymbol(vaddr);
+    if (expected == nullptr) {
+      ASSERT_TRUE(actual == nullptr) << "vaddr 0x" << std::hex << vaddr;
+    } else {
+      ASSERT_TRUE(actual != nullptr) << "vaddr 0x" << std::hex << vaddr;
+      ASSERT_EQ(expected->addr, actual->addr) << "vaddr 0x" << std::hex << vaddr;
+    }
+  }
+}
+
+TEST(dso, find_symbol_with_few_symbols) {
+  CheckFindSymbol(0x10000, 100, 0x100);
+}
+
+TEST(dso, find_symbol_with_symbol_directory) {
+  CheckFindSymbol(0x100000, 5000, 0x100);
+  CheckFindSymbol(0x100000, 5000, 0x10);
+  // Symbols spread over a large address range use large buckets.
+  CheckFindSymbol(1ULL << 40, 5000, 0x1000);
+}
+
+TEST(dso, kernel_symbol_table_in_file) {
+  DsoContext context;
+  std::unique_ptr<Dso> kernel = Dso::CreateDso(DSO_KERNEL, "", &context);
+  kernel->SetSymbolsForTesting({Symbol("schedule", 0x1000, 0x100),
+                                Symbol("do_sys_open", 0x2000, 0x80)});
+  std::string table;
+  ASSERT_TRUE(kernel->SymbolTableToBinary(&table));
+
+  // The table may not start at a page or 8-byte aligned offset in the file holding it.
+  TemporaryFile tmpfile;
+  std::string content = std::string(13, '\0') + table;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, tmpfile.path));
+  context.SetKernelSymbolTable(tmpfile.path, 13, table.size());
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_KERNEL, "", &context);
+  const Symbol* symbol = dso->FindSymbol(0x2010);
+  ASSERT_TRUE(symbol != nullptr);
+  ASSERT_STREQ("do_sys_open", symbol->Name());
+  ASSERT_TRUE(dso->FindSymbol(0x1100) == nullptr);
+}
+
+TEST(dso, perf_map) {
+  TemporaryFile tmpfile;
+  // The second line replaces JIT code collected from the same address, the third line isn't
+  // a symbol, and the last line isn't complete yet.
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "1000 100 void Foo.run()\n1000 80 int Foo.get()\nnot a symbol\n2000 40 void Bar.",
+      tmpfile.path));
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_PERF_MAP, tmpfile.path);
+  const Symbol* symbol = dso->FindSymbol(0x1010);
+  ASSERT_TRUE(symbol != nullptr);
+  ASSERT_STREQ("int Foo.get()", symbol->Name());
+  ASSERT_TRUE(dso->FindSymbol(0x10a0) == nullptr);
+  ASSERT_TRUE(dso->FindSymbol(0x2010) == nullptr);
+
+  // Symbols appended later are found after UpdatePerfMap(), and old symbols stay valid.
+  ASSERT_FALSE(dso->UpdatePerfMap());
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "1000 100 void Foo.run()\n1000 80 int Foo.get()\nnot a symbol\n2000 40 void Bar.run()\n",
+      tmpfile.path));
+  ASSERT_TRUE(dso->UpdatePerfMap());
+  ASSERT_STREQ("int Foo.get()", symbol->Name());
+  const Symbol* new_symbol = dso->FindSymbol(0x2010);
+  ASSERT_TRUE(new_symbol != nullptr);
+  ASSERT_STREQ("void Bar.run()", new_symbol->Name());
+}
+
+TEST(dso, build_id_index) {
+  TemporaryDir symfs_dir;
+  std::string subdir = std::string(symfs_dir.path) + "/symbols";
+  ASSERT_EQ(0, mkdir(subdir.c_str(), 0755));
+  std::string elf;
+  ASSERT_TRUE(android::base::ReadFileToString(GetTestData(ELF_FILE), &elf));
+  ASSERT_TRUE(android::base::WriteStringToFile(elf, subdir + "/libfoo.so"));
+  ASSERT_TRUE(android::base::WriteStringToFile("not elf", subdir + "/README"));
+  size_t file_count;
+  ASSERT_TRUE(BuildIdIndex::Build(symfs_dir.path, &file_count));
+  ASSERT_EQ(1u, file_count);
+
+  std::unique_ptr<BuildIdIndex> index = BuildIdIndex::Open(symfs_dir.path);
+  ASSERT_TRUE(index != nullptr);
+  ASSERT_STREQ("symbols/libfoo.so", index->FindPath(elf_file_build_id));
+  ASSERT_TRUE(index->FindPath(BuildId("0123456789")) == nullptr);
+
+  // A dso recorded at another path finds the file by its build id.
+  DsoContext context;
+  ASSERT_TRUE(context.SetSymFsDir(symfs_dir.path));
+  context.SetBuildIds({std::make_pair("/system/lib/libfoo.so", elf_file_build_id)});
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_ELF_FILE, "/system/lib/libfoo.so", &context);
+  ASSERT_EQ(subdir + "/libfoo.so", dso->GetAccessiblePath());
+
+  unlink((subdir + "/libfoo.so").c_str());
+  unlink((subdir + "/README").c_str());
+  rmdir(subdir.c_str());
+  unlink((std::string(symfs_dir.path) + "/" + BuildIdIndex::FILENAME).c_str());
+}
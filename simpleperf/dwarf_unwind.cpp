@@ -94,8 +94,34 @@ static ucontext_t BuildUContextFromRegs(const RegSet& regs __attribute__((unused
   return ucontext;
 }
 
-std::vector<uint64_t> UnwindCallChain(ArchType arch, const ThreadEntry& thread,
-                                      const RegSet& regs, const std::vector<char>& stack) {
+OfflineUnwinder::OfflineUnwinder() {
+}
+
+OfflineUnwinder::~OfflineUnwinder() {
+}
+
+BacktraceMap* OfflineUnwinder::GetBacktraceMap(const ThreadEntry& thread) {
+  CachedMap& cached_map = map_cache_[thread.tid];
+  if (cached_map.map != nullptr && cached_map.maps_version == thread.maps_version) {
+    return cached_map.map.get();
+  }
+  std::vector<backtrace_map_t> bt_maps(thread.maps.size());
+  size_t map_index = 0;
+  for (auto& map : thread.maps) {
+    backtrace_map_t& bt_map = bt_maps[map_index++];
+    bt_map.start = map->start_addr;
+    bt_map.end = map->start_addr + map->len;
+    bt_map.offset = map->pgoff;
+    bt_map.name = map->dso->GetAccessiblePath();
+  }
+  cached_map.map.reset(BacktraceMap::Create(thread.pid, bt_maps));
+  cached_map.maps_version = thread.maps_version;
+  return cached_map.map.get();
+}
+
+std::vector<uint64_t> OfflineUnwinder::UnwindCallChain(ArchType arch, const ThreadEntry& thread,
+                                                       const RegSet& regs,
+                                                       const std::vector<char>& stack) {
   std::vector<uint64_t> result;
   if (arch != GetBuildArch()) {
     LOG(ERROR) << "can't unwind data recorded on a different architecture";
@@ -108,16 +134,7 @@ std::vector<uint64_t> UnwindCallChain(ArchType arch, const ThreadEntry& thread,
   }
   uint64_t stack_addr = sp_reg_value;
 
-  std::vector<backtrace_map_t> bt_maps(thread.maps.size());
-  size_t map_index = 0;
-  for (auto& map : thread.maps) {
-    backtrace_map_t& bt_map = bt_maps[map_index++];
-    bt_map.start = map->start_addr;
-    bt_map.end = map->start_addr + map->len;
-    bt_map.offset = map->pgoff;
-    bt_map.name = map->dso->GetAccessiblePath();
-  }
-  std::unique_ptr<BacktraceMap> backtrace_map(BacktraceMap::Create(thread.pid, bt_maps));
+  BacktraceMap* backtrace_map = GetBacktraceMap(thread);
 
   backtrace_stackinfo_t stack_info;
   stack_info.start = stack_addr;
@@ -125,7 +142,7 @@ std::vector<uint64_t> UnwindCallChain(ArchType arch, const ThreadEntry& thread,
   stack_info.data = reinterpret_cast<const uint8_t*>(stack.data());
 
   std::unique_ptr<Backtrace> backtrace(
-      Backtrace::CreateOffline(thread.pid, thread.tid, backtrace_map.get(), stack_info, true));
+      Backtrace::CreateOffline(thread.pid, thread.tid, backtrace_map, stack_info, true));
   ucontext_t ucontext = BuildUContextFromRegs(regs);
   if (backtrace->Unwind(0, &ucontext)) {
     for (auto it = backtrace->begin(); it != backtrace->end(); ++it) {
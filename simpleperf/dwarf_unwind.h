@@ -17,8 +17,12 @@
 #ifndef SIMPLE_PERF_DWARF_UNWIND_H_
 #define SIMPLE_PERF_DWARF_UNWIND_H_
 
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
+#include <android-base/macros.h>
+
 #include "perf_regs.h"
 
 namespace simpleperf {
@@ -27,7 +31,29 @@ struct ThreadEntry;
 
 using ThreadEntry = simpleperf::ThreadEntry;
 
-std::vector<uint64_t> UnwindCallChain(ArchType arch, const ThreadEntry& thread, const RegSet& regs,
-                                      const std::vector<char>& stack);
+class BacktraceMap;
+
+// OfflineUnwinder unwinds user stacks recorded in samples. Building a BacktraceMap from all maps
+// of a thread is expensive, so it keeps the map built for each thread until the maps of the
+// thread change. Unwind tables parsed from each file are kept by libbacktrace.
+class OfflineUnwinder {
+ public:
+  OfflineUnwinder();
+  ~OfflineUnwinder();
+
+  std::vector<uint64_t> UnwindCallChain(ArchType arch, const ThreadEntry& thread,
+                                        const RegSet& regs, const std::vector<char>& stack);
+
+ private:
+  BacktraceMap* GetBacktraceMap(const ThreadEntry& thread);
+
+  struct CachedMap {
+    uint64_t maps_version;
+    std::unique_ptr<BacktraceMap> map;
+  };
+  std::unordered_map<int, CachedMap> map_cache_;  // Indexed by tid.
+
+  DISALLOW_COPY_AND_ASSIGN(OfflineUnwinder);
+};
 
 #endif  // SIMPLE_PERF_DWARF_UNWIND_H_
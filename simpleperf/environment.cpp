@@ -17,8 +17,11 @@
 #include "environment.h"
 
 #include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <limits>
 #include <set>
@@ -35,7 +38,9 @@
 #include <sys/system_properties.h>
 #endif
 
+#include "read_apk.h"
 #include "read_elf.h"
+#include "record.h"
 #include "utils.h"
 
 class LineReader {
@@ -250,30 +255,6 @@ void GetKernelAndModuleMmaps(KernelMmap* kernel_mmap, std::vector<KernelMmap>* m
   }
 }
 
-static bool ReadThreadNameAndTgid(const std::string& status_file, std::string* comm, pid_t* tgid) {
-  FILE* fp = fopen(status_file.c_str(), "re");
-  if (fp == nullptr) {
-    return false;
-  }
-  bool read_comm = false;
-  bool read_tgid = false;
-  LineReader reader(fp);
-  char* line;
-  while ((line = reader.ReadLine()) != nullptr) {
-    char s[reader.MaxLineSize()];
-    if (sscanf(line, "Name:%s", s) == 1) {
-      *comm = s;
-      read_comm = true;
-    } else if (sscanf(line, "Tgid:%d", tgid) == 1) {
-      read_tgid = true;
-    }
-    if (read_comm && read_tgid) {
-      return true;
-    }
-  }
-  return false;
-}
-
 static std::vector<pid_t> GetThreadsInProcess(pid_t pid) {
   std::vector<pid_t> result;
   std::string task_dirname = android::base::StringPrintf("/proc/%d/task", pid);
@@ -289,73 +270,132 @@ static std::vector<pid_t> GetThreadsInProcess(pid_t pid) {
   return result;
 }
 
-static bool GetThreadComm(pid_t pid, std::vector<ThreadComm>* thread_comms) {
+std::vector<pid_t> GetAllProcesses() {
+  std::vector<pid_t> result;
+  std::vector<std::string> subdirs;
+  GetEntriesInDir("/proc", nullptr, &subdirs);
+  for (const auto& name : subdirs) {
+    int pid;
+    if (android::base::ParseInt(name.c_str(), &pid, 0)) {
+      result.push_back(pid);
+    }
+  }
+  return result;
+}
+
+bool GetThreadCommsInProcess(pid_t pid, std::vector<ThreadComm>* thread_comms) {
+  size_t old_size = thread_comms->size();
   std::vector<pid_t> tids = GetThreadsInProcess(pid);
   for (auto& tid : tids) {
-    std::string status_file = android::base::StringPrintf("/proc/%d/task/%d/status", pid, tid);
+    // Read the comm file instead of the status file, which is much slower for the kernel to
+    // generate. It is possible that the thread exited before we can read it.
+    std::string comm_file = android::base::StringPrintf("/proc/%d/task/%d/comm", pid, tid);
     std::string comm;
-    pid_t tgid;
-    // It is possible that the process or thread exited before we can read its status.
-    if (!ReadThreadNameAndTgid(status_file, &comm, &tgid)) {
+    if (!android::base::ReadFileToString(comm_file, &comm)) {
       continue;
     }
-    CHECK_EQ(pid, tgid);
+    if (!comm.empty() && comm.back() == '\n') {
+      comm.pop_back();
+    }
     ThreadComm thread;
     thread.tid = tid;
     thread.pid = pid;
     thread.comm = comm;
     thread_comms->push_back(thread);
   }
-  return true;
+  return thread_comms->size() != old_size;
 }
 
 bool GetThreadComms(std::vector<ThreadComm>* thread_comms) {
   thread_comms->clear();
-  std::vector<std::string> subdirs;
-  GetEntriesInDir("/proc", nullptr, &subdirs);
-  for (auto& name : subdirs) {
-    int pid;
-    if (!android::base::ParseInt(name.c_str(), &pid, 0)) {
-      continue;
-    }
-    if (!GetThreadComm(pid, thread_comms)) {
-      return false;
-    }
+  for (auto& pid : GetAllProcesses()) {
+    GetThreadCommsInProcess(pid, thread_comms);
   }
   return true;
 }
 
-bool GetThreadMmapsInProcess(pid_t pid, std::vector<ThreadMmap>* thread_mmaps) {
-  std::string map_file = android::base::StringPrintf("/proc/%d/maps", pid);
-  FILE* fp = fopen(map_file.c_str(), "re");
-  if (fp == nullptr) {
-    PLOG(DEBUG) << "can't open file " << map_file;
+static bool ParseHex(const char** p, const char* end, uint64_t* value) {
+  const char* s = *p;
+  uint64_t result = 0;
+  for (; s != end; ++s) {
+    int digit;
+    if (*s >= '0' && *s <= '9') {
+      digit = *s - '0';
+    } else if (*s >= 'a' && *s <= 'f') {
+      digit = *s - 'a' + 10;
+    } else if (*s >= 'A' && *s <= 'F') {
+      digit = *s - 'A' + 10;
+    } else {
+      break;
+    }
+    result = (result << 4) | digit;
+  }
+  if (s == *p) {
     return false;
   }
-  thread_mmaps->clear();
-  LineReader reader(fp);
-  char* line;
-  while ((line = reader.ReadLine()) != nullptr) {
+  *p = s;
+  *value = result;
+  return true;
+}
+
+static const char* SkipField(const char* p, const char* end) {
+  while (p != end && *p != ' ' && *p != '\t') {
+    ++p;
+  }
+  while (p != end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+  return p;
+}
+
+void ParseThreadMmaps(const char* data, size_t size, std::vector<ThreadMmap>* thread_mmaps) {
+  const char* end = data + size;
+  for (const char* line = data; line < end;) {
+    const char* line_end = static_cast<const char*>(memchr(line, '\n', end - line));
+    if (line_end == nullptr) {
+      line_end = end;
+    }
     // Parse line like: 00400000-00409000 r-xp 00000000 fc:00 426998  /usr/lib/gvfs/gvfsd-http
+    const char* p = line;
     uint64_t start_addr, end_addr, pgoff;
-    char type[reader.MaxLineSize()];
-    char execname[reader.MaxLineSize()];
-    strcpy(execname, "");
-    if (sscanf(line, "%" PRIx64 "-%" PRIx64 " %s %" PRIx64 " %*x:%*x %*u %s\n", &start_addr,
-               &end_addr, type, &pgoff, execname) < 4) {
-      continue;
-    }
-    if (strcmp(execname, "") == 0) {
-      strcpy(execname, DEFAULT_EXECNAME_FOR_THREAD_MMAP);
+    if (ParseHex(&p, line_end, &start_addr) && p != line_end && *p++ == '-' &&
+        ParseHex(&p, line_end, &end_addr) && line_end - p >= 5 && *p == ' ') {
+      const char* type = p + 1;
+      p = SkipField(type, line_end);
+      if (ParseHex(&p, line_end, &pgoff)) {
+        // Skip device and inode. Like the sscanf("%s") used before, the name ends at the first
+        // whitespace, dropping suffixes like " (deleted)".
+        p = SkipField(SkipField(SkipField(p, line_end), line_end), line_end);
+        const char* name_end = p;
+        while (name_end != line_end && *name_end != ' ' && *name_end != '\t') {
+          ++name_end;
+        }
+        ThreadMmap thread;
+        thread.start_addr = start_addr;
+        thread.len = end_addr - start_addr;
+        thread.pgoff = pgoff;
+        if (name_end == p) {
+          thread.name = DEFAULT_EXECNAME_FOR_THREAD_MMAP;
+        } else {
+          thread.name.assign(p, name_end);
+        }
+        thread.executable = (type[2] == 'x');
+        thread_mmaps->push_back(thread);
+      }
     }
-    ThreadMmap thread;
-    thread.start_addr = start_addr;
-    thread.len = end_addr - start_addr;
-    thread.pgoff = pgoff;
-    thread.name = execname;
-    thread.executable = (type[2] == 'x');
-    thread_mmaps->push_back(thread);
+    line = line_end + 1;
+  }
+}
+
+bool GetThreadMmapsInProcess(pid_t pid, std::vector<ThreadMmap>* thread_mmaps) {
+  std::string map_file = android::base::StringPrintf("/proc/%d/maps", pid);
+  std::string data;
+  if (!android::base::ReadFileToString(map_file, &data)) {
+    PLOG(DEBUG) << "can't read file " << map_file;
+    return false;
   }
+  thread_mmaps->clear();
+  ParseThreadMmaps(data.data(), data.size(), thread_mmaps);
   return true;
 }
 
@@ -363,11 +403,68 @@ bool GetKernelBuildId(BuildId* build_id) {
   return GetBuildIdFromNoteFile("/sys/kernel/notes", build_id);
 }
 
+bool GetBootId(std::string* boot_id) {
+  std::string s;
+  if (!android::base::ReadFileToString("/proc/sys/kernel/random/boot_id", &s)) {
+    PLOG(DEBUG) << "failed to read /proc/sys/kernel/random/boot_id";
+    return false;
+  }
+  *boot_id = android::base::Trim(s);
+  return !boot_id->empty();
+}
+
 bool GetModuleBuildId(const std::string& module_name, BuildId* build_id) {
   std::string notefile = "/sys/module/" + module_name + "/notes/.note.gnu.build-id";
   return GetBuildIdFromNoteFile(notefile, build_id);
 }
 
+void GetBuildIdRecordsOfHitFiles(const std::set<std::string>& hit_kernel_modules,
+                                 const std::set<std::string>& hit_user_files,
+                                 std::vector<BuildIdRecord>* build_id_records) {
+  BuildId build_id;
+  // Add build_ids for kernel/modules.
+  for (const auto& filename : hit_kernel_modules) {
+    if (filename == DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID) {
+      if (!GetKernelBuildId(&build_id)) {
+        LOG(DEBUG) << "can't read build_id for kernel";
+        continue;
+      }
+      build_id_records->push_back(
+          CreateBuildIdRecord(true, UINT_MAX, build_id, DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID));
+    } else {
+      std::string path = filename;
+      std::string module_name = basename(&path[0]);
+      if (android::base::EndsWith(module_name, ".ko")) {
+        module_name = module_name.substr(0, module_name.size() - 3);
+      }
+      if (!GetModuleBuildId(module_name, &build_id)) {
+        LOG(DEBUG) << "can't read build_id for module " << module_name;
+        continue;
+      }
+      build_id_records->push_back(CreateBuildIdRecord(true, UINT_MAX, build_id, filename));
+    }
+  }
+  // Add build_ids for user elf files.
+  for (const auto& filename : hit_user_files) {
+    if (filename == DEFAULT_EXECNAME_FOR_THREAD_MMAP) {
+      continue;
+    }
+    auto tuple = SplitUrlInApk(filename);
+    if (std::get<0>(tuple)) {
+      if (!GetBuildIdFromApkFile(std::get<1>(tuple), std::get<2>(tuple), &build_id)) {
+        LOG(DEBUG) << "can't read build_id from file " << filename;
+        continue;
+      }
+    } else {
+      if (!GetBuildIdFromElfFile(filename, &build_id)) {
+        LOG(DEBUG) << "can't read build_id from file " << filename;
+        continue;
+      }
+    }
+    build_id_records->push_back(CreateBuildIdRecord(false, UINT_MAX, build_id, filename));
+  }
+}
+
 bool GetValidThreadsFromProcessString(const std::string& pid_str, std::set<pid_t>* tid_set) {
   std::vector<std::string> strs = android::base::Split(pid_str, ",");
   for (const auto& s : strs) {
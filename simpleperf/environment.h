@@ -46,6 +46,10 @@ struct ThreadComm {
 };
 
 bool GetThreadComms(std::vector<ThreadComm>* thread_comms);
+std::vector<pid_t> GetAllProcesses();
+// Append comms of threads in process pid. Return false if none can be read, like when the
+// process has exited.
+bool GetThreadCommsInProcess(pid_t pid, std::vector<ThreadComm>* thread_comms);
 
 constexpr char DEFAULT_EXECNAME_FOR_THREAD_MMAP[] = "//anon";
 
@@ -58,12 +62,24 @@ struct ThreadMmap {
 };
 
 bool GetThreadMmapsInProcess(pid_t pid, std::vector<ThreadMmap>* thread_mmaps);
+// Append maps parsed from data in the format of /proc/<pid>/maps.
+void ParseThreadMmaps(const char* data, size_t size, std::vector<ThreadMmap>* thread_mmaps);
 
 constexpr char DEFAULT_KERNEL_FILENAME_FOR_BUILD_ID[] = "[kernel.kallsyms]";
 
 bool GetKernelBuildId(BuildId* build_id);
+// Return an id of the current boot, which changes on every boot.
+bool GetBootId(std::string* boot_id);
 bool GetModuleBuildId(const std::string& module_name, BuildId* build_id);
 
+struct BuildIdRecord;
+
+// Get build ids of the kernel, kernel modules and elf files hit by samples, skipping files
+// whose build id can't be read.
+void GetBuildIdRecordsOfHitFiles(const std::set<std::string>& hit_kernel_modules,
+                                 const std::set<std::string>& hit_user_files,
+                                 std::vector<BuildIdRecord>* build_id_records);
+
 bool GetValidThreadsFromProcessString(const std::string& pid_str, std::set<pid_t>* tid_set);
 bool GetValidThreadsFromThreadString(const std::string& tid_str, std::set<pid_t>* tid_set);
 
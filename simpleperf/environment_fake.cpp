@@ -24,3 +24,7 @@ bool ProcessKernelSymbols(const std::string&, std::function<bool(const KernelSym
 bool GetKernelBuildId(BuildId*) {
   return false;
 }
+
+bool GetBootId(std::string*) {
+  return false;
+}
@@ -72,3 +72,24 @@ TEST(environment, ProcessKernelSymbols) {
   ASSERT_FALSE(ProcessKernelSymbols(
       tempfile.path, std::bind(&KernelSymbolsMatch, std::placeholders::_1, expected_symbol)));
 }
+
+TEST(environment, ParseThreadMmaps) {
+  std::string data =
+      "00400000-00409000 r-xp 00000000 fc:00 426998  /usr/lib/gvfs/gvfsd-http\n"
+      "7f0000001000-7f0000002000 rw-p 00001000 00:00 0 \n"
+      "7f0000003000-7f0000004000 r-xp 0000a000 fc:00 12 /data/app/base.apk (deleted)\n"
+      "invalid line\n"
+      "7f0000005000-7f0000006000 r-xp 00000000 00:00 0                  [vdso]";
+  std::vector<ThreadMmap> mmaps;
+  ParseThreadMmaps(data.data(), data.size(), &mmaps);
+  ASSERT_EQ(4u, mmaps.size());
+  ASSERT_EQ(0x400000u, mmaps[0].start_addr);
+  ASSERT_EQ(0x9000u, mmaps[0].len);
+  ASSERT_EQ("/usr/lib/gvfs/gvfsd-http", mmaps[0].name);
+  ASSERT_TRUE(mmaps[0].executable);
+  ASSERT_EQ(DEFAULT_EXECNAME_FOR_THREAD_MMAP, mmaps[1].name);
+  ASSERT_FALSE(mmaps[1].executable);
+  ASSERT_EQ(0xa000u, mmaps[2].pgoff);
+  ASSERT_EQ("/data/app/base.apk", mmaps[2].name);
+  ASSERT_EQ("[vdso]", mmaps[3].name);
+}
@@ -16,7 +16,9 @@
 
 #include "event_fd.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,13 +26,21 @@
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <algorithm>
 #include <atomic>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 
+#include "environment.h"
 #include "event_type.h"
 #include "perf_event.h"
 #include "utils.h"
@@ -43,14 +53,16 @@ static int perf_event_open(perf_event_attr* attr, pid_t pid, int cpu, int group_
 }
 
 std::unique_ptr<EventFd> EventFd::OpenEventFile(const perf_event_attr& attr, pid_t tid, int cpu,
-                                                bool report_error) {
+                                                bool report_error,
+                                                const EventFd* group_event_fd) {
   perf_event_attr perf_attr = attr;
   std::string event_name = "unknown event";
   const EventType* event_type = FindEventTypeByConfig(perf_attr.type, perf_attr.config);
   if (event_type != nullptr) {
     event_name = event_type->name;
   }
-  int perf_event_fd = perf_event_open(&perf_attr, tid, cpu, -1, 0);
+  int group_fd = (group_event_fd != nullptr) ? group_event_fd->perf_event_fd_ : -1;
+  int perf_event_fd = perf_event_open(&perf_attr, tid, cpu, group_fd, 0);
   if (perf_event_fd == -1) {
     if (report_error) {
       PLOG(ERROR) << "open perf_event_file (event " << event_name << ", tid " << tid << ", cpu "
@@ -71,7 +83,8 @@ std::unique_ptr<EventFd> EventFd::OpenEventFile(const perf_event_attr& attr, pid
     }
     return nullptr;
   }
-  return std::unique_ptr<EventFd>(new EventFd(perf_event_fd, event_name, tid, cpu));
+  bool read_group = (perf_attr.read_format & PERF_FORMAT_GROUP) != 0;
+  return std::unique_ptr<EventFd>(new EventFd(perf_event_fd, event_name, tid, cpu, read_group));
 }
 
 EventFd::~EventFd() {
@@ -98,6 +111,14 @@ uint64_t EventFd::Id() const {
 
 bool EventFd::ReadCounter(PerfCounter* counter) const {
   CHECK(counter != nullptr);
+  if (read_group_) {
+    std::vector<PerfCounter> counters;
+    if (!ReadGroupCounters(&counters)) {
+      return false;
+    }
+    *counter = counters[0];
+    return true;
+  }
   if (!android::base::ReadFully(perf_event_fd_, counter, sizeof(*counter))) {
     PLOG(ERROR) << "ReadCounter from " << Name() << " failed";
     return false;
@@ -105,6 +126,65 @@ bool EventFd::ReadCounter(PerfCounter* counter) const {
   return true;
 }
 
+bool EventFd::ReadGroupCounters(std::vector<PerfCounter>* counters) const {
+  CHECK(read_group_);
+  // With PERF_FORMAT_GROUP, the data read is:
+  //   struct { u64 nr; u64 time_enabled; u64 time_running; struct { u64 value; u64 id; } [nr]; }
+  // The group can't have more members than fds we can open, so size the buffer on demand.
+  if (group_read_buffer_.empty()) {
+    group_read_buffer_.resize(3 + 2 * 16);
+  }
+  while (true) {
+    ssize_t size = TEMP_FAILURE_RETRY(read(perf_event_fd_, group_read_buffer_.data(),
+                                           group_read_buffer_.size() * sizeof(uint64_t)));
+    if (size >= static_cast<ssize_t>(3 * sizeof(uint64_t))) {
+      break;
+    }
+    if (size == -1 && errno == ENOSPC) {
+      group_read_buffer_.resize(group_read_buffer_.size() * 2);
+      continue;
+    }
+    PLOG(ERROR) << "ReadGroupCounters from " << Name() << " failed";
+    return false;
+  }
+  const uint64_t* p = group_read_buffer_.data();
+  uint64_t nr = p[0];
+  CHECK_LE(3 + 2 * nr, group_read_buffer_.size());
+  counters->resize(nr);
+  for (uint64_t i = 0; i < nr; ++i) {
+    PerfCounter& counter = (*counters)[i];
+    counter.value = p[3 + 2 * i];
+    counter.time_enabled = p[1];
+    counter.time_running = p[2];
+    counter.id = p[3 + 2 * i + 1];
+  }
+  return true;
+}
+
+bool EventFd::EnableEvent() {
+  if (ioctl(perf_event_fd_, PERF_EVENT_IOC_ENABLE, 0) != 0) {
+    PLOG(ERROR) << "failed to enable " << Name();
+    return false;
+  }
+  return true;
+}
+
+bool EventFd::DisableEvent() {
+  if (ioctl(perf_event_fd_, PERF_EVENT_IOC_DISABLE, 0) != 0) {
+    PLOG(ERROR) << "failed to disable " << Name();
+    return false;
+  }
+  return true;
+}
+
+bool EventFd::SetSamplePeriodOrFreq(uint64_t value) {
+  if (ioctl(perf_event_fd_, PERF_EVENT_IOC_PERIOD, &value) != 0) {
+    PLOG(ERROR) << "failed to set sample period or frequency of " << Name() << " to " << value;
+    return false;
+  }
+  return true;
+}
+
 bool EventFd::MmapContent(size_t mmap_pages) {
   CHECK(IsPowerOfTwo(mmap_pages));
   size_t page_size = sysconf(_SC_PAGE_SIZE);
@@ -126,6 +206,16 @@ bool EventFd::MmapContent(size_t mmap_pages) {
 }
 
 size_t EventFd::GetAvailableMmapData(char** pdata) {
+  size_t read_bytes = CopyAvailableMmapData(&data_process_buffer_, 0);
+  *pdata = data_process_buffer_.data();
+  return read_bytes;
+}
+
+size_t EventFd::ReadAvailableMmapData(std::vector<char>* buffer) {
+  return CopyAvailableMmapData(buffer, buffer->size());
+}
+
+size_t EventFd::CopyAvailableMmapData(std::vector<char>* buffer, size_t offset) {
   // The mmap_data_buffer is used as a ring buffer like below. The kernel continuously writes
   // records to the buffer, and the user continuously read records out.
   //         _________________________________________
@@ -149,14 +239,18 @@ size_t EventFd::GetAvailableMmapData(char** pdata) {
   // Make sure we can see the data after the fence.
   std::atomic_thread_fence(std::memory_order_acquire);
 
-  // Copy records from mapped buffer to data_process_buffer. Note that records can be wrapped
-  // at the end of the mapped buffer.
-  char* to = data_process_buffer_.data();
+  size_t read_bytes = (write_head - read_head) & buf_mask;
+  if (buffer->size() < offset + read_bytes) {
+    buffer->resize(offset + read_bytes);
+  }
+
+  // Copy records from mapped buffer to the buffer. Note that records can be wrapped at the end
+  // of the mapped buffer.
+  char* to = buffer->data() + offset;
   if (read_head < write_head) {
     char* from = mmap_data_buffer_ + read_head;
     size_t n = write_head - read_head;
     memcpy(to, from, n);
-    to += n;
   } else {
     char* from = mmap_data_buffer_ + read_head;
     size_t n = mmap_data_buffer_size_ - read_head;
@@ -165,10 +259,7 @@ size_t EventFd::GetAvailableMmapData(char** pdata) {
     from = mmap_data_buffer_;
     n = write_head;
     memcpy(to, from, n);
-    to += n;
   }
-  size_t read_bytes = to - data_process_buffer_.data();
-  *pdata = data_process_buffer_.data();
   DiscardMmapData(read_bytes);
   return read_bytes;
 }
@@ -177,13 +268,208 @@ void EventFd::DiscardMmapData(size_t discard_size) {
   mmap_metadata_page_->data_tail += discard_size;
 }
 
+double EventFd::GetMmapBufferUsage() const {
+  if (mmap_addr_ == nullptr) {
+    return 0;
+  }
+  uint64_t data_head = mmap_metadata_page_->data_head;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t unread_bytes = data_head - mmap_metadata_page_->data_tail;
+  return static_cast<double>(unread_bytes) / mmap_data_buffer_size_;
+}
+
 void EventFd::PreparePollForMmapData(pollfd* poll_fd) {
   memset(poll_fd, 0, sizeof(pollfd));
   poll_fd->fd = perf_event_fd_;
   poll_fd->events = POLLIN;
 }
 
+// EventSupportCache keeps the results of probing event attrs. They are saved in a file per uid,
+// whose first line describes the state they were probed in. The file is ignored when the state
+// has changed: after a reboot or with another kernel, when cpus of another pmu were plugged in or
+// out, or when perf_event_paranoid changed.
+class EventSupportCache {
+ public:
+  static EventSupportCache& GetInstance() {
+    static EventSupportCache cache;
+    return cache;
+  }
+
+  bool Find(uint64_t key, bool* supported) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = results_.find(key);
+    if (it == results_.end()) {
+      return false;
+    }
+    *supported = it->second;
+    return true;
+  }
+
+  void Add(uint64_t key, bool supported) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    results_[key] = supported;
+  }
+
+  void Save();
+
+ private:
+  EventSupportCache();
+
+  std::mutex mutex_;
+  std::string path_;
+  std::string state_;
+  std::unordered_map<uint64_t, bool> results_;
+};
+
+static std::string GetProbeState() {
+  std::string boot_id;
+  utsname uname_buf;
+  if (!GetBootId(&boot_id) || TEMP_FAILURE_RETRY(uname(&uname_buf)) != 0) {
+    return "";
+  }
+  std::string paranoid;
+  android::base::ReadFileToString("/proc/sys/kernel/perf_event_paranoid", &paranoid);
+  std::string cpus;
+  for (int cpu : GetOnlineCpus()) {
+    cpus += std::to_string(cpu) + ",";
+  }
+  return android::base::StringPrintf("%s %s %s %s %s", boot_id.c_str(), uname_buf.release,
+                                     cpus.c_str(), android::base::Trim(paranoid).c_str(),
+                                     uname_buf.version);
+}
+
+EventSupportCache::EventSupportCache() {
+  state_ = GetProbeState();
+  if (state_.empty()) {
+    return;
+  }
+#if defined(__ANDROID__)
+  path_ = "/data/local/tmp/simpleperf_event_support." + std::to_string(getuid());
+#else
+  path_ = "/tmp/simpleperf_event_support." + std::to_string(getuid());
+#endif
+  std::string content;
+  if (!android::base::ReadFileToString(path_, &content)) {
+    return;
+  }
+  std::vector<std::string> lines = android::base::Split(content, "\n");
+  if (lines.empty() || lines[0] != state_) {
+    LOG(DEBUG) << "ignore " << path_ << " probed in another state";
+    return;
+  }
+  for (size_t i = 1; i < lines.size(); ++i) {
+    uint64_t key;
+    int supported;
+    if (sscanf(lines[i].c_str(), "%" SCNx64 " %d", &key, &supported) == 2) {
+      results_[key] = (supported != 0);
+    }
+  }
+}
+
+void EventSupportCache::Save() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (path_.empty()) {
+    return;
+  }
+  std::string content = state_ + "\n";
+  for (auto& pair : results_) {
+    content += android::base::StringPrintf("%" PRIx64 " %d\n", pair.first, pair.second ? 1 : 0);
+  }
+  // Write a new file and rename it, so other simpleperf processes never read half a file.
+  std::string tmp_path = path_ + "." + std::to_string(getpid());
+  if (!android::base::WriteStringToFile(content, tmp_path) ||
+      rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    PLOG(DEBUG) << "failed to write " << path_;
+    unlink(tmp_path.c_str());
+  }
+}
+
+static uint64_t GetEventAttrKey(const perf_event_attr& attr) {
+  // Attrs are zeroed before being filled, so hashing their bytes is stable.
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(&attr);
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(attr); ++i) {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Return whether the kernel supports attr. *cacheable is set to false if the probe failed for a
+// reason that may go away, like running out of fds or of hardware counters.
+static bool ProbeEventAttr(perf_event_attr attr, bool* cacheable) {
+  int fd = perf_event_open(&attr, getpid(), -1, -1, 0);
+  if (fd != -1) {
+    close(fd);
+    *cacheable = true;
+    return true;
+  }
+  int err = errno;
+  PLOG(DEBUG) << "probing event (type " << attr.type << ", config " << attr.config << ") failed";
+  *cacheable = (err == ENOENT || err == EINVAL || err == EOPNOTSUPP || err == ENODEV ||
+                err == EACCES || err == EPERM || err == E2BIG);
+  return false;
+}
+
 bool IsEventAttrSupportedByKernel(perf_event_attr attr) {
-  auto event_fd = EventFd::OpenEventFile(attr, getpid(), -1, false);
-  return event_fd != nullptr;
+  EventSupportCache& cache = EventSupportCache::GetInstance();
+  uint64_t key = GetEventAttrKey(attr);
+  bool supported;
+  if (cache.Find(key, &supported)) {
+    return supported;
+  }
+  bool cacheable;
+  supported = ProbeEventAttr(attr, &cacheable);
+  if (cacheable) {
+    cache.Add(key, supported);
+    cache.Save();
+  }
+  return supported;
+}
+
+std::vector<bool> AreEventAttrsSupportedByKernel(const std::vector<perf_event_attr>& attrs) {
+  EventSupportCache& cache = EventSupportCache::GetInstance();
+  std::vector<bool> results(attrs.size());
+  std::vector<size_t> misses;
+  for (size_t i = 0; i < attrs.size(); ++i) {
+    bool supported;
+    if (cache.Find(GetEventAttrKey(attrs[i]), &supported)) {
+      results[i] = supported;
+    } else {
+      misses.push_back(i);
+    }
+  }
+  if (misses.empty()) {
+    return results;
+  }
+  // Each probe mostly waits in the kernel for the pmu driver, so probes are spread over threads
+  // even on few cpus.
+  constexpr size_t MAX_PROBE_THREADS = 8;
+  size_t thread_count = std::min(misses.size(), MAX_PROBE_THREADS);
+  std::vector<char> probed(misses.size());
+  std::vector<char> cacheable(misses.size());
+  std::atomic<size_t> next_miss(0);
+  auto probe = [&]() {
+    size_t j;
+    while ((j = next_miss++) < misses.size()) {
+      bool c;
+      probed[j] = ProbeEventAttr(attrs[misses[j]], &c);
+      cacheable[j] = c;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.push_back(std::thread(probe));
+  }
+  probe();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (size_t j = 0; j < misses.size(); ++j) {
+    results[misses[j]] = probed[j];
+    if (cacheable[j]) {
+      cache.Add(GetEventAttrKey(attrs[misses[j]]), probed[j]);
+    }
+  }
+  cache.Save();
+  return results;
 }
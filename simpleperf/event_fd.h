@@ -39,8 +39,11 @@ struct pollfd;
 // EventFd represents an opened perf_event_file.
 class EventFd {
  public:
+  // If group_event_fd is not null, the perf_event_file joins the group led by it, so the
+  // kernel schedules them together.
   static std::unique_ptr<EventFd> OpenEventFile(const perf_event_attr& attr, pid_t tid, int cpu,
-                                                bool report_error = true);
+                                                bool report_error = true,
+                                                const EventFd* group_event_fd = nullptr);
 
   ~EventFd();
 
@@ -56,6 +59,21 @@ class EventFd {
 
   bool ReadCounter(PerfCounter* counter) const;
 
+  // Read counters of all perf_event_files in the group led by this perf_event_file with one
+  // read(). It is only available when this perf_event_file is opened with PERF_FORMAT_GROUP.
+  // Counters are ordered as the perf_event_files joined the group, starting with the leader.
+  bool ReadGroupCounters(std::vector<PerfCounter>* counters) const;
+
+  // Enable an event opened with attr.disabled set, and the events inherited from it.
+  bool EnableEvent();
+
+  // Disable the event and the events inherited from it, so it can be enabled again later.
+  bool DisableEvent();
+
+  // Change the sample period, or the sample frequency for an event sampled by frequency, without
+  // reopening the perf_event_file.
+  bool SetSamplePeriodOrFreq(uint64_t value);
+
   // Call mmap() for this perf_event_file, so we can read sampled records from mapped area.
   // mmap_pages should be power of 2.
   bool MmapContent(size_t mmap_pages);
@@ -64,13 +82,21 @@ class EventFd {
   // the start address and size of the data.
   size_t GetAvailableMmapData(char** pdata);
 
+  // Like GetAvailableMmapData(), but append the data to buffer instead of the buffer shared by
+  // all EventFds. So different EventFds can be read on different threads.
+  size_t ReadAvailableMmapData(std::vector<char>* buffer);
+
+  // Return how much of the mapped ring buffer is filled by data not read yet, between 0 and 1.
+  double GetMmapBufferUsage() const;
+
   // Prepare pollfd for poll() to wait on available mmap_data.
   void PreparePollForMmapData(pollfd* poll_fd);
 
  private:
-  EventFd(int perf_event_fd, const std::string& event_name, pid_t tid, int cpu)
+  EventFd(int perf_event_fd, const std::string& event_name, pid_t tid, int cpu, bool read_group)
       : perf_event_fd_(perf_event_fd),
         id_(0),
+        read_group_(read_group),
         event_name_(event_name),
         tid_(tid),
         cpu_(cpu),
@@ -81,12 +107,18 @@ class EventFd {
   // Give information about this perf_event_file, like (event_name, tid, cpu).
   std::string Name() const;
 
+  // Copy available data in the mapped area to buffer at offset, and return the copied size.
+  size_t CopyAvailableMmapData(std::vector<char>* buffer, size_t offset);
+
   // Discard how much data we have read, so the kernel can reuse this part of mapped area to store
   // new data.
   void DiscardMmapData(size_t discard_size);
 
   int perf_event_fd_;
   mutable uint64_t id_;
+  // Whether read() on this perf_event_file returns counters of the whole group.
+  bool read_group_;
+  mutable std::vector<uint64_t> group_read_buffer_;
   const std::string event_name_;
   pid_t tid_;
   int cpu_;
@@ -106,6 +138,12 @@ class EventFd {
   DISALLOW_COPY_AND_ASSIGN(EventFd);
 };
 
+// Probing whether the kernel supports an event attr opens a perf event file, which is slow on
+// some kernels. So results are cached in memory and in a file kept for the current boot, kernel,
+// online cpus and perf_event_paranoid.
 bool IsEventAttrSupportedByKernel(perf_event_attr attr);
+// Same as calling IsEventAttrSupportedByKernel() for each attr, but attrs not in the cache are
+// probed on several threads.
+std::vector<bool> AreEventAttrsSupportedByKernel(const std::vector<perf_event_attr>& attrs);
 
 #endif  // SIMPLE_PERF_EVENT_FD_H_
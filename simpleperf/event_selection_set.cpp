@@ -16,7 +16,17 @@
 
 #include "event_selection_set.h"
 
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
@@ -26,6 +36,165 @@
 #include "event_type.h"
 #include "perf_regs.h"
 
+// PerCpuReader drains the event files opened on one cpu into its own buffer, on a thread pinned
+// to that cpu.
+class PerCpuReader {
+ public:
+  PerCpuReader(int cpu, int wakeup_fd)
+      : cpu_(cpu),
+        stop_fds_{-1, -1},
+        wakeup_fd_(wakeup_fd),
+        failed_(false),
+        read_bytes_(0),
+        lost_records_(0) {
+  }
+
+  ~PerCpuReader() {
+    Stop();
+    if (stop_fds_[0] != -1) {
+      close(stop_fds_[0]);
+      close(stop_fds_[1]);
+    }
+  }
+
+  int Cpu() const {
+    return cpu_;
+  }
+
+  void AddEventFd(EventFd* event_fd) {
+    event_fds_.push_back(event_fd);
+  }
+
+  // Each reader has its own stop pipe, so the reader of one cpu can be replaced when the cpu
+  // comes online again, while other readers keep running.
+  bool Start() {
+    if (pipe2(stop_fds_, O_CLOEXEC) != 0) {
+      PLOG(ERROR) << "pipe2() failed";
+      return false;
+    }
+    thread_ = std::thread(&PerCpuReader::ReaderThreadMain, this);
+    return true;
+  }
+
+  // Stop the reader thread after it drains the event files.
+  void Stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    char c = 0;
+    if (TEMP_FAILURE_RETRY(write(stop_fds_[1], &c, 1)) != 1) {
+      PLOG(FATAL) << "failed to stop the reader thread of cpu " << cpu_;
+    }
+    thread_.join();
+  }
+
+  bool Failed() const {
+    return failed_;
+  }
+
+  // Move collected data to the end of buffer.
+  void MoveDataTo(std::vector<char>* buffer);
+
+  // It should be called after Stop().
+  PerCpuReaderStat Stat() const {
+    return PerCpuReaderStat{cpu_, read_bytes_, lost_records_};
+  }
+
+ private:
+  void ReaderThreadMain();
+  void DrainEventFds();
+
+  const int cpu_;
+  int stop_fds_[2];
+  const int wakeup_fd_;
+  std::vector<EventFd*> event_fds_;
+  std::atomic<bool> failed_;
+  uint64_t read_bytes_;
+  uint64_t lost_records_;
+  std::mutex data_mutex_;
+  std::vector<char> data_;  // Guarded by data_mutex_.
+  std::thread thread_;
+};
+
+void PerCpuReader::MoveDataTo(std::vector<char>* buffer) {
+  std::lock_guard<std::mutex> lock(data_mutex_);
+  if (buffer->empty()) {
+    buffer->swap(data_);
+  } else {
+    buffer->insert(buffer->end(), data_.begin(), data_.end());
+  }
+  data_.clear();
+}
+
+void PerCpuReader::ReaderThreadMain() {
+  if (cpu_ != -1) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu_, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+      PLOG(WARNING) << "failed to bind reader thread to cpu " << cpu_;
+    }
+  }
+  std::vector<pollfd> pollfds(event_fds_.size() + 1);
+  for (size_t i = 0; i < event_fds_.size(); ++i) {
+    event_fds_[i]->PreparePollForMmapData(&pollfds[i]);
+  }
+  pollfds.back().fd = stop_fds_[0];
+  pollfds.back().events = POLLIN;
+  while (true) {
+    DrainEventFds();
+    if (TEMP_FAILURE_RETRY(poll(pollfds.data(), pollfds.size(), -1)) == -1) {
+      PLOG(ERROR) << "poll() failed in the reader thread of cpu " << cpu_;
+      failed_ = true;
+      break;
+    }
+    if (pollfds.back().revents & POLLIN) {
+      break;
+    }
+    for (size_t i = 0; i < event_fds_.size(); ++i) {
+      // The monitored thread has exited, stop polling its file to avoid busy looping.
+      if (pollfds[i].revents & (POLLHUP | POLLERR)) {
+        pollfds[i].fd = -1;
+      }
+    }
+  }
+  DrainEventFds();
+}
+
+void PerCpuReader::DrainEventFds() {
+  std::lock_guard<std::mutex> lock(data_mutex_);
+  size_t old_size = data_.size();
+  for (auto& event_fd : event_fds_) {
+    while (event_fd->ReadAvailableMmapData(&data_) != 0) {
+    }
+  }
+  if (data_.size() == old_size) {
+    return;
+  }
+  const char* p = data_.data() + old_size;
+  const char* end = data_.data() + data_.size();
+  while (p < end) {
+    perf_event_header header;
+    memcpy(&header, p, sizeof(header));
+    if (header.size == 0) {
+      break;
+    }
+    if (header.type == PERF_RECORD_LOST) {
+      // A lost record is {header, id, lost}.
+      uint64_t lost;
+      memcpy(&lost, p + sizeof(header) + sizeof(uint64_t), sizeof(lost));
+      lost_records_ += lost;
+    }
+    p += header.size;
+  }
+  read_bytes_ += data_.size() - old_size;
+  if (old_size == 0) {
+    char c = 0;
+    // Ignore EAGAIN, as the pipe is full only when it is already readable.
+    TEMP_FAILURE_RETRY(write(wakeup_fd_, &c, 1));
+  }
+}
+
 bool IsBranchSamplingSupported() {
   const EventType* type = FindEventTypeByName("cpu-cycles");
   if (type == nullptr) {
@@ -50,6 +219,23 @@ bool IsDwarfCallChainSamplingSupported() {
   return IsEventAttrSupportedByKernel(attr);
 }
 
+EventSelectionSet::EventSelectionSet()
+    : group_read_(false),
+      has_event_group_(false),
+      mmap_pages_(0),
+      events_enabled_(false),
+      reader_wakeup_fds_{-1, -1} {
+}
+
+EventSelectionSet::~EventSelectionSet() {
+  StopPerCpuReaders();
+  per_cpu_readers_.clear();
+  if (reader_wakeup_fds_[0] != -1) {
+    close(reader_wakeup_fds_[0]);
+    close(reader_wakeup_fds_[1]);
+  }
+}
+
 bool EventSelectionSet::AddEventType(const EventTypeAndModifier& event_type_modifier) {
   EventSelection selection;
   selection.event_type_modifier = event_type_modifier;
@@ -64,11 +250,24 @@ bool EventSelectionSet::AddEventType(const EventTypeAndModifier& event_type_modi
     LOG(ERROR) << "Event type '" << event_type_modifier.name << "' is not supported by the kernel";
     return false;
   }
+  selection.group_id = selections_.empty() ? 0 : selections_.back().group_id + 1;
   selections_.push_back(std::move(selection));
   UnionSampleType();
   return true;
 }
 
+bool EventSelectionSet::AddEventGroup(const std::vector<EventTypeAndModifier>& event_types) {
+  size_t group_id = selections_.empty() ? 0 : selections_.back().group_id + 1;
+  for (auto& event_type : event_types) {
+    if (!AddEventType(event_type)) {
+      return false;
+    }
+    selections_.back().group_id = group_id;
+  }
+  has_event_group_ = event_types.size() > 1 || has_event_group_;
+  return true;
+}
+
 // Union the sample type of different event attrs can make reading sample records in perf.data
 // easier.
 void EventSelectionSet::UnionSampleType() {
@@ -76,6 +275,10 @@ void EventSelectionSet::UnionSampleType() {
   for (auto& selection : selections_) {
     sample_type |= selection.event_attr.sample_type;
   }
+  // Samples of different events are told apart by their ids.
+  if (selections_.size() > 1) {
+    sample_type |= PERF_SAMPLE_ID;
+  }
   for (auto& selection : selections_) {
     selection.event_attr.sample_type = sample_type;
   }
@@ -106,6 +309,13 @@ bool EventSelectionSet::GetEnableOnExec() {
   return true;
 }
 
+void EventSelectionSet::SetEnableOnDemand() {
+  for (auto& selection : selections_) {
+    selection.event_attr.enable_on_exec = 0;
+    selection.event_attr.disabled = 1;
+  }
+}
+
 void EventSelectionSet::SampleIdAll() {
   for (auto& selection : selections_) {
     selection.event_attr.sample_id_all = 1;
@@ -178,6 +388,10 @@ void EventSelectionSet::SetInherit(bool enable) {
   }
 }
 
+void EventSelectionSet::EnableGroupRead() {
+  group_read_ = true;
+}
+
 static bool CheckIfCpusOnline(const std::vector<int>& cpus) {
   std::vector<int> online_cpus = GetOnlineCpus();
   for (const auto& cpu : cpus) {
@@ -195,6 +409,9 @@ bool EventSelectionSet::OpenEventFilesForCpus(const std::vector<int>& cpus) {
 
 bool EventSelectionSet::OpenEventFilesForThreadsOnCpus(const std::vector<pid_t>& threads,
                                                        std::vector<int> cpus) {
+  monitored_threads_ = threads;
+  monitored_cpus_ = cpus;
+  online_cpus_ = GetOnlineCpus();
   if (!cpus.empty()) {
     if (!CheckIfCpusOnline(cpus)) {
       return false;
@@ -205,8 +422,15 @@ bool EventSelectionSet::OpenEventFilesForThreadsOnCpus(const std::vector<pid_t>&
   return OpenEventFiles(threads, cpus);
 }
 
+bool EventSelectionSet::OpenEventFilesForThreads(const std::vector<pid_t>& threads) {
+  return OpenEventFiles(threads, {-1});
+}
+
 bool EventSelectionSet::OpenEventFiles(const std::vector<pid_t>& threads,
                                        const std::vector<int>& cpus) {
+  if (group_read_ || has_event_group_) {
+    return OpenEventFilesInGroups(threads, cpus);
+  }
   for (auto& selection : selections_) {
     for (auto& tid : threads) {
       size_t open_per_thread = 0;
@@ -231,11 +455,128 @@ bool EventSelectionSet::OpenEventFiles(const std::vector<pid_t>& threads,
   return true;
 }
 
+bool EventSelectionSet::OpenEventFilesInGroups(const std::vector<pid_t>& threads,
+                                               const std::vector<int>& cpus) {
+  std::vector<bool> in_event_group(selections_.size(), false);
+  for (size_t i = 1; i < selections_.size(); ++i) {
+    if (selections_[i].group_id == selections_[i - 1].group_id) {
+      in_event_group[i - 1] = in_event_group[i] = true;
+    }
+  }
+  // Old kernels refuse PERF_FORMAT_GROUP together with inherit. Then fall back to reading each
+  // event file separately. Event groups are still scheduled together.
+  bool group_format_supported = true;
+  for (auto& tid : threads) {
+    std::vector<size_t> open_per_thread(selections_.size(), 0);
+    for (auto& cpu : cpus) {
+      const EventFd* leader = nullptr;
+      bool leader_reads_group = false;
+      for (size_t i = 0; i < selections_.size(); ++i) {
+        EventSelection& selection = selections_[i];
+        bool joins_event_group =
+            in_event_group[i] && i > 0 && selections_[i - 1].group_id == selection.group_id;
+        std::unique_ptr<EventFd> event_fd;
+        if (joins_event_group) {
+          if (leader == nullptr) {
+            // The group leader isn't opened on this cpu.
+            continue;
+          }
+          event_fd = EventFd::OpenEventFile(selection.event_attr, tid, cpu, true, leader);
+          if (event_fd == nullptr) {
+            LOG(ERROR) << "event type " << selection.event_type_modifier.name
+                       << " can't be counted together with the other events in its group";
+            return false;
+          }
+          if (!leader_reads_group) {
+            counter_groups_.push_back(CounterGroup());
+          }
+        } else {
+          if (in_event_group[i] || (i > 0 && in_event_group[i - 1])) {
+            // An event group doesn't share its leader with event types outside the group.
+            leader = nullptr;
+          }
+          if (leader != nullptr && group_read_) {
+            event_fd = EventFd::OpenEventFile(selection.event_attr, tid, cpu, false, leader);
+          }
+          if (event_fd == nullptr && group_format_supported &&
+              (group_read_ || in_event_group[i])) {
+            perf_event_attr attr = selection.event_attr;
+            attr.read_format |= PERF_FORMAT_GROUP;
+            event_fd = EventFd::OpenEventFile(attr, tid, cpu, false);
+            if (event_fd != nullptr) {
+              leader = event_fd.get();
+              leader_reads_group = true;
+              counter_groups_.push_back(CounterGroup());
+            }
+          }
+          if (event_fd == nullptr) {
+            event_fd = EventFd::OpenEventFile(selection.event_attr, tid, cpu);
+            if (event_fd == nullptr) {
+              continue;
+            }
+            if (group_format_supported && (group_read_ || in_event_group[i])) {
+              LOG(DEBUG) << "perf event groups can't be read, read event files separately";
+              group_format_supported = false;
+            }
+            leader = in_event_group[i] ? event_fd.get() : nullptr;
+            leader_reads_group = false;
+            counter_groups_.push_back(CounterGroup());
+          }
+        }
+        LOG(VERBOSE) << "OpenEventFile for tid " << tid << ", cpu " << cpu << " in group "
+                     << counter_groups_.size() - 1;
+        counter_groups_.back().push_back(std::make_pair(i, selection.event_fds.size()));
+        selection.event_fds.push_back(std::move(event_fd));
+        ++open_per_thread[i];
+      }
+    }
+    for (size_t i = 0; i < selections_.size(); ++i) {
+      if (open_per_thread[i] == 0) {
+        PLOG(ERROR) << "failed to open perf event file for event_type "
+                    << selections_[i].event_type_modifier.name << " for "
+                    << (tid == -1 ? "all threads" : android::base::StringPrintf(" thread %d", tid));
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool EventSelectionSet::EnableEvents() {
+  // Unlike enable_on_exec, this uses ioctl(PERF_EVENT_IOC_ENABLE), which some android kernels
+  // don't handle well when cpu-hotplug happens. See SetEnableOnExec().
+  for (auto& selection : selections_) {
+    for (auto& event_fd : selection.event_fds) {
+      if (!event_fd->EnableEvent()) {
+        return false;
+      }
+    }
+  }
+  events_enabled_ = true;
+  return true;
+}
+
+bool EventSelectionSet::DisableEvents() {
+  for (auto& selection : selections_) {
+    for (auto& event_fd : selection.event_fds) {
+      if (!event_fd->DisableEvent()) {
+        return false;
+      }
+    }
+  }
+  events_enabled_ = false;
+  return true;
+}
+
 bool EventSelectionSet::ReadCounters(std::vector<CountersInfo>* counters) {
   counters->clear();
+  if (group_read_ || has_event_group_) {
+    return ReadCountersInGroups(counters);
+  }
   for (auto& selection : selections_) {
     CountersInfo counters_info;
     counters_info.event_type = &selection.event_type_modifier;
+    counters_info.group_id = selection.group_id;
     for (auto& event_fd : selection.event_fds) {
       CountersInfo::CounterInfo counter_info;
       if (!event_fd->ReadCounter(&counter_info.counter)) {
@@ -250,7 +591,51 @@ bool EventSelectionSet::ReadCounters(std::vector<CountersInfo>* counters) {
   return true;
 }
 
+bool EventSelectionSet::ReadCountersInGroups(std::vector<CountersInfo>* counters) {
+  counters->resize(selections_.size());
+  for (size_t i = 0; i < selections_.size(); ++i) {
+    CountersInfo& counters_info = (*counters)[i];
+    counters_info.event_type = &selections_[i].event_type_modifier;
+    counters_info.group_id = selections_[i].group_id;
+    counters_info.counters.resize(selections_[i].event_fds.size());
+    for (size_t j = 0; j < selections_[i].event_fds.size(); ++j) {
+      counters_info.counters[j].tid = selections_[i].event_fds[j]->ThreadId();
+      counters_info.counters[j].cpu = selections_[i].event_fds[j]->Cpu();
+    }
+  }
+  std::vector<PerfCounter> group_counters;
+  for (auto& group : counter_groups_) {
+    const EventFd* leader = selections_[group[0].first].event_fds[group[0].second].get();
+    if (group.size() == 1) {
+      if (!leader->ReadCounter(&(*counters)[group[0].first].counters[group[0].second].counter)) {
+        return false;
+      }
+      continue;
+    }
+    if (!leader->ReadGroupCounters(&group_counters)) {
+      return false;
+    }
+    if (group_counters.size() != group.size()) {
+      LOG(ERROR) << "read " << group_counters.size() << " counters from a group of "
+                 << group.size() << " event files";
+      return false;
+    }
+    for (size_t i = 0; i < group.size(); ++i) {
+      (*counters)[group[i].first].counters[group[i].second].counter = group_counters[i];
+    }
+  }
+  return true;
+}
+
 void EventSelectionSet::PreparePollForEventFiles(std::vector<pollfd>* pollfds) {
+  if (!per_cpu_readers_.empty()) {
+    pollfd poll_fd;
+    memset(&poll_fd, 0, sizeof(poll_fd));
+    poll_fd.fd = reader_wakeup_fds_[0];
+    poll_fd.events = POLLIN;
+    pollfds->push_back(poll_fd);
+    return;
+  }
   for (auto& selection : selections_) {
     for (auto& event_fd : selection.event_fds) {
       pollfd poll_fd;
@@ -261,6 +646,7 @@ void EventSelectionSet::PreparePollForEventFiles(std::vector<pollfd>* pollfds) {
 }
 
 bool EventSelectionSet::MmapEventFiles(size_t mmap_pages) {
+  mmap_pages_ = mmap_pages;
   for (auto& selection : selections_) {
     for (auto& event_fd : selection.event_fds) {
       if (!event_fd->MmapContent(mmap_pages)) {
@@ -271,6 +657,37 @@ bool EventSelectionSet::MmapEventFiles(size_t mmap_pages) {
   return true;
 }
 
+bool EventSelectionSet::ChangeSampleFreq(uint64_t sample_freq) {
+  for (auto& selection : selections_) {
+    const perf_event_attr& attr = selection.event_attr;
+    CHECK(attr.freq);
+    uint64_t value = sample_freq;
+    // The kernel drives cpu-clock and task-clock by hrtimers, and turns their frequency into a
+    // period in ns when opening them. So PERF_EVENT_IOC_PERIOD takes a period for them.
+    if (attr.type == PERF_TYPE_SOFTWARE &&
+        (attr.config == PERF_COUNT_SW_CPU_CLOCK || attr.config == PERF_COUNT_SW_TASK_CLOCK)) {
+      value = std::max<uint64_t>(1, 1000000000 / sample_freq);
+    }
+    for (auto& event_fd : selection.event_fds) {
+      if (!event_fd->SetSamplePeriodOrFreq(value)) {
+        return false;
+      }
+    }
+    selection.event_attr.sample_freq = sample_freq;
+  }
+  return true;
+}
+
+double EventSelectionSet::GetMaxMmapBufferUsage() const {
+  double max_usage = 0;
+  for (auto& selection : selections_) {
+    for (auto& event_fd : selection.event_fds) {
+      max_usage = std::max(max_usage, event_fd->GetMmapBufferUsage());
+    }
+  }
+  return max_usage;
+}
+
 static bool ReadMmapEventDataForFd(std::unique_ptr<EventFd>& event_fd,
                                    std::function<bool(const char*, size_t)> callback,
                                    bool* have_data) {
@@ -290,6 +707,9 @@ static bool ReadMmapEventDataForFd(std::unique_ptr<EventFd>& event_fd,
 }
 
 bool EventSelectionSet::ReadMmapEventData(std::function<bool(const char*, size_t)> callback) {
+  if (!per_cpu_readers_.empty()) {
+    return ReadPerCpuReaderData(callback);
+  }
   for (auto& selection : selections_) {
     for (auto& event_fd : selection.event_fds) {
       while (true) {
@@ -306,6 +726,174 @@ bool EventSelectionSet::ReadMmapEventData(std::function<bool(const char*, size_t
   return true;
 }
 
+bool EventSelectionSet::StartPerCpuReaders() {
+  CHECK(per_cpu_readers_.empty());
+  if (pipe2(reader_wakeup_fds_, O_CLOEXEC | O_NONBLOCK) != 0) {
+    PLOG(ERROR) << "pipe2() failed";
+    return false;
+  }
+  std::map<int, PerCpuReader*> reader_map;
+  for (auto& selection : selections_) {
+    for (auto& event_fd : selection.event_fds) {
+      PerCpuReader*& reader = reader_map[event_fd->Cpu()];
+      if (reader == nullptr) {
+        per_cpu_readers_.emplace_back(new PerCpuReader(event_fd->Cpu(), reader_wakeup_fds_[1]));
+        reader = per_cpu_readers_.back().get();
+      }
+      reader->AddEventFd(event_fd.get());
+    }
+  }
+  for (auto& reader : per_cpu_readers_) {
+    if (!StartPerCpuReader(reader.get())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool EventSelectionSet::StartPerCpuReader(PerCpuReader* reader) {
+  // Signals should be handled by the main thread, to interrupt its poll() call.
+  sigset_t mask;
+  sigset_t old_mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+  bool result = reader->Start();
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+  return result;
+}
+
+void EventSelectionSet::StopPerCpuReaders() {
+  for (auto& reader : per_cpu_readers_) {
+    reader->Stop();
+  }
+}
+
+std::vector<PerCpuReaderStat> EventSelectionSet::GetPerCpuReaderStats() const {
+  std::vector<PerCpuReaderStat> stats = replaced_reader_stats_;
+  for (auto& reader : per_cpu_readers_) {
+    stats.push_back(reader->Stat());
+  }
+  return stats;
+}
+
+bool EventSelectionSet::ReadPerCpuReaderData(std::function<bool(const char*, size_t)> callback) {
+  char buf[64];
+  while (read(reader_wakeup_fds_[0], buf, sizeof(buf)) > 0) {
+  }
+  // Pass data of all cpus in one call, so records of different cpus are sorted together by the
+  // RecordCache in the callback.
+  per_cpu_reader_data_.clear();
+  for (auto& reader : per_cpu_readers_) {
+    if (reader->Failed()) {
+      return false;
+    }
+    reader->MoveDataTo(&per_cpu_reader_data_);
+  }
+  if (per_cpu_reader_data_.empty()) {
+    return true;
+  }
+  return callback(per_cpu_reader_data_.data(), per_cpu_reader_data_.size());
+}
+
+bool EventSelectionSet::HandleCpuHotplug(std::function<bool(const char*, size_t)> callback,
+                                         bool* changed) {
+  *changed = false;
+  // Only event files opened per cpu are affected. Event groups aren't reopened, as they are
+  // only used for counting.
+  if (online_cpus_.empty() || group_read_ || has_event_group_) {
+    return true;
+  }
+  std::vector<int> online_cpus = GetOnlineCpus();
+  std::vector<int> new_cpus;
+  for (int cpu : online_cpus) {
+    if (std::find(online_cpus_.begin(), online_cpus_.end(), cpu) == online_cpus_.end() &&
+        (monitored_cpus_.empty() ||
+         std::find(monitored_cpus_.begin(), monitored_cpus_.end(), cpu) != monitored_cpus_.end())) {
+      new_cpus.push_back(cpu);
+    }
+  }
+  online_cpus_ = online_cpus;
+  for (int cpu : new_cpus) {
+    if (!ReopenEventFilesOnCpu(cpu, callback)) {
+      return false;
+    }
+    *changed = true;
+  }
+  return true;
+}
+
+bool EventSelectionSet::ReopenEventFilesOnCpu(int cpu,
+                                              std::function<bool(const char*, size_t)> callback) {
+  LOG(VERBOSE) << "cpu " << cpu << " came online, reopen event files on it";
+  // The reader of the cpu refers to the event files to close, so stop it first.
+  for (auto it = per_cpu_readers_.begin(); it != per_cpu_readers_.end(); ++it) {
+    if ((*it)->Cpu() == cpu) {
+      (*it)->Stop();
+      std::vector<char> data;
+      (*it)->MoveDataTo(&data);
+      if (!data.empty() && !callback(data.data(), data.size())) {
+        return false;
+      }
+      replaced_reader_stats_.push_back((*it)->Stat());
+      per_cpu_readers_.erase(it);
+      break;
+    }
+  }
+  std::unique_ptr<PerCpuReader> reader;
+  if (reader_wakeup_fds_[1] != -1) {
+    reader.reset(new PerCpuReader(cpu, reader_wakeup_fds_[1]));
+  }
+  size_t open_count = 0;
+  for (auto& selection : selections_) {
+    auto& event_fds = selection.event_fds;
+    for (auto it = event_fds.begin(); it != event_fds.end();) {
+      if ((*it)->Cpu() != cpu) {
+        ++it;
+        continue;
+      }
+      bool have_data;
+      do {
+        if (!ReadMmapEventDataForFd(*it, callback, &have_data)) {
+          return false;
+        }
+      } while (have_data);
+      it = event_fds.erase(it);
+    }
+    // Events enabled on exec have been enabled by now. Events enabled on demand should only
+    // start counting once EnableEvents() is called.
+    perf_event_attr attr = selection.event_attr;
+    bool enable_on_demand = attr.disabled && !attr.enable_on_exec;
+    attr.enable_on_exec = 0;
+    attr.disabled = (enable_on_demand && !events_enabled_) ? 1 : 0;
+    for (auto& tid : monitored_threads_) {
+      // Monitored threads may have exited.
+      std::unique_ptr<EventFd> event_fd = EventFd::OpenEventFile(attr, tid, cpu, false);
+      if (event_fd == nullptr) {
+        continue;
+      }
+      if (mmap_pages_ != 0 && !event_fd->MmapContent(mmap_pages_)) {
+        return false;
+      }
+      if (reader != nullptr) {
+        reader->AddEventFd(event_fd.get());
+      }
+      event_fds.push_back(std::move(event_fd));
+      ++open_count;
+    }
+  }
+  if (open_count == 0) {
+    LOG(WARNING) << "failed to open event files on cpu " << cpu << " after it came online";
+    return true;
+  }
+  if (reader != nullptr) {
+    if (!StartPerCpuReader(reader.get())) {
+      return false;
+    }
+    per_cpu_readers_.push_back(std::move(reader));
+  }
+  return true;
+}
+
 EventSelectionSet::EventSelection* EventSelectionSet::FindSelectionByType(
     const EventTypeAndModifier& event_type_modifier) {
   for (auto& selection : selections_) {
@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <android-base/macros.h>
@@ -29,6 +30,8 @@
 
 struct CountersInfo {
   const EventTypeAndModifier* event_type;
+  // Event types added by the same AddEventGroup() call have the same group_id.
+  size_t group_id;
   struct CounterInfo {
     pid_t tid;
     int cpu;
@@ -37,7 +40,14 @@ struct CountersInfo {
   std::vector<CounterInfo> counters;
 };
 
+struct PerCpuReaderStat {
+  int cpu;  // -1 for event files not bound to a cpu.
+  uint64_t read_bytes;
+  uint64_t lost_records;
+};
+
 struct pollfd;
+class PerCpuReader;
 
 // EventSelectionSet helps to monitor events.
 // Firstly, the user creates an EventSelectionSet, and adds the specific event types to monitor.
@@ -50,17 +60,23 @@ struct pollfd;
 
 class EventSelectionSet {
  public:
-  EventSelectionSet() {
-  }
+  EventSelectionSet();
+  ~EventSelectionSet();
 
   bool Empty() const {
     return selections_.empty();
   }
 
   bool AddEventType(const EventTypeAndModifier& event_type_modifier);
+  // Add event types counted as one perf event group: the kernel only schedules them together,
+  // so ratios between them aren't distorted by multiplexing, and each group is read with one
+  // read(). The first event type is the group leader.
+  bool AddEventGroup(const std::vector<EventTypeAndModifier>& event_types);
 
   void SetEnableOnExec(bool enable);
   bool GetEnableOnExec();
+  // Open event files disabled, until EnableEvents() is called.
+  void SetEnableOnDemand();
   void SampleIdAll();
   void SetSampleFreq(uint64_t sample_freq);
   void SetSamplePeriod(uint64_t sample_period);
@@ -68,14 +84,45 @@ class EventSelectionSet {
   void EnableFpCallChainSampling();
   bool EnableDwarfCallChainSampling(uint32_t dump_stack_size);
   void SetInherit(bool enable);
+  // Open event files on the same thread and cpu as one perf event group when the kernel allows
+  // it, so ReadCounters() needs one read() per group instead of one per event file. Event types
+  // that don't fit in a group (like too many hardware events) start another group.
+  void EnableGroupRead();
 
   bool OpenEventFilesForCpus(const std::vector<int>& cpus);
   bool OpenEventFilesForThreadsOnCpus(const std::vector<pid_t>& threads, std::vector<int> cpus);
+  // Open one event file per thread counting it on any cpu, instead of one per thread and cpu.
+  // The kernel refuses to map inherited event files not bound to a cpu, so it is only for
+  // counting.
+  bool OpenEventFilesForThreads(const std::vector<pid_t>& threads);
+  bool EnableEvents();
+  bool DisableEvents();
   bool ReadCounters(std::vector<CountersInfo>* counters);
   void PreparePollForEventFiles(std::vector<pollfd>* pollfds);
   bool MmapEventFiles(size_t mmap_pages);
+  // Change the sample frequency of opened event files, which should be sampled by frequency.
+  bool ChangeSampleFreq(uint64_t sample_freq);
+  // Return the highest usage of mapped buffers of all event files, between 0 and 1.
+  double GetMaxMmapBufferUsage() const;
   bool ReadMmapEventData(std::function<bool(const char*, size_t)> callback);
 
+  // Read mapped event data on reader threads pinned to each cpu, instead of on the thread
+  // calling ReadMmapEventData(). Each reader drains the event files on its cpu into its own
+  // buffer. Then PreparePollForEventFiles() returns an fd readable when readers have new data,
+  // and ReadMmapEventData() passes data collected by all readers to the callback.
+  // It should be called after MmapEventFiles().
+  bool StartPerCpuReaders();
+  // Stop readers after they drain the event files. The data left can still be read by
+  // ReadMmapEventData().
+  void StopPerCpuReaders();
+  std::vector<PerCpuReaderStat> GetPerCpuReaderStats() const;
+
+  // Event files opened on a cpu stop working once it goes offline. Check online cpus, and for
+  // cpus that came online since the last check, drain their old event files through callback,
+  // then open, map and read new ones like the event files opened before. Set *changed if event
+  // files are reopened, so pollfds from PreparePollForEventFiles() should be prepared again.
+  bool HandleCpuHotplug(std::function<bool(const char*, size_t)> callback, bool* changed);
+
   const perf_event_attr* FindEventAttrByType(const EventTypeAndModifier& event_type_modifier);
   const std::vector<std::unique_ptr<EventFd>>* FindEventFdsByType(
       const EventTypeAndModifier& event_type_modifier);
@@ -83,16 +130,41 @@ class EventSelectionSet {
  private:
   void UnionSampleType();
   bool OpenEventFiles(const std::vector<pid_t>& threads, const std::vector<int>& cpus);
+  bool OpenEventFilesInGroups(const std::vector<pid_t>& threads, const std::vector<int>& cpus);
 
   struct EventSelection {
     EventTypeAndModifier event_type_modifier;
     perf_event_attr event_attr;
     std::vector<std::unique_ptr<EventFd>> event_fds;
+    size_t group_id;
   };
   EventSelection* FindSelectionByType(const EventTypeAndModifier& event_type_modifier);
+  bool ReadCountersInGroups(std::vector<CountersInfo>* counters);
+  bool ReadPerCpuReaderData(std::function<bool(const char*, size_t)> callback);
+  bool StartPerCpuReader(PerCpuReader* reader);
+  bool ReopenEventFilesOnCpu(int cpu, std::function<bool(const char*, size_t)> callback);
 
   std::vector<EventSelection> selections_;
 
+  bool group_read_;
+  bool has_event_group_;
+  // Each group is a list of (selection index, event_fd index), led by the first one.
+  typedef std::vector<std::pair<size_t, size_t>> CounterGroup;
+  std::vector<CounterGroup> counter_groups_;
+
+  // What event files are opened and mapped for, to open them again on cpus coming online.
+  std::vector<pid_t> monitored_threads_;
+  std::vector<int> monitored_cpus_;  // Empty for all cpus.
+  std::vector<int> online_cpus_;
+  size_t mmap_pages_;
+  bool events_enabled_;
+
+  std::vector<std::unique_ptr<PerCpuReader>> per_cpu_readers_;
+  int reader_wakeup_fds_[2];  // A pipe written by readers when they have new data.
+  std::vector<char> per_cpu_reader_data_;
+  // Stats of readers replaced after their cpus went offline and came back.
+  std::vector<PerCpuReaderStat> replaced_reader_stats_;
+
   DISALLOW_COPY_AND_ASSIGN(EventSelectionSet);
 };
 
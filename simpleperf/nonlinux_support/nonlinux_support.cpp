@@ -20,8 +20,16 @@
 #include "dwarf_unwind.h"
 #include "environment.h"
 
-std::vector<uint64_t> UnwindCallChain(ArchType, const ThreadEntry&, const RegSet&,
-                                      const std::vector<char>&) {
+class BacktraceMap {};
+
+OfflineUnwinder::OfflineUnwinder() {
+}
+
+OfflineUnwinder::~OfflineUnwinder() {
+}
+
+std::vector<uint64_t> OfflineUnwinder::UnwindCallChain(ArchType, const ThreadEntry&,
+                                                       const RegSet&, const std::vector<char>&) {
   return std::vector<uint64_t>();
 }
 
@@ -24,7 +24,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -32,110 +35,165 @@
 #include "read_elf.h"
 #include "utils.h"
 
+struct ApkInspector::ZipEntryIndex {
+  struct Entry {
+    std::string name;
+    uint64_t offset;
+    uint32_t compressed_length;
+    uint32_t uncompressed_length;
+    bool stored;
+  };
+
+  time_t mtime;
+  off_t size;
+  std::vector<Entry> entries;  // Sorted by offset.
+  std::unordered_map<std::string, size_t> name_to_entry;
+};
+
 std::map<ApkInspector::ApkOffset, std::unique_ptr<EmbeddedElf>> ApkInspector::embedded_elf_cache_;
+std::map<std::string, std::shared_ptr<const ApkInspector::ZipEntryIndex>>
+    ApkInspector::zip_entry_index_cache_;
+// Guards the caches above, as dsos can be loaded on different threads.
+static std::mutex apk_cache_mutex;
 
 EmbeddedElf* ApkInspector::FindElfInApkByOffset(const std::string& apk_path, uint64_t file_offset) {
   // Already in cache?
   ApkOffset ami(apk_path, file_offset);
-  auto it = embedded_elf_cache_.find(ami);
-  if (it != embedded_elf_cache_.end()) {
-    return it->second.get();
+  {
+    std::lock_guard<std::mutex> lock(apk_cache_mutex);
+    auto it = embedded_elf_cache_.find(ami);
+    if (it != embedded_elf_cache_.end()) {
+      return it->second.get();
+    }
   }
   std::unique_ptr<EmbeddedElf> elf = FindElfInApkByOffsetWithoutCache(apk_path, file_offset);
-  EmbeddedElf* result = elf.get();
-  embedded_elf_cache_[ami] = std::move(elf);
-  return result;
+  std::lock_guard<std::mutex> lock(apk_cache_mutex);
+  std::unique_ptr<EmbeddedElf>& cached_elf = embedded_elf_cache_[ami];
+  if (cached_elf == nullptr) {
+    cached_elf = std::move(elf);
+  }
+  return cached_elf.get();
 }
 
-std::unique_ptr<EmbeddedElf> ApkInspector::FindElfInApkByOffsetWithoutCache(const std::string& apk_path,
-                                                                            uint64_t file_offset) {
+std::shared_ptr<const ApkInspector::ZipEntryIndex> ApkInspector::GetZipEntryIndex(
+    const std::string& apk_path) {
+  struct stat st;
+  if (stat(apk_path.c_str(), &st) != 0) {
+    return nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(apk_cache_mutex);
+    auto it = zip_entry_index_cache_.find(apk_path);
+    if (it != zip_entry_index_cache_.end() && it->second->mtime == st.st_mtime &&
+        it->second->size == st.st_size) {
+      return it->second;
+    }
+  }
+
   // Crack open the apk(zip) file and take a look.
   if (!IsValidApkPath(apk_path)) {
     return nullptr;
   }
-
   FileHelper fhelper = FileHelper::OpenReadOnly(apk_path);
   if (!fhelper) {
     return nullptr;
   }
-
   ArchiveHelper ahelper(fhelper.fd(), apk_path);
   if (!ahelper) {
     return nullptr;
   }
-  ZipArchiveHandle &handle = ahelper.archive_handle();
-
-  // Iterate through the zip file. Look for a zip entry corresponding
-  // to an uncompressed blob whose range intersects with the mmap
-  // offset we're interested in.
+  ZipArchiveHandle& handle = ahelper.archive_handle();
   void* iteration_cookie;
   if (StartIteration(handle, &iteration_cookie, nullptr, nullptr) < 0) {
     return nullptr;
   }
+  std::shared_ptr<ZipEntryIndex> index(new ZipEntryIndex);
+  index->mtime = st.st_mtime;
+  index->size = st.st_size;
   ZipEntry zentry;
   ZipString zname;
-  bool found = false;
-  int zrc;
-  while ((zrc = Next(iteration_cookie, &zentry, &zname)) == 0) {
-    if (zentry.method == kCompressStored &&
-        file_offset >= static_cast<uint64_t>(zentry.offset) &&
-        file_offset < static_cast<uint64_t>(zentry.offset + zentry.uncompressed_length)) {
-      // Found.
-      found = true;
-      break;
-    }
+  while (Next(iteration_cookie, &zentry, &zname) == 0) {
+    ZipEntryIndex::Entry entry;
+    entry.name.assign(reinterpret_cast<const char*>(zname.name), zname.name_length);
+    entry.offset = zentry.offset;
+    entry.compressed_length = zentry.compressed_length;
+    entry.uncompressed_length = zentry.uncompressed_length;
+    entry.stored = (zentry.method == kCompressStored);
+    index->entries.push_back(std::move(entry));
   }
   EndIteration(iteration_cookie);
-  if (!found) {
+  std::sort(index->entries.begin(), index->entries.end(),
+            [](const ZipEntryIndex::Entry& e1, const ZipEntryIndex::Entry& e2) {
+              return e1.offset < e2.offset;
+            });
+  for (size_t i = 0; i < index->entries.size(); ++i) {
+    index->name_to_entry[index->entries[i].name] = i;
+  }
+
+  std::lock_guard<std::mutex> lock(apk_cache_mutex);
+  zip_entry_index_cache_[apk_path] = index;
+  return index;
+}
+
+std::unique_ptr<EmbeddedElf> ApkInspector::FindElfInApkByOffsetWithoutCache(const std::string& apk_path,
+                                                                            uint64_t file_offset) {
+  std::shared_ptr<const ZipEntryIndex> index = GetZipEntryIndex(apk_path);
+  if (index == nullptr) {
+    return nullptr;
+  }
+
+  // Look for a zip entry corresponding to an uncompressed blob whose range intersects with the
+  // mmap offset we're interested in.
+  auto it = std::upper_bound(index->entries.begin(), index->entries.end(), file_offset,
+                             [](uint64_t offset, const ZipEntryIndex::Entry& entry) {
+                               return offset < entry.offset;
+                             });
+  if (it == index->entries.begin()) {
+    return nullptr;
+  }
+  const ZipEntryIndex::Entry& entry = *--it;
+  if (!entry.stored || file_offset >= entry.offset + entry.uncompressed_length) {
     return nullptr;
   }
 
   // We found something in the zip file at the right spot. Is it an ELF?
-  if (lseek(fhelper.fd(), zentry.offset, SEEK_SET) != zentry.offset) {
-    PLOG(ERROR) << "lseek() failed in " << apk_path << " offset " << zentry.offset;
+  FileHelper fhelper = FileHelper::OpenReadOnly(apk_path);
+  if (!fhelper) {
+    return nullptr;
+  }
+  if (lseek(fhelper.fd(), entry.offset, SEEK_SET) != static_cast<off_t>(entry.offset)) {
+    PLOG(ERROR) << "lseek() failed in " << apk_path << " offset " << entry.offset;
     return nullptr;
   }
-  std::string entry_name;
-  entry_name.resize(zname.name_length,'\0');
-  memcpy(&entry_name[0], zname.name, zname.name_length);
   if (!IsValidElfFile(fhelper.fd())) {
     LOG(ERROR) << "problems reading ELF from in " << apk_path << " entry '"
-               << entry_name << "'";
+               << entry.name << "'";
     return nullptr;
   }
 
   // Elf found: add EmbeddedElf to vector, update cache.
-  return std::unique_ptr<EmbeddedElf>(new EmbeddedElf(apk_path, entry_name, zentry.offset,
-                                                      zentry.uncompressed_length));
+  return std::unique_ptr<EmbeddedElf>(new EmbeddedElf(apk_path, entry.name, entry.offset,
+                                                      entry.uncompressed_length));
 }
 
 std::unique_ptr<EmbeddedElf> ApkInspector::FindElfInApkByName(const std::string& apk_path,
                                                               const std::string& elf_filename) {
-  if (!IsValidApkPath(apk_path)) {
+  std::shared_ptr<const ZipEntryIndex> index = GetZipEntryIndex(apk_path);
+  if (index == nullptr) {
     return nullptr;
   }
-  FileHelper fhelper = FileHelper::OpenReadOnly(apk_path);
-  if (!fhelper) {
-    return nullptr;
-  }
-  ArchiveHelper ahelper(fhelper.fd(), apk_path);
-  if (!ahelper) {
-    return nullptr;
-  }
-  ZipArchiveHandle& handle = ahelper.archive_handle();
-  ZipEntry zentry;
-  int32_t rc = FindEntry(handle, ZipString(elf_filename.c_str()), &zentry);
-  if (rc != 0) {
-    LOG(ERROR) << "failed to find " << elf_filename << " in " << apk_path
-        << ": " << ErrorCodeString(rc);
+  auto it = index->name_to_entry.find(elf_filename);
+  if (it == index->name_to_entry.end()) {
+    LOG(ERROR) << "failed to find " << elf_filename << " in " << apk_path;
     return nullptr;
   }
-  if (zentry.method != kCompressStored || zentry.compressed_length != zentry.uncompressed_length) {
+  const ZipEntryIndex::Entry& entry = index->entries[it->second];
+  if (!entry.stored || entry.compressed_length != entry.uncompressed_length) {
     LOG(ERROR) << "shared library " << elf_filename << " in " << apk_path << " is compressed";
     return nullptr;
   }
-  return std::unique_ptr<EmbeddedElf>(new EmbeddedElf(apk_path, elf_filename, zentry.offset,
-                                                  zentry.uncompressed_length));
+  return std::unique_ptr<EmbeddedElf>(new EmbeddedElf(apk_path, elf_filename, entry.offset,
+                                                      entry.uncompressed_length));
 }
 
 bool IsValidApkPath(const std::string& apk_path) {
@@ -23,6 +23,7 @@
 #include <memory>
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include "read_elf.h"
 
@@ -79,10 +80,16 @@ class ApkInspector {
   static std::unique_ptr<EmbeddedElf> FindElfInApkByOffsetWithoutCache(const std::string& apk_path,
                                                                        uint64_t file_offset);
 
+  // Entries of an APK file, read from its central directory once, so looking up embedded ELF
+  // files doesn't rescan the zip file.
+  struct ZipEntryIndex;
+  static std::shared_ptr<const ZipEntryIndex> GetZipEntryIndex(const std::string& apk_path);
+
   // First component of pair is APK file path, second is offset into APK.
   typedef std::pair<std::string, uint64_t> ApkOffset;
 
   static std::map<ApkOffset, std::unique_ptr<EmbeddedElf>> embedded_elf_cache_;
+  static std::map<std::string, std::shared_ptr<const ZipEntryIndex>> zip_entry_index_cache_;
 };
 
 // Export for test only.
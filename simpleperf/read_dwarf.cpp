@@ -0,0 +1,1105 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "read_dwarf.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+#include <android-base/logging.h>
+
+// Constants from the DWARF 5 standard, only the ones used here.
+enum {
+  DW_TAG_inlined_subroutine = 0x1d,
+  DW_TAG_compile_unit = 0x11,
+  DW_TAG_partial_unit = 0x3c,
+};
+
+enum {
+  DW_AT_stmt_list = 0x10,
+  DW_AT_low_pc = 0x11,
+  DW_AT_high_pc = 0x12,
+  DW_AT_ranges = 0x55,
+  DW_AT_call_file = 0x58,
+  DW_AT_call_line = 0x59,
+  DW_AT_addr_base = 0x73,
+  DW_AT_rnglists_base = 0x74,
+};
+
+enum {
+  DW_FORM_addr = 0x01,
+  DW_FORM_block2 = 0x03,
+  DW_FORM_block4 = 0x04,
+  DW_FORM_data2 = 0x05,
+  DW_FORM_data4 = 0x06,
+  DW_FORM_data8 = 0x07,
+  DW_FORM_string = 0x08,
+  DW_FORM_block = 0x09,
+  DW_FORM_block1 = 0x0a,
+  DW_FORM_data1 = 0x0b,
+  DW_FORM_flag = 0x0c,
+  DW_FORM_sdata = 0x0d,
+  DW_FORM_strp = 0x0e,
+  DW_FORM_udata = 0x0f,
+  DW_FORM_ref_addr = 0x10,
+  DW_FORM_ref1 = 0x11,
+  DW_FORM_ref2 = 0x12,
+  DW_FORM_ref4 = 0x13,
+  DW_FORM_ref8 = 0x14,
+  DW_FORM_ref_udata = 0x15,
+  DW_FORM_indirect = 0x16,
+  DW_FORM_sec_offset = 0x17,
+  DW_FORM_exprloc = 0x18,
+  DW_FORM_flag_present = 0x19,
+  DW_FORM_strx = 0x1a,
+  DW_FORM_addrx = 0x1b,
+  DW_FORM_ref_sup4 = 0x1c,
+  DW_FORM_strp_sup = 0x1d,
+  DW_FORM_data16 = 0x1e,
+  DW_FORM_line_strp = 0x1f,
+  DW_FORM_ref_sig8 = 0x20,
+  DW_FORM_implicit_const = 0x21,
+  DW_FORM_loclistx = 0x22,
+  DW_FORM_rnglistx = 0x23,
+  DW_FORM_ref_sup8 = 0x24,
+  DW_FORM_strx1 = 0x25,
+  DW_FORM_strx2 = 0x26,
+  DW_FORM_strx3 = 0x27,
+  DW_FORM_strx4 = 0x28,
+  DW_FORM_addrx1 = 0x29,
+  DW_FORM_addrx2 = 0x2a,
+  DW_FORM_addrx3 = 0x2b,
+  DW_FORM_addrx4 = 0x2c,
+  DW_FORM_GNU_addr_index = 0x1f01,
+  DW_FORM_GNU_str_index = 0x1f02,
+  DW_FORM_GNU_ref_alt = 0x1f20,
+  DW_FORM_GNU_strp_alt = 0x1f21,
+};
+
+enum {
+  DW_LNS_copy = 1,
+  DW_LNS_advance_pc = 2,
+  DW_LNS_advance_line = 3,
+  DW_LNS_set_file = 4,
+  DW_LNS_const_add_pc = 8,
+  DW_LNS_fixed_advance_pc = 9,
+  DW_LNE_end_sequence = 1,
+  DW_LNE_set_address = 2,
+  DW_LNE_define_file = 3,
+  DW_LNCT_path = 1,
+  DW_LNCT_directory_index = 2,
+};
+
+enum {
+  DW_UT_compile = 1,
+  DW_UT_partial = 3,
+};
+
+enum {
+  DW_RLE_end_of_list = 0,
+  DW_RLE_base_addressx = 1,
+  DW_RLE_startx_endx = 2,
+  DW_RLE_startx_length = 3,
+  DW_RLE_offset_pair = 4,
+  DW_RLE_base_address = 5,
+  DW_RLE_start_end = 6,
+  DW_RLE_start_length = 7,
+};
+
+// Reads little-endian values from [pos, end) of a section. Reading past the end returns zeros and
+// sets an error checked by ok(), so parsers only check it at points where they make decisions.
+class DwarfReader {
+ public:
+  DwarfReader(const std::string& data, uint64_t pos)
+      : data_(data.data()), pos_(pos), end_(data.size()), ok_(pos <= data.size()) {
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+  uint64_t pos() const {
+    return pos_;
+  }
+
+  uint64_t end() const {
+    return end_;
+  }
+
+  // Limit reading to [pos, end), like to the current unit.
+  void SetEnd(uint64_t end) {
+    if (end < end_) {
+      end_ = end;
+    }
+  }
+
+  void Seek(uint64_t pos) {
+    if (pos > end_) {
+      ok_ = false;
+      pos = end_;
+    }
+    pos_ = pos;
+  }
+
+  void Skip(uint64_t size) {
+    if (size > end_ - pos_) {
+      ok_ = false;
+      pos_ = end_;
+    } else {
+      pos_ += size;
+    }
+  }
+
+  uint64_t ReadUnsigned(size_t size) {
+    if (size > 8 || size > end_ - pos_) {
+      ok_ = false;
+      pos_ = end_;
+      return 0;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+      value |= static_cast<uint64_t>(static_cast<unsigned char>(data_[pos_ + i])) << (8 * i);
+    }
+    pos_ += size;
+    return value;
+  }
+
+  uint8_t U8() {
+    return ReadUnsigned(1);
+  }
+
+  uint16_t U16() {
+    return ReadUnsigned(2);
+  }
+
+  uint32_t U32() {
+    return ReadUnsigned(4);
+  }
+
+  uint64_t U64() {
+    return ReadUnsigned(8);
+  }
+
+  uint64_t Uleb() {
+    uint64_t value = 0;
+    for (uint32_t shift = 0; pos_ < end_; shift += 7) {
+      uint8_t byte = data_[pos_++];
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  int64_t Sleb() {
+    int64_t value = 0;
+    for (uint32_t shift = 0; pos_ < end_;) {
+      uint8_t byte = data_[pos_++];
+      if (shift < 64) {
+        value |= static_cast<int64_t>(static_cast<uint64_t>(byte & 0x7f) << shift);
+      }
+      shift += 7;
+      if ((byte & 0x80) == 0) {
+        if (shift < 64 && (byte & 0x40)) {
+          value |= static_cast<int64_t>(~0ULL << shift);
+        }
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  const char* CStr() {
+    const void* p = memchr(data_ + pos_, '\0', end_ - pos_);
+    if (p == nullptr) {
+      ok_ = false;
+      pos_ = end_;
+      return "";
+    }
+    const char* s = data_ + pos_;
+    pos_ = static_cast<const char*>(p) - data_ + 1;
+    return s;
+  }
+
+ private:
+  const char* data_;
+  uint64_t pos_;
+  uint64_t end_;
+  bool ok_;
+};
+
+// Return the string at offset of a string section, or nullptr.
+static const char* StringAt(const std::string& section, uint64_t offset) {
+  if (offset >= section.size() || memchr(section.data() + offset, '\0',
+                                         section.size() - offset) == nullptr) {
+    return nullptr;
+  }
+  return section.data() + offset;
+}
+
+// Read the unit length starting a unit of a DWARF section, and limit the reader to the unit.
+// Return false if the length is invalid, in which case units after it can't be found.
+static bool ReadUnitLength(DwarfReader* r, size_t* offset_size) {
+  uint64_t length = r->U32();
+  *offset_size = 4;
+  if (length == 0xffffffff) {
+    length = r->U64();
+    *offset_size = 8;
+  } else if (length >= 0xfffffff0) {
+    return false;
+  }
+  if (!r->ok() || length > r->end() - r->pos()) {
+    return false;
+  }
+  r->SetEnd(r->pos() + length);
+  return true;
+}
+
+// Linkers resolve addresses of code removed from the output, like by --gc-sections, to zero or
+// to a tombstone value of all ones (minus one for .debug_ranges), so skip them.
+static bool IsRemovedAddress(uint64_t addr, size_t address_size) {
+  uint64_t max_addr = (address_size >= 8) ? std::numeric_limits<uint64_t>::max()
+                                          : (1ULL << (8 * address_size)) - 1;
+  return addr == 0 || addr >= max_addr - 1;
+}
+
+namespace {
+
+// Intern paths of source files into DwarfLineInfo::files.
+class FileTable {
+ public:
+  explicit FileTable(std::vector<std::string>* files) : files_(files) {
+  }
+
+  uint32_t Add(const std::string& dir, const std::string& name) {
+    std::string path = (dir.empty() || name[0] == '/') ? name : dir + "/" + name;
+    auto it = index_.find(path);
+    if (it != index_.end()) {
+      return it->second;
+    }
+    uint32_t index = files_->size();
+    files_->push_back(path);
+    index_[path] = index;
+    return index;
+  }
+
+ private:
+  std::vector<std::string>* files_;
+  std::unordered_map<std::string, uint32_t> index_;
+};
+
+// A line program maps file numbers used in it to indexes of DwarfLineInfo::files.
+// NO_INLINED_CALL marks numbers without a file, like 0 before DWARF 5.
+typedef std::vector<uint32_t> FileMap;
+
+struct LineProgramParser {
+  const DwarfSections& sections;
+  FileTable& file_table;
+
+  // Read a string of an entry in the directory or file name tables of a DWARF 5 line program.
+  bool ReadEntryString(DwarfReader* r, uint64_t form, size_t offset_size, std::string* s) {
+    const char* p = nullptr;
+    if (form == DW_FORM_string) {
+      p = r->CStr();
+    } else if (form == DW_FORM_line_strp) {
+      p = StringAt(sections.debug_line_str, r->ReadUnsigned(offset_size));
+    } else if (form == DW_FORM_strp) {
+      p = StringAt(sections.debug_str, r->ReadUnsigned(offset_size));
+    }
+    if (p == nullptr || !r->ok()) {
+      return false;
+    }
+    *s = p;
+    return true;
+  }
+
+  bool SkipEntryValue(DwarfReader* r, uint64_t form, size_t offset_size, uint64_t* value) {
+    *value = 0;
+    switch (form) {
+      case DW_FORM_data1: *value = r->U8(); break;
+      case DW_FORM_data2: *value = r->U16(); break;
+      case DW_FORM_data4: *value = r->U32(); break;
+      case DW_FORM_data8: *value = r->U64(); break;
+      case DW_FORM_udata: *value = r->Uleb(); break;
+      case DW_FORM_data16: r->Skip(16); break;
+      case DW_FORM_block: r->Skip(r->Uleb()); break;
+      case DW_FORM_string: r->CStr(); break;
+      case DW_FORM_line_strp:
+      case DW_FORM_strp: r->Skip(offset_size); break;
+      default:
+        return false;
+    }
+    return r->ok();
+  }
+
+  // Read the directory or file name table of a DWARF 5 line program, as (directory index, path)
+  // pairs.
+  bool ReadEntryTable(DwarfReader* r, size_t offset_size,
+                      std::vector<std::pair<uint64_t, std::string>>* entries) {
+    std::vector<std::pair<uint64_t, uint64_t>> formats(r->U8());
+    for (auto& format : formats) {
+      format.first = r->Uleb();
+      format.second = r->Uleb();
+    }
+    uint64_t count = r->Uleb();
+    for (uint64_t i = 0; i < count && r->ok(); ++i) {
+      std::pair<uint64_t, std::string> entry(0, "");
+      for (auto& format : formats) {
+        if (format.first == DW_LNCT_path) {
+          if (!ReadEntryString(r, format.second, offset_size, &entry.second)) {
+            return false;
+          }
+        } else {
+          uint64_t value;
+          if (!SkipEntryValue(r, format.second, offset_size, &value)) {
+            return false;
+          }
+          if (format.first == DW_LNCT_directory_index) {
+            entry.first = value;
+          }
+        }
+      }
+      entries->push_back(entry);
+    }
+    return r->ok();
+  }
+
+  // Parse the line program at offset of .debug_line. Set *next_offset to the offset of the next
+  // line program, or leave it unchanged if it can't be found. If rows isn't nullptr, append
+  // rows of its sequences to it, and their positions in rows to sequences.
+  bool Parse(uint64_t offset, uint64_t* next_offset, FileMap* file_map,
+             std::vector<DwarfLineRow>* rows,
+             std::vector<std::pair<size_t, size_t>>* sequences) {
+    DwarfReader r(sections.debug_line, offset);
+    size_t offset_size;
+    if (!ReadUnitLength(&r, &offset_size)) {
+      return false;
+    }
+    *next_offset = r.end();
+    uint16_t version = r.U16();
+    if (version < 2 || version > 5) {
+      LOG(DEBUG) << "unsupported .debug_line version " << version << " at offset " << offset;
+      return false;
+    }
+    if (version >= 5) {
+      r.U8();  // address_size
+      r.U8();  // segment_selector_size
+    }
+    uint64_t header_length = r.ReadUnsigned(offset_size);
+    uint64_t program_start = r.pos() + header_length;
+    uint8_t min_inst_length = r.U8();
+    if (version >= 4) {
+      r.U8();  // maximum_operations_per_instruction
+    }
+    r.U8();  // default_is_stmt
+    int8_t line_base = static_cast<int8_t>(r.U8());
+    uint8_t line_range = r.U8();
+    uint8_t opcode_base = r.U8();
+    std::vector<uint8_t> opcode_lengths;
+    for (int i = 1; i < opcode_base; ++i) {
+      opcode_lengths.push_back(r.U8());
+    }
+    if (!r.ok() || line_range == 0 || program_start > r.end()) {
+      return false;
+    }
+
+    std::vector<std::string> dirs;
+    file_map->clear();
+    if (version >= 5) {
+      std::vector<std::pair<uint64_t, std::string>> entries;
+      if (!ReadEntryTable(&r, offset_size, &entries)) {
+        return false;
+      }
+      for (auto& entry : entries) {
+        dirs.push_back(entry.second);
+      }
+      entries.clear();
+      if (!ReadEntryTable(&r, offset_size, &entries)) {
+        return false;
+      }
+      for (auto& entry : entries) {
+        file_map->push_back(
+            file_table.Add(entry.first < dirs.size() ? dirs[entry.first] : "", entry.second));
+      }
+    } else {
+      // Directory 0 is the compilation directory, and file 0 isn't used.
+      dirs.push_back("");
+      while (true) {
+        const char* dir = r.CStr();
+        if (!r.ok() || *dir == '\0') {
+          break;
+        }
+        dirs.push_back(dir);
+      }
+      file_map->push_back(NO_INLINED_CALL);
+      while (true) {
+        const char* name = r.CStr();
+        if (!r.ok() || *name == '\0') {
+          break;
+        }
+        uint64_t dir = r.Uleb();
+        r.Uleb();  // modification time
+        r.Uleb();  // file length
+        file_map->push_back(file_table.Add(dir < dirs.size() ? dirs[dir] : "", name));
+      }
+    }
+    if (!r.ok()) {
+      return false;
+    }
+    if (rows == nullptr) {
+      return true;
+    }
+
+    r.Seek(program_start);
+    uint64_t addr = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    size_t address_size = 8;
+    size_t sequence_start = rows->size();
+    auto add_row = [&](bool end_sequence) {
+      DwarfLineRow row;
+      row.addr = addr;
+      row.file = 0;
+      row.line = 0;
+      if (!end_sequence && file < file_map->size() && (*file_map)[file] != NO_INLINED_CALL &&
+          line > 0 && line <= std::numeric_limits<uint32_t>::max()) {
+        row.file = (*file_map)[file];
+        row.line = static_cast<uint32_t>(line);
+      }
+      rows->push_back(row);
+    };
+    while (r.pos() < r.end() && r.ok()) {
+      uint8_t opcode = r.U8();
+      if (opcode >= opcode_base) {
+        uint8_t adjusted = opcode - opcode_base;
+        addr += (adjusted / line_range) * min_inst_length;
+        line += line_base + adjusted % line_range;
+        add_row(false);
+      } else if (opcode == 0) {
+        uint64_t length = r.Uleb();
+        if (length == 0 || length > r.end() - r.pos()) {
+          continue;
+        }
+        uint64_t end = r.pos() + length;
+        uint8_t sub_opcode = r.U8();
+        if (sub_opcode == DW_LNE_end_sequence) {
+          add_row(true);
+          if (rows->size() - sequence_start < 2 ||
+              IsRemovedAddress((*rows)[sequence_start].addr, address_size)) {
+            rows->resize(sequence_start);
+          } else {
+            sequences->push_back(std::make_pair(sequence_start, rows->size()));
+          }
+          sequence_start = rows->size();
+          addr = 0;
+          file = 1;
+          line = 1;
+        } else if (sub_opcode == DW_LNE_set_address) {
+          address_size = length - 1;
+          addr = r.ReadUnsigned(address_size);
+        } else if (sub_opcode == DW_LNE_define_file && version < 5) {
+          const char* name = r.CStr();
+          uint64_t dir = r.Uleb();
+          file_map->push_back(file_table.Add(dir < dirs.size() ? dirs[dir] : "", name));
+        }
+        r.Seek(end);
+      } else if (opcode == DW_LNS_copy) {
+        add_row(false);
+      } else if (opcode == DW_LNS_advance_pc) {
+        addr += r.Uleb() * min_inst_length;
+      } else if (opcode == DW_LNS_advance_line) {
+        line += r.Sleb();
+      } else if (opcode == DW_LNS_set_file) {
+        file = r.Uleb();
+      } else if (opcode == DW_LNS_const_add_pc) {
+        addr += ((255 - opcode_base) / line_range) * min_inst_length;
+      } else if (opcode == DW_LNS_fixed_advance_pc) {
+        addr += r.U16();
+      } else {
+        // Other standard opcodes only change columns or flags.
+        for (uint8_t i = 0; i < opcode_lengths[opcode - 1]; ++i) {
+          r.Uleb();
+        }
+      }
+    }
+    // Drop rows of a sequence without an end.
+    rows->resize(sequence_start);
+    return true;
+  }
+};
+
+struct Abbrev {
+  struct Attr {
+    uint64_t attr;
+    uint64_t form;
+    int64_t implicit_const;
+  };
+  uint64_t tag = 0;
+  bool has_children = false;
+  std::vector<Attr> attrs;
+};
+
+// Abbrevs of a table in .debug_abbrev indexed by code, with tag 0 for unused codes.
+typedef std::vector<Abbrev> AbbrevTable;
+
+static bool ParseAbbrevTable(const std::string& debug_abbrev, uint64_t offset,
+                             AbbrevTable* table) {
+  DwarfReader r(debug_abbrev, offset);
+  while (true) {
+    uint64_t code = r.Uleb();
+    if (!r.ok()) {
+      return false;
+    }
+    if (code == 0) {
+      return true;
+    }
+    // Codes are usually numbered from 1, so a vector is enough.
+    if (code > 100000) {
+      return false;
+    }
+    if (code >= table->size()) {
+      table->resize(code + 1);
+    }
+    Abbrev& abbrev = (*table)[code];
+    abbrev.tag = r.Uleb();
+    abbrev.has_children = r.U8() != 0;
+    while (true) {
+      Abbrev::Attr attr;
+      attr.attr = r.Uleb();
+      attr.form = r.Uleb();
+      attr.implicit_const = (attr.form == DW_FORM_implicit_const) ? r.Sleb() : 0;
+      if (!r.ok()) {
+        return false;
+      }
+      if (attr.attr == 0 && attr.form == 0) {
+        break;
+      }
+      abbrev.attrs.push_back(attr);
+    }
+  }
+}
+
+struct FormValue {
+  enum Kind {
+    NONE,
+    CONSTANT,
+    ADDRESS,
+    ADDRESS_INDEX,
+    OFFSET,
+    RNGLIST_INDEX,
+  };
+  Kind kind = NONE;
+  uint64_t value = 0;
+};
+
+struct UnitInfo {
+  uint16_t version;
+  size_t offset_size;
+  size_t address_size;
+  uint64_t addr_base;
+  uint64_t rnglists_base;
+  uint64_t base_address;
+  const FileMap* file_map;
+};
+
+struct InlinedInterval {
+  uint64_t begin;
+  uint64_t end;
+  uint32_t call;
+  uint32_t depth;
+};
+
+struct DebugInfoParser {
+  const DwarfSections& sections;
+  std::unordered_map<uint64_t, FileMap>& file_maps;
+  LineProgramParser& line_parser;
+  std::vector<DwarfInlinedCall>* calls;
+  std::vector<InlinedInterval>* intervals;
+  std::unordered_map<uint64_t, AbbrevTable> abbrev_tables;
+
+  bool ReadForm(DwarfReader* r, uint64_t form, int64_t implicit_const, const UnitInfo& unit,
+                FormValue* v) {
+    v->kind = FormValue::NONE;
+    v->value = 0;
+    switch (form) {
+      case DW_FORM_addr:
+        v->kind = FormValue::ADDRESS;
+        v->value = r->ReadUnsigned(unit.address_size);
+        break;
+      case DW_FORM_data1:
+      case DW_FORM_ref1:
+      case DW_FORM_flag:
+      case DW_FORM_strx1:
+        v->kind = FormValue::CONSTANT;
+        v->value = r->U8();
+        break;
+      case DW_FORM_data2:
+      case DW_FORM_ref2:
+      case DW_FORM_strx2:
+        v->kind = FormValue::CONSTANT;
+        v->value = r->U16();
+        break;
+      case DW_FORM_strx3:
+        r->Skip(3);
+        break;
+      case DW_FORM_data4:
+      case DW_FORM_ref4:
+      case DW_FORM_ref_sup4:
+      case DW_FORM_strx4:
+        v->kind = FormValue::CONSTANT;
+        v->value = r->U32();
+        break;
+      case DW_FORM_data8:
+      case DW_FORM_ref8:
+      case DW_FORM_ref_sig8:
+      case DW_FORM_ref_sup8:
+        v->kind = FormValue::CONSTANT;
+        v->value = r->U64();
+        break;
+      case DW_FORM_data16:
+        r->Skip(16);
+        break;
+      case DW_FORM_udata:
+      case DW_FORM_ref_udata:
+      case DW_FORM_strx:
+      case DW_FORM_loclistx:
+      case DW_FORM_GNU_str_index:
+        v->kind = FormValue::CONSTANT;
+        v->value = r->Uleb();
+        break;
+      case DW_FORM_sdata:
+        v->kind = FormValue::CONSTANT;
+        v->value = static_cast<uint64_t>(r->Sleb());
+        break;
+      case DW_FORM_implicit_const:
+        v->kind = FormValue::CONSTANT;
+        v->value = static_cast<uint64_t>(implicit_const);
+        break;
+      case DW_FORM_string:
+        r->CStr();
+        break;
+      case DW_FORM_block1:
+        r->Skip(r->U8());
+        break;
+      case DW_FORM_block2:
+        r->Skip(r->U16());
+        break;
+      case DW_FORM_block4:
+        r->Skip(r->U32());
+        break;
+      case DW_FORM_block:
+      case DW_FORM_exprloc:
+        r->Skip(r->Uleb());
+        break;
+      case DW_FORM_flag_present:
+        v->kind = FormValue::CONSTANT;
+        v->value = 1;
+        break;
+      case DW_FORM_ref_addr:
+        r->Skip(unit.version <= 2 ? unit.address_size : unit.offset_size);
+        break;
+      case DW_FORM_strp:
+      case DW_FORM_line_strp:
+      case DW_FORM_strp_sup:
+      case DW_FORM_GNU_ref_alt:
+      case DW_FORM_GNU_strp_alt:
+        r->Skip(unit.offset_size);
+        break;
+      case DW_FORM_sec_offset:
+        v->kind = FormValue::OFFSET;
+        v->value = r->ReadUnsigned(unit.offset_size);
+        break;
+      case DW_FORM_addrx:
+      case DW_FORM_GNU_addr_index:
+        v->kind = FormValue::ADDRESS_INDEX;
+        v->value = r->Uleb();
+        break;
+      case DW_FORM_addrx1:
+      case DW_FORM_addrx2:
+      case DW_FORM_addrx3:
+      case DW_FORM_addrx4:
+        v->kind = FormValue::ADDRESS_INDEX;
+        v->value = r->ReadUnsigned(form - DW_FORM_addrx1 + 1);
+        break;
+      case DW_FORM_rnglistx:
+        v->kind = FormValue::RNGLIST_INDEX;
+        v->value = r->Uleb();
+        break;
+      case DW_FORM_indirect:
+        return ReadForm(r, r->Uleb(), implicit_const, unit, v);
+      default:
+        return false;
+    }
+    return r->ok();
+  }
+
+  bool ReadAddressAtIndex(const UnitInfo& unit, uint64_t index, uint64_t* addr) {
+    DwarfReader r(sections.debug_addr, unit.addr_base + index * unit.address_size);
+    *addr = r.ReadUnsigned(unit.address_size);
+    return r.ok();
+  }
+
+  bool GetAddress(const UnitInfo& unit, const FormValue& v, uint64_t* addr) {
+    if (v.kind == FormValue::ADDRESS) {
+      *addr = v.value;
+      return true;
+    }
+    return v.kind == FormValue::ADDRESS_INDEX && ReadAddressAtIndex(unit, v.value, addr);
+  }
+
+  // Read the address ranges referred to by a DW_AT_ranges value.
+  bool ReadRanges(const UnitInfo& unit, const FormValue& v,
+                  std::vector<std::pair<uint64_t, uint64_t>>* ranges) {
+    uint64_t base = unit.base_address;
+    if (unit.version < 5) {
+      DwarfReader r(sections.debug_ranges, v.value);
+      uint64_t max_addr = (unit.address_size >= 8) ? std::numeric_limits<uint64_t>::max()
+                                                   : (1ULL << (8 * unit.address_size)) - 1;
+      while (r.ok()) {
+        uint64_t begin = r.ReadUnsigned(unit.address_size);
+        uint64_t end = r.ReadUnsigned(unit.address_size);
+        if (!r.ok() || (begin == 0 && end == 0)) {
+          break;
+        }
+        if (begin == max_addr) {
+          base = end;
+        } else {
+          ranges->push_back(std::make_pair(base + begin, base + end));
+        }
+      }
+      return r.ok();
+    }
+    uint64_t offset = v.value;
+    if (v.kind == FormValue::RNGLIST_INDEX) {
+      DwarfReader r(sections.debug_rnglists, unit.rnglists_base + v.value * unit.offset_size);
+      offset = unit.rnglists_base + r.ReadUnsigned(unit.offset_size);
+      if (!r.ok()) {
+        return false;
+      }
+    }
+    DwarfReader r(sections.debug_rnglists, offset);
+    while (r.ok()) {
+      uint8_t kind = r.U8();
+      uint64_t begin = 0;
+      uint64_t end = 0;
+      bool valid = true;
+      switch (kind) {
+        case DW_RLE_end_of_list:
+          return r.ok();
+        case DW_RLE_base_addressx:
+          ReadAddressAtIndex(unit, r.Uleb(), &base);
+          continue;
+        case DW_RLE_startx_endx:
+          valid = ReadAddressAtIndex(unit, r.Uleb(), &begin);
+          valid = ReadAddressAtIndex(unit, r.Uleb(), &end) && valid;
+          break;
+        case DW_RLE_startx_length:
+          valid = ReadAddressAtIndex(unit, r.Uleb(), &begin);
+          end = begin + r.Uleb();
+          break;
+        case DW_RLE_offset_pair:
+          begin = base + r.Uleb();
+          end = base + r.Uleb();
+          break;
+        case DW_RLE_base_address:
+          base = r.ReadUnsigned(unit.address_size);
+          continue;
+        case DW_RLE_start_end:
+          begin = r.ReadUnsigned(unit.address_size);
+          end = r.ReadUnsigned(unit.address_size);
+          break;
+        case DW_RLE_start_length:
+          begin = r.ReadUnsigned(unit.address_size);
+          end = begin + r.Uleb();
+          break;
+        default:
+          return false;
+      }
+      if (valid) {
+        ranges->push_back(std::make_pair(begin, end));
+      }
+    }
+    return false;
+  }
+
+  const FileMap* GetFileMap(uint64_t stmt_list) {
+    auto it = file_maps.find(stmt_list);
+    if (it == file_maps.end()) {
+      // The line program wasn't reached by walking .debug_line, so only read its file names.
+      FileMap file_map;
+      uint64_t next_offset;
+      line_parser.Parse(stmt_list, &next_offset, &file_map, nullptr, nullptr);
+      it = file_maps.insert(std::make_pair(stmt_list, std::move(file_map))).first;
+    }
+    return &it->second;
+  }
+
+  // Parse the unit at offset of .debug_info. Set *next_offset to the offset of the next unit, or
+  // leave it unchanged if it can't be found.
+  bool ParseUnit(uint64_t offset, uint64_t* next_offset) {
+    DwarfReader r(sections.debug_info, offset);
+    UnitInfo unit;
+    if (!ReadUnitLength(&r, &unit.offset_size)) {
+      return false;
+    }
+    *next_offset = r.end();
+    unit.version = r.U16();
+    uint64_t abbrev_offset;
+    if (unit.version == 5) {
+      uint8_t unit_type = r.U8();
+      if (unit_type != DW_UT_compile && unit_type != DW_UT_partial) {
+        return true;
+      }
+      unit.address_size = r.U8();
+      abbrev_offset = r.ReadUnsigned(unit.offset_size);
+    } else if (unit.version >= 2 && unit.version <= 4) {
+      abbrev_offset = r.ReadUnsigned(unit.offset_size);
+      unit.address_size = r.U8();
+    } else {
+      LOG(DEBUG) << "unsupported .debug_info version " << unit.version << " at offset " << offset;
+      return false;
+    }
+    if (!r.ok() || (unit.address_size != 4 && unit.address_size != 8)) {
+      return false;
+    }
+    // Defaults used when the unit doesn't have DW_AT_addr_base or DW_AT_rnglists_base: the size
+    // of the header of .debug_addr and .debug_rnglists.
+    unit.addr_base = (unit.offset_size == 8) ? 16 : 8;
+    unit.rnglists_base = (unit.offset_size == 8) ? 20 : 12;
+    unit.base_address = 0;
+    unit.file_map = nullptr;
+
+    auto abbrev_it = abbrev_tables.find(abbrev_offset);
+    if (abbrev_it == abbrev_tables.end()) {
+      AbbrevTable table;
+      if (!ParseAbbrevTable(sections.debug_abbrev, abbrev_offset, &table)) {
+        LOG(DEBUG) << "invalid abbrev table at offset " << abbrev_offset;
+        table.clear();
+      }
+      abbrev_it = abbrev_tables.insert(std::make_pair(abbrev_offset, std::move(table))).first;
+    }
+    const AbbrevTable& abbrevs = abbrev_it->second;
+
+    // The innermost inlined call containing each DIE having children, from the unit DIE.
+    std::vector<uint32_t> parents;
+    bool is_unit_die = true;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    while (r.pos() < r.end()) {
+      uint64_t code = r.Uleb();
+      if (!r.ok()) {
+        return false;
+      }
+      if (code == 0) {
+        if (!parents.empty()) {
+          parents.pop_back();
+        }
+        continue;
+      }
+      if (code >= abbrevs.size() || abbrevs[code].tag == 0) {
+        return false;
+      }
+      const Abbrev& abbrev = abbrevs[code];
+      FormValue low_pc;
+      FormValue high_pc;
+      FormValue ranges_value;
+      FormValue call_file;
+      FormValue call_line;
+      FormValue stmt_list;
+      for (auto& attr : abbrev.attrs) {
+        FormValue v;
+        if (!ReadForm(&r, attr.form, attr.implicit_const, unit, &v)) {
+          return false;
+        }
+        switch (attr.attr) {
+          case DW_AT_low_pc: low_pc = v; break;
+          case DW_AT_high_pc: high_pc = v; break;
+          case DW_AT_ranges: ranges_value = v; break;
+          case DW_AT_call_file: call_file = v; break;
+          case DW_AT_call_line: call_line = v; break;
+          case DW_AT_stmt_list: stmt_list = v; break;
+          case DW_AT_addr_base:
+            unit.addr_base = v.value;
+            break;
+          case DW_AT_rnglists_base:
+            unit.rnglists_base = v.value;
+            break;
+        }
+      }
+      uint32_t parent = parents.empty() ? NO_INLINED_CALL : parents.back();
+      uint32_t call = parent;
+      if (is_unit_die) {
+        if (abbrev.tag != DW_TAG_compile_unit && abbrev.tag != DW_TAG_partial_unit) {
+          return true;
+        }
+        is_unit_die = false;
+        if (stmt_list.kind == FormValue::NONE) {
+          // Without a line program, call_file can't be resolved.
+          return true;
+        }
+        unit.file_map = GetFileMap(stmt_list.value);
+        GetAddress(unit, low_pc, &unit.base_address);
+      } else if (abbrev.tag == DW_TAG_inlined_subroutine) {
+        DwarfInlinedCall inlined_call;
+        inlined_call.file = 0;
+        inlined_call.line = 0;
+        if (call_file.value < unit.file_map->size() &&
+            (*unit.file_map)[call_file.value] != NO_INLINED_CALL &&
+            call_line.value <= std::numeric_limits<uint32_t>::max()) {
+          inlined_call.file = (*unit.file_map)[call_file.value];
+          inlined_call.line = call_line.value;
+        }
+        inlined_call.parent = parent;
+        call = calls->size();
+        calls->push_back(inlined_call);
+
+        ranges.clear();
+        uint64_t low;
+        if (GetAddress(unit, low_pc, &low) && high_pc.kind != FormValue::NONE) {
+          uint64_t high;
+          if (high_pc.kind == FormValue::CONSTANT) {
+            ranges.push_back(std::make_pair(low, low + high_pc.value));
+          } else if (GetAddress(unit, high_pc, &high)) {
+            ranges.push_back(std::make_pair(low, high));
+          }
+        } else if (ranges_value.kind != FormValue::NONE) {
+          ReadRanges(unit, ranges_value, &ranges);
+        }
+        for (auto& range : ranges) {
+          if (range.first < range.second && !IsRemovedAddress(range.first, unit.address_size)) {
+            intervals->push_back(
+                InlinedInterval{range.first, range.second, call,
+                                static_cast<uint32_t>(parents.size())});
+          }
+        }
+      }
+      if (abbrev.has_children) {
+        parents.push_back(call);
+      }
+    }
+    return true;
+  }
+};
+
+}  // namespace
+
+// Sort sequences of a line table by address, and drop rows not needed to find source lines.
+static void BuildLineTable(const std::vector<DwarfLineRow>& rows,
+                           std::vector<std::pair<size_t, size_t>>* sequences,
+                           std::vector<DwarfLineRow>* table) {
+  std::stable_sort(sequences->begin(), sequences->end(),
+                   [&](const std::pair<size_t, size_t>& s1, const std::pair<size_t, size_t>& s2) {
+                     return rows[s1.first].addr < rows[s2.first].addr;
+                   });
+  for (auto& sequence : *sequences) {
+    for (size_t i = sequence.first; i < sequence.second; ++i) {
+      const DwarfLineRow& row = rows[i];
+      if (!table->empty()) {
+        // Rows overlapping an earlier sequence can't be looked up.
+        if (row.addr < table->back().addr) {
+          continue;
+        }
+        // Of rows at the same address, the last one is used.
+        if (row.addr == table->back().addr) {
+          table->pop_back();
+        }
+        if (!table->empty() && table->back().file == row.file &&
+            table->back().line == row.line) {
+          continue;
+        }
+      }
+      table->push_back(row);
+    }
+  }
+}
+
+// Split the address ranges of inlined calls into ranges belonging to the innermost call, by
+// assigning calls to ranges from the outermost ones in.
+static void BuildInlinedRanges(std::vector<InlinedInterval>* intervals,
+                               std::vector<DwarfInlinedRange>* inlined_ranges) {
+  std::vector<uint64_t> bounds;
+  for (auto& interval : *intervals) {
+    bounds.push_back(interval.begin);
+    bounds.push_back(interval.end);
+  }
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  std::stable_sort(intervals->begin(), intervals->end(),
+                   [](const InlinedInterval& i1, const InlinedInterval& i2) {
+                     return i1.depth < i2.depth;
+                   });
+  std::vector<uint32_t> calls(bounds.size(), NO_INLINED_CALL);
+  for (auto& interval : *intervals) {
+    size_t i = std::lower_bound(bounds.begin(), bounds.end(), interval.begin) - bounds.begin();
+    for (; i < bounds.size() && bounds[i] < interval.end; ++i) {
+      calls[i] = interval.call;
+    }
+  }
+  for (size_t i = 0; i < bounds.size(); ++i) {
+    if (inlined_ranges->empty() ? calls[i] != NO_INLINED_CALL
+                                : inlined_ranges->back().call != calls[i]) {
+      inlined_ranges->push_back(DwarfInlinedRange{bounds[i], calls[i]});
+    }
+  }
+}
+
+bool ParseDwarfLineInfo(const DwarfSections& sections, DwarfLineInfo* info) {
+  *info = DwarfLineInfo();
+  FileTable file_table(&info->files);
+  LineProgramParser line_parser{sections, file_table};
+  std::unordered_map<uint64_t, FileMap> file_maps;
+  std::vector<DwarfLineRow> rows;
+  std::vector<std::pair<size_t, size_t>> sequences;
+  uint64_t offset = 0;
+  while (offset < sections.debug_line.size()) {
+    uint64_t next_offset = offset;
+    FileMap file_map;
+    if (line_parser.Parse(offset, &next_offset, &file_map, &rows, &sequences)) {
+      file_maps[offset] = std::move(file_map);
+    }
+    if (next_offset == offset) {
+      break;
+    }
+    offset = next_offset;
+  }
+  BuildLineTable(rows, &sequences, &info->rows);
+  if (info->rows.empty()) {
+    return false;
+  }
+
+  std::vector<InlinedInterval> intervals;
+  DebugInfoParser info_parser{sections, file_maps, line_parser, &info->calls, &intervals, {}};
+  offset = 0;
+  while (offset < sections.debug_info.size()) {
+    uint64_t next_offset = offset;
+    if (!info_parser.ParseUnit(offset, &next_offset)) {
+      LOG(DEBUG) << "failed to parse .debug_info unit at offset " << offset;
+    }
+    if (next_offset == offset) {
+      break;
+    }
+    offset = next_offset;
+  }
+  BuildInlinedRanges(&intervals, &info->inlined_ranges);
+  return true;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SIMPLE_PERF_READ_DWARF_H_
+#define SIMPLE_PERF_READ_DWARF_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Contents of the DWARF sections of an elf file used to find source lines. Sections the file
+// doesn't have are left empty.
+struct DwarfSections {
+  std::string debug_abbrev;
+  std::string debug_addr;
+  std::string debug_info;
+  std::string debug_line;
+  std::string debug_line_str;
+  std::string debug_ranges;
+  std::string debug_rnglists;
+  std::string debug_str;
+};
+
+// Code from addr up to the addr of the next row comes from line of files[file]. Line 0 means the
+// code has no source line, like the gap after the end of a sequence.
+struct DwarfLineRow {
+  uint64_t addr;
+  uint32_t file;
+  uint32_t line;
+};
+
+// A call site an inlined function is inlined into. parent is the innermost inlined call
+// containing the call site, or NO_INLINED_CALL if the call site is in an out-of-line function.
+struct DwarfInlinedCall {
+  uint32_t file;
+  uint32_t line;
+  uint32_t parent;
+};
+
+// Code from addr up to the addr of the next range is in the inlined call calls[call], or in no
+// inlined call if call is NO_INLINED_CALL.
+struct DwarfInlinedRange {
+  uint64_t addr;
+  uint32_t call;
+};
+
+static const uint32_t NO_INLINED_CALL = UINT32_MAX;
+
+struct DwarfLineInfo {
+  std::vector<std::string> files;
+  // Sorted by addr, with no two adjacent rows of the same source line.
+  std::vector<DwarfLineRow> rows;
+  std::vector<DwarfInlinedCall> calls;
+  // Sorted by addr, with no two adjacent ranges of the same call.
+  std::vector<DwarfInlinedRange> inlined_ranges;
+};
+
+// Build the address to source line table of all line programs in .debug_line, and the inlined
+// calls found in DW_TAG_inlined_subroutine entries of .debug_info. DWARF versions 2 to 5 are
+// supported. Units that can't be parsed are skipped, and return false if nothing is found.
+bool ParseDwarfLineInfo(const DwarfSections& sections, DwarfLineInfo* info);
+
+#endif  // SIMPLE_PERF_READ_DWARF_H_
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "read_dwarf.h"
+
+#include <gtest/gtest.h>
+
+// Builds the content of a DWARF section.
+class SectionBuilder {
+ public:
+  SectionBuilder& U8(uint8_t value) {
+    return Unsigned(value, 1);
+  }
+
+  SectionBuilder& Unsigned(uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      data_.push_back(static_cast<char>(value >> (8 * i)));
+    }
+    return *this;
+  }
+
+  SectionBuilder& Uleb(uint64_t value) {
+    do {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      data_.push_back(static_cast<char>(value != 0 ? (byte | 0x80) : byte));
+    } while (value != 0);
+    return *this;
+  }
+
+  SectionBuilder& Sleb(int64_t value) {
+    while (true) {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+        data_.push_back(static_cast<char>(byte));
+        return *this;
+      }
+      data_.push_back(static_cast<char>(byte | 0x80));
+    }
+  }
+
+  SectionBuilder& String(const std::string& s) {
+    data_.append(s.c_str(), s.size() + 1);
+    return *this;
+  }
+
+  size_t size() const {
+    return data_.size();
+  }
+
+  const std::string& data() const {
+    return data_;
+  }
+
+  // Set the 32-bit unit length at the start of the section.
+  std::string Finish() {
+    std::string data = data_;
+    uint32_t length = data.size() - 4;
+    for (size_t i = 0; i < 4; ++i) {
+      data[i] = static_cast<char>(length >> (8 * i));
+    }
+    return data;
+  }
+
+ private:
+  std::string data_;
+};
+
+// A DWARF 4 unit of a function at [0x1000, 0x1030) in a.cpp, with code of a.h at
+// [0x1010, 0x1020) inlined into line 11 of a.cpp.
+static DwarfSections BuildSections() {
+  DwarfSections sections;
+  SectionBuilder line;
+  line.Unsigned(0, 4).Unsigned(4, 2);
+  size_t header_length_pos = line.size();
+  line.Unsigned(0, 4);
+  // min_inst_length, max_ops, default_is_stmt, line_base, line_range, opcode_base
+  line.U8(1).U8(1).U8(1).U8(static_cast<uint8_t>(-5)).U8(14).U8(13);
+  for (uint8_t length : {0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1}) {
+    line.U8(length);
+  }
+  line.String("/src").U8(0);
+  line.String("a.cpp").Uleb(1).Uleb(0).Uleb(0);
+  line.String("a.h").Uleb(1).Uleb(0).Uleb(0);
+  line.U8(0);
+  size_t program_pos = line.size();
+  // 0x1000: a.cpp:10, 0x1010: a.h:5, 0x1020: a.cpp:11, end at 0x1030.
+  line.U8(0).Uleb(9).U8(2).Unsigned(0x1000, 8);
+  line.U8(3).Sleb(9).U8(1);
+  line.U8(4).Uleb(2).U8(3).Sleb(-5).U8(2).Uleb(0x10).U8(1);
+  line.U8(4).Uleb(1).U8(3).Sleb(6).U8(2).Uleb(0x10).U8(1);
+  line.U8(2).Uleb(0x10).U8(0).Uleb(1).U8(1);
+  // A sequence of code removed by the linker, starting at address 0.
+  line.U8(0).Uleb(9).U8(2).Unsigned(0, 8);
+  line.U8(1).U8(2).Uleb(4).U8(0).Uleb(1).U8(1);
+  sections.debug_line = line.Finish();
+  uint32_t header_length = program_pos - header_length_pos - 4;
+  for (size_t i = 0; i < 4; ++i) {
+    sections.debug_line[header_length_pos + i] = static_cast<char>(header_length >> (8 * i));
+  }
+
+  SectionBuilder abbrev;
+  // 1: DW_TAG_compile_unit, with DW_AT_stmt_list and DW_AT_low_pc.
+  abbrev.Uleb(1).Uleb(0x11).U8(1).Uleb(0x10).Uleb(0x17).Uleb(0x11).Uleb(0x01).Uleb(0).Uleb(0);
+  // 2: DW_TAG_subprogram, with DW_AT_name, DW_AT_low_pc and DW_AT_high_pc.
+  abbrev.Uleb(2).Uleb(0x2e).U8(1).Uleb(0x03).Uleb(0x08).Uleb(0x11).Uleb(0x01).Uleb(0x12)
+      .Uleb(0x06).Uleb(0).Uleb(0);
+  // 3: DW_TAG_inlined_subroutine, with DW_AT_low_pc, DW_AT_high_pc, DW_AT_call_file and
+  // DW_AT_call_line.
+  abbrev.Uleb(3).Uleb(0x1d).U8(0).Uleb(0x11).Uleb(0x01).Uleb(0x12).Uleb(0x06).Uleb(0x58)
+      .Uleb(0x0b).Uleb(0x59).Uleb(0x0b).Uleb(0).Uleb(0);
+  abbrev.Uleb(0);
+  sections.debug_abbrev = abbrev.data();
+
+  SectionBuilder info;
+  info.Unsigned(0, 4).Unsigned(4, 2).Unsigned(0, 4).U8(8);
+  info.Uleb(1).Unsigned(0, 4).Unsigned(0, 8);
+  info.Uleb(2).String("func").Unsigned(0x1000, 8).Unsigned(0x30, 4);
+  info.Uleb(3).Unsigned(0x1010, 8).Unsigned(0x10, 4).U8(1).U8(11);
+  info.Uleb(0).Uleb(0);
+  sections.debug_info = info.Finish();
+  return sections;
+}
+
+TEST(read_dwarf, parse_line_table) {
+  DwarfLineInfo info;
+  ASSERT_TRUE(ParseDwarfLineInfo(BuildSections(), &info));
+  ASSERT_EQ(2u, info.files.size());
+  ASSERT_EQ("/src/a.cpp", info.files[0]);
+  ASSERT_EQ("/src/a.h", info.files[1]);
+  ASSERT_EQ(4u, info.rows.size());
+  ASSERT_EQ(0x1000u, info.rows[0].addr);
+  ASSERT_EQ(0u, info.rows[0].file);
+  ASSERT_EQ(10u, info.rows[0].line);
+  ASSERT_EQ(0x1010u, info.rows[1].addr);
+  ASSERT_EQ(1u, info.rows[1].file);
+  ASSERT_EQ(5u, info.rows[1].line);
+  ASSERT_EQ(0x1020u, info.rows[2].addr);
+  ASSERT_EQ(0u, info.rows[2].file);
+  ASSERT_EQ(11u, info.rows[2].line);
+  // The end of the sequence, the removed sequence at address 0 is dropped.
+  ASSERT_EQ(0x1030u, info.rows[3].addr);
+  ASSERT_EQ(0u, info.rows[3].line);
+}
+
+TEST(read_dwarf, parse_inlined_calls) {
+  DwarfLineInfo info;
+  ASSERT_TRUE(ParseDwarfLineInfo(BuildSections(), &info));
+  ASSERT_EQ(1u, info.calls.size());
+  ASSERT_EQ(0u, info.calls[0].file);
+  ASSERT_EQ(11u, info.calls[0].line);
+  ASSERT_EQ(NO_INLINED_CALL, info.calls[0].parent);
+  ASSERT_EQ(2u, info.inlined_ranges.size());
+  ASSERT_EQ(0x1010u, info.inlined_ranges[0].addr);
+  ASSERT_EQ(0u, info.inlined_ranges[0].call);
+  ASSERT_EQ(0x1020u, info.inlined_ranges[1].addr);
+  ASSERT_EQ(NO_INLINED_CALL, info.inlined_ranges[1].call);
+}
+
+TEST(read_dwarf, truncated_sections) {
+  DwarfSections sections = BuildSections();
+  DwarfLineInfo info;
+  // Units cut anywhere are skipped without reading out of the sections.
+  for (size_t size = 0; size < sections.debug_info.size(); ++size) {
+    DwarfSections truncated = sections;
+    truncated.debug_info.resize(size);
+    ASSERT_TRUE(ParseDwarfLineInfo(truncated, &info));
+    ASSERT_EQ(4u, info.rows.size());
+  }
+  for (size_t size = 0; size < sections.debug_line.size(); ++size) {
+    DwarfSections truncated = sections;
+    truncated.debug_line.resize(size);
+    ParseDwarfLineInfo(truncated, &info);
+  }
+}
@@ -24,6 +24,10 @@
 
 #include <algorithm>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -143,8 +147,8 @@ struct BinaryRet {
   }
 };
 
-static BinaryRet OpenObjectFile(const std::string& filename, uint64_t file_offset = 0,
-                                uint64_t file_size = 0) {
+static BinaryRet OpenObjectFileWithoutCache(const std::string& filename, uint64_t file_offset,
+                                            uint64_t file_size) {
   BinaryRet ret;
   FileHelper fhelper = FileHelper::OpenReadOnly(filename);
   if (!fhelper) {
@@ -180,22 +184,112 @@ static BinaryRet OpenObjectFile(const std::string& filename, uint64_t file_offse
   return ret;
 }
 
+// Parsed object files are kept in a process-wide cache, so asking for the build id, symbols and
+// min vaddr of a file (like DumpBuildIdFeature() and report do) opens and parses it only once.
+// llvm::MemoryBuffer maps big files instead of reading them. A cached file is reused until its
+// size or modification time changes.
+struct ElfObject {
+  BinaryRet ret;
+  time_t mtime;
+  off_t size;
+
+  std::mutex build_id_mutex;
+  bool build_id_read;
+  bool has_build_id;
+  BuildId build_id;
+
+  ElfObject() : mtime(0), size(0), build_id_read(false), has_build_id(false) {
+  }
+};
+
+// Each Dso asks for a few things about its file in a short time, so a small cache is enough.
+constexpr size_t ELF_OBJECT_CACHE_SIZE = 32;
+
+// Indexed by (filename, file_offset, file_size), the value is (last use time, object).
+typedef std::tuple<std::string, uint64_t, uint64_t> ElfObjectKey;
+static std::map<ElfObjectKey, std::pair<uint64_t, std::shared_ptr<ElfObject>>> elf_object_cache;
+static uint64_t elf_object_cache_time;
+static std::mutex elf_object_cache_mutex;
+
+// If check_elf_path is true, return nullptr for a file not passing IsValidElfPath() instead of
+// reporting errors.
+static std::shared_ptr<ElfObject> OpenObjectFile(const std::string& filename,
+                                                 uint64_t file_offset = 0,
+                                                 uint64_t file_size = 0,
+                                                 bool check_elf_path = false) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    PLOG(DEBUG) << "failed to stat " << filename;
+    return nullptr;
+  }
+  ElfObjectKey key(filename, file_offset, file_size);
+  {
+    std::lock_guard<std::mutex> lock(elf_object_cache_mutex);
+    auto it = elf_object_cache.find(key);
+    if (it != elf_object_cache.end()) {
+      const ElfObject& object = *it->second.second;
+      if (object.mtime == st.st_mtime && object.size == st.st_size) {
+        it->second.first = ++elf_object_cache_time;
+        return it->second.second;
+      }
+      elf_object_cache.erase(it);
+    }
+  }
+  if (check_elf_path && !IsValidElfPath(filename)) {
+    return nullptr;
+  }
+  // Parse the file without holding the lock, so files can be parsed on different threads.
+  std::shared_ptr<ElfObject> object(new ElfObject);
+  object->ret = OpenObjectFileWithoutCache(filename, file_offset, file_size);
+  if (object->ret.obj == nullptr) {
+    return nullptr;
+  }
+  object->mtime = st.st_mtime;
+  object->size = st.st_size;
+
+  std::lock_guard<std::mutex> lock(elf_object_cache_mutex);
+  if (elf_object_cache.size() >= ELF_OBJECT_CACHE_SIZE) {
+    auto lru = elf_object_cache.begin();
+    for (auto it = elf_object_cache.begin(); it != elf_object_cache.end(); ++it) {
+      if (it->second.first < lru->second.first) {
+        lru = it;
+      }
+    }
+    elf_object_cache.erase(lru);
+  }
+  elf_object_cache[key] = std::make_pair(++elf_object_cache_time, object);
+  return object;
+}
+
+static bool GetBuildIdFromElfObject(ElfObject* object, BuildId* build_id) {
+  std::lock_guard<std::mutex> lock(object->build_id_mutex);
+  if (!object->build_id_read) {
+    object->has_build_id = GetBuildIdFromObjectFile(object->ret.obj, &object->build_id);
+    object->build_id_read = true;
+  }
+  if (object->has_build_id) {
+    *build_id = object->build_id;
+  }
+  return object->has_build_id;
+}
+
 bool GetBuildIdFromElfFile(const std::string& filename, BuildId* build_id) {
-  if (!IsValidElfPath(filename)) {
+  std::shared_ptr<ElfObject> object = OpenObjectFile(filename, 0, 0, true);
+  if (object == nullptr) {
     return false;
   }
-  bool result = GetBuildIdFromEmbeddedElfFile(filename, 0, 0, build_id);
+  bool result = GetBuildIdFromElfObject(object.get(), build_id);
   LOG(VERBOSE) << "GetBuildIdFromElfFile(" << filename << ") => " << build_id->ToString();
   return result;
 }
 
 bool GetBuildIdFromEmbeddedElfFile(const std::string& filename, uint64_t file_offset,
                                    uint32_t file_size, BuildId* build_id) {
-  BinaryRet ret = OpenObjectFile(filename, file_offset, file_size);
-  if (ret.obj == nullptr) {
+  std::shared_ptr<ElfObject> object = OpenObjectFile(filename, file_offset, file_size);
+  if (object == nullptr) {
     return false;
   }
-  return GetBuildIdFromObjectFile(ret.obj, build_id);
+  return GetBuildIdFromElfObject(object.get(), build_id);
 }
 
 bool IsArmMappingSymbol(const char* name) {
@@ -265,13 +359,13 @@ void ParseSymbolsFromELFFile(const llvm::object::ELFObjectFile<ELFT>* elf_obj,
   }
 }
 
-bool MatchBuildId(llvm::object::ObjectFile* obj, const BuildId& expected_build_id,
-                  const std::string& debug_filename) {
+static bool MatchBuildId(ElfObject* object, const BuildId& expected_build_id,
+                         const std::string& debug_filename) {
   if (expected_build_id.IsEmpty()) {
     return true;
   }
   BuildId real_build_id;
-  if (!GetBuildIdFromObjectFile(obj, &real_build_id)) {
+  if (!GetBuildIdFromElfObject(object, &real_build_id)) {
     return false;
   }
   if (expected_build_id != real_build_id) {
@@ -283,24 +377,17 @@ bool MatchBuildId(llvm::object::ObjectFile* obj, const BuildId& expected_build_i
   return true;
 }
 
-bool ParseSymbolsFromElfFile(const std::string& filename, const BuildId& expected_build_id,
-                             std::function<void(const ElfFileSymbol&)> callback) {
-  if (!IsValidElfPath(filename)) {
+static bool ParseSymbolsFromElfObject(const std::shared_ptr<ElfObject>& object,
+                                      const std::string& filename,
+                                      const BuildId& expected_build_id,
+                                      std::function<void(const ElfFileSymbol&)> callback) {
+  if (object == nullptr || !MatchBuildId(object.get(), expected_build_id, filename)) {
     return false;
   }
-  return ParseSymbolsFromEmbeddedElfFile(filename, 0, 0, expected_build_id, callback);
-}
-
-bool ParseSymbolsFromEmbeddedElfFile(const std::string& filename, uint64_t file_offset,
-                                     uint32_t file_size, const BuildId& expected_build_id,
-                                     std::function<void(const ElfFileSymbol&)> callback) {
-  BinaryRet ret = OpenObjectFile(filename, file_offset, file_size);
-  if (ret.obj == nullptr || !MatchBuildId(ret.obj, expected_build_id, filename)) {
-    return false;
-  }
-  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(ret.obj)) {
+  llvm::object::ObjectFile* obj = object->ret.obj;
+  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(obj)) {
     ParseSymbolsFromELFFile(elf, callback);
-  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(ret.obj)) {
+  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(obj)) {
     ParseSymbolsFromELFFile(elf, callback);
   } else {
     LOG(ERROR) << "unknown elf format in file " << filename;
@@ -309,6 +396,19 @@ bool ParseSymbolsFromEmbeddedElfFile(const std::string& filename, uint64_t file_
   return true;
 }
 
+bool ParseSymbolsFromElfFile(const std::string& filename, const BuildId& expected_build_id,
+                             std::function<void(const ElfFileSymbol&)> callback) {
+  return ParseSymbolsFromElfObject(OpenObjectFile(filename, 0, 0, true), filename,
+                                   expected_build_id, callback);
+}
+
+bool ParseSymbolsFromEmbeddedElfFile(const std::string& filename, uint64_t file_offset,
+                                     uint32_t file_size, const BuildId& expected_build_id,
+                                     std::function<void(const ElfFileSymbol&)> callback) {
+  return ParseSymbolsFromElfObject(OpenObjectFile(filename, file_offset, file_size), filename,
+                                   expected_build_id, callback);
+}
+
 template <class ELFT>
 bool ReadMinExecutableVirtualAddress(const llvm::object::ELFFile<ELFT>* elf, uint64_t* p_vaddr) {
   bool has_vaddr = false;
@@ -330,18 +430,16 @@ bool ReadMinExecutableVirtualAddress(const llvm::object::ELFFile<ELFT>* elf, uin
 bool ReadMinExecutableVirtualAddressFromElfFile(const std::string& filename,
                                                 const BuildId& expected_build_id,
                                                 uint64_t* min_vaddr) {
-  if (!IsValidElfPath(filename)) {
-    return false;
-  }
-  BinaryRet ret = OpenObjectFile(filename);
-  if (ret.obj == nullptr || !MatchBuildId(ret.obj, expected_build_id, filename)) {
+  std::shared_ptr<ElfObject> object = OpenObjectFile(filename, 0, 0, true);
+  if (object == nullptr || !MatchBuildId(object.get(), expected_build_id, filename)) {
     return false;
   }
+  llvm::object::ObjectFile* obj = object->ret.obj;
 
   bool result = false;
-  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(ret.obj)) {
+  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(obj)) {
     result = ReadMinExecutableVirtualAddress(elf->getELFFile(), min_vaddr);
-  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(ret.obj)) {
+  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(obj)) {
     result = ReadMinExecutableVirtualAddress(elf->getELFFile(), min_vaddr);
   } else {
     LOG(ERROR) << "unknown elf format in file" << filename;
@@ -354,6 +452,42 @@ bool ReadMinExecutableVirtualAddressFromElfFile(const std::string& filename,
   return result;
 }
 
+template <class ELFT>
+bool ConvertVaddrToFileOffset(const llvm::object::ELFFile<ELFT>* elf, uint64_t vaddr,
+                              uint64_t* file_offset) {
+  for (auto it = elf->program_header_begin(); it != elf->program_header_end(); ++it) {
+    if (it->p_type == llvm::ELF::PT_LOAD && vaddr >= it->p_vaddr &&
+        vaddr < it->p_vaddr + it->p_filesz) {
+      *file_offset = vaddr - it->p_vaddr + it->p_offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ConvertVaddrToFileOffsetInElfFile(const std::string& filename, uint64_t vaddr,
+                                       uint64_t* file_offset) {
+  std::shared_ptr<ElfObject> object = OpenObjectFile(filename, 0, 0, true);
+  if (object == nullptr) {
+    return false;
+  }
+  llvm::object::ObjectFile* obj = object->ret.obj;
+  bool result = false;
+  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(obj)) {
+    result = ConvertVaddrToFileOffset(elf->getELFFile(), vaddr, file_offset);
+  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(obj)) {
+    result = ConvertVaddrToFileOffset(elf->getELFFile(), vaddr, file_offset);
+  } else {
+    LOG(ERROR) << "unknown elf format in file" << filename;
+    return false;
+  }
+  if (!result) {
+    LOG(ERROR) << "address 0x" << std::hex << vaddr << " isn't in a loadable segment of "
+               << filename;
+  }
+  return result;
+}
+
 template <class ELFT>
 bool ReadSectionFromELFFile(const llvm::object::ELFFile<ELFT>* elf, const std::string& section_name,
                             std::string* content) {
@@ -375,17 +509,15 @@ bool ReadSectionFromELFFile(const llvm::object::ELFFile<ELFT>* elf, const std::s
 
 bool ReadSectionFromElfFile(const std::string& filename, const std::string& section_name,
                             std::string* content) {
-  if (!IsValidElfPath(filename)) {
-    return false;
-  }
-  BinaryRet ret = OpenObjectFile(filename);
-  if (ret.obj == nullptr) {
+  std::shared_ptr<ElfObject> object = OpenObjectFile(filename, 0, 0, true);
+  if (object == nullptr) {
     return false;
   }
+  llvm::object::ObjectFile* obj = object->ret.obj;
   bool result = false;
-  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(ret.obj)) {
+  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(obj)) {
     result = ReadSectionFromELFFile(elf->getELFFile(), section_name, content);
-  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(ret.obj)) {
+  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(obj)) {
     result = ReadSectionFromELFFile(elf->getELFFile(), section_name, content);
   } else {
     LOG(ERROR) << "unknown elf format in file" << filename;
@@ -393,3 +525,47 @@ bool ReadSectionFromElfFile(const std::string& filename, const std::string& sect
   }
   return result;
 }
+
+template <class ELFT>
+void ReadSectionsFromELFFile(const llvm::object::ELFFile<ELFT>* elf,
+                             const std::vector<std::pair<std::string, std::string*>>& sections) {
+  for (auto it = elf->section_begin(); it != elf->section_end(); ++it) {
+    auto name_or_err = elf->getSectionName(&*it);
+    if (!name_or_err) {
+      continue;
+    }
+    for (auto& section : sections) {
+      if (*name_or_err != section.first) {
+        continue;
+      }
+      // Compressed sections (SHF_COMPRESSED) can't be used in place.
+      if (it->sh_flags & 0x800) {
+        LOG(DEBUG) << "section " << section.first << " is compressed";
+        break;
+      }
+      auto data_or_err = elf->getSectionContents(&*it);
+      if (data_or_err) {
+        section.second->append(data_or_err->begin(), data_or_err->end());
+      }
+      break;
+    }
+  }
+}
+
+bool ReadSectionsFromElfFile(const std::string& filename, const BuildId& expected_build_id,
+                             const std::vector<std::pair<std::string, std::string*>>& sections) {
+  std::shared_ptr<ElfObject> object = OpenObjectFile(filename, 0, 0, true);
+  if (object == nullptr || !MatchBuildId(object.get(), expected_build_id, filename)) {
+    return false;
+  }
+  llvm::object::ObjectFile* obj = object->ret.obj;
+  if (auto elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(obj)) {
+    ReadSectionsFromELFFile(elf->getELFFile(), sections);
+  } else if (auto elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(obj)) {
+    ReadSectionsFromELFFile(elf->getELFFile(), sections);
+  } else {
+    LOG(ERROR) << "unknown elf format in file" << filename;
+    return false;
+  }
+  return true;
+}
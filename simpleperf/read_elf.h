@@ -19,6 +19,8 @@
 
 #include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 #include "build_id.h"
 
 bool GetBuildIdFromNoteFile(const std::string& filename, BuildId* build_id);
@@ -51,9 +53,19 @@ bool ReadMinExecutableVirtualAddressFromElfFile(const std::string& filename,
                                                 const BuildId& expected_build_id,
                                                 uint64_t* min_addr);
 
+// Find the offset in the file of a virtual address in a loadable segment, like the offset used
+// to place a uprobe.
+bool ConvertVaddrToFileOffsetInElfFile(const std::string& filename, uint64_t vaddr,
+                                       uint64_t* file_offset);
+
 bool ReadSectionFromElfFile(const std::string& filename, const std::string& section_name,
                             std::string* content);
 
+// Read sections of an elf file having expected_build_id. The content of the section named by the
+// first of each pair is appended to the second, if the file has it.
+bool ReadSectionsFromElfFile(const std::string& filename, const BuildId& expected_build_id,
+                             const std::vector<std::pair<std::string, std::string*>>& sections);
+
 // Expose the following functions for unit tests.
 bool IsArmMappingSymbol(const char* name);
 bool IsValidElfFile(int fd);
@@ -19,6 +19,10 @@
 #include <gtest/gtest.h>
 
 #include <map>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+
 #include "get_test_data.h"
 
 TEST(read_elf, GetBuildIdFromElfFile) {
@@ -34,6 +38,21 @@ TEST(read_elf, GetBuildIdFromEmbeddedElfFile) {
   ASSERT_EQ(build_id, native_lib_build_id);
 }
 
+TEST(read_elf, parsed_file_is_reloaded_after_change) {
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(GetTestData(ELF_FILE), &content));
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, tmpfile.path));
+  BuildId build_id;
+  ASSERT_TRUE(GetBuildIdFromElfFile(tmpfile.path, &build_id));
+  ASSERT_EQ(build_id, BuildId(elf_file_build_id));
+  // The file is parsed once for both queries.
+  uint64_t min_vaddr;
+  ASSERT_TRUE(ReadMinExecutableVirtualAddressFromElfFile(tmpfile.path, build_id, &min_vaddr));
+  ASSERT_TRUE(android::base::WriteStringToFile("not an elf file", tmpfile.path));
+  ASSERT_FALSE(GetBuildIdFromElfFile(tmpfile.path, &build_id));
+}
+
 void ParseSymbol(const ElfFileSymbol& symbol, std::map<std::string, ElfFileSymbol>* symbols) {
   (*symbols)[symbol.name] = symbol;
 }
@@ -77,6 +96,15 @@ TEST(read_elf, ParseSymbolsFromEmbeddedElfFile) {
   CheckElfFileSymbols(symbols);
 }
 
+TEST(read_elf, ConvertVaddrToFileOffsetInElfFile) {
+  uint64_t file_offset;
+  ASSERT_TRUE(ConvertVaddrToFileOffsetInElfFile(GetTestData(ELF_FILE), 0x400502, &file_offset));
+  ASSERT_EQ(0x502u, file_offset);
+  ASSERT_TRUE(ConvertVaddrToFileOffsetInElfFile(GetTestData(ELF_FILE), 0x600e20, &file_offset));
+  ASSERT_EQ(0xe20u, file_offset);
+  ASSERT_FALSE(ConvertVaddrToFileOffsetInElfFile(GetTestData(ELF_FILE), 0x100, &file_offset));
+}
+
 TEST(read_elf, arm_mapping_symbol) {
   ASSERT_TRUE(IsArmMappingSymbol("$a"));
   ASSERT_FALSE(IsArmMappingSymbol("$b"));
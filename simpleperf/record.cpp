@@ -25,6 +25,7 @@
 
 #include "environment.h"
 #include "perf_regs.h"
+#include "read_apk.h"
 #include "utils.h"
 
 static std::string RecordTypeToString(int record_type) {
@@ -64,6 +65,13 @@ void MoveToBinaryFormat(const T* data_p, size_t n, char*& p) {
   p += size;
 }
 
+// Grow buf by size zeroed bytes, and return the start of them.
+static char* GrowBuffer(std::vector<char>* buf, size_t size) {
+  size_t offset = buf->size();
+  buf->resize(offset + size);
+  return buf->data() + offset;
+}
+
 SampleId::SampleId() {
   memset(this, 0, sizeof(SampleId));
 }
@@ -180,6 +188,13 @@ void Record::Dump(size_t indent) const {
   sample_id.Dump(indent + 1);
 }
 
+std::vector<char> Record::BinaryFormat() const {
+  std::vector<char> buf;
+  buf.reserve(header.size);
+  AppendBinaryFormat(&buf);
+  return buf;
+}
+
 uint64_t Record::Timestamp() const {
   return sample_id.time_data.time;
 }
@@ -195,15 +210,13 @@ MmapRecord::MmapRecord(const perf_event_attr& attr, const perf_event_header* phe
   sample_id.ReadFromBinaryFormat(attr, p, end);
 }
 
-std::vector<char> MmapRecord::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void MmapRecord::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   MoveToBinaryFormat(data, p);
   strcpy(p, filename.c_str());
   p += ALIGN(filename.size() + 1, 8);
   sample_id.WriteToBinaryFormat(p);
-  return buf;
 }
 
 void MmapRecord::AdjustSizeBasedOnData() {
@@ -227,15 +240,13 @@ Mmap2Record::Mmap2Record(const perf_event_attr& attr, const perf_event_header* p
   sample_id.ReadFromBinaryFormat(attr, p, end);
 }
 
-std::vector<char> Mmap2Record::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void Mmap2Record::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   MoveToBinaryFormat(data, p);
   strcpy(p, filename.c_str());
   p += ALIGN(filename.size() + 1, 8);
   sample_id.WriteToBinaryFormat(p);
-  return buf;
 }
 
 void Mmap2Record::AdjustSizeBasedOnData() {
@@ -263,15 +274,13 @@ CommRecord::CommRecord(const perf_event_attr& attr, const perf_event_header* phe
   sample_id.ReadFromBinaryFormat(attr, p, end);
 }
 
-std::vector<char> CommRecord::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void CommRecord::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   MoveToBinaryFormat(data, p);
   strcpy(p, comm.c_str());
   p += ALIGN(comm.size() + 1, 8);
   sample_id.WriteToBinaryFormat(p);
-  return buf;
 }
 
 void CommRecord::DumpData(size_t indent) const {
@@ -287,13 +296,11 @@ ExitOrForkRecord::ExitOrForkRecord(const perf_event_attr& attr, const perf_event
   sample_id.ReadFromBinaryFormat(attr, p, end);
 }
 
-std::vector<char> ExitOrForkRecord::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void ExitOrForkRecord::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   MoveToBinaryFormat(data, p);
   sample_id.WriteToBinaryFormat(p);
-  return buf;
 }
 
 void ExitOrForkRecord::DumpData(size_t indent) const {
@@ -383,9 +390,8 @@ SampleRecord::SampleRecord(const perf_event_attr& attr, const perf_event_header*
   }
 }
 
-std::vector<char> SampleRecord::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void SampleRecord::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   if (sample_type & PERF_SAMPLE_IP) {
     MoveToBinaryFormat(ip_data, p);
@@ -443,8 +449,7 @@ std::vector<char> SampleRecord::BinaryFormat() const {
 
   // If record command does stack unwinding, sample records' size may be decreased.
   // So we can't trust header.size here, and should adjust buffer size based on real need.
-  buf.resize(p - buf.data());
-  return buf;
+  buf->resize(p - buf->data());
 }
 
 void SampleRecord::AdjustSizeBasedOnData() {
@@ -542,16 +547,14 @@ BuildIdRecord::BuildIdRecord(const perf_event_header* pheader) : Record(pheader)
   CHECK_EQ(p, end);
 }
 
-std::vector<char> BuildIdRecord::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void BuildIdRecord::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   MoveToBinaryFormat(pid, p);
   memcpy(p, build_id.Data(), build_id.Size());
   p += ALIGN(build_id.Size(), 8);
   strcpy(p, filename.c_str());
   p += ALIGN(filename.size() + 1, 64);
-  return buf;
 }
 
 void BuildIdRecord::DumpData(size_t indent) const {
@@ -566,12 +569,10 @@ UnknownRecord::UnknownRecord(const perf_event_header* pheader) : Record(pheader)
   data.insert(data.end(), p, end);
 }
 
-std::vector<char> UnknownRecord::BinaryFormat() const {
-  std::vector<char> buf(header.size);
-  char* p = buf.data();
+void UnknownRecord::AppendBinaryFormat(std::vector<char>* buf) const {
+  char* p = GrowBuffer(buf, header.size);
   MoveToBinaryFormat(header, p);
   MoveToBinaryFormat(data.data(), data.size(), p);
-  return buf;
 }
 
 void UnknownRecord::DumpData(size_t) const {
@@ -612,6 +613,67 @@ std::vector<std::unique_ptr<Record>> ReadRecordsFromBuffer(const perf_event_attr
   return result;
 }
 
+uint64_t RecordView::Timestamp() const {
+  const char* p = reinterpret_cast<const char*>(header_ + 1);
+  if (header_->type == SIMPLE_PERF_RECORD_CHUNKED_SAMPLE) {
+    return RecordView(*attr_, reinterpret_cast<const perf_event_header*>(p)).Timestamp();
+  }
+  uint64_t sample_type = attr_->sample_type;
+  if (header_->type == PERF_RECORD_SAMPLE) {
+    if (!(sample_type & PERF_SAMPLE_TIME)) {
+      return 0;
+    }
+    if (sample_type & PERF_SAMPLE_IP) {
+      p += sizeof(PerfSampleIpType);
+    }
+    if (sample_type & PERF_SAMPLE_TID) {
+      p += sizeof(PerfSampleTidType);
+    }
+  } else {
+    if (!attr_->sample_id_all || !(sample_type & PERF_SAMPLE_TIME)) {
+      return 0;
+    }
+    // Find the start of sample_id in the same way as the constructors of Record classes.
+    switch (header_->type) {
+      case PERF_RECORD_MMAP:
+        p += sizeof(MmapRecord::MmapRecordDataType);
+        p += ALIGN(strlen(p) + 1, 8);
+        break;
+      case PERF_RECORD_MMAP2:
+        p += sizeof(Mmap2Record::Mmap2RecordDataType);
+        p += ALIGN(strlen(p) + 1, 8);
+        break;
+      case PERF_RECORD_COMM:
+        p += sizeof(CommRecord::CommRecordDataType);
+        p += ALIGN(strlen(p) + 1, 8);
+        break;
+      case PERF_RECORD_EXIT:
+      case PERF_RECORD_FORK:
+        p += sizeof(ExitOrForkRecord::ExitOrForkRecordDataType);
+        break;
+      default:
+        // UnknownRecord doesn't parse sample_id.
+        return 0;
+    }
+    if (sample_type & PERF_SAMPLE_TID) {
+      p += sizeof(PerfSampleTidType);
+    }
+  }
+  CHECK_LE(p + sizeof(uint64_t), reinterpret_cast<const char*>(header_) + header_->size);
+  uint64_t time;
+  MoveFromBinaryFormat(time, p);
+  return time;
+}
+
+std::unique_ptr<Record> RecordView::Parse() const {
+  if (header_->type == SIMPLE_PERF_RECORD_CHUNKED_SAMPLE) {
+    static const std::vector<const perf_event_header*> empty_chunks;
+    return ReadChunkedSampleRecord(*attr_, header_,
+                                   stack_chunks_ != nullptr ? *stack_chunks_ : empty_chunks);
+  }
+  return ReadRecordFromBuffer(*attr_, header_);
+}
+
 std::unique_ptr<Record> ReadRecordFromFile(const perf_event_attr& attr, FILE* fp) {
   std::vector<char> buf(sizeof(perf_event_header));
   perf_event_header* header = reinterpret_cast<perf_event_header*>(&buf[0]);
@@ -771,3 +833,124 @@ RecordCache::RecordWithSeq RecordCache::CreateRecordWithSeq(Record *r) {
   result.record = r;
   return result;
 }
+
+std::vector<char> StackChunkRecordBinary(uint64_t id, const char* data, size_t size) {
+  perf_event_header header;
+  header.type = SIMPLE_PERF_RECORD_STACK_CHUNK;
+  header.misc = 0;
+  header.size = sizeof(header) + 2 * sizeof(uint64_t) + ALIGN(size, 8);
+  std::vector<char> buf(header.size, '\0');
+  char* p = buf.data();
+  MoveToBinaryFormat(header, p);
+  MoveToBinaryFormat(id, p);
+  uint64_t data_size = size;
+  MoveToBinaryFormat(data_size, p);
+  MoveToBinaryFormat(data, size, p);
+  return buf;
+}
+
+uint64_t StackChunkRecordId(const perf_event_header* pheader) {
+  const char* p = reinterpret_cast<const char*>(pheader + 1);
+  uint64_t id;
+  MoveFromBinaryFormat(id, p);
+  return id;
+}
+
+std::vector<char> ChunkedSampleRecordBinary(const SampleRecord& r,
+                                            const std::vector<uint64_t>& chunk_ids) {
+  SampleRecord sample = r;
+  sample.stack_user_data.data.clear();
+  sample.stack_user_data.dyn_size = 0;
+  sample.AdjustSizeBasedOnData();
+  // Serialize the sample after room left for the header.
+  std::vector<char> buf(sizeof(perf_event_header));
+  sample.AppendBinaryFormat(&buf);
+  size_t sample_size = buf.size() - sizeof(perf_event_header);
+
+  perf_event_header header;
+  header.type = SIMPLE_PERF_RECORD_CHUNKED_SAMPLE;
+  header.misc = r.header.misc;
+  header.size = sizeof(header) + sample_size + (3 + chunk_ids.size()) * sizeof(uint64_t);
+  buf.resize(header.size);
+  char* p = buf.data();
+  MoveToBinaryFormat(header, p);
+  p += sample_size;
+  uint64_t stack_size = r.stack_user_data.data.size();
+  MoveToBinaryFormat(stack_size, p);
+  MoveToBinaryFormat(r.stack_user_data.dyn_size, p);
+  uint64_t chunk_count = chunk_ids.size();
+  MoveToBinaryFormat(chunk_count, p);
+  MoveToBinaryFormat(chunk_ids.data(), chunk_ids.size(), p);
+  return buf;
+}
+
+std::unique_ptr<SampleRecord> ReadChunkedSampleRecord(
+    const perf_event_attr& attr, const perf_event_header* pheader,
+    const std::vector<const perf_event_header*>& stack_chunks) {
+  const char* p = reinterpret_cast<const char*>(pheader + 1);
+  const perf_event_header* sample_header = reinterpret_cast<const perf_event_header*>(p);
+  std::unique_ptr<SampleRecord> r(new SampleRecord(attr, sample_header));
+  p += sample_header->size;
+  uint64_t stack_size;
+  uint64_t chunk_count;
+  MoveFromBinaryFormat(stack_size, p);
+  MoveFromBinaryFormat(r->stack_user_data.dyn_size, p);
+  MoveFromBinaryFormat(chunk_count, p);
+  std::vector<char>& stack = r->stack_user_data.data;
+  stack.reserve(stack_size);
+  for (uint64_t i = 0; i < chunk_count; ++i) {
+    uint64_t id;
+    MoveFromBinaryFormat(id, p);
+    if (id >= stack_chunks.size() || stack_chunks[id] == nullptr) {
+      LOG(WARNING) << "stack chunk " << id << " used by a sample is missing";
+      stack.clear();
+      break;
+    }
+    const char* chunk = reinterpret_cast<const char*>(stack_chunks[id] + 1) + sizeof(uint64_t);
+    uint64_t chunk_size;
+    MoveFromBinaryFormat(chunk_size, chunk);
+    stack.insert(stack.end(), chunk, chunk + chunk_size);
+  }
+  if (stack.size() != stack_size) {
+    stack.clear();
+    r->stack_user_data.dyn_size = 0;
+  }
+  if (!stack.empty()) {
+    // Add stack data and dyn_size to the sample with empty stack.
+    r->header.size += stack.size() + sizeof(uint64_t);
+  }
+  return r;
+}
+
+template<class RecordType>
+static void UpdateMmapRecordForEmbeddedElfPath(RecordType* record) {
+  RecordType& r = *record;
+  bool in_kernel = ((r.header.misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL);
+  if (!in_kernel && r.data.pgoff != 0) {
+    // For the case of a shared library "foobar.so" embedded
+    // inside an APK, we rewrite the original MMAP from
+    // ["path.apk" offset=X] to ["path.apk!/foobar.so" offset=W]
+    // so as to make the library name explicit. This update is
+    // done here (as part of the record operation) as opposed to
+    // on the host during the report, since we want to report
+    // the correct library name even if the the APK in question
+    // is not present on the host. The new offset W is
+    // calculated to be with respect to the start of foobar.so,
+    // not to the start of path.apk.
+    EmbeddedElf* ee = ApkInspector::FindElfInApkByOffset(r.filename, r.data.pgoff);
+    if (ee != nullptr) {
+      // Compute new offset relative to start of elf in APK.
+      r.data.pgoff -= ee->entry_offset();
+      r.filename = GetUrlInApk(r.filename, ee->entry_name());
+      r.AdjustSizeBasedOnData();
+    }
+  }
+}
+
+void UpdateRecordForEmbeddedElfPath(Record* record) {
+  if (record->type() == PERF_RECORD_MMAP) {
+    UpdateMmapRecordForEmbeddedElfPath(static_cast<MmapRecord*>(record));
+  } else if (record->type() == PERF_RECORD_MMAP2) {
+    UpdateMmapRecordForEmbeddedElfPath(static_cast<Mmap2Record*>(record));
+  }
+}
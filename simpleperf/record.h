@@ -41,6 +41,18 @@ enum user_record_type {
   PERF_RECORD_FINISHED_ROUND,
 };
 
+// Record types only used by simpleperf in record files. RecordFileReader passes chunked samples
+// as normal sample records, and doesn't pass stack chunks.
+enum simpleperf_record_type {
+  // A piece of user stack data shared by samples of the same thread. The layout is
+  // {header, u64 id, u64 size, data padded to 8 bytes}.
+  SIMPLE_PERF_RECORD_STACK_CHUNK = 32768,
+  // A sample storing its user stack as a list of stack chunks. The layout is
+  // {header, sample record without stack data, u64 stack_size, u64 dyn_size, u64 chunk_count,
+  // u64 chunk_ids[chunk_count]}.
+  SIMPLE_PERF_RECORD_CHUNKED_SAMPLE,
+};
+
 struct PerfSampleIpType {
   uint64_t ip;
 };
@@ -153,7 +165,10 @@ struct Record {
   }
 
   void Dump(size_t indent = 0) const;
-  virtual std::vector<char> BinaryFormat() const = 0;
+  std::vector<char> BinaryFormat() const;
+  // Append the binary format to buf. Serializing records into one reused buffer avoids
+  // allocating a vector for each record.
+  virtual void AppendBinaryFormat(std::vector<char>* buf) const = 0;
   virtual uint64_t Timestamp() const;
 
  protected:
@@ -173,7 +188,7 @@ struct MmapRecord : public Record {
   }
 
   MmapRecord(const perf_event_attr& attr, const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
   void AdjustSizeBasedOnData();
 
  protected:
@@ -198,7 +213,7 @@ struct Mmap2Record : public Record {
   }
 
   Mmap2Record(const perf_event_attr& attr, const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
   void AdjustSizeBasedOnData();
 
  protected:
@@ -215,7 +230,7 @@ struct CommRecord : public Record {
   }
 
   CommRecord(const perf_event_attr& attr, const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
 
  protected:
   void DumpData(size_t indent) const override;
@@ -231,7 +246,7 @@ struct ExitOrForkRecord : public Record {
   ExitOrForkRecord() {
   }
   ExitOrForkRecord(const perf_event_attr& attr, const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
 
  protected:
   void DumpData(size_t indent) const override;
@@ -270,7 +285,7 @@ struct SampleRecord : public Record {
   PerfSampleStackUserType stack_user_data;      // Valid if PERF_SAMPLE_STACK_USER.
 
   SampleRecord(const perf_event_attr& attr, const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
   void AdjustSizeBasedOnData();
   uint64_t Timestamp() const override;
 
@@ -288,7 +303,7 @@ struct BuildIdRecord : public Record {
   }
 
   BuildIdRecord(const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
 
  protected:
   void DumpData(size_t indent) const override;
@@ -300,12 +315,49 @@ struct UnknownRecord : public Record {
   std::vector<char> data;
 
   UnknownRecord(const perf_event_header* pheader);
-  std::vector<char> BinaryFormat() const override;
+  void AppendBinaryFormat(std::vector<char>* buf) const override;
 
  protected:
   void DumpData(size_t indent) const override;
 };
 
+// RecordView refers to a record in binary format, like a record in a memory mapped record file.
+// It can read the type and timestamp of the record without parsing it, and only builds a Record
+// object when Parse() is called. The viewed buffer must outlive the view.
+class RecordView {
+ public:
+  // stack_chunks, indexed by chunk id, is used to parse chunked sample records.
+  RecordView(const perf_event_attr& attr, const perf_event_header* pheader,
+             const std::vector<const perf_event_header*>* stack_chunks = nullptr)
+      : attr_(&attr), header_(pheader), stack_chunks_(stack_chunks) {
+  }
+
+  const perf_event_header* header() const {
+    return header_;
+  }
+
+  // Chunked sample records are viewed as sample records.
+  uint32_t type() const {
+    if (header_->type == SIMPLE_PERF_RECORD_CHUNKED_SAMPLE) {
+      return PERF_RECORD_SAMPLE;
+    }
+    return header_->type;
+  }
+
+  size_t size() const {
+    return header_->size;
+  }
+
+  // Return the same value as Parse()->Timestamp().
+  uint64_t Timestamp() const;
+  std::unique_ptr<Record> Parse() const;
+
+ private:
+  const perf_event_attr* attr_;
+  const perf_event_header* header_;
+  const std::vector<const perf_event_header*>* stack_chunks_;
+};
+
 // RecordCache is a cache used when receiving records from the kernel.
 // It sorts received records based on type and timestamp, and pops records
 // in sorted order. Records from the kernel need to be sorted because
@@ -329,6 +381,10 @@ class RecordCache {
   void Push(std::unique_ptr<Record> record);
   std::unique_ptr<Record> Pop();
   std::vector<std::unique_ptr<Record>> PopAll();
+  // Return the latest timestamp of records pushed.
+  uint64_t LastTime() const {
+    return last_time_;
+  }
 
  private:
   struct RecordWithSeq {
@@ -366,5 +422,15 @@ ForkRecord CreateForkRecord(const perf_event_attr& attr, uint32_t pid, uint32_t
                             uint32_t ptid);
 BuildIdRecord CreateBuildIdRecord(bool in_kernel, pid_t pid, const BuildId& build_id,
                                   const std::string& filename);
+// Make the name of a shared library embedded in an apk explicit in an mmap record of the apk.
+void UpdateRecordForEmbeddedElfPath(Record* record);
+std::vector<char> StackChunkRecordBinary(uint64_t id, const char* data, size_t size);
+uint64_t StackChunkRecordId(const perf_event_header* pheader);
+// Return a chunked sample record of r, with the stack data of r stored in chunk_ids.
+std::vector<char> ChunkedSampleRecordBinary(const SampleRecord& r,
+                                            const std::vector<uint64_t>& chunk_ids);
+std::unique_ptr<SampleRecord> ReadChunkedSampleRecord(
+    const perf_event_attr& attr, const perf_event_header* pheader,
+    const std::vector<const perf_event_header*>& stack_chunks);
 
 #endif  // SIMPLE_PERF_RECORD_H_
@@ -23,6 +23,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/macros.h>
@@ -30,16 +31,22 @@
 #include "perf_event.h"
 #include "record.h"
 #include "record_file_format.h"
+#include "tracing.h"
 
 struct AttrWithId {
   const perf_event_attr* attr;
   std::vector<uint64_t> ids;
 };
 
+class AsyncDataWriter;
+
 // RecordFileWriter writes to a perf record file, like perf.data.
 class RecordFileWriter {
  public:
   static std::unique_ptr<RecordFileWriter> CreateInstance(const std::string& filename);
+  // Write the record file to buffer instead of a file. The buffer holds the whole file after
+  // Close(). Async data writing isn't supported.
+  static std::unique_ptr<RecordFileWriter> CreateInstance(std::vector<char>* buffer);
 
   ~RecordFileWriter();
 
@@ -50,11 +57,38 @@ class RecordFileWriter {
     return WriteData(data.data(), data.size());
   }
 
+  // Write a record to the data section. If stack dedup is enabled, user stack data of samples is
+  // split into stack chunks, and chunks unchanged since the previous sample of the same thread
+  // are shared instead of written again.
+  bool WriteRecord(const Record& record);
+  void EnableStackDedup() {
+    stack_dedup_ = true;
+  }
+
+  // Write the data section on a separate thread, so WriteData() only copies data into large
+  // buffers instead of waiting for the storage. If direct_io is true, the buffers are written
+  // with O_DIRECT when the file system supports it. It should be called after
+  // WriteAttrSection(), and the data section is flushed in WriteFeatureHeader() or Close().
+  bool StartAsyncDataWriting(bool direct_io);
+
+  // Return the time WriteData() was blocked waiting for the writer thread.
+  uint64_t AsyncWriteBlockedTimeInNs() const;
+
+  // Compress the data section in chunks, and write a FEAT_COMPRESSED_DATA feature indexing
+  // them in WriteFeatureHeader() or Close(). It should be called before writing any data.
+  void EnableCompression();
+
   bool WriteFeatureHeader(size_t feature_count);
   bool WriteBuildIdFeature(const std::vector<BuildIdRecord>& build_id_records);
   bool WriteFeatureString(int feature, const std::string& s);
   bool WriteCmdlineFeature(const std::vector<std::string>& cmdline);
   bool WriteBranchStackFeature();
+  bool WriteTracepointFormatsFeature(const std::vector<TracingFormat>& formats);
+  bool WriteSampleFreqChangesFeature(
+      const std::vector<PerfFileFormat::SampleFreqChange>& changes);
+  bool WriteKernelSymbolsFeature(const std::string& symbol_table);
+  // Write a feature section read by RecordFileReader::ReadFeatureSection() as it is.
+  bool WriteFeature(int feature, const std::vector<char>& data);
 
   // Normally, Close() should be called after writing. But if something
   // wrong happens and we need to finish in advance, the destructor
@@ -62,18 +96,30 @@ class RecordFileWriter {
   bool Close();
 
  private:
-  RecordFileWriter(const std::string& filename, FILE* fp);
+  RecordFileWriter(const std::string& filename, FILE* fp, std::vector<char>* buffer);
   void GetHitModulesInBuffer(const char* p, const char* end,
                              std::vector<std::string>* hit_kernel_modules,
                              std::vector<std::string>* hit_user_files);
   bool WriteFileHeader();
   bool Write(const void* buf, size_t len);
+  bool Seek(uint64_t offset);
+  bool Tell(uint64_t* offset);
   bool SeekFileEnd(uint64_t* file_end);
   bool WriteFeatureBegin(uint64_t* start_offset);
   bool WriteFeatureEnd(int feature, uint64_t start_offset);
+  bool FinishAsyncDataWriting();
+  bool WriteToDataSection(const void* buf, size_t len);
+  bool FlushCompressedData();
+  bool WriteCompressedDataFeature();
+  bool WriteFeatureDesc(int feature, size_t index, uint64_t start_offset);
+  bool WriteDedupSampleRecord(const SampleRecord& r);
+  bool WriteSerializedRecord(const Record& record);
 
   const std::string filename_;
   FILE* record_fp_;
+  // Used instead of record_fp_ when writing to memory.
+  std::vector<char>* buffer_;
+  size_t buffer_pos_;
 
   perf_event_attr event_attr_;
   uint64_t attr_section_offset_;
@@ -85,12 +131,46 @@ class RecordFileWriter {
   int feature_count_;
   int current_feature_index_;
 
+  bool compress_data_;
+  std::vector<char> uncompressed_data_;
+  std::vector<PerfFileFormat::CompressedDataChunk> compressed_chunks_;
+
+  std::unique_ptr<AsyncDataWriter> async_data_writer_;
+  uint64_t async_write_blocked_time_in_ns_;
+
+  // Reused to serialize records written by WriteRecord().
+  std::vector<char> record_buffer_;
+
+  // The stack of the previous sample of a thread, used for stack dedup.
+  struct ThreadStack {
+    uint64_t start_addr;
+    std::vector<char> data;
+    std::vector<uint64_t> chunk_ids;
+  };
+  bool stack_dedup_;
+  uint64_t next_stack_chunk_id_;
+  std::unordered_map<uint32_t, ThreadStack> thread_stacks_;
+
   DISALLOW_COPY_AND_ASSIGN(RecordFileWriter);
 };
 
 // RecordFileReader read contents from a perf record file, like perf.data.
 class RecordFileReader {
  public:
+  // Records from different cpus are written by the record command after sorting them in a
+  // RecordCache, so they are only out of order across a short period.
+  static constexpr uint64_t DEFAULT_REORDER_WINDOW_IN_NS = 1000000000u;
+
+  // Statistics of the last sorted read of the data section.
+  struct ReorderStats {
+    // The most records held in the reordering heap at the same time.
+    size_t max_pending_records;
+    // Records read after a later record was passed to the callback, so they were passed out
+    // of order.
+    size_t late_records;
+    size_t late_non_sample_records;
+  };
+
   static std::unique_ptr<RecordFileReader> CreateInstance(const std::string& filename);
 
   ~RecordFileReader();
@@ -108,11 +188,27 @@ class RecordFileReader {
   }
 
   bool ReadIdsForAttr(const PerfFileFormat::FileAttr& attr, std::vector<uint64_t>* ids);
+  // Sorted reads pass a record to the callback once a record reorder_window_in_ns later has been
+  // read, so only records of the window are held in memory. A window of 0 sorts the whole data
+  // section, which is needed if records can be out of order by any period.
+  void SetReorderWindow(uint64_t reorder_window_in_ns) {
+    reorder_window_in_ns_ = reorder_window_in_ns;
+  }
+  const ReorderStats& GetReorderStats() const {
+    return reorder_stats_;
+  }
   // If sorted is true, sort records before passing them to callback function.
   bool ReadDataSection(std::function<bool(std::unique_ptr<Record>)> callback, bool sorted = true);
+  // Like ReadDataSection(), but pass views over the memory mapped data section instead of parsed
+  // records. A view is only valid until the reader is closed, so call RecordView::Parse() to keep
+  // a record longer.
+  bool ReadDataSectionViews(std::function<bool(const RecordView&)> callback, bool sorted = true);
   std::vector<std::string> ReadCmdlineFeature();
   std::vector<BuildIdRecord> ReadBuildIdFeature();
   std::string ReadFeatureString(int feature);
+  std::vector<TracingFormat> ReadTracepointFormatsFeature();
+  std::vector<PerfFileFormat::SampleFreqChange> ReadSampleFreqChangesFeature();
+  bool ReadFeatureSection(int feature, std::vector<char>* data);
   bool Close();
 
   // For testing only.
@@ -123,14 +219,29 @@ class RecordFileReader {
   bool ReadHeader();
   bool ReadAttrSection();
   bool ReadFeatureSectionDescriptors();
-  bool ReadFeatureSection(int feature, std::vector<char>* data);
+  bool MapDataSection();
+  bool DecompressDataSection();
+  void UnmapDataSection();
 
   const std::string filename_;
   FILE* record_fp_;
 
+  // The data section is memory mapped in mapped_addr_, or read into data_buffer_ if mmap()
+  // isn't available. data_section_ points to its start in either case.
+  void* mapped_addr_;
+  size_t mapped_size_;
+  std::vector<char> data_buffer_;
+  const char* data_section_;
+  size_t data_section_size_;
+  bool data_section_truncated_;
+
   PerfFileFormat::FileHeader header_;
   std::vector<PerfFileFormat::FileAttr> file_attrs_;
   std::map<int, PerfFileFormat::SectionDesc> feature_section_descriptors_;
+  // Stack chunk records in the data section, indexed by chunk id.
+  std::vector<const perf_event_header*> stack_chunks_;
+  uint64_t reorder_window_in_ns_;
+  ReorderStats reorder_stats_;
 
   DISALLOW_COPY_AND_ASSIGN(RecordFileReader);
 };
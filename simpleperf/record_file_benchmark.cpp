@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of simpleperf processing perf.data files, on synthetic files written with
+// RecordFileWriter. items_per_second is records processed per second. The label shows the peak
+// RSS of the benchmark. Use --benchmark_format=json to get machine-readable results.
+
+#include <benchmark/benchmark_api.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <map>
+#include <random>
+#include <tuple>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+
+#include "command.h"
+#include "dwarf_unwind.h"
+#include "environment.h"
+#include "event_attr.h"
+#include "event_type.h"
+#include "perf_regs.h"
+#include "record.h"
+#include "record_file.h"
+#include "thread_tree.h"
+
+constexpr uint32_t SAMPLE_PID = 1000;
+constexpr size_t THREAD_COUNT = 8;
+constexpr size_t DWARF_STACK_SIZE = 8192;
+
+// The synthetic samples hit the code of the benchmark binary itself, so report has real
+// symbols to look up, and post-unwinding has a real ELF file with unwind tables.
+static bool GetExecutableMap(ThreadMmap* map) {
+  char buf[PATH_MAX];
+  ssize_t size = readlink("/proc/self/exe", buf, sizeof(buf));
+  if (size <= 0) {
+    return false;
+  }
+  std::string exe_path(buf, size);
+  std::vector<ThreadMmap> thread_mmaps;
+  if (!GetThreadMmapsInProcess(getpid(), &thread_mmaps)) {
+    return false;
+  }
+  for (auto& thread_mmap : thread_mmaps) {
+    if (thread_mmap.executable && thread_mmap.name == exe_path) {
+      *map = thread_mmap;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Set a pc in the executable map and a sp at the start of the dumped stack. Other registers
+// are zero, so unwinding stops after a few frames.
+static void SetDwarfRegs(SampleRecord* r, uint64_t pc, uint64_t sp) {
+  size_t pc_reg = 0;
+  size_t sp_reg = 0;
+  switch (GetBuildArch()) {
+    case ARCH_X86_32:
+    case ARCH_X86_64:
+      pc_reg = PERF_REG_X86_IP;
+      sp_reg = PERF_REG_X86_SP;
+      break;
+    case ARCH_ARM:
+      pc_reg = PERF_REG_ARM_PC;
+      sp_reg = PERF_REG_ARM_SP;
+      break;
+    case ARCH_ARM64:
+      pc_reg = PERF_REG_ARM64_PC;
+      sp_reg = PERF_REG_ARM64_SP;
+      break;
+    default:
+      break;
+  }
+  r->regs_user_data.abi = 1;
+  r->regs_user_data.reg_mask = GetSupportedRegMask(GetBuildArch());
+  r->regs_user_data.regs.clear();
+  for (size_t i = 0; i < 64; ++i) {
+    if (r->regs_user_data.reg_mask & (1ULL << i)) {
+      r->regs_user_data.regs.push_back(i == pc_reg ? pc : (i == sp_reg ? sp : 0));
+    }
+  }
+}
+
+static std::string CreateSyntheticRecordFile(const std::string& filename, size_t sample_count,
+                                             size_t callchain_depth, bool dwarf_samples) {
+  ThreadMmap exe_map;
+  CHECK(GetExecutableMap(&exe_map));
+  const EventType* event_type = FindEventTypeByName("cpu-cycles");
+  CHECK(event_type != nullptr);
+  perf_event_attr attr = CreateDefaultPerfEventAttr(*event_type);
+  attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+  if (dwarf_samples) {
+    attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+    attr.sample_regs_user = GetSupportedRegMask(GetBuildArch());
+    attr.sample_stack_user = DWARF_STACK_SIZE;
+  }
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(filename);
+  CHECK(writer != nullptr);
+  CHECK(writer->WriteAttrSection({AttrWithId{&attr, {1}}}));
+
+  CHECK(writer->WriteData(CreateCommRecord(attr, SAMPLE_PID, SAMPLE_PID, "benchmark")
+                              .BinaryFormat()));
+  CHECK(writer->WriteData(CreateMmapRecord(attr, false, SAMPLE_PID, SAMPLE_PID,
+                                           exe_map.start_addr, exe_map.len, exe_map.pgoff,
+                                           exe_map.name)
+                              .BinaryFormat()));
+  for (size_t i = 1; i < THREAD_COUNT; ++i) {
+    uint32_t tid = SAMPLE_PID + i;
+    CHECK(writer->WriteData(
+        CreateForkRecord(attr, SAMPLE_PID, tid, SAMPLE_PID, SAMPLE_PID).BinaryFormat()));
+    CHECK(writer->WriteData(CreateCommRecord(attr, SAMPLE_PID, tid, "benchmark_thread")
+                                .BinaryFormat()));
+  }
+
+  // Create samples from a zeroed buffer, then fill in the fields.
+  std::vector<char> buf(1024, '\0');
+  perf_event_header* header = reinterpret_cast<perf_event_header*>(buf.data());
+  header->type = PERF_RECORD_SAMPLE;
+  header->size = buf.size();
+  SampleRecord sample(attr, header);
+  sample.period_data.period = 1;
+  std::mt19937_64 random(0);
+  // Samples share a small set of call paths, like samples of a real program do.
+  std::vector<std::vector<uint64_t>> callchains(64);
+  for (auto& callchain : callchains) {
+    for (size_t i = 0; i < callchain_depth; ++i) {
+      callchain.push_back(exe_map.start_addr + random() % exe_map.len);
+    }
+  }
+  std::vector<char> stack(DWARF_STACK_SIZE);
+  for (size_t i = 0; i < sample_count; ++i) {
+    SampleRecord r = sample;
+    r.tid_data.pid = SAMPLE_PID;
+    r.tid_data.tid = SAMPLE_PID + i % THREAD_COUNT;
+    r.time_data.time = i * 1000;
+    r.ip_data.ip = exe_map.start_addr + random() % exe_map.len;
+    if (dwarf_samples) {
+      SetDwarfRegs(&r, r.ip_data.ip, 0x7f0000000000ULL);
+      r.stack_user_data.data = stack;
+      r.stack_user_data.dyn_size = stack.size();
+    } else {
+      r.callchain_data.ips = callchains[random() % callchains.size()];
+      r.callchain_data.ips.insert(r.callchain_data.ips.begin(), r.ip_data.ip);
+    }
+    // BinaryFormat() only shrinks the size, so start from the max size.
+    r.header.size = UINT16_MAX;
+    r.AdjustSizeBasedOnData();
+    CHECK(writer->WriteData(r.BinaryFormat()));
+  }
+  CHECK(writer->Close());
+  return filename;
+}
+
+// Synthetic files are created once for each set of arguments, and removed at exit.
+static std::string GetSyntheticRecordFile(size_t sample_count, size_t callchain_depth,
+                                          bool dwarf_samples) {
+  static std::map<std::tuple<size_t, size_t, bool>, std::unique_ptr<TemporaryFile>> files;
+  auto key = std::make_tuple(sample_count, callchain_depth, dwarf_samples);
+  auto it = files.find(key);
+  if (it == files.end()) {
+    std::unique_ptr<TemporaryFile> tmpfile(new TemporaryFile);
+    CreateSyntheticRecordFile(tmpfile->path, sample_count, callchain_depth, dwarf_samples);
+    it = files.insert(std::make_pair(key, std::move(tmpfile))).first;
+  }
+  return it->second->path;
+}
+
+// Return the number of records (not including feature sections) in the file.
+static size_t CountRecords(const std::string& filename) {
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(filename);
+  CHECK(reader != nullptr);
+  size_t count = 0;
+  CHECK(reader->ReadDataSectionViews([&](const RecordView&) {
+    count++;
+    return true;
+  }, false));
+  return count;
+}
+
+// Writing 5 to clear_refs resets the peak RSS (VmHWM) of the process, so each benchmark can
+// report its own peak. On kernels not supporting it, the peak RSS of the process is reported.
+static void ResetPeakRss() {
+  android::base::WriteStringToFile("5", "/proc/self/clear_refs");
+}
+
+static void SetPeakRssLabel(benchmark::State& state) {
+  std::string status;
+  if (!android::base::ReadFileToString("/proc/self/status", &status)) {
+    return;
+  }
+  for (auto& line : android::base::Split(status, "\n")) {
+    if (android::base::StartsWith(line, "VmHWM:")) {
+      std::vector<std::string> strs = android::base::Split(line, " \t");
+      state.SetLabel("peak_rss_kb=" + strs[strs.size() - 2]);
+      break;
+    }
+  }
+}
+
+// Commands print to stdout, which isn't part of what we measure.
+class ScopedStdoutToDevNull {
+ public:
+  ScopedStdoutToDevNull() {
+    fflush(stdout);
+    saved_fd_ = dup(STDOUT_FILENO);
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+  ~ScopedStdoutToDevNull() {
+    fflush(stdout);
+    dup2(saved_fd_, STDOUT_FILENO);
+    close(saved_fd_);
+  }
+
+ private:
+  int saved_fd_;
+};
+
+static void BM_read_record_file(benchmark::State& state) {
+  std::string filename = GetSyntheticRecordFile(state.range_x(), state.range_y(), false);
+  size_t record_count = CountRecords(filename);
+  ResetPeakRss();
+  while (state.KeepRunning()) {
+    std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(filename);
+    CHECK(reader != nullptr);
+    CHECK(reader->ReadDataSection([](std::unique_ptr<Record>) { return true; }));
+  }
+  state.SetItemsProcessed(state.iterations() * record_count);
+  SetPeakRssLabel(state);
+}
+BENCHMARK(BM_read_record_file)->ArgPair(10000, 16)->ArgPair(100000, 16)->ArgPair(100000, 64);
+
+static void RunCommandBenchmark(benchmark::State& state, const std::string& filename,
+                                const std::string& cmd_name, const std::vector<std::string>& args) {
+  size_t record_count = CountRecords(filename);
+  ResetPeakRss();
+  while (state.KeepRunning()) {
+    ScopedStdoutToDevNull redirect;
+    CHECK(CreateCommandInstance(cmd_name)->Run(args));
+  }
+  state.SetItemsProcessed(state.iterations() * record_count);
+  SetPeakRssLabel(state);
+}
+
+static void BM_report(benchmark::State& state) {
+  std::string filename = GetSyntheticRecordFile(state.range_x(), state.range_y(), false);
+  RunCommandBenchmark(state, filename, "report", {"-i", filename, "-o", "/dev/null"});
+}
+BENCHMARK(BM_report)->ArgPair(10000, 16)->ArgPair(100000, 16)->ArgPair(100000, 64);
+
+static void BM_report_callgraph(benchmark::State& state) {
+  std::string filename = GetSyntheticRecordFile(state.range_x(), state.range_y(), false);
+  RunCommandBenchmark(state, filename, "report", {"-i", filename, "-o", "/dev/null", "-g"});
+}
+BENCHMARK(BM_report_callgraph)->ArgPair(10000, 16)->ArgPair(10000, 64)->ArgPair(100000, 16);
+
+static void BM_dumprecord(benchmark::State& state) {
+  std::string filename = GetSyntheticRecordFile(state.range_x(), state.range_y(), false);
+  RunCommandBenchmark(state, filename, "dump", {filename});
+}
+BENCHMARK(BM_dumprecord)->ArgPair(10000, 16);
+
+// Keeps the compiler from dropping unwinding results that are unused.
+volatile size_t unwound_ip_count;
+
+// The unwinding part of `record --post-unwind`, on samples with dumped user stacks.
+static void BM_post_unwind(benchmark::State& state) {
+  std::string filename = GetSyntheticRecordFile(state.range_x(), 0, true);
+  size_t record_count = CountRecords(filename);
+  ResetPeakRss();
+  while (state.KeepRunning()) {
+    std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(filename);
+    CHECK(reader != nullptr);
+    ThreadTree thread_tree;
+    OfflineUnwinder unwinder;
+    CHECK(reader->ReadDataSection([&](std::unique_ptr<Record> record) {
+      BuildThreadTree(*record, &thread_tree);
+      if (record->type() == PERF_RECORD_SAMPLE) {
+        SampleRecord& r = *static_cast<SampleRecord*>(record.get());
+        const ThreadEntry* thread = thread_tree.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+        RegSet regs = CreateRegSet(r.regs_user_data.reg_mask, r.regs_user_data.regs);
+        unwound_ip_count +=
+            unwinder.UnwindCallChain(GetBuildArch(), *thread, regs, r.stack_user_data.data)
+                .size();
+      }
+      return true;
+    }, false));
+  }
+  state.SetItemsProcessed(state.iterations() * record_count);
+  SetPeakRssLabel(state);
+}
+BENCHMARK(BM_post_unwind)->Arg(10000);
+
+BENCHMARK_MAIN()
@@ -31,6 +31,8 @@
 //    data section of feature 1
 //    data section of feature 2
 //    ....
+//
+//  The data section is compressed when FEAT_COMPRESSED_DATA exists, see CompressedDataHeader.
 
 namespace PerfFileFormat {
 
@@ -55,6 +57,18 @@ enum {
   FEAT_PMU_MAPPINGS,
   FEAT_GROUP_DESC,
   FEAT_LAST_FEATURE,
+
+  // Features below are only used by simpleperf.
+  FEAT_SIMPLEPERF_START = 128,
+  FEAT_COMPRESSED_DATA = FEAT_SIMPLEPERF_START,
+  // Field offsets of tracepoint events, see TracingFormatsToBinary() in tracing.h.
+  FEAT_TRACEPOINT_FORMATS,
+  // Sample frequencies used by `record --target-bandwidth`, see SampleFreqChange.
+  FEAT_SAMPLE_FREQ_CHANGES,
+  // Symbols of the recording kernel, a symbol table in the format of symbol cache files written
+  // by Dso::SymbolTableToBinary(). It starts at an 8-byte aligned offset to be mapped directly.
+  FEAT_KERNEL_SYMBOLS,
+
   FEAT_MAX_NUM = 256,
 };
 
@@ -80,6 +94,32 @@ struct FileAttr {
   SectionDesc ids;
 };
 
+// If FEAT_COMPRESSED_DATA exists, the data section is a list of chunks compressed separately,
+// and the feature section is a CompressedDataHeader followed by a CompressedDataChunk for each
+// chunk. Decompressed chunks concatenate into the normal data section.
+enum CompressionType : uint32_t {
+  COMPRESSION_ZLIB = 1,
+};
+
+struct CompressedDataHeader {
+  uint32_t compression_type;
+  uint32_t chunk_count;
+};
+
+struct CompressedDataChunk {
+  uint64_t offset;  // Offset relative to the start of the data section.
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+};
+
+// The feature section of FEAT_SAMPLE_FREQ_CHANGES is a u64 count followed by an array of
+// SampleFreqChange, ordered by time. Events are sampled at freq Hz from time (in the clock used
+// by samples) to the time of the next element.
+struct SampleFreqChange {
+  uint64_t time;
+  uint64_t freq;
+};
+
 }  // namespace PerfFileFormat
 
 #endif  // SIMPLE_PERF_RECORD_FILE_FORMAT_H_
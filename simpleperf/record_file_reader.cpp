@@ -18,10 +18,18 @@
 
 #include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
 #include <set>
 #include <vector>
 
 #include <android-base/logging.h>
+#include <zlib.h>
 
 #include "perf_event.h"
 #include "record.h"
@@ -29,6 +37,8 @@
 
 using namespace PerfFileFormat;
 
+constexpr uint64_t RecordFileReader::DEFAULT_REORDER_WINDOW_IN_NS;
+
 std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(const std::string& filename) {
   std::string mode = std::string("rb") + CLOSE_ON_EXEC_MODE;
   FILE* fp = fopen(filename.c_str(), mode.c_str());
@@ -45,7 +55,15 @@ std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(const std::st
 }
 
 RecordFileReader::RecordFileReader(const std::string& filename, FILE* fp)
-    : filename_(filename), record_fp_(fp) {
+    : filename_(filename),
+      record_fp_(fp),
+      mapped_addr_(nullptr),
+      mapped_size_(0),
+      data_section_(nullptr),
+      data_section_size_(0),
+      data_section_truncated_(false),
+      reorder_window_in_ns_(DEFAULT_REORDER_WINDOW_IN_NS),
+      reorder_stats_() {
 }
 
 RecordFileReader::~RecordFileReader() {
@@ -55,6 +73,7 @@ RecordFileReader::~RecordFileReader() {
 }
 
 bool RecordFileReader::Close() {
+  UnmapDataSection();
   bool result = true;
   if (fclose(record_fp_) != 0) {
     PLOG(ERROR) << "failed to close record file '" << filename_ << "'";
@@ -144,42 +163,266 @@ bool RecordFileReader::ReadIdsForAttr(const FileAttr& attr, std::vector<uint64_t
   return true;
 }
 
-bool RecordFileReader::ReadDataSection(std::function<bool(std::unique_ptr<Record>)> callback,
-                                       bool sorted) {
-  if (fseek(record_fp_, header_.data.offset, SEEK_SET) != 0) {
+bool RecordFileReader::MapDataSection() {
+  if (data_section_ != nullptr) {
+    return true;
+  }
+  struct stat st;
+  if (fstat(fileno(record_fp_), &st) != 0) {
+    PLOG(ERROR) << "failed to stat " << filename_;
+    return false;
+  }
+  // Only map the part of the data section existing in the file, so a truncated record file is
+  // reported when reading records instead of faulting on access.
+  uint64_t file_size = st.st_size;
+  uint64_t data_begin = std::min<uint64_t>(header_.data.offset, file_size);
+  uint64_t data_end = std::min<uint64_t>(header_.data.offset + header_.data.size, file_size);
+  data_section_size_ = data_end - data_begin;
+  data_section_truncated_ = data_section_size_ < header_.data.size;
+  if (data_section_size_ == 0) {
+    data_section_ = reinterpret_cast<const char*>(&header_);
+    return true;
+  }
+#if !defined(_WIN32)
+  // The offset passed to mmap() must be page aligned.
+  uint64_t page_size = sysconf(_SC_PAGE_SIZE);
+  uint64_t map_begin = data_begin & ~(page_size - 1);
+  size_t map_size = data_end - map_begin;
+  void* addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fileno(record_fp_), map_begin);
+  if (addr != MAP_FAILED) {
+    mapped_addr_ = addr;
+    mapped_size_ = map_size;
+    data_section_ = static_cast<const char*>(addr) + (data_begin - map_begin);
+    return DecompressDataSection();
+  }
+  PLOG(DEBUG) << "failed to mmap " << filename_ << ", read it instead";
+#endif
+  data_buffer_.resize(data_section_size_);
+  if (fseek(record_fp_, data_begin, SEEK_SET) != 0) {
     PLOG(ERROR) << "failed to fseek()";
     return false;
   }
-  RecordCache cache(file_attrs_[0].attr);
-  for (size_t nbytes_read = 0; nbytes_read < header_.data.size;) {
-    std::unique_ptr<Record> record = ReadRecordFromFile(file_attrs_[0].attr, record_fp_);
-    if (record == nullptr) {
+  if (fread(data_buffer_.data(), data_buffer_.size(), 1, record_fp_) != 1) {
+    PLOG(ERROR) << "failed to read " << filename_;
+    return false;
+  }
+  data_section_ = data_buffer_.data();
+  return DecompressDataSection();
+}
+
+bool RecordFileReader::DecompressDataSection() {
+  if (feature_section_descriptors_.find(FEAT_COMPRESSED_DATA) ==
+      feature_section_descriptors_.end()) {
+    return true;
+  }
+  std::vector<char> index;
+  if (!ReadFeatureSection(FEAT_COMPRESSED_DATA, &index) ||
+      index.size() < sizeof(CompressedDataHeader)) {
+    LOG(ERROR) << "failed to read compressed data index in " << filename_;
+    return false;
+  }
+  const CompressedDataHeader* header = reinterpret_cast<const CompressedDataHeader*>(index.data());
+  const CompressedDataChunk* chunks =
+      reinterpret_cast<const CompressedDataChunk*>(index.data() + sizeof(CompressedDataHeader));
+  if (header->compression_type != COMPRESSION_ZLIB ||
+      index.size() < sizeof(CompressedDataHeader) +
+                         header->chunk_count * sizeof(CompressedDataChunk)) {
+    LOG(ERROR) << "unsupported compressed data index in " << filename_;
+    return false;
+  }
+  uint64_t total_size = 0;
+  for (uint32_t i = 0; i < header->chunk_count; ++i) {
+    total_size += chunks[i].uncompressed_size;
+  }
+  // Decompress chunks that exist in the file, like reading a truncated uncompressed data section.
+  std::vector<char> data(total_size);
+  size_t data_size = 0;
+  for (uint32_t i = 0; i < header->chunk_count; ++i) {
+    const CompressedDataChunk& chunk = chunks[i];
+    if (chunk.offset + chunk.compressed_size > data_section_size_) {
+      data_section_truncated_ = true;
+      break;
+    }
+    uLongf size = chunk.uncompressed_size;
+    if (uncompress(reinterpret_cast<Bytef*>(data.data() + data_size), &size,
+                   reinterpret_cast<const Bytef*>(data_section_ + chunk.offset),
+                   chunk.compressed_size) != Z_OK ||
+        size != chunk.uncompressed_size) {
+      LOG(ERROR) << "failed to decompress data chunk " << i << " in " << filename_;
       return false;
     }
-    nbytes_read += record->size();
-    if (sorted) {
-      cache.Push(std::move(record));
-      record = cache.Pop();
-      if (record != nullptr) {
-        if (!callback(std::move(record))) {
-          return false;
-        }
+    data_size += size;
+  }
+  bool truncated = data_section_truncated_;
+  UnmapDataSection();
+  data.resize(data_size);
+  data_buffer_ = std::move(data);
+  data_section_ = data_buffer_.empty() ? reinterpret_cast<const char*>(&header_)
+                                       : data_buffer_.data();
+  data_section_size_ = data_buffer_.size();
+  data_section_truncated_ = truncated;
+  return true;
+}
+
+void RecordFileReader::UnmapDataSection() {
+#if !defined(_WIN32)
+  if (mapped_addr_ != nullptr) {
+    munmap(mapped_addr_, mapped_size_);
+  }
+#endif
+  mapped_addr_ = nullptr;
+  mapped_size_ = 0;
+  data_buffer_.clear();
+  data_section_ = nullptr;
+  data_section_size_ = 0;
+}
+
+namespace {
+
+struct RecordViewWithSeq {
+  uint64_t time;
+  uint32_t seq;
+  bool is_sample;
+  const perf_event_header* header;
+
+  // Use the same order as RecordCache: the record with smaller time happens first, non-sample
+  // records happen before sample records at the same time, otherwise keep the file order.
+  bool IsHappensBefore(const RecordViewWithSeq& other) const {
+    if (time != other.time) {
+      return time < other.time;
+    }
+    if (is_sample != other.is_sample) {
+      return !is_sample;
+    }
+    return seq < other.seq;
+  }
+};
+
+}  // namespace
+
+bool RecordFileReader::ReadDataSectionViews(std::function<bool(const RecordView&)> callback,
+                                            bool sorted) {
+  if (!MapDataSection()) {
+    return false;
+  }
+  const perf_event_attr& attr = file_attrs_[0].attr;
+  // Without timestamps, records are sorted like RecordCache does, by holding a fixed number of
+  // records. Otherwise records are held for reorder_window_in_ns_ in a min heap, which only
+  // keeps a window of small entries pointing into the data section.
+  bool has_timestamp = attr.sample_id_all && (attr.sample_type & PERF_SAMPLE_TIME);
+  bool sort_all = has_timestamp && reorder_window_in_ns_ == 0;
+  const size_t min_cache_size = 1000u;
+  auto heap_compare = [](const RecordViewWithSeq& r1, const RecordViewWithSeq& r2) {
+    return r2.IsHappensBefore(r1);
+  };
+  std::vector<RecordViewWithSeq> records;
+  uint32_t seq = 0;
+  uint64_t max_time = 0;
+  uint64_t last_popped_time = 0;
+  reorder_stats_ = ReorderStats();
+  auto pop_record = [&]() {
+    std::pop_heap(records.begin(), records.end(), heap_compare);
+    const RecordViewWithSeq& r = records.back();
+    if (r.time < last_popped_time) {
+      reorder_stats_.late_records++;
+      if (!r.is_sample) {
+        reorder_stats_.late_non_sample_records++;
       }
     } else {
-      if (!callback(std::move(record))) {
+      last_popped_time = r.time;
+    }
+    bool result = callback(RecordView(attr, r.header, &stack_chunks_));
+    records.pop_back();
+    return result;
+  };
+  stack_chunks_.clear();
+  const char* p = data_section_;
+  const char* end = data_section_ + data_section_size_;
+  while (p < end) {
+    const perf_event_header* header = reinterpret_cast<const perf_event_header*>(p);
+    if (end - p < static_cast<ptrdiff_t>(sizeof(perf_event_header)) || header->size == 0 ||
+        end - p < header->size) {
+      LOG(ERROR) << "failed to read record file " << filename_ << ": record at offset "
+                 << (header_.data.offset + (p - data_section_)) << " is truncated";
+      return false;
+    }
+    p += header->size;
+    if (header->type == SIMPLE_PERF_RECORD_STACK_CHUNK) {
+      // Stack chunks are written before samples using them, and are only needed to parse them.
+      uint64_t id = StackChunkRecordId(header);
+      if (id >= data_section_size_ / (sizeof(perf_event_header) + 2 * sizeof(uint64_t))) {
+        LOG(ERROR) << "failed to read record file " << filename_ << ": invalid stack chunk id "
+                   << id;
+        return false;
+      }
+      if (id >= stack_chunks_.size()) {
+        stack_chunks_.resize(id + 1, nullptr);
+      }
+      stack_chunks_[id] = header;
+      continue;
+    }
+    RecordView view(attr, header, &stack_chunks_);
+    if (!sorted) {
+      if (!callback(view)) {
+        return false;
+      }
+      continue;
+    }
+    uint64_t time = view.Timestamp();
+    records.push_back(RecordViewWithSeq{time, seq++, view.type() == PERF_RECORD_SAMPLE, header});
+    if (sort_all) {
+      continue;
+    }
+    std::push_heap(records.begin(), records.end(), heap_compare);
+    reorder_stats_.max_pending_records =
+        std::max(reorder_stats_.max_pending_records, records.size());
+    if (!has_timestamp) {
+      if (records.size() >= min_cache_size && !pop_record()) {
+        return false;
+      }
+      continue;
+    }
+    max_time = std::max(max_time, time);
+    while (!records.empty() && records.front().time + reorder_window_in_ns_ <= max_time) {
+      if (!pop_record()) {
+        return false;
+      }
+    }
+  }
+  if (data_section_truncated_) {
+    LOG(ERROR) << "failed to read record file " << filename_ << ": data section is truncated";
+    return false;
+  }
+  if (sort_all) {
+    reorder_stats_.max_pending_records = records.size();
+    std::sort(records.begin(), records.end(),
+              [](const RecordViewWithSeq& r1, const RecordViewWithSeq& r2) {
+                return r1.IsHappensBefore(r2);
+              });
+    for (auto& r : records) {
+      if (!callback(RecordView(attr, r.header, &stack_chunks_))) {
         return false;
       }
     }
+    return true;
   }
-  std::vector<std::unique_ptr<Record>> records = cache.PopAll();
-  for (auto& record : records) {
-    if (!callback(std::move(record))) {
+  while (!records.empty()) {
+    if (!pop_record()) {
       return false;
     }
   }
   return true;
 }
 
+bool RecordFileReader::ReadDataSection(std::function<bool(std::unique_ptr<Record>)> callback,
+                                       bool sorted) {
+  return ReadDataSectionViews(
+      [&](const RecordView& view) {
+        return callback(view.Parse());
+      },
+      sorted);
+}
+
 bool RecordFileReader::ReadFeatureSection(int feature, std::vector<char>* data) {
   const std::map<int, SectionDesc>& section_map = FeatureSectionDescriptors();
   auto it = section_map.find(feature);
@@ -253,6 +496,42 @@ std::string RecordFileReader::ReadFeatureString(int feature) {
   return p;
 }
 
+std::vector<TracingFormat> RecordFileReader::ReadTracepointFormatsFeature() {
+  std::vector<char> buf;
+  std::vector<TracingFormat> formats;
+  if (!ReadFeatureSection(FEAT_TRACEPOINT_FORMATS, &buf)) {
+    return formats;
+  }
+  if (!TracingFormatsFromBinary(buf.data(), buf.size(), &formats)) {
+    LOG(ERROR) << "invalid tracepoint formats feature in " << filename_;
+    formats.clear();
+  }
+  return formats;
+}
+
+std::vector<SampleFreqChange> RecordFileReader::ReadSampleFreqChangesFeature() {
+  std::vector<char> buf;
+  std::vector<SampleFreqChange> changes;
+  if (!ReadFeatureSection(FEAT_SAMPLE_FREQ_CHANGES, &buf)) {
+    return changes;
+  }
+  const char* p = buf.data();
+  const char* end = buf.data() + buf.size();
+  uint64_t count;
+  if (buf.size() < sizeof(count)) {
+    LOG(ERROR) << "invalid sample freq changes feature in " << filename_;
+    return changes;
+  }
+  MoveFromBinaryFormat(count, p);
+  if (count > static_cast<size_t>(end - p) / sizeof(SampleFreqChange)) {
+    LOG(ERROR) << "invalid sample freq changes feature in " << filename_;
+    return changes;
+  }
+  changes.resize(count);
+  memcpy(changes.data(), p, count * sizeof(SampleFreqChange));
+  return changes;
+}
+
 std::vector<std::unique_ptr<Record>> RecordFileReader::DataSection() {
   std::vector<std::unique_ptr<Record>> records;
   ReadDataSection([&](std::unique_ptr<Record> record) {
@@ -20,11 +20,13 @@
 
 #include <memory>
 
+#include <android-base/file.h>
 #include <android-base/test_utils.h>
 
 #include "environment.h"
 #include "event_attr.h"
 #include "event_type.h"
+#include "perf_regs.h"
 #include "record.h"
 #include "record_file.h"
 
@@ -134,6 +136,97 @@ TEST_F(RecordFileTest, records_sorted_by_time) {
   ASSERT_TRUE(reader->Close());
 }
 
+TEST_F(RecordFileTest, records_sorted_in_reorder_window) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  attrs_[0]->sample_id_all = 1;
+  attrs_[0]->sample_type |= PERF_SAMPLE_TIME;
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+
+  // r2 is out of order within the window, r4 is later than the window.
+  MmapRecord r1 =
+      CreateMmapRecord(*(attr_ids_[0].attr), true, 1, 1, 0x100, 0x2000, 0x3000, "mmap_record1");
+  std::vector<MmapRecord> records(5, r1);
+  const uint64_t times[] = {20, 10, 30, 100, 15};
+  for (size_t i = 0; i < records.size(); ++i) {
+    records[i].sample_id.time_data.time = times[i];
+    ASSERT_TRUE(writer->WriteData(records[i].BinaryFormat()));
+  }
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  reader->SetReorderWindow(50);
+  std::vector<uint64_t> read_times;
+  ASSERT_TRUE(reader->ReadDataSection([&](std::unique_ptr<Record> r) {
+    read_times.push_back(r->Timestamp());
+    return true;
+  }));
+  ASSERT_EQ(std::vector<uint64_t>({10, 20, 30, 15, 100}), read_times);
+  ASSERT_EQ(4u, reader->GetReorderStats().max_pending_records);
+  ASSERT_EQ(1u, reader->GetReorderStats().late_records);
+  ASSERT_EQ(1u, reader->GetReorderStats().late_non_sample_records);
+
+  // A window of 0 sorts all records.
+  reader->SetReorderWindow(0);
+  read_times.clear();
+  ASSERT_TRUE(reader->ReadDataSection([&](std::unique_ptr<Record> r) {
+    read_times.push_back(r->Timestamp());
+    return true;
+  }));
+  ASSERT_EQ(std::vector<uint64_t>({10, 15, 20, 30, 100}), read_times);
+  ASSERT_EQ(0u, reader->GetReorderStats().late_records);
+}
+
+TEST_F(RecordFileTest, read_data_section_views) {
+  // Write to a record file.
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+
+  // Write attr section.
+  AddEventType("cpu-cycles");
+  attrs_[0]->sample_id_all = 1;
+  attrs_[0]->sample_type |= PERF_SAMPLE_TIME;
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+
+  // Write data section.
+  MmapRecord r1 =
+      CreateMmapRecord(*(attr_ids_[0].attr), true, 1, 1, 0x100, 0x2000, 0x3000, "mmap_record1");
+  CommRecord r2 = CreateCommRecord(*(attr_ids_[0].attr), 1, 1, "comm_record");
+  r1.sample_id.time_data.time = 2;
+  r2.sample_id.time_data.time = 1;
+  ASSERT_TRUE(writer->WriteData(r1.BinaryFormat()));
+  ASSERT_TRUE(writer->WriteData(r2.BinaryFormat()));
+  ASSERT_TRUE(writer->Close());
+
+  // Read from a record file.
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<std::unique_ptr<Record>> records;
+  ASSERT_TRUE(reader->ReadDataSectionViews([&](const RecordView& view) {
+    std::unique_ptr<Record> record = view.Parse();
+    EXPECT_EQ(record->Timestamp(), view.Timestamp());
+    records.push_back(std::move(record));
+    return true;
+  }));
+  ASSERT_EQ(2u, records.size());
+  CheckRecordEqual(r2, *records[0]);
+  CheckRecordEqual(r1, *records[1]);
+
+  // Read again without sorting.
+  records.clear();
+  ASSERT_TRUE(reader->ReadDataSectionViews([&](const RecordView& view) {
+    records.push_back(view.Parse());
+    return true;
+  }, false));
+  ASSERT_EQ(2u, records.size());
+  CheckRecordEqual(r1, *records[0]);
+  CheckRecordEqual(r2, *records[1]);
+
+  ASSERT_TRUE(reader->Close());
+}
+
 TEST_F(RecordFileTest, record_more_than_one_attr) {
   // Write to a record file.
   std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
@@ -159,3 +252,210 @@ TEST_F(RecordFileTest, record_more_than_one_attr) {
     ASSERT_EQ(ids, attr_ids_[i].ids);
   }
 }
+
+TEST_F(RecordFileTest, async_data_writing) {
+  // Write to a record file.
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  ASSERT_TRUE(writer->StartAsyncDataWriting(true));
+
+  // Write enough records to fill the ring of buffers several times.
+  std::vector<MmapRecord> mmap_records;
+  for (size_t i = 0; i < 100000; ++i) {
+    mmap_records.push_back(CreateMmapRecord(*(attr_ids_[0].attr), false, i, i, 0x1000 * i, 0x1000,
+                                            0, "mmap_record_" + std::to_string(i)));
+    ASSERT_TRUE(writer->WriteData(mmap_records.back().BinaryFormat()));
+  }
+  ASSERT_TRUE(writer->WriteFeatureHeader(1));
+  BuildIdRecord build_id_record = CreateBuildIdRecord(false, getpid(), BuildId(), "init");
+  ASSERT_TRUE(writer->WriteBuildIdFeature({build_id_record}));
+  ASSERT_TRUE(writer->Close());
+
+  // Read from a record file.
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  size_t i = 0;
+  ASSERT_TRUE(reader->ReadDataSection([&](std::unique_ptr<Record> record) {
+    EXPECT_LT(i, mmap_records.size());
+    CheckRecordEqual(mmap_records[i++], *record);
+    return !HasFailure();
+  }, false));
+  ASSERT_EQ(mmap_records.size(), i);
+  std::vector<BuildIdRecord> build_id_records = reader->ReadBuildIdFeature();
+  ASSERT_EQ(1u, build_id_records.size());
+  CheckRecordEqual(build_id_record, build_id_records[0]);
+  ASSERT_TRUE(reader->Close());
+}
+
+TEST_F(RecordFileTest, write_to_memory) {
+  AddEventType("cpu-cycles");
+  MmapRecord mmap_record = CreateMmapRecord(*(attr_ids_[0].attr), false, 1, 1, 0x1000, 0x2000,
+                                            0, "mmap_record_example");
+  BuildIdRecord build_id_record = CreateBuildIdRecord(false, getpid(), BuildId(), "init");
+  auto write_file = [&](RecordFileWriter* writer) {
+    ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+    ASSERT_TRUE(writer->WriteData(mmap_record.BinaryFormat()));
+    ASSERT_TRUE(writer->WriteFeatureHeader(2));
+    ASSERT_TRUE(writer->WriteBuildIdFeature({build_id_record}));
+    ASSERT_TRUE(writer->WriteFeatureString(FEAT_OSRELEASE, "4.4"));
+    ASSERT_TRUE(writer->Close());
+  };
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  write_file(writer.get());
+  std::string file_data;
+  ASSERT_TRUE(android::base::ReadFileToString(tmpfile_.path, &file_data));
+
+  // The buffer is reused for a second file, with stale data from a longer one in it.
+  std::vector<char> buffer(file_data.size() * 2, 'x');
+  writer = RecordFileWriter::CreateInstance(&buffer);
+  ASSERT_TRUE(writer != nullptr);
+  write_file(writer.get());
+  ASSERT_EQ(file_data, std::string(buffer.begin(), buffer.end()));
+}
+
+TEST_F(RecordFileTest, stack_dedup) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  attrs_[0]->sample_type |= PERF_SAMPLE_TID | PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+  attrs_[0]->sample_regs_user = GetSupportedRegMask(GetBuildArch());
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  writer->EnableStackDedup();
+
+  // Create samples from a zeroed buffer, then fill in regs and stacks.
+  std::vector<char> buf(1024, '\0');
+  perf_event_header* header = reinterpret_cast<perf_event_header*>(buf.data());
+  header->type = PERF_RECORD_SAMPLE;
+  header->size = buf.size();
+  SampleRecord sample(*attrs_[0], header);
+  auto create_sample = [&](uint32_t tid, uint64_t sp, const std::vector<char>& stack) {
+    SampleRecord r = sample;
+    r.tid_data.pid = r.tid_data.tid = tid;
+    r.regs_user_data.abi = 1;
+    r.regs_user_data.reg_mask = attrs_[0]->sample_regs_user;
+    // Set all regs to sp, so we don't depend on the sp register number of the arch.
+    r.regs_user_data.regs.assign(__builtin_popcountll(r.regs_user_data.reg_mask), sp);
+    r.stack_user_data.data = stack;
+    r.stack_user_data.dyn_size = stack.size();
+    // BinaryFormat() only shrinks the size, so start from the max size.
+    r.header.size = UINT16_MAX;
+    r.AdjustSizeBasedOnData();
+    return r;
+  };
+  std::vector<char> stack(5000);
+  for (size_t i = 0; i < stack.size(); ++i) {
+    stack[i] = static_cast<char>(i);
+  }
+  std::vector<SampleRecord> samples;
+  samples.push_back(create_sample(1, 0x7f000100, stack));
+  // Only the top of the stack changes, so the chunks below it are shared.
+  stack[0]++;
+  samples.push_back(create_sample(1, 0x7f000100, stack));
+  // The stack grows, so the first chunk covers a different range.
+  std::vector<char> grown_stack(16, 'a');
+  grown_stack.insert(grown_stack.end(), stack.begin(), stack.end() - 16);
+  samples.push_back(create_sample(1, 0x7f0000f0, grown_stack));
+  samples.push_back(create_sample(2, 0x7f000100, stack));
+  // Samples of a thread don't share chunks with samples before its exit.
+  std::vector<char> exit_binary = CreateForkRecord(*attrs_[0], 1, 1, 0, 0).BinaryFormat();
+  reinterpret_cast<perf_event_header*>(exit_binary.data())->type = PERF_RECORD_EXIT;
+  ExitRecord exit_record(*attrs_[0], reinterpret_cast<perf_event_header*>(exit_binary.data()));
+  size_t sample_data_size = 0;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    if (i == 3) {
+      ASSERT_TRUE(writer->WriteRecord(exit_record));
+    }
+    ASSERT_TRUE(writer->WriteRecord(samples[i]));
+    sample_data_size += samples[i].header.size;
+  }
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_LT(reader->FileHeader().data.size, sample_data_size);
+  std::vector<std::unique_ptr<Record>> records;
+  ASSERT_TRUE(reader->ReadDataSection([&](std::unique_ptr<Record> record) {
+    records.push_back(std::move(record));
+    return true;
+  }, false));
+  ASSERT_EQ(samples.size() + 1, records.size());
+  records.erase(records.begin() + 3);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    ASSERT_EQ(PERF_RECORD_SAMPLE, records[i]->type());
+    ASSERT_EQ(samples[i].BinaryFormat(), records[i]->BinaryFormat());
+  }
+  ASSERT_TRUE(reader->Close());
+}
+
+TEST_F(RecordFileTest, compressed_data_section) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  writer->EnableCompression();
+
+  // Write enough records to use several chunks.
+  std::vector<MmapRecord> mmap_records;
+  size_t data_size = 0;
+  for (size_t i = 0; i < 20000; ++i) {
+    mmap_records.push_back(CreateMmapRecord(*(attr_ids_[0].attr), false, i, i, 0x1000 * i, 0x1000,
+                                            0, "mmap_record_" + std::to_string(i)));
+    ASSERT_TRUE(writer->WriteData(mmap_records.back().BinaryFormat()));
+    data_size += mmap_records.back().header.size;
+  }
+  ASSERT_TRUE(writer->WriteFeatureHeader(1));
+  BuildIdRecord build_id_record = CreateBuildIdRecord(false, getpid(), BuildId(), "init");
+  ASSERT_TRUE(writer->WriteBuildIdFeature({build_id_record}));
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_LT(reader->FileHeader().data.size, data_size);
+  ASSERT_EQ(1u, reader->FeatureSectionDescriptors().count(FEAT_COMPRESSED_DATA));
+  size_t i = 0;
+  ASSERT_TRUE(reader->ReadDataSection([&](std::unique_ptr<Record> record) {
+    EXPECT_LT(i, mmap_records.size());
+    CheckRecordEqual(mmap_records[i++], *record);
+    return !HasFailure();
+  }, false));
+  ASSERT_EQ(mmap_records.size(), i);
+  std::vector<BuildIdRecord> build_id_records = reader->ReadBuildIdFeature();
+  ASSERT_EQ(1u, build_id_records.size());
+  CheckRecordEqual(build_id_record, build_id_records[0]);
+  ASSERT_TRUE(reader->Close());
+}
+
+TEST_F(RecordFileTest, tracepoint_formats_feature) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  TracingFormat format;
+  format.system_name = "sched";
+  format.name = "sched_switch";
+  format.id = 318;
+  TracingField field;
+  field.name = "prev_comm";
+  field.offset = 8;
+  field.size = 16;
+  field.is_string = true;
+  format.fields.push_back(field);
+  ASSERT_TRUE(writer->WriteFeatureHeader(1));
+  ASSERT_TRUE(writer->WriteTracepointFormatsFeature({format}));
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<TracingFormat> formats = reader->ReadTracepointFormatsFeature();
+  ASSERT_EQ(1u, formats.size());
+  ASSERT_EQ("sched:sched_switch", formats[0].FullName());
+  ASSERT_EQ(318u, formats[0].id);
+  ASSERT_EQ(1u, formats[0].fields.size());
+  ASSERT_EQ("prev_comm", formats[0].fields[0].name);
+  ASSERT_EQ(8u, formats[0].fields[0].offset);
+  ASSERT_TRUE(formats[0].fields[0].is_string);
+  ASSERT_TRUE(reader->Close());
+}
@@ -16,23 +16,257 @@
 
 #include "record_file.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <zlib.h>
 
 #include "perf_event.h"
+#include "perf_regs.h"
 #include "record.h"
 #include "utils.h"
 
 using namespace PerfFileFormat;
 
+// AsyncDataWriter writes the data section of a record file on its own thread. The producer fills
+// a ring of large buffers and hands full buffers to the writer thread by advancing atomic ring
+// indexes, so it only waits when all buffers are still being written. The mutex is only used to
+// sleep and wake up when the ring is empty or full.
+// Each buffer except the first one starts at a file offset aligned to DIRECT_IO_ALIGNMENT, so
+// full buffers can be written with O_DIRECT.
+class AsyncDataWriter {
+ public:
+  AsyncDataWriter(const std::string& filename, int fd, uint64_t file_offset);
+  ~AsyncDataWriter();
+
+  bool Start(bool direct_io);
+  bool Write(const char* data, size_t size);
+  // Write all data and stop the writer thread.
+  bool Finish();
+
+  uint64_t BlockedTimeInNs() const {
+    return blocked_time_in_ns_;
+  }
+
+ private:
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+  static constexpr size_t BUFFER_COUNT = 8;
+  static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+  struct Buffer {
+    char* data;
+    size_t size;
+    size_t capacity;
+    uint64_t file_offset;
+  };
+
+  bool SubmitBuffer();
+  void WriterThreadMain();
+  bool WriteBuffer(const Buffer& buffer);
+  void Notify(std::condition_variable* cond);
+
+  const std::string filename_;
+  const int fd_;
+  int direct_fd_;
+  uint64_t file_offset_;  // The file offset of buffers_[tail_ % BUFFER_COUNT].
+  Buffer buffers_[BUFFER_COUNT];
+
+  // buffers_ in [head_, tail_) are full and owned by the writer thread, buffers_[tail_] is
+  // filled by the producer. Indexes are taken modulo BUFFER_COUNT.
+  std::atomic<uint64_t> head_;
+  std::atomic<uint64_t> tail_;
+  std::atomic<bool> finished_;
+  std::atomic<bool> failed_;
+  std::mutex mutex_;
+  std::condition_variable buffer_full_cond_;
+  std::condition_variable buffer_free_cond_;
+  std::thread writer_thread_;
+  uint64_t blocked_time_in_ns_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncDataWriter);
+};
+
+AsyncDataWriter::AsyncDataWriter(const std::string& filename, int fd, uint64_t file_offset)
+    : filename_(filename),
+      fd_(fd),
+      direct_fd_(-1),
+      file_offset_(file_offset),
+      head_(0),
+      tail_(0),
+      finished_(false),
+      failed_(false),
+      blocked_time_in_ns_(0) {
+  for (auto& buffer : buffers_) {
+    buffer.data = nullptr;
+    buffer.size = 0;
+    buffer.capacity = BUFFER_SIZE;
+    buffer.file_offset = 0;
+  }
+  // Shorten the first buffer to make the following buffers aligned.
+  buffers_[0].capacity -= file_offset % DIRECT_IO_ALIGNMENT;
+}
+
+AsyncDataWriter::~AsyncDataWriter() {
+  if (writer_thread_.joinable()) {
+    Finish();
+  }
+  for (auto& buffer : buffers_) {
+    free(buffer.data);
+  }
+  if (direct_fd_ != -1) {
+    close(direct_fd_);
+  }
+}
+
+bool AsyncDataWriter::Start(bool direct_io) {
+  for (auto& buffer : buffers_) {
+    // Buffers written with O_DIRECT need aligned addresses.
+    void* p;
+    if (posix_memalign(&p, DIRECT_IO_ALIGNMENT, BUFFER_SIZE) != 0) {
+      LOG(ERROR) << "failed to allocate buffers for writing " << filename_;
+      return false;
+    }
+    buffer.data = static_cast<char*>(p);
+  }
+  if (direct_io) {
+    direct_fd_ = TEMP_FAILURE_RETRY(open(filename_.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC));
+    if (direct_fd_ == -1) {
+      PLOG(WARNING) << "failed to open " << filename_ << " with O_DIRECT, use buffered writes";
+    }
+  }
+  writer_thread_ = std::thread(&AsyncDataWriter::WriterThreadMain, this);
+  return true;
+}
+
+bool AsyncDataWriter::Write(const char* data, size_t size) {
+  while (size > 0) {
+    Buffer& buffer = buffers_[tail_.load(std::memory_order_relaxed) % BUFFER_COUNT];
+    size_t copy_size = std::min(size, buffer.capacity - buffer.size);
+    memcpy(buffer.data + buffer.size, data, copy_size);
+    buffer.size += copy_size;
+    data += copy_size;
+    size -= copy_size;
+    if (buffer.size == buffer.capacity && !SubmitBuffer()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool AsyncDataWriter::SubmitBuffer() {
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+  Buffer& buffer = buffers_[tail % BUFFER_COUNT];
+  buffer.file_offset = file_offset_;
+  file_offset_ += buffer.size;
+  tail_.store(++tail, std::memory_order_release);
+  Notify(&buffer_full_cond_);
+
+  // Wait until the writer thread releases the next buffer.
+  auto next_buffer_is_free = [&]() {
+    return tail - head_.load(std::memory_order_acquire) < BUFFER_COUNT ||
+           failed_.load(std::memory_order_relaxed);
+  };
+  if (!next_buffer_is_free()) {
+    auto start_time = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    buffer_free_cond_.wait(lock, next_buffer_is_free);
+    blocked_time_in_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+  }
+  if (failed_) {
+    return false;
+  }
+  Buffer& next_buffer = buffers_[tail % BUFFER_COUNT];
+  next_buffer.size = 0;
+  next_buffer.capacity = BUFFER_SIZE;
+  return true;
+}
+
+bool AsyncDataWriter::Finish() {
+  bool result = true;
+  if (buffers_[tail_ % BUFFER_COUNT].size > 0) {
+    result = SubmitBuffer();
+  }
+  finished_ = true;
+  Notify(&buffer_full_cond_);
+  writer_thread_.join();
+  return result && !failed_;
+}
+
+void AsyncDataWriter::Notify(std::condition_variable* cond) {
+  // Taking the mutex makes sure the waiter either sees the new state or is already waiting.
+  { std::lock_guard<std::mutex> lock(mutex_); }
+  cond->notify_one();
+}
+
+void AsyncDataWriter::WriterThreadMain() {
+  while (true) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    auto has_full_buffer = [&]() {
+      return head != tail_.load(std::memory_order_acquire);
+    };
+    if (!has_full_buffer()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      buffer_full_cond_.wait(lock, [&]() { return has_full_buffer() || finished_; });
+      if (!has_full_buffer()) {
+        break;
+      }
+    }
+    if (!WriteBuffer(buffers_[head % BUFFER_COUNT])) {
+      failed_ = true;
+      Notify(&buffer_free_cond_);
+      break;
+    }
+    head_.store(head + 1, std::memory_order_release);
+    Notify(&buffer_free_cond_);
+  }
+}
+
+bool AsyncDataWriter::WriteBuffer(const Buffer& buffer) {
+  int fd = fd_;
+  if (direct_fd_ != -1 && buffer.file_offset % DIRECT_IO_ALIGNMENT == 0 &&
+      buffer.size % DIRECT_IO_ALIGNMENT == 0) {
+    fd = direct_fd_;
+  }
+  const char* p = buffer.data;
+  size_t size = buffer.size;
+  uint64_t offset = buffer.file_offset;
+  while (size > 0) {
+    ssize_t n = TEMP_FAILURE_RETRY(pwrite(fd, p, size, offset));
+    if (n == -1 && errno == EINVAL && fd == direct_fd_) {
+      // Some file systems accept O_DIRECT in open() but not in write().
+      PLOG(WARNING) << "failed to write " << filename_ << " with O_DIRECT, use buffered writes";
+      close(direct_fd_);
+      direct_fd_ = -1;
+      fd = fd_;
+      continue;
+    }
+    if (n <= 0) {
+      PLOG(ERROR) << "failed to write to record file '" << filename_ << "'";
+      return false;
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
 std::unique_ptr<RecordFileWriter> RecordFileWriter::CreateInstance(const std::string& filename) {
   // Remove old perf.data to avoid file ownership problems.
   std::string err;
@@ -46,22 +280,36 @@ std::unique_ptr<RecordFileWriter> RecordFileWriter::CreateInstance(const std::st
     return nullptr;
   }
 
-  return std::unique_ptr<RecordFileWriter>(new RecordFileWriter(filename, fp));
+  return std::unique_ptr<RecordFileWriter>(new RecordFileWriter(filename, fp, nullptr));
 }
 
-RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp)
+std::unique_ptr<RecordFileWriter> RecordFileWriter::CreateInstance(std::vector<char>* buffer) {
+  // Keep the capacity of the buffer, so a caller writing a record file per collection period
+  // doesn't reallocate it each time.
+  buffer->clear();
+  return std::unique_ptr<RecordFileWriter>(new RecordFileWriter("[in memory]", nullptr, buffer));
+}
+
+RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp,
+                                   std::vector<char>* buffer)
     : filename_(filename),
       record_fp_(fp),
+      buffer_(buffer),
+      buffer_pos_(0),
       attr_section_offset_(0),
       attr_section_size_(0),
       data_section_offset_(0),
       data_section_size_(0),
       feature_count_(0),
-      current_feature_index_(0) {
+      current_feature_index_(0),
+      compress_data_(false),
+      async_write_blocked_time_in_ns_(0),
+      stack_dedup_(false),
+      next_stack_chunk_id_(0) {
 }
 
 RecordFileWriter::~RecordFileWriter() {
-  if (record_fp_ != nullptr) {
+  if (record_fp_ != nullptr || buffer_ != nullptr) {
     Close();
   }
 }
@@ -72,13 +320,13 @@ bool RecordFileWriter::WriteAttrSection(const std::vector<AttrWithId>& attr_ids)
   }
 
   // Skip file header part.
-  if (fseek(record_fp_, sizeof(FileHeader), SEEK_SET) == -1) {
+  if (!Seek(sizeof(FileHeader))) {
     return false;
   }
 
   // Write id section.
-  long id_section_offset = ftell(record_fp_);
-  if (id_section_offset == -1) {
+  uint64_t id_section_offset;
+  if (!Tell(&id_section_offset)) {
     return false;
   }
   for (auto& attr_id : attr_ids) {
@@ -88,8 +336,8 @@ bool RecordFileWriter::WriteAttrSection(const std::vector<AttrWithId>& attr_ids)
   }
 
   // Write attr section.
-  long attr_section_offset = ftell(record_fp_);
-  if (attr_section_offset == -1) {
+  uint64_t attr_section_offset;
+  if (!Tell(&attr_section_offset)) {
     return false;
   }
   for (auto& attr_id : attr_ids) {
@@ -103,8 +351,8 @@ bool RecordFileWriter::WriteAttrSection(const std::vector<AttrWithId>& attr_ids)
     }
   }
 
-  long data_section_offset = ftell(record_fp_);
-  if (data_section_offset == -1) {
+  uint64_t data_section_offset;
+  if (!Tell(&data_section_offset)) {
     return false;
   }
 
@@ -117,15 +365,176 @@ bool RecordFileWriter::WriteAttrSection(const std::vector<AttrWithId>& attr_ids)
   return true;
 }
 
+bool RecordFileWriter::StartAsyncDataWriting(bool direct_io) {
+  CHECK(async_data_writer_ == nullptr);
+  CHECK(record_fp_ != nullptr) << "async data writing needs a record file";
+  // Data written before through record_fp_ should reach the file before the writer thread
+  // writes at following offsets.
+  if (fflush(record_fp_) != 0) {
+    PLOG(ERROR) << "failed to write to record file '" << filename_ << "'";
+    return false;
+  }
+  async_data_writer_.reset(new AsyncDataWriter(filename_, fileno(record_fp_),
+                                               data_section_offset_ + data_section_size_));
+  if (!async_data_writer_->Start(direct_io)) {
+    async_data_writer_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool RecordFileWriter::FinishAsyncDataWriting() {
+  if (async_data_writer_ == nullptr) {
+    return true;
+  }
+  bool result = async_data_writer_->Finish();
+  async_write_blocked_time_in_ns_ = async_data_writer_->BlockedTimeInNs();
+  async_data_writer_ = nullptr;
+  return result;
+}
+
+uint64_t RecordFileWriter::AsyncWriteBlockedTimeInNs() const {
+  if (async_data_writer_ != nullptr) {
+    return async_data_writer_->BlockedTimeInNs();
+  }
+  return async_write_blocked_time_in_ns_;
+}
+
+void RecordFileWriter::EnableCompression() {
+  CHECK_EQ(data_section_size_, 0u);
+  compress_data_ = true;
+}
+
 bool RecordFileWriter::WriteData(const void* buf, size_t len) {
-  if (!Write(buf, len)) {
+  if (!compress_data_) {
+    return WriteToDataSection(buf, len);
+  }
+  // Records are collected into chunks of about this size before compression. Chunks end at
+  // record boundaries unless a record is bigger than a chunk.
+  constexpr size_t UNCOMPRESSED_CHUNK_SIZE = 256 * 1024;
+  if (!uncompressed_data_.empty() && uncompressed_data_.size() + len > UNCOMPRESSED_CHUNK_SIZE) {
+    if (!FlushCompressedData()) {
+      return false;
+    }
+  }
+  const char* p = static_cast<const char*>(buf);
+  uncompressed_data_.insert(uncompressed_data_.end(), p, p + len);
+  return true;
+}
+
+bool RecordFileWriter::FlushCompressedData() {
+  if (uncompressed_data_.empty()) {
+    return true;
+  }
+  uLongf compressed_size = compressBound(uncompressed_data_.size());
+  std::vector<char> compressed_data(compressed_size);
+  // Use the fastest level, as compression runs on the thread reading the kernel buffers.
+  int ret = compress2(reinterpret_cast<Bytef*>(compressed_data.data()), &compressed_size,
+                      reinterpret_cast<const Bytef*>(uncompressed_data_.data()),
+                      uncompressed_data_.size(), Z_BEST_SPEED);
+  if (ret != Z_OK) {
+    LOG(ERROR) << "failed to compress data for record file '" << filename_ << "': " << ret;
+    return false;
+  }
+  CompressedDataChunk chunk;
+  chunk.offset = data_section_size_;
+  chunk.compressed_size = compressed_size;
+  chunk.uncompressed_size = uncompressed_data_.size();
+  compressed_chunks_.push_back(chunk);
+  uncompressed_data_.clear();
+  return WriteToDataSection(compressed_data.data(), compressed_size);
+}
+
+bool RecordFileWriter::WriteToDataSection(const void* buf, size_t len) {
+  if (async_data_writer_ != nullptr) {
+    if (!async_data_writer_->Write(static_cast<const char*>(buf), len)) {
+      return false;
+    }
+  } else if (!Write(buf, len)) {
     return false;
   }
   data_section_size_ += len;
   return true;
 }
 
+bool RecordFileWriter::WriteRecord(const Record& record) {
+  if (stack_dedup_) {
+    if (record.header.type == PERF_RECORD_SAMPLE) {
+      const SampleRecord& r = static_cast<const SampleRecord&>(record);
+      if ((r.sample_type & PERF_SAMPLE_STACK_USER) && !r.stack_user_data.data.empty()) {
+        return WriteDedupSampleRecord(r);
+      }
+    } else if (record.header.type == PERF_RECORD_EXIT) {
+      thread_stacks_.erase(static_cast<const ExitRecord&>(record).data.tid);
+    }
+  }
+  return WriteSerializedRecord(record);
+}
+
+bool RecordFileWriter::WriteSerializedRecord(const Record& record) {
+  record_buffer_.clear();
+  record.AppendBinaryFormat(&record_buffer_);
+  return WriteData(record_buffer_);
+}
+
+bool RecordFileWriter::WriteDedupSampleRecord(const SampleRecord& r) {
+  // Chunk boundaries are aligned by stack address, so a chunk has the same range in consecutive
+  // samples as long as the stack pointer stays below it.
+  constexpr uint64_t STACK_CHUNK_SIZE = 1024;
+  uint64_t sp;
+  if (!GetSpRegValue(CreateRegSet(r.regs_user_data.reg_mask, r.regs_user_data.regs),
+                     GetBuildArch(), &sp)) {
+    return WriteSerializedRecord(r);
+  }
+  const std::vector<char>& stack = r.stack_user_data.data;
+  uint64_t stack_end = sp + stack.size();
+  ThreadStack& prev = thread_stacks_[r.tid_data.tid];
+  uint64_t prev_end = prev.start_addr + prev.data.size();
+  std::vector<uint64_t> chunk_ids;
+  for (uint64_t addr = sp; addr < stack_end;) {
+    uint64_t next = std::min((addr & ~(STACK_CHUNK_SIZE - 1)) + STACK_CHUNK_SIZE, stack_end);
+    const char* data = stack.data() + (addr - sp);
+    size_t size = next - addr;
+    // A chunk of the previous stack can be reused if it covers exactly the same range.
+    bool reused = false;
+    if (addr >= prev.start_addr && next <= prev_end) {
+      uint64_t prev_base = prev.start_addr & ~(STACK_CHUNK_SIZE - 1);
+      size_t index = ((addr & ~(STACK_CHUNK_SIZE - 1)) - prev_base) / STACK_CHUNK_SIZE;
+      uint64_t prev_addr = (index == 0) ? prev.start_addr : prev_base + index * STACK_CHUNK_SIZE;
+      uint64_t prev_next = std::min(prev_base + (index + 1) * STACK_CHUNK_SIZE, prev_end);
+      if (prev_addr == addr && prev_next == next &&
+          memcmp(prev.data.data() + (addr - prev.start_addr), data, size) == 0) {
+        chunk_ids.push_back(prev.chunk_ids[index]);
+        reused = true;
+      }
+    }
+    if (!reused) {
+      uint64_t id = next_stack_chunk_id_++;
+      if (!WriteData(StackChunkRecordBinary(id, data, size))) {
+        return false;
+      }
+      chunk_ids.push_back(id);
+    }
+    addr = next;
+  }
+  if (!WriteData(ChunkedSampleRecordBinary(r, chunk_ids))) {
+    return false;
+  }
+  prev.start_addr = sp;
+  prev.data = stack;
+  prev.chunk_ids = std::move(chunk_ids);
+  return true;
+}
+
 bool RecordFileWriter::Write(const void* buf, size_t len) {
+  if (buffer_ != nullptr) {
+    if (buffer_pos_ + len > buffer_->size()) {
+      buffer_->resize(buffer_pos_ + len);
+    }
+    memcpy(buffer_->data() + buffer_pos_, buf, len);
+    buffer_pos_ += len;
+    return true;
+  }
   if (fwrite(buf, len, 1, record_fp_) != 1) {
     PLOG(ERROR) << "failed to write to record file '" << filename_ << "'";
     return false;
@@ -133,32 +542,86 @@ bool RecordFileWriter::Write(const void* buf, size_t len) {
   return true;
 }
 
-bool RecordFileWriter::SeekFileEnd(uint64_t* file_end) {
-  if (fseek(record_fp_, 0, SEEK_END) == -1) {
+bool RecordFileWriter::Seek(uint64_t offset) {
+  if (buffer_ != nullptr) {
+    // Like a file, seeking past the end and writing leaves a zero filled gap.
+    if (offset > buffer_->size()) {
+      buffer_->resize(offset);
+    }
+    buffer_pos_ = offset;
+    return true;
+  }
+  if (fseek(record_fp_, offset, SEEK_SET) == -1) {
     PLOG(ERROR) << "fseek() failed";
     return false;
   }
-  long offset = ftell(record_fp_);
-  if (offset == -1) {
+  return true;
+}
+
+bool RecordFileWriter::Tell(uint64_t* offset) {
+  if (buffer_ != nullptr) {
+    *offset = buffer_pos_;
+    return true;
+  }
+  long pos = ftell(record_fp_);
+  if (pos == -1) {
     PLOG(ERROR) << "ftell() failed";
     return false;
   }
-  *file_end = static_cast<uint64_t>(offset);
+  *offset = static_cast<uint64_t>(pos);
   return true;
 }
 
+bool RecordFileWriter::SeekFileEnd(uint64_t* file_end) {
+  if (buffer_ != nullptr) {
+    buffer_pos_ = buffer_->size();
+    *file_end = buffer_pos_;
+    return true;
+  }
+  if (fseek(record_fp_, 0, SEEK_END) == -1) {
+    PLOG(ERROR) << "fseek() failed";
+    return false;
+  }
+  return Tell(file_end);
+}
+
 bool RecordFileWriter::WriteFeatureHeader(size_t feature_count) {
+  if (compress_data_ && !FlushCompressedData()) {
+    return false;
+  }
+  if (!FinishAsyncDataWriting()) {
+    return false;
+  }
   feature_count_ = feature_count;
   current_feature_index_ = 0;
-  uint64_t feature_header_size = feature_count * sizeof(SectionDesc);
+  // FEAT_COMPRESSED_DATA is written here in an extra slot after the features of the caller, as
+  // features are ordered by id.
+  uint64_t feature_header_size = (feature_count + (compress_data_ ? 1 : 0)) * sizeof(SectionDesc);
 
   // Reserve enough space in the record file for the feature header.
   std::vector<unsigned char> zero_data(feature_header_size);
-  if (fseek(record_fp_, data_section_offset_ + data_section_size_, SEEK_SET) == -1) {
-    PLOG(ERROR) << "fseek() failed";
+  if (!Seek(data_section_offset_ + data_section_size_)) {
+    return false;
+  }
+  if (!Write(zero_data.data(), zero_data.size())) {
     return false;
   }
-  return Write(zero_data.data(), zero_data.size());
+  return !compress_data_ || WriteCompressedDataFeature();
+}
+
+bool RecordFileWriter::WriteCompressedDataFeature() {
+  uint64_t start_offset;
+  if (!SeekFileEnd(&start_offset)) {
+    return false;
+  }
+  CompressedDataHeader header;
+  header.compression_type = COMPRESSION_ZLIB;
+  header.chunk_count = compressed_chunks_.size();
+  if (!Write(&header, sizeof(header)) ||
+      !Write(compressed_chunks_.data(), compressed_chunks_.size() * sizeof(CompressedDataChunk))) {
+    return false;
+  }
+  return WriteFeatureDesc(FEAT_COMPRESSED_DATA, feature_count_, start_offset);
 }
 
 bool RecordFileWriter::WriteBuildIdFeature(const std::vector<BuildIdRecord>& build_id_records) {
@@ -166,11 +629,12 @@ bool RecordFileWriter::WriteBuildIdFeature(const std::vector<BuildIdRecord>& bui
   if (!WriteFeatureBegin(&start_offset)) {
     return false;
   }
+  std::vector<char> data;
   for (auto& record : build_id_records) {
-    std::vector<char> data = record.BinaryFormat();
-    if (!Write(data.data(), data.size())) {
-      return false;
-    }
+    record.AppendBinaryFormat(&data);
+  }
+  if (!data.empty() && !Write(data.data(), data.size())) {
+    return false;
   }
   return WriteFeatureEnd(FEAT_BUILD_ID, start_offset);
 }
@@ -223,6 +687,65 @@ bool RecordFileWriter::WriteBranchStackFeature() {
   return WriteFeatureEnd(FEAT_BRANCH_STACK, start_offset);
 }
 
+bool RecordFileWriter::WriteTracepointFormatsFeature(const std::vector<TracingFormat>& formats) {
+  uint64_t start_offset;
+  if (!WriteFeatureBegin(&start_offset)) {
+    return false;
+  }
+  std::vector<char> data = TracingFormatsToBinary(formats);
+  if (!Write(data.data(), data.size())) {
+    return false;
+  }
+  return WriteFeatureEnd(FEAT_TRACEPOINT_FORMATS, start_offset);
+}
+
+bool RecordFileWriter::WriteSampleFreqChangesFeature(
+    const std::vector<SampleFreqChange>& changes) {
+  uint64_t start_offset;
+  if (!WriteFeatureBegin(&start_offset)) {
+    return false;
+  }
+  uint64_t count = changes.size();
+  if (!Write(&count, sizeof(count))) {
+    return false;
+  }
+  if (!changes.empty() && !Write(changes.data(), changes.size() * sizeof(SampleFreqChange))) {
+    return false;
+  }
+  return WriteFeatureEnd(FEAT_SAMPLE_FREQ_CHANGES, start_offset);
+}
+
+bool RecordFileWriter::WriteKernelSymbolsFeature(const std::string& symbol_table) {
+  uint64_t start_offset;
+  if (!WriteFeatureBegin(&start_offset)) {
+    return false;
+  }
+  // Pad before the feature section, so report can map the symbol table in place.
+  uint64_t padding = ALIGN(start_offset, 8) - start_offset;
+  if (padding != 0) {
+    char zeros[8] = {};
+    if (!Write(zeros, padding)) {
+      return false;
+    }
+    start_offset += padding;
+  }
+  if (!Write(symbol_table.data(), symbol_table.size())) {
+    return false;
+  }
+  return WriteFeatureEnd(FEAT_KERNEL_SYMBOLS, start_offset);
+}
+
+bool RecordFileWriter::WriteFeature(int feature, const std::vector<char>& data) {
+  uint64_t start_offset;
+  if (!WriteFeatureBegin(&start_offset)) {
+    return false;
+  }
+  if (!data.empty() && !Write(data.data(), data.size())) {
+    return false;
+  }
+  return WriteFeatureEnd(feature, start_offset);
+}
+
 bool RecordFileWriter::WriteFeatureBegin(uint64_t* start_offset) {
   CHECK_LT(current_feature_index_, feature_count_);
   if (!SeekFileEnd(start_offset)) {
@@ -232,6 +755,14 @@ bool RecordFileWriter::WriteFeatureBegin(uint64_t* start_offset) {
 }
 
 bool RecordFileWriter::WriteFeatureEnd(int feature, uint64_t start_offset) {
+  if (!WriteFeatureDesc(feature, current_feature_index_, start_offset)) {
+    return false;
+  }
+  ++current_feature_index_;
+  return true;
+}
+
+bool RecordFileWriter::WriteFeatureDesc(int feature, size_t index, uint64_t start_offset) {
   uint64_t end_offset;
   if (!SeekFileEnd(&end_offset)) {
     return false;
@@ -240,15 +771,12 @@ bool RecordFileWriter::WriteFeatureEnd(int feature, uint64_t start_offset) {
   desc.offset = start_offset;
   desc.size = end_offset - start_offset;
   uint64_t feature_offset = data_section_offset_ + data_section_size_;
-  if (fseek(record_fp_, feature_offset + current_feature_index_ * sizeof(SectionDesc), SEEK_SET) ==
-      -1) {
-    PLOG(ERROR) << "fseek() failed";
+  if (!Seek(feature_offset + index * sizeof(SectionDesc))) {
     return false;
   }
   if (!Write(&desc, sizeof(SectionDesc))) {
     return false;
   }
-  ++current_feature_index_;
   features_.push_back(feature);
   return true;
 }
@@ -269,7 +797,7 @@ bool RecordFileWriter::WriteFileHeader() {
     header.features[i] |= (1 << j);
   }
 
-  if (fseek(record_fp_, 0, SEEK_SET) == -1) {
+  if (!Seek(0)) {
     return false;
   }
   if (!Write(&header, sizeof(header))) {
@@ -279,15 +807,27 @@ bool RecordFileWriter::WriteFileHeader() {
 }
 
 bool RecordFileWriter::Close() {
-  CHECK(record_fp_ != nullptr);
+  CHECK(record_fp_ != nullptr || buffer_ != nullptr);
   bool result = true;
 
+  // A compressed data section can't be read without its index in the feature section.
+  if (compress_data_ && features_.empty() && !WriteFeatureHeader(0)) {
+    result = false;
+  }
+  if (!FinishAsyncDataWriting()) {
+    result = false;
+  }
+
   // Write file header. We gather enough information to write file header only after
   // writing data section and feature section.
   if (!WriteFileHeader()) {
     result = false;
   }
 
+  if (buffer_ != nullptr) {
+    buffer_ = nullptr;
+    return result;
+  }
   if (fclose(record_fp_) != 0) {
     PLOG(ERROR) << "failed to close record file '" << filename_ << "'";
     result = false;
@@ -55,6 +55,20 @@ TEST_F(RecordTest, CommRecordMatchBinary) {
   CheckRecordMatchBinary(record);
 }
 
+TEST_F(RecordTest, AppendBinaryFormat) {
+  MmapRecord mmap_record =
+      CreateMmapRecord(event_attr, true, 1, 2, 0x1000, 0x2000, 0x3000, "MmapRecord");
+  CommRecord comm_record = CreateCommRecord(event_attr, 1, 2, "CommRecord");
+  std::vector<char> buf;
+  mmap_record.AppendBinaryFormat(&buf);
+  comm_record.AppendBinaryFormat(&buf);
+  std::vector<std::unique_ptr<Record>> records =
+      ReadRecordsFromBuffer(event_attr, buf.data(), buf.size());
+  ASSERT_EQ(2u, records.size());
+  CheckRecordEqual(mmap_record, *records[0]);
+  CheckRecordEqual(comm_record, *records[1]);
+}
+
 TEST_F(RecordTest, RecordCache_smoke) {
   event_attr.sample_id_all = 1;
   event_attr.sample_type |= PERF_SAMPLE_TIME;
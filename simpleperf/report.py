@@ -21,9 +21,12 @@ There are two ways to use gui reporter. One way is to pass it a report file
 generated by simpleperf report command, and reporter will display it. The
 other ways is to pass it any arguments you want to use when calling
 simpleperf report command. The reporter will call `simpleperf report` to
-generate report file, and display it.
+generate report file, and display it. In that case, the report is exported
+as json by `simpleperf report --export json`, instead of being parsed from
+the text report.
 """
 
+import json
 import os.path
 import re
 import subprocess
@@ -137,6 +140,59 @@ def parse_report_items(lines):
   return report_items
 
 
+def load_report_json(report_file):
+  """Build report items from the output of `simpleperf report --export json`.
+
+  Return the report context, title line and report items, like the text report.
+  """
+  with open(report_file, 'r') as fh:
+    report = json.load(fh)
+  strings = report['strings']
+  total = report['event_count']
+  children = report['children']
+
+  def percentage(period):
+    return 100.0 * period / total if total else 0.0
+
+  report_context = []
+  if report['cmdline']:
+    report_context.append('Cmdline: %s' % report['cmdline'])
+  report_context.append("Samples: %d of event '%s'" % (report['samples'],
+                                                       report['event']))
+  report_context.append('Event count: %d' % total)
+  title_line = '  '.join((['Children', 'Self'] if children else ['Overhead']) +
+                         report['keys'])
+
+  report_items = []
+  for entry in report['entries']:
+    columns = []
+    if children:
+      columns.append('%.2f%%' % percentage(entry['period'] +
+                                           entry['accumulated_period']))
+    columns.append('%.2f%%' % percentage(entry['period']))
+    columns += [strings[key] for key in entry['keys']]
+    item = ReportItem('  '.join(columns))
+    if 'callgraph' in entry:
+      # Nodes are [parent, period, children_period, [names]], in preorder.
+      root = CallTreeNode(100.0, strings[entry['symbol']])
+      nodes = []
+      for parent, period, children_period, names in entry['callgraph']:
+        parent_node = root if parent == -1 else nodes[parent][0]
+        parent_period = (entry['callgraph_period'] if parent == -1
+                         else nodes[parent][1])
+        node_period = period + children_period
+        node_percentage = (100.0 * node_period / parent_period
+                           if parent_period else 100.0)
+        node = CallTreeNode(node_percentage, strings[names[0]])
+        for name in names[1:]:
+          node.add_call(strings[name])
+        parent_node.add_child(node)
+        nodes.append((node, children_period))
+      item.call_tree = root
+    report_items.append(item)
+  return report_context, title_line, report_items
+
+
 class ReportWindow(object):
 
   """A window used to display report file."""
@@ -241,19 +297,27 @@ def display_report_file(report_file):
   root.mainloop()
 
 
+def display_report_json(report_file):
+  report_context, title_line, report_items = load_report_json(report_file)
+  root = Tk()
+  ReportWindow(root, report_context, title_line, report_items)
+  root.mainloop()
+
+
 def call_simpleperf_report(args, report_file):
-  output_fh = open(report_file, 'w')
-  args = ['simpleperf', 'report'] + args
-  subprocess.check_call(args, stdout=output_fh)
-  output_fh.close()
+  args = ['simpleperf', 'report', '--export', 'json', '-o', report_file] + args
+  subprocess.check_call(args)
 
 
 def main():
   if len(sys.argv) == 2 and os.path.isfile(sys.argv[1]):
-    display_report_file(sys.argv[1])
+    if sys.argv[1].endswith('.json'):
+      display_report_json(sys.argv[1])
+    else:
+      display_report_file(sys.argv[1])
   else:
-    call_simpleperf_report(sys.argv[1:], 'perf.report')
-    display_report_file('perf.report')
+    call_simpleperf_report(sys.argv[1:], 'perf.report.json')
+    display_report_json('perf.report.json')
 
 
 if __name__ == '__main__':
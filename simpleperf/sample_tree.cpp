@@ -16,10 +16,79 @@
 
 #include "sample_tree.h"
 
+#include <algorithm>
+#include <unordered_map>
+
 #include <android-base/logging.h>
 
 #include "environment.h"
 
+SampleEntryAllocator::~SampleEntryAllocator() {
+  for (auto& chunk : chunks_) {
+    SampleEntry* end = (chunk.first == chunks_.back().first) ? cur_ : chunk.first + chunk.second;
+    for (SampleEntry* p = chunk.first; p != end; ++p) {
+      p->~SampleEntry();
+    }
+    operator delete(chunk.first);
+  }
+}
+
+SampleEntry* SampleEntryAllocator::Allocate(SampleEntry&& value) {
+  if (cur_ == end_) {
+    cur_ = static_cast<SampleEntry*>(operator new(sizeof(SampleEntry) * samples_per_chunk_));
+    end_ = cur_ + samples_per_chunk_;
+    chunks_.push_back(std::make_pair(cur_, samples_per_chunk_));
+  }
+  return new (cur_++) SampleEntry(std::move(value));
+}
+
+SampleEntry* SampleHashTable::Find(const SampleEntry& value, uint64_t hash,
+                                   const compare_sample_func_t& compare_function) const {
+  if (slots_.empty()) {
+    return nullptr;
+  }
+  size_t mask = slots_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& slot = slots_[i];
+    if (slot.sample == nullptr) {
+      return nullptr;
+    }
+    if (slot.hash == hash && compare_function(*slot.sample, value) == 0) {
+      return slot.sample;
+    }
+  }
+}
+
+void SampleHashTable::Insert(SampleEntry* sample, uint64_t hash) {
+  // Keep the load factor below 1/2, so probe sequences stay short.
+  if ((size_ + 1) * 2 > slots_.size()) {
+    Grow();
+  }
+  size_t mask = slots_.size() - 1;
+  size_t i = hash & mask;
+  while (slots_[i].sample != nullptr) {
+    i = (i + 1) & mask;
+  }
+  slots_[i].hash = hash;
+  slots_[i].sample = sample;
+  ++size_;
+}
+
+void SampleHashTable::Grow() {
+  std::vector<Slot> old_slots(std::max<size_t>(slots_.size() * 2, 1024u), Slot{0, nullptr});
+  old_slots.swap(slots_);
+  size_t mask = slots_.size() - 1;
+  for (auto& slot : old_slots) {
+    if (slot.sample != nullptr) {
+      size_t i = slot.hash & mask;
+      while (slots_[i].sample != nullptr) {
+        i = (i + 1) & mask;
+      }
+      slots_[i] = slot;
+    }
+  }
+}
+
 void SampleTree::SetFilters(const std::unordered_set<int>& pid_filter,
                             const std::unordered_set<int>& tid_filter,
                             const std::unordered_set<std::string>& comm_filter,
@@ -34,9 +103,18 @@ SampleEntry* SampleTree::AddSample(int pid, int tid, uint64_t ip, uint64_t time,
                                    bool in_kernel) {
   const ThreadEntry* thread = thread_tree_->FindThreadOrNew(pid, tid);
   const MapEntry* map = thread_tree_->FindMap(thread, ip, in_kernel);
+  return AddSample(thread, thread->comm, map, ip, time, period);
+}
+
+SampleEntry* SampleTree::AddSample(const ThreadEntry* thread, const char* thread_comm,
+                                   const MapEntry* map, uint64_t ip, uint64_t time,
+                                   uint64_t period,
+                                   const std::vector<const char*>* tracepoint_values) {
   const Symbol* symbol = thread_tree_->FindSymbol(map, ip);
 
   SampleEntry value(ip, time, period, 0, 1, thread, map, symbol);
+  value.thread_comm = thread_comm;
+  value.tracepoint_values = tracepoint_values;
 
   if (IsFilteredOut(value)) {
     return nullptr;
@@ -51,14 +129,23 @@ void SampleTree::AddBranchSample(int pid, int tid, uint64_t from_ip, uint64_t to
   if (from_map == thread_tree_->UnknownMap()) {
     from_map = thread_tree_->FindMap(thread, from_ip, true);
   }
-  const Symbol* from_symbol = thread_tree_->FindSymbol(from_map, from_ip);
   const MapEntry* to_map = thread_tree_->FindMap(thread, to_ip, false);
   if (to_map == thread_tree_->UnknownMap()) {
     to_map = thread_tree_->FindMap(thread, to_ip, true);
   }
+  AddBranchSample(thread, thread->comm, from_map, from_ip, to_map, to_ip, branch_flags, time,
+                  period);
+}
+
+void SampleTree::AddBranchSample(const ThreadEntry* thread, const char* thread_comm,
+                                 const MapEntry* from_map, uint64_t from_ip,
+                                 const MapEntry* to_map, uint64_t to_ip, uint64_t branch_flags,
+                                 uint64_t time, uint64_t period) {
+  const Symbol* from_symbol = thread_tree_->FindSymbol(from_map, from_ip);
   const Symbol* to_symbol = thread_tree_->FindSymbol(to_map, to_ip);
 
   SampleEntry value(to_ip, time, period, 0, 1, thread, to_map, to_symbol);
+  value.thread_comm = thread_comm;
   value.branch_from.ip = from_ip;
   value.branch_from.map = from_map;
   value.branch_from.symbol = from_symbol;
@@ -75,24 +162,25 @@ SampleEntry* SampleTree::AddCallChainSample(int pid, int tid, uint64_t ip, uint6
                                             const std::vector<SampleEntry*>& callchain) {
   const ThreadEntry* thread = thread_tree_->FindThreadOrNew(pid, tid);
   const MapEntry* map = thread_tree_->FindMap(thread, ip, in_kernel);
+  return AddCallChainSample(thread, thread->comm, map, ip, time, period, callchain);
+}
+
+SampleEntry* SampleTree::AddCallChainSample(const ThreadEntry* thread, const char* thread_comm,
+                                            const MapEntry* map, uint64_t ip, uint64_t time,
+                                            uint64_t period,
+                                            const std::vector<SampleEntry*>& callchain) {
   const Symbol* symbol = thread_tree_->FindSymbol(map, ip);
 
   SampleEntry value(ip, time, 0, period, 0, thread, map, symbol);
+  value.thread_comm = thread_comm;
 
   if (IsFilteredOut(value)) {
     // Store in callchain_sample_tree_ for use in other SampleEntry's callchain.
-    auto it = callchain_sample_tree_.find(&value);
-    if (it != callchain_sample_tree_.end()) {
-      return *it;
-    }
-    SampleEntry* sample = AllocateSample(value);
-    callchain_sample_tree_.insert(sample);
-    return sample;
+    return InsertCallChainSample(value);
   }
 
-  auto it = sample_tree_.find(&value);
-  if (it != sample_tree_.end()) {
-    SampleEntry* sample = *it;
+  SampleEntry* sample = FindSample(value);
+  if (sample != nullptr) {
     // Process only once for recursive function call.
     if (std::find(callchain.begin(), callchain.end(), sample) != callchain.end()) {
       return sample;
@@ -101,17 +189,22 @@ SampleEntry* SampleTree::AddCallChainSample(int pid, int tid, uint64_t ip, uint6
   return InsertSample(value);
 }
 
-bool SampleTree::IsFilteredOut(const SampleEntry& value) {
-  if (!pid_filter_.empty() && pid_filter_.find(value.thread->pid) == pid_filter_.end()) {
+bool SampleTree::IsFilteredOut(const SampleEntry& value) const {
+  return IsFilteredOut(value.thread, value.thread_comm, value.map);
+}
+
+bool SampleTree::IsFilteredOut(const ThreadEntry* thread, const char* thread_comm,
+                               const MapEntry* map) const {
+  if (!pid_filter_.empty() && pid_filter_.find(thread->pid) == pid_filter_.end()) {
     return true;
   }
-  if (!tid_filter_.empty() && tid_filter_.find(value.thread->tid) == tid_filter_.end()) {
+  if (!tid_filter_.empty() && tid_filter_.find(thread->tid) == tid_filter_.end()) {
     return true;
   }
-  if (!comm_filter_.empty() && comm_filter_.find(value.thread_comm) == comm_filter_.end()) {
+  if (!comm_filter_.empty() && comm_filter_.find(thread_comm) == comm_filter_.end()) {
     return true;
   }
-  if (!dso_filter_.empty() && dso_filter_.find(value.map->dso->Path()) == dso_filter_.end()) {
+  if (!dso_filter_.empty() && dso_filter_.find(map->dso->Path()) == dso_filter_.end()) {
     return true;
   }
   return false;
@@ -119,13 +212,23 @@ bool SampleTree::IsFilteredOut(const SampleEntry& value) {
 
 SampleEntry* SampleTree::InsertSample(SampleEntry& value) {
   SampleEntry* result;
-  auto it = sample_tree_.find(&value);
-  if (it == sample_tree_.end()) {
+  uint64_t hash = 0;
+  if (sample_hash_function_) {
+    hash = sample_hash_function_(value);
+    result = sample_table_.Find(value, hash, sample_compare_function_);
+  } else {
+    auto it = sample_tree_.find(&value);
+    result = (it == sample_tree_.end()) ? nullptr : *it;
+  }
+  if (result == nullptr) {
     result = AllocateSample(value);
-    auto pair = sample_tree_.insert(result);
-    CHECK(pair.second);
+    if (sample_hash_function_) {
+      sample_table_.Insert(result, hash);
+    } else {
+      auto pair = sample_tree_.insert(result);
+      CHECK(pair.second);
+    }
   } else {
-    result = *it;
     result->period += value.period;
     result->accumulated_period += value.accumulated_period;
     result->sample_count += value.sample_count;
@@ -135,7 +238,37 @@ SampleEntry* SampleTree::InsertSample(SampleEntry& value) {
   return result;
 }
 
+SampleEntry* SampleTree::InsertCallChainSample(SampleEntry& value) {
+  if (sample_hash_function_) {
+    uint64_t hash = sample_hash_function_(value);
+    SampleEntry* sample = callchain_sample_table_.Find(value, hash, sample_compare_function_);
+    if (sample == nullptr) {
+      sample = AllocateSample(value);
+      callchain_sample_table_.Insert(sample, hash);
+    }
+    return sample;
+  }
+  auto it = callchain_sample_tree_.find(&value);
+  if (it != callchain_sample_tree_.end()) {
+    return *it;
+  }
+  SampleEntry* sample = AllocateSample(value);
+  callchain_sample_tree_.insert(sample);
+  return sample;
+}
+
+SampleEntry* SampleTree::FindSample(const SampleEntry& value) {
+  if (sample_hash_function_) {
+    return sample_table_.Find(value, sample_hash_function_(value), sample_compare_function_);
+  }
+  auto it = sample_tree_.find(const_cast<SampleEntry*>(&value));
+  return (it == sample_tree_.end()) ? nullptr : *it;
+}
+
 SampleEntry* SampleTree::AllocateSample(SampleEntry& value) {
+  if (sample_hash_function_) {
+    return sample_allocator_.Allocate(std::move(value));
+  }
   SampleEntry* sample = new SampleEntry(std::move(value));
   sample_storage_.push_back(std::unique_ptr<SampleEntry>(sample));
   return sample;
@@ -144,10 +277,77 @@ SampleEntry* SampleTree::AllocateSample(SampleEntry& value) {
 void SampleTree::InsertCallChainForSample(SampleEntry* sample,
                                           const std::vector<SampleEntry*>& callchain,
                                           uint64_t period) {
-  sample->callchain.AddCallChain(callchain, period);
+  sample->callchain.AddCallChain(callchain, period, &callchain_allocator_);
+}
+
+void SampleTree::AddStack(const std::vector<SampleEntry*>& stack, uint64_t period) {
+  stack_root_.AddCallChain(stack, period, &callchain_allocator_);
+}
+
+SampleEntry* SampleTree::MergeSample(const SampleEntry& sample, bool is_callchain_sample) {
+  SampleEntry value(sample.ip, sample.time, sample.period, sample.accumulated_period,
+                    sample.sample_count, sample.thread, sample.map, sample.symbol);
+  value.thread_comm = sample.thread_comm;
+  value.branch_from = sample.branch_from;
+  value.tracepoint_values = sample.tracepoint_values;
+  return is_callchain_sample ? InsertCallChainSample(value) : InsertSample(value);
+}
+
+void SampleTree::Merge(const SampleTree& other) {
+  CHECK(sample_hash_function_ && other.sample_hash_function_);
+  std::unordered_map<const SampleEntry*, SampleEntry*> sample_map;
+  other.sample_table_.ForEach(
+      [&](SampleEntry* sample) { sample_map[sample] = MergeSample(*sample, false); });
+  other.callchain_sample_table_.ForEach(
+      [&](SampleEntry* sample) { sample_map[sample] = MergeSample(*sample, true); });
+
+  // Replay each path in the other callchain trees, so nodes are split and merged the same
+  // way as if the callchains were added to this tree directly.
+  std::vector<SampleEntry*> path;
+  std::function<void(CallChainRoot*, const CallChainNode&)> merge_node =
+      [&](CallChainRoot* root, const CallChainNode& node) {
+        size_t old_size = path.size();
+        for (size_t i = 0; i < node.chain_length; ++i) {
+          path.push_back(sample_map[node.chain[i]]);
+        }
+        if (node.period != 0) {
+          root->AddCallChain(path, node.period, &callchain_allocator_);
+        }
+        for (auto& child : node.children) {
+          merge_node(root, *child);
+        }
+        path.resize(old_size);
+      };
+  other.sample_table_.ForEach([&](SampleEntry* sample) {
+    for (auto& child : sample->callchain.children) {
+      merge_node(&sample_map[sample]->callchain, *child);
+    }
+  });
+  for (auto& child : other.stack_root_.children) {
+    merge_node(&stack_root_, *child);
+  }
+}
+
+void SampleTree::SortSamples() {
+  sorted_samples_.clear();
+  sorted_samples_.reserve(sample_table_.Size());
+  sample_table_.ForEach([this](SampleEntry* sample) {
+    sample->callchain.SortByPeriod();
+    sorted_samples_.push_back(sample);
+  });
+  std::sort(sorted_samples_.begin(), sorted_samples_.end(), sorted_sample_comparator_);
 }
 
 void SampleTree::VisitAllSamples(std::function<void(const SampleEntry&)> callback) {
+  if (sample_hash_function_) {
+    if (sorted_samples_.size() != sample_table_.Size()) {
+      SortSamples();
+    }
+    for (auto& sample : sorted_samples_) {
+      callback(*sample);
+    }
+    return;
+  }
   if (sorted_sample_tree_.size() != sample_tree_.size()) {
     sorted_sample_tree_.clear();
     for (auto& sample : sample_tree_) {
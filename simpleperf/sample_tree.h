@@ -25,6 +25,8 @@
 #include <unordered_set>
 #include <vector>
 
+#include <android-base/macros.h>
+
 #include "callchain.h"
 #include "thread_tree.h"
 
@@ -49,6 +51,9 @@ struct SampleEntry {
   const MapEntry* map;
   const Symbol* symbol;
   BranchFromEntry branch_from;
+  // Values of tracepoint fields used as sort keys, or nullptr if there are none. The strings
+  // are interned by the owner of the SampleTree, so equal values have equal pointers.
+  const std::vector<const char*>* tracepoint_values;
   CallChainRoot callchain;  // A callchain tree representing all callchains in the sample records.
 
   SampleEntry(uint64_t ip, uint64_t time, uint64_t period, uint64_t accumulated_period,
@@ -62,7 +67,8 @@ struct SampleEntry {
         thread(thread),
         thread_comm(thread->comm),
         map(map),
-        symbol(symbol) {
+        symbol(symbol),
+        tracepoint_values(nullptr) {
   }
 
   // The data member 'callchain' can only move, not copy.
@@ -71,16 +77,82 @@ struct SampleEntry {
 };
 
 typedef std::function<int(const SampleEntry&, const SampleEntry&)> compare_sample_func_t;
+// The hash function must be consistent with the compare function: samples comparing
+// equal must have the same hash value.
+typedef std::function<uint64_t(const SampleEntry&)> hash_sample_func_t;
+
+// SampleEntryAllocator allocates SampleEntry objects in large chunks, and destroys
+// them all at once when it is destroyed.
+class SampleEntryAllocator {
+ public:
+  SampleEntryAllocator(size_t samples_per_chunk = 1024u)
+      : samples_per_chunk_(samples_per_chunk), cur_(nullptr), end_(nullptr) {
+  }
+
+  ~SampleEntryAllocator();
+
+  SampleEntry* Allocate(SampleEntry&& value);
+
+ private:
+  const size_t samples_per_chunk_;
+  std::vector<std::pair<SampleEntry*, size_t>> chunks_;
+  SampleEntry* cur_;
+  SampleEntry* end_;
+
+  DISALLOW_COPY_AND_ASSIGN(SampleEntryAllocator);
+};
+
+// SampleHashTable is an open-addressing hash table of SampleEntry pointers. It finds
+// samples by a hash of the sort keys, and uses the compare function only to resolve
+// hash collisions.
+class SampleHashTable {
+ public:
+  SampleHashTable() : size_(0) {
+  }
+
+  SampleEntry* Find(const SampleEntry& value, uint64_t hash,
+                    const compare_sample_func_t& compare_function) const;
+  void Insert(SampleEntry* sample, uint64_t hash);
+
+  size_t Size() const {
+    return size_;
+  }
+
+  template <class Function>
+  void ForEach(Function function) const {
+    for (auto& slot : slots_) {
+      if (slot.sample != nullptr) {
+        function(slot.sample);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    uint64_t hash;
+    SampleEntry* sample;
+  };
+
+  void Grow();
+
+  std::vector<Slot> slots_;
+  size_t size_;
+};
 
 class SampleTree {
  public:
-  SampleTree(ThreadTree* thread_tree, compare_sample_func_t sample_compare_function)
+  // If sample_hash_function is given, samples are aggregated in hash tables instead of
+  // std::set, and are sorted only once when visited.
+  SampleTree(ThreadTree* thread_tree, compare_sample_func_t sample_compare_function,
+             hash_sample_func_t sample_hash_function = nullptr)
       : thread_tree_(thread_tree),
         sample_comparator_(sample_compare_function),
         sample_tree_(sample_comparator_),
         callchain_sample_tree_(sample_comparator_),
         sorted_sample_comparator_(sample_compare_function),
         sorted_sample_tree_(sorted_sample_comparator_),
+        sample_compare_function_(sample_compare_function),
+        sample_hash_function_(sample_hash_function),
         total_samples_(0),
         total_period_(0) {
   }
@@ -96,8 +168,33 @@ class SampleTree {
                        uint64_t time, uint64_t period);
   SampleEntry* AddCallChainSample(int pid, int tid, uint64_t ip, uint64_t time, uint64_t period,
                                   bool in_kernel, const std::vector<SampleEntry*>& callchain);
+
+  // The functions below take the thread, thread comm and maps already found by the caller,
+  // and don't modify the ThreadTree. So they can be used on different SampleTrees in
+  // different threads, while another thread keeps updating the ThreadTree.
+  SampleEntry* AddSample(const ThreadEntry* thread, const char* thread_comm, const MapEntry* map,
+                         uint64_t ip, uint64_t time, uint64_t period,
+                         const std::vector<const char*>* tracepoint_values = nullptr);
+  void AddBranchSample(const ThreadEntry* thread, const char* thread_comm,
+                       const MapEntry* from_map, uint64_t from_ip, const MapEntry* to_map,
+                       uint64_t to_ip, uint64_t branch_flags, uint64_t time, uint64_t period);
+  SampleEntry* AddCallChainSample(const ThreadEntry* thread, const char* thread_comm,
+                                  const MapEntry* map, uint64_t ip, uint64_t time,
+                                  uint64_t period, const std::vector<SampleEntry*>& callchain);
+
   void InsertCallChainForSample(SampleEntry* sample, const std::vector<SampleEntry*>& callchain,
                                 uint64_t period);
+  // Add a whole callchain of a sample, ordered from the outermost caller to the sampled
+  // function, to a single tree shared by all samples. Used to export folded stacks.
+  void AddStack(const std::vector<SampleEntry*>& stack, uint64_t period);
+  const CallChainRoot& Stacks() const {
+    return stack_root_;
+  }
+  // Return true if a sample in the thread and map is filtered out by SetFilters().
+  bool IsFilteredOut(const ThreadEntry* thread, const char* thread_comm, const MapEntry* map) const;
+  // Merge samples and callchains aggregated in another SampleTree using the same compare
+  // and hash functions. Both SampleTrees should have a hash function.
+  void Merge(const SampleTree& other);
   void VisitAllSamples(std::function<void(const SampleEntry&)> callback);
 
   uint64_t TotalSamples() const {
@@ -109,9 +206,13 @@ class SampleTree {
   }
 
  private:
-  bool IsFilteredOut(const SampleEntry& value);
+  bool IsFilteredOut(const SampleEntry& value) const;
   SampleEntry* InsertSample(SampleEntry& value);
+  SampleEntry* InsertCallChainSample(SampleEntry& value);
+  SampleEntry* FindSample(const SampleEntry& value);
   SampleEntry* AllocateSample(SampleEntry& value);
+  SampleEntry* MergeSample(const SampleEntry& sample, bool is_callchain_sample);
+  void SortSamples();
 
   struct SampleComparator {
     bool operator()(SampleEntry* sample1, SampleEntry* sample2) const {
@@ -150,6 +251,16 @@ class SampleTree {
   std::set<SampleEntry*, SortedSampleComparator> sorted_sample_tree_;
   std::vector<std::unique_ptr<SampleEntry>> sample_storage_;
 
+  // Used instead of the std::set trees above when sample_hash_function_ is set.
+  compare_sample_func_t sample_compare_function_;
+  hash_sample_func_t sample_hash_function_;
+  SampleHashTable sample_table_;
+  SampleHashTable callchain_sample_table_;
+  std::vector<SampleEntry*> sorted_samples_;
+  SampleEntryAllocator sample_allocator_;
+  CallChainAllocator callchain_allocator_;
+  CallChainRoot stack_root_;
+
   std::unordered_set<int> pid_filter_;
   std::unordered_set<int> tid_filter_;
   std::unordered_set<std::string> comm_filter_;
@@ -69,6 +69,15 @@ static int CompareSampleFunction(const SampleEntry& sample1, const SampleEntry&
   return 0;
 }
 
+static uint64_t HashSampleFunction(const SampleEntry& sample) {
+  uint64_t hash = std::hash<std::string>()(sample.thread_comm);
+  hash = hash * 31 + sample.thread->pid;
+  hash = hash * 31 + sample.thread->tid;
+  hash = hash * 31 + std::hash<std::string>()(sample.map->dso->Path());
+  hash = hash * 31 + sample.map->start_addr;
+  return hash;
+}
+
 void VisitSampleTree(SampleTree* sample_tree,
                      const std::vector<ExpectedSampleInMap>& expected_samples) {
   size_t pos = 0;
@@ -187,3 +196,169 @@ TEST(sample_tree, overlapped_map) {
   };
   VisitSampleTree(&sample_tree, expected_samples);
 }
+
+TEST(sample_tree, find_map_after_fork_and_mmap) {
+  ThreadTree thread_tree;
+  thread_tree.AddThreadMap(1, 1, 0x1000, 0x1000, 0, 0, "map1");
+  thread_tree.AddKernelMap(0x10000, 0x1000, 0, 0, "module1");
+  const ThreadEntry* parent = thread_tree.FindThreadOrNew(1, 1);
+  ASSERT_EQ("map1", thread_tree.FindMap(parent, 0x1800, false)->dso->Path());
+  ASSERT_EQ("module1", thread_tree.FindMap(parent, 0x10800, true)->dso->Path());
+
+  thread_tree.ForkThread(2, 2, 1, 1);
+  const ThreadEntry* child = thread_tree.FindThreadOrNew(2, 2);
+  ASSERT_EQ("map1", thread_tree.FindMap(child, 0x1800, false)->dso->Path());
+  thread_tree.AddThreadMap(2, 2, 0x1800, 0x1000, 0, 0, "map2");
+  thread_tree.AddKernelMap(0x10400, 0x1000, 0, 0, "module2");
+  ASSERT_EQ("map2", thread_tree.FindMap(child, 0x1800, false)->dso->Path());
+  ASSERT_EQ("map1", thread_tree.FindMap(child, 0x17ff, false)->dso->Path());
+  ASSERT_EQ("map1", thread_tree.FindMap(parent, 0x1800, false)->dso->Path());
+  ASSERT_EQ(thread_tree.UnknownMap(), thread_tree.FindMap(child, 0x2800, false));
+  ASSERT_EQ("module2", thread_tree.FindMap(parent, 0x10800, true)->dso->Path());
+  ASSERT_EQ("module1", thread_tree.FindMap(child, 0x10000, true)->dso->Path());
+}
+
+TEST(sample_tree, thread_comms_are_interned) {
+  ThreadTree thread_tree;
+  thread_tree.AddThread(1, 1, "comm1");
+  thread_tree.AddThread(1, 2, "comm1");
+  thread_tree.AddThread(1, 3, "comm2");
+  const char* comm = thread_tree.FindThreadOrNew(1, 1)->comm;
+  ASSERT_STREQ("comm1", comm);
+  ASSERT_EQ(comm, thread_tree.FindThreadOrNew(1, 2)->comm);
+  ASSERT_STREQ("comm2", thread_tree.FindThreadOrNew(1, 3)->comm);
+  thread_tree.AddThread(1, 3, "comm1");
+  ASSERT_EQ(comm, thread_tree.FindThreadOrNew(1, 3)->comm);
+}
+
+TEST(sample_tree, hash_aggregation) {
+  ThreadTree thread_tree;
+  SampleTree sample_tree(&thread_tree, CompareSampleFunction, HashSampleFunction);
+  thread_tree.AddThread(1, 1, "p1t1");
+  thread_tree.AddThread(1, 11, "p1t11");
+  thread_tree.AddThreadMap(1, 1, 1, 5, 0, 0, "process1_thread1");
+  thread_tree.AddThreadMap(1, 1, 6, 5, 0, 0, "process1_thread1_map2");
+  thread_tree.AddThreadMap(1, 11, 1, 10, 0, 0, "process1_thread11");
+  sample_tree.AddSample(1, 1, 1, 0, 1, false);
+  sample_tree.AddSample(1, 1, 2, 0, 1, false);
+  sample_tree.AddSample(1, 11, 1, 0, 1, false);
+  sample_tree.AddSample(1, 1, 6, 0, 3, false);
+  thread_tree.AddThread(1, 1, "p1t1_comm2");
+  sample_tree.AddSample(1, 1, 2, 0, 1, false);
+
+  // Samples are sorted by period first, then by the compare function.
+  std::vector<ExpectedSampleInMap> expected_samples = {
+      {1, 1, "p1t1", "process1_thread1_map2", 6, 1},
+      {1, 1, "p1t1", "process1_thread1", 1, 2},
+      {1, 1, "p1t1_comm2", "process1_thread1", 1, 1},
+      {1, 11, "p1t11", "process1_thread11", 1, 1},
+  };
+  VisitSampleTree(&sample_tree, expected_samples);
+  ASSERT_EQ(5u, sample_tree.TotalSamples());
+  ASSERT_EQ(7u, sample_tree.TotalPeriod());
+}
+
+TEST(sample_tree, hash_aggregation_with_many_samples) {
+  ThreadTree thread_tree;
+  SampleTree hash_tree(&thread_tree, CompareSampleFunction, HashSampleFunction);
+  SampleTree set_tree(&thread_tree, CompareSampleFunction);
+  for (int tid = 1; tid <= 3000; ++tid) {
+    thread_tree.AddThread(1, tid, "thread");
+  }
+  for (int i = 0; i < 10000; ++i) {
+    int tid = i % 3000 + 1;
+    hash_tree.AddSample(1, tid, 0, 0, tid % 7, false);
+    set_tree.AddSample(1, tid, 0, 0, tid % 7, false);
+  }
+  std::vector<const SampleEntry*> hash_samples;
+  std::vector<const SampleEntry*> set_samples;
+  hash_tree.VisitAllSamples([&](const SampleEntry& sample) { hash_samples.push_back(&sample); });
+  set_tree.VisitAllSamples([&](const SampleEntry& sample) { set_samples.push_back(&sample); });
+  ASSERT_EQ(3000u, hash_samples.size());
+  ASSERT_EQ(set_samples.size(), hash_samples.size());
+  for (size_t i = 0; i < hash_samples.size(); ++i) {
+    ASSERT_EQ(set_samples[i]->thread, hash_samples[i]->thread);
+    ASSERT_EQ(set_samples[i]->period, hash_samples[i]->period);
+    ASSERT_EQ(set_samples[i]->sample_count, hash_samples[i]->sample_count);
+  }
+}
+
+TEST(sample_tree, merge) {
+  ThreadTree thread_tree;
+  thread_tree.AddThread(1, 1, "p1t1");
+  thread_tree.AddThread(1, 11, "p1t11");
+  thread_tree.AddThreadMap(1, 1, 1, 5, 0, 0, "process1_thread1");
+  thread_tree.AddThreadMap(1, 11, 1, 10, 0, 0, "process1_thread11");
+  SampleTree sample_tree(&thread_tree, CompareSampleFunction, HashSampleFunction);
+  SampleTree other_tree(&thread_tree, CompareSampleFunction, HashSampleFunction);
+  sample_tree.AddSample(1, 1, 1, 0, 1, false);
+  other_tree.AddSample(1, 1, 2, 0, 2, false);
+  other_tree.AddSample(1, 11, 1, 0, 1, false);
+  sample_tree.Merge(other_tree);
+  std::vector<ExpectedSampleInMap> expected_samples = {
+      {1, 1, "p1t1", "process1_thread1", 1, 2},
+      {1, 11, "p1t11", "process1_thread11", 1, 1},
+  };
+  VisitSampleTree(&sample_tree, expected_samples);
+  ASSERT_EQ(3u, sample_tree.TotalSamples());
+  ASSERT_EQ(4u, sample_tree.TotalPeriod());
+}
+
+TEST(sample_tree, maps_version_changes_with_maps) {
+  ThreadTree thread_tree;
+  thread_tree.AddThreadMap(1, 1, 0x1000, 0x1000, 0, 0, "map1");
+  const ThreadEntry* parent = thread_tree.FindThreadOrNew(1, 1);
+  uint64_t version = parent->maps_version;
+  thread_tree.AddThread(1, 1, "comm1");
+  thread_tree.FindMap(parent, 0x1800, false);
+  ASSERT_EQ(version, parent->maps_version);
+  thread_tree.AddThreadMap(1, 1, 0x2000, 0x1000, 0, 0, "map2");
+  ASSERT_NE(version, parent->maps_version);
+
+  thread_tree.ForkThread(2, 2, 1, 1);
+  const ThreadEntry* child = thread_tree.FindThreadOrNew(2, 2);
+  ASSERT_NE(parent->maps_version, child->maps_version);
+
+  // Threads created after Clear() don't reuse versions of old threads.
+  version = child->maps_version;
+  thread_tree.Clear();
+  thread_tree.AddThreadMap(2, 2, 0x1000, 0x1000, 0, 0, "map1");
+  ASSERT_NE(version, thread_tree.FindThreadOrNew(2, 2)->maps_version);
+}
+
+TEST(sample_tree, callchain_nodes_share_paths) {
+  ThreadTree thread_tree;
+  thread_tree.AddThread(1, 1, "p1t1");
+  const ThreadEntry* thread = thread_tree.FindThreadOrNew(1, 1);
+  std::vector<Symbol> symbols = {Symbol("a", 0, 1), Symbol("b", 1, 1), Symbol("c", 2, 1),
+                                 Symbol("d", 3, 1)};
+  std::vector<SampleEntry> samples;
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    samples.emplace_back(i, 0, 1, 0, 1, thread, nullptr, &symbols[i]);
+  }
+  SampleEntry* a = &samples[0];
+  SampleEntry* b = &samples[1];
+  SampleEntry* c = &samples[2];
+  SampleEntry* d = &samples[3];
+  CallChainAllocator allocator;
+  CallChainRoot root1;
+  CallChainRoot root2;
+  root1.AddCallChain({a, b, c}, 1, &allocator);
+  // Paths added as suffixes of the previous one share its storage.
+  root2.AddCallChain({b, c}, 1, &allocator);
+  ASSERT_EQ(root1.children[0]->chain + 1, root2.children[0]->chain);
+
+  // Splitting a node keeps the samples on its path in place.
+  root1.AddCallChain({a, d}, 2, &allocator);
+  ASSERT_EQ(1u, root1.children.size());
+  CallChainNode* node = root1.children[0];
+  ASSERT_EQ(1u, node->chain_length);
+  ASSERT_EQ(a, node->chain[0]);
+  ASSERT_EQ(2u, node->children.size());
+  ASSERT_EQ(node->chain + 1, node->children[0]->chain);
+  ASSERT_EQ(2u, node->children[0]->chain_length);
+  ASSERT_EQ(d, node->children[1]->chain[0]);
+  ASSERT_EQ(3u, node->children_period);
+  root1.SortByPeriod();
+  ASSERT_EQ(d, node->children[0]->chain[0]);
+}
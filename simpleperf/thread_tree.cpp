@@ -16,9 +16,11 @@
 
 #include "thread_tree.h"
 
+#include <algorithm>
 #include <limits>
 
 #include <android-base/logging.h>
+#include <android-base/strings.h>
 
 #include "environment.h"
 #include "perf_event.h"
@@ -30,9 +32,8 @@ bool MapComparator::operator()(const MapEntry* map1, const MapEntry* map2) const
   if (map1->start_addr != map2->start_addr) {
     return map1->start_addr < map2->start_addr;
   }
-  // Compare map->len instead of map->get_end_addr() here. Because we set map's len
-  // to std::numeric_limits<uint64_t>::max() in FindMapByAddr(), which makes
-  // map->get_end_addr() overflow.
+  // Compare map->len instead of map->get_end_addr() here. Because a map's len can be
+  // std::numeric_limits<uint64_t>::max(), which makes map->get_end_addr() overflow.
   if (map1->len != map2->len) {
     return map1->len < map2->len;
   }
@@ -50,12 +51,12 @@ void ThreadTree::AddThread(int pid, int tid, const std::string& comm) {
         "unknown",                             // comm
         std::set<MapEntry*, MapComparator>(),  // maps
     };
+    thread->maps_version = ++maps_version_counter_;
     auto pair = thread_tree_.insert(std::make_pair(tid, std::unique_ptr<ThreadEntry>(thread)));
     CHECK(pair.second);
     it = pair.first;
   }
-  thread_comm_storage_.push_back(std::unique_ptr<std::string>(new std::string(comm)));
-  it->second->comm = thread_comm_storage_.back()->c_str();
+  it->second->comm = comm_pool_.Intern(comm);
 }
 
 void ThreadTree::ForkThread(int pid, int tid, int ppid, int ptid) {
@@ -63,6 +64,8 @@ void ThreadTree::ForkThread(int pid, int tid, int ppid, int ptid) {
   ThreadEntry* child = FindThreadOrNew(pid, tid);
   child->comm = parent->comm;
   child->maps = parent->maps;
+  child->map_index.Invalidate();
+  child->maps_version = ++maps_version_counter_;
 }
 
 ThreadEntry* ThreadTree::FindThreadOrNew(int pid, int tid) {
@@ -91,42 +94,91 @@ void ThreadTree::AddKernelMap(uint64_t start_addr, uint64_t len, uint64_t pgoff,
   FixOverlappedMap(&kernel_map_tree_, map);
   auto pair = kernel_map_tree_.insert(map);
   CHECK(pair.second);
+  kernel_map_index_.Invalidate();
 }
 
 Dso* ThreadTree::FindKernelDsoOrNew(const std::string& filename) {
   if (filename == DEFAULT_KERNEL_MMAP_NAME) {
     if (kernel_dso_ == nullptr) {
-      kernel_dso_ = Dso::CreateDso(DSO_KERNEL);
+      kernel_dso_ = Dso::CreateDso(DSO_KERNEL, "", dso_context_);
+      if (dso_created_callback_) {
+        dso_created_callback_(kernel_dso_.get());
+      }
     }
     return kernel_dso_.get();
   }
   auto it = module_dso_tree_.find(filename);
   if (it == module_dso_tree_.end()) {
-    module_dso_tree_[filename] = Dso::CreateDso(DSO_KERNEL_MODULE, filename);
+    module_dso_tree_[filename] = Dso::CreateDso(DSO_KERNEL_MODULE, filename, dso_context_);
     it = module_dso_tree_.find(filename);
+    if (dso_created_callback_) {
+      dso_created_callback_(it->second.get());
+    }
   }
   return it->second.get();
 }
 
+// JIT compilers place code in anonymous memory, and list its symbols in /tmp/perf-<pid>.map.
+static bool IsJitCodeMap(const std::string& filename) {
+  return filename == "//anon" || filename == "[unknown]" ||
+         android::base::StartsWith(filename, "[anon:") ||
+         android::base::StartsWith(filename, "/dev/ashmem/dalvik-jit-code-cache") ||
+         android::base::StartsWith(filename, "/memfd:jit-cache");
+}
+
 void ThreadTree::AddThreadMap(int pid, int tid, uint64_t start_addr, uint64_t len, uint64_t pgoff,
                               uint64_t time, const std::string& filename) {
   ThreadEntry* thread = FindThreadOrNew(pid, tid);
-  Dso* dso = FindUserDsoOrNew(filename);
+  Dso* dso = nullptr;
+  if (IsJitCodeMap(filename)) {
+    dso = FindPerfMapDsoOrNew(pid);
+  }
+  if (dso == nullptr) {
+    dso = FindUserDsoOrNew(filename);
+  }
   MapEntry* map = AllocateMap(MapEntry(start_addr, len, pgoff, time, dso));
   FixOverlappedMap(&thread->maps, map);
   auto pair = thread->maps.insert(map);
   CHECK(pair.second);
+  thread->map_index.Invalidate();
+  thread->maps_version = ++maps_version_counter_;
 }
 
 Dso* ThreadTree::FindUserDsoOrNew(const std::string& filename) {
   auto it = user_dso_tree_.find(filename);
   if (it == user_dso_tree_.end()) {
-    user_dso_tree_[filename] = Dso::CreateDso(DSO_ELF_FILE, filename);
+    user_dso_tree_[filename] = Dso::CreateDso(DSO_ELF_FILE, filename, dso_context_);
     it = user_dso_tree_.find(filename);
+    if (dso_created_callback_) {
+      dso_created_callback_(it->second.get());
+    }
   }
   return it->second.get();
 }
 
+Dso* ThreadTree::FindPerfMapDsoOrNew(int pid) {
+  auto it = perf_map_dso_tree_.find(pid);
+  if (it == perf_map_dso_tree_.end()) {
+    std::unique_ptr<Dso> dso =
+        Dso::CreateDso(DSO_PERF_MAP, "/tmp/perf-" + std::to_string(pid) + ".map", dso_context_);
+    if (!IsRegularFile(dso->GetAccessiblePath())) {
+      dso = nullptr;
+    } else if (dso_created_callback_) {
+      dso_created_callback_(dso.get());
+    }
+    it = perf_map_dso_tree_.insert(std::make_pair(pid, std::move(dso))).first;
+  }
+  return it->second.get();
+}
+
+void ThreadTree::UpdatePerfMaps() {
+  for (auto& pair : perf_map_dso_tree_) {
+    if (pair.second != nullptr) {
+      pair.second->UpdatePerfMap();
+    }
+  }
+}
+
 MapEntry* ThreadTree::AllocateMap(const MapEntry& value) {
   MapEntry* map = new MapEntry(value);
   map_storage_.push_back(std::unique_ptr<MapEntry>(map));
@@ -164,35 +216,52 @@ static bool IsAddrInMap(uint64_t addr, const MapEntry* map) {
   return (addr >= map->start_addr && addr < map->get_end_addr());
 }
 
-static MapEntry* FindMapByAddr(const std::set<MapEntry*, MapComparator>& maps, uint64_t addr) {
-  // Construct a map_entry which is strictly after the searched map_entry, based on MapComparator.
-  MapEntry find_map(addr, std::numeric_limits<uint64_t>::max(), 0,
-                    std::numeric_limits<uint64_t>::max(), nullptr);
-  auto it = maps.upper_bound(&find_map);
-  if (it != maps.begin() && IsAddrInMap(addr, *--it)) {
-    return *it;
+static const MapEntry* FindMapByAddr(const std::set<MapEntry*, MapComparator>& maps,
+                                     MapIndex* index, uint64_t addr) {
+  if (index->last_hit_map != nullptr && IsAddrInMap(addr, index->last_hit_map)) {
+    return index->last_hit_map;
+  }
+  if (!index->valid) {
+    index->start_addrs.clear();
+    index->maps.clear();
+    for (const auto& map : maps) {
+      index->start_addrs.push_back(map->start_addr);
+      index->maps.push_back(map);
+    }
+    index->valid = true;
+  }
+  // Find the last map starting at or before addr. Maps in the set don't overlap, so it is the
+  // only map which may contain addr.
+  auto it = std::upper_bound(index->start_addrs.begin(), index->start_addrs.end(), addr);
+  if (it != index->start_addrs.begin()) {
+    const MapEntry* map = index->maps[it - index->start_addrs.begin() - 1];
+    if (IsAddrInMap(addr, map)) {
+      index->last_hit_map = map;
+      return map;
+    }
   }
   return nullptr;
 }
 
 const MapEntry* ThreadTree::FindMap(const ThreadEntry* thread, uint64_t ip, bool in_kernel) {
-  MapEntry* result = nullptr;
+  const MapEntry* result = nullptr;
   if (!in_kernel) {
-    result = FindMapByAddr(thread->maps, ip);
+    result = FindMapByAddr(thread->maps, &thread->map_index, ip);
   } else {
-    result = FindMapByAddr(kernel_map_tree_, ip);
+    result = FindMapByAddr(kernel_map_tree_, &kernel_map_index_, ip);
   }
   return result != nullptr ? result : &unknown_map_;
 }
 
-const Symbol* ThreadTree::FindSymbol(const MapEntry* map, uint64_t ip) {
-  uint64_t vaddr_in_file;
-  if (map->dso == kernel_dso_.get()) {
-    vaddr_in_file = ip;
-  } else {
-    vaddr_in_file = ip - map->start_addr + map->dso->MinVirtualAddress();
+uint64_t ThreadTree::GetVaddrInFile(const MapEntry* map, uint64_t ip) {
+  if (map->dso->type() == DSO_KERNEL || map->dso->type() == DSO_PERF_MAP) {
+    return ip;
   }
-  const Symbol* symbol = map->dso->FindSymbol(vaddr_in_file);
+  return ip - map->start_addr + map->dso->MinVirtualAddress();
+}
+
+const Symbol* ThreadTree::FindSymbol(const MapEntry* map, uint64_t ip) {
+  const Symbol* symbol = map->dso->FindSymbol(GetVaddrInFile(map, ip));
   if (symbol == nullptr) {
     symbol = &unknown_symbol_;
   }
@@ -201,12 +270,14 @@ const Symbol* ThreadTree::FindSymbol(const MapEntry* map, uint64_t ip) {
 
 void ThreadTree::Clear() {
   thread_tree_.clear();
-  thread_comm_storage_.clear();
+  comm_pool_.Clear();
   kernel_map_tree_.clear();
+  kernel_map_index_ = MapIndex();
   map_storage_.clear();
   kernel_dso_.reset();
   module_dso_tree_.clear();
   user_dso_tree_.clear();
+  perf_map_dso_tree_.clear();
 }
 
 }  // namespace simpleperf
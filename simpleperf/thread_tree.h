@@ -19,11 +19,14 @@
 
 #include <stdint.h>
 
+#include <functional>
 #include <limits>
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "dso.h"
+#include "utils.h"
 
 namespace simpleperf {
 
@@ -49,16 +52,41 @@ struct MapComparator {
   bool operator()(const MapEntry* map1, const MapEntry* map2) const;
 };
 
+// MapIndex is a sorted flat copy of a map set. It finds the map containing an address by a
+// binary search over contiguous arrays instead of walking the tree, and remembers the last hit
+// map, as consecutive lookups (like frames of a callchain) often hit the same map. It is rebuilt
+// lazily after the map set changes.
+struct MapIndex {
+  std::vector<uint64_t> start_addrs;
+  std::vector<const MapEntry*> maps;
+  bool valid;
+  const MapEntry* last_hit_map;
+
+  MapIndex() : valid(false), last_hit_map(nullptr) {
+  }
+
+  void Invalidate() {
+    valid = false;
+    last_hit_map = nullptr;
+  }
+};
+
 struct ThreadEntry {
   int pid;
   int tid;
   const char* comm;  // It always refers to the latest comm.
   std::set<MapEntry*, MapComparator> maps;
+  mutable MapIndex map_index;  // Lookup index of maps, updated in ThreadTree::FindMap().
+  // Changed each time maps change, so caches built from maps know when to rebuild.
+  uint64_t maps_version;
 };
 
 class ThreadTree {
  public:
-  ThreadTree() : unknown_symbol_("unknown", 0, std::numeric_limits<unsigned long long>::max()) {
+  ThreadTree()
+      : maps_version_counter_(0),
+        unknown_symbol_("unknown", 0, std::numeric_limits<unsigned long long>::max()),
+        dso_context_(nullptr) {
     unknown_dso_ = Dso::CreateDso(DSO_ELF_FILE, "unknown");
     unknown_map_ =
         MapEntry(0, std::numeric_limits<unsigned long long>::max(), 0, 0, unknown_dso_.get());
@@ -72,31 +100,57 @@ class ThreadTree {
   void AddThreadMap(int pid, int tid, uint64_t start_addr, uint64_t len, uint64_t pgoff,
                     uint64_t time, const std::string& filename);
   const MapEntry* FindMap(const ThreadEntry* thread, uint64_t ip, bool in_kernel);
+  // FindSymbol() doesn't modify the ThreadTree, and can be called from more than one thread.
   const Symbol* FindSymbol(const MapEntry* map, uint64_t ip);
+  // Return the virtual address of ip in the file of map->dso, the address used to look up
+  // symbols.
+  static uint64_t GetVaddrInFile(const MapEntry* map, uint64_t ip);
   const MapEntry* UnknownMap() const {
     return &unknown_map_;
   }
+  // Call callback each time a dso is created for the kernel, a kernel module or an elf file,
+  // like when an mmap record refers to a file not seen before.
+  void SetDsoCreatedCallback(std::function<void(Dso*)> callback) {
+    dso_created_callback_ = callback;
+  }
+  // Create dsos with their own context instead of the default one. It should be called before
+  // any dso is created, and the context should outlive the ThreadTree.
+  void SetDsoContext(const DsoContext* context) {
+    dso_context_ = context;
+  }
+
+  // Read symbols JIT compilers have appended to perf map files since they were last read.
+  // Samples added before keep the symbols they found.
+  void UpdatePerfMaps();
 
   void Clear();
 
  private:
   Dso* FindKernelDsoOrNew(const std::string& filename);
   Dso* FindUserDsoOrNew(const std::string& filename);
+  Dso* FindPerfMapDsoOrNew(int pid);
   MapEntry* AllocateMap(const MapEntry& value);
   void FixOverlappedMap(std::set<MapEntry*, MapComparator>* map_set, const MapEntry* map);
 
   std::unordered_map<int, std::unique_ptr<ThreadEntry>> thread_tree_;
-  std::vector<std::unique_ptr<std::string>> thread_comm_storage_;
+  StringPool comm_pool_;
+  // Not reset in Clear(), so a new ThreadEntry never reuses the maps_version of an old one.
+  uint64_t maps_version_counter_;
 
   std::set<MapEntry*, MapComparator> kernel_map_tree_;
+  MapIndex kernel_map_index_;
   std::vector<std::unique_ptr<MapEntry>> map_storage_;
   MapEntry unknown_map_;
 
   std::unique_ptr<Dso> kernel_dso_;
   std::unordered_map<std::string, std::unique_ptr<Dso>> module_dso_tree_;
   std::unordered_map<std::string, std::unique_ptr<Dso>> user_dso_tree_;
+  // Dsos of /tmp/perf-<pid>.map, keyed by pid. nullptr means the process has no perf map.
+  std::unordered_map<int, std::unique_ptr<Dso>> perf_map_dso_tree_;
   std::unique_ptr<Dso> unknown_dso_;
   Symbol unknown_symbol_;
+  std::function<void(Dso*)> dso_created_callback_;
+  const DsoContext* dso_context_;
 };
 
 }  // namespace simpleperf
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracing.h"
+
+#include <string.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+static const std::string TRACING_EVENTS_DIR = "/sys/kernel/debug/tracing/events";
+
+static std::string BytesToHexString(const char* data, size_t size) {
+  std::string s = "0x";
+  for (size_t i = 0; i < size; ++i) {
+    s += android::base::StringPrintf("%02x", static_cast<unsigned char>(data[i]));
+  }
+  return s;
+}
+
+std::string TracingField::ValueToString(const char* raw_data, size_t raw_size) const {
+  if (static_cast<uint64_t>(offset) + size > raw_size) {
+    return std::string();
+  }
+  const char* p = raw_data + offset;
+  if (is_dynamic) {
+    // The low 16 bits are the offset of the array in raw data, and the high 16 bits are its
+    // length.
+    uint32_t location;
+    memcpy(&location, p, sizeof(location));
+    size_t data_offset = location & 0xffff;
+    size_t data_size = location >> 16;
+    if (data_offset + data_size > raw_size) {
+      return std::string();
+    }
+    p = raw_data + data_offset;
+    if (is_string) {
+      return std::string(p, strnlen(p, data_size));
+    }
+    return BytesToHexString(p, data_size);
+  }
+  if (is_string) {
+    return std::string(p, strnlen(p, size));
+  }
+  switch (size) {
+    case 1: {
+      uint8_t value = *reinterpret_cast<const uint8_t*>(p);
+      return is_signed ? std::to_string(static_cast<int8_t>(value)) : std::to_string(value);
+    }
+    case 2: {
+      uint16_t value;
+      memcpy(&value, p, sizeof(value));
+      return is_signed ? std::to_string(static_cast<int16_t>(value)) : std::to_string(value);
+    }
+    case 4: {
+      uint32_t value;
+      memcpy(&value, p, sizeof(value));
+      return is_signed ? std::to_string(static_cast<int32_t>(value)) : std::to_string(value);
+    }
+    case 8: {
+      uint64_t value;
+      memcpy(&value, p, sizeof(value));
+      return is_signed ? std::to_string(static_cast<int64_t>(value)) : std::to_string(value);
+    }
+  }
+  return BytesToHexString(p, size);
+}
+
+bool TracingField::ValueToInteger(const char* raw_data, size_t raw_size, int64_t* value) const {
+  if (is_dynamic || is_string || static_cast<uint64_t>(offset) + size > raw_size) {
+    return false;
+  }
+  const char* p = raw_data + offset;
+  switch (size) {
+    case 1: {
+      uint8_t v = *reinterpret_cast<const uint8_t*>(p);
+      *value = is_signed ? static_cast<int8_t>(v) : v;
+      return true;
+    }
+    case 2: {
+      uint16_t v;
+      memcpy(&v, p, sizeof(v));
+      *value = is_signed ? static_cast<int16_t>(v) : v;
+      return true;
+    }
+    case 4: {
+      uint32_t v;
+      memcpy(&v, p, sizeof(v));
+      *value = is_signed ? static_cast<int32_t>(v) : v;
+      return true;
+    }
+    case 8: {
+      uint64_t v;
+      memcpy(&v, p, sizeof(v));
+      *value = static_cast<int64_t>(v);
+      return true;
+    }
+  }
+  return false;
+}
+
+const TracingField* TracingFormat::FindField(const std::string& field_name) const {
+  for (auto& field : fields) {
+    if (field.name == field_name) {
+      return &field;
+    }
+  }
+  return nullptr;
+}
+
+// Parse a field line like
+// "field:char prev_comm[16];	offset:8;	size:16;	signed:1;".
+static bool ParseTracingField(const std::string& line, TracingField* field) {
+  std::vector<std::string> items = android::base::Split(line, ";");
+  if (items.size() < 3) {
+    return false;
+  }
+  std::string declaration = android::base::Trim(items[0].substr(strlen("field:")));
+  const std::string data_loc_prefix = "__data_loc ";
+  if (android::base::StartsWith(declaration, data_loc_prefix.c_str())) {
+    field->is_dynamic = true;
+    declaration = declaration.substr(data_loc_prefix.size());
+  }
+  size_t name_start = declaration.find_last_of(" *");
+  std::string name =
+      (name_start == std::string::npos) ? declaration : declaration.substr(name_start + 1);
+  std::string type = (name_start == std::string::npos) ? "" : declaration.substr(0, name_start);
+  size_t bracket = name.find('[');
+  bool is_array = field->is_dynamic || type.find('[') != std::string::npos;
+  if (bracket != std::string::npos) {
+    name = name.substr(0, bracket);
+    is_array = true;
+  }
+  if (name.empty()) {
+    return false;
+  }
+  field->name = name;
+  field->is_string = is_array && type.find("char") != std::string::npos;
+  for (size_t i = 1; i < items.size(); ++i) {
+    std::string item = android::base::Trim(items[i]);
+    size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string key = item.substr(0, colon);
+    std::string value = item.substr(colon + 1);
+    uint32_t number;
+    if (key == "offset" || key == "size" || key == "signed") {
+      if (!android::base::ParseUint(value.c_str(), &number)) {
+        return false;
+      }
+      if (key == "offset") {
+        field->offset = number;
+      } else if (key == "size") {
+        field->size = number;
+      } else {
+        field->is_signed = (number != 0);
+      }
+    }
+  }
+  return true;
+}
+
+bool ParseTracingFormat(const std::string& system_name, const std::string& content,
+                        TracingFormat* format) {
+  format->system_name = system_name;
+  format->fields.clear();
+  bool has_id = false;
+  for (auto& raw_line : android::base::Split(content, "\n")) {
+    std::string line = android::base::Trim(raw_line);
+    if (android::base::StartsWith(line, "name:")) {
+      format->name = android::base::Trim(line.substr(strlen("name:")));
+    } else if (android::base::StartsWith(line, "ID:")) {
+      std::string id = android::base::Trim(line.substr(strlen("ID:")));
+      if (!android::base::ParseUint(id.c_str(), &format->id)) {
+        LOG(ERROR) << "invalid tracepoint id: " << line;
+        return false;
+      }
+      has_id = true;
+    } else if (android::base::StartsWith(line, "field:")) {
+      TracingField field;
+      if (!ParseTracingField(line, &field)) {
+        LOG(ERROR) << "invalid tracepoint field: " << line;
+        return false;
+      }
+      format->fields.push_back(field);
+    }
+  }
+  if (format->name.empty() || !has_id) {
+    LOG(ERROR) << "tracepoint format has no name or ID";
+    return false;
+  }
+  return true;
+}
+
+bool ReadTracingFormat(const std::string& event_name, TracingFormat* format) {
+  size_t colon = event_name.find(':');
+  if (colon == std::string::npos) {
+    LOG(ERROR) << "invalid tracepoint event name: " << event_name;
+    return false;
+  }
+  std::string system_name = event_name.substr(0, colon);
+  std::string path =
+      TRACING_EVENTS_DIR + "/" + system_name + "/" + event_name.substr(colon + 1) + "/format";
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    PLOG(ERROR) << "failed to read " << path;
+    return false;
+  }
+  return ParseTracingFormat(system_name, content, format);
+}
+
+template <class T>
+static void AppendBinary(const T& data, std::vector<char>* buf) {
+  const char* p = reinterpret_cast<const char*>(&data);
+  buf->insert(buf->end(), p, p + sizeof(T));
+}
+
+static void AppendString(const std::string& s, std::vector<char>* buf) {
+  AppendBinary(static_cast<uint32_t>(s.size()), buf);
+  buf->insert(buf->end(), s.begin(), s.end());
+}
+
+// Binary format:
+//   u32 format_count;
+//   struct {
+//     u64 id;
+//     string system_name, name;  // u32 length followed by chars.
+//     u32 field_count;
+//     struct {
+//       string name;
+//       u32 offset, size;
+//       u32 flags;  // Bit 0: is_signed, bit 1: is_string, bit 2: is_dynamic.
+//     } fields[field_count];
+//   } formats[format_count];
+std::vector<char> TracingFormatsToBinary(const std::vector<TracingFormat>& formats) {
+  std::vector<char> buf;
+  AppendBinary(static_cast<uint32_t>(formats.size()), &buf);
+  for (auto& format : formats) {
+    AppendBinary(format.id, &buf);
+    AppendString(format.system_name, &buf);
+    AppendString(format.name, &buf);
+    AppendBinary(static_cast<uint32_t>(format.fields.size()), &buf);
+    for (auto& field : format.fields) {
+      AppendString(field.name, &buf);
+      AppendBinary(field.offset, &buf);
+      AppendBinary(field.size, &buf);
+      uint32_t flags = (field.is_signed ? 1 : 0) | (field.is_string ? 2 : 0) |
+                       (field.is_dynamic ? 4 : 0);
+      AppendBinary(flags, &buf);
+    }
+  }
+  return buf;
+}
+
+class BinaryReader {
+ public:
+  BinaryReader(const char* data, size_t size) : p_(data), end_(data + size) {
+  }
+
+  template <class T>
+  bool Read(T* data) {
+    if (static_cast<size_t>(end_ - p_) < sizeof(T)) {
+      return false;
+    }
+    memcpy(data, p_, sizeof(T));
+    p_ += sizeof(T);
+    return true;
+  }
+
+  bool ReadString(std::string* s) {
+    uint32_t size;
+    if (!Read(&size) || static_cast<size_t>(end_ - p_) < size) {
+      return false;
+    }
+    s->assign(p_, size);
+    p_ += size;
+    return true;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+bool TracingFormatsFromBinary(const char* data, size_t size, std::vector<TracingFormat>* formats) {
+  BinaryReader reader(data, size);
+  uint32_t format_count;
+  if (!reader.Read(&format_count)) {
+    return false;
+  }
+  formats->clear();
+  for (uint32_t i = 0; i < format_count; ++i) {
+    TracingFormat format;
+    uint32_t field_count;
+    if (!reader.Read(&format.id) || !reader.ReadString(&format.system_name) ||
+        !reader.ReadString(&format.name) || !reader.Read(&field_count)) {
+      return false;
+    }
+    for (uint32_t j = 0; j < field_count; ++j) {
+      TracingField field;
+      uint32_t flags;
+      if (!reader.ReadString(&field.name) || !reader.Read(&field.offset) ||
+          !reader.Read(&field.size) || !reader.Read(&flags)) {
+        return false;
+      }
+      field.is_signed = (flags & 1) != 0;
+      field.is_string = (flags & 2) != 0;
+      field.is_dynamic = (flags & 4) != 0;
+      format.fields.push_back(field);
+    }
+    formats->push_back(std::move(format));
+  }
+  return true;
+}
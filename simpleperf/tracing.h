@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SIMPLE_PERF_TRACING_H_
+#define SIMPLE_PERF_TRACING_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// A field in the raw data of a tracepoint sample, as described in
+// /sys/kernel/debug/tracing/events/<system>/<event>/format.
+struct TracingField {
+  std::string name;
+  uint32_t offset;
+  uint32_t size;
+  bool is_signed;
+  // A char array, like "char prev_comm[16]".
+  bool is_string;
+  // A __data_loc field, which stores the offset and length of a dynamic array in the raw data.
+  bool is_dynamic;
+
+  TracingField() : offset(0), size(0), is_signed(false), is_string(false), is_dynamic(false) {
+  }
+
+  // Return the value of the field in raw data of a sample. Return an empty string if the field
+  // is out of the range of the raw data.
+  std::string ValueToString(const char* raw_data, size_t raw_size) const;
+  // Read the value of an integer field in raw data of a sample, sign extended if the field is
+  // signed. Return false if the field isn't an integer or is out of the range of the raw data.
+  bool ValueToInteger(const char* raw_data, size_t raw_size, int64_t* value) const;
+};
+
+// The format of a tracepoint event, parsed once from its format file. The field offsets are
+// used to decode raw data of samples without parsing text.
+struct TracingFormat {
+  std::string system_name;
+  std::string name;
+  uint64_t id;
+  std::vector<TracingField> fields;
+
+  TracingFormat() : id(0) {
+  }
+
+  // Return the full event name, like "sched:sched_switch".
+  std::string FullName() const {
+    return system_name + ":" + name;
+  }
+
+  const TracingField* FindField(const std::string& field_name) const;
+};
+
+// Parse the content of a format file.
+bool ParseTracingFormat(const std::string& system_name, const std::string& content,
+                        TracingFormat* format);
+// Read the format file of a tracepoint event, like "sched:sched_switch".
+bool ReadTracingFormat(const std::string& event_name, TracingFormat* format);
+
+// Serialize tracing formats for the tracepoint formats feature section of perf.data.
+std::vector<char> TracingFormatsToBinary(const std::vector<TracingFormat>& formats);
+bool TracingFormatsFromBinary(const char* data, size_t size, std::vector<TracingFormat>* formats);
+
+#endif  // SIMPLE_PERF_TRACING_H_
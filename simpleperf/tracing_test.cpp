@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include "tracing.h"
+
+static const std::string SCHED_SWITCH_FORMAT =
+    "name: sched_switch\n"
+    "ID: 318\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:char prev_comm[16];\toffset:8;\tsize:16;\tsigned:1;\n"
+    "\tfield:pid_t prev_pid;\toffset:24;\tsize:4;\tsigned:1;\n"
+    "\tfield:long prev_state;\toffset:32;\tsize:8;\tsigned:1;\n"
+    "\tfield:__data_loc char[] name;\toffset:40;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "print fmt: \"prev_comm=%s prev_pid=%d\", REC->prev_comm, REC->prev_pid\n";
+
+TEST(tracing, parse_format) {
+  TracingFormat format;
+  ASSERT_TRUE(ParseTracingFormat("sched", SCHED_SWITCH_FORMAT, &format));
+  ASSERT_EQ("sched:sched_switch", format.FullName());
+  ASSERT_EQ(318u, format.id);
+  ASSERT_EQ(6u, format.fields.size());
+  const TracingField* field = format.FindField("prev_comm");
+  ASSERT_TRUE(field != nullptr);
+  ASSERT_EQ(8u, field->offset);
+  ASSERT_EQ(16u, field->size);
+  ASSERT_TRUE(field->is_string);
+  ASSERT_FALSE(field->is_dynamic);
+  field = format.FindField("prev_pid");
+  ASSERT_TRUE(field != nullptr);
+  ASSERT_TRUE(field->is_signed);
+  ASSERT_FALSE(field->is_string);
+  field = format.FindField("name");
+  ASSERT_TRUE(field != nullptr);
+  ASSERT_TRUE(field->is_dynamic);
+  ASSERT_TRUE(field->is_string);
+  ASSERT_TRUE(format.FindField("next_comm") == nullptr);
+  ASSERT_FALSE(ParseTracingFormat("sched", "format:\n", &format));
+}
+
+TEST(tracing, field_value_to_string) {
+  TracingFormat format;
+  ASSERT_TRUE(ParseTracingFormat("sched", SCHED_SWITCH_FORMAT, &format));
+  char raw[52] = {};
+  strcpy(raw + 8, "surfaceflinger");
+  int32_t pid = -2;
+  memcpy(raw + 24, &pid, sizeof(pid));
+  // The dynamic string "abc" is at offset 44, with length 4.
+  uint32_t location = (4 << 16) | 44;
+  memcpy(raw + 40, &location, sizeof(location));
+  strcpy(raw + 44, "abc");
+  ASSERT_EQ("surfaceflinger", format.FindField("prev_comm")->ValueToString(raw, sizeof(raw)));
+  ASSERT_EQ("-2", format.FindField("prev_pid")->ValueToString(raw, sizeof(raw)));
+  ASSERT_EQ("0", format.FindField("prev_state")->ValueToString(raw, sizeof(raw)));
+  ASSERT_EQ("abc", format.FindField("name")->ValueToString(raw, sizeof(raw)));
+  // Fields out of the raw data are empty.
+  ASSERT_EQ("", format.FindField("prev_state")->ValueToString(raw, 32));
+}
+
+TEST(tracing, field_value_to_integer) {
+  TracingFormat format;
+  ASSERT_TRUE(ParseTracingFormat("sched", SCHED_SWITCH_FORMAT, &format));
+  char raw[52] = {};
+  int32_t pid = -2;
+  memcpy(raw + 24, &pid, sizeof(pid));
+  int64_t state = 1;
+  memcpy(raw + 32, &state, sizeof(state));
+  int64_t value;
+  ASSERT_TRUE(format.FindField("prev_pid")->ValueToInteger(raw, sizeof(raw), &value));
+  ASSERT_EQ(-2, value);
+  ASSERT_TRUE(format.FindField("prev_state")->ValueToInteger(raw, sizeof(raw), &value));
+  ASSERT_EQ(1, value);
+  // Strings and fields out of the raw data aren't integers.
+  ASSERT_FALSE(format.FindField("prev_comm")->ValueToInteger(raw, sizeof(raw), &value));
+  ASSERT_FALSE(format.FindField("prev_state")->ValueToInteger(raw, 32, &value));
+}
+
+TEST(tracing, binary_format) {
+  TracingFormat format;
+  ASSERT_TRUE(ParseTracingFormat("sched", SCHED_SWITCH_FORMAT, &format));
+  std::vector<char> data = TracingFormatsToBinary({format});
+  std::vector<TracingFormat> formats;
+  ASSERT_TRUE(TracingFormatsFromBinary(data.data(), data.size(), &formats));
+  ASSERT_EQ(1u, formats.size());
+  ASSERT_EQ(format.FullName(), formats[0].FullName());
+  ASSERT_EQ(format.id, formats[0].id);
+  ASSERT_EQ(format.fields.size(), formats[0].fields.size());
+  for (size_t i = 0; i < format.fields.size(); ++i) {
+    const TracingField& field1 = format.fields[i];
+    const TracingField& field2 = formats[0].fields[i];
+    ASSERT_EQ(field1.name, field2.name);
+    ASSERT_EQ(field1.offset, field2.offset);
+    ASSERT_EQ(field1.size, field2.size);
+    ASSERT_EQ(field1.is_signed, field2.is_signed);
+    ASSERT_EQ(field1.is_string, field2.is_string);
+    ASSERT_EQ(field1.is_dynamic, field2.is_dynamic);
+  }
+  // Truncated data is rejected.
+  ASSERT_FALSE(TracingFormatsFromBinary(data.data(), data.size() - 1, &formats));
+}
@@ -23,8 +23,12 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
 
 #include <algorithm>
+#include <limits>
 #include <map>
 #include <string>
 
@@ -55,6 +59,30 @@ const char* OneTimeFreeAllocator::AllocateString(const std::string& s) {
   return result;
 }
 
+size_t StringPool::CStringHash::operator()(const char* s) const {
+  // FNV-1a hash.
+  size_t hash = 2166136261u;
+  for (; *s != '\0'; ++s) {
+    hash = (hash ^ static_cast<unsigned char>(*s)) * 16777619u;
+  }
+  return hash;
+}
+
+const char* StringPool::Intern(const std::string& s) {
+  auto it = strings_.find(s.c_str());
+  if (it != strings_.end()) {
+    return *it;
+  }
+  const char* result = allocator_.AllocateString(s);
+  strings_.insert(result);
+  return result;
+}
+
+void StringPool::Clear() {
+  strings_.clear();
+  allocator_.Clear();
+}
+
 
 FileHelper FileHelper::OpenReadOnly(const std::string& filename) {
     int fd = TEMP_FAILURE_RETRY(open(filename.c_str(), O_RDONLY | O_BINARY));
@@ -72,6 +100,70 @@ FileHelper::~FileHelper() {
   }
 }
 
+std::unique_ptr<MappedFile> MappedFile::Create(const std::string& filename) {
+  return Create(filename, 0, std::numeric_limits<uint64_t>::max());
+}
+
+std::unique_ptr<MappedFile> MappedFile::Create(const std::string& filename, uint64_t offset,
+                                               uint64_t size) {
+  FileHelper file = FileHelper::OpenReadOnly(filename);
+  if (!file) {
+    PLOG(DEBUG) << "failed to open " << filename;
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(file.fd(), &st) != 0) {
+    PLOG(DEBUG) << "failed to stat " << filename;
+    return nullptr;
+  }
+  uint64_t file_size = st.st_size;
+  if (size == std::numeric_limits<uint64_t>::max() && offset <= file_size) {
+    size = file_size - offset;
+  }
+  if (offset > file_size || size > file_size - offset) {
+    LOG(DEBUG) << "[" << offset << ", " << offset << " + " << size << ") is out of " << filename;
+    return nullptr;
+  }
+  std::unique_ptr<MappedFile> result(new MappedFile);
+  result->size_ = size;
+  if (result->size_ == 0) {
+    result->data_ = result->buffer_.data();
+    return result;
+  }
+#if !defined(_WIN32)
+  // Only map regions starting at 8-byte aligned offsets, so the structs they hold can be read in
+  // place.
+  if (offset % 8 == 0) {
+    uint64_t map_offset = offset & ~(static_cast<uint64_t>(sysconf(_SC_PAGE_SIZE)) - 1);
+    size_t map_size = size + (offset - map_offset);
+    void* addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, file.fd(), map_offset);
+    if (addr != MAP_FAILED) {
+      result->data_ = static_cast<const char*>(addr) + (offset - map_offset);
+      result->map_addr_ = addr;
+      result->map_size_ = map_size;
+      return result;
+    }
+    PLOG(DEBUG) << "failed to mmap " << filename << ", read it instead";
+  }
+#endif
+  result->buffer_.resize(size);
+  if (lseek(file.fd(), offset, SEEK_SET) != static_cast<off_t>(offset) ||
+      !android::base::ReadFully(file.fd(), &result->buffer_[0], size)) {
+    PLOG(DEBUG) << "failed to read " << filename;
+    return nullptr;
+  }
+  result->data_ = result->buffer_.data();
+  return result;
+}
+
+MappedFile::~MappedFile() {
+#if !defined(_WIN32)
+  if (map_addr_ != nullptr) {
+    munmap(map_addr_, map_size_);
+  }
+#endif
+}
+
 ArchiveHelper::ArchiveHelper(int fd, const std::string& debug_filename) : valid_(false) {
   int rc = OpenArchiveFd(fd, "", &handle_, false);
   if (rc == 0) {
@@ -18,8 +18,11 @@
 #define SIMPLE_PERF_UTILS_H_
 
 #include <stddef.h>
+#include <string.h>
 
+#include <memory>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -56,6 +59,29 @@ class OneTimeFreeAllocator {
   char* end_;
 };
 
+// StringPool keeps one copy of each distinct string, like symbol names shared by many dsos or
+// comms shared by many threads. Equal strings are interned to the same pointer, which stays
+// valid until the pool is cleared.
+class StringPool {
+ public:
+  const char* Intern(const std::string& s);
+  void Clear();
+
+ private:
+  struct CStringHash {
+    size_t operator()(const char* s) const;
+  };
+
+  struct CStringEqual {
+    bool operator()(const char* s1, const char* s2) const {
+      return strcmp(s1, s2) == 0;
+    }
+  };
+
+  std::unordered_set<const char*, CStringHash, CStringEqual> strings_;
+  OneTimeFreeAllocator allocator_;
+};
+
 class FileHelper {
  public:
   static FileHelper OpenReadOnly(const std::string& filename);
@@ -83,6 +109,38 @@ class FileHelper {
   DISALLOW_COPY_AND_ASSIGN(FileHelper);
 };
 
+// MappedFile maps a whole file read-only into memory. On platforms without mmap(), it reads
+// the file into a buffer instead.
+class MappedFile {
+ public:
+  static std::unique_ptr<MappedFile> Create(const std::string& filename);
+  // Map [offset, offset + size) of the file.
+  static std::unique_ptr<MappedFile> Create(const std::string& filename, uint64_t offset,
+                                            uint64_t size);
+
+  ~MappedFile();
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  MappedFile() : data_(nullptr), size_(0), map_addr_(nullptr), map_size_(0) {
+  }
+
+  const char* data_;
+  size_t size_;
+  void* map_addr_;
+  size_t map_size_;
+  std::string buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
 class ArchiveHelper {
  public:
   ArchiveHelper(int fd, const std::string& debug_filename);
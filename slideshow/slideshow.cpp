@@ -16,17 +16,42 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <time.h>
 #include <linux/input.h>
 #include <cutils/klog.h>
 #include <utils/SystemClock.h>
+#include <utils/Timers.h>
 #include "minui/minui.h"
 
 #define NEXT_TIMEOUT_MS 5000
 #define LAST_TIMEOUT_MS 30000
+#define PREFETCH_COUNT 2
 
 #define LOGE(x...) do { KLOG_ERROR("slideshow", x); } while (0)
+#define LOGI(x...) do { KLOG_INFO("slideshow", x); } while (0)
+
+/* images are decoded ahead of time by a prefetch thread, which keeps at
+ * most prefetch_count of them that were not drawn yet */
+struct slide {
+    const char *resname;
+    GRSurface *surface;
+    bool busy;          /* being decoded */
+    bool done;          /* decoded, surface is NULL if it failed */
+    nsecs_t decode_ns;
+};
+
+static struct slide *slides;
+static int num_slides;
+static int next_slide;  /* first slide not drawn yet */
+static int prefetch_count = PREFETCH_COUNT;
+static bool prefetch_stop;
+static pthread_mutex_t slides_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slides_cond = PTHREAD_COND_INITIALIZER;
+
+static nsecs_t key_time;
 
 static int input_cb(int fd, unsigned int epevents, void *data)
 {
@@ -41,11 +66,59 @@ static int input_cb(int fd, unsigned int epevents, void *data)
 
     if (ev.type == EV_KEY && ev.value == 1) {
         *key_code = ev.code;
+        key_time = systemTime(SYSTEM_TIME_MONOTONIC);
     }
 
     return 0;
 }
 
+/* called with slides_lock held and slide->busy set */
+static void decode(struct slide *slide)
+{
+    GRSurface* surface;
+    nsecs_t start;
+
+    pthread_mutex_unlock(&slides_lock);
+
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (res_create_display_surface(slide->resname, &surface) < 0) {
+        LOGE("failed to create surface for %s\n", slide->resname);
+        surface = NULL;
+    }
+
+    pthread_mutex_lock(&slides_lock);
+    slide->surface = surface;
+    slide->decode_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    slide->busy = false;
+    slide->done = true;
+    pthread_cond_broadcast(&slides_cond);
+}
+
+static void *prefetch_thread(void *)
+{
+    pthread_mutex_lock(&slides_lock);
+    while (!prefetch_stop) {
+        struct slide *slide = NULL;
+        int last = next_slide + prefetch_count;
+
+        for (int i = next_slide; i < last && i < num_slides; i++) {
+            if (!slides[i].busy && !slides[i].done) {
+                slide = &slides[i];
+                break;
+            }
+        }
+
+        if (slide) {
+            slide->busy = true;
+            decode(slide);
+        } else {
+            pthread_cond_wait(&slides_cond, &slides_lock);
+        }
+    }
+    pthread_mutex_unlock(&slides_lock);
+    return NULL;
+}
+
 static void clear()
 {
     gr_color(0, 0, 0, 0);
@@ -53,13 +126,33 @@ static void clear()
     gr_flip();
 }
 
-static void draw(const char *resname)
+/* draws a slide, decoding it unless the prefetch thread did, and logs the
+ * time from event_time (the key press or the timeout) to display */
+static void draw(int index, const char *event, nsecs_t event_time)
 {
+    struct slide *slide = &slides[index];
+    const char *source = "prefetched";
     GRSurface* surface;
     int w, h, x, y;
 
-    if (res_create_display_surface(resname, &surface) < 0) {
-        LOGE("failed to create surface for %s\n", resname);
+    pthread_mutex_lock(&slides_lock);
+    if (slide->busy) {
+        source = "waited";
+    } else if (!slide->done) {
+        source = "on demand";
+        slide->busy = true;
+        decode(slide);
+    }
+    while (!slide->done) {
+        pthread_cond_wait(&slides_cond, &slides_lock);
+    }
+    surface = slide->surface;
+    slide->surface = NULL;
+    next_slide = index + 1;
+    pthread_cond_broadcast(&slides_cond);
+    pthread_mutex_unlock(&slides_lock);
+
+    if (!surface) {
         return;
     }
 
@@ -71,12 +164,16 @@ static void draw(const char *resname)
     gr_blit(surface, 0, 0, w, h, x, y);
     gr_flip();
 
+    LOGI("%s: %s to display %" PRId64 " ms, decode %" PRId64 " ms (%s)\n",
+        slide->resname, event, ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - event_time),
+        ns2ms(slide->decode_ns), source);
+
     res_free_surface(surface);
 }
 
 int usage()
 {
-    LOGE("usage: slideshow [-t timeout] image.png [image2.png ...] last.png\n");
+    LOGE("usage: slideshow [-t timeout] [-p prefetch] [-v] image.png [image2.png ...] last.png\n");
     return EXIT_FAILURE;
 }
 
@@ -87,8 +184,12 @@ int main(int argc, char **argv)
     int opt;
     long int timeout = NEXT_TIMEOUT_MS;
     int64_t start;
+    nsecs_t event_time;
+    const char *event;
+    pthread_t prefetcher;
+    int index;
 
-    while ((opt = getopt(argc, argv, "t:")) != -1) {
+    while ((opt = getopt(argc, argv, "t:p:v")) != -1) {
         switch (opt) {
         case 't':
             timeout = strtol(optarg, NULL, 0);
@@ -99,6 +200,18 @@ int main(int argc, char **argv)
                     timeout);
             }
             break;
+        case 'p':
+            prefetch_count = strtol(optarg, NULL, 0);
+
+            if (prefetch_count < 0) {
+                prefetch_count = PREFETCH_COUNT;
+                LOGE("invalid prefetch count %s, defaulting to %d\n", optarg,
+                    prefetch_count);
+            }
+            break;
+        case 'v':
+            klog_set_level(KLOG_INFO_LEVEL);
+            break;
         default:
             return usage();
         }
@@ -108,30 +221,54 @@ int main(int argc, char **argv)
         return usage();
     }
 
+    num_slides = argc - optind;
+    slides = (struct slide *)calloc(num_slides, sizeof(*slides));
+    if (!slides) {
+        LOGE("failed to allocate slides\n");
+        return EXIT_FAILURE;
+    }
+    for (index = 0; index < num_slides; index++) {
+        slides[index].resname = argv[optind + index];
+    }
+
+    event = "start";
+    event_time = systemTime(SYSTEM_TIME_MONOTONIC);
+
     if (gr_init() == -1 || ev_init(input_cb, &key_code) == -1) {
         LOGE("failed to initialize minui\n");
         return EXIT_FAILURE;
     }
 
+    /* without the thread, each image is decoded when it is drawn */
+    if (prefetch_count > 0 &&
+            pthread_create(&prefetcher, NULL, prefetch_thread, NULL) != 0) {
+        LOGE("failed to start prefetch thread\n");
+        prefetch_count = 0;
+    }
+
     /* display all images except the last one, switch to next image after
      * timeout or user input */
 
-    while (optind < argc - 1) {
-        draw(argv[optind++]);
+    for (index = 0; index < num_slides - 1; index++) {
+        draw(index, event, event_time);
 
         start = android::uptimeMillis();
         long int timeout_remaining = timeout;
+        bool pressed = false;
         do {
             if (ev_wait(timeout_remaining) == 0) {
                 ev_dispatch();
 
                 if (key_code != -1) {
                     input = true;
+                    pressed = true;
                     break;
                 }
             }
             timeout_remaining -= android::uptimeMillis() - start;
         } while (timeout_remaining > 0);
+        event = pressed ? "input" : "timeout";
+        event_time = pressed ? key_time : systemTime(SYSTEM_TIME_MONOTONIC);
     };
 
     /* if there was user input while showing the images, display the last
@@ -141,7 +278,7 @@ int main(int argc, char **argv)
     if (input) {
         start = android::uptimeMillis();
 
-        draw(argv[optind]);
+        draw(index, event, event_time);
 
         do {
             if (ev_wait(timeout) == 0) {
@@ -154,6 +291,20 @@ int main(int argc, char **argv)
         } while (key_code != KEY_POWER);
     }
 
+    if (prefetch_count > 0) {
+        pthread_mutex_lock(&slides_lock);
+        prefetch_stop = true;
+        pthread_cond_broadcast(&slides_cond);
+        pthread_mutex_unlock(&slides_lock);
+        pthread_join(prefetcher, NULL);
+    }
+    for (index = 0; index < num_slides; index++) {
+        if (slides[index].surface) {
+            res_free_surface(slides[index].surface);
+        }
+    }
+    free(slides);
+
     clear();
     gr_exit();
     ev_exit();
@@ -4,10 +4,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <linux/ioctl.h>
@@ -34,32 +37,46 @@ struct msm_audio_stats {
     uint32_t out_bytes;
     uint32_t unused[3];
 };
-    
-int pcm_play(unsigned rate, unsigned channels,
-             int (*fill)(void *buf, unsigned sz, void *cookie),
-             void *cookie)
+
+static int pcm_open(unsigned rate, unsigned channels,
+                    struct msm_audio_config *config)
 {
-    struct msm_audio_config config;
-    struct msm_audio_stats stats;
-    unsigned sz, n;
-    char buf[8192];
     int afd;
-    
+
     afd = open("/dev/msm_pcm_out", O_RDWR);
     if (afd < 0) {
         perror("pcm_play: cannot open audio device");
         return -1;
     }
 
-    if(ioctl(afd, AUDIO_GET_CONFIG, &config)) {
+    if(ioctl(afd, AUDIO_GET_CONFIG, config)) {
         perror("could not get config");
+        close(afd);
         return -1;
     }
 
-    config.channel_count = channels;
-    config.sample_rate = rate;
-    if (ioctl(afd, AUDIO_SET_CONFIG, &config)) {
+    config->channel_count = channels;
+    config->sample_rate = rate;
+    if (ioctl(afd, AUDIO_SET_CONFIG, config)) {
         perror("could not set config");
+        close(afd);
+        return -1;
+    }
+    return afd;
+}
+
+int pcm_play(unsigned rate, unsigned channels,
+             int (*fill)(void *buf, unsigned sz, void *cookie),
+             void *cookie)
+{
+    struct msm_audio_config config;
+    struct msm_audio_stats stats;
+    unsigned sz, n;
+    char buf[8192];
+    int afd;
+    
+    afd = pcm_open(rate, channels, &config);
+    if (afd < 0) {
         return -1;
     }
     sz = config.buffer_size;
@@ -150,7 +167,168 @@ void play_file(unsigned rate, unsigned channels,
     pcm_play(rate, channels, fill_buffer, 0);
 }
 
-int wav_play(const char *fn)
+/* Low latency playback: the samples are played straight from a locked
+ * mapping of the file, so that the write loop neither reads the file nor
+ * faults, at SCHED_FIFO.  The driver's buffer_count buffers are kept full.
+ * Each write is timed, and the interval between the ends of successive
+ * writes is compared with the time it takes to play a buffer.
+ */
+
+#define LOWLAT_PRIORITY 2
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_usecs(const char *name, uint64_t *ns, unsigned n)
+{
+    uint64_t total = 0;
+    unsigned i;
+
+    if (!n)
+        return;
+    qsort(ns, n, sizeof(*ns), cmp_u64);
+    for (i = 0; i < n; i++)
+        total += ns[i];
+    fprintf(stderr, "%-14s avg %7llu  p50 %7llu  p99 %7llu  max %7llu usecs\n",
+            name, (unsigned long long)(total / n / 1000),
+            (unsigned long long)(ns[n / 2] / 1000),
+            (unsigned long long)(ns[n * 99 / 100] / 1000),
+            (unsigned long long)(ns[n - 1] / 1000));
+}
+
+int pcm_play_lowlat(unsigned rate, unsigned channels, int priority,
+                    const char *data, unsigned count)
+{
+    struct msm_audio_config config;
+    struct msm_audio_stats stats;
+    struct sched_param param;
+    uint64_t *latency, *jitter;
+    uint64_t period_ns, start, end, last = 0;
+    unsigned sz, n, writes, underruns = 0, stats_failed = 0;
+    uint32_t written = 0;
+    int afd;
+
+    afd = pcm_open(rate, channels, &config);
+    if (afd < 0) {
+        return -1;
+    }
+    sz = config.buffer_size;
+    if (!sz || count < sz) {
+        fprintf(stderr,"file shorter than a buffer of %d bytes\n", sz);
+        close(afd);
+        return -1;
+    }
+    writes = count / sz;
+    period_ns = (uint64_t)sz * 1000000000ULL / (rate * channels * 2);
+    fprintf(stderr,"buffer size %d x %d, %llu usecs per buffer\n",
+            sz, config.buffer_count, (unsigned long long)(period_ns / 1000));
+
+    /* allocated and locked before playing, with the samples */
+    latency = calloc(writes, sizeof(*latency));
+    jitter = calloc(writes, sizeof(*jitter));
+    if (!latency || !jitter) {
+        fprintf(stderr,"could not allocate statistics\n");
+        goto done;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        perror("cannot lock memory");
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param))
+        perror("cannot set SCHED_FIFO");
+
+    fprintf(stderr,"prefill\n");
+    for (n = 0; n < config.buffer_count && n < writes; n++) {
+        if (write(afd, data + n * sz, sz) != sz) {
+            perror("cannot prefill");
+            writes = n;
+            break;
+        }
+        written += sz;
+    }
+
+    fprintf(stderr,"start\n");
+    ioctl(afd, AUDIO_START, 0);
+
+    for (; n < writes; n++) {
+        /* the driver played all we gave it before this write */
+        if (ioctl(afd, AUDIO_GET_STATS, &stats) == 0) {
+            if ((int32_t)(written - stats.out_bytes) <= 0)
+                underruns++;
+        } else {
+            stats_failed++;
+        }
+
+        start = now_ns();
+        if (write(afd, data + n * sz, sz) != sz) {
+            perror("cannot write buffer");
+            break;
+        }
+        end = now_ns();
+        written += sz;
+
+        latency[n] = end - start;
+        if (last)
+            jitter[n] = end - last > period_ns ?
+                end - last - period_ns : period_ns - (end - last);
+        last = end;
+    }
+
+    param.sched_priority = 0;
+    sched_setscheduler(0, SCHED_OTHER, &param);
+
+    /* only the writes after the first one following the prefill count */
+    n = n > config.buffer_count + 1 ? n - config.buffer_count - 1 : 0;
+    fprintf(stderr,"%d buffers timed, %d underruns%s\n", n, underruns,
+            stats_failed ? " (AUDIO_GET_STATS failed)" : "");
+    print_usecs("write latency", latency + config.buffer_count + 1, n);
+    print_usecs("write jitter", jitter + config.buffer_count + 1, n);
+
+done:
+    munlockall();
+    free(latency);
+    free(jitter);
+    close(afd);
+    return 0;
+}
+
+int wav_play_lowlat(int fd, unsigned rate, unsigned channels,
+                    unsigned count, int priority)
+{
+    struct stat st;
+    char *map;
+    size_t len = sizeof(struct wav_header) + count;
+    int ret;
+
+    if (fstat(fd, &st) || (size_t)st.st_size < len) {
+        fprintf(stderr,"could not map %d bytes of samples\n", count);
+        return -1;
+    }
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("cannot map wav file");
+        return -1;
+    }
+    ret = pcm_play_lowlat(rate, channels, priority,
+                          map + sizeof(struct wav_header), count);
+    munmap(map, len);
+    return ret;
+}
+
+int wav_play(const char *fn, int lowlat_priority)
 {
 	struct wav_header hdr;
     unsigned rate, channels;
@@ -184,6 +362,11 @@ int wav_play(const char *fn)
         return -1;
     }
 
+    if (lowlat_priority) {
+        return wav_play_lowlat(fd, hdr.sample_rate, hdr.num_channels,
+                               hdr.data_sz, lowlat_priority);
+    }
+
     play_file(hdr.sample_rate, hdr.num_channels,
               fd, hdr.data_sz);
     
@@ -334,6 +517,7 @@ int main(int argc, char **argv)
     int play = 1;
     unsigned channels = 1;
     unsigned rate = 44100;
+    int lowlat_priority = 0;
 
     argc--;
     argv++;
@@ -354,6 +538,21 @@ int main(int argc, char **argv)
                 return -1;
             }
             rate = atoi(argv[0]);
+        } else if (!strcmp(argv[0],"-lowlat")) {
+            if (!lowlat_priority)
+                lowlat_priority = LOWLAT_PRIORITY;
+        } else if (!strcmp(argv[0],"-prio")) {
+            argc--;
+            argv++;
+            if (argc == 0) {
+                fprintf(stderr,"playwav: -prio requires a parameter\n");
+                return -1;
+            }
+            lowlat_priority = atoi(argv[0]);
+            if (lowlat_priority < 1 || lowlat_priority > 99) {
+                fprintf(stderr,"playwav: -prio must be 1 to 99\n");
+                return -1;
+            }
         } else {
             fn = argv[0];
         }
@@ -370,7 +569,7 @@ int main(int argc, char **argv)
         if (dot && !strcmp(dot,".mp3")) {
             return mp3_play(fn);
         } else {
-            return wav_play(fn);
+            return wav_play(fn, lowlat_priority);
         }
     } else {
         return wav_rec(fn, channels, rate);
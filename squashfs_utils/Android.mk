@@ -3,15 +3,15 @@
 LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := squashfs_utils.c
-LOCAL_STATIC_LIBRARIES := libcutils
+LOCAL_SRC_FILES := squashfs_utils.c squashfs_reader.c
+LOCAL_STATIC_LIBRARIES := libcutils liblz4 libz
 LOCAL_C_INCLUDES := external/squashfs-tools/squashfs-tools
 LOCAL_MODULE := libsquashfs_utils
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := squashfs_utils.c
-LOCAL_STATIC_LIBRARIES := libcutils
+LOCAL_SRC_FILES := squashfs_utils.c squashfs_reader.c
+LOCAL_STATIC_LIBRARIES := libcutils liblz4 libz
 LOCAL_C_INCLUDES := external/squashfs-tools/squashfs-tools
 LOCAL_CFLAGS := -Wall -Werror -D_GNU_SOURCE -DSQUASHFS_NO_KLOG
 LOCAL_MODULE := libsquashfs_utils_host
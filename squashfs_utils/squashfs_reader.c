@@ -0,0 +1,1146 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "squashfs_utils.h"
+
+#include <cutils/fs.h>
+#include <cutils/klog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lz4.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "squashfs_fs.h"
+
+#ifdef SQUASHFS_NO_KLOG
+#include <stdio.h>
+#define ERROR(x...)   fprintf(stderr, x)
+#else
+#define ERROR(x...)   KLOG_ERROR("squashfs_utils", x)
+#endif
+
+/*
+ * Metadata (inodes, directories and the fragment table) is stored in blocks of
+ * up to SQUASHFS_METADATA_SIZE bytes, each compressed on its own. The most
+ * recently used ones are kept decompressed, and so are the most recently used
+ * fragment blocks, which hold the tails of many small files. Directories
+ * already looked up by path are remembered, so walking a tree does not start
+ * from the root for every file.
+ */
+#define META_CACHE_BLOCKS     64
+#define FRAGMENT_CACHE_BLOCKS 8
+#define DIR_CACHE_BUCKETS     1024
+
+/* Most data blocks decompressed in parallel by squashfs_file_read_all */
+#define READ_ALL_MAX_BLOCKS   64
+#define READER_MAX_THREADS    32
+
+/* Fragment entries per metadata block */
+#define FRAGMENTS_PER_BLOCK \
+    (SQUASHFS_METADATA_SIZE / sizeof(struct squashfs_fragment_entry))
+
+struct meta_block {
+    uint64_t start;         /* offset of the block in the image */
+    uint64_t next;          /* offset of the following block */
+    uint32_t len;           /* 0 if the entry is unused */
+    uint64_t last_used;
+    uint8_t data[SQUASHFS_METADATA_SIZE];
+};
+
+struct fragment_block {
+    uint32_t index;
+    uint32_t len;           /* 0 if the entry is unused */
+    uint64_t last_used;
+    uint8_t *data;
+};
+
+struct dir_cache_entry {
+    char *path;
+    uint64_t inode;
+    struct dir_cache_entry *next;
+};
+
+/* A data block to decompress in squashfs_file_read_all */
+struct block_job {
+    const uint8_t *in;
+    uint32_t in_len;        /* 0 for a sparse block */
+    bool compressed;
+    uint8_t *out;
+    uint32_t out_len;
+    bool failed;
+};
+
+struct squashfs_reader {
+    int fd;
+    bool own_fd;
+    struct squashfs_super_block sb;
+    struct squashfs_info info;
+
+    uint64_t *fragment_index;
+    uint64_t clock;
+    struct meta_block *meta_cache;
+    struct fragment_block fragment_cache[FRAGMENT_CACHE_BLOCKS];
+    struct dir_cache_entry *dir_cache[DIR_CACHE_BUCKETS];
+
+    /* decompression threads for squashfs_file_read_all, started on first use */
+    int threads;
+    int started;
+    pthread_t thread[READER_MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    struct block_job *jobs;
+    int num_jobs;
+    int next_job;
+    int finished_jobs;
+    bool quit;
+};
+
+/* An inode as read from the inode table */
+struct inode_info {
+    struct squashfs_stat st;
+
+    /* regular files */
+    uint64_t start_block;
+    uint32_t fragment;
+    uint32_t fragment_offset;
+    uint64_t block_list;    /* position of the block sizes in the inode table */
+    uint32_t block_list_offset;
+
+    /* directories */
+    uint32_t dir_start_block;
+    uint32_t dir_offset;
+    uint32_t dir_size;
+    uint32_t index_count;
+    uint64_t index_block;   /* position of the directory index */
+    uint32_t index_offset;
+};
+
+struct squashfs_file {
+    struct squashfs_reader *r;
+    uint64_t size;
+    uint32_t fragment;
+    uint32_t fragment_offset;
+    uint32_t blocks;        /* data blocks, not counting a fragment */
+    uint32_t *block_sizes;  /* on-disk sizes, with SQUASHFS_COMPRESSED_BIT_BLOCK */
+    uint64_t *block_starts; /* offsets of the data blocks in the image */
+
+    /* the last block read by squashfs_file_pread */
+    uint32_t cached_block;
+    uint32_t cached_len;
+    uint8_t *cached_data;
+};
+
+static int read_fully(int fd, void *buf, size_t len, uint64_t offset)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread64(fd, p, len, offset));
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Decompresses in_len bytes into out, returns the decompressed size or -1 */
+static int decompress(int compression, const void *in, uint32_t in_len,
+                      void *out, uint32_t out_len)
+{
+    if (compression == ZLIB_COMPRESSION) {
+        uLongf len = out_len;
+        if (uncompress(out, &len, in, in_len) != Z_OK) {
+            return -1;
+        }
+        return len;
+    }
+
+    if (compression == LZ4_COMPRESSION) {
+        return LZ4_decompress_safe(in, out, in_len, out_len);
+    }
+
+    return -1;
+}
+
+/* Returns a decompressed metadata block */
+static struct meta_block *get_meta_block(struct squashfs_reader *r, uint64_t start)
+{
+    struct meta_block *m = NULL;
+    uint8_t raw[SQUASHFS_METADATA_SIZE];
+    uint16_t header;
+    uint32_t len;
+    int i;
+
+    for (i = 0; i < META_CACHE_BLOCKS; i++) {
+        struct meta_block *c = &r->meta_cache[i];
+
+        if (c->len && c->start == start) {
+            c->last_used = ++r->clock;
+            return c;
+        }
+        if (!m || (m->len && (!c->len || c->last_used < m->last_used))) {
+            m = c;
+        }
+    }
+
+    if (read_fully(r->fd, &header, sizeof(header), start) < 0) {
+        ERROR("Error reading metadata block at %llu\n", (unsigned long long)start);
+        return NULL;
+    }
+
+    len = header & ~SQUASHFS_COMPRESSED_BIT;
+    if (len == 0 || len > SQUASHFS_METADATA_SIZE ||
+            read_fully(r->fd, raw, len, start + sizeof(header)) < 0) {
+        ERROR("Error reading metadata block at %llu\n", (unsigned long long)start);
+        return NULL;
+    }
+
+    m->len = 0;
+    if (header & SQUASHFS_COMPRESSED_BIT) {
+        memcpy(m->data, raw, len);
+        m->len = len;
+    } else {
+        int n = decompress(r->sb.compression, raw, len, m->data, sizeof(m->data));
+        if (n <= 0) {
+            ERROR("Error decompressing metadata block at %llu\n",
+                  (unsigned long long)start);
+            return NULL;
+        }
+        m->len = n;
+    }
+
+    m->start = start;
+    m->next = start + sizeof(header) + len;
+    m->last_used = ++r->clock;
+    return m;
+}
+
+/* Reads len bytes of metadata at offset in the block at *block, and moves
+   *block and *offset past them */
+static int read_metadata(struct squashfs_reader *r, uint64_t *block,
+                         uint32_t *offset, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        struct meta_block *m = get_meta_block(r, *block);
+        size_t n;
+
+        if (!m || *offset > m->len) {
+            return -1;
+        }
+
+        n = m->len - *offset;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(p, m->data + *offset, n);
+        p += n;
+        len -= n;
+        *offset += n;
+
+        if (*offset == m->len) {
+            *block = m->next;
+            *offset = 0;
+        }
+    }
+    return 0;
+}
+
+static int read_inode(struct squashfs_reader *r, uint64_t inode,
+                      struct inode_info *ii)
+{
+    uint64_t block = r->sb.inode_table_start + (inode >> 16);
+    uint32_t offset = inode & 0xffff;
+    struct squashfs_base_inode_header base;
+    size_t rest;
+
+    memset(ii, 0, sizeof(*ii));
+
+    if (read_metadata(r, &block, &offset, &base, sizeof(base)) < 0) {
+        return -1;
+    }
+
+    ii->st.inode = inode;
+    ii->st.inode_number = base.inode_number;
+    ii->st.mode = base.mode;
+    ii->st.mtime = base.mtime;
+
+    switch (base.inode_type) {
+    case SQUASHFS_DIR_TYPE: {
+        struct squashfs_dir_inode_header dir;
+        rest = sizeof(dir) - sizeof(base);
+        if (read_metadata(r, &block, &offset, (uint8_t *)&dir + sizeof(base), rest) < 0) {
+            return -1;
+        }
+        ii->st.type = SQUASHFS_READER_DIR;
+        ii->st.size = dir.file_size;
+        ii->dir_start_block = dir.start_block;
+        ii->dir_offset = dir.offset;
+        ii->dir_size = dir.file_size;
+        break;
+    }
+    case SQUASHFS_LDIR_TYPE: {
+        struct squashfs_ldir_inode_header dir;
+        rest = sizeof(dir) - sizeof(base);
+        if (read_metadata(r, &block, &offset, (uint8_t *)&dir + sizeof(base), rest) < 0) {
+            return -1;
+        }
+        ii->st.type = SQUASHFS_READER_DIR;
+        ii->st.size = dir.file_size;
+        ii->dir_start_block = dir.start_block;
+        ii->dir_offset = dir.offset;
+        ii->dir_size = dir.file_size;
+        ii->index_count = dir.i_count;
+        ii->index_block = block;
+        ii->index_offset = offset;
+        break;
+    }
+    case SQUASHFS_FILE_TYPE: {
+        struct squashfs_reg_inode_header reg;
+        rest = sizeof(reg) - sizeof(base);
+        if (read_metadata(r, &block, &offset, (uint8_t *)&reg + sizeof(base), rest) < 0) {
+            return -1;
+        }
+        ii->st.type = SQUASHFS_READER_REG;
+        ii->st.size = reg.file_size;
+        ii->start_block = reg.start_block;
+        ii->fragment = reg.fragment;
+        ii->fragment_offset = reg.offset;
+        ii->block_list = block;
+        ii->block_list_offset = offset;
+        break;
+    }
+    case SQUASHFS_LREG_TYPE: {
+        struct squashfs_lreg_inode_header reg;
+        rest = sizeof(reg) - sizeof(base);
+        if (read_metadata(r, &block, &offset, (uint8_t *)&reg + sizeof(base), rest) < 0) {
+            return -1;
+        }
+        ii->st.type = SQUASHFS_READER_REG;
+        ii->st.size = reg.file_size;
+        ii->start_block = reg.start_block;
+        ii->fragment = reg.fragment;
+        ii->fragment_offset = reg.offset;
+        ii->block_list = block;
+        ii->block_list_offset = offset;
+        break;
+    }
+    case SQUASHFS_SYMLINK_TYPE:
+    case SQUASHFS_LSYMLINK_TYPE: {
+        struct squashfs_symlink_inode_header link;
+        rest = sizeof(link) - sizeof(base);
+        if (read_metadata(r, &block, &offset, (uint8_t *)&link + sizeof(base), rest) < 0) {
+            return -1;
+        }
+        ii->st.type = SQUASHFS_READER_SYMLINK;
+        ii->st.size = link.symlink_size;
+        break;
+    }
+    case SQUASHFS_BLKDEV_TYPE:
+    case SQUASHFS_CHRDEV_TYPE:
+    case SQUASHFS_FIFO_TYPE:
+    case SQUASHFS_SOCKET_TYPE:
+        ii->st.type = base.inode_type;
+        break;
+    case SQUASHFS_LBLKDEV_TYPE:
+    case SQUASHFS_LCHRDEV_TYPE:
+    case SQUASHFS_LFIFO_TYPE:
+    case SQUASHFS_LSOCKET_TYPE:
+        ii->st.type = base.inode_type - (SQUASHFS_LDIR_TYPE - SQUASHFS_DIR_TYPE);
+        break;
+    default:
+        ERROR("Unknown inode type %d\n", base.inode_type);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Finds name in a directory, returns 1 and sets *inode and *type if it is
+ * there, 0 if it is not and -1 on error. Entries are sorted by name, and large
+ * directories have an index of the first name in each metadata block, so the
+ * scan starts from the last indexed name that is not past name.
+ */
+static int dir_lookup(struct squashfs_reader *r, const struct inode_info *dir,
+                      const char *name, uint64_t *inode, int *type)
+{
+    uint64_t block = r->sb.directory_table_start + dir->dir_start_block;
+    uint32_t offset = dir->dir_offset;
+    uint32_t pos = 3;   /* directory sizes include 3 bytes for . and .. */
+    char entry_name[SQUASHFS_NAME_LEN + 1];
+
+    if (dir->index_count) {
+        uint64_t index_block = dir->index_block;
+        uint32_t index_offset = dir->index_offset;
+        uint32_t index = 0;
+        uint32_t i;
+
+        for (i = 0; i < dir->index_count; i++) {
+            struct squashfs_dir_index di;
+
+            if (read_metadata(r, &index_block, &index_offset, &di, sizeof(di)) < 0 ||
+                    di.size + 1 > SQUASHFS_NAME_LEN ||
+                    read_metadata(r, &index_block, &index_offset, entry_name,
+                                  di.size + 1) < 0) {
+                return -1;
+            }
+            entry_name[di.size + 1] = 0;
+
+            if (strcmp(entry_name, name) > 0) {
+                break;
+            }
+            index = di.index;
+            block = r->sb.directory_table_start + di.start_block;
+        }
+
+        offset = (dir->dir_offset + index) % SQUASHFS_METADATA_SIZE;
+        pos = index + 3;
+    }
+
+    while (pos < dir->dir_size) {
+        struct squashfs_dir_header header;
+        uint32_t i;
+
+        if (read_metadata(r, &block, &offset, &header, sizeof(header)) < 0) {
+            return -1;
+        }
+        pos += sizeof(header);
+
+        for (i = 0; i <= header.count; i++) {
+            struct squashfs_dir_entry entry;
+            int cmp;
+
+            if (read_metadata(r, &block, &offset, &entry, sizeof(entry)) < 0 ||
+                    entry.size + 1 > SQUASHFS_NAME_LEN ||
+                    read_metadata(r, &block, &offset, entry_name, entry.size + 1) < 0) {
+                return -1;
+            }
+            entry_name[entry.size + 1] = 0;
+            pos += sizeof(entry) + entry.size + 1;
+
+            cmp = strcmp(entry_name, name);
+            if (cmp == 0) {
+                *inode = ((uint64_t)header.start_block << 16) | entry.offset;
+                *type = entry.type;
+                return 1;
+            }
+            if (cmp > 0) {
+                return 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static unsigned int dir_cache_hash(const char *path, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+    }
+    return hash % DIR_CACHE_BUCKETS;
+}
+
+static struct dir_cache_entry *dir_cache_find(struct squashfs_reader *r,
+                                              const char *path, size_t len)
+{
+    struct dir_cache_entry *e;
+
+    for (e = r->dir_cache[dir_cache_hash(path, len)]; e; e = e->next) {
+        if (strlen(e->path) == len && !memcmp(e->path, path, len)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void dir_cache_add(struct squashfs_reader *r, const char *path,
+                          size_t len, uint64_t inode)
+{
+    unsigned int hash = dir_cache_hash(path, len);
+    struct dir_cache_entry *e = malloc(sizeof(*e));
+
+    /* the cache is only an optimization, so failing to add is fine */
+    if (!e) {
+        return;
+    }
+    e->path = strndup(path, len);
+    if (!e->path) {
+        free(e);
+        return;
+    }
+    e->inode = inode;
+    e->next = r->dir_cache[hash];
+    r->dir_cache[hash] = e;
+}
+
+/* Finds the inode of a path, returns 1 if found, 0 if not and -1 on error */
+static int lookup(struct squashfs_reader *r, const char *path, struct inode_info *ii)
+{
+    char name[SQUASHFS_NAME_LEN + 1];
+    const char *p;
+    size_t len;
+
+    while (*path == '/') {
+        path++;
+    }
+
+    /* start from the deepest directory of the path already looked up */
+    len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    for (p = path + len; p > path; p--) {
+        struct dir_cache_entry *e;
+
+        if (p != path + len && *p != '/') {
+            continue;
+        }
+        e = dir_cache_find(r, path, p - path);
+        if (e) {
+            if (read_inode(r, e->inode, ii) < 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    if (p == path && read_inode(r, r->sb.root_inode, ii) < 0) {
+        return -1;
+    }
+
+    while (p < path + len) {
+        const char *end;
+        uint64_t inode;
+        int type, rc;
+
+        while (*p == '/') {
+            p++;
+        }
+        end = strchr(p, '/');
+        if (!end || end > path + len) {
+            end = path + len;
+        }
+        if ((size_t)(end - p) > SQUASHFS_NAME_LEN) {
+            return 0;
+        }
+        memcpy(name, p, end - p);
+        name[end - p] = 0;
+
+        if (ii->st.type != SQUASHFS_READER_DIR) {
+            return 0;
+        }
+
+        rc = dir_lookup(r, ii, name, &inode, &type);
+        if (rc <= 0) {
+            return rc;
+        }
+        if (read_inode(r, inode, ii) < 0) {
+            return -1;
+        }
+        if (ii->st.type == SQUASHFS_READER_DIR) {
+            dir_cache_add(r, path, end - path, inode);
+        }
+        p = end;
+    }
+
+    return 1;
+}
+
+int squashfs_stat_inode(struct squashfs_reader *r, uint64_t inode,
+                        struct squashfs_stat *st)
+{
+    struct inode_info ii;
+
+    if (read_inode(r, inode, &ii) < 0) {
+        return -1;
+    }
+    *st = ii.st;
+    return 0;
+}
+
+int squashfs_stat(struct squashfs_reader *r, const char *path,
+                  struct squashfs_stat *st)
+{
+    struct inode_info ii;
+
+    if (lookup(r, path, &ii) != 1) {
+        return -1;
+    }
+    *st = ii.st;
+    return 0;
+}
+
+int squashfs_read_dir(struct squashfs_reader *r, const char *path,
+                      int (*func)(void *priv, const char *name, int type,
+                                  uint64_t inode),
+                      void *priv)
+{
+    struct inode_info dir;
+    uint64_t block;
+    uint32_t offset;
+    uint32_t pos = 3;
+    char name[SQUASHFS_NAME_LEN + 1];
+
+    if (lookup(r, path, &dir) != 1 || dir.st.type != SQUASHFS_READER_DIR) {
+        return -1;
+    }
+
+    block = r->sb.directory_table_start + dir.dir_start_block;
+    offset = dir.dir_offset;
+
+    while (pos < dir.dir_size) {
+        struct squashfs_dir_header header;
+        uint32_t i;
+
+        if (read_metadata(r, &block, &offset, &header, sizeof(header)) < 0) {
+            return -1;
+        }
+        pos += sizeof(header);
+
+        for (i = 0; i <= header.count; i++) {
+            struct squashfs_dir_entry entry;
+
+            if (read_metadata(r, &block, &offset, &entry, sizeof(entry)) < 0 ||
+                    entry.size + 1 > SQUASHFS_NAME_LEN ||
+                    read_metadata(r, &block, &offset, name, entry.size + 1) < 0) {
+                return -1;
+            }
+            name[entry.size + 1] = 0;
+            pos += sizeof(entry) + entry.size + 1;
+
+            if (func(priv, name, entry.type > SQUASHFS_SOCKET_TYPE ?
+                             entry.type - (SQUASHFS_LDIR_TYPE - SQUASHFS_DIR_TYPE) :
+                             entry.type,
+                     ((uint64_t)header.start_block << 16) | entry.offset)) {
+                return 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Reads and decompresses a data or fragment block, returns its length */
+static int read_data_block(struct squashfs_reader *r, uint64_t start,
+                           uint32_t size, uint8_t *out, uint32_t out_len)
+{
+    uint32_t len = size & ~SQUASHFS_COMPRESSED_BIT_BLOCK;
+    uint8_t *raw;
+    int n;
+
+    if (len == 0) {
+        memset(out, 0, out_len);
+        return out_len;
+    }
+    if (len > r->info.block_size) {
+        return -1;
+    }
+
+    if (size & SQUASHFS_COMPRESSED_BIT_BLOCK) {
+        if (len > out_len || read_fully(r->fd, out, len, start) < 0) {
+            return -1;
+        }
+        return len;
+    }
+
+    raw = malloc(len);
+    if (!raw) {
+        return -1;
+    }
+    if (read_fully(r->fd, raw, len, start) < 0) {
+        free(raw);
+        return -1;
+    }
+    n = decompress(r->sb.compression, raw, len, out, out_len);
+    free(raw);
+    return n;
+}
+
+/* Returns the decompressed fragment block with the given index */
+static struct fragment_block *get_fragment(struct squashfs_reader *r, uint32_t index)
+{
+    struct fragment_block *f = NULL;
+    struct squashfs_fragment_entry entry;
+    uint64_t block;
+    uint32_t offset;
+    int i, n;
+
+    for (i = 0; i < FRAGMENT_CACHE_BLOCKS; i++) {
+        struct fragment_block *c = &r->fragment_cache[i];
+
+        if (c->len && c->index == index) {
+            c->last_used = ++r->clock;
+            return c;
+        }
+        if (!f || (f->len && (!c->len || c->last_used < f->last_used))) {
+            f = c;
+        }
+    }
+
+    if (index >= r->sb.fragments) {
+        return NULL;
+    }
+
+    block = r->fragment_index[index / FRAGMENTS_PER_BLOCK];
+    offset = (index % FRAGMENTS_PER_BLOCK) * sizeof(entry);
+    if (read_metadata(r, &block, &offset, &entry, sizeof(entry)) < 0) {
+        return NULL;
+    }
+
+    if (!f->data) {
+        f->data = malloc(r->info.block_size);
+        if (!f->data) {
+            return NULL;
+        }
+    }
+
+    f->len = 0;
+    n = read_data_block(r, entry.start_block, entry.size, f->data, r->info.block_size);
+    if (n <= 0) {
+        ERROR("Error reading fragment %u\n", index);
+        return NULL;
+    }
+
+    f->index = index;
+    f->len = n;
+    f->last_used = ++r->clock;
+    return f;
+}
+
+struct squashfs_file *squashfs_file_open(struct squashfs_reader *r,
+                                         const char *path)
+{
+    struct squashfs_file *f;
+    struct inode_info ii;
+    uint64_t start;
+    uint32_t i;
+
+    if (lookup(r, path, &ii) != 1 || ii.st.type != SQUASHFS_READER_REG) {
+        return NULL;
+    }
+
+    f = calloc(1, sizeof(*f));
+    if (!f) {
+        return NULL;
+    }
+
+    f->r = r;
+    f->size = ii.st.size;
+    f->fragment = ii.fragment;
+    f->fragment_offset = ii.fragment_offset;
+    f->cached_block = UINT32_MAX;
+
+    if (f->fragment == SQUASHFS_INVALID_FRAG) {
+        f->blocks = (f->size + r->info.block_size - 1) / r->info.block_size;
+    } else {
+        f->blocks = f->size / r->info.block_size;
+    }
+
+    f->block_sizes = malloc((f->blocks + 1) * sizeof(uint32_t));
+    f->block_starts = malloc((f->blocks + 1) * sizeof(uint64_t));
+    f->cached_data = malloc(r->info.block_size);
+    if (!f->block_sizes || !f->block_starts || !f->cached_data ||
+            read_metadata(r, &ii.block_list, &ii.block_list_offset,
+                          f->block_sizes, f->blocks * sizeof(uint32_t)) < 0) {
+        squashfs_file_close(f);
+        return NULL;
+    }
+
+    start = ii.start_block;
+    for (i = 0; i < f->blocks; i++) {
+        f->block_starts[i] = start;
+        start += f->block_sizes[i] & ~SQUASHFS_COMPRESSED_BIT_BLOCK;
+    }
+
+    return f;
+}
+
+void squashfs_file_close(struct squashfs_file *f)
+{
+    if (!f) {
+        return;
+    }
+    free(f->block_sizes);
+    free(f->block_starts);
+    free(f->cached_data);
+    free(f);
+}
+
+uint64_t squashfs_file_size(const struct squashfs_file *f)
+{
+    return f->size;
+}
+
+/* Length of data block i of a file */
+static uint32_t block_len(const struct squashfs_file *f, uint32_t i)
+{
+    uint64_t left = f->size - (uint64_t)i * f->r->info.block_size;
+
+    return left < f->r->info.block_size ? left : f->r->info.block_size;
+}
+
+ssize_t squashfs_file_pread(struct squashfs_file *f, void *buf, size_t count,
+                            uint64_t offset)
+{
+    struct squashfs_reader *r = f->r;
+    uint8_t *p = buf;
+
+    if (offset >= f->size) {
+        return 0;
+    }
+    if (count > f->size - offset) {
+        count = f->size - offset;
+    }
+
+    while (count > 0) {
+        uint32_t i = offset / r->info.block_size;
+        uint32_t in_block = offset % r->info.block_size;
+        const uint8_t *data;
+        uint32_t len;
+        size_t n;
+
+        if (i < f->blocks) {
+            len = block_len(f, i);
+            if (f->cached_block != i) {
+                f->cached_block = UINT32_MAX;
+                if (read_data_block(r, f->block_starts[i], f->block_sizes[i],
+                                    f->cached_data, len) != (int)len) {
+                    return -1;
+                }
+                f->cached_block = i;
+            }
+            data = f->cached_data;
+        } else {
+            struct fragment_block *frag = get_fragment(r, f->fragment);
+
+            len = f->size % r->info.block_size;
+            if (!frag || f->fragment_offset + len > frag->len) {
+                return -1;
+            }
+            data = frag->data + f->fragment_offset;
+        }
+
+        n = len - in_block;
+        if (n > count) {
+            n = count;
+        }
+        memcpy(p, data + in_block, n);
+        p += n;
+        offset += n;
+        count -= n;
+    }
+
+    return p - (uint8_t *)buf;
+}
+
+static void run_job(struct squashfs_reader *r, struct block_job *job)
+{
+    int n;
+
+    if (job->in_len == 0) {
+        memset(job->out, 0, job->out_len);
+        return;
+    }
+
+    if (!job->compressed) {
+        job->failed = job->in_len != job->out_len;
+        if (!job->failed) {
+            memcpy(job->out, job->in, job->in_len);
+        }
+        return;
+    }
+
+    n = decompress(r->sb.compression, job->in, job->in_len, job->out, job->out_len);
+    job->failed = n != (int)job->out_len;
+}
+
+/* Runs queued jobs until there are none left, called with r->mutex held */
+static void run_jobs(struct squashfs_reader *r)
+{
+    while (r->next_job < r->num_jobs) {
+        struct block_job *job = &r->jobs[r->next_job++];
+
+        pthread_mutex_unlock(&r->mutex);
+        run_job(r, job);
+        pthread_mutex_lock(&r->mutex);
+
+        if (++r->finished_jobs == r->num_jobs) {
+            pthread_cond_broadcast(&r->done_cond);
+        }
+    }
+}
+
+static void *decompress_thread(void *arg)
+{
+    struct squashfs_reader *r = arg;
+
+    pthread_mutex_lock(&r->mutex);
+    while (!r->quit) {
+        run_jobs(r);
+        pthread_cond_wait(&r->work_cond, &r->mutex);
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    return NULL;
+}
+
+/* Decompresses jobs with the reader's threads and the calling thread */
+static void decompress_jobs(struct squashfs_reader *r, struct block_job *jobs, int num_jobs)
+{
+    pthread_mutex_lock(&r->mutex);
+
+    while (r->started < r->threads - 1) {
+        if (pthread_create(&r->thread[r->started], NULL, decompress_thread, r) != 0) {
+            /* run with the threads that did start */
+            r->threads = r->started + 1;
+            break;
+        }
+        r->started++;
+    }
+
+    r->jobs = jobs;
+    r->num_jobs = num_jobs;
+    r->next_job = 0;
+    r->finished_jobs = 0;
+    pthread_cond_broadcast(&r->work_cond);
+
+    run_jobs(r);
+    while (r->finished_jobs < r->num_jobs) {
+        pthread_cond_wait(&r->done_cond, &r->mutex);
+    }
+
+    r->jobs = NULL;
+    r->num_jobs = 0;
+    r->next_job = 0;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+int squashfs_file_read_all(struct squashfs_file *f,
+                           int (*func)(void *priv, const void *data, size_t len),
+                           void *priv)
+{
+    struct squashfs_reader *r = f->r;
+    uint32_t batch = r->threads * 4;
+    struct block_job jobs[READ_ALL_MAX_BLOCKS];
+    uint8_t *in = NULL, *out = NULL;
+    int rc = -1;
+    uint32_t i, j;
+
+    if (batch > READ_ALL_MAX_BLOCKS) {
+        batch = READ_ALL_MAX_BLOCKS;
+    }
+
+    if (f->blocks) {
+        in = malloc((size_t)batch * r->info.block_size);
+        out = malloc((size_t)batch * r->info.block_size);
+        if (!in || !out) {
+            goto out;
+        }
+    }
+
+    for (i = 0; i < f->blocks; i += batch) {
+        uint32_t n = f->blocks - i < batch ? f->blocks - i : batch;
+        uint64_t in_len = 0;
+        uint8_t *p = out;
+
+        /* the data blocks of a file are stored one after another, so a
+           batch is read at once */
+        for (j = 0; j < n; j++) {
+            uint32_t size = f->block_sizes[i + j];
+            uint32_t len = size & ~SQUASHFS_COMPRESSED_BIT_BLOCK;
+
+            if (len > r->info.block_size) {
+                goto out;
+            }
+            jobs[j].in = in + in_len;
+            jobs[j].in_len = len;
+            jobs[j].compressed = !(size & SQUASHFS_COMPRESSED_BIT_BLOCK);
+            jobs[j].out = out + (size_t)j * r->info.block_size;
+            jobs[j].out_len = block_len(f, i + j);
+            jobs[j].failed = false;
+            in_len += len;
+        }
+
+        if (in_len && read_fully(r->fd, in, in_len, f->block_starts[i]) < 0) {
+            goto out;
+        }
+
+        decompress_jobs(r, jobs, n);
+
+        for (j = 0; j < n; j++, p += r->info.block_size) {
+            if (jobs[j].failed) {
+                ERROR("Error decompressing data block at %llu\n",
+                      (unsigned long long)f->block_starts[i + j]);
+                goto out;
+            }
+            if (func(priv, p, jobs[j].out_len)) {
+                rc = 0;
+                goto out;
+            }
+        }
+    }
+
+    if (f->fragment != SQUASHFS_INVALID_FRAG && f->size % r->info.block_size) {
+        struct fragment_block *frag = get_fragment(r, f->fragment);
+        uint32_t len = f->size % r->info.block_size;
+
+        if (!frag || f->fragment_offset + len > frag->len) {
+            goto out;
+        }
+        func(priv, frag->data + f->fragment_offset, len);
+    }
+
+    rc = 0;
+
+out:
+    free(in);
+    free(out);
+    return rc;
+}
+
+struct squashfs_reader *squashfs_reader_open_fd(int fd, int threads)
+{
+    struct squashfs_reader *r;
+    uint32_t index_blocks;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    r->fd = fd;
+
+    if (read_fully(fd, &r->sb, sizeof(r->sb), 0) < 0 ||
+            squashfs_parse_sb_buffer(&r->sb, &r->info) < 0) {
+        ERROR("Not a valid squashfs filesystem\n");
+        free(r);
+        return NULL;
+    }
+
+    if (r->sb.compression != ZLIB_COMPRESSION &&
+            r->sb.compression != LZ4_COMPRESSION) {
+        ERROR("Unsupported squashfs compression %d\n", r->sb.compression);
+        free(r);
+        return NULL;
+    }
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+    r->threads = threads < READER_MAX_THREADS ? threads : READER_MAX_THREADS;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->work_cond, NULL);
+    pthread_cond_init(&r->done_cond, NULL);
+
+    r->meta_cache = calloc(META_CACHE_BLOCKS, sizeof(struct meta_block));
+    if (!r->meta_cache) {
+        squashfs_reader_close(r);
+        return NULL;
+    }
+
+    index_blocks = (r->sb.fragments + FRAGMENTS_PER_BLOCK - 1) / FRAGMENTS_PER_BLOCK;
+    if (index_blocks) {
+        r->fragment_index = malloc(index_blocks * sizeof(uint64_t));
+        if (!r->fragment_index ||
+                read_fully(fd, r->fragment_index, index_blocks * sizeof(uint64_t),
+                           r->sb.fragment_table_start) < 0) {
+            ERROR("Error reading fragment table\n");
+            squashfs_reader_close(r);
+            return NULL;
+        }
+    }
+
+    return r;
+}
+
+struct squashfs_reader *squashfs_reader_open(const char *path, int threads)
+{
+    struct squashfs_reader *r;
+    int fd;
+
+    fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        ERROR("Error opening %s (%s)\n", path, strerror(errno));
+        return NULL;
+    }
+
+    r = squashfs_reader_open_fd(fd, threads);
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->own_fd = true;
+    return r;
+}
+
+void squashfs_reader_close(struct squashfs_reader *r)
+{
+    int i;
+
+    if (!r) {
+        return;
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    r->quit = true;
+    pthread_cond_broadcast(&r->work_cond);
+    pthread_mutex_unlock(&r->mutex);
+    for (i = 0; i < r->started; i++) {
+        pthread_join(r->thread[i], NULL);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->work_cond);
+    pthread_cond_destroy(&r->done_cond);
+
+    for (i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        while (r->dir_cache[i]) {
+            struct dir_cache_entry *e = r->dir_cache[i];
+            r->dir_cache[i] = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+
+    for (i = 0; i < FRAGMENT_CACHE_BLOCKS; i++) {
+        free(r->fragment_cache[i].data);
+    }
+
+    free(r->meta_cache);
+    free(r->fragment_index);
+    if (r->own_fd) {
+        close(r->fd);
+    }
+    free(r);
+}
+
+const struct squashfs_info *squashfs_reader_get_info(const struct squashfs_reader *r)
+{
+    return &r->info;
+}
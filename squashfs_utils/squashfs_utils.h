@@ -19,6 +19,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +36,71 @@ size_t squashfs_get_sb_size();
 int squashfs_parse_sb_buffer(const void *data, struct squashfs_info *info);
 int squashfs_parse_sb(const char *blk_device, struct squashfs_info *info);
 
+/*
+ * Reader for the contents of squashfs images, in squashfs_reader.c. Paths are
+ * relative to the root directory, with or without a leading slash. Functions
+ * that return int return 0 on success and -1 on failure. A reader and its
+ * files must not be used from more than one thread at a time; the reader
+ * starts its own threads to decompress data blocks.
+ */
+
+struct squashfs_reader;
+struct squashfs_file;
+
+/* File types, the same as the basic inode types of squashfs */
+#define SQUASHFS_READER_DIR     1
+#define SQUASHFS_READER_REG     2
+#define SQUASHFS_READER_SYMLINK 3
+#define SQUASHFS_READER_BLKDEV  4
+#define SQUASHFS_READER_CHRDEV  5
+#define SQUASHFS_READER_FIFO    6
+#define SQUASHFS_READER_SOCKET  7
+
+struct squashfs_stat {
+    uint64_t inode;         /* inode reference, for squashfs_stat_inode */
+    uint32_t inode_number;
+    int type;               /* SQUASHFS_READER_* */
+    uint16_t mode;          /* permission bits */
+    uint32_t mtime;
+    uint64_t size;          /* file size, or length of the symlink target */
+};
+
+/* Opens the squashfs image at path, or in fd, which stays owned by the
+   caller. threads is the number of threads used to decompress data blocks
+   in squashfs_file_read_all, 0 for one per cpu. */
+struct squashfs_reader *squashfs_reader_open(const char *path, int threads);
+struct squashfs_reader *squashfs_reader_open_fd(int fd, int threads);
+void squashfs_reader_close(struct squashfs_reader *r);
+const struct squashfs_info *squashfs_reader_get_info(const struct squashfs_reader *r);
+
+int squashfs_stat(struct squashfs_reader *r, const char *path,
+                  struct squashfs_stat *st);
+int squashfs_stat_inode(struct squashfs_reader *r, uint64_t inode,
+                        struct squashfs_stat *st);
+
+/* Calls func for each entry of the directory at path, in name order, until it
+   returns non-zero */
+int squashfs_read_dir(struct squashfs_reader *r, const char *path,
+                      int (*func)(void *priv, const char *name, int type,
+                                  uint64_t inode),
+                      void *priv);
+
+struct squashfs_file *squashfs_file_open(struct squashfs_reader *r,
+                                         const char *path);
+void squashfs_file_close(struct squashfs_file *f);
+uint64_t squashfs_file_size(const struct squashfs_file *f);
+
+/* Reads up to count bytes at offset, returns the number of bytes read, which
+   is less than count only at the end of the file, or -1 */
+ssize_t squashfs_file_pread(struct squashfs_file *f, void *buf, size_t count,
+                            uint64_t offset);
+
+/* Reads the whole file in order, decompressing blocks in parallel, and calls
+   func with each piece of it until it returns non-zero */
+int squashfs_file_read_all(struct squashfs_file *f,
+                           int (*func)(void *priv, const void *data, size_t len),
+                           void *priv);
+
 #ifdef __cplusplus
 }
 #endif
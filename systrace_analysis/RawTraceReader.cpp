@@ -0,0 +1,563 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+
+#include <lz4frame.h>
+
+#include "RawTraceReader.h"
+
+// The types of the ring buffer event headers, in their low 5 bits.
+static constexpr uint32_t TYPE_PADDING = 29;
+static constexpr uint32_t TYPE_TIME_EXTEND = 30;
+static constexpr uint32_t TYPE_TIME_STAMP = 31;
+static constexpr int TIME_SHIFT = 27;
+// The high bits of commit flag the events lost before the page.
+static constexpr uint64_t COMMIT_MASK = (1ULL << 30) - 1;
+// The kernel's encoding of a dev_t.
+static constexpr int MINOR_BITS = 20;
+
+struct RawTraceReader::CpuStream {
+  int cpu;
+  int fd = -1;
+  LZ4F_decompressionContext_t lz4 = nullptr;
+  std::vector<uint8_t> in;
+  size_t in_pos = 0;
+  size_t in_len = 0;
+  std::vector<uint8_t> page;
+  // The next header to read and the end of the data of the page.
+  size_t pos = 0;
+  size_t end = 0;
+  uint64_t time = 0;
+  // The event the stream is at.
+  size_t event_offset = 0;
+  size_t event_len = 0;
+};
+
+RawTraceReader::RawTraceReader() {
+}
+
+RawTraceReader::~RawTraceReader() {
+  for (auto& stream : streams_) {
+    if (stream->lz4 != nullptr) {
+      LZ4F_freeDecompressionContext(stream->lz4);
+    }
+    close(stream->fd);
+  }
+}
+
+static uint32_t Read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t ReadField(const uint8_t* data, size_t len, uint32_t offset, uint32_t size,
+                          bool is_signed) {
+  if (size == 0 || offset + size > len) {
+    return 0;
+  }
+  switch (size) {
+    case 1: {
+      uint8_t v = data[offset];
+      return is_signed ? static_cast<int8_t>(v) : v;
+    }
+    case 2: {
+      uint16_t v;
+      memcpy(&v, data + offset, sizeof(v));
+      return is_signed ? static_cast<int16_t>(v) : v;
+    }
+    case 4: {
+      uint32_t v;
+      memcpy(&v, data + offset, sizeof(v));
+      return is_signed ? static_cast<int32_t>(v) : v;
+    }
+    default: {
+      uint64_t v;
+      memcpy(&v, data + offset, sizeof(v));
+      return v;
+    }
+  }
+}
+
+static void ReadString(const uint8_t* data, size_t len, uint32_t offset, uint32_t size,
+                       char* dst, size_t dst_size) {
+  size_t n = 0;
+  if (offset + size <= len) {
+    n = strnlen(reinterpret_cast<const char*>(data + offset), size);
+  }
+  if (n >= dst_size) {
+    n = dst_size - 1;
+  }
+  memcpy(dst, data + offset, n);
+  dst[n] = '\0';
+}
+
+// Parses the "\tfield:<type> <name>;\toffset:N;\tsize:N;\tsigned:N;" lines
+// of a format file.
+static bool ReadFields(FILE* fp, std::string* name, uint32_t* id,
+                       std::map<std::string, std::pair<uint32_t, uint32_t>>* fields,
+                       std::map<std::string, bool>* is_signed) {
+  char line[512];
+  bool has_fields = false;
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    char* p = line;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (name != nullptr && !strncmp(p, "name: ", 6)) {
+      *name = std::string(p + 6, strcspn(p + 6, "\n"));
+      continue;
+    }
+    if (id != nullptr && !strncmp(p, "ID: ", 4)) {
+      *id = strtoul(p + 4, nullptr, 10);
+      continue;
+    }
+    if (strncmp(p, "field:", 6)) {
+      continue;
+    }
+    char* decl_end = strchr(p, ';');
+    if (decl_end == nullptr) {
+      continue;
+    }
+    // The name is the last word of the declaration, without its array size.
+    char* field_end = decl_end;
+    char* bracket = static_cast<char*>(memchr(p, '[', decl_end - p));
+    if (bracket != nullptr) {
+      field_end = bracket;
+    }
+    char* field = field_end;
+    while (field > p && field[-1] != ' ' && field[-1] != ':') {
+      field--;
+    }
+    unsigned offset, size;
+    int sign = 0;
+    if (sscanf(decl_end + 1, " offset:%u; size:%u; signed:%d;", &offset, &size, &sign) < 2) {
+      continue;
+    }
+    std::string field_name(field, field_end - field);
+    (*fields)[field_name] = std::make_pair(offset, size);
+    (*is_signed)[field_name] = sign;
+    has_fields = true;
+  }
+  return has_fields;
+}
+
+bool RawTraceReader::ReadHeaderPage(const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "re");
+  if (fp == nullptr) {
+    return false;
+  }
+  std::map<std::string, std::pair<uint32_t, uint32_t>> fields;
+  std::map<std::string, bool> is_signed;
+  ReadFields(fp, nullptr, nullptr, &fields, &is_signed);
+  fclose(fp);
+
+  auto commit = fields.find("commit");
+  auto data = fields.find("data");
+  if (commit == fields.end() || data == fields.end()) {
+    errno = EINVAL;
+    return false;
+  }
+  commit_.offset = commit->second.first;
+  commit_.size = commit->second.second;
+  data_offset_ = data->second.first;
+  page_size_ = data->second.first + data->second.second;
+  return true;
+}
+
+bool RawTraceReader::ReadFormat(const std::string& path) {
+  static const std::map<std::string, EventType> kEvents = {
+    { "sched_switch", EVENT_SCHED_SWITCH },
+    { "sched_waking", EVENT_SCHED_WAKEUP },
+    { "sched_wakeup", EVENT_SCHED_WAKEUP },
+    { "sched_wakeup_new", EVENT_SCHED_WAKEUP },
+    { "sched_blocked_reason", EVENT_SCHED_BLOCKED_REASON },
+    { "binder_transaction", EVENT_BINDER_TRANSACTION },
+    { "binder_transaction_received", EVENT_BINDER_TRANSACTION_RECEIVED },
+    { "block_rq_issue", EVENT_BLOCK_RQ_ISSUE },
+    { "block_rq_complete", EVENT_BLOCK_RQ_COMPLETE },
+    { "cpu_frequency", EVENT_CPU_FREQUENCY },
+  };
+
+  FILE* fp = fopen(path.c_str(), "re");
+  if (fp == nullptr) {
+    return false;
+  }
+  std::string name;
+  uint32_t id = 0;
+  std::map<std::string, std::pair<uint32_t, uint32_t>> fields;
+  std::map<std::string, bool> is_signed;
+  bool has_fields = ReadFields(fp, &name, &id, &fields, &is_signed);
+  fclose(fp);
+  if (!has_fields) {
+    return false;
+  }
+
+  auto field = [&](const char* field_name) {
+    Field f;
+    auto it = fields.find(field_name);
+    if (it != fields.end()) {
+      f.offset = it->second.first;
+      f.size = it->second.second;
+      f.is_signed = is_signed[field_name];
+    }
+    return f;
+  };
+  // The common fields are the same for every event.
+  common_type_ = field("common_type");
+  common_pid_ = field("common_pid");
+
+  auto event = kEvents.find(name);
+  if (event == kEvents.end()) {
+    return true;
+  }
+  EventFormat& format = formats_[id];
+  format.type = event->second;
+  format.pid = field("pid");
+  format.comm = field("comm");
+  format.prev_pid = field("prev_pid");
+  format.prev_state = field("prev_state");
+  format.prev_comm = field("prev_comm");
+  format.next_pid = field("next_pid");
+  format.next_comm = field("next_comm");
+  format.iowait = field("io_wait");
+  format.caller = field("caller");
+  format.transaction = field("debug_id");
+  format.dest_proc = field("to_proc");
+  format.dest_thread = field("to_thread");
+  format.reply = field("reply");
+  format.flags = field("flags");
+  format.dev = field("dev");
+  format.sector = field("sector");
+  format.nr_sector = field("nr_sector");
+  format.freq = field("state");
+  format.freq_cpu = field("cpu_id");
+  return true;
+}
+
+void RawTraceReader::ReadCmdlines(const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "re");
+  if (fp == nullptr) {
+    return;
+  }
+  char line[64];
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    char* comm;
+    pid_t pid = strtol(line, &comm, 10);
+    if (*comm == ' ') {
+      comm++;
+      cmdlines_[pid] = std::string(comm, strcspn(comm, "\n"));
+    }
+  }
+  fclose(fp);
+}
+
+bool RawTraceReader::OpenCpu(const std::string& path, int cpu) {
+  std::unique_ptr<CpuStream> stream(new CpuStream);
+  stream->cpu = cpu;
+  stream->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (stream->fd == -1) {
+    return false;
+  }
+  if (path.size() > 4 && !path.compare(path.size() - 4, 4, ".lz4")) {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&stream->lz4, LZ4F_VERSION))) {
+      close(stream->fd);
+      errno = ENOMEM;
+      return false;
+    }
+    stream->in.resize(64 * 1024);
+  }
+  stream->page.resize(page_size_);
+  if (Advance(stream.get())) {
+    streams_.push_back(std::move(stream));
+  } else {
+    if (stream->lz4 != nullptr) {
+      LZ4F_freeDecompressionContext(stream->lz4);
+    }
+    close(stream->fd);
+  }
+  return true;
+}
+
+bool RawTraceReader::Open(const char* dir) {
+  std::string path(dir);
+  if (!ReadHeaderPage(path + "/header_page")) {
+    return false;
+  }
+  ReadCmdlines(path + "/saved_cmdlines");
+
+  DIR* d = opendir(dir);
+  if (d == nullptr) {
+    return false;
+  }
+  std::vector<std::pair<std::string, int>> cpus;
+  struct dirent* de;
+  while ((de = readdir(d)) != nullptr) {
+    const char* name = de->d_name;
+    size_t len = strlen(name);
+    int cpu;
+    char suffix[8] = "";
+    if (len > 7 && !strcmp(name + len - 7, ".format")) {
+      ReadFormat(path + "/" + name);
+    } else if (sscanf(name, "cpu%d%7s", &cpu, suffix) >= 1 &&
+               (suffix[0] == '\0' || !strcmp(suffix, ".lz4"))) {
+      cpus.emplace_back(path + "/" + name, cpu);
+    }
+  }
+  closedir(d);
+
+  if (formats_.empty() || cpus.empty()) {
+    errno = ENOENT;
+    return false;
+  }
+  for (auto& cpu : cpus) {
+    if (!OpenCpu(cpu.first, cpu.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RawTraceReader::ReadPage(CpuStream* stream) {
+  size_t filled = 0;
+  while (filled < page_size_) {
+    if (stream->lz4 == nullptr) {
+      ssize_t n = TEMP_FAILURE_RETRY(read(stream->fd, &stream->page[filled], page_size_ - filled));
+      if (n <= 0) {
+        return false;
+      }
+      filled += n;
+      continue;
+    }
+    if (stream->in_pos == stream->in_len) {
+      ssize_t n = TEMP_FAILURE_RETRY(read(stream->fd, stream->in.data(), stream->in.size()));
+      if (n <= 0) {
+        return false;
+      }
+      stream->in_pos = 0;
+      stream->in_len = n;
+    }
+    size_t out_size = page_size_ - filled;
+    size_t in_size = stream->in_len - stream->in_pos;
+    size_t ret = LZ4F_decompress(stream->lz4, &stream->page[filled], &out_size,
+                                 &stream->in[stream->in_pos], &in_size, nullptr);
+    if (LZ4F_isError(ret)) {
+      fprintf(stderr, "cpu%d: %s\n", stream->cpu, LZ4F_getErrorName(ret));
+      return false;
+    }
+    stream->in_pos += in_size;
+    filled += out_size;
+  }
+
+  const uint8_t* page = stream->page.data();
+  uint64_t commit = ReadField(page, page_size_, commit_.offset, commit_.size, false);
+  stream->time = ReadField(page, page_size_, 0, 8, false);
+  stream->pos = data_offset_;
+  stream->end = data_offset_ + std::min<uint64_t>(commit & COMMIT_MASK, page_size_ - data_offset_);
+  return true;
+}
+
+bool RawTraceReader::Advance(CpuStream* stream) {
+  const uint8_t* page = stream->page.data();
+  while (true) {
+    if (stream->pos + 4 > stream->end) {
+      if (!ReadPage(stream)) {
+        return false;
+      }
+      continue;
+    }
+    uint32_t header = Read32(page + stream->pos);
+    uint32_t type_len = header & 0x1f;
+    uint64_t delta = header >> 5;
+    stream->pos += 4;
+
+    size_t len;
+    switch (type_len) {
+      case TYPE_PADDING:
+        // Padding to the end of the page, or a discarded event.
+        if (delta == 0 || stream->pos + 4 > stream->end) {
+          stream->pos = stream->end;
+        } else {
+          stream->time += delta;
+          stream->pos += Read32(page + stream->pos);
+        }
+        continue;
+      case TYPE_TIME_EXTEND:
+      case TYPE_TIME_STAMP:
+        if (stream->pos + 4 > stream->end) {
+          stream->pos = stream->end;
+          continue;
+        }
+        delta += static_cast<uint64_t>(Read32(page + stream->pos)) << TIME_SHIFT;
+        stream->pos += 4;
+        stream->time = type_len == TYPE_TIME_STAMP ? delta : stream->time + delta;
+        continue;
+      case 0:
+        // The length, which counts itself, is in the first word.
+        if (stream->pos + 4 > stream->end) {
+          stream->pos = stream->end;
+          continue;
+        }
+        len = (Read32(page + stream->pos) - 4 + 3) & ~3;
+        stream->pos += 4;
+        break;
+      default:
+        len = type_len * 4;
+        break;
+    }
+    stream->time += delta;
+    if (stream->pos + len > stream->end) {
+      stream->pos = stream->end;
+      continue;
+    }
+    stream->event_offset = stream->pos;
+    stream->event_len = len;
+    stream->pos += len;
+    return true;
+  }
+}
+
+// The states of a task in the prev_state bitmask. The low bits are the
+// same in every kernel; since 4.14 0x80 is an idle kernel thread and 0x100
+// a preemption, while before 0x80 only came with 0x2 and preemptions were
+// in higher bits.
+static ThreadState StateFromMask(uint64_t state) {
+  if (state & 0x2) {
+    return THREAD_BLOCKED;
+  }
+  if (state & 0x1) {
+    return THREAD_SLEEPING;
+  }
+  // EXIT_DEAD and EXIT_ZOMBIE, and 0x40 which is TASK_DEAD before 4.14 and
+  // a parked thread after: the time of neither is accounted.
+  if (state & 0x70) {
+    return THREAD_DEAD;
+  }
+  // Stopped, traced and idle.
+  if (state & 0x8c) {
+    return THREAD_SLEEPING;
+  }
+  return THREAD_RUNNABLE;
+}
+
+bool RawTraceReader::Decode(const CpuStream& stream, TraceEvent* event) {
+  const uint8_t* data = &stream.page[stream.event_offset];
+  size_t len = stream.event_len;
+  uint32_t id = ReadField(data, len, common_type_.offset, common_type_.size, false);
+  auto it = formats_.find(id);
+  if (it == formats_.end()) {
+    return false;
+  }
+  const EventFormat& f = it->second;
+  auto get = [&](const Field& field) {
+    return ReadField(data, len, field.offset, field.size, field.is_signed);
+  };
+  auto get_string = [&](const Field& field, char* dst, size_t dst_size) {
+    ReadString(data, len, field.offset, field.size, dst, dst_size);
+  };
+
+  event->type = f.type;
+  event->time_ns = stream.time;
+  event->cpu = stream.cpu;
+  event->pid = get(common_pid_);
+  event->tgid = -1;
+  auto cmdline = cmdlines_.find(event->pid);
+  if (cmdline != cmdlines_.end()) {
+    snprintf(event->comm, sizeof(event->comm), "%s", cmdline->second.c_str());
+  } else {
+    event->comm[0] = '\0';
+  }
+
+  switch (f.type) {
+    case EVENT_SCHED_SWITCH:
+      event->prev_pid = get(f.prev_pid);
+      event->prev_state = StateFromMask(get(f.prev_state));
+      get_string(f.prev_comm, event->prev_comm, sizeof(event->prev_comm));
+      event->next_pid = get(f.next_pid);
+      get_string(f.next_comm, event->next_comm, sizeof(event->next_comm));
+      break;
+    case EVENT_SCHED_WAKEUP:
+      event->target_pid = get(f.pid);
+      get_string(f.comm, event->target_comm, sizeof(event->target_comm));
+      break;
+    case EVENT_SCHED_BLOCKED_REASON:
+      // Without the kernel's symbols, callers are shown as addresses.
+      event->target_pid = get(f.pid);
+      event->iowait = get(f.iowait);
+      snprintf(event->caller, sizeof(event->caller), "0x%" PRIx64, get(f.caller));
+      break;
+    case EVENT_BINDER_TRANSACTION:
+      event->transaction = get(f.transaction);
+      event->dest_proc = get(f.dest_proc);
+      event->dest_thread = get(f.dest_thread);
+      event->reply = get(f.reply);
+      event->flags = get(f.flags);
+      break;
+    case EVENT_BINDER_TRANSACTION_RECEIVED:
+      event->transaction = get(f.transaction);
+      break;
+    case EVENT_BLOCK_RQ_ISSUE:
+    case EVENT_BLOCK_RQ_COMPLETE: {
+      uint64_t dev = get(f.dev);
+      event->dev_major = dev >> MINOR_BITS;
+      event->dev_minor = dev & ((1U << MINOR_BITS) - 1);
+      event->sector = get(f.sector);
+      event->nr_sector = get(f.nr_sector);
+      break;
+    }
+    case EVENT_CPU_FREQUENCY:
+      event->freq = get(f.freq);
+      event->freq_cpu = get(f.freq_cpu);
+      break;
+  }
+  return true;
+}
+
+bool RawTraceReader::Next(TraceEvent* event) {
+  while (!streams_.empty()) {
+    // There are few cpus, a scan for the earliest is as fast as a heap.
+    size_t earliest = 0;
+    for (size_t i = 1; i < streams_.size(); i++) {
+      if (streams_[i]->time < streams_[earliest]->time) {
+        earliest = i;
+      }
+    }
+    CpuStream* stream = streams_[earliest].get();
+    bool decoded = Decode(*stream, event);
+    if (!Advance(stream)) {
+      if (stream->lz4 != nullptr) {
+        LZ4F_freeDecompressionContext(stream->lz4);
+      }
+      close(stream->fd);
+      streams_.erase(streams_.begin() + earliest);
+    }
+    if (decoded) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYSTRACE_ANALYSIS_RAW_TRACE_READER_H
+#define _SYSTRACE_ANALYSIS_RAW_TRACE_READER_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TraceEvent.h"
+
+// Reads the ring buffer pages of a trace, as dumped by ANRdaemon -r: a
+// directory with the pages of each cpu in cpu<N>.lz4 (or uncompressed in
+// cpu<N>), the header_page and <system>.<event>.format files to decode
+// them and saved_cmdlines. The cpus are merged in time order, decoding one
+// page of each at a time.
+class RawTraceReader : public TraceReader {
+ public:
+  RawTraceReader();
+  ~RawTraceReader() override;
+
+  // Returns false, with errno set, if the directory is not a dump.
+  bool Open(const char* dir);
+
+  bool Next(TraceEvent* event) override;
+
+ private:
+  struct Field {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    bool is_signed = false;
+  };
+
+  // The fields of the events the analyzer uses, found by name in the
+  // format files since their offsets change with the kernel.
+  struct EventFormat {
+    EventType type;
+    Field pid;
+    Field comm;
+    Field prev_pid;
+    Field prev_state;
+    Field prev_comm;
+    Field next_pid;
+    Field next_comm;
+    Field iowait;
+    Field caller;
+    Field transaction;
+    Field dest_proc;
+    Field dest_thread;
+    Field reply;
+    Field flags;
+    Field dev;
+    Field sector;
+    Field nr_sector;
+    Field freq;
+    Field freq_cpu;
+  };
+
+  struct CpuStream;
+
+  bool ReadHeaderPage(const std::string& path);
+  bool ReadFormat(const std::string& path);
+  void ReadCmdlines(const std::string& path);
+  bool OpenCpu(const std::string& path, int cpu);
+
+  bool ReadPage(CpuStream* stream);
+  // Moves the stream to its next event, returns false at its end.
+  bool Advance(CpuStream* stream);
+  bool Decode(const CpuStream& stream, TraceEvent* event);
+
+  size_t page_size_ = 4096;
+  Field commit_;
+  size_t data_offset_ = 16;
+  Field common_type_;
+  Field common_pid_;
+  std::unordered_map<uint32_t, EventFormat> formats_;
+  std::unordered_map<pid_t, std::string> cmdlines_;
+  std::vector<std::unique_ptr<CpuStream>> streams_;
+};
+
+#endif // _SYSTRACE_ANALYSIS_RAW_TRACE_READER_H
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TextTraceReader.h"
+
+TextTraceReader::~TextTraceReader() {
+  free(line_);
+}
+
+bool TextTraceReader::Next(TraceEvent* event) {
+  while (getline(&line_, &line_size_, fp_) != -1) {
+    if (ParseLine(line_, event)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void CopyComm(char* dst, const char* src, size_t len) {
+  if (len >= COMM_LEN) {
+    len = COMM_LEN - 1;
+  }
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
+
+// Returns the value of key=, with the key at the start of args or after a
+// space.
+static const char* FindArg(const char* args, const char* key) {
+  size_t key_len = strlen(key);
+  for (const char* p = strstr(args, key); p != nullptr; p = strstr(p + 1, key)) {
+    if ((p == args || p[-1] == ' ') && p[key_len] == '=') {
+      return p + key_len + 1;
+    }
+  }
+  return nullptr;
+}
+
+static bool GetInt(const char* args, const char* key, long* value) {
+  const char* p = FindArg(args, key);
+  if (p == nullptr) {
+    return false;
+  }
+  char* end;
+  *value = strtol(p, &end, 0);
+  return end != p;
+}
+
+// Copies the value of key=, which may have spaces, up to the next key.
+static bool GetComm(const char* args, const char* key, const char* next_key, char* comm) {
+  const char* p = FindArg(args, key);
+  if (p == nullptr) {
+    return false;
+  }
+  const char* end = FindArg(p, next_key);
+  if (end == nullptr) {
+    return false;
+  }
+  end -= strlen(next_key) + 2;
+  CopyComm(comm, p, end > p ? end - p : 0);
+  return true;
+}
+
+static ThreadState StateFromLetter(char c) {
+  switch (c) {
+    case 'R':
+      return THREAD_RUNNABLE;
+    case 'D':
+      return THREAD_BLOCKED;
+    case 'x':
+    case 'X':
+    case 'Z':
+      return THREAD_DEAD;
+    default:
+      // S, and the stopped, parked and idle states, which are sleeps too.
+      return THREAD_SLEEPING;
+  }
+}
+
+static bool ParseSchedSwitch(const char* args, TraceEvent* event) {
+  long prev_pid, next_pid;
+  const char* state = FindArg(args, "prev_state");
+  if (!GetComm(args, "prev_comm", "prev_pid", event->prev_comm) ||
+      !GetComm(args, "next_comm", "next_pid", event->next_comm) ||
+      !GetInt(args, "prev_pid", &prev_pid) || !GetInt(args, "next_pid", &next_pid) ||
+      state == nullptr) {
+    return false;
+  }
+  event->type = EVENT_SCHED_SWITCH;
+  event->prev_pid = prev_pid;
+  event->next_pid = next_pid;
+  event->prev_state = StateFromLetter(*state);
+  return true;
+}
+
+static bool ParseSchedWakeup(const char* args, TraceEvent* event) {
+  long pid;
+  if (!GetComm(args, "comm", "pid", event->target_comm) || !GetInt(args, "pid", &pid)) {
+    return false;
+  }
+  event->type = EVENT_SCHED_WAKEUP;
+  event->target_pid = pid;
+  return true;
+}
+
+static bool ParseSchedBlockedReason(const char* args, TraceEvent* event) {
+  long pid, iowait;
+  const char* caller = FindArg(args, "caller");
+  if (!GetInt(args, "pid", &pid) || !GetInt(args, "iowait", &iowait) || caller == nullptr) {
+    return false;
+  }
+  event->type = EVENT_SCHED_BLOCKED_REASON;
+  event->target_pid = pid;
+  event->iowait = iowait;
+  size_t len = strcspn(caller, " \n");
+  if (len >= sizeof(event->caller)) {
+    len = sizeof(event->caller) - 1;
+  }
+  memcpy(event->caller, caller, len);
+  event->caller[len] = '\0';
+  return true;
+}
+
+static bool ParseBinderTransaction(const char* args, TraceEvent* event) {
+  long transaction, dest_proc, dest_thread, reply, flags;
+  if (!GetInt(args, "transaction", &transaction) || !GetInt(args, "dest_proc", &dest_proc) ||
+      !GetInt(args, "dest_thread", &dest_thread) || !GetInt(args, "reply", &reply) ||
+      !GetInt(args, "flags", &flags)) {
+    return false;
+  }
+  event->type = EVENT_BINDER_TRANSACTION;
+  event->transaction = transaction;
+  event->dest_proc = dest_proc;
+  event->dest_thread = dest_thread;
+  event->reply = reply;
+  event->flags = flags;
+  return true;
+}
+
+static bool ParseBinderTransactionReceived(const char* args, TraceEvent* event) {
+  long transaction;
+  if (!GetInt(args, "transaction", &transaction)) {
+    return false;
+  }
+  event->type = EVENT_BINDER_TRANSACTION_RECEIVED;
+  event->transaction = transaction;
+  return true;
+}
+
+// "<major>,<minor> <rwbs> ... (<cmd>) <sector> + <nr_sector> ..."
+static bool ParseBlockRq(const char* args, EventType type, TraceEvent* event) {
+  unsigned long long sector;
+  if (sscanf(args, "%u,%u", &event->dev_major, &event->dev_minor) != 2) {
+    return false;
+  }
+  const char* p = strstr(args, ") ");
+  if (p == nullptr || sscanf(p + 2, "%llu + %u", &sector, &event->nr_sector) != 2) {
+    return false;
+  }
+  event->type = type;
+  event->sector = sector;
+  return true;
+}
+
+static bool ParseCpuFrequency(const char* args, TraceEvent* event) {
+  long state, cpu_id;
+  if (!GetInt(args, "state", &state) || !GetInt(args, "cpu_id", &cpu_id)) {
+    return false;
+  }
+  event->type = EVENT_CPU_FREQUENCY;
+  event->freq = state;
+  event->freq_cpu = cpu_id;
+  return true;
+}
+
+// "<comm>-<pid> [(<tgid>)] [<cpu>] [<flags>] <seconds>: <event>: <args>"
+// The comm may have spaces and dashes, so the line is split at the cpu.
+bool TextTraceReader::ParseLine(char* line, TraceEvent* event) {
+  char* cpu = strchr(line, '[');
+  while (cpu != nullptr && !(isdigit(cpu[1]) && strchr(cpu, ']') != nullptr)) {
+    cpu = strchr(cpu + 1, '[');
+  }
+  if (cpu == nullptr || cpu == line) {
+    return false;
+  }
+
+  char* task_end = cpu;
+  while (task_end > line && task_end[-1] == ' ') {
+    task_end--;
+  }
+  event->tgid = -1;
+  if (task_end > line && task_end[-1] == ')') {
+    char* open = task_end - 1;
+    while (open > line && *open != '(') {
+      open--;
+    }
+    if (*open != '(') {
+      return false;
+    }
+    char* tgid = open + 1;
+    while (*tgid == ' ') {
+      tgid++;
+    }
+    if (isdigit(*tgid)) {
+      event->tgid = atoi(tgid);
+    }
+    task_end = open;
+    while (task_end > line && task_end[-1] == ' ') {
+      task_end--;
+    }
+  }
+  char* dash = task_end;
+  while (dash > line && *dash != '-') {
+    dash--;
+  }
+  if (*dash != '-' || !isdigit(dash[1])) {
+    return false;
+  }
+  char* comm = line;
+  while (*comm == ' ') {
+    comm++;
+  }
+  event->pid = atoi(dash + 1);
+  CopyComm(event->comm, comm, dash > comm ? dash - comm : 0);
+
+  char* p;
+  event->cpu = strtol(cpu + 1, &p, 10);
+  if (*p != ']') {
+    return false;
+  }
+  p++;
+
+  // The flags column is optional.
+  while (*p == ' ') {
+    p++;
+  }
+  char* token_end = strchr(p, ' ');
+  if (token_end == nullptr) {
+    return false;
+  }
+  if (token_end[-1] != ':') {
+    p = token_end;
+    while (*p == ' ') {
+      p++;
+    }
+  }
+  char* frac;
+  uint64_t seconds = strtoull(p, &frac, 10);
+  if (*frac != '.') {
+    return false;
+  }
+  uint64_t ns = 0;
+  int digits = 0;
+  for (p = frac + 1; isdigit(*p); p++) {
+    if (digits++ < 9) {
+      ns = ns * 10 + (*p - '0');
+    }
+  }
+  for (; digits < 9; digits++) {
+    ns *= 10;
+  }
+  if (p[0] != ':' || p[1] != ' ') {
+    return false;
+  }
+  event->time_ns = seconds * 1000000000ULL + ns;
+
+  char* name = p + 2;
+  char* args = strchr(name, ':');
+  if (args == nullptr || args[1] != ' ') {
+    return false;
+  }
+  *args = '\0';
+  args += 2;
+
+  if (!strcmp(name, "sched_switch")) {
+    return ParseSchedSwitch(args, event);
+  }
+  if (!strcmp(name, "sched_waking") || !strcmp(name, "sched_wakeup") ||
+      !strcmp(name, "sched_wakeup_new")) {
+    return ParseSchedWakeup(args, event);
+  }
+  if (!strcmp(name, "sched_blocked_reason")) {
+    return ParseSchedBlockedReason(args, event);
+  }
+  if (!strcmp(name, "binder_transaction")) {
+    return ParseBinderTransaction(args, event);
+  }
+  if (!strcmp(name, "binder_transaction_received")) {
+    return ParseBinderTransactionReceived(args, event);
+  }
+  if (!strcmp(name, "block_rq_issue")) {
+    return ParseBlockRq(args, EVENT_BLOCK_RQ_ISSUE, event);
+  }
+  if (!strcmp(name, "block_rq_complete")) {
+    return ParseBlockRq(args, EVENT_BLOCK_RQ_COMPLETE, event);
+  }
+  if (!strcmp(name, "cpu_frequency")) {
+    return ParseCpuFrequency(args, event);
+  }
+  return false;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYSTRACE_ANALYSIS_TEXT_TRACE_READER_H
+#define _SYSTRACE_ANALYSIS_TEXT_TRACE_READER_H
+
+#include <stdio.h>
+
+#include "TraceEvent.h"
+
+// Reads the text output of ftrace, as in /sys/kernel/debug/tracing/trace,
+// atrace or the trace data of a systrace html file, one line at a time.
+// Lines that are not events the analyzer uses are skipped, so the html
+// around the trace data does not need to be removed.
+class TextTraceReader : public TraceReader {
+ public:
+  explicit TextTraceReader(FILE* fp) : fp_(fp) {}
+  ~TextTraceReader() override;
+
+  bool Next(TraceEvent* event) override;
+
+ private:
+  static bool ParseLine(char* line, TraceEvent* event);
+
+  FILE* fp_;
+  char* line_ = nullptr;
+  size_t line_size_ = 0;
+};
+
+#endif // _SYSTRACE_ANALYSIS_TEXT_TRACE_READER_H
@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "TraceAnalyzer.h"
+
+// TF_ONE_WAY in the flags of a transaction.
+static constexpr uint32_t BINDER_ONE_WAY = 0x1;
+// Transactions a thread waits for at once before the oldest replies are
+// considered lost, and requests in flight before the pending ones are.
+static constexpr size_t MAX_OUTGOING = 16;
+static constexpr size_t MAX_BLOCK_IN_FLIGHT = 4096;
+static constexpr int MINOR_BITS = 20;
+
+static double Ms(uint64_t ns) {
+  return ns / 1000000.0;
+}
+
+TraceAnalyzer::Thread& TraceAnalyzer::GetThread(pid_t tid) {
+  Thread& thread = threads_[tid];
+  thread.tid = tid;
+  return thread;
+}
+
+void TraceAnalyzer::AddBlockedReason(Thread& thread, const std::string& caller, bool iowait,
+                                     uint64_t ns) {
+  blocked_reasons_[caller].Add(ns);
+  if (iowait) {
+    thread.iowait_ns += ns;
+  }
+}
+
+void TraceAnalyzer::Account(Thread& thread, uint64_t time_ns) {
+  if (thread.since_ns == 0 || time_ns < thread.since_ns) {
+    return;
+  }
+  uint64_t ns = time_ns - thread.since_ns;
+  switch (thread.state) {
+    case THREAD_RUNNING:
+      thread.running_ns += ns;
+      break;
+    case THREAD_RUNNABLE:
+      thread.runnable.Add(ns);
+      break;
+    case THREAD_SLEEPING:
+      thread.sleeping_ns += ns;
+      break;
+    case THREAD_BLOCKED:
+      thread.blocked_ns += ns;
+      // The blocked reason comes with the wakeup, before or after it.
+      if (!thread.blocked_caller.empty()) {
+        AddBlockedReason(thread, thread.blocked_caller, thread.blocked_iowait, ns);
+        thread.blocked_caller.clear();
+      } else {
+        thread.last_blocked_ns = ns;
+        thread.blocked_pending = true;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void TraceAnalyzer::SetState(Thread& thread, ThreadState state, uint64_t time_ns) {
+  Account(thread, time_ns);
+  thread.state = state;
+  thread.since_ns = time_ns;
+}
+
+pid_t TraceAnalyzer::ProcessOf(const Thread& thread) const {
+  return thread.tgid != -1 ? thread.tgid : thread.tid;
+}
+
+std::string TraceAnalyzer::NameOf(pid_t pid) const {
+  auto it = threads_.find(pid);
+  if (it == threads_.end() || it->second.comm[0] == '\0') {
+    return "<" + std::to_string(pid) + ">";
+  }
+  return std::string(it->second.comm) + " (" + std::to_string(pid) + ")";
+}
+
+void TraceAnalyzer::AddEvent(const TraceEvent& event) {
+  if (events_++ == 0) {
+    first_ns_ = event.time_ns;
+  }
+  last_ns_ = std::max(last_ns_, event.time_ns);
+
+  // Swapper is not a thread to analyze.
+  if (event.pid != 0) {
+    Thread& thread = GetThread(event.pid);
+    if (event.tgid != -1) {
+      thread.tgid = event.tgid;
+    }
+    if (event.comm[0] != '\0') {
+      memcpy(thread.comm, event.comm, sizeof(thread.comm));
+    }
+  }
+
+  switch (event.type) {
+    case EVENT_SCHED_SWITCH:
+      OnSchedSwitch(event);
+      break;
+    case EVENT_SCHED_WAKEUP:
+      OnSchedWakeup(event);
+      break;
+    case EVENT_SCHED_BLOCKED_REASON:
+      OnSchedBlockedReason(event);
+      break;
+    case EVENT_BINDER_TRANSACTION:
+      OnBinderTransaction(event);
+      break;
+    case EVENT_BINDER_TRANSACTION_RECEIVED:
+      binder_received_++;
+      break;
+    case EVENT_BLOCK_RQ_ISSUE:
+      OnBlockRqIssue(event);
+      break;
+    case EVENT_BLOCK_RQ_COMPLETE:
+      OnBlockRqComplete(event);
+      break;
+    case EVENT_CPU_FREQUENCY:
+      OnCpuFrequency(event);
+      break;
+  }
+}
+
+void TraceAnalyzer::OnSchedSwitch(const TraceEvent& event) {
+  if (event.cpu < 0) {
+    return;
+  }
+  if (static_cast<size_t>(event.cpu) >= cpu_switch_ns_.size()) {
+    cpu_switch_ns_.resize(event.cpu + 1);
+  }
+  uint64_t& switch_ns = cpu_switch_ns_[event.cpu];
+
+  if (event.prev_pid != 0) {
+    Thread& prev = GetThread(event.prev_pid);
+    memcpy(prev.comm, event.prev_comm, sizeof(prev.comm));
+    // The first switch out of a thread tells it was running since the
+    // previous switch of the cpu.
+    if (prev.state != THREAD_RUNNING && switch_ns != 0) {
+      prev.state = THREAD_RUNNING;
+      prev.since_ns = switch_ns;
+    }
+    SetState(prev, event.prev_state, event.time_ns);
+  }
+  if (event.next_pid != 0) {
+    Thread& next = GetThread(event.next_pid);
+    memcpy(next.comm, event.next_comm, sizeof(next.comm));
+    SetState(next, THREAD_RUNNING, event.time_ns);
+  }
+  switch_ns = event.time_ns;
+}
+
+void TraceAnalyzer::OnSchedWakeup(const TraceEvent& event) {
+  if (event.target_pid == 0) {
+    return;
+  }
+  Thread& thread = GetThread(event.target_pid);
+  memcpy(thread.comm, event.target_comm, sizeof(thread.comm));
+  // sched_waking and sched_wakeup both come for the same wakeup.
+  if (thread.state != THREAD_RUNNING && thread.state != THREAD_RUNNABLE) {
+    SetState(thread, THREAD_RUNNABLE, event.time_ns);
+  }
+}
+
+void TraceAnalyzer::OnSchedBlockedReason(const TraceEvent& event) {
+  Thread& thread = GetThread(event.target_pid);
+  if (thread.blocked_pending) {
+    AddBlockedReason(thread, event.caller, event.iowait, thread.last_blocked_ns);
+    thread.blocked_pending = false;
+  } else if (thread.state == THREAD_BLOCKED) {
+    thread.blocked_caller = event.caller;
+    thread.blocked_iowait = event.iowait;
+  }
+}
+
+void TraceAnalyzer::OnBinderTransaction(const TraceEvent& event) {
+  Thread& sender = GetThread(event.pid);
+  if (!event.reply) {
+    if (event.flags & BINDER_ONE_WAY) {
+      binder_async_[std::make_pair(ProcessOf(sender), event.dest_proc)]++;
+      return;
+    }
+    if (sender.outgoing.size() == MAX_OUTGOING) {
+      sender.outgoing.erase(sender.outgoing.begin());
+      binder_lost_replies_++;
+    }
+    sender.outgoing.emplace_back(event.time_ns, event.dest_proc);
+    return;
+  }
+
+  // The reply goes to the thread waiting for it.
+  auto it = threads_.find(event.dest_thread);
+  if (it == threads_.end() || it->second.outgoing.empty()) {
+    return;
+  }
+  Thread& client = it->second;
+  auto call = client.outgoing.back();
+  client.outgoing.pop_back();
+  binder_calls_[std::make_pair(ProcessOf(client), call.second)].Add(event.time_ns - call.first);
+}
+
+void TraceAnalyzer::OnBlockRqIssue(const TraceEvent& event) {
+  if (block_in_flight_.size() == MAX_BLOCK_IN_FLIGHT) {
+    block_lost_ += block_in_flight_.size();
+    block_in_flight_.clear();
+  }
+  uint32_t dev = event.dev_major << MINOR_BITS | event.dev_minor;
+  BlockRequest& request = block_in_flight_[std::make_pair(dev, event.sector)];
+  request.issue_ns = event.time_ns;
+  request.nr_sector = event.nr_sector;
+}
+
+void TraceAnalyzer::OnBlockRqComplete(const TraceEvent& event) {
+  uint32_t dev = event.dev_major << MINOR_BITS | event.dev_minor;
+  auto it = block_in_flight_.find(std::make_pair(dev, event.sector));
+  if (it == block_in_flight_.end()) {
+    return;
+  }
+  BlockDevice& device = block_devices_[dev];
+  device.latency.Add(event.time_ns - it->second.issue_ns);
+  device.sectors += it->second.nr_sector;
+  block_in_flight_.erase(it);
+}
+
+void TraceAnalyzer::OnCpuFrequency(const TraceEvent& event) {
+  if (event.freq_cpu < 0) {
+    return;
+  }
+  size_t cpu = event.freq_cpu;
+  if (cpu >= cpu_freq_.size()) {
+    cpu_freq_.resize(cpu + 1);
+    cpu_freq_ns_.resize(cpu + 1);
+  }
+  auto& current = cpu_freq_[cpu];
+  if (current.second != 0) {
+    cpu_freq_ns_[cpu][current.first] += event.time_ns - current.second;
+  }
+  current.first = event.freq;
+  current.second = event.time_ns;
+}
+
+void TraceAnalyzer::Finish() {
+  for (auto& it : threads_) {
+    Account(it.second, last_ns_);
+    it.second.since_ns = last_ns_;
+  }
+  for (size_t cpu = 0; cpu < cpu_freq_.size(); cpu++) {
+    auto& current = cpu_freq_[cpu];
+    if (current.second != 0) {
+      cpu_freq_ns_[cpu][current.first] += last_ns_ - current.second;
+      current.second = last_ns_;
+    }
+  }
+}
+
+template <typename T, typename Compare>
+static std::vector<T> Top(std::vector<T> items, size_t limit, Compare compare) {
+  std::sort(items.begin(), items.end(), compare);
+  if (limit && items.size() > limit) {
+    items.resize(limit);
+  }
+  return items;
+}
+
+void TraceAnalyzer::Print(FILE* fp, size_t limit) const {
+  fprintf(fp, "%" PRIu64 " events over %.3f s\n", events_, Ms(last_ns_ - first_ns_) / 1000);
+
+  std::vector<const Thread*> threads;
+  std::map<pid_t, Process> processes;
+  for (const auto& it : threads_) {
+    const Thread& thread = it.second;
+    threads.push_back(&thread);
+    if (thread.tgid != -1) {
+      Process& process = processes[thread.tgid];
+      process.tgid = thread.tgid;
+      process.running_ns += thread.running_ns;
+      process.runnable_ns += thread.runnable.total_ns;
+      process.blocked_ns += thread.blocked_ns;
+      process.threads++;
+    }
+  }
+
+  fprintf(fp, "\nThreads by cpu time (ms):\n");
+  fprintf(fp, "%7s %7s %-16s %10s %10s %7s %9s %10s %10s %9s\n", "tid", "tgid", "comm",
+          "running", "runnable", "waits", "max wait", "sleeping", "blocked", "iowait");
+  for (const Thread* t : Top(threads, limit, [](const Thread* a, const Thread* b) {
+         return a->running_ns > b->running_ns;
+       })) {
+    fprintf(fp, "%7d %7d %-16s %10.3f %10.3f %7" PRIu64 " %9.3f %10.3f %10.3f %9.3f\n", t->tid,
+            t->tgid, t->comm, Ms(t->running_ns), Ms(t->runnable.total_ns), t->runnable.count,
+            Ms(t->runnable.max_ns), Ms(t->sleeping_ns), Ms(t->blocked_ns), Ms(t->iowait_ns));
+  }
+
+  if (!processes.empty()) {
+    std::vector<Process> list;
+    for (const auto& it : processes) {
+      list.push_back(it.second);
+    }
+    fprintf(fp, "\nProcesses by cpu time (ms):\n");
+    fprintf(fp, "%-32s %7s %10s %10s %10s\n", "process", "threads", "running", "runnable",
+            "blocked");
+    for (const Process& p : Top(list, limit, [](const Process& a, const Process& b) {
+           return a.running_ns > b.running_ns;
+         })) {
+      fprintf(fp, "%-32s %7" PRIu64 " %10.3f %10.3f %10.3f\n", NameOf(p.tgid).c_str(),
+              p.threads, Ms(p.running_ns), Ms(p.runnable_ns), Ms(p.blocked_ns));
+    }
+  }
+
+  if (!blocked_reasons_.empty()) {
+    std::vector<std::pair<std::string, DurationStats>> reasons(blocked_reasons_.begin(),
+                                                               blocked_reasons_.end());
+    fprintf(fp, "\nUninterruptible sleep by caller (ms):\n");
+    fprintf(fp, "%7s %10s %9s  %s\n", "count", "total", "max", "caller");
+    for (const auto& r : Top(reasons, limit, [](const std::pair<std::string, DurationStats>& a,
+                                                const std::pair<std::string, DurationStats>& b) {
+           return a.second.total_ns > b.second.total_ns;
+         })) {
+      fprintf(fp, "%7" PRIu64 " %10.3f %9.3f  %s\n", r.second.count, Ms(r.second.total_ns),
+              Ms(r.second.max_ns), r.first.c_str());
+    }
+  }
+
+  if (!binder_calls_.empty() || !binder_async_.empty()) {
+    std::vector<std::pair<std::pair<pid_t, pid_t>, DurationStats>> calls(binder_calls_.begin(),
+                                                                         binder_calls_.end());
+    fprintf(fp, "\nBinder transactions, request to reply (ms):\n");
+    fprintf(fp, "%-32s %-32s %7s %10s %9s %7s\n", "client", "server", "count", "total", "max",
+            "async");
+    for (const auto& c : Top(calls, limit,
+                             [](const std::pair<std::pair<pid_t, pid_t>, DurationStats>& a,
+                                const std::pair<std::pair<pid_t, pid_t>, DurationStats>& b) {
+                               return a.second.total_ns > b.second.total_ns;
+                             })) {
+      auto async = binder_async_.find(c.first);
+      fprintf(fp, "%-32s %-32s %7" PRIu64 " %10.3f %9.3f %7" PRIu64 "\n",
+              NameOf(c.first.first).c_str(), NameOf(c.first.second).c_str(), c.second.count,
+              Ms(c.second.total_ns), Ms(c.second.max_ns),
+              async != binder_async_.end() ? async->second : 0);
+    }
+    for (const auto& a : binder_async_) {
+      if (binder_calls_.find(a.first) == binder_calls_.end()) {
+        fprintf(fp, "%-32s %-32s %7d %10s %9s %7" PRIu64 "\n", NameOf(a.first.first).c_str(),
+                NameOf(a.first.second).c_str(), 0, "-", "-", a.second);
+      }
+    }
+    fprintf(fp, "%" PRIu64 " transactions received, %" PRIu64 " replies lost\n",
+            binder_received_, binder_lost_replies_);
+  }
+
+  if (!block_devices_.empty()) {
+    fprintf(fp, "\nBlock requests, issue to completion (ms):\n");
+    fprintf(fp, "%-9s %7s %10s %9s %9s %10s\n", "device", "count", "total", "average", "max",
+            "KiB");
+    for (const auto& it : block_devices_) {
+      const DurationStats& latency = it.second.latency;
+      char dev[16];
+      snprintf(dev, sizeof(dev), "%u,%u", it.first >> MINOR_BITS,
+               it.first & ((1U << MINOR_BITS) - 1));
+      fprintf(fp, "%-9s %7" PRIu64 " %10.3f %9.3f %9.3f %10" PRIu64 "\n", dev, latency.count,
+              Ms(latency.total_ns), Ms(latency.total_ns / latency.count), Ms(latency.max_ns),
+              it.second.sectors / 2);
+    }
+    if (block_lost_) {
+      fprintf(fp, "%" PRIu64 " requests without completion\n", block_lost_);
+    }
+  }
+
+  for (size_t cpu = 0; cpu < cpu_freq_ns_.size(); cpu++) {
+    if (cpu_freq_ns_[cpu].empty()) {
+      continue;
+    }
+    uint64_t total = 0;
+    for (const auto& it : cpu_freq_ns_[cpu]) {
+      total += it.second;
+    }
+    fprintf(fp, "\nCPU %zu frequency residency:\n", cpu);
+    for (const auto& it : cpu_freq_ns_[cpu]) {
+      fprintf(fp, "%10u kHz %6.2f%% (%.3f ms)\n", it.first,
+              total ? it.second * 100.0 / total : 0, Ms(it.second));
+    }
+  }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYSTRACE_ANALYSIS_TRACE_ANALYZER_H
+#define _SYSTRACE_ANALYSIS_TRACE_ANALYZER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "TraceEvent.h"
+
+// Durations of something that happens many times.
+struct DurationStats {
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+
+  void Add(uint64_t ns) {
+    count++;
+    total_ns += ns;
+    if (ns > max_ns) {
+      max_ns = ns;
+    }
+  }
+};
+
+// Summarizes a trace in one pass over its events. The state kept grows
+// with the number of threads, blocking callers, devices and cpus of the
+// trace, not with its length: transactions and requests still in flight
+// are bounded and dropped when their end is lost.
+class TraceAnalyzer {
+ public:
+  void AddEvent(const TraceEvent& event);
+  // Accounts the time of the threads up to the last event.
+  void Finish();
+  // Prints the threads and processes with the most cpu time, up to limit
+  // of each, and the other summaries.
+  void Print(FILE* fp, size_t limit) const;
+
+ private:
+  struct Thread {
+    pid_t tid = 0;
+    pid_t tgid = -1;
+    char comm[COMM_LEN] = "";
+    ThreadState state = THREAD_UNKNOWN;
+    uint64_t since_ns = 0;
+
+    uint64_t running_ns = 0;
+    uint64_t sleeping_ns = 0;
+    uint64_t blocked_ns = 0;
+    uint64_t iowait_ns = 0;
+    // From a wakeup or a preemption to running again.
+    DurationStats runnable;
+
+    // The last uninterruptible sleep, until its blocked reason comes.
+    std::string blocked_caller;
+    bool blocked_iowait = false;
+    uint64_t last_blocked_ns = 0;
+    bool blocked_pending = false;
+
+    // The start of the synchronous transactions waiting for their reply,
+    // nested when a server calls another one.
+    std::vector<std::pair<uint64_t, pid_t>> outgoing;
+  };
+
+  struct Process {
+    pid_t tgid;
+    uint64_t running_ns = 0;
+    uint64_t runnable_ns = 0;
+    uint64_t blocked_ns = 0;
+    uint64_t threads = 0;
+  };
+
+  struct BlockRequest {
+    uint64_t issue_ns;
+    uint32_t nr_sector;
+  };
+
+  struct BlockDevice {
+    DurationStats latency;
+    uint64_t sectors = 0;
+  };
+
+  Thread& GetThread(pid_t tid);
+  void Account(Thread& thread, uint64_t time_ns);
+  void SetState(Thread& thread, ThreadState state, uint64_t time_ns);
+  void AddBlockedReason(Thread& thread, const std::string& caller, bool iowait, uint64_t ns);
+  // The process of a thread, or the thread if the trace does not have it.
+  pid_t ProcessOf(const Thread& thread) const;
+  std::string NameOf(pid_t pid) const;
+
+  void OnSchedSwitch(const TraceEvent& event);
+  void OnSchedWakeup(const TraceEvent& event);
+  void OnSchedBlockedReason(const TraceEvent& event);
+  void OnBinderTransaction(const TraceEvent& event);
+  void OnBlockRqIssue(const TraceEvent& event);
+  void OnBlockRqComplete(const TraceEvent& event);
+  void OnCpuFrequency(const TraceEvent& event);
+
+  uint64_t first_ns_ = 0;
+  uint64_t last_ns_ = 0;
+  uint64_t events_ = 0;
+
+  std::unordered_map<pid_t, Thread> threads_;
+  // The last switch of each cpu, when its current thread started running.
+  std::vector<uint64_t> cpu_switch_ns_;
+
+  std::map<std::string, DurationStats> blocked_reasons_;
+
+  // Synchronous transactions by client and server process.
+  std::map<std::pair<pid_t, pid_t>, DurationStats> binder_calls_;
+  std::map<std::pair<pid_t, pid_t>, uint64_t> binder_async_;
+  uint64_t binder_received_ = 0;
+  uint64_t binder_lost_replies_ = 0;
+
+  // Requests by device and sector.
+  std::map<std::pair<uint32_t, uint64_t>, BlockRequest> block_in_flight_;
+  std::map<uint32_t, BlockDevice> block_devices_;
+  uint64_t block_lost_ = 0;
+
+  // Time at each frequency, by cpu, and the current one.
+  std::vector<std::map<uint32_t, uint64_t>> cpu_freq_ns_;
+  std::vector<std::pair<uint32_t, uint64_t>> cpu_freq_;
+};
+
+#endif // _SYSTRACE_ANALYSIS_TRACE_ANALYZER_H
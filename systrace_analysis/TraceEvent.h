@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYSTRACE_ANALYSIS_TRACE_EVENT_H
+#define _SYSTRACE_ANALYSIS_TRACE_EVENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// The kernel's TASK_COMM_LEN.
+static constexpr size_t COMM_LEN = 16;
+
+enum ThreadState : uint8_t {
+  THREAD_UNKNOWN,
+  THREAD_RUNNING,
+  THREAD_RUNNABLE,
+  THREAD_SLEEPING,
+  THREAD_BLOCKED,
+  THREAD_DEAD,
+};
+
+enum EventType : uint8_t {
+  EVENT_SCHED_SWITCH,
+  // sched_waking, sched_wakeup and sched_wakeup_new.
+  EVENT_SCHED_WAKEUP,
+  EVENT_SCHED_BLOCKED_REASON,
+  EVENT_BINDER_TRANSACTION,
+  EVENT_BINDER_TRANSACTION_RECEIVED,
+  EVENT_BLOCK_RQ_ISSUE,
+  EVENT_BLOCK_RQ_COMPLETE,
+  EVENT_CPU_FREQUENCY,
+};
+
+// The fields of the events the analyzer uses, whether they come from the
+// text or the binary format. Only the fields of the type are set.
+struct TraceEvent {
+  EventType type;
+  uint64_t time_ns;
+  int cpu;
+  // The thread that emitted the event, and its thread group if the trace
+  // has it or -1.
+  pid_t pid;
+  pid_t tgid;
+  char comm[COMM_LEN];
+
+  // sched_switch
+  pid_t prev_pid;
+  ThreadState prev_state;
+  char prev_comm[COMM_LEN];
+  pid_t next_pid;
+  char next_comm[COMM_LEN];
+
+  // sched_wakeup and sched_blocked_reason
+  pid_t target_pid;
+  char target_comm[COMM_LEN];
+  bool iowait;
+  char caller[64];
+
+  // binder_transaction and binder_transaction_received
+  uint32_t transaction;
+  pid_t dest_proc;
+  pid_t dest_thread;
+  bool reply;
+  uint32_t flags;
+
+  // block_rq_issue and block_rq_complete
+  uint32_t dev_major;
+  uint32_t dev_minor;
+  uint64_t sector;
+  uint32_t nr_sector;
+
+  // cpu_frequency
+  uint32_t freq;
+  int freq_cpu;
+};
+
+// A source of events in time order.
+class TraceReader {
+ public:
+  virtual ~TraceReader() {}
+
+  // Returns false at the end of the trace.
+  virtual bool Next(TraceEvent* event) = 0;
+};
+
+#endif // _SYSTRACE_ANALYSIS_TRACE_EVENT_H
@@ -22,7 +22,9 @@ import sys
 
 def main():
     # Create argument parser
-    parser = argparse.ArgumentParser()
+    parser = argparse.ArgumentParser(
+        epilog='For traces too large to import, such as ANRdaemon dumps or long captures, '
+               'trace_analyzer summarizes scheduling, binder and block activity in one pass.')
     parser.add_argument('systrace_file', metavar='SYSTRACE_FILE', help='systrace file to analyze')
     parser.add_argument('-e', metavar='EVENT_LOG', help='android event log file')
     args = parser.parse_args()
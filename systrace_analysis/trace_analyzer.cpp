@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <memory>
+
+#include "RawTraceReader.h"
+#include "TextTraceReader.h"
+#include "TraceAnalyzer.h"
+
+static void usage(const char* cmd) {
+  fprintf(stderr,
+          "Usage: %s [-n LIMIT] TRACE\n"
+          "Summarizes the scheduling, binder and block activity of a trace in one pass.\n"
+          "TRACE is the text output of ftrace or atrace, a systrace html file, - for\n"
+          "stdin, or the directory of an ANRdaemon -r dump.\n"
+          "  -n LIMIT  rows of each summary (default 20, 0 for all)\n",
+          cmd);
+}
+
+int main(int argc, char** argv) {
+  size_t limit = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "hn:")) != -1) {
+    switch (opt) {
+      case 'n':
+        limit = strtoul(optarg, nullptr, 10);
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char* path = argv[optind];
+
+  std::unique_ptr<TraceReader> reader;
+  FILE* fp = nullptr;
+  struct stat st;
+  if (strcmp(path, "-") && stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    std::unique_ptr<RawTraceReader> raw(new RawTraceReader);
+    if (!raw->Open(path)) {
+      err(1, "%s is not a trace dump", path);
+    }
+    reader = std::move(raw);
+  } else {
+    fp = strcmp(path, "-") ? fopen(path, "re") : stdin;
+    if (fp == nullptr) {
+      err(1, "Unable to open %s", path);
+    }
+    reader.reset(new TextTraceReader(fp));
+  }
+
+  TraceAnalyzer analyzer;
+  TraceEvent event;
+  while (reader->Next(&event)) {
+    analyzer.AddEvent(event);
+  }
+  analyzer.Finish();
+  analyzer.Print(stdout, limit);
+
+  if (fp != nullptr && fp != stdin) {
+    fclose(fp);
+  }
+  return 0;
+}
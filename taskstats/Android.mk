@@ -6,6 +6,9 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
 	taskstats.c
 
+LOCAL_STATIC_LIBRARIES := \
+	libtaskstats
+
 LOCAL_SHARED_LIBRARIES := \
 	libnl
 
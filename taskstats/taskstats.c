@@ -16,25 +16,25 @@
 
 /*
  * Linux task stats reporting tool. Queries and prints out the kernel's
- * taskstats structure for a given process or thread group id. See
+ * taskstats structure for given process or thread group ids, or for every
+ * task as it exits. See
  * https://www.kernel.org/doc/Documentation/accounting/ for more information
  * about the reported fields.
  */
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
-#include <netlink/attr.h>
-#include <netlink/genl/genl.h>
-#include <netlink/genl/ctrl.h>
-#include <netlink/handlers.h>
-#include <netlink/msg.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/cdefs.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <linux/taskstats.h>
+#include <taskstats/taskstats.h>
 
 struct TaskStatistics {
     int pid;
@@ -42,79 +42,6 @@ struct TaskStatistics {
     struct taskstats stats;
 };
 
-int print_receive_error(struct sockaddr_nl* address __unused,
-                        struct nlmsgerr* error, void* arg __unused) {
-    fprintf(stderr, "Netlink receive error: %s\n", strerror(-error->error));
-    return NL_STOP;
-}
-
-void parse_aggregate_task_stats(struct nlattr* attr, int attr_size,
-                                struct TaskStatistics* stats) {
-    nla_for_each_attr(attr, attr, attr_size, attr_size) {
-        switch (attr->nla_type) {
-            case TASKSTATS_TYPE_PID:
-                stats->pid = nla_get_u32(attr);
-                break;
-            case TASKSTATS_TYPE_TGID:
-                stats->tgid = nla_get_u32(attr);
-                break;
-            case TASKSTATS_TYPE_STATS:
-                nla_memcpy(&stats->stats, attr, sizeof(stats->stats));
-                break;
-            default:
-                break;
-        }
-    }
-}
-
-int parse_task_stats(struct nl_msg* msg, void* arg) {
-    struct TaskStatistics* stats = (struct TaskStatistics*)arg;
-    struct genlmsghdr* gnlh = (struct genlmsghdr*)nlmsg_data(nlmsg_hdr(msg));
-    struct nlattr* attr = genlmsg_attrdata(gnlh, 0);
-    int remaining = genlmsg_attrlen(gnlh, 0);
-
-    nla_for_each_attr(attr, attr, remaining, remaining) {
-        switch (attr->nla_type) {
-            case TASKSTATS_TYPE_AGGR_PID:
-            case TASKSTATS_TYPE_AGGR_TGID:
-                parse_aggregate_task_stats(nla_data(attr), nla_len(attr),
-                                           stats);
-                break;
-            default:
-                break;
-        }
-    }
-    return NL_STOP;
-}
-
-int query_task_stats(struct nl_sock* netlink_socket, int family_id,
-                     int command_type, int parameter,
-                     struct TaskStatistics* stats) {
-    memset(stats, 0, sizeof(*stats));
-
-    struct nl_msg* message = nlmsg_alloc();
-    genlmsg_put(message, NL_AUTO_PID, NL_AUTO_SEQ, family_id, 0, 0,
-		TASKSTATS_CMD_GET, TASKSTATS_VERSION);
-    nla_put_u32(message, command_type, parameter);
-
-    int result = nl_send_auto_complete(netlink_socket, message);
-    nlmsg_free(message);
-    if (result < 0) {
-        return result;
-    }
-
-    struct nl_cb* callbacks = nl_cb_get(nl_cb_alloc(NL_CB_CUSTOM));
-    nl_cb_set(callbacks, NL_CB_VALID, NL_CB_CUSTOM, &parse_task_stats, stats);
-    nl_cb_err(callbacks, NL_CB_CUSTOM, &print_receive_error, &family_id);
-
-    result = nl_recvmsgs(netlink_socket, callbacks);
-    nl_cb_put(callbacks);
-    if (result < 0) {
-        return result;
-    }
-    return stats->pid || stats->tgid;
-}
-
 double average_ms(unsigned long long total, unsigned long long count) {
     if (!count) {
         return 0;
@@ -236,6 +163,168 @@ void print_task_stats(const struct TaskStatistics* stats,
     printf("%-25s%llu\n", "Involuntary switches:", s->nivcsw);
 }
 
+void print_task_header(int human_readable) {
+    const char* unit = human_readable ? "(ms)" : "(ns)";
+    printf("%-5s %7s %-16s %5s %12s %12s %12s %12s %12s %12s %12s\n",
+           "", "PID", "Command", "Exit", "Elapsed(ms)", "CPU(ms)", "CPU dly", "IO dly",
+           "Swap dly", "Reclaim dly", "Read KB");
+    printf("%-5s %7s %-16s %5s %12s %12s %12s %12s %12s %12s %12s\n",
+           "", "", "", "", "", "", unit, unit, unit, unit, "");
+}
+
+/* Prints the stats of a task on one line, for many tasks at once. */
+void print_task_line(int type, pid_t pid, const struct taskstats* s,
+                     int human_readable) {
+    const double ns_per_unit = human_readable ? 1e6 : 1;
+    printf("%-5s %7d %-16.16s %5d %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f %12llu\n",
+           type == TASKSTATS_TYPE_TGID ? "TGID" : "PID",
+           pid,
+           s->ac_comm,
+           s->ac_exitcode,
+           s->ac_etime / 1e3,
+           (s->ac_utime + s->ac_stime) / 1e3,
+           s->cpu_delay_total / ns_per_unit,
+           s->blkio_delay_total / ns_per_unit,
+           s->swapin_delay_total / ns_per_unit,
+           s->freepages_delay_total / ns_per_unit,
+           s->read_bytes / 1024);
+}
+
+static void print_task_callback(int type, pid_t pid, const struct taskstats* stats,
+                                void* arg) {
+    print_task_line(type, pid, stats, *(int*)arg);
+}
+
+struct PidList {
+    pid_t* pids;
+    size_t count;
+    size_t capacity;
+};
+
+static int add_pid(struct PidList* list, pid_t pid) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        pid_t* pids = realloc(list->pids, capacity * sizeof(pid_t));
+        if (!pids) {
+            return ENOMEM;
+        }
+        list->pids = pids;
+        list->capacity = capacity;
+    }
+    list->pids[list->count++] = pid;
+    return 0;
+}
+
+/* Adds the numeric entries of the directory path, which are the processes in
+ * /proc and the threads in /proc/<pid>/task. */
+static int add_dir_pids(struct PidList* list, const char* path) {
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    int ret = 0;
+
+    if (!dir) {
+        /* The process may have exited since /proc was read */
+        return errno == ENOENT ? 0 : errno;
+    }
+    while (!ret && (entry = readdir(dir))) {
+        if (isdigit(entry->d_name[0])) {
+            ret = add_pid(list, atoi(entry->d_name));
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+/* Adds every process, or every thread of every process for threads. */
+static int add_all_pids(struct PidList* list, int threads) {
+    struct PidList processes = { 0 };
+    char path[64];
+    size_t i;
+    int ret;
+
+    if (!threads) {
+        return add_dir_pids(list, "/proc");
+    }
+    ret = add_dir_pids(&processes, "/proc");
+    for (i = 0; !ret && i < processes.count; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/task", processes.pids[i]);
+        ret = add_dir_pids(list, path);
+    }
+    free(processes.pids);
+    return ret;
+}
+
+/* Parses a comma separated list of ids, or "all". */
+static int parse_pids(struct PidList* list, const char* arg, int threads) {
+    char* copy;
+    char* token;
+    char* save;
+    int ret = 0;
+
+    if (!strcmp(arg, "all")) {
+        return add_all_pids(list, threads);
+    }
+    copy = strdup(arg);
+    if (!copy) {
+        return ENOMEM;
+    }
+    for (token = strtok_r(copy, ",", &save); !ret && token;
+         token = strtok_r(NULL, ",", &save)) {
+        int pid = atoi(token);
+        ret = pid > 0 ? add_pid(list, pid) : EINVAL;
+    }
+    free(copy);
+    return ret;
+}
+
+static volatile sig_atomic_t stop_listening;
+
+static void stop_handler(int sig __unused) {
+    stop_listening = 1;
+}
+
+/* Prints the stats of every task exiting on cpumask until interrupted, or
+ * for duration seconds if not zero. */
+static int listen_exits(ts_socket_t* sock, const char* cpumask, int duration,
+                        int human_readable) {
+    const struct timespec poll_interval = { 0, 100 * 1000 * 1000 };
+    struct timespec now, end;
+    size_t dropped = 0;
+    int ret;
+
+    ret = ts_register_exits(sock, cpumask);
+    if (ret) {
+        fprintf(stderr, "Failed to register for task exits: %s\n", strerror(ret));
+        return ret;
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += duration;
+
+    print_task_header(human_readable);
+    while (!stop_listening) {
+        ret = ts_read_exits(sock, print_task_callback, &human_readable, &dropped);
+        if (ret) {
+            fprintf(stderr, "Failed to read task exits: %s\n", strerror(ret));
+            return ret;
+        }
+        fflush(stdout);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (duration && (now.tv_sec > end.tv_sec ||
+                         (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec))) {
+            break;
+        }
+        nanosleep(&poll_interval, NULL);
+    }
+
+    if (dropped) {
+        fprintf(stderr, "%zu batches of exits were dropped\n", dropped);
+    }
+    return 0;
+}
+
 void print_usage() {
   printf("Linux task stats reporting tool\n"
          "\n"
@@ -246,23 +335,36 @@ void print_usage() {
          "  --pid PID     Print stats for the process id PID\n"
          "  --tgid TGID   Print stats for the thread group id TGID\n"
          "  --raw         Print raw numbers instead of human readable units\n"
+         "  --exits       Print stats for every task as it exits, until\n"
+         "                interrupted\n"
+         "  --cpumask MASK  With --exits, only follow the tasks exiting on the\n"
+         "                cpus in MASK, such as 0-3 (default: all)\n"
+         "  --duration SEC  With --exits, stop after SEC seconds\n"
          "\n"
-         "Either PID or TGID must be specified. For more documentation about "
-         "the reported fields, see\n"
+         "PID and TGID can also be comma separated lists, or \"all\" for every\n"
+         "thread or process, which are queried in batches and printed one per\n"
+         "line. Either PID, TGID or --exits must be specified. For more\n"
+         "documentation about the reported fields, see\n"
          "https://www.kernel.org/doc/Documentation/accounting/"
          "taskstats-struct.txt\n");
 }
 
 int main(int argc, char** argv) {
     int command_type = 0;
-    int pid = 0;
+    struct PidList pids = { 0 };
     int human_readable = 1;
+    int exits = 0;
+    const char* cpumask = NULL;
+    int duration = 0;
 
     const struct option long_options[] = {
         {"help", no_argument, 0, 0},
         {"pid", required_argument, 0, 0},
         {"tgid", required_argument, 0, 0},
         {"raw", no_argument, 0, 0},
+        {"exits", no_argument, 0, 0},
+        {"cpumask", required_argument, 0, 0},
+        {"duration", required_argument, 0, 0},
         {0, 0, 0, 0}
     };
 
@@ -278,58 +380,89 @@ int main(int argc, char** argv) {
                 print_usage();
                 return EXIT_SUCCESS;
             case 1:
-                command_type = TASKSTATS_CMD_ATTR_PID;
-                pid = atoi(optarg);
-                break;
-            case 2:
-                command_type = TASKSTATS_CMD_ATTR_TGID;
-                pid = atoi(optarg);
+            case 2: {
+                command_type = option_index == 1 ? TASKSTATS_CMD_ATTR_PID
+                                                 : TASKSTATS_CMD_ATTR_TGID;
+                pids.count = 0;
+                int ret = parse_pids(&pids, optarg, option_index == 1);
+                if (ret) {
+                    fprintf(stderr, "Invalid %s list %s: %s\n",
+                            long_options[option_index].name, optarg, strerror(ret));
+                    return EXIT_FAILURE;
+                }
                 break;
+            }
             case 3:
                 human_readable = 0;
                 break;
+            case 4:
+                exits = 1;
+                break;
+            case 5:
+                cpumask = optarg;
+                break;
+            case 6:
+                duration = atoi(optarg);
+                break;
             default:
                 break;
         };
     }
 
-    if (!pid) {
-        printf("Either PID or TGID must be specified\n");
+    if (!pids.count && !exits) {
+        printf("Either PID, TGID or --exits must be specified\n");
         return EXIT_FAILURE;
     }
 
-    struct nl_sock* netlink_socket = nl_socket_alloc();
-    if (!netlink_socket) {
-        fprintf(stderr, "Unable to allocate netlink socket\n");
-        goto error;
+    ts_socket_t* sock;
+    int ret = ts_socket_open(&sock);
+    if (ret == EPROTONOSUPPORT) {
+        fprintf(stderr, "Unable to determine taskstats family id "
+                "(does your kernel support taskstats?)\n");
+        return EXIT_FAILURE;
+    } else if (ret) {
+        fprintf(stderr, "Unable to open netlink socket (are you root?): %s\n",
+                strerror(ret));
+        return EXIT_FAILURE;
     }
 
-    int ret = genl_connect(netlink_socket);
-    if (ret < 0) {
-        nl_perror(ret, "Unable to open netlink socket (are you root?)");
-        goto error;
+    if (exits) {
+        ret = listen_exits(sock, cpumask, duration, human_readable);
+        ts_socket_close(sock);
+        free(pids.pids);
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
-    int family_id = genl_ctrl_resolve(netlink_socket, TASKSTATS_GENL_NAME);
-    if (family_id < 0) {
-        nl_perror(family_id, "Unable to determine taskstats family id "
-               "(does your kernel support taskstats?)");
-        goto error;
+    if (pids.count > 1) {
+        /* The requests are sent without waiting for each reply, and the
+         * tasks that exited since are skipped */
+        print_task_header(human_readable);
+        ret = ts_get_stats_batch(sock, command_type, pids.pids, pids.count,
+                                 print_task_callback, &human_readable);
+        ts_socket_close(sock);
+        free(pids.pids);
+        if (ret) {
+            fprintf(stderr, "Failed to query taskstats: %s\n", strerror(ret));
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
+
     struct TaskStatistics stats;
-    ret = query_task_stats(netlink_socket, family_id, command_type, pid, &stats);
-    if (ret < 0) {
-        nl_perror(ret, "Failed to query taskstats");
-        goto error;
+    memset(&stats, 0, sizeof(stats));
+    if (command_type == TASKSTATS_CMD_ATTR_PID) {
+        stats.pid = pids.pids[0];
+    } else {
+        stats.tgid = pids.pids[0];
+    }
+    ret = ts_get_stats(sock, command_type, pids.pids[0], &stats.stats);
+    ts_socket_close(sock);
+    free(pids.pids);
+    if (ret) {
+        fprintf(stderr, "Failed to query taskstats: %s\n", strerror(ret));
+        return EXIT_FAILURE;
     }
     print_task_stats(&stats, human_readable);
 
-    nl_socket_free(netlink_socket);
     return EXIT_SUCCESS;
-
-error:
-    if (netlink_socket) {
-        nl_socket_free(netlink_socket);
-    }
-    return EXIT_FAILURE;
 }
@@ -25,3 +25,12 @@ LOCAL_STATIC_LIBRARIES += libtestUtil
 LOCAL_C_INCLUDES += system/extras/tests/include external/tinyalsa/include
 
 include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := pcmlatency
+LOCAL_SRC_FILES := pcmlatency.cpp
+LOCAL_SHARED_LIBRARIES += libtinyalsa
+LOCAL_C_INCLUDES += external/tinyalsa/include
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Real time counterpart of pcmtest: plays and captures at once through
+ * tinyalsa, with the playback looped back to the capture by a cable or by
+ * the codec, and measures
+ *   - the round trip latency, by finding a noise burst in the capture,
+ *   - the xruns over a long run,
+ *   - the jitter of the capture period wakeups.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <tinyalsa/asoundlib.h>
+
+struct options {
+    unsigned int card;
+    unsigned int playback_device;
+    unsigned int capture_device;
+    unsigned int rate;
+    unsigned int channels;
+    unsigned int period_size;
+    unsigned int period_count;
+    unsigned int latency_runs;
+    unsigned int duration_s;
+    int fifo_priority;
+};
+
+static options opts = { 0, 0, 0, 48000, 2, 240, 2, 5, 10, 0 };
+
+/* length of the noise burst, and how much capture to search it in */
+static const unsigned int kBurstFrames = 2048;
+static const unsigned int kSearchSeconds = 1;
+
+struct duplex {
+    pcm *playback;
+    pcm *capture;
+    std::vector<int16_t> out;   /* one period, interleaved */
+    std::vector<int16_t> in;
+    unsigned int underruns;
+    unsigned int overruns;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_duplex(duplex *d)
+{
+    if (d->playback)
+        pcm_close(d->playback);
+    if (d->capture)
+        pcm_close(d->capture);
+    d->playback = d->capture = NULL;
+}
+
+static int open_duplex(duplex *d)
+{
+    pcm_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.channels = opts.channels;
+    config.rate = opts.rate;
+    config.period_size = opts.period_size;
+    config.period_count = opts.period_count;
+    config.format = PCM_FORMAT_S16_LE;
+
+    /* underruns are returned rather than recovered from, to count them */
+    d->playback = pcm_open(opts.card, opts.playback_device, PCM_OUT | PCM_NORESTART,
+                           &config);
+    d->capture = pcm_open(opts.card, opts.capture_device, PCM_IN, &config);
+    if (!pcm_is_ready(d->playback) || !pcm_is_ready(d->capture)) {
+        fprintf(stderr, "Unable to open pcm %u:%u/%u: %s\n", opts.card,
+                opts.playback_device, opts.capture_device,
+                pcm_get_error(pcm_is_ready(d->playback) ? d->capture : d->playback));
+        close_duplex(d);
+        return -1;
+    }
+    d->out.assign(opts.period_size * opts.channels, 0);
+    d->in.assign(opts.period_size * opts.channels, 0);
+    d->underruns = d->overruns = 0;
+    return 0;
+}
+
+static int write_period(duplex *d)
+{
+    int ret = pcm_write(d->playback, d->out.data(), d->out.size() * sizeof(int16_t));
+
+    if (ret == -EPIPE) {
+        d->underruns++;
+        /* start again from a full buffer of silence */
+        std::vector<int16_t> silence(d->out.size(), 0);
+        pcm_prepare(d->playback);
+        for (unsigned int i = 0; i < opts.period_count; i++) {
+            ret = pcm_write(d->playback, silence.data(), silence.size() * sizeof(int16_t));
+            if (ret)
+                break;
+        }
+    }
+    return ret;
+}
+
+/* Starts both streams, with the playback buffer full of silence. */
+static int start_duplex(duplex *d)
+{
+    std::fill(d->out.begin(), d->out.end(), 0);
+    for (unsigned int i = 0; i < opts.period_count; i++) {
+        if (write_period(d) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Pseudo random noise, white enough to give one sharp correlation peak. */
+static void make_burst(std::vector<int16_t> *burst)
+{
+    uint32_t lfsr = 0xace1u;
+
+    burst->resize(kBurstFrames);
+    for (unsigned int i = 0; i < kBurstFrames; i++) {
+        lfsr = (lfsr >> 1) ^ (-(lfsr & 1u) & 0xb400u);
+        (*burst)[i] = (lfsr & 1) ? 16384 : -16384;
+    }
+}
+
+/*
+ * Plays the burst once, right after the silence filling the playback buffer,
+ * and captures kSearchSeconds. Returns the lag of the correlation peak in
+ * frames, from the frame at which the burst was written to the one at which
+ * it came back, or -1 if no clear peak stands out of the capture.
+ */
+static long measure_round_trip(duplex *d, const std::vector<int16_t> &burst)
+{
+    unsigned int periods = opts.rate * kSearchSeconds / opts.period_size;
+    unsigned int burst_at = opts.period_count * opts.period_size;
+    std::vector<int16_t> captured;
+
+    if (start_duplex(d) != 0)
+        return -1;
+
+    /* frames written so far, counting the silence of start_duplex */
+    unsigned int written = burst_at;
+    for (unsigned int p = 0; p < periods; p++) {
+        if (pcm_read(d->capture, d->in.data(), d->in.size() * sizeof(int16_t)) != 0)
+            return -1;
+        for (unsigned int f = 0; f < opts.period_size; f++)
+            captured.push_back(d->in[f * opts.channels]);
+
+        for (unsigned int f = 0; f < opts.period_size; f++, written++) {
+            int16_t v = 0;
+            if (written >= burst_at && written < burst_at + kBurstFrames)
+                v = burst[written - burst_at];
+            for (unsigned int c = 0; c < opts.channels; c++)
+                d->out[f * opts.channels + c] = v;
+        }
+        if (write_period(d) != 0)
+            return -1;
+    }
+
+    /* the burst can't come back before it is written */
+    double best = 0, sum = 0;
+    long best_lag = -1;
+    unsigned long lags = 0;
+    for (size_t lag = 0; lag + kBurstFrames <= captured.size(); lag++) {
+        double c = 0;
+        for (unsigned int i = 0; i < kBurstFrames; i++)
+            c += (double)captured[lag + i] * burst[i];
+        c = fabs(c);
+        sum += c;
+        lags++;
+        if (c > best) {
+            best = c;
+            best_lag = lag;
+        }
+    }
+    /* a loopback gives a peak far above the average correlation */
+    if (lags == 0 || best < 8 * (sum / lags))
+        return -1;
+    return best_lag - (long)burst_at;
+}
+
+static int latency_mode(void)
+{
+    std::vector<int16_t> burst;
+    std::vector<double> results;
+
+    make_burst(&burst);
+    for (unsigned int i = 0; i < opts.latency_runs; i++) {
+        duplex d = duplex();
+        if (open_duplex(&d) != 0)
+            return 1;
+        long lag = measure_round_trip(&d, burst);
+        close_duplex(&d);
+        if (lag < 0) {
+            printf("run %u: no loopback signal found\n", i);
+            continue;
+        }
+        double ms = lag * 1000.0 / opts.rate;
+        printf("run %u: %ld frames, %.2f ms\n", i, lag, ms);
+        results.push_back(ms);
+    }
+    if (results.empty()) {
+        fprintf(stderr, "Round trip latency not measured: is the output looped back?\n");
+        return 1;
+    }
+    std::sort(results.begin(), results.end());
+    double sum = 0;
+    for (double r : results)
+        sum += r;
+    printf("round trip latency: min %.2f ms, avg %.2f ms, max %.2f ms\n",
+           results.front(), sum / results.size(), results.back());
+    return 0;
+}
+
+/*
+ * Plays silence and captures for duration_s, timing every capture wakeup.
+ * A capture wakeup later than a whole buffer means the capture overran,
+ * as tinyalsa recovers from those itself.
+ */
+static int xrun_mode(void)
+{
+    duplex d = duplex();
+    std::vector<uint32_t> jitter_us;
+    uint64_t period_ns = (uint64_t)opts.period_size * 1000000000ULL / opts.rate;
+    uint64_t buffer_ns = period_ns * opts.period_count;
+    uint64_t end, last;
+
+    if (open_duplex(&d) != 0 || start_duplex(&d) != 0) {
+        close_duplex(&d);
+        return 1;
+    }
+
+    end = now_ns() + opts.duration_s * 1000000000ULL;
+    last = 0;
+    while (true) {
+        if (pcm_read(d.capture, d.in.data(), d.in.size() * sizeof(int16_t)) != 0) {
+            fprintf(stderr, "Capture failed: %s\n", pcm_get_error(d.capture));
+            close_duplex(&d);
+            return 1;
+        }
+        uint64_t now = now_ns();
+        if (last) {
+            uint64_t interval = now - last;
+            uint64_t dev = interval > period_ns ? interval - period_ns : period_ns - interval;
+            jitter_us.push_back(dev / 1000);
+            if (interval > buffer_ns)
+                d.overruns++;
+        }
+        last = now;
+        if (write_period(&d) != 0) {
+            fprintf(stderr, "Playback failed: %s\n", pcm_get_error(d.playback));
+            close_duplex(&d);
+            return 1;
+        }
+        if (now >= end)
+            break;
+    }
+    close_duplex(&d);
+
+    std::sort(jitter_us.begin(), jitter_us.end());
+    printf("%zu periods in %u s: %u underruns, %u overruns\n", jitter_us.size() + 1,
+           opts.duration_s, d.underruns, d.overruns);
+    if (!jitter_us.empty()) {
+        size_t n = jitter_us.size();
+        printf("wakeup jitter: p50 %u us, p99 %u us, max %u us (period %.2f ms)\n",
+               jitter_us[(n - 1) / 2], jitter_us[(n - 1) * 99 / 100], jitter_us[n - 1],
+               period_ns / 1e6);
+    }
+    return d.underruns || d.overruns ? 2 : 0;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-l | -x] [-D card] [-d playback_device] [-c capture_device]\n"
+            "          [-r rate] [-C channels] [-p period_size] [-n period_count]\n"
+            "          [-N runs] [-t seconds] [-f priority]\n"
+            "    -l  Only measure the round trip latency, -N times (5).\n"
+            "        The playback has to be looped back to the capture.\n"
+            "    -x  Only count xruns and time the period wakeups, for -t seconds (10).\n"
+            "    -p  Frames per period (240), -n periods per buffer (2).\n"
+            "    -f  Run as SCHED_FIFO with this priority, as audio fast tracks do.\n",
+            cmd);
+}
+
+int main(int argc, char *argv[])
+{
+    bool latency = true, xruns = true;
+    bool capture_set = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "lxD:d:c:r:C:p:n:N:t:f:")) != -1) {
+        switch (opt) {
+        case 'l': xruns = false; break;
+        case 'x': latency = false; break;
+        case 'D': opts.card = atoi(optarg); break;
+        case 'd': opts.playback_device = atoi(optarg); break;
+        case 'c': opts.capture_device = atoi(optarg); capture_set = true; break;
+        case 'r': opts.rate = atoi(optarg); break;
+        case 'C': opts.channels = atoi(optarg); break;
+        case 'p': opts.period_size = atoi(optarg); break;
+        case 'n': opts.period_count = atoi(optarg); break;
+        case 'N': opts.latency_runs = atoi(optarg); break;
+        case 't': opts.duration_s = atoi(optarg); break;
+        case 'f': opts.fifo_priority = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!capture_set)
+        opts.capture_device = opts.playback_device;
+    if (!latency && !xruns) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opts.rate == 0 || opts.channels == 0 || opts.period_size == 0 ||
+            opts.period_count < 2 || opts.duration_s == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.fifo_priority > 0) {
+        struct sched_param param;
+        param.sched_priority = opts.fifo_priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+            fprintf(stderr, "Unable to use SCHED_FIFO: %s\n", strerror(errno));
+    }
+
+    printf("card %u, devices %u/%u, %u Hz, %u channels, %u x %u frames\n", opts.card,
+           opts.playback_device, opts.capture_device, opts.rate, opts.channels,
+           opts.period_count, opts.period_size);
+
+    int ret = 0;
+    if (latency)
+        ret = latency_mode();
+    if (xruns) {
+        int xrun_ret = xrun_mode();
+        if (ret == 0)
+            ret = xrun_ret;
+    }
+    return ret;
+}
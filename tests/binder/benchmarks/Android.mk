@@ -37,3 +37,22 @@ LOCAL_MODULE := binderAddInts
 LOCAL_SRC_FILES := binderAddInts.cpp
 
 include $(BUILD_NATIVE_BENCHMARK)
+
+include $(CLEAR_VARS)
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+
+LOCAL_MODULE_TAGS := eng tests
+
+LOCAL_SHARED_LIBRARIES += \
+    libutils \
+    libcutils \
+    liblog \
+    libbinder
+
+LOCAL_C_INCLUDES += \
+    frameworks/base/include
+
+LOCAL_MODULE := binderThroughput
+LOCAL_SRC_FILES := binderThroughput.cpp
+
+include $(BUILD_NATIVE_BENCHMARK)
@@ -21,6 +21,7 @@
  */
 
 #include <cerrno>
+#include <cstring>
 #include <grp.h>
 #include <iostream>
 #include <iomanip>
@@ -40,6 +41,7 @@
 #include <benchmark/benchmark.h>
 
 #include <utils/Log.h>
+#include <testPerf.h>
 #include <testUtil.h>
 
 using namespace android;
@@ -53,12 +55,19 @@ struct options {
     int serverCPU;
     int clientCPU;
     float        iterDelay; // End of iteration delay in seconds
+    const char   *jsonFile; // Report of the latencies, or NULL
 } options = { // Set defaults
     unbound, // Server CPU
     unbound, // Client CPU
     0.0,    // End of iteration delay
+    NULL,   // No report
 };
 
+// Latencies of the transactions of the last run of BM_addInts, which is
+// the one google-benchmark reports
+static struct testHist addIntsHist;
+static struct testCpuFreq freqBefore;
+
 class AddIntsService : public BBinder
 {
   public:
@@ -81,6 +90,7 @@ class AddIntsService : public BBinder
 static bool server(void);
 static void BM_addInts(benchmark::State& state);
 static void bindCPU(unsigned int cpu);
+static void writeReport(void);
 static ostream &operator<<(ostream &stream, const String16& str);
 static ostream &operator<<(ostream &stream, const cpu_set_t& set);
 
@@ -125,6 +135,7 @@ static void BM_addInts(benchmark::State& state)
         return;
     }
 
+    memset(&addIntsHist, 0, sizeof(addIntsHist));
     unsigned int iter = 0;
     // Perform the IPC operations in the benchmark
     while (state.KeepRunning()) {
@@ -142,14 +153,17 @@ static void BM_addInts(benchmark::State& state)
         state.ResumeTiming();
         // Send the parcel, while timing how long it takes for
         // the answer to return.
+        uint64_t start = testClockTicks();
         if ((rv = binder->transact(AddIntsService::ADD_INTS,
             send, &reply)) != 0) {
             cerr << "binder->transact failed, rv: " << rv
                 << " errno: " << errno << endl;
             exit(10);
         }
+        uint64_t end = testClockTicks();
 
         state.PauseTiming();
+        testHistAdd(&addIntsHist, testClockTicksToNs(end - start));
         int result = reply.readInt32();
         if (result != (int) (iter + iter + 3)) {
             cerr << "Unexpected result for iteration " << iter << endl;
@@ -204,12 +218,7 @@ status_t AddIntsService::onTransact(uint32_t code, const Parcel &data,
 
 static void bindCPU(unsigned int cpu)
 {
-    int rv;
-    cpu_set_t cpuset;
-
-    CPU_ZERO(&cpuset);
-    CPU_SET(cpu, &cpuset);
-    rv = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+    int rv = testCpuPin(cpu);
 
     if (rv != 0) {
         cerr << "bindCPU failed, rv: " << rv << " errno: " << errno << endl;
@@ -218,6 +227,31 @@ static void bindCPU(unsigned int cpu)
     }
 }
 
+// Prints the percentiles of the transaction latencies, and appends them to
+// the JSON report if one was asked for.
+static void writeReport(void)
+{
+    if (!addIntsHist.count) { return; }
+
+    cout << "addInts latency ns: p50 " << testHistPercentile(&addIntsHist, 0.5)
+        << " p90 " << testHistPercentile(&addIntsHist, 0.9)
+        << " p99 " << testHistPercentile(&addIntsHist, 0.99)
+        << " max " << addIntsHist.max << endl;
+
+    if (options.jsonFile == NULL) { return; }
+    FILE *out = fopen(options.jsonFile, "a");
+    if (out == NULL) {
+        cerr << "Cannot open " << options.jsonFile << " errno: " << errno << endl;
+        return;
+    }
+    struct testJson json;
+    testJsonInit(&json, out);
+    testJsonBeginReport(&json, "binderAddInts", testClockSource(), &freqBefore);
+    testJsonResult(&json, "addInts", &addIntsHist, 0, 0);
+    testJsonEndReport(&json);
+    fclose(out);
+}
+
 static ostream &operator<<(ostream &stream, const String16& str)
 {
     for (unsigned int n1 = 0; n1 < str.size(); n1++) {
@@ -259,7 +293,7 @@ int main(int argc, char *argv[])
 
     // Parse command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "s:c:d:?")) != -1) {
+    while ((opt = getopt(argc, argv, "s:c:d:j:?")) != -1) {
         char *chptr; // character pointer for command-line parsing
 
         switch (opt) {
@@ -293,6 +327,10 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case 'j': // JSON report
+            options.jsonFile = optarg;
+            break;
+
         case '?':
         default:
             cerr << basename(argv[0]) << " [options]" << endl;
@@ -300,14 +338,20 @@ int main(int argc, char *argv[])
             cerr << "    -s cpu - server CPU number" << endl;
             cerr << "    -c cpu - client CPU number" << endl;
             cerr << "    -d time - delay after operation in seconds" << endl;
+            cerr << "    -j file - append the latency percentiles to a JSON file"
+                << endl;
             exit(((optopt == 0) || (optopt == '?')) ? 0 : 7);
         }
     }
 
+    testClockCalibrate();
+    testCpuFreqSnapshot(&freqBefore);
+
     fflush(stdout);
     switch (pid_t pid = fork()) {
     case 0: // Child
         ::benchmark::RunSpecifiedBenchmarks();
+        writeReport();
         return 0;
 
     default: // Parent
@@ -0,0 +1,572 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Binder throughput and latency benchmarks (Using google-benchmark library)
+ *
+ * A server process publishes a service, and the benchmark threads of a
+ * client process call it: with inline payloads from bytes to hundreds of
+ * KB, with file descriptors, and with ashmem regions of up to 16MB, each
+ * both two-way and oneway, and with 1 to 16 concurrent clients. The label
+ * of each benchmark has the percentiles of the latency of its calls.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <libgen.h>
+#include <mutex>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <binder/IPCThreadState.h>
+#include <binder/ProcessState.h>
+#include <binder/IServiceManager.h>
+
+#include <benchmark/benchmark.h>
+
+#include <cutils/ashmem.h>
+#include <utils/Log.h>
+
+using namespace android;
+using namespace std;
+
+String16 serviceName("test.binderThroughput");
+
+const int maxClients = 64;
+
+// Oneway calls are queued in the server's async buffer, which is half of
+// its 1MB binder mapping; each client waits for the server to catch up
+// after this many bytes, split between the clients, are outstanding.
+const size_t onewayWindow = 128 * 1024;
+
+struct options {
+    cpu_set_t serverCPUs;
+    bool serverBound;
+    vector<int> clientCPUs;
+    int serverThreads;
+} options;
+
+class ThroughputService : public BBinder
+{
+  public:
+    ThroughputService() {}
+    virtual ~ThroughputService() {}
+
+    enum command {
+        PAYLOAD = 0x120,
+        FDS,
+        ASHMEM,
+        DRAIN,
+    };
+
+    virtual status_t onTransact(uint32_t code,
+                                const Parcel& data, Parcel* reply,
+                                uint32_t flags = 0);
+
+  private:
+    // Oneway calls handled for each client
+    mutex lock_;
+    condition_variable handled_;
+    int64_t numOneway_[maxClients] = {};
+};
+
+// File scope function prototypes
+static bool server(void);
+static void bindCPU(unsigned int cpu);
+static bool parseCPUs(const char *str, const cpu_set_t& avail, vector<int> *cpus);
+static ostream &operator<<(ostream &stream, const String16& str);
+static ostream &operator<<(ostream &stream, const cpu_set_t& set);
+
+static bool server(void)
+{
+    int rv;
+
+    // The pool threads inherit the affinity of this thread
+    if (options.serverBound) {
+        if (sched_setaffinity(0, sizeof(options.serverCPUs), &options.serverCPUs) != 0) {
+            cerr << "sched_setaffinity failed, errno: " << errno << endl;
+            return false;
+        }
+    }
+
+    // Add the service
+    sp<ProcessState> proc(ProcessState::self());
+    proc->setThreadPoolMaxThreadCount(options.serverThreads);
+    sp<IServiceManager> sm = defaultServiceManager();
+    if ((rv = sm->addService(serviceName, new ThroughputService())) != 0) {
+        cerr << "addService " << serviceName << " failed, rv: " << rv
+            << " errno: " << errno << endl;
+        return false;
+    }
+
+    // Start threads to handle server work
+    proc->startThreadPool();
+    return true;
+}
+
+static sp<IBinder> getServer(void)
+{
+    sp<IServiceManager> sm = defaultServiceManager();
+    sp<IBinder> binder;
+    for (int i = 0; i < 10; i++) {
+        binder = sm->getService(serviceName);
+        if (binder != 0) break;
+        cout << serviceName << " not published, waiting..." << endl;
+        usleep(500000); // 0.5 s
+    }
+    if (binder == 0) {
+        cerr << serviceName << " failed to publish, aborting" << endl;
+        exit(11);
+    }
+    return binder;
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return uint64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// Call latencies of all the threads of the current run
+static mutex latencyLock;
+static vector<uint64_t> latencies;
+
+// Adds the latencies of one thread to those of the run, and labels the
+// benchmark with their percentiles.  The last thread to finish labels it
+// with those of all the threads.
+static void reportLatency(benchmark::State& state, const vector<uint64_t>& samples)
+{
+    lock_guard<mutex> lock(latencyLock);
+    latencies.insert(latencies.end(), samples.begin(), samples.end());
+    if (latencies.empty()) return;
+
+    vector<uint64_t> sorted(latencies);
+    sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double p) {
+        return sorted[min(sorted.size() - 1, size_t(p / 100.0 * sorted.size()))] / 1000.0;
+    };
+    ostringstream label;
+    label.precision(1);
+    label << fixed << "p50 " << percentile(50) << "us p90 " << percentile(90)
+          << "us p99 " << percentile(99) << "us p99.9 " << percentile(99.9)
+          << "us max " << sorted.back() / 1000.0 << "us";
+    state.SetLabel(label.str());
+}
+
+// Waits for the server to handle the first count oneway calls of client
+static void drain(const sp<IBinder>& binder, int client, int64_t count)
+{
+    Parcel send, reply;
+    send.writeInt32(client);
+    send.writeInt64(count);
+    status_t rv = binder->transact(ThroughputService::DRAIN, send, &reply);
+    if (rv != 0) {
+        cerr << "drain failed, rv: " << rv << " errno: " << errno << endl;
+        exit(12);
+    }
+}
+
+// Makes calls of code, with the parcels built by fill, until the benchmark
+// is done.  Two-way calls expect the server to reply with expected.
+static void runCalls(benchmark::State& state, uint32_t code, bool oneway,
+                     size_t bytes, int32_t expected,
+                     const function<void(Parcel&)>& fill)
+{
+    sp<IBinder> binder = getServer();
+    int client = state.thread_index;
+    if (client >= maxClients) {
+        cerr << "Too many clients, at most " << maxClients << endl;
+        exit(13);
+    }
+
+    // If needed bind to client CPU
+    if (!options.clientCPUs.empty()) {
+        bindCPU(options.clientCPUs[client % options.clientCPUs.size()]);
+    }
+
+    if (client == 0) {
+        // The other threads wait for this one in the first KeepRunning
+        lock_guard<mutex> lock(latencyLock);
+        latencies.clear();
+    }
+
+    vector<uint64_t> samples;
+    size_t window = max(bytes, onewayWindow / state.threads);
+    size_t outstanding = 0;
+    int64_t sent = 0;
+    while (state.KeepRunning()) {
+        Parcel send, reply;
+        send.writeInt32(client);
+        fill(send);
+
+        uint64_t start = nowNs();
+        status_t rv = binder->transact(code, send, &reply,
+                                       oneway ? IBinder::FLAG_ONEWAY : 0);
+        samples.push_back(nowNs() - start);
+        if (rv != 0) {
+            cerr << "binder->transact failed, rv: " << rv
+                << " errno: " << errno << endl;
+            exit(10);
+        }
+
+        if (oneway) {
+            sent++;
+            outstanding += send.dataSize();
+            if (outstanding >= window) {
+                drain(binder, client, sent);
+                outstanding = 0;
+            }
+        } else if (reply.readInt32() != expected) {
+            cerr << "Unexpected reply for code " << code << endl;
+            exit(14);
+        }
+    }
+    if (oneway) {
+        drain(binder, client, sent);
+    }
+
+    state.SetBytesProcessed(state.iterations() * bytes);
+    reportLatency(state, samples);
+}
+
+// Inline payloads of range_x bytes, oneway if range_y
+static void BM_payload(benchmark::State& state)
+{
+    static vector<char> payload(256 * 1024, 0x5a);
+    size_t size = state.range_x();
+    runCalls(state, ThroughputService::PAYLOAD, state.range_y(), size, size,
+             [&](Parcel& send) {
+                 send.writeInt32(size);
+                 send.write(payload.data(), size);
+             });
+}
+BENCHMARK(BM_payload)->Apply([](benchmark::internal::Benchmark* b) {
+    for (int oneway = 0; oneway <= 1; oneway++) {
+        for (int size = 4; size <= 256 * 1024; size *= 4) {
+            b->ArgPair(size, oneway);
+        }
+    }
+});
+
+// range_x file descriptors, oneway if range_y
+static void BM_fds(benchmark::State& state)
+{
+    static int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int num = state.range_x();
+    runCalls(state, ThroughputService::FDS, state.range_y(), 0, num,
+             [&](Parcel& send) {
+                 send.writeInt32(num);
+                 for (int i = 0; i < num; i++) {
+                     send.writeFileDescriptor(fd);
+                 }
+             });
+}
+BENCHMARK(BM_fds)->ArgPair(1, 0)->ArgPair(4, 0)->ArgPair(16, 0)->ArgPair(64, 0)
+                 ->ArgPair(1, 1)->ArgPair(4, 1)->ArgPair(16, 1)->ArgPair(64, 1);
+
+// An ashmem region of range_x bytes, which the server maps and reads a
+// word of on each page, oneway if range_y
+static void BM_ashmem(benchmark::State& state)
+{
+    size_t size = state.range_x();
+    int fd = ashmem_create_region("binderThroughput", size);
+    if (fd < 0) {
+        cerr << "ashmem_create_region failed, errno: " << errno << endl;
+        exit(15);
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        cerr << "mmap failed, errno: " << errno << endl;
+        exit(16);
+    }
+    memset(map, 0x5a, size);
+    munmap(map, size);
+
+    runCalls(state, ThroughputService::ASHMEM, state.range_y(), size, size,
+             [&](Parcel& send) {
+                 send.writeInt32(size);
+                 send.writeFileDescriptor(fd);
+             });
+    close(fd);
+}
+BENCHMARK(BM_ashmem)->ArgPair(64 << 10, 0)->ArgPair(1 << 20, 0)->ArgPair(4 << 20, 0)
+                    ->ArgPair(16 << 20, 0)->ArgPair(1 << 20, 1)->ArgPair(16 << 20, 1);
+
+// Concurrent clients with 64 byte payloads, oneway if range_x, to see how
+// the calls scale with the server threads (-m)
+static void BM_clients(benchmark::State& state)
+{
+    static vector<char> payload(64, 0x5a);
+    runCalls(state, ThroughputService::PAYLOAD, state.range_x(), payload.size(),
+             payload.size(),
+             [&](Parcel& send) {
+                 send.writeInt32(payload.size());
+                 send.write(payload.data(), payload.size());
+             });
+}
+BENCHMARK(BM_clients)->Arg(0)->Arg(1)->ThreadRange(1, 16);
+
+// Server function that handles parcels received from the client
+status_t ThroughputService::onTransact(uint32_t code, const Parcel &data,
+                                       Parcel* reply, uint32_t flags) {
+    // If server bound to particular CPUs, check that
+    // were executing on one of them.
+    if (options.serverBound) {
+        int cpu = sched_getcpu();
+        if (!CPU_ISSET(cpu, &options.serverCPUs)) {
+            cerr << "server onTransact on CPU " << cpu << " expected CPUs "
+                  << options.serverCPUs << endl;
+            exit(20);
+        }
+    }
+
+    int client = data.readInt32();
+    if ((client < 0) || (client >= maxClients)) {
+        cerr << "server onTransact bad client: " << client << endl;
+        exit(22);
+    }
+
+    // Perform the requested operation
+    int32_t result = 0;
+    switch (code) {
+    case PAYLOAD: {
+        int32_t size = data.readInt32();
+        if (data.readInplace(size) == NULL) {
+            cerr << "server onTransact short payload, size: " << size << endl;
+            exit(23);
+        }
+        result = size;
+        break;
+    }
+
+    case FDS: {
+        int32_t num = data.readInt32();
+        for (int32_t i = 0; i < num; i++) {
+            if (data.readFileDescriptor() < 0) {
+                cerr << "server onTransact missing fd " << i << endl;
+                exit(24);
+            }
+        }
+        result = num;
+        break;
+    }
+
+    case ASHMEM: {
+        int32_t size = data.readInt32();
+        int fd = data.readFileDescriptor();
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            cerr << "server mmap failed, errno: " << errno << endl;
+            exit(25);
+        }
+        volatile uint32_t sum = 0;
+        for (int32_t offset = 0; offset < size; offset += getpagesize()) {
+            sum += *reinterpret_cast<uint32_t *>(static_cast<char *>(map) + offset);
+        }
+        munmap(map, size);
+        result = size;
+        break;
+    }
+
+    case DRAIN: {
+        int64_t count = data.readInt64();
+        unique_lock<mutex> lock(lock_);
+        handled_.wait(lock, [&] { return numOneway_[client] >= count; });
+        break;
+    }
+
+    default:
+      cerr << "server onTransact unknown code, code: " << code << endl;
+      exit(21);
+    }
+
+    if (flags & IBinder::FLAG_ONEWAY) {
+        lock_guard<mutex> lock(lock_);
+        numOneway_[client]++;
+        handled_.notify_all();
+    } else {
+        reply->writeInt32(result);
+    }
+
+    return 0;
+}
+
+static void bindCPU(unsigned int cpu)
+{
+    int rv;
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    rv = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+
+    if (rv != 0) {
+        cerr << "bindCPU failed, rv: " << rv << " errno: " << errno << endl;
+        perror(NULL);
+        exit(30);
+    }
+}
+
+// Parses a comma separated list of CPUs, each of which must be available
+static bool parseCPUs(const char *str, const cpu_set_t& avail, vector<int> *cpus)
+{
+    char *chptr;
+    do {
+        int cpu = strtoul(str, &chptr, 10);
+        if ((chptr == str) || ((*chptr != ',') && (*chptr != '\0'))) {
+            cerr << "Invalid cpu list: " << str << endl;
+            return false;
+        }
+        if ((cpu >= CPU_SETSIZE) || !CPU_ISSET(cpu, &avail)) {
+            cerr << "CPU " << cpu << " not currently available" << endl;
+            cerr << "  Available CPUs: " << avail << endl;
+            return false;
+        }
+        cpus->push_back(cpu);
+        str = chptr + 1;
+    } while (*chptr == ',');
+
+    return true;
+}
+
+static ostream &operator<<(ostream &stream, const String16& str)
+{
+    for (unsigned int n1 = 0; n1 < str.size(); n1++) {
+        if ((str[n1] > 0x20) && (str[n1] < 0x80)) {
+            stream << (char) str[n1];
+        } else {
+            stream << '~';
+        }
+    }
+
+    return stream;
+}
+
+static ostream &operator<<(ostream &stream, const cpu_set_t& set)
+{
+    bool first = true;
+    for (unsigned int n1 = 0; n1 < CPU_SETSIZE; n1++) {
+        if (CPU_ISSET(n1, &set)) {
+            if (!first) { stream << ' '; }
+            stream << n1;
+            first = false;
+        }
+    }
+
+    return stream;
+}
+
+int main(int argc, char *argv[])
+{
+    int rv;
+    ::benchmark::Initialize(&argc, argv);
+    // Determine CPUs available for use.
+    // This testcase limits its self to using CPUs that were
+    // available at the start of the benchmark.
+    cpu_set_t availCPUs;
+    if ((rv = sched_getaffinity(0, sizeof(availCPUs), &availCPUs)) != 0) {
+        cerr << "sched_getaffinity failure, rv: " << rv
+            << " errno: " << errno << endl;
+        exit(1);
+    }
+
+    options.serverBound = false;
+    options.serverThreads = 4;
+
+    // Parse command line arguments
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:m:?")) != -1) {
+        char *chptr; // character pointer for command-line parsing
+
+        switch (opt) {
+        case 'c': // client CPUs
+            if (!parseCPUs(optarg, availCPUs, &options.clientCPUs)) {
+                exit(2);
+            }
+            break;
+
+        case 's': { // server CPUs
+            vector<int> cpus;
+            if (!parseCPUs(optarg, availCPUs, &cpus)) {
+                exit(3);
+            }
+            CPU_ZERO(&options.serverCPUs);
+            for (int cpu : cpus) {
+                CPU_SET(cpu, &options.serverCPUs);
+            }
+            options.serverBound = true;
+            break;
+        }
+
+        case 'm': // server threads
+            options.serverThreads = strtoul(optarg, &chptr, 10);
+            if ((*chptr != '\0') || (options.serverThreads < 1)) {
+                cerr << "Invalid number of server threads: " << optarg << endl;
+                exit(4);
+            }
+            break;
+
+        case '?':
+        default:
+            cerr << basename(argv[0]) << " [options]" << endl;
+            cerr << "  options:" << endl;
+            cerr << "    -s cpu[,cpu...] - server CPUs" << endl;
+            cerr << "    -c cpu[,cpu...] - client CPUs, one per client in turn" << endl;
+            cerr << "    -m threads - most server threads (default 4)" << endl;
+            exit(((optopt == 0) || (optopt == '?')) ? 0 : 7);
+        }
+    }
+
+    fflush(stdout);
+    switch (pid_t pid = fork()) {
+    case 0: // Child
+        ::benchmark::RunSpecifiedBenchmarks();
+        return 0;
+
+    default: // Parent
+        if (!server()) { break; }
+
+        // Wait for all children to end
+        do {
+            int stat;
+            rv = wait(&stat);
+            if ((rv == -1) && (errno == ECHILD)) { break; }
+            if (rv == -1) {
+                cerr << "wait failed, rv: " << rv << " errno: "
+                    << errno << endl;
+                perror(NULL);
+                exit(8);
+            }
+        } while (1);
+        return 0;
+
+    case -1: // Error
+        exit(9);
+    }
+}
@@ -15,6 +15,10 @@
  *
  * Performs a simple write/readback test to verify correct functionality
  * of direct i/o on a block device node.
+ *
+ * With -p, several threads instead write and then read back the device with
+ * several direct i/os in flight each, verifying the checksum of every block,
+ * and the throughput and latency of both passes are reported.
  */
 
 /* For large-file support */
@@ -30,6 +34,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,9 +42,12 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/aio_abi.h>
 #include <linux/fs.h>
 
 #define NUM_TEST_BLKS 128
@@ -167,7 +175,390 @@ static void update_progress(int current, int total)
 	fflush(stdout);
 }
 
-int main(int argc, const char *argv[])
+/*
+ * Throughput mode.  The test area is split between the threads, which each
+ * write their part with up to queue_depth asynchronous direct i/os in
+ * flight, and then read it back the same way.  Every block starts with a
+ * header holding its block number and a checksum of the rest of the block,
+ * so that the read pass detects corrupted, torn and misplaced blocks.
+ */
+
+#define TP_MAGIC 0x4f494944	/* "DIIO" */
+
+struct block_header {
+	uint32_t magic;
+	uint32_t checksum;	/* of the data after the header */
+	uint64_t block;		/* index of the block in the test area */
+	uint64_t seed;		/* of the run that wrote the block */
+};
+
+/* latencies, in power-of-two buckets of microseconds */
+#define LAT_BUCKETS 32
+
+struct tp_thread {
+	pthread_t thread;
+	int fd;
+	int writing;
+	uint64_t seed;
+	size_t block_size;
+	int queue_depth;
+	uint64_t first_block;
+	uint64_t num_blocks;
+
+	/* results */
+	int failed;
+	uint64_t bytes;
+	uint64_t bad_blocks;
+	uint64_t lat_count;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	uint64_t lat_hist[LAT_BUCKETS];
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Fletcher-like checksum of 32-bit words, sensitive to their order. */
+static uint32_t block_checksum(const void *buf, size_t len)
+{
+	const uint32_t *data = buf;
+	uint64_t sum1 = 0, sum2 = 0;
+	size_t i;
+
+	len /= sizeof(uint32_t);
+	for (i = 0; i < len; i++) {
+		sum1 += data[i];
+		sum2 += sum1;
+	}
+	return (uint32_t)(sum1 ^ (sum1 >> 32) ^ sum2 ^ (sum2 >> 32));
+}
+
+static void fill_block(void *buf, size_t size, uint64_t block, uint64_t seed)
+{
+	struct block_header *hdr = buf;
+	uint64_t *data = (uint64_t *)(hdr + 1);
+	uint64_t x = (block + 1) * 0x9E3779B97F4A7C15ULL ^ seed;
+	size_t i, len = (size - sizeof(*hdr)) / sizeof(uint64_t);
+
+	/* xorshift64, so that no two blocks hold the same data */
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[i] = x;
+	}
+
+	hdr->magic = TP_MAGIC;
+	hdr->block = block;
+	hdr->seed = seed;
+	hdr->checksum = block_checksum(data, size - sizeof(*hdr));
+}
+
+static int check_block(const void *buf, size_t size, uint64_t block,
+		uint64_t seed)
+{
+	const struct block_header *hdr = buf;
+
+	if (hdr->magic != TP_MAGIC || hdr->seed != seed) {
+		fprintf(stderr, "Block %" PRIu64 " was not written by this "
+				"test\n", block);
+		return -1;
+	}
+	if (hdr->block != block) {
+		fprintf(stderr, "Block %" PRIu64 " holds block %" PRIu64
+				"\n", block, hdr->block);
+		return -1;
+	}
+	if (hdr->checksum != block_checksum(hdr + 1, size - sizeof(*hdr))) {
+		fprintf(stderr, "Block %" PRIu64 " has a bad checksum\n",
+				block);
+		return -1;
+	}
+	return 0;
+}
+
+static void add_latency(struct tp_thread *t, uint64_t us)
+{
+	int bucket = 0;
+
+	while (bucket < LAT_BUCKETS - 1 && (us >> (bucket + 1)))
+		bucket++;
+	t->lat_hist[bucket]++;
+	t->lat_count++;
+	t->lat_sum += us;
+	if (us > t->lat_max)
+		t->lat_max = us;
+}
+
+static void *tp_thread_main(void *arg)
+{
+	struct tp_thread *t = arg;
+	int depth = t->queue_depth;
+	aio_context_t ctx = 0;
+	struct iocb *iocbs = NULL, **submit = NULL;
+	struct io_event *events = NULL;
+	uint64_t *submit_us = NULL;
+	int *free_slots = NULL;
+	int num_free = depth;
+	char *bufs;
+	uint64_t next = 0, done = 0;
+	int i;
+
+	bufs = pagealign_alloc(t->block_size * depth);
+	iocbs = calloc(depth, sizeof(*iocbs));
+	submit = calloc(depth, sizeof(*submit));
+	events = calloc(depth, sizeof(*events));
+	submit_us = calloc(depth, sizeof(*submit_us));
+	free_slots = calloc(depth, sizeof(*free_slots));
+	if (!bufs || !iocbs || !submit || !events || !submit_us ||
+			!free_slots) {
+		fprintf(stderr, "Error allocating i/o buffers\n");
+		t->failed = 1;
+		goto out;
+	}
+	for (i = 0; i < depth; i++)
+		free_slots[i] = i;
+
+	if (syscall(__NR_io_setup, depth, &ctx) == -1) {
+		perror("io_setup");
+		t->failed = 1;
+		goto out;
+	}
+
+	while (done < t->num_blocks) {
+		int n = 0, ret;
+
+		/* fill the queue */
+		while (num_free > 0 && next < t->num_blocks) {
+			int slot = free_slots[--num_free];
+			struct iocb *cb = &iocbs[slot];
+			char *buf = bufs + (size_t)slot * t->block_size;
+			uint64_t block = t->first_block + next++;
+
+			if (t->writing)
+				fill_block(buf, t->block_size, block, t->seed);
+
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_data = slot;
+			cb->aio_lio_opcode = t->writing ? IOCB_CMD_PWRITE :
+					IOCB_CMD_PREAD;
+			cb->aio_fildes = t->fd;
+			cb->aio_buf = (uintptr_t)buf;
+			cb->aio_nbytes = t->block_size;
+			cb->aio_offset = block * t->block_size;
+			submit[n++] = cb;
+		}
+
+		if (n > 0) {
+			uint64_t now = now_us();
+			int submitted = 0;
+
+			for (i = 0; i < n; i++)
+				submit_us[submit[i]->aio_data] = now;
+			while (submitted < n) {
+				ret = syscall(__NR_io_submit, ctx, n - submitted,
+						submit + submitted);
+				if (ret <= 0) {
+					perror("io_submit");
+					t->failed = 1;
+					goto out_destroy;
+				}
+				submitted += ret;
+			}
+		}
+
+		/* reap at least one completion */
+		ret = syscall(__NR_io_getevents, ctx, 1, depth, events, NULL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("io_getevents");
+			t->failed = 1;
+			goto out_destroy;
+		}
+
+		for (i = 0; i < ret; i++) {
+			int slot = events[i].data;
+			struct iocb *cb = &iocbs[slot];
+			uint64_t block = cb->aio_offset / t->block_size;
+
+			add_latency(t, now_us() - submit_us[slot]);
+
+			if (events[i].res != (int64_t)t->block_size) {
+				fprintf(stderr, "%s of block %" PRIu64
+						" failed: %s\n",
+						t->writing ? "Write" : "Read",
+						block,
+						(int64_t)events[i].res < 0 ?
+						strerror(-events[i].res) :
+						"short i/o");
+				t->failed = 1;
+			} else {
+				t->bytes += t->block_size;
+				if (!t->writing && check_block(
+						(void *)(uintptr_t)cb->aio_buf,
+						t->block_size, block, t->seed))
+					t->bad_blocks++;
+			}
+
+			free_slots[num_free++] = slot;
+			done++;
+		}
+	}
+
+out_destroy:
+	/* i/os still in flight are cancelled or waited for */
+	syscall(__NR_io_destroy, ctx);
+out:
+	if (bufs)
+		pagealign_free(bufs, t->block_size * depth);
+	free(iocbs);
+	free(submit);
+	free(events);
+	free(submit_us);
+	free(free_slots);
+	return NULL;
+}
+
+/*
+ * Upper bound, in microseconds, of the bucket holding the pct percentile,
+ * or the largest latency if lower.
+ */
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t count,
+		uint64_t max, int pct)
+{
+	uint64_t rank = (count * pct + 99) / 100, seen = 0;
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= rank)
+			break;
+	}
+	return (i < LAT_BUCKETS && (2ULL << i) < max) ? 2ULL << i : max;
+}
+
+static int run_pass(struct tp_thread *threads, int num_threads, int writing)
+{
+	uint64_t start, elapsed, bytes = 0, bad = 0, count = 0, sum = 0, max = 0;
+	uint64_t hist[LAT_BUCKETS];
+	double secs;
+	int i, j, failed = 0;
+
+	memset(hist, 0, sizeof(hist));
+	start = now_us();
+
+	for (i = 0; i < num_threads; i++) {
+		struct tp_thread *t = &threads[i];
+
+		t->writing = writing;
+		t->failed = 0;
+		t->bytes = t->bad_blocks = 0;
+		t->lat_count = t->lat_sum = t->lat_max = 0;
+		memset(t->lat_hist, 0, sizeof(t->lat_hist));
+		if (pthread_create(&t->thread, NULL, tp_thread_main, t)) {
+			fprintf(stderr, "Error starting thread\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		struct tp_thread *t = &threads[i];
+
+		pthread_join(t->thread, NULL);
+		failed |= t->failed;
+		bytes += t->bytes;
+		bad += t->bad_blocks;
+		count += t->lat_count;
+		sum += t->lat_sum;
+		if (t->lat_max > max)
+			max = t->lat_max;
+		for (j = 0; j < LAT_BUCKETS; j++)
+			hist[j] += t->lat_hist[j];
+	}
+
+	elapsed = now_us() - start;
+	secs = elapsed ? elapsed / 1e6 : 1e-6;
+
+	printf("%-5s %8.1f MB in %7.2f s: %8.1f MB/s, %8.0f IOPS\n",
+			writing ? "write" : "read", bytes / 1048576.0, secs,
+			bytes / 1048576.0 / secs, count / secs);
+	if (count)
+		printf("      latency avg %" PRIu64 " us, p50 <= %" PRIu64
+				" us, p99 <= %" PRIu64 " us, max %" PRIu64
+				" us\n", sum / count,
+				lat_percentile(hist, count, max, 50),
+				lat_percentile(hist, count, max, 99), max);
+	if (!writing)
+		printf("      %" PRIu64 " bad blocks\n", bad);
+
+	return (failed || bad) ? -1 : 0;
+}
+
+static int throughput_test(int fd, uint64_t dev_size, size_t block_size,
+		int num_threads, int queue_depth, uint64_t limit)
+{
+	struct tp_thread *threads;
+	uint64_t num_blocks, per_thread;
+	uint64_t seed = now_us() ^ ((uint64_t)getpid() << 32);
+	int i, ret;
+
+	if (limit && limit < dev_size)
+		dev_size = limit;
+	num_blocks = dev_size / block_size;
+	if (num_blocks < (uint64_t)num_threads) {
+		fprintf(stderr, "Test area too small for %d threads\n",
+				num_threads);
+		return -1;
+	}
+	per_thread = num_blocks / num_threads;
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < num_threads; i++) {
+		threads[i].fd = fd;
+		threads[i].seed = seed;
+		threads[i].block_size = block_size;
+		threads[i].queue_depth = queue_depth;
+		threads[i].first_block = i * per_thread;
+		threads[i].num_blocks = (i == num_threads - 1) ?
+				num_blocks - i * per_thread : per_thread;
+	}
+
+	printf("Testing %" PRIu64 " blocks of %zu bytes with %d threads, "
+			"queue depth %d\n", num_blocks, block_size,
+			num_threads, queue_depth);
+
+	ret = run_pass(threads, num_threads, 1);
+	if (ret == 0)
+		ret = run_pass(threads, num_threads, 0);
+
+	free(threads);
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage: directiotest [-p [-j threads] [-b block_size] "
+			"[-q queue_depth] [-l limit_mb]] blkdev_path\n"
+			"    -p  Throughput mode: write and read back the device "
+			"from several threads\n"
+			"    -j  Number of threads (4)\n"
+			"    -b  Bytes per i/o, a multiple of the sector size "
+			"(65536)\n"
+			"    -q  I/Os in flight per thread (4)\n"
+			"    -l  Only test the first limit_mb MB of the device\n");
+}
+
+int main(int argc, char *argv[])
 {
 	int ret = 1;
 	const char *path;
@@ -178,13 +569,40 @@ int main(int argc, const char *argv[])
 	uint64_t num_blks;
 	size_t test_size;
 	int test_areas, i;
+	int throughput = 0, num_threads = 4, queue_depth = 4;
+	size_t tp_block_size = 65536;
+	uint64_t limit = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "pj:b:q:l:")) != -1) {
+		switch (opt) {
+		case 'p':
+			throughput = 1;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		case 'b':
+			tp_block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		case 'l':
+			limit = strtoull(optarg, NULL, 0) << 20;
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
 
-	if (argc != 2) {
-		printf("Usage: directiotest blkdev_path\n");
+	if (optind != argc - 1 || num_threads <= 0 || queue_depth <= 0) {
+		usage();
 		exit(1);
 	}
 
-	path = argv[1];
+	path = argv[optind];
 	fd = open(path, O_RDWR | O_DIRECT | O_LARGEFILE);
 	if (fd == -1) {
 		perror("open");
@@ -206,6 +624,20 @@ int main(int argc, const char *argv[])
 		perror("ioctl");
 		goto cleanup;
 	}
+
+	if (throughput) {
+		if (tp_block_size < sizeof(struct block_header) ||
+				tp_block_size % blk_size) {
+			fprintf(stderr, "Block size must be a multiple of %d\n",
+					blk_size);
+			goto cleanup;
+		}
+		if (throughput_test(fd, num_blks, tp_block_size, num_threads,
+					queue_depth, limit) == 0)
+			ret = 0;
+		goto cleanup;
+	}
+
 	num_blks /= blk_size;
 
 	test_size = (size_t)blk_size * NUM_TEST_BLKS;
@@ -12,7 +12,8 @@ LOCAL_MODULE_STEM_64:= rand_emmc_perf64
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_PATH := $(local_target_dir)
 LOCAL_FORCE_STATIC_EXECUTABLE := true
-LOCAL_STATIC_LIBRARIES := libm libc
+LOCAL_C_INCLUDES := system/extras/tests/include
+LOCAL_STATIC_LIBRARIES := libtestUtil libm libc
 
 include $(BUILD_EXECUTABLE)
 
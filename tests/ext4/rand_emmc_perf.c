@@ -21,6 +21,7 @@
  */
 
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -30,32 +31,78 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <testPerf.h>
 
 #define TST_BLK_SIZE 4096
 /* Number of seconds to run the test */
 #define TEST_LEN 10
 
-struct stats {
-    struct timeval start;
-    struct timeval end;
-    off64_t offset;
+enum { OP_READ, OP_WRITE, OP_FSYNC, NUM_OPS };
+static const char *op_names[NUM_OPS] = { "read", "write", "fsync" };
+
+struct op_stats {
+    struct testHist hist;
+    unsigned long long bytes;
 };
 
+/* Report of the results in JSON, and the cpu frequencies before the test */
+static const char *json_file;
+static struct testCpuFreq freq_before;
+
 static void usage(void) {
-        fprintf(stderr, "Usage: rand_emmc_perf [ -r | -w ] [-o] [-s count] [-f full_stats_filename] <size_in_mb> <block_dev>\n");
+        fprintf(stderr, "Usage: rand_emmc_perf [ -r | -w ] [-o] [-s count] [-f full_stats_filename] [-j json_file] <size_in_mb> <block_dev>\n");
+        fprintf(stderr, "       rand_emmc_perf -m [-p read_pct] [-b size[:weight],...] [-t threads]\n"
+                        "                      [-y writes_per_fsync] [-d secs] [-i secs] [-o] [-D]\n"
+                        "                      [-j json_file] <size_in_mb> <block_dev>\n"
+                        "  -m  mixed workload: threads issue random reads and writes for -d secs\n"
+                        "      (default 60), printing latency percentiles every -i secs (default 1)\n"
+                        "      and a full summary at the end\n"
+                        "  -p  percentage of reads (default 70)\n"
+                        "  -b  block sizes and their relative weights, with k or m suffixes,\n"
+                        "      multiples of 4k (default 4k)\n"
+                        "  -t  number of threads (default 1)\n"
+                        "  -y  fsync after every N writes of a thread (default 0, never)\n"
+                        "  -D  open the device with O_DIRECT\n"
+                        "  -j  append the latency percentiles of each operation to json_file,\n"
+                        "      in the report format shared with the other tests\n");
         exit(1);
 }
 
-static void print_stats(struct stats *stats_buf, int stats_count,
+/* Appends the operations of stats that were done to the JSON report. */
+static void write_json(const struct op_stats *stats, double seconds) {
+    struct testJson json;
+    FILE *out;
+    int op;
+
+    if (!json_file)
+        return;
+    out = fopen(json_file, "a");
+    if (!out) {
+        fprintf(stderr, "Cannot open %s: %s\n", json_file, strerror(errno));
+        return;
+    }
+    testJsonInit(&json, out);
+    testJsonBeginReport(&json, "rand_emmc_perf", testClockSource(), &freq_before);
+    for (op = 0; op < NUM_OPS; op++) {
+        if (stats[op].hist.count)
+            testJsonResult(&json, op_names[op], &stats[op].hist, stats[op].bytes, seconds);
+    }
+    testJsonEndReport(&json);
+    fclose(out);
+}
+
+static void print_stats(const unsigned long long *durations_ns, int stats_count,
                         char * full_stats_file)
 {
     int i;
-    struct timeval t;
-    struct timeval sum = { 0 };
-    struct timeval max = { 0 };
-    long long total_usecs;
+    long long t;
+    long long total_usecs = 0;
     long long avg_usecs;
-    long long max_usecs;
+    long long max_usecs = 0;
     long long variance = 0;;
     long long x;
     double sdev;
@@ -70,22 +117,20 @@ static void print_stats(struct stats *stats_buf, int stats_count,
     }
 
     for (i = 0; i < stats_count; i++) {
-        timersub(&stats_buf[i].end, &stats_buf[i].start, &t);
-        if (timercmp(&t, &max, >)) {
-            max = t;
+        t = durations_ns[i] / 1000;
+        if (t > max_usecs) {
+            max_usecs = t;
         }
         if (full_stats) {
-            fprintf(full_stats, "%lld\n", (t.tv_sec * 1000000LL) + t.tv_usec);
+            fprintf(full_stats, "%lld\n", t);
         }
-        timeradd(&sum, &t, &sum);
+        total_usecs += t;
     }
 
     if (full_stats) {
         fclose(full_stats);
     }
 
-    max_usecs = (max.tv_sec * 1000000LL) + max.tv_usec;
-    total_usecs = (sum.tv_sec * 1000000LL) + sum.tv_usec;
     avg_usecs = total_usecs / stats_count;
     printf("average random %d byte iop time = %lld usecs\n",
            TST_BLK_SIZE, avg_usecs);
@@ -97,8 +142,7 @@ static void print_stats(struct stats *stats_buf, int stats_count,
      * The formula is sqrt(sum_1_to_n((Xi - avg)^2)/n)
      */
     for (i = 0; i < stats_count; i++) {
-        timersub(&stats_buf[i].end, &stats_buf[i].start, &t);  /* Xi */
-        x = (t.tv_sec * 1000000LL) + t.tv_usec;                /* Convert to long long */
+        x = durations_ns[i] / 1000;                            /* Xi */
         x = x - avg_usecs;                                     /* Xi - avg */
         x = x * x;                                             /* (Xi - avg) ^ 2 */
         variance += x;                                         /* Summation */
@@ -110,18 +154,24 @@ static void print_stats(struct stats *stats_buf, int stats_count,
 static void stats_test(int fd, int write_mode, off64_t max_blocks, int stats_count,
                        char *full_stats_file)
 {
-    struct stats *stats_buf;
+    unsigned long long *durations_ns;
+    struct op_stats *stats;
+    struct op_stats *op;
     char buf[TST_BLK_SIZE] = { 0 };
+    unsigned long long start, test_start;
     int i;
 
-    stats_buf = malloc(stats_count * sizeof(struct stats));
-    if (stats_buf == NULL) {
+    durations_ns = malloc(stats_count * sizeof(*durations_ns));
+    stats = calloc(NUM_OPS, sizeof(struct op_stats));
+    if (durations_ns == NULL || stats == NULL) {
         fprintf(stderr, "Cannot allocate stats_buf\n");
         exit(1);
     }
+    op = &stats[write_mode ? OP_WRITE : OP_READ];
 
+    test_start = testClockTicks();
     for (i = 0; i < stats_count; i++) {
-        gettimeofday(&stats_buf[i].start, NULL);
+        start = testClockTicks();
 
         if (lseek64(fd, (rand() % max_blocks) * TST_BLK_SIZE, SEEK_SET) < 0) {
             fprintf(stderr, "lseek64 failed\n");
@@ -137,22 +187,36 @@ static void stats_test(int fd, int write_mode, off64_t max_blocks, int stats_cou
             }
         }
 
-        gettimeofday(&stats_buf[i].end, NULL);
+        durations_ns[i] = testClockTicksToNs(testClockTicks() - start);
+        testHistAdd(&op->hist, durations_ns[i]);
+        op->bytes += sizeof(buf);
     }
 
-    print_stats(stats_buf, stats_count, full_stats_file);
+    print_stats(durations_ns, stats_count, full_stats_file);
+    write_json(stats, testClockTicksToNs(testClockTicks() - test_start) / 1e9);
+    free(durations_ns);
+    free(stats);
 }
 
 static void perf_test(int fd, int write_mode, off64_t max_blocks)
 {
     struct timeval start, end, res;
     char buf[TST_BLK_SIZE] = { 0 };
+    struct op_stats *stats = calloc(NUM_OPS, sizeof(struct op_stats));
+    struct op_stats *op = &stats[write_mode ? OP_WRITE : OP_READ];
+    unsigned long long op_start;
     long long iops = 0;
     int msecs;
 
+    if (!stats) {
+        fprintf(stderr, "Cannot allocate the stats\n");
+        exit(1);
+    }
+
     res.tv_sec = 0;
     gettimeofday(&start, NULL);
     while (res.tv_sec < TEST_LEN) {
+        op_start = testClockTicks();
         if (lseek64(fd, (rand() % max_blocks) * TST_BLK_SIZE, SEEK_SET) < 0) {
             fprintf(stderr, "lseek64 failed\n");
         }
@@ -165,6 +229,8 @@ static void perf_test(int fd, int write_mode, off64_t max_blocks)
                 fprintf(stderr, "Short read\n");
             }
         }
+        testHistAdd(&op->hist, testClockTicksToNs(testClockTicks() - op_start));
+        op->bytes += sizeof(buf);
         iops++;
         gettimeofday(&end, NULL);
         timersub(&end, &start, &res);
@@ -178,6 +244,261 @@ static void perf_test(int fd, int write_mode, off64_t max_blocks)
 
     msecs = (res.tv_sec * 1000) + (res.tv_usec / 1000);
     printf("%.0f %dbyte iops/sec\n", (float)iops * 1000 / msecs, TST_BLK_SIZE);
+    write_json(stats, msecs / 1000.0);
+    free(stats);
+}
+
+/*
+ * Mixed workload. The latencies go in the log-linear histograms of
+ * libtestUtil, in nanoseconds, and are printed in usecs.
+ */
+#define MAX_THREADS 64
+#define MAX_BLOCK_SIZES 8
+#define MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+struct mixed_config {
+    int fd;
+    off64_t max_blocks;
+    int read_pct;
+    int num_sizes;
+    int sizes[MAX_BLOCK_SIZES];
+    int weights[MAX_BLOCK_SIZES];  /* cumulative */
+    int max_size;
+    int fsync_every;
+};
+
+struct worker {
+    pthread_t thread;
+    const struct mixed_config *config;
+    unsigned int seed;
+    /* Taken by the worker for each update and by the main thread to collect
+     * the interval, so it is almost never contended. */
+    pthread_mutex_t lock;
+    struct op_stats interval[NUM_OPS];
+    unsigned long long errors;
+};
+
+static volatile int mixed_stop;
+
+static unsigned long long now_usecs(void) {
+    return testClockNs() / 1000;
+}
+
+static void record(struct worker *w, int op, unsigned long long start_ticks, int bytes) {
+    unsigned long long ns = testClockTicksToNs(testClockTicks() - start_ticks);
+
+    pthread_mutex_lock(&w->lock);
+    testHistAdd(&w->interval[op].hist, ns);
+    w->interval[op].bytes += bytes;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void *mixed_worker(void *arg) {
+    struct worker *w = arg;
+    const struct mixed_config *c = w->config;
+    char *buf;
+    int writes = 0;
+    int i;
+
+    if (posix_memalign((void **)&buf, TST_BLK_SIZE, c->max_size)) {
+        fprintf(stderr, "Cannot allocate the I/O buffer\n");
+        exit(1);
+    }
+    /* Random data, so that compressing or deduplicating parts write it all. */
+    for (i = 0; i < c->max_size; i++)
+        buf[i] = rand_r(&w->seed);
+
+    while (!mixed_stop) {
+        int pick = rand_r(&w->seed) % c->weights[c->num_sizes - 1];
+        int size, op;
+        off64_t blocks, offset;
+        unsigned long long start;
+        ssize_t ret;
+
+        for (i = 0; pick >= c->weights[i]; i++)
+            ;
+        size = c->sizes[i];
+        blocks = c->max_blocks - size / TST_BLK_SIZE + 1;
+        offset = ((((off64_t)rand_r(&w->seed) << 31) | rand_r(&w->seed)) % blocks) * TST_BLK_SIZE;
+        op = (rand_r(&w->seed) % 100) < c->read_pct ? OP_READ : OP_WRITE;
+
+        start = testClockTicks();
+        if (op == OP_READ)
+            ret = pread64(c->fd, buf, size, offset);
+        else
+            ret = pwrite64(c->fd, buf, size, offset);
+        if (ret != size) {
+            __sync_fetch_and_add(&w->errors, 1);
+            continue;
+        }
+        record(w, op, start, size);
+
+        if (op == OP_WRITE && c->fsync_every && ++writes % c->fsync_every == 0) {
+            start = testClockTicks();
+            if (fsync(c->fd))
+                __sync_fetch_and_add(&w->errors, 1);
+            else
+                record(w, OP_FSYNC, start, 0);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Parses "4k:80,64k:15,1m:5" into the sizes and cumulative weights. */
+static int parse_block_sizes(const char *arg, struct mixed_config *c) {
+    char *copy = strdup(arg);
+    char *saveptr = NULL;
+    char *tok;
+    int total = 0;
+
+    c->num_sizes = 0;
+    c->max_size = 0;
+    for (tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *end;
+        long size = strtol(tok, &end, 10);
+        long weight = 1;
+
+        if (*end == 'k' || *end == 'K') {
+            size *= 1024;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            size *= 1024 * 1024;
+            end++;
+        }
+        if (*end == ':')
+            weight = strtol(end + 1, &end, 10);
+        if (*end || size <= 0 || size % TST_BLK_SIZE || size > MAX_BLOCK_SIZE ||
+            weight <= 0 || weight > 1000000 || c->num_sizes == MAX_BLOCK_SIZES) {
+            fprintf(stderr, "Invalid block size %s\n", tok);
+            free(copy);
+            return -1;
+        }
+        total += weight;
+        c->sizes[c->num_sizes] = size;
+        c->weights[c->num_sizes++] = total;
+        if (size > c->max_size)
+            c->max_size = size;
+    }
+    free(copy);
+    return c->num_sizes ? 0 : -1;
+}
+
+static void print_interval(unsigned long long elapsed_usecs, unsigned long long interval_usecs,
+                           const struct op_stats *stats) {
+    int op;
+
+    printf("%7.1f", elapsed_usecs / 1000000.0);
+    for (op = 0; op < NUM_OPS; op++) {
+        const struct testHist *h = &stats[op].hist;
+        printf(" | %7.0f", h->count * 1000000.0 / interval_usecs);
+        if (op != OP_FSYNC)
+            printf(" %7.1f", stats[op].bytes * 1000000.0 / interval_usecs / (1024 * 1024));
+        printf(" %7llu %7llu %8llu", (unsigned long long)testHistPercentile(h, 0.5) / 1000,
+               (unsigned long long)testHistPercentile(h, 0.99) / 1000,
+               (unsigned long long)h->max / 1000);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void print_summary(unsigned long long elapsed_usecs, const struct op_stats *stats) {
+    static const double fractions[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    int op;
+    size_t i;
+
+    printf("\n%-5s %10s %8s %8s %8s %8s %8s %8s %8s %8s %9s\n", "op", "count", "iops", "MB/s",
+           "avg", "p50", "p90", "p99", "p99.9", "p99.99", "max usecs");
+    for (op = 0; op < NUM_OPS; op++) {
+        const struct testHist *h = &stats[op].hist;
+        if (!h->count)
+            continue;
+        printf("%-5s %10llu %8.0f %8.1f %8llu", op_names[op], (unsigned long long)h->count,
+               h->count * 1000000.0 / elapsed_usecs,
+               stats[op].bytes * 1000000.0 / elapsed_usecs / (1024 * 1024),
+               (unsigned long long)testHistMean(h) / 1000);
+        for (i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++)
+            printf(" %8llu", (unsigned long long)testHistPercentile(h, fractions[i]) / 1000);
+        printf(" %9llu\n", (unsigned long long)h->max / 1000);
+    }
+}
+
+/* Runs the workers for duration secs, collecting their histograms every
+ * interval secs so that a stall shows up in the interval it happened. */
+static void mixed_test(struct mixed_config *config, int num_threads, int duration, int interval)
+{
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+    struct op_stats *totals = calloc(NUM_OPS, sizeof(struct op_stats));
+    struct op_stats *current = calloc(NUM_OPS, sizeof(struct op_stats));
+    unsigned long long start, last, now, end;
+    unsigned long long errors = 0;
+    int i, op;
+
+    if (!workers || !totals || !current) {
+        fprintf(stderr, "Cannot allocate the workers\n");
+        exit(1);
+    }
+
+    printf("%7s | %7s %7s %7s %7s %8s | %7s %7s %7s %7s %8s | %7s %7s %7s %8s\n", "secs",
+           "r iops", "r MB/s", "r p50", "r p99", "r max", "w iops", "w MB/s", "w p50", "w p99",
+           "w max", "fsyncs", "f p50", "f p99", "f max");
+
+    start = last = now_usecs();
+    end = start + duration * 1000000ULL;
+    for (i = 0; i < num_threads; i++) {
+        workers[i].config = config;
+        workers[i].seed = rand();
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (pthread_create(&workers[i].thread, NULL, mixed_worker, &workers[i])) {
+            fprintf(stderr, "Cannot create thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    do {
+        unsigned long long next = last + interval * 1000000ULL;
+        struct timespec ts;
+
+        if (next > end)
+            next = end;
+        while ((now = now_usecs()) < next) {
+            ts.tv_sec = (next - now) / 1000000;
+            ts.tv_nsec = (next - now) % 1000000 * 1000;
+            nanosleep(&ts, NULL);
+        }
+
+        memset(current, 0, NUM_OPS * sizeof(struct op_stats));
+        for (i = 0; i < num_threads; i++) {
+            pthread_mutex_lock(&workers[i].lock);
+            for (op = 0; op < NUM_OPS; op++) {
+                testHistMerge(&current[op].hist, &workers[i].interval[op].hist);
+                current[op].bytes += workers[i].interval[op].bytes;
+            }
+            memset(workers[i].interval, 0, sizeof(workers[i].interval));
+            pthread_mutex_unlock(&workers[i].lock);
+        }
+        print_interval(now - start, now - last, current);
+        for (op = 0; op < NUM_OPS; op++) {
+            testHistMerge(&totals[op].hist, &current[op].hist);
+            totals[op].bytes += current[op].bytes;
+        }
+        last = now;
+    } while (now < end);
+
+    mixed_stop = 1;
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        errors += workers[i].errors;
+    }
+
+    print_summary(now - start, totals);
+    write_json(totals, (now - start) / 1e6);
+    if (errors)
+        printf("%llu failed or short I/Os\n", errors);
+    free(workers);
+    free(totals);
+    free(current);
 }
 
 int main(int argc, char *argv[])
@@ -187,12 +508,19 @@ int main(int argc, char *argv[])
     int o_sync = 0;
     int stats_mode = 0;
     int stats_count;
+    int mixed_mode = 0;
+    int o_direct = 0;
+    int num_threads = 1;
+    int duration = 60;
+    int interval = 1;
+    struct mixed_config mixed = { .read_pct = 70, .num_sizes = 1, .sizes = { TST_BLK_SIZE },
+                                  .weights = { 1 }, .max_size = TST_BLK_SIZE };
     char *full_stats_file = NULL;
     off64_t max_blocks;
     unsigned int seed;
     int c;
 
-    while ((c = getopt(argc, argv, "+rwos:f:")) != -1) {
+    while ((c = getopt(argc, argv, "+rwos:f:j:mp:b:t:y:d:i:D")) != -1) {
         switch (c) {
           case '?':
           default:
@@ -222,10 +550,58 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Cannot get full stats filename\n");
             }
             break;
+
+          case 'j':
+            json_file = optarg;
+            break;
+
+          case 'm':
+            mixed_mode = 1;
+            break;
+
+          case 'p':
+            mixed.read_pct = atoi(optarg);
+            if (mixed.read_pct < 0 || mixed.read_pct > 100) {
+                usage();
+            }
+            break;
+
+          case 'b':
+            if (parse_block_sizes(optarg, &mixed)) {
+                usage();
+            }
+            break;
+
+          case 't':
+            num_threads = atoi(optarg);
+            if (num_threads < 1 || num_threads > MAX_THREADS) {
+                usage();
+            }
+            break;
+
+          case 'y':
+            mixed.fsync_every = atoi(optarg);
+            break;
+
+          case 'd':
+            duration = atoi(optarg);
+            break;
+
+          case 'i':
+            interval = atoi(optarg);
+            break;
+
+          case 'D':
+            o_direct = O_DIRECT;
+            break;
         }
     }
 
-    if (o_sync && !write_mode) {
+    if (mixed_mode && (duration <= 0 || interval <= 0 || mixed.fsync_every < 0)) {
+        usage();
+    }
+
+    if (o_sync && !write_mode && !mixed_mode) {
         /* Can only specify o_sync in write mode.  Probably doesn't matter,
          * but clear o_sync if in read mode */
         o_sync = 0;
@@ -238,7 +614,7 @@ int main(int argc, char *argv[])
     /* Size is given in megabytes, so compute the number of TST_BLK_SIZE blocks. */
     max_blocks = atoll(argv[optind]) * ((1024*1024) / TST_BLK_SIZE);
 
-    if ((fd = open(argv[optind + 1], O_RDWR | o_sync)) < 0) {
+    if ((fd = open(argv[optind + 1], O_RDWR | o_sync | o_direct)) < 0) {
         fprintf(stderr, "Cannot open block device %s\n", argv[optind + 1]);
         exit(1);
     }
@@ -253,7 +629,18 @@ int main(int argc, char *argv[])
     close(fd2);
     srand(seed);
 
-    if (stats_mode) {
+    testClockCalibrate();
+    testCpuFreqSnapshot(&freq_before);
+
+    if (mixed_mode) {
+        if (max_blocks < mixed.max_size / TST_BLK_SIZE) {
+            fprintf(stderr, "The test area is smaller than the largest block size\n");
+            exit(1);
+        }
+        mixed.fd = fd;
+        mixed.max_blocks = max_blocks;
+        mixed_test(&mixed, num_threads, duration, interval);
+    } else if (stats_mode) {
         stats_test(fd, write_mode, max_blocks, stats_count, full_stats_file);
     } else {
         perf_test(fd, write_mode, max_blocks);
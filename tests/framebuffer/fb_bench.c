@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Framebuffer benchmark, for the path recovery, charger and the boot
+ * animation draw through: the sustained rate at which the cpu fills the
+ * framebuffer memory, and the jitter of the vsyncs and the frames missed
+ * when flipping between two buffers, optionally under cpu and memory load.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
+#define MAX_LOAD_THREADS 32
+#define LOAD_BUFFER_SIZE (16 << 20)
+
+struct fb {
+    int fd;
+    struct fb_fix_screeninfo fix;
+    struct fb_var_screeninfo var;
+    uint8_t *mem;
+    size_t frame_size;      /* bytes of one visible buffer */
+    int buffers;            /* 2 if the virtual screen holds two */
+};
+
+typedef void (*fill_func)(void *dst, size_t len, uint32_t value);
+
+static volatile int load_stop;
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int open_fb(struct fb *fb)
+{
+    static const char *const names[] = { "/dev/graphics/fb0", "/dev/fb0", NULL };
+    int i;
+
+    fb->fd = -1;
+    for (i = 0; fb->fd < 0 && names[i]; i++)
+        fb->fd = open(names[i], O_RDWR);
+    if (fb->fd < 0) {
+        perror("cannot open the framebuffer");
+        return -1;
+    }
+    if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->fix) < 0 ||
+            ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->var) < 0) {
+        perror("cannot get the framebuffer info");
+        return -1;
+    }
+
+    fb->frame_size = (size_t)fb->fix.line_length * fb->var.yres;
+    fb->buffers = (fb->var.yres_virtual >= fb->var.yres * 2 &&
+                   fb->fix.smem_len >= fb->frame_size * 2) ? 2 : 1;
+    fb->mem = mmap(NULL, fb->fix.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+    if (fb->mem == MAP_FAILED) {
+        perror("cannot map the framebuffer");
+        return -1;
+    }
+    return 0;
+}
+
+/* The refresh period from the timings, or 0 if the driver doesn't give them. */
+static int64_t timing_period_ns(const struct fb_var_screeninfo *var)
+{
+    uint64_t pixels = (uint64_t)(var->upper_margin + var->lower_margin + var->vsync_len +
+                                 var->yres) *
+                      (var->left_margin + var->right_margin + var->hsync_len + var->xres);
+
+    /* pixclock is in ps */
+    return (int64_t)(pixels * var->pixclock / 1000);
+}
+
+static void fill_memset(void *dst, size_t len, uint32_t value)
+{
+    memset(dst, value & 0xff, len);
+}
+
+static void fill_words(void *dst, size_t len, uint32_t value)
+{
+    uint32_t *p = dst;
+    size_t i, n = len / 4;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        p[i] = value;
+        p[i + 1] = value;
+        p[i + 2] = value;
+        p[i + 3] = value;
+    }
+    for (; i < n; i++)
+        p[i] = value;
+}
+
+#ifdef HAVE_NEON
+/* 64 bytes a store group, like the pixelflinger and recovery fills */
+static void fill_neon(void *dst, size_t len, uint32_t value)
+{
+    uint32x4_t v = vdupq_n_u32(value);
+    uint32_t *p = dst;
+    size_t i, n = len / 4;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        vst1q_u32(p + i, v);
+        vst1q_u32(p + i + 4, v);
+        vst1q_u32(p + i + 8, v);
+        vst1q_u32(p + i + 12, v);
+    }
+    for (; i < n; i++)
+        p[i] = value;
+}
+#endif
+
+/* Fills dst again and again for the given time, returning MB/s. */
+static double fill_rate(fill_func fill, void *dst, size_t len, int64_t duration_ns)
+{
+    int64_t start = now_ns(), elapsed;
+    uint64_t bytes = 0;
+    uint32_t value = 0;
+
+    do {
+        fill(dst, len, value);
+        value += 0x01010101;
+        bytes += len;
+        elapsed = now_ns() - start;
+    } while (elapsed < duration_ns);
+
+    return bytes / (elapsed / 1e9) / (1 << 20);
+}
+
+static void fill_bench(struct fb *fb, int seconds)
+{
+    static const struct {
+        const char *name;
+        fill_func fill;
+    } fills[] = {
+        { "memset", fill_memset },
+        { "words", fill_words },
+#ifdef HAVE_NEON
+        { "neon", fill_neon },
+#endif
+    };
+    int64_t duration = (int64_t)seconds * 1000000000LL;
+    uint8_t *ram = malloc(fb->frame_size);
+    size_t i;
+
+    printf("%-8s\t%12s\t%12s\t%10s\n", "[fill]", "[fb MB/s]", "[ram MB/s]", "[fb fps]");
+    for (i = 0; i < sizeof(fills) / sizeof(fills[0]); i++) {
+        double fb_rate = fill_rate(fills[i].fill, fb->mem, fb->frame_size, duration);
+        double ram_rate = ram ? fill_rate(fills[i].fill, ram, fb->frame_size, duration) : 0;
+
+        printf("%-8s\t%12.1f\t%12.1f\t%10.1f\n", fills[i].name, fb_rate, ram_rate,
+               fb_rate * (1 << 20) / fb->frame_size);
+    }
+    free(ram);
+}
+
+/* Keeps a cpu and the memory bus busy, copying between two large buffers. */
+static void *load_main(void *arg)
+{
+    uint8_t *a = malloc(LOAD_BUFFER_SIZE), *b = malloc(LOAD_BUFFER_SIZE);
+
+    (void)arg;
+    if (!a || !b)
+        goto out;
+    memset(a, 1, LOAD_BUFFER_SIZE);
+    while (!load_stop) {
+        memcpy(b, a, LOAD_BUFFER_SIZE);
+        memcpy(a, b, LOAD_BUFFER_SIZE);
+    }
+out:
+    free(a);
+    free(b);
+    return NULL;
+}
+
+/* Waits for the next vsync, by waiting for it or by flipping buffers. */
+static int next_frame(struct fb *fb, int use_wait, int frame)
+{
+    if (use_wait) {
+        __u32 crtc = 0;
+        return ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc);
+    }
+    fb->var.yoffset = (frame % fb->buffers) * fb->var.yres;
+    fb->var.activate = FB_ACTIVATE_VBL;
+    return ioctl(fb->fd, FBIOPAN_DISPLAY, &fb->var);
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int vsync_bench(struct fb *fb, int frames, int load_threads, int draw)
+{
+    pthread_t threads[MAX_LOAD_THREADS];
+    int64_t *intervals = malloc(sizeof(*intervals) * frames);
+    int64_t *jitter = malloc(sizeof(*jitter) * frames);
+    int64_t period, last;
+    int use_wait, started = 0, missed = 0;
+    int i;
+
+    if (!intervals || !jitter)
+        return -1;
+
+    /* FBIO_WAITFORVSYNC times the display alone; without it, the pan
+     * ioctl blocking until the vsync does */
+    use_wait = next_frame(fb, 1, 0) == 0;
+    if (!use_wait && next_frame(fb, 0, 0) != 0) {
+        perror("neither FBIO_WAITFORVSYNC nor FBIOPAN_DISPLAY work");
+        return -1;
+    }
+
+    load_stop = 0;
+    for (i = 0; i < load_threads && i < MAX_LOAD_THREADS; i++) {
+        if (pthread_create(&threads[started], NULL, load_main, NULL) == 0)
+            started++;
+    }
+
+    last = now_ns();
+    for (i = 0; i < frames; i++) {
+        int64_t now;
+
+        if (draw) {
+            /* draw the buffer shown next, as a ui would */
+            uint8_t *back = fb->mem + ((i + 1) % fb->buffers) * fb->frame_size;
+            memset(back, i & 0xff, fb->frame_size);
+        }
+        if (next_frame(fb, use_wait, i + 1) != 0) {
+            perror("vsync wait failed");
+            break;
+        }
+        now = now_ns();
+        intervals[i] = now - last;
+        last = now;
+    }
+    frames = i;
+
+    load_stop = 1;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (frames == 0)
+        return -1;
+
+    /* the median interval is the period actually running, if the timings
+     * aren't there or are wrong */
+    memcpy(jitter, intervals, sizeof(*jitter) * frames);
+    qsort(jitter, frames, sizeof(*jitter), compare_i64);
+    period = timing_period_ns(&fb->var);
+    if (period <= 0 || period > jitter[frames / 2] * 3 / 2 || period < jitter[frames / 2] * 2 / 3)
+        period = jitter[frames / 2];
+
+    for (i = 0; i < frames; i++) {
+        int64_t d = intervals[i] - period;
+
+        /* an interval of n periods and more means n - 1 vsyncs were missed */
+        if (intervals[i] > period * 3 / 2)
+            missed += (int)((intervals[i] + period / 2) / period) - 1;
+        jitter[i] = d < 0 ? -d : d;
+    }
+    qsort(jitter, frames, sizeof(*jitter), compare_i64);
+
+    printf("%d frames by %s, %d buffers, %d load threads%s\n", frames,
+           use_wait ? "FBIO_WAITFORVSYNC" : "FBIOPAN_DISPLAY", fb->buffers, started,
+           draw ? ", drawing each frame" : "");
+    printf("period %.3f ms (%.2f Hz), jitter p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+           "max %.1f us, %d missed frames\n",
+           period / 1e6, 1e9 / period, jitter[(frames - 1) / 2] / 1e3,
+           jitter[(frames - 1) * 90 / 100] / 1e3, jitter[(frames - 1) * 99 / 100] / 1e3,
+           jitter[frames - 1] / 1e3, missed);
+
+    free(intervals);
+    free(jitter);
+    return missed ? 2 : 0;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-F] [-V] [-t seconds] [-n frames] [-l threads] [-d]\n"
+            "    -F  Only measure the fill rate, for -t seconds per fill (2).\n"
+            "    -V  Only measure the vsyncs, over -n frames (600).\n"
+            "    -l  Threads copying memory during the vsyncs (0).\n"
+            "    -d  Fill the back buffer before each flip.\n",
+            cmd);
+}
+
+int main(int argc, char **argv)
+{
+    struct fb fb;
+    int fill = 1, vsync = 1;
+    int seconds = 2, frames = 600, load_threads = 0, draw = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "FVt:n:l:d")) != -1) {
+        switch (opt) {
+        case 'F': vsync = 0; break;
+        case 'V': fill = 0; break;
+        case 't': seconds = atoi(optarg); break;
+        case 'n': frames = atoi(optarg); break;
+        case 'l': load_threads = atoi(optarg); break;
+        case 'd': draw = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((!fill && !vsync) || seconds <= 0 || frames <= 0 || load_threads < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (open_fb(&fb) != 0)
+        return 1;
+    printf("%s: %ux%u, %u bpp, stride %u bytes\n", fb.fix.id, fb.var.xres, fb.var.yres,
+           fb.var.bits_per_pixel, fb.fix.line_length);
+
+    if (fill)
+        fill_bench(&fb, seconds);
+    if (vsync) {
+        int ret = vsync_bench(&fb, frames, load_threads, draw);
+        return ret < 0 ? 1 : ret;
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 # Copyright 2006 The Android Open Source Project
-ifeq ($(TARGET_ARCH),arm)
 LOCAL_PATH:= $(call my-dir)
+
+ifeq ($(TARGET_ARCH),arm)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= icache_main.c icache.S icache2.S
@@ -13,3 +14,15 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_EXECUTABLE)
 endif
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= icache_gen.c
+
+LOCAL_MODULE:= icachegen
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_MODULE_TARGET_ARCH := arm arm64 x86 x86_64
+
+include $(BUILD_EXECUTABLE)
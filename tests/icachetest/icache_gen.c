@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Instruction fetch benchmark. Unlike icache.S, whose loop has a fixed
+ * shape, the code is generated at run time: a chain of blocks covering a
+ * given footprint, each block made of cheap instructions and ending with a
+ * taken branch to the next block. Timing the chain as the footprint grows
+ * shows where the i-cache and iTLB stop holding it.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Every instruction but the branches is 4 bytes long, on x86 too. */
+#define INSN_SIZE 4
+
+struct code {
+    uint8_t *base;
+    size_t pos;
+};
+
+static void put32(struct code *c, uint32_t word)
+{
+    memcpy(c->base + c->pos, &word, sizeof(word));
+    c->pos += sizeof(word);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define BRANCH_SIZE 5
+
+static void put8(struct code *c, uint8_t byte)
+{
+    c->base[c->pos++] = byte;
+}
+
+static void emit_filler(struct code *c)
+{
+    /* nopl 0x0(%eax) */
+    put32(c, 0x00401f0f);
+}
+
+static void emit_pad(struct code *c, size_t len)
+{
+    /* int3, never executed */
+    memset(c->base + c->pos, 0xcc, len);
+    c->pos += len;
+}
+
+static void emit_branch(struct code *c, size_t target)
+{
+    /* jmp rel32 */
+    put8(c, 0xe9);
+    put32(c, (uint32_t)(target - (c->pos + 4)));
+}
+
+/* Puts the iteration count in ecx/rdi. */
+static void emit_prologue(struct code *c)
+{
+#if defined(__i386__)
+    /* mov 4(%esp), %ecx */
+    put32(c, 0x04244c8b);
+#else
+    (void)c;
+#endif
+}
+
+/* Decrements the iteration count, and branches back to loop_start until it
+ * is zero. */
+static void emit_loop_end(struct code *c, size_t loop_start)
+{
+#if defined(__i386__)
+    /* dec %ecx */
+    put8(c, 0x49);
+#else
+    /* dec %rdi */
+    put8(c, 0x48);
+    put8(c, 0xff);
+    put8(c, 0xcf);
+#endif
+    /* jnz rel32 */
+    put8(c, 0x0f);
+    put8(c, 0x85);
+    put32(c, (uint32_t)(loop_start - (c->pos + 4)));
+    /* ret */
+    put8(c, 0xc3);
+}
+
+#elif defined(__aarch64__)
+
+#define BRANCH_SIZE 4
+
+static void emit_filler(struct code *c)
+{
+    /* nop */
+    put32(c, 0xd503201f);
+}
+
+static void emit_pad(struct code *c, size_t len)
+{
+    for (; len >= INSN_SIZE; len -= INSN_SIZE)
+        emit_filler(c);
+}
+
+static void emit_branch(struct code *c, size_t target)
+{
+    /* b, +-128MB */
+    put32(c, 0x14000000 | (((target - c->pos) >> 2) & 0x3ffffff));
+}
+
+static void emit_prologue(struct code *c)
+{
+    (void)c;
+}
+
+static void emit_loop_end(struct code *c, size_t loop_start)
+{
+    /* subs x0, x0, #1 */
+    put32(c, 0xf1000400);
+    /* b.eq over the next branch, as b.ne can't reach past 1MB */
+    put32(c, 0x54000000 | (2 << 5));
+    emit_branch(c, loop_start);
+    /* ret */
+    put32(c, 0xd65f03c0);
+}
+
+#elif defined(__arm__)
+
+#define BRANCH_SIZE 4
+
+static void emit_filler(struct code *c)
+{
+    /* mov r0, r0, the filler of icache.S */
+    put32(c, 0xe1a00000);
+}
+
+static void emit_pad(struct code *c, size_t len)
+{
+    for (; len >= INSN_SIZE; len -= INSN_SIZE)
+        emit_filler(c);
+}
+
+static void emit_cond_branch(struct code *c, uint32_t cond, size_t target)
+{
+    /* b<cond>, +-32MB, relative to the branch + 8 */
+    put32(c, (cond << 28) | 0x0a000000 |
+             (((target - c->pos - 8) >> 2) & 0xffffff));
+}
+
+static void emit_branch(struct code *c, size_t target)
+{
+    emit_cond_branch(c, 0xe, target);
+}
+
+static void emit_prologue(struct code *c)
+{
+    (void)c;
+}
+
+static void emit_loop_end(struct code *c, size_t loop_start)
+{
+    /* subs r0, r0, #1 */
+    put32(c, 0xe2500001);
+    /* bne */
+    emit_cond_branch(c, 0x1, loop_start);
+    /* bx lr */
+    put32(c, 0xe12fff1e);
+}
+
+#else
+#error "icachegen doesn't know the instructions of this architecture"
+#endif
+
+/* Largest prologue or loop end, plus the branch to the first block. */
+#define OVERHEAD_SIZE 64
+
+typedef void (*chain_func)(long iterations);
+
+struct chain {
+    void *mem;
+    size_t mem_size;
+    chain_func func;
+    size_t blocks;
+};
+
+/*
+ * Generates a function running `iterations` times through a chain of
+ * blocks of `footprint` bytes in total. Each block has insns_per_branch
+ * instructions, the last one being the branch to the next block, and
+ * starts on an `align` boundary. With `shuffle`, the blocks are visited in
+ * a random order rather than in address order, so that each branch goes to
+ * a different cache line and page than the next one in memory.
+ */
+static int make_chain(struct chain *ch, size_t footprint,
+                      size_t insns_per_branch, size_t align, int shuffle)
+{
+    struct code c;
+    size_t block_size, first, loop_start, i;
+    size_t *order;
+
+    block_size = (insns_per_branch - 1) * INSN_SIZE + BRANCH_SIZE;
+    block_size = (block_size + align - 1) & ~(align - 1);
+
+    ch->blocks = footprint / block_size;
+    if (ch->blocks == 0)
+        ch->blocks = 1;
+
+    order = malloc(ch->blocks * sizeof(*order));
+    if (!order)
+        return -1;
+    for (i = 0; i < ch->blocks; i++)
+        order[i] = i;
+    if (shuffle) {
+        for (i = ch->blocks - 1; i > 0; i--) {
+            size_t j = (size_t)rand() % (i + 1);
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+
+    ch->mem_size = ch->blocks * block_size + OVERHEAD_SIZE + align;
+    ch->mem = mmap(NULL, ch->mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ch->mem == MAP_FAILED) {
+        free(order);
+        return -1;
+    }
+
+    /* prologue, then each iteration jumps to the first block, and the last
+     * block jumps to the loop end placed after all blocks */
+    c.base = ch->mem;
+    c.pos = 0;
+    emit_prologue(&c);
+    loop_start = c.pos;
+    first = (loop_start + BRANCH_SIZE + align - 1) & ~(align - 1);
+    emit_branch(&c, first + order[0] * block_size);
+    emit_pad(&c, first - c.pos);
+
+    for (i = 0; i < ch->blocks; i++) {
+        size_t k, next;
+
+        c.pos = first + order[i] * block_size;
+        for (k = 0; k + 1 < insns_per_branch; k++)
+            emit_filler(&c);
+        next = (i + 1 < ch->blocks) ? first + order[i + 1] * block_size
+                                    : first + ch->blocks * block_size;
+        emit_branch(&c, next);
+        emit_pad(&c, first + (order[i] + 1) * block_size - c.pos);
+    }
+
+    c.pos = first + ch->blocks * block_size;
+    emit_loop_end(&c, loop_start);
+    free(order);
+
+    __builtin___clear_cache((char *)ch->mem, (char *)ch->mem + c.pos);
+    if (mprotect(ch->mem, ch->mem_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(ch->mem, ch->mem_size);
+        return -1;
+    }
+
+    ch->func = (chain_func)ch->mem;
+    return 0;
+}
+
+static void free_chain(struct chain *ch)
+{
+    munmap(ch->mem, ch->mem_size);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t size = strtoul(arg, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+        size <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20;
+    return size;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-s min] [-S max] [-b insns] [-a align] [-r] [-n insns]\n"
+            "    -s  Smallest code footprint, in bytes, or with a K or M suffix\n"
+            "        (1K).\n"
+            "    -S  Largest code footprint, doubled from the smallest (16M).\n"
+            "    -b  Instructions per taken branch, including the branch (8).\n"
+            "    -a  Alignment of the branch targets, a power of two (%d).\n"
+            "    -r  Visit the blocks in a random order instead of in address\n"
+            "        order, defeating sequential prefetching.\n"
+            "    -n  Instructions to run per footprint (256M).\n",
+            cmd, INSN_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t min_footprint = 1 << 10, max_footprint = 16 << 20;
+    size_t insns_per_branch = 8, align = INSN_SIZE;
+    size_t insns_per_run = 256 << 20;
+    size_t footprint;
+    int shuffle = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:S:b:a:rn:")) != -1) {
+        switch (opt) {
+        case 's': min_footprint = parse_size(optarg); break;
+        case 'S': max_footprint = parse_size(optarg); break;
+        case 'b': insns_per_branch = strtoul(optarg, NULL, 0); break;
+        case 'a': align = strtoul(optarg, NULL, 0); break;
+        case 'r': shuffle = 1; break;
+        case 'n': insns_per_run = parse_size(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (min_footprint == 0 || max_footprint < min_footprint ||
+            insns_per_branch == 0 || align < INSN_SIZE ||
+            (align & (align - 1)) != 0 || insns_per_run == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("# %zu instructions per branch, %zu byte alignment, %s order\n",
+           insns_per_branch, align, shuffle ? "random" : "address");
+    printf("%10s\t%8s\t%10s\t%10s\n",
+           "[bytes]", "[blocks]", "[ns/insn]", "[ns/branch]");
+
+    for (footprint = min_footprint; footprint <= max_footprint;
+            footprint *= 2) {
+        struct chain ch;
+        size_t insns_per_iteration;
+        long iterations;
+        double start, ns;
+
+        if (make_chain(&ch, footprint, insns_per_branch, align, shuffle)) {
+            fprintf(stderr, "Unable to generate %zu bytes of code: %s\n",
+                    footprint, strerror(errno));
+            return 1;
+        }
+
+        insns_per_iteration = ch.blocks * insns_per_branch;
+        iterations = insns_per_run / insns_per_iteration;
+        if (iterations < 2)
+            iterations = 2;
+
+        /* once to fault the code in and warm up the caches */
+        ch.func(1);
+
+        start = now_ns();
+        ch.func(iterations);
+        ns = now_ns() - start;
+
+        printf("%10zu\t%8zu\t%10.3f\t%10.3f\n", footprint, ch.blocks,
+               ns / ((double)iterations * insns_per_iteration),
+               ns / ((double)iterations * ch.blocks));
+        fflush(stdout);
+
+        free_chain(&ch);
+    }
+
+    return 0;
+}
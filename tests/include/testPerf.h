@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _TESTPERF_H_
+#define _TESTPERF_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/cdefs.h>
+#include <time.h>
+
+__BEGIN_DECLS
+
+// Clock
+//
+// testClockTicks reads the cpu's counter (cntvct on arm64, the TSC on x86)
+// without a system call, and testClockTicksToNs converts a number of ticks
+// to nanoseconds. Other architectures use CLOCK_MONOTONIC, with a tick per
+// nanosecond. testClockCalibrate must be called once before converting;
+// on x86 it measures the TSC against CLOCK_MONOTONIC for about 20ms.
+void testClockCalibrate(void);
+uint64_t testClockTicksToNs(uint64_t ticks);
+uint64_t testClockNs(void);
+const char *testClockSource(void);
+
+static inline uint64_t testClockTicks(void)
+{
+#if defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (ticks) : : "memory");
+    return ticks;
+#elif defined(__i386__) || defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("lfence; rdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+    return ((uint64_t) hi << 32) | lo;
+#else
+    return testClockNs();
+#endif
+}
+
+// Latency Histograms
+//
+// Values below TEST_HIST_SUB_BUCKETS have a bucket each, and every power of
+// two above is split in TEST_HIST_SUB_BUCKETS buckets, so percentiles are
+// within 7%. Values are expected in nanoseconds; 2^TEST_HIST_MAX_EXPONENT ns
+// (about 5 hours) and more share the last bucket. A zeroed histogram is
+// empty, and histograms of different threads or processes can be merged.
+#define TEST_HIST_SUB_BUCKET_BITS 4
+#define TEST_HIST_SUB_BUCKETS (1 << TEST_HIST_SUB_BUCKET_BITS)
+#define TEST_HIST_MAX_EXPONENT 44
+#define TEST_HIST_BUCKETS \
+    ((TEST_HIST_MAX_EXPONENT - TEST_HIST_SUB_BUCKET_BITS + 1) * TEST_HIST_SUB_BUCKETS)
+
+struct testHist {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[TEST_HIST_BUCKETS];
+};
+
+void testHistAdd(struct testHist *hist, uint64_t value);
+void testHistMerge(struct testHist *dst, const struct testHist *src);
+uint64_t testHistMean(const struct testHist *hist);
+// Upper bound of the bucket holding the given fraction (0.99 for p99) of
+// the values, capped at the maximum.
+uint64_t testHistPercentile(const struct testHist *hist, double fraction);
+
+// CPU Utilities
+#define TEST_MAX_CPUS 32
+
+// Binds the calling thread to cpu. Returns 0 or -1 with errno set.
+int testCpuPin(int cpu);
+
+// Current frequency of each cpu in kHz, -1 when offline or unknown.
+struct testCpuFreq {
+    int numCpus;
+    int khz[TEST_MAX_CPUS];
+};
+void testCpuFreqSnapshot(struct testCpuFreq *freq);
+
+// JSON Results
+//
+// Writes JSON to a stream without building it in memory. Keys are ignored
+// for the values of arrays, and must be NULL for the top level object.
+//
+// Tools write one report per line:
+//   {"tool": ..., "clock": ..., "cpu_freq_khz_before": [...],
+//    "results": [{"name": ..., "count": ..., "mean_ns": ..., ...}, ...],
+//    "cpu_freq_khz_after": [...]}
+// so that results of different tools, or of the processes of one tool, can
+// be concatenated and compared.
+#define TEST_JSON_MAX_DEPTH 16
+
+struct testJson {
+    FILE *out;
+    int depth;
+    int count[TEST_JSON_MAX_DEPTH];
+};
+
+void testJsonInit(struct testJson *json, FILE *out);
+void testJsonBeginObject(struct testJson *json, const char *key);
+void testJsonEndObject(struct testJson *json);
+void testJsonBeginArray(struct testJson *json, const char *key);
+void testJsonEndArray(struct testJson *json);
+void testJsonString(struct testJson *json, const char *key, const char *value);
+void testJsonInt(struct testJson *json, const char *key, int64_t value);
+void testJsonDouble(struct testJson *json, const char *key, double value);
+void testJsonCpuFreq(struct testJson *json, const char *key,
+    const struct testCpuFreq *freq);
+
+// Starts a report of latencies measured with clock, which is
+// testClockSource() for testClockTicks. before may be NULL, the frequencies
+// after are taken by testJsonEndReport.
+void testJsonBeginReport(struct testJson *json, const char *tool,
+    const char *clock, const struct testCpuFreq *before);
+void testJsonEndReport(struct testJson *json);
+// Adds a result to the report: the latencies in hist, and the rates of
+// operations and bytes if seconds isn't 0.
+void testJsonResult(struct testJson *json, const char *name,
+    const struct testHist *hist, uint64_t bytes, double seconds);
+
+__END_DECLS
+
+#endif
@@ -26,3 +26,10 @@ LOCAL_C_INCLUDES += system/extras/tests/include
 LOCAL_CFLAGS += -fno-strict-aliasing
 
 include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := socketTagBenchmark
+LOCAL_SRC_FILES := socketTagBenchmark.cpp
+
+include $(BUILD_NATIVE_BENCHMARK)
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Cost of the netfilter/xt_qtaguid socket tagging: the rate at which
+ * sockets can be tagged and untagged, and the cpu time spent per packet
+ * sent and received over loopback with and without a tag.
+ *
+ * Loopback receive runs in the context of the sender, so the cpu time per
+ * packet of BM_udpLoopback is the whole cost of a packet, including the
+ * accounting of both its sending and its receiving socket.  The per-UID
+ * accounting of netd's iptables rules applies to untagged sockets too; the
+ * difference between the two runs is the cost of the tag.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark_api.h"
+
+using namespace std;
+
+static const char *ctrlPath = "/proc/net/xt_qtaguid/ctrl";
+
+// Packets sent before receiving them, well below the default receive buffer
+// so that loopback never drops one.
+static const int packetBatch = 16;
+
+static uint64_t threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Accounting tags live in the upper 32 bits, the kernel adds the uid.
+static uint64_t benchTag(int index) {
+    return (uint64_t)(0x5a00 + index) << 32;
+}
+
+static bool ctrlCommand(int ctrl, const string& cmd) {
+    return write(ctrl, cmd.data(), cmd.size()) == (ssize_t)cmd.size();
+}
+
+static void BM_tagUntag(benchmark::State& state) {
+    int ctrl = open(ctrlPath, O_WRONLY);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    uint64_t failures = 0;
+    int lastErrno = 0;
+
+    // The commands are formatted once so that only the kernel is measured
+    stringstream tagStream, untagStream;
+    tagStream << "t " << fd << " " << benchTag(state.thread_index);
+    untagStream << "u " << fd;
+    const string tag = tagStream.str(), untag = untagStream.str();
+
+    while (state.KeepRunning()) {
+        if (!ctrlCommand(ctrl, tag)) {
+            failures++;
+            lastErrno = errno;
+        }
+        if (!ctrlCommand(ctrl, untag)) {
+            failures++;
+            lastErrno = errno;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * 2);
+    if (failures) {
+        stringstream label;
+        label << "failed commands=" << failures << " (" << strerror(lastErrno) << ")";
+        state.SetLabel(label.str());
+    }
+    close(fd);
+    close(ctrl);
+}
+BENCHMARK(BM_tagUntag)->ThreadRange(1, 8);
+
+static int udpSocket(struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)addr, len) < 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// range_x: whether both sockets are tagged, range_y: payload size.
+static void BM_udpLoopback(benchmark::State& state) {
+    bool tagged = state.range_x();
+    size_t size = state.range_y();
+    struct sockaddr_in sendAddr, recvAddr;
+    int sender = udpSocket(&sendAddr);
+    int receiver = udpSocket(&recvAddr);
+    int ctrl = open(ctrlPath, O_WRONLY);
+    vector<char> packet(size, 'q');
+    uint64_t cpuNs = 0, packets = 0;
+    bool ok = sender >= 0 && receiver >= 0 &&
+        connect(sender, (struct sockaddr *)&recvAddr, sizeof(recvAddr)) == 0;
+
+    if (ok && tagged) {
+        stringstream tagSender, tagReceiver;
+        tagSender << "t " << sender << " " << benchTag(0);
+        tagReceiver << "t " << receiver << " " << benchTag(1);
+        ok = ctrlCommand(ctrl, tagSender.str()) && ctrlCommand(ctrl, tagReceiver.str());
+    }
+    if (!ok) {
+        state.SetLabel(string("setup failed: ") + strerror(errno));
+    }
+
+    while (state.KeepRunning()) {
+        if (!ok)
+            continue;
+        uint64_t start = threadCpuNs();
+        for (int i = 0; i < packetBatch; i++)
+            send(sender, packet.data(), size, 0);
+        for (int i = 0; i < packetBatch; i++)
+            recv(receiver, packet.data(), size, 0);
+        cpuNs += threadCpuNs() - start;
+        packets += packetBatch;
+    }
+
+    if (ok) {
+        state.SetItemsProcessed(packets);
+        state.SetBytesProcessed(packets * size);
+        stringstream label;
+        label << (tagged ? "tagged" : "untagged")
+              << " cpu_ns/packet=" << (packets ? cpuNs / packets : 0);
+        state.SetLabel(label.str());
+    }
+    if (tagged) {
+        stringstream untagSender, untagReceiver;
+        untagSender << "u " << sender;
+        untagReceiver << "u " << receiver;
+        ctrlCommand(ctrl, untagSender.str());
+        ctrlCommand(ctrl, untagReceiver.str());
+    }
+    close(ctrl);
+    close(receiver);
+    close(sender);
+}
+BENCHMARK(BM_udpLoopback)
+    ->ArgPair(0, 64)->ArgPair(1, 64)
+    ->ArgPair(0, 1400)->ArgPair(1, 1400);
+
+int main(int argc, char *argv[])
+{
+    ::benchmark::Initialize(&argc, argv);
+    if (access(ctrlPath, W_OK) != 0) {
+        fprintf(stderr, "%s: %s, is xt_qtaguid enabled?\n", ctrlPath, strerror(errno));
+        return 1;
+    }
+    ::benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -19,7 +19,7 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 LOCAL_MODULE_TAGS := tests
 LOCAL_MODULE:= libtestUtil
-LOCAL_SRC_FILES:= testUtil.c
+LOCAL_SRC_FILES:= testUtil.c testPerf.c
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../../include
 LOCAL_CFLAGS += -std=c99
 LOCAL_SHARED_LIBRARIES += libcutils libutils
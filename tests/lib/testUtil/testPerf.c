@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <testPerf.h>
+
+#include <inttypes.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const uint64_t nSecsPerSec = 1000000000ULL;
+
+// Nanoseconds per tick, set by testClockCalibrate
+static double nsPerTick = 1.0;
+
+uint64_t testClockNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * nSecsPerSec + ts.tv_nsec;
+}
+
+const char *testClockSource(void)
+{
+#if defined(__aarch64__)
+    return "cntvct";
+#elif defined(__i386__) || defined(__x86_64__)
+    return "tsc";
+#else
+    return "monotonic";
+#endif
+}
+
+void testClockCalibrate(void)
+{
+#if defined(__aarch64__)
+    uint64_t freq;
+
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r" (freq));
+    nsPerTick = (double) nSecsPerSec / freq;
+#elif defined(__i386__) || defined(__x86_64__)
+    // The TSC is assumed to be invariant, which all the x86 cpus running
+    // Android have
+    const struct timespec delay = { 0, 20 * 1000 * 1000 };
+    uint64_t startNs, startTicks, endNs, endTicks;
+
+    startNs = testClockNs();
+    startTicks = testClockTicks();
+    nanosleep(&delay, NULL);
+    endNs = testClockNs();
+    endTicks = testClockTicks();
+    nsPerTick = (double) (endNs - startNs) / (endTicks - startTicks);
+#else
+    nsPerTick = 1.0;
+#endif
+}
+
+uint64_t testClockTicksToNs(uint64_t ticks)
+{
+    return ticks * nsPerTick;
+}
+
+static int bucketIndex(uint64_t value)
+{
+    int exponent, shift;
+
+    if (value < TEST_HIST_SUB_BUCKETS) {
+        return value;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent >= TEST_HIST_MAX_EXPONENT) {
+        return TEST_HIST_BUCKETS - 1;
+    }
+    shift = exponent - TEST_HIST_SUB_BUCKET_BITS;
+    return (shift + 1) * TEST_HIST_SUB_BUCKETS
+        + ((value >> shift) & (TEST_HIST_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucketMax(int index)
+{
+    int shift;
+
+    if (index < TEST_HIST_SUB_BUCKETS) {
+        return index;
+    }
+    shift = index / TEST_HIST_SUB_BUCKETS - 1;
+    return ((uint64_t) (TEST_HIST_SUB_BUCKETS + index % TEST_HIST_SUB_BUCKETS + 1)
+        << shift) - 1;
+}
+
+void testHistAdd(struct testHist *hist, uint64_t value)
+{
+    hist->buckets[bucketIndex(value)]++;
+    if (!hist->count || value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    hist->count++;
+    hist->total += value;
+}
+
+void testHistMerge(struct testHist *dst, const struct testHist *src)
+{
+    int i;
+
+    if (!src->count) {
+        return;
+    }
+    for (i = 0; i < TEST_HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    if (!dst->count || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->count += src->count;
+    dst->total += src->total;
+}
+
+uint64_t testHistMean(const struct testHist *hist)
+{
+    return hist->count ? hist->total / hist->count : 0;
+}
+
+uint64_t testHistPercentile(const struct testHist *hist, double fraction)
+{
+    uint64_t target = hist->count * fraction;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < TEST_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > target) {
+            return bucketMax(i) < hist->max ? bucketMax(i) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int testCpuPin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+void testCpuFreqSnapshot(struct testCpuFreq *freq)
+{
+    long numCpus = sysconf(_SC_NPROCESSORS_CONF);
+    char path[80];
+    int cpu;
+
+    freq->numCpus = numCpus < TEST_MAX_CPUS ? numCpus : TEST_MAX_CPUS;
+    for (cpu = 0; cpu < freq->numCpus; cpu++) {
+        FILE *fp;
+
+        snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+        freq->khz[cpu] = -1;
+        if ((fp = fopen(path, "r")) != NULL) {
+            if (fscanf(fp, "%d", &freq->khz[cpu]) != 1) {
+                freq->khz[cpu] = -1;
+            }
+            fclose(fp);
+        }
+    }
+}
+
+void testJsonInit(struct testJson *json, FILE *out)
+{
+    memset(json, 0, sizeof(*json));
+    json->out = out;
+}
+
+// Separates the value from the previous one of its object or array, and
+// writes its key in objects.
+static void jsonKey(struct testJson *json, const char *key)
+{
+    if (json->depth > 0 && json->count[json->depth - 1]++) {
+        fputs(", ", json->out);
+    }
+    if (key) {
+        fprintf(json->out, "\"%s\": ", key);
+    }
+}
+
+static void jsonOpen(struct testJson *json, const char *key, char bracket)
+{
+    jsonKey(json, key);
+    fputc(bracket, json->out);
+    if (json->depth < TEST_JSON_MAX_DEPTH) {
+        json->count[json->depth] = 0;
+    }
+    json->depth++;
+}
+
+static void jsonClose(struct testJson *json, char bracket)
+{
+    fputc(bracket, json->out);
+    json->depth--;
+}
+
+void testJsonBeginObject(struct testJson *json, const char *key)
+{
+    jsonOpen(json, key, '{');
+}
+
+void testJsonEndObject(struct testJson *json)
+{
+    jsonClose(json, '}');
+}
+
+void testJsonBeginArray(struct testJson *json, const char *key)
+{
+    jsonOpen(json, key, '[');
+}
+
+void testJsonEndArray(struct testJson *json)
+{
+    jsonClose(json, ']');
+}
+
+void testJsonString(struct testJson *json, const char *key, const char *value)
+{
+    const char *p;
+
+    jsonKey(json, key);
+    fputc('"', json->out);
+    for (p = value; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(json->out, "\\%c", *p);
+        } else if ((unsigned char) *p < 0x20) {
+            fprintf(json->out, "\\u%04x", *p);
+        } else {
+            fputc(*p, json->out);
+        }
+    }
+    fputc('"', json->out);
+}
+
+void testJsonInt(struct testJson *json, const char *key, int64_t value)
+{
+    jsonKey(json, key);
+    fprintf(json->out, "%" PRId64, value);
+}
+
+void testJsonDouble(struct testJson *json, const char *key, double value)
+{
+    jsonKey(json, key);
+    // JSON has no representation for them
+    if (isnan(value) || isinf(value)) {
+        fputs("null", json->out);
+    } else {
+        fprintf(json->out, "%.6g", value);
+    }
+}
+
+void testJsonCpuFreq(struct testJson *json, const char *key,
+    const struct testCpuFreq *freq)
+{
+    int cpu;
+
+    testJsonBeginArray(json, key);
+    for (cpu = 0; cpu < freq->numCpus; cpu++) {
+        testJsonInt(json, NULL, freq->khz[cpu]);
+    }
+    testJsonEndArray(json);
+}
+
+void testJsonBeginReport(struct testJson *json, const char *tool,
+    const char *clock, const struct testCpuFreq *before)
+{
+    testJsonBeginObject(json, NULL);
+    testJsonString(json, "tool", tool);
+    testJsonString(json, "clock", clock);
+    if (before) {
+        testJsonCpuFreq(json, "cpu_freq_khz_before", before);
+    }
+    testJsonBeginArray(json, "results");
+}
+
+void testJsonEndReport(struct testJson *json)
+{
+    struct testCpuFreq after;
+
+    testJsonEndArray(json);
+    testCpuFreqSnapshot(&after);
+    testJsonCpuFreq(json, "cpu_freq_khz_after", &after);
+    testJsonEndObject(json);
+    fputc('\n', json->out);
+    fflush(json->out);
+}
+
+void testJsonResult(struct testJson *json, const char *name,
+    const struct testHist *hist, uint64_t bytes, double seconds)
+{
+    static const struct {
+        const char *key;
+        double fraction;
+    } percentiles[] = {
+        { "p50_ns", 0.5 },
+        { "p90_ns", 0.9 },
+        { "p99_ns", 0.99 },
+        { "p999_ns", 0.999 },
+    };
+    size_t i;
+
+    testJsonBeginObject(json, NULL);
+    testJsonString(json, "name", name);
+    testJsonInt(json, "count", hist->count);
+    testJsonInt(json, "mean_ns", testHistMean(hist));
+    testJsonInt(json, "min_ns", hist->min);
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        testJsonInt(json, percentiles[i].key,
+            testHistPercentile(hist, percentiles[i].fraction));
+    }
+    testJsonInt(json, "max_ns", hist->max);
+    if (seconds > 0) {
+        testJsonDouble(json, "ops_per_sec", hist->count / seconds);
+        if (bytes) {
+            testJsonDouble(json, "mb_per_sec", bytes / seconds / (1024 * 1024));
+        }
+    }
+    testJsonEndObject(json);
+}
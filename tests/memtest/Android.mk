@@ -18,7 +18,9 @@ LOCAL_CFLAGS += \
     -Wall \
     -Werror \
 
-LOCAL_MULTILIB := 32
+LOCAL_MULTILIB := both
+LOCAL_MODULE_STEM_32 := $(LOCAL_MODULE)
+LOCAL_MODULE_STEM_64 := $(LOCAL_MODULE)64
 
 LOCAL_SANITIZE := never
 
@@ -40,6 +40,12 @@ option_t bandwidth_opts[] = {
     { NULL, false },
 };
 
+option_t latency_opts[] = {
+    { "size", true },
+    { "num_loops", true },
+    { NULL, false },
+};
+
 option_t per_core_opts[] = {
     { "size", true },
     { "num_warm_loops", true},
@@ -57,6 +63,12 @@ option_t multithread_opts[] = {
     { NULL, false },
 };
 
+// The sizes the latency test sweeps and the number of loads it times for
+// each size.
+const size_t DEFAULT_LATENCY_MIN_SIZE = 4 * 1024;
+const size_t DEFAULT_LATENCY_MAX_SIZE = 64 * 1024 * 1024;
+const size_t DEFAULT_LATENCY_LOADS = 16 * 1024 * 1024;
+
 typedef union {
     int int_value;
     const char *char_value;
@@ -107,6 +119,14 @@ BandwidthBenchmark *createBandwidthBenchmarkObject(arg_t values) {
         bench = new CopyVldrVstrBenchmark();
     } else if (strcmp(name, "copy_vldmia_vstmia") == 0) {
         bench = new CopyVldmiaVstmiaBenchmark();
+    } else if (strcmp(name, "copy_ldp_stp") == 0) {
+        bench = new CopyLdpStpBenchmark();
+    } else if (strcmp(name, "copy_ld1_st1") == 0) {
+        bench = new CopyLd1St1Benchmark();
+    } else if (strcmp(name, "copy_ldnp_stnp") == 0) {
+        bench = new CopyLdnpStnpBenchmark();
+    } else if (strcmp(name, "copy_sve") == 0) {
+        bench = new CopySveBenchmark();
     } else if (strcmp(name, "memcpy") == 0) {
         bench = new MemcpyBenchmark();
     } else if (strcmp(name, "write_strd") == 0) {
@@ -119,6 +139,14 @@ BandwidthBenchmark *createBandwidthBenchmarkObject(arg_t values) {
         bench = new WriteVstrBenchmark();
     } else if (strcmp(name, "write_vstmia") == 0) {
         bench = new WriteVstmiaBenchmark();
+    } else if (strcmp(name, "write_stp") == 0) {
+        bench = new WriteStpBenchmark();
+    } else if (strcmp(name, "write_st1") == 0) {
+        bench = new WriteSt1Benchmark();
+    } else if (strcmp(name, "write_stnp") == 0) {
+        bench = new WriteStnpBenchmark();
+    } else if (strcmp(name, "write_sve") == 0) {
+        bench = new WriteSveBenchmark();
     } else if (strcmp(name, "memset") == 0) {
         bench = new MemsetBenchmark();
     } else if (strcmp(name, "read_ldrd") == 0) {
@@ -131,11 +159,27 @@ BandwidthBenchmark *createBandwidthBenchmarkObject(arg_t values) {
         bench = new ReadVldrBenchmark();
     } else if (strcmp(name, "read_vldmia") == 0) {
         bench = new ReadVldmiaBenchmark();
+    } else if (strcmp(name, "read_ldp") == 0) {
+        bench = new ReadLdpBenchmark();
+    } else if (strcmp(name, "read_ld1") == 0) {
+        bench = new ReadLd1Benchmark();
+    } else if (strcmp(name, "read_ldnp") == 0) {
+        bench = new ReadLdnpBenchmark();
+    } else if (strcmp(name, "read_sve") == 0) {
+        bench = new ReadSveBenchmark();
+    } else if (strcmp(name, "read_sum") == 0) {
+        bench = new ReadSumBenchmark();
     } else {
         printf("Unknown type name %s\n", name);
         return NULL;
     }
 
+    if (!bench->canRun()) {
+        printf("The type %s is not supported on this cpu.\n", name);
+        delete bench;
+        return NULL;
+    }
+
     if (!bench->setSize(size)) {
         printf("Failed to allocate buffers for benchmark.\n");
         return NULL;
@@ -316,7 +360,7 @@ int per_core_bandwidth(int argc, char** argv) {
         }
     }
 
-    printf("Running on %d cores\n", cpu_list.size());
+    printf("Running on %zu cores\n", cpu_list.size());
     printf("  run_time = %ds\n", values["run_time"].int_value);
     printf("  size = %d\n", values["size"].int_value);
     printf("  num_warm_loops = %d\n", values["num_warm_loops"].int_value);
@@ -407,9 +451,9 @@ bool run_bandwidth_benchmark(int argc, char** argv, const char *name,
         if (!preamble_printed) {
             preamble_printed = true;
             printf("Benchmarking %s bandwidth\n", name);
-            printf("  size = %d\n", (*it)->size());
-            printf("  num_warm_loops = %d\n", (*it)->num_warm_loops());
-            printf("  num_loops = %d\n\n", (*it)->num_loops());
+            printf("  size = %zu\n", (*it)->size());
+            printf("  num_warm_loops = %zu\n", (*it)->num_warm_loops());
+            printf("  num_loops = %zu\n\n", (*it)->num_loops());
         }
         (*it)->run();
         printf("  %s bandwidth with %s: %0.2f MB/s\n", name, (*it)->getName(),
@@ -426,6 +470,10 @@ int copy_bandwidth(int argc, char** argv) {
     bench_objs.push_back(new CopyVld1Vst1Benchmark());
     bench_objs.push_back(new CopyVldrVstrBenchmark());
     bench_objs.push_back(new CopyVldmiaVstmiaBenchmark());
+    bench_objs.push_back(new CopyLdpStpBenchmark());
+    bench_objs.push_back(new CopyLd1St1Benchmark());
+    bench_objs.push_back(new CopyLdnpStnpBenchmark());
+    bench_objs.push_back(new CopySveBenchmark());
     bench_objs.push_back(new MemcpyBenchmark());
 
     if (!run_bandwidth_benchmark(argc, argv, "copy", bench_objs)) {
@@ -441,6 +489,10 @@ int write_bandwidth(int argc, char** argv) {
     bench_objs.push_back(new WriteVst1Benchmark());
     bench_objs.push_back(new WriteVstrBenchmark());
     bench_objs.push_back(new WriteVstmiaBenchmark());
+    bench_objs.push_back(new WriteStpBenchmark());
+    bench_objs.push_back(new WriteSt1Benchmark());
+    bench_objs.push_back(new WriteStnpBenchmark());
+    bench_objs.push_back(new WriteSveBenchmark());
     bench_objs.push_back(new MemsetBenchmark());
 
     if (!run_bandwidth_benchmark(argc, argv, "write", bench_objs)) {
@@ -457,9 +509,63 @@ int read_bandwidth(int argc, char** argv) {
     bench_objs.push_back(new ReadVld1Benchmark());
     bench_objs.push_back(new ReadVldrBenchmark());
     bench_objs.push_back(new ReadVldmiaBenchmark());
+    bench_objs.push_back(new ReadLdpBenchmark());
+    bench_objs.push_back(new ReadLd1Benchmark());
+    bench_objs.push_back(new ReadLdnpBenchmark());
+    bench_objs.push_back(new ReadSveBenchmark());
+    bench_objs.push_back(new ReadSumBenchmark());
 
     if (!run_bandwidth_benchmark(argc, argv, "read", bench_objs)) {
         return -1;
     }
     return 0;
 }
+
+int latency(int argc, char** argv) {
+    arg_t values;
+    values["size"].int_value = 0;
+    values["num_loops"].int_value = 0;
+    if (!processBandwidthOptions(argc, argv, latency_opts, &values)) {
+        return -1;
+    }
+
+    size_t size = values["size"].int_value;
+    if ((size % LatencyBenchmark::LINE_SIZE) != 0) {
+        printf("The size value must be a multiple of %zu.\n", LatencyBenchmark::LINE_SIZE);
+        return -1;
+    }
+
+    if (setpriority(PRIO_PROCESS, 0, -20)) {
+        perror("Unable to raise priority of process.");
+        return -1;
+    }
+
+    // Without a size, sweep from within the first level cache to well past
+    // the last level cache.
+    size_t min_size = size ? size : DEFAULT_LATENCY_MIN_SIZE;
+    size_t max_size = size ? size : DEFAULT_LATENCY_MAX_SIZE;
+    printf("Benchmarking load latency\n\n");
+    for (size = min_size; size <= max_size; size *= 2) {
+        LatencyBenchmark bench;
+        if (!bench.setSize(size)) {
+            printf("Failed creating buffer for latency test.\n");
+            return -1;
+        }
+        size_t num_lines = size / LatencyBenchmark::LINE_SIZE;
+        size_t num_loops = values["num_loops"].int_value;
+        if (!num_loops) {
+            num_loops = DEFAULT_LATENCY_LOADS / num_lines;
+            if (num_loops == 0) {
+                num_loops = 1;
+            }
+        }
+        // One pass through the buffer is enough to warm it up.
+        bench.set_num_warm_loops(1);
+        bench.set_num_loops(num_loops);
+        bench.run();
+        printf("  latency with %s size %zu: %0.2f ns\n", bench.getName(), size,
+               bench.ns_per_load());
+    }
+
+    return 0;
+}
@@ -17,8 +17,12 @@
 #ifndef __BANDWIDTH_H__
 #define __BANDWIDTH_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
 
 #include "utils/Compat.h"
 #include "memtest.h"
@@ -51,7 +55,10 @@ public:
         return true;
     }
 
-    bool canRun() { return !usesNeon() || isNeonSupported(); }
+    bool canRun() {
+        return (!usesArm32() || isArm32()) && (!usesAArch64() || isAArch64()) &&
+               (!usesNeon() || isNeonSupported()) && (!usesSve() || isSveSupported());
+    }
 
     virtual bool setSize(size_t size) = 0;
 
@@ -61,6 +68,12 @@ public:
 
     virtual bool usesNeon() { return false; }
 
+    virtual bool usesArm32() { return false; }
+
+    virtual bool usesAArch64() { return false; }
+
+    virtual bool usesSve() { return false; }
+
     bool isNeonSupported() {
 #if defined(__ARM_NEON__)
         return true;
@@ -69,6 +82,32 @@ public:
 #endif
     }
 
+    bool isArm32() {
+#if defined(__arm__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool isAArch64() {
+#if defined(__aarch64__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // The SVE benchmarks are only built when the compiler targets SVE, and
+    // only run when the cpu has it.
+    bool isSveSupported() {
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+        return (getauxval(AT_HWCAP) & _HWCAP_SVE) != 0;
+#else
+        return false;
+#endif
+    }
+
     // Accessors/mutators.
     double mb_per_sec() { return _mb_per_sec; }
     size_t num_warm_loops() { return _num_warm_loops; }
@@ -96,6 +135,8 @@ private:
     // Static constants
     static const CONSTEXPR double _NUM_NS_PER_SEC = 1000000000.0;
     static const CONSTEXPR double _BYTES_PER_MB = 1024.0* 1024.0;
+    // HWCAP_SVE, for headers that do not have it yet.
+    static const unsigned long _HWCAP_SVE = 1UL << 22;
 };
 
 class CopyBandwidthBenchmark : public BandwidthBenchmark {
@@ -175,8 +216,11 @@ public:
 
     const char *getName() { return "ldrd/strd"; }
 
+    bool usesArm32() { return true; }
+
 protected:
     // Copy using ldrd/strd instructions.
+#if defined(__arm__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4,r6,r7}\n"
@@ -219,6 +263,9 @@ protected:
 
             "ldmfd sp!, {r0,r1,r2,r3,r4,r6,r7}\n"
         :: "r" (_src), "r" (_dst), "r" (_size), "r" (num_loops) : "r0", "r1", "r2", "r3");
+#else
+    void bench(size_t) {
+#endif
     }
 };
 
@@ -229,8 +276,11 @@ public:
 
     const char *getName() { return "ldmia/stmia"; }
 
+    bool usesArm32() { return true; }
+
 protected:
     // Copy using ldmia/stmia instructions.
+#if defined(__arm__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11,r12}\n"
@@ -258,6 +308,9 @@ protected:
 
             "ldmfd sp!, {r0,r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11,r12}\n"
         :: "r" (_src), "r" (_dst), "r" (_size), "r" (num_loops) : "r0", "r1", "r2", "r3");
+#else
+    void bench(size_t) {
+#endif
     }
 };
 
@@ -268,11 +321,13 @@ public:
 
     const char *getName() { return "vld1/vst1"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Copy using vld1/vst1 instructions.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4}\n"
@@ -313,11 +368,13 @@ public:
 
     const char *getName() { return "vldr/vstr"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Copy using vldr/vstr instructions.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4}\n"
@@ -372,11 +429,13 @@ public:
 
     const char *getName() { return "vldmia/vstmia"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Copy using vldmia/vstmia instructions.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4}\n"
@@ -408,6 +467,164 @@ protected:
     }
 };
 
+class CopyLdpStpBenchmark : public CopyBandwidthBenchmark {
+public:
+    CopyLdpStpBenchmark() : CopyBandwidthBenchmark() { }
+    virtual ~CopyLdpStpBenchmark() {}
+
+    const char *getName() { return "ldp/stp"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Copy using ldp/stp instructions.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, %[src]\n"
+            "mov x1, %[dst]\n"
+            "lsr x2, %[size], #6\n"
+
+            "1:\n"
+            "ldp x3, x4, [x0]\n"
+            "ldp x5, x6, [x0, #16]\n"
+            "ldp x7, x8, [x0, #32]\n"
+            "ldp x9, x10, [x0, #48]\n"
+            "add x0, x0, #64\n"
+            "subs x2, x2, #1\n"
+            "stp x3, x4, [x1]\n"
+            "stp x5, x6, [x1, #16]\n"
+            "stp x7, x8, [x1, #32]\n"
+            "stp x9, x10, [x1, #48]\n"
+            "add x1, x1, #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [src] "r" (_src), [dst] "r" (_dst), [size] "r" (_size)
+        : "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class CopyLd1St1Benchmark : public CopyBandwidthBenchmark {
+public:
+    CopyLd1St1Benchmark() : CopyBandwidthBenchmark() { }
+    virtual ~CopyLd1St1Benchmark() {}
+
+    const char *getName() { return "ld1/st1"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Copy using four register ld1/st1 instructions.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, %[src]\n"
+            "mov x1, %[dst]\n"
+            "lsr x2, %[size], #6\n"
+
+            "1:\n"
+            "ld1 {v0.16b, v1.16b, v2.16b, v3.16b}, [x0], #64\n"
+            "subs x2, x2, #1\n"
+            "st1 {v0.16b, v1.16b, v2.16b, v3.16b}, [x1], #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [src] "r" (_src), [dst] "r" (_dst), [size] "r" (_size)
+        : "x0", "x1", "x2", "v0", "v1", "v2", "v3", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class CopyLdnpStnpBenchmark : public CopyBandwidthBenchmark {
+public:
+    CopyLdnpStnpBenchmark() : CopyBandwidthBenchmark() { }
+    virtual ~CopyLdnpStnpBenchmark() {}
+
+    const char *getName() { return "ldnp/stnp"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Copy using the non-temporal ldnp/stnp instructions, which hint that
+    // the data need not be kept in the caches.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, %[src]\n"
+            "mov x1, %[dst]\n"
+            "lsr x2, %[size], #6\n"
+
+            "1:\n"
+            "ldnp q0, q1, [x0]\n"
+            "ldnp q2, q3, [x0, #32]\n"
+            "add x0, x0, #64\n"
+            "subs x2, x2, #1\n"
+            "stnp q0, q1, [x1]\n"
+            "stnp q2, q3, [x1, #32]\n"
+            "add x1, x1, #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [src] "r" (_src), [dst] "r" (_dst), [size] "r" (_size)
+        : "x0", "x1", "x2", "v0", "v1", "v2", "v3", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class CopySveBenchmark : public CopyBandwidthBenchmark {
+public:
+    CopySveBenchmark() : CopyBandwidthBenchmark() { }
+    virtual ~CopySveBenchmark() {}
+
+    const char *getName() { return "sve ld1b/st1b"; }
+
+    bool usesSve() { return true; }
+
+protected:
+    // Copy using SVE ld1b/st1b, a vector of whatever length the cpu has
+    // at a time.
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, #0\n"
+            "whilelo p0.b, x0, %[size]\n"
+
+            "1:\n"
+            "ld1b {z0.b}, p0/z, [%[src], x0]\n"
+            "st1b {z0.b}, p0, [%[dst], x0]\n"
+            "incb x0\n"
+            "whilelo p0.b, x0, %[size]\n"
+            "b.first 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [src] "r" (_src), [dst] "r" (_dst), [size] "r" (_size)
+        : "x0", "z0", "p0", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
 class MemcpyBenchmark : public CopyBandwidthBenchmark {
 public:
     MemcpyBenchmark() : CopyBandwidthBenchmark() { }
@@ -498,8 +715,11 @@ public:
 
     const char *getName() { return "strd"; }
 
+    bool usesArm32() { return true; }
+
 protected:
     // Write a given value using strd.
+#if defined(__arm__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4,r5}\n"
@@ -532,6 +752,9 @@ protected:
 
             "ldmfd sp!, {r0,r1,r2,r3,r4,r5}\n"
           :: "r" (_buffer), "r" (_size), "r" (num_loops) : "r0", "r1", "r2");
+#else
+    void bench(size_t) {
+#endif
     }
 };
 
@@ -542,8 +765,11 @@ public:
 
     const char *getName() { return "stmia"; }
 
+    bool usesArm32() { return true; }
+
 protected:
       // Write a given value using stmia.
+#if defined(__arm__)
       void bench(size_t num_loops) {
           asm volatile(
               "stmfd sp!, {r0,r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11}\n"
@@ -577,6 +803,9 @@ protected:
 
               "ldmfd sp!, {r0,r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11}\n"
         :: "r" (_buffer), "r" (_size), "r" (num_loops) : "r0", "r1", "r2");
+#else
+    void bench(size_t) {
+#endif
     }
 };
 
@@ -587,11 +816,13 @@ public:
 
     const char *getName() { return "vst1"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Write a given value using vst.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4}\n"
@@ -634,11 +865,13 @@ public:
 
     const char *getName() { return "vstr"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Write a given value using vst.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4}\n"
@@ -685,11 +918,13 @@ public:
 
     const char *getName() { return "vstmia"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Write a given value using vstmia.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4}\n"
@@ -725,6 +960,169 @@ protected:
     }
 };
 
+class WriteStpBenchmark : public WriteBandwidthBenchmark {
+public:
+    WriteStpBenchmark() : WriteBandwidthBenchmark() { }
+    virtual ~WriteStpBenchmark() {}
+
+    const char *getName() { return "stp"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Write a given value using stp.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "mov x3, #0\n"
+            "mov x4, #0x0101010101010101\n"
+
+            "0:\n"
+            "mov x0, %[buffer]\n"
+            "lsr x1, %[size], #6\n"
+            "add x3, x3, x4\n"
+
+            "1:\n"
+            "subs x1, x1, #1\n"
+            "stp x3, x3, [x0]\n"
+            "stp x3, x3, [x0, #16]\n"
+            "stp x3, x3, [x0, #32]\n"
+            "stp x3, x3, [x0, #48]\n"
+            "add x0, x0, #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x1", "x3", "x4", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class WriteSt1Benchmark : public WriteBandwidthBenchmark {
+public:
+    WriteSt1Benchmark() : WriteBandwidthBenchmark() { }
+    virtual ~WriteSt1Benchmark() {}
+
+    const char *getName() { return "st1"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Write a given value using four register st1.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "mov w3, #0\n"
+
+            "0:\n"
+            "mov x0, %[buffer]\n"
+            "lsr x1, %[size], #6\n"
+            "add w3, w3, #1\n"
+            "dup v0.16b, w3\n"
+            "mov v1.16b, v0.16b\n"
+            "mov v2.16b, v0.16b\n"
+            "mov v3.16b, v0.16b\n"
+
+            "1:\n"
+            "subs x1, x1, #1\n"
+            "st1 {v0.16b, v1.16b, v2.16b, v3.16b}, [x0], #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x1", "x3", "v0", "v1", "v2", "v3", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class WriteStnpBenchmark : public WriteBandwidthBenchmark {
+public:
+    WriteStnpBenchmark() : WriteBandwidthBenchmark() { }
+    virtual ~WriteStnpBenchmark() {}
+
+    const char *getName() { return "stnp"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Write a given value using the non-temporal stnp.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "mov w3, #0\n"
+
+            "0:\n"
+            "mov x0, %[buffer]\n"
+            "lsr x1, %[size], #6\n"
+            "add w3, w3, #1\n"
+            "dup v0.16b, w3\n"
+            "mov v1.16b, v0.16b\n"
+
+            "1:\n"
+            "subs x1, x1, #1\n"
+            "stnp q0, q1, [x0]\n"
+            "stnp q0, q1, [x0, #32]\n"
+            "add x0, x0, #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x1", "x3", "v0", "v1", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class WriteSveBenchmark : public WriteBandwidthBenchmark {
+public:
+    WriteSveBenchmark() : WriteBandwidthBenchmark() { }
+    virtual ~WriteSveBenchmark() {}
+
+    const char *getName() { return "sve st1b"; }
+
+    bool usesSve() { return true; }
+
+protected:
+    // Write a given value using SVE st1b.
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "mov w3, #0\n"
+
+            "0:\n"
+            "mov x0, #0\n"
+            "add w3, w3, #1\n"
+            "dup z0.b, w3\n"
+            "whilelo p0.b, x0, %[size]\n"
+
+            "1:\n"
+            "st1b {z0.b}, p0, [%[buffer], x0]\n"
+            "incb x0\n"
+            "whilelo p0.b, x0, %[size]\n"
+            "b.first 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x3", "z0", "p0", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
 class MemsetBenchmark : public WriteBandwidthBenchmark {
 public:
     MemsetBenchmark() : WriteBandwidthBenchmark() { }
@@ -747,8 +1145,11 @@ public:
 
     const char *getName() { return "ldrd"; }
 
+    bool usesArm32() { return true; }
+
 protected:
     // Write a given value using strd.
+#if defined(__arm__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3,r4,r5}\n"
@@ -775,6 +1176,9 @@ protected:
 
             "ldmfd sp!, {r0,r1,r2,r3,r4,r5}\n"
           :: "r" (_buffer), "r" (_size), "r" (num_loops) : "r0", "r1", "r2");
+#else
+    void bench(size_t) {
+#endif
     }
 };
 
@@ -785,8 +1189,11 @@ public:
 
     const char *getName() { return "ldmia"; }
 
+    bool usesArm32() { return true; }
+
 protected:
       // Write a given value using stmia.
+#if defined(__arm__)
       void bench(size_t num_loops) {
           asm volatile(
               "stmfd sp!, {r0,r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11}\n"
@@ -809,6 +1216,9 @@ protected:
 
               "ldmfd sp!, {r0,r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11}\n"
         :: "r" (_buffer), "r" (_size), "r" (num_loops) : "r0", "r1", "r2");
+#else
+    void bench(size_t) {
+#endif
     }
 };
 
@@ -819,11 +1229,13 @@ public:
 
     const char *getName() { return "vld1"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Write a given value using vst.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3}\n"
@@ -859,11 +1271,13 @@ public:
 
     const char *getName() { return "vldr"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Write a given value using vst.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3}\n"
@@ -904,11 +1318,13 @@ public:
 
     const char *getName() { return "vldmia"; }
 
+    bool usesArm32() { return true; }
+
     bool usesNeon() { return true; }
 
 protected:
     // Write a given value using vstmia.
-#if defined(__ARM_NEON__)
+#if defined(__arm__) && defined(__ARM_NEON__)
     void bench(size_t num_loops) {
         asm volatile(
             "stmfd sp!, {r0,r1,r2,r3}\n"
@@ -937,4 +1353,235 @@ protected:
     }
 };
 
+class ReadLdpBenchmark : public SingleBufferBandwidthBenchmark {
+public:
+    ReadLdpBenchmark() : SingleBufferBandwidthBenchmark() { }
+    virtual ~ReadLdpBenchmark() {}
+
+    const char *getName() { return "ldp"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Read using ldp.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, %[buffer]\n"
+            "lsr x1, %[size], #6\n"
+
+            "1:\n"
+            "subs x1, x1, #1\n"
+            "ldp x2, x3, [x0]\n"
+            "ldp x4, x5, [x0, #16]\n"
+            "ldp x6, x7, [x0, #32]\n"
+            "ldp x8, x9, [x0, #48]\n"
+            "add x0, x0, #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class ReadLd1Benchmark : public SingleBufferBandwidthBenchmark {
+public:
+    ReadLd1Benchmark() : SingleBufferBandwidthBenchmark() { }
+    virtual ~ReadLd1Benchmark() {}
+
+    const char *getName() { return "ld1"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Read using four register ld1.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, %[buffer]\n"
+            "lsr x1, %[size], #6\n"
+
+            "1:\n"
+            "subs x1, x1, #1\n"
+            "ld1 {v0.16b, v1.16b, v2.16b, v3.16b}, [x0], #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x1", "v0", "v1", "v2", "v3", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class ReadLdnpBenchmark : public SingleBufferBandwidthBenchmark {
+public:
+    ReadLdnpBenchmark() : SingleBufferBandwidthBenchmark() { }
+    virtual ~ReadLdnpBenchmark() {}
+
+    const char *getName() { return "ldnp"; }
+
+    bool usesAArch64() { return true; }
+
+protected:
+    // Read using the non-temporal ldnp.
+#if defined(__aarch64__)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, %[buffer]\n"
+            "lsr x1, %[size], #6\n"
+
+            "1:\n"
+            "subs x1, x1, #1\n"
+            "ldnp q0, q1, [x0]\n"
+            "ldnp q2, q3, [x0, #32]\n"
+            "add x0, x0, #64\n"
+            "b.gt 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "x1", "v0", "v1", "v2", "v3", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class ReadSveBenchmark : public SingleBufferBandwidthBenchmark {
+public:
+    ReadSveBenchmark() : SingleBufferBandwidthBenchmark() { }
+    virtual ~ReadSveBenchmark() {}
+
+    const char *getName() { return "sve ld1b"; }
+
+    bool usesSve() { return true; }
+
+protected:
+    // Read using SVE ld1b.
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+    void bench(size_t num_loops) {
+        asm volatile(
+            "0:\n"
+            "mov x0, #0\n"
+            "whilelo p0.b, x0, %[size]\n"
+
+            "1:\n"
+            "ld1b {z0.b}, p0/z, [%[buffer], x0]\n"
+            "incb x0\n"
+            "whilelo p0.b, x0, %[size]\n"
+            "b.first 1b\n"
+
+            "subs %[loops], %[loops], #1\n"
+            "b.gt 0b\n"
+        : [loops] "+r" (num_loops)
+        : [buffer] "r" (_buffer), [size] "r" (_size)
+        : "x0", "z0", "p0", "cc", "memory");
+#else
+    void bench(size_t) {
+#endif
+    }
+};
+
+class ReadSumBenchmark : public SingleBufferBandwidthBenchmark {
+public:
+    ReadSumBenchmark() : SingleBufferBandwidthBenchmark(), _sum(0) { }
+    virtual ~ReadSumBenchmark() {}
+
+    const char *getName() { return "sum"; }
+
+protected:
+    // Read by summing 64 bit words, with four sums so that the adds do not
+    // limit the loads. Runs on any architecture.
+    void bench(size_t num_loops) {
+        const uint64_t *end = reinterpret_cast<const uint64_t*>(_buffer + _size);
+        for (size_t i = 0; i < num_loops; i++) {
+            uint64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+            for (const uint64_t *p = reinterpret_cast<const uint64_t*>(_buffer); p < end; p += 4) {
+                sum0 += p[0];
+                sum1 += p[1];
+                sum2 += p[2];
+                sum3 += p[3];
+            }
+            _sum += sum0 + sum1 + sum2 + sum3;
+        }
+    }
+
+    // Keeps the compiler from dropping the loads.
+    volatile uint64_t _sum;
+};
+
+// Measures the load to use latency by following a chain of pointers, one
+// per cache line, in a random order through the buffer, so that neither
+// the prefetchers nor out of order execution hide the latency.
+class LatencyBenchmark : public SingleBufferBandwidthBenchmark {
+public:
+    LatencyBenchmark() : SingleBufferBandwidthBenchmark(), _head(NULL) { }
+    virtual ~LatencyBenchmark() {}
+
+    const char *getName() { return "pointer chase"; }
+
+    bool setSize(size_t size) {
+        if (!SingleBufferBandwidthBenchmark::setSize(size)) {
+            return false;
+        }
+
+        // Sattolo's algorithm gives a random permutation that is a single
+        // cycle through all of the lines.
+        size_t num_lines = _size / LINE_SIZE;
+        size_t *order = new size_t[num_lines];
+        for (size_t i = 0; i < num_lines; i++) {
+            order[i] = i;
+        }
+        uint64_t seed = 0x2545f4914f6cdd1dULL;
+        for (size_t i = num_lines - 1; i > 0; i--) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            size_t j = (seed >> 33) % i;
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        for (size_t i = 0; i < num_lines; i++) {
+            *reinterpret_cast<void**>(_buffer + i * LINE_SIZE) =
+                _buffer + order[i] * LINE_SIZE;
+        }
+        delete[] order;
+        _head = _buffer;
+
+        return true;
+    }
+
+    // Every loop follows size / LINE_SIZE pointers.
+    double ns_per_load() {
+        return LINE_SIZE * 1000000000.0 / (mb_per_sec() * 1024.0 * 1024.0);
+    }
+
+    static const size_t LINE_SIZE = 64;
+
+protected:
+    void bench(size_t num_loops) {
+        size_t num_loads = num_loops * (_size / LINE_SIZE);
+        void *p = _head;
+        for (size_t i = 0; i < num_loads; i++) {
+            p = *reinterpret_cast<void**>(p);
+        }
+        _head = p;
+    }
+
+    void * volatile _head;
+};
+
 #endif  // __BANDWIDTH_H__
@@ -41,16 +41,18 @@ static void usage(char* p) {
            "  copy_bandwidth [--size BYTES_TO_COPY]\n"
            "  write_bandwidth [--size BYTES_TO_WRITE]\n"
            "  read_bandwidth [--size BYTES_TO_COPY]\n"
+           "  latency [--size BYTES] [--num_loops LOOPS]\n"
+           "    Without --size, sweeps the sizes from 4KB to 64MB.\n"
            "  per_core_bandwidth [--size BYTES]\n"
            "    --type copy_ldrd_strd | copy_ldmia_stmia | copy_vld1_vst1 |\n"
-           "           copy_vldr_vstr | copy_vldmia_vstmia | memcpy | write_strd |\n"
-           "           write_stmia | write_vst1 | write_vstr | write_vstmia | memset |\n"
-           "           read_ldrd | read_ldmia | read_vld1 | read_vldr | read_vldmia\n"
+           "           copy_vldr_vstr | copy_vldmia_vstmia | copy_ldp_stp |\n"
+           "           copy_ld1_st1 | copy_ldnp_stnp | copy_sve | memcpy |\n"
+           "           write_strd | write_stmia | write_vst1 | write_vstr |\n"
+           "           write_vstmia | write_stp | write_st1 | write_stnp | write_sve |\n"
+           "           memset | read_ldrd | read_ldmia | read_vld1 | read_vldr |\n"
+           "           read_vldmia | read_ldp | read_ld1 | read_ldnp | read_sve | read_sum\n"
            "  multithread_bandwidth [--size BYTES]\n"
-           "    --type copy_ldrd_strd | copy_ldmia_stmia | copy_vld1_vst1 |\n"
-           "           copy_vldr_vstr | copy_vldmia_vstmia | memcpy | write_strd |\n"
-           "           write_stmia | write_vst1 | write_vstr | write_vstmia | memset |\n"
-           "           read_ldrd | read_ldmia | read_vld1 | read_vldr | read_vldmia\n"
+           "    --type (as for per_core_bandwidth)\n"
            "    --num_threads NUM_THREADS_TO_RUN\n"
            "  malloc [fill]\n"
            "  madvise\n"
@@ -63,6 +65,7 @@ static void usage(char* p) {
 int copy_bandwidth(int argc, char** argv);
 int write_bandwidth(int argc, char** argv);
 int read_bandwidth(int argc, char** argv);
+int latency(int argc, char** argv);
 int per_core_bandwidth(int argc, char** argv);
 int multithread_bandwidth(int argc, char** argv);
 int malloc_test(int argc, char** argv);
@@ -85,6 +88,7 @@ function_t function_table[] = {
     { "copy_bandwidth", copy_bandwidth },
     { "write_bandwidth", write_bandwidth },
     { "read_bandwidth", read_bandwidth },
+    { "latency", latency },
     { "per_core_bandwidth", per_core_bandwidth },
     { "multithread_bandwidth", multithread_bandwidth },
 };
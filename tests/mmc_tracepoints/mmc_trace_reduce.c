@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native version of the mmc_trace_reduce script, for traces too large for
+ * it. The trace is read in a single pass with memory bounded by the number
+ * of requests in flight, and each start/end pair of the mmc_blk_rw and
+ * mmc_blk_erase tracepoints is written out in the same form as the script
+ * does. Optionally it also writes the queue depth each time it changes and
+ * size and latency histograms per command.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define READ_SIZE       (1 << 20)
+#define MAX_LINE        4096
+#define MAX_INFLIGHT    256
+#define HIST_BUCKETS    32
+
+enum op {
+    OP_READ,
+    OP_WRITE,
+    OP_DISCARD,
+    OP_FLUSH,
+    OP_SECURE_TRIM2,
+    OP_SANITIZE,
+    OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+    "read", "write", "discard", "flush", "secure_trim2", "sanitize",
+};
+
+struct request {
+    uint64_t start_usec;
+    uint32_t cmd;
+    uint64_t addr;
+    uint64_t size;
+    char addr_text[24];
+    char size_text[24];
+};
+
+struct op_stats {
+    uint64_t count;
+    uint64_t sectors;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint64_t size_hist[HIST_BUCKETS];       /* log2 of the size in sectors */
+    uint64_t latency_hist[HIST_BUCKETS];    /* log2 of the latency in usec */
+};
+
+struct reducer {
+    FILE *out;
+    FILE *depth_out;
+
+    /* requests started but not ended, oldest first */
+    struct request inflight[MAX_INFLIGHT];
+    int num_inflight;
+
+    struct op_stats stats[OP_COUNT];
+    uint64_t first_usec;
+    uint64_t last_usec;
+    uint64_t depth_usec;        /* integral of the depth over time */
+    int max_depth;
+    uint64_t lines;
+    uint64_t unmatched;
+};
+
+static int ilog2(uint64_t v)
+{
+    int b = 0;
+    while (v >>= 1)
+        b++;
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/* Maps a command number the way the script does; -1 for unknown ones. */
+static int cmd_to_op(uint32_t cmd)
+{
+    switch (cmd) {
+    case 18:
+        return OP_READ;
+    case 25:
+        return OP_WRITE;
+    case 32:
+        return OP_FLUSH;
+    case 0:
+    case 1:
+    case 3:
+    case 0x80000000:
+    case 0x80000001:
+        return OP_DISCARD;
+    case 0x80008000:
+        return OP_SECURE_TRIM2;
+    case 165:
+        return OP_SANITIZE;
+    default:
+        return -1;
+    }
+}
+
+/* Copies a number out of the parameters, up to the next comma. */
+static const char *parse_param(const char *p, const char *name, char *text, size_t len,
+                               uint64_t *value)
+{
+    size_t n = strlen(name);
+    size_t i;
+
+    if (strncmp(p, name, n) != 0)
+        return NULL;
+    p += n;
+    for (i = 0; p[i] && p[i] != ',' && p[i] != ' ' && p[i] != '\n'; i++) {
+        if (i + 1 >= len)
+            return NULL;
+        text[i] = p[i];
+    }
+    if (i == 0)
+        return NULL;
+    text[i] = '\0';
+    *value = strtoull(text, NULL, 0);
+    return p + i;
+}
+
+static void account_depth(struct reducer *r, uint64_t now)
+{
+    if (r->lines == 0 || now < r->last_usec) {
+        r->first_usec = now;
+    } else {
+        r->depth_usec += (now - r->last_usec) * r->num_inflight;
+    }
+    r->last_usec = now;
+}
+
+static void depth_changed(struct reducer *r, uint64_t now)
+{
+    if (r->num_inflight > r->max_depth)
+        r->max_depth = r->num_inflight;
+    if (r->depth_out) {
+        fprintf(r->depth_out, "%" PRIu64 ".%06" PRIu64 ",%d\n",
+                now / 1000000, now % 1000000, r->num_inflight);
+    }
+}
+
+static void start_request(struct reducer *r, const struct request *req)
+{
+    if (r->num_inflight == MAX_INFLIGHT) {
+        fprintf(stderr, "Too many requests in flight, dropping the oldest\n");
+        memmove(&r->inflight[0], &r->inflight[1],
+                sizeof(r->inflight[0]) * (MAX_INFLIGHT - 1));
+        r->num_inflight--;
+        r->unmatched++;
+    }
+    r->inflight[r->num_inflight++] = *req;
+    depth_changed(r, req->start_usec);
+}
+
+static void end_request(struct reducer *r, const struct request *end)
+{
+    struct request *req = NULL;
+    uint64_t dur;
+    int op;
+    int i;
+
+    /* with command queueing several requests may be in flight, and they do
+     * not have to complete in order */
+    for (i = 0; i < r->num_inflight; i++) {
+        req = &r->inflight[i];
+        if (req->cmd == end->cmd && req->addr == end->addr && req->size == end->size)
+            break;
+    }
+    if (i == r->num_inflight) {
+        fprintf(stderr, "End line without a matching start, ignoring\n");
+        r->unmatched++;
+        return;
+    }
+
+    dur = end->start_usec >= req->start_usec ? end->start_usec - req->start_usec : 0;
+    op = cmd_to_op(req->cmd);
+    if (op < 0) {
+        fprintf(stderr, "Unrecognized command %u, ignoring\n", req->cmd);
+    } else {
+        struct op_stats *s = &r->stats[op];
+
+        s->count++;
+        s->sectors += req->size;
+        s->total_usec += dur;
+        if (dur > s->max_usec)
+            s->max_usec = dur;
+        s->size_hist[ilog2(req->size)]++;
+        s->latency_hist[ilog2(dur)]++;
+
+        /* the flash analysis tool only knows about these */
+        if (op == OP_READ || op == OP_WRITE || op == OP_DISCARD) {
+            fprintf(r->out, "$%s,%s,%s,%" PRIu64 ".%06" PRIu64 ",%" PRIu64 ".%06" PRIu64 "\n",
+                    op_names[op], req->addr_text, req->size_text,
+                    req->start_usec / 1000000, req->start_usec % 1000000,
+                    dur / 1000000, dur % 1000000);
+        }
+    }
+
+    memmove(req, req + 1, sizeof(*req) * (r->num_inflight - i - 1));
+    r->num_inflight--;
+    depth_changed(r, end->start_usec);
+}
+
+/*
+ * Handles one line of the form
+ *   TASK-PID [CPU] FLAGS SEC.USEC: mmc_blk_rw_start: cmd=25,addr=0x...,size=0x...
+ * where the task name may contain spaces.
+ */
+static void reduce_line(struct reducer *r, char *line)
+{
+    struct request req;
+    char *event, *colon, *ts, *p;
+    uint64_t sec, usec;
+    int is_start;
+    int digits;
+
+    if (line[strspn(line, " \t")] == '#')
+        return;
+    event = strstr(line, ": mmc_blk_");
+    if (!event)
+        return;
+    colon = strchr(event + 2, ':');
+    if (!colon)
+        return;
+    if (colon - event >= 8 && !strncmp(colon - 6, "_start", 6)) {
+        is_start = 1;
+    } else if (colon - event >= 6 && !strncmp(colon - 4, "_end", 4)) {
+        is_start = 0;
+    } else {
+        return;
+    }
+
+    /* the timestamp ends at the ':' before the event name */
+    ts = event;
+    while (ts > line && ts[-1] != ' ')
+        ts--;
+    sec = strtoull(ts, &p, 10);
+    if (*p != '.')
+        return;
+    usec = 0;
+    for (p++, digits = 0; *p >= '0' && *p <= '9'; p++, digits++) {
+        if (digits < 6)
+            usec = usec * 10 + (*p - '0');
+    }
+    for (; digits < 6; digits++)
+        usec *= 10;
+
+    memset(&req, 0, sizeof(req));
+    req.start_usec = sec * 1000000 + usec;
+    p = colon + 1;
+    while (*p == ' ')
+        p++;
+    {
+        char cmd_text[24];
+        uint64_t cmd;
+
+        if (!(p = (char *)parse_param(p, "cmd=", cmd_text, sizeof(cmd_text), &cmd)) ||
+                *p++ != ',' ||
+                !(p = (char *)parse_param(p, "addr=", req.addr_text, sizeof(req.addr_text),
+                                          &req.addr)) ||
+                *p++ != ',' ||
+                !(p = (char *)parse_param(p, "size=", req.size_text, sizeof(req.size_text),
+                                          &req.size))) {
+            fprintf(stderr, "Malformed mmc event, ignoring: %s\n", line);
+            return;
+        }
+        req.cmd = cmd;
+    }
+
+    account_depth(r, req.start_usec);
+    r->lines++;
+    if (is_start)
+        start_request(r, &req);
+    else
+        end_request(r, &req);
+}
+
+static int reduce(struct reducer *r, FILE *in)
+{
+    static char buf[READ_SIZE + MAX_LINE + 1];
+    size_t have = 0;
+    size_t n;
+
+    while ((n = fread(buf + have, 1, READ_SIZE, in)) > 0) {
+        char *line = buf;
+        char *end = buf + have + n;
+        char *nl;
+
+        while ((nl = memchr(line, '\n', end - line)) != NULL) {
+            *nl = '\0';
+            reduce_line(r, line);
+            line = nl + 1;
+        }
+        have = end - line;
+        if (have > MAX_LINE) {
+            fprintf(stderr, "Line too long, ignoring\n");
+            have = 0;
+        }
+        memmove(buf, line, have);
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Read error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (have) {
+        buf[have] = '\0';
+        reduce_line(r, buf);
+    }
+    return 0;
+}
+
+static void print_hist(FILE *f, const char *name, const char *unit, const uint64_t *hist)
+{
+    int first = HIST_BUCKETS, last = -1;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (hist[b]) {
+            if (first == HIST_BUCKETS)
+                first = b;
+            last = b;
+        }
+    }
+    for (b = first; b <= last; b++) {
+        fprintf(f, "%s,%" PRIu64 ",%s,%" PRIu64 "\n", name, (uint64_t)1 << b, unit, hist[b]);
+    }
+}
+
+static void print_summary(struct reducer *r, FILE *f)
+{
+    uint64_t span = r->last_usec - r->first_usec;
+    int op;
+
+    fprintf(f, "# op,count,sectors,avg_usec,max_usec\n");
+    for (op = 0; op < OP_COUNT; op++) {
+        struct op_stats *s = &r->stats[op];
+        if (!s->count)
+            continue;
+        fprintf(f, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", op_names[op],
+                s->count, s->sectors, s->total_usec / s->count, s->max_usec);
+    }
+    fprintf(f, "# queue depth: avg %.3f max %d, unmatched events %" PRIu64
+            ", still in flight %d\n", span ? (double)r->depth_usec / span : 0.0,
+            r->max_depth, r->unmatched, r->num_inflight);
+
+    fprintf(f, "# op,bucket,unit,count (bucket is the lower bound, log2 sized)\n");
+    for (op = 0; op < OP_COUNT; op++) {
+        struct op_stats *s = &r->stats[op];
+        if (!s->count)
+            continue;
+        print_hist(f, op_names[op], "sectors", s->size_hist);
+        print_hist(f, op_names[op], "usec", s->latency_hist);
+    }
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-d depth_file] [-s summary_file] <trace_file | ->\n"
+            "Writes one line per mmc request to stdout, as mmc_trace_reduce does.\n"
+            "    -d  Write time,queue depth each time the depth changes.\n"
+            "    -s  Write per command totals and size and latency histograms.\n",
+            cmd);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct reducer r;
+    FILE *summary = NULL;
+    FILE *in;
+    int opt;
+    int ret;
+
+    r.out = stdout;
+    while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            r.depth_out = fopen(optarg, "w");
+            if (!r.depth_out) {
+                fprintf(stderr, "Cannot open %s: %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        case 's':
+            summary = fopen(optarg, "w");
+            if (!summary) {
+                fprintf(stderr, "Cannot open %s: %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!strcmp(argv[optind], "-")) {
+        in = stdin;
+    } else {
+        in = fopen(argv[optind], "r");
+        if (!in) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+
+    ret = reduce(&r, in);
+    if (summary) {
+        print_summary(&r, summary);
+        fclose(summary);
+    }
+    if (r.depth_out)
+        fclose(r.depth_out);
+    if (in != stdin)
+        fclose(in);
+    return ret ? 1 : 0;
+}
@@ -6,7 +6,8 @@ LOCAL_SRC_FILES:=    \
     pagingtest.c    \
     mmap_test.c      \
     pageinout_test.c \
-    thrashing_test.c
+    thrashing_test.c \
+    pressure_test.c
 
 LOCAL_CFLAGS := -std=gnu11
 
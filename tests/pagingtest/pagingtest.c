@@ -134,10 +134,39 @@ bool check_caching(void *buf, unsigned char *vec, size_t size, bool is_cached) {
 int main(int argc, char **argv) {
     unsigned long long alloc_size = 0ULL;
     unsigned long long file_size = 0ULL;
+    unsigned long long limit = 0ULL;
+    enum pressure_method method = PRESSURE_CGROUP;
     int test_runs = 0;
     int rc;
+    int opt;
+
+    //arguments: <program> [-p limit [-m cgroup|balloon]] [test_runs [alloc_size [file_size]]]
+    //With -p, only the pressure test runs, reading file_size bytes with about
+    //limit bytes of memory for them
+    while ((opt = getopt(argc, argv, "p:m:")) != -1) {
+        switch (opt) {
+        case 'p':
+            limit = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "cgroup")) {
+                method = PRESSURE_CGROUP;
+            } else if (!strcmp(optarg, "balloon")) {
+                method = PRESSURE_BALLOON;
+            } else {
+                fprintf(stderr, "unknown pressure method: %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p limit [-m cgroup|balloon]] "
+                    "[test_runs [alloc_size [file_size]]]\n", argv[0]);
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
-    //arguments: <program> [test_runs [alloc_size [file_size]]]
     if (argc >= 2) {
         test_runs = atoi(argv[1]);
     }
@@ -157,6 +186,10 @@ int main(int argc, char **argv) {
         file_size = FILE_SIZE;
     }
 
+    if (limit) {
+        return pressure_test(test_runs, file_size, limit, method);
+    }
+
     rc = mmap_test(test_runs, alloc_size);
     if (rc) {
         return rc;
@@ -7,6 +7,11 @@
 #define mincore_vec_len(size) (((size) + sysconf(_SC_PAGE_SIZE) - 1) / sysconf(_SC_PAGE_SIZE))
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
 
+enum pressure_method {
+    PRESSURE_CGROUP,
+    PRESSURE_BALLOON,
+};
+
 //Helpers
 int create_tmp_file(char *filename, off_t size);
 unsigned char *alloc_mincore_vec(size_t size);
@@ -16,5 +21,7 @@ bool check_caching(void *buf, unsigned char *vec, size_t size, bool is_cached);
 int mmap_test(int test_runs, unsigned long long alloc_size);
 int pageinout_test(int test_runs, unsigned long long file_size);
 int thrashing_test(int test_runs);
+int pressure_test(int test_runs, unsigned long long file_size, unsigned long long limit,
+                  enum pressure_method method);
 
 #endif //__PAGINGTEST_H__
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "pagingtest.h"
+
+#define CGROUP_NAME "pagingtest"
+
+//Counters of /proc/vmstat, summed over the kswapd, direct and khugepaged
+//variants and over the zones on kernels that split them that way
+struct vmstat {
+    unsigned long long majfault;
+    unsigned long long refault;
+    unsigned long long steal;
+    unsigned long long scan;
+};
+
+struct phase {
+    const char *name;
+    struct timeval time;
+    struct vmstat delta;
+    unsigned long long pages;
+};
+
+struct pressure {
+    enum pressure_method method;
+    unsigned long long limit;
+    //cgroup
+    char root[PATH_MAX];
+    char dir[PATH_MAX];
+    bool v2;
+    //balloon
+    void *balloon;
+    size_t balloon_size;
+};
+
+static bool starts_with(const char *str, const char *prefix) {
+    return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+static int read_vmstat(struct vmstat *vs) {
+    char name[64];
+    unsigned long long value;
+    FILE *f;
+
+    f = fopen("/proc/vmstat", "r");
+    if (f == NULL) {
+        fprintf(stderr, "unable to open /proc/vmstat: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(vs, 0, sizeof(*vs));
+    while (fscanf(f, "%63s %llu", name, &value) == 2) {
+        if (!strcmp(name, "pgmajfault")) {
+            vs->majfault += value;
+        } else if (!strcmp(name, "workingset_refault") ||
+                   !strcmp(name, "workingset_refault_anon") ||
+                   !strcmp(name, "workingset_refault_file")) {
+            vs->refault += value;
+        } else if (starts_with(name, "pgsteal_kswapd") || starts_with(name, "pgsteal_direct") ||
+                   starts_with(name, "pgsteal_khugepaged")) {
+            vs->steal += value;
+        } else if (starts_with(name, "pgscan_kswapd") || starts_with(name, "pgscan_direct") ||
+                   starts_with(name, "pgscan_khugepaged")) {
+            vs->scan += value;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int write_file(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    ssize_t len = strlen(value);
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (write(fd, value, len) != len) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    close(fd);
+    return 0;
+}
+
+static unsigned long long mem_available(void) {
+    char line[128];
+    unsigned long long kb = 0;
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+//Moves this process into a memory cgroup of its own, in which the page cache
+//it faults is charged
+static int cgroup_init(struct pressure *p) {
+    char pid[16];
+    struct stat st;
+    int rc;
+
+    if (!stat("/sys/fs/cgroup/cgroup.controllers", &st)) {
+        strcpy(p->root, "/sys/fs/cgroup");
+        p->v2 = true;
+        //The memory controller has to be enabled for the children of the root
+        write_file(p->root, "cgroup.subtree_control", "+memory");
+    } else if (!stat("/dev/memcg/memory.limit_in_bytes", &st)) {
+        strcpy(p->root, "/dev/memcg");
+    } else if (!stat("/sys/fs/cgroup/memory/memory.limit_in_bytes", &st)) {
+        strcpy(p->root, "/sys/fs/cgroup/memory");
+    } else {
+        fprintf(stderr, "no memory cgroup found, try the balloon\n");
+        return -1;
+    }
+
+    snprintf(p->dir, sizeof(p->dir), "%s/%s", p->root, CGROUP_NAME);
+    if (mkdir(p->dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "unable to create %s: %s\n", p->dir, strerror(errno));
+        return -1;
+    }
+
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    rc = write_file(p->dir, "cgroup.procs", pid);
+    if (rc) {
+        fprintf(stderr, "unable to move to %s: %s\n", p->dir, strerror(-rc));
+        rmdir(p->dir);
+        return -1;
+    }
+    return 0;
+}
+
+static void cgroup_destroy(struct pressure *p) {
+    char pid[16];
+
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    write_file(p->root, "cgroup.procs", pid);
+    rmdir(p->dir);
+}
+
+//Reclaims down to the limit: the cgroup is limited to it, or a balloon of
+//anonymous memory leaves only about the limit available
+static int pressure_apply(struct pressure *p) {
+    char value[32];
+    unsigned long long available;
+    size_t i;
+    long pagesize = sysconf(_SC_PAGE_SIZE);
+    int rc;
+
+    if (p->method == PRESSURE_CGROUP) {
+        snprintf(value, sizeof(value), "%llu", p->limit);
+        rc = write_file(p->dir, p->v2 ? "memory.max" : "memory.limit_in_bytes", value);
+        if (rc) {
+            fprintf(stderr, "unable to set the cgroup limit: %s\n", strerror(-rc));
+            return -1;
+        }
+        return 0;
+    }
+
+    available = mem_available();
+    if (available <= p->limit) {
+        fprintf(stderr, "only %llu bytes available, no balloon needed\n", available);
+        return 0;
+    }
+    p->balloon_size = (available - p->limit) & ~(pagesize - 1);
+    p->balloon = mmap(NULL, p->balloon_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->balloon == MAP_FAILED) {
+        fprintf(stderr, "unable to map the balloon: %s\n", strerror(errno));
+        p->balloon = NULL;
+        return -1;
+    }
+    //Non-zero, so zram has to store the pages if they are swapped
+    for (i = 0; i < p->balloon_size; i += pagesize) {
+        ((volatile char *)p->balloon)[i] = 1;
+    }
+    return 0;
+}
+
+static void pressure_release(struct pressure *p) {
+    if (p->method == PRESSURE_CGROUP) {
+        write_file(p->dir, p->v2 ? "memory.max" : "memory.limit_in_bytes", p->v2 ? "max" : "-1");
+    } else if (p->balloon) {
+        munmap(p->balloon, p->balloon_size);
+        p->balloon = NULL;
+    }
+}
+
+static void phase_begin(struct vmstat *vs, struct timeval *begin_time) {
+    read_vmstat(vs);
+    gettimeofday(begin_time, NULL);
+}
+
+static void phase_end(struct phase *ph, const struct vmstat *begin_vs,
+                      const struct timeval *begin_time, unsigned long long pages) {
+    struct timeval end_time, elapsed_time;
+    struct vmstat vs;
+
+    gettimeofday(&end_time, NULL);
+    read_vmstat(&vs);
+
+    timersub(&end_time, begin_time, &elapsed_time);
+    timeradd(&ph->time, &elapsed_time, &ph->time);
+    ph->delta.majfault += vs.majfault - begin_vs->majfault;
+    ph->delta.refault += vs.refault - begin_vs->refault;
+    ph->delta.steal += vs.steal - begin_vs->steal;
+    ph->delta.scan += vs.scan - begin_vs->scan;
+    ph->pages += pages;
+}
+
+static void phase_print(const struct pressure *p, const struct phase *ph) {
+    unsigned long long usec = ph->time.tv_sec * USEC_PER_SEC + ph->time.tv_usec;
+    //The latency of reclaim is per page stolen, the one of the reads per
+    //page read
+    unsigned long long per = ph->pages ? ph->pages : ph->delta.steal;
+
+    printf("pressure %s %llu MB %s: %.2f us/page, pages %llu, majfault %llu, "
+           "refault %llu (%.1f%%), steal %llu, scan %llu\n",
+           p->method == PRESSURE_CGROUP ? "cgroup" : "balloon", p->limit / (1024 * 1024),
+           ph->name, per ? (double)usec / per : 0.0, ph->pages, ph->delta.majfault,
+           ph->delta.refault, ph->pages ? 100.0 * ph->delta.refault / ph->pages : 0.0,
+           ph->delta.steal, ph->delta.scan);
+}
+
+//Reads the file, backwards to prevent mmap prefetching
+static void read_pages(volatile char *buf, unsigned long long file_size, long pagesize) {
+    long long j;
+
+    for (j = ((file_size - 1) & ~(pagesize - 1)); j >= 0; j -= pagesize) {
+        buf[j];
+    }
+}
+
+//Each run reads the file with the pressure lifted (populate), then applies
+//the pressure (reclaim) and reads the file again (refault). The vmstat
+//counters are system wide, so other activity adds to them.
+int pressure_test(int test_runs, unsigned long long file_size, unsigned long long limit,
+                  enum pressure_method method) {
+    int fd;
+    char tmpname[] = "pressureXXXXXX";
+    volatile char *buf;
+    int ret = -1;
+    int i;
+    long pagesize = sysconf(_SC_PAGE_SIZE);
+    unsigned long long pages = mincore_vec_len(file_size);
+    struct pressure p;
+    struct phase phases[3] = {{ .name = "populate" }, { .name = "reclaim" }, { .name = "refault" }};
+    struct vmstat vs;
+    struct timeval begin_time;
+
+    memset(&p, 0, sizeof(p));
+    p.method = method;
+    p.limit = limit;
+    if (limit >= file_size) {
+        fprintf(stderr, "the limit has to be below the file size to cause refaults\n");
+        return -1;
+    }
+    if (method == PRESSURE_CGROUP && cgroup_init(&p)) {
+        return -1;
+    }
+
+    fd = create_tmp_file(tmpname, file_size);
+    if (fd < 0) {
+        goto err_fd;
+    }
+
+    buf = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == ((void *)-1)) {
+        fprintf(stderr, "Failed to mmap file: %s\n", strerror(errno));
+        goto err_mmap;
+    }
+
+    for (i = 0; i < test_runs; i++) {
+        pressure_release(&p);
+        phase_begin(&vs, &begin_time);
+        read_pages(buf, file_size, pagesize);
+        phase_end(&phases[0], &vs, &begin_time, pages);
+
+        phase_begin(&vs, &begin_time);
+        if (pressure_apply(&p)) {
+            goto err;
+        }
+        phase_end(&phases[1], &vs, &begin_time, 0);
+
+        phase_begin(&vs, &begin_time);
+        read_pages(buf, file_size, pagesize);
+        phase_end(&phases[2], &vs, &begin_time, pages);
+    }
+
+    for (i = 0; i < (int)ARRAY_SIZE(phases); i++) {
+        phase_print(&p, &phases[i]);
+    }
+
+    ret = 0;
+
+err:
+    pressure_release(&p);
+    munmap((void *)buf, file_size);
+err_mmap:
+    close(fd);
+err_fd:
+    if (method == PRESSURE_CGROUP) {
+        cgroup_destroy(&p);
+    }
+    return ret;
+}
@@ -16,3 +16,13 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS += -fomit-frame-pointer
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= pffault.c
+
+LOCAL_MODULE:= pffault
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,638 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Page fault benchmark. Where pftest times walking pages that are already
+ * mapped, this times the faults that map them, one by one, for each kind of
+ * page a process ends up touching: anonymous pages read from the zero page
+ * or written first, file pages clean or dirty in the page cache, pages
+ * copied after fork, pages swapped back in from zram, and huge pages. With
+ * several threads, the faults of all of them contend on the same mm.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE 15
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+#define HUGE_SIZE (2 << 20)
+#define MAX_THREADS 64
+
+static size_t page_size;
+static const char *tmp_dir;
+
+/* ticks of the cpu counter, read without a system call where possible */
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t v;
+
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#else
+    /* the arm generic timer isn't always readable from user space */
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static double ns_per_tick = 1.0;
+
+static void calibrate_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+    uint64_t t0 = now_ns(), k0 = ticks();
+    uint64_t t1, k1;
+
+    do {
+        t1 = now_ns();
+    } while (t1 - t0 < 20000000);
+    k1 = ticks();
+    ns_per_tick = (double)(t1 - t0) / (k1 - k0);
+#endif
+}
+
+/* A mapping to fault in, and how each page is touched. */
+struct region {
+    char *base;
+    size_t len;
+    size_t stride;
+    int write;
+};
+
+/* Times a fault on each stride of the region, storing the ticks in lat. */
+static size_t fault_region(const struct region *r, uint64_t *lat)
+{
+    size_t i, n = r->len / r->stride;
+
+    for (i = 0; i < n; i++) {
+        volatile char *p = r->base + i * r->stride;
+        uint64_t t0 = ticks();
+
+        if (r->write)
+            *p = 1;
+        else
+            (void)*p;
+        lat[i] = ticks() - t0;
+    }
+    return n;
+}
+
+static char *map_anon(size_t len, int advice)
+{
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+    madvise(p, len, advice);
+    return p;
+}
+
+/* Maps len bytes aligned to a huge page. */
+static char *map_anon_huge(size_t len, int advice, char **unmap_base, size_t *unmap_len)
+{
+    char *p = mmap(NULL, len + HUGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *aligned;
+
+    if (p == MAP_FAILED)
+        return NULL;
+    aligned = (char *)(((uintptr_t)p + HUGE_SIZE - 1) & ~(uintptr_t)(HUGE_SIZE - 1));
+    madvise(aligned, len, advice);
+    *unmap_base = p;
+    *unmap_len = len + HUGE_SIZE;
+    return aligned;
+}
+
+/* Creates an unlinked file of len bytes in the page cache, clean or dirty. */
+static int make_file(size_t len, int dirty)
+{
+    char path[256];
+    char *buf;
+    size_t off;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/pffault.XXXXXX", tmp_dir);
+    fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+
+    buf = malloc(page_size);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+    for (off = 0; off < len; off += page_size) {
+        memset(buf, (int)(off / page_size) | 1, page_size);
+        if (write(fd, buf, page_size) != (ssize_t)page_size) {
+            free(buf);
+            close(fd);
+            return -1;
+        }
+    }
+    free(buf);
+    if (!dirty)
+        fdatasync(fd);
+    return fd;
+}
+
+struct scenario;
+
+typedef ssize_t (*scenario_func)(const struct scenario *s, size_t pages, uint64_t *lat);
+
+struct scenario {
+    const char *name;
+    const char *desc;
+    scenario_func run;
+    int threads_ok;     /* meaningful with several threads */
+};
+
+static ssize_t run_anon(const struct scenario *s, size_t pages, uint64_t *lat, int write)
+{
+    struct region r;
+    size_t n;
+
+    (void)s;
+    r.len = pages * page_size;
+    r.base = map_anon(r.len, MADV_NOHUGEPAGE);
+    if (!r.base)
+        return -1;
+    r.stride = page_size;
+    r.write = write;
+    n = fault_region(&r, lat);
+    munmap(r.base, r.len);
+    return n;
+}
+
+static ssize_t anon_zero(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    return run_anon(s, pages, lat, 0);
+}
+
+static ssize_t anon_write(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    return run_anon(s, pages, lat, 1);
+}
+
+/* Writes to pages that were first read, copying them from the zero page. */
+static ssize_t anon_zero_cow(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    struct region r;
+    size_t n;
+
+    (void)s;
+    r.len = pages * page_size;
+    r.base = map_anon(r.len, MADV_NOHUGEPAGE);
+    if (!r.base)
+        return -1;
+    r.stride = page_size;
+    r.write = 0;
+    fault_region(&r, lat);
+    r.write = 1;
+    n = fault_region(&r, lat);
+    munmap(r.base, r.len);
+    return n;
+}
+
+static ssize_t run_file(size_t pages, uint64_t *lat, int dirty, int flags, int write)
+{
+    struct region r;
+    size_t n;
+    int fd;
+
+    r.len = pages * page_size;
+    fd = make_file(r.len, dirty);
+    if (fd < 0)
+        return -1;
+    r.base = mmap(NULL, r.len, PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);
+    if (r.base == MAP_FAILED)
+        return -1;
+    /* read faults map the cached pages around them too, so most reads
+     * find their page mapped already, as they do in apps; the mean and
+     * us/MB account for the few faults that did the work */
+    r.stride = page_size;
+    r.write = write;
+    n = fault_region(&r, lat);
+    munmap(r.base, r.len);
+    return n;
+}
+
+static ssize_t file_clean(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    (void)s;
+    return run_file(pages, lat, 0, MAP_SHARED, 0);
+}
+
+static ssize_t file_dirty(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    (void)s;
+    return run_file(pages, lat, 1, MAP_SHARED, 0);
+}
+
+static ssize_t file_write(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    (void)s;
+    return run_file(pages, lat, 0, MAP_SHARED, 1);
+}
+
+static ssize_t file_private(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    (void)s;
+    return run_file(pages, lat, 0, MAP_PRIVATE, 1);
+}
+
+/* Writes in a child to pages the parent wrote before forking. */
+static ssize_t fork_cow(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    struct region r;
+    uint64_t *shared;
+    size_t lat_len = pages * sizeof(*lat);
+    ssize_t n = -1;
+    int status;
+    pid_t pid;
+
+    (void)s;
+    r.len = pages * page_size;
+    r.base = map_anon(r.len, MADV_NOHUGEPAGE);
+    if (!r.base)
+        return -1;
+    memset(r.base, 1, r.len);
+    r.stride = page_size;
+    r.write = 1;
+
+    shared = mmap(NULL, lat_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        goto out;
+    memset(shared, 0, lat_len);
+
+    pid = fork();
+    if (pid == 0) {
+        fault_region(&r, shared);
+        _exit(0);
+    }
+    if (pid > 0 && waitpid(pid, &status, 0) == pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        memcpy(lat, shared, lat_len);
+        n = pages;
+    }
+    munmap(shared, lat_len);
+out:
+    munmap(r.base, r.len);
+    return n;
+}
+
+/* Reads pages back after pushing them out to swap, zram on most devices. */
+static ssize_t swap_in(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    struct region r;
+    unsigned char *vec;
+    size_t i, resident = 0;
+    size_t n;
+
+    (void)s;
+    r.len = pages * page_size;
+    r.base = map_anon(r.len, MADV_NOHUGEPAGE);
+    if (!r.base)
+        return -1;
+    /* different in each page, but compressible like most app memory */
+    for (i = 0; i < r.len; i += sizeof(uint32_t))
+        *(uint32_t *)(r.base + i) = (uint32_t)(i / 64);
+
+    vec = malloc(pages);
+    if (!vec || madvise(r.base, r.len, MADV_PAGEOUT) != 0 ||
+            mincore(r.base, r.len, vec) != 0) {
+        free(vec);
+        munmap(r.base, r.len);
+        return -1;
+    }
+    for (i = 0; i < pages; i++)
+        resident += vec[i] & 1;
+    free(vec);
+    if (resident > pages / 2) {
+        /* no swap, or it is full */
+        munmap(r.base, r.len);
+        return -1;
+    }
+
+    r.stride = page_size;
+    r.write = 0;
+    n = fault_region(&r, lat);
+    munmap(r.base, r.len);
+    return n;
+}
+
+static ssize_t run_huge(size_t pages, uint64_t *lat, int advice, size_t stride)
+{
+    struct region r;
+    char *unmap_base;
+    size_t unmap_len;
+    size_t n;
+
+    r.len = (pages * page_size + HUGE_SIZE - 1) & ~(size_t)(HUGE_SIZE - 1);
+    r.base = map_anon_huge(r.len, advice, &unmap_base, &unmap_len);
+    if (!r.base)
+        return -1;
+    r.stride = stride;
+    r.write = 1;
+    n = fault_region(&r, lat);
+    munmap(unmap_base, unmap_len);
+    return n;
+}
+
+static ssize_t thp(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    (void)s;
+    return run_huge(pages, lat, MADV_HUGEPAGE, HUGE_SIZE);
+}
+
+/* The same huge page aligned memory as thp, faulted in 4K at a time. */
+static ssize_t thp_4k(const struct scenario *s, size_t pages, uint64_t *lat)
+{
+    (void)s;
+    return run_huge(pages, lat, MADV_NOHUGEPAGE, page_size);
+}
+
+static const struct scenario scenarios[] = {
+    { "anon-zero", "read of untouched anonymous memory", anon_zero, 1 },
+    { "anon-write", "first write to anonymous memory", anon_write, 1 },
+    { "anon-zero-cow", "write to anonymous memory read before", anon_zero_cow, 1 },
+    { "file-clean", "read of a clean page cache page", file_clean, 1 },
+    { "file-dirty", "read of a dirty page cache page", file_dirty, 1 },
+    { "file-write", "shared write to a clean file page", file_write, 1 },
+    { "file-private", "private write to a file page", file_private, 1 },
+    { "fork-cow", "write in a child to a page of its parent", fork_cow, 0 },
+    { "swap-in", "read of a page pushed to swap", swap_in, 0 },
+    { "thp", "first write to a transparent huge page", thp, 1 },
+    { "thp-4k", "first write to the same memory without huge pages", thp_4k, 1 },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+struct worker {
+    pthread_t thread;
+    const struct scenario *s;
+    size_t pages;
+    int runs;
+    uint64_t *lat;      /* room for runs * pages latencies */
+    size_t count;
+    uint64_t mapped;    /* bytes faulted in */
+    int failed;
+};
+
+static pthread_barrier_t start_barrier;
+static volatile int churn_stop;
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    int i;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < w->runs; i++) {
+        ssize_t n = w->s->run(w->s, w->pages, w->lat + w->count);
+
+        if (n < 0) {
+            w->failed = 1;
+            break;
+        }
+        w->count += n;
+        w->mapped += w->pages * page_size;
+    }
+    return NULL;
+}
+
+/* Takes mmap_sem for writing over and over, as an allocator would. */
+static void *churn_main(void *arg)
+{
+    (void)arg;
+    while (!churn_stop) {
+        void *p = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (p != MAP_FAILED)
+            munmap(p, page_size);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ns(const uint64_t *sorted, size_t n, int p)
+{
+    return sorted[(n - 1) * p / 100] * ns_per_tick;
+}
+
+static int run_scenario(const struct scenario *s, size_t pages, int runs,
+                        int num_threads, int churn)
+{
+    struct worker workers[MAX_THREADS];
+    pthread_t churn_thread;
+    uint64_t *all;
+    size_t per_run = pages + HUGE_SIZE / page_size;
+    size_t total = 0, k;
+    uint64_t sum = 0, mapped = 0;
+    int i, failed = 0;
+
+    memset(workers, 0, sizeof(workers));
+    all = malloc(sizeof(*all) * per_run * runs * num_threads);
+    if (!all)
+        return -1;
+
+    pthread_barrier_init(&start_barrier, NULL, num_threads);
+    churn_stop = 0;
+    if (churn && pthread_create(&churn_thread, NULL, churn_main, NULL) != 0)
+        churn = 0;
+
+    for (i = 0; i < num_threads; i++) {
+        workers[i].s = s;
+        workers[i].pages = pages;
+        workers[i].runs = runs;
+        workers[i].lat = all + (size_t)i * per_run * runs;
+        /* fault the buffer in now, rather than while timing */
+        memset(workers[i].lat, 0, sizeof(*all) * per_run * runs);
+        if (i > 0 && pthread_create(&workers[i].thread, NULL, worker_main,
+                                    &workers[i]) != 0) {
+            fprintf(stderr, "Unable to start thread %d\n", i);
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
+    for (i = 1; i < num_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    if (churn) {
+        churn_stop = 1;
+        pthread_join(churn_thread, NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+
+    /* gather the latencies of all threads at the start of the buffer */
+    for (i = 0; i < num_threads; i++) {
+        failed |= workers[i].failed;
+        memmove(all + total, workers[i].lat, sizeof(*all) * workers[i].count);
+        total += workers[i].count;
+        mapped += workers[i].mapped;
+    }
+
+    if (failed || total == 0) {
+        printf("%-14s\tskipped: not supported here\n", s->name);
+        free(all);
+        return 0;
+    }
+
+    qsort(all, total, sizeof(*all), compare_u64);
+    for (k = 0; k < total; k++)
+        sum += all[k];
+
+    printf("%-14s\t%8zu\t%8.0f\t%8.0f\t%8.0f\t%8.0f\t%10.0f\t%8.1f\n",
+           s->name, total, sum * ns_per_tick / total,
+           percentile_ns(all, total, 50), percentile_ns(all, total, 90),
+           percentile_ns(all, total, 99), all[total - 1] * ns_per_tick,
+           sum * ns_per_tick / 1000 / ((double)mapped / (1 << 20)));
+    fflush(stdout);
+    free(all);
+    return 0;
+}
+
+static void usage(const char *cmd)
+{
+    size_t i;
+
+    fprintf(stderr,
+            "Usage: %s [-n pages] [-r runs] [-t threads] [-c] [-d dir] [scenario...]\n"
+            "    -n  Pages faulted in each run, per thread (4096).\n"
+            "    -r  Runs of each scenario (5).\n"
+            "    -t  Threads faulting at the same time in the process (1).\n"
+            "    -c  Also run a thread mapping and unmapping memory, contending\n"
+            "        for mmap_sem with the faults.\n"
+            "    -d  Directory for the files of the file scenarios\n"
+            "        (/data/local/tmp, or /tmp).\n"
+            "Scenarios, all by default:\n", cmd);
+    for (i = 0; i < NUM_SCENARIOS; i++)
+        fprintf(stderr, "    %-14s%s\n", scenarios[i].name, scenarios[i].desc);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t pages = 4096;
+    int runs = 5, num_threads = 1, churn = 0;
+    size_t i;
+    int opt;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    tmp_dir = access("/data/local/tmp", W_OK) == 0 ? "/data/local/tmp" : "/tmp";
+
+    while ((opt = getopt(argc, argv, "n:r:t:cd:")) != -1) {
+        switch (opt) {
+        case 'n': pages = strtoul(optarg, NULL, 0); break;
+        case 'r': runs = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'c': churn = 1; break;
+        case 'd': tmp_dir = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (pages == 0 || runs <= 0 || num_threads <= 0 || num_threads > MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = optind; i < (size_t)argc; i++) {
+        size_t k;
+
+        for (k = 0; k < NUM_SCENARIOS; k++)
+            if (!strcmp(argv[i], scenarios[k].name))
+                break;
+        if (k == NUM_SCENARIOS) {
+            fprintf(stderr, "Unknown scenario %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    calibrate_ticks();
+
+    printf("# %zu pages of %zu bytes, %d runs, %d threads%s\n", pages, page_size,
+           runs, num_threads, churn ? ", mmap churn" : "");
+    printf("%-14s\t%8s\t%8s\t%8s\t%8s\t%8s\t%10s\t%8s\n", "[scenario]", "[faults]",
+           "[mean]", "[p50]", "[p90]", "[p99]", "[max ns]", "[us/MB]");
+
+    for (i = 0; i < NUM_SCENARIOS; i++) {
+        const struct scenario *s = &scenarios[i];
+
+        if (optind < argc) {
+            int k, wanted = 0;
+
+            for (k = optind; k < argc; k++)
+                wanted |= !strcmp(argv[k], s->name);
+            if (!wanted)
+                continue;
+        }
+        if (num_threads > 1 && !s->threads_ok) {
+            printf("%-14s\tskipped: single threaded only\n", s->name);
+            continue;
+        }
+        if (run_scenario(s, pages, runs, num_threads, churn) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    return 0;
+}
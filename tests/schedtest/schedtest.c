@@ -14,14 +14,89 @@
 ** limitations under the License.
 */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-int main(int argc, char **argv) {
+/* Wakeup latencies are kept in 1us buckets up to this, and above it only
+ * count towards the max. */
+#define HIST_BUCKETS 10000
+#define MAX_THREADS 1024
+
+#ifndef SCHED_FLAG_UTIL_CLAMP_MIN
+#define SCHED_FLAG_UTIL_CLAMP_MIN 0x20
+#define SCHED_FLAG_UTIL_CLAMP_MAX 0x40
+#endif
+
+/* Not in all libcs yet */
+struct sched_attr_v1 {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+    uint32_t sched_util_min;
+    uint32_t sched_util_max;
+};
+
+enum wake_method {
+    WAKE_TIMER,
+    WAKE_FUTEX,
+    WAKE_PIPE,
+};
+
+struct options {
+    enum wake_method method;
+    int threads_per_cpu;
+    int policy;
+    int priority;       /* nice for SCHED_OTHER, rt priority otherwise */
+    int uclamp_min;     /* -1 to leave it alone */
+    long interval_us;
+    int duration_s;
+    int load_threads;
+    int load_duty;      /* percent of each 10ms the load threads spin */
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint32_t buckets[HIST_BUCKETS + 1];
+};
+
+/* A thread whose wakeups are timed, and for futex and pipe wakeups, the
+ * thread on the next cpu waking it. */
+struct sleeper {
+    pthread_t thread;
+    pthread_t waker;
+    int cpu;
+    int waker_cpu;
+    int pipe_fds[2];
+    volatile int futex_word;
+    volatile uint64_t wake_stamp;
+    struct histogram hist;
+};
+
+static struct options opts;
+static volatile int stopping;
+
+static void sleep_loop() {
     int i;
 
     struct timeval tv1;
@@ -45,5 +120,340 @@ int main(int argc, char **argv) {
             avg = 0;
         }
     }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void hist_add(struct histogram *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    h->buckets[us < HIST_BUCKETS ? us : HIST_BUCKETS]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+static void hist_merge(struct histogram *to, const struct histogram *from) {
+    int i;
+    for (i = 0; i <= HIST_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+    to->count += from->count;
+    to->sum_ns += from->sum_ns;
+    if (from->max_ns > to->max_ns) to->max_ns = from->max_ns;
+}
+
+/* In us, rounded up to the bucket, or the max past the last bucket. */
+static double hist_percentile(const struct histogram *h, int percent) {
+    uint64_t target = (h->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target && seen > 0) return i + 1;
+    }
+    return h->max_ns / 1000.0;
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* Applies the policy, priority and uclamp under test to the calling thread. */
+static int set_sched(int policy, int priority, int uclamp_min) {
+#ifdef __NR_sched_setattr
+    struct sched_attr_v1 attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sched_policy = policy;
+    if (policy == SCHED_OTHER) {
+        attr.sched_nice = priority;
+    } else {
+        attr.sched_priority = priority;
+    }
+    if (uclamp_min >= 0) {
+        attr.sched_flags = SCHED_FLAG_UTIL_CLAMP_MIN;
+        attr.sched_util_min = uclamp_min;
+    }
+    if (syscall(__NR_sched_setattr, 0, &attr, 0) == 0) return 0;
+    if (uclamp_min >= 0) return -1;
+#else
+    if (uclamp_min >= 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+    if (policy == SCHED_OTHER) {
+        return setpriority(PRIO_PROCESS, syscall(__NR_gettid), priority);
+    } else {
+        struct sched_param param;
+        param.sched_priority = priority;
+        return sched_setscheduler(0, policy, &param);
+    }
+}
+
+static void *sleeper_main(void *arg) {
+    struct sleeper *s = arg;
+    uint64_t next = now_ns();
+    int seen = 0;
+
+    pin_to_cpu(s->cpu);
+    if (set_sched(opts.policy, opts.priority, opts.uclamp_min) != 0) {
+        fprintf(stderr, "Cannot set the scheduling policy of cpu %d threads: %s\n",
+                s->cpu, strerror(errno));
+        exit(1);
+    }
+
+    while (!stopping) {
+        uint64_t stamp;
+
+        switch (opts.method) {
+        case WAKE_TIMER: {
+            struct timespec ts;
+            next += opts.interval_us * 1000;
+            ns_to_timespec(next, &ts);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+            stamp = next;
+            break;
+        }
+        case WAKE_FUTEX:
+            while (s->futex_word == seen && !stopping) {
+                syscall(__NR_futex, &s->futex_word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+            }
+            seen = s->futex_word;
+            stamp = s->wake_stamp;
+            break;
+        case WAKE_PIPE:
+        default:
+            if (read(s->pipe_fds[0], &stamp, sizeof(stamp)) != sizeof(stamp)) return NULL;
+            break;
+        }
+
+        uint64_t now = now_ns();
+        if (!stopping) hist_add(&s->hist, now > stamp ? now - stamp : 0);
+    }
+    return NULL;
+}
+
+/* Wakes the sleeper every interval, stamping the time just before. */
+static void *waker_main(void *arg) {
+    struct sleeper *s = arg;
+    uint64_t next = now_ns();
+
+    pin_to_cpu(s->waker_cpu);
+    while (!stopping) {
+        struct timespec ts;
+        uint64_t stamp;
+
+        next += opts.interval_us * 1000;
+        ns_to_timespec(next, &ts);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+
+        stamp = now_ns();
+        if (opts.method == WAKE_FUTEX) {
+            s->wake_stamp = stamp;
+            __sync_fetch_and_add(&s->futex_word, 1);
+            syscall(__NR_futex, &s->futex_word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        } else if (write(s->pipe_fds[1], &stamp, sizeof(stamp)) != sizeof(stamp)) {
+            break;
+        }
+    }
+
+    /* let the sleeper see stopping */
+    if (opts.method == WAKE_FUTEX) {
+        __sync_fetch_and_add(&s->futex_word, 1);
+        syscall(__NR_futex, &s->futex_word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    } else {
+        close(s->pipe_fds[1]);
+    }
+    return NULL;
+}
+
+/* Spins for load_duty percent of every 10ms, on whichever cpu it is put. */
+static void *load_main(void *arg) {
+    const uint64_t period = 10000000;
+    uint64_t next = now_ns();
+    volatile uint64_t sink = 0;
+
+    while (!stopping) {
+        uint64_t busy_until = next + period * opts.load_duty / 100;
+        while (now_ns() < busy_until) sink++;
+
+        next += period;
+        if (opts.load_duty < 100) {
+            struct timespec ts;
+            ns_to_timespec(next, &ts);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void print_hist(const char *name, const struct histogram *h) {
+    if (h->count == 0) {
+        printf("%-6s\t%10d\n", name, 0);
+        return;
+    }
+    printf("%-6s\t%10llu\t%8.1f\t%8.0f\t%8.0f\t%8.1f\n", name, (unsigned long long)h->count,
+           h->sum_ns / 1000.0 / h->count, hist_percentile(h, 50), hist_percentile(h, 99),
+           h->max_ns / 1000.0);
+}
+
+static int wakeup_latency() {
+    static struct sleeper sleepers[MAX_THREADS];
+    static struct histogram per_cpu, all;
+    pthread_t loaders[MAX_THREADS];
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0, nsleepers = 0, nloaders = 0;
+    cpu_set_t set;
+    int i, j;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set)) cpus[ncpus++] = i;
+    }
+    if (ncpus * opts.threads_per_cpu > MAX_THREADS) {
+        fprintf(stderr, "Too many threads\n");
+        return 1;
+    }
+
+    for (i = 0; i < opts.load_threads && i < MAX_THREADS; i++) {
+        if (pthread_create(&loaders[nloaders], NULL, load_main, NULL) == 0) nloaders++;
+    }
+
+    for (i = 0; i < ncpus; i++) {
+        for (j = 0; j < opts.threads_per_cpu; j++) {
+            struct sleeper *s = &sleepers[nsleepers];
+            s->cpu = cpus[i];
+            s->waker_cpu = cpus[(i + 1) % ncpus];
+            if (opts.method == WAKE_PIPE && pipe(s->pipe_fds) != 0) {
+                perror("pipe");
+                return 1;
+            }
+            if (pthread_create(&s->thread, NULL, sleeper_main, s) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+            if (opts.method != WAKE_TIMER &&
+                    pthread_create(&s->waker, NULL, waker_main, s) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+            nsleepers++;
+        }
+    }
+
+    sleep(opts.duration_s);
+    stopping = 1;
+
+    for (i = 0; i < nsleepers; i++) {
+        if (opts.method != WAKE_TIMER) pthread_join(sleepers[i].waker, NULL);
+        pthread_join(sleepers[i].thread, NULL);
+    }
+    for (i = 0; i < nloaders; i++) {
+        pthread_join(loaders[i], NULL);
+    }
+
+    printf("%-6s\t%10s\t%8s\t%8s\t%8s\t%8s\n", "[cpu]", "[wakeups]", "[avg us]",
+           "[p50 us]", "[p99 us]", "[max us]");
+    for (i = 0; i < ncpus; i++) {
+        char name[16];
+        memset(&per_cpu, 0, sizeof(per_cpu));
+        for (j = 0; j < nsleepers; j++) {
+            if (sleepers[j].cpu == cpus[i]) hist_merge(&per_cpu, &sleepers[j].hist);
+        }
+        hist_merge(&all, &per_cpu);
+        snprintf(name, sizeof(name), "%d", cpus[i]);
+        print_hist(name, &per_cpu);
+    }
+    print_hist("all", &all);
     return 0;
 }
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-w [-m timer|futex|pipe] [-t threads] [-p other|fifo|rr]\n"
+            "          [-P priority] [-u uclamp_min] [-i interval_us] [-d seconds]\n"
+            "          [-l load_threads] [-D load_duty]]\n"
+            "Without -w, prints the max and avg time of 1ms sleeps, every 1000 sleeps.\n"
+            "    -w  Measure wakeup latency, per cpu, until -d seconds have passed (10).\n"
+            "    -m  How threads are woken: at the end of their timer (default), or by\n"
+            "        a futex or a pipe written by a thread on the next cpu.\n"
+            "    -t  Threads woken on each cpu (1).\n"
+            "    -p  Scheduling policy of the woken threads (other).\n"
+            "    -P  Their nice value with other, or rt priority (0, or 50 with fifo/rr).\n"
+            "    -u  Their minimum utilization clamp, 0 to 1024.\n"
+            "    -i  Wakeup interval in us (1000).\n"
+            "    -l  Background threads loading the cpus (0).\n"
+            "    -D  Percent of the time the background threads run (100).\n",
+            cmd);
+}
+
+int main(int argc, char **argv) {
+    int wakeup = 0;
+    int priority_set = 0;
+    int opt;
+
+    opts.method = WAKE_TIMER;
+    opts.threads_per_cpu = 1;
+    opts.policy = SCHED_OTHER;
+    opts.uclamp_min = -1;
+    opts.interval_us = 1000;
+    opts.duration_s = 10;
+    opts.load_duty = 100;
+
+    while ((opt = getopt(argc, argv, "wm:t:p:P:u:i:d:l:D:")) != -1) {
+        switch (opt) {
+        case 'w': wakeup = 1; break;
+        case 'm':
+            if (!strcmp(optarg, "timer")) opts.method = WAKE_TIMER;
+            else if (!strcmp(optarg, "futex")) opts.method = WAKE_FUTEX;
+            else if (!strcmp(optarg, "pipe")) opts.method = WAKE_PIPE;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 't': opts.threads_per_cpu = atoi(optarg); break;
+        case 'p':
+            if (!strcmp(optarg, "other")) opts.policy = SCHED_OTHER;
+            else if (!strcmp(optarg, "fifo")) opts.policy = SCHED_FIFO;
+            else if (!strcmp(optarg, "rr")) opts.policy = SCHED_RR;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'P': opts.priority = atoi(optarg); priority_set = 1; break;
+        case 'u': opts.uclamp_min = atoi(optarg); break;
+        case 'i': opts.interval_us = atol(optarg); break;
+        case 'd': opts.duration_s = atoi(optarg); break;
+        case 'l': opts.load_threads = atoi(optarg); break;
+        case 'D': opts.load_duty = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (!wakeup) {
+        sleep_loop();
+        return 0;
+    }
+
+    if (!priority_set && opts.policy != SCHED_OTHER) opts.priority = 50;
+    if (opts.threads_per_cpu < 1 || opts.interval_us < 1 || opts.duration_s < 1 ||
+            opts.uclamp_min > 1024 || opts.load_duty < 1 || opts.load_duty > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+    return wakeup_latency();
+}
@@ -30,6 +30,8 @@ LOCAL_SRC_FILES = \
 
 LOCAL_MODULE := sdcard_perf_test
 LOCAL_MODULE_TAGS := eng tests
+LOCAL_C_INCLUDES := system/extras/tests/include
+LOCAL_STATIC_LIBRARIES := libtestUtil
 LOCAL_SHARED_LIBRARIES := libutils libhardware_legacy
 
 include $(BUILD_EXECUTABLE)
@@ -44,6 +44,21 @@ scalability() {
 
 }
 
+# Throughput and latency of random 4k reads vs queue depth
+queue_depth() {
+  local file="/tmp/sdcard-queue-depth.txt"
+  rm -f ${file}
+  echo "# Queue depth tests" | tee -a ${file}
+  echo "# Kernel: $(print_kernel)" | tee -a ${file}
+  echo "# Depth Speed(Kbyte/s) p50 p99 p99.9" | tee -a ${file}
+  for qd in 1 2 4 8 16 32; do
+    adb shell sdcard_perf_test --test=async --engine=aio --direct --pattern=random --queue-depth=${qd} --size=65536 --chunk-size=4 --iterations=5 >/tmp/tmp-sdcard.txt
+    local speed=$(grep '# Speed' /tmp/tmp-sdcard.txt | tail -n 1 | cut -f 3 -d ' ')
+    local pct=$(grep '# Percentiles read' /tmp/tmp-sdcard.txt | tail -n 1 | cut -f 6,10,12 -d ' ')
+    echo "$qd $speed $pct" | tee -a ${file}
+  done
+}
+
 # Readers and writers should not starve each others.
 fairness() {
   # Check readers finished before writers.
@@ -59,6 +74,7 @@ fairness() {
 echo "Make sure debugfs is mounted on the device."
 block_level
 scalability
+queue_depth
 fairness
 
 
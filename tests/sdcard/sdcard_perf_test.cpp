@@ -38,6 +38,10 @@
 #include <linux/fadvise.h>
 #include <unistd.h>
 #include <fts.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 
 #include "stopwatch.h"
 #include "sysutil.h"
@@ -57,6 +61,9 @@
 //  read:        Open a file read it and close.
 //  read_write:  Combine readers and writers.
 //  open_create: Open|create an non existing file.
+//  traverse:    Traverse a deep directory tree.
+//  async:       Keep --queue-depth I/Os of chunk size in flight on a
+//               file, using native AIO or threads (--engine).
 //
 // For each run you can control how many processes will run the test in
 // parallel to simulate a real load (--procnb flag)
@@ -105,6 +112,8 @@ using android_test::TestCase;
 const char *kAppName = "sdcard_perf_test";
 const char *kTestDir = "/sdcard/perf";
 const bool kVerbose = false;
+// Alignment of the offsets, sizes and buffers of O_DIRECT I/Os.
+const int kDirectIoAlignment = 4096;
 
 // Used by getopt to parse the command line.
 struct option long_options[] = {
@@ -121,18 +130,24 @@ struct option long_options[] = {
     {"no-new-fair-sleepers", no_argument, 0, 'z'},
     {"no-normalized-sleepers", no_argument, 0, 'Z'},
     {"fadvise", required_argument, 0, 'a'},
+    {"engine", required_argument, 0, 'E'},
+    {"queue-depth", required_argument, 0, 'q'},
+    {"pattern", required_argument, 0, 'P'},
+    {"direct", no_argument, 0, 'o'},
+    {"read-percent", required_argument, 0, 'r'},
+    {"json", required_argument, 0, 'j'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0},
 };
 
 void usage()
 {
-    printf("sdcard_perf_test --test=write|read|read_write|open_create|traverse [options]\n\n"
+    printf("sdcard_perf_test --test=write|read|read_write|open_create|traverse|async [options]\n\n"
            "  -t --test:        Select the test.\n"
            "  -s --size:        Size in kbytes of the data.\n"
            "  -S --chunk-size:  Size of a chunk. Default to size ie 1 chunk.\n"
            "                    Data will be written/read using that chunk size.\n"
-           "  -D --depth:       Depth of directory tree to create for traversal.\n",
+           "  -D --depth:       Depth of directory tree to create for traversal.\n"
            "  -i --iterations:  Number of time a process should carry its task.\n"
            "  -p --procnb:      Number of processes to use.\n"
            "  -d --dump:        Print the raw timing on stdout.\n"
@@ -142,6 +157,13 @@ void usage()
            "  -z --no-new-fair-sleepers: Turn them off. You need to mount debugfs.\n"
            "  -Z --no-normalized-sleepers: Turn them off. You need to mount debugfs.\n"
            "  -a --fadvise:     Specify an fadvise policy (not supported).\n"
+           "  -E --engine:      aio|threads How the async test keeps I/Os in flight. Default: aio.\n"
+           "  -q --queue-depth: Number of I/Os in flight in the async test. Default: 1.\n"
+           "  -P --pattern:     seq|random Offsets of the async test. Default: seq.\n"
+           "  -o --direct:      Use O_DIRECT in the async test. Chunk size must be a multiple of 4k.\n"
+           "  -r --read-percent: Percentage of reads in the async test, the rest are writes.\n"
+           "                    Default: 100.\n"
+           "  -j --json:        Append a JSON report of the timers of each process to a file.\n"
            );
 }
 
@@ -191,6 +213,13 @@ void printHeader(int argc, char **argv, const TestCase& testCase)
         }
     }
     printf("# Fadvise: %s\n", testCase.fadviseAsStr());
+    if (testCase.type() == TestCase::ASYNC)
+    {
+        printf("# Engine: %s Queue depth: %d Pattern: %s Direct: %s Read percent: %d\n",
+               testCase.engineAsStr(), testCase.queueDepth(),
+               testCase.randomIo() ? "random" : "seq", testCase.directIo() ? "yes" : "no",
+               testCase.readPercent());
+    }
 }
 
 // Remove all the files under kTestDir and clear the caches.
@@ -211,7 +240,7 @@ void parseCmdLine(int argc, char **argv, TestCase *testCase)\
         int option_index = 0;
 
         c = getopt_long (argc, argv,
-                         "hS:s:D:i:p:t:dcf:ezZa:",
+                         "hS:s:D:i:p:t:dcf:ezZa:E:q:P:or:j:",
                          long_options,
                          &option_index);
         // Detect the end of the options.
@@ -267,6 +296,27 @@ void parseCmdLine(int argc, char **argv, TestCase *testCase)\
             case 'a':  // fadvise
                 testCase->setFadvise(optarg);
                 break;
+            case 'E':
+                if (!testCase->setEngine(optarg)) {
+                    fprintf(stderr, "Unknown engine %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                testCase->setQueueDepth(atoi(optarg));
+                break;
+            case 'P':
+                testCase->setRandomIo(strcmp("random", optarg) == 0);
+                break;
+            case 'o':  // o for O_DIRECT
+                testCase->setDirectIo();
+                break;
+            case 'r':
+                testCase->setReadPercent(atoi(optarg));
+                break;
+            case 'j':
+                testCase->setJsonFile(optarg);
+                break;
             case 'h':
                 usage();
                 exit(0);
@@ -677,6 +727,328 @@ bool testTraverse(TestCase *testCase) {
     return true;
 }
 
+// ----------------------------------------------------------------------
+// ASYNC I/O
+
+// Several I/Os of chunk size are kept in flight on one file of the
+// data size, like fio does, to see how the storage behaves at queue
+// depths above 1. Each iteration does as many I/Os as the file has
+// chunks, at sequential or random offsets, reads or writes in the
+// requested ratio. The latency of each I/O, from its submission to its
+// completion, goes to the read or write timer.
+
+struct IoRequest {
+    off_t offset;
+    bool isRead;
+};
+
+struct IoSlot {
+    char *buf;
+    struct timespec start;
+    const IoRequest *request;
+};
+
+// Builds the I/Os of one iteration.
+void buildRequests(TestCase *testCase, unsigned int *seed, IoRequest *requests, size_t num)
+{
+    for (size_t i = 0; i < num; ++i)
+    {
+        size_t chunk = testCase->randomIo() ? rand_r(seed) % num : i;
+        requests[i].offset = off_t(chunk) * testCase->chunkSize();
+        requests[i].isRead = int(rand_r(seed) % 100) < testCase->readPercent();
+    }
+}
+
+void recordIo(TestCase *testCase, const IoRequest& request, const struct timespec& start,
+              const struct timespec& end)
+{
+    StopWatch *timer = request.isRead ? testCase->readTimer() : testCase->writeTimer();
+    timer->add(start, end);
+}
+
+// Native AIO engine: batches of I/Os are submitted as soon as slots of
+// the queue are free.
+bool runAio(TestCase *testCase, int fd, IoSlot *slots, const IoRequest *requests, size_t num)
+{
+    const size_t depth = testCase->queueDepth();
+    aio_context_t ctx = 0;
+    if (syscall(__NR_io_setup, depth, &ctx) < 0)
+    {
+        fprintf(stderr, "io_setup failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct iocb *iocbs = new iocb[depth];
+    struct iocb **batch = new iocb*[depth];
+    struct io_event *events = new io_event[depth];
+    size_t *freeSlots = new size_t[depth];
+    size_t numFree = depth;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        freeSlots[i] = i;
+    }
+
+    bool res = false;
+    size_t issued = 0, done = 0;
+    while (done < num)
+    {
+        size_t batchSize = 0;
+        while (numFree > 0 && issued < num)
+        {
+            size_t idx = freeSlots[--numFree];
+            IoSlot *slot = &slots[idx];
+            slot->request = &requests[issued++];
+
+            struct iocb *cb = &iocbs[idx];
+            memset(cb, 0, sizeof(*cb));
+            cb->aio_data = idx;
+            cb->aio_lio_opcode = slot->request->isRead ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+            cb->aio_fildes = fd;
+            cb->aio_buf = reinterpret_cast<uintptr_t>(slot->buf);
+            cb->aio_nbytes = testCase->chunkSize();
+            cb->aio_offset = slot->request->offset;
+            batch[batchSize++] = cb;
+        }
+
+        if (batchSize > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            for (size_t i = 0; i < batchSize; ++i)
+            {
+                slots[batch[i]->aio_data].start = now;
+            }
+            int submitted = syscall(__NR_io_submit, ctx, batchSize, batch);
+            if (submitted != int(batchSize))
+            {
+                fprintf(stderr, "io_submit failed: %s\n",
+                        submitted < 0 ? strerror(errno) : "partial submission");
+                goto fail;
+            }
+        }
+
+        int completed = syscall(__NR_io_getevents, ctx, 1, depth, events, NULL);
+        if (completed < 0)
+        {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "io_getevents failed: %s\n", strerror(errno));
+            goto fail;
+        }
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        for (int i = 0; i < completed; ++i)
+        {
+            size_t idx = events[i].data;
+            if (events[i].res != int64_t(testCase->chunkSize()))
+            {
+                fprintf(stderr, "Async I/O failed: %lld\n", (long long)events[i].res);
+                goto fail;
+            }
+            recordIo(testCase, *slots[idx].request, slots[idx].start, end);
+            freeSlots[numFree++] = idx;
+            ++done;
+        }
+    }
+    res = true;
+
+fail:
+    // Waits for the I/Os still in flight, their buffers are freed next.
+    syscall(__NR_io_destroy, ctx);
+    delete [] iocbs;
+    delete [] batch;
+    delete [] events;
+    delete [] freeSlots;
+    return res;
+}
+
+// Thread engine: each thread has one I/O in flight at a time, and
+// takes the next one when it is done.
+struct IoThread {
+    TestCase *testCase;
+    int fd;
+    char *buf;
+    const IoRequest *requests;
+    size_t num;
+    volatile size_t *next;
+    // Start and end of each request, recorded once all the threads are
+    // done since the timers are not thread safe.
+    struct timespec *starts;
+    struct timespec *ends;
+    bool ok;
+};
+
+void *ioThread(void *arg)
+{
+    IoThread *t = static_cast<IoThread *>(arg);
+    const size_t chunkSize = t->testCase->chunkSize();
+    while (true)
+    {
+        size_t i = __sync_fetch_and_add(t->next, 1);
+        if (i >= t->num) break;
+
+        const IoRequest& request = t->requests[i];
+        clock_gettime(CLOCK_MONOTONIC, &t->starts[i]);
+        ssize_t s = request.isRead ?
+                pread(t->fd, t->buf, chunkSize, request.offset) :
+                pwrite(t->fd, t->buf, chunkSize, request.offset);
+        clock_gettime(CLOCK_MONOTONIC, &t->ends[i]);
+        if (s != ssize_t(chunkSize))
+        {
+            fprintf(stderr, "Thread I/O failed: %s\n", s < 0 ? strerror(errno) : "short");
+            t->ok = false;
+            break;
+        }
+    }
+    return NULL;
+}
+
+bool runThreads(TestCase *testCase, int fd, IoSlot *slots, const IoRequest *requests, size_t num)
+{
+    const size_t depth = testCase->queueDepth();
+    IoThread *threads = new IoThread[depth];
+    pthread_t *tids = new pthread_t[depth];
+    struct timespec *starts = new timespec[num];
+    struct timespec *ends = new timespec[num];
+    volatile size_t next = 0;
+
+    bool res = true;
+    size_t started = 0;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        IoThread *t = &threads[i];
+        t->testCase = testCase;
+        t->fd = fd;
+        t->buf = slots[i].buf;
+        t->requests = requests;
+        t->num = num;
+        t->next = &next;
+        t->starts = starts;
+        t->ends = ends;
+        t->ok = true;
+        if (pthread_create(&tids[i], NULL, ioThread, t) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            res = false;
+            next = num;  // stops the threads already started.
+            break;
+        }
+        ++started;
+    }
+    for (size_t i = 0; i < started; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        res = res && threads[i].ok;
+    }
+
+    if (res)
+    {
+        for (size_t i = 0; i < num; ++i)
+        {
+            recordIo(testCase, requests[i], starts[i], ends[i]);
+        }
+    }
+    delete [] threads;
+    delete [] tids;
+    delete [] starts;
+    delete [] ends;
+    return res;
+}
+
+bool testAsync(TestCase *testCase)
+{
+    const size_t chunkSize = testCase->chunkSize();
+    const size_t num = testCase->dataSize() / chunkSize;
+    const size_t depth = testCase->queueDepth();
+    char filename[80] = {'\0',};
+
+    if (num == 0 || depth == 0)
+    {
+        fprintf(stderr, "Need a size of at least one chunk and a queue depth of at least 1.\n");
+        return false;
+    }
+    if (testCase->directIo() && chunkSize % kDirectIoAlignment != 0)
+    {
+        fprintf(stderr, "O_DIRECT needs a chunk size multiple of %d bytes.\n",
+                kDirectIoAlignment);
+        return false;
+    }
+
+    // Each slot of the queue has its own buffer, aligned for O_DIRECT.
+    IoSlot *slots = new IoSlot[depth];
+    for (size_t i = 0; i < depth; ++i)
+    {
+        if (posix_memalign(reinterpret_cast<void **>(&slots[i].buf), kDirectIoAlignment,
+                           chunkSize) != 0)
+        {
+            fprintf(stderr, "posix_memalign failed\n");
+            return false;
+        }
+        memset(slots[i].buf, 0xaa, chunkSize);
+    }
+
+    // The file is written in full first, so reads and overwrites do not
+    // allocate blocks during the test.
+    sprintf(filename, "%s/file-async-%d", kTestDir, testCase->pid());
+    if (!writeTestFile(testCase, filename))
+    {
+        return false;
+    }
+    int fd = open(filename, O_RDWR | (testCase->directIo() ? O_DIRECT : 0));
+    if (fd < 0)
+    {
+        fprintf(stderr, "open() failed: %s\n", strerror(errno));
+        return false;
+    }
+    FADVISE(fd, 0, 0, testCase->fadvise());
+
+    // Per I/O timers, the throughput is the one of the test timer.
+    testCase->readTimer()->setDataSize(0);
+    testCase->writeTimer()->setDataSize(0);
+
+    IoRequest *requests = new IoRequest[num];
+    unsigned int seed = testCase->pid();
+    bool res = true;
+
+    android::fsyncAndDropCaches(fd);
+    testCase->signalParentAndWait();
+
+    for (size_t i = 0; i < testCase->iter() && res; ++i)
+    {
+        buildRequests(testCase, &seed, requests, num);
+        testCase->testTimer()->start();
+        if (testCase->engine() == TestCase::AIO)
+        {
+            res = runAio(testCase, fd, slots, requests, num);
+        }
+        else
+        {
+            res = runThreads(testCase, fd, slots, requests, num);
+        }
+        if (res && TestCase::FSYNC == testCase->sync())
+        {
+            testCase->syncTimer()->start();
+            fsync(fd);
+            testCase->syncTimer()->stop();
+        }
+        else if (res && TestCase::SYNC == testCase->sync())
+        {
+            testCase->syncTimer()->start();
+            sync();
+            testCase->syncTimer()->stop();
+        }
+        testCase->testTimer()->stop();
+    }
+
+    close(fd);
+    for (size_t i = 0; i < depth; ++i)
+    {
+        free(slots[i].buf);
+    }
+    delete [] slots;
+    delete [] requests;
+    return res;
+}
+
 }  // anonymous namespace
 
 int main(int argc, char **argv)
@@ -713,6 +1085,9 @@ int main(int argc, char **argv)
         case TestCase::TRAVERSE:
             testCase.mTestBody = testTraverse;
             break;
+        case TestCase::ASYNC:
+            testCase.mTestBody = testAsync;
+            break;
         default:
             fprintf(stderr, "Unknown test type %s", testCase.name());
             exit(EXIT_FAILURE);
@@ -29,6 +29,7 @@
 
 #include <malloc.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include "stopwatch.h"
 #include <math.h>
@@ -57,10 +58,11 @@ StopWatch::StopWatch(const char *name, size_t capacity)
       mDuration(0.0), mDeviation(0.0),
       mMinDuration(0.0), mMinIdx(0),
       mMaxDuration(0.0), mMaxIdx(0),
-      mDeltas(NULL), mUsed(false)
+      mDeltas(NULL), mProcessed(false), mUsed(false)
 {
     mStart.tv_sec = 0;
     mStart.tv_nsec = 0;
+    memset(&mHist, 0, sizeof(mHist));
     mData = (Measurement *) malloc(mCapacity * sizeof(Measurement));
 }
 
@@ -97,6 +99,23 @@ void StopWatch::stop()
     ++mDataLen;
 }
 
+void StopWatch::add(const struct timespec& start, const struct timespec& end)
+{
+    checkCapacity();  // capacity is even, there is room for the pair.
+    if (!mUsed || start.tv_sec < mStart.tv_sec ||
+        (start.tv_sec == mStart.tv_sec && start.tv_nsec < mStart.tv_nsec))
+    {
+        mStart = start;
+        mUsed = true;
+    }
+    mData[mDataLen].mTime = start;
+    mData[mDataLen].mIsStart = true;
+    mData[mDataLen + 1].mTime = end;
+    mData[mDataLen + 1].mIsStart = false;
+    ++mNum;
+    mDataLen += 2;
+}
+
 void StopWatch::setPrintRawMode(bool raw)
 {
     printRaw = raw;
@@ -122,6 +141,7 @@ void StopWatch::sprint(char **str, size_t *size)
                        mName, mDuration, mNum);
     printThroughput(str, size);
     printAverageMinMax(str, size);
+    printPercentiles(str, size);
 
     if (printRaw)
     {
@@ -173,7 +193,9 @@ void StopWatch::processSamples()
         long nano = mData[i + 1].mTime.tv_nsec - mData[i].mTime.tv_nsec;
 
         mDeltas[i / 2] = double(second) + double(nano) / 1.0e9;
+        testHistAdd(&mHist, second * 1000000000LL + nano);
     }
+    mProcessed = true;
 
     for (size_t i = 0; i < n; ++i)
     {
@@ -225,6 +247,31 @@ void StopWatch::printAverageMinMax(char **str, size_t *size)
     }
 }
 
+// Like the average, trivial with only one sample.
+void StopWatch::printPercentiles(char **str, size_t *size)
+{
+    size_t n = mDataLen / 2;
+    if (n > 1)
+    {
+        double p50 = testHistPercentile(&mHist, 0.5) / 1.0e9;
+        double p90 = testHistPercentile(&mHist, 0.9) / 1.0e9;
+        double p99 = testHistPercentile(&mHist, 0.99) / 1.0e9;
+        double p999 = testHistPercentile(&mHist, 0.999) / 1.0e9;
+
+        SNPRINTF_OR_RETURN(*str, *size, "# Percentiles %s duration p50 %f p90 %f p99 %f p99.9 %f\n",
+                           mName, p50, p90, p99, p999);
+    }
+}
+
+void StopWatch::json(struct testJson *json)
+{
+    if (!mProcessed)
+    {
+        return;
+    }
+    testJsonResult(json, mName, &mHist, uint64_t(mSizeKbytes) * 1000 * mNum, mDuration);
+}
+
 void StopWatch::printThroughput(char **str, size_t *size)
 {
     if (0 != mSizeKbytes)
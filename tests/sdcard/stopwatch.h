@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <testPerf.h>
 
 namespace android_test {
 
@@ -101,7 +102,13 @@ class StopWatch {
     void start();
     void stop();
 
-    // Print a summary of the measurement and optionaly the raw data.
+    // Records an interval that was timed by the caller. Used when
+    // intervals overlap, like asynchronous I/Os in flight at the same
+    // time, which start and stop cannot express.
+    void add(const struct timespec& start, const struct timespec& end);
+
+    // Print a summary of the measurement, including the median and
+    // tail percentiles of the durations, and optionaly the raw data.
     // The summary is commented out using a leading '#'.  The raw data
     // is a pair (time, duration). The 1st sample is always at time
     // '0.0'.
@@ -114,6 +121,10 @@ class StopWatch {
     // and a warning is printed.
     void sprint(char **str, size_t *size);
 
+    // Add the summary as a result of a JSON report, once sprint has
+    // processed the samples.
+    void json(struct testJson *json);
+
     // @return true if at least one interval was timed.
     bool used() const { return mUsed; }
 
@@ -126,6 +137,7 @@ class StopWatch {
     double timespecToDouble(const struct timespec& time);
     void printAverageMinMax(char **str, size_t *size);
     void printThroughput(char **str, size_t *size);
+    void printPercentiles(char **str, size_t *size);
     // Allocate mDeltas and fill it in. Search for the min and max.
     void processSamples();
 
@@ -147,6 +159,9 @@ class StopWatch {
     double mMaxDuration;
     size_t mMaxIdx;
     double *mDeltas;
+    // The durations in ns, for the percentiles.
+    struct testHist mHist;
+    bool mProcessed;
 
     bool mUsed;
 };
@@ -28,6 +28,9 @@
 
 #include "testcase.h"
 #include <hardware_legacy/power.h>  // wake lock
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -44,7 +47,8 @@ TestCase::TestCase(const char *appName)
       mChunkSize(mDataSize), mTreeDepth(8), mIter(20), mNproc(1),
       mType(UNKNOWN_TEST),  mDump(false), mCpuScaling(false),
       mSync(NO_SYNC), mFadvice(POSIX_FADV_NORMAL), mTruncateToSize(false),
-      mTestTimer(NULL)
+      mEngine(AIO), mQueueDepth(1), mRandomIo(false), mDirectIo(false), mReadPercent(100),
+      mJsonFile(NULL), mTestTimer(NULL)
 {
     // Make sure the cpu and phone are fully awake. The
     // FULL_WAKE_LOCK was used by java apps and don't do
@@ -92,6 +96,8 @@ bool TestCase::runTest()
             close(mIpc[WRITE_TO_CHILD]);
 
             if (kVerbose) printf("Child pid: %d\n", mPid);
+            struct testCpuFreq freqBefore;
+            testCpuFreqSnapshot(&freqBefore);
             if (!mTestBody(this)) {
                 printf("Test failed\n");
             }
@@ -108,6 +114,7 @@ bool TestCase::runTest()
             if(traverseTimer()->used()) traverseTimer()->sprint(&str, &size_left);
 
             write(mIpc[TestCase::WRITE_TO_PARENT], buffer, str - buffer);
+            if (mJsonFile) writeJson(freqBefore);
 
 
             close(mIpc[WRITE_TO_PARENT]);
@@ -140,6 +147,40 @@ bool TestCase::runTest()
     return true;
 }
 
+void TestCase::writeJson(const struct testCpuFreq& before)
+{
+    // The report is built in memory and appended with one write, so that the
+    // lines of the children don't mix.
+    char *report = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&report, &len);
+    if (out == NULL)
+    {
+        fprintf(stderr, "open_memstream failed\n");
+        return;
+    }
+    struct testJson json;
+    testJsonInit(&json, out);
+    // The stop watches use CLOCK_MONOTONIC
+    testJsonBeginReport(&json, mAppName, "monotonic", &before);
+    StopWatch *timers[] = {testTimer(), openTimer(), readTimer(), writeTimer(), syncTimer(),
+                           truncateTimer(), traverseTimer()};
+    for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); ++i)
+    {
+        if (timers[i]->used()) timers[i]->json(&json);
+    }
+    testJsonEndReport(&json);
+    fclose(out);
+
+    int fd = open(mJsonFile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, report, len) != static_cast<ssize_t>(len))
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", mJsonFile, strerror(errno));
+    }
+    if (fd >= 0) close(fd);
+    free(report);
+}
+
 void TestCase::setIter(size_t iter)
 {
     mIter = iter;
@@ -150,7 +191,8 @@ void TestCase::createTimers()
     char total_time[80];
 
     snprintf(total_time, sizeof(total_time), "%s_total", mName);
-    mTestTimer = new StopWatch(total_time, 1);
+    // The async test times each iteration, to get the throughput.
+    mTestTimer = new StopWatch(total_time, ASYNC == mType ? iter() : 1);
     mTestTimer->setDataSize(dataSize());
 
     mOpenTimer = new StopWatch("open", iter() * kReadWriteFactor);
@@ -176,6 +218,7 @@ bool TestCase::setTypeFromName(const char *test_name)
     if (strcmp(mName, "read_write") == 0) mType = READ_WRITE;
     if (strcmp(mName, "open_create") == 0) mType = OPEN_CREATE;
     if (strcmp(mName, "traverse") == 0) mType = TRAVERSE;
+    if (strcmp(mName, "async") == 0) mType = ASYNC;
 
     return UNKNOWN_TEST != mType;
 }
@@ -190,6 +233,28 @@ const char *TestCase::syncAsStr() const
     return mSync == NO_SYNC ? "disabled" : (mSync == FSYNC ? "fsync" : "sync");
 }
 
+bool TestCase::setEngine(const char *engine)
+{
+    if (strcmp(engine, "aio") == 0)
+    {
+        mEngine = AIO;
+    }
+    else if (strcmp(engine, "threads") == 0)
+    {
+        mEngine = THREADS;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char *TestCase::engineAsStr() const
+{
+    return mEngine == AIO ? "aio" : "threads";
+}
+
 void TestCase::setFadvise(const char *advice)
 {
     mFadvice = POSIX_FADV_NORMAL;
@@ -41,9 +41,12 @@ namespace android_test {
 
 class TestCase {
   public:
-    enum Type {UNKNOWN_TEST, WRITE, READ, OPEN_CREATE, READ_WRITE, TRAVERSE};
+    enum Type {UNKNOWN_TEST, WRITE, READ, OPEN_CREATE, READ_WRITE, TRAVERSE, ASYNC};
     enum Pipe {READ_FROM_CHILD = 0, WRITE_TO_PARENT, READ_FROM_PARENT, WRITE_TO_CHILD};
     enum Sync {NO_SYNC, FSYNC, SYNC};
+    // How the async test keeps several I/Os in flight: Linux native
+    // AIO, or one thread doing synchronous I/O per slot of the queue.
+    enum Engine {AIO, THREADS};
 
     // Reads takes less time than writes. This is a basic
     // approximation of how much longer the read tasks must run to
@@ -95,9 +98,32 @@ class TestCase {
     void setFadvise(const char *advice);
     const char *fadviseAsStr() const;
 
+    Engine engine() const { return mEngine; }
+    bool setEngine(const char *engine);
+    const char *engineAsStr() const;
+
+    // Number of I/Os the async test keeps in flight.
+    size_t queueDepth() const { return mQueueDepth; }
+    void setQueueDepth(size_t val) { mQueueDepth = val; }
+
+    // Random offsets instead of sequential ones in the async test.
+    bool randomIo() const { return mRandomIo; }
+    void setRandomIo(bool val) { mRandomIo = val; }
+
+    bool directIo() const { return mDirectIo; }
+    void setDirectIo() { mDirectIo = true; }
+
+    // Percentage of the I/Os of the async test that are reads, the
+    // others are writes.
+    int readPercent() const { return mReadPercent; }
+    void setReadPercent(int val) { mReadPercent = val; }
+
     // Print the samples.
     void setDump() { StopWatch::setPrintRawMode(true); }
 
+    // Append a JSON report of the timers of each process to a file.
+    void setJsonFile(const char *path) { mJsonFile = path; }
+
     StopWatch *testTimer() { return mTestTimer; }
     StopWatch *openTimer() { return mOpenTimer; }
     StopWatch *readTimer() { return mReadTimer; }
@@ -109,6 +135,9 @@ class TestCase {
     // Fork the children, run the test and wait for them to complete.
     bool runTest();
 
+    // Append the timers of this process to the JSON file.
+    void writeJson(const struct testCpuFreq& before);
+
     void signalParentAndWait() {
         if (!android::writePidAndWaitForReply(mIpc[WRITE_TO_PARENT], mIpc[READ_FROM_PARENT])) {
             exit(1);
@@ -146,6 +175,13 @@ private:
     bool mNewFairSleepers;
     bool mNormalizedSleepers;
 
+    Engine mEngine;
+    size_t mQueueDepth;
+    bool mRandomIo;
+    bool mDirectIo;  // open the files with O_DIRECT, bypassing the page cache.
+    int mReadPercent;
+    const char *mJsonFile;
+
     // IPC
     //        Parent               Child(ren)
     // ---------------------------------------
@@ -13,5 +13,7 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES   := wipe_blkdev.c
 LOCAL_MODULE      := wipe_blkdev
 LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES  := system/extras/ext4_utils
+LOCAL_SHARED_LIBRARIES := libext4_utils
 include $(BUILD_EXECUTABLE)
 
@@ -21,86 +21,80 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
-#include <linux/fs.h>
 #include <errno.h>
 
-typedef unsigned long long u64;
+#include "wipe.h"
 
-#ifndef BLKDISCARD
-#define BLKDISCARD _IO(0x12,119)
-#endif
+static const char *method_names[WIPE_METHODS] = {
+    "secure discard",
+    "discard",
+    "zeroout",
+};
 
-#ifndef BLKSECDISCARD
-#define BLKSECDISCARD _IO(0x12,125)
-#endif
-
-static u64 get_block_device_size(int fd)
-{
-        u64 size = 0;
-        int ret;
-
-        ret = ioctl(fd, BLKGETSIZE64, &size);
-
-        if (ret)
-                return 0;
-
-        return size;
-}
-
-static int wipe_block_device(int fd, u64 len, int secure)
+static void print_progress(u64 done, u64 total, void *cookie)
 {
-    u64 range[2];
-    int ret;
-    int req;
-
-    range[0] = 0;
-    range[1] = len;
-    if (secure) {
-       req = BLKSECDISCARD;
-    } else {
-       req = BLKDISCARD;
-    }
-
-    ret = ioctl(fd, req, &range);
-    if (ret < 0) {
-        fprintf(stderr, "%s discard failed, errno = %d\n",
-                secure ? "Secure" : "Nonsecure", errno);
+    int *last_percent = cookie;
+    int percent = total ? (int)(done * 100 / total) : 100;
+
+    if (percent != *last_percent) {
+        *last_percent = percent;
+        fprintf(stderr, "\r%3d%%", percent);
+        if (done == total) {
+            fprintf(stderr, "\n");
+        }
     }
-
-    return ret;
 }
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage: wipe_blkdev [-s] <partition>\n");
+    fprintf(stderr, "Usage: wipe_blkdev [-s] [-z] [-j threads] [-c chunk_mb] <partition>\n"
+                    "    -s  Use secure discard instead of discard\n"
+                    "    -z  Zero out the device if discarding is not supported\n"
+                    "    -j  Number of threads issuing requests (one per cpu)\n"
+                    "    -c  Size of each request in MB (64)\n");
     exit(1);
 }
 
 int main(int argc, char *argv[])
 {
+    struct wipe_options opts;
+    enum wipe_method used;
     int secure = 0;
+    int zeroout = 0;
+    int last_percent = -1;
     char *devname;
     int fd;
     u64 len;
     struct stat statbuf;
     int ret;
+    int opt;
 
-    if ((argc != 2) && (argc != 3)) {
-        usage();
-    }
+    memset(&opts, 0, sizeof(opts));
 
-    if (argc == 3) {
-        if (!strcmp(argv[1], "-s")) {
+    while ((opt = getopt(argc, argv, "szj:c:")) != -1) {
+        switch (opt) {
+        case 's':
             secure = 1;
-            devname = argv[2];
-        } else {
+            break;
+        case 'z':
+            zeroout = 1;
+            break;
+        case 'j':
+            opts.threads = atoi(optarg);
+            break;
+        case 'c':
+            opts.chunk_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        default:
             usage();
         }
-    } else {
-        devname = argv[1];
     }
 
+    if (optind != argc - 1) {
+        usage();
+    }
+    devname = argv[optind];
+
     fd = open(devname, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Cannot open device %s\n", devname);
@@ -124,7 +118,19 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    ret = wipe_block_device(fd, len, secure);
+    opts.methods = WIPE_ALLOW(secure ? WIPE_SECURE_DISCARD : WIPE_DISCARD);
+    if (zeroout) {
+        opts.methods |= WIPE_ALLOW(WIPE_ZEROOUT);
+    }
+    opts.progress = print_progress;
+    opts.cookie = &last_percent;
+
+    ret = wipe_block_device_range(fd, 0, len, &opts, &used);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot wipe %s\n", devname);
+    } else {
+        fprintf(stderr, "Wiped %s with %s\n", devname, method_names[used]);
+    }
 
     close(fd);
 
@@ -15,8 +15,10 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +28,11 @@
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
 #include <cutils/klog.h>
 
 #define NSEC_PER_SEC (1000*1000*1000)
@@ -37,6 +44,273 @@ long long timediff_ns(const struct timespec *a, const struct timespec *b) {
             (a->tv_nsec - b->tv_nsec);
 }
 
+static const char kSuspendStats[] = "/sys/kernel/debug/suspend_stats";
+static const char kWakeupSources[] = "/sys/kernel/debug/wakeup_sources";
+static const char kResumeReason[] = "/sys/kernel/wakeup_reasons/last_resume_reason";
+static const char kSuspendTime[] = "/sys/kernel/wakeup_reasons/last_suspend_time";
+static const char kPmPrintTimes[] = "/sys/power/pm_print_times";
+
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int)
+{
+    interrupted = 1;
+}
+
+static bool read_file(const char *path, std::string *out)
+{
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    out->clear();
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out->append(buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+static bool write_file(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+/* Values of a sample, in ms, summarized by percentiles. */
+struct samples {
+    std::vector<double> values;
+
+    void add(double v) { values.push_back(v); }
+
+    double percentile(int p) const {
+        std::vector<double> sorted(values);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[(sorted.size() - 1) * p / 100];
+    }
+
+    double mean() const {
+        double sum = 0;
+        for (double v : values) sum += v;
+        return sum / values.size();
+    }
+
+    void print(const char *name) const {
+        if (values.empty()) {
+            printf("  %-28s no samples\n", name);
+            return;
+        }
+        printf("  %-28s n %-6zu mean %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f ms\n",
+               name, values.size(), mean(), percentile(50), percentile(90), percentile(99),
+               percentile(100));
+    }
+};
+
+/* The "success" and "fail" counts of suspend_stats, and the most recent
+ * device that failed to suspend. */
+static bool read_suspend_stats(long *success, long *fail, std::string *last_failed)
+{
+    std::string text;
+    if (!read_file(kSuspendStats, &text)) {
+        return false;
+    }
+    *success = *fail = 0;
+    last_failed->clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        sscanf(line.c_str(), "success: %ld", success);
+        sscanf(line.c_str(), "fail: %ld", fail);
+        size_t dev = line.find("last_failed_dev:");
+        if (dev != std::string::npos) {
+            *last_failed = line.substr(dev);
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+struct wakeup_source {
+    unsigned long wakeup_count;
+    long long prevent_suspend_ms;
+};
+
+static std::map<std::string, wakeup_source> read_wakeup_sources()
+{
+    std::map<std::string, wakeup_source> sources;
+    std::string text;
+    if (!read_file(kWakeupSources, &text)) {
+        return sources;
+    }
+    size_t pos = text.find('\n');
+    while (pos != std::string::npos && pos + 1 < text.size()) {
+        size_t end = text.find('\n', pos + 1);
+        std::string line = text.substr(pos + 1, end == std::string::npos ? end : end - pos - 1);
+        char name[128];
+        unsigned long active, event, wakeup, expire;
+        long long since, total, max, last_change, prevent;
+        if (sscanf(line.c_str(), "%127s %lu %lu %lu %lu %lld %lld %lld %lld %lld", name, &active,
+                   &event, &wakeup, &expire, &since, &total, &max, &last_change, &prevent) == 10) {
+            sources[name] = wakeup_source{wakeup, prevent};
+        }
+        pos = end;
+    }
+    return sources;
+}
+
+/*
+ * Reads the kernel log since the last call for the times of the device
+ * resume callbacks, which the kernel prints with pm_print_times set, adding
+ * them up per device.
+ */
+class device_times {
+public:
+    bool open_log() {
+        fd_ = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd_ < 0) {
+            return false;
+        }
+        lseek(fd_, 0, SEEK_END);
+        return true;
+    }
+
+    void read_cycle() {
+        if (fd_ < 0) return;
+        std::map<std::string, double> cycle;
+        bool resuming = false;
+        char record[1024];
+        while (true) {
+            ssize_t n = read(fd_, record, sizeof(record) - 1);
+            if (n < 0 && errno == EPIPE) continue;  /* overwritten, skip ahead */
+            if (n <= 0) break;
+            record[n] = '\0';
+            char *msg = strchr(record, ';');
+            if (!msg) continue;
+            msg++;
+            if (strstr(msg, "Enabling non-boot CPUs") || strstr(msg, "noirq resume") ||
+                    strstr(msg, "early resume") || strstr(msg, "resume of devices")) {
+                resuming = true;
+            }
+            unsigned long long usecs;
+            const char *ret = strstr(msg, " returned ");
+            const char *after = ret ? strstr(ret, " after ") : NULL;
+            if (!resuming || !after || sscanf(after, " after %llu usecs", &usecs) != 1) {
+                continue;
+            }
+            /* "call <dev>+ returned", or "<driver> <dev>: <callback> returned" */
+            std::string name(msg, ret - msg);
+            if (name.compare(0, 5, "call ") == 0) {
+                name = name.substr(5);
+                if (!name.empty() && name.back() == '+') name.pop_back();
+            } else if (name.find(':') != std::string::npos) {
+                name = name.substr(0, name.find(':'));
+            }
+            cycle[name] += usecs / 1000.0;
+        }
+        for (auto& it : cycle) {
+            resume_[it.first].add(it.second);
+        }
+    }
+
+    void print(size_t top) const {
+        if (resume_.empty()) return;
+        std::vector<std::pair<double, std::string>> order;
+        for (auto& it : resume_) {
+            order.push_back(std::make_pair(-it.second.mean() * it.second.values.size(),
+                                           it.first));
+        }
+        std::sort(order.begin(), order.end());
+        printf("device resume callbacks, by total time:\n");
+        for (size_t i = 0; i < order.size() && i < top; i++) {
+            resume_.at(order[i].second).print(order[i].second.c_str());
+        }
+    }
+
+private:
+    int fd_ = -1;
+    std::map<std::string, samples> resume_;
+};
+
+struct cycle_stats {
+    samples suspend;     /* awake from arming the alarm until suspended */
+    samples resume;      /* from the alarm until this process ran again */
+    samples asleep;
+    samples kernel_suspend_resume;  /* last_suspend_time, on kernels with it */
+    std::map<std::string, int> reasons;
+    int cycles = 0;
+    int not_suspended = 0;
+};
+
+static void print_stats(const cycle_stats& stats, const device_times& devices,
+                        long success0, long fail0,
+                        const std::map<std::string, wakeup_source>& sources0)
+{
+    printf("\n%d cycles, %d without suspending\n", stats.cycles, stats.not_suspended);
+    stats.suspend.print("time to suspend");
+    stats.resume.print("time to resume");
+    stats.asleep.print("time asleep");
+    if (!stats.kernel_suspend_resume.values.empty()) {
+        stats.kernel_suspend_resume.print("kernel suspend + resume");
+    }
+
+    if (!stats.reasons.empty()) {
+        printf("wakeup reasons:\n");
+        for (auto& it : stats.reasons) {
+            printf("  %6d  %s\n", it.second, it.first.c_str());
+        }
+    }
+
+    long success, fail;
+    std::string last_failed;
+    if (read_suspend_stats(&success, &fail, &last_failed)) {
+        printf("suspend_stats: %ld successful, %ld failed suspends\n", success - success0,
+               fail - fail0);
+        if (fail != fail0 && !last_failed.empty()) {
+            printf("  %s\n", last_failed.c_str());
+        }
+    }
+
+    /* the sources that kept the device awake the longest */
+    std::map<std::string, wakeup_source> sources = read_wakeup_sources();
+    std::vector<std::pair<long long, std::string>> order;
+    for (auto& it : sources) {
+        auto before = sources0.find(it.first);
+        long long prevent = it.second.prevent_suspend_ms;
+        unsigned long wakeups = it.second.wakeup_count;
+        if (before != sources0.end()) {
+            prevent -= before->second.prevent_suspend_ms;
+            wakeups -= before->second.wakeup_count;
+        }
+        if (prevent > 0 || wakeups > 0) {
+            order.push_back(std::make_pair(-prevent, it.first));
+        }
+    }
+    std::sort(order.begin(), order.end());
+    if (!order.empty()) {
+        printf("wakeup sources, by time preventing suspend:\n");
+        for (size_t i = 0; i < order.size() && i < 10; i++) {
+            const wakeup_source& ws = sources[order[i].second];
+            auto before = sources0.find(order[i].second);
+            unsigned long wakeups = ws.wakeup_count -
+                    (before != sources0.end() ? before->second.wakeup_count : 0);
+            printf("  %8lld ms  %6lu wakeups  %s\n", -order[i].first, wakeups,
+                   order[i].second.c_str());
+        }
+    }
+
+    devices.print(10);
+    fflush(stdout);
+}
+
 void usage(void)
 {
     printf("usage: suspend_stress [ <options> ]\n"
@@ -44,6 +318,10 @@ void usage(void)
            "  -a,--abort                abort test on late alarm\n"
            "  -c,--count=<count>        number of times to suspend (default infinite)\n"
            "  -t,--time=<seconds>       time to suspend for (default 5)\n"
+           "  -d,--devices              time the resume of each device, from the\n"
+           "                            kernel log with pm_print_times set\n"
+           "  -r,--report=<count>       print the statistics every count cycles, as\n"
+           "                            well as at the end (default 100)\n"
         );
 }
 
@@ -52,14 +330,19 @@ int main(int argc, char **argv)
     int alarm_time = 5;
     int count = -1;
     bool abort_on_failure = false;
+    bool per_device = false;
+    int report_every = 100;
 
     while (1) {
         const static struct option long_options[] = {
             {"abort", no_argument, 0, 'a'},
             {"count", required_argument, 0, 'c'},
             {"time", required_argument, 0, 't'},
+            {"devices", no_argument, 0, 'd'},
+            {"report", required_argument, 0, 'r'},
+            {0, 0, 0, 0},
         };
-        int c = getopt_long(argc, argv, "ac:t:", long_options, NULL);
+        int c = getopt_long(argc, argv, "ac:t:dr:", long_options, NULL);
         if (c < 0) {
             break;
         }
@@ -74,6 +357,12 @@ int main(int argc, char **argv)
         case 't':
             alarm_time = strtoul(optarg, NULL, 0);
             break;
+        case 'd':
+            per_device = true;
+            break;
+        case 'r':
+            report_every = strtoul(optarg, NULL, 0);
+            break;
         case '?':
             usage();
             exit(EXIT_FAILURE);
@@ -115,9 +404,32 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    while (count != 0) {
+    /* print the statistics on ^C rather than losing them */
+    struct sigaction sa = {};
+    sa.sa_handler = on_interrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    device_times devices;
+    if (per_device) {
+        if (!write_file(kPmPrintTimes, "1")) {
+            fprintf(stderr, "cannot set %s: %s\n", kPmPrintTimes, strerror(errno));
+        }
+        if (!devices.open_log()) {
+            perror("cannot open /dev/kmsg");
+        }
+    }
+
+    cycle_stats stats;
+    long success0 = 0, fail0 = 0;
+    std::string last_failed;
+    read_suspend_stats(&success0, &fail0, &last_failed);
+    std::map<std::string, wakeup_source> sources0 = read_wakeup_sources();
+
+    while (count != 0 && !interrupted) {
         struct timespec expected_time;
         struct timespec actual_time;
+        struct timespec start_mono, end_mono, start_boot;
         uint64_t fired = 0;
 
         ret = timerfd_settime(fd, 0, &delay, NULL);
@@ -131,10 +443,12 @@ int main(int argc, char **argv)
             perror("failed to get time");
             exit(EXIT_FAILURE);
         }
+        start_boot = expected_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_mono);
         expected_time.tv_sec += alarm_time;
 
         ret = 0;
-        while (ret != 1) {
+        while (ret != 1 && !interrupted) {
             struct epoll_event out_ev;
             ret = epoll_wait(epoll_fd, &out_ev, 1, -1);
             if (ret < 0 && errno != EINTR) {
@@ -142,6 +456,9 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
             }
         }
+        if (interrupted) {
+            break;
+        }
 
         ssize_t bytes = read(fd, &fired, sizeof(fired));
         if (bytes < 0) {
@@ -160,6 +477,40 @@ int main(int argc, char **argv)
             perror("failed to get time");
             exit(EXIT_FAILURE);
         }
+        clock_gettime(CLOCK_MONOTONIC, &end_mono);
+
+        /*
+         * CLOCK_MONOTONIC stops while suspended and CLOCK_BOOTTIME doesn't:
+         * the difference is the time asleep. The alarm is late by the time
+         * the resume took, and the rest of the time awake went to getting
+         * into suspend.
+         */
+        double awake_ms = timediff_ns(&end_mono, &start_mono) / (double)NSEC_PER_MSEC;
+        double asleep_ms = timediff_ns(&actual_time, &start_boot) / (double)NSEC_PER_MSEC -
+                awake_ms;
+        double resume_ms = std::max(0LL, timediff_ns(&actual_time, &expected_time)) /
+                (double)NSEC_PER_MSEC;
+        std::string reason;
+        stats.cycles++;
+        if (asleep_ms < 1) {
+            stats.not_suspended++;
+        } else {
+            stats.suspend.add(std::max(0.0, awake_ms - resume_ms));
+            stats.resume.add(resume_ms);
+            stats.asleep.add(asleep_ms);
+
+            std::string text;
+            if (read_file(kResumeReason, &text)) {
+                reason = text.substr(0, text.find('\n'));
+                stats.reasons[reason.empty() ? "unknown" : reason]++;
+            }
+            double kernel_s, sleep_s;
+            if (read_file(kSuspendTime, &text) &&
+                    sscanf(text.c_str(), "%lf %lf", &kernel_s, &sleep_s) == 2) {
+                stats.kernel_suspend_resume.add(kernel_s * MSEC_PER_SEC);
+            }
+        }
+        devices.read_cycle();
 
         long long diff = timediff_ns(&actual_time, &expected_time);
         if (llabs(diff) > NSEC_PER_SEC) {
@@ -178,9 +529,18 @@ int main(int argc, char **argv)
 
         time_t t = time(NULL);
         i += fired;
-        printf("timer fired: %d at boottime %lld.%.3ld, %s", i,
+        char timing[256];
+        if (asleep_ms < 1) {
+            snprintf(timing, sizeof(timing), "not suspended");
+        } else {
+            snprintf(timing, sizeof(timing), "suspend %.0f ms, resume %.0f ms%s%s",
+                     std::max(0.0, awake_ms - resume_ms), resume_ms,
+                     reason.empty() ? "" : ", woken by ", reason.c_str());
+        }
+        printf("timer fired: %d at boottime %lld.%.3ld, %s, %s", i,
                    (long long)actual_time.tv_sec,
                    actual_time.tv_nsec / NSEC_PER_MSEC,
+                   timing,
                    ctime(&t));
 
         KLOG_INFO("suspend_stress", "timer fired: %d at boottime %lld.%.3ld, %s", i,
@@ -190,6 +550,14 @@ int main(int argc, char **argv)
 
         if (count > 0)
             count--;
+        if (report_every > 0 && stats.cycles % report_every == 0 && count != 0) {
+            print_stats(stats, devices, success0, fail0, sources0);
+        }
+    }
+
+    print_stats(stats, devices, success0, fail0, sources0);
+    if (per_device) {
+        write_file(kPmPrintTimes, "0");
     }
     return 0;
 }
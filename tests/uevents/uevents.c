@@ -14,12 +14,71 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <cutils/uevent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #define UEVENT_MSG_LEN  1024
 
-int main(int argc, char *argv[])
+#define MAX_BATCH 256
+#define MAX_RCVBUF_SIZES 16
+
+static const char kSeqnumPath[] = "/sys/kernel/uevent_seqnum";
+
+struct bench_options {
+    const char *trigger_path;
+    int count;
+    int rate;               /* events per second, 0 for as fast as possible */
+    int batch;              /* messages per recvmmsg */
+    int rcvbuf_sizes[MAX_RCVBUF_SIZES];
+    int num_rcvbuf_sizes;
+};
+
+/* What ueventd looks at in an event */
+struct uevent {
+    const char *action;
+    const char *path;
+    const char *subsystem;
+    const char *firmware;
+    long long seqnum;
+    int major;
+    int minor;
+};
+
+struct receiver {
+    int fd;
+    int batch;
+    volatile int stop;
+    uint64_t base_seqnum;
+    int count;
+    int64_t *sent_ns;       /* by seqnum - base_seqnum, 0 until sent */
+    int64_t *received_ns;   /* by seqnum - base_seqnum, 0 until received */
+    int overruns;           /* ENOBUFS: the socket buffer overflowed */
+    int64_t parse_ns;
+    uint64_t parse_bytes;
+    int parsed;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void monitor(void)
 {
     int device_fd;
     char msg[UEVENT_MSG_LEN+2];
@@ -28,7 +87,7 @@ int main(int argc, char *argv[])
 
     device_fd = uevent_open_socket(64*1024, true);
     if(device_fd < 0)
-        return -1;
+        return;
 
     while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
         msg[n] = '\0';
@@ -40,6 +99,312 @@ int main(int argc, char *argv[])
 
         printf("%s\n", msg);
     }
+}
+
+/* Splits a message into its keys, as ueventd's parse_event does. */
+static void parse_uevent(const char *msg, int len, struct uevent *uevent)
+{
+    const char *end = msg + len;
+
+    memset(uevent, 0, sizeof(*uevent));
+    uevent->major = -1;
+    uevent->minor = -1;
+    uevent->seqnum = -1;
+
+    while (msg < end && *msg) {
+        if (!strncmp(msg, "ACTION=", 7)) {
+            uevent->action = msg + 7;
+        } else if (!strncmp(msg, "DEVPATH=", 8)) {
+            uevent->path = msg + 8;
+        } else if (!strncmp(msg, "SUBSYSTEM=", 10)) {
+            uevent->subsystem = msg + 10;
+        } else if (!strncmp(msg, "FIRMWARE=", 9)) {
+            uevent->firmware = msg + 9;
+        } else if (!strncmp(msg, "MAJOR=", 6)) {
+            uevent->major = atoi(msg + 6);
+        } else if (!strncmp(msg, "MINOR=", 6)) {
+            uevent->minor = atoi(msg + 6);
+        } else if (!strncmp(msg, "SEQNUM=", 7)) {
+            uevent->seqnum = atoll(msg + 7);
+        }
+        msg += strnlen(msg, end - msg) + 1;
+    }
+}
+
+static long long read_seqnum(int fd)
+{
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return atoll(buf);
+}
+
+/* Receives batches of events with recvmmsg, keeping only those sent by the
+ * kernel as uevent_kernel_multicast_recv does. */
+static void *receiver_main(void *arg)
+{
+    struct receiver *r = arg;
+    static char bufs[MAX_BATCH][UEVENT_MSG_LEN + 2];
+    static char cmsgs[MAX_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+    struct sockaddr_nl addrs[MAX_BATCH];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    int i;
+
+    while (!r->stop) {
+        struct pollfd pfd = { r->fd, POLLIN, 0 };
+        int n;
+
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        for (i = 0; i < r->batch; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = UEVENT_MSG_LEN;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = cmsgs[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i]);
+        }
+
+        int64_t start = now_ns();
+        n = recvmmsg(r->fd, msgs, r->batch, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == ENOBUFS)
+                r->overruns++;
+            continue;
+        }
+        int64_t received_ns = now_ns();
+
+        for (i = 0; i < n; i++) {
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            struct ucred *cred;
+            struct uevent uevent;
+            int len = msgs[i].msg_len;
+
+            if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+                continue;
+            cred = (struct ucred *)CMSG_DATA(cmsg);
+            if (cred->uid != 0 || addrs[i].nl_groups == 0 || addrs[i].nl_pid != 0)
+                continue;
+            if (len >= UEVENT_MSG_LEN)
+                continue;
+            bufs[i][len] = '\0';
+            bufs[i][len + 1] = '\0';
+
+            parse_uevent(bufs[i], len, &uevent);
+            r->parse_bytes += len;
+            r->parsed++;
+
+            /* the sender may not have recorded the seqnum yet, so the
+             * latency is worked out once the run is over */
+            uint64_t k = uevent.seqnum - r->base_seqnum;
+            if (uevent.seqnum > (long long)r->base_seqnum && k <= (uint64_t)r->count &&
+                    !r->received_ns[k - 1]) {
+                r->received_ns[k - 1] = received_ns;
+            }
+        }
+        r->parse_ns += now_ns() - start;
+    }
+    return NULL;
+}
 
+static int compare_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Triggers count events at the given rate with a socket buffer of rcvbuf
+ * bytes, and prints how many arrived and how late. */
+static int run_bench(const struct bench_options *opts, int rcvbuf)
+{
+    struct receiver r;
+    pthread_t thread;
+    int trigger_fd, seqnum_fd;
+    int64_t start, elapsed, next;
+    int sent = 0, i;
+
+    memset(&r, 0, sizeof(r));
+    r.batch = opts->batch;
+    r.count = opts->count;
+    r.sent_ns = calloc(opts->count, sizeof(*r.sent_ns));
+    r.received_ns = calloc(opts->count, sizeof(*r.received_ns));
+    if (!r.sent_ns || !r.received_ns)
+        return -1;
+
+    r.fd = uevent_open_socket(rcvbuf, true);
+    trigger_fd = open(opts->trigger_path, O_WRONLY | O_CLOEXEC);
+    seqnum_fd = open(kSeqnumPath, O_RDONLY | O_CLOEXEC);
+    if (r.fd < 0 || trigger_fd < 0 || seqnum_fd < 0) {
+        fprintf(stderr, "cannot open the uevent socket, %s or %s: %s\n",
+                opts->trigger_path, kSeqnumPath, strerror(errno));
+        return -1;
+    }
+
+    /* the events triggered here get the seqnums following this one, unless
+     * other events come in between, which are then counted apart */
+    r.base_seqnum = read_seqnum(seqnum_fd);
+    if (pthread_create(&thread, NULL, receiver_main, &r) != 0)
+        return -1;
+
+    start = next = now_ns();
+    for (i = 0; i < opts->count; i++) {
+        int64_t t;
+        long long seqnum;
+
+        if (opts->rate) {
+            while ((t = now_ns()) < next) {
+                if (next - t > 200000) {
+                    struct timespec ts = { 0, (next - t) / 2 };
+                    nanosleep(&ts, NULL);
+                }
+            }
+            next += 1000000000LL / opts->rate;
+        }
+        t = now_ns();
+        if (write(trigger_fd, "change", 6) != 6) {
+            fprintf(stderr, "cannot write to %s: %s\n", opts->trigger_path, strerror(errno));
+            break;
+        }
+        /* the event has been broadcast by the time the write returns */
+        seqnum = read_seqnum(seqnum_fd);
+        if (seqnum > (long long)r.base_seqnum && seqnum - r.base_seqnum <= (uint64_t)opts->count)
+            r.sent_ns[seqnum - r.base_seqnum - 1] = t;
+        sent++;
+    }
+    elapsed = now_ns() - start;
+
+    /* let the receiver drain what is left */
+    usleep(500000);
+    r.stop = 1;
+    pthread_join(thread, NULL);
+    close(trigger_fd);
+    close(seqnum_fd);
+    close(r.fd);
+
+    /* events of ours whose seqnum was taken by another event in between
+     * are not matched and count as lost */
+    int64_t *lat = malloc(sizeof(*lat) * opts->count);
+    int n = 0, other = 0;
+    for (i = 0; i < opts->count; i++) {
+        if (r.sent_ns[i] && r.received_ns[i])
+            lat[n++] = r.received_ns[i] - r.sent_ns[i];
+        else if (r.received_ns[i])
+            other++;
+    }
+    qsort(lat, n, sizeof(*lat), compare_i64);
+
+    printf("%8d\t%6d\t%8d\t%6d\t%8d\t%8.0f", rcvbuf / 1024, sent, n, sent - n,
+           r.overruns, sent / (elapsed / 1e9));
+    if (n) {
+        printf("\t%8.1f\t%8.1f\t%8.1f", lat[(n - 1) / 2] / 1e3, lat[(n - 1) * 99 / 100] / 1e3,
+               lat[n - 1] / 1e3);
+    } else {
+        printf("\t%8s\t%8s\t%8s", "-", "-", "-");
+    }
+    if (r.parse_ns) {
+        printf("\t%10.0f\t%8.1f\n", r.parsed / (r.parse_ns / 1e9),
+               r.parse_bytes / (r.parse_ns / 1e9) / (1 << 20));
+    } else {
+        printf("\t%10s\t%8s\n", "-", "-");
+    }
+    if (other)
+        printf("# %d events from other sources were received\n", other);
+
+    free(lat);
+    free(r.sent_ns);
+    free(r.received_ns);
+    return 0;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-b [-p uevent_file] [-n count] [-r rate] [-s kb[,kb...]] [-m batch]]\n"
+            "Without -b, prints the uevents received.\n"
+            "    -b  Benchmark: trigger events and time their delivery.\n"
+            "    -p  uevent file written to trigger change events\n"
+            "        (/sys/devices/virtual/mem/null/uevent).\n"
+            "    -n  Events per run (10000).\n"
+            "    -r  Events per second, 0 for as fast as possible (0).\n"
+            "    -s  Socket receive buffer sizes to run with, in KB (64,256,1024).\n"
+            "    -m  Messages received per recvmmsg, up to %d (64).\n",
+            cmd, MAX_BATCH);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts;
+    int bench = 0;
+    int opt, i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.trigger_path = "/sys/devices/virtual/mem/null/uevent";
+    opts.count = 10000;
+    opts.batch = 64;
+
+    while ((opt = getopt(argc, argv, "bp:n:r:s:m:")) != -1) {
+        switch (opt) {
+        case 'b':
+            bench = 1;
+            break;
+        case 'p':
+            opts.trigger_path = optarg;
+            break;
+        case 'n':
+            opts.count = atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = atoi(optarg);
+            break;
+        case 's': {
+            char *s = optarg;
+            opts.num_rcvbuf_sizes = 0;
+            while (*s && opts.num_rcvbuf_sizes < MAX_RCVBUF_SIZES) {
+                opts.rcvbuf_sizes[opts.num_rcvbuf_sizes++] = strtol(s, &s, 0) * 1024;
+                if (*s == ',')
+                    s++;
+            }
+            break;
+        }
+        case 'm':
+            opts.batch = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!bench) {
+        monitor();
+        return 0;
+    }
+
+    if (opts.num_rcvbuf_sizes == 0) {
+        opts.rcvbuf_sizes[0] = 64 * 1024;
+        opts.rcvbuf_sizes[1] = 256 * 1024;
+        opts.rcvbuf_sizes[2] = 1024 * 1024;
+        opts.num_rcvbuf_sizes = 3;
+    }
+    if (opts.count <= 0 || opts.rate < 0 || opts.batch < 1 || opts.batch > MAX_BATCH) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%8s\t%6s\t%8s\t%6s\t%8s\t%8s\t%8s\t%8s\t%8s\t%10s\t%8s\n", "[rcvbuf KB]",
+           "[sent]", "[received]", "[lost]", "[ENOBUFS]", "[sent/s]", "[p50 us]", "[p99 us]",
+           "[max us]", "[parsed/s]", "[MB/s]");
+    for (i = 0; i < opts.num_rcvbuf_sizes; i++) {
+        if (run_bench(&opts, opts.rcvbuf_sizes[i]) != 0)
+            return 1;
+    }
     return 0;
 }
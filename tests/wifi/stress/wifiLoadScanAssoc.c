@@ -43,6 +43,26 @@
  * pass via the -p option.  There is also a default time in which the
  * test executes, which is given by DEFAULT_DURATION and can be overriden
  * through the use of the -t command-line option.
+ *
+ * Each pass also times the phases of bringing up the connection, on
+ * the CPU the test was bound to:
+ *
+ *   load_driver       wifi_load_driver()
+ *   start_supplicant  wifi_start_supplicant()
+ *   scan              SCAN request to CTRL-EVENT-SCAN-RESULTS
+ *   assoc             "Trying to authenticate/associate" to
+ *                     CTRL-EVENT-CONNECTED
+ *   dhcp              CTRL-EVENT-CONNECTED to an IPv4 address on the
+ *                     interface, only when a DHCP client command is
+ *                     given with -c, since the framework is stopped
+ *
+ * The scan, assoc and dhcp phases are timed from the supplicant events
+ * received during the random delay, so a phase still in progress when
+ * the supplicant is stopped is counted as incomplete.  Each pass prints
+ * its phases with the 1 minute load average and the percentage of busy
+ * CPU time during the delay, and a summary of the latency percentiles of
+ * each phase, overall and per CPU, is printed at the end and optionally
+ * appended as a JSON report to the file given with -j.
  */
 
 #define _GNU_SOURCE
@@ -51,20 +71,28 @@
 #include <errno.h>
 #include <libgen.h>
 #include <math.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <cutils/properties.h>
 #include <hardware_legacy/wifi.h>
 
 #define LOG_TAG "wifiLoadScanAssocTest"
 #include <utils/Log.h>
+#include <testPerf.h>
 #include <testUtil.h>
 
 #define DEFAULT_START_PASS     0
@@ -84,6 +112,11 @@
 
 #define MAXSTR      100
 #define MAXCMD      500
+#define MAXEVENT   2048
+
+#define POLL_INTERVAL          0.01    // Seconds between checks of the
+                                       // supplicant connection and of the
+                                       // interface address during the delay
 
 typedef unsigned int bool_t;
 #define true (0 == 0)
@@ -96,14 +129,54 @@ float delayMin = DEFAULT_DELAY_MIN;
 float delayMax = DEFAULT_DELAY_MAX;
 bool_t driverLoadedAtStart;
 
+// Phases of a pass that are timed
+enum phase {
+    PHASE_LOAD,
+    PHASE_START,
+    PHASE_SCAN,
+    PHASE_ASSOC,
+    PHASE_DHCP,
+    NUM_PHASES
+};
+static const char *phaseNames[NUM_PHASES] = {
+    "load_driver", "start_supplicant", "scan", "assoc", "dhcp",
+};
+
+// Start and end of each phase of the current pass, in ns of
+// testClockNs, 0 when not seen.  Written by the main thread and by the
+// supplicant event thread, under timingLock.
+struct passTiming {
+    uint64_t start[NUM_PHASES];
+    uint64_t end[NUM_PHASES];
+    int cpu[NUM_PHASES];
+};
+static struct passTiming timing;
+static pthread_mutex_t timingLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Latencies of each phase, overall and per CPU below TEST_MAX_CPUS
+// (indexed by cpu * NUM_PHASES + phase), and the phases started but not
+// completed
+static struct testHist phaseHist[NUM_PHASES];
+static struct testHist *cpuPhaseHist;
+static unsigned int incomplete[NUM_PHASES];
+static const char *dhcpCmd;
+static const char *jsonFile;
+static struct testCpuFreq freqBefore;
+
 // Command-line mutual exclusion detection flags.
 // Corresponding flag set true once an option is used.
 bool_t eFlag, sFlag, pFlag;
 
 // File scope prototypes
 static void init(void);
-static void randDelay(void);
+static void randDelay(int cpu);
 static void randBind(const cpu_set_t *availSet, int *chosenCPU);
+static void *supplicantEvents(void *arg);
+static bool_t interfaceHasAddress(void);
+static uint64_t cpuBusyTicks(uint64_t *total);
+static void recordPass(unsigned int pass, double load, double busy);
+static void printSummary(void);
+static void writeJson(void);
 
 /*
  * Main
@@ -138,7 +211,7 @@ main(int argc, char *argv[])
     testSetLogCatTag(LOG_TAG);
 
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "d:D:s:e:p:t:?")) != -1) {
+    while ((opt = getopt(argc, argv, "d:D:s:e:p:t:c:j:?")) != -1) {
         switch (opt) {
         case 'd': // Minimum Delay
             delayMin = strtod(optarg, &chptr);
@@ -225,6 +298,14 @@ main(int argc, char *argv[])
             }
             break;
 
+        case 'c': // DHCP client command
+            dhcpCmd = optarg;
+            break;
+
+        case 'j': // JSON report
+            jsonFile = optarg;
+            break;
+
         case '?':
         default:
             testPrintE("  %s [options]", basename(argv[0]));
@@ -235,6 +316,9 @@ main(int argc, char *argv[])
             testPrintE("      -t Duration");
             testPrintE("      -d Delay min");
             testPrintE("      -D Delay max");
+            testPrintE("      -c DHCP client command, run in the background "
+                "once connected");
+            testPrintE("      -j Append the phase latencies to a JSON file");
             exit(((optopt == 0) || (optopt == '?')) ? 0 : 6);
         }
     }
@@ -261,6 +345,8 @@ main(int argc, char *argv[])
     testPrintI("delayMax: %f", delayMax);
 
     init();
+    testClockCalibrate();
+    testCpuFreqSnapshot(&freqBefore);
 
     // For each pass
     gettimeofday(&startTime, NULL);
@@ -274,27 +360,45 @@ main(int argc, char *argv[])
 
         // Use a pass dependent sequence of random numbers
         srand48(pass);
+        memset(&timing, 0, sizeof(timing));
 
         // Load WiFi Driver
         randBind(&availCPU, &cpu);
+        timing.cpu[PHASE_LOAD] = cpu;
+        timing.start[PHASE_LOAD] = testClockNs();
         if ((rv = wifi_load_driver()) != 0) {
             testPrintE("CPU: %i wifi_load_driver() failed, rv: %i\n",
                 cpu, rv);
             exit(20);
         }
+        timing.end[PHASE_LOAD] = testClockNs();
         testPrintI("CPU: %i wifi_load_driver succeeded", cpu);
 
         // Start Supplicant
         randBind(&availCPU, &cpu);
+        timing.cpu[PHASE_START] = cpu;
+        timing.start[PHASE_START] = testClockNs();
         if ((rv = wifi_start_supplicant(false)) != 0) {
             testPrintE("CPU: %i wifi_start_supplicant() failed, rv: %i\n",
                 cpu, rv);
             exit(21);
         }
+        timing.end[PHASE_START] = testClockNs();
         testPrintI("CPU: %i wifi_start_supplicant succeeded", cpu);
 
-        // Sleep a random amount of time
-        randDelay();
+        // Sleep a random amount of time, timing the scan, association
+        // and DHCP on the CPU the supplicant was started from
+        uint64_t busyStart, totalStart, busyEnd, totalEnd;
+        double load = -1.0;
+        busyStart = cpuBusyTicks(&totalStart);
+        randDelay(cpu);
+        busyEnd = cpuBusyTicks(&totalEnd);
+        if ((fp = fopen("/proc/loadavg", "r")) != NULL) {
+            if (fscanf(fp, "%lf", &load) != 1) { load = -1.0; }
+            fclose(fp);
+        }
+        recordPass(pass, load, (totalEnd > totalStart)
+            ? 100.0 * (busyEnd - busyStart) / (totalEnd - totalStart) : -1.0);
 
         /*
          * Obtain WiFi Status
@@ -365,6 +469,8 @@ main(int argc, char *argv[])
     testExecCmd(cmd);
 
     testPrintI("Successfully completed %u passes", pass - startPass);
+    printSummary();
+    writeJson();
 
     return 0;
 }
@@ -405,6 +511,12 @@ init(void)
     }
     testPrintI("numAvailCPU: %u", numAvailCPU);
 
+    cpuPhaseHist = calloc(TEST_MAX_CPUS * NUM_PHASES, sizeof(*cpuPhaseHist));
+    if (cpuPhaseHist == NULL) {
+        testPrintE("init failed to allocate the per CPU histograms");
+        exit(44);
+    }
+
     // Stop framework
     rv = snprintf(cmd, sizeof(cmd), "%s", CMD_STOP_FRAMEWORK);
     if (rv >= (signed) sizeof(cmd) - 1) {
@@ -447,12 +559,20 @@ init(void)
  * The setting of DELAY_EXP should always be > 1.0, with higher
  * values causing a more significant bias toward the value
  * of delayMin.
+ *
+ * While delaying, connects to the supplicant as soon as it accepts
+ * connections, requests a scan and receives its events on another
+ * thread, to time the scan, association and DHCP phases, which are
+ * attributed to cpu.
  */
-void randDelay(void)
+void randDelay(int cpu)
 {
-    const unsigned long nanosecspersec = 1000000000;
     float            fract, biasedFract, amt;
     struct timeval   startTime, endTime;
+    pthread_t        eventThread;
+    bool_t           connected = false;
+    bool_t           dhcpStarted = false;
+    char             cmd[MAXCMD];
 
     // Obtain start time
     gettimeofday(&startTime, NULL);
@@ -464,8 +584,56 @@ void randDelay(void)
     biasedFract = pow(DELAY_EXP, fract) / pow(DELAY_EXP, 1.0);
     amt = delayMin + ((delayMax - delayMin) * biasedFract);
 
+    timing.cpu[PHASE_SCAN] = timing.cpu[PHASE_ASSOC]
+        = timing.cpu[PHASE_DHCP] = cpu;
+
     // Delay
-    testDelay(amt);
+    do {
+        if (!connected && wifi_connect_to_supplicant() == 0) {
+            char reply[MAXSTR];
+            size_t replyLen = sizeof(reply) - 1;
+
+            if (pthread_create(&eventThread, NULL, supplicantEvents, NULL)) {
+                testPrintE("randDelay pthread_create failed");
+                exit(60);
+            }
+            connected = true;
+
+            pthread_mutex_lock(&timingLock);
+            timing.start[PHASE_SCAN] = testClockNs();
+            pthread_mutex_unlock(&timingLock);
+            // A FAIL-BUSY reply means a scan is already in progress,
+            // whose results are also the answer to this request.
+            if (wifi_command("SCAN", reply, &replyLen) != 0) {
+                pthread_mutex_lock(&timingLock);
+                timing.start[PHASE_SCAN] = 0;
+                pthread_mutex_unlock(&timingLock);
+            }
+        }
+
+        pthread_mutex_lock(&timingLock);
+        bool_t assocDone = timing.end[PHASE_ASSOC] != 0;
+        pthread_mutex_unlock(&timingLock);
+        if (dhcpCmd && assocDone && !dhcpStarted) {
+            dhcpStarted = true;
+            timing.start[PHASE_DHCP] = testClockNs();
+            snprintf(cmd, sizeof(cmd), "%s >/dev/null 2>&1 &", dhcpCmd);
+            system(cmd);
+        }
+        if (dhcpStarted && !timing.end[PHASE_DHCP] && interfaceHasAddress()) {
+            timing.end[PHASE_DHCP] = testClockNs();
+        }
+
+        gettimeofday(&endTime, NULL);
+        if (tv2double(&endTime) - tv2double(&startTime) >= amt) { break; }
+        testDelay(POLL_INTERVAL);
+    } while (true);
+
+    // Stop receiving the events
+    if (connected) {
+        wifi_close_supplicant_connection();
+        pthread_join(eventThread, NULL);
+    }
 
     // Obtain end time and display delta
     gettimeofday(&endTime, NULL);
@@ -473,6 +641,210 @@ void randDelay(void)
         (float) (tv2double(&endTime) - tv2double(&startTime)));
 }
 
+/*
+ * Supplicant Events
+ *
+ * Receives the events of the supplicant until the connection is closed,
+ * and timestamps the ones that start or end a phase.
+ */
+static void *
+supplicantEvents(void *arg __unused)
+{
+    char buf[MAXEVENT];
+    int len;
+
+    while ((len = wifi_wait_for_event(buf, sizeof(buf) - 1)) >= 0) {
+        uint64_t now = testClockNs();
+
+        buf[len] = '\0';
+        if (strstr(buf, "CTRL-EVENT-TERMINATING")) { break; }
+
+        pthread_mutex_lock(&timingLock);
+        if (strstr(buf, "CTRL-EVENT-SCAN-RESULTS")) {
+            if (timing.start[PHASE_SCAN] && !timing.end[PHASE_SCAN]) {
+                timing.end[PHASE_SCAN] = now;
+            }
+        } else if (strstr(buf, "Trying to authenticate with")
+            || strstr(buf, "Trying to associate with")) {
+            if (!timing.start[PHASE_ASSOC]) {
+                timing.start[PHASE_ASSOC] = now;
+            }
+        } else if (strstr(buf, "CTRL-EVENT-CONNECTED")) {
+            if (timing.start[PHASE_ASSOC] && !timing.end[PHASE_ASSOC]) {
+                timing.end[PHASE_ASSOC] = now;
+            }
+        }
+        pthread_mutex_unlock(&timingLock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Interface Has Address
+ *
+ * Returns true once the WiFi interface, given by the wifi.interface
+ * property, has an IPv4 address.
+ */
+static bool_t
+interfaceHasAddress(void)
+{
+    struct ifreq ifr;
+    char ifname[PROPERTY_VALUE_MAX];
+    int fd;
+    bool_t rv;
+
+    property_get("wifi.interface", ifname, "wlan0");
+    if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        return false;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+    ifr.ifr_addr.sa_family = AF_INET;
+    rv = (ioctl(fd, SIOCGIFADDR, &ifr) == 0)
+        && (((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr.s_addr != 0);
+    close(fd);
+
+    return rv;
+}
+
+/*
+ * CPU Busy Ticks
+ *
+ * Returns the busy clock ticks of all the CPUs from /proc/stat, and their
+ * total in total.
+ */
+static uint64_t
+cpuBusyTicks(uint64_t *total)
+{
+    unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+    FILE *fp;
+
+    *total = 0;
+    if ((fp = fopen("/proc/stat", "r")) == NULL) { return 0; }
+    if (fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+        &sys, &idle, &iowait, &irq, &softirq) != 7) {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    *total = user + nice + sys + idle + iowait + irq + softirq;
+    return user + nice + sys + irq + softirq;
+}
+
+/*
+ * Record Pass
+ *
+ * Adds the phases of the pass to the histograms, and prints them with the
+ * load during the pass.
+ */
+static void
+recordPass(unsigned int pass, double load, double busy)
+{
+    char line[MAXCMD];
+    size_t len = 0;
+    int phase;
+
+    len += snprintf(line + len, sizeof(line) - len,
+        "pass: %u cpu: %i load: %.2f busy: %.0f%%", pass,
+        timing.cpu[PHASE_SCAN], load, busy);
+    for (phase = 0; phase < NUM_PHASES; phase++) {
+        if (!timing.start[phase]) { continue; }
+        if (!timing.end[phase]) {
+            incomplete[phase]++;
+            len += snprintf(line + len, sizeof(line) - len, " %s: -",
+                phaseNames[phase]);
+            continue;
+        }
+
+        uint64_t ns = timing.end[phase] - timing.start[phase];
+        testHistAdd(&phaseHist[phase], ns);
+        if (timing.cpu[phase] < TEST_MAX_CPUS) {
+            testHistAdd(&cpuPhaseHist[timing.cpu[phase] * NUM_PHASES + phase],
+                ns);
+        }
+        len += snprintf(line + len, sizeof(line) - len, " %s: %.1fms",
+            phaseNames[phase], ns / 1e6);
+    }
+    testPrintI("%s", line);
+}
+
+/*
+ * Print Summary
+ *
+ * Prints the latency percentiles of each phase, then of each phase
+ * on each CPU.
+ */
+static void
+printSummary(void)
+{
+    int phase, cpu;
+
+    testPrintI("%-16s %4s %6s %5s %9s %9s %9s %9s %9s", "phase", "cpu",
+        "count", "incmp", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (phase = 0; phase < NUM_PHASES; phase++) {
+        const struct testHist *h = &phaseHist[phase];
+
+        if (!h->count && !incomplete[phase]) { continue; }
+        testPrintI("%-16s %4s %6llu %5u %9.1f %9.1f %9.1f %9.1f %9.1f",
+            phaseNames[phase], "all", (unsigned long long) h->count,
+            incomplete[phase], testHistMean(h) / 1e6,
+            testHistPercentile(h, 0.5) / 1e6,
+            testHistPercentile(h, 0.9) / 1e6,
+            testHistPercentile(h, 0.99) / 1e6, h->max / 1e6);
+    }
+    for (phase = 0; phase < NUM_PHASES; phase++) {
+        for (cpu = 0; cpu < TEST_MAX_CPUS; cpu++) {
+            const struct testHist *h = &cpuPhaseHist[cpu * NUM_PHASES + phase];
+
+            if (!h->count) { continue; }
+            testPrintI("%-16s %4i %6llu %5s %9.1f %9.1f %9.1f %9.1f %9.1f",
+                phaseNames[phase], cpu, (unsigned long long) h->count, "",
+                testHistMean(h) / 1e6, testHistPercentile(h, 0.5) / 1e6,
+                testHistPercentile(h, 0.9) / 1e6,
+                testHistPercentile(h, 0.99) / 1e6, h->max / 1e6);
+        }
+    }
+}
+
+/*
+ * Write JSON
+ *
+ * Appends the phases, overall and per CPU as "<phase>/cpu<n>", to the
+ * JSON report file if one was given.
+ */
+static void
+writeJson(void)
+{
+    struct testJson json;
+    char name[MAXSTR];
+    int phase, cpu;
+    FILE *fp;
+
+    if (jsonFile == NULL) { return; }
+    if ((fp = fopen(jsonFile, "a")) == NULL) {
+        testPrintE("Failed to open %s, errno: %i", jsonFile, errno);
+        return;
+    }
+    testJsonInit(&json, fp);
+    testJsonBeginReport(&json, "wifiLoadScanAssoc", "monotonic", &freqBefore);
+    for (phase = 0; phase < NUM_PHASES; phase++) {
+        if (phaseHist[phase].count) {
+            testJsonResult(&json, phaseNames[phase], &phaseHist[phase], 0, 0);
+        }
+        for (cpu = 0; cpu < TEST_MAX_CPUS; cpu++) {
+            const struct testHist *h = &cpuPhaseHist[cpu * NUM_PHASES + phase];
+
+            if (!h->count) { continue; }
+            snprintf(name, sizeof(name), "%s/cpu%i", phaseNames[phase], cpu);
+            testJsonResult(&json, name, h, 0, 0);
+        }
+    }
+    testJsonEndReport(&json);
+    fclose(fp);
+}
+
 static void
 randBind(const cpu_set_t *availSet, int *chosenCPU)
 {
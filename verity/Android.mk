@@ -55,6 +55,7 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_SANITIZE := integer
 LOCAL_STATIC_LIBRARIES := \
     libfec_host \
+    libjobpool_host \
     libfec_rs_host \
     libcrypto_static \
     libcrypto_utils_static \
@@ -104,9 +105,10 @@ include $(BUILD_PREBUILT)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := build_verity_tree
-LOCAL_SRC_FILES := build_verity_tree.cpp
+LOCAL_SRC_FILES := build_verity_tree.cpp hash_tree.cpp
 LOCAL_MODULE_TAGS := optional
-LOCAL_STATIC_LIBRARIES := libsparse_host libz
+LOCAL_C_INCLUDES := system/extras/libfec/include
+LOCAL_STATIC_LIBRARIES := libsparse_host libz libjobpool_host
 LOCAL_SHARED_LIBRARIES := libcrypto-host libbase
 LOCAL_CFLAGS += -Wall -Werror
 include $(BUILD_HOST_EXECUTABLE)
@@ -16,106 +16,50 @@
 #include <string.h>
 #include <unistd.h>
 
-#include <android-base/file.h>
-
-struct sparse_hash_ctx {
-    unsigned char *hashes;
-    const unsigned char *salt;
-    uint64_t salt_size;
-    uint64_t hash_size;
-    uint64_t block_size;
-    const unsigned char *zero_block_hash;
-    const EVP_MD *md;
-};
+#include <string>
+#include <vector>
 
-#define div_round_up(x,y) (((x) + (y) - 1)/(y))
+#include <android-base/file.h>
 
-#define round_up(x,y) (div_round_up(x,y)*(y))
+#include "hash_tree.h"
 
 #define FATAL(x...) { \
     fprintf(stderr, x); \
     exit(1); \
 }
 
-size_t verity_tree_blocks(uint64_t data_size, size_t block_size, size_t hash_size,
-                          int level)
-{
-    size_t level_blocks = div_round_up(data_size, block_size);
-    int hashes_per_block = div_round_up(block_size, hash_size);
-
-    do {
-        level_blocks = div_round_up(level_blocks, hashes_per_block);
-    } while (level--);
-
-    return level_blocks;
-}
+struct read_ctx {
+    int fd;
+    size_t block_size;
+};
 
-int hash_block(const EVP_MD *md,
-               const unsigned char *block, size_t len,
-               const unsigned char *salt, size_t salt_len,
-               unsigned char *out, size_t *out_size)
+/* verity_read_block_func for raw images */
+static int read_block(void *priv, uint64_t block, unsigned char *data)
 {
-    EVP_MD_CTX *mdctx;
-    unsigned int s;
-    int ret = 1;
-
-    mdctx = EVP_MD_CTX_create();
-    assert(mdctx);
-    ret &= EVP_DigestInit_ex(mdctx, md, NULL);
-    ret &= EVP_DigestUpdate(mdctx, salt, salt_len);
-    ret &= EVP_DigestUpdate(mdctx, block, len);
-    ret &= EVP_DigestFinal_ex(mdctx, out, &s);
-    EVP_MD_CTX_destroy(mdctx);
-    assert(ret == 1);
-    if (out_size) {
-        *out_size = s;
-    }
-    return 0;
-}
+    struct read_ctx *ctx = (struct read_ctx *)priv;
 
-int hash_blocks(const EVP_MD *md,
-                const unsigned char *in, size_t in_size,
-                unsigned char *out, size_t *out_size,
-                const unsigned char *salt, size_t salt_size,
-                size_t block_size)
-{
-    size_t s;
-    *out_size = 0;
-    for (size_t i = 0; i < in_size; i += block_size) {
-        hash_block(md, in + i, block_size, salt, salt_size, out, &s);
-        out += s;
-        *out_size += s;
+    ssize_t n = TEMP_FAILURE_RETRY(pread64(ctx->fd, data, ctx->block_size,
+                                           block * ctx->block_size));
+    if (n != (ssize_t)ctx->block_size) {
+        return -1;
     }
 
     return 0;
 }
 
-int hash_chunk(void *priv, const void *data, int len)
-{
-    struct sparse_hash_ctx *ctx = (struct sparse_hash_ctx *)priv;
-    assert(len % ctx->block_size == 0);
-    if (data) {
-        size_t s;
-        hash_blocks(ctx->md, (const unsigned char *)data, len,
-                    ctx->hashes, &s,
-                    ctx->salt, ctx->salt_size, ctx->block_size);
-        ctx->hashes += s;
-    } else {
-        for (size_t i = 0; i < (size_t)len; i += ctx->block_size) {
-            memcpy(ctx->hashes, ctx->zero_block_hash, ctx->hash_size);
-            ctx->hashes += ctx->hash_size;
-        }
-    }
-    return 0;
-}
-
 void usage(void)
 {
     printf("usage: build_verity_tree [ <options> ] -s <size> | <data> <verity>\n"
            "options:\n"
            "  -a,--salt-str=<string>       set salt to <string>\n"
            "  -A,--salt-hex=<hex digits>   set salt to <hex digits>\n"
+           "  -C,--changed-blocks=<file>   with -P, list of data blocks that changed,\n"
+           "                               e.g. \"7 10-12\"\n"
            "  -h                           show this help\n"
+           "  -j,--threads=<threads>       number of hashing threads (default: one per cpu)\n"
+           "  -P,--prev-tree=<verity>      update the tree of the previous image instead of\n"
+           "                               hashing all of <data>, which must be a raw image\n"
+           "                               of the same size; the salt must be the same\n"
            "  -s,--verity-size=<data size> print the size of the verity tree\n"
            "  -v,                          enable verbose logging\n"
            "  -S                           treat <data image> as a sparse file\n"
@@ -132,18 +76,23 @@ int main(int argc, char **argv)
     size_t block_size = 4096;
     uint64_t calculate_size = 0;
     bool verbose = false;
+    char *prev_tree_filename = NULL;
+    char *changed_filename = NULL;
 
     while (1) {
         const static struct option long_options[] = {
             {"salt-str", required_argument, 0, 'a'},
             {"salt-hex", required_argument, 0, 'A'},
+            {"changed-blocks", required_argument, 0, 'C'},
             {"help", no_argument, 0, 'h'},
+            {"threads", required_argument, 0, 'j'},
+            {"prev-tree", required_argument, 0, 'P'},
             {"sparse", no_argument, 0, 'S'},
             {"verity-size", required_argument, 0, 's'},
             {"verbose", no_argument, 0, 'v'},
             {NULL, 0, 0, 0}
         };
-        int c = getopt_long(argc, argv, "a:A:hSs:v", long_options, NULL);
+        int c = getopt_long(argc, argv, "a:A:C:hj:P:Ss:v", long_options, NULL);
         if (c < 0) {
             break;
         }
@@ -172,9 +121,26 @@ int main(int argc, char **argv)
                 }
             }
             break;
+        case 'C':
+            changed_filename = optarg;
+            break;
         case 'h':
             usage();
             return 1;
+        case 'j': {
+                char* endptr;
+                errno = 0;
+                unsigned long threads = strtoul(optarg, &endptr, 0);
+                if (optarg[0] == '\0' || *endptr != '\0' || errno ||
+                        threads < 1 || threads > 1024) {
+                    FATAL("invalid value of threads\n");
+                }
+                hash_blocks_set_threads((unsigned int)threads);
+            }
+            break;
+        case 'P':
+            prev_tree_filename = optarg;
+            break;
         case 'S':
             sparse = true;
             break;
@@ -214,7 +180,15 @@ int main(int argc, char **argv)
     size_t hash_size = EVP_MD_size(md);
     assert(hash_size * 2 < block_size);
 
+    if (!prev_tree_filename != !changed_filename) {
+        FATAL("--prev-tree and --changed-blocks must be used together\n");
+    }
+
     if (!salt || !salt_size) {
+        if (prev_tree_filename) {
+            FATAL("--prev-tree needs the salt of the previous tree\n");
+        }
+
         salt_size = hash_size;
         salt = new unsigned char[salt_size];
         if (salt == NULL) {
@@ -239,13 +213,7 @@ int main(int argc, char **argv)
             return 1;
         }
         size_t verity_blocks = 0;
-        size_t level_blocks;
-        int levels = 0;
-        do {
-            level_blocks = verity_tree_blocks(calculate_size, block_size, hash_size, levels);
-            levels++;
-            verity_blocks += level_blocks;
-        } while (level_blocks > 1);
+        verity_tree_num_levels(calculate_size, block_size, hash_size, &verity_blocks);
 
         printf("%" PRIu64 "\n", (uint64_t)verity_blocks * block_size);
         return 0;
@@ -264,32 +232,38 @@ int main(int argc, char **argv)
         FATAL("failed to open %s\n", data_filename);
     }
 
-    struct sparse_file *file;
-    if (sparse) {
-        file = sparse_file_import(fd, false, false);
+    struct sparse_file *file = NULL;
+    int64_t len;
+
+    if (prev_tree_filename) {
+        if (sparse) {
+            FATAL("--prev-tree needs a raw image\n");
+        }
+        len = lseek64(fd, 0, SEEK_END);
+        if (len < 0) {
+            FATAL("failed to get the size of %s\n", data_filename);
+        }
     } else {
-        file = sparse_file_import_auto(fd, false, verbose);
-    }
+        if (sparse) {
+            file = sparse_file_import(fd, false, false);
+        } else {
+            file = sparse_file_import_auto(fd, false, verbose);
+        }
+
+        if (!file) {
+            FATAL("failed to read file %s\n", data_filename);
+        }
 
-    if (!file) {
-        FATAL("failed to read file %s\n", data_filename);
+        len = sparse_file_len(file, false, false);
     }
 
-    int64_t len = sparse_file_len(file, false, false);
     if (len % block_size != 0) {
         FATAL("file size %" PRIu64 " is not a multiple of %zu bytes\n",
                 len, block_size);
     }
 
-    int levels = 0;
     size_t verity_blocks = 0;
-    size_t level_blocks;
-
-    do {
-        level_blocks = verity_tree_blocks(len, block_size, hash_size, levels);
-        levels++;
-        verity_blocks += level_blocks;
-    } while (level_blocks > 1);
+    int levels = verity_tree_num_levels(len, block_size, hash_size, &verity_blocks);
 
     unsigned char *verity_tree = new unsigned char[verity_blocks * block_size]();
     unsigned char **verity_tree_levels = new unsigned char *[levels + 1]();
@@ -298,14 +272,8 @@ int main(int argc, char **argv)
         FATAL("failed to allocate memory for verity tree\n");
     }
 
-    unsigned char *ptr = verity_tree;
-    for (int i = levels - 1; i >= 0; i--) {
-        verity_tree_levels[i] = ptr;
-        verity_tree_level_blocks[i] = verity_tree_blocks(len, block_size, hash_size, i);
-        ptr += verity_tree_level_blocks[i] * block_size;
-    }
-    assert(ptr == verity_tree + verity_blocks * block_size);
-    assert(verity_tree_level_blocks[levels - 1] == 1);
+    verity_tree_layout(verity_tree, len, block_size, hash_size, levels,
+                       verity_tree_levels, verity_tree_level_blocks);
 
     unsigned char zero_block_hash[hash_size];
     unsigned char zero_block[block_size];
@@ -315,31 +283,56 @@ int main(int argc, char **argv)
     unsigned char root_hash[hash_size];
     verity_tree_levels[levels] = root_hash;
 
-    struct sparse_hash_ctx ctx;
-    ctx.hashes = verity_tree_levels[0];
-    ctx.salt = salt;
-    ctx.salt_size = salt_size;
-    ctx.hash_size = hash_size;
-    ctx.block_size = block_size;
-    ctx.zero_block_hash = zero_block_hash;
-    ctx.md = md;
+    if (prev_tree_filename) {
+        std::string prev;
+        if (!android::base::ReadFileToString(prev_tree_filename, &prev)) {
+            FATAL("failed to read '%s'\n", prev_tree_filename);
+        }
+        if (prev.size() != verity_blocks * block_size) {
+            FATAL("'%s' is not a tree for %" PRIu64 " bytes of data\n",
+                    prev_tree_filename, len);
+        }
+        memcpy(verity_tree, prev.data(), prev.size());
+
+        std::vector<uint64_t> changed;
+        if (!verity_read_block_list(changed_filename, &changed)) {
+            FATAL("failed to read block list '%s'\n", changed_filename);
+        }
+        if (!changed.empty() && changed.back() >= len / block_size) {
+            FATAL("block %" PRIu64 " is past the end of %s\n",
+                    changed.back(), data_filename);
+        }
 
-    sparse_file_callback(file, false, false, hash_chunk, &ctx);
+        struct read_ctx rctx = { fd, block_size };
+        if (verity_tree_update(md, verity_tree_levels, levels, salt, salt_size,
+                               block_size, changed, read_block, &rctx,
+                               NULL) != 0) {
+            FATAL("failed to read %s\n", data_filename);
+        }
 
-    sparse_file_destroy(file);
-    close(fd);
+        if (verbose) {
+            printf("rehashed %zu of %" PRIu64 " blocks\n", changed.size(),
+                    len / block_size);
+        }
 
-    for (int i = 0; i < levels; i++) {
-        size_t out_size;
-        hash_blocks(md,
-                verity_tree_levels[i], verity_tree_level_blocks[i] * block_size,
-                verity_tree_levels[i + 1], &out_size,
-                salt, salt_size, block_size);
-          if (i < levels - 1) {
-              assert(div_round_up(out_size, block_size) == verity_tree_level_blocks[i + 1]);
-          } else {
-              assert(out_size == hash_size);
-          }
+        close(fd);
+    } else {
+        struct sparse_hash_ctx ctx;
+        ctx.hashes = verity_tree_levels[0];
+        ctx.salt = salt;
+        ctx.salt_size = salt_size;
+        ctx.hash_size = hash_size;
+        ctx.block_size = block_size;
+        ctx.zero_block_hash = zero_block_hash;
+        ctx.md = md;
+
+        sparse_file_callback(file, false, false, hash_chunk, &ctx);
+
+        sparse_file_destroy(file);
+        close(fd);
+
+        verity_tree_hash_levels(md, verity_tree_levels, verity_tree_level_blocks,
+                                levels, salt, salt_size, block_size);
     }
 
     for (size_t i = 0; i < hash_size; i++) {
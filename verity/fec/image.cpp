@@ -27,13 +27,13 @@ extern "C" {
 #include <fcntl.h>
 #include <getopt.h>
 #include <openssl/sha.h>
-#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sparse/sparse.h>
+#include <jobpool/jobpool.h>
 #include "image.h"
 
 #if defined(__linux__)
@@ -53,7 +53,9 @@ void image_free(image *ctx)
 {
     assert(ctx->input == ctx->output);
 
-    if (ctx->input) {
+    if (ctx->map_size) {
+        munmap(ctx->input, ctx->map_size);
+    } else if (ctx->input) {
         delete[] ctx->input;
     }
 
@@ -88,6 +90,11 @@ static int process_chunk(void *priv, const void *data, int len)
     }
 
     ctx->pos += len;
+
+    if (ctx->chunk) {
+        return ctx->chunk(ctx->hook_priv, data, len);
+    }
+
     return 0;
 }
 
@@ -116,6 +123,10 @@ static void file_image_load(const std::vector<int>& fds, image *ctx)
         size += len;
     }
 
+    if (ctx->reserve) {
+        size += ctx->reserve(ctx->hook_priv, size);
+    }
+
     calculate_rounds(size, ctx);
 
     if (ctx->verbose) {
@@ -142,6 +153,112 @@ static void file_image_load(const std::vector<int>& fds, image *ctx)
     }
 }
 
+/* asks the kernel to read `len' bytes of mapped input from `offset' */
+static void prefetch(image *ctx, uint64_t offset, uint64_t len)
+{
+    static long page_size = sysconf(_SC_PAGESIZE);
+
+    if (offset >= ctx->inp_size) {
+        return;
+    }
+
+    if (offset + len > ctx->inp_size) {
+        len = ctx->inp_size - offset;
+    }
+
+    uint64_t start = offset - offset % page_size;
+    madvise(&ctx->input[start], len + offset - start, MADV_WILLNEED);
+}
+
+/* maps the input files next to each other instead of copying them to
+   memory, so clean pages can be dropped by the kernel when memory is low,
+   and the size of the image isn't limited by RAM */
+static void file_image_map(const std::vector<int>& fds, image *ctx)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t size = 0;
+    std::vector<uint64_t> sizes;
+
+    for (auto fd : fds) {
+        off64_t len = lseek64(fd, 0, SEEK_END);
+
+        if (len < 0) {
+            FATAL("failed to get file size: %s\n", strerror(errno));
+        }
+
+        /* each file is mapped at a page aligned offset */
+        if (len % page_size) {
+            FATAL("file size %" PRIu64 " is not a multiple of the page "
+                "size %ld, cannot map\n", (uint64_t)len, page_size);
+        }
+
+        sizes.push_back(len);
+        size += len;
+    }
+
+    uint64_t data_size = size;
+
+    if (ctx->reserve) {
+        size += ctx->reserve(ctx->hook_priv, size);
+    }
+
+    calculate_rounds(size, ctx);
+
+    ctx->map_size = fec_div_round_up(ctx->inp_size, page_size) * page_size;
+
+    if (ctx->verbose) {
+        INFO("mapping %" PRIu64 " bytes\n", ctx->inp_size);
+    }
+
+    /* reserve the address space, the part after the files stays as zeroed
+       anonymous memory */
+    void *base = mmap(NULL, ctx->map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) {
+        FATAL("failed to map %" PRIu64 " bytes: %s\n", ctx->map_size,
+            strerror(errno));
+    }
+
+    ctx->input = (uint8_t *)base;
+    ctx->output = ctx->input;
+
+    uint64_t offset = 0;
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        /* private mappings, so corrections are only written to the output
+           file by image_save */
+        if (sizes[i] > 0 && mmap(&ctx->input[offset], sizes[i],
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fds[i],
+                0) == MAP_FAILED) {
+            FATAL("failed to map input: %s\n", strerror(errno));
+        }
+
+        offset += sizes[i];
+        close(fds[i]);
+    }
+
+    ctx->pos = 0;
+
+    while (ctx->chunk && ctx->pos < data_size) {
+        uint64_t len = data_size - ctx->pos;
+
+        if (len > IMAGE_MAP_CHUNK) {
+            len = IMAGE_MAP_CHUNK;
+        }
+
+        prefetch(ctx, ctx->pos + len, IMAGE_MAP_CHUNK);
+
+        if (ctx->chunk(ctx->hook_priv, &ctx->input[ctx->pos], (int)len)) {
+            FATAL("failed to process input\n");
+        }
+
+        ctx->pos += len;
+    }
+
+    ctx->pos = data_size;
+}
+
 bool image_load(const std::vector<std::string>& filenames, image *ctx)
 {
     assert(ctx->roots > 0 && ctx->roots < FEC_RSM);
@@ -165,7 +282,11 @@ bool image_load(const std::vector<std::string>& filenames, image *ctx)
         fds.push_back(fd);
     }
 
-    file_image_load(fds, ctx);
+    if (ctx->mmap) {
+        file_image_map(fds, ctx);
+    } else {
+        file_image_load(fds, ctx);
+    }
 
     return true;
 }
@@ -173,8 +294,15 @@ bool image_load(const std::vector<std::string>& filenames, image *ctx)
 bool image_save(const std::string& filename, image *ctx)
 {
     /* TODO: support saving as a sparse file */
-    int fd = TEMP_FAILURE_RETRY(open(filename.c_str(),
-                O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    int flags = O_WRONLY | O_CREAT;
+
+    /* the output can be a mapped input file, which must not be truncated
+       before it's written */
+    if (!ctx->map_size) {
+        flags |= O_TRUNC;
+    }
+
+    int fd = TEMP_FAILURE_RETRY(open(filename.c_str(), flags, 0666));
 
     if (fd < 0) {
         FATAL("failed to open file '%s: %s'\n", filename.c_str(),
@@ -185,6 +313,10 @@ bool image_save(const std::string& filename, image *ctx)
         FATAL("failed to write to output: %s\n", strerror(errno));
     }
 
+    if (ctx->map_size && ftruncate64(fd, ctx->inp_size) < 0) {
+        FATAL("failed to truncate output: %s\n", strerror(errno));
+    }
+
     close(fd);
     return true;
 }
@@ -343,11 +475,81 @@ bool image_ecc_save(image *ctx)
     return true;
 }
 
-static void * process(void *cookie)
+/* worker threads are started by the first call to image_process and live
+   until the process exits; each call splits the codewords into chunks of
+   IMAGE_CHUNK_CODEWORDS that the workers take roughly in order, idle workers
+   taking over the chunks of busy ones, so threads that are slowed down by
+   I/O simply process fewer chunks */
+static jobpool *pool;
+
+/* the current call to image_process */
+struct image_proc_call {
+    image_proc_func func;
+    image *ctx;
+};
+
+static void process_chunks(void *cookie, int worker, uint64_t first_chunk,
+        uint64_t last_chunk)
 {
-    image_proc_ctx *ctx = (image_proc_ctx *)cookie;
-    ctx->func(ctx);
-    return NULL;
+    image_proc_call *call = (image_proc_call *)cookie;
+    image *ctx = call->ctx;
+    uint64_t codewords = ctx->rounds * FEC_BLOCKSIZE;
+
+    /* each worker keeps its state between calls in its scratch buffer */
+    image_proc_ctx *args = (image_proc_ctx *)jobpool_scratch(pool, worker,
+                                sizeof(image_proc_ctx));
+
+    if (!args) {
+        FATAL("failed to allocate state for thread %d\n", worker);
+    }
+
+    args->id = worker;
+
+    /* the RS tables only depend on the number of roots, so keep them
+       between calls */
+    if (!args->rs || args->roots != ctx->roots) {
+        if (args->rs) {
+            free_rs_char(args->rs);
+        }
+
+        args->rs = init_rs_char(FEC_PARAMS(ctx->roots));
+        args->roots = ctx->roots;
+
+        if (!args->rs) {
+            FATAL("failed to initialize encoder for thread %d\n", args->id);
+        }
+    }
+
+    args->func = call->func;
+    args->ctx = ctx;
+
+    for (uint64_t chunk = first_chunk; chunk < last_chunk; ++chunk) {
+        uint64_t first = chunk * IMAGE_CHUNK_CODEWORDS;
+        uint64_t last = first + IMAGE_CHUNK_CODEWORDS;
+
+        if (last > codewords) {
+            last = codewords;
+        }
+
+        args->fec_pos = first * ctx->roots;
+        args->start = first * ctx->rs_n;
+        args->end = last * ctx->rs_n;
+        args->rv = 0;
+
+        /* chunks are taken roughly in order, so with a mapped image, read
+           the next window of each row of the interleaved codewords ahead */
+        if (ctx->map_size && chunk % IMAGE_MAP_WINDOW == 0) {
+            uint64_t window = IMAGE_MAP_WINDOW * IMAGE_CHUNK_CODEWORDS;
+
+            for (int j = 0; j < ctx->rs_n; ++j) {
+                prefetch(ctx, first + window +
+                    j * ctx->rounds * FEC_BLOCKSIZE, window);
+            }
+        }
+
+        args->func(args);
+        __sync_fetch_and_add(&ctx->rv, args->rv);
+    }
 }
 
 bool image_process(image_proc_func func, image *ctx)
@@ -364,81 +566,34 @@ bool image_process(image_proc_func func, image *ctx)
 
     assert(ctx->rounds > 0);
 
-    if ((uint64_t)threads > ctx->rounds) {
-        threads = (int)ctx->rounds;
+    uint64_t chunks = fec_div_round_up(ctx->rounds * FEC_BLOCKSIZE,
+                        IMAGE_CHUNK_CODEWORDS);
+
+    if ((uint64_t)threads > chunks) {
+        threads = (int)chunks;
     }
     if (threads > IMAGE_MAX_THREADS) {
         threads = IMAGE_MAX_THREADS;
     }
 
-    if (ctx->verbose) {
-        INFO("starting %d threads to compute RS(255, %d)\n", threads,
-            ctx->rs_n);
-    }
-
-    pthread_t pthreads[threads];
-    image_proc_ctx args[threads];
-
-    uint64_t current = 0;
-    uint64_t end = ctx->rounds * ctx->rs_n * FEC_BLOCKSIZE;
-    uint64_t rs_blocks_per_thread =
-        fec_div_round_up(ctx->rounds * FEC_BLOCKSIZE, threads);
-
-    if (ctx->verbose) {
-        INFO("computing %" PRIu64 " codes per thread\n", rs_blocks_per_thread);
-    }
-
-    for (int i = 0; i < threads; ++i) {
-        args[i].func = func;
-        args[i].id = i;
-        args[i].ctx = ctx;
-        args[i].rv = 0;
-        args[i].fec_pos = current * ctx->roots;
-        args[i].start = current * ctx->rs_n;
-        args[i].end = (current + rs_blocks_per_thread) * ctx->rs_n;
-
-        args[i].rs = init_rs_char(FEC_PARAMS(ctx->roots));
-
-        if (!args[i].rs) {
-            FATAL("failed to initialize encoder for thread %d\n", i);
-        }
+    if (!pool) {
+        pool = jobpool_new(threads, NULL, 0);
 
-        if (args[i].end > end) {
-            args[i].end = end;
-        } else if (i == threads && args[i].end + rs_blocks_per_thread *
-                                        ctx->rs_n > end) {
-            args[i].end = end;
-        }
-
-        if (ctx->verbose) {
-            INFO("thread %d: [%" PRIu64 ", %" PRIu64 ")\n",
-                i, args[i].start, args[i].end);
-        }
-
-        assert(args[i].start < args[i].end);
-        assert((args[i].end - args[i].start) % ctx->rs_n == 0);
-
-        if (pthread_create(&pthreads[i], NULL, process, &args[i]) != 0) {
-            FATAL("failed to create thread %d\n", i);
+        if (!pool) {
+            FATAL("failed to create threads\n");
         }
+    }
 
-        current += rs_blocks_per_thread;
+    if (ctx->verbose) {
+        INFO("using %d threads to compute RS(255, %d) in %" PRIu64
+            " chunks\n", jobpool_threads(pool), ctx->rs_n, chunks);
     }
 
+    image_proc_call call;
+    call.func = func;
+    call.ctx = ctx;
     ctx->rv = 0;
 
-    for (int i = 0; i < threads; ++i) {
-        if (pthread_join(pthreads[i], NULL) != 0) {
-            FATAL("failed to join thread %d: %s\n", i, strerror(errno));
-        }
-
-        ctx->rv += args[i].rv;
-
-        if (args[i].rs) {
-            free_rs_char(args[i].rs);
-            args[i].rs = NULL;
-        }
-    }
-
+    jobpool_for(pool, 0, chunks, 1, process_chunks, &call);
     return true;
 }
@@ -25,6 +25,12 @@
 
 #define IMAGE_MIN_THREADS     1
 #define IMAGE_MAX_THREADS     128
+/* codewords processed by a thread at a time, a multiple of RS_BATCH_LANES */
+#define IMAGE_CHUNK_CODEWORDS 4096
+/* chunks of codewords to read ahead at a time from a mapped image */
+#define IMAGE_MAP_WINDOW      64
+/* bytes of a mapped image passed to the chunk hook at a time */
+#define IMAGE_MAP_CHUNK       (64 * 1024 * 1024)
 
 #define INFO(x...) \
     fprintf(stderr, x);
@@ -42,6 +48,8 @@ struct image {
     bool sparse;
     /* if true, print more verbose information to stderr */
     bool verbose;
+    /* if true, map input files instead of reading them to memory */
+    bool mmap;
     const char *fec_filename;
     int fec_fd;
     int inp_fd;
@@ -61,6 +69,15 @@ struct image {
     uint8_t *fec;
     uint8_t *input;
     uint8_t *output;
+    /* size of the mapping at `input', or zero if it was allocated */
+    uint64_t map_size;
+    /* optional image_load hooks: `reserve' returns the number of bytes to
+       allocate after `size' bytes of input data, and `chunk' is called for
+       each chunk of input data as it's read, with NULL for holes in sparse
+       files */
+    void *hook_priv;
+    uint64_t (*reserve)(void *priv, uint64_t size);
+    int (*chunk)(void *priv, const void *data, int len);
 };
 
 struct image_proc_ctx;
@@ -75,6 +92,8 @@ struct image_proc_ctx {
     uint64_t start;
     uint64_t end;
     void *rs;
+    /* the number of roots `rs' was initialized for */
+    int roots;
 };
 
 extern bool image_load(const std::vector<std::string>& filename, image *ctx);
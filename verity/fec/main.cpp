@@ -21,6 +21,7 @@ extern "C" {
 #undef NDEBUG
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <fcntl.h>
@@ -28,64 +29,207 @@ extern "C" {
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <android-base/file.h>
+#include <openssl/evp.h>
+#include "hash_tree.h"
 #include "image.h"
+#include "rs_batch.h"
 
 enum {
     MODE_ENCODE,
     MODE_DECODE,
     MODE_PRINTSIZE,
     MODE_GETECCSTART,
-    MODE_GETVERITYSTART
+    MODE_GETVERITYSTART,
+    MODE_VERITY
+};
+
+/* verity metadata block, as written by build_verity_metadata.py */
+#define VERITY_METADATA_SIZE (8 * FEC_BLOCKSIZE)
+#define VERITY_MAGIC 0xB001B001
+#define VERITY_VERSION 0
+#define VERITY_SIGNATURE_SIZE 256
+
+struct verity_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t signature[VERITY_SIGNATURE_SIZE];
+    uint32_t length;
+} __attribute__ ((packed));
+
+/* state for building a hash tree while image_load reads the data */
+struct verity_tree {
+    const EVP_MD *md;
+    size_t hash_size;
+    std::vector<uint8_t> salt;
+    std::string block_device;
+    std::string signer;
+    std::string signer_args;
+    std::string signing_key;
+    /* previous verity and fec files and the list of changed data blocks
+       for incremental updates */
+    std::string prev_verity;
+    std::string prev_fec;
+    std::string changed_blocks;
+    uint64_t data_size;
+    int levels;
+    size_t tree_blocks;
+    std::vector<uint8_t> tree;
+    std::vector<uint8_t *> level_ptrs;
+    std::vector<size_t> level_blocks;
+    std::vector<uint8_t> zero_hash;
+    std::vector<uint8_t> root_hash;
+    sparse_hash_ctx hash;
 };
 
+/* loads RS_BATCH_LANES codewords starting from `i' to `rows', transposed so
+   that row j holds byte j of each codeword */
+static void get_interleaved_rows(uint64_t i, image *fcx, uint8_t *rows)
+{
+    /* byte j of codeword c is at offset c + j * rounds * FEC_BLOCKSIZE, so
+       codewords next to each other are also next to each other in input */
+    uint64_t c = i / fcx->rs_n;
+
+    for (int j = 0; j < fcx->rs_n; ++j) {
+        uint64_t offset = c + j * fcx->rounds * FEC_BLOCKSIZE;
+        uint8_t *row = &rows[j * RS_BATCH_LANES];
+
+        if (unlikely(offset + RS_BATCH_LANES > fcx->inp_size)) {
+            for (int k = 0; k < RS_BATCH_LANES; ++k) {
+                row[k] = image_get_interleaved_byte(i + k * fcx->rs_n + j,
+                            fcx);
+            }
+        } else {
+            memcpy(row, &fcx->input[offset], RS_BATCH_LANES);
+        }
+    }
+}
+
 static void encode_rs(struct image_proc_ctx *ctx)
 {
     struct image *fcx = ctx->ctx;
     int j;
     uint8_t data[fcx->rs_n];
-    uint64_t i;
+    uint64_t i = ctx->start;
+    rs_batch batch;
+
+    if (rs_batch_init(&batch, fcx->roots)) {
+        uint64_t batch_size = RS_BATCH_LANES * fcx->rs_n;
+        uint8_t rows[FEC_RSM * RS_BATCH_LANES];
+        uint8_t parity[FEC_RSM * RS_BATCH_LANES];
+
+        for (; i + batch_size <= ctx->end; i += batch_size) {
+            get_interleaved_rows(i, fcx, rows);
+
+            /* the code is linear, so zeros have zero parity */
+            if (fec_is_zero(rows, fcx->rs_n * RS_BATCH_LANES)) {
+                memset(&fcx->fec[ctx->fec_pos], 0,
+                    RS_BATCH_LANES * fcx->roots);
+                ctx->fec_pos += RS_BATCH_LANES * fcx->roots;
+                continue;
+            }
+
+            rs_batch_encode(&batch, rows, parity);
+
+            for (int k = 0; k < RS_BATCH_LANES; ++k) {
+                for (j = 0; j < fcx->roots; ++j) {
+                    fcx->fec[ctx->fec_pos++] = parity[j * RS_BATCH_LANES + k];
+                }
+            }
+        }
+    }
 
-    for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
+    for (; i < ctx->end; i += fcx->rs_n) {
         for (j = 0; j < fcx->rs_n; ++j) {
             data[j] = image_get_interleaved_byte(i + j, fcx);
         }
 
-        encode_rs_char(ctx->rs, data, &fcx->fec[ctx->fec_pos]);
+        if (fec_is_zero(data, fcx->rs_n)) {
+            memset(&fcx->fec[ctx->fec_pos], 0, fcx->roots);
+        } else {
+            encode_rs_char(ctx->rs, data, &fcx->fec[ctx->fec_pos]);
+        }
+
         ctx->fec_pos += fcx->roots;
     }
 }
 
-static void decode_rs(struct image_proc_ctx *ctx)
+/* decodes the codeword starting from `i' with parity at `fec_pos' */
+static void decode_codeword(struct image_proc_ctx *ctx, uint64_t i,
+        uint64_t fec_pos)
 {
     struct image *fcx = ctx->ctx;
     int j, rv;
     uint8_t data[fcx->rs_n + fcx->roots];
-    uint64_t i;
 
     assert(sizeof(data) == FEC_RSM);
 
-    for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
+    for (j = 0; j < fcx->rs_n; ++j) {
+        data[j] = image_get_interleaved_byte(i + j, fcx);
+    }
+
+    memcpy(&data[fcx->rs_n], &fcx->fec[fec_pos], fcx->roots);
+    rv = decode_rs_char(ctx->rs, data, NULL, 0);
+
+    if (rv < 0) {
+        FATAL("failed to recover [%" PRIu64 ", %" PRIu64 ")\n",
+            i, i + fcx->rs_n);
+    } else if (rv > 0) {
+        /* copy corrected data to output */
         for (j = 0; j < fcx->rs_n; ++j) {
-            data[j] = image_get_interleaved_byte(i + j, fcx);
+            image_set_interleaved_byte(i + j, fcx, data[j]);
         }
 
-        memcpy(&data[fcx->rs_n], &fcx->fec[ctx->fec_pos], fcx->roots);
-        rv = decode_rs_char(ctx->rs, data, NULL, 0);
+        ctx->rv += rv;
+    }
+}
+
+static void decode_rs(struct image_proc_ctx *ctx)
+{
+    struct image *fcx = ctx->ctx;
+    uint64_t i = ctx->start;
+    rs_batch batch;
+
+    if (rs_batch_init(&batch, fcx->roots)) {
+        uint64_t batch_size = RS_BATCH_LANES * fcx->rs_n;
+        uint8_t rows[FEC_RSM * RS_BATCH_LANES];
+
+        for (; i + batch_size <= ctx->end; i += batch_size) {
+            get_interleaved_rows(i, fcx, rows);
+
+            for (int k = 0; k < RS_BATCH_LANES; ++k) {
+                for (int j = 0; j < fcx->roots; ++j) {
+                    rows[(fcx->rs_n + j) * RS_BATCH_LANES + k] =
+                        fcx->fec[ctx->fec_pos + k * fcx->roots + j];
+                }
+            }
+
+            /* only codewords with non-zero syndromes need to be decoded,
+               and all zero codewords are valid */
+            uint32_t errors = 0;
 
-        if (rv < 0) {
-            FATAL("failed to recover [%" PRIu64 ", %" PRIu64 ")\n",
-                i, i + fcx->rs_n);
-        } else if (rv > 0) {
-            /* copy corrected data to output */
-            for (j = 0; j < fcx->rs_n; ++j) {
-                image_set_interleaved_byte(i + j, fcx, data[j]);
+            if (!fec_is_zero(rows, FEC_RSM * RS_BATCH_LANES)) {
+                errors = rs_batch_check(&batch, rows);
             }
 
-            ctx->rv += rv;
+            for (int k = 0; errors && k < RS_BATCH_LANES; ++k) {
+                if (errors & (1U << k)) {
+                    decode_codeword(ctx, i + k * fcx->rs_n,
+                        ctx->fec_pos + k * fcx->roots);
+                }
+            }
+
+            ctx->fec_pos += RS_BATCH_LANES * fcx->roots;
         }
+    }
 
+    for (; i < ctx->end; i += fcx->rs_n) {
+        decode_codeword(ctx, i, ctx->fec_pos);
         ctx->fec_pos += fcx->roots;
     }
 }
@@ -101,16 +245,34 @@ static int usage()
            "  -s, --print-fec-size=<data size>  print FEC size\n"
            "  -E, --get-ecc-start=data          print ECC offset in data\n"
            "  -V, --get-verity-start=data       print verity offset\n"
+           "  -y, --verity                      build a hash tree, verity metadata\n"
+           "                                    and FEC in one pass:\n"
+           "                                    <data> <verity> <fec>\n"
            "options:\n"
            "  -h                                show this help\n"
            "  -v                                enable verbose logging\n"
            "  -r, --roots=<bytes>               number of parity bytes\n"
            "  -j, --threads=<threads>           number of threads to use\n"
            "  -S                                treat data as a sparse file\n"
+           "  -m, --mmap                        map data instead of reading it\n"
+           "                                    to memory\n"
            "encoding options:\n"
            "  -p, --padding=<bytes>             add padding after ECC data\n"
            "decoding options:\n"
            "  -i, --inplace                     correct <data> in place\n"
+           "verity options:\n"
+           "  -A, --salt-hex=<hex digits>       set salt (default: random)\n"
+           "  -B, --block-device=<path>         block device in the verity table\n"
+           "  -G, --signer=<path>               verity table signer\n"
+           "  -g, --signer-args=<args>          extra arguments for the signer\n"
+           "  -K, --signing-key=<path>          key passed to the signer\n"
+           "  -P, --prev-verity=<path>          update the verity and fec files of\n"
+           "                                    the previous image instead of\n"
+           "                                    processing all of <data>, which\n"
+           "                                    must have the same size and salt\n"
+           "  -F, --prev-fec=<path>             fec file of the previous image\n"
+           "  -C, --changed-blocks=<path>       list of data blocks that changed,\n"
+           "                                    e.g. \"7 10-12\"\n"
         );
 
     return 1;
@@ -212,6 +374,461 @@ static int encode(image& ctx, const std::vector<std::string>& inp_filenames,
     return 0;
 }
 
+static std::string to_hex(const std::vector<uint8_t>& data)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+
+    for (auto b : data) {
+        hex += digits[b >> 4];
+        hex += digits[b & 0x0f];
+    }
+
+    return hex;
+}
+
+static void parse_hex(const char *arg, const char *name,
+        std::vector<uint8_t>& data)
+{
+    size_t len = strlen(arg);
+
+    if (len == 0 || len % 2) {
+        FATAL("invalid value of %s\n", name);
+    }
+
+    data.clear();
+
+    for (size_t i = 0; i < len; i += 2) {
+        char byte[3] = { arg[i], arg[i + 1], '\0' };
+        char *endptr;
+
+        if (!isxdigit(byte[0]) || !isxdigit(byte[1])) {
+            FATAL("invalid value of %s\n", name);
+        }
+
+        data.push_back((uint8_t)strtoul(byte, &endptr, 16));
+    }
+}
+
+/* image_load hook, sets up the hash tree for `size' bytes of data and
+   reserves space for the tree and metadata after the data, so they are
+   protected by the same FEC */
+static uint64_t verity_reserve(void *priv, uint64_t size)
+{
+    verity_tree *v = (verity_tree *)priv;
+
+    if (size % FEC_BLOCKSIZE) {
+        FATAL("file size %" PRIu64 " is not a multiple of %u bytes\n",
+            size, FEC_BLOCKSIZE);
+    }
+
+    v->data_size = size;
+    v->levels = verity_tree_num_levels(size, FEC_BLOCKSIZE, v->hash_size,
+                    &v->tree_blocks);
+
+    v->tree.assign(v->tree_blocks * FEC_BLOCKSIZE, 0);
+    v->level_ptrs.assign(v->levels + 1, NULL);
+    v->level_blocks.assign(v->levels, 0);
+
+    verity_tree_layout(v->tree.data(), size, FEC_BLOCKSIZE, v->hash_size,
+        v->levels, v->level_ptrs.data(), v->level_blocks.data());
+
+    v->root_hash.assign(v->hash_size, 0);
+    v->level_ptrs[v->levels] = v->root_hash.data();
+
+    uint8_t zero_block[FEC_BLOCKSIZE] = {0};
+    v->zero_hash.assign(v->hash_size, 0);
+
+    hash_block(v->md, zero_block, FEC_BLOCKSIZE, v->salt.data(),
+        v->salt.size(), v->zero_hash.data(), NULL);
+
+    v->hash.hashes = v->level_ptrs[0];
+    v->hash.salt = v->salt.data();
+    v->hash.salt_size = v->salt.size();
+    v->hash.hash_size = v->hash_size;
+    v->hash.block_size = FEC_BLOCKSIZE;
+    v->hash.zero_block_hash = v->zero_hash.data();
+    v->hash.md = v->md;
+
+    return v->tree.size() + VERITY_METADATA_SIZE;
+}
+
+/* image_load hook, hashes level 0 of the tree while the data is read */
+static int verity_chunk(void *priv, const void *data, int len)
+{
+    verity_tree *v = (verity_tree *)priv;
+    return hash_chunk(&v->hash, data, len);
+}
+
+/* verity_read_block_func for the mapped input */
+static int verity_read_block(void *priv, uint64_t block, unsigned char *data)
+{
+    image *ctx = (image *)priv;
+    memcpy(data, &ctx->input[block * FEC_BLOCKSIZE], FEC_BLOCKSIZE);
+    return 0;
+}
+
+/* computes parity again for the RS blocks that contain any of the input
+   blocks in `blocks', leaving the rest of the previous ecc data as is */
+static void encode_blocks(image& ctx, const std::vector<uint64_t>& blocks)
+{
+    /* byte j of codeword c is in input block c / FEC_BLOCKSIZE + j * rounds,
+       so block b is covered by the FEC_BLOCKSIZE codewords of RS block
+       b % rounds */
+    std::vector<uint64_t> rs_blocks;
+
+    for (auto b : blocks) {
+        rs_blocks.push_back(b % ctx.rounds);
+    }
+
+    std::sort(rs_blocks.begin(), rs_blocks.end());
+    rs_blocks.erase(std::unique(rs_blocks.begin(), rs_blocks.end()),
+        rs_blocks.end());
+
+    if (ctx.verbose) {
+        INFO("	updating %zu of %" PRIu64 " RS blocks\n", rs_blocks.size(),
+            ctx.rounds);
+    }
+
+    image_proc_ctx args;
+    memset(&args, 0, sizeof(args));
+
+    args.ctx = &ctx;
+    args.rs = init_rs_char(FEC_PARAMS(ctx.roots));
+    args.roots = ctx.roots;
+
+    if (!args.rs) {
+        FATAL("failed to initialize RS\n");
+    }
+
+    for (auto n : rs_blocks) {
+        uint64_t c = n * FEC_BLOCKSIZE;
+
+        args.start = c * ctx.rs_n;
+        args.end = (c + FEC_BLOCKSIZE) * ctx.rs_n;
+        args.fec_pos = c * ctx.roots;
+
+        encode_rs(&args);
+    }
+
+    free_rs_char(args.rs);
+}
+
+/* runs `signer [args] table key signature' like build_verity_metadata.py
+   and returns the signature in `signature' */
+static void sign_table(const verity_tree& v, const std::string& table,
+        uint8_t *signature)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    std::string table_filename = std::string(tmpdir ? tmpdir : "/tmp") +
+        "/fec_table.XXXXXX";
+    std::string sig_filename = std::string(tmpdir ? tmpdir : "/tmp") +
+        "/fec_sig.XXXXXX";
+
+    int table_fd = mkstemp(&table_filename[0]);
+    int sig_fd = mkstemp(&sig_filename[0]);
+
+    if (table_fd < 0 || sig_fd < 0) {
+        FATAL("failed to create temporary files: %s\n", strerror(errno));
+    }
+
+    if (!android::base::WriteFully(table_fd, table.data(), table.size())) {
+        FATAL("failed to write verity table: %s\n", strerror(errno));
+    }
+
+    close(table_fd);
+    close(sig_fd);
+
+    std::vector<std::string> args;
+    args.push_back(v.signer);
+
+    size_t pos = 0;
+
+    while (pos < v.signer_args.size()) {
+        size_t end = v.signer_args.find(' ', pos);
+
+        if (end == std::string::npos) {
+            end = v.signer_args.size();
+        }
+
+        if (end > pos) {
+            args.push_back(v.signer_args.substr(pos, end - pos));
+        }
+
+        pos = end + 1;
+    }
+
+    args.push_back(table_filename);
+    args.push_back(v.signing_key);
+    args.push_back(sig_filename);
+
+    std::vector<char *> argv;
+
+    for (auto& arg : args) {
+        argv.push_back(&arg[0]);
+    }
+
+    argv.push_back(NULL);
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        FATAL("failed to fork: %s\n", strerror(errno));
+    } else if (pid == 0) {
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status;
+
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        FATAL("failed to sign verity table with '%s'\n", v.signer.c_str());
+    }
+
+    std::string sig;
+
+    if (!android::base::ReadFileToString(sig_filename, &sig)) {
+        FATAL("failed to read signature: %s\n", strerror(errno));
+    }
+
+    unlink(table_filename.c_str());
+    unlink(sig_filename.c_str());
+
+    if (sig.empty() || sig.size() > VERITY_SIGNATURE_SIZE) {
+        FATAL("invalid signature size %zu\n", sig.size());
+    }
+
+    memcpy(signature, sig.data(), sig.size());
+}
+
+/* builds the verity metadata block for the hash tree to `metadata' */
+static void build_metadata(const verity_tree& v, uint8_t *metadata)
+{
+    std::string root_hash = to_hex(v.root_hash);
+    std::string salt = to_hex(v.salt);
+    char table[VERITY_METADATA_SIZE];
+
+    int len = snprintf(table, sizeof(table),
+                "1 %s %s %u %u %" PRIu64 " %" PRIu64 " sha256 %s %s",
+                v.block_device.c_str(), v.block_device.c_str(),
+                FEC_BLOCKSIZE, FEC_BLOCKSIZE,
+                v.data_size / FEC_BLOCKSIZE, v.data_size / FEC_BLOCKSIZE,
+                root_hash.c_str(), salt.c_str());
+
+    if (len < 0 || (size_t)len > VERITY_METADATA_SIZE -
+            sizeof(verity_header)) {
+        FATAL("verity table too long\n");
+    }
+
+    verity_header *header = (verity_header *)metadata;
+
+    memset(metadata, 0, VERITY_METADATA_SIZE);
+    header->magic = VERITY_MAGIC;
+    header->version = VERITY_VERSION;
+    header->length = (uint32_t)len;
+
+    if (!v.signer.empty()) {
+        sign_table(v, std::string(table, len), header->signature);
+    }
+
+    memcpy(&metadata[sizeof(verity_header)], table, len);
+}
+
+static int verity(image& ctx, verity_tree& v,
+        const std::vector<std::string>& inp_filenames,
+        const std::string& verity_filename, const std::string& fec_filename)
+{
+    if (ctx.inplace) {
+        FATAL("invalid parameters: inplace can only used when decoding\n");
+    }
+
+    if (v.block_device.empty()) {
+        FATAL("invalid parameters: block device is required\n");
+    }
+
+    if (v.signer.empty() != v.signing_key.empty()) {
+        FATAL("invalid parameters: signer and signing key must be used "
+            "together\n");
+    }
+
+    v.md = EVP_sha256();
+
+    if (!v.md) {
+        FATAL("failed to get digest\n");
+    }
+
+    v.hash_size = EVP_MD_size(v.md);
+
+    if (v.salt.empty()) {
+        v.salt.resize(v.hash_size);
+
+        int fd = TEMP_FAILURE_RETRY(open("/dev/urandom", O_RDONLY));
+
+        if (fd < 0 || !android::base::ReadFully(fd, v.salt.data(),
+                            v.salt.size())) {
+            FATAL("failed to read salt from /dev/urandom\n");
+        }
+
+        close(fd);
+    }
+
+    if (ctx.threads > 0) {
+        hash_blocks_set_threads(ctx.threads);
+    }
+
+    bool incremental = !v.prev_verity.empty();
+    uint64_t prev_size = 0;
+
+    if (incremental) {
+        if (v.prev_fec.empty() || v.changed_blocks.empty()) {
+            FATAL("invalid parameters: previous fec and changed blocks are "
+                "required for incremental updates\n");
+        }
+
+        if (ctx.sparse) {
+            FATAL("invalid parameters: sparse files cannot be updated "
+                "incrementally\n");
+        }
+
+        /* map the input, so only the blocks that are hashed and encoded
+           again are read */
+        ctx.mmap = true;
+
+        if (!image_ecc_load(v.prev_fec, &ctx)) {
+            FATAL("failed to read input\n");
+        }
+
+        prev_size = ctx.inp_size;
+    }
+
+    /* hash the data while it's read, and compute ecc for the data, the
+       tree, and the metadata from memory, so the image is read only once */
+    ctx.hook_priv = &v;
+    ctx.reserve = verity_reserve;
+    ctx.chunk = incremental ? NULL : verity_chunk;
+
+    if (!image_load(inp_filenames, &ctx)) {
+        FATAL("failed to read input\n");
+    }
+
+    assert(ctx.pos == v.data_size);
+
+    uint8_t *verity_data = &ctx.input[v.data_size];
+    uint64_t verity_size = v.tree.size() + VERITY_METADATA_SIZE;
+    std::string prev_verity;
+    std::vector<uint64_t> changed;
+
+    if (incremental) {
+        if (ctx.inp_size != prev_size) {
+            FATAL("input size doesn't match '%s'\n", v.prev_fec.c_str());
+        }
+
+        if (!android::base::ReadFileToString(v.prev_verity, &prev_verity)) {
+            FATAL("failed to read '%s': %s\n", v.prev_verity.c_str(),
+                strerror(errno));
+        }
+
+        if (prev_verity.size() != verity_size) {
+            FATAL("input size doesn't match '%s'\n", v.prev_verity.c_str());
+        }
+
+        if (!verity_read_block_list(v.changed_blocks.c_str(), &changed)) {
+            FATAL("failed to read block list '%s'\n",
+                v.changed_blocks.c_str());
+        }
+
+        if (!changed.empty() &&
+                changed.back() >= v.data_size / FEC_BLOCKSIZE) {
+            FATAL("block %" PRIu64 " is past the end of input\n",
+                changed.back());
+        }
+
+        /* rehash the changed blocks and their ancestors, and remember which
+           input blocks the tree occupies were modified */
+        memcpy(v.tree.data(), prev_verity.data(), v.tree.size());
+
+        std::vector<uint64_t> changed_tree;
+
+        if (verity_tree_update(v.md, v.level_ptrs.data(), v.levels,
+                v.salt.data(), v.salt.size(), FEC_BLOCKSIZE, changed,
+                verity_read_block, &ctx, &changed_tree) != 0) {
+            FATAL("failed to update hash tree\n");
+        }
+
+        for (auto n : changed_tree) {
+            changed.push_back(v.data_size / FEC_BLOCKSIZE + n);
+        }
+    } else {
+        verity_tree_hash_levels(v.md, v.level_ptrs.data(),
+            v.level_blocks.data(), v.levels, v.salt.data(), v.salt.size(),
+            FEC_BLOCKSIZE);
+    }
+
+    memcpy(verity_data, v.tree.data(), v.tree.size());
+    build_metadata(v, &verity_data[v.tree.size()]);
+
+    if (incremental) {
+        uint64_t first = (v.data_size + v.tree.size()) / FEC_BLOCKSIZE;
+
+        for (uint64_t n = 0; n < VERITY_METADATA_SIZE / FEC_BLOCKSIZE; ++n) {
+            uint64_t offset = v.tree.size() + n * FEC_BLOCKSIZE;
+
+            if (memcmp(&verity_data[offset], &prev_verity[offset],
+                    FEC_BLOCKSIZE) != 0) {
+                changed.push_back(first + n);
+            }
+        }
+    }
+
+    int fd = TEMP_FAILURE_RETRY(open(verity_filename.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC, 0666));
+
+    if (fd < 0) {
+        FATAL("failed to open file '%s': %s\n", verity_filename.c_str(),
+            strerror(errno));
+    }
+
+    if (!android::base::WriteFully(fd, verity_data, verity_size)) {
+        FATAL("failed to write to '%s': %s\n", verity_filename.c_str(),
+            strerror(errno));
+    }
+
+    close(fd);
+
+    if (incremental) {
+        ctx.fec_filename = fec_filename.c_str();
+    } else if (!image_ecc_new(fec_filename, &ctx)) {
+        FATAL("failed to allocate ecc\n");
+    }
+
+    INFO("%s RS(255, %d) to '%s' and verity to '%s' for '%s'\n",
+        incremental ? "updating" : "encoding", ctx.rs_n, fec_filename.c_str(),
+        verity_filename.c_str(), inp_filenames.front().c_str());
+
+    if (ctx.verbose) {
+        INFO("\tverity size: %" PRIu64 "\n", verity_size);
+        INFO("\traw fec size: %u\n", ctx.fec_size);
+        INFO("\tblocks: %" PRIu64 "\n", ctx.blocks);
+        INFO("\trounds: %" PRIu64 "\n", ctx.rounds);
+    }
+
+    if (incremental) {
+        encode_blocks(ctx, changed);
+    } else if (!image_process(encode_rs, &ctx)) {
+        FATAL("failed to process input\n");
+    }
+
+    if (!image_ecc_save(&ctx)) {
+        FATAL("failed to write output\n");
+    }
+
+    printf("%s %s\n", to_hex(v.root_hash).c_str(), to_hex(v.salt).c_str());
+
+    image_free(&ctx);
+    return 0;
+}
+
 static int decode(image& ctx, const std::vector<std::string>& inp_filenames,
         const std::string& fec_filename, std::string& out_filename)
 {
@@ -272,8 +889,10 @@ int main(int argc, char **argv)
     std::string fec_filename;
     std::string out_filename;
     std::vector<std::string> inp_filenames;
+    std::string verity_filename;
     int mode = MODE_ENCODE;
     image ctx;
+    verity_tree v;
 
     image_init(&ctx);
     ctx.roots = FEC_DEFAULT_ROOTS;
@@ -292,9 +911,20 @@ int main(int argc, char **argv)
             {"get-verity-start", required_argument, 0, 'V'},
             {"padding", required_argument, 0, 'p'},
             {"verbose", no_argument, 0, 'v'},
+            {"mmap", no_argument, 0, 'm'},
+            {"verity", no_argument, 0, 'y'},
+            {"salt-hex", required_argument, 0, 'A'},
+            {"block-device", required_argument, 0, 'B'},
+            {"signer", required_argument, 0, 'G'},
+            {"signer-args", required_argument, 0, 'g'},
+            {"signing-key", required_argument, 0, 'K'},
+            {"prev-verity", required_argument, 0, 'P'},
+            {"prev-fec", required_argument, 0, 'F'},
+            {"changed-blocks", required_argument, 0, 'C'},
             {NULL, 0, 0, 0}
         };
-        int c = getopt_long(argc, argv, "hedSr:ij:s:E:V:p:v", long_options, NULL);
+        int c = getopt_long(argc, argv, "hedSr:ij:s:E:V:p:vmyA:B:G:g:K:P:F:C:",
+                    long_options, NULL);
         if (c < 0) {
             break;
         }
@@ -355,6 +985,39 @@ int main(int argc, char **argv)
         case 'v':
             ctx.verbose = true;
             break;
+        case 'm':
+            ctx.mmap = true;
+            break;
+        case 'y':
+            if (mode != MODE_ENCODE) {
+                return usage();
+            }
+            mode = MODE_VERITY;
+            break;
+        case 'A':
+            parse_hex(optarg, "salt-hex", v.salt);
+            break;
+        case 'B':
+            v.block_device = optarg;
+            break;
+        case 'G':
+            v.signer = optarg;
+            break;
+        case 'g':
+            v.signer_args = optarg;
+            break;
+        case 'K':
+            v.signing_key = optarg;
+            break;
+        case 'P':
+            v.prev_verity = optarg;
+            break;
+        case 'F':
+            v.prev_fec = optarg;
+            break;
+        case 'C':
+            v.changed_blocks = optarg;
+            break;
         case '?':
             return usage();
         default:
@@ -367,6 +1030,10 @@ int main(int argc, char **argv)
 
     assert(ctx.roots > 0 && ctx.roots < FEC_RSM);
 
+    if (ctx.mmap && ctx.sparse) {
+        FATAL("invalid parameters: sparse files cannot be mapped\n");
+    }
+
     /* check for input / output parameters */
     if (mode == MODE_ENCODE) {
         /* allow multiple input files */
@@ -392,6 +1059,14 @@ int main(int argc, char **argv)
 
         inp_filenames.push_back(argv[0]);
         fec_filename = argv[1];
+    } else if (mode == MODE_VERITY) {
+        if (argc != 3) {
+            return usage();
+        }
+
+        inp_filenames.push_back(argv[0]);
+        verity_filename = argv[1];
+        fec_filename = argv[2];
     }
 
     switch (mode) {
@@ -404,6 +1079,8 @@ int main(int argc, char **argv)
         return encode(ctx, inp_filenames, fec_filename);
     case MODE_DECODE:
         return decode(ctx, inp_filenames, fec_filename, out_filename);
+    case MODE_VERITY:
+        return verity(ctx, v, inp_filenames, verity_filename, fec_filename);
     default:
         abort();
     }
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#undef NDEBUG
+
+#include <assert.h>
+#include <string.h>
+#include "rs_batch.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+    #include <tmmintrin.h>
+    #define RS_BATCH_SSSE3 __attribute__((target("ssse3")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define RS_BATCH_NEON
+#endif
+
+/* GF(2^8) with the field generator polynomial from FEC_PARAMS */
+#define GF_POLY 0x11d
+
+struct gf_tables {
+    uint8_t alpha_to[FEC_RSM + 1];
+    uint8_t index_of[FEC_RSM + 1];
+};
+
+static void gf_init(gf_tables *gf)
+{
+    unsigned sr = 1;
+
+    gf->index_of[0] = 0; /* log of zero is undefined, never used */
+
+    for (int i = 0; i < FEC_RSM; ++i) {
+        gf->index_of[sr] = (uint8_t)i;
+        gf->alpha_to[i] = (uint8_t)sr;
+
+        sr <<= 1;
+
+        if (sr & 0x100) {
+            sr ^= GF_POLY;
+        }
+    }
+
+    gf->alpha_to[FEC_RSM] = 0;
+}
+
+static uint8_t gf_mul(const gf_tables *gf, uint8_t a, uint8_t b)
+{
+    if (!a || !b) {
+        return 0;
+    }
+
+    return gf->alpha_to[(gf->index_of[a] + gf->index_of[b]) % FEC_RSM];
+}
+
+/* fills the low and high nibble product tables for multiplying by `c' */
+static void mul_table_init(const gf_tables *gf, uint8_t c, uint8_t *table)
+{
+    for (int x = 0; x < 16; ++x) {
+        table[x] = gf_mul(gf, c, (uint8_t)x);
+        table[RS_BATCH_LANES + x] = gf_mul(gf, c, (uint8_t)(x << 4));
+    }
+}
+
+#if defined(RS_BATCH_SSSE3)
+
+static inline RS_BATCH_SSSE3 __m128i mul_ssse3(__m128i v,
+        const uint8_t *table)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_loadu_si128((const __m128i *)table);
+    __m128i hi = _mm_loadu_si128((const __m128i *)&table[RS_BATCH_LANES]);
+
+    return _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, mask)),
+                _mm_shuffle_epi8(hi,
+                    _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+}
+
+static RS_BATCH_SSSE3 void encode_ssse3(const rs_batch *rs,
+        const uint8_t *data, uint8_t *parity)
+{
+    int roots = rs->roots;
+    __m128i par[FEC_RSM];
+
+    for (int k = 0; k < roots; ++k) {
+        par[k] = _mm_setzero_si128();
+    }
+
+    for (int j = 0; j < FEC_RSM - roots; ++j) {
+        __m128i fb = _mm_xor_si128(par[0],
+                        _mm_loadu_si128((const __m128i *)
+                            &data[j * RS_BATCH_LANES]));
+
+        for (int k = 0; k < roots - 1; ++k) {
+            par[k] = _mm_xor_si128(par[k + 1],
+                        mul_ssse3(fb, rs->gen_tables[roots - 1 - k]));
+        }
+
+        par[roots - 1] = mul_ssse3(fb, rs->gen_tables[0]);
+    }
+
+    for (int k = 0; k < roots; ++k) {
+        _mm_storeu_si128((__m128i *)&parity[k * RS_BATCH_LANES], par[k]);
+    }
+}
+
+static RS_BATCH_SSSE3 uint32_t check_ssse3(const rs_batch *rs,
+        const uint8_t *data)
+{
+    int roots = rs->roots;
+    __m128i s[FEC_RSM];
+    __m128i row = _mm_loadu_si128((const __m128i *)data);
+
+    for (int i = 0; i < roots; ++i) {
+        s[i] = row;
+    }
+
+    for (int j = 1; j < FEC_RSM; ++j) {
+        row = _mm_loadu_si128((const __m128i *)&data[j * RS_BATCH_LANES]);
+
+        for (int i = 0; i < roots; ++i) {
+            s[i] = _mm_xor_si128(row, mul_ssse3(s[i], rs->root_tables[i]));
+        }
+    }
+
+    __m128i any = _mm_setzero_si128();
+
+    for (int i = 0; i < roots; ++i) {
+        any = _mm_or_si128(any, s[i]);
+    }
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) &
+                0xffff;
+}
+
+#elif defined(RS_BATCH_NEON)
+
+static inline uint8x16_t mul_neon(uint8x16_t v, const uint8_t *table)
+{
+    uint8x16_t l = vandq_u8(v, vdupq_n_u8(0x0f));
+    uint8x16_t h = vshrq_n_u8(v, 4);
+
+#if defined(__aarch64__)
+    return veorq_u8(vqtbl1q_u8(vld1q_u8(table), l),
+                vqtbl1q_u8(vld1q_u8(&table[RS_BATCH_LANES]), h));
+#else
+    uint8x8x2_t lo = {{ vld1_u8(table), vld1_u8(&table[8]) }};
+    uint8x8x2_t hi = {{ vld1_u8(&table[RS_BATCH_LANES]),
+                        vld1_u8(&table[RS_BATCH_LANES + 8]) }};
+
+    return veorq_u8(
+                vcombine_u8(vtbl2_u8(lo, vget_low_u8(l)),
+                            vtbl2_u8(lo, vget_high_u8(l))),
+                vcombine_u8(vtbl2_u8(hi, vget_low_u8(h)),
+                            vtbl2_u8(hi, vget_high_u8(h))));
+#endif
+}
+
+static void encode_neon(const rs_batch *rs, const uint8_t *data,
+        uint8_t *parity)
+{
+    int roots = rs->roots;
+    uint8x16_t par[FEC_RSM];
+
+    for (int k = 0; k < roots; ++k) {
+        par[k] = vdupq_n_u8(0);
+    }
+
+    for (int j = 0; j < FEC_RSM - roots; ++j) {
+        uint8x16_t fb = veorq_u8(par[0], vld1q_u8(&data[j * RS_BATCH_LANES]));
+
+        for (int k = 0; k < roots - 1; ++k) {
+            par[k] = veorq_u8(par[k + 1],
+                        mul_neon(fb, rs->gen_tables[roots - 1 - k]));
+        }
+
+        par[roots - 1] = mul_neon(fb, rs->gen_tables[0]);
+    }
+
+    for (int k = 0; k < roots; ++k) {
+        vst1q_u8(&parity[k * RS_BATCH_LANES], par[k]);
+    }
+}
+
+static uint32_t check_neon(const rs_batch *rs, const uint8_t *data)
+{
+    int roots = rs->roots;
+    uint8x16_t s[FEC_RSM];
+    uint8x16_t row = vld1q_u8(data);
+
+    for (int i = 0; i < roots; ++i) {
+        s[i] = row;
+    }
+
+    for (int j = 1; j < FEC_RSM; ++j) {
+        row = vld1q_u8(&data[j * RS_BATCH_LANES]);
+
+        for (int i = 0; i < roots; ++i) {
+            s[i] = veorq_u8(row, mul_neon(s[i], rs->root_tables[i]));
+        }
+    }
+
+    uint8x16_t any = vdupq_n_u8(0);
+
+    for (int i = 0; i < roots; ++i) {
+        any = vorrq_u8(any, s[i]);
+    }
+
+    uint8_t lanes[RS_BATCH_LANES];
+    uint32_t mask = 0;
+
+    vst1q_u8(lanes, any);
+
+    for (int i = 0; i < RS_BATCH_LANES; ++i) {
+        if (lanes[i]) {
+            mask |= 1U << i;
+        }
+    }
+
+    return mask;
+}
+
+#endif
+
+bool rs_batch_init(rs_batch *rs, int roots)
+{
+    assert(roots > 0 && roots < FEC_RSM);
+
+    memset(rs, 0, sizeof(*rs));
+    rs->roots = roots;
+
+#if defined(RS_BATCH_SSSE3)
+    if (__builtin_cpu_supports("ssse3")) {
+        rs->encode = encode_ssse3;
+        rs->check = check_ssse3;
+    }
+#elif defined(RS_BATCH_NEON)
+    rs->encode = encode_neon;
+    rs->check = check_neon;
+#endif
+
+    if (!rs->encode) {
+        return false;
+    }
+
+    gf_tables gf;
+    gf_init(&gf);
+
+    /* generator polynomial with roots alpha^i, i = 0..roots-1 (first root 0,
+       primitive element 1), computed the same way as init_rs_char */
+    uint8_t genpoly[FEC_RSM];
+
+    genpoly[0] = 1;
+
+    for (int i = 0; i < roots; ++i) {
+        uint8_t root = gf.alpha_to[i];
+
+        genpoly[i + 1] = 1;
+
+        for (int j = i; j > 0; --j) {
+            genpoly[j] = genpoly[j - 1] ^ gf_mul(&gf, genpoly[j], root);
+        }
+
+        genpoly[0] = gf_mul(&gf, genpoly[0], root);
+    }
+
+    for (int i = 0; i < roots; ++i) {
+        mul_table_init(&gf, genpoly[i], rs->gen_tables[i]);
+        mul_table_init(&gf, gf.alpha_to[i], rs->root_tables[i]);
+    }
+
+    return true;
+}
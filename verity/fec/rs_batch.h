@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __RS_BATCH_H__
+#define __RS_BATCH_H__
+
+#include <stdint.h>
+#include <fec/ecc.h>
+
+/* number of codewords processed in parallel, one per byte of a vector */
+#define RS_BATCH_LANES 16
+
+/* Reed-Solomon kernels that process RS_BATCH_LANES codewords at a time with
+   table lookup instructions (SSSE3 pshufb, NEON tbl), for the code defined
+   by FEC_PARAMS. Codewords are passed transposed: row j holds byte j of each
+   codeword, so that codewords that are next to each other in an interleaved
+   image can be loaded directly. */
+struct rs_batch {
+    int roots;
+    /* multiplication tables for the generator polynomial coefficients
+       used by the encoder: low nibble products followed by high nibble
+       products, RS_BATCH_LANES bytes each */
+    uint8_t gen_tables[FEC_RSM][2 * RS_BATCH_LANES];
+    /* multiplication tables for the roots of the generator, used for
+       computing syndromes */
+    uint8_t root_tables[FEC_RSM][2 * RS_BATCH_LANES];
+    void (*encode)(const rs_batch *rs, const uint8_t *data, uint8_t *parity);
+    uint32_t (*check)(const rs_batch *rs, const uint8_t *data);
+};
+
+/* initializes `rs' for `roots' parity bytes, returns false if the CPU doesn't
+   support any of the vectorized kernels and callers should use
+   encode_rs_char and decode_rs_char instead */
+extern bool rs_batch_init(rs_batch *rs, int roots);
+
+/* computes parity for FEC_RSM - roots rows of `data' to `roots' rows of
+   `parity', each row being RS_BATCH_LANES bytes */
+inline void rs_batch_encode(const rs_batch *rs, const uint8_t *data,
+        uint8_t *parity)
+{
+    rs->encode(rs, data, parity);
+}
+
+/* computes syndromes for FEC_RSM rows of `data' (data followed by parity),
+   returns a bit mask of codewords that have errors and need to be passed to
+   decode_rs_char */
+inline uint32_t rs_batch_check(const rs_batch *rs, const uint8_t *data)
+{
+    return rs->check(rs, data);
+}
+
+#endif // __RS_BATCH_H__
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#undef NDEBUG
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <fec/ecc.h>
+#include <jobpool/jobpool.h>
+
+#include "hash_tree.h"
+
+/* hash_blocks hands ranges of this many blocks to the workers */
+#define BLOCKS_PER_TASK 256
+
+/* number of threads for hash_blocks, 0 for one per cpu */
+static unsigned int num_threads = 0;
+
+size_t verity_tree_blocks(uint64_t data_size, size_t block_size, size_t hash_size,
+                          int level)
+{
+    size_t level_blocks = div_round_up(data_size, block_size);
+    int hashes_per_block = div_round_up(block_size, hash_size);
+
+    do {
+        level_blocks = div_round_up(level_blocks, hashes_per_block);
+    } while (level--);
+
+    return level_blocks;
+}
+
+int hash_block(const EVP_MD *md,
+               const unsigned char *block, size_t len,
+               const unsigned char *salt, size_t salt_len,
+               unsigned char *out, size_t *out_size)
+{
+    EVP_MD_CTX *mdctx;
+    unsigned int s;
+    int ret = 1;
+
+    mdctx = EVP_MD_CTX_create();
+    assert(mdctx);
+    ret &= EVP_DigestInit_ex(mdctx, md, NULL);
+    ret &= EVP_DigestUpdate(mdctx, salt, salt_len);
+    ret &= EVP_DigestUpdate(mdctx, block, len);
+    ret &= EVP_DigestFinal_ex(mdctx, out, &s);
+    EVP_MD_CTX_destroy(mdctx);
+    assert(ret == 1);
+    if (out_size) {
+        *out_size = s;
+    }
+    return 0;
+}
+
+/* hashes `blocks' consecutive blocks from `in' to `out' on the calling
+   thread; the salt is hashed once and the resulting context copied for each
+   block, instead of creating a new context per block as hash_block does, and
+   zero blocks are only hashed once */
+static void hash_blocks_range(const EVP_MD *md,
+                              const unsigned char *in, size_t blocks,
+                              unsigned char *out,
+                              const unsigned char *salt, size_t salt_size,
+                              size_t block_size)
+{
+    EVP_MD_CTX *salted = EVP_MD_CTX_create();
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+    size_t hash_size = EVP_MD_size(md);
+    unsigned int s;
+    int ret = 1;
+
+    assert(salted && mdctx);
+    ret &= EVP_DigestInit_ex(salted, md, NULL);
+    ret &= EVP_DigestUpdate(salted, salt, salt_size);
+
+    /* hash of a zero block, computed when the first one is seen */
+    unsigned char zero_hash[EVP_MAX_MD_SIZE];
+    bool have_zero_hash = false;
+
+    for (size_t i = 0; i < blocks; i++) {
+        const unsigned char *block = in + i * block_size;
+        bool zero = fec_is_zero(block, block_size);
+
+        if (zero && have_zero_hash) {
+            memcpy(out + i * hash_size, zero_hash, hash_size);
+            continue;
+        }
+
+        ret &= EVP_MD_CTX_copy_ex(mdctx, salted);
+        ret &= EVP_DigestUpdate(mdctx, block, block_size);
+        ret &= EVP_DigestFinal_ex(mdctx, out + i * hash_size, &s);
+
+        if (zero) {
+            memcpy(zero_hash, out + i * hash_size, hash_size);
+            have_zero_hash = true;
+        }
+    }
+
+    EVP_MD_CTX_destroy(mdctx);
+    EVP_MD_CTX_destroy(salted);
+    assert(ret == 1);
+}
+
+/* a call to hash_blocks, split into ranges of blocks */
+struct hash_blocks_call {
+    const EVP_MD *md;
+    const unsigned char *in;
+    unsigned char *out;
+    const unsigned char *salt;
+    size_t salt_size;
+    size_t block_size;
+};
+
+/* each range of blocks is hashed to the matching range of hashes, so no
+   synchronization is needed */
+static void hash_blocks_task(void *cookie, int, uint64_t first, uint64_t last)
+{
+    hash_blocks_call *c = (hash_blocks_call *)cookie;
+    size_t hash_size = EVP_MD_size(c->md);
+
+    hash_blocks_range(c->md, c->in + first * c->block_size, last - first,
+                      c->out + first * hash_size, c->salt, c->salt_size,
+                      c->block_size);
+}
+
+/* workers are started by the first buffer big enough to be split, and reused
+   for the following ones, like the chunks of a sparse image */
+static jobpool *hash_blocks_pool()
+{
+    static jobpool *pool = jobpool_new(num_threads, NULL, 0);
+    return pool;
+}
+
+int hash_blocks(const EVP_MD *md,
+                const unsigned char *in, size_t in_size,
+                unsigned char *out, size_t *out_size,
+                const unsigned char *salt, size_t salt_size,
+                size_t block_size)
+{
+    size_t blocks = div_round_up(in_size, block_size);
+    size_t hash_size = EVP_MD_size(md);
+    jobpool *pool = NULL;
+
+    if (num_threads != 1 && blocks >= 2 * BLOCKS_PER_TASK) {
+        pool = hash_blocks_pool();
+    }
+
+    if (!pool) {
+        hash_blocks_range(md, in, blocks, out, salt, salt_size, block_size);
+    } else {
+        hash_blocks_call call = { md, in, out, salt, salt_size, block_size };
+        jobpool_for(pool, 0, blocks, BLOCKS_PER_TASK, hash_blocks_task,
+                    &call);
+    }
+
+    *out_size = blocks * hash_size;
+    return 0;
+}
+
+int hash_chunk(void *priv, const void *data, int len)
+{
+    struct sparse_hash_ctx *ctx = (struct sparse_hash_ctx *)priv;
+    assert(len % ctx->block_size == 0);
+    if (data) {
+        size_t s;
+        hash_blocks(ctx->md, (const unsigned char *)data, len,
+                    ctx->hashes, &s,
+                    ctx->salt, ctx->salt_size, ctx->block_size);
+        ctx->hashes += s;
+    } else {
+        for (size_t i = 0; i < (size_t)len; i += ctx->block_size) {
+            memcpy(ctx->hashes, ctx->zero_block_hash, ctx->hash_size);
+            ctx->hashes += ctx->hash_size;
+        }
+    }
+    return 0;
+}
+
+int verity_tree_num_levels(uint64_t data_size, size_t block_size,
+                       size_t hash_size, size_t *tree_blocks)
+{
+    size_t verity_blocks = 0;
+    size_t level_blocks;
+    int levels = 0;
+
+    do {
+        level_blocks = verity_tree_blocks(data_size, block_size, hash_size,
+                                          levels);
+        levels++;
+        verity_blocks += level_blocks;
+    } while (level_blocks > 1);
+
+    if (tree_blocks) {
+        *tree_blocks = verity_blocks;
+    }
+    return levels;
+}
+
+void verity_tree_layout(unsigned char *tree, uint64_t data_size,
+                        size_t block_size, size_t hash_size, int levels,
+                        unsigned char **level_ptrs, size_t *level_blocks)
+{
+    unsigned char *ptr = tree;
+    for (int i = levels - 1; i >= 0; i--) {
+        level_ptrs[i] = ptr;
+        level_blocks[i] = verity_tree_blocks(data_size, block_size,
+                                             hash_size, i);
+        ptr += level_blocks[i] * block_size;
+    }
+    assert(level_blocks[levels - 1] == 1);
+}
+
+void verity_tree_hash_levels(const EVP_MD *md, unsigned char **level_ptrs,
+                             const size_t *level_blocks, int levels,
+                             const unsigned char *salt, size_t salt_size,
+                             size_t block_size)
+{
+    size_t hash_size = EVP_MD_size(md);
+
+    for (int i = 0; i < levels; i++) {
+        size_t out_size;
+        hash_blocks(md,
+                level_ptrs[i], level_blocks[i] * block_size,
+                level_ptrs[i + 1], &out_size,
+                salt, salt_size, block_size);
+        if (i < levels - 1) {
+            assert(div_round_up(out_size, block_size) == level_blocks[i + 1]);
+        } else {
+            assert(out_size == hash_size);
+        }
+    }
+}
+
+void hash_blocks_set_threads(unsigned int threads)
+{
+    num_threads = threads;
+}
+
+int verity_tree_update(const EVP_MD *md, unsigned char **level_ptrs,
+                       int levels, const unsigned char *salt,
+                       size_t salt_size, size_t block_size,
+                       const std::vector<uint64_t>& changed,
+                       verity_read_block_func read_block, void *priv,
+                       std::vector<uint64_t> *changed_tree)
+{
+    size_t hash_size = EVP_MD_size(md);
+    std::vector<unsigned char> block(block_size);
+    std::vector<uint64_t> dirty(changed);
+
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+    /* hashes of the dirty blocks on the level below (data blocks for level
+       0) go to level i, and the blocks that contain them are dirty next */
+    for (int i = 0; i < levels && !dirty.empty(); i++) {
+        std::vector<uint64_t> parents;
+
+        for (auto n : dirty) {
+            const unsigned char *data;
+
+            if (i == 0) {
+                if (read_block(priv, n, block.data()) != 0) {
+                    return -1;
+                }
+                data = block.data();
+            } else {
+                data = level_ptrs[i - 1] + n * block_size;
+            }
+
+            hash_block(md, data, block_size, salt, salt_size,
+                       level_ptrs[i] + n * hash_size, NULL);
+
+            uint64_t parent = n * hash_size / block_size;
+            if (parents.empty() || parents.back() != parent) {
+                parents.push_back(parent);
+            }
+        }
+
+        if (changed_tree) {
+            /* the top level is stored first */
+            uint64_t first = (level_ptrs[i] - level_ptrs[levels - 1]) /
+                    block_size;
+            for (auto n : parents) {
+                changed_tree->push_back(first + n);
+            }
+        }
+
+        dirty.swap(parents);
+    }
+
+    hash_block(md, level_ptrs[levels - 1], block_size, salt, salt_size,
+               level_ptrs[levels], NULL);
+    return 0;
+}
+
+bool verity_read_block_list(const char *filename,
+                            std::vector<uint64_t> *blocks)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        return false;
+    }
+
+    std::string list;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        list.append(buf, n);
+    }
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    const char *p = list.c_str();
+    while (ok) {
+        while (isspace(*p) || *p == ',') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+
+        char *end;
+        uint64_t first = strtoull(p, &end, 0);
+        uint64_t last = first;
+        ok = (end != p && isdigit(*p));
+        p = end;
+
+        if (ok && *p == '-') {
+            p++;
+            last = strtoull(p, &end, 0);
+            ok = (end != p && isdigit(*p) && last >= first);
+            p = end;
+        }
+
+        ok = ok && (!*p || isspace(*p) || *p == ',');
+
+        for (uint64_t b = first; ok && b <= last; b++) {
+            blocks->push_back(b);
+        }
+    }
+
+    std::sort(blocks->begin(), blocks->end());
+    blocks->erase(std::unique(blocks->begin(), blocks->end()), blocks->end());
+    return ok;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __VERITY_HASH_TREE_H__
+#define __VERITY_HASH_TREE_H__
+
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#define div_round_up(x,y) (((x) + (y) - 1)/(y))
+
+#define round_up(x,y) (div_round_up(x,y)*(y))
+
+/* state for hash_chunk, which hashes the data blocks of a sparse file into
+   level 0 of the hash tree */
+struct sparse_hash_ctx {
+    unsigned char *hashes;
+    const unsigned char *salt;
+    uint64_t salt_size;
+    uint64_t hash_size;
+    uint64_t block_size;
+    const unsigned char *zero_block_hash;
+    const EVP_MD *md;
+};
+
+/* returns the number of blocks on `level' of the hash tree for `data_size'
+   bytes of data */
+size_t verity_tree_blocks(uint64_t data_size, size_t block_size,
+                          size_t hash_size, int level);
+
+/* returns the number of levels of the hash tree for `data_size' bytes of
+   data, and the number of blocks in all of them in `tree_blocks' */
+int verity_tree_num_levels(uint64_t data_size, size_t block_size,
+                       size_t hash_size, size_t *tree_blocks);
+
+/* sets `level_ptrs[i]' to the start of level i in `tree' and
+   `level_blocks[i]' to its size; the top level is stored first, as on
+   disk */
+void verity_tree_layout(unsigned char *tree, uint64_t data_size,
+                        size_t block_size, size_t hash_size, int levels,
+                        unsigned char **level_ptrs, size_t *level_blocks);
+
+/* hashes each level of a tree with level 0 filled in to the level above it,
+   and the top level to `level_ptrs[levels]' (the root hash) */
+void verity_tree_hash_levels(const EVP_MD *md, unsigned char **level_ptrs,
+                             const size_t *level_blocks, int levels,
+                             const unsigned char *salt, size_t salt_size,
+                             size_t block_size);
+
+int hash_block(const EVP_MD *md,
+               const unsigned char *block, size_t len,
+               const unsigned char *salt, size_t salt_len,
+               unsigned char *out, size_t *out_size);
+
+int hash_blocks(const EVP_MD *md,
+                const unsigned char *in, size_t in_size,
+                unsigned char *out, size_t *out_size,
+                const unsigned char *salt, size_t salt_size,
+                size_t block_size);
+
+/* reads data block `block' to `data', returns 0 on success */
+typedef int (*verity_read_block_func)(void *priv, uint64_t block,
+                                      unsigned char *data);
+
+/* updates a tree laid out with verity_tree_layout, and `level_ptrs[levels]'
+   (the root hash), after the data blocks in `changed' have been modified;
+   only those blocks and their ancestors are hashed. If `changed_tree' is
+   not NULL, the indices of the modified tree blocks, counted from the start
+   of the tree, are appended to it. */
+int verity_tree_update(const EVP_MD *md, unsigned char **level_ptrs,
+                       int levels, const unsigned char *salt,
+                       size_t salt_size, size_t block_size,
+                       const std::vector<uint64_t>& changed,
+                       verity_read_block_func read_block, void *priv,
+                       std::vector<uint64_t> *changed_tree);
+
+/* reads block numbers and inclusive ranges of them, such as "7 10-12",
+   separated by whitespace or commas, from `filename' to `blocks' in
+   ascending order without duplicates */
+bool verity_read_block_list(const char *filename,
+                            std::vector<uint64_t> *blocks);
+
+/* sparse_file_callback callback, `priv' is a sparse_hash_ctx */
+int hash_chunk(void *priv, const void *data, int len);
+
+/* sets the number of threads used by hash_blocks, 0 for one per cpu */
+void hash_blocks_set_threads(unsigned int threads);
+
+#endif // __VERITY_HASH_TREE_H__
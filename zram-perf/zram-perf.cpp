@@ -1,6 +1,17 @@
 #include <iostream>
 #include <chrono>
 #include <numeric>
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -11,21 +22,117 @@
 using namespace std;
 
 const char zram_blkdev_path[] = "/dev/block/zram0";
+const char zram_sysfs_path[] = "/sys/block/zram0";
 const size_t sector_size = 512;
 const size_t page_size = 4096;
+// Pages each thread fills ahead of time, so filling is not timed
+const size_t pool_pages = 1024;
 
-void fillPageRand(uint32_t *page) {
-    int start = rand();
+void fillPageRand(uint32_t *page, mt19937 &rng) {
     for (int i = 0; i < page_size / sizeof(int); i++) {
-        page[i] = start+i;
+        page[i] = rng();
     }
 }
-void fillPageCompressible(uint32_t *page) {
-    int val = rand() & 0xfff;
+void fillPageCompressible(uint32_t *page, mt19937 &rng) {
+    int val = rng() & 0xfff;
     for (int i = 0; i < page_size / sizeof(int); i++) {
         page[i] = val;
     }
 }
+// A page of which percent% compresses away: that part holds one value,
+// the rest is random.
+void fillPagePercent(uint32_t *page, unsigned int percent, mt19937 &rng) {
+    int words = page_size / sizeof(int);
+    int same = words * percent / 100;
+    int val = rng() & 0xfff;
+    for (int i = 0; i < words; i++) {
+        page[i] = i < same ? val : rng();
+    }
+}
+
+// How compressible the written pages are: a weighted mix of percentages,
+// or pages sampled from a file like a core or a dump of process memory.
+class PageSource {
+    vector<pair<unsigned int, unsigned int>> m_mix;
+    unsigned int m_totalWeight = 0;
+    string m_samplePath;
+    size_t m_samplePages = 0;
+public:
+    // "100" or "100:50,50:30,0:20", percent compressible:weight
+    bool parseMix(const string &spec) {
+        m_mix.clear();
+        m_totalWeight = 0;
+        stringstream ss(spec);
+        string item;
+        while (getline(ss, item, ',')) {
+            unsigned int percent, weight = 1;
+            if (sscanf(item.c_str(), "%u:%u", &percent, &weight) < 1 || percent > 100)
+                return false;
+            m_mix.emplace_back(percent, weight);
+            m_totalWeight += weight;
+        }
+        return m_totalWeight > 0;
+    }
+    bool setSampleFile(const string &path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0 || st.st_size < page_size)
+            return false;
+        m_samplePath = path;
+        m_samplePages = st.st_size / page_size;
+        return true;
+    }
+    string describe() const {
+        if (!m_samplePath.empty())
+            return "pages sampled from " + m_samplePath;
+        string desc;
+        for (auto &m : m_mix) {
+            desc += (desc.empty() ? "" : ", ") + to_string(m.first) + "% compressible x" +
+                    to_string(m.second);
+        }
+        return desc;
+    }
+    // Fills count pages at pool
+    void fill(uint8_t *pool, size_t count, mt19937 &rng) const {
+        if (!m_samplePath.empty()) {
+            int fd = open(m_samplePath.c_str(), O_RDONLY);
+            for (size_t i = 0; i < count; i++) {
+                off_t offset = (off_t)(rng() % m_samplePages) * page_size;
+                if (fd < 0 || pread(fd, pool + i * page_size, page_size, offset) != page_size) {
+                    cout << "reading " << m_samplePath << " failed" << endl;
+                    memset(pool + i * page_size, 0, page_size);
+                }
+            }
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            unsigned int pick = rng() % m_totalWeight;
+            unsigned int percent = m_mix.back().first;
+            for (auto &m : m_mix) {
+                if (pick < m.second) {
+                    percent = m.first;
+                    break;
+                }
+                pick -= m.second;
+            }
+            uint32_t *page = (uint32_t*)(pool + i * page_size);
+            if (percent == 100)
+                fillPageCompressible(page, rng);
+            else if (percent == 0)
+                fillPageRand(page, rng);
+            else
+                fillPagePercent(page, percent, rng);
+        }
+    }
+};
+
+struct Options {
+    int threads = 1;
+    vector<int> cpus;
+    size_t passes = 4;
+    PageSource source;
+};
 
 class AlignedAlloc {
     void *m_ptr;
@@ -41,8 +148,127 @@ public:
     }
 };
 
+// Per page latencies of all the threads of a run
+class Latencies {
+    vector<uint32_t> m_ns;
+public:
+    void merge(const vector<uint32_t> &ns) {
+        m_ns.insert(m_ns.end(), ns.begin(), ns.end());
+    }
+    void print(const char *name) {
+        if (m_ns.empty())
+            return;
+        sort(m_ns.begin(), m_ns.end());
+        auto at = [&](double fraction) {
+            return m_ns[min(m_ns.size() - 1, (size_t)(m_ns.size() * fraction))] / 1000.0;
+        };
+        cout << name << " latency us: p50 " << at(0.5) << " p99 " << at(0.99)
+             << " p99.9 " << at(0.999) << " max " << m_ns.back() / 1000.0 << endl;
+    }
+};
+
+// /sys/block/zram0/mm_stat, as of Linux 4.4
+struct MmStat {
+    uint64_t origDataSize = 0;
+    uint64_t comprDataSize = 0;
+    uint64_t memUsedTotal = 0;
+    uint64_t memLimit = 0;
+    uint64_t memUsedMax = 0;
+    uint64_t samePages = 0;
+    uint64_t pagesCompacted = 0;
+
+    bool read() {
+        ifstream in(string(zram_sysfs_path) + "/mm_stat");
+        in >> origDataSize >> comprDataSize >> memUsedTotal >> memLimit >> memUsedMax;
+        if (!in)
+            return false;
+        // Older kernels do not have the last fields
+        in >> samePages >> pagesCompacted;
+        return true;
+    }
+    void print() {
+        cout << "mm_stat: orig " << origDataSize / 1024 / 1024 << "MB compr "
+             << comprDataSize / 1024 / 1024 << "MB used " << memUsedTotal / 1024 / 1024
+             << "MB used_max " << memUsedMax / 1024 / 1024 << "MB same_pages " << samePages
+             << " compacted " << pagesCompacted;
+        if (comprDataSize)
+            cout << " ratio " << (double)origDataSize / comprDataSize;
+        cout << endl;
+    }
+};
+
+static string readSysfs(const char *name) {
+    ifstream in(string(zram_sysfs_path) + "/" + name);
+    string value;
+    getline(in, value);
+    return value;
+}
+
 class BlockFd {
     int m_fd = -1;
+
+    // Runs fn(thread, begin, end) on opts.threads threads, each on its own
+    // slice of the device and pinned to the next cpu of opts.cpus.
+    template <typename Fn> void runThreads(const Options &opts, Fn fn) {
+        size_t devPages = getSize() / page_size;
+        vector<thread> threads;
+        for (int t = 0; t < opts.threads; t++) {
+            uint64_t begin = devPages * t / opts.threads * page_size;
+            uint64_t end = devPages * (t + 1) / opts.threads * page_size;
+            threads.emplace_back([&opts, fn, t, begin, end]() {
+                if (!opts.cpus.empty()) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(opts.cpus[t % opts.cpus.size()], &set);
+                    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+                        cout << "sched_setaffinity failed: " << strerror(errno) << endl;
+                }
+                fn(t, begin, end);
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+    }
+
+    void bench(const Options &opts, bool write) {
+        chrono::time_point<chrono::high_resolution_clock> start, end;
+        size_t devSize = getSize();
+        vector<vector<uint32_t>> ns(opts.threads);
+
+        start = chrono::high_resolution_clock::now();
+        runThreads(opts, [&](int t, uint64_t begin, uint64_t end) {
+            AlignedAlloc pool(pool_pages * page_size, page_size);
+            uint8_t *pages = (uint8_t*)pool.ptr();
+            mt19937 rng(t + 1);
+            if (write)
+                opts.source.fill(pages, pool_pages, rng);
+            ns[t].reserve((end - begin) / page_size * opts.passes);
+            size_t n = 0;
+            for (size_t i = 0; i < opts.passes; i++) {
+                for (uint64_t offset = begin; offset < end; offset += page_size, n++) {
+                    uint8_t *page = pages + (n % pool_pages) * page_size;
+                    auto before = chrono::high_resolution_clock::now();
+                    ssize_t ret = write ? pwrite(m_fd, page, page_size, offset)
+                                        : pread(m_fd, page, page_size, offset);
+                    auto after = chrono::high_resolution_clock::now();
+                    if (ret != page_size) {
+                        cout << (write ? "write() failed" : "read() failed") << endl;
+                    }
+                    ns[t].push_back(chrono::duration_cast<chrono::nanoseconds>(after - before).count());
+                }
+            }
+        });
+        end = chrono::high_resolution_clock::now();
+        size_t duration = chrono::duration_cast<chrono::microseconds>(end - start).count();
+        cout << (write ? "write: " : "read: ")
+             << (double)devSize * opts.passes / 1024.0 / 1024.0 / (duration / 1000.0 / 1000.0)
+             << "MB/s" << endl;
+
+        Latencies latencies;
+        for (auto &v : ns)
+            latencies.merge(v);
+        latencies.print(write ? "write" : "read");
+    }
 public:
     BlockFd(const char *path, bool direct) {
         m_fd = open(path, O_RDWR | (direct ? O_DIRECT : 0));
@@ -60,81 +286,126 @@ public:
             close(m_fd);
         }
     }
-    void fillWithCompressible() {
-        size_t devSize = getSize();
-        AlignedAlloc page(page_size, page_size);
-        for (uint64_t offset = 0; offset < devSize; offset += page_size) {
-            fillPageCompressible((uint32_t*)page.ptr());
-            ssize_t ret = write(m_fd, page.ptr(), page_size);
-            if (ret != page_size) {
-                cout << "write() failed" << endl;
-            }
-        }
-    }
-    void benchSequentialRead() {
-        chrono::time_point<chrono::high_resolution_clock> start, end;
-        size_t devSize = getSize();
-        size_t passes = 4;
-        AlignedAlloc page(page_size, page_size);
-
-        start = chrono::high_resolution_clock::now();
-        for (int i = 0; i < passes; i++) {
-            for (uint64_t offset = 0; offset < devSize; offset += page_size) {
-                if (offset == 0)
-                    lseek(m_fd, offset, SEEK_SET);
-                ssize_t ret = read(m_fd, page.ptr(), page_size);
-                if (ret != page_size) {
-                    cout << "read() failed" << endl;
-                }
-            }
-        }
-        end = chrono::high_resolution_clock::now();
-        size_t duration = chrono::duration_cast<chrono::microseconds>(end - start).count();
-        cout << "read: " << (double)devSize * passes / 1024.0 / 1024.0 / (duration / 1000.0 / 1000.0) << "MB/s" << endl;
-    }
-    void benchSequentialWrite() {
-        chrono::time_point<chrono::high_resolution_clock> start, end;
-        size_t devSize = getSize();
-        size_t passes = 4;
-        AlignedAlloc page(page_size, page_size);
-
-        start = chrono::high_resolution_clock::now();
-        for (int i = 0; i < passes; i++) {
-            for (uint64_t offset = 0; offset < devSize; offset += page_size) {
-                fillPageCompressible((uint32_t*)page.ptr());
-                if (offset == 0)
-                    lseek(m_fd, offset, SEEK_SET);
-                ssize_t ret = write(m_fd, page.ptr(), page_size);
+    void fill(const Options &opts) {
+        Options once = opts;
+        once.passes = 1;
+        runThreads(once, [&](int t, uint64_t begin, uint64_t end) {
+            AlignedAlloc pool(pool_pages * page_size, page_size);
+            uint8_t *pages = (uint8_t*)pool.ptr();
+            mt19937 rng(t + 1);
+            opts.source.fill(pages, pool_pages, rng);
+            size_t n = 0;
+            for (uint64_t offset = begin; offset < end; offset += page_size, n++) {
+                ssize_t ret = pwrite(m_fd, pages + (n % pool_pages) * page_size, page_size, offset);
                 if (ret != page_size) {
                     cout << "write() failed" << endl;
                 }
             }
-        }
-        end = chrono::high_resolution_clock::now();
-        size_t duration = chrono::duration_cast<chrono::microseconds>(end - start).count();
-        cout << "write: " << (double)devSize * passes / 1024.0 / 1024.0 / (duration / 1000.0 / 1000.0) << "MB/s" << endl;
-
+        });
+    }
+    void benchSequentialRead(const Options &opts) {
+        bench(opts, false);
+    }
+    void benchSequentialWrite(const Options &opts) {
+        bench(opts, true);
     }
 };
 
-int bench(bool direct)
+int bench(bool direct, const Options &opts)
 {
     BlockFd zramDev{zram_blkdev_path, direct};
+    MmStat stat;
+
+    cout << "comp_algorithm: " << readSysfs("comp_algorithm")
+         << " max_comp_streams: " << readSysfs("max_comp_streams") << endl;
+    cout << "threads: " << opts.threads << " pages: " << opts.source.describe() << endl;
 
-    zramDev.fillWithCompressible();
-    zramDev.benchSequentialRead();
-    zramDev.benchSequentialWrite();
+    zramDev.fill(opts);
+    if (stat.read())
+        stat.print();
+    zramDev.benchSequentialRead(opts);
+    zramDev.benchSequentialWrite(opts);
+    if (stat.read())
+        stat.print();
     return 0;
 }
 
+static bool parseCpus(const char *list, vector<int> *cpus) {
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')) {
+        int first, last;
+        int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+        if (n < 1 || first < 0)
+            return false;
+        if (n == 1)
+            last = first;
+        if (last < first || last >= CPU_SETSIZE)
+            return false;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus->push_back(cpu);
+    }
+    return !cpus->empty();
+}
+
+static void usage(const char *name) {
+    cout << "Usage: " << name << " [-t THREADS] [-c CPUS] [-p PASSES] [-m MIX | -s FILE]" << endl
+         << "  -t THREADS  read and write with THREADS threads, each on a slice of the device" << endl
+         << "  -c CPUS     pin the threads to CPUS in turn, like 4-7 or 0,2" << endl
+         << "  -p PASSES   passes over the device per benchmark (default 4)" << endl
+         << "  -m MIX      compressibility of the pages written: percent:weight pairs," << endl
+         << "              like 100:50,50:30,0:20 (default 100, fully compressible)" << endl
+         << "  -s FILE     write pages sampled from FILE, like a memory dump" << endl;
+}
+
 int main(int argc, char *argv[])
 {
+    Options opts;
+    opts.source.parseMix("100");
+
+    int c;
+    while ((c = getopt(argc, argv, "t:c:p:m:s:h")) != -1) {
+        switch (c) {
+        case 't':
+            opts.threads = atoi(optarg);
+            if (opts.threads <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'c':
+            if (!parseCpus(optarg, &opts.cpus)) {
+                cout << "bad cpu list: " << optarg << endl;
+                return -1;
+            }
+            break;
+        case 'p':
+            opts.passes = atoi(optarg);
+            break;
+        case 'm':
+            if (!opts.source.parseMix(optarg)) {
+                cout << "bad mix: " << optarg << endl;
+                return -1;
+            }
+            break;
+        case 's':
+            if (!opts.source.setSampleFile(optarg)) {
+                cout << "cannot sample pages from " << optarg << endl;
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : -1;
+        }
+    }
+
     int result = swapoff(zram_blkdev_path);
     if (result < 0) {
         cout << "swapoff failed: " << strerror(errno) << endl;
     }
 
-    bench(1);
+    bench(1, opts);
 
     result = system((string("mkswap ") + string(zram_blkdev_path)).c_str());
     if (result < 0) {